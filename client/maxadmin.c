@@ -57,6 +57,7 @@ static int setipaddress(struct in_addr *a, char *p);
 static int authMaxScale(int so, char *user, char *password);
 static int sendCommand(int so, char *cmd);
 static void DoSource(int so, char *cmd);
+static void DoStream(int so);
 static void DoUsage();
 
 #ifdef HISTORY
@@ -238,8 +239,9 @@ int		argno = 0;
 		cmd[cmdlen - 2] = '\0';		/* Remove trailing space */
 		if (access(cmd, R_OK) == 0)
 			DoSource(so, cmd);
-		else
-			sendCommand(so, cmd);
+		else if (sendCommand(so, cmd) &&
+				!strncasecmp(cmd, "subscribe", 9))
+			DoStream(so);
 		exit(0);
 	}
 
@@ -317,7 +319,9 @@ int		argno = 0;
 		}
 		else if (*buf)
 		{
-			sendCommand(so, buf);
+			if (sendCommand(so, buf) &&
+					!strncasecmp(buf, "subscribe", 9))
+				DoStream(so);
 		}
 	}
 
@@ -532,6 +536,25 @@ FILE		*fp;
 	return;
 }
 
+/**
+ * Copy the changes of the metrics sent after a subscribe command to
+ * standard output, until the connection is closed
+ *
+ * @param so		The socket connected to MaxScale
+ */
+static void
+DoStream(int so)
+{
+char	buf[4096];
+int	i;
+
+	while ((i = read(so, buf, sizeof(buf))) > 0)
+	{
+		fwrite(buf, 1, i, stdout);
+		fflush(stdout);
+	}
+}
+
 /**
  * Display the --help text.
  */
@@ -0,0 +1,811 @@
+/*
+ * This file is distributed as part of MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file maxload.c  - A load generator for the capacity planning of MaxScale
+ *
+ * Many MySQL connections are driven by a few threads, each thread has an
+ * epoll instance and its share of the connections, all of them non-blocking.
+ * The scenarios are those that an ordinary benchmark does not stress:
+ *
+ * storm	Each connection connects, authenticates, sends COM_QUIT and
+ *		closes, and starts again at once. This is the accept path, the
+ *		authentication and the zombie DCBs of the gateway. The time
+ *		from the connect to the OK of the authentication is measured.
+ * idle		The connections are opened and stay open, with a COM_PING
+ *		every -i seconds if given. At the end the connections that
+ *		are still open are counted, the gateway must not lose or
+ *		close idle sessions.
+ * pipeline	Each connection writes -d queries at once and then reads the
+ *		replies. The time from the write to the last reply is
+ *		measured, and the throughput of the queries.
+ *
+ * A line of the rates is printed every second and a summary at the end.
+ *
+ * Usage: maxload [-h host] [-P port] [-u user] [-p password] [-D database]
+ *		  [-m storm|idle|pipeline] [-c connections] [-T threads]
+ *		  [-t seconds] [-d depth] [-q query] [-i ping interval]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/sha.h>
+
+#define	HEADER_LEN		4
+#define	SCRAMBLE_SIZE		20
+#define	CHARSET			0x21	/* utf8_general_ci */
+#define	MORE_RESULTS		0x0008	/* SERVER_MORE_RESULTS_EXISTS */
+#define	MAX_THREADS		64
+#define	MAX_EVENTS		256
+#define	BUFSIZE			65536
+
+/* The capabilities of the load client */
+#define	CAPABILITIES		(0x00000001 |	/* LONG_PASSWORD */ \
+				 0x00000004 |	/* LONG_FLAG */ \
+				 0x00000200 |	/* PROTOCOL_41 */ \
+				 0x00002000 |	/* TRANSACTIONS */ \
+				 0x00008000 |	/* SECURE_CONNECTION */ \
+				 0x00020000 |	/* MULTI_RESULTS */ \
+				 0x00080000)	/* PLUGIN_AUTH */
+#define	CONNECT_WITH_DB		0x00000008
+
+#define	COM_QUIT		0x01
+#define	COM_QUERY		0x03
+#define	COM_PING		0x0e
+
+#define	get_byte2(p)	((uint32_t)(p)[0] | ((uint32_t)(p)[1] << 8))
+#define	get_byte3(p)	(get_byte2(p) | ((uint32_t)(p)[2] << 16))
+
+#define	MODE_STORM		1
+#define	MODE_IDLE		2
+#define	MODE_PIPELINE		3
+
+/* The states of a connection */
+#define	CONN_CONNECTING		1	/* Waiting for the connect */
+#define	CONN_HANDSHAKE		2	/* Waiting for the handshake */
+#define	CONN_AUTH		3	/* Waiting for the OK of the login */
+#define	CONN_READY		4	/* Logged in, no reply expected */
+#define	CONN_REPLY		5	/* Reading replies */
+
+/* The parts of a reply */
+#define	REPLY_FIRST		1	/* The first packet */
+#define	REPLY_COLUMNS		2	/* The column definitions */
+#define	REPLY_ROWS		3	/* The rows */
+
+/** A sample buffer of response times, in microseconds */
+typedef struct {
+	uint32_t	*values;
+	long		n;
+	long		size;
+} SAMPLES;
+
+/** A connection and the state of its protocol */
+typedef struct {
+	int		fd;
+	int		state;
+	int		reply;		/* REPLY_ part being read */
+	int		pending;	/* Replies not yet read */
+	uint64_t	started;	/* Connect or write of the batch */
+	uint64_t	pinged;		/* Last ping of an idle connection */
+	unsigned char	*in;
+	int		inlen;
+	unsigned char	*out;		/* Data not yet written */
+	int		outlen, outpos;
+} CONN;
+
+/** A thread, its connections and its counters */
+typedef struct {
+	pthread_t	thread;
+	int		epfd;
+	CONN		*conns;
+	int		nconns;
+	volatile long	connects;	/* Logins completed */
+	volatile long	queries;	/* Replies read */
+	volatile long	errors;		/* Error replies */
+	volatile long	failures;	/* Failed connects and lost connections */
+	volatile int	open;		/* Connections logged in */
+	SAMPLES		samples;
+} WORKER;
+
+static char		*host = "127.0.0.1";
+static char		*port = "4006";
+static char		*user = "root";
+static char		*passwd = "";
+static char		*database = NULL;
+static char		*query = "SELECT 1";
+static int		mode = MODE_PIPELINE;
+static int		n_connections = 100;
+static int		n_threads = 4;
+static int		seconds = 10;
+static int		depth = 16;
+static int		ping_interval = 0;
+static struct addrinfo	*address;
+static volatile int	stopping = 0;
+static unsigned char	*batch;		/* The pipelined queries */
+static int		batchlen;
+
+static uint64_t
+now()
+{
+struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+addSample(SAMPLES *s, uint64_t value)
+{
+	if (s->n == s->size)
+	{
+		uint32_t	*nvalues;
+		long		size = s->size ? s->size * 2 : 65536;
+
+		if ((nvalues = realloc(s->values, size * sizeof(uint32_t))) == NULL)
+			return;
+		s->values = nvalues;
+		s->size = size;
+	}
+	s->values[s->n++] = value > UINT32_MAX ? UINT32_MAX : (uint32_t)value;
+}
+
+/**
+ * The token of mysql_native_password,
+ * SHA1(password) XOR SHA1(scramble, SHA1(SHA1(password)))
+ */
+static void
+scramblePassword(unsigned char *token, unsigned char *scramble, char *pw)
+{
+unsigned char	hash1[SHA_DIGEST_LENGTH];
+unsigned char	hash2[SHA_DIGEST_LENGTH];
+unsigned char	data[SCRAMBLE_SIZE + SHA_DIGEST_LENGTH];
+int		i;
+
+	SHA1((unsigned char *)pw, strlen(pw), hash1);
+	SHA1(hash1, SHA_DIGEST_LENGTH, hash2);
+	memcpy(data, scramble, SCRAMBLE_SIZE);
+	memcpy(data + SCRAMBLE_SIZE, hash2, SHA_DIGEST_LENGTH);
+	SHA1(data, sizeof(data), hash2);
+	for (i = 0; i < SHA_DIGEST_LENGTH; i++)
+		token[i] = hash1[i] ^ hash2[i];
+}
+
+/**
+ * Queue data to be written to a connection, what the socket does not take
+ * at once is kept and written when the socket is writable
+ *
+ * @return 0 on success, -1 if the connection was lost
+ */
+static int
+connWrite(WORKER *w, CONN *conn, unsigned char *data, int len)
+{
+struct epoll_event	ev;
+int			n;
+
+	if (conn->outlen == conn->outpos)
+	{
+		conn->outlen = conn->outpos = 0;
+		while (len > 0)
+		{
+			if ((n = write(conn->fd, data, len)) < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN)
+					break;
+				return -1;
+			}
+			data += n;
+			len -= n;
+		}
+		if (len == 0)
+			return 0;
+		ev.events = EPOLLIN | EPOLLOUT;
+		ev.data.ptr = conn;
+		epoll_ctl(w->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+	}
+	if ((conn->out = realloc(conn->out, conn->outlen + len)) == NULL)
+		return -1;
+	memcpy(conn->out + conn->outlen, data, len);
+	conn->outlen += len;
+	return 0;
+}
+
+/**
+ * Write what is left of the queued data when the socket is writable
+ *
+ * @return 0 on success, -1 if the connection was lost
+ */
+static int
+connFlush(WORKER *w, CONN *conn)
+{
+struct epoll_event	ev;
+int			n;
+
+	while (conn->outpos < conn->outlen)
+	{
+		if ((n = write(conn->fd, conn->out + conn->outpos,
+					conn->outlen - conn->outpos)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return 0;
+			return -1;
+		}
+		conn->outpos += n;
+	}
+	conn->outlen = conn->outpos = 0;
+	ev.events = EPOLLIN;
+	ev.data.ptr = conn;
+	epoll_ctl(w->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+	return 0;
+}
+
+/**
+ * Start a connection, the connect completes when the socket is writable
+ *
+ * @return 0 on success, -1 if the connect failed
+ */
+static int
+connStart(WORKER *w, CONN *conn)
+{
+struct epoll_event	ev;
+int			one = 1;
+
+	conn->inlen = 0;
+	conn->outlen = conn->outpos = 0;
+	conn->pending = 0;
+	conn->started = now();
+	if ((conn->fd = socket(address->ai_family,
+				SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0)
+		return -1;
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(conn->fd, address->ai_addr, address->ai_addrlen) < 0 &&
+						errno != EINPROGRESS)
+	{
+		close(conn->fd);
+		conn->fd = -1;
+		return -1;
+	}
+	conn->state = CONN_CONNECTING;
+	ev.events = EPOLLIN | EPOLLOUT;
+	ev.data.ptr = conn;
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0)
+	{
+		close(conn->fd);
+		conn->fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Close a connection, in the storm and a lost connection in the other
+ * scenarios it is started again
+ *
+ * @param lost	The connection was lost or refused
+ */
+static void
+connClose(WORKER *w, CONN *conn, int lost)
+{
+	if (conn->fd >= 0)
+	{
+		epoll_ctl(w->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+		close(conn->fd);
+		conn->fd = -1;
+	}
+	if (conn->state >= CONN_READY)
+		w->open--;
+	if (lost)
+		w->failures++;
+	conn->state = 0;
+	if (!stopping && (mode == MODE_STORM || mode == MODE_PIPELINE))
+	{
+		while (connStart(w, conn) != 0 && !stopping)
+		{
+			w->failures++;
+			usleep(10000);
+		}
+	}
+}
+
+/**
+ * Answer the handshake of the server with the login of the user
+ *
+ * @return 0 on success, -1 if the handshake is not understood
+ */
+static int
+sendLogin(WORKER *w, CONN *conn, unsigned char *hs, uint32_t len)
+{
+unsigned char	pkt[512], scramble[SCRAMBLE_SIZE];
+unsigned char	*p;
+uint32_t	caps = CAPABILITIES;
+
+	if (len < 45 || hs[0] == 0xff)
+		return -1;
+	p = hs + 1 + strlen((char *)hs + 1) + 1 + 4;
+	memcpy(scramble, p, 8);
+	p += 8 + 1 + 2 + 1 + 2 + 2 + 1 + 10;
+	memcpy(scramble + 8, p, SCRAMBLE_SIZE - 8);
+
+	if (database)
+		caps |= CONNECT_WITH_DB;
+	memset(pkt, 0, sizeof(pkt));
+	p = pkt + HEADER_LEN;
+	p[0] = caps & 0xff;
+	p[1] = (caps >> 8) & 0xff;
+	p[2] = (caps >> 16) & 0xff;
+	p[3] = (caps >> 24) & 0xff;
+	p[7] = 0x01;			/* Max packet 16MB */
+	p[8] = CHARSET;
+	p += 32;
+	p += snprintf((char *)p, 64, "%s", user) + 1;
+	if (*passwd)
+	{
+		*p++ = SHA_DIGEST_LENGTH;
+		scramblePassword(p, scramble, passwd);
+		p += SHA_DIGEST_LENGTH;
+	}
+	else
+		*p++ = 0;
+	if (database)
+		p += snprintf((char *)p, 64, "%s", database) + 1;
+	p += sprintf((char *)p, "mysql_native_password") + 1;
+	len = p - pkt - HEADER_LEN;
+	pkt[0] = len & 0xff;
+	pkt[1] = (len >> 8) & 0xff;
+	pkt[2] = (len >> 16) & 0xff;
+	pkt[3] = 1;
+	return connWrite(w, conn, pkt, p - pkt);
+}
+
+/**
+ * Send the next requests of a connection that is logged in
+ *
+ * @return 0 on success, -1 if the connection was lost
+ */
+static int
+sendNext(WORKER *w, CONN *conn)
+{
+static unsigned char	quit[] = { 1, 0, 0, 0, COM_QUIT };
+static unsigned char	ping[] = { 1, 0, 0, 0, COM_PING };
+
+	switch (mode)
+	{
+	case MODE_STORM:
+		/* The gateway sees the quit and the close together */
+		connWrite(w, conn, quit, sizeof(quit));
+		connClose(w, conn, 0);
+		return 0;
+	case MODE_IDLE:
+		conn->state = CONN_READY;
+		if (ping_interval > 0 &&
+			now() - conn->pinged >= ping_interval * 1000000ULL)
+		{
+			conn->pinged = now();
+			conn->state = CONN_REPLY;
+			conn->reply = REPLY_FIRST;
+			conn->pending = 1;
+			conn->started = now();
+			return connWrite(w, conn, ping, sizeof(ping));
+		}
+		return 0;
+	case MODE_PIPELINE:
+		conn->state = CONN_REPLY;
+		conn->reply = REPLY_FIRST;
+		conn->pending = depth;
+		conn->started = now();
+		return connWrite(w, conn, batch, batchlen);
+	}
+	return 0;
+}
+
+/**
+ * Process a packet of a reply
+ *
+ * @return 1 at the end of a reply, 0 if more packets of the reply follow
+ */
+static int
+replyPacket(WORKER *w, CONN *conn, unsigned char *p, uint32_t len)
+{
+uint32_t	status = 0;
+unsigned char	*q;
+int		i;
+
+	switch (conn->reply)
+	{
+	case REPLY_FIRST:
+		if (len == 0)
+			return 1;
+		if (p[0] == 0xff)
+		{
+			w->errors++;
+			return 1;
+		}
+		if (p[0] == 0x00)
+		{
+			/* Skip the length encoded affected rows and insert id */
+			q = p + 1;
+			for (i = 0; i < 2; i++)
+				q += *q < 0xfb ? 1 : *q == 0xfc ? 3 :
+						*q == 0xfd ? 4 : 9;
+			status = q + 2 <= p + len ? get_byte2(q) : 0;
+			return (status & MORE_RESULTS) ? 0 : 1;
+		}
+		conn->reply = REPLY_COLUMNS;
+		return 0;
+	case REPLY_COLUMNS:
+	case REPLY_ROWS:
+		if (len > 0 && p[0] == 0xff)
+		{
+			w->errors++;
+			conn->reply = REPLY_FIRST;
+			return 1;
+		}
+		if (len > 0 && len < 9 && p[0] == 0xfe)
+		{
+			if (conn->reply == REPLY_COLUMNS)
+			{
+				conn->reply = REPLY_ROWS;
+				return 0;
+			}
+			status = len >= 5 ? get_byte2(p + 3) : 0;
+			conn->reply = REPLY_FIRST;
+			return (status & MORE_RESULTS) ? 0 : 1;
+		}
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Read what the server sent and act on the complete packets
+ *
+ * @return 0 on success, -1 if the connection was lost or refused
+ */
+static int
+connRead(WORKER *w, CONN *conn)
+{
+unsigned char	*p;
+uint32_t	len;
+int		n, pos;
+
+	for (;;)
+	{
+		if (conn->inlen == BUFSIZE)
+			return -1;	/* No packets this large are expected */
+		n = read(conn->fd, conn->in + conn->inlen, BUFSIZE - conn->inlen);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return 0;
+		if (n <= 0)
+			return -1;
+		conn->inlen += n;
+
+		pos = 0;
+		while (conn->inlen - pos >= HEADER_LEN &&
+			conn->inlen - pos >= HEADER_LEN +
+				(int)(len = get_byte3(conn->in + pos)))
+		{
+			p = conn->in + pos + HEADER_LEN;
+			pos += HEADER_LEN + len;
+			switch (conn->state)
+			{
+			case CONN_HANDSHAKE:
+				if (sendLogin(w, conn, p, len) != 0)
+					return -1;
+				conn->state = CONN_AUTH;
+				break;
+			case CONN_AUTH:
+				if (len == 0 || p[0] != 0x00)
+					return -1;
+				conn->state = CONN_READY;
+				w->connects++;
+				w->open++;
+				if (mode == MODE_STORM)
+					addSample(&w->samples,
+						now() - conn->started);
+				conn->pinged = now();
+				if (sendNext(w, conn) != 0)
+					return -1;
+				if (mode == MODE_STORM)
+					return 0;	/* Started again */
+				break;
+			case CONN_REPLY:
+				if (replyPacket(w, conn, p, len) &&
+						--conn->pending == 0)
+				{
+					w->queries += (mode == MODE_PIPELINE ?
+								depth : 1);
+					addSample(&w->samples,
+						now() - conn->started);
+					if (stopping)
+						conn->state = CONN_READY;
+					else if (sendNext(w, conn) != 0)
+						return -1;
+				}
+				break;
+			default:
+				break;
+			}
+		}
+		if (pos > 0)
+		{
+			memmove(conn->in, conn->in + pos, conn->inlen - pos);
+			conn->inlen -= pos;
+		}
+	}
+}
+
+/**
+ * The event loop of a thread
+ */
+static void *
+workerMain(void *arg)
+{
+WORKER			*w = (WORKER *)arg;
+struct epoll_event	events[MAX_EVENTS];
+CONN			*conn;
+uint64_t		last = now();
+int			i, n, err;
+socklen_t		errlen;
+
+	for (i = 0; i < w->nconns; i++)
+	{
+		w->conns[i].fd = -1;
+		if ((w->conns[i].in = malloc(BUFSIZE)) == NULL ||
+					connStart(w, &w->conns[i]) != 0)
+			w->failures++;
+	}
+	while (!stopping)
+	{
+		n = epoll_wait(w->epfd, events, MAX_EVENTS, 100);
+		for (i = 0; i < n; i++)
+		{
+			conn = (CONN *)events[i].data.ptr;
+			if (conn->fd < 0)
+				continue;
+			if (conn->state == CONN_CONNECTING)
+			{
+				errlen = sizeof(err);
+				err = 0;
+				getsockopt(conn->fd, SOL_SOCKET, SO_ERROR,
+							&err, &errlen);
+				if (err != 0 || (events[i].events & EPOLLERR))
+				{
+					connClose(w, conn, 1);
+					continue;
+				}
+				conn->state = CONN_HANDSHAKE;
+				connFlush(w, conn);
+			}
+			if ((events[i].events & EPOLLOUT) &&
+						connFlush(w, conn) != 0)
+			{
+				connClose(w, conn, 1);
+				continue;
+			}
+			if ((events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR)) &&
+						connRead(w, conn) != 0)
+				connClose(w, conn, 1);
+		}
+		/* The idle connections that are due a ping */
+		if (mode == MODE_IDLE && ping_interval > 0 &&
+					now() - last >= 100000)
+		{
+			last = now();
+			for (i = 0; i < w->nconns; i++)
+				if (w->conns[i].state == CONN_READY &&
+					sendNext(w, &w->conns[i]) != 0)
+					connClose(w, &w->conns[i], 1);
+		}
+	}
+	return NULL;
+}
+
+static int
+compareUint32(const void *a, const void *b)
+{
+uint32_t	x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static void
+usage(char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-h host] [-P port] [-u user] [-p password] "
+		"[-D database]\n"
+		"\t\t[-m storm|idle|pipeline] [-c connections] [-T threads]\n"
+		"\t\t[-t seconds] [-d depth] [-q query] [-i ping interval]\n",
+		prog);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+WORKER		workers[MAX_THREADS];
+struct addrinfo	hints;
+SAMPLES		all;
+long		connects = 0, queries = 0, errors = 0, failures = 0;
+long		last_connects = 0, last_queries = 0;
+int		opt, i, j, n, open, len, elapsed;
+uint64_t	start;
+
+	while ((opt = getopt(argc, argv, "h:P:u:p:D:m:c:T:t:d:q:i:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'h': host = optarg; break;
+		case 'P': port = optarg; break;
+		case 'u': user = optarg; break;
+		case 'p': passwd = optarg; break;
+		case 'D': database = optarg; break;
+		case 'm':
+			if (!strcmp(optarg, "storm"))
+				mode = MODE_STORM;
+			else if (!strcmp(optarg, "idle"))
+				mode = MODE_IDLE;
+			else if (!strcmp(optarg, "pipeline"))
+				mode = MODE_PIPELINE;
+			else
+				usage(argv[0]);
+			break;
+		case 'c': n_connections = atoi(optarg); break;
+		case 'T': n_threads = atoi(optarg); break;
+		case 't': seconds = atoi(optarg); break;
+		case 'd': depth = atoi(optarg); break;
+		case 'q': query = optarg; break;
+		case 'i': ping_interval = atoi(optarg); break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (n_connections < 1 || n_threads < 1 || n_threads > MAX_THREADS ||
+			seconds < 1 || depth < 1 || ping_interval < 0)
+		usage(argv[0]);
+	if (n_threads > n_connections)
+		n_threads = n_connections;
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((n = getaddrinfo(host, port, &hints, &address)) != 0)
+	{
+		fprintf(stderr, "%s: %s\n", host, gai_strerror(n));
+		exit(1);
+	}
+
+	/* The pipelined queries are written in one go */
+	len = strlen(query);
+	if ((batch = malloc(depth * (HEADER_LEN + 1 + len))) == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (i = 0; i < depth; i++)
+	{
+		unsigned char	*p = batch + batchlen;
+
+		p[0] = (len + 1) & 0xff;
+		p[1] = ((len + 1) >> 8) & 0xff;
+		p[2] = ((len + 1) >> 16) & 0xff;
+		p[3] = 0;
+		p[4] = COM_QUERY;
+		memcpy(p + 5, query, len);
+		batchlen += HEADER_LEN + 1 + len;
+	}
+
+	memset(workers, 0, sizeof(workers));
+	for (i = 0; i < n_threads; i++)
+	{
+		workers[i].nconns = n_connections / n_threads +
+				(i < n_connections % n_threads ? 1 : 0);
+		if ((workers[i].conns = calloc(workers[i].nconns,
+						sizeof(CONN))) == NULL ||
+			(workers[i].epfd = epoll_create(workers[i].nconns)) < 0)
+		{
+			fprintf(stderr, "Unable to create the connections\n");
+			exit(1);
+		}
+	}
+	start = now();
+	for (i = 0; i < n_threads; i++)
+	{
+		if (pthread_create(&workers[i].thread, NULL, workerMain,
+							&workers[i]) != 0)
+		{
+			fprintf(stderr, "Unable to start a thread\n");
+			exit(1);
+		}
+	}
+
+	printf("%-8s%12s%12s%12s%12s\n", "Second", "Connects/s", "Queries/s",
+			"Open", "Failures");
+	for (elapsed = 1; elapsed <= seconds; elapsed++)
+	{
+		while (now() - start < elapsed * 1000000ULL)
+			usleep(10000);
+		connects = queries = failures = open = 0;
+		for (i = 0; i < n_threads; i++)
+		{
+			connects += workers[i].connects;
+			queries += workers[i].queries;
+			failures += workers[i].failures;
+			open += workers[i].open;
+		}
+		printf("%-8d%12ld%12ld%12d%12ld\n", elapsed,
+			connects - last_connects, queries - last_queries,
+			open, failures);
+		fflush(stdout);
+		last_connects = connects;
+		last_queries = queries;
+	}
+	stopping = 1;
+	for (i = 0; i < n_threads; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	memset(&all, 0, sizeof(all));
+	connects = queries = errors = failures = open = 0;
+	for (i = 0; i < n_threads; i++)
+	{
+		connects += workers[i].connects;
+		queries += workers[i].queries;
+		errors += workers[i].errors;
+		failures += workers[i].failures;
+		open += workers[i].open;
+		for (j = 0; j < workers[i].samples.n; j++)
+			addSample(&all, workers[i].samples.values[j]);
+	}
+	printf("\nConnections			%d\n", n_connections);
+	printf("Logins				%ld, %.0f/s\n", connects,
+					(double)connects / seconds);
+	printf("Queries				%ld, %.0f/s\n", queries,
+					(double)queries / seconds);
+	printf("Error replies			%ld\n", errors);
+	printf("Failed or lost connections	%ld\n", failures);
+	printf("Open at the end			%d\n", open);
+	if (all.n > 0)
+	{
+		qsort(all.values, all.n, sizeof(uint32_t), compareUint32);
+		printf("%s, microseconds	p50 %u, p90 %u, p99 %u, max %u\n",
+			mode == MODE_STORM ? "Connect and login" :
+			mode == MODE_IDLE ? "Ping" : "Batch of queries",
+			all.values[all.n / 2], all.values[all.n * 9 / 10],
+			all.values[all.n * 99 / 100], all.values[all.n - 1]);
+	}
+	return 0;
+}
@@ -0,0 +1,580 @@
+/*
+ * This file is distributed as part of MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file maxlogdecode.c  - Render a log file written in binary mode as text
+ *
+ * The trace and debug logs of MaxScale may be written in binary mode, the
+ * log string is then recorded as the id of its format, the time and the
+ * arguments and formatting is done by this program. The layout of the
+ * records is in log_binary.h. The output is the same as the log file
+ * would have been in text mode.
+ *
+ * Usage: maxlogdecode [-u] <log file> ...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <log_binary.h>
+
+/** Longest rendered log string, a record is at most 64k */
+#define MAX_MSGLEN	(128*1024)
+
+/** A log string being rendered */
+typedef struct {
+	char	buf[MAX_MSGLEN];
+	size_t	len;
+} MSGBUF;
+
+/** The formats of a log file, indexed by the id of the format */
+typedef struct {
+	char	**fmts;
+	size_t	nfmts;
+} FORMATS;
+
+static int	usecs = 0;
+
+static char *readFile(char *file, size_t *p_len);
+static void collectFormats(char *data, size_t len, FORMATS *formats);
+static void decode(char *data, size_t len, FORMATS *formats);
+static int checkRecord(char *p, char *endp, int *p_type, size_t *p_len);
+static void renderMessage(char *body, size_t len, FORMATS *formats);
+static void renderText(char *body, size_t len);
+static char *renderTimestamp(char *p, char *endp, MSGBUF *msg);
+static int renderArgs(char *fmt, char *rp, char *endp, MSGBUF *msg);
+static void msgPrintf(MSGBUF *msg, const char *fmt, ...);
+static void msgOutput(MSGBUF *msg);
+
+int
+main(int argc, char **argv)
+{
+FORMATS	formats;
+char	*data;
+size_t	len, i;
+int	opt, rval = 0;
+
+	while ((opt = getopt(argc, argv, "u")) != -1)
+	{
+		switch (opt)
+		{
+		case 'u':
+			usecs = 1;
+			break;
+		default:
+			fprintf(stderr,
+				"Usage: %s [-u] <log file> ...\n"
+				"  -u	Print microseconds in the timestamps\n",
+				argv[0]);
+			exit(1);
+		}
+	}
+	if (optind == argc)
+	{
+		fprintf(stderr, "Usage: %s [-u] <log file> ...\n", argv[0]);
+		exit(1);
+	}
+	for (; optind < argc; optind++)
+	{
+		if ((data = readFile(argv[optind], &len)) == NULL)
+		{
+			rval = 1;
+			continue;
+		}
+		formats.fmts = NULL;
+		formats.nfmts = 0;
+		/*
+		 * A format record is written by the thread that first used
+		 * the format, the records of the other threads may precede
+		 * it, the formats are therefore collected first.
+		 */
+		collectFormats(data, len, &formats);
+		decode(data, len, &formats);
+
+		for (i = 0; i < formats.nfmts; i++)
+			free(formats.fmts[i]);
+		free(formats.fmts);
+		free(data);
+	}
+	return rval;
+}
+
+/**
+ * Read the whole log file to memory
+ *
+ * @param file	The name of the file
+ * @param p_len	The length of the file
+ * @return The content of the file or NULL
+ */
+static char *
+readFile(char *file, size_t *p_len)
+{
+FILE	*fp;
+char	*data = NULL;
+size_t	size = 0, n;
+
+	if ((fp = fopen(file, "r")) == NULL)
+	{
+		perror(file);
+		return NULL;
+	}
+	*p_len = 0;
+	do {
+		if (*p_len == size)
+		{
+			char *ndata;
+
+			size = size ? size * 2 : 1024 * 1024;
+			if ((ndata = realloc(data, size)) == NULL)
+			{
+				fprintf(stderr, "%s: Out of memory\n", file);
+				free(data);
+				fclose(fp);
+				return NULL;
+			}
+			data = ndata;
+		}
+		n = fread(data + *p_len, 1, size - *p_len, fp);
+		*p_len += n;
+	} while (n > 0);
+
+	if (ferror(fp))
+	{
+		perror(file);
+		free(data);
+		data = NULL;
+	}
+	fclose(fp);
+	return data;
+}
+
+/**
+ * Check whether a record starts at a position of the file
+ *
+ * @param p		The position
+ * @param endp		The end of the file
+ * @param p_type	The type of the record
+ * @param p_len		The length of the body of the record
+ * @return Non-zero if a record starts at p
+ */
+static int
+checkRecord(char *p, char *endp, int *p_type, size_t *p_len)
+{
+uint16_t	len;
+
+	if ((unsigned char)*p != LOG_BINARY_MAGIC
+		|| endp - p < LOG_BINARY_HDRLEN)
+		return 0;
+	*p_type = p[1];
+	if (*p_type != LOG_BINARY_FORMAT && *p_type != LOG_BINARY_MESSAGE
+			&& *p_type != LOG_BINARY_TEXT)
+		return 0;
+	memcpy(&len, p + 2, sizeof(len));
+	if (endp - p - LOG_BINARY_HDRLEN < len)
+		return 0;
+	*p_len = len;
+	return 1;
+}
+
+/**
+ * Collect the format records of the file
+ *
+ * @param data		The content of the log file
+ * @param len		The length of the content
+ * @param formats	The formats of the file
+ */
+static void
+collectFormats(char *data, size_t len, FORMATS *formats)
+{
+char		*p = data, *endp = data + len;
+int		type;
+size_t		blen;
+uint32_t	id;
+
+	while (p < endp)
+	{
+		if (!checkRecord(p, endp, &type, &blen))
+		{
+			p++;
+			continue;
+		}
+		p += LOG_BINARY_HDRLEN;
+		if (type == LOG_BINARY_FORMAT && blen >= sizeof(id))
+		{
+			memcpy(&id, p, sizeof(id));
+			if (id >= formats->nfmts)
+			{
+				size_t	n = id + 1;
+				char	**nfmts;
+
+				if ((nfmts = realloc(formats->fmts,
+						n * sizeof(char *))) == NULL)
+				{
+					fprintf(stderr, "Out of memory\n");
+					exit(1);
+				}
+				memset(&nfmts[formats->nfmts], 0,
+					(n - formats->nfmts) * sizeof(char *));
+				formats->fmts = nfmts;
+				formats->nfmts = n;
+			}
+			free(formats->fmts[id]);
+			formats->fmts[id] = strndup(p + sizeof(id),
+						blen - sizeof(id));
+		}
+		p += blen;
+	}
+}
+
+/**
+ * Write the log file as text, the text header and footer of the file are
+ * written as they are.
+ *
+ * @param data		The content of the log file
+ * @param len		The length of the content
+ * @param formats	The formats of the file
+ */
+static void
+decode(char *data, size_t len, FORMATS *formats)
+{
+char	*p = data, *endp = data + len, *textp = data;
+int	type;
+size_t	blen;
+
+	while (p < endp)
+	{
+		if (!checkRecord(p, endp, &type, &blen))
+		{
+			p++;
+			continue;
+		}
+		fwrite(textp, 1, p - textp, stdout);
+		p += LOG_BINARY_HDRLEN;
+		if (type == LOG_BINARY_MESSAGE)
+			renderMessage(p, blen, formats);
+		else if (type == LOG_BINARY_TEXT)
+			renderText(p, blen);
+		p += blen;
+		textp = p;
+	}
+	fwrite(textp, 1, p - textp, stdout);
+}
+
+/**
+ * Render a message record
+ *
+ * @param body		The body of the record
+ * @param len		The length of the body
+ * @param formats	The formats of the file
+ */
+static void
+renderMessage(char *body, size_t len, FORMATS *formats)
+{
+static MSGBUF	msg;
+char		*rp = body, *endp = body + len;
+uint32_t	id;
+
+	msg.len = 0;
+	if (len < sizeof(id))
+		return;
+	memcpy(&id, rp, sizeof(id));
+	rp += sizeof(id);
+	if ((rp = renderTimestamp(rp, endp, &msg)) == NULL)
+		return;
+	if (id >= formats->nfmts || formats->fmts[id] == NULL)
+		msgPrintf(&msg, "<message of unknown format %u>", id);
+	else if (!renderArgs(formats->fmts[id], rp, endp, &msg))
+		msgPrintf(&msg, " <arguments don't match the format \"%s\">",
+				formats->fmts[id]);
+	msgOutput(&msg);
+}
+
+/**
+ * Render a text record
+ *
+ * @param body		The body of the record
+ * @param len		The length of the body
+ */
+static void
+renderText(char *body, size_t len)
+{
+static MSGBUF	msg;
+char		*rp;
+
+	msg.len = 0;
+	if ((rp = renderTimestamp(body, body + len, &msg)) == NULL)
+		return;
+	msgPrintf(&msg, "%.*s", (int)(body + len - rp), rp);
+	msgOutput(&msg);
+}
+
+/**
+ * Render the time of a record like the log manager timestamp
+ *
+ * @param p	The time in the record
+ * @param endp	The end of the record
+ * @param msg	The log string
+ * @return The position after the time or NULL
+ */
+static char *
+renderTimestamp(char *p, char *endp, MSGBUF *msg)
+{
+int64_t		sec;
+int32_t		usec;
+time_t		t;
+struct tm	tm;
+
+	if (endp - p < (int)(sizeof(sec) + sizeof(usec)))
+		return NULL;
+	memcpy(&sec, p, sizeof(sec));
+	p += sizeof(sec);
+	memcpy(&usec, p, sizeof(usec));
+	p += sizeof(usec);
+	t = (time_t)sec;
+	localtime_r(&t, &tm);
+	msgPrintf(msg, "%04d %02d/%02d %02d:%02d:%02d",
+			tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+			tm.tm_hour, tm.tm_min, tm.tm_sec);
+	if (usecs)
+		msgPrintf(msg, ".%06d", usec);
+	msgPrintf(msg, "   ");
+	return p;
+}
+
+/** Print a conversion with the star arguments before the value */
+#define PRINT_ARG(msg, spec, nstars, stars, value)			\
+	do {								\
+		if ((nstars) == 0)					\
+			msgPrintf(msg, spec, value);			\
+		else if ((nstars) == 1)					\
+			msgPrintf(msg, spec, (stars)[0], value);	\
+		else							\
+			msgPrintf(msg, spec, (stars)[0], (stars)[1], value); \
+	} while (0)
+
+/**
+ * Render the arguments of a message record with a format. The conversions
+ * are passed to snprintf one by one with the length modifier matching the
+ * type of the recorded argument.
+ *
+ * @param fmt	The format
+ * @param rp	The arguments in the record
+ * @param endp	The end of the record
+ * @param msg	The log string
+ * @return Non-zero if the arguments matched the format
+ */
+static int
+renderArgs(char *fmt, char *rp, char *endp, MSGBUF *msg)
+{
+char	*p = fmt, *start;
+char	spec[64];
+int	stars[2];
+int	nstars;
+size_t	slen;
+char	tag, conv;
+
+	while (*p != '\0')
+	{
+		if (*p != '%')
+		{
+			start = p;
+			while (*p != '\0' && *p != '%')
+				p++;
+			msgPrintf(msg, "%.*s", (int)(p - start), start);
+			continue;
+		}
+		if (p[1] == '%')
+		{
+			msgPrintf(msg, "%%");
+			p += 2;
+			continue;
+		}
+		/* Build the conversion without its length modifier */
+		slen = 0;
+		spec[slen++] = *p++;
+		nstars = 0;
+		while (*p != '\0' && (strchr("-+ #0.*", *p) != NULL
+				|| (*p >= '0' && *p <= '9')))
+		{
+			if (*p == '*')
+			{
+				int32_t	v;
+
+				if (nstars == 2 || endp - rp < 1 + (int)sizeof(v)
+						|| *rp != LOG_ARG_INT)
+					return 0;
+				memcpy(&v, rp + 1, sizeof(v));
+				rp += 1 + sizeof(v);
+				stars[nstars++] = v;
+			}
+			if (slen < sizeof(spec) - 8)
+				spec[slen++] = *p;
+			p++;
+		}
+		while (*p != '\0' && strchr("hlLqjzt", *p) != NULL)
+		{
+			if (*p == 'h' && slen < sizeof(spec) - 8)
+				spec[slen++] = *p;
+			p++;
+		}
+		if ((conv = *p) == '\0' || endp - rp < 1)
+			return 0;
+		p++;
+		tag = *rp++;
+
+		switch (tag)
+		{
+		case LOG_ARG_INT:
+		{
+			int32_t	v;
+
+			if (endp - rp < (int)sizeof(v) || strchr("diouxXc", conv) == NULL)
+				return 0;
+			memcpy(&v, rp, sizeof(v));
+			rp += sizeof(v);
+			spec[slen++] = conv;
+			spec[slen] = '\0';
+			PRINT_ARG(msg, spec, nstars, stars, (int)v);
+			break;
+		}
+		case LOG_ARG_LONG:
+		{
+			int64_t	v;
+
+			if (endp - rp < (int)sizeof(v) || strchr("diouxX", conv) == NULL)
+				return 0;
+			memcpy(&v, rp, sizeof(v));
+			rp += sizeof(v);
+			spec[slen++] = 'l';
+			spec[slen++] = 'l';
+			spec[slen++] = conv;
+			spec[slen] = '\0';
+			PRINT_ARG(msg, spec, nstars, stars, (long long)v);
+			break;
+		}
+		case LOG_ARG_DOUBLE:
+		{
+			double	v;
+
+			if (endp - rp < (int)sizeof(v) || strchr("eEfFgGaA", conv) == NULL)
+				return 0;
+			memcpy(&v, rp, sizeof(v));
+			rp += sizeof(v);
+			spec[slen++] = conv;
+			spec[slen] = '\0';
+			PRINT_ARG(msg, spec, nstars, stars, v);
+			break;
+		}
+		case LOG_ARG_LDOUBLE:
+		{
+			long double	v;
+
+			if (endp - rp < (int)sizeof(v) || strchr("eEfFgGaA", conv) == NULL)
+				return 0;
+			memcpy(&v, rp, sizeof(v));
+			rp += sizeof(v);
+			spec[slen++] = 'L';
+			spec[slen++] = conv;
+			spec[slen] = '\0';
+			PRINT_ARG(msg, spec, nstars, stars, v);
+			break;
+		}
+		case LOG_ARG_POINTER:
+		{
+			uint64_t	v;
+
+			if (endp - rp < (int)sizeof(v) || conv != 'p')
+				return 0;
+			memcpy(&v, rp, sizeof(v));
+			rp += sizeof(v);
+			spec[slen++] = conv;
+			spec[slen] = '\0';
+			PRINT_ARG(msg, spec, nstars, stars, (void *)(uintptr_t)v);
+			break;
+		}
+		case LOG_ARG_STRING:
+		{
+			uint16_t	len;
+			char		*s;
+
+			if (endp - rp < (int)sizeof(len) || conv != 's')
+				return 0;
+			memcpy(&len, rp, sizeof(len));
+			rp += sizeof(len);
+			if (endp - rp < len || (s = strndup(rp, len)) == NULL)
+				return 0;
+			rp += len;
+			spec[slen++] = conv;
+			spec[slen] = '\0';
+			PRINT_ARG(msg, spec, nstars, stars, s);
+			free(s);
+			break;
+		}
+		default:
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Append to a log string, the string is truncated at MAX_MSGLEN
+ *
+ * @param msg	The log string
+ * @param fmt	The printf format
+ */
+static void
+msgPrintf(MSGBUF *msg, const char *fmt, ...)
+{
+va_list	args;
+int	n;
+
+	if (msg->len >= sizeof(msg->buf) - 1)
+		return;
+	va_start(args, fmt);
+	n = vsnprintf(&msg->buf[msg->len], sizeof(msg->buf) - msg->len,
+			fmt, args);
+	va_end(args);
+	if (n > 0)
+	{
+		msg->len += n;
+		if (msg->len > sizeof(msg->buf) - 1)
+			msg->len = sizeof(msg->buf) - 1;
+	}
+}
+
+/**
+ * Write a log string as the log manager does in text mode, a line feed
+ * that ends the string is replaced by space before the line feed that
+ * ends the line.
+ *
+ * @param msg	The log string
+ */
+static void
+msgOutput(MSGBUF *msg)
+{
+	if (msg->len > 0 && msg->buf[msg->len - 1] == '\n')
+		msg->buf[msg->len - 1] = ' ';
+	fwrite(msg->buf, 1, msg->len, stdout);
+	fputc('\n', stdout);
+}
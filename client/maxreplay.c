@@ -0,0 +1,862 @@
+/*
+ * This file is distributed as part of MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file maxreplay.c  - Replay a traffic capture of the QLA filter
+ *
+ * The QLA filter with format=capture writes a file for each session with
+ * the packets of the client and the times of the replies, the layout of
+ * the records is in qlacapture.h. This program plays the sessions of the
+ * files given back to a MaxScale, or to a server, each session in a
+ * thread of its own. A session connects at the time it started and sends
+ * each packet at the time it was sent, relative to the start of the
+ * capture, so that the concurrency and the arrival times of the capture
+ * are reproduced. With -s the times are divided by a factor, -s 0 sends
+ * each packet as soon as the reply to the previous one has been read.
+ *
+ * The passwords are not in the capture, every session logs in as the user
+ * of the command line. A COM_CHANGE_USER is not replayed. The ids of the
+ * prepared statements sent are those of the capture, they are the same in
+ * the replay as long as the server numbers the statements of a connection
+ * in the order they are prepared.
+ *
+ * The response time of a packet is the time to the first packet of the
+ * reply, as that is what the capture records, the report compares the
+ * response times of the capture to those of the replay.
+ *
+ * Usage: maxreplay [-h host] [-P port] [-u user] [-p password]
+ *			[-D database] [-s speed] <capture file> ...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/sha.h>
+
+#include <qlacapture.h>
+
+#define	HEADER_LEN		4
+#define	MAX_PAYLOAD		0xffffff
+#define	SCRAMBLE_SIZE		20
+#define	CHARSET			0x21	/* utf8_general_ci */
+#define	MORE_RESULTS		0x0008	/* SERVER_MORE_RESULTS_EXISTS */
+#define	THREAD_STACK		(256 * 1024)
+
+/* The capabilities of the replay client */
+#define	CAPABILITIES		(0x00000001 |	/* LONG_PASSWORD */ \
+				 0x00000004 |	/* LONG_FLAG */ \
+				 0x00000200 |	/* PROTOCOL_41 */ \
+				 0x00002000 |	/* TRANSACTIONS */ \
+				 0x00008000 |	/* SECURE_CONNECTION */ \
+				 0x00010000 |	/* MULTI_STATEMENTS */ \
+				 0x00020000 |	/* MULTI_RESULTS */ \
+				 0x00080000)	/* PLUGIN_AUTH */
+#define	CONNECT_WITH_DB		0x00000008
+
+#define	COM_QUIT		0x01
+#define	COM_FIELD_LIST		0x04
+#define	COM_STATISTICS		0x09
+#define	COM_CHANGE_USER		0x11
+#define	COM_BINLOG_DUMP		0x12
+#define	COM_REGISTER_SLAVE	0x15
+#define	COM_STMT_PREPARE	0x16
+#define	COM_STMT_SEND_LONG_DATA	0x18
+#define	COM_STMT_CLOSE		0x19
+#define	COM_STMT_FETCH		0x1c
+
+#define	get_byte2(p)	((uint32_t)(p)[0] | ((uint32_t)(p)[1] << 8))
+#define	get_byte3(p)	(get_byte2(p) | ((uint32_t)(p)[2] << 16))
+
+/** A packet of the capture */
+typedef struct {
+	uint64_t	sent;		/* Microseconds of the packet */
+	uint64_t	reply;		/* Microseconds of the reply, 0 if none */
+	unsigned char	*data;		/* The packet with its header */
+	uint32_t	length;
+} EVENT;
+
+/** The response times of a packet that had a reply in both runs */
+typedef struct {
+	uint32_t	captured;
+	uint32_t	replayed;
+} LATENCY;
+
+/** A session of the capture and the state of its replay */
+typedef struct {
+	char		*file;
+	char		*data;		/* Content of the file */
+	uint64_t	start;		/* Microseconds of the start */
+	EVENT		*events;
+	int		nevents;
+	LATENCY		*latencies;
+	int		nlatencies;
+	long		sent;
+	long		errors;
+	long		skipped;
+	int		failed;		/* The connection was lost */
+	int		fd;
+	unsigned char	*buf;		/* Data read from the server */
+	size_t		bufsize, pos, len;
+	pthread_t	thread;
+} SESSION;
+
+static char		*host = "127.0.0.1";
+static char		*port = "4006";
+static char		*user = "root";
+static char		*passwd = "";
+static char		*database = NULL;
+static double		speed = 1.0;
+static struct addrinfo	*address;
+static uint64_t		capture_start;	/* The first session of the capture */
+static uint64_t		replay_start;	/* The clock at the start of the replay */
+
+static char *readFile(char *file, size_t *p_len);
+static int loadSession(SESSION *ses, char *file);
+static void *replaySession(void *arg);
+static void report(SESSION *sessions, int nsessions, uint64_t elapsed);
+
+static uint64_t
+now()
+{
+struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Wait until the clock of the replay reaches the time of the capture
+ *
+ * @param when	Microseconds of the capture
+ */
+static void
+waitFor(uint64_t when)
+{
+uint64_t	target, t;
+
+	if (speed == 0.0 || when < capture_start)
+		return;
+	target = replay_start + (uint64_t)((when - capture_start) / speed);
+	while ((t = now()) < target)
+	{
+		struct timespec	ts;
+
+		ts.tv_sec = (target - t) / 1000000;
+		ts.tv_nsec = ((target - t) % 1000000) * 1000;
+		nanosleep(&ts, NULL);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+SESSION		*sessions;
+struct addrinfo	hints;
+pthread_attr_t	attr;
+uint64_t	elapsed;
+int		opt, i, n, nsessions = 0;
+
+	while ((opt = getopt(argc, argv, "h:P:u:p:D:s:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'h':
+			host = optarg;
+			break;
+		case 'P':
+			port = optarg;
+			break;
+		case 'u':
+			user = optarg;
+			break;
+		case 'p':
+			passwd = optarg;
+			break;
+		case 'D':
+			database = optarg;
+			break;
+		case 's':
+			speed = atof(optarg);
+			break;
+		default:
+			fprintf(stderr,
+				"Usage: %s [-h host] [-P port] [-u user] "
+				"[-p password] [-D database]\n"
+				"\t\t[-s speed] <capture file> ...\n"
+				"  -s	Divide the times of the capture by speed, "
+				"0 sends without waiting\n",
+				argv[0]);
+			exit(1);
+		}
+	}
+	if (optind == argc || speed < 0.0)
+	{
+		fprintf(stderr, "Usage: %s [-h host] [-P port] [-u user] "
+			"[-p password] [-D database] [-s speed] "
+			"<capture file> ...\n", argv[0]);
+		exit(1);
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((n = getaddrinfo(host, port, &hints, &address)) != 0)
+	{
+		fprintf(stderr, "%s: %s\n", host, gai_strerror(n));
+		exit(1);
+	}
+
+	if ((sessions = calloc(argc - optind, sizeof(SESSION))) == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	for (; optind < argc; optind++)
+	{
+		if (loadSession(&sessions[nsessions], argv[optind]) == 0)
+			continue;
+		if (nsessions == 0 || sessions[nsessions].start < capture_start)
+			capture_start = sessions[nsessions].start;
+		nsessions++;
+	}
+	if (nsessions == 0)
+	{
+		fprintf(stderr, "No sessions to replay\n");
+		exit(1);
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, THREAD_STACK);
+	/* The threads are started before the first session connects */
+	replay_start = now() + (speed == 0.0 ? 0 : 100000);
+	for (i = 0; i < nsessions; i++)
+	{
+		if (pthread_create(&sessions[i].thread, &attr, replaySession,
+							&sessions[i]) != 0)
+		{
+			fprintf(stderr, "%s: Unable to start a thread\n",
+				sessions[i].file);
+			sessions[i].failed = 1;
+			sessions[i].thread = 0;
+		}
+	}
+	for (i = 0; i < nsessions; i++)
+		if (sessions[i].thread)
+			pthread_join(sessions[i].thread, NULL);
+	elapsed = now() - replay_start;
+
+	report(sessions, nsessions, elapsed);
+	return 0;
+}
+
+/**
+ * Read the whole capture file to memory
+ *
+ * @param file	The name of the file
+ * @param p_len	The length of the file
+ * @return The content of the file or NULL
+ */
+static char *
+readFile(char *file, size_t *p_len)
+{
+FILE	*fp;
+char	*data = NULL;
+size_t	size = 0, n;
+
+	if ((fp = fopen(file, "r")) == NULL)
+	{
+		perror(file);
+		return NULL;
+	}
+	*p_len = 0;
+	do {
+		if (*p_len == size)
+		{
+			char *ndata;
+
+			size = size ? size * 2 : 1024 * 1024;
+			if ((ndata = realloc(data, size)) == NULL)
+			{
+				fprintf(stderr, "%s: Out of memory\n", file);
+				free(data);
+				fclose(fp);
+				return NULL;
+			}
+			data = ndata;
+		}
+		n = fread(data + *p_len, 1, size - *p_len, fp);
+		*p_len += n;
+	} while (n > 0);
+
+	if (ferror(fp))
+	{
+		perror(file);
+		free(data);
+		data = NULL;
+	}
+	fclose(fp);
+	return data;
+}
+
+/**
+ * Read the records of a capture file. A file that the writer of the filter
+ * has not finished may end in the middle of a record, the records before
+ * it are replayed.
+ *
+ * @param ses	The session to fill in
+ * @param file	The capture file
+ * @return Non-zero if the session has packets to replay
+ */
+static int
+loadSession(SESSION *ses, char *file)
+{
+struct qla_capture	rec;
+char			*p, *endp;
+size_t			len;
+int			size = 0;
+uint64_t		t;
+
+	memset(ses, 0, sizeof(SESSION));
+	ses->file = file;
+	if ((ses->data = readFile(file, &len)) == NULL)
+		return 0;
+	p = ses->data;
+	endp = ses->data + len;
+	while (endp - p >= sizeof(rec))
+	{
+		memcpy(&rec, p, sizeof(rec));
+		if (rec.magic != QLA_CAPTURE_MAGIC)
+		{
+			fprintf(stderr, "%s: Not a capture of the QLA filter "
+				"at offset %ld\n", file, (long)(p - ses->data));
+			break;
+		}
+		if (endp - p - sizeof(rec) < rec.length)
+			break;
+		p += sizeof(rec);
+		t = rec.sec * 1000000 + rec.usec;
+		switch (rec.type)
+		{
+		case QLA_CAPTURE_OPEN:
+			ses->start = t;
+			break;
+		case QLA_CAPTURE_PACKET:
+			if (rec.length < HEADER_LEN + 1)
+				break;
+			if (ses->nevents == size)
+			{
+				EVENT	*nevents;
+
+				size = size ? size * 2 : 256;
+				if ((nevents = realloc(ses->events,
+						size * sizeof(EVENT))) == NULL)
+				{
+					fprintf(stderr, "%s: Out of memory\n",
+						file);
+					return 0;
+				}
+				ses->events = nevents;
+			}
+			if (ses->nevents == 0 && ses->start == 0)
+				ses->start = t;
+			ses->events[ses->nevents].sent = t;
+			ses->events[ses->nevents].reply = 0;
+			ses->events[ses->nevents].data = (unsigned char *)p;
+			ses->events[ses->nevents].length = rec.length;
+			ses->nevents++;
+			break;
+		case QLA_CAPTURE_REPLY:
+			if (ses->nevents > 0 &&
+					ses->events[ses->nevents - 1].reply == 0)
+				ses->events[ses->nevents - 1].reply = t;
+			break;
+		case QLA_CAPTURE_CLOSE:
+			break;
+		}
+		p += rec.length;
+	}
+	if (ses->nevents == 0)
+	{
+		free(ses->data);
+		free(ses->events);
+		return 0;
+	}
+	if ((ses->latencies = calloc(ses->nevents, sizeof(LATENCY))) == NULL)
+	{
+		fprintf(stderr, "%s: Out of memory\n", file);
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Read the next packet from the server
+ *
+ * @param ses	The session
+ * @param p_len	The length of the payload
+ * @return The payload, valid until the next read, or NULL if the
+ *	   connection was lost
+ */
+static unsigned char *
+readPacket(SESSION *ses, uint32_t *p_len)
+{
+unsigned char	*pkt;
+uint32_t	len;
+ssize_t		n;
+
+	for (;;)
+	{
+		if (ses->len - ses->pos >= HEADER_LEN)
+		{
+			len = get_byte3(ses->buf + ses->pos);
+			if (ses->len - ses->pos >= HEADER_LEN + len)
+				break;
+		}
+		else
+			len = 0;
+		if (ses->pos > 0)
+		{
+			memmove(ses->buf, ses->buf + ses->pos,
+						ses->len - ses->pos);
+			ses->len -= ses->pos;
+			ses->pos = 0;
+		}
+		if (ses->bufsize < HEADER_LEN + len || ses->len == ses->bufsize)
+		{
+			unsigned char	*nbuf;
+			size_t		size = ses->bufsize ? ses->bufsize * 2
+							: 65536;
+
+			while (size < HEADER_LEN + len)
+				size *= 2;
+			if ((nbuf = realloc(ses->buf, size)) == NULL)
+				return NULL;
+			ses->buf = nbuf;
+			ses->bufsize = size;
+		}
+		n = read(ses->fd, ses->buf + ses->len, ses->bufsize - ses->len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return NULL;
+		ses->len += n;
+	}
+	pkt = ses->buf + ses->pos + HEADER_LEN;
+	ses->pos += HEADER_LEN + len;
+	*p_len = len;
+	return pkt;
+}
+
+static int
+writeAll(int fd, unsigned char *data, size_t len)
+{
+ssize_t	w;
+
+	while (len > 0)
+	{
+		if ((w = write(fd, data, len)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += w;
+		len -= w;
+	}
+	return 0;
+}
+
+/**
+ * The token of mysql_native_password,
+ * SHA1(password) XOR SHA1(scramble, SHA1(SHA1(password)))
+ */
+static void
+scramblePassword(unsigned char *token, unsigned char *scramble, char *pw)
+{
+unsigned char	hash1[SHA_DIGEST_LENGTH];
+unsigned char	hash2[SHA_DIGEST_LENGTH];
+unsigned char	data[SCRAMBLE_SIZE + SHA_DIGEST_LENGTH];
+int		i;
+
+	SHA1((unsigned char *)pw, strlen(pw), hash1);
+	SHA1(hash1, SHA_DIGEST_LENGTH, hash2);
+	memcpy(data, scramble, SCRAMBLE_SIZE);
+	memcpy(data + SCRAMBLE_SIZE, hash2, SHA_DIGEST_LENGTH);
+	SHA1(data, sizeof(data), hash2);
+	for (i = 0; i < SHA_DIGEST_LENGTH; i++)
+		token[i] = hash1[i] ^ hash2[i];
+}
+
+/**
+ * Connect to the service and authenticate as the user of the command line
+ *
+ * @param ses	The session
+ * @return 0 on success
+ */
+static int
+replayConnect(SESSION *ses)
+{
+unsigned char	pkt[512], scramble[SCRAMBLE_SIZE];
+unsigned char	*hs, *p;
+uint32_t	caps = CAPABILITIES, len;
+int		one = 1;
+
+	if ((ses->fd = socket(address->ai_family, SOCK_STREAM, 0)) < 0)
+		return -1;
+	setsockopt(ses->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(ses->fd, address->ai_addr, address->ai_addrlen) < 0)
+	{
+		fprintf(stderr, "%s: Connect to %s:%s failed: %s\n",
+			ses->file, host, port, strerror(errno));
+		return -1;
+	}
+
+	/* The handshake: version, string, thread id, scramble, ... */
+	if ((hs = readPacket(ses, &len)) == NULL || hs[0] == 0xff || len < 45)
+		return -1;
+	p = hs + 1 + strlen((char *)hs + 1) + 1 + 4;
+	memcpy(scramble, p, 8);
+	p += 8 + 1 + 2 + 1 + 2 + 2 + 1 + 10;
+	memcpy(scramble + 8, p, SCRAMBLE_SIZE - 8);
+
+	if (database)
+		caps |= CONNECT_WITH_DB;
+	memset(pkt, 0, sizeof(pkt));
+	p = pkt + HEADER_LEN;
+	p[0] = caps & 0xff;
+	p[1] = (caps >> 8) & 0xff;
+	p[2] = (caps >> 16) & 0xff;
+	p[3] = (caps >> 24) & 0xff;
+	p[6] = 0x00;
+	p[7] = 0x01;			/* Max packet 16MB */
+	p[8] = CHARSET;
+	p += 32;
+	p += snprintf((char *)p, 64, "%s", user) + 1;
+	if (*passwd)
+	{
+		*p++ = SHA_DIGEST_LENGTH;
+		scramblePassword(p, scramble, passwd);
+		p += SHA_DIGEST_LENGTH;
+	}
+	else
+		*p++ = 0;
+	if (database)
+		p += snprintf((char *)p, 64, "%s", database) + 1;
+	p += sprintf((char *)p, "mysql_native_password") + 1;
+	len = p - pkt - HEADER_LEN;
+	pkt[0] = len & 0xff;
+	pkt[1] = (len >> 8) & 0xff;
+	pkt[2] = (len >> 16) & 0xff;
+	pkt[3] = 1;
+	if (writeAll(ses->fd, pkt, p - pkt) < 0)
+		return -1;
+
+	if ((p = readPacket(ses, &len)) == NULL)
+		return -1;
+	if (p[0] != 0x00)
+	{
+		fprintf(stderr, "%s: Authentication failed: %.*s\n", ses->file,
+			p[0] == 0xff && len > 9 ? (int)len - 9 : 0,
+			(char *)p + 9);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Read packets up to and including an EOF packet
+ *
+ * @return 0 at the EOF, -1 at an ERR and -2 if the connection was lost
+ */
+static int
+readToEOF(SESSION *ses, uint32_t *p_status)
+{
+unsigned char	*p;
+uint32_t	len;
+
+	for (;;)
+	{
+		if ((p = readPacket(ses, &len)) == NULL)
+			return -2;
+		if (len > 0 && p[0] == 0xff)
+			return -1;
+		if (len > 0 && len < 9 && p[0] == 0xfe)
+		{
+			if (p_status)
+				*p_status = len >= 5 ? get_byte2(p + 3) : 0;
+			return 0;
+		}
+	}
+}
+
+/**
+ * Read the rest of a reply of which the first packet has been read
+ *
+ * @param ses	The session
+ * @param cmd	The command of the packet replied to
+ * @param p	The first packet of the reply
+ * @param len	Length of the first packet
+ * @return 0 for a reply that is not an error, -1 for an error and -2 if
+ *	   the connection was lost
+ */
+static int
+readReply(SESSION *ses, int cmd, unsigned char *p, uint32_t len)
+{
+unsigned char	*q;
+uint32_t	status, ncols, nparams;
+int		i, rc, infile;
+
+	for (;;)
+	{
+		if (len == 0)
+			return 0;
+		infile = 0;
+		if (p[0] == 0xff)
+			return -1;
+		if (cmd == COM_STATISTICS)
+			return 0;
+		if (cmd == COM_FIELD_LIST || cmd == COM_STMT_FETCH)
+		{
+			if (p[0] == 0xfe && len < 9)
+				return 0;
+			return readToEOF(ses, NULL);
+		}
+		if (cmd == COM_STMT_PREPARE && p[0] == 0x00)
+		{
+			if (len < 9)
+				return 0;
+			ncols = get_byte2(p + 5);
+			nparams = get_byte2(p + 7);
+			if (nparams > 0 && (rc = readToEOF(ses, NULL)) != 0)
+				return rc;
+			if (ncols > 0 && (rc = readToEOF(ses, NULL)) != 0)
+				return rc;
+			return 0;
+		}
+		if (p[0] == 0x00)
+		{
+			/* Skip the length encoded affected rows and insert id */
+			q = p + 1;
+			for (i = 0; i < 2; i++)
+				q += *q < 0xfb ? 1 : *q == 0xfc ? 3 :
+						*q == 0xfd ? 4 : 9;
+			status = q + 2 <= p + len ? get_byte2(q) : 0;
+		}
+		else if (p[0] == 0xfe && len < 9)
+		{
+			status = len >= 5 ? get_byte2(p + 3) : 0;
+		}
+		else if (p[0] == 0xfb)
+		{
+			/* LOCAL INFILE, the file is sent empty */
+			unsigned char	empty[HEADER_LEN] = { 0, 0, 0, 2 };
+
+			if (writeAll(ses->fd, empty, HEADER_LEN) < 0)
+				return -2;
+			status = 0;
+			infile = 1;
+		}
+		else
+		{
+			/* A result set, the columns, an EOF, the rows, an EOF */
+			if ((rc = readToEOF(ses, NULL)) != 0)
+				return rc;
+			if ((rc = readToEOF(ses, &status)) != 0)
+				return rc;
+		}
+		if ((status & MORE_RESULTS) == 0 && !infile)
+			return 0;
+		if ((p = readPacket(ses, &len)) == NULL)
+			return -2;
+	}
+}
+
+/**
+ * The thread of a session, the packets of the capture are sent at their
+ * times and the replies are read whole
+ *
+ * @param arg	The session
+ */
+static void *
+replaySession(void *arg)
+{
+SESSION		*ses = (SESSION *)arg;
+EVENT		*ev;
+unsigned char	*p;
+uint64_t	sent;
+uint32_t	len;
+int		i, cmd, rc;
+
+	waitFor(ses->start);
+	if (replayConnect(ses) != 0)
+	{
+		ses->failed = 1;
+		close(ses->fd);
+		return NULL;
+	}
+	for (i = 0; i < ses->nevents; i++)
+	{
+		ev = &ses->events[i];
+		cmd = ev->data[HEADER_LEN];
+		if (ev->data[3] == 0 && (cmd == COM_CHANGE_USER ||
+			cmd == COM_BINLOG_DUMP || cmd == COM_REGISTER_SLAVE))
+		{
+			ses->skipped++;
+			continue;
+		}
+		waitFor(ev->sent);
+		sent = now();
+		if (writeAll(ses->fd, ev->data, ev->length) < 0)
+		{
+			ses->failed = 1;
+			break;
+		}
+		ses->sent++;
+		if (ev->data[3] == 0 && cmd == COM_QUIT)
+			break;
+		/*
+		 * No reply to the packets of a statement continued in the next
+		 * packet or to the commands that have none.
+		 */
+		if (get_byte3(ev->data) == MAX_PAYLOAD ||
+			(ev->data[3] == 0 && (cmd == COM_STMT_CLOSE ||
+				cmd == COM_STMT_SEND_LONG_DATA)))
+			continue;
+		if (ev->data[3] != 0)
+			cmd = -1;
+		if ((p = readPacket(ses, &len)) == NULL)
+		{
+			ses->failed = 1;
+			break;
+		}
+		if (ev->reply)
+		{
+			ses->latencies[ses->nlatencies].captured =
+						ev->reply - ev->sent;
+			ses->latencies[ses->nlatencies].replayed =
+						now() - sent;
+			ses->nlatencies++;
+		}
+		if ((rc = readReply(ses, cmd, p, len)) == -2)
+		{
+			ses->failed = 1;
+			break;
+		}
+		if (rc == -1)
+			ses->errors++;
+	}
+	close(ses->fd);
+	return NULL;
+}
+
+static int
+compareUint32(const void *a, const void *b)
+{
+uint32_t	x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static uint32_t
+percentile(uint32_t *values, long n, double pct)
+{
+long	i = (long)(n * pct / 100.0);
+
+	return values[i < n ? i : n - 1];
+}
+
+/**
+ * Print the totals of the replay and the response times of the capture
+ * and of the replay side by side
+ */
+static void
+report(SESSION *sessions, int nsessions, uint64_t elapsed)
+{
+uint32_t	*captured, *replayed;
+double		csum = 0.0, rsum = 0.0;
+long		n = 0, sent = 0, errors = 0, skipped = 0;
+int		i, j, failed = 0;
+uint64_t	last = capture_start;
+static double	pcts[] = { 50.0, 90.0, 99.0, 99.9 };
+
+	for (i = 0; i < nsessions; i++)
+	{
+		n += sessions[i].nlatencies;
+		sent += sessions[i].sent;
+		errors += sessions[i].errors;
+		skipped += sessions[i].skipped;
+		failed += sessions[i].failed;
+		if (sessions[i].events[sessions[i].nevents - 1].sent > last)
+			last = sessions[i].events[sessions[i].nevents - 1].sent;
+	}
+	printf("Sessions replayed		%d\n", nsessions);
+	printf("Sessions failed			%d\n", failed);
+	printf("Packets sent			%ld\n", sent);
+	printf("Packets skipped			%ld\n", skipped);
+	printf("Error replies			%ld\n", errors);
+	printf("Length of the capture		%.3f s\n",
+				(last - capture_start) / 1000000.0);
+	printf("Length of the replay		%.3f s\n", elapsed / 1000000.0);
+	if (n == 0)
+		return;
+
+	if ((captured = malloc(n * sizeof(uint32_t))) == NULL ||
+		(replayed = malloc(n * sizeof(uint32_t))) == NULL)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return;
+	}
+	n = 0;
+	for (i = 0; i < nsessions; i++)
+		for (j = 0; j < sessions[i].nlatencies; j++)
+		{
+			captured[n] = sessions[i].latencies[j].captured;
+			replayed[n] = sessions[i].latencies[j].replayed;
+			csum += captured[n];
+			rsum += replayed[n];
+			n++;
+		}
+	qsort(captured, n, sizeof(uint32_t), compareUint32);
+	qsort(replayed, n, sizeof(uint32_t), compareUint32);
+
+	printf("\nResponse times of %ld replies, microseconds\n\n", n);
+	printf("%-12s%12s%12s%12s\n", "", "Capture", "Replay", "Difference");
+	printf("%-12s%12.0f%12.0f%+11.1f%%\n", "Average", csum / n, rsum / n,
+			csum > 0 ? (rsum - csum) * 100.0 / csum : 0.0);
+	for (i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++)
+	{
+		uint32_t	c = percentile(captured, n, pcts[i]);
+		uint32_t	r = percentile(replayed, n, pcts[i]);
+		char		label[16];
+
+		snprintf(label, sizeof(label), "p%g", pcts[i]);
+		printf("%-12s%12u%12u%+11.1f%%\n", label, c, r,
+			c > 0 ? ((double)r - c) * 100.0 / c : 0.0);
+	}
+	printf("%-12s%12u%12u\n", "Maximum", captured[n - 1], replayed[n - 1]);
+	free(captured);
+	free(replayed);
+}
@@ -0,0 +1,56 @@
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+#if !defined(LOG_BINARY_H)
+#define LOG_BINARY_H
+
+#include <stdint.h>
+
+/**
+ * @file log_binary.h - The records of a log file written in binary mode
+ *
+ * A log file in binary mode has the text header and footer of any log file,
+ * between them are records. Every record starts with LOG_BINARY_MAGIC, the
+ * record type and the 16 bit length of the body that follows, all in the
+ * byte order of the host that wrote the log.
+ *
+ * LOG_BINARY_FORMAT	uint32_t id, the format string, not terminated.
+ *			Written by the first write that uses the format, the
+ *			records of other threads may be before it in the file.
+ * LOG_BINARY_MESSAGE	uint32_t id of the format, int64_t seconds and
+ *			int32_t microseconds of the write, then the arguments
+ *			each as a LOG_ARG_ tag and the value.
+ * LOG_BINARY_TEXT	int64_t seconds and int32_t microseconds of the
+ *			write, the text of the log string, not terminated.
+ *			Used for strings with arguments that are not recorded.
+ */
+
+#define LOG_BINARY_MAGIC	0xb1
+#define LOG_BINARY_HDRLEN	4
+
+#define LOG_BINARY_FORMAT	'F'
+#define LOG_BINARY_MESSAGE	'M'
+#define LOG_BINARY_TEXT		'T'
+
+#define LOG_ARG_INT		'i'	/*< int32_t */
+#define LOG_ARG_LONG		'q'	/*< int64_t, any long or size type */
+#define LOG_ARG_DOUBLE		'd'	/*< double */
+#define LOG_ARG_LDOUBLE		'D'	/*< long double */
+#define LOG_ARG_POINTER		'p'	/*< uint64_t */
+#define LOG_ARG_STRING		's'	/*< uint16_t length, the bytes */
+
+#endif /* LOG_BINARY_H */
@@ -17,6 +17,8 @@
  */
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 
 #include <unistd.h>
@@ -26,16 +28,20 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <syslog.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
 
 #include <skygw_debug.h>
 #include <skygw_types.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
+#include <log_binary.h>
 
 #define MAX_PREFIXLEN 250
 #define MAX_SUFFIXLEN 250
 #define MAX_PATHLEN   512
-#define MAXNBLOCKBUFS 10
 
 /** for procname */
 #if !defined(_GNU_SOURCE)
@@ -58,6 +64,20 @@ int lm_enabled_logfiles_bitmask = 0;
  */
 #define MAX_LOGSTRLEN BUFSIZ
 
+/**
+ * Size of the log ring of a thread, it holds several log strings of the
+ * maximum length so that a thread seldom waits for the file writer.
+ */
+#define LOGRING_SIZE  (4*MAX_LOGSTRLEN)
+/** Number of log rings allocated at a time */
+#define BLOCKBUF_POOL_CHUNK 8
+
+/**
+ * Buffers gathered by file writer to one write, a log ring has at most two
+ * of them.
+ */
+#define FILEWRITER_MAXIOV 512
+
 #if defined(SS_PROF)
 /**
  * These counters may be inaccurate but give some idea of how
@@ -76,6 +96,12 @@ char* shmem_id_str     = NULL;
 /** Errors are written to syslog too by default */
 char* syslog_id_str    = strdup("LOGFILE_ERROR");
 char* syslog_ident_str = NULL;
+/** Logfile ids from call argument '-k', written in binary mode */
+char* binlog_id_str    = NULL;
+/** Timestamps of log strings have milliseconds, call argument '-t' */
+static bool lm_timestamp_ms = false;
+/** Dirty bytes of a log file before writeback, call argument '-w' */
+static size_t lm_writeback = 0;
 
 /**
  * Global log manager pointer and lock variable.
@@ -83,6 +109,37 @@ char* syslog_ident_str = NULL;
  */
 static int lmlock;
 static logmanager_t* lm;
+/** Incremented by each init, the log rings of an earlier logmanager are stale */
+static size_t lm_generation;
+
+/**
+ * Rate limit and sampling of the log strings of the LOGIF call sites.
+ * A site writes lp_burst strings in lp_interval seconds and after them one
+ * in lp_every, the rest are suppressed and counted. Before a log string is
+ * counted it is dropped at random if lp_drop is set.
+ */
+typedef struct logpolicy_st {
+        int      lp_burst;    /**< 0 for no limit */
+        int      lp_every;    /**< 0 for none after the burst */
+        int      lp_interval; /**< seconds */
+        uint32_t lp_drop;     /**< dropped if random is below, 0 for none */
+} logpolicy_t;
+
+/** Indexed by logfile id, only the error log is limited by default */
+static logpolicy_t lm_policy[LOGFILE_LAST+1] = {
+        {0, 0, 0, 0},
+        {LOG_RATELIMIT_BURST, LOG_RATELIMIT_EVERY, LOG_RATELIMIT_INTERVAL, 0},
+        {0, 0, 0, 0},
+        {0, 0, 0, 0},
+        {0, 0, 0, 0},
+        {0, 0, 0, 0},
+        {0, 0, 0, 0},
+        {0, 0, 0, 0},
+        {0, 0, 0, 0}
+};
+
+/** State of the random numbers of the sampling, per thread */
+static __thread uint32_t lm_sample_state;
 
 
 /** Writer thread structure */
@@ -105,27 +162,68 @@ struct filewriter_st {
 };
 
 /**
- * Log client's string is copied to block-sized log buffer, which is passed
- * to file writer thread.
+ * Log client's string is copied to the log ring of the client thread, from
+ * where file writer thread writes it to disk. A ring has one writer, the
+ * thread which owns it, and one reader, the file writer, so neither needs
+ * a lock. bb_head and bb_tail only grow, bb_head is moved by the owner
+ * after the string is in the ring, bb_tail by the file writer after the
+ * strings are on disk. A ring whose owner has exited is orphaned and it may
+ * be adopted by a new thread. The rings of a logfile are allocated from its
+ * pool and linked to its list by bb_node, they are freed with the logfile.
  */
 typedef struct blockbuf_st {
 #if defined(SS_DEBUG)
-        skygw_chk_t    bb_chk_top;
+        skygw_chk_t     bb_chk_top;
 #endif
-        logfile_id_t   bb_fileid;
-        bool           bb_isfull;   /**< closed for disk write */
-        simple_mutex_t bb_mutex;    /**< bb_buf_used, bb_isfull */
-        int            bb_refcount; /**< protected by list mutex. #of clients */
-//        int            bb_blankcount; /**< # of blanks used btw strings */
-        size_t         bb_buf_size;
-        size_t         bb_buf_left;
-        size_t         bb_buf_used;
-        char           bb_buf[MAX_LOGSTRLEN];
+        ilist_node_t    bb_node;    /**< link of lf_blockbuf_list */
+        logfile_id_t    bb_fileid;
+        volatile bool   bb_isfull;  /**< owner asks the file writer for a write */
+        volatile bool   bb_orphan;  /**< owner has exited, cleared by adopter */
+        size_t          bb_buf_size;
+        volatile size_t bb_head;    /**< end of the strings written to the ring */
+        volatile size_t bb_tail;    /**< end of the strings written to disk */
+        char            bb_buf[LOGRING_SIZE];
 #if defined(SS_DEBUG)
-        skygw_chk_t    bb_chk_tail;
+        skygw_chk_t     bb_chk_tail;
 #endif
 } blockbuf_t;
 
+/**
+ * The log rings of a thread, one for each logfile. The rings belong to the
+ * logmanager of lr_generation.
+ */
+typedef struct logrings_st {
+        size_t       lr_generation;
+        blockbuf_t*  lr_bb[LOGFILE_LAST+1];
+} logrings_t;
+
+static pthread_key_t  logrings_key;
+static pthread_once_t logrings_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Maximum number of format strings in a log file in binary mode, a
+ * power of 2, and the number of arguments a format may have. The log
+ * strings exceeding either are written as text records.
+ */
+#define LOGFMT_MAX     4096
+#define LOGFMT_MAXARGS 32
+
+/**
+ * A format string used by the writes to a log file in binary mode. The
+ * formats are kept in an open addressing table keyed by the address of
+ * the format string. A slot is claimed by compare and swap of fm_str and
+ * fm_ready is set when the slot is complete, the index of the slot is the
+ * id of the format in the log.
+ */
+typedef struct logfmt_st {
+        const char* volatile fm_str;   /**< format string, NULL if free */
+        volatile bool        fm_ready; /**< fm_args and fm_text are set */
+        bool                 fm_text;  /**< arguments can't be recorded */
+        char*                fm_copy;  /**< text of the format */
+        int                  fm_nargs;
+        char                 fm_args[LOGFMT_MAXARGS]; /**< LOG_ARG_ tags */
+} logfmt_t;
+
 /**
  * logfile object corresponds to physical file(s) where
  * certain log is written.
@@ -139,6 +237,8 @@ struct logfile_st {
         bool             lf_enabled;
         bool             lf_store_shmem;
         bool             lf_write_syslog;
+        bool             lf_binary; /**< records, see log_binary.h */
+        logfmt_t*        lf_fmts;   /**< formats of the records */
         logmanager_t*    lf_lmgr;
         /** fwr_logmes is for messages from log clients */
         skygw_message_t* lf_logmes;
@@ -152,8 +252,9 @@ struct logfile_st {
         char*            lf_full_link_name; /**< complete symlink name */
         int              lf_nfiles_max;
         size_t           lf_file_size;
-        /** list of block-sized log buffers */
-        mlist_t          lf_blockbuf_list;
+        /** list of the log rings of the client threads, never shrinks */
+        mpsc_list_t      lf_blockbuf_list;
+        skygw_pool_t     lf_blockbuf_pool;
         int              lf_buf_size;
         bool             lf_flushflag;
         int              lf_spinlock; /**< lf_flushflag */
@@ -222,7 +323,8 @@ static bool logfile_init(
         logfile_id_t   logfile_id,
         logmanager_t*  logmanager,
         bool           store_shmem,
-        bool           write_syslog);
+        bool           write_syslog,
+        bool           write_binary);
 static void logfile_done(logfile_t* logfile);
 static void logfile_free_memory(logfile_t* lf);
 static void logfile_flush(logfile_t* lf);
@@ -238,6 +340,14 @@ static void   fnames_conf_free_memory(fnames_conf_t* fn);
 static char*  fname_conf_get_prefix(fnames_conf_t* fn, logfile_id_t id);
 static char*  fname_conf_get_suffix(fnames_conf_t* fn, logfile_id_t id);
 static void*  thr_filewriter_fun(void* data);
+static void   filewriter_write_rings(
+        skygw_file_t* file,
+        struct iovec* iov,
+        int           niov,
+        blockbuf_t**  bbs,
+        size_t*       heads,
+        int           nbbs,
+        bool          flush);
 static logfile_t* logmanager_get_logfile(logmanager_t* lm, logfile_id_t id);
 static bool logmanager_register(bool writep);
 static void logmanager_unregister(void);
@@ -249,23 +359,29 @@ static int  logmanager_write_log(
         bool         use_valist,
         bool         spread_down,
         size_t       len,
-        char*        str,
+        const char*  str,
+        va_list      valist);
+static int  logmanager_write_binary(
+        logfile_t*   lf,
+        blockbuf_t*  bb,
+        bool         flush,
+        bool         use_valist,
+        const char*  str,
         va_list      valist);
+static bool      logfile_is_binary(logfile_id_t id);
+static logfmt_t* logfmt_get(logfile_t* lf, const char* str, bool* p_new);
+static void      logfmt_parse(logfmt_t* fmt, const char* str);
+static void      logfmt_add(logfmt_t* fmt, char tag);
 
 static blockbuf_t* blockbuf_init(logfile_id_t id);
-static void        blockbuf_node_done(void* bb_data);
-static char*       blockbuf_get_writepos(
-#if 0
-        int**        refcount,
-#else
-        blockbuf_t** p_bb,
-#endif
-        logfile_id_t id,
+static blockbuf_t* blockbuf_get_ring(logfile_id_t id);
+static void        blockbuf_write(
+        blockbuf_t*  bb,
+        char*        str,
         size_t       str_len,
         bool         flush);
-
-static void  blockbuf_register(blockbuf_t* bb);
-static void  blockbuf_unregister(blockbuf_t* bb);
+static void        logrings_key_init(void);
+static void        logrings_done(void* data);
 static bool  logfile_set_enabled(logfile_id_t id, bool val);
 static char* add_slash(char* str);
 static bool  file_exists_and_is_writable(char* filename, bool* writable);
@@ -334,6 +450,8 @@ static bool logmanager_init_nomutex(
         bool           succp = false;
 
         lm = (logmanager_t *)calloc(1, sizeof(logmanager_t));
+        /** Log rings of the threads are of the earlier logmanager */
+        lm_generation += 1;
 #if defined(SS_DEBUG)
         lm->lm_chk_top   = CHK_NUM_LOGMANAGER;
         lm->lm_chk_tail  = CHK_NUM_LOGMANAGER;
@@ -603,16 +721,15 @@ static int logmanager_write_log(
         bool          use_valist,
         bool          spread_down,
         size_t        str_len,
-        char*         str,
+        const char*   str,
         va_list       valist)
 {
         logfile_t*   lf;
         char*        wp;
         int          err = 0;
         blockbuf_t*  bb;
-        blockbuf_t*  bb_c;
         int          timestamp_len;
-        int          i;
+        char         logstr[MAX_LOGSTRLEN+1];
 
         CHK_LOGMANAGER(lm);
         
@@ -652,30 +769,52 @@ static int logmanager_write_log(
                 /** Length of string that will be written, limited by bufsize */
                 int safe_str_len; 
 
-                timestamp_len = get_timestamp_len();
-                safe_str_len = MIN(timestamp_len-1+str_len, lf->lf_buf_size);
                 /**
-                 * Seek write position and register to block buffer.
-                 * Then print formatted string to write position.
+                 * The log ring of this thread. The string is formatted
+                 * outside the ring as it may wrap around the ring's end.
                  */
-                wp = blockbuf_get_writepos(&bb,
-                                           id,
-                                           safe_str_len,
-                                           flush);
+                if ((bb = blockbuf_get_ring(id)) == NULL) {
+                        err = -1;
+                        goto return_err;
+                }
+                /** Neither timestamp nor string is formatted in binary mode */
+                if (lf->lf_binary)
+                {
+                        err = logmanager_write_binary(lf,
+                                                      bb,
+                                                      flush,
+                                                      use_valist,
+                                                      str,
+                                                      valist);
+                        goto return_err;
+                }
+                timestamp_len = (lm_timestamp_ms ?
+                                 get_timestamp_len_ms() :
+                                 get_timestamp_len());
+                safe_str_len = MIN(timestamp_len-1+str_len, lf->lf_buf_size);
+                wp = logstr;
                 /**
                  * Write timestamp with at most <timestamp_len> characters
                  * to wp.
                  * Returned timestamp_len doesn't include terminating null.
                  */
-                timestamp_len = snprint_timestamp(wp, timestamp_len);
+                timestamp_len = (lm_timestamp_ms ?
+                                 snprint_timestamp_ms(wp, timestamp_len) :
+                                 snprint_timestamp(wp, timestamp_len));
                 /**
                  * Write next string to overwrite terminating null character
                  * of the timestamp string.
                  */
                 if (use_valist) {
-                        vsnprintf(wp+timestamp_len, safe_str_len, str, valist);
+                        vsnprintf(wp+timestamp_len,
+                                  sizeof(logstr)-timestamp_len,
+                                  str,
+                                  valist);
                 } else {
-                        snprintf(wp+timestamp_len, safe_str_len, "%s", str);
+                        snprintf(wp+timestamp_len,
+                                 sizeof(logstr)-timestamp_len,
+                                 "%s",
+                                 str);
                 }
                 
                 /** write to syslog */
@@ -696,330 +835,587 @@ static int logmanager_write_log(
                 }
                 
                 /** remove double line feed */
-                if (wp[timestamp_len+str_len-2] == '\n') {
-                        wp[timestamp_len+str_len-2]=' ';
+                if (wp[safe_str_len-2] == '\n') {
+                        wp[safe_str_len-2]=' ';
                 }
-                wp[timestamp_len+str_len-1]='\n';
-                blockbuf_unregister(bb);
-
+                wp[safe_str_len-1]='\n';
                 /**
-                 * disable because cross-blockbuffer locking either causes deadlock
-                 * or run out of memory blocks.
+                 * Copy to the ring. spread_down, writing the string also to
+                 * the logs with larger id, is not done.
                  */
-                if (spread_down && false) {
-                        /**
-                         * Write to target log. If spread_down == true, then
-                         * write also to all logs with greater logfile id.
-                         * LOGFILE_ERROR   = 1,
-                         * LOGFILE_MESSAGE = 2,
-                         * LOGFILE_TRACE   = 4,
-                         * LOGFILE_DEBUG   = 8
-                         *
-                         * So everything written to error log will appear in
-                         * message, trace and debuglog. Messages will be
-                         * written in trace and debug log.
-                         */
-                        for (i=(id<<1); i<=LOGFILE_LAST; i<<=1)
-                        {
-                                /** pointer to write buffer of larger-id log */
-                                char* wp_c;
-                            
-                                /**< Check if particular log is enabled */
-                                if (!(lm->lm_enabled_logfiles & i))
-                                {
-                                        continue;
-                                }
-                                /**
-                                 * Seek write position and register to block
-                                 * buffer. Then print formatted string to
-                                 * write position.
-                                 */
-                                wp_c = blockbuf_get_writepos(
-                                        &bb_c,
-                                        (logfile_id_t)i,
-                                        timestamp_len-1+str_len,
-                                        flush);
-                                /**
-                                 * Copy original string from block buffer to
-                                 * other logs' block buffers.
-                                 */
-                                snprintf(wp_c, timestamp_len+str_len, "%s", wp);
-                            
-                                /** remove double line feed */
-                                if (wp_c[timestamp_len-1+str_len-2] == '\n')
-                                {
-                                        wp_c[timestamp_len-1+str_len-2]=' ';
-                                }
-                                wp_c[timestamp_len-1+str_len-1]='\n';
-                            
-                                /** lock-free unregistration, includes flush if
-                                 * bb_isfull */
-                                blockbuf_unregister(bb_c);
-                        }
-                } /* if (spread_down) */
+                blockbuf_write(bb, wp, safe_str_len, flush);
         }
         
 return_err:
         return err;
 }
 
-static void blockbuf_register(
-        blockbuf_t* bb)
+/**
+ * @node Writes a log string to a log file in binary mode.
+ *
+ * Parameters:
+ * @param lf - in, use
+ *          log file in binary mode
+ *
+ * @param bb - in, use
+ *          log ring of the calling thread
+ *
+ * @param flush - in, use
+ *          indicates whether log string must be written to disk immediately
+ *
+ * @param use_valist - in, use
+ *          str is a format and valist has its arguments
+ *
+ * @param str - in, use
+ *          string to be written to log
+ *
+ * @param valist - in, use
+ *          variable-length argument list for formatting the string
+ *
+ * @return 0
+ *
+ * @details The first write of a format writes the format record, the
+ * message record has the id of the format, the time of the write and the
+ * arguments as they are. Formatting is left to maxlogdecode. A string
+ * without arguments, or whose arguments can't be recorded, is written as
+ * a text record. See log_binary.h.
+ */
+static int logmanager_write_binary(
+        logfile_t*     lf,
+        blockbuf_t*    bb,
+        bool           flush,
+        bool           use_valist,
+        const char*    str,
+        va_list        valist)
 {
-        CHK_BLOCKBUF(bb);
-        ss_dassert(bb->bb_refcount >= 0);
-        atomic_add(&bb->bb_refcount, 1);
-}
+        char           rec[MAX_LOGSTRLEN];
+        char*          endp = rec+sizeof(rec);
+        char*          wp;
+        logfmt_t*      fmt = NULL;
+        bool           isnew = false;
+        struct timeval tv;
+        int64_t        sec;
+        int32_t        usec;
+        uint32_t       fmtid;
+        uint16_t       len;
+        int            i;
+
+        gettimeofday(&tv, NULL);
+        sec = tv.tv_sec;
+        usec = tv.tv_usec;
+
+        if (use_valist)
+        {
+                fmt = logfmt_get(lf, str, &isnew);
+        }
+        wp = rec+LOG_BINARY_HDRLEN;
 
+        if (fmt == NULL || fmt->fm_text)
+        {
+                int n;
 
-static void blockbuf_unregister(
-        blockbuf_t* bb)
-{
-        logfile_t* lf;
-        
-        CHK_BLOCKBUF(bb);
-        ss_dassert(bb->bb_refcount >= 1);
-        lf = &lm->lm_logfile[bb->bb_fileid];
-        CHK_LOGFILE(lf);
-        /**
-         * if this is the last client in a full buffer, send write request.
-         */
-        if (atomic_add(&bb->bb_refcount, -1) == 1 && bb->bb_isfull) {
-            skygw_message_send(lf->lf_logmes);
+                rec[1] = LOG_BINARY_TEXT;
+                memcpy(wp, &sec, sizeof(sec));
+                wp += sizeof(sec);
+                memcpy(wp, &usec, sizeof(usec));
+                wp += sizeof(usec);
+
+                if (use_valist) {
+                        n = vsnprintf(wp, endp-wp, str, valist);
+                } else {
+                        n = snprintf(wp, endp-wp, "%s", str);
+                }
+                /** The terminating null is not written */
+                if (n < 0) {
+                        n = 0;
+                } else if (n > endp-wp-1) {
+                        n = endp-wp-1;
+                }
+                wp += n;
+                goto write_rec;
         }
-        ss_dassert(bb->bb_refcount >= 0);
+        fmtid = (uint32_t)(fmt - lf->lf_fmts);
+
+        if (isnew)
+        {
+                size_t flen = strlen(fmt->fm_copy);
+
+                rec[0] = LOG_BINARY_MAGIC;
+                rec[1] = LOG_BINARY_FORMAT;
+                memcpy(wp, &fmtid, sizeof(fmtid));
+                wp += sizeof(fmtid);
+                memcpy(wp, fmt->fm_copy, flen);
+                wp += flen;
+                len = (uint16_t)(wp-rec-LOG_BINARY_HDRLEN);
+                memcpy(rec+2, &len, sizeof(len));
+                blockbuf_write(bb, rec, wp-rec, false);
+                wp = rec+LOG_BINARY_HDRLEN;
+        }
+        rec[1] = LOG_BINARY_MESSAGE;
+        memcpy(wp, &fmtid, sizeof(fmtid));
+        wp += sizeof(fmtid);
+        memcpy(wp, &sec, sizeof(sec));
+        wp += sizeof(sec);
+        memcpy(wp, &usec, sizeof(usec));
+        wp += sizeof(usec);
+
+        for (i=0; i<fmt->fm_nargs; i++)
+        {
+                *wp++ = fmt->fm_args[i];
+
+                switch (fmt->fm_args[i]) {
+                case LOG_ARG_INT:
+                {
+                        int32_t v = va_arg(valist, int);
+                        memcpy(wp, &v, sizeof(v));
+                        wp += sizeof(v);
+                        break;
+                }
+                case LOG_ARG_LONG:
+                {
+                        int64_t v = va_arg(valist, long long);
+                        memcpy(wp, &v, sizeof(v));
+                        wp += sizeof(v);
+                        break;
+                }
+                case LOG_ARG_DOUBLE:
+                {
+                        double v = va_arg(valist, double);
+                        memcpy(wp, &v, sizeof(v));
+                        wp += sizeof(v);
+                        break;
+                }
+                case LOG_ARG_LDOUBLE:
+                {
+                        long double v = va_arg(valist, long double);
+                        memcpy(wp, &v, sizeof(v));
+                        wp += sizeof(v);
+                        break;
+                }
+                case LOG_ARG_POINTER:
+                {
+                        uint64_t v = (uintptr_t)va_arg(valist, void*);
+                        memcpy(wp, &v, sizeof(v));
+                        wp += sizeof(v);
+                        break;
+                }
+                case LOG_ARG_STRING:
+                {
+                        const char* s = va_arg(valist, const char*);
+                        /** Room is left for the arguments after the string */
+                        size_t      room = endp-wp-sizeof(len)-
+                                (fmt->fm_nargs-i-1)*(1+sizeof(long double));
+                        uint16_t    slen;
+
+                        if (s == NULL) {
+                                s = "(null)";
+                        }
+                        slen = (uint16_t)strnlen(s, room);
+                        memcpy(wp, &slen, sizeof(slen));
+                        wp += sizeof(slen);
+                        memcpy(wp, s, slen);
+                        wp += slen;
+                        break;
+                }
+                default:
+                        ss_dassert(false);
+                        break;
+                }
+        }
+
+write_rec:
+        rec[0] = LOG_BINARY_MAGIC;
+        len = (uint16_t)(wp-rec-LOG_BINARY_HDRLEN);
+        memcpy(rec+2, &len, sizeof(len));
+        blockbuf_write(bb, rec, wp-rec, flush);
+        return 0;
 }
 
+/**
+ * @node Finds out whether log strings of a log file are formatted by the
+ * writer, that isn't necessary for a log file in binary mode.
+ */
+static bool logfile_is_binary(
+        logfile_id_t id)
+{
+        return (id >= LOGFILE_FIRST &&
+                id <= LOGFILE_LAST &&
+                lm->lm_logfile[id].lf_binary);
+}
 
-/** 
- * @node (write brief function description here) 
+/**
+ * @node Finds the format of a log string in binary mode, its index in
+ * lf_fmts is the id of the format.
  *
  * Parameters:
- * @param id - <usage>
- *          <description>
+ * @param lf - in, use
+ *          log file in binary mode
  *
- * @param str_len - <usage>
- *          <description>
+ * @param str - in, use
+ *          format string of the log string
  *
- * @return 
+ * @param p_new - out
+ *          set true if the format was added and its record isn't written
  *
- * 
- * @details List mutex now protects both the list and the contents of it.
- * TODO : It should be so that adding and removing nodes of the list is protected
- * by the list mutex. Buffer modifications should be protected by buffer
- * mutex.
+ * @return the format, NULL if the table is full
  *
+ * @details The format is found by its address, its text is compared as
+ * well since the same address may hold another format later, a buffer on
+ * stack or a module loaded to the place of an unloaded one, for example.
  */
-static char* blockbuf_get_writepos(
-        blockbuf_t** p_bb,
-        logfile_id_t id,
-        size_t       str_len,
-        bool         flush)
+static logfmt_t* logfmt_get(
+        logfile_t*  lf,
+        const char* str,
+        bool*       p_new)
 {
-        logfile_t*     lf;
-        mlist_t*       bb_list;
-        char*          pos = NULL;
-        mlist_node_t*  node;
-        blockbuf_t*    bb;
-        ss_debug(bool  succp;)
+        size_t      h = ((uintptr_t)str >> 3) & (LOGFMT_MAX-1);
+        logfmt_t*   fmt;
+        size_t      n;
 
-            
-        CHK_LOGMANAGER(lm);
-        lf = &lm->lm_logfile[id];
-        CHK_LOGFILE(lf);
-        bb_list = &lf->lf_blockbuf_list;
+        for (n = 0; n < LOGFMT_MAX; n++)
+        {
+                fmt = &lf->lf_fmts[(h+n) & (LOGFMT_MAX-1)];
 
-        /** Lock list */
-        simple_mutex_lock(&bb_list->mlist_mutex, true);
-        CHK_MLIST(bb_list);
+                if (fmt->fm_str == NULL &&
+                    __sync_bool_compare_and_swap(&fmt->fm_str,
+                                                 (const char*)NULL,
+                                                 str))
+                {
+                        logfmt_parse(fmt, str);
+                        __sync_synchronize();
+                        fmt->fm_ready = true;
+                        *p_new = true;
+                        return fmt;
+                }
 
-        if (bb_list->mlist_nodecount > 0) {
-            /**
-             * At least block buffer exists on the list. 
-             */
-            node = bb_list->mlist_first;
-            
-            /** Loop over blockbuf list to find write position */
-            while (true) {
-                CHK_MLIST_NODE(node);
+                if (fmt->fm_str == str)
+                {
+                        while (!fmt->fm_ready)
+                        {
+                                __sync_synchronize();
+                        }
+                        __sync_synchronize();
 
-                /** Unlock list */
-                simple_mutex_unlock(&bb_list->mlist_mutex);
-                
-                bb = (blockbuf_t *)node->mlnode_data;
-                CHK_BLOCKBUF(bb);
+                        if (fmt->fm_copy != NULL &&
+                            strcmp(fmt->fm_copy, str) == 0)
+                        {
+                                return fmt;
+                        }
+                }
+        }
+        return NULL;
+}
 
-                /** Lock buffer */
-                simple_mutex_lock(&bb->bb_mutex, true);
-                
-                if (bb->bb_isfull || bb->bb_buf_left < str_len) {
-                    /**
-                     * This block buffer is too full.
-                     * Send flush request to file writer thread. This causes
-                     * flushing all buffers, and (eventually) frees buffer space.
-                     */
-                    blockbuf_register(bb);
-                    bb->bb_isfull = true;
-                    blockbuf_unregister(bb);
-
-                    /** Unlock buffer */
-                    simple_mutex_unlock(&bb->bb_mutex);
-
-                    /** Lock list */
-                    simple_mutex_lock(&bb_list->mlist_mutex, true);
-                    
-                    /**
-                     * If next node exists move forward. Else check if there is
-                     * space for a new block buffer on the list.
-                     */
-                    if (node != bb_list->mlist_last) {
-                        node = node->mlnode_next;
+/**
+ * @node Finds out the types of the arguments of a format.
+ *
+ * @details Positional arguments, %n, %m, precision of a string and wide
+ * characters are not recorded, nor are the formats whose record would be
+ * too long. fm_text is set for them.
+ */
+static void logfmt_parse(
+        logfmt_t*   fmt,
+        const char* str)
+{
+        const char* p = str;
+        int         nlong;
+        bool        ldbl;
+        bool        prec;
+        char        tag;
+
+        fmt->fm_copy  = strdup(str);
+        fmt->fm_nargs = 0;
+        fmt->fm_text  = (fmt->fm_copy == NULL ||
+                         strlen(str) > MAX_LOGSTRLEN/2);
+
+        while (*p != '\0' && !fmt->fm_text)
+        {
+                if (*p++ != '%') {
                         continue;
-                    }
-                    /**
-                     * All buffers on the list are full.
-                     */
-                    if (bb_list->mlist_nodecount <
-                        bb_list->mlist_nodecount_max)
-                    {
-                        /**
-                         * New node is created
-                         */
-                        bb = blockbuf_init(id);
-                        CHK_BLOCKBUF(bb);
+                }
+                if (*p == '%') {
+                        p += 1;
+                        continue;
+                }
+                while (*p != '\0' && strchr("-+ #0", *p) != NULL) {
+                        p += 1;
+                }
+                if (*p == '*') {
+                        logfmt_add(fmt, LOG_ARG_INT);
+                        p += 1;
+                }
+                while (*p >= '0' && *p <= '9') {
+                        p += 1;
+                }
+                prec = false;
 
-                        /**
-                         * Increase version to odd to mark list update active
-                         * update.
-                         */
-                        bb_list->mlist_versno += 1;
-                        ss_dassert(bb_list->mlist_versno%2 == 1);
-                        
-                        ss_debug(succp =)
-                            mlist_add_data_nomutex(bb_list, bb);
-                        ss_dassert(succp);
+                if (*p == '.') {
+                        prec = true;
+                        p += 1;
 
-                        /**
-                         * Increase version to even to mark completion of update.
-                         */
-                        bb_list->mlist_versno += 1;
-                        ss_dassert(bb_list->mlist_versno%2 == 0);
-                    } else {
-                        /**
-                         * List and buffers are full.
-                         * Reset to the beginning of the list, and wait until
-                         * there is a block buffer with enough space.
-                         */
-                        simple_mutex_unlock(&bb_list->mlist_mutex);
-                        simple_mutex_lock(&bb_list->mlist_mutex, true);
+                        if (*p == '*') {
+                                logfmt_add(fmt, LOG_ARG_INT);
+                                p += 1;
+                        }
+                        while (*p >= '0' && *p <= '9') {
+                                p += 1;
+                        }
+                }
+                nlong = 0;
+                ldbl = false;
+
+                while (*p != '\0' && strchr("hlLqjzt", *p) != NULL) {
+                        if (*p == 'L') {
+                                ldbl = true;
+                        } else if (*p != 'h') {
+                                nlong += 1;
+                        }
+                        p += 1;
+                }
 
-                        node = bb_list->mlist_first;
-                        continue;
-                    }
+                switch (*p) {
+                case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+                        tag = (nlong > 0 ? LOG_ARG_LONG : LOG_ARG_INT);
+                        break;
+                case 'c':
+                        tag = (nlong > 0 ? 0 : LOG_ARG_INT);
+                        break;
+                case 's':
+                        tag = (nlong > 0 || prec ? 0 : LOG_ARG_STRING);
+                        break;
+                case 'p':
+                        tag = LOG_ARG_POINTER;
+                        break;
+                case 'e': case 'E': case 'f': case 'F':
+                case 'g': case 'G': case 'a': case 'A':
+                        tag = (ldbl ? LOG_ARG_LDOUBLE : LOG_ARG_DOUBLE);
+                        break;
+                default:
+                        tag = 0;
+                        break;
+                }
+
+                if (tag == 0) {
+                        fmt->fm_text = true;
                 } else {
-                    /**
-                     * There is space for new log string.
-                     */
-                    break;
+                        logfmt_add(fmt, tag);
+                        p += 1;
                 }
-            } /** while (true) */
+        }
+}
+
+static void logfmt_add(
+        logfmt_t* fmt,
+        char      tag)
+{
+        if (fmt->fm_nargs == LOGFMT_MAXARGS) {
+                fmt->fm_text = true;
         } else {
-            /**
-             * Create the first block buffer to logfile's blockbuf list.
-             */
-            bb = blockbuf_init(id);
-            CHK_BLOCKBUF(bb);
+                fmt->fm_args[fmt->fm_nargs++] = tag;
+        }
+}
 
-            /** Lock buffer */
-            simple_mutex_lock(&bb->bb_mutex, true);
-            /**
-             * Increase version to odd to mark list update active update.
-             */
-            bb_list->mlist_versno += 1;
-            ss_dassert(bb_list->mlist_versno%2 == 1);
+/** 
+ * @node Creates the key of the log rings of the threads.
+ */
+static void logrings_key_init(void)
+{
+        pthread_key_create(&logrings_key, logrings_done);
+}
 
-            ss_debug(succp =)mlist_add_data_nomutex(bb_list, bb);
-            ss_dassert(succp);
+/** 
+ * @node Releases the log rings of an exiting thread. 
+ *
+ * Parameters:
+ * @param data - in, take
+ *          log rings of the thread
+ *
+ * @return void
+ *
+ * 
+ * @details The rings stay on the blockbuf lists where the file writer
+ * writes what is left in them. They are marked orphans so that the threads
+ * started later use them, instead of adding rings to the lists. Rings of
+ * an earlier logmanager have been freed already. The lmlock keeps the
+ * logmanager from being freed meanwhile, the lists are not locked.
+ *
+ */
+static void logrings_done(
+        void* data)
+{
+        logrings_t* lr = (logrings_t *)data;
+        blockbuf_t* bb;
+        int         i;
 
-            /**
-             * Increase version to even to mark completion of update.
-             */
-            bb_list->mlist_versno += 1;
-            ss_dassert(bb_list->mlist_versno%2 == 0);
-            
-            /** Unlock list */
-            simple_mutex_unlock(&bb_list->mlist_mutex);
-        } /* if (bb_list->mlist_nodecount > 0) */
-        
-        ss_dassert(pos == NULL);
-        ss_dassert(!(bb->bb_isfull || bb->bb_buf_left < str_len));
-        ss_dassert(bb_list->mlist_nodecount <= bb_list->mlist_nodecount_max);
+        acquire_lock(&lmlock);
 
-        /**
-         * Registration to blockbuf adds reference for the write operation.
-         * It indicates that client has allocated space from the buffer,
-         * but not written yet. As long as refcount > 0 buffer can't be
-         * written to disk.
-         */
-        blockbuf_register(bb);
-        *p_bb = bb;
-        /**
-         * At this point list mutex is held and bb points to a node with
-         * enough space available. pos is not yet set.
-         */
-        pos = &bb->bb_buf[bb->bb_buf_used];
-        bb->bb_buf_used += str_len;
-        bb->bb_buf_left -= str_len;
-        
-        ss_dassert(pos >= &bb->bb_buf[0] &&
-                   pos <= &bb->bb_buf[MAX_LOGSTRLEN-str_len]);
-        
-        /** read checkmark */
-        /** TODO: add buffer overflow checkmark
-        chk_val = (int)bb->bb_buf[bb->bb_buf_used-count_len];
-        ss_dassert(chk_val == bb->bb_strcount);
-        */
-        
-        /** TODO : write next checkmark
-        bb->bb_strcount += 1;
-        memcpy(&bb->bb_buf[bb->bb_buf_used], &bb->bb_strcount, count_len);
-        bb->bb_buf_used += count_len;
-        bb->bb_buf_left -= count_len;
-        */
-        
-        /**
-         * If flush flag is set, set buffer full. As a consequence, no-one
-         * can write to it before it is flushed to disk.
-         */
-        bb->bb_isfull = (flush == true ? true : bb->bb_isfull);
-        
-        /** Unlock buffer */
-        simple_mutex_unlock(&bb->bb_mutex);
-        return pos;
+        if (lm != NULL && lr->lr_generation == lm_generation) {
+                for (i=LOGFILE_FIRST; i<=LOGFILE_LAST; i <<= 1) {
+                        if ((bb = lr->lr_bb[i]) == NULL) {
+                                continue;
+                        }
+                        CHK_BLOCKBUF(bb);
+                        /** The last string is in the ring before adoption */
+                        __sync_synchronize();
+                        bb->bb_orphan = true;
+                }
+        }
+        release_lock(&lmlock);
+        free(lr);
 }
 
-static void blockbuf_node_done(
-        void* bb_data)
+/** 
+ * @node Finds the log ring of the calling thread for a logfile. 
+ *
+ * Parameters:
+ * @param id - in, use
+ *          logfile object identifier
+ *
+ * @return pointer to the ring, NULL if there's no memory for it
+ *
+ * 
+ * @details The first write of the thread to the logfile adopts an orphaned
+ * ring, claiming it with compare and swap, or pushes a new ring to the
+ * list. Neither takes a lock. Later writes find the ring from
+ * thread-specific data.
+ *
+ */
+static blockbuf_t* blockbuf_get_ring(
+        logfile_id_t id)
 {
-        blockbuf_t* bb = (blockbuf_t *)bb_data;
-        simple_mutex_done(&bb->bb_mutex);
+        logrings_t*    lr;
+        logfile_t*     lf;
+        ilist_node_t*  node;
+        blockbuf_t*    bb = NULL;
+
+        pthread_once(&logrings_once, logrings_key_init);
+
+        if ((lr = (logrings_t *)pthread_getspecific(logrings_key)) == NULL) {
+                if ((lr = (logrings_t *)calloc(1, sizeof(logrings_t))) == NULL) {
+                        return NULL;
+                }
+                pthread_setspecific(logrings_key, lr);
+        }
+
+        if (lr->lr_generation != lm_generation) {
+                memset(lr->lr_bb, 0, sizeof(lr->lr_bb));
+                lr->lr_generation = lm_generation;
+        }
+
+        if ((bb = lr->lr_bb[id]) != NULL) {
+                return bb;
+        }
+        CHK_LOGMANAGER(lm);
+        lf = &lm->lm_logfile[id];
+        CHK_LOGFILE(lf);
+
+        for (node = mpsc_list_first(&lf->lf_blockbuf_list);
+             node != NULL;
+             node = node->iln_next)
+        {
+                bb = ILIST_ENTRY(node, blockbuf_t, bb_node);
+                CHK_BLOCKBUF(bb);
+
+                if (bb->bb_orphan &&
+                    __sync_bool_compare_and_swap(&bb->bb_orphan, true, false))
+                {
+                        break;
+                }
+                bb = NULL;
+        }
+
+        if (bb == NULL && (bb = blockbuf_init(id)) != NULL) {
+                mpsc_list_push(&lf->lf_blockbuf_list, &bb->bb_node);
+        }
+        lr->lr_bb[id] = bb;
+        return bb;
 }
 
+/** 
+ * @node Copies a log string to the log ring of the calling thread. 
+ *
+ * Parameters:
+ * @param bb - in, use
+ *          the log ring of the thread
+ *
+ * @param str - in, use
+ *          the log string with its timestamp and line feed
+ *
+ * @param str_len - in, use
+ *          length of the string, at most the size of the ring
+ *
+ * @param flush - in, use
+ *          indicates whether log string must be written to disk immediately
+ *
+ * @return void
+ *
+ * 
+ * @details Only the owner thread moves bb_head, so the write is a copy
+ * and a move of the head after it. The file writer is asked for a write
+ * when the ring is half full, and when there is no space the thread waits
+ * until the file writer has made some.
+ *
+ */
+static void blockbuf_write(
+        blockbuf_t* bb,
+        char*       str,
+        size_t      str_len,
+        bool        flush)
+{
+        logfile_t* lf;
+        size_t     pos;
+        size_t     n;
+
+        CHK_BLOCKBUF(bb);
+        ss_dassert(str_len <= bb->bb_buf_size);
+        lf = &lm->lm_logfile[bb->bb_fileid];
+        CHK_LOGFILE(lf);
+
+        while (bb->bb_buf_size - (bb->bb_head - bb->bb_tail) < str_len) {
+                bb->bb_isfull = true;
+                skygw_message_send(lf->lf_logmes);
+                sched_yield();
+        }
+        /** The space is not reused before the file writer has read it */
+        __sync_synchronize();
+
+        pos = bb->bb_head % bb->bb_buf_size;
+        n = MIN(str_len, bb->bb_buf_size - pos);
+        memcpy(&bb->bb_buf[pos], str, n);
+
+        if (n < str_len) {
+                memcpy(bb->bb_buf, str + n, str_len - n);
+        }
+        /** The string is in the ring before the head is moved over it */
+        __sync_synchronize();
+        bb->bb_head += str_len;
+
+        if (flush) {
+                logfile_flush(lf); /**< here we wake up file writer */
+        } else if (!bb->bb_isfull &&
+                   bb->bb_head - bb->bb_tail >= bb->bb_buf_size/2)
+        {
+                bb->bb_isfull = true;
+                skygw_message_send(lf->lf_logmes);
+        }
+}
 
 static blockbuf_t* blockbuf_init(
         logfile_id_t id)
 {
         blockbuf_t* bb;
 
-        bb = (blockbuf_t *)calloc(1, sizeof(blockbuf_t));
+        bb = (blockbuf_t *)skygw_pool_alloc(&lm->lm_logfile[id].lf_blockbuf_pool);
+
+        if (bb == NULL) {
+                return NULL;
+        }
         bb->bb_fileid = id;
 #if defined(SS_DEBUG)
         bb->bb_chk_top = CHK_NUM_BLOCKBUF;
         bb->bb_chk_tail = CHK_NUM_BLOCKBUF;
 #endif
-        simple_mutex_init(&bb->bb_mutex, "Blockbuf mutex");
-        bb->bb_buf_left = MAX_LOGSTRLEN;
-        bb->bb_buf_size = MAX_LOGSTRLEN;
+        bb->bb_buf_size = LOGRING_SIZE;
 
         CHK_BLOCKBUF(bb);
         return bb;
@@ -1077,6 +1473,164 @@ return_err:
         return err;
 }
 
+/**
+ * @node Finds out whether LOGIF of a call site writes.
+ *
+ * Parameters:
+ * @param id - in, use
+ *          logfile id of the LOGIF
+ *
+ * @param site - in, use
+ *          state of the call site
+ *
+ * @param file - in, use
+ *          source file of the call site
+ *
+ * @param line - in, use
+ *          line of the call site
+ *
+ * @return true if the log string of the site is to be written
+ *
+ * @details Log strings are sampled first, then the site is rate limited.
+ * The count of suppressed strings is written when the site next writes,
+ * either the one in lp_every or the first string of a new interval. The
+ * counters are shared by the threads and updated without a lock, so they
+ * may be off by a few.
+ */
+bool skygw_log_site_check(
+        logfile_id_t id,
+        log_site_t*  site,
+        const char*  file,
+        int          line)
+{
+        logpolicy_t* p;
+        long         now;
+        long         start;
+        int          n;
+        int          nsuppressed = 0;
+
+        if (id < LOGFILE_FIRST || id > LOGFILE_LAST) {
+                return true;
+        }
+        p = &lm_policy[id];
+
+        if (p->lp_drop != 0)
+        {
+                uint32_t x = lm_sample_state;
+
+                if (x == 0) {
+                        x = (uint32_t)(uintptr_t)&x ^ (uint32_t)time(NULL);
+                        x = (x == 0 ? 1 : x);
+                }
+                /** xorshift */
+                x ^= x << 13;
+                x ^= x >> 17;
+                x ^= x << 5;
+                lm_sample_state = x;
+
+                if (x < p->lp_drop) {
+                        return false;
+                }
+        }
+
+        if (p->lp_burst <= 0) {
+                return true;
+        }
+        now = (long)time(NULL);
+        start = site->ls_start;
+
+        if (now - start >= p->lp_interval &&
+            __sync_bool_compare_and_swap(&site->ls_start, start, now))
+        {
+                site->ls_nseen = 0;
+                nsuppressed = __sync_lock_test_and_set(&site->ls_nsuppressed, 0);
+        }
+        n = __sync_add_and_fetch(&site->ls_nseen, 1);
+
+        if (n > p->lp_burst &&
+            (p->lp_every <= 0 || (n - p->lp_burst) % p->lp_every != 0))
+        {
+                __sync_add_and_fetch(&site->ls_nsuppressed, 1);
+                return false;
+        }
+
+        if (n > p->lp_burst) {
+                nsuppressed += __sync_lock_test_and_set(&site->ls_nsuppressed,
+                                                        0);
+        }
+
+        if (nsuppressed > 0)
+        {
+                skygw_log_write(id,
+                                "Suppressed %d similar log messages from %s:%d.",
+                                nsuppressed,
+                                file,
+                                line);
+        }
+        return true;
+}
+
+/**
+ * @node Sets the rate limit of the LOGIF call sites of a log file.
+ *
+ * Parameters:
+ * @param id - in, use
+ *          logfile id
+ *
+ * @param burst - in, use
+ *          log strings a site writes in an interval, 0 for no limit
+ *
+ * @param every - in, use
+ *          after the burst one in every is written, 0 for none
+ *
+ * @param interval - in, use
+ *          length of the interval in seconds
+ *
+ * @return 0 if succeed, -1 for an invalid argument
+ */
+int skygw_log_set_ratelimit(
+        logfile_id_t id,
+        int          burst,
+        int          every,
+        int          interval)
+{
+        if (id < LOGFILE_FIRST || id > LOGFILE_LAST ||
+            burst < 0 || every < 0 || interval <= 0)
+        {
+                return -1;
+        }
+        lm_policy[id].lp_every = every;
+        lm_policy[id].lp_interval = interval;
+        lm_policy[id].lp_burst = burst;
+        return 0;
+}
+
+/**
+ * @node Sets the share of the log strings of the LOGIF call sites of a log
+ * file that are written.
+ *
+ * Parameters:
+ * @param id - in, use
+ *          logfile id
+ *
+ * @param fraction - in, use
+ *          share of the log strings written at random, 1.0 for all
+ *
+ * @return 0 if succeed, -1 for an invalid argument
+ */
+int skygw_log_set_sampling(
+        logfile_id_t id,
+        double       fraction)
+{
+        if (id < LOGFILE_FIRST || id > LOGFILE_LAST ||
+            fraction < 0.0 || fraction > 1.0)
+        {
+                return -1;
+        }
+        lm_policy[id].lp_drop = (uint32_t)((1.0 - fraction) * 4294967295.0);
+        return 0;
+}
+
 
 static bool logfile_set_enabled(
         logfile_id_t id,
@@ -1146,7 +1700,7 @@ return_succp:
 
 int skygw_log_write_flush(
         logfile_id_t  id,
-        char*         str,
+        const char*   str,
         ...)
 {
         int     err = 0;
@@ -1168,11 +1722,16 @@ int skygw_log_write_flush(
             goto return_unregister;
         }
         /**
-         * Find out the length of log string (to be formatted str).
+         * Find out the length of log string (to be formatted str), it
+         * isn't formatted in binary mode.
          */
-        va_start(valist, str);
-        len = vsnprintf(NULL, 0, str, valist);
-        va_end(valist);
+        if (logfile_is_binary(id)) {
+                len = 0;
+        } else {
+                va_start(valist, str);
+                len = vsnprintf(NULL, 0, str, valist);
+                va_end(valist);
+        }
         /**
          * Add one for line feed.
          */
@@ -1199,7 +1758,7 @@ return_err:
 
 int skygw_log_write(
         logfile_id_t  id,
-        char*         str,
+        const char*   str,
         ...)
 {
         int     err = 0;
@@ -1221,11 +1780,16 @@ int skygw_log_write(
                 goto return_unregister;
         }
         /**
-         * Find out the length of log string (to be formatted str).
+         * Find out the length of log string (to be formatted str), it
+         * isn't formatted in binary mode.
          */
-        va_start(valist, str);
-        len = vsnprintf(NULL, 0, str, valist);
-        va_end(valist);
+        if (logfile_is_binary(id)) {
+                len = 0;
+        } else {
+                va_start(valist, str);
+                len = vsnprintf(NULL, 0, str, valist);
+                va_end(valist);
+        }
         /**
          * Add one for line feed.
          */
@@ -1395,9 +1959,12 @@ static bool fnames_conf_init(
                 "-g <error prefix>   ............(\"skygw_err\")\n"
                 "-i <error suffix>   ............(\".log\")\n"
                 "-j <log path>       ............(\"/tmp\")\n"
+                "-k <binary log file ids> .......(no default)\n"
                 "-l <syslog log file ids> .......(no default)\n"
                 "-m <syslog ident>   ............(argv[0])\n"
-                "-s <shmem log file ids>  .......(no default)\n";
+                "-s <shmem log file ids>  .......(no default)\n"
+                "-t - milliseconds in timestamps (no)\n"
+                "-w <writeback KB>   ............(0, fsync every 10 writes)\n";
 
         /**
          * When init_started is set, clean must be done for it.
@@ -1408,7 +1975,7 @@ static bool fnames_conf_init(
         fn->fn_chk_tail = CHK_NUM_FNAMES;
 #endif
         optind = 1; /**<! reset getopt index */
-        while ((opt = getopt(argc, argv, "+a:b:c:d:e:f:g:h:i:j:l:m:s:")) != -1)
+        while ((opt = getopt(argc, argv, "+a:b:c:d:e:f:g:h:i:j:k:l:m:s:tw:")) != -1)
         {
                 switch (opt) {
                 case 'a':
@@ -1446,6 +2013,14 @@ static bool fnames_conf_init(
                         fn->fn_logpath = strndup(optarg, MAX_PATHLEN);
                         break;
 
+                case 'k':
+                        /**
+                         * record list of log file ids written in binary
+                         * mode, only trace and debug log may be.
+                         */
+                        binlog_id_str = optarg;
+                        break;
+
                 case 'l':
                         /** record list of log file ids for syslogged */
                         if (syslog_id_str != NULL)
@@ -1467,6 +2042,15 @@ static bool fnames_conf_init(
                         /** record list of log file ids for later use */
                         shmem_id_str = optarg;
                         break;
+
+                case 't':
+                        lm_timestamp_ms = true;
+                        break;
+
+                case 'w':
+                        /** bound of dirty data in kilobytes */
+                        lm_writeback = strtoul(optarg, NULL, 10)*1024;
+                        break;
                 case 'h':
                 default:
                         fprintf(stderr,
@@ -1625,6 +2209,7 @@ static bool logfiles_init(
         int   i     = 0;
         bool  store_shmem;
         bool  write_syslog;
+        bool  write_binary;
 
         if (syslog_id_str != NULL)
         {
@@ -1661,11 +2246,34 @@ static bool logfiles_init(
                 {
                         write_syslog = false;
                 }
+                /**
+                 * Check if file is written in binary mode. Error and
+                 * message logs are always text, they are read by people.
+                 */
+                write_binary = false;
+
+                if (binlog_id_str != NULL &&
+                    strcasestr(binlog_id_str,
+                               STRLOGID(logfile_id_t(lid))) != NULL)
+                {
+                        if (lid == LOGFILE_TRACE || lid == LOGFILE_DEBUG)
+                        {
+                                write_binary = true;
+                        }
+                        else
+                        {
+                                fprintf(stderr,
+                                        "Warning : %s can't be written in "
+                                        "binary mode.\n",
+                                        STRLOGID(logfile_id_t(lid)));
+                        }
+                }
                 succp = logfile_init(&lm->lm_logfile[lid],
                                      (logfile_id_t)lid,
                                      lm,
                                      store_shmem,
-                                     write_syslog);
+                                     write_syslog,
+                                     write_binary);
                
                 if (!succp) {
                         fprintf(stderr, "Initializing logfiles failed\n");
@@ -1924,7 +2532,8 @@ static bool logfile_init(
         logfile_id_t   logfile_id,
         logmanager_t*  logmanager,
         bool           store_shmem,
-        bool           write_syslog)
+        bool           write_syslog,
+        bool           write_binary)
 {
         bool           succp = false;
         fnames_conf_t* fn = &logmanager->lm_fnames_conf;
@@ -1950,6 +2559,8 @@ static bool logfile_init(
         logfile->lf_spinlock = 0;
         logfile->lf_store_shmem = store_shmem;
         logfile->lf_write_syslog = write_syslog;
+        logfile->lf_binary = write_binary;
+        logfile->lf_fmts = NULL;
         logfile->lf_buf_size = MAX_LOGSTRLEN;
         logfile->lf_enabled = logmanager->lm_enabled_logfiles & logfile_id;
         /**
@@ -2062,18 +2673,19 @@ static bool logfile_init(
          * Create a block buffer list for log file. Clients' writes go to buffers
          * from where separate log flusher thread writes them to disk.
          */
-        if (mlist_init(&logfile->lf_blockbuf_list,
-                       NULL,
-                       strdup("logfile block buffer list"),
-                       blockbuf_node_done,
-                       MAXNBLOCKBUFS) == NULL)
+        if (write_binary &&
+            (logfile->lf_fmts = (logfmt_t *)calloc(LOGFMT_MAX,
+                                                   sizeof(logfmt_t))) == NULL)
         {
                 ss_dfprintf(stderr,
-                            "Initializing logfile blockbuf list "
-                            "failed\n");
+                            "Allocating logfile format table failed\n");
                 logfile_free_memory(logfile);
                 goto return_with_succp;
         }
+        mpsc_list_init(&logfile->lf_blockbuf_list);
+        skygw_pool_init(&logfile->lf_blockbuf_pool,
+                        sizeof(blockbuf_t),
+                        BLOCKBUF_POOL_CHUNK);
         succp = true;
         logfile->lf_state = RUN;
         CHK_LOGFILE(logfile);
@@ -2114,7 +2726,7 @@ static void logfile_done(
                 CHK_LOGFILE(lf);
                 ss_dassert(lf->lf_npending_writes == 0);
             case INIT:
-                mlist_done(&lf->lf_blockbuf_list);
+                skygw_pool_done(&lf->lf_blockbuf_pool);
                 logfile_free_memory(lf);
                 lf->lf_state = DONE;
             case DONE:
@@ -2133,6 +2745,21 @@ static void logfile_free_memory(
         if (lf->lf_name_suffix != NULL)    free(lf->lf_name_suffix);
         if (lf->lf_full_link_name != NULL) free(lf->lf_full_link_name);
         if (lf->lf_full_file_name != NULL) free(lf->lf_full_file_name);
+
+        if (lf->lf_fmts != NULL)
+        {
+                int i;
+
+                for (i = 0; i < LOGFMT_MAX; i++)
+                {
+                        if (lf->lf_fmts[i].fm_copy != NULL)
+                        {
+                                free(lf->lf_fmts[i].fm_copy);
+                        }
+                }
+                free(lf->lf_fmts);
+                lf->lf_fmts = NULL;
+        }
 }
 
 /** 
@@ -2196,6 +2823,8 @@ static bool filewriter_init(
                 if (fw->fwr_file[id] == NULL) {
                         goto return_succp;
                 }
+                skygw_file_set_writeback(fw->fwr_file[id], lm_writeback);
+
                 if (lf->lf_enabled) {
                         start_msg_str = strdup("---\tLogging is enabled.\n");
                 } else {
@@ -2253,31 +2882,30 @@ static void filewriter_done(
  * @return 
  *
  * 
- * @details Waits until receives wake-up message. Scans through block buffer
- * lists of each logfile object.
+ * @details Waits until receives wake-up message. Scans through the log rings
+ * of each logfile object.
  *
- * Block buffer is written to log file if
+ * The strings of a log ring are written to log file if
  * 1. bb_isfull == true,
  * 2. logfile object's lf_flushflag == true, or
  * 3. skygw_thread_must_exit returns true.
  * 
+ * The strings of all the rings of a log file are written with one writev.
  * Log file is flushed (fsync'd) in cases #2 and #3.
  *
- * Concurrency control : block buffer is accessed by file writer (this) and
- * log clients. File writer reads and sets each logfile object's flushflag
- * with spinlock. Another protected section is when block buffer's metadata is
- * read, and optionally the write operation.
- *
- * When block buffer is marked full, logfile's flushflag is set, other
- * log clients don't try to access buffer(s). There may, however, be
- * active writes, on the block in parallel with file writer operations.
- * Each active write corresponds to bb_refcounter values.
- * On the other hand, file writer doesn't process the block buffer before
- * its refcount is zero.
- *
- * Every log file obj. has its own block buffer (linked) list.
- * List is accessed by log clients, which add nodes if necessary, and
- * by file writer which traverses the list and accesses block buffers
+ * Concurrency control : a log ring is written by the client thread that
+ * owns it and read by file writer (this), without locks. The owner copies
+ * a string to the ring and then moves bb_head, file writer writes the
+ * strings up to bb_head to disk and then moves bb_tail. File writer reads
+ * and sets each logfile object's flushflag with spinlock.
+ *
+ * The strings of one thread are in order in the log file, the strings of
+ * different threads are ordered by the rings they are in and by the time
+ * they are written to disk. Their order can be found from the timestamps.
+ *
+ * Every log file obj. has its own log ring (linked) list.
+ * List is accessed by log clients, which add nodes on their first write,
+ * and by file writer which traverses the list and accesses the rings
  * included in list nodes.
  * List modifications are protected with version numbers.
  * Before modification, version is increased by one to be odd. After the
@@ -2293,15 +2921,21 @@ static void* thr_filewriter_fun(
         skygw_file_t*   file;
         logfile_t*      lf;
             
-        mlist_t*      bb_list;
         blockbuf_t*   bb;
-        mlist_node_t* node;
+        ilist_node_t* node;
         int           i;
         bool          flush_blockbuf;   /**< flush single block buffer. */
         bool          flush_logfile;    /**< flush logfile */
         bool          flushall_logfiles;/**< flush all logfiles */
-        size_t        vn1;
-        size_t        vn2;
+        size_t        head;
+        size_t        tail;
+        size_t        pos;
+        size_t        n;
+        struct iovec  iov[FILEWRITER_MAXIOV];
+        blockbuf_t*   bbs[FILEWRITER_MAXIOV];
+        size_t        heads[FILEWRITER_MAXIOV];
+        int           niov;
+        int           nbbs;
 
         thr = (skygw_thread_t *)data;
         fwr = (filewriter_t *)skygw_thread_get_data(thr);
@@ -2338,70 +2972,95 @@ static void* thr_filewriter_fun(
                         release_lock(&lf->lf_spinlock);
                 
                         /**
-                         * get logfile's block buffer list
+                         * Rings pushed to the list later are written by
+                         * the next round.
                          */
-                        bb_list = &lf->lf_blockbuf_list;
-#if defined(SS_DEBUG)
-                        simple_mutex_lock(&bb_list->mlist_mutex, true);
-                        CHK_MLIST(bb_list);
-                        simple_mutex_unlock(&bb_list->mlist_mutex);
-#endif
-                        node = bb_list->mlist_first;
+                        node = mpsc_list_first(&lf->lf_blockbuf_list);
+                        niov = nbbs = 0;
                 
                         while (node != NULL) {
-                                CHK_MLIST_NODE(node);
-                                bb = (blockbuf_t *)node->mlnode_data;
+                                bb = ILIST_ENTRY(node, blockbuf_t, bb_node);
                                 CHK_BLOCKBUF(bb);
 
-                                /** Lock block buffer */
-                                simple_mutex_lock(&bb->bb_mutex, true);
-
                                 flush_blockbuf = bb->bb_isfull;
                     
-                                if (bb->bb_buf_used != 0 &&
-                                    (flush_blockbuf ||
-                                     flush_logfile ||
-                                     flushall_logfiles))
+                                if (flush_blockbuf ||
+                                    flush_logfile ||
+                                    flushall_logfiles)
                                 {
                                         /**
-                                         * buffer is at least half-full
-                                         * -> write to disk
+                                         * Reset the request before reading
+                                         * the head so that a later request
+                                         * isn't lost.
+                                         */
+                                        bb->bb_isfull = false;
+                                        __sync_synchronize();
+                                        head = bb->bb_head;
+                                        tail = bb->bb_tail;
+                                        /**
+                                         * The strings up to head are in
+                                         * the ring.
                                          */
-                                        while(bb->bb_refcount > 0) {
-                                                simple_mutex_unlock(
-                                                        &bb->bb_mutex);
-                                                simple_mutex_lock(
-                                                        &bb->bb_mutex,
-                                                        true);
+                                        __sync_synchronize();
+                                }
+                                else
+                                {
+                                        head = tail = 0;
+                                }
+                                
+                                if (head != tail)
+                                {
+                                        if (niov+2 > FILEWRITER_MAXIOV)
+                                        {
+                                                filewriter_write_rings(file,
+                                                                       iov,
+                                                                       niov,
+                                                                       bbs,
+                                                                       heads,
+                                                                       nbbs,
+                                                                       false);
+                                                niov = nbbs = 0;
                                         }
-
-                                        skygw_file_write(file,
-                                                         (void *)bb->bb_buf,
-                                                         bb->bb_buf_used,
-                                                         (flush_logfile ||
-                                                          flushall_logfiles));
                                         /**
-                                         * Reset buffer's counters and mark
-                                         * not full.
+                                         * The strings of the ring are
+                                         * gathered to the write of the
+                                         * log file, in two parts if they
+                                         * wrap around the end of the ring.
                                          */
-                                        bb->bb_buf_left = bb->bb_buf_size;
-                                        bb->bb_buf_used = 0;
-                                        memset(bb->bb_buf, 0, bb->bb_buf_size);
-                                        bb->bb_isfull = false;
+                                        pos = tail % bb->bb_buf_size;
+                                        n = MIN(head - tail,
+                                                bb->bb_buf_size - pos);
+                                        iov[niov].iov_base = &bb->bb_buf[pos];
+                                        iov[niov].iov_len = n;
+                                        niov += 1;
+
+                                        if (n < head - tail)
+                                        {
+                                                iov[niov].iov_base = bb->bb_buf;
+                                                iov[niov].iov_len = head-tail-n;
+                                                niov += 1;
+                                        }
+                                        bbs[nbbs] = bb;
+                                        heads[nbbs] = head;
+                                        nbbs += 1;
                                 }
-                                /** Release lock to block buffer */
-                                simple_mutex_unlock(&bb->bb_mutex);
                     
-                                /** Consistent lock-free read on the list */
-                                do {
-                                        while ((vn1 = bb_list->mlist_versno)%2
-                                               != 0);
-                                        node = node->mlnode_next;
-                                        vn2 = bb_list->mlist_versno;
-                                } while (vn1 != vn2);
+                                node = node->iln_next;
                     
                         } /* while (node != NULL) */
 
+                        if (niov > 0)
+                        {
+                                filewriter_write_rings(file,
+                                                       iov,
+                                                       niov,
+                                                       bbs,
+                                                       heads,
+                                                       nbbs,
+                                                       (flush_logfile ||
+                                                        flushall_logfiles));
+                        }
+
                         /**
                          * Writer's exit flag was set after checking it.
                          * Loop is restarted to ensure that all logfiles are
@@ -2423,6 +3082,58 @@ static void* thr_filewriter_fun(
 }
 
 
+/**
+ * @node Writes the strings gathered from the log rings to the log file and
+ * gives the space back to the owners of the rings.
+ *
+ * Parameters:
+ * @param file - in, use
+ *          log file
+ *
+ * @param iov - in, use
+ *          the strings of the rings
+ *
+ * @param niov - in, use
+ *          number of the strings
+ *
+ * @param bbs - in, use
+ *          the rings
+ *
+ * @param heads - in, use
+ *          new tail of each ring
+ *
+ * @param nbbs - in, use
+ *          number of the rings
+ *
+ * @param flush - in, use
+ *          the log file is synced after the write
+ *
+ * @return void
+ */
+static void filewriter_write_rings(
+        skygw_file_t* file,
+        struct iovec* iov,
+        int           niov,
+        blockbuf_t**  bbs,
+        size_t*       heads,
+        int           nbbs,
+        bool          flush)
+{
+        int i;
+
+        skygw_file_writev(file, iov, niov, flush);
+        /**
+         * The rings are read before their space is given back to the
+         * owners.
+         */
+        __sync_synchronize();
+
+        for (i = 0; i < nbbs; i++)
+        {
+                bbs[i]->bb_tail = heads[i];
+        }
+}
+
 static void fnames_conf_done(
         fnames_conf_t* fn)
 {
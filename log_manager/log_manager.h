@@ -40,12 +40,62 @@ typedef enum { FILEWRITER_INIT, FILEWRITER_RUN, FILEWRITER_DONE }
 #define LT LOGFILE_TRACE
 #define LD LOGFILE_DEBUG
 
-#define LOGIF(id,cmd) if (lm_enabled_logfiles_bitmask & id)     \
+/**
+ * Each LOGIF has the state of its call site, the log strings of a site
+ * are rate limited and sampled by the policy of the log file, see
+ * skygw_log_set_ratelimit and skygw_log_set_sampling. Zeroed memory is
+ * the initial state.
+ */
+typedef struct log_site_st {
+        long ls_start;       /**< start of the interval, seconds */
+        int  ls_nseen;       /**< log strings of the interval */
+        int  ls_nsuppressed; /**< log strings not written */
+} log_site_t;
+
+/** Default rate limit of the error log, see skygw_log_set_ratelimit */
+#define LOG_RATELIMIT_BURST    100
+#define LOG_RATELIMIT_EVERY    1000
+#define LOG_RATELIMIT_INTERVAL 10
+
+/**
+ * LOG_LEVEL is the most verbose log whose LOGIF calls are compiled in, the
+ * calls of the logs above it compile to nothing, arguments included. Set in
+ * makefile.inc, all logs are compiled in by default. The logs compiled in
+ * are enabled and disabled at run time as before.
+ */
+#if !defined(LOG_LEVEL)
+#define LOG_LEVEL LOGFILE_LAST
+#endif
+
+#define LOG_COMPILED_IN(id) ((id) <= LOG_LEVEL)
+
+/**
+ * The error and message logs are usually enabled, the trace and debug logs
+ * usually not, the branches of LOGIF are hinted so.
+ */
+#if defined(__GNUC__)
+#define LOG_EXPECT(id,exp) __builtin_expect(!!(exp), (id) <= LOGFILE_MESSAGE)
+#else
+#define LOG_EXPECT(id,exp) (exp)
+#endif
+
+#define LOGIF(id,cmd) if (LOG_COMPILED_IN(id) &&                 \
+                          LOG_EXPECT(id, lm_enabled_logfiles_bitmask & id)) \
         {                                                       \
-                cmd;                                            \
+                static log_site_t lm_log_site;                  \
+                                                                \
+                if (skygw_log_site_check(id,                    \
+                                         &lm_log_site,          \
+                                         __FILE__,              \
+                                         __LINE__))             \
+                {                                               \
+                        cmd;                                    \
+                }                                               \
         }                                                       \
         
-#define LOG_IS_ENABLED(id) ((lm_enabled_logfiles_bitmask & id) ? true : false)
+#define LOG_IS_ENABLED(id) ((LOG_COMPILED_IN(id) &&                   \
+                             LOG_EXPECT(id, lm_enabled_logfiles_bitmask & id)) ? \
+                            true : false)
 
 /**
  * UNINIT means zeroed memory buffer allocated for the struct.
@@ -66,11 +116,20 @@ void skygw_logmanager_exit(void);
  * free private write buffer list
  */
 void skygw_log_done(void);
-int  skygw_log_write(logfile_id_t id, char* format, ...);
+int  skygw_log_write(logfile_id_t id, const char* format, ...);
 int  skygw_log_flush(logfile_id_t id);
-int  skygw_log_write_flush(logfile_id_t id, char* format, ...);
+int  skygw_log_write_flush(logfile_id_t id, const char* format, ...);
 int  skygw_log_enable(logfile_id_t id);
 int  skygw_log_disable(logfile_id_t id);
+bool skygw_log_site_check(logfile_id_t id,
+                          log_site_t*  site,
+                          const char*  file,
+                          int          line);
+int  skygw_log_set_ratelimit(logfile_id_t id,
+                             int          burst,
+                             int          every,
+                             int          interval);
+int  skygw_log_set_sampling(logfile_id_t id, double fraction);
 
 
 EXTERN_C_BLOCK_END
@@ -58,11 +58,124 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 extern int lm_enabled_logfiles_bitmask;
 
 #define QTYPE_LESS_RESTRICTIVE_THAN_WRITE(t) (t<QUERY_TYPE_WRITE ? true : false)
 
+/**
+ * The classification cache maps a statement digest, the statement with its
+ * literals replaced by '?' and white space collapsed, to the query type.
+ * Only the types which can't depend on the value of a literal are cached,
+ * the session, transaction and autocommit statements are always parsed.
+ */
+#if !defined(QC_CACHE_SIZE)
+#define QC_CACHE_SIZE           4096 /*< max # of digests, 0 disables the cache */
+#endif
+#define QC_CACHE_NBUCKETS       8192 /*< hash buckets, a power of two */
+#define QC_CACHE_MAX_QUERY_LEN  2048 /*< longer statements are not cached */
+#define QC_CACHEABLE_TYPES      (QUERY_TYPE_LOCAL_READ|QUERY_TYPE_READ| \
+                                 QUERY_TYPE_WRITE)
+
+/**
+ * The saved cache is only loaded by the same MaxScale version and the same
+ * build of the classifier, a new build may digest or classify differently.
+ */
+#define QC_CACHE_FILE_MAGIC     "MXSQCC01"
+#define QC_CACHE_FILE_MAXSIZE   (64*1024*1024)
+#define QC_BUILD_ID             MYSQL_SERVER_VERSION " " __DATE__ " " __TIME__
+
+typedef struct qc_cache_entry_st {
+        unsigned int              qce_hash;     /*< hash of the digest */
+        skygw_query_type_t        qce_type;     /*< the cached query type */
+        int                       qce_ntables;  /*< # of tables, -1 if unparsed */
+        char*                     qce_tables;   /*< the names, NUL separated */
+        struct qc_cache_entry_st* qce_next;     /*< hash chain */
+        struct qc_cache_entry_st* qce_lru_prev; /*< more recently used */
+        struct qc_cache_entry_st* qce_lru_next; /*< less recently used */
+        char                      qce_digest[1]; /*< the digest, allocated inline */
+} qc_cache_entry_t;
+
+static pthread_mutex_t    qc_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static qc_cache_entry_t*  qc_cache_buckets[QC_CACHE_NBUCKETS];
+static qc_cache_entry_t*  qc_cache_lru_head; /*< most recently used */
+static qc_cache_entry_t*  qc_cache_lru_tail; /*< least recently used */
+static skygw_qc_cache_stats_t qc_cache_stats = { QC_CACHE_SIZE, 0, 0, 0, 0, 0 };
+
+static int qc_make_digest(
+        const char* query,
+        char*       digest,
+        int         maxlen);
+
+static unsigned int qc_digest_hash(
+        const char* digest);
+
+static bool qc_cache_lookup(
+        const char*         digest,
+        unsigned int        hash,
+        skygw_query_type_t* qtype,
+        char***             tables,
+        int*                n_tables);
+
+static void qc_cache_insert(
+        const char*        digest,
+        unsigned int       hash,
+        skygw_query_type_t qtype,
+        const char*        tables,
+        size_t             tables_len,
+        int                n_tables);
+
+static char* qc_get_table_list(
+        THD*    thd,
+        int*    n_tables,
+        size_t* len);
+
+static char** qc_unpack_tables(
+        const char* packed,
+        int         n_tables);
+
+static size_t qc_packed_tables_len(
+        const char* packed,
+        int         n_tables);
+
+static skygw_query_type_t qc_classify(
+        const char*   query,
+        unsigned long client_flags,
+        MYSQL**       p_mysql,
+        char***       tables,
+        int*          n_tables);
+
+static bool qc_fast_classify(
+        const char*         query,
+        skygw_query_type_t* qtype);
+
+static bool qc_is_plain_dml(
+        const char* p,
+        bool        is_select);
+
+/**
+ * Each thread keeps the MYSQL handle and the THD of its last parse and resets
+ * them for the next statement. The THD is bound to the thread which created
+ * it, so the handles aren't shared. If the thread's handle is still held by
+ * the caller when another statement is classified, a new handle is created
+ * and freed as before.
+ */
+static __thread MYSQL* qc_thread_mysql;      /*< kept between statements */
+static __thread bool   qc_thread_mysql_busy; /*< returned to the caller */
+
+static MYSQL* qc_mysql_init(void);
+
+static void qc_mysql_done(
+        MYSQL* mysql);
+
+static void reset_thd_for_next_query(
+        THD* thd);
+
 static THD* get_or_create_thd_for_parsing(
         MYSQL* mysql,
         char*  query_str);
@@ -76,111 +189,1549 @@ static bool create_parse_tree(
 static skygw_query_type_t resolve_query_type(
         THD* thd);
 
-static bool skygw_stmt_causes_implicit_commit(
-        LEX*  lex,
-        int* autocommit_stmt);
+static bool skygw_stmt_causes_implicit_commit(
+        LEX*  lex,
+        int* autocommit_stmt);
+
+static int is_autocommit_stmt(
+        LEX* lex);
+
+/** 
+ * @node (write brief function description here) 
+ *
+ * Parameters:
+ * @param query_str - <usage>
+ *          <description>
+ *
+ * @param client_flag - <usage>
+ *          <description>
+ *
+ * @return 
+ *
+ * 
+ * @details (write detailed description here)
+ *
+ */
+skygw_query_type_t skygw_query_classifier_get_type(
+        const char*   query,
+        unsigned long client_flags,
+        MYSQL**       p_mysql)
+{
+        return qc_classify(query, client_flags, p_mysql, NULL, NULL);
+}
+
+/** 
+ * @node Classify a statement and return the names of the tables it uses
+ *
+ * Parameters:
+ * @param query - in, use
+ *          The statement
+ *
+ * @param client_flags - in, use
+ *          The client flags of the parse
+ *
+ * @param p_mysql - out, use
+ *          The MYSQL handle of the parse, or NULL if the caller doesn't
+ *          need it, see skygw_query_classifier_get_type
+ *
+ * @param tables - out, use
+ *          An array of n_tables names, or NULL if the statement couldn't be
+ *          parsed. The array and each name must be freed by the caller.
+ *
+ * @param n_tables - out, use
+ *          The number of names in tables
+ *
+ * @return The query type
+ *
+ * 
+ * @details The names come from the same parse as the type and are cached
+ * with it, so a statement is parsed at most once for both.
+ *
+ */
+skygw_query_type_t skygw_query_classifier_get_type_tables(
+        const char*   query,
+        unsigned long client_flags,
+        MYSQL**       p_mysql,
+        char***       tables,
+        int*          n_tables)
+{
+        return qc_classify(query, client_flags, p_mysql, tables, n_tables);
+}
+
+/** 
+ * @node Classify a statement, the common part of the public functions
+ *
+ * Parameters:
+ * @param query - in, use
+ *          The statement
+ *
+ * @param client_flags - in, use
+ *          The client flags of the parse
+ *
+ * @param p_mysql - out, use
+ *          The MYSQL handle of the parse or NULL
+ *
+ * @param tables - out, use
+ *          The names of the tables or NULL if they aren't needed
+ *
+ * @param n_tables - out, use
+ *          The number of names, used only with tables
+ *
+ * @return The query type
+ *
+ * 
+ * @details The fast path doesn't know the tables of a SELECT so such
+ * statements are parsed, or found from the cache, when the tables are
+ * asked for. The other trivial statements have no tables.
+ *
+ */
+static skygw_query_type_t qc_classify(
+        const char*   query,
+        unsigned long client_flags,
+        MYSQL**       p_mysql,
+        char***       tables,
+        int*          n_tables)
+{
+        MYSQL*      mysql;
+        char*       query_str;
+        THD*        thd;
+        skygw_query_type_t qtype = QUERY_TYPE_UNKNOWN;
+        bool        failp = FALSE;
+        char        digest[QC_CACHE_MAX_QUERY_LEN+1];
+        int         digest_len = -1;
+        unsigned int hash = 0;
+        char*       packed = NULL;
+        size_t      packed_len = 0;
+        int         n = -1;
+
+        ss_info_dassert(query != NULL, ("query_str is NULL"));
+        
+        query_str = const_cast<char*>(query);
+        LOGIF(LT, (skygw_log_write(
+                LOGFILE_TRACE,
+                "Query : \"%s\"", query_str)));
+        
+        if (p_mysql != NULL)
+        {
+                *p_mysql = NULL;
+        }
+        if (tables != NULL)
+        {
+                *tables = NULL;
+                *n_tables = 0;
+        }
+        /** 
+         * Trivial statements and cached types are returned without a MYSQL
+         * handle. Neither includes named prepared statements so there's no
+         * statement name to be read from the handle.
+         */
+        if (qc_fast_classify(query, &qtype) &&
+            (tables == NULL || qtype != QUERY_TYPE_READ))
+        {
+                __sync_fetch_and_add(&qc_cache_stats.qcs_fast, 1);
+                
+                if (tables != NULL)
+                {
+                        *tables = qc_unpack_tables("", 0);
+                }
+                goto return_qtype;
+        }
+        qtype = QUERY_TYPE_UNKNOWN;
+        
+        if (QC_CACHE_SIZE > 0)
+        {
+                digest_len = qc_make_digest(query, digest, QC_CACHE_MAX_QUERY_LEN);
+        }
+        if (digest_len > 0)
+        {
+                hash = qc_digest_hash(digest);
+                
+                if (qc_cache_lookup(digest, hash, &qtype, tables, n_tables))
+                {
+                        goto return_qtype;
+                }
+        }
+        /** Get server handle, the one of this thread if it is free */
+        if (qc_thread_mysql != NULL && !qc_thread_mysql_busy)
+        {
+                mysql = qc_thread_mysql;
+        }
+        else if ((mysql = qc_mysql_init()) == NULL)
+        {
+                goto return_qtype;
+        }
+        else if (qc_thread_mysql == NULL)
+        {
+                qc_thread_mysql = mysql;
+        }
+        if (mysql == qc_thread_mysql)
+        {
+                qc_thread_mysql_busy = true;
+        }
+        
+        /** Get one or create new THD object to be use in parsing */
+        thd = get_or_create_thd_for_parsing(mysql, query_str);
+
+        if (thd == NULL) 
+        {
+                qc_mysql_done(mysql);
+                goto return_qtype;
+        }
+        /** 
+         * Create parse_tree inside thd.
+         * thd and even lex are readable even if parser failed so let it 
+         * continue despite failure.
+         */
+        failp = create_parse_tree(thd);
+        qtype = resolve_query_type(thd);
+
+        if (!failp)
+        {
+                packed = qc_get_table_list(thd, &n, &packed_len);
+        }
+        if (digest_len > 0 && (qtype & ~QC_CACHEABLE_TYPES) == 0)
+        {
+                qc_cache_insert(digest, hash, qtype, packed, packed_len, n);
+        }
+        if (tables != NULL && packed != NULL)
+        {
+                if ((*tables = qc_unpack_tables(packed, n)) != NULL)
+                {
+                        *n_tables = n;
+                }
+        }
+        free(packed);
+        
+        if (p_mysql == NULL)
+        {
+                skygw_query_classifier_free(mysql);
+        }
+        else
+        {
+                *p_mysql = mysql;
+        }
+return_qtype:
+        return qtype;
+}
+
+/** 
+ * @node Create a MYSQL handle for the embedded server
+ *
+ * @return The handle or NULL if it couldn't be created
+ */
+static MYSQL* qc_mysql_init(void)
+{
+        MYSQL*      mysql;
+        const char* user  = "skygw";
+        const char* db    = "skygw";
+
+        mysql = mysql_init(NULL);
+        
+        if (mysql == NULL) {
+                LOGIF(LE, (skygw_log_write_flush(
+                        LOGFILE_ERROR,
+                        "Error : call to mysql_real_connect failed due %d, %s.",
+                        mysql_errno(mysql),
+                        mysql_error(mysql))));
+                
+                mysql_library_end();
+                goto return_mysql;
+        }
+        /** Set methods and authentication to mysql */
+        mysql_options(mysql, MYSQL_READ_DEFAULT_GROUP, "libmysqld_skygw");
+        mysql_options(mysql, MYSQL_OPT_USE_EMBEDDED_CONNECTION, NULL);
+        mysql->methods = &embedded_methods;
+        mysql->user    = my_strdup(user, MYF(0));
+        mysql->db      = my_strdup(db, MYF(0));
+        mysql->passwd  = NULL;
+        
+return_mysql:
+        return mysql;
+}
+
+/** 
+ * @node Free THD context and close MYSQL, also if it is the handle of
+ * this thread
+ *
+ * Parameters:
+ * @param mysql - in, take ownership
+ *          The handle
+ *
+ * @return void
+ */
+static void qc_mysql_done(
+        MYSQL* mysql)
+{
+        if (mysql == qc_thread_mysql)
+        {
+                qc_thread_mysql = NULL;
+                qc_thread_mysql_busy = false;
+        }
+        if (mysql->thd != NULL)
+        {
+                (*mysql->methods->free_embedded_thd)(mysql);
+                mysql->thd = NULL;
+        }
+        mysql_close(mysql);
+        mysql_thread_end();
+}
+
+/** 
+ * @node Release what the parse of a statement allocated in the THD
+ *
+ * Parameters:
+ * @param thd - in, use
+ *          The THD of the thread's handle
+ *
+ * @return void
+ *
+ * 
+ * @details This is what dispatch_command does after each statement, the
+ * items, the lex and the statement memory are freed while the preallocated
+ * memory root is kept for the next statement.
+ *
+ */
+static void reset_thd_for_next_query(
+        THD* thd)
+{
+        thd->end_statement();
+        thd->cleanup_after_query();
+        free_root(thd->mem_root, MYF(MY_KEEP_PREALLOC));
+}
+
+
+/** 
+ * @node Copy the statistics of the classification cache
+ *
+ * Parameters:
+ * @param stats - out, use
+ *          The statistics are copied here
+ *
+ * @return void
+ */
+void skygw_query_classifier_get_cache_stats(
+        skygw_qc_cache_stats_t* stats)
+{
+        pthread_mutex_lock(&qc_cache_lock);
+        *stats = qc_cache_stats;
+        pthread_mutex_unlock(&qc_cache_lock);
+}
+
+/** Append a 32 bit value to the image of a saved cache */
+static char* qc_put_u32(
+        char*    p,
+        uint32_t v)
+{
+        memcpy(p, &v, sizeof(v));
+        return p + sizeof(v);
+}
+
+/** Append a string and its length to the image of a saved cache */
+static char* qc_put_str(
+        char*       p,
+        const char* str,
+        size_t      len)
+{
+        p = qc_put_u32(p, (uint32_t)len);
+        memcpy(p, str, len);
+        return p + len;
+}
+
+/** Read a 32 bit value of a saved cache, false past the end of the image */
+static bool qc_get_u32(
+        const char** p,
+        const char*  end,
+        uint32_t*    v)
+{
+        if ((size_t)(end - *p) < sizeof(*v))
+        {
+                return false;
+        }
+        memcpy(v, *p, sizeof(*v));
+        *p += sizeof(*v);
+        return true;
+}
+
+/** FNV-1a of the image of a saved cache */
+static uint32_t qc_file_checksum(
+        const char* p,
+        size_t      len)
+{
+        uint32_t h = 2166136261U;
+
+        while (len-- > 0)
+        {
+                h ^= (unsigned char)*p++;
+                h *= 16777619U;
+        }
+        return h;
+}
+
+/** 
+ * @node Write the classification cache to a file
+ *
+ * Parameters:
+ * @param fname - in, use
+ *          The file, it is written as fname.tmp and renamed over fname
+ *
+ * @param version - in, use
+ *          The MaxScale version, a different version doesn't load the file
+ *
+ * @return The number of entries written or -1 on error
+ *
+ * 
+ * @details The entries are copied under the cache lock and written without
+ * it. They are written from the least recently used one, the load then
+ * leaves the most recently used digests at the head of the LRU list. The
+ * image is in the byte order of the host and has a checksum at its end.
+ *
+ */
+int skygw_query_classifier_cache_save(
+        const char* fname,
+        const char* version)
+{
+        qc_cache_entry_t* e;
+        char*             buf;
+        char*             p;
+        char*             countp;
+        size_t            size;
+        size_t            dlen;
+        size_t            tlen;
+        uint32_t          n = 0;
+        char              tmpname[PATH_MAX+1];
+        FILE*             fp;
+        int               rc = -1;
+
+        pthread_mutex_lock(&qc_cache_lock);
+        size = strlen(QC_CACHE_FILE_MAGIC) + strlen(version) +
+                strlen(QC_BUILD_ID) + 4 * sizeof(uint32_t);
+
+        for (e = qc_cache_lru_tail; e != NULL; e = e->qce_lru_prev)
+        {
+                size += 4 * sizeof(uint32_t) + strlen(e->qce_digest) +
+                        qc_packed_tables_len(e->qce_tables, e->qce_ntables);
+        }
+        
+        if ((buf = (char *)malloc(size)) == NULL)
+        {
+                pthread_mutex_unlock(&qc_cache_lock);
+                return -1;
+        }
+        p = buf;
+        memcpy(p, QC_CACHE_FILE_MAGIC, strlen(QC_CACHE_FILE_MAGIC));
+        p += strlen(QC_CACHE_FILE_MAGIC);
+        p = qc_put_str(p, version, strlen(version));
+        p = qc_put_str(p, QC_BUILD_ID, strlen(QC_BUILD_ID));
+        countp = p;
+        p += sizeof(uint32_t);
+        
+        for (e = qc_cache_lru_tail; e != NULL; e = e->qce_lru_prev)
+        {
+                dlen = strlen(e->qce_digest);
+                tlen = qc_packed_tables_len(e->qce_tables, e->qce_ntables);
+                p = qc_put_u32(p, (uint32_t)e->qce_type);
+                p = qc_put_u32(p, (uint32_t)e->qce_ntables);
+                p = qc_put_u32(p, (uint32_t)dlen);
+                p = qc_put_u32(p, (uint32_t)tlen);
+                memcpy(p, e->qce_digest, dlen);
+                p += dlen;
+                memcpy(p, e->qce_tables, tlen);
+                p += tlen;
+                n += 1;
+        }
+        pthread_mutex_unlock(&qc_cache_lock);
+        
+        qc_put_u32(countp, n);
+        p = qc_put_u32(p, qc_file_checksum(buf, p - buf));
+        ss_dassert((size_t)(p - buf) == size);
+        
+        snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname);
+        
+        if ((fp = fopen(tmpname, "wb")) == NULL)
+        {
+                goto return_err;
+        }
+        if (fwrite(buf, 1, size, fp) != size ||
+            fflush(fp) != 0 ||
+            fsync(fileno(fp)) != 0)
+        {
+                fclose(fp);
+                unlink(tmpname);
+                goto return_err;
+        }
+        fclose(fp);
+        
+        if (rename(tmpname, fname) != 0)
+        {
+                unlink(tmpname);
+                goto return_err;
+        }
+        rc = (int)n;
+        goto return_rc;
+        
+return_err:
+        LOGIF(LE, (skygw_log_write_flush(
+                LOGFILE_ERROR,
+                "Error : Failed to write the query classification cache "
+                "to %s, %d, %s.",
+                fname,
+                errno,
+                strerror(errno))));
+return_rc:
+        free(buf);
+        return rc;
+}
+
+/** 
+ * @node Check or add the entries of a saved cache
+ *
+ * Parameters:
+ * @param p - in, use
+ *          The first entry of the image
+ *
+ * @param end - in, use
+ *          The end of the entries, the checksum
+ *
+ * @param n - in, use
+ *          The number of entries
+ *
+ * @param add - in, use
+ *          false only checks the entries, true adds them to the cache
+ *
+ * @return The number of entries added, or -1 if an entry is damaged
+ *
+ */
+static int qc_cache_load_entries(
+        const char* p,
+        const char* end,
+        uint32_t    n,
+        bool        add)
+{
+        char         digest[QC_CACHE_MAX_QUERY_LEN+1];
+        const char*  tables;
+        const char*  q;
+        uint32_t     i;
+        uint32_t     qtype;
+        uint32_t     ntables;
+        uint32_t     dlen;
+        uint32_t     tlen;
+        uint32_t     nuls;
+        int          n_added = 0;
+
+        for (i = 0; i < n; i++)
+        {
+                if (!qc_get_u32(&p, end, &qtype) ||
+                    !qc_get_u32(&p, end, &ntables) ||
+                    !qc_get_u32(&p, end, &dlen) ||
+                    !qc_get_u32(&p, end, &tlen) ||
+                    (size_t)(end - p) < (size_t)dlen + tlen ||
+                    dlen == 0 || dlen > QC_CACHE_MAX_QUERY_LEN ||
+                    memchr(p, '\0', dlen) != NULL ||
+                    (qtype & ~QC_CACHEABLE_TYPES) != 0)
+                {
+                        return -1;
+                }
+                tables = p + dlen;
+                
+                /** Each name ends with a NUL, no names if the parse failed */
+                for (q = tables, nuls = 0; q < tables + tlen; q++)
+                {
+                        nuls += (*q == '\0');
+                }
+                if ((int)ntables < 0 ? tlen != 0 :
+                    nuls != ntables || (tlen > 0 && tables[tlen-1] != '\0'))
+                {
+                        return -1;
+                }
+                memcpy(digest, p, dlen);
+                digest[dlen] = '\0';
+                p += dlen + tlen;
+                
+                /** Older entries would only be evicted by the newer ones */
+                if (!add || n - i > QC_CACHE_SIZE)
+                {
+                        continue;
+                }
+                qc_cache_insert(digest,
+                                qc_digest_hash(digest),
+                                (skygw_query_type_t)qtype,
+                                (int)ntables >= 0 ? tables : NULL,
+                                tlen,
+                                (int)ntables);
+                n_added += 1;
+        }
+        return p == end ? n_added : -1;
+}
+
+/** 
+ * @node Read the classification cache written by
+ * skygw_query_classifier_cache_save
+ *
+ * Parameters:
+ * @param fname - in, use
+ *          The file
+ *
+ * @param version - in, use
+ *          The MaxScale version
+ *
+ * @return The number of entries added to the cache, 0 if there is no file
+ * or it was written by another version or build, -1 if it is damaged or
+ * can't be read
+ *
+ * 
+ * @details The whole image is checked before anything is added. Only the
+ * most recently used QC_CACHE_SIZE entries of a larger file are added, the
+ * digests already in the cache are kept as they are.
+ *
+ */
+int skygw_query_classifier_cache_load(
+        const char* fname,
+        const char* version)
+{
+        FILE*        fp;
+        struct stat  st;
+        char*        buf = NULL;
+        const char*  p;
+        const char*  end;
+        uint32_t     len;
+        uint32_t     n;
+        uint32_t     sum;
+        bool         same_build;
+        int          rc = -1;
+
+        if (QC_CACHE_SIZE == 0)
+        {
+                return 0;
+        }
+        
+        if ((fp = fopen(fname, "rb")) == NULL)
+        {
+                return errno == ENOENT ? 0 : -1;
+        }
+        
+        if (fstat(fileno(fp), &st) != 0 ||
+            st.st_size < (off_t)(strlen(QC_CACHE_FILE_MAGIC) +
+                                 4 * sizeof(uint32_t)) ||
+            st.st_size > QC_CACHE_FILE_MAXSIZE ||
+            (buf = (char *)malloc(st.st_size)) == NULL ||
+            fread(buf, 1, st.st_size, fp) != (size_t)st.st_size)
+        {
+                fclose(fp);
+                goto return_err;
+        }
+        fclose(fp);
+        p = buf;
+        end = buf + st.st_size - sizeof(uint32_t);
+        memcpy(&sum, end, sizeof(sum));
+        
+        if (memcmp(p, QC_CACHE_FILE_MAGIC, strlen(QC_CACHE_FILE_MAGIC)) != 0 ||
+            qc_file_checksum(buf, end - buf) != sum)
+        {
+                goto return_err;
+        }
+        p += strlen(QC_CACHE_FILE_MAGIC);
+        same_build = qc_get_u32(&p, end, &len) && len == strlen(version) &&
+                (size_t)(end - p) >= len && memcmp(p, version, len) == 0;
+        
+        if (same_build)
+        {
+                p += len;
+                same_build = qc_get_u32(&p, end, &len) &&
+                        len == strlen(QC_BUILD_ID) &&
+                        (size_t)(end - p) >= len &&
+                        memcmp(p, QC_BUILD_ID, len) == 0;
+        }
+        if (!same_build)
+        {
+                LOGIF(LM, (skygw_log_write(
+                        LOGFILE_MESSAGE,
+                        "The query classification cache in %s was saved by "
+                        "another version of MaxScale or of the classifier, "
+                        "it is not loaded.",
+                        fname)));
+                rc = 0;
+                goto return_rc;
+        }
+        p += len;
+        
+        if (!qc_get_u32(&p, end, &n) ||
+            qc_cache_load_entries(p, end, n, false) < 0)
+        {
+                goto return_err;
+        }
+        rc = qc_cache_load_entries(p, end, n, true);
+        goto return_rc;
+        
+return_err:
+        LOGIF(LE, (skygw_log_write_flush(
+                LOGFILE_ERROR,
+                "Error : The query classification cache in %s is damaged or "
+                "can't be read, it is not loaded.",
+                fname)));
+        rc = -1;
+return_rc:
+        free(buf);
+        return rc;
+}
+
+/** 
+ * @node Make the digest of a statement
+ *
+ * Parameters:
+ * @param query - in, use
+ *          The statement
+ *
+ * @param digest - out, use
+ *          Buffer of at least maxlen+1 bytes for the digest
+ *
+ * @param maxlen - in, use
+ *          The maximum length of the digest
+ *
+ * @return The length of the digest, or -1 if the statement is too long or
+ * it can't be tokenized
+ *
+ * 
+ * @details Numbers and quoted strings are replaced by '?' and white space is
+ * collapsed to a single space. Identifiers in backquotes and comments are
+ * copied as they are, comments may include executable code. The digest is
+ * never longer than the statement.
+ *
+ */
+static int qc_make_digest(
+        const char* query,
+        char*       digest,
+        int         maxlen)
+{
+        const char* p = query;
+        int         n = 0;
+        bool        space = false;
+        char        q;
+
+        while (*p != '\0')
+        {
+                if (isspace((unsigned char)*p))
+                {
+                        space = true;
+                        p++;
+                        continue;
+                }
+                if (space && n > 0)
+                {
+                        if (n >= maxlen)
+                        {
+                                return -1;
+                        }
+                        digest[n++] = ' ';
+                }
+                space = false;
+                
+                if (n >= maxlen)
+                {
+                        return -1;
+                }
+                
+                if (*p == '\'' || *p == '"')
+                {
+                        /** String literal, quotes are escaped by \ or doubling */
+                        q = *p++;
+                        
+                        while (*p != '\0')
+                        {
+                                if (*p == '\\' && p[1] != '\0')
+                                {
+                                        p += 2;
+                                }
+                                else if (*p == q && p[1] == q)
+                                {
+                                        p += 2;
+                                }
+                                else if (*p == q)
+                                {
+                                        break;
+                                }
+                                else
+                                {
+                                        p++;
+                                }
+                        }
+                        if (*p == '\0')
+                        {
+                                return -1;
+                        }
+                        p++;
+                        digest[n++] = '?';
+                }
+                else if (isdigit((unsigned char)*p) &&
+                         (p == query ||
+                          !(isalnum((unsigned char)p[-1]) || p[-1] == '_' ||
+                            p[-1] == '$')))
+                {
+                        /** Number, including decimals, exponents and hex */
+                        while (isalnum((unsigned char)*p) || *p == '.' || *p == '_')
+                        {
+                                p++;
+                        }
+                        digest[n++] = '?';
+                }
+                else if (*p == '`' ||
+                         (*p == '/' && p[1] == '*') ||
+                         *p == '#' ||
+                         (*p == '-' && p[1] == '-' && isspace((unsigned char)p[2])))
+                {
+                        /** Copy up to and including the terminator */
+                        const char* end;
+                        
+                        if (*p == '`')
+                        {
+                                end = strchr(p+1, '`');
+                        }
+                        else if (*p == '/')
+                        {
+                                end = strstr(p+2, "*/");
+                                end = (end != NULL ? end+1 : NULL);
+                        }
+                        else
+                        {
+                                end = strchr(p, '\n');
+                        }
+                        if (end == NULL)
+                        {
+                                end = p + strlen(p) - 1;
+                        }
+                        if (n + (end - p) + 1 > maxlen)
+                        {
+                                return -1;
+                        }
+                        memcpy(&digest[n], p, end - p + 1);
+                        n += end - p + 1;
+                        p = end + 1;
+                }
+                else
+                {
+                        digest[n++] = *p++;
+                }
+        }
+        digest[n] = '\0';
+        return n;
+}
+
+/** FNV-1a hash of a digest */
+static unsigned int qc_digest_hash(
+        const char* digest)
+{
+        unsigned int h = 2166136261U;
+
+        while (*digest != '\0')
+        {
+                h ^= (unsigned char)*digest++;
+                h *= 16777619U;
+        }
+        return h;
+}
+
+/** Unlink an entry from the LRU list, the cache lock must be held */
+static void qc_cache_lru_unlink(
+        qc_cache_entry_t* e)
+{
+        if (e->qce_lru_prev != NULL)
+                e->qce_lru_prev->qce_lru_next = e->qce_lru_next;
+        else
+                qc_cache_lru_head = e->qce_lru_next;
+        if (e->qce_lru_next != NULL)
+                e->qce_lru_next->qce_lru_prev = e->qce_lru_prev;
+        else
+                qc_cache_lru_tail = e->qce_lru_prev;
+}
+
+/** Link an entry as the most recently used, the cache lock must be held */
+static void qc_cache_lru_push(
+        qc_cache_entry_t* e)
+{
+        e->qce_lru_prev = NULL;
+        e->qce_lru_next = qc_cache_lru_head;
+        
+        if (qc_cache_lru_head != NULL)
+                qc_cache_lru_head->qce_lru_prev = e;
+        else
+                qc_cache_lru_tail = e;
+        qc_cache_lru_head = e;
+}
+
+/** 
+ * @node Find the query type of a digest from the cache
+ *
+ * Parameters:
+ * @param digest - in, use
+ *          The statement digest
+ *
+ * @param hash - in, use
+ *          The hash of the digest
+ *
+ * @param qtype - out, use
+ *          The cached query type
+ *
+ * @param tables - out, use
+ *          The cached table names or NULL if they aren't needed, NULL is
+ *          returned for a statement that the parser failed on
+ *
+ * @param n_tables - out, use
+ *          The number of cached names, used only with tables
+ *
+ * @return true if the digest was found, the entry becomes the most
+ * recently used one
+ */
+static bool qc_cache_lookup(
+        const char*         digest,
+        unsigned int        hash,
+        skygw_query_type_t* qtype,
+        char***             tables,
+        int*                n_tables)
+{
+        qc_cache_entry_t* e;
+        bool              succp = false;
+
+        pthread_mutex_lock(&qc_cache_lock);
+        e = qc_cache_buckets[hash & (QC_CACHE_NBUCKETS-1)];
+        
+        while (e != NULL &&
+               (e->qce_hash != hash || strcmp(e->qce_digest, digest) != 0))
+        {
+                e = e->qce_next;
+        }
+        if (e != NULL)
+        {
+                *qtype = e->qce_type;
+                
+                if (tables != NULL && e->qce_ntables >= 0 &&
+                    (*tables = qc_unpack_tables(e->qce_tables,
+                                                e->qce_ntables)) != NULL)
+                {
+                        *n_tables = e->qce_ntables;
+                }
+                qc_cache_lru_unlink(e);
+                qc_cache_lru_push(e);
+                qc_cache_stats.qcs_hits += 1;
+                succp = true;
+        }
+        else
+        {
+                qc_cache_stats.qcs_misses += 1;
+        }
+        pthread_mutex_unlock(&qc_cache_lock);
+        return succp;
+}
+
+/** 
+ * @node Add the query type of a digest to the cache
+ *
+ * Parameters:
+ * @param digest - in, use
+ *          The statement digest
+ *
+ * @param hash - in, use
+ *          The hash of the digest
+ *
+ * @param qtype - in, use
+ *          The query type resolved by the parser
+ *
+ * @param tables - in, use
+ *          The table names packed by qc_get_table_list, or NULL if the
+ *          parser failed
+ *
+ * @param tables_len - in, use
+ *          The length of the packed names
+ *
+ * @param n_tables - in, use
+ *          The number of names or -1 if the parser failed
+ *
+ * @return void
+ *
+ * 
+ * @details The least recently used entry is evicted when the cache is full.
+ * Another thread may have added the same digest after our lookup, that
+ * entry is left as it is.
+ *
+ */
+static void qc_cache_insert(
+        const char*        digest,
+        unsigned int       hash,
+        skygw_query_type_t qtype,
+        const char*        tables,
+        size_t             tables_len,
+        int                n_tables)
+{
+        qc_cache_entry_t*  e;
+        qc_cache_entry_t** pp;
+        size_t             len = strlen(digest);
+
+        pthread_mutex_lock(&qc_cache_lock);
+        
+        for (e = qc_cache_buckets[hash & (QC_CACHE_NBUCKETS-1)];
+             e != NULL;
+             e = e->qce_next)
+        {
+                if (e->qce_hash == hash && strcmp(e->qce_digest, digest) == 0)
+                {
+                        goto return_unlock;
+                }
+        }
+        
+        if (qc_cache_stats.qcs_entries >= QC_CACHE_SIZE)
+        {
+                e = qc_cache_lru_tail;
+                qc_cache_lru_unlink(e);
+                pp = &qc_cache_buckets[e->qce_hash & (QC_CACHE_NBUCKETS-1)];
+                
+                while (*pp != e)
+                {
+                        pp = &(*pp)->qce_next;
+                }
+                *pp = e->qce_next;
+                free(e);
+                qc_cache_stats.qcs_entries -= 1;
+                qc_cache_stats.qcs_evictions += 1;
+        }
+        if (tables == NULL)
+        {
+                tables_len = 0;
+                n_tables = -1;
+        }
+        /** The names are allocated inline after the digest */
+        e = (qc_cache_entry_t *)malloc(sizeof(qc_cache_entry_t) + len + 
+                                       tables_len + 1);
+
+        if (e == NULL)
+        {
+                goto return_unlock;
+        }
+        memcpy(e->qce_digest, digest, len+1);
+        e->qce_tables = e->qce_digest + len + 1;
+        memcpy(e->qce_tables, tables != NULL ? tables : "", tables_len);
+        e->qce_tables[tables_len] = '\0';
+        e->qce_ntables = n_tables;
+        e->qce_hash = hash;
+        e->qce_type = qtype;
+        pp = &qc_cache_buckets[hash & (QC_CACHE_NBUCKETS-1)];
+        e->qce_next = *pp;
+        *pp = e;
+        qc_cache_lru_push(e);
+        qc_cache_stats.qcs_entries += 1;
+        
+return_unlock:
+        pthread_mutex_unlock(&qc_cache_lock);
+}
+
+/** Skip white space */
+static const char* qc_skip_space(
+        const char* p)
+{
+        while (isspace((unsigned char)*p))
+        {
+                p++;
+        }
+        return p;
+}
+
+/** 
+ * @node Match a keyword
+ *
+ * Parameters:
+ * @param p - in, use
+ *          The current position, white space is skipped first
+ *
+ * @param word - in, use
+ *          The keyword in upper case
+ *
+ * @return Position after the keyword or NULL if the next word is
+ * something else
+ */
+static const char* qc_match_word(
+        const char* p,
+        const char* word)
+{
+        size_t len = strlen(word);
+
+        p = qc_skip_space(p);
+        
+        if (strncasecmp(p, word, len) != 0 ||
+            isalnum((unsigned char)p[len]) || p[len] == '_' || p[len] == '$')
+        {
+                return NULL;
+        }
+        return p + len;
+}
+
+/** True if only an optional semicolon and white space are left */
+static bool qc_at_end(
+        const char* p)
+{
+        p = qc_skip_space(p);
+        
+        if (*p == ';')
+        {
+                p = qc_skip_space(p+1);
+        }
+        return *p == '\0';
+}
+
+/** 
+ * @node Check that a SELECT has nothing that would need the parser
+ *
+ * Parameters:
+ * @param p - in, use
+ *          The statement after the SELECT keyword
+ *
+ * @return true if the statement consists only of identifiers, literals
+ * and operators
+ *
+ * 
+ * @details Function calls, subqueries and IN lists, variables, INTO and
+ * comments are left to the parser, as are the keywords that the parser
+ * turns into NOW() (CURRENT_TIMESTAMP, LOCALTIME, UTC_TIME, ...) since
+ * they make the query a local read.
+ *
+ */
+static bool qc_is_simple_select(
+        const char* p)
+{
+        const char* w;
+        char        q;
+
+        while (*p != '\0')
+        {
+                if (isalpha((unsigned char)*p) || *p == '_' || *p == '$')
+                {
+                        w = p;
+                        
+                        while (isalnum((unsigned char)*p) || *p == '_' || *p == '$')
+                        {
+                                p++;
+                        }
+                        if ((p - w == 4 && strncasecmp(w, "INTO", 4) == 0) ||
+                            (p - w == 7 && strncasecmp(w, "SYSDATE", 7) == 0) ||
+                            strncasecmp(w, "CURRENT_", 8) == 0 ||
+                            strncasecmp(w, "LOCALTIME", 9) == 0 ||
+                            strncasecmp(w, "UTC_", 4) == 0)
+                        {
+                                return false;
+                        }
+                }
+                else if (*p == '\'' || *p == '"' || *p == '`')
+                {
+                        q = *p++;
+                        
+                        while (*p != '\0' && *p != q)
+                        {
+                                if (*p == '\\' && q != '`')
+                                {
+                                        return false;
+                                }
+                                p++;
+                        }
+                        if (*p == '\0')
+                        {
+                                return false;
+                        }
+                        p++;
+                }
+                else if (*p == ';')
+                {
+                        return qc_at_end(p);
+                }
+                else if (*p == '(' || *p == '@' || *p == '?' || *p == '#' ||
+                         (*p == '/' && p[1] == '*') ||
+                         (*p == '-' && p[1] == '-'))
+                {
+                        return false;
+                }
+                else
+                {
+                        p++;
+                }
+        }
+        return true;
+}
+
+/** 
+ * @node Classify trivial statements without the parser
+ *
+ * Parameters:
+ * @param query - in, use
+ *          The statement
+ *
+ * @param qtype - out, use
+ *          The query type
+ *
+ * @return true if the statement was recognized, false if it must be parsed
+ *
+ * 
+ * @details Recognizes BEGIN, START TRANSACTION, COMMIT, ROLLBACK, 
+ * SET autocommit=0|1, USE db and SELECTs without functions, variables or
+ * subqueries. The types are the ones resolve_query_type gives for them.
+ * START TRANSACTION may have the WITH CONSISTENT SNAPSHOT, READ ONLY and
+ * READ WRITE modifiers, READ ONLY adds QUERY_TYPE_READ_ONLY_TRX. They are
+ * recognized here since older parsers don't know the access modes. Other
+ * modifiers, like ROLLBACK TO SAVEPOINT, are left to the parser.
+ *
+ */
+static bool qc_fast_classify(
+        const char*         query,
+        skygw_query_type_t* qtype)
+{
+        const char* p;
+        const char* r;
+        int         value = -1;
+        
+        p = qc_skip_space(query);
+
+        if ((r = qc_match_word(p, "SELECT")) != NULL)
+        {
+                if (!qc_at_end(r) && qc_is_simple_select(r))
+                {
+                        *qtype = QUERY_TYPE_READ;
+                        return true;
+                }
+                return false;
+        }
+        if ((r = qc_match_word(p, "BEGIN")) != NULL ||
+            ((r = qc_match_word(p, "START")) != NULL &&
+             (r = qc_match_word(r, "TRANSACTION")) != NULL))
+        {
+                bool read_only = false;
+                
+                if (toupper((unsigned char)*p) == 'B' &&
+                    qc_match_word(r, "WORK") != NULL)
+                {
+                        r = qc_match_word(r, "WORK");
+                }
+                else if (toupper((unsigned char)*p) == 'S' && !qc_at_end(r))
+                {
+                        /** Modifiers separated by commas */
+                        for (;;)
+                        {
+                                const char* m;
+                                
+                                if ((m = qc_match_word(r, "WITH")) != NULL &&
+                                    (m = qc_match_word(m, "CONSISTENT")) != NULL &&
+                                    (m = qc_match_word(m, "SNAPSHOT")) != NULL)
+                                {
+                                        r = m;
+                                }
+                                else if ((m = qc_match_word(r, "READ")) != NULL &&
+                                         qc_match_word(m, "ONLY") != NULL)
+                                {
+                                        r = qc_match_word(m, "ONLY");
+                                        read_only = true;
+                                }
+                                else if ((m = qc_match_word(r, "READ")) != NULL &&
+                                         qc_match_word(m, "WRITE") != NULL)
+                                {
+                                        r = qc_match_word(m, "WRITE");
+                                }
+                                else
+                                {
+                                        return false;
+                                }
+                                if (*qc_skip_space(r) != ',')
+                                {
+                                        break;
+                                }
+                                r = qc_skip_space(r) + 1;
+                        }
+                }
+                if (qc_at_end(r))
+                {
+                        *qtype = (read_only ?
+                                  (skygw_query_type_t)(QUERY_TYPE_BEGIN_TRX|
+                                                       QUERY_TYPE_READ_ONLY_TRX) :
+                                  QUERY_TYPE_BEGIN_TRX);
+                        return true;
+                }
+                return false;
+        }
+        if ((r = qc_match_word(p, "COMMIT")) != NULL ||
+            (r = qc_match_word(p, "ROLLBACK")) != NULL)
+        {
+                skygw_query_type_t t = (toupper((unsigned char)*p) == 'C' ?
+                                        QUERY_TYPE_COMMIT :
+                                        QUERY_TYPE_ROLLBACK);
+                
+                if (qc_match_word(r, "WORK") != NULL)
+                {
+                        r = qc_match_word(r, "WORK");
+                }
+                if (qc_at_end(r))
+                {
+                        *qtype = t;
+                        return true;
+                }
+                return false;
+        }
+        if ((r = qc_match_word(p, "USE")) != NULL)
+        {
+                r = qc_skip_space(r);
+                
+                if (*r == '`')
+                {
+                        r = strchr(r+1, '`');
+                        
+                        if (r == NULL)
+                        {
+                                return false;
+                        }
+                        r++;
+                }
+                else
+                {
+                        while (isalnum((unsigned char)*r) || *r == '_' || *r == '$')
+                        {
+                                r++;
+                        }
+                }
+                if (qc_at_end(r))
+                {
+                        *qtype = QUERY_TYPE_SESSION_WRITE;
+                        return true;
+                }
+                return false;
+        }
+        if ((r = qc_match_word(p, "SET")) != NULL)
+        {
+                r = qc_skip_space(r);
+                
+                if (strncmp(r, "@@", 2) == 0)
+                {
+                        r += 2;
+                        
+                        if (strncasecmp(r, "session.", 8) == 0)
+                        {
+                                r += 8;
+                        }
+                }
+                else if (qc_match_word(r, "SESSION") != NULL)
+                {
+                        r = qc_match_word(r, "SESSION");
+                }
+                if ((r = qc_match_word(r, "AUTOCOMMIT")) == NULL)
+                {
+                        return false;
+                }
+                r = qc_skip_space(r);
+                
+                if (*r != '=')
+                {
+                        return false;
+                }
+                r++;
+                
+                if ((p = qc_match_word(r, "1")) != NULL ||
+                    (p = qc_match_word(r, "ON")) != NULL ||
+                    (p = qc_match_word(r, "TRUE")) != NULL)
+                {
+                        value = 1;
+                }
+                else if ((p = qc_match_word(r, "0")) != NULL ||
+                         (p = qc_match_word(r, "OFF")) != NULL ||
+                         (p = qc_match_word(r, "FALSE")) != NULL)
+                {
+                        value = 0;
+                }
+                if (value == -1 || !qc_at_end(p))
+                {
+                        return false;
+                }
+                if (value == 1)
+                {
+                        *qtype = (skygw_query_type_t)(QUERY_TYPE_ENABLE_AUTOCOMMIT|
+                                                      QUERY_TYPE_COMMIT|
+                                                      QUERY_TYPE_SESSION_WRITE);
+                }
+                else
+                {
+                        *qtype = (skygw_query_type_t)(QUERY_TYPE_DISABLE_AUTOCOMMIT|
+                                                      QUERY_TYPE_BEGIN_TRX|
+                                                      QUERY_TYPE_SESSION_WRITE);
+                }
+                return true;
+        }
+        return false;
+}
+
+/** 
+ * @node Check that a DML statement can't change the session or commit
+ *
+ * Parameters:
+ * @param p - in, use
+ *          The statement after its first keyword
+ *
+ * @param is_select - in, use
+ *          true if the statement is a SELECT
+ *
+ * @return true if the statement has no user variables, no comments, no
+ * other statements after it and, for a SELECT, no INTO
+ *
+ * 
+ * @details User variables are session state and comments may include
+ * executable code, such statements are left to the parser. INSERT INTO
+ * names the table so INTO is accepted for the other statements.
+ *
+ */
+static bool qc_is_plain_dml(
+        const char* p,
+        bool        is_select)
+{
+        const char* w;
+        char        q;
 
-static int is_autocommit_stmt(
-        LEX* lex);
+        while (*p != '\0')
+        {
+                if (isalpha((unsigned char)*p) || *p == '_' || *p == '$')
+                {
+                        w = p;
+                        
+                        while (isalnum((unsigned char)*p) || *p == '_' || *p == '$')
+                        {
+                                p++;
+                        }
+                        if (is_select &&
+                            p - w == 4 && strncasecmp(w, "INTO", 4) == 0)
+                        {
+                                return false;
+                        }
+                }
+                else if (*p == '\'' || *p == '"' || *p == '`')
+                {
+                        q = *p++;
+                        
+                        while (*p != '\0' && *p != q)
+                        {
+                                if (*p == '\\' && q != '`' && p[1] != '\0')
+                                {
+                                        p++;
+                                }
+                                p++;
+                        }
+                        if (*p == '\0')
+                        {
+                                return false;
+                        }
+                        p++;
+                }
+                else if (*p == ';')
+                {
+                        return qc_at_end(p);
+                }
+                else if (*p == '@' || *p == '#' ||
+                         (*p == '/' && p[1] == '*') ||
+                         (*p == '-' && p[1] == '-'))
+                {
+                        return false;
+                }
+                else
+                {
+                        p++;
+                }
+        }
+        return true;
+}
 
 /** 
- * @node (write brief function description here) 
+ * @node Find the transaction boundaries of a statement without the parser
  *
  * Parameters:
- * @param query_str - <usage>
- *          <description>
+ * @param query - in, use
+ *          The statement
  *
- * @param client_flag - <usage>
- *          <description>
+ * @param qtype - out, use
+ *          The query type
  *
- * @return 
+ * @return true if the tokenizer recognized the statement, false if the
+ * full type from skygw_query_classifier_get_type is needed
  *
  * 
- * @details (write detailed description here)
+ * @details For routers that only need to know whether a statement begins
+ * or ends a transaction, changes autocommit or the session, like the ones
+ * that route everything of an active transaction to the master. The
+ * trivial statements get their full types. SELECT, INSERT, UPDATE, DELETE
+ * and REPLACE without user variables and comments get QUERY_TYPE_READ or
+ * QUERY_TYPE_WRITE, which is right for the routing in a transaction but
+ * may be wrong outside one, a SELECT can call a function that writes.
+ * Anything else, including the statements which commit implicitly, is
+ * left to the parser.
  *
  */
-skygw_query_type_t skygw_query_classifier_get_type(
-        const char*   query,
-        unsigned long client_flags,
-        MYSQL**       p_mysql)
+bool skygw_query_classifier_get_trx_type(
+        const char*         query,
+        skygw_query_type_t* qtype)
 {
-        MYSQL*      mysql;
-        char*       query_str;
-        const char* user  = "skygw";
-        const char* db    = "skygw";
-        THD*        thd;
-        skygw_query_type_t qtype = QUERY_TYPE_UNKNOWN;
-        bool        failp = FALSE;
-
-        ss_info_dassert(query != NULL, ("query_str is NULL"));
+        const char* p;
+        const char* r;
+        bool        succp = true;
         
-        query_str = const_cast<char*>(query);
-        LOGIF(LT, (skygw_log_write(
-                LOGFILE_TRACE,
-                "Query : \"%s\"", query_str)));
+        ss_info_dassert(query != NULL, ("query_str is NULL"));
         
-        /** Get server handle */
-        mysql = mysql_init(NULL);
+        p = qc_skip_space(query);
         
-        if (mysql == NULL) {
-                LOGIF(LE, (skygw_log_write_flush(
-                        LOGFILE_ERROR,
-                        "Error : call to mysql_real_connect failed due %d, %s.",
-                        mysql_errno(mysql),
-                        mysql_error(mysql))));
-                
-                mysql_library_end();
-                goto return_qtype;
+        if (qc_fast_classify(query, qtype))
+        {
+                goto return_succp;
         }
-
-        if (p_mysql != NULL)
+        if ((r = qc_match_word(p, "SELECT")) != NULL)
         {
-                *p_mysql = mysql;
+                if (qc_is_plain_dml(r, true))
+                {
+                        *qtype = QUERY_TYPE_READ;
+                        goto return_succp;
+                }
         }
-        /** Set methods and authentication to mysql */
-        mysql_options(mysql, MYSQL_READ_DEFAULT_GROUP, "libmysqld_skygw");
-        mysql_options(mysql, MYSQL_OPT_USE_EMBEDDED_CONNECTION, NULL);
-        mysql->methods = &embedded_methods;
-        mysql->user    = my_strdup(user, MYF(0));
-        mysql->db      = my_strdup(db, MYF(0));
-        mysql->passwd  = NULL;
-        
-        /** Get one or create new THD object to be use in parsing */
-        thd = get_or_create_thd_for_parsing(mysql, query_str);
-
-        if (thd == NULL) 
+        else if ((r = qc_match_word(p, "INSERT")) != NULL ||
+                 (r = qc_match_word(p, "UPDATE")) != NULL ||
+                 (r = qc_match_word(p, "DELETE")) != NULL ||
+                 (r = qc_match_word(p, "REPLACE")) != NULL)
         {
-                skygw_query_classifier_free(mysql);
-                *p_mysql = NULL;
-                goto return_qtype;
+                if (qc_is_plain_dml(r, false))
+                {
+                        *qtype = QUERY_TYPE_WRITE;
+                        goto return_succp;
+                }
         }
-        /** 
-         * Create parse_tree inside thd.
-         * thd and even lex are readable even if parser failed so let it 
-         * continue despite failure.
-         */
-        failp = create_parse_tree(thd);
-        qtype = resolve_query_type(thd);
-
-        if (p_mysql == NULL)
+        succp = false;
+        
+return_succp:
+        if (succp)
         {
-                skygw_query_classifier_free(mysql);
+                __sync_fetch_and_add(&qc_cache_stats.qcs_fast, 1);
         }
-return_qtype:
-        return qtype;
+        return succp;
 }
 
-
+/** 
+ * @node Release a handle returned by skygw_query_classifier_get_type
+ *
+ * Parameters:
+ * @param mysql - in, use
+ *          The handle
+ *
+ * @return void
+ *
+ * 
+ * @details The handle of the calling thread is only reset and kept for
+ * the next statement, other handles are closed.
+ *
+ */
 void skygw_query_classifier_free(
         MYSQL* mysql)
 {
-        if (mysql->thd != NULL)
+        if (mysql == qc_thread_mysql)
         {
-                (*mysql->methods->free_embedded_thd)(mysql);
-                mysql->thd = NULL;
+                if (mysql->thd != NULL)
+                {
+                        reset_thd_for_next_query((THD *)mysql->thd);
+                }
+                qc_thread_mysql_busy = false;
+                return;
         }
-        mysql_close(mysql);
-        mysql_thread_end();
+        qc_mysql_done(mysql);
 }        
 
 
@@ -217,29 +1768,33 @@ static THD* get_or_create_thd_for_parsing(
         query_len = strlen(query_str);
         client_flags = set_client_flags(mysql);
         
-        /** Get THD.
-         * NOTE: Instead of creating new every time, THD instance could
-         * be get from a pool of them.
-         */
-        thd = (THD *)create_embedded_thd(client_flags);
-
-        if (thd == NULL) {
-                LOGIF(LE, (skygw_log_write_flush(
-                        LOGFILE_ERROR,
-                        "Error : Failed to create thread context for parsing. "
-                        "Exiting.")));
-                goto return_thd;
+        /** Get THD, the one of a reused handle or a new one. */
+        if (mysql->thd != NULL)
+        {
+                thd = (THD *)mysql->thd;
         }
-        mysql->thd = thd;
-        init_embedded_mysql(mysql, client_flags);
-        failp = check_embedded_connection(mysql, db);
+        else
+        {
+                thd = (THD *)create_embedded_thd(client_flags);
 
-        if (failp) {
-                LOGIF(LE, (skygw_log_write_flush(
-                        LOGFILE_ERROR,
-                        "Error : Call to check_embedded_connection failed. "
-                        "Exiting.")));
-                goto return_err_with_thd;
+                if (thd == NULL) {
+                        LOGIF(LE, (skygw_log_write_flush(
+                                LOGFILE_ERROR,
+                                "Error : Failed to create thread context for parsing. "
+                                "Exiting.")));
+                        goto return_thd;
+                }
+                mysql->thd = thd;
+                init_embedded_mysql(mysql, client_flags);
+                failp = check_embedded_connection(mysql, db);
+
+                if (failp) {
+                        LOGIF(LE, (skygw_log_write_flush(
+                                LOGFILE_ERROR,
+                                "Error : Call to check_embedded_connection failed. "
+                                "Exiting.")));
+                        goto return_err_with_thd;
+                }
         }
         thd->clear_data_list();
 
@@ -525,6 +2080,13 @@ static skygw_query_type_t resolve_query_type(
                         
                 case SQLCOM_BEGIN:
                         type |= QUERY_TYPE_BEGIN_TRX;
+#if defined(MYSQL_START_TRANS_OPT_READ_ONLY)
+                        if (lex->start_transaction_opt &
+                            MYSQL_START_TRANS_OPT_READ_ONLY)
+                        {
+                                type |= QUERY_TYPE_READ_ONLY_TRX;
+                        }
+#endif
                         goto return_qtype;
                         break;
                 
@@ -816,3 +2378,168 @@ char* skygw_query_classifier_get_stmtname(
         return ((THD *)(mysql->thd))->lex->prepared_stmt_name.str;
         
 }
+
+/** 
+ * @node Pack the names of the tables of a parsed statement
+ *
+ * Parameters:
+ * @param thd - in, use
+ *          The THD of the parse
+ *
+ * @param n_tables - out, use
+ *          The number of names, -1 if the memory couldn't be allocated
+ *
+ * @param len - out, use
+ *          The length of the packed names
+ *
+ * @return The names, each one followed by a NUL, or NULL if the memory
+ * couldn't be allocated. The caller must free the names.
+ *
+ * 
+ * @details A name is db.table when the database is given and table when it
+ * isn't. Tables without a database get the virtual one of the parse. Each
+ * name is packed once.
+ *
+ */
+static char* qc_get_table_list(
+        THD*    thd,
+        int*    n_tables,
+        size_t* len)
+{
+        TABLE_LIST* tbl;
+        char*       packed;
+        char*       p;
+        char*       q;
+        size_t      size = 1;
+        int         i;
+        
+        *n_tables = -1;
+        *len = 0;
+        
+        for (tbl = thd->lex->query_tables; tbl != NULL; tbl = tbl->next_global)
+        {
+                size += strlen(tbl->db != NULL ? tbl->db : "") +
+                        strlen(tbl->table_name) + 2;
+        }
+        
+        if ((packed = (char *)malloc(size)) == NULL)
+        {
+                return NULL;
+        }
+        *n_tables = 0;
+        p = packed;
+        
+        for (tbl = thd->lex->query_tables; tbl != NULL; tbl = tbl->next_global)
+        {
+                if (tbl->db == NULL || *tbl->db == '\0' ||
+                    strcmp(tbl->db, thd->db) == 0)
+                {
+                        strcpy(p, tbl->table_name);
+                }
+                else
+                {
+                        sprintf(p, "%s.%s", tbl->db, tbl->table_name);
+                }
+                
+                for (i = 0, q = packed; i < *n_tables; i++, q += strlen(q) + 1)
+                {
+                        if (strcmp(q, p) == 0)
+                        {
+                                break;
+                        }
+                }
+                if (i == *n_tables)
+                {
+                        p += strlen(p) + 1;
+                        *n_tables += 1;
+                }
+        }
+        *len = p - packed;
+        return packed;
+}
+
+/** 
+ * @node Copy packed table names to an array
+ *
+ * Parameters:
+ * @param packed - in, use
+ *          The names packed by qc_get_table_list
+ *
+ * @param n_tables - in, use
+ *          The number of names
+ *
+ * @return An array of n_tables names and a NULL, or NULL if the memory
+ * couldn't be allocated. The array and each name must be freed by the
+ * caller.
+ *
+ */
+static char** qc_unpack_tables(
+        const char* packed,
+        int         n_tables)
+{
+        char** names;
+        int    i;
+        
+        if ((names = (char **)malloc((n_tables + 1) * sizeof(char *))) == NULL)
+        {
+                return NULL;
+        }
+        
+        for (i = 0; i < n_tables; i++)
+        {
+                if ((names[i] = strdup(packed)) == NULL)
+                {
+                        while (i > 0)
+                        {
+                                free(names[--i]);
+                        }
+                        free(names);
+                        return NULL;
+                }
+                packed += strlen(packed) + 1;
+        }
+        names[n_tables] = NULL;
+        return names;
+}
+
+/** Length of the names packed by qc_get_table_list, 0 if n_tables is -1 */
+static size_t qc_packed_tables_len(
+        const char* packed,
+        int         n_tables)
+{
+        const char* p = packed;
+        
+        while (n_tables-- > 0)
+        {
+                p += strlen(p) + 1;
+        }
+        return p - packed;
+}
+
+/** 
+ * @node Parse a statement and return the names of the tables it uses.
+ *
+ * Parameters:
+ * @param query - in, use
+ *          The statement
+ *
+ * @param n_tables - out
+ *          The number of names returned
+ *
+ * @return An array of n_tables names, db.table when the database is given
+ * and table when it isn't, or NULL if the statement couldn't be parsed.
+ * The array and each name must be freed by the caller.
+ *
+ * @details The names are cached with the query type, a statement that was
+ * classified before isn't parsed again. Each name is returned once.
+ *
+ */
+char** skygw_query_classifier_get_tables(
+        const char* query,
+        int*        n_tables)
+{
+        char** names;
+        
+        qc_classify(query, 0, NULL, &names, n_tables);
+        return names;
+}
@@ -43,7 +43,8 @@ typedef enum {
     QUERY_TYPE_COMMIT             = 0x0200,  /*< COMMIT */
     QUERY_TYPE_PREPARE_NAMED_STMT = 0x0400,  /*< Prepared stmt with name from user */
     QUERY_TYPE_PREPARE_STMT       = 0x0800,  /*< Prepared stmt with id provided by server */
-    QUERY_TYPE_EXEC_STMT          = 0x1000   /*< Execute prepared statement */
+    QUERY_TYPE_EXEC_STMT          = 0x1000,  /*< Execute prepared statement */
+    QUERY_TYPE_READ_ONLY_TRX      = 0x2000   /*< START TRANSACTION READ ONLY */
 } skygw_query_type_t;
 
 #define QUERY_IS_TYPE(mask,type) ((mask & type) == type)
@@ -57,9 +58,51 @@ skygw_query_type_t skygw_query_classifier_get_type(
         unsigned long client_flags,
         MYSQL**       mysql);
 
+/**
+ * Transaction boundaries, autocommit and session changes of the query by a
+ * tokenizer. Returns false if the query needs skygw_query_classifier_get_type.
+ */
+bool skygw_query_classifier_get_trx_type(
+        const char*         query_str,
+        skygw_query_type_t* qtype);
+
+/** Statistics of the query classification cache */
+typedef struct skygw_qc_cache_stats_st {
+        int           qcs_size;      /*< max # of cached digests */
+        int           qcs_entries;   /*< current # of cached digests */
+        unsigned long qcs_hits;      /*< types found from the cache */
+        unsigned long qcs_misses;    /*< statements parsed after a lookup */
+        unsigned long qcs_evictions; /*< digests evicted from a full cache */
+        unsigned long qcs_fast;      /*< trivial statements classified without parsing */
+} skygw_qc_cache_stats_t;
+
+void skygw_query_classifier_get_cache_stats(skygw_qc_cache_stats_t* stats);
+
+/**
+ * Write the cached digests, types and table names to a file, and read them
+ * back into the cache. A file written by another MaxScale version or
+ * classifier build is not loaded. Both return the # of entries or -1.
+ */
+int skygw_query_classifier_cache_save(const char* fname, const char* version);
+int skygw_query_classifier_cache_load(const char* fname, const char* version);
+
 /** Free THD context and close MYSQL */
 void  skygw_query_classifier_free(MYSQL* mysql);
 char* skygw_query_classifier_get_stmtname(MYSQL* mysql);
 
+/** Names of the tables of a statement, db.table or table */
+char** skygw_query_classifier_get_tables(const char* query, int* n_tables);
+
+/**
+ * Classify the query and return the names of its tables from the same parse.
+ * The names are cached with the type, tables is NULL if the parse failed.
+ */
+skygw_query_type_t skygw_query_classifier_get_type_tables(
+        const char*   query_str,
+        unsigned long client_flags,
+        MYSQL**       mysql,
+        char***       tables,
+        int*          n_tables);
+
 EXTERN_C_BLOCK_END
 
@@ -0,0 +1,597 @@
+/*
+This file is distributed as part of the SkySQL Gateway. It is free
+software: you can redistribute it and/or modify it under the terms of the
+GNU General Public License as published by the Free Software Foundation,
+version 2.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 51
+Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+Copyright SkySQL Ab
+
+*/
+
+/**
+ * @file benchqc.c - Throughput of skygw_query_classifier_get_type
+ *
+ * A corpus of statements is classified by 1, 2, 4, ... threads up to the
+ * given thread count, each thread goes through the whole corpus starting
+ * from a different statement. The corpus is generated unless a file with
+ * one statement in each line is given. It mixes point and range SELECTs,
+ * joins, SELECTs with long IN-lists, INSERTs of several rows, UPDATEs,
+ * DELETEs, SET statements and transactions, the literals differ from one
+ * statement to the next. With -u the table names differ too, so that no
+ * two statements have the same digest and every statement that isn't
+ * classified by the fast path is parsed.
+ *
+ * The first result is that of the first pass, in which the cache is
+ * empty. The allocations are counted in a separate single threaded pass
+ * over the corpus, the counters of malloc aren't updated in the timed
+ * runs. Each result is a line of JSON, e.g.
+ *
+ * {"bench":"qc_get_type","threads":4,"statements":400000,"nsec":812345678,
+ *      "stmts_per_sec":492403,"hits":312000,"misses":8000,"fast":80000}
+ * {"bench":"qc_allocs","statements":100000,"allocs_per_stmt":12.500,
+ *      "bytes_per_stmt":2304.000}
+ *
+ *      benchqc [-t threads] [-n statements] [-p passes] [-u] [-f corpus]
+ */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <mysql.h>
+
+#include "../../utils/skygw_utils.h"
+#include "../query_classifier.h"
+
+#define BENCH_MAX_THREADS 64
+#define BENCH_MAX_STMT    16384 /*< longest statement of a corpus file */
+
+static char datadir[1024] = "";
+static char mysqldir[1024] = "";
+
+static char* server_options[] = {
+        "SkySQL Gateway",
+        "--datadir=",
+        "--default-storage-engine=myisam",
+        NULL
+};
+
+const int num_elements = (sizeof(server_options) / sizeof(char *)) - 1;
+
+static char* server_groups[] = {
+        "embedded",
+        "server",
+        "server",
+        NULL
+};
+
+/**
+ * The allocations of the process, counted while bench_count_allocs is set.
+ * The functions of glibc are wrapped, the embedded server and the C++ new
+ * use them too.
+ */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static volatile int  bench_count_allocs;
+static unsigned long bench_nallocs;
+static unsigned long bench_nbytes;
+
+void* malloc(
+        size_t size)
+{
+        if (bench_count_allocs)
+        {
+                __sync_fetch_and_add(&bench_nallocs, 1);
+                __sync_fetch_and_add(&bench_nbytes, size);
+        }
+        return __libc_malloc(size);
+}
+
+void* calloc(
+        size_t n,
+        size_t size)
+{
+        if (bench_count_allocs)
+        {
+                __sync_fetch_and_add(&bench_nallocs, 1);
+                __sync_fetch_and_add(&bench_nbytes, n * size);
+        }
+        return __libc_calloc(n, size);
+}
+
+void* realloc(
+        void*  ptr,
+        size_t size)
+{
+        if (bench_count_allocs)
+        {
+                __sync_fetch_and_add(&bench_nallocs, 1);
+                __sync_fetch_and_add(&bench_nbytes, size);
+        }
+        return __libc_realloc(ptr, size);
+}
+
+typedef struct bench_corpus_st {
+        char** bc_stmts;
+        int    bc_nstmts;
+        int    bc_size;
+} bench_corpus_t;
+
+typedef struct bench_thread_st {
+        pthread_t       bt_thread;
+        bench_corpus_t* bt_corpus;
+        int             bt_first;   /*< index of the first statement */
+        int             bt_passes;  /*< times the corpus is classified */
+        volatile int*   bt_start;
+} bench_thread_t;
+
+static void corpus_add(
+        bench_corpus_t* corpus,
+        const char*     stmt)
+{
+        if (corpus->bc_nstmts == corpus->bc_size)
+        {
+                corpus->bc_size = (corpus->bc_size == 0 ? 1024 :
+                                   corpus->bc_size * 2);
+                corpus->bc_stmts = (char **)realloc(
+                        corpus->bc_stmts,
+                        corpus->bc_size * sizeof(char *));
+                ss_dassert(corpus->bc_stmts != NULL);
+        }
+        corpus->bc_stmts[corpus->bc_nstmts++] = strdup(stmt);
+}
+
+/**
+ * @node Read a corpus, one statement in each line
+ *
+ * Parameters:
+ * @param corpus - out, use
+ *          The statements are added here
+ *
+ * @param fname - in, use
+ *          The file, empty lines and lines starting with # are skipped
+ *
+ * @return true if the file was read
+ */
+static bool corpus_read(
+        bench_corpus_t* corpus,
+        const char*     fname)
+{
+        FILE* fp;
+        char  line[BENCH_MAX_STMT];
+        int   len;
+
+        if ((fp = fopen(fname, "r")) == NULL)
+        {
+                fprintf(stderr,
+                        "Failed to open %s due %d, %s\n",
+                        fname,
+                        errno,
+                        strerror(errno));
+                return false;
+        }
+        while (fgets(line, sizeof(line), fp) != NULL)
+        {
+                len = strlen(line);
+
+                while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r'))
+                {
+                        line[--len] = '\0';
+                }
+                if (len > 0 && line[0] != '#')
+                {
+                        corpus_add(corpus, line);
+                }
+        }
+        fclose(fp);
+        return true;
+}
+
+/**
+ * @node Generate a corpus
+ *
+ * Parameters:
+ * @param corpus - out, use
+ *          The statements are added here
+ *
+ * @param nstmts - in, use
+ *          The number of statements
+ *
+ * @param unique - in, use
+ *          Use a different table in each statement
+ *
+ * @return void
+ *
+ *
+ * @details The mix is roughly that of an OLTP application: most of the
+ * statements are reads, a fifth are writes and the rest are SET statements
+ * and the statements of the transactions.
+ *
+ */
+static void corpus_generate(
+        bench_corpus_t* corpus,
+        int             nstmts,
+        bool            unique)
+{
+        char  stmt[BENCH_MAX_STMT];
+        char  tbl[32];
+        int   i;
+        int   j;
+        int   n;
+        int   len;
+
+        srandom(1);
+
+        for (i = 0; i < nstmts; i++)
+        {
+                n = random();
+
+                if (unique)
+                {
+                        snprintf(tbl, sizeof(tbl), "t%d", i);
+                }
+                else
+                {
+                        snprintf(tbl, sizeof(tbl), "t%d", n % 8);
+                }
+                switch (i % 20) {
+                case 0: case 1: case 2: case 3:
+                        snprintf(stmt, sizeof(stmt),
+                                 "SELECT c, pad FROM %s WHERE id = %d",
+                                 tbl, n % 100000);
+                        break;
+                case 4: case 5:
+                        snprintf(stmt, sizeof(stmt),
+                                 "SELECT c FROM %s WHERE id BETWEEN %d AND %d "
+                                 "ORDER BY c LIMIT 100",
+                                 tbl, n % 100000, n % 100000 + 100);
+                        break;
+                case 6:
+                        snprintf(stmt, sizeof(stmt),
+                                 "SELECT o.id, o.total, c.name FROM orders_%s o "
+                                 "JOIN customers c ON c.id = o.customer_id "
+                                 "LEFT JOIN regions r ON r.id = c.region_id "
+                                 "WHERE o.created > '2014-0%d-01' AND "
+                                 "r.name <> 'test' GROUP BY o.id, c.name "
+                                 "HAVING SUM(o.total) > %d",
+                                 tbl, 1 + n % 9, n % 1000);
+                        break;
+                case 7: case 8:
+                        /** IN-list of 20 to 520 values */
+                        len = snprintf(stmt, sizeof(stmt),
+                                       "SELECT id, c FROM %s WHERE id IN (%d",
+                                       tbl, n % 100000);
+
+                        for (j = 0; j < 20 + n % 500; j++)
+                        {
+                                len += snprintf(stmt + len, sizeof(stmt) - len,
+                                                ", %d", (n + j * 7919) % 100000);
+                        }
+                        snprintf(stmt + len, sizeof(stmt) - len, ")");
+                        break;
+                case 9:
+                        snprintf(stmt, sizeof(stmt),
+                                 "SELECT COUNT(*) FROM %s WHERE k = %d", tbl,
+                                 n % 1000);
+                        break;
+                case 10:
+                        snprintf(stmt, sizeof(stmt), "SELECT 1");
+                        break;
+                case 11:
+                        snprintf(stmt, sizeof(stmt), "SELECT @@max_allowed_packet");
+                        break;
+                case 12:
+                        snprintf(stmt, sizeof(stmt),
+                                 "INSERT INTO %s (id, k, c, pad) VALUES "
+                                 "(%d, %d, 'c-%d', 'pad'), (%d, %d, 'c-%d', 'pad'), "
+                                 "(%d, %d, 'c-%d', 'pad')",
+                                 tbl, n, n % 1000, n, n + 1, n % 1000, n + 1,
+                                 n + 2, n % 1000, n + 2);
+                        break;
+                case 13:
+                        snprintf(stmt, sizeof(stmt),
+                                 "UPDATE %s SET k = k + 1 WHERE id = %d",
+                                 tbl, n % 100000);
+                        break;
+                case 14:
+                        snprintf(stmt, sizeof(stmt),
+                                 "UPDATE %s SET c = 'c-%d' WHERE id = %d",
+                                 tbl, n, n % 100000);
+                        break;
+                case 15:
+                        snprintf(stmt, sizeof(stmt),
+                                 "DELETE FROM %s WHERE id = %d",
+                                 tbl, n % 100000);
+                        break;
+                case 16:
+                        snprintf(stmt, sizeof(stmt),
+                                 (n % 2 == 0 ? "BEGIN" : "START TRANSACTION"));
+                        break;
+                case 17:
+                        snprintf(stmt, sizeof(stmt),
+                                 (n % 4 == 0 ? "ROLLBACK" : "COMMIT"));
+                        break;
+                case 18:
+                        snprintf(stmt, sizeof(stmt), "SET autocommit=%d", n % 2);
+                        break;
+                case 19:
+                        if (n % 2 == 0)
+                        {
+                                snprintf(stmt, sizeof(stmt), "SET @v%d = %d",
+                                         n % 16, n);
+                        }
+                        else
+                        {
+                                snprintf(stmt, sizeof(stmt),
+                                         "SET NAMES utf8");
+                        }
+                        break;
+                }
+                corpus_add(corpus, stmt);
+        }
+}
+
+static void* bench_thread(
+        void* data)
+{
+        bench_thread_t* bt = (bench_thread_t *)data;
+        bench_corpus_t* corpus = bt->bt_corpus;
+        int             i;
+        int             p;
+
+        mysql_thread_init();
+
+        while (!*bt->bt_start)
+        {
+                ;
+        }
+        for (p = 0; p < bt->bt_passes; p++)
+        {
+                for (i = 0; i < corpus->bc_nstmts; i++)
+                {
+                        skygw_query_classifier_get_type(
+                                corpus->bc_stmts[(bt->bt_first + i) %
+                                                 corpus->bc_nstmts],
+                                0,
+                                NULL);
+                }
+        }
+        mysql_thread_end();
+        return NULL;
+}
+
+static unsigned long long bench_nsec(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @node Classify the corpus in some threads and print the rate
+ *
+ * Parameters:
+ * @param corpus - in, use
+ *          The statements
+ *
+ * @param nthreads - in, use
+ *          The number of threads
+ *
+ * @param passes - in, use
+ *          The times each thread classifies the corpus
+ *
+ * @param name - in, use
+ *          The name of the result
+ *
+ * @return void
+ */
+static void bench_run(
+        bench_corpus_t* corpus,
+        int             nthreads,
+        int             passes,
+        const char*     name)
+{
+        bench_thread_t         threads[BENCH_MAX_THREADS];
+        volatile int           start = 0;
+        skygw_qc_cache_stats_t before;
+        skygw_qc_cache_stats_t after;
+        unsigned long long     t0;
+        unsigned long long     nsec;
+        unsigned long          nstmts;
+        int                    i;
+
+        for (i = 0; i < nthreads; i++)
+        {
+                threads[i].bt_corpus = corpus;
+                threads[i].bt_first = (int)((long)corpus->bc_nstmts * i / nthreads);
+                threads[i].bt_passes = passes;
+                threads[i].bt_start = &start;
+                pthread_create(&threads[i].bt_thread, NULL, bench_thread,
+                               &threads[i]);
+        }
+        skygw_query_classifier_get_cache_stats(&before);
+        t0 = bench_nsec();
+        start = 1;
+
+        for (i = 0; i < nthreads; i++)
+        {
+                pthread_join(threads[i].bt_thread, NULL);
+        }
+        nsec = bench_nsec() - t0;
+        skygw_query_classifier_get_cache_stats(&after);
+        nstmts = (unsigned long)corpus->bc_nstmts * passes * nthreads;
+
+        printf("{\"bench\":\"%s\",\"threads\":%d,\"statements\":%lu,"
+               "\"nsec\":%llu,\"stmts_per_sec\":%.0f,\"hits\":%lu,"
+               "\"misses\":%lu,\"fast\":%lu}\n",
+               name,
+               nthreads,
+               nstmts,
+               nsec,
+               nsec > 0 ? (double)nstmts * 1000000000.0 / nsec : 0.0,
+               after.qcs_hits - before.qcs_hits,
+               after.qcs_misses - before.qcs_misses,
+               after.qcs_fast - before.qcs_fast);
+        fflush(stdout);
+}
+
+/**
+ * @node Count the allocations of one pass over the corpus
+ *
+ * Parameters:
+ * @param corpus - in, use
+ *          The statements, the corpus has been classified before so the
+ *          cache and the handle of the thread are warm
+ *
+ * @return void
+ */
+static void bench_allocs(
+        bench_corpus_t* corpus)
+{
+        int i;
+
+        bench_nallocs = 0;
+        bench_nbytes = 0;
+        bench_count_allocs = 1;
+
+        for (i = 0; i < corpus->bc_nstmts; i++)
+        {
+                skygw_query_classifier_get_type(corpus->bc_stmts[i], 0, NULL);
+        }
+        bench_count_allocs = 0;
+
+        printf("{\"bench\":\"qc_allocs\",\"statements\":%d,"
+               "\"allocs_per_stmt\":%.3f,\"bytes_per_stmt\":%.3f}\n",
+               corpus->bc_nstmts,
+               (double)bench_nallocs / corpus->bc_nstmts,
+               (double)bench_nbytes / corpus->bc_nstmts);
+        fflush(stdout);
+}
+
+static void usage(
+        const char* progname)
+{
+        fprintf(stderr,
+                "Usage: %s [-t threads] [-n statements] [-p passes] [-u] "
+                "[-f corpus]\n",
+                progname);
+}
+
+int main(int argc, char** argv)
+{
+        bench_corpus_t corpus;
+        char*          workingdir;
+        char           ddoption[1024];
+        char*          fname = NULL;
+        int            maxthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        int            nstmts = 100000;
+        int            passes = 1;
+        bool           unique = false;
+        int            nthreads;
+        int            opt;
+
+        while ((opt = getopt(argc, argv, "t:n:p:uf:")) != -1)
+        {
+                switch (opt) {
+                case 't': maxthreads = atoi(optarg); break;
+                case 'n': nstmts = atoi(optarg); break;
+                case 'p': passes = atoi(optarg); break;
+                case 'u': unique = true; break;
+                case 'f': fname = optarg; break;
+                default:
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+        if (maxthreads < 1 || maxthreads > BENCH_MAX_THREADS ||
+            nstmts < 1 || passes < 1)
+        {
+                usage(argv[0]);
+                return 1;
+        }
+        memset(&corpus, 0, sizeof(corpus));
+
+        if (fname != NULL)
+        {
+                if (!corpus_read(&corpus, fname))
+                {
+                        return 1;
+                }
+                if (corpus.bc_nstmts == 0)
+                {
+                        fprintf(stderr, "No statements in %s\n", fname);
+                        return 1;
+                }
+        }
+        else
+        {
+                corpus_generate(&corpus, nstmts, unique);
+        }
+        /**
+         * Init libmysqld, the data directory is created in the working
+         * directory as in testmain.
+         */
+        workingdir = getenv("PWD");
+
+        if (workingdir == NULL || access(workingdir, R_OK) != 0)
+        {
+                fprintf(stderr,
+                        "Failed to access the working directory, $PWD is "
+                        "not set or readable.\n");
+                return 1;
+        }
+        else
+        {
+                char** so = server_options;
+                snprintf(datadir, 1023, "%s/data", workingdir);
+                mkdir(datadir, 0777);
+                snprintf(ddoption, 1023, "--datadir=%s", datadir);
+
+                while (strncmp(*so++, "--datadir=", 10) != 0) ;
+                *(so-1) = ddoption;
+
+                snprintf(mysqldir, 1023, "%s/mysql", workingdir);
+                setenv("MYSQL_HOME", mysqldir, 1);
+        }
+        if (mysql_library_init(num_elements, server_options, server_groups))
+        {
+                fprintf(stderr, "mysql_library_init failed\n");
+                return 1;
+        }
+        /**
+         * The first pass parses the statements into the cache and creates
+         * the handle of this thread, the type of each statement is looked
+         * up from the cache in the following passes.
+         */
+        bench_run(&corpus, 1, 1, "qc_get_type_cold");
+        bench_allocs(&corpus);
+
+        for (nthreads = 1; nthreads <= maxthreads; nthreads *= 2)
+        {
+                bench_run(&corpus, nthreads, passes, "qc_get_type");
+
+                if (nthreads < maxthreads && nthreads * 2 > maxthreads)
+                {
+                        nthreads = maxthreads / 2;
+                }
+        }
+        mysql_library_end();
+        return 0;
+}
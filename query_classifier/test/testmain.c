@@ -441,6 +441,46 @@ int main(int argc, char** argv)
                 nsucc,
                 nfail);
 
+        /**
+         * The tokenizer of skygw_query_classifier_get_trx_type must agree
+         * with the parser on the transaction boundaries and session changes
+         * whenever it recognizes a statement.
+         */
+        fprintf(stderr, "\nTransaction boundaries by the tokenizer :\n\n");
+        succp = slcursor_move_to_begin(c);
+        
+        while(succp) {
+                skygw_query_type_t trx_type;
+                skygw_query_type_t mask = (skygw_query_type_t)
+                        (QUERY_TYPE_SESSION_WRITE|QUERY_TYPE_BEGIN_TRX|
+                         QUERY_TYPE_ENABLE_AUTOCOMMIT|
+                         QUERY_TYPE_DISABLE_AUTOCOMMIT|
+                         QUERY_TYPE_ROLLBACK|QUERY_TYPE_COMMIT);
+                
+                qtest = slcursor_get_case(c);
+                
+                if (skygw_query_classifier_get_trx_type(
+                            query_test_get_querystr(qtest), &trx_type))
+                {
+                        if ((trx_type & mask) !=
+                            (query_test_get_result_type(qtest) & mask))
+                        {
+                                nfail += 1;
+                                ss_dfprintf(stderr,
+                                            "* Failed: \"%s\" -> %s (Parser %s)\n",
+                                            query_test_get_querystr(qtest),
+                                            STRQTYPE(trx_type),
+                                            STRQTYPE(query_test_get_result_type(qtest)));
+                        } else {
+                                ss_dfprintf(stderr,
+                                            "Succeed\t: \"%s\" -> %s\n",
+                                            query_test_get_querystr(qtest),
+                                            STRQTYPE(trx_type));
+                        }
+                }
+                succp = slcursor_step_ahead(c);
+        }
+
         /**
          * Scan test results and re-execute those which are marked to be
          * executed also in the server. This serves mostly debugging purposes.
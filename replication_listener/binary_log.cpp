@@ -26,6 +26,10 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
 SkySQL change details:
 - Added support for setting binlog position based on GTID
 - Added support for MySQL and MariDB server types
+- Added event views over the receive buffer of the driver
+- Added header only mode
+- Added event checksum verification
+- Added connecting from a binlog file and position
 
 Author: Jan Lindström (jan.lindstrom@skysql.com
 
@@ -119,6 +123,31 @@ int Binary_log::wait_for_next_event(mysql::Binary_log_event **event_ptr)
   return 0;
 }
 
+int Binary_log::wait_for_next_event_view(mysql::Binary_log_event_view *view)
+{
+  int rc;
+
+  if ((rc= m_driver->wait_for_next_event_view(view)))
+    return rc;
+  m_binlog_position= view->header()->next_position;
+  return ERR_OK;
+}
+
+Binary_log_event *Binary_log::copy_event(const mysql::Binary_log_event_view &view)
+{
+  return m_driver->copy_event(view);
+}
+
+void Binary_log::set_header_only(bool header_only)
+{
+  m_driver->set_header_only(header_only);
+}
+
+void Binary_log::set_verify_checksum(bool verify)
+{
+  m_driver->set_verify_checksum(verify);
+}
+
 int Binary_log::set_position(const std::string &filename, unsigned long position)
 {
   int status= m_driver->set_position(filename, position);
@@ -139,7 +168,7 @@ int Binary_log::set_position(unsigned long position)
 
 int Binary_log::set_position_gtid(const Gtid gtid)
 {
-  return this->set_position_gtid(gtid);
+  return m_driver->set_position_gtid(gtid);
 }
 
 unsigned long Binary_log::get_position(void)
@@ -164,6 +193,12 @@ int Binary_log::connect(const boost::uint64_t binlog_pos)
   return m_driver->connect(binlog_pos);
 }
 
+int Binary_log::connect(const std::string &binlog_file,
+                        const boost::uint64_t binlog_pos)
+{
+  return m_driver->connect(binlog_file, binlog_pos);
+}
+
 int Binary_log::connect(const Gtid gtid)
 {
   return m_driver->connect(gtid);
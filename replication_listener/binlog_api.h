@@ -26,6 +26,10 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
 SkySQL change details:
 - Added support for setting binlog position based on GTID
 - Added support for MySQL and MariDB server types
+- Added event views over the receive buffer of the driver
+- Added header only mode
+- Added event checksum verification
+- Added connecting from a binlog file and position
 
 Author: Jan Lindström (jan.lindstrom@skysql.com
 
@@ -79,6 +83,8 @@ public:
   virtual int connect() { return 1; }
   virtual int connect(const Gtid gtid) { return 1; }
   virtual int connect(const boost::uint64_t binlog_pos) { return 1;}
+  virtual int connect(const std::string &binlog_file,
+                      const boost::uint64_t binlog_pos) { return 1;}
 
   virtual int wait_for_next_event(mysql::Binary_log_event **event) {
     return ERR_EOF;
@@ -129,12 +135,41 @@ public:
   int connect();
   int connect(const Gtid gtid);
   int connect(const boost::uint64_t binlog_pos);
+  int connect(const std::string &binlog_file, const boost::uint64_t binlog_pos);
 
   /**
    * Blocking attempt to get the next binlog event from the stream
    */
   int wait_for_next_event(Binary_log_event **event);
 
+  /**
+   * Blocking attempt to get the next binlog event as a view over the
+   * receive buffer of the driver. Content handlers are not applied to
+   * views. The view is valid until the next call; use copy_event() to
+   * keep the event.
+   *
+   * @return Error_code
+   *  @retval ERR_OK The view is filled in.
+   *  @retval ERR_EOF The driver doesn't support event views
+   */
+  int wait_for_next_event_view(Binary_log_event_view *view);
+
+  /**
+   * Build an event object from a view. The caller must delete the event.
+   */
+  Binary_log_event *copy_event(const Binary_log_event_view &view);
+
+  /**
+   * Declare that the row images of rows events are not needed. The
+   * Row_event objects returned then have an empty row vector.
+   */
+  void set_header_only(bool header_only);
+
+  /**
+   * Verify the checksums of the events when the master writes them.
+   */
+  void set_verify_checksum(bool verify);
+
 
   /**
    * Inserts/removes content handlers in and out of the chain
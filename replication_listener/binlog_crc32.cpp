@@ -0,0 +1,299 @@
+/*
+Copyright (C) 2014, SkySQL Ab
+
+This file is distributed as part of the SkySQL Gateway. It is free
+software: you can redistribute it and/or modify it under the terms of the
+GNU General Public License as published by the Free Software Foundation,
+version 2.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 51
+Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+Author: Jan Lindström jan.lindstrom@skysql.com
+
+*/
+
+#include <string.h>
+#include "binlog_crc32.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BINLOG_CRC32_PCLMUL
+#include <emmintrin.h>
+#include <smmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+#if defined(__ARM_FEATURE_CRC32)
+#define BINLOG_CRC32_ARM
+#include <arm_acle.h>
+#endif
+
+namespace mysql {
+namespace system {
+
+/* Offsets in the common event header */
+#define CRC_EVENT_TYPE_OFFSET 4
+#define CRC_FLAGS_OFFSET 17
+#define CRC_FORMAT_DESCRIPTION_EVENT 15
+#define CRC_LOG_EVENT_BINLOG_IN_USE_F 0x1
+
+static boost::uint32_t crc32_table[8][256];
+
+/**
+ * Build the slicing-by-8 tables. Called from a static initializer so
+ * that the tables are ready before any listener thread starts.
+ */
+static bool crc32_init_tables()
+{
+  for (boost::uint32_t i= 0; i < 256; i++)
+  {
+    boost::uint32_t c= i;
+    for (int k= 0; k < 8; k++)
+      c= (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+    crc32_table[0][i]= c;
+  }
+  for (boost::uint32_t i= 0; i < 256; i++)
+    for (int t= 1; t < 8; t++)
+      crc32_table[t][i]= crc32_table[0][crc32_table[t - 1][i] & 0xFF] ^
+                         (crc32_table[t - 1][i] >> 8);
+  return true;
+}
+
+static bool crc32_tables_ready= crc32_init_tables();
+
+/**
+ * Portable CRC32 of the inverted crc, eight bytes at a time.
+ */
+static boost::uint32_t crc32_slice8(boost::uint32_t crc,
+                                    const unsigned char *buf, size_t len)
+{
+  while (len && ((size_t) buf & 7))
+  {
+    crc= crc32_table[0][(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+    len--;
+  }
+  while (len >= 8)
+  {
+    boost::uint32_t lo= crc ^ ((boost::uint32_t) buf[0] |
+                               (boost::uint32_t) buf[1] << 8 |
+                               (boost::uint32_t) buf[2] << 16 |
+                               (boost::uint32_t) buf[3] << 24);
+    boost::uint32_t hi= (boost::uint32_t) buf[4] |
+                        (boost::uint32_t) buf[5] << 8 |
+                        (boost::uint32_t) buf[6] << 16 |
+                        (boost::uint32_t) buf[7] << 24;
+    crc= crc32_table[7][lo & 0xFF] ^
+         crc32_table[6][(lo >> 8) & 0xFF] ^
+         crc32_table[5][(lo >> 16) & 0xFF] ^
+         crc32_table[4][lo >> 24] ^
+         crc32_table[3][hi & 0xFF] ^
+         crc32_table[2][(hi >> 8) & 0xFF] ^
+         crc32_table[1][(hi >> 16) & 0xFF] ^
+         crc32_table[0][hi >> 24];
+    buf+= 8;
+    len-= 8;
+  }
+  while (len--)
+    crc= crc32_table[0][(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+  return crc;
+}
+
+#ifdef BINLOG_CRC32_PCLMUL
+/**
+ * CRC32 of the inverted crc over len bytes, len being a multiple of 16
+ * and at least 64, by folding four 128 bit lanes with carry-less
+ * multiplication and a final Barrett reduction. The constants are the
+ * bit reflected ones of "Fast CRC Computation for Generic Polynomials
+ * Using PCLMULQDQ Instruction" (Intel, 2009) for the zlib polynomial.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static boost::uint32_t crc32_pclmul(boost::uint32_t crc,
+                                    const unsigned char *buf, size_t len)
+{
+  static const boost::uint64_t k1k2[2] __attribute__((aligned(16)))=
+    { 0x0154442bd4ULL, 0x01c6e41596ULL };
+  static const boost::uint64_t k3k4[2] __attribute__((aligned(16)))=
+    { 0x01751997d0ULL, 0x00ccaa009eULL };
+  static const boost::uint64_t k5k0[2] __attribute__((aligned(16)))=
+    { 0x0163cd6124ULL, 0x0000000000ULL };
+  static const boost::uint64_t poly[2] __attribute__((aligned(16)))=
+    { 0x01db710641ULL, 0x01f7011641ULL };
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+  x1= _mm_loadu_si128((const __m128i *) (buf + 0x00));
+  x2= _mm_loadu_si128((const __m128i *) (buf + 0x10));
+  x3= _mm_loadu_si128((const __m128i *) (buf + 0x20));
+  x4= _mm_loadu_si128((const __m128i *) (buf + 0x30));
+  x1= _mm_xor_si128(x1, _mm_cvtsi32_si128((int) crc));
+  x0= _mm_load_si128((const __m128i *) k1k2);
+  buf+= 64;
+  len-= 64;
+
+  /* Fold 64 bytes at a time */
+  while (len >= 64)
+  {
+    x5= _mm_clmulepi64_si128(x1, x0, 0x00);
+    x6= _mm_clmulepi64_si128(x2, x0, 0x00);
+    x7= _mm_clmulepi64_si128(x3, x0, 0x00);
+    x8= _mm_clmulepi64_si128(x4, x0, 0x00);
+    x1= _mm_clmulepi64_si128(x1, x0, 0x11);
+    x2= _mm_clmulepi64_si128(x2, x0, 0x11);
+    x3= _mm_clmulepi64_si128(x3, x0, 0x11);
+    x4= _mm_clmulepi64_si128(x4, x0, 0x11);
+    y5= _mm_loadu_si128((const __m128i *) (buf + 0x00));
+    y6= _mm_loadu_si128((const __m128i *) (buf + 0x10));
+    y7= _mm_loadu_si128((const __m128i *) (buf + 0x20));
+    y8= _mm_loadu_si128((const __m128i *) (buf + 0x30));
+    x1= _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+    x2= _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+    x3= _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+    x4= _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+    buf+= 64;
+    len-= 64;
+  }
+
+  /* Fold the four lanes into one */
+  x0= _mm_load_si128((const __m128i *) k3k4);
+  x5= _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1= _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1= _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5= _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1= _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1= _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5= _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1= _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1= _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  /* Fold the remaining 16 byte blocks */
+  while (len >= 16)
+  {
+    x2= _mm_loadu_si128((const __m128i *) buf);
+    x5= _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1= _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1= _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    buf+= 16;
+    len-= 16;
+  }
+
+  /* Fold 128 bits to 64 bits */
+  x2= _mm_clmulepi64_si128(x1, x0, 0x10);
+  x3= _mm_setr_epi32(~0, 0, ~0, 0);
+  x1= _mm_srli_si128(x1, 8);
+  x1= _mm_xor_si128(x1, x2);
+  x0= _mm_loadl_epi64((const __m128i *) k5k0);
+  x2= _mm_srli_si128(x1, 4);
+  x1= _mm_and_si128(x1, x3);
+  x1= _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1= _mm_xor_si128(x1, x2);
+
+  /* Barrett reduction to 32 bits */
+  x0= _mm_load_si128((const __m128i *) poly);
+  x2= _mm_and_si128(x1, x3);
+  x2= _mm_clmulepi64_si128(x2, x0, 0x10);
+  x2= _mm_and_si128(x2, x3);
+  x2= _mm_clmulepi64_si128(x2, x0, 0x00);
+  x1= _mm_xor_si128(x1, x2);
+
+  return (boost::uint32_t) _mm_extract_epi32(x1, 1);
+}
+
+static bool crc32_have_pclmul()
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+}
+
+static bool crc32_use_pclmul= crc32_have_pclmul();
+#endif
+
+#ifdef BINLOG_CRC32_ARM
+/**
+ * CRC32 of the inverted crc with the ARMv8 CRC32 instructions, which use
+ * the same polynomial as zlib.
+ */
+static boost::uint32_t crc32_arm(boost::uint32_t crc,
+                                 const unsigned char *buf, size_t len)
+{
+  while (len && ((size_t) buf & 7))
+  {
+    crc= __crc32b(crc, *buf++);
+    len--;
+  }
+  while (len >= 8)
+  {
+    boost::uint64_t v;
+    memcpy(&v, buf, 8);
+    crc= __crc32d(crc, v);
+    buf+= 8;
+    len-= 8;
+  }
+  while (len--)
+    crc= __crc32b(crc, *buf++);
+  return crc;
+}
+#endif
+
+boost::uint32_t binlog_crc32(boost::uint32_t crc, const unsigned char *buf,
+                             size_t len)
+{
+  crc= ~crc;
+#if defined(BINLOG_CRC32_ARM)
+  crc= crc32_arm(crc, buf, len);
+#else
+#if defined(BINLOG_CRC32_PCLMUL)
+  if (crc32_use_pclmul && len >= 64)
+  {
+    size_t chunk= len & ~(size_t) 15;
+    crc= crc32_pclmul(crc, buf, chunk);
+    buf+= chunk;
+    len-= chunk;
+  }
+#endif
+  (void) crc32_tables_ready;
+  crc= crc32_slice8(crc, buf, len);
+#endif
+  return ~crc;
+}
+
+bool binlog_event_checksum_ok(const unsigned char *event, size_t length)
+{
+  boost::uint32_t crc;
+  boost::uint32_t stored;
+
+  if (length < CRC_FLAGS_OFFSET + 2 + BINLOG_CHECKSUM_LEN)
+    return false;
+
+  length-= BINLOG_CHECKSUM_LEN;
+  stored= (boost::uint32_t) event[length] |
+          (boost::uint32_t) event[length + 1] << 8 |
+          (boost::uint32_t) event[length + 2] << 16 |
+          (boost::uint32_t) event[length + 3] << 24;
+
+  /*
+    The server computes the checksum of a format description event with
+    the binlog in use flag cleared, the flag is set later in the file.
+   */
+  if (event[CRC_EVENT_TYPE_OFFSET] == CRC_FORMAT_DESCRIPTION_EVENT &&
+      (event[CRC_FLAGS_OFFSET] & CRC_LOG_EVENT_BINLOG_IN_USE_F))
+  {
+    unsigned char flags= event[CRC_FLAGS_OFFSET] & ~CRC_LOG_EVENT_BINLOG_IN_USE_F;
+
+    crc= binlog_crc32(0, event, CRC_FLAGS_OFFSET);
+    crc= binlog_crc32(crc, &flags, 1);
+    crc= binlog_crc32(crc, event + CRC_FLAGS_OFFSET + 1,
+                      length - CRC_FLAGS_OFFSET - 1);
+  }
+  else
+    crc= binlog_crc32(0, event, length);
+
+  return crc == stored;
+}
+
+} // namespace mysql::system
+} // namespace mysql
@@ -0,0 +1,71 @@
+/*
+Copyright (C) 2014, SkySQL Ab
+
+This file is distributed as part of the SkySQL Gateway. It is free
+software: you can redistribute it and/or modify it under the terms of the
+GNU General Public License as published by the Free Software Foundation,
+version 2.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 51
+Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+Author: Jan Lindström jan.lindstrom@skysql.com
+
+*/
+
+#ifndef _BINLOG_CRC32_H
+#define	_BINLOG_CRC32_H
+
+#include <stddef.h>
+#include <boost/cstdint.hpp>
+
+namespace mysql {
+namespace system {
+
+#define BINLOG_CHECKSUM_LEN 4
+
+/**
+ * The checksum algorithms of binlog events, as stored in the format
+ * description event and named by @@global.binlog_checksum.
+ */
+enum binlog_checksum_alg {
+  BINLOG_CHECKSUM_ALG_OFF= 0,
+  BINLOG_CHECKSUM_ALG_CRC32= 1,
+  BINLOG_CHECKSUM_ALG_UNDEF= 255
+};
+
+/**
+ * Continue the CRC32 of the binlog checksums (the zlib CRC32, polynomial
+ * 0xEDB88320) over len bytes. Start with crc 0.
+ *
+ * The folding of the data is done with carry-less multiplication on x86
+ * CPUs with PCLMULQDQ and with the CRC32 instructions on ARMv8 when the
+ * compiler targets them. Other CPUs use a slicing-by-8 table.
+ *
+ * Note that the SSE4.2 crc32 instruction computes CRC32C, a different
+ * polynomial, and can not be used for binlog checksums.
+ */
+boost::uint32_t binlog_crc32(boost::uint32_t crc, const unsigned char *buf,
+                             size_t len);
+
+/**
+ * Verify the checksum at the end of a complete binlog event.
+ *
+ * @param event The event, starting from the common header
+ * @param length The length of the event including the checksum
+ *
+ * @retval true The checksum matches
+ * @retval false The checksum doesn't match or the event is too short
+ */
+bool binlog_event_checksum_ok(const unsigned char *event, size_t length);
+
+} // namespace mysql::system
+} // namespace mysql
+
+#endif	/* _BINLOG_CRC32_H */
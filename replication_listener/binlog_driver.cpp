@@ -31,9 +31,39 @@ Author: Jan Lindström (jan.lindstrom@skysql.com
 */
 
 #include "binlog_driver.h"
+#include <streambuf>
 
 namespace mysql { namespace system {
 
+/**
+ * A read only stream buffer over a block of memory. It lets the stream
+ * based event parsers run over an event view without copying it first.
+ */
+class Memory_streambuf : public std::streambuf
+{
+public:
+  Memory_streambuf(const boost::uint8_t *data, size_t length)
+  {
+    char *ptr= (char *) data;
+    setg(ptr, ptr, ptr + length);
+  }
+};
+
+Binary_log_event* Binary_log_driver::copy_event(const Binary_log_event_view &view)
+{
+  if (view.event())
+  {
+    Incident_event *incident= static_cast<Incident_event *>(view.event());
+    return create_incident_event(incident->type, incident->message.c_str(),
+                                 incident->header()->next_position);
+  }
+
+  Log_event_header header= *view.header();
+  Memory_streambuf buf(view.body(), view.body_length());
+  std::istream is(&buf);
+  return parse_event(is, &header);
+}
+
 
 Binary_log_event* Binary_log_driver::parse_event(std::istream &is,
                                                  Log_event_header *header)
@@ -57,7 +87,7 @@ Binary_log_event* Binary_log_driver::parse_event(std::istream &is,
     case WRITE_ROWS_EVENT:
     case UPDATE_ROWS_EVENT:
     case DELETE_ROWS_EVENT:
-      parsed_event= proto_rows_event(is, header);
+      parsed_event= proto_rows_event(is, header, !m_header_only);
       break;
     case ROTATE_EVENT:
       {
@@ -26,6 +26,10 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
 SkySQL change details:
 - Added support for GTID event handling for both MySQL and MariaDB
 - Added support for setting binlog position based on GTID
+- Added event views over the receive buffer of the driver
+- Added a header only mode which doesn't copy row images
+- Added optional verification of binlog event checksums
+- Added connecting from a binlog file and position
 
 Author: Jan Lindström (jan.lindstrom@skysql.com
 
@@ -36,6 +40,7 @@ Author: Jan Lindström (jan.lindstrom@skysql.com
 #include "binlog_event.h"
 #include "protocol.h"
 #include "gtid.h"
+#include "binlog_crc32.h"
 
 namespace mysql {
 namespace system {
@@ -45,7 +50,9 @@ class Binary_log_driver
 public:
   template <class FilenameT>
   Binary_log_driver(const FilenameT& filename = FilenameT(), unsigned int offset = 0)
-    : m_binlog_file_name(filename), m_binlog_offset(offset), m_server_type(MYSQL_SERVER_TYPE_NA)
+    : m_binlog_file_name(filename), m_binlog_offset(offset), m_server_type(MYSQL_SERVER_TYPE_NA),
+      m_header_only(false), m_verify_checksum(false),
+      m_checksum_alg(BINLOG_CHECKSUM_ALG_UNDEF)
   {
   }
 
@@ -61,6 +68,8 @@ public:
   virtual int connect(Gtid gtid)= 0;
   virtual int connect() = 0;
   virtual int connect(const boost::uint64_t binlog_pos) = 0;
+  virtual int connect(const std::string &binlog_file,
+                      const boost::uint64_t binlog_pos) = 0;
 
   /**
    * Blocking attempt to get the next binlog event from the stream
@@ -68,6 +77,29 @@ public:
    */
   virtual int wait_for_next_event(mysql::Binary_log_event **event)= 0;
 
+  /**
+   * Blocking attempt to get the next binlog event as a view over the
+   * receive buffer of the driver, without building an event object.
+   * The view is valid until the next call to wait_for_next_event_view()
+   * or wait_for_next_event().
+   *
+   * @param view [out] The view to fill in.
+   *
+   * @retval 0 Success
+   * @retval 1 The driver doesn't support event views
+   */
+  virtual int wait_for_next_event_view(mysql::Binary_log_event_view *view)
+  {
+    return 1;
+  }
+
+  /**
+   * Build an event object from a view, for events the caller wants to
+   * keep after the view has been released. The caller must delete the
+   * returned event.
+   */
+  Binary_log_event* copy_event(const mysql::Binary_log_event_view &view);
+
   /**
    * Set the reader position
    * @param str The file name
@@ -99,6 +131,27 @@ public:
 
   Binary_log_event* parse_event(std::istream &sbuff, Log_event_header *header);
 
+  /**
+   * In header only mode rows events are parsed without their row images,
+   * for consumers that only need the table id and the position. The
+   * row vector of such Row_event objects is empty.
+   */
+  void set_header_only(bool header_only) { m_header_only= header_only; }
+  bool is_header_only() const { return m_header_only; }
+
+  /**
+   * Verify the CRC32 checksum of every event when the master writes
+   * checksums. A mismatch is reported as an incident event.
+   */
+  void set_verify_checksum(bool verify) { m_verify_checksum= verify; }
+  bool is_verify_checksum() const { return m_verify_checksum; }
+
+  /**
+   * The checksum algorithm of the master, BINLOG_CHECKSUM_ALG_UNDEF until
+   * connected.
+   */
+  binlog_checksum_alg get_checksum_alg() const { return m_checksum_alg; }
+
   mysql_server_types get_mysql_server_type() const 
   {
     return m_server_type;
@@ -112,6 +165,9 @@ protected:
   unsigned long m_binlog_offset;
   std::string m_binlog_file_name;
   mysql_server_types m_server_type;
+  bool m_header_only;
+  bool m_verify_checksum;
+  binlog_checksum_alg m_checksum_alg;
 };
 
 } // namespace mysql::system
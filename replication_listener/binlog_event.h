@@ -25,6 +25,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
 /*
 SkySQL change details:
 - Added support for GTID event handling for both MySQL and MariaDB
+- Added event views referencing the receive buffer of the driver
 
 Author: Jan Lindström (jan.lindstrom@skysql.com
 
@@ -292,6 +293,66 @@ public:
     boost::uint64_t xid_id;
 };
 
+/**
+ * A binary log event referenced in place in the receive buffer of the
+ * driver. Only the common header is decoded; the post-header and payload
+ * are pointed at. The view is valid until the next call to
+ * wait_for_next_event_view() or wait_for_next_event() on the driver that
+ * returned it. Use Binary_log_driver::copy_event() to keep the event
+ * longer than that.
+ */
+class Binary_log_event_view
+{
+public:
+    Binary_log_event_view() : m_body(0), m_body_length(0), m_event(0)
+    {
+        m_header.event_length= 0;
+        m_header.type_code=    0;
+    }
+
+    enum Log_event_type get_event_type() const
+    {
+      return (enum Log_event_type) m_header.type_code;
+    }
+
+    const Log_event_header *header() const { return &m_header; }
+
+    /**
+     * The event data following the common header
+     */
+    const boost::uint8_t *body() const { return m_body; }
+    size_t body_length() const { return m_body_length; }
+
+    /**
+     * Set when the driver reports an error instead of an event read from
+     * the server. The view has no body in that case and the event is
+     * owned by the driver.
+     */
+    Binary_log_event *event() const { return m_event; }
+
+    Log_event_header m_header;
+    const boost::uint8_t *m_body;
+    size_t m_body_length;
+    Binary_log_event *m_event;
+};
+
+/**
+ * Rows event fields decoded from an event view. The column bitmaps and
+ * the row image point into the receive buffer of the view.
+ */
+class Row_event_view
+{
+public:
+    boost::uint64_t table_id;
+    boost::uint16_t flags;
+    boost::uint64_t columns_len;
+    boost::uint32_t null_bits_len;
+    const boost::uint8_t *used_columns;
+    const boost::uint8_t *columns_before_image; // UPDATE_ROWS_EVENT only
+    const boost::uint8_t *row;
+    size_t row_len;
+};
+
 Binary_log_event *create_incident_event(unsigned int type, const char *message, unsigned long pos= 0);
 
 } // end namespace mysql
@@ -0,0 +1,212 @@
+/*
+Copyright (C) 2014, SkySQL Ab
+
+This file is distributed as part of the SkySQL Gateway. It is free
+software: you can redistribute it and/or modify it under the terms of the
+GNU General Public License as published by the Free Software Foundation,
+version 2.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 51
+Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+Author: Jan Lindström jan.lindstrom@skysql.com
+
+*/
+
+#include "field_iterator.h"
+
+namespace mysql {
+
+bool is_null(unsigned char *bitmap, int index)
+{
+  return (bitmap[index / 8] & (1 << (index & 7))) != 0;
+}
+
+int lookup_metadata_field_size(enum enum_field_types field_type)
+{
+  switch (field_type)
+  {
+    case MYSQL_TYPE_DOUBLE:
+    case MYSQL_TYPE_FLOAT:
+    case MYSQL_TYPE_BLOB:
+    case MYSQL_TYPE_GEOMETRY:
+      return 1;
+    case MYSQL_TYPE_BIT:
+    case MYSQL_TYPE_VARCHAR:
+    case MYSQL_TYPE_NEWDECIMAL:
+    case MYSQL_TYPE_STRING:
+    case MYSQL_TYPE_VAR_STRING:
+      return 2;
+    default:
+      return 0;
+  }
+}
+
+/**
+ Decode the metadata of a column starting at offset in the metadata block
+ of a table map.
+ */
+static boost::uint32_t decode_metadata(const Table_map_event *map,
+                                       unsigned int type, size_t offset)
+{
+  boost::uint32_t metadata= 0;
+
+  switch (lookup_metadata_field_size((enum enum_field_types) type))
+  {
+    case 1:
+      if (offset < map->metadata.size())
+        metadata= map->metadata[offset];
+      break;
+    case 2:
+      if (offset + 1 < map->metadata.size())
+        metadata= map->metadata[offset] | (map->metadata[offset + 1] << 8);
+      break;
+  }
+  return metadata;
+}
+
+boost::uint32_t extract_metadata(const Table_map_event *map, int col_no)
+{
+  size_t offset= 0;
+
+  for (int i= 0; i < col_no; ++i)
+    offset+= lookup_metadata_field_size((enum enum_field_types) map->columns[i]);
+  return decode_metadata(map, map->columns[col_no], offset);
+}
+
+Table_columns::Table_columns(const Table_map_event *map)
+  : m_types(map->columns), m_metadata(map->columns.size())
+{
+  size_t offset= 0;
+
+  for (size_t i= 0; i < m_types.size(); ++i)
+  {
+    m_metadata[i]= decode_metadata(map, m_types[i], offset);
+    offset+= lookup_metadata_field_size((enum enum_field_types) m_types[i]);
+  }
+}
+
+Lazy_row::Lazy_row(const Table_columns *columns, const boost::uint8_t *image,
+                   size_t length, boost::uint32_t null_bits_len)
+  : m_columns(columns), m_image(image), m_length(length),
+    m_null_bits_len(null_bits_len)
+{
+  m_offsets.reserve(columns->size() + 1);
+  m_offsets.push_back(null_bits_len);
+}
+
+bool Lazy_row::is_null(unsigned col_no) const
+{
+  if (col_no / 8 >= m_null_bits_len)
+    return false;
+  return mysql::is_null((unsigned char *) m_image, col_no);
+}
+
+/**
+ Extend the known offsets up to and including the end of column col_no.
+ A NULL column takes no space in the row image.
+
+ @return False if the row image is too short or a column type is unknown.
+ */
+bool Lazy_row::offsets_to(unsigned col_no)
+{
+  while (m_offsets.size() <= col_no + 1)
+  {
+    unsigned i= m_offsets.size() - 1;
+    boost::uint32_t offset= m_offsets.back();
+    size_t size= 0;
+
+    if (offset > m_length)
+      return false;
+    if (!is_null(i))
+    {
+      if (offset == m_length)
+        return false;
+      size= calc_field_size((unsigned char) m_columns->type(i),
+                            m_image + offset, m_columns->metadata(i));
+      if (size > m_length - offset)
+        return false;
+    }
+    m_offsets.push_back(offset + size);
+  }
+  return true;
+}
+
+Value Lazy_row::field(unsigned col_no)
+{
+  Value val;
+
+  if (col_no >= m_columns->size() || !offsets_to(col_no))
+  {
+    val.is_null(true);
+    return val;
+  }
+
+  if (is_null(col_no))
+  {
+    val.is_null(true);
+    return val;
+  }
+  return Value(m_columns->type(col_no), m_columns->metadata(col_no),
+               (const char *) m_image + m_offsets[col_no]);
+}
+
+size_t Lazy_row::length()
+{
+  if (m_columns->size() == 0)
+    return m_null_bits_len <= m_length ? m_null_bits_len : 0;
+  if (!offsets_to(m_columns->size() - 1))
+    return 0;
+  return m_offsets.back();
+}
+
+void Lazy_row::fields(Row_of_fields &row)
+{
+  for (unsigned col_no= 0; col_no < m_columns->size(); ++col_no)
+    row.push_back(field(col_no));
+}
+
+Lazy_row_cursor::Lazy_row_cursor(const Row_event *row_event,
+                                 const Table_columns *columns)
+  : m_columns(columns), m_null_bits_len(row_event->null_bits_len)
+{
+  m_pos= row_event->row.empty() ? 0 : &row_event->row[0];
+  m_end= m_pos + row_event->row.size();
+}
+
+Lazy_row_cursor::Lazy_row_cursor(const Row_event_view &row_event,
+                                 const Table_columns *columns)
+  : m_columns(columns), m_pos(row_event.row),
+    m_end(row_event.row + row_event.row_len),
+    m_null_bits_len(row_event.null_bits_len)
+{
+}
+
+bool Lazy_row_cursor::next(Lazy_row *row)
+{
+  if (m_pos >= m_end)
+    return false;
+
+  *row= Lazy_row(m_columns, m_pos, m_end - m_pos, m_null_bits_len);
+
+  /*
+    Finding the next row needs the size of every column of this one, but
+    no values. The offsets stay cached in the row for field().
+  */
+  size_t length= row->length();
+  if (length == 0)
+  {
+    m_pos= m_end;
+    return false;
+  }
+  m_pos+= length;
+  return true;
+}
+
+} // end namespace mysql
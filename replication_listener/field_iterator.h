@@ -35,6 +35,102 @@ bool is_null(unsigned char *bitmap, int index);
 int lookup_metadata_field_size(enum enum_field_types field_type);
 boost::uint32_t extract_metadata(const Table_map_event *map, int col_no);
 
+/**
+ * The column types and metadata of a table map, decoded once per table
+ * map so that rows of the table can be decoded column by column.
+ */
+class Table_columns
+{
+public:
+  Table_columns(const Table_map_event *map);
+
+  size_t size() const { return m_types.size(); }
+  enum enum_field_types type(unsigned col_no) const
+  {
+    return (enum enum_field_types) m_types[col_no];
+  }
+  boost::uint32_t metadata(unsigned col_no) const { return m_metadata[col_no]; }
+
+private:
+  std::vector<boost::uint8_t> m_types;
+  std::vector<boost::uint32_t> m_metadata;
+};
+
+/**
+ * One row image of a rows event decoded on demand. Nothing is decoded
+ * when the row is created; the offset of a column is computed the first
+ * time it or a later column is asked for, and a Value is only built for
+ * the columns that are read. The row refers to the row data of the event
+ * and to the Table_columns, both must outlive it.
+ */
+class Lazy_row
+{
+public:
+  Lazy_row() : m_columns(0), m_image(0), m_length(0), m_null_bits_len(0) {}
+  Lazy_row(const Table_columns *columns, const boost::uint8_t *image,
+           size_t length, boost::uint32_t null_bits_len);
+
+  size_t field_count() const { return m_columns->size(); }
+
+  bool is_null(unsigned col_no) const;
+
+  /**
+   * The value of a column.
+   *
+   * @return The value, or a null Value if the column is NULL or the row
+   *         image is too short for it.
+   */
+  Value field(unsigned col_no);
+
+  /**
+   * The number of bytes of the row image. This decodes the offsets of all
+   * the columns.
+   *
+   * @return The length, or 0 if the row image is truncated.
+   */
+  size_t length();
+
+  /**
+   * Build all the values of the row.
+   */
+  void fields(Row_of_fields &row);
+
+private:
+  bool offsets_to(unsigned col_no);
+
+  const Table_columns *m_columns;
+  const boost::uint8_t *m_image;
+  size_t m_length;
+  boost::uint32_t m_null_bits_len;
+  /* m_offsets[i] is the offset of column i, known for the first columns */
+  std::vector<boost::uint32_t> m_offsets;
+};
+
+/**
+ * Walks the row images of a rows event. UPDATE_ROWS_EVENT images come in
+ * before/after pairs. Only the column sizes are decoded to step from one
+ * row to the next.
+ */
+class Lazy_row_cursor
+{
+public:
+  Lazy_row_cursor(const Row_event *row_event, const Table_columns *columns);
+  Lazy_row_cursor(const Row_event_view &row_event, const Table_columns *columns);
+
+  /**
+   * Move to the next row image.
+   *
+   * @return False at the end of the event or if the image is truncated.
+   */
+  bool next(Lazy_row *row);
+
+private:
+  const Table_columns *m_columns;
+  const boost::uint8_t *m_pos;
+  const boost::uint8_t *m_end;
+  boost::uint32_t m_null_bits_len;
+};
+
 template <class Iterator_value_type >
 class Row_event_iterator : public std::iterator<std::forward_iterator_tag,
                                                 Iterator_value_type>
@@ -25,6 +25,7 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
 /*
 SkySQL change details:
 - Added support for GTID event handling for both MySQL and MariaDB
+- Added in place decoding of event headers and rows events
 
 Author: Jan Lindström (jan.lindstrom@skysql.com
 
@@ -479,7 +480,8 @@ Incident_event *proto_incident_event(std::istream &is, Log_event_header *header)
   return incident;
 }
 
-Row_event *proto_rows_event(std::istream &is, Log_event_header *header)
+Row_event *proto_rows_event(std::istream &is, Log_event_header *header,
+                            bool row_image)
 {
   Row_event *rev=new Row_event(header);
 
@@ -516,6 +518,13 @@ Row_event *proto_rows_event(std::istream &is, Log_event_header *header)
   if (header->type_code == UPDATE_ROWS_EVENT)
     bytes_read+=used_column_len;
 
+  /*
+    The row image is the rest of the event; in header only mode it is left
+    unread, the caller discards the remainder of the stream.
+  */
+  if (!row_image)
+    return rev;
+
   unsigned long row_len= header->event_length - bytes_read - LOG_EVENT_HEADER_SIZE + 1;
   //std::cout << "Bytes read: " << bytes_read << " Bytes expected: " << rev->row_len << std::endl;
   Protocol_chunk_vector proto_row(rev->row, row_len);
@@ -524,6 +533,73 @@ Row_event *proto_rows_event(std::istream &is, Log_event_header *header)
   return rev;
 }
 
+void proto_event_packet_header(const boost::uint8_t *buf, Log_event_header *h)
+{
+  h->marker=        buf[0];
+  h->timestamp=     (boost::uint32_t) proto_read_le(buf + 1, 4);
+  h->type_code=     buf[5];
+  h->server_id=     (boost::uint32_t) proto_read_le(buf + 6, 4);
+  h->event_length=  (boost::uint32_t) proto_read_le(buf + 10, 4);
+  h->next_position= (boost::uint32_t) proto_read_le(buf + 14, 4);
+  h->flags=         (boost::uint16_t) proto_read_le(buf + 18, 2);
+}
+
+bool proto_rows_event_view(const Binary_log_event_view &view, Row_event_view *rev)
+{
+  const boost::uint8_t *ptr= view.body();
+  const boost::uint8_t *end= ptr + view.body_length();
+  int type= view.header()->type_code;
+  int len_bytes;
+
+  if ((type != WRITE_ROWS_EVENT && type != UPDATE_ROWS_EVENT &&
+       type != DELETE_ROWS_EVENT) || ptr == 0 || end - ptr < 9)
+    return true;
+
+  rev->table_id= proto_read_le(ptr, 6);
+  rev->flags= (boost::uint16_t) proto_read_le(ptr + 6, 2);
+  ptr+= 8;
+
+  /* Length encoded column count, see the Protocol stream operator */
+  switch (*ptr)
+  {
+    case 251: len_bytes= 0; break;
+    case 252: len_bytes= 2; break;
+    case 253: len_bytes= 3; break;
+    case 254: len_bytes= 8; break;
+    default:  len_bytes= -1; break;
+  }
+  if (len_bytes < 0)
+  {
+    rev->columns_len= *ptr++;
+  }
+  else
+  {
+    if (end - ptr < len_bytes + 1)
+      return true;
+    rev->columns_len= proto_read_le(ptr + 1, len_bytes);
+    ptr+= len_bytes + 1;
+  }
+
+  rev->null_bits_len= (boost::uint32_t) ((rev->columns_len + 7) / 8);
+  if ((boost::uint64_t) (end - ptr) < rev->null_bits_len)
+    return true;
+  rev->used_columns= ptr;
+  ptr+= rev->null_bits_len;
+
+  rev->columns_before_image= 0;
+  if (type == UPDATE_ROWS_EVENT)
+  {
+    if ((boost::uint64_t) (end - ptr) < rev->null_bits_len)
+      return true;
+    rev->columns_before_image= ptr;
+    ptr+= rev->null_bits_len;
+  }
+
+  rev->row= ptr;
+  rev->row_len= end - ptr;
+  return false;
+}
+
 Int_var_event *proto_intvar_event(std::istream &is, Log_event_header *header)
 {
   Int_var_event *event= new Int_var_event(header);
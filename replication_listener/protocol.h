@@ -298,12 +298,39 @@ void proto_get_handshake_package(std::istream &is, struct st_handshake_package &
 Query_event *proto_query_event(std::istream &is, Log_event_header *header);
 Rotate_event *proto_rotate_event(std::istream &is, Log_event_header *header);
 Incident_event *proto_incident_event(std::istream &is, Log_event_header *header);
-Row_event *proto_rows_event(std::istream &is, Log_event_header *header);
+Row_event *proto_rows_event(std::istream &is, Log_event_header *header,
+                            bool row_image= true);
 Table_map_event *proto_table_map_event(std::istream &is, Log_event_header *header);
 Int_var_event *proto_intvar_event(std::istream &is, Log_event_header *header);
 User_var_event *proto_uservar_event(std::istream &is, Log_event_header *header);
 Gtid_event *proto_gtid_event(std::istream &is, Log_event_header *header);
 
+/**
+  Read a little endian integer of the given number of bytes from memory.
+*/
+inline boost::uint64_t proto_read_le(const boost::uint8_t *ptr, int bytes)
+{
+  boost::uint64_t value= 0;
+  while (bytes-- > 0)
+    value= (value << 8) | ptr[bytes];
+  return value;
+}
+
+/**
+  Decode the status byte and the common event header in place from the
+  first LOG_EVENT_HEADER_SIZE bytes of a received event packet.
+*/
+void proto_event_packet_header(const boost::uint8_t *buf, Log_event_header *h);
+
+/**
+  Decode the fixed part of a rows event from an event view without copying
+  the column bitmaps or the row image.
+
+  @return False if the view was decoded, true if it isn't a rows event or
+          is truncated.
+*/
+bool proto_rows_event_view(const Binary_log_event_view &view, Row_event_view *rev);
+
 } // end namespace system
 } // end namespace mysql
 
@@ -0,0 +1,263 @@
+/*
+Copyright (C) 2014, SkySQL Ab
+
+This file is distributed as part of the SkySQL Gateway. It is free
+software: you can redistribute it and/or modify it under the terms of the
+GNU General Public License as published by the Free Software Foundation,
+version 2.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 51
+Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+Author: Jan Lindström jan.lindstrom@skysql.com
+
+*/
+
+#ifndef _SPSC_RING_H
+#define	_SPSC_RING_H
+
+#include <boost/cstdint.hpp>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <limits.h>
+
+#define SPSC_CACHE_LINE 64
+#define SPSC_SPIN_MIN   16
+#define SPSC_SPIN_MAX   4096
+
+/**
+ * A bounded single producer, single consumer ring.
+ *
+ * Exactly one thread may push and exactly one thread may pop at any time.
+ * The two sides only share the head and tail counters, each on its own
+ * cache line, and each side keeps a private copy of the other side's
+ * counter so that it only reads the shared one when the ring looks full
+ * or empty.
+ *
+ * A side that has to wait first spins and then sleeps on a futex on the
+ * counter of the other side. The spin length adapts: it grows while
+ * spinning is enough and shrinks when the side ends up sleeping anyway.
+ * The other side only makes the wake up system call when a sleeper has
+ * announced itself.
+ */
+/**
+ * Spinning only makes sense if the other side can run meanwhile.
+ */
+inline bool spsc_spin_allowed()
+{
+  static long cpus= sysconf(_SC_NPROCESSORS_ONLN);
+  return cpus > 1;
+}
+
+template <class T>
+class spsc_ring
+{
+public:
+
+  explicit spsc_ring(boost::uint32_t capacity)
+    : m_capacity(capacity),
+      m_head(0), m_tail_cache(0), m_producer_spin(SPSC_SPIN_MIN),
+      m_consumer_waiting(0),
+      m_tail(0), m_head_cache(0), m_consumer_spin(SPSC_SPIN_MIN),
+      m_producer_waiting(0)
+  {
+    m_size= 1;
+    while (m_size < capacity)
+      m_size<<= 1;
+    m_mask= m_size - 1;
+    m_items= new T[m_size];
+  }
+
+  ~spsc_ring()
+  {
+    delete [] m_items;
+  }
+
+  /**
+   * Add an item, waiting while the ring is full. Producer only.
+   */
+  void push_front(const T& item)
+  {
+    push_batch(&item, 1);
+  }
+
+  /**
+   * Add a number of items, waiting for room as needed. The items become
+   * visible to the consumer when each chunk that fits has been copied.
+   * Producer only.
+   */
+  void push_batch(const T *items, boost::uint32_t count)
+  {
+    while (count > 0)
+    {
+      boost::uint32_t head= m_head;
+      boost::uint32_t room= m_capacity - (head - m_tail_cache);
+
+      if (room == 0)
+      {
+        m_tail_cache= m_tail;
+        __sync_synchronize();
+        if (m_tail_cache == head - m_capacity)
+          m_tail_cache= wait_for_change(&m_tail, m_tail_cache,
+                                        &m_producer_waiting, &m_producer_spin);
+        continue;
+      }
+      if (room > count)
+        room= count;
+      for (boost::uint32_t i= 0; i < room; i++)
+        m_items[(head + i) & m_mask]= items[i];
+      publish(&m_head, head + room, &m_consumer_waiting);
+      items+= room;
+      count-= room;
+    }
+  }
+
+  /**
+   * Remove the oldest item, waiting while the ring is empty.
+   * Consumer only.
+   */
+  void pop_back(T *item)
+  {
+    pop_batch(item, 1);
+  }
+
+  /**
+   * Remove up to max items, waiting until at least one is available.
+   * Consumer only.
+   *
+   * @return The number of items stored in items
+   */
+  boost::uint32_t pop_batch(T *items, boost::uint32_t max)
+  {
+    boost::uint32_t tail= m_tail;
+    boost::uint32_t count;
+
+    while ((count= m_head_cache - tail) == 0)
+    {
+      m_head_cache= m_head;
+      __sync_synchronize();
+      if (m_head_cache == tail)
+        m_head_cache= wait_for_change(&m_head, tail, &m_consumer_waiting,
+                                      &m_consumer_spin);
+    }
+    if (count > max)
+      count= max;
+    for (boost::uint32_t i= 0; i < count; i++)
+      items[i]= m_items[(tail + i) & m_mask];
+    publish(&m_tail, tail + count, &m_producer_waiting);
+    return count;
+  }
+
+  /**
+   * True if there are items to pop. Either side may call this, the answer
+   * may be stale by the time it returns.
+   */
+  bool has_unread()
+  {
+    __sync_synchronize();
+    return m_head != m_tail;
+  }
+
+private:
+  spsc_ring(const spsc_ring&);              // Disabled copy constructor
+  spsc_ring& operator = (const spsc_ring&); // Disabled assign operator
+
+  static long futex(volatile boost::uint32_t *addr, int op, boost::uint32_t val)
+  {
+    return syscall(SYS_futex, (boost::uint32_t *) addr, op, val, NULL, NULL, 0);
+  }
+
+  /**
+   * Make a new counter value visible and wake the other side if it is
+   * sleeping on it. The full barrier orders the store against the read
+   * of the waiting flag; the sleeper does the reverse. The flag is
+   * cleared by the waker so a sleeper costs one wake up call, however
+   * many items are published before it gets to run.
+   */
+  static void publish(volatile boost::uint32_t *counter, boost::uint32_t value,
+                      volatile boost::uint32_t *waiting)
+  {
+    __sync_synchronize();
+    *counter= value;
+    __sync_synchronize();
+    if (*waiting && __sync_bool_compare_and_swap(waiting, 1, 0))
+      futex(counter, FUTEX_WAKE_PRIVATE, INT_MAX);
+  }
+
+  /**
+   * Wait until the counter of the other side no longer holds the value
+   * seen, first spinning and then sleeping.
+   *
+   * @return The new value of the counter
+   */
+  static boost::uint32_t wait_for_change(volatile boost::uint32_t *counter,
+                                         boost::uint32_t seen,
+                                         volatile boost::uint32_t *waiting,
+                                         boost::uint32_t *spin)
+  {
+    boost::uint32_t value;
+
+    for (boost::uint32_t i= 0; i < *spin && spsc_spin_allowed(); i++)
+    {
+      if ((value= *counter) != seen)
+      {
+        if (*spin < SPSC_SPIN_MAX)
+          *spin<<= 1;
+        __sync_synchronize();
+        return value;
+      }
+#if defined(__i386__) || defined(__x86_64__)
+      __asm__ __volatile__("pause");
+#endif
+    }
+
+    if (*spin > SPSC_SPIN_MIN)
+      *spin>>= 1;
+
+    for (;;)
+    {
+      *waiting= 1;
+      __sync_synchronize();
+      if ((value= *counter) != seen)
+        break;
+      futex(counter, FUTEX_WAIT_PRIVATE, seen);
+    }
+    *waiting= 0;
+    __sync_synchronize();
+    return value;
+  }
+
+  /*
+    Read only after construction. The object isn't cache line aligned, so
+    each group is followed by a full line of padding to keep the groups
+    written by the two sides off each other's lines.
+   */
+  boost::uint32_t m_capacity;
+  boost::uint32_t m_size;
+  boost::uint32_t m_mask;
+  T *m_items;
+  char m_pad0[SPSC_CACHE_LINE];
+
+  /* Producer side */
+  volatile boost::uint32_t m_head;
+  boost::uint32_t m_tail_cache;
+  boost::uint32_t m_producer_spin;
+  volatile boost::uint32_t m_consumer_waiting;
+  char m_pad1[SPSC_CACHE_LINE];
+
+  /* Consumer side */
+  volatile boost::uint32_t m_tail;
+  boost::uint32_t m_head_cache;
+  boost::uint32_t m_consumer_spin;
+  volatile boost::uint32_t m_producer_waiting;
+  char m_pad2[SPSC_CACHE_LINE];
+};
+
+#endif	/* _SPSC_RING_H */
@@ -27,6 +27,9 @@ SkySQL change details:
 - Added support for GTID event handling for both MySQL and MariaDB
 - Added support for starting binlog dump from GTID position
 - Added error handling using exceptions
+- Events are read into reusable buffers and parsed by the user thread
+- Event checksums are verified when requested
+- A lost connection resumes after the last complete transaction
 
 Author: Jan Lindström (jan.lindstrom@skysql.com
 
@@ -278,6 +281,23 @@ int Binlog_tcp_driver::fetch_server_version(const std::string& user,
     m_server_type = MYSQL_SERVER_TYPE_MYSQL;
   }
 
+  /*
+    Servers without binlog checksums don't know the variable and never
+    write checksums.
+   */
+  m_checksum_alg= BINLOG_CHECKSUM_ALG_OFF;
+  if (mysql_query(mysql, "SELECT @@global.binlog_checksum") == 0)
+  {
+    MYSQL_RES *res= mysql_store_result(mysql);
+    MYSQL_ROW row;
+
+    if (res && (row= mysql_fetch_row(res)) && row[0] &&
+        strcasecmp(row[0], "CRC32") == 0)
+      m_checksum_alg= BINLOG_CHECKSUM_ALG_CRC32;
+    if (res)
+      mysql_free_result(res);
+  }
+
   mysql_close(mysql);
 
   return false;
@@ -303,6 +323,13 @@ int Binlog_tcp_driver::connect(const std::string& user, const std::string& passw
   if(fetch_server_version(user, passwd, host, port))
     return 1;
 
+  /* Start from the given file on both server types */
+  if (!gtid.is_real_gtid() && binlog_filename != "")
+  {
+    m_binlog_file_name=binlog_filename;
+    m_binlog_offset=offset;
+  }
+
   /* Need to get master status if we do not know global transaction ID */
   if (m_server_type == MYSQL_SERVER_TYPE_MARIADB
       && !gtid.is_real_gtid())
@@ -347,6 +374,13 @@ int Binlog_tcp_driver::connect(const std::string& user, const std::string& passw
      use COM_BINLOG_DUMP.
   */
 
+  m_resume_file= m_binlog_file_name;
+  m_resume_pos= m_binlog_offset;
+  m_resume_gtid= gtid;
+  m_trx_gtid= Gtid();
+  m_resume_in_trx= false;
+  m_resume_standalone= false;
+
   if (gtid.is_real_gtid() && 
       m_server_type == MYSQL_SERVER_TYPE_MYSQL) {
     start_binlog_dump(gtid);
@@ -651,37 +685,11 @@ void Binlog_tcp_driver::start_binlog_dump(const Gtid gtid)
 
 }
 
-/**
- Helper function used to extract the event header from a memory block
- */
-static void proto_event_packet_header(boost::asio::streambuf &event_src, Log_event_header *h)
-{
-  std::istream is(&event_src);
-
-  Protocol_chunk<boost::uint8_t> prot_marker(h->marker);
-  Protocol_chunk<boost::uint32_t> prot_timestamp(h->timestamp);
-  Protocol_chunk<boost::uint8_t> prot_type_code(h->type_code);
-  Protocol_chunk<boost::uint32_t> prot_server_id(h->server_id);
-  Protocol_chunk<boost::uint32_t> prot_event_length(h->event_length);
-  Protocol_chunk<boost::uint32_t> prot_next_position(h->next_position);
-  Protocol_chunk<boost::uint16_t> prot_flags(h->flags);
-
-  is >> prot_marker
-          >> prot_timestamp
-          >> prot_type_code
-          >> prot_server_id
-          >> prot_event_length
-          >> prot_next_position
-          >> prot_flags;
-
-}
-
 void Binlog_tcp_driver::handle_net_packet(const boost::system::error_code& err, std::size_t bytes_transferred)
 {
   if (err)
   {
-    Binary_log_event * ev= create_incident_event(175, err.message().c_str(), m_binlog_offset);
-    m_event_queue->push_front(ev);
+    push_incident(err.message().c_str());
     return;
   }
 
@@ -693,54 +701,72 @@ void Binlog_tcp_driver::handle_net_packet(const boost::system::error_code& err,
        << " number of bytes; got "
        << bytes_transferred
        << " instead.";
-    Binary_log_event * ev= create_incident_event(175, os.str().c_str(), m_binlog_offset);
-    m_event_queue->push_front(ev);
+    push_incident(os.str().c_str());
     return;
   }
 
-  //assert(m_waiting_event != 0);
-  //std::cerr << "Committing '"<< bytes_transferred << "' bytes to the event stream." << std::endl;
-  //std::cerr << m_event_stream_buffer << std::endl;
+  Event_buffer *buf= m_receive_buffer;
+  buf->length+= bytes_transferred;
 
-  m_event_stream_buffer.commit(bytes_transferred);
   /*
-    If the event object doesn't have an event length it means that the header
-    hasn't been parsed. If the event stream also contains enough bytes
-    we make the assumption that the next bytes waiting in the stream is
-    the event header and attempt to parse it.
+    An event is preceded by a status byte which is 0 for an event and
+    0xFF for an error packet, e.g. when the requested binlog position
+    doesn't exist. The server closes the connection after an error.
    */
-  if (m_waiting_event->event_length == 0 && m_event_stream_buffer.size() >= 19)
+  if (buf->header.event_length == 0 && buf->data[0] == 0xFF)
   {
-    /*
-      Copy and remove from the event stream, the remaining bytes might be
-      dynamic payload.
-     */
-    //std::cerr << "Consuming event stream for header. Size before: " << m_event_stream_buffer.size() << std::endl;
-    proto_event_packet_header(m_event_stream_buffer, m_waiting_event);
-    //std::cerr << " Size after: " << m_event_stream_buffer.size() << std::endl;
+    std::string message("Binlog dump failed");
+    size_t start= 3;  // status byte and error code
+
+    if (buf->length > start && buf->data[start] == '#')
+      start+= 6;      // SQL state
+    if (buf->length > start)
+      message.append(": ").append((char *) &buf->data[start], buf->length - start);
+    push_incident(message.c_str());
+    return;
   }
 
-  //std::cerr << "Event length: and available payload size is " << m_event_stream_buffer.size()+LOG_EVENT_HEADER_SIZE-1 <<  std::endl;
-  if (m_waiting_event->event_length == m_event_stream_buffer.size() + LOG_EVENT_HEADER_SIZE - 1)
+  /*
+    The header is decoded in place once it has arrived. Events larger than
+    a packet continue in the following packets which are appended to the
+    same buffer until the whole event is in.
+   */
+  if (buf->header.event_length == 0 && buf->length >= LOG_EVENT_HEADER_SIZE)
   {
-    /*
-     If the header length equals the size of the payload plus the
-     size of the header, the event object is complete.
-     Next we need to parse the payload buffer
-     */
-    std::istream is(&m_event_stream_buffer);
-    Binary_log_event * event= parse_event(is, m_waiting_event);
-
-    m_event_stream_buffer.consume(m_event_stream_buffer.size());
-
-    m_event_queue->push_front(event);
+    proto_event_packet_header(&buf->data[0], &buf->header);
+    if (buf->header.event_length < LOG_EVENT_HEADER_SIZE - 1)
+    {
+      std::ostringstream os;
+      os << "Invalid event length "
+         << buf->header.event_length
+         << " in binlog event header.";
+      push_incident(os.str().c_str());
+      return;
+    }
+  }
 
+  if (buf->header.event_length != 0 &&
+      buf->length >= (size_t) buf->header.event_length + 1)
+  {
     /*
-      Note on memory management: The pushed Binary_log_event will be
-      deleted in user land.
-    */
-    delete m_waiting_event;
-    m_waiting_event= 0;
+      The event is complete. It is parsed by the user application thread,
+      either in place or into an event object.
+     */
+    if (m_verify_checksum && m_checksum_alg == BINLOG_CHECKSUM_ALG_CRC32 &&
+        !binlog_event_checksum_ok(&buf->data[1], buf->header.event_length))
+    {
+      std::ostringstream os;
+      os << "Binlog event checksum mismatch in event of type "
+         << (int) buf->header.type_code
+         << " ending at position "
+         << buf->header.next_position
+         << ".";
+      push_incident(os.str().c_str());
+      return;
+    }
+    track_resume_position(buf);
+    m_receive_buffer= 0;
+    m_event_queue->push_front(buf);
   }
 
   if (!m_shutdown)
@@ -752,8 +778,7 @@ void Binlog_tcp_driver::handle_net_packet_header(const boost::system::error_code
 {
   if (err)
   {
-    Binary_log_event * ev= create_incident_event(175, err.message().c_str(), m_binlog_offset);
-    m_event_queue->push_front(ev);
+    push_incident(err.message().c_str());
     return;
   }
 
@@ -765,8 +790,7 @@ void Binlog_tcp_driver::handle_net_packet_header(const boost::system::error_code
        << " number of bytes; got "
        << bytes_transferred
        << " instead.";
-    Binary_log_event * ev= create_incident_event(175, os.str().c_str(), m_binlog_offset);
-    m_event_queue->push_front(ev);
+    push_incident(os.str().c_str());
     return;
   }
 
@@ -777,16 +801,15 @@ void Binlog_tcp_driver::handle_net_packet_header(const boost::system::error_code
   // TODO validate packet sequence numbers
   //int packet_no=(unsigned char) m_net_header[3];
 
-  if (m_waiting_event == 0)
-  {
-    //std::cerr << "event_stream_buffer.size= " << m_event_stream_buffer.size() << std::endl;
-    m_waiting_event= new Log_event_header();
-    m_event_packet=  boost::asio::buffer_cast<char *>(m_event_stream_buffer.prepare(packet_length));
-    //assert(m_event_stream_buffer.size() == 0);
-  }
+  if (m_receive_buffer == 0)
+    m_receive_buffer= acquire_buffer();
+
+  Event_buffer *buf= m_receive_buffer;
+  if (buf->data.size() < buf->length + packet_length)
+    buf->data.resize(buf->length + packet_length);
 
   boost::asio::async_read(*m_socket,
-                          boost::asio::buffer(m_event_packet, packet_length),
+                          boost::asio::buffer(&buf->data[buf->length], packet_length),
                           boost::bind(&Binlog_tcp_driver::handle_net_packet,
                                       this,
                                       boost::asio::placeholders::error,
@@ -794,6 +817,34 @@ void Binlog_tcp_driver::handle_net_packet_header(const boost::system::error_code
 
 }
 
+Event_buffer *Binlog_tcp_driver::acquire_buffer()
+{
+  Event_buffer *buf;
+
+  m_free_buffers->pop_back(&buf);
+  buf->length= 0;
+  buf->header.event_length= 0;
+  buf->event= 0;
+  return buf;
+}
+
+void Binlog_tcp_driver::release_buffer(Event_buffer *buf)
+{
+  delete buf->event;
+  buf->event= 0;
+  m_free_buffers->push_front(buf);
+}
+
+void Binlog_tcp_driver::push_incident(const char *message)
+{
+  Event_buffer *buf= m_receive_buffer ? m_receive_buffer : acquire_buffer();
+
+  m_receive_buffer= 0;
+  buf->event= create_incident_event(175, message, m_binlog_offset);
+  buf->header= *buf->event->header();
+  m_event_queue->push_front(buf);
+}
+
 int Binlog_tcp_driver::authenticate(tcp::socket *socket, const std::string& user, const std::string& passwd,
                      const st_handshake_package &handshake_package)
 {
@@ -904,11 +955,75 @@ int Binlog_tcp_driver::authenticate(tcp::socket *socket, const std::string& user
 
 int Binlog_tcp_driver::wait_for_next_event(mysql::Binary_log_event **event_ptr)
 {
-  // poll for new event until one event is found.
-  // return the event
+  Binary_log_event_view view;
+  Binary_log_event *event;
+
   if (event_ptr)
     *event_ptr= 0;
-  m_event_queue->pop_back(event_ptr);
+
+  wait_for_next_event_view(&view);
+
+  /*
+    Incidents raised by the driver already are event objects, hand them
+    over instead of copying.
+   */
+  if (m_consumer_buffer->event)
+  {
+    event= m_consumer_buffer->event;
+    m_consumer_buffer->event= 0;
+  }
+  else
+    event= copy_event(view);
+
+  release_buffer(m_consumer_buffer);
+  m_consumer_buffer= 0;
+
+  if (event_ptr)
+    *event_ptr= event;
+  else
+    delete event;
+  return 0;
+}
+
+int Binlog_tcp_driver::wait_for_next_event_view(mysql::Binary_log_event_view *view)
+{
+  Event_buffer *buf;
+
+  if (m_consumer_buffer)
+  {
+    release_buffer(m_consumer_buffer);
+    m_consumer_buffer= 0;
+  }
+
+  if (m_pending_next == m_pending_count)
+  {
+    m_pending_count= m_event_queue->pop_batch(m_pending, EVENT_BATCH_SIZE);
+    m_pending_next= 0;
+  }
+  buf= m_pending[m_pending_next++];
+  m_consumer_buffer= buf;
+
+  view->m_header= buf->header;
+  view->m_event= buf->event;
+  if (buf->event)
+  {
+    view->m_body= 0;
+    view->m_body_length= 0;
+    return 0;
+  }
+
+  view->m_body= &buf->data[LOG_EVENT_HEADER_SIZE];
+  view->m_body_length= buf->header.event_length - (LOG_EVENT_HEADER_SIZE - 1);
+
+  /*
+    Keep track of the binlog file like parse_event() does for event objects.
+   */
+  if (buf->header.type_code == ROTATE_EVENT && view->m_body_length >= 8)
+  {
+    m_binlog_offset= (unsigned long) proto_read_le(view->m_body, 8);
+    m_binlog_file_name.assign((const char *) view->m_body + 8,
+                              view->m_body_length - 8);
+  }
   return 0;
 }
 
@@ -941,7 +1056,7 @@ void Binlog_tcp_driver::start_event_loop()
       break;
     }
 
-    reconnect();
+    resume();
   }
 
 }
@@ -957,6 +1072,13 @@ int Binlog_tcp_driver::connect()
   return connect(m_user, m_passwd, m_host, m_port, gtid);
 }
 
+int Binlog_tcp_driver::connect(const std::string &binlog_file,
+                               const boost::uint64_t binlog_pos)
+{
+  Gtid gtid = Gtid();
+  return connect(m_user, m_passwd, m_host, m_port, gtid, binlog_file, (size_t)binlog_pos);
+}
+
 int Binlog_tcp_driver::connect(boost::uint64_t binlog_pos)
 {
   Gtid gtid = Gtid();
@@ -973,21 +1095,125 @@ void Binlog_tcp_driver::reconnect(const Gtid gtid)
   connect(m_user, m_passwd, m_host, m_port, gtid);
 }
 
+void Binlog_tcp_driver::resume()
+{
+  disconnect();
+  if (m_server_type == MYSQL_SERVER_TYPE_MARIADB && m_resume_gtid.is_real_gtid())
+    connect(m_user, m_passwd, m_host, m_port, m_resume_gtid);
+  else
+    connect(m_user, m_passwd, m_host, m_port, Gtid(), m_resume_file, m_resume_pos);
+}
+
+void Binlog_tcp_driver::track_resume_position(const Event_buffer *buf)
+{
+  const Log_event_header &header= buf->header;
+  const boost::uint8_t *body= &buf->data[LOG_EVENT_HEADER_SIZE];
+  size_t body_length= header.event_length - (LOG_EVENT_HEADER_SIZE - 1);
+
+  if (m_checksum_alg == BINLOG_CHECKSUM_ALG_CRC32 &&
+      body_length >= BINLOG_CHECKSUM_LEN)
+    body_length-= BINLOG_CHECKSUM_LEN;
+
+  switch (header.type_code)
+  {
+  case ROTATE_EVENT:
+    if (body_length >= 8)
+    {
+      m_resume_pos= (unsigned long) proto_read_le(body, 8);
+      m_resume_file.assign((const char *) body + 8, body_length - 8);
+    }
+    return;
+
+  case GTID_EVENT_MARIADB:
+    /* Sequence number, domain id and flags, bit 0 is standalone */
+    if (body_length >= 13)
+    {
+      m_trx_gtid= Gtid((boost::uint32_t) proto_read_le(body + 8, 4),
+                       header.server_id, proto_read_le(body, 8));
+      m_resume_in_trx= true;
+      m_resume_standalone= (body[12] & 1) != 0;
+    }
+    return;
+
+  case QUERY_EVENT:
+  {
+    /*
+      Thread id, execution time, database name length, error code and
+      status variables length come before the status variables, the
+      database name with its terminator and the query.
+     */
+    if (body_length < 13)
+      return;
+    size_t skip= 13 + proto_read_le(body + 11, 2) + body[8] + 1;
+    const char *query= (const char *) body + skip;
+    size_t query_length= body_length > skip ? body_length - skip : 0;
+
+    if (query_length == 5 && memcmp(query, "BEGIN", 5) == 0)
+    {
+      m_resume_in_trx= true;
+      return;
+    }
+    if (m_resume_in_trx && !m_resume_standalone &&
+        !(query_length == 6 && memcmp(query, "COMMIT", 6) == 0))
+      return;
+    break;
+  }
+
+  case XID_EVENT:
+    break;
+
+  default:
+    if (m_resume_in_trx)
+      return;
+    if (header.next_position)
+      m_resume_pos= header.next_position;
+    return;
+  }
+
+  /* The transaction is complete */
+  m_resume_in_trx= false;
+  m_resume_standalone= false;
+  if (m_trx_gtid.is_real_gtid())
+    m_resume_gtid= m_trx_gtid;
+  if (header.next_position)
+    m_resume_pos= header.next_position;
+}
+
 void Binlog_tcp_driver::disconnect()
 {
-  Binary_log_event * event;
-  m_waiting_event= 0;
-  m_event_stream_buffer.consume(m_event_stream_buffer.in_avail());
-  while(m_event_queue->has_unread())
+  /*
+    This runs in the io thread on reconnect, which must not push to the
+    free list. A partly received event is dropped by reusing its buffer
+    for the next connection instead. Complete events stay queued.
+  */
+  if (m_receive_buffer)
   {
-    m_event_queue->pop_back(&event);
-    delete(event);
+    delete m_receive_buffer->event;
+    m_receive_buffer->event= 0;
+    m_receive_buffer->length= 0;
+    m_receive_buffer->header.event_length= 0;
   }
   if (m_socket)
     m_socket->close();
   m_socket= 0;
 }
 
+void Binlog_tcp_driver::flush_events()
+{
+  Event_buffer *buf;
+
+  if (m_consumer_buffer)
+    release_buffer(m_consumer_buffer);
+  m_consumer_buffer= 0;
+  while (m_pending_next < m_pending_count)
+    release_buffer(m_pending[m_pending_next++]);
+  m_pending_next= m_pending_count= 0;
+  while (m_event_queue->has_unread())
+  {
+    m_event_queue->pop_back(&buf);
+    release_buffer(buf);
+  }
+}
 
 void Binlog_tcp_driver::shutdown(void)
 {
@@ -1042,6 +1268,7 @@ int Binlog_tcp_driver::set_position(const std::string &str, unsigned long positi
   }
   m_event_loop= 0;
   disconnect();
+  flush_events();
   /*
     Uppon return of connect we only know if we succesfully authenticated
     against the server. The binlog dump command is executed asynchronously
@@ -1236,6 +1463,7 @@ int Binlog_tcp_driver::set_position_gtid(const Gtid gtid)
   }
   m_event_loop= 0;
   disconnect();
+  flush_events();
   /*
     Uppon return of connect we only know if we succesfully authenticated
     against the server. The binlog dump command is executed asynchronously
@@ -27,6 +27,8 @@ SkySQL change details:
 - Added support for GTID event handling for both MySQL and MariaDB
 - Added support for starting binlog dump from GTID position
 - Added support for MariaDB server
+- Events are received into reusable buffers and can be read as views
+- Events are handed to the user thread through a lock free ring
 
 Author: Jan Lindström (jan.lindstrom@skysql.com
 
@@ -38,13 +40,21 @@ Author: Jan Lindström (jan.lindstrom@skysql.com
 #include "protocol.h"
 #include <boost/asio.hpp>
 #include <boost/thread.hpp>
-#include "bounded_buffer.h"
+#include "spsc_ring.h"
 #include "gtid.h"
 #include <mysql.h>
 
 
 #define MAX_PACKAGE_SIZE 0xffffff
 
+/* Number of received events waiting for the user application */
+#define EVENT_QUEUE_SIZE 50
+/* One buffer being received and one held by the user on top of the queue */
+#define EVENT_BUFFER_COUNT (EVENT_QUEUE_SIZE + 2)
+#define EVENT_BUFFER_INITIAL_SIZE 8192
+/* Events taken from the queue at a time by the user thread */
+#define EVENT_BATCH_SIZE 16
+
 #define GET_NEXT_PACKET_HEADER   \
    boost::asio::async_read(*m_socket, boost::asio::buffer(m_net_header, 4), \
      boost::bind(&Binlog_tcp_driver::handle_net_packet_header, this, \
@@ -54,6 +64,25 @@ using boost::asio::ip::tcp;
 
 namespace mysql { namespace system {
 
+/**
+ * A reusable receive buffer holding one binlog event: the status byte of
+ * the packet followed by the event. The buffers are recycled through a
+ * free list, so once they have grown to the event sizes of the stream no
+ * memory is allocated per event.
+ */
+struct Event_buffer
+{
+    Event_buffer() : data(EVENT_BUFFER_INITIAL_SIZE), length(0), event(0)
+    {
+        header.event_length= 0;
+    }
+
+    std::vector<boost::uint8_t> data;
+    size_t length;              // Bytes received so far
+    Log_event_header header;    // Decoded once the header has arrived
+    Binary_log_event *event;    // Incident raised by the driver, if any
+};
+
 class Binlog_tcp_driver : public Binary_log_driver
 {
 public:
@@ -61,14 +90,31 @@ public:
     Binlog_tcp_driver(const std::string& user, const std::string& passwd,
                       const std::string& host, unsigned long port)
       : Binary_log_driver("", 4), m_host(host), m_user(user), m_passwd(passwd),
-        m_port(port), m_socket(NULL), m_waiting_event(0), m_event_loop(0),
+        m_port(port), m_socket(NULL), m_event_loop(0),
     m_total_bytes_transferred(0), m_shutdown(false), m_packet_no(0),
-        m_event_queue(new bounded_buffer<Binary_log_event*>(50))
+        m_event_queue(new spsc_ring<Event_buffer*>(EVENT_QUEUE_SIZE)),
+        m_free_buffers(new spsc_ring<Event_buffer*>(EVENT_BUFFER_COUNT)),
+        m_receive_buffer(0), m_consumer_buffer(0),
+        m_pending_count(0), m_pending_next(0),
+        m_resume_pos(4), m_resume_in_trx(false), m_resume_standalone(false)
     {
+        for (int i= 0; i < EVENT_BUFFER_COUNT; i++)
+            m_free_buffers->push_front(new Event_buffer());
     }
 
     ~Binlog_tcp_driver()
     {
+        Event_buffer *buf;
+
+        if (m_receive_buffer)
+            release_buffer(m_receive_buffer);
+        flush_events();
+        while (m_free_buffers->has_unread())
+        {
+            m_free_buffers->pop_back(&buf);
+            delete buf;
+        }
+        delete m_free_buffers;
         delete m_event_queue;
         delete m_socket;
     }
@@ -79,12 +125,20 @@ public:
     int connect();
     int connect(const Gtid gtid);
     int connect(const boost::uint64_t binlog_pos);
+    int connect(const std::string &binlog_file, const boost::uint64_t binlog_pos);
 
     /**
      * Blocking wait for the next binary log event to reach the client
      */
     int wait_for_next_event(mysql::Binary_log_event **event);
 
+    /**
+     * Blocking wait for the next binary log event, returned as a view over
+     * the receive buffer. The buffer of the previous view is recycled by
+     * this call.
+     */
+    int wait_for_next_event_view(mysql::Binary_log_event_view *view);
+
     /**
      * Reconnects to the master with a new binlog dump request.
      */
@@ -207,19 +261,55 @@ private:
      */
     void reconnect(Gtid gtid = Gtid());
 
+    /**
+     * Reconnect after the connection was lost, continuing after the last
+     * transaction received completely.
+     */
+    void resume(void);
+
+    /**
+     * Follow the transaction boundaries of the received events to know
+     * where resume() continues from. Io thread only.
+     */
+    void track_resume_position(const Event_buffer *buf);
+
     /**
      * Disconnet from the server. The io service must have been stopped before
      * this function is called.
-     * The event queue is emptied.
+     * A partly received event is dropped, complete events stay queued.
      */
     void disconnect(void);
 
+    /**
+     * Return the events not yet read by the user application to the free
+     * list. The io service must have been stopped before this function is
+     * called, as it pops the event queue like the user application does.
+     */
+    void flush_events(void);
+
     /**
      * Terminates the io service and sets the shudown flag.
      * this causes the event loop to terminate.
      */
     void shutdown(void);
 
+    /**
+     * Take a buffer from the free list, waiting until the user application
+     * has released one if they are all in use.
+     */
+    Event_buffer *acquire_buffer(void);
+
+    /**
+     * Return a buffer to the free list.
+     */
+    void release_buffer(Event_buffer *buf);
+
+    /**
+     * Queue an incident event for the user application in place of the
+     * event being received.
+     */
+    void push_incident(const char *message);
+
     boost::thread *m_event_loop;
     boost::asio::io_service m_io_service;
     tcp::socket *m_socket;
@@ -252,25 +342,57 @@ private:
      */
     boost::uint8_t m_net_header[4];
 
+    /**
+     * Where resume() continues: the position after the last complete
+     * transaction and, on MariaDB, its GTID. Only used by the io thread
+     * once the dump has started. The events of a partly received
+     * transaction are sent again after a resume.
+     */
+    std::string m_resume_file;
+    unsigned long m_resume_pos;
+    Gtid m_resume_gtid;
+    Gtid m_trx_gtid;
+    bool m_resume_in_trx;
+    bool m_resume_standalone;
+
     /**
      *
      */
     boost::uint8_t m_net_packet[MAX_PACKAGE_SIZE];
-    boost::asio::streambuf m_event_stream_buffer;
-    char * m_event_packet;
+
+    Log_event_header m_log_event_header;
+    /**
+     * A ring used to dispatch received events to the user application.
+     * The io thread is its only producer and the user thread its only
+     * consumer.
+     */
+    spsc_ring<Event_buffer *> *m_event_queue;
 
     /**
-     * This pointer points to an object constructed from event
-     * stream during async communication with
-     * server. If it is 0 it means that no event has been
-     * constructed yet.
+     * Buffers not in use by the receiver or the user application. The user
+     * thread is its only producer and the io thread its only consumer.
      */
-    Log_event_header *m_waiting_event;
-    Log_event_header m_log_event_header;
+    spsc_ring<Event_buffer *> *m_free_buffers;
+
+    /**
+     * The buffer the event currently being received from the server is
+     * read into, 0 between events.
+     */
+    Event_buffer *m_receive_buffer;
+
+    /**
+     * The buffer of the last event returned to the user application. It
+     * is recycled on the next call to wait_for_next_event_view().
+     */
+    Event_buffer *m_consumer_buffer;
+
     /**
-     * A ring buffer used to dispatch aggregated events to the user application
+     * Events taken from the queue in one batch and not yet returned to
+     * the user application.
      */
-    bounded_buffer<Binary_log_event *> *m_event_queue;
+    Event_buffer *m_pending[EVENT_BATCH_SIZE];
+    boost::uint32_t m_pending_count;
+    boost::uint32_t m_pending_next;
 
     std::string m_user;
     std::string m_host;
@@ -0,0 +1,140 @@
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file brlock.c  -  Reader-writer lock with a reader counter per thread
+ */
+#include <sched.h>
+#include <string.h>
+#include <brlock.h>
+#include <atomic.h>
+
+/**
+ * The pause between two looks at the lock, also a compiler barrier
+ */
+#if defined(__i386__) || defined(__x86_64__)
+#define	BRLOCK_PAUSE()	__asm__ __volatile__("pause" ::: "memory")
+#else
+#define	BRLOCK_PAUSE()	__asm__ __volatile__("" ::: "memory")
+#endif
+
+#define	BRLOCK_SPINS	1000	/*< Pauses of a writer before it yields */
+
+static	int		next_slot = 0;		/*< Counter of the next new thread */
+static	__thread int	thread_slot = -1;	/*< Counter of the calling thread */
+
+/**
+ * Return the index of the reader counter of the calling thread
+ */
+static inline int
+brlock_slot()
+{
+	if (thread_slot < 0)
+		thread_slot = atomic_add(&next_slot, 1) & (BRLOCK_SLOTS - 1);
+	return thread_slot;
+}
+
+/**
+ * Initialise a lock that is not statically initialised with BRLOCK_INIT
+ *
+ * @param lock	The lock to initialise
+ */
+void
+brlock_init(BRLOCK *lock)
+{
+	memset(lock, 0, sizeof(BRLOCK));
+	spinlock_init(&lock->wlock);
+}
+
+/**
+ * Acquire a read lock. The reader adds itself to its counter and then
+ * checks for a writer, the writer sets its flag and then checks the
+ * counters, so at least one of them sees the other. A reader that finds
+ * a writer backs off and waits for it to finish.
+ *
+ * @param lock	The lock to acquire
+ */
+void
+brlock_read_acquire(BRLOCK *lock)
+{
+BRLOCK_SLOT	*slot = &lock->slots[brlock_slot()];
+
+	while (1)
+	{
+		while (lock->writer)
+			BRLOCK_PAUSE();
+		/*< The locked add orders the counter before the flag read */
+		atomic_add((int *)&slot->readers, 1);
+		if (lock->writer == 0)
+			return;
+		atomic_add((int *)&slot->readers, -1);
+	}
+}
+
+/**
+ * Release a read lock
+ *
+ * @param lock	The lock to release
+ */
+void
+brlock_read_release(BRLOCK *lock)
+{
+	/*< Shared with other threads if there are more than BRLOCK_SLOTS */
+	atomic_add((int *)&lock->slots[thread_slot].readers, -1);
+}
+
+/**
+ * Acquire the write lock. Writers take the spinlock of the lock one at a
+ * time, set the writer flag and wait for the readers already in to leave.
+ *
+ * @param lock	The lock to acquire
+ */
+void
+brlock_write_acquire(BRLOCK *lock)
+{
+int	i, spins;
+
+	spinlock_acquire(&lock->wlock);
+	lock->writer = 1;
+	/*< Order the flag before the reads of the counters */
+	__sync_synchronize();
+	for (i = 0; i < BRLOCK_SLOTS; i++)
+	{
+		for (spins = 0; lock->slots[i].readers != 0; spins++)
+		{
+			if (spins > BRLOCK_SPINS)
+				sched_yield();
+			else
+				BRLOCK_PAUSE();
+		}
+	}
+}
+
+/**
+ * Release the write lock
+ *
+ * @param lock	The lock to release
+ */
+void
+brlock_write_release(BRLOCK *lock)
+{
+	/*< The updates are visible before a reader can get in */
+	__sync_synchronize();
+	lock->writer = 0;
+	spinlock_release(&lock->wlock);
+}
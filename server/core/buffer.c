@@ -38,14 +38,16 @@
 #include <stdlib.h>
 #include <buffer.h>
 #include <atomic.h>
+#include <slab.h>
 #include <skygw_debug.h>
 
+static void gwbuf_free_buffer_objects(SHARED_BUF *sbuf);
+
 /**
  * Allocate a new gateway buffer structure of size bytes.
  *
- * For now we allocate memory directly from malloc for buffer the management
- * structure and the actual data buffer itself. We may swap at a future date
- * to a more effecient mechanism.
+ * The buffer management structure, the shared buffer and the data area are
+ * taken from the size classed slab cache of the calling thread, see slab.c.
  *
  * @param	size The size in bytes of the data area required
  * @return	Pointer to the buffer structure or NULL if memory could not
@@ -57,29 +59,51 @@ gwbuf_alloc(unsigned int size)
 GWBUF		*rval;
 SHARED_BUF	*sbuf;
 
-	// Allocate the buffer header
-	if ((rval = (GWBUF *)malloc(sizeof(GWBUF))) == NULL)
+	if (size <= GWBUF_INLINE_SIZE)
 	{
-		return NULL;
+		/*
+		 * Small buffer, the shared buffer and the data follow the
+		 * buffer header in a single allocation.
+		 */
+		if ((rval = (GWBUF *)slab_alloc(sizeof(GWBUF) +
+				sizeof(SHARED_BUF) + size)) == NULL)
+		{
+			return NULL;
+		}
+		sbuf = (SHARED_BUF *)(rval + 1);
+		sbuf->data = (unsigned char *)(sbuf + 1);
+		sbuf->size = slab_size(rval) - sizeof(GWBUF) - sizeof(SHARED_BUF);
+		sbuf->info = SHARED_BUF_INLINE;
 	}
-
-	// Allocate the shared data buffer
-	if ((sbuf = (SHARED_BUF *)malloc(sizeof(SHARED_BUF))) == NULL)
+	else
 	{
-		free(rval);
-		return NULL;
-	}
+		// Allocate the buffer header
+		if ((rval = (GWBUF *)slab_alloc(sizeof(GWBUF))) == NULL)
+		{
+			return NULL;
+		}
 
-	// Allocate the space for the actual data
-	if ((sbuf->data = (unsigned char *)malloc(size)) == NULL)
-	{
-		free(rval);
-		free(sbuf);
-		return NULL;
+		// Allocate the shared data buffer
+		if ((sbuf = (SHARED_BUF *)slab_alloc(sizeof(SHARED_BUF))) == NULL)
+		{
+			slab_free(rval);
+			return NULL;
+		}
+
+		// Allocate the space for the actual data
+		if ((sbuf->data = (unsigned char *)slab_alloc(size)) == NULL)
+		{
+			slab_free(rval);
+			slab_free(sbuf);
+			return NULL;
+		}
+		sbuf->size = slab_size(sbuf->data);
+		sbuf->info = 0;
 	}
 	rval->start = sbuf->data;
 	rval->end = rval->start + size;
 	sbuf->refcount = 1;
+	sbuf->bufobj = NULL;
 	rval->sbuf = sbuf;
 	rval->next = NULL;
         rval->gwbuf_type = GWBUF_TYPE_UNDEFINED;
@@ -91,18 +115,39 @@ SHARED_BUF	*sbuf;
 /**
  * Free a gateway buffer
  *
+ * If the shared buffer was allocated inline with the buffer header of the
+ * original GWBUF, that header is only released together with the
+ * shared buffer, once every clone of the buffer has been freed.
+ *
  * @param buf The buffer to free
  */
 void
 gwbuf_free(GWBUF *buf)
 {
+SHARED_BUF	*sbuf = buf->sbuf;
+int		ishost;
+
 	CHK_GWBUF(buf);
-	if (atomic_add(&buf->sbuf->refcount, -1) == 1)
+	ishost = (sbuf->info & SHARED_BUF_INLINE) && (void *)(buf + 1) == (void *)sbuf;
+
+	if (atomic_add(&sbuf->refcount, -1) == 1)
 	{
-                free(buf->sbuf->data);
-                free(buf->sbuf);
+		gwbuf_free_buffer_objects(sbuf);
+		if (sbuf->info & SHARED_BUF_INLINE)
+		{
+			/*< Releases the hosting header, the sbuf and the data */
+			slab_free(((GWBUF *)sbuf) - 1);
+		}
+		else
+		{
+			slab_free(sbuf->data);
+			slab_free(sbuf);
+		}
+	}
+	if (!ishost)
+	{
+		slab_free(buf);
 	}
-	free(buf);
 }
 
 /**
@@ -120,7 +165,7 @@ gwbuf_clone(GWBUF *buf)
 {
 GWBUF	*rval;
 
-	if ((rval = (GWBUF *)malloc(sizeof(GWBUF))) == NULL)
+	if ((rval = (GWBUF *)slab_alloc(sizeof(GWBUF))) == NULL)
 	{
 		return NULL;
 	}
@@ -146,7 +191,7 @@ GWBUF *gwbuf_clone_portion(
         CHK_GWBUF(buf);
         ss_dassert(start_offset+length <= GWBUF_LENGTH(buf));
         
-        if ((clonebuf = (GWBUF *)malloc(sizeof(GWBUF))) == NULL)
+        if ((clonebuf = (GWBUF *)slab_alloc(sizeof(GWBUF))) == NULL)
         {
                 return NULL;
         }
@@ -338,5 +383,132 @@ void gwbuf_set_type(
         }
 }
 
+/**
+ * Attach an object to the shared data of a buffer. Every clone of the
+ * buffer sees the object and it is freed with the data.
+ *
+ * The objects are not protected by a lock, the caller must be the only
+ * user of the buffer and its clones while objects are added or removed,
+ * as is the case for a statement passed down a filter chain.
+ *
+ * @param buf		The buffer, the object belongs to the packet at
+ *			its start
+ * @param id		The object identifier, an existing object of
+ *			the packet with the same identifier is replaced
+ * @param data		The object
+ * @param freefn	Routine to free the object or NULL
+ * @return		1 on success, 0 if memory could not be allocated
+ */
+int
+gwbuf_add_buffer_object(GWBUF *buf, bufobj_id_t id, void *data,
+			void (*freefn)(void *))
+{
+BUFFER_OBJECT	*obj;
+
+	CHK_GWBUF(buf);
+	if ((obj = (BUFFER_OBJECT *)malloc(sizeof(BUFFER_OBJECT))) == NULL)
+		return 0;
+	gwbuf_remove_buffer_object(buf, id);
+	obj->id = id;
+	obj->start = buf->start;
+	obj->data = data;
+	obj->freefn = freefn;
+	obj->next = buf->sbuf->bufobj;
+	buf->sbuf->bufobj = obj;
+	return 1;
+}
+
+/**
+ * Find an object attached to the data of a buffer
+ *
+ * @param buf	The buffer, the object of the packet at its start is found
+ * @param id	The object identifier
+ * @return	The object or NULL if there is none
+ */
+void *
+gwbuf_get_buffer_object_data(GWBUF *buf, bufobj_id_t id)
+{
+BUFFER_OBJECT	*obj;
+
+	CHK_GWBUF(buf);
+	for (obj = buf->sbuf->bufobj; obj; obj = obj->next)
+	{
+		if (obj->id == id && obj->start == buf->start)
+			return obj->data;
+	}
+	return NULL;
+}
+
+/**
+ * Remove and free an object attached to the data of a buffer, this must
+ * be done whenever the data is modified in place.
+ *
+ * @param buf	The buffer
+ * @param id	The object identifier
+ */
+void
+gwbuf_remove_buffer_object(GWBUF *buf, bufobj_id_t id)
+{
+BUFFER_OBJECT	**pp, *obj;
+
+	CHK_GWBUF(buf);
+	for (pp = &buf->sbuf->bufobj; (obj = *pp) != NULL; pp = &obj->next)
+	{
+		if (obj->id == id && obj->start == buf->start)
+		{
+			*pp = obj->next;
+			if (obj->freefn)
+				obj->freefn(obj->data);
+			free(obj);
+			return;
+		}
+	}
+}
+
+/**
+ * Remove and free all the objects of the packet at the start of a buffer
+ *
+ * @param buf	The buffer
+ */
+void
+gwbuf_remove_buffer_objects(GWBUF *buf)
+{
+BUFFER_OBJECT	**pp, *obj;
+
+	CHK_GWBUF(buf);
+	pp = &buf->sbuf->bufobj;
+	while ((obj = *pp) != NULL)
+	{
+		if (obj->start == buf->start)
+		{
+			*pp = obj->next;
+			if (obj->freefn)
+				obj->freefn(obj->data);
+			free(obj);
+		}
+		else
+		{
+			pp = &obj->next;
+		}
+	}
+}
 
+/**
+ * Free the objects of a shared buffer, called when the last reference
+ * to the shared buffer goes.
+ *
+ * @param sbuf	The shared buffer
+ */
+static void
+gwbuf_free_buffer_objects(SHARED_BUF *sbuf)
+{
+BUFFER_OBJECT	*obj;
 
+	while ((obj = sbuf->bufobj) != NULL)
+	{
+		sbuf->bufobj = obj->next;
+		if (obj->freefn)
+			obj->freefn(obj->data);
+		free(obj);
+	}
+}
@@ -37,18 +37,26 @@
  *
  * @endverbatim
  */
+/** for sched_getaffinity */
+#define _GNU_SOURCE
+#include <sched.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/un.h>
 #include <ini.h>
 #include <config.h>
 #include <service.h>
 #include <server.h>
 #include <users.h>
 #include <monitor.h>
+#include <statistics.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <mysql.h>
+#include <slab.h>
+#include <pollengine.h>
 
 extern int lm_enabled_logfiles_bitmask;
 
@@ -58,8 +66,19 @@ static	void	free_config_context(CONFIG_CONTEXT	*);
 static	char 	*config_get_value(CONFIG_PARAMETER *, const char *);
 static	int	handle_global_item(const char *, const char *);
 static	void	global_defaults();
+static	void	config_log_policy();
+static	int	config_cgroup_cpus();
+static	int	config_auto_threads();
 static	void	check_config_objects(CONFIG_CONTEXT *context);
 static	int	config_truth_value(char *str);
+static	void	server_set_persist_params(SERVER *server, CONFIG_PARAMETER *params);
+static	void	server_set_compress_params(SERVER *server, CONFIG_PARAMETER *params);
+static	void	server_set_socket_param(SERVER *server, CONFIG_PARAMETER *params);
+static	void	server_set_circuit_params(SERVER *server, CONFIG_PARAMETER *params);
+static	int	listener_set_listen_params(CONFIG_CONTEXT *obj, SERVICE *service,
+				char *protocol, unsigned short port);
+static	int	listener_set_ssl_params(CONFIG_CONTEXT *obj, SERVICE *service,
+					char *protocol, unsigned short port);
 
 static	char		*config_file = NULL;
 static	GATEWAY_CONF	gateway;
@@ -147,7 +166,11 @@ int		rval;
 		return 0;
 
 	config_file = file;
+	config_log_policy();
+	slab_set_huge_pages(gateway.huge_pages);
 
+	/*< The per thread statistics of the objects need the thread count */
+	ts_stats_init(config_threadcount());
 	check_config_objects(config.next);
 	rval = process_config_context(config.next);
 	free_config_context(config.next);
@@ -171,6 +194,12 @@ int		rval;
 
 	if (gateway.version_string)
 		free(gateway.version_string);
+	if (gateway.thread_affinity)
+		free(gateway.thread_affinity);
+	if (gateway.qc_cache_file)
+		free(gateway.qc_cache_file);
+	if (gateway.handoff_socket)
+		free(gateway.handoff_socket);
 
 	global_defaults();
 
@@ -180,6 +209,8 @@ int		rval;
 	if (ini_parse(config_file, handler, &config) < 0)
 		return 0;
 
+	config_log_policy();
+	slab_set_huge_pages(gateway.huge_pages);
 	rval = process_config_update(config.next);
 	free_config_context(config.next);
 
@@ -233,6 +264,28 @@ int			error_count = 0;
 					config_get_value(obj->parameters, "enable_root_user");
 				char *weightby =
 					config_get_value(obj->parameters, "weightby");
+				char *connection_timeout =
+					config_get_value(obj->parameters, "connection_timeout");
+				char *query_timeout =
+					config_get_value(obj->parameters, "query_timeout");
+				char *poll_threads =
+					config_get_value(obj->parameters, "poll_threads");
+				char *max_connections =
+					config_get_value(obj->parameters, "max_connections");
+				char *max_queued =
+					config_get_value(obj->parameters, "max_queued_connections");
+				char *trace_sample =
+					config_get_value(obj->parameters, "trace_sample");
+				char *mem_soft_limit =
+					config_get_value(obj->parameters, "session_mem_soft_limit");
+				char *mem_hard_limit =
+					config_get_value(obj->parameters, "session_mem_hard_limit");
+				char *priority =
+					config_get_value(obj->parameters, "priority");
+				char *write_timeout =
+					config_get_value(obj->parameters, "client_write_timeout");
+				char *writeq_limit =
+					config_get_value(obj->parameters, "client_writeq_limit");
 			
 				char *version_string = config_get_value(obj->parameters, "version_string");
 
@@ -269,6 +322,71 @@ int			error_count = 0;
                                                 config_truth_value(enable_root_user));
 				if (weightby)
 					serviceWeightBy(obj->element, weightby);
+				if (connection_timeout)
+					serviceSetTimeout(obj->element,
+						atoi(connection_timeout));
+				if (query_timeout && !serviceSetQueryTimeout(
+						obj->element, query_timeout))
+				{
+					LOGIF(LE, (skygw_log_write_flush(
+						LOGFILE_ERROR,
+						"Error : Invalid query_timeout '%s' "
+						"for service '%s'.",
+						query_timeout,
+						obj->object)));
+				}
+				if (trace_sample)
+					serviceSetTraceSample(obj->element,
+						atoi(trace_sample));
+				if (mem_soft_limit || mem_hard_limit)
+					serviceSetMemoryLimits(obj->element,
+						mem_soft_limit ? atoi(mem_soft_limit) : 0,
+						mem_hard_limit ? atoi(mem_hard_limit) : 0);
+				if (write_timeout || writeq_limit)
+					serviceSetWriteLimits(obj->element,
+						write_timeout ? atoi(write_timeout) : 0,
+						writeq_limit ? atoi(writeq_limit) : 0);
+				if (priority && !serviceSetPriority(obj->element,
+								priority))
+				{
+					LOGIF(LE, (skygw_log_write_flush(
+						LOGFILE_ERROR,
+						"Error : Invalid priority '%s' for "
+						"service '%s', it must be high, normal "
+						"or low.",
+						priority,
+						obj->object)));
+				}
+				if (poll_threads)
+				{
+					if (!serviceSetPollThreads(obj->element,
+								poll_threads))
+					{
+						LOGIF(LE, (skygw_log_write_flush(
+							LOGFILE_ERROR,
+							"Error : Invalid poll_threads '%s' "
+							"for service '%s', the threads are "
+							"numbered from 0 to %d.",
+							poll_threads,
+							obj->object,
+							config_threadcount() - 1)));
+					}
+					else if (!gateway.per_thread_poll)
+					{
+						/*< The threads need sets of their own */
+						gateway.per_thread_poll = 1;
+						LOGIF(LM, (skygw_log_write(
+							LOGFILE_MESSAGE,
+							"Enabled per_thread_poll for the "
+							"poll_threads of service '%s'.",
+							obj->object)));
+					}
+				}
+				if (max_connections || max_queued)
+					serviceSetConnectionLimits(obj->element,
+						max_connections ? atoi(max_connections) : 0,
+						max_queued ? atoi(max_queued) :
+							SERVICE_MAX_QUEUED);
 
 				if (!auth)
 					auth = config_get_value(obj->parameters, 
@@ -408,6 +526,17 @@ int			error_count = 0;
                                         obj->object)));
 			}
 			if (obj->element)
+			{
+				server_set_persist_params(obj->element,
+							obj->parameters);
+				server_set_circuit_params(obj->element,
+							obj->parameters);
+				server_set_compress_params(obj->element,
+							obj->parameters);
+				server_set_socket_param(obj->element,
+							obj->parameters);
+			}
+			if (obj->element)
 			{
 				CONFIG_PARAMETER *params = obj->parameters;
 				while (params)
@@ -420,6 +549,22 @@ int			error_count = 0;
 								"monitoruser")
 						&& strcmp(params->name,
 								"monitorpw")
+						&& strcmp(params->name,
+								"persistpoolmax")
+						&& strcmp(params->name,
+								"persistmaxtime")
+						&& strcmp(params->name,
+								"circuit_failures")
+						&& strcmp(params->name,
+								"circuit_cooldown")
+						&& strcmp(params->name,
+								"compress")
+						&& strcmp(params->name,
+								"compress_threshold")
+						&& strcmp(params->name,
+								"socket")
+						&& strcmp(params->name,
+								"fastopen")
 						&& strcmp(params->name,
 								"type")
 						)
@@ -574,6 +719,10 @@ int			error_count = 0;
                                                            protocol,
 							   socket,
                                                            0);
+					error_count += listener_set_ssl_params(
+						obj, ptr->element, protocol, 0);
+					error_count += listener_set_listen_params(
+						obj, ptr->element, protocol, 0);
 				} else {
 					LOGIF(LE, (skygw_log_write_flush(
 						LOGFILE_ERROR,
@@ -595,6 +744,12 @@ int			error_count = 0;
                                                            protocol,
 							   address,
                                                            atoi(port));
+					error_count += listener_set_ssl_params(
+						obj, ptr->element, protocol,
+						atoi(port));
+					error_count += listener_set_listen_params(
+						obj, ptr->element, protocol,
+						atoi(port));
 				}
 				else
 				{
@@ -627,6 +782,8 @@ int			error_count = 0;
 			char *passwd;
 			unsigned long interval = 0;
 			int replication_heartbeat = 0;
+			unsigned long heartbeat_interval = 0;
+			unsigned long probe_interval = 0;
 
                         module = config_get_value(obj->parameters, "module");
 			servers = config_get_value(obj->parameters, "servers");
@@ -640,6 +797,14 @@ int			error_count = 0;
 				replication_heartbeat = atoi(config_get_value(obj->parameters, "detect_replication_lag"));
 			}
 
+			if (config_get_value(obj->parameters, "heartbeat_interval")) {
+				heartbeat_interval = strtoul(config_get_value(obj->parameters, "heartbeat_interval"), NULL, 10);
+			}
+
+			if (config_get_value(obj->parameters, "probe_interval")) {
+				probe_interval = strtoul(config_get_value(obj->parameters, "probe_interval"), NULL, 10);
+			}
+
                         if (module)
 			{
 				obj->element = monitor_alloc(obj->object, module);
@@ -663,6 +828,14 @@ int			error_count = 0;
 					if(replication_heartbeat == 1)
 						monitorSetReplicationHeartbeat(obj->element, replication_heartbeat);
 
+					/* set the high resolution heartbeat interval */
+					if (replication_heartbeat == 1 && heartbeat_interval > 0)
+						monitorSetHeartbeatInterval(obj->element, heartbeat_interval);
+
+					/* set the liveness probe interval */
+					if (probe_interval > 0)
+						monitorSetProbeInterval(obj->element, probe_interval);
+
 					/* get the servers to monitor */
 					s = strtok(servers, ",");
 					while (s)
@@ -883,6 +1056,314 @@ config_threadcount()
 	return gateway.n_threads;
 }
 
+/**
+ * Return whether each polling thread has an epoll set of its own
+ *
+ * @return Non-zero if per_thread_poll is set in the config file
+ */
+int
+config_per_thread_poll()
+{
+	return gateway.per_thread_poll;
+}
+
+/**
+ * Return the longest time a polling thread spins before it blocks
+ *
+ * @return The spin time in microseconds
+ */
+int
+config_poll_spin_time()
+{
+	return gateway.poll_spin_time;
+}
+
+/**
+ * Return the maximum number of freed DCBs kept for reuse
+ *
+ * @return The DCB pool size
+ */
+int
+config_dcb_pool_size()
+{
+	return gateway.dcb_pool_size;
+}
+
+/**
+ * Return the time to allow a backend connection to answer
+ *
+ * @return The timeout in seconds, 0 if there is no timeout
+ */
+int
+config_backend_connect_timeout()
+{
+	return gateway.backend_connect_timeout;
+}
+
+/**
+ * Return the size of the write queue of a client above which the reads of
+ * the backends of the client are paused
+ *
+ * @return The high water mark in bytes, 0 if the reads are never paused
+ */
+int
+config_writeq_high_water()
+{
+	return gateway.writeq_high_water;
+}
+
+/**
+ * Return the size the write queue of a client must drain to before the
+ * paused reads of its backends resume
+ *
+ * @return The low water mark in bytes
+ */
+int
+config_writeq_low_water()
+{
+	return gateway.writeq_low_water;
+}
+
+/**
+ * Return the number of requests kept for a backend connection that is not
+ * ready for them yet, the client reads pause when the limit is reached
+ *
+ * @return The number of requests
+ */
+int
+config_backend_pending_requests()
+{
+	return gateway.backend_pending_requests;
+}
+
+/**
+ * Return the CPUs the polling threads are bound to
+ *
+ * @return The thread_affinity of the config file, "auto", a list of CPUs,
+ *	   or NULL if the threads are not bound
+ */
+char *
+config_thread_affinity()
+{
+	return gateway.thread_affinity;
+}
+
+/**
+ * Return the backing of the buffer and DCB pools of the polling threads
+ *
+ * @return SLAB_HUGE_OFF, SLAB_HUGE_ON or SLAB_HUGE_TRANSPARENT
+ */
+int
+config_huge_pages()
+{
+	return gateway.huge_pages;
+}
+
+/**
+ * Return the event engine of the polling threads
+ *
+ * @return POLL_ENGINE_EPOLL or POLL_ENGINE_URING
+ */
+int
+config_poll_engine()
+{
+	return gateway.poll_engine;
+}
+
+/**
+ * Return the number of events of the low priority services a polling thread
+ * runs in a cycle
+ *
+ * @return The low_priority_budget of the config file, 0 for no limit
+ */
+int
+config_low_priority_budget()
+{
+	return gateway.low_priority_budget;
+}
+
+/**
+ * Return how the accepted clients are given to the polling threads
+ *
+ * @return ACCEPT_BALANCE_OFF, ACCEPT_BALANCE_SESSIONS or ACCEPT_BALANCE_BUSY
+ */
+int
+config_accept_balance()
+{
+	return gateway.accept_balance;
+}
+
+/**
+ * Return whether the idle polling threads take the events that wait for
+ * the busy ones
+ *
+ * @return Non-zero if work_stealing is set in the config file
+ */
+int
+config_work_stealing()
+{
+	return gateway.work_stealing;
+}
+
+/**
+ * Return the number of services started at the same time
+ *
+ * @return The start_threads of the config file, at least 1
+ */
+int
+config_start_threads()
+{
+	return gateway.start_threads;
+}
+
+/**
+ * Return whether the polling threads serve the listeners of the services
+ * already started while the others are still starting
+ *
+ * @return Non-zero if listen_early is set in the config file
+ */
+int
+config_listen_early()
+{
+	return gateway.listen_early;
+}
+
+/**
+ * Return the file the query classification cache is saved to
+ *
+ * @return The qc_cache_file of the config file, NULL for the default
+ */
+char *
+config_qc_cache_file()
+{
+	return gateway.qc_cache_file;
+}
+
+/**
+ * Return the seconds between the saves of the query classification cache
+ *
+ * @return The qc_cache_save_interval of the config file, 0 saves only at
+ * shutdown
+ */
+int
+config_qc_cache_save_interval()
+{
+	return gateway.qc_cache_save_interval;
+}
+
+/**
+ * Return whether the users' tables of the services are saved to snapshots
+ * and loaded from them at startup
+ *
+ * @return Non-zero unless users_snapshot is off in the config file
+ */
+int
+config_users_snapshot()
+{
+	return gateway.users_snapshot;
+}
+
+/**
+ * Return whether the listeners are handed over when MaxScale is restarted
+ *
+ * @return Non-zero if handoff is on in the config file
+ */
+int
+config_handoff()
+{
+	return gateway.handoff;
+}
+
+/**
+ * Return the Unix socket the listeners are handed over through
+ *
+ * @return The handoff_socket of the config file, NULL for the default
+ */
+char *
+config_handoff_socket()
+{
+	return gateway.handoff_socket;
+}
+
+/**
+ * Return the seconds MaxScale waits for its sessions to close once its
+ * listeners are handed over
+ *
+ * @return The handoff_drain_timeout of the config file
+ */
+int
+config_handoff_drain_timeout()
+{
+	return gateway.handoff_drain_timeout;
+}
+
+/**
+ * Read the CPU quota of the cgroup of the process, cpu.max of the unified
+ * hierarchy or the cfs quota and period of the version 1 cpu controller.
+ *
+ * @return The quota in CPUs, rounded up, or 0 if there is no quota
+ */
+static int
+config_cgroup_cpus()
+{
+FILE	*fp;
+long	quota = -1, period = 0;
+char	buf[80];
+
+	if ((fp = fopen("/sys/fs/cgroup/cpu.max", "r")) != NULL)
+	{
+		if (fscanf(fp, "%79s %ld", buf, &period) == 2 &&
+						strcmp(buf, "max") != 0)
+			quota = atol(buf);
+		fclose(fp);
+	}
+	else
+	{
+		if ((fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r")) != NULL)
+		{
+			if (fscanf(fp, "%ld", &quota) != 1)
+				quota = -1;
+			fclose(fp);
+		}
+		if ((fp = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r")) != NULL)
+		{
+			if (fscanf(fp, "%ld", &period) != 1)
+				period = 0;
+			fclose(fp);
+		}
+	}
+	if (quota <= 0 || period <= 0)
+		return 0;
+	return (quota + period - 1) / period;
+}
+
+/**
+ * The number of polling threads for threads=auto, one for each CPU the
+ * process may run on, bounded by the CPU quota of its cgroup. Threads
+ * beyond the quota would only be throttled.
+ *
+ * @return The number of threads
+ */
+static int
+config_auto_threads()
+{
+cpu_set_t	cpus;
+int		n, quota;
+
+	if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0)
+		n = CPU_COUNT(&cpus);
+	else
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	if ((quota = config_cgroup_cpus()) > 0 && quota < n)
+		n = quota;
+	if (n < 1)
+		n = 1;
+	LOGIF(LM, (skygw_log_write(
+		LOGFILE_MESSAGE,
+		"Using %d polling threads for threads=auto.", n)));
+	return n;
+}
+
 /**
  * Configuration handler for items in the global [MaxScale] section
  *
@@ -894,7 +1375,83 @@ static	int
 handle_global_item(const char *name, const char *value)
 {
 	if (strcmp(name, "threads") == 0) {
-		gateway.n_threads = atoi(value);
+		if (strcasecmp(value, "auto") == 0)
+			gateway.n_threads = config_auto_threads();
+		else
+			gateway.n_threads = atoi(value);
+	} else if (strcmp(name, "per_thread_poll") == 0) {
+		gateway.per_thread_poll = config_truth_value((char *)value);
+	} else if (strcmp(name, "poll_spin_time") == 0) {
+		gateway.poll_spin_time = atoi(value);
+	} else if (strcmp(name, "dcb_pool_size") == 0) {
+		gateway.dcb_pool_size = atoi(value);
+	} else if (strcmp(name, "backend_connect_timeout") == 0) {
+		gateway.backend_connect_timeout = atoi(value);
+	} else if (strcmp(name, "writeq_high_water") == 0) {
+		gateway.writeq_high_water = atoi(value);
+	} else if (strcmp(name, "writeq_low_water") == 0) {
+		gateway.writeq_low_water = atoi(value);
+	} else if (strcmp(name, "backend_pending_requests") == 0) {
+		gateway.backend_pending_requests = atoi(value);
+	} else if (strcmp(name, "log_error_burst") == 0) {
+		gateway.log_error_burst = atoi(value);
+	} else if (strcmp(name, "log_error_every") == 0) {
+		gateway.log_error_every = atoi(value);
+	} else if (strcmp(name, "log_ratelimit_interval") == 0) {
+		gateway.log_ratelimit_interval = atoi(value);
+	} else if (strcmp(name, "log_trace_sample") == 0) {
+		gateway.log_trace_sample = atof(value);
+	} else if (strcmp(name, "thread_affinity") == 0) {
+		if (gateway.thread_affinity)
+			free(gateway.thread_affinity);
+		gateway.thread_affinity = NULL;
+		if (strcasecmp(value, "off") != 0)
+			gateway.thread_affinity = strdup(value);
+	} else if (strcmp(name, "start_threads") == 0) {
+		gateway.start_threads = atoi(value);
+		if (gateway.start_threads < 1)
+			gateway.start_threads = 1;
+	} else if (strcmp(name, "listen_early") == 0) {
+		gateway.listen_early = config_truth_value((char *)value);
+	} else if (strcmp(name, "huge_pages") == 0) {
+		if (strcasecmp(value, "transparent") == 0)
+			gateway.huge_pages = SLAB_HUGE_TRANSPARENT;
+		else if (config_truth_value((char *)value))
+			gateway.huge_pages = SLAB_HUGE_ON;
+		else
+			gateway.huge_pages = SLAB_HUGE_OFF;
+	} else if (strcmp(name, "poll_engine") == 0) {
+		if (strcasecmp(value, "io_uring") == 0)
+			gateway.poll_engine = POLL_ENGINE_URING;
+		else
+			gateway.poll_engine = POLL_ENGINE_EPOLL;
+	} else if (strcmp(name, "work_stealing") == 0) {
+		gateway.work_stealing = config_truth_value((char *)value);
+	} else if (strcmp(name, "low_priority_budget") == 0) {
+		gateway.low_priority_budget = atoi(value);
+	} else if (strcmp(name, "accept_balance") == 0) {
+		if (strcasecmp(value, "sessions") == 0)
+			gateway.accept_balance = ACCEPT_BALANCE_SESSIONS;
+		else if (strcasecmp(value, "busy") == 0)
+			gateway.accept_balance = ACCEPT_BALANCE_BUSY;
+		else
+			gateway.accept_balance = ACCEPT_BALANCE_OFF;
+	} else if (strcmp(name, "qc_cache_file") == 0) {
+		if (gateway.qc_cache_file)
+			free(gateway.qc_cache_file);
+		gateway.qc_cache_file = strdup(value);
+	} else if (strcmp(name, "qc_cache_save_interval") == 0) {
+		gateway.qc_cache_save_interval = atoi(value);
+	} else if (strcmp(name, "users_snapshot") == 0) {
+		gateway.users_snapshot = config_truth_value((char *)value);
+	} else if (strcmp(name, "handoff") == 0) {
+		gateway.handoff = config_truth_value((char *)value);
+	} else if (strcmp(name, "handoff_socket") == 0) {
+		if (gateway.handoff_socket)
+			free(gateway.handoff_socket);
+		gateway.handoff_socket = strdup(value);
+	} else if (strcmp(name, "handoff_drain_timeout") == 0) {
+		gateway.handoff_drain_timeout = atoi(value);
         } else {
                 return 0;
         }
@@ -908,6 +1465,31 @@ static void
 global_defaults()
 {
 	gateway.n_threads = 1;
+	gateway.per_thread_poll = 0;
+	gateway.poll_spin_time = DEFAULT_POLL_SPIN_TIME;
+	gateway.dcb_pool_size = DEFAULT_DCB_POOL_SIZE;
+	gateway.backend_connect_timeout = 0;
+	gateway.writeq_high_water = DEFAULT_WRITEQ_HIGH_WATER;
+	gateway.writeq_low_water = DEFAULT_WRITEQ_LOW_WATER;
+	gateway.backend_pending_requests = DEFAULT_BACKEND_PENDING_REQUESTS;
+	gateway.log_error_burst = LOG_RATELIMIT_BURST;
+	gateway.log_error_every = LOG_RATELIMIT_EVERY;
+	gateway.log_ratelimit_interval = LOG_RATELIMIT_INTERVAL;
+	gateway.log_trace_sample = 100.0;
+	gateway.thread_affinity = NULL;
+	gateway.start_threads = DEFAULT_START_THREADS;
+	gateway.listen_early = 0;
+	gateway.huge_pages = SLAB_HUGE_OFF;
+	gateway.poll_engine = POLL_ENGINE_EPOLL;
+	gateway.work_stealing = 0;
+	gateway.low_priority_budget = DEFAULT_LOW_PRIORITY_BUDGET;
+	gateway.accept_balance = ACCEPT_BALANCE_OFF;
+	gateway.qc_cache_file = NULL;
+	gateway.qc_cache_save_interval = DEFAULT_QC_CACHE_SAVE_INTERVAL;
+	gateway.users_snapshot = 1;
+	gateway.handoff = 0;
+	gateway.handoff_socket = NULL;
+	gateway.handoff_drain_timeout = DEFAULT_HANDOFF_DRAIN_TIMEOUT;
 	if (version_string != NULL)
 		gateway.version_string = strdup(version_string);
 	else
@@ -915,6 +1497,40 @@ global_defaults()
 	gateway.id=0;
 }
 
+/**
+ * Pass the rate limit of the error log and the sampling of the trace log
+ * to the log manager
+ */
+static void
+config_log_policy()
+{
+	if (skygw_log_set_ratelimit(LOGFILE_ERROR, gateway.log_error_burst,
+			gateway.log_error_every,
+			gateway.log_ratelimit_interval) != 0)
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : Invalid log_error_burst %d, log_error_every %d "
+			"or log_ratelimit_interval %d, the error log is not "
+			"rate limited.",
+			gateway.log_error_burst,
+			gateway.log_error_every,
+			gateway.log_ratelimit_interval)));
+		skygw_log_set_ratelimit(LOGFILE_ERROR, 0, 0,
+					LOG_RATELIMIT_INTERVAL);
+	}
+	if (skygw_log_set_sampling(LOGFILE_TRACE,
+			gateway.log_trace_sample / 100.0) != 0)
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : Invalid log_trace_sample %g, it is the "
+			"percentage of the trace log written.",
+			gateway.log_trace_sample)));
+		skygw_log_set_sampling(LOGFILE_TRACE, 1.0);
+	}
+}
+
 /**
  * Process a configuration context update and turn it into the set of object
  * we need.
@@ -958,6 +1574,16 @@ SERVER			*server;
                                         char* max_slave_conn_str;
                                         char* max_slave_rlag_str;
 					char *version_string;
+					char *connection_timeout;
+					char *query_timeout;
+					char *max_connections;
+					char *max_queued;
+					char *trace_sample;
+					char *mem_soft_limit;
+					char *mem_hard_limit;
+					char *priority;
+					char *write_timeout;
+					char *writeq_limit;
 
 					enable_root_user = config_get_value(obj->parameters, "enable_root_user");
 
@@ -975,6 +1601,65 @@ SERVER			*server;
 						service->version_string = strdup(version_string);
 					}
 
+					connection_timeout = config_get_value(obj->parameters,
+								"connection_timeout");
+					if (connection_timeout)
+						serviceSetTimeout(service,
+							atoi(connection_timeout));
+					query_timeout = config_get_value(obj->parameters,
+								"query_timeout");
+					if (!serviceSetQueryTimeout(service,
+						query_timeout ? query_timeout : "0"))
+					{
+						LOGIF(LE, (skygw_log_write_flush(
+							LOGFILE_ERROR,
+							"Error : Invalid query_timeout '%s' "
+							"for service '%s'.",
+							query_timeout,
+							obj->object)));
+					}
+					trace_sample = config_get_value(obj->parameters,
+								"trace_sample");
+					serviceSetTraceSample(service, trace_sample ?
+							atoi(trace_sample) : 0);
+					mem_soft_limit = config_get_value(obj->parameters,
+								"session_mem_soft_limit");
+					mem_hard_limit = config_get_value(obj->parameters,
+								"session_mem_hard_limit");
+					serviceSetMemoryLimits(service,
+						mem_soft_limit ? atoi(mem_soft_limit) : 0,
+						mem_hard_limit ? atoi(mem_hard_limit) : 0);
+					write_timeout = config_get_value(obj->parameters,
+								"client_write_timeout");
+					writeq_limit = config_get_value(obj->parameters,
+								"client_writeq_limit");
+					serviceSetWriteLimits(service,
+						write_timeout ? atoi(write_timeout) : 0,
+						writeq_limit ? atoi(writeq_limit) : 0);
+					priority = config_get_value(obj->parameters,
+								"priority");
+					if (!serviceSetPriority(service,
+							priority ? priority : "normal"))
+					{
+						LOGIF(LE, (skygw_log_write_flush(
+							LOGFILE_ERROR,
+							"Error : Invalid priority '%s' for "
+							"service '%s', it must be high, "
+							"normal or low.",
+							priority,
+							obj->object)));
+					}
+
+					max_connections = config_get_value(obj->parameters,
+								"max_connections");
+					max_queued = config_get_value(obj->parameters,
+								"max_queued_connections");
+					if (max_connections || max_queued)
+						serviceSetConnectionLimits(service,
+							max_connections ? atoi(max_connections) : 0,
+							max_queued ? atoi(max_queued) :
+								SERVICE_MAX_QUEUED);
+
 					if (user && auth) {
 						service_update(service, router,
                                                                user,
@@ -1131,6 +1816,17 @@ SERVER			*server;
                                                                  monpw);
                                         }
 				}
+				if (obj->element)
+				{
+					server_set_persist_params(obj->element,
+								obj->parameters);
+					server_set_circuit_params(obj->element,
+								obj->parameters);
+					server_set_compress_params(obj->element,
+								obj->parameters);
+					server_set_socket_param(obj->element,
+								obj->parameters);
+				}
 			}
 			else
                         {
@@ -1233,6 +1929,10 @@ SERVER			*server;
                                                            protocol,
 							   socket,
                                                            0);
+					listener_set_ssl_params(obj,
+						ptr->element, protocol, 0);
+					listener_set_listen_params(obj,
+						ptr->element, protocol, 0);
 					serviceStartProtocol(ptr->element,
                                                              protocol,
                                                              0);
@@ -1255,6 +1955,12 @@ SERVER			*server;
                                                            protocol,
 							   address,
                                                            atoi(port));
+					listener_set_ssl_params(obj,
+						ptr->element, protocol,
+						atoi(port));
+					listener_set_listen_params(obj,
+						ptr->element, protocol,
+						atoi(port));
 					serviceStartProtocol(ptr->element,
                                                              protocol,
                                                              atoi(port));
@@ -1289,6 +1995,17 @@ static char *service_params[] =
                 "max_slave_replication_lag",
 		"version_string",
 		"filters",
+		"connection_timeout",
+		"query_timeout",
+		"poll_threads",
+		"max_connections",
+		"max_queued_connections",
+		"trace_sample",
+		"session_mem_soft_limit",
+		"session_mem_hard_limit",
+		"priority",
+		"client_write_timeout",
+		"client_writeq_limit",
                 NULL
         };
 
@@ -1300,6 +2017,15 @@ static char *server_params[] =
                 "protocol",
                 "monitorpw",
                 "monitoruser",
+                "persistpoolmax",
+                "persistmaxtime",
+		"max_connections",
+                "circuit_failures",
+                "circuit_cooldown",
+                "compress",
+                "compress_threshold",
+                "socket",
+                "fastopen",
                 NULL
         };
 
@@ -1311,6 +2037,15 @@ static char *listener_params[] =
                 "port",
                 "address",
                 "socket",
+                "ssl_cert",
+                "ssl_key",
+                "ssl_ca_cert",
+                "ssl_required",
+                "backlog",
+                "defer_accept",
+                "write_coalesce",
+                "notsent_lowat",
+                "fastopen",
                 NULL
         };
 
@@ -1323,6 +2058,8 @@ static char *monitor_params[] =
                 "passwd",
 		"monitor_interval",
 		"detect_replication_lag",
+		"heartbeat_interval",
+		"probe_interval",
                 NULL
         };
 /**
@@ -1443,3 +2180,221 @@ config_truth_value(char *str)
 	return atoi(str);
 }
 
+/**
+ * Set the listen backlog, the TCP_DEFER_ACCEPT time and the write policy of
+ * a listener. With defer_accept the kernel hands a connection over once the
+ * client has sent data, this only suits the protocols in which the client
+ * speaks first. The write_coalesce and notsent_lowat parameters set how the
+ * replies to the clients of the listener are written. The fastopen parameter
+ * is the TCP Fast Open queue length of the listener, or on for the default.
+ *
+ * @param obj		The listener section
+ * @param service	The service of the listener
+ * @param protocol	The protocol of the listener
+ * @param port		The port of the listener, 0 for a socket
+ * @return		The number of errors found
+ */
+static int
+listener_set_listen_params(CONFIG_CONTEXT *obj, SERVICE *service,
+			char *protocol, unsigned short port)
+{
+char	*backlog = config_get_value(obj->parameters, "backlog");
+char	*defer = config_get_value(obj->parameters, "defer_accept");
+char	*coalesce = config_get_value(obj->parameters, "write_coalesce");
+char	*lowat = config_get_value(obj->parameters, "notsent_lowat");
+char	*fastopen = config_get_value(obj->parameters, "fastopen");
+int	tfo = 0;
+
+	if (coalesce || lowat)
+	{
+		if (lowat && atoi(lowat) < 0)
+		{
+			LOGIF(LE, (skygw_log_write_flush(
+				LOGFILE_ERROR,
+				"Error : Invalid notsent_lowat for "
+				"listener '%s'.",
+				obj->object)));
+			return 1;
+		}
+		serviceSetProtocolWrites(service, protocol, port,
+				coalesce ? config_truth_value(coalesce) : 0,
+				lowat ? atoi(lowat) : 0);
+	}
+	if (backlog == NULL && defer == NULL && fastopen == NULL)
+		return 0;
+	if ((backlog && atoi(backlog) <= 0) || (defer && atoi(defer) < 0) ||
+		(fastopen && atoi(fastopen) < 0))
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : Invalid backlog, defer_accept or fastopen for "
+			"listener '%s'.",
+			obj->object)));
+		return 1;
+	}
+	if (fastopen)
+	{
+		tfo = atoi(fastopen);
+		if (tfo == 0 && config_truth_value(fastopen))
+			tfo = SERVICE_FASTOPEN_QUEUE;
+	}
+	serviceSetProtocolListen(service, protocol, port,
+				backlog ? atoi(backlog) : 0,
+				defer ? atoi(defer) : 0, tfo);
+	return 0;
+}
+
+/**
+ * Set the TLS parameters of a listener. The clients of the listener may
+ * switch to TLS if both ssl_cert and ssl_key are given, ssl_ca_cert is
+ * used to verify the certificates that clients present and ssl_required
+ * refuses the clients that do not switch.
+ *
+ * @param obj		The listener section
+ * @param service	The service of the listener
+ * @param protocol	The protocol of the listener
+ * @param port		The port of the listener, 0 for a socket
+ * @return		The number of errors found
+ */
+static int
+listener_set_ssl_params(CONFIG_CONTEXT *obj, SERVICE *service, char *protocol,
+			unsigned short port)
+{
+char	*cert = config_get_value(obj->parameters, "ssl_cert");
+char	*key = config_get_value(obj->parameters, "ssl_key");
+char	*ca = config_get_value(obj->parameters, "ssl_ca_cert");
+char	*required = config_get_value(obj->parameters, "ssl_required");
+
+	if (cert == NULL && key == NULL)
+	{
+		if (ca || required)
+		{
+			LOGIF(LE, (skygw_log_write_flush(
+				LOGFILE_ERROR,
+				"Error : Listener '%s' has TLS parameters but no "
+				"ssl_cert and ssl_key.",
+				obj->object)));
+			return 1;
+		}
+		return 0;
+	}
+	if (cert == NULL || key == NULL)
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : Listener '%s' must have both ssl_cert and "
+			"ssl_key for TLS.",
+			obj->object)));
+		return 1;
+	}
+	serviceSetProtocolSSL(service, protocol, port, cert, key, ca,
+				required ? config_truth_value(required) : 0);
+	return 0;
+}
+
+/**
+ * Set the persistent connection pool parameters of a server. The pool is
+ * disabled unless persistpoolmax is given, persistmaxtime is the number of
+ * seconds an idle connection is kept in the pool. max_connections limits
+ * the open connections to the server, those in the pool included.
+ *
+ * @param server	The server
+ * @param params	The parameters of the server section
+ */
+static void
+server_set_persist_params(SERVER *server, CONFIG_PARAMETER *params)
+{
+char	*poolmax = config_get_value(params, "persistpoolmax");
+char	*maxtime = config_get_value(params, "persistmaxtime");
+char	*maxconn = config_get_value(params, "max_connections");
+
+	server->max_connections = maxconn ? atoi(maxconn) : 0;
+	if (server->max_connections < 0)
+		server->max_connections = 0;
+	server->persistpoolmax = poolmax ? atoi(poolmax) : 0;
+	if (server->persistpoolmax < 0)
+		server->persistpoolmax = 0;
+	if (maxtime && atoi(maxtime) > 0)
+		server->persistmaxtime = atoi(maxtime);
+	else
+		server->persistmaxtime = SERVER_PERSIST_MAXTIME;
+}
+
+/**
+ * Set the circuit breaker parameters of a server. The circuit opens after
+ * circuit_failures connection failures within circuit_cooldown seconds and
+ * stays open for circuit_cooldown seconds, circuit_failures=0 disables the
+ * circuit breaker of the server.
+ *
+ * @param server	The server
+ * @param params	The parameters of the server section
+ */
+static void
+server_set_circuit_params(SERVER *server, CONFIG_PARAMETER *params)
+{
+char	*failures = config_get_value(params, "circuit_failures");
+char	*cooldown = config_get_value(params, "circuit_cooldown");
+
+	if (failures && atoi(failures) >= 0)
+		server->circuit_max_failures = atoi(failures);
+	else
+		server->circuit_max_failures = SERVER_CIRCUIT_FAILURES;
+	if (cooldown && atoi(cooldown) > 0)
+		server->circuit_cooldown = atoi(cooldown);
+	else
+		server->circuit_cooldown = SERVER_CIRCUIT_COOLDOWN;
+}
+
+/**
+ * Set the compressed protocol parameters of a server. The compressed protocol
+ * is used only if compress is set and the server has it, compress_threshold
+ * is the number of bytes below which the data is sent without compression.
+ *
+ * @param server	The server
+ * @param params	The parameters of the server section
+ */
+static void
+server_set_compress_params(SERVER *server, CONFIG_PARAMETER *params)
+{
+char	*compress = config_get_value(params, "compress");
+char	*threshold = config_get_value(params, "compress_threshold");
+
+	server->compress = compress ? config_truth_value(compress) : 0;
+	if (threshold && atoi(threshold) >= 0)
+		server->compress_threshold = atoi(threshold);
+	else
+		server->compress_threshold = SERVER_COMPRESS_THRESHOLD;
+}
+
+/**
+ * Set the Unix domain socket of a server. The backend connections to a
+ * server that runs on the same host use the socket instead of TCP, the
+ * address and port still name the server for the monitors. The TCP
+ * connections use TCP Fast Open if fastopen is set.
+ *
+ * @param server	The server
+ * @param params	The parameters of the server section
+ */
+static void
+server_set_socket_param(SERVER *server, CONFIG_PARAMETER *params)
+{
+char	*socket = config_get_value(params, "socket");
+char	*fastopen = config_get_value(params, "fastopen");
+
+	server->fastopen = fastopen ? config_truth_value(fastopen) : 0;
+	free(server->socket);
+	server->socket = NULL;
+	if (socket == NULL)
+		return;
+	if (*socket != '/' || strlen(socket) >= sizeof(((struct sockaddr_un *)0)->sun_path))
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : Invalid socket '%s' for server '%s', the "
+			"server is connected by TCP.",
+			socket,
+			server->name)));
+		return;
+	}
+	server->socket = strdup(socket);
+}
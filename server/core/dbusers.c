@@ -33,6 +33,11 @@
  */
 
 #include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <mysql.h>
 
 #include <dcb.h>
@@ -42,15 +47,52 @@
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <secrets.h>
+#include <atomic.h>
 #include <mysql_client_server_protocol.h>
+#include <resolver.h>
+#include <config.h>
+#include <modules.h>
 
 #define USERS_QUERY_NO_ROOT " AND user NOT IN ('root')"
 #define LOAD_MYSQL_USERS_QUERY "SELECT user, host, password, concat(user,host,password) AS userdata FROM mysql.user WHERE user IS NOT NULL AND user <> ''"
-#define MYSQL_USERS_COUNT "SELECT COUNT(1) AS nusers FROM mysql.user"
+#define MYSQL_USERS_CHECKSUM_QUERY "SELECT COUNT(1) AS nusers, SHA1(GROUP_CONCAT(concat(user,host,password) ORDER BY host DESC, user)) AS cksum FROM mysql.user WHERE user IS NOT NULL AND user <> ''"
+#define MYSQL_USERS_CONCAT_LEN "SET SESSION group_concat_max_len = 16777216"
+
+/**
+ * The snapshot of a users' table is kept in USERS_SNAPSHOT_DIR of the home
+ * directory, in the file named after the service. It holds the service user
+ * and the backend servers the table was loaded from, the checksum of the
+ * backend, the users and a SHA1 of all that.
+ */
+#define USERS_SNAPSHOT_DIR	"cache"
+#define USERS_SNAPSHOT_MAGIC	"MXSUSR01"
+#define USERS_SNAPSHOT_MAXSIZE	(64 * 1024 * 1024)
+
+/** 64 bit FNV-1a parameters of the user@host hash */
+#define UH_FNV_OFFSET	0xcbf29ce484222325ULL
+#define UH_FNV_PRIME	0x100000001b3ULL
+
+/** The netmask, in network byte order, of an address with n wildcard bits */
+#define uh_netmask(n)	((n) >= 32 ? 0 : htonl(0xffffffffU << (n)))
 
 extern int lm_enabled_logfiles_bitmask;
 
-static int getUsers(SERVICE *service, struct users *users);
+/**
+ * The last version given to a users' table, the cached authentication
+ * data of a table is valid while the table keeps its version
+ */
+static int users_version = 0;
+
+/**
+ * The sources of the users of the services, the services with the same
+ * source share its table. Sources are never removed, like the services.
+ */
+static MYSQL_USERS_SOURCE *users_sources = NULL;
+static SPINLOCK users_sources_lock = SPINLOCK_INIT;
+
+static int getUsers(SERVICE *service, struct users *users, unsigned char *cksum);
+static void users_snapshot_write(SERVICE *service, USERS *users);
+static int users_snapshot_read(SERVICE *service, USERS *users);
 static int uh_cmpfun( void* v1, void* v2);
 static void *uh_keydup(void* key);
 static void uh_keyfree( void* key);
@@ -58,17 +100,280 @@ static int uh_hfun( void* key);
 char *mysql_users_fetch(USERS *users, MYSQL_USER_HOST *key);
 char *mysql_format_user_entry(void *data);
 
+/**
+ * Tell whether a service loads its users from a source: the same service
+ * user and password, the same root users and the same backend servers.
+ *
+ * @param src		The source
+ * @param service	The service
+ * @param user		The service user
+ * @param passwd	The password of the service user
+ * @return		True if the users of the service come from the source
+ */
+static bool
+users_source_match(MYSQL_USERS_SOURCE *src, SERVICE *service, char *user, char *passwd)
+{
+SERVER	*server;
+int	n = 0, i;
+
+	if (src->enable_root != service->enable_root ||
+		strcmp(src->user, user) || strcmp(src->passwd, passwd))
+		return false;
+
+	for (server = service->databases; server; server = server->nextdb)
+	{
+		for (i = 0; i < src->n_servers; i++)
+		{
+			if (src->servers[i] == server)
+				break;
+		}
+		if (i == src->n_servers)
+			return false;
+		n++;
+	}
+	return n == src->n_servers;
+}
+
+/**
+ * Find the source of the users of a service, or add it.
+ *
+ * @param service	The service
+ * @return		The source or NULL if the service has no user or
+ *			memory could not be allocated
+ */
+static MYSQL_USERS_SOURCE *
+users_source_find(SERVICE *service)
+{
+MYSQL_USERS_SOURCE	*src;
+SERVER			*server;
+char			*user, *passwd;
+int			n = 0;
+
+	if (!serviceGetUser(service, &user, &passwd))
+		return NULL;
+
+	spinlock_acquire(&users_sources_lock);
+	for (src = users_sources; src; src = src->next)
+	{
+		if (users_source_match(src, service, user, passwd))
+		{
+			spinlock_release(&users_sources_lock);
+			return src;
+		}
+	}
+
+	for (server = service->databases; server; server = server->nextdb)
+		n++;
+	if ((src = (MYSQL_USERS_SOURCE *)calloc(1, sizeof(MYSQL_USERS_SOURCE))) == NULL ||
+		(src->servers = (SERVER **)calloc(n + 1, sizeof(SERVER *))) == NULL ||
+		(src->user = strdup(user)) == NULL ||
+		(src->passwd = strdup(passwd)) == NULL)
+	{
+		spinlock_release(&users_sources_lock);
+		if (src)
+		{
+			free(src->servers);
+			free(src->user);
+			free(src);
+		}
+		return NULL;
+	}
+	for (server = service->databases; server; server = server->nextdb)
+		src->servers[src->n_servers++] = server;
+	src->enable_root = service->enable_root;
+	src->nusers = -1;
+	pthread_mutex_init(&src->lock, NULL);
+	src->next = users_sources;
+	users_sources = src;
+	spinlock_release(&users_sources_lock);
+
+	return src;
+}
+
+/**
+ * Replace the users' table of a service with a shared one. The readers of
+ * the table of the service hold its read lock, the old table is dropped once
+ * none of them can see it.
+ *
+ * @param service	The service
+ * @param users		The new table
+ */
+static void
+users_swap(SERVICE *service, USERS *users)
+{
+USERS	*oldusers;
+
+	brlock_write_acquire(&service->users_lock);
+	oldusers = service->users;
+	service->users = users_share(users);
+	brlock_write_release(&service->users_lock);
+
+	if (oldusers)
+		users_free(oldusers);
+}
+
+/**
+ * Make a table the table of a source and of all the services sharing it.
+ * The caller holds the lock of the source.
+ *
+ * @param src		The source
+ * @param users		The new table
+ */
+static void
+users_source_publish(MYSQL_USERS_SOURCE *src, USERS *users)
+{
+USERS	*oldusers = src->users;
+int	i;
+
+	src->users = users_share(users);
+	for (i = 0; i < src->n_services; i++)
+		users_swap(src->services[i], users);
+	if (oldusers)
+		users_free(oldusers);
+}
+
+/**
+ * Join a service to the source of its users. The lock of the source is
+ * held on return.
+ *
+ * @param service	The service
+ * @return		The source or NULL if the service has none
+ */
+static MYSQL_USERS_SOURCE *
+users_source_join(SERVICE *service)
+{
+MYSQL_USERS_SOURCE	*src;
+SERVICE			**services;
+
+	if ((src = users_source_find(service)) == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&src->lock);
+	if (service->users_source == NULL)
+	{
+		services = (SERVICE **)realloc(src->services,
+				(src->n_services + 1) * sizeof(SERVICE *));
+		if (services == NULL)
+		{
+			pthread_mutex_unlock(&src->lock);
+			return NULL;
+		}
+		services[src->n_services++] = service;
+		src->services = services;
+		service->users_source = src;
+	}
+	return src;
+}
+
+/**
+ * Save the snapshots of the services of a source, the caller holds the lock
+ * of the source.
+ *
+ * @param src		The source
+ */
+static void
+users_source_snapshot(MYSQL_USERS_SOURCE *src)
+{
+int	i;
+
+	for (i = 0; i < src->n_services; i++)
+		users_snapshot_write(src->services[i], src->users);
+}
+
 /**
  * Load the user/passwd form mysql.user table into the service users' hashtable
  * environment.
  *
+ * The service shares the table of the services with the same source, which
+ * is loaded once. The table of the source is loaded again if it could not be
+ * loaded before.
+ *
  * @param service   The current service
  * @return      -1 on any error or the number of users inserted (0 means no users at all)
  */
 int 
 load_mysql_users(SERVICE *service)
 {
-	return getUsers(service, service->users);
+MYSQL_USERS_SOURCE	*src;
+int			i;
+
+	if ((src = users_source_join(service)) == NULL)
+	{
+		if ((i = getUsers(service, service->users, NULL)) > 0)
+			users_snapshot_write(service, service->users);
+		return i;
+	}
+
+	if (src->nusers >= 0)
+	{
+		/*< Another service has loaded the users */
+		users_swap(service, src->users);
+		i = src->nusers;
+	}
+	else
+	{
+		i = getUsers(service, service->users, NULL);
+		src->nusers = i;
+		src->checked = time(NULL);
+		users_source_publish(src, service->users);
+		if (i > 0)
+			users_source_snapshot(src);
+	}
+	pthread_mutex_unlock(&src->lock);
+
+	return i;
+}
+
+/**
+ * Load the users' table of a service from the snapshot saved by an earlier
+ * run, so that the clients can be authenticated before any backend has
+ * answered. The table is marked as not checked, the next refresh of the
+ * service asks the backend for its checksum and loads the users if they
+ * have changed.
+ *
+ * @param service	The current service
+ * @return		-1 if there is no valid snapshot, the number of users
+ *			otherwise
+ */
+int
+load_mysql_users_snapshot(SERVICE *service)
+{
+MYSQL_USERS_SOURCE	*src;
+USERS			*users;
+int			i;
+
+	if (!config_users_snapshot())
+		return -1;
+
+	src = users_source_join(service);
+	if (src != NULL && src->nusers >= 0)
+	{
+		/*< Another service has loaded the users */
+		users_swap(service, src->users);
+		i = src->nusers;
+		pthread_mutex_unlock(&src->lock);
+		return i;
+	}
+
+	if ((users = mysql_users_alloc()) == NULL)
+		i = -1;
+	else if ((i = users_snapshot_read(service, users)) >= 0)
+	{
+		if (src != NULL)
+		{
+			src->nusers = i;
+			src->checked = 0;
+			users_source_publish(src, users);
+		}
+		else
+			users_swap(service, users);
+	}
+	if (src != NULL)
+		pthread_mutex_unlock(&src->lock);
+	if (users)
+		users_free(users);
+
+	return i;
 }
 
 /**
@@ -81,16 +386,40 @@ load_mysql_users(SERVICE *service)
 int 
 reload_mysql_users(SERVICE *service)
 {
-int		i;
-struct users	*newusers, *oldusers;
+int			i;
+struct users		*newusers, *oldusers;
+MYSQL_USERS_SOURCE	*src = service->users_source;
 
 	if ((newusers = mysql_users_alloc()) == NULL)
 		return 0;
-	i = getUsers(service, newusers);
-	spinlock_acquire(&service->spin);
+
+	if (src != NULL)
+	{
+		/*< The table is replaced for all the services of the source */
+		pthread_mutex_lock(&src->lock);
+		i = getUsers(service, newusers, NULL);
+		if (i >= 0)
+		{
+			src->nusers = i;
+			src->checked = time(NULL);
+			users_source_publish(src, newusers);
+		}
+		if (i > 0)
+			users_source_snapshot(src);
+		pthread_mutex_unlock(&src->lock);
+		users_free(newusers);
+
+		return i;
+	}
+
+	i = getUsers(service, newusers, NULL);
+	if (i > 0)
+		users_snapshot_write(service, newusers);
+	brlock_write_acquire(&service->users_lock);
 	oldusers = service->users;
 	service->users = newusers;
-	spinlock_release(&service->spin);
+	brlock_write_release(&service->users_lock);
+	/*< No reader can still see the old table */
 	users_free(oldusers);
 
 	return i;
@@ -99,26 +428,89 @@ struct users	*newusers, *oldusers;
 /**
  * Replace the user/passwd form mysql.user table into the service users' hashtable
  * environment.
- * The replacement is succesful only if the users' table checksums differ
+ * The replacement is succesful only if the users' table checksums differ,
+ * the users are not fetched at all if the checksum has not changed.
  *
  * @param service   The current service
- * @return      -1 on any error or the number of users inserted (0 means no users at all)
+ * @return      -1 on any error, 0 if the table has not changed or the number of users inserted
  */
 int 
 replace_mysql_users(SERVICE *service)
 {
-int		i;
-struct users	*newusers, *oldusers;
+	return refresh_mysql_users(service, time(NULL));
+}
+
+/**
+ * Replace the users' table of a service if its checksum has changed, as
+ * replace_mysql_users does. If the source of the users of the service has
+ * been checked at or after the time since, for another service, the table
+ * is left as it is: the check replaced the tables of all the services of
+ * the source.
+ *
+ * @param service	The current service
+ * @param since		The time after which a check of the source is recent
+ * @return      -1 on any error, 0 if the table has not changed or the number of users inserted
+ */
+int
+refresh_mysql_users(SERVICE *service, time_t since)
+{
+int			i;
+struct users		*newusers, *oldusers;
+unsigned char		cksum[SHA_DIGEST_LENGTH];
+MYSQL_USERS_SOURCE	*src = service->users_source;
+
+	if (src != NULL)
+	{
+		pthread_mutex_lock(&src->lock);
+		if (src->nusers >= 0 && src->checked >= since)
+		{
+			pthread_mutex_unlock(&src->lock);
+			return 0;
+		}
+		if ((newusers = mysql_users_alloc()) == NULL)
+		{
+			pthread_mutex_unlock(&src->lock);
+			return -1;
+		}
+		/*< A table that could not be loaded is loaded in full */
+		i = getUsers(service, newusers,
+				src->nusers >= 0 ? src->users->cksum : NULL);
+		if (i >= 0)
+			src->checked = time(NULL);
+		if (i > 0)
+		{
+			LOGIF(LD, (skygw_log_write_flush(
+				LOGFILE_DEBUG,
+				"%lu [refresh_mysql_users] users' tables of %d "
+				"services replaced, checksum differs",
+				pthread_self(),
+				src->n_services)));
+			src->nusers = i;
+			users_source_publish(src, newusers);
+			users_source_snapshot(src);
+		}
+		pthread_mutex_unlock(&src->lock);
+		users_free(newusers);
+
+		return i;
+	}
 
 	if ((newusers = mysql_users_alloc()) == NULL)
 		return -1;
 
-	i = getUsers(service, newusers);
+	brlock_read_acquire(&service->users_lock);
+	memcpy(cksum, service->users->cksum, SHA_DIGEST_LENGTH);
+	brlock_read_release(&service->users_lock);
 
-	if (i <= 0)
+	i = getUsers(service, newusers, cksum);
+
+	if (i <= 0) {
+		users_free(newusers);
 		return i;
+	}
+	users_snapshot_write(service, newusers);
 
-	spinlock_acquire(&service->spin);
+	brlock_write_acquire(&service->users_lock);
 	oldusers = service->users;
 
 	/* digest compare */
@@ -140,7 +532,7 @@ struct users	*newusers, *oldusers;
 		service->users = newusers;
 	}
 
-	spinlock_release(&service->spin);
+	brlock_write_release(&service->users_lock);
 
 	if (i)
 		users_free(oldusers);
@@ -152,12 +544,16 @@ struct users	*newusers, *oldusers;
  * Load the user/passwd form mysql.user table into the service users' hashtable
  * environment.
  *
+ * The checksum of the users is computed by the backend first. If it is the
+ * same as cksum the users are not fetched and users is left empty.
+ *
  * @param service	The current service
  * @param users		The users table into which to load the users
- * @return      -1 on any error or the number of users inserted (0 means no users at all)
+ * @param cksum		The checksum of the current table or NULL
+ * @return      -1 on any error, 0 if the checksum is cksum or the number of users inserted
  */
 static int
-getUsers(SERVICE *service, struct users *users)
+getUsers(SERVICE *service, struct users *users, unsigned char *cksum)
 {
 	MYSQL			*con = NULL;
 	MYSQL_ROW		row;
@@ -169,18 +565,18 @@ getUsers(SERVICE *service, struct users *users)
 	int			total_users = 0;
 	SERVER			*server;
 	char			*users_query;
-	unsigned char		hash[SHA_DIGEST_LENGTH]="";
-	char			*users_data = NULL;
+	char			*cksum_query;
 	int 			nusers = 0;
-	int			users_data_row_len = MYSQL_USER_MAXLEN + MYSQL_HOST_MAXLEN + MYSQL_PASSWORD_LEN;
 	struct sockaddr_in	serv_addr;
 	MYSQL_USER_HOST		key;
 
 	/* enable_root for MySQL protocol module means load the root user credentials from backend databases */
 	if(service->enable_root) {
 		users_query = LOAD_MYSQL_USERS_QUERY " ORDER BY HOST DESC";
+		cksum_query = MYSQL_USERS_CHECKSUM_QUERY;
 	} else {
 		users_query = LOAD_MYSQL_USERS_QUERY USERS_QUERY_NO_ROOT " ORDER BY HOST DESC";
+		cksum_query = MYSQL_USERS_CHECKSUM_QUERY USERS_QUERY_NO_ROOT;
 	}
 
 	serviceGetUser(service, &service_user, &service_passwd);
@@ -244,7 +640,8 @@ getUsers(SERVICE *service, struct users *users)
 		return -1;
 	}
 
-	if (mysql_query(con, MYSQL_USERS_COUNT)) {
+	/* the concatenation of all the users is hashed by the backend */
+	if (mysql_query(con, MYSQL_USERS_CONCAT_LEN) || mysql_query(con, cksum_query)) {
 		LOGIF(LE, (skygw_log_write_flush(
                         LOGFILE_ERROR,
                         "Error : Loading users for service %s encountered "
@@ -271,17 +668,31 @@ getUsers(SERVICE *service, struct users *users)
 
 	nusers = atoi(row[0]);
 
-	mysql_free_result(result);
-
-	if (!nusers) {
+	if (!nusers || row[1] == NULL || strlen(row[1]) != 2 * SHA_DIGEST_LENGTH) {
 		LOGIF(LE, (skygw_log_write_flush(
                         LOGFILE_ERROR,
                         "Error : Counting users for service %s returned 0",
                         service->name)));
+		mysql_free_result(result);
 		mysql_close(con);
 		return -1;
 	}
 
+	gw_hex2bin(users->cksum, row[1], 2 * SHA_DIGEST_LENGTH);
+	mysql_free_result(result);
+
+	if (cksum && memcmp(cksum, users->cksum, SHA_DIGEST_LENGTH) == 0) {
+		/* same data, the users need not be fetched */
+		LOGIF(LD, (skygw_log_write_flush(
+			LOGFILE_DEBUG,
+			"%lu [getUsers()] users' table of service %s has not changed",
+			pthread_self(),
+			service->name)));
+		mysql_close(con);
+		mysql_thread_end();
+		return 0;
+	}
+
 	if (mysql_query(con, users_query)) {
 		LOGIF(LE, (skygw_log_write_flush(
                         LOGFILE_ERROR,
@@ -306,11 +717,28 @@ getUsers(SERVICE *service, struct users *users)
 		return -1;
 	}
 	num_fields = mysql_num_fields(result);
-	
-	users_data = (char *)calloc(nusers, (users_data_row_len * sizeof(char)) + 1);
 
-	if(users_data == NULL)
-		return -1;
+	/*<
+	 * The host names are looked up by the resolver thread before the
+	 * users are added, the loop below only reads its cache. The names
+	 * still unknown when the wait ends are left out and the checksum is
+	 * cleared, so that the next check loads the users again.
+	 */
+	while ((row = mysql_fetch_row(result))) {
+		if (strchr(row[1], '%') == NULL && strchr(row[1], '/') == NULL)
+			resolver_add(row[1]);
+	}
+	if (!resolver_wait(RESOLVER_WAIT)) {
+		LOGIF(LE, (skygw_log_write_flush(
+                        LOGFILE_ERROR,
+                        "Error : The host names of the users of service %s "
+                        "could not all be looked up in %d seconds, the users "
+                        "of the names not found are not loaded.",
+                        service->name,
+                        RESOLVER_WAIT)));
+		memset(users->cksum, 0, SHA_DIGEST_LENGTH);
+	}
+	mysql_data_seek(result, 0);
 
 	while ((row = mysql_fetch_row(result))) { 
 		/**
@@ -326,8 +754,8 @@ getUsers(SERVICE *service, struct users *users)
 		memset(&serv_addr, 0, sizeof(serv_addr));
 		memset(&key, 0, sizeof(key));
 
-		/* if host == '%', 0 is passed */
-		if (setipaddress(&serv_addr.sin_addr, strcmp(row[1], "%") ? row[1] : "0.0.0.0")) {
+		/* '%', 'a.b.%' and 'a.b.c.d/m.m.m.m' are wildcard hosts */
+		if (mysql_users_parse_host(row[1], &serv_addr, &key.hostbits)) {
 
 			key.user = strdup(row[0]);
 
@@ -354,9 +782,6 @@ getUsers(SERVICE *service, struct users *users)
 					row[0],
 					row[1],
 					rc == NULL ? "NULL" : ret_ip)));
-		
-				/* Append data in the memory area for SHA1 digest */	
-				strncat(users_data, row[3], users_data_row_len);
 
 				total_users++;
 			} else {
@@ -382,13 +807,6 @@ getUsers(SERVICE *service, struct users *users)
 		}
 	}
 
-	/* compute SHA1 digest for users' data */
-        SHA1((const unsigned char *) users_data, strlen(users_data), hash);
-
-	memcpy(users->cksum, hash, SHA_DIGEST_LENGTH);
-
-	free(users_data);
-
 	mysql_free_result(result);
 	mysql_close(con);
 	mysql_thread_end();
@@ -396,6 +814,291 @@ getUsers(SERVICE *service, struct users *users)
 	return total_users;
 }
 
+/**
+ * Make the name of the snapshot file of a service, the directory is made
+ * if it does not exist.
+ *
+ * @param service	The service
+ * @param fname		The name, of PATH_MAX + 1 bytes
+ * @return		1 on success, 0 if the name is too long
+ */
+static int
+users_snapshot_fname(SERVICE *service, char *fname)
+{
+char	*p;
+int	len;
+
+	len = snprintf(fname, PATH_MAX + 1, "%s/%s", get_maxscale_home(),
+			USERS_SNAPSHOT_DIR);
+	if (len > PATH_MAX)
+		return 0;
+	mkdir(fname, 0700);
+	p = fname + len + 1;
+	len += snprintf(fname + len, PATH_MAX + 1 - len, "/%s.users",
+			service->name);
+	if (len > PATH_MAX)
+		return 0;
+	/*< A service name may have a slash */
+	for (; *p; p++)
+		if (*p == '/')
+			*p = '_';
+	return 1;
+}
+
+/**
+ * Make the description of where the users of a service come from, the
+ * service user and the backend servers. A snapshot is only loaded by a
+ * service with the same description.
+ *
+ * @param service	The service
+ * @return		The description, to be freed by the caller, or NULL
+ */
+static char *
+users_snapshot_origin(SERVICE *service)
+{
+SERVER	*server;
+char	*user, *passwd, *origin;
+int	len, n;
+
+	if (!serviceGetUser(service, &user, &passwd))
+		return NULL;
+	len = strlen(user) + 2;
+	for (server = service->databases; server; server = server->nextdb)
+		len += strlen(server->name) + 12;
+	if ((origin = (char *)malloc(len)) == NULL)
+		return NULL;
+	n = sprintf(origin, "%s%s", user, service->enable_root ? "+" : "");
+	for (server = service->databases; server; server = server->nextdb)
+		n += sprintf(origin + n, " %s:%d", server->name, server->port);
+	return origin;
+}
+
+/**
+ * Save the snapshot of the users' table of a service. The snapshot is
+ * written to a new file that is renamed over the old one, so that a crash
+ * leaves the last complete snapshot. The file is only readable by its
+ * owner, it holds the password hashes.
+ *
+ * @param service	The service
+ * @param users		The users' table, not modified while it is saved
+ */
+static void
+users_snapshot_write(SERVICE *service, USERS *users)
+{
+HASHITERATOR	*iter;
+MYSQL_USER_HOST	*key;
+char		fname[PATH_MAX + 1], tmpname[PATH_MAX + 1];
+char		*origin, *auth;
+unsigned char	*buf, *p;
+uint16_t	ulen, alen;
+uint32_t	len, n = 0;
+size_t		size;
+int		fd, rc;
+
+	if (!config_users_snapshot() || !users_snapshot_fname(service, fname))
+		return;
+	if ((origin = users_snapshot_origin(service)) == NULL)
+		return;
+
+	size = strlen(USERS_SNAPSHOT_MAGIC) + 4 + strlen(origin) +
+		SHA_DIGEST_LENGTH + 4 + SHA_DIGEST_LENGTH;
+	if ((iter = hashtable_iterator(users->data)) == NULL)
+	{
+		free(origin);
+		return;
+	}
+	while ((key = (MYSQL_USER_HOST *)hashtable_next(iter)) != NULL)
+	{
+		auth = (char *)hashtable_fetch(users->data, key);
+		size += 4 + 1 + 2 + strlen(key->user) + 2 +
+			(auth ? strlen(auth) : 0);
+	}
+	hashtable_iterator_free(iter);
+
+	if ((buf = (unsigned char *)malloc(size)) == NULL ||
+		(iter = hashtable_iterator(users->data)) == NULL)
+	{
+		free(buf);
+		free(origin);
+		return;
+	}
+	p = buf + strlen(USERS_SNAPSHOT_MAGIC) + 4 + strlen(origin) +
+		SHA_DIGEST_LENGTH + 4;
+	while ((key = (MYSQL_USER_HOST *)hashtable_next(iter)) != NULL)
+	{
+		auth = (char *)hashtable_fetch(users->data, key);
+		ulen = strlen(key->user);
+		alen = auth ? strlen(auth) : 0;
+		if (p + 9 + ulen + alen > buf + size - SHA_DIGEST_LENGTH)
+			break;
+		memcpy(p, &key->ipv4.sin_addr.s_addr, 4);
+		p[4] = (unsigned char)key->hostbits;
+		memcpy(p + 5, &ulen, 2);
+		memcpy(p + 7, key->user, ulen);
+		p += 7 + ulen;
+		memcpy(p, &alen, 2);
+		memcpy(p + 2, auth, alen);
+		p += 2 + alen;
+		n++;
+	}
+	hashtable_iterator_free(iter);
+	size = p - buf + SHA_DIGEST_LENGTH;
+
+	p = buf;
+	memcpy(p, USERS_SNAPSHOT_MAGIC, strlen(USERS_SNAPSHOT_MAGIC));
+	p += strlen(USERS_SNAPSHOT_MAGIC);
+	len = strlen(origin);
+	memcpy(p, &len, 4);
+	memcpy(p + 4, origin, len);
+	p += 4 + len;
+	memcpy(p, users->cksum, SHA_DIGEST_LENGTH);
+	memcpy(p + SHA_DIGEST_LENGTH, &n, 4);
+	SHA1(buf, size - SHA_DIGEST_LENGTH, buf + size - SHA_DIGEST_LENGTH);
+	free(origin);
+
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", fname);
+	rc = -1;
+	if ((fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0600)) >= 0)
+	{
+		if (write(fd, buf, size) == (ssize_t)size && fsync(fd) == 0)
+			rc = 0;
+		close(fd);
+		if (rc == 0 && (rc = rename(tmpname, fname)) != 0)
+			unlink(tmpname);
+	}
+	free(buf);
+
+	if (rc != 0)
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : Failed to save the snapshot of the users of "
+			"service %s to %s, %s.",
+			service->name,
+			fname,
+			strerror(errno))));
+	}
+}
+
+/**
+ * Read the snapshot of the users' table of a service
+ *
+ * @param service	The service
+ * @param users		The empty users' table the users are added to
+ * @return		-1 if there is no snapshot, it is damaged or it is
+ *			of other backends, the number of users otherwise
+ */
+static int
+users_snapshot_read(SERVICE *service, USERS *users)
+{
+MYSQL_USER_HOST	key;
+struct stat	st;
+char		fname[PATH_MAX + 1];
+char		auth[MYSQL_PASSWORD_LEN + 1];
+char		*origin;
+unsigned char	*buf, *p, *end;
+unsigned char	sha[SHA_DIGEST_LENGTH];
+uint16_t	ulen, alen;
+uint32_t	len, n, i;
+int		fd, total_users = 0;
+
+	if (!users_snapshot_fname(service, fname))
+		return -1;
+	if ((fd = open(fname, O_RDONLY)) < 0)
+		return -1;
+	buf = NULL;
+	if (fstat(fd, &st) != 0 ||
+		st.st_size < (off_t)(strlen(USERS_SNAPSHOT_MAGIC) + 8 +
+					2 * SHA_DIGEST_LENGTH) ||
+		st.st_size > USERS_SNAPSHOT_MAXSIZE ||
+		(buf = (unsigned char *)malloc(st.st_size)) == NULL ||
+		read(fd, buf, st.st_size) != st.st_size)
+	{
+		close(fd);
+		free(buf);
+		goto damaged;
+	}
+	close(fd);
+
+	end = buf + st.st_size - SHA_DIGEST_LENGTH;
+	SHA1(buf, end - buf, sha);
+	if (memcmp(buf, USERS_SNAPSHOT_MAGIC, strlen(USERS_SNAPSHOT_MAGIC)) ||
+		memcmp(sha, end, SHA_DIGEST_LENGTH))
+	{
+		free(buf);
+		goto damaged;
+	}
+	p = buf + strlen(USERS_SNAPSHOT_MAGIC);
+	memcpy(&len, p, 4);
+	p += 4;
+	if ((origin = users_snapshot_origin(service)) == NULL ||
+		len != strlen(origin) ||
+		(size_t)(end - p) < len + SHA_DIGEST_LENGTH + 4 ||
+		memcmp(p, origin, len))
+	{
+		LOGIF(LM, (skygw_log_write(
+			LOGFILE_MESSAGE,
+			"The snapshot of the users of service %s is of another "
+			"service user or other backend servers, it is not "
+			"loaded.",
+			service->name)));
+		free(origin);
+		free(buf);
+		return -1;
+	}
+	free(origin);
+	p += len;
+	memcpy(users->cksum, p, SHA_DIGEST_LENGTH);
+	memcpy(&n, p + SHA_DIGEST_LENGTH, 4);
+	p += SHA_DIGEST_LENGTH + 4;
+
+	for (i = 0; i < n; i++)
+	{
+		if (end - p < 7)
+			break;
+		memset(&key, 0, sizeof(key));
+		key.ipv4.sin_family = AF_INET;
+		memcpy(&key.ipv4.sin_addr.s_addr, p, 4);
+		key.hostbits = p[4];
+		memcpy(&ulen, p + 5, 2);
+		p += 7;
+		if (ulen == 0 || ulen > MYSQL_USER_MAXLEN || end - p < ulen + 2)
+			break;
+		if ((key.user = (char *)malloc(ulen + 1)) == NULL)
+			break;
+		memcpy(key.user, p, ulen);
+		key.user[ulen] = '\0';
+		p += ulen;
+		memcpy(&alen, p, 2);
+		p += 2;
+		if (alen > MYSQL_PASSWORD_LEN || end - p < alen)
+		{
+			free(key.user);
+			break;
+		}
+		memcpy(auth, p, alen);
+		auth[alen] = '\0';
+		p += alen;
+		total_users += mysql_users_add(users, &key, auth);
+		free(key.user);
+	}
+	free(buf);
+	if (i < n || p != end)
+		goto damaged;
+
+	return total_users;
+
+damaged:
+	LOGIF(LE, (skygw_log_write_flush(
+		LOGFILE_ERROR,
+		"Error : The snapshot of the users of service %s in %s is "
+		"damaged or can't be read, the users are loaded from the "
+		"backends.",
+		service->name,
+		fname)));
+	return -1;
+}
+
 /**
  * Allocate a new MySQL users table for mysql specific users@host as key
  *
@@ -416,6 +1119,8 @@ USERS	*rval;
 
 	/* set the MySQL user@host print routine for the debug interface */
 	rval->usersCustomUserFormat = mysql_format_user_entry;
+	rval->refcount = 1;
+	rval->version = atomic_add(&users_version, 1) + 1;
 
 	/* the key is handled by uh_keydup/uh_keyfree.
 	* the value is a (char *): it's handled by strdup/free
@@ -432,6 +1137,8 @@ USERS	*rval;
  * @param user		The user name
  * @param auth		The authentication data
  * @return		The number of users added to the table
+ *
+ * The wildcard bits of the address of the key are cleared.
  */
 int
 mysql_users_add(USERS *users, MYSQL_USER_HOST *key, char *auth)
@@ -441,10 +1148,21 @@ int     add;
 	if (key == NULL || key->user == NULL)
 		return 0;
 
+	if (key->hostbits < 0 || key->hostbits > 32)
+		return 0;
+
+	if (key->hostbits > 0)
+		key->ipv4.sin_addr.s_addr &= uh_netmask(key->hostbits);
+
         atomic_add(&users->stats.n_adds, 1);
         add = hashtable_add(users->data, key, auth);
         atomic_add(&users->stats.n_entries, add);
 
+        if (add) {
+                users->version = atomic_add(&users_version, 1) + 1;
+		users->hostbits |= 1ULL << key->hostbits;
+	}
+
         return add;
 }
 
@@ -462,6 +1180,119 @@ char *mysql_users_fetch(USERS *users, MYSQL_USER_HOST *key) {
         return hashtable_fetch(users->data, key);
 }
 
+/**
+ * Fetch the authentication data of a user from the wildcard and netmask
+ * hosts that match the address of the key. The table has an index of the
+ * numbers of wildcard bits its hosts have, the address is masked for each of
+ * them and looked up, from the most specific host to '%'. So there are as
+ * many lookups as there are different kinds of wildcard hosts, not as many
+ * as there are hosts.
+ *
+ * @param users The MySQL users table
+ * @param key	The key with user@host, the host is the client address
+ * @return	The authentication data or NULL if no host matches
+ */
+char *mysql_users_fetch_wildcard(USERS *users, MYSQL_USER_HOST *key) {
+	MYSQL_USER_HOST	find_key;
+	char		*rval;
+	int		bits;
+
+	if (key == NULL || key->user == NULL)
+		return NULL;
+
+	find_key.user = key->user;
+	memcpy(&find_key.ipv4, &key->ipv4, sizeof(struct sockaddr_in));
+
+	for (bits = 1; bits <= 32; bits++) {
+		if ((users->hostbits & (1ULL << bits)) == 0)
+			continue;
+
+		find_key.hostbits = bits;
+		find_key.ipv4.sin_addr.s_addr = key->ipv4.sin_addr.s_addr & uh_netmask(bits);
+
+		if ((rval = mysql_users_fetch(users, &find_key)) != NULL)
+			return rval;
+	}
+	return NULL;
+}
+
+/**
+ * Convert the host of a mysql.user row to an address and the number of
+ * wildcard bits. The wildcard hosts that are supported are '%', one to
+ * three octets followed by '.%' and an address with a netmask of
+ * contiguous bits. Other hosts are a single host, a name is found in the
+ * cache of the resolver and is not valid until the resolver has found it.
+ *
+ * @param host		The host column
+ * @param addr		The address, the wildcard bits are 0
+ * @param hostbits	The number of wildcard bits
+ * @return		1 on success, 0 if the host is not valid
+ */
+int
+mysql_users_parse_host(char *host, struct sockaddr_in *addr, int *hostbits)
+{
+	char		buf[MYSQL_HOST_MAXLEN + 1];
+	char		*ptr, *slash;
+	struct in_addr	mask;
+	unsigned int	octet, value = 0;
+	int		noctets = 0, digits = 0;
+	uint32_t	m;
+
+	*hostbits = 0;
+
+	if (strcmp(host, "%") == 0) {
+		addr->sin_addr.s_addr = INADDR_ANY;
+		*hostbits = 32;
+		return 1;
+	}
+
+	/* a.%, a.b.% and a.b.c.% */
+	if (strlen(host) > 2 && strcmp(host + strlen(host) - 2, ".%") == 0) {
+		for (ptr = host, octet = 0; *ptr != '%'; ptr++) {
+			if (*ptr >= '0' && *ptr <= '9' && digits < 3) {
+				octet = octet * 10 + (*ptr - '0');
+				digits++;
+			} else if (*ptr == '.' && digits > 0 && octet <= 255 && noctets < 3) {
+				value = (value << 8) | octet;
+				noctets++;
+				octet = digits = 0;
+			} else {
+				return 0;
+			}
+		}
+		addr->sin_addr.s_addr = htonl(value << (32 - 8 * noctets));
+		*hostbits = 32 - 8 * noctets;
+		return 1;
+	}
+
+	/* a.b.c.d/m.m.m.m */
+	if ((slash = strchr(host, '/')) != NULL) {
+		if (strlen(host) > MYSQL_HOST_MAXLEN)
+			return 0;
+		strcpy(buf, host);
+		buf[slash - host] = '\0';
+
+		if (inet_pton(AF_INET, buf, &addr->sin_addr) != 1 ||
+			inet_pton(AF_INET, buf + (slash - host) + 1, &mask) != 1)
+			return 0;
+
+		m = ntohl(mask.s_addr);
+
+		/* the mask bits must be contiguous */
+		while (*hostbits < 32 && (m & (1U << *hostbits)) == 0)
+			(*hostbits)++;
+
+		if (*hostbits < 32 && (~m >> *hostbits) != 0)
+			return 0;
+
+		addr->sin_addr.s_addr &= mask.s_addr;
+		return 1;
+	}
+
+	/* host names come from the cache of the resolver */
+	return resolver_lookup(host, &addr->sin_addr);
+}
+
 /**
  * The hash function we use for storing MySQL users as: users@hosts.
  * Currently only IPv4 addresses are supported
@@ -472,12 +1303,27 @@ char *mysql_users_fetch(USERS *users, MYSQL_USER_HOST *key) {
 
 static int uh_hfun( void* key) {
         MYSQL_USER_HOST *hu = (MYSQL_USER_HOST *) key;
+	uint64_t	h = UH_FNV_OFFSET;
+	unsigned char	*ptr;
 
 	if (key == NULL || hu == NULL || hu->user == NULL) {
 		return 0;
-	} else {
-        	return (*hu->user + *(hu->user + 1) + (unsigned int) (hu->ipv4.sin_addr.s_addr & 0xFF000000 / (256 * 256 * 256)));
 	}
+
+	/* FNV-1a over the user, then the address and the wildcard bits */
+	for (ptr = (unsigned char *)hu->user; *ptr; ptr++) {
+		h = (h ^ *ptr) * UH_FNV_PRIME;
+	}
+	h ^= ((uint64_t)hu->ipv4.sin_addr.s_addr << 8) | (unsigned int)hu->hostbits;
+
+	/* the final mix spreads the address to all bits */
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return (int)(h ^ (h >> 32));
 }
 
 /**
@@ -496,7 +1342,9 @@ static int uh_cmpfun( void* v1, void* v2) {
 	if (v1 == NULL || v2 == NULL || hu1 == NULL || hu2 == NULL || hu1->user == NULL || hu2->user == NULL)
 		return 0;
 	
-	if (strcmp(hu1->user, hu2->user) == 0 && (hu1->ipv4.sin_addr.s_addr == hu2->ipv4.sin_addr.s_addr)) {
+	if (hu1->ipv4.sin_addr.s_addr == hu2->ipv4.sin_addr.s_addr &&
+		hu1->hostbits == hu2->hostbits &&
+		strcmp(hu1->user, hu2->user) == 0) {
 		return 0;
 	} else {
 		return 1;
@@ -523,6 +1371,7 @@ static void *uh_keydup(void* key) {
 		return NULL;
 
 	memcpy(&rval->ipv4, &current_key->ipv4, sizeof(struct sockaddr_in));
+	rval->hostbits = current_key->hostbits;
 
 	return (void *) rval;
 }
@@ -556,7 +1405,10 @@ char *mysql_format_user_entry(void *data)
 	MYSQL_USER_HOST *entry;
 	char *mysql_user;
 	/* the returned user string is "USER" + "@" + "HOST" + '\0' */
-	int mysql_user_len = MYSQL_USER_MAXLEN + 1 + INET_ADDRSTRLEN + 1;
+	int mysql_user_len = MYSQL_USER_MAXLEN + 1 + 2 * INET_ADDRSTRLEN + 1;
+	struct in_addr mask;
+	unsigned char *octets;
+	int len;
 
 	if (data == NULL)
 		return NULL;
@@ -571,12 +1423,25 @@ char *mysql_format_user_entry(void *data)
 	if (mysql_user == NULL)
 		return NULL;
 	
-	if (entry->ipv4.sin_addr.s_addr == INADDR_ANY) {
+	if (entry->hostbits == 32) {
 		snprintf(mysql_user, mysql_user_len, "%s@%%", entry->user);
+	} else if (entry->hostbits > 0 && entry->hostbits % 8 == 0) {
+		octets = (unsigned char *)&entry->ipv4.sin_addr.s_addr;
+		len = snprintf(mysql_user, mysql_user_len, "%.*s@%u.", MYSQL_USER_MAXLEN, entry->user, octets[0]);
+		if (entry->hostbits <= 16)
+			len += snprintf(mysql_user + len, mysql_user_len - len, "%u.", octets[1]);
+		if (entry->hostbits <= 8)
+			len += snprintf(mysql_user + len, mysql_user_len - len, "%u.", octets[2]);
+		strcat(mysql_user, "%");
 	} else {
 		strncpy(mysql_user, entry->user, MYSQL_USER_MAXLEN);
 		strcat(mysql_user, "@");
 		inet_ntop(AF_INET, &(entry->ipv4).sin_addr, mysql_user+strlen(mysql_user), INET_ADDRSTRLEN);
+		if (entry->hostbits > 0) {
+			mask.s_addr = uh_netmask(entry->hostbits);
+			strcat(mysql_user, "/");
+			inet_ntop(AF_INET, &mask, mysql_user+strlen(mysql_user), INET_ADDRSTRLEN);
+		}
 	}
 
         return mysql_user;
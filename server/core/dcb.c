@@ -52,10 +52,14 @@
  *
  * @endverbatim
  */
+/** for splice and pipe2 */
+#define _GNU_SOURCE
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <dcb.h>
 #include <spinlock.h>
 #include <server.h>
@@ -70,12 +74,73 @@
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <hashtable.h>
+#include <config.h>
+#include <timer.h>
+#include <tls.h>
+#include <tracepoint.h>
+#include <slab.h>
 
 extern int lm_enabled_logfiles_bitmask;
 
+/*< Maximum number of buffers of a chain that are written with one writev */
+#if defined(IOV_MAX)
+#define DCB_MAX_IOV	IOV_MAX
+#else
+#define DCB_MAX_IOV	1024
+#endif
+
 static	DCB		*allDCBs = NULL;	/* Diagnotics need a list of DCBs */
-static	DCB		*zombies = NULL;
 static	SPINLOCK	dcbspin = SPINLOCK_INIT;
+
+/*<
+ * Freed DCBs are kept on a free list, up to the configured dcb_pool_size,
+ * with their mutexes and spinlocks initialised and with the protocol
+ * object and callback entries they last used still attached. There is a
+ * list for each NUMA node, a DCB goes back to the node of the polling
+ * thread that created it and a thread only reuses the DCBs of its node.
+ */
+#define	DCB_POOL_NODES	8	/*< Free lists, a power of 2 */
+static	DCB		*dcbPool[DCB_POOL_NODES];
+static	SPINLOCK	dcbpoolspin = SPINLOCK_INIT;
+static	struct {
+	int	n_pooled;	/*< DCBs currently on the free list */
+	int	n_reused;	/*< Allocations satisfied from the free list */
+	int	n_created;	/*< Allocations that had to create a DCB */
+	int	n_released;	/*< DCBs freed as the free list was full */
+} dcbPoolStats;
+
+/**
+ * The epoch state of a polling thread. The records are never freed, a thread
+ * that stops polling is simply marked as inactive.
+ */
+typedef struct dcb_epoch_thread {
+	volatile unsigned long	epoch;		/*< The last epoch announced */
+	volatile int		active;		/*< The thread is polling */
+	int			thread_id;	/*< The polling thread id */
+	DCB			*head;		/*< Oldest zombie of the thread */
+	DCB			*tail;		/*< Newest zombie of the thread */
+	struct dcb_epoch_thread	*next;		/*< All the registered threads */
+} DCB_EPOCH_THREAD;
+
+static	volatile unsigned long	dcb_epoch = 1;	/*< The global epoch */
+static	DCB_EPOCH_THREAD	*epochThreads = NULL;
+static	__thread DCB_EPOCH_THREAD *thread_epoch = NULL;
+static	int			n_zombies = 0;	/*< Zombies not yet freed */
+
+/*<
+ * While a polling thread processes an event the writes to the DCBs that
+ * coalesce their writes are only queued, the DCBs are listed here and their
+ * queues are sent by dcb_flush_writes once the event is done.
+ */
+static	__thread int	writes_corked = 0;
+static	__thread DCB	*corked_dcbs = NULL;
+
+/*<
+ * Zombies created by threads that do not poll go on a shared list that the
+ * polling threads reclaim, this is not on the hot path.
+ */
+static	DCB		*zombies = NULL;
+static	DCB		*zombies_tail = NULL;
 static	SPINLOCK	zombiespin = SPINLOCK_INIT;
 
 static void dcb_final_free(DCB *dcb);
@@ -84,14 +149,32 @@ static bool dcb_set_state_nomutex(
         const dcb_state_t new_state,
         dcb_state_t*      old_state);
 static void dcb_call_callback(DCB *dcb, DCB_REASON reason);
+static void dcb_release_callbacks(DCB *dcb);
+static void dcb_printf_flush(DCB *dcb);
 static DCB* dcb_get_next (DCB* dcb);
+static int  dcb_write_chain(DCB *dcb, GWBUF **queue);
+static int  dcb_read_socket(DCB *dcb, GWBUF **head);
 static int dcb_null_write(DCB *dcb, GWBUF *buf);
 static int dcb_null_close(DCB *dcb);
 static int dcb_null_auth(DCB *dcb, SERVER *server, SESSION *session, GWBUF *buf);
+static DCB *dcb_connect_persistent(SERVER *server, SESSION *session, const char *protocol);
+static void dcb_read_unpause(DCB *dcb);
+static int dcb_read_wait(DCB *dcb, DCB *peer, int water);
+static int dcb_writeq_lock(DCB *dcb);
+static void dcb_writeq_unlock(DCB *dcb, int locked);
+static void dcb_writeq_add(DCB *dcb, int bytes);
+static int dcb_peer_full(DCB *peer);
+static void dcb_write_watch(DCB *dcb);
+static int dcb_writeq_exceeded(DCB *dcb, int bytes);
 
-DCB* dcb_get_zombies(void)
+/**
+ * Return the number of zombie DCBs that are waiting to be freed
+ *
+ * @return The number of zombies
+ */
+int dcb_get_zombies(void)
 {
-        return zombies;
+        return n_zombies;
 }
 
 /**
@@ -106,11 +189,47 @@ DCB *
 dcb_alloc(dcb_role_t role)
 {
 DCB	*rval;
+int	node = poll_thread_node() & (DCB_POOL_NODES - 1);
 
-	if ((rval = calloc(1, sizeof(DCB))) == NULL)
+	spinlock_acquire(&dcbpoolspin);
+	if ((rval = dcbPool[node]) != NULL)
 	{
-		return NULL;
+		dcbPool[node] = rval->next;
+		dcbPoolStats.n_pooled--;
+		dcbPoolStats.n_reused++;
+	}
+	spinlock_release(&dcbpoolspin);
+
+	if (rval != NULL)
+	{
+		simple_mutex_t	read_lock, write_lock;
+		void		*protocol = rval->protocol_cache;
+		size_t		protocol_size = rval->protocol_size;
+		DCB_CALLBACK	*cb_spare = rval->cb_spare;
+
+		/*< Keep the initialised mutexes, reset everything else */
+		memcpy(&read_lock, &rval->dcb_read_lock, sizeof(simple_mutex_t));
+		memcpy(&write_lock, &rval->dcb_write_lock, sizeof(simple_mutex_t));
+		memset(rval, 0, sizeof(DCB));
+		memcpy(&rval->dcb_read_lock, &read_lock, sizeof(simple_mutex_t));
+		memcpy(&rval->dcb_write_lock, &write_lock, sizeof(simple_mutex_t));
+		rval->protocol_cache = protocol;
+		rval->protocol_size = protocol_size;
+		rval->cb_spare = cb_spare;
+	}
+	else
+	{
+		/*< From the cache of the thread, huge pages if configured */
+		if ((rval = slab_alloc(sizeof(DCB))) == NULL)
+		{
+			return NULL;
+		}
+		memset(rval, 0, sizeof(DCB));
+		atomic_add(&dcbPoolStats.n_created, 1);
+		simple_mutex_init(&rval->dcb_write_lock, "DCB write mutex");
+		simple_mutex_init(&rval->dcb_read_lock, "DCB read mutex");
 	}
+	rval->numa_node = node;
 #if defined(SS_DEBUG)
         rval->dcb_chk_top = CHK_NUM_DCB;
         rval->dcb_chk_tail = CHK_NUM_DCB;
@@ -118,8 +237,6 @@ DCB	*rval;
 #endif
         rval->dcb_role = role;
 #if 1
-        simple_mutex_init(&rval->dcb_write_lock, "DCB write mutex");
-        simple_mutex_init(&rval->dcb_read_lock, "DCB read mutex");
         rval->dcb_write_active = false;
         rval->dcb_read_active = false;
 #endif
@@ -128,34 +245,140 @@ DCB	*rval;
 	spinlock_init(&rval->delayqlock);
 	spinlock_init(&rval->authlock);
 	spinlock_init(&rval->cb_lock);
+	spinlock_init(&rval->poll_lock);
         rval->fd = -1;
 	memset(&rval->stats, 0, sizeof(DCBSTATS));	// Zero the statistics
 	rval->state = DCB_STATE_ALLOC;
-	bitmask_init(&rval->memdata.bitmask);
+	rval->memdata.epoch = 0;
+	rval->memdata.next = NULL;
 	rval->writeqlen = 0;
+	rval->mail_pending = 0;
+	rval->poll_busy = 0;
+	rval->poll_pending = 0;
+	rval->read_size = DCB_READ_SIZE_MIN;
+	rval->owner_thread = 0;
+	rval->listener_copy = NULL;
 	rval->high_water = 0;
 	rval->low_water = 0;
 	rval->next = NULL;
-	rval->callbacks = NULL;
+	memset(rval->callbacks, 0, sizeof(rval->callbacks));
+	rval->cb_mask = 0;
+	timer_init(&rval->timer);
+	timer_init(&rval->write_timer);
+	rval->last_written = 0;
+	rval->idle_timeout = 0;
+	rval->last_activity = 0;
+	rval->server = NULL;
+	rval->nextpersistent = NULL;
+	rval->persistentstart = 0;
+	rval->splice_to = NULL;
+	rval->splice_pipe[0] = rval->splice_pipe[1] = -1;
+	rval->splice_pending = 0;
+	rval->paused = NULL;
+	rval->paused_by = NULL;
+	rval->paused_next = NULL;
+	rval->tls_ctx = NULL;
+	rval->tls = NULL;
 
 	rval->remote = NULL;
 	rval->user = NULL;
 	rval->flags = 0;
 
+	/*< New DCBs go at the head of the chain, no need to walk it */
 	spinlock_acquire(&dcbspin);
-	if (allDCBs == NULL)
-		allDCBs = rval;
-	else
+	rval->prev = NULL;
+	rval->next = allDCBs;
+	if (allDCBs)
+		allDCBs->prev = rval;
+	allDCBs = rval;
+	spinlock_release(&dcbspin);
+	return rval;
+}
+
+/**
+ * Allocate the protocol specific state of a DCB. The memory is zeroed and is
+ * owned by the DCB, it is released when the DCB is freed. The protocol
+ * object last used by a pooled DCB is reused if it is large enough.
+ *
+ * @param dcb	The DCB the protocol state belongs to
+ * @param size	The size of the protocol state
+ * @return	The zeroed memory or NULL if it could not be allocated
+ */
+void *
+dcb_protocol_alloc(DCB *dcb, size_t size)
+{
+void	*rval;
+
+	if (dcb->protocol_cache != NULL && dcb->protocol_size >= size)
 	{
-		DCB *ptr = allDCBs;
-		while (ptr->next)
-			ptr = ptr->next;
-		ptr->next = rval;
+		rval = dcb->protocol_cache;
+		dcb->protocol_cache = NULL;
+		memset(rval, 0, size);
+		return rval;
 	}
-	spinlock_release(&dcbspin);
+	if (dcb->protocol_cache != NULL)
+	{
+		free(dcb->protocol_cache);
+		dcb->protocol_cache = NULL;
+	}
+	if ((rval = calloc(1, size)) != NULL)
+		dcb->protocol_size = size;
+	else
+		dcb->protocol_size = 0;
 	return rval;
 }
 
+/**
+ * Return a DCB that is no longer referenced to the pool, or free it if the
+ * pool is full or disabled.
+ *
+ * @param dcb	The DCB to release
+ */
+static void
+dcb_pool_release(DCB *dcb)
+{
+DCB_CALLBACK	*cb;
+
+	spinlock_acquire(&dcbpoolspin);
+	if (dcbPoolStats.n_pooled < config_dcb_pool_size())
+	{
+		dcb->next = dcbPool[dcb->numa_node];
+		dcbPool[dcb->numa_node] = dcb;
+		dcbPoolStats.n_pooled++;
+		spinlock_release(&dcbpoolspin);
+		return;
+	}
+	dcbPoolStats.n_released++;
+	spinlock_release(&dcbpoolspin);
+
+	while ((cb = dcb->cb_spare) != NULL)
+	{
+		dcb->cb_spare = cb->next;
+		free(cb);
+	}
+	if (dcb->protocol_cache)
+		free(dcb->protocol_cache);
+        simple_mutex_done(&dcb->dcb_read_lock);
+        simple_mutex_done(&dcb->dcb_write_lock);
+	slab_free(dcb);
+}
+
+/**
+ * Diagnostic routine to print the statistics of the DCB pool
+ *
+ * @param pdcb	The DCB to print to
+ */
+void
+dprintDCBPool(DCB *pdcb)
+{
+	dcb_printf(pdcb, "DCB pool:\n");
+	dcb_printf(pdcb, "\tPool size limit:       %d\n", config_dcb_pool_size());
+	dcb_printf(pdcb, "\tPooled DCBs:           %d\n", dcbPoolStats.n_pooled);
+	dcb_printf(pdcb, "\tReused DCBs:           %d\n", dcbPoolStats.n_reused);
+	dcb_printf(pdcb, "\tCreated DCBs:          %d\n", dcbPoolStats.n_created);
+	dcb_printf(pdcb, "\tReleased DCBs:         %d\n", dcbPoolStats.n_released);
+}
+
 
 /**
  * Free a DCB that has not been associated with a descriptor.
@@ -176,81 +399,64 @@ dcb_free(DCB *dcb)
 	}
 }
 
-/** 
+/**
  * Add the DCB to the end of zombies list. 
  *
  * Adding to list occurs once per DCB. This is ensured by changing the
- * state of DCB to DCB_STATE_ZOMBIE after addition. Prior insertion, DCB state
- * is checked and operation proceeds only if state differs from DCB_STATE_ZOMBIE.
+ * state of DCB to DCB_STATE_ZOMBIE, only the caller that makes the change
+ * from DCB_STATE_NOPOLLING adds the DCB. The DCB is tagged with the global
+ * epoch and appended to the zombie list of the calling polling thread, no
+ * lock is taken unless the caller is not a polling thread.
+ *
+ * The DCB must already have been removed from the poll set, which is what
+ * makes the epoch read here a safe bound for references to it.
+ *
  * @param dcb The DCB to add to the zombie list
  * @return none
  */
 void
 dcb_add_to_zombieslist(DCB *dcb)
 {
-        bool        succp = false;
-        dcb_state_t prev_state = DCB_STATE_UNDEFINED;
+        bool             succp = false;
+        dcb_state_t      prev_state = DCB_STATE_UNDEFINED;
+        DCB_EPOCH_THREAD *self = thread_epoch;
         
         CHK_DCB(dcb);        
 
-        /*<
-         * Protect zombies list access.
-         */
-	spinlock_acquire(&zombiespin);
         /*<
          * If dcb is already added to zombies list, return.
          */
-        if (dcb->state != DCB_STATE_NOPOLLING) {
-                ss_dassert(dcb->state != DCB_STATE_POLLING &&
-                           dcb->state != DCB_STATE_LISTENING);
-                spinlock_release(&zombiespin);
+        succp = dcb_set_state(dcb, DCB_STATE_ZOMBIE, &prev_state);
+
+        if (!succp || prev_state != DCB_STATE_NOPOLLING) {
+                ss_dassert(prev_state != DCB_STATE_POLLING &&
+                           prev_state != DCB_STATE_LISTENING);
                 return;
         }
-#if 1
-        /*<
-         * Add closing dcb to the top of the list.
-         */
-        dcb->memdata.next = zombies;
-        zombies = dcb;
-#else
-	if (zombies == NULL) {
-		zombies = dcb;
-        } else {
-		DCB *ptr = zombies;
-		while (ptr->memdata.next)
-		{
-                        ss_info_dassert(
-                                ptr->memdata.next->state == DCB_STATE_ZOMBIE,
-                                "Next zombie is not in DCB_STATE_ZOMBIE state");
-
-                        ss_info_dassert(
-                                ptr != dcb,
-                                "Attempt to add DCB to zombies list although it "
-                                "is already there.");
-                        
-			if (ptr == dcb)
-			{
-				LOGIF(LE, (skygw_log_write_flush(
-                                        LOGFILE_ERROR,
-                                        "Error : Attempt to add DCB to zombies "
-                                        "list when it is already in the list")));
-				break;
-			}
-			ptr = ptr->memdata.next;
-		}
-		if (ptr != dcb) {
-                        ptr->memdata.next = dcb;
-                }
-	}
-#endif
-        /*<
-         * Set state which indicates that it has been added to zombies
-         * list.
-         */
-        succp = dcb_set_state(dcb, DCB_STATE_ZOMBIE, &prev_state);
-        ss_info_dassert(succp, "Failed to set DCB_STATE_ZOMBIE");
-        
-	spinlock_release(&zombiespin);
+        /*< Order the removal from the poll set before the epoch read */
+        __sync_synchronize();
+        dcb->memdata.epoch = dcb_epoch;
+        dcb->memdata.next = NULL;
+        atomic_add(&n_zombies, 1);
+
+        if (self != NULL && self->active)
+        {
+                if (self->tail)
+                        self->tail->memdata.next = dcb;
+                else
+                        self->head = dcb;
+                self->tail = dcb;
+        }
+        else
+        {
+                spinlock_acquire(&zombiespin);
+                if (zombies_tail)
+                        zombies_tail->memdata.next = dcb;
+                else
+                        zombies = dcb;
+                zombies_tail = dcb;
+                spinlock_release(&zombiespin);
+        }
 }
 
 /*
@@ -287,6 +493,27 @@ DCB	*clone;
 	return clone;
 }
 
+/**
+ * Remove a DCB, or a cursor, from the chain of all DCBs. The chain is doubly
+ * linked so that closing a DCB does not walk it. Must be called with dcbspin
+ * held.
+ *
+ * @param dcb	The DCB to remove
+ */
+static void
+dcb_list_remove(DCB *dcb)
+{
+	if (dcb->prev == NULL && allDCBs != dcb)
+		return;		/*< Not in the chain */
+	if (dcb->prev)
+		dcb->prev->next = dcb->next;
+	else
+		allDCBs = dcb->next;
+	if (dcb->next)
+		dcb->next->prev = dcb->prev;
+	dcb->next = dcb->prev = NULL;
+}
+
 /**
  * Free a DCB and remove it from the chain of all DCBs
  *
@@ -298,8 +525,6 @@ DCB	*clone;
 static void
 dcb_final_free(DCB *dcb)
 {
-DCB_CALLBACK		*cb;
-
         CHK_DCB(dcb);
         ss_info_dassert(dcb->state == DCB_STATE_DISCONNECTED || 
                         dcb->state == DCB_STATE_ALLOC,
@@ -307,27 +532,7 @@ DCB_CALLBACK		*cb;
 
 	/*< First remove this DCB from the chain */
 	spinlock_acquire(&dcbspin);
-	if (allDCBs == dcb)
-	{
-		/*<
-		 * Deal with the special case of removing the DCB at the head of
-		 * the chain.
-		 */
-		allDCBs = dcb->next;
-	}
-	else
-	{
-		/*<
-		 * We find the DCB that point to the one we are removing and then
-		 * set the next pointer of that DCB to the next pointer of the
-		 * DCB we are removing.
-		 */
-		DCB *ptr = allDCBs;
-		while (ptr && ptr->next != dcb)
-			ptr = ptr->next;
-		if (ptr)
-			ptr->next = dcb->next;
-	}
+	dcb_list_remove(dcb);
 	spinlock_release(&dcbspin);
 
         if (dcb->session) {
@@ -348,8 +553,17 @@ DCB_CALLBACK		*cb;
 		}
 	}
 
+	/*< Keep the protocol object for reuse if it came from dcb_protocol_alloc */
 	if (dcb->protocol && ((dcb->flags & DCBF_CLONE) ==0))
-		free(dcb->protocol);
+	{
+		if (dcb->protocol_size > 0 && dcb->protocol_cache == NULL)
+			dcb->protocol_cache = dcb->protocol;
+		else
+			free(dcb->protocol);
+	}
+	dcb->protocol = NULL;
+	if (dcb->protocol_cache == NULL)
+		dcb->protocol_size = 0;
 	if (dcb->data && ((dcb->flags & DCBF_CLONE) ==0))
 		free(dcb->data);
 	if (dcb->remote)
@@ -358,129 +572,130 @@ DCB_CALLBACK		*cb;
 		free(dcb->user);
 
 	/* Clear write and read buffers */	
-	if (dcb->delayq) {
-		GWBUF *queue = dcb->delayq;
-		while ((queue = gwbuf_consume(queue, GWBUF_LENGTH(queue))) != NULL);
+	dcb_delayq_free(dcb);
+	if (dcb->printq)
+		gwbuf_consume(dcb->printq, gwbuf_length(dcb->printq));
+	dcb->printq = NULL;
+	dcb->printq_tail = NULL;
+	free(dcb->delayq);
+	dcb->delayq = NULL;
+	dcb->delayq_size = 0;
+	if (dcb->tls)
+	{
+		tls_session_free(dcb->tls);
+		dcb->tls = NULL;
 	}
+	dcb->tls_ctx = NULL;
 	if (dcb->dcb_readqueue)
         {
                 GWBUF* queue = dcb->dcb_readqueue;
                 while ((queue = gwbuf_consume(queue, GWBUF_LENGTH(queue))) != NULL);
+                dcb->dcb_readqueue = NULL;
         }
 
-	spinlock_acquire(&dcb->cb_lock);
-	while ((cb = dcb->callbacks) != NULL)
-	{
-		dcb->callbacks = cb->next;
-		free(cb);
-	}
-	spinlock_release(&dcb->cb_lock);
+	/*< The callback entries are kept as spares for the next user */
+	dcb_release_callbacks(dcb);
 
-	if (dcb->dcb_readqueue)
-        {
-                GWBUF* queue = dcb->dcb_readqueue;
-                while ((queue = gwbuf_consume(queue, GWBUF_LENGTH(queue))) != NULL);
-        }
-	bitmask_free(&dcb->memdata.bitmask);
-        simple_mutex_done(&dcb->dcb_read_lock);
-        simple_mutex_done(&dcb->dcb_write_lock);
-	free(dcb);
+	dcb_pool_release(dcb);
 }
 
 /**
- * Process the DCB zombie queue
- *
- * This routine is called by each of the polling threads with
- * the thread id of the polling thread. It must clear the bit in
- * the memdata bitmask for the polling thread that calls it. If the
- * operation of clearing this bit means that no bits are set in
- * the memdata.bitmask then the DCB is no longer able to be 
- * referenced and it can be finally removed.
+ * Register the calling thread as a polling thread. The thread announces the
+ * current epoch, so that no DCB it may see in its first poll can be freed
+ * before it has passed a quiescent point. A thread that called
+ * dcb_thread_done takes part again, it is marked active before it announces
+ * the epoch so that the epoch can not move on without it in between.
  *
  * @param	threadid	The thread ID of the caller
  */
-DCB*
-dcb_process_zombies(int threadid)
+void
+dcb_thread_init(int threadid)
 {
-DCB	*ptr, *lptr;
-DCB*    dcb_list = NULL;
-DCB*    dcb = NULL;
-bool    succp = false;
-
-	/*<
-	 * Perform a dirty read to see if there is anything in the queue.
-	 * This avoids threads hitting the queue spinlock when the queue 
-	 * is empty. This will really help when the only entry is being
-	 * freed, since the queue is updated before the expensive call to
-	 * dcb_final_free.
-	 */
-	if (!zombies)
-		return NULL;
+DCB_EPOCH_THREAD	*self;
 
-	spinlock_acquire(&zombiespin);
-	ptr = zombies;
-	lptr = NULL;
-	while (ptr)
-	{                    
-		bitmask_clear(&ptr->memdata.bitmask, threadid);
-		if (bitmask_isallclear(&ptr->memdata.bitmask))
-		{
-			/*<
-			 * Remove the DCB from the zombie queue
- 			 * and call the final free routine for the
-			 * DCB
-			 *
-			 * ptr is the DCB we are processing
-			 * lptr is the previous DCB on the zombie queue
-			 * or NULL if the DCB is at the head of the queue
-			 * tptr is the DCB after the one we are processing
-			 * on the zombie queue
-			 */
-			DCB	*tptr = ptr->memdata.next;
-			if (lptr == NULL)
-				zombies = tptr;
-			else
-				lptr->memdata.next = tptr;
-                        LOGIF(LD, (skygw_log_write_flush(
-                                LOGFILE_DEBUG,
-                                "%lu [dcb_process_zombies] Remove dcb %p fd %d "
-                                "in state %s from zombies list.",
-                                pthread_self(),
-                                ptr,
-                                ptr->fd,
-                                STRDCBSTATE(ptr->state)))); 
-                        ss_info_dassert(ptr->state == DCB_STATE_ZOMBIE,
-                                        "dcb not in DCB_STATE_ZOMBIE state.");
-                        /*<
-                         * Move dcb to linked list of victim dcbs.
-                         */
-                        if (dcb_list == NULL) {
-                                dcb_list = ptr;
-                                dcb = dcb_list;
-                        } else {
-                                dcb->memdata.next = ptr;
-                                dcb = dcb->memdata.next;
-                        }
-                        dcb->memdata.next = NULL;
-			ptr = tptr;
-		}
-		else
+	if ((self = thread_epoch) != NULL)
+	{
+		if (!self->active)
 		{
-			lptr = ptr;
-			ptr = ptr->memdata.next;
+			self->active = 1;
+			__sync_synchronize();
+			self->epoch = dcb_epoch;
 		}
+		return;
 	}
+	if ((self = (DCB_EPOCH_THREAD *)calloc(1, sizeof(DCB_EPOCH_THREAD))) == NULL)
+		return;
+	self->thread_id = threadid;
+	self->epoch = dcb_epoch;
+	self->active = 1;
+	spinlock_acquire(&zombiespin);
+	self->next = epochThreads;
+	__sync_synchronize();
+	epochThreads = self;
 	spinlock_release(&zombiespin);
+	thread_epoch = self;
+}
+
+/**
+ * Unregister the calling polling thread, it no longer holds back the
+ * advance of the epoch. Zombies it still owns are moved to the shared list.
+ */
+void
+dcb_thread_done()
+{
+DCB_EPOCH_THREAD	*self = thread_epoch;
+
+	if (self == NULL)
+		return;
+	self->active = 0;
+	if (self->head)
+	{
+		spinlock_acquire(&zombiespin);
+		if (zombies_tail)
+			zombies_tail->memdata.next = self->head;
+		else
+			zombies = self->head;
+		zombies_tail = self->tail;
+		spinlock_release(&zombiespin);
+		self->head = self->tail = NULL;
+	}
+}
+
+/**
+ * Close and free a list of zombie DCBs that can no longer be referenced
+ *
+ * @param dcb	The list of DCBs, linked through memdata.next
+ */
+static void
+dcb_free_zombies(DCB *dcb)
+{
+bool    succp = false;
 
-        dcb = dcb_list;
         /*< Close, and set DISCONNECTED victims */
         while (dcb != NULL) {
 		DCB* dcb_next = NULL;
                 int  rc = 0;
+
+                LOGIF(LD, (skygw_log_write_flush(
+                        LOGFILE_DEBUG,
+                        "%lu [dcb_process_zombies] Remove dcb %p fd %d "
+                        "in state %s from zombies list.",
+                        pthread_self(),
+                        dcb,
+                        dcb->fd,
+                        STRDCBSTATE(dcb->state)))); 
+                ss_info_dassert(dcb->state == DCB_STATE_ZOMBIE,
+                                "dcb not in DCB_STATE_ZOMBIE state.");
                 /*<
                  * Close file descriptor and move to clean-up phase.
                  */
                 rc = close(dcb->fd);
+		if (dcb->splice_pipe[0] >= 0)
+		{
+			close(dcb->splice_pipe[0]);
+			close(dcb->splice_pipe[1]);
+			dcb->splice_pipe[0] = dcb->splice_pipe[1] = -1;
+		}
 
                 if (rc < 0) {
                     int eno = errno;
@@ -511,9 +726,107 @@ bool    succp = false;
                 ss_dassert(succp);
 		dcb_next = dcb->memdata.next;
                 dcb_final_free(dcb);
+                atomic_add(&n_zombies, -1);
                 dcb = dcb_next;
         }
-        return zombies;
+}
+
+/**
+ * Process the DCB zombie queue
+ *
+ * This routine is called by each of the polling threads with
+ * the thread id of the polling thread at the end of the polling loop,
+ * where the thread holds no references to DCBs. The thread announces the
+ * global epoch, advances the global epoch if every active polling thread
+ * has announced it, and frees the zombies on its own list that were tagged
+ * two or more epochs ago. The zombie lists are in epoch order, so only the
+ * DCBs that are freed are visited.
+ *
+ * @param	threadid	The thread ID of the caller
+ * @return	The number of zombies still waiting to be freed
+ */
+int
+dcb_process_zombies(int threadid)
+{
+DCB_EPOCH_THREAD	*self = thread_epoch;
+DCB_EPOCH_THREAD	*ptr;
+unsigned long		epoch;
+DCB			*dcb_list = NULL;
+DCB			*dcb;
+
+	if (self == NULL)
+	{
+		dcb_thread_init(threadid);
+		if ((self = thread_epoch) == NULL)
+			return n_zombies;
+	}
+
+	/*<
+	 * Perform a dirty read to see if there is anything to do, this avoids
+	 * all the shared cache lines when there are no zombies at all.
+	 */
+	epoch = dcb_epoch;
+	self->epoch = epoch;
+	if (n_zombies == 0)
+		return 0;
+	__sync_synchronize();
+
+	for (ptr = epochThreads; ptr; ptr = ptr->next)
+	{
+		if (ptr->active && ptr->epoch != epoch)
+			break;
+	}
+	if (ptr == NULL &&
+		__sync_bool_compare_and_swap(&dcb_epoch, epoch, epoch + 1))
+	{
+		epoch++;
+		self->epoch = epoch;
+	}
+
+	/*<
+	 * Detach the zombies that are at least two epochs old. A zombie with
+	 * writes in the mailbox of its owner waits for them, the mail holds a
+	 * reference that the epochs do not see.
+	 */
+	if (self->head && self->head->memdata.epoch + 2 <= epoch &&
+		self->head->mail_pending == 0)
+	{
+		dcb_list = self->head;
+		dcb = dcb_list;
+		while (dcb->memdata.next &&
+			dcb->memdata.next->memdata.epoch + 2 <= epoch &&
+			dcb->memdata.next->mail_pending == 0)
+			dcb = dcb->memdata.next;
+		self->head = dcb->memdata.next;
+		if (self->head == NULL)
+			self->tail = NULL;
+		dcb->memdata.next = NULL;
+		dcb_free_zombies(dcb_list);
+	}
+
+	/*< The shared list of zombies from threads that do not poll */
+	if (zombies && zombies->memdata.epoch + 2 <= epoch &&
+		spinlock_acquire_nowait(&zombiespin))
+	{
+		dcb_list = NULL;
+		if (zombies && zombies->memdata.epoch + 2 <= epoch &&
+			zombies->mail_pending == 0)
+		{
+			dcb_list = zombies;
+			dcb = dcb_list;
+			while (dcb->memdata.next &&
+				dcb->memdata.next->memdata.epoch + 2 <= epoch &&
+				dcb->memdata.next->mail_pending == 0)
+				dcb = dcb->memdata.next;
+			zombies = dcb->memdata.next;
+			if (zombies == NULL)
+				zombies_tail = NULL;
+			dcb->memdata.next = NULL;
+		}
+		spinlock_release(&zombiespin);
+		dcb_free_zombies(dcb_list);
+	}
+        return n_zombies;
 }
 
 /**
@@ -536,6 +849,23 @@ GWPROTOCOL	*funcs;
 int             fd;
 int             rc;
 
+	if (server->persistpoolmax > 0 &&
+		(dcb = dcb_connect_persistent(server, session, protocol)) != NULL)
+	{
+		return dcb;
+	}
+	if (SERVER_IS_FULL(server))
+	{
+		LOGIF(LD, (skygw_log_write(
+			LOGFILE_DEBUG,
+			"%lu [dcb_connect] Server %s:%d has reached its limit "
+			"of %d connections.",
+			pthread_self(),
+			server->name,
+			server->port,
+			server->max_connections)));
+		return NULL;
+	}
 	if ((dcb = dcb_alloc(DCB_ROLE_REQUEST_HANDLER)) == NULL)
 	{
 		return NULL;
@@ -602,6 +932,7 @@ int             rc;
          * Successfully connected to backend. Assign file descriptor to dcb
          */
         dcb->fd = fd;
+        dcb->server = server;
         /** Copy status field to DCB */
         dcb->dcb_server_status = server->status;
         ss_debug(dcb->dcb_port = server->port;)
@@ -626,88 +957,168 @@ int             rc;
 	/*<
 	 * The dcb will be addded into poll set by dcb->func.connect
 	 */
-	atomic_add(&server->stats.n_connections, 1);
+	ts_stats_add(server->stats.counters, SERVER_N_CONNECTIONS, 1);
 	atomic_add(&server->stats.n_current, 1);
+
+	if (config_backend_connect_timeout() > 0)
+		dcb_set_connect_timeout(dcb, config_backend_connect_timeout());
         
 	return dcb;
 }
 
 
 /**
- * General purpose read routine to read data from a socket in the
- * Descriptor Control Block and append it to a linked list of buffers.
- * The list may be empty, in which case *head == NULL
+ * Take an idle connection to the server from its persistent pool and make
+ * it ready for the session. The protocol re-authenticates the connection
+ * as the user of the session, which also resets the state left behind by
+ * the session that used it before.
  *
- * @param dcb	The DCB to read from
- * @param head	Pointer to linked list to append data to
- * @return	-1 on error, otherwise the number of read bytes on the last 
- * iteration of while loop. 0 is returned if no data available.
+ * @param server	The server to connect to
+ * @param session	The session the connection is for
+ * @param protocol	The protocol module name
+ * @return		The DCB or NULL if no pooled connection could be used
  */
-int dcb_read(
-        DCB   *dcb, 
-        GWBUF **head)
+static DCB *
+dcb_connect_persistent(SERVER *server, SESSION *session, const char *protocol)
 {
-        GWBUF *buffer = NULL;
-        int   b;
-        int   rc;
-        int   n ;
-        int   nread = 0;
-        int   eno = 0;
-        
-        CHK_DCB(dcb);
-        while (true)
-        {
-                int bufsize;
-                
-                rc = ioctl(dcb->fd, FIONREAD, &b);
-                
-                if (rc == -1) 
-                {
-                        eno = errno;
-                        errno = 0;
-                        LOGIF(LE, (skygw_log_write_flush(
-                                LOGFILE_ERROR,
-                                "Error : ioctl FIONREAD for dcb %p in "
-                                "state %s fd %d failed due error %d, %s.",
-                                dcb,
-                                STRDCBSTATE(dcb->state),
-                                dcb->fd,
-                                eno,
-                                strerror(eno))));
-                        n = -1;
-                        goto return_n;
-                }
+DCB		*dcb;
+GWPROTOCOL	*funcs;
 
-                if (b == 0 && nread == 0)
-                {                        
-                        /** Handle closed client socket */
-                        if (dcb_isclient(dcb)) 
-                        {
-                                char c;
-                                int l_errno = 0;
-                                int r = -1;
-                                
-                                /* try to read 1 byte, without consuming the socket buffer */
-                                r = recv(dcb->fd, &c, sizeof(char), MSG_PEEK);
-                                l_errno = errno;
-                                
-                                if (r <= 0 && 
-                                        l_errno != EAGAIN && 
-                                        l_errno != EWOULDBLOCK) 
-                                {
-                                        n = -1;
-                                        goto return_n;
-                                }
-                        }
-                        n = 0;
-                        goto return_n;
-                }
-                else if (b == 0)
+	if ((funcs = (GWPROTOCOL *)load_module(protocol,
+					       MODULE_PROTOCOL)) == NULL ||
+		funcs->reuse == NULL)
+	{
+		return NULL;
+	}
+	while ((dcb = server_get_persistent(server, funcs,
+					    poll_owner_thread())) != NULL)
+	{
+		dcb_set_idle_timeout(dcb, 0);
+
+		if (!session_link_dcb(session, dcb))
+		{
+			dcb_close(dcb);
+			return NULL;
+		}
+		if (dcb->func.reuse(dcb, session) == 1)
+		{
+			dcb->dcb_server_status = server->status;
+			ts_stats_add(server->stats.counters, SERVER_N_PERSISTENT, 1);
+			atomic_add(&server->stats.n_current, 1);
+			LOGIF(LD, (skygw_log_write(
+				LOGFILE_DEBUG,
+				"%lu [dcb_connect] Reused pooled connection to "
+				"server %s:%d, backend dcb %p fd %d.",
+				pthread_self(),
+				server->name,
+				server->port,
+				dcb,
+				dcb->fd)));
+			return dcb;
+		}
+		/*< The connection is no longer usable, try the next one */
+		dcb_close(dcb);
+	}
+	return NULL;
+}
+
+/**
+ * Keep an idle backend DCB in the persistent pool of its server instead of
+ * closing it. The DCB is detached from its session, the callbacks of the
+ * session are dropped and the DCB is closed if it stays in the pool for
+ * longer than the persistmaxtime of the server.
+ *
+ * The caller must know that no reply is pending on the DCB, the protocol
+ * only checks its own state. If the DCB can not be pooled the caller still
+ * owns it and closes it with dcb_close.
+ *
+ * @param dcb	The backend DCB
+ * @return	1 if the DCB was pooled, 0 otherwise
+ */
+int
+dcb_park(DCB *dcb)
+{
+SERVER		*server = dcb->server;
+SESSION		*session = dcb->session;
+
+	CHK_DCB(dcb);
+
+	if (server == NULL || server->persistpoolmax <= 0 ||
+		!SERVER_IS_RUNNING(server) ||
+		server->n_persistent >= server->persistpoolmax ||
+		session == NULL ||
+		dcb->state != DCB_STATE_POLLING ||
+		dcb->writeq != NULL ||
+		dcb->delayq_count != 0 ||
+		dcb->dcb_readqueue != NULL ||
+		dcb->splice_pipe[0] >= 0 ||
+		dcb->func.reuse == NULL ||
+		dcb->func.reuse(dcb, NULL) != 1)
+	{
+		return 0;
+	}
+	dcb_read_unpause(dcb);
+	dcb_release_callbacks(dcb);
+
+	dcb->session = NULL;
+	session_free(session);
+
+	if (!server_add_persistent(server, dcb))
+	{
+		return 0;
+	}
+	dcb_set_idle_timeout(dcb, server->persistmaxtime);
+	LOGIF(LD, (skygw_log_write(
+		LOGFILE_DEBUG,
+		"%lu [dcb_park] Pooled connection to server %s:%d, "
+		"backend dcb %p fd %d.",
+		pthread_self(),
+		server->name,
+		server->port,
+		dcb,
+		dcb->fd)));
+	return 1;
+}
+
+/**
+ * Read data from the socket of the Descriptor Control Block and append it
+ * to a linked list of buffers. The list may be empty, in which case
+ * *head == NULL
+ *
+ * The data is read directly into buffers from the slab cache. The size of
+ * the buffers adapts to the recent reads of the DCB: a read that fills its
+ * buffer doubles the size used for the next one, a read that uses less than
+ * a quarter of it halves the size. Reading stops at the first short read or
+ * when the socket returns EAGAIN. A short read means the socket receive
+ * queue was empty at the time of the read and any data arriving after it
+ * generates a new edge triggered event, so the socket is still drained
+ * correctly without an extra system call.
+ *
+ * @param dcb	The DCB to read from
+ * @param head	Pointer to linked list to append data to
+ * @return	-1 on error, otherwise the number of read bytes on the last 
+ * iteration of while loop. 0 is returned if no data available.
+ */
+static int
+dcb_read_socket(
+        DCB   *dcb, 
+        GWBUF **head)
+{
+        GWBUF *buffer = NULL;
+        int   n = 0;
+        int   nread = 0;
+        int   eno = 0;
+        
+        CHK_DCB(dcb);
+        while (true)
+        {
+                int bufsize;
+
+                if (dcb->read_size < DCB_READ_SIZE_MIN)
                 {
-                        n = 0;
-                        goto return_n;
+                        dcb->read_size = DCB_READ_SIZE_MIN;
                 }
-                bufsize = MIN(b, MAX_BUFFER_SIZE);
+                bufsize = dcb->read_size;
                 
                 if ((buffer = gwbuf_alloc(bufsize)) == NULL)
                 {
@@ -733,10 +1144,16 @@ int dcb_read(
                 
                 if (n <= 0)
                 {
-                        int eno = errno;
+                        eno = errno;
                         errno = 0;
-                        
-                        if (eno != 0 && eno != EAGAIN && eno != EWOULDBLOCK) 
+                        gwbuf_free(buffer);
+
+                        if (n < 0 && (eno == EAGAIN || eno == EWOULDBLOCK))
+                        {
+                                /*< Socket drained */
+                                n = 0;
+                        }
+                        else if (n < 0)
                         {
                                 LOGIF(LE, (skygw_log_write_flush(
                                         LOGFILE_ERROR,
@@ -748,10 +1165,15 @@ int dcb_read(
                                         eno,
                                         strerror(eno))));
                         }
-                        gwbuf_free(buffer);
+                        else if (nread == 0 && dcb_isclient(dcb))
+                        {
+                                /** Client closed the socket */
+                                n = -1;
+                        }
                         goto return_n;
                 }
                 nread += n;
+                dcb->last_activity = timer_now();
                 
                 LOGIF(LD, (skygw_log_write(
                         LOGFILE_DEBUG,
@@ -762,15 +1184,117 @@ int dcb_read(
                         dcb,
                         STRDCBSTATE(dcb->state),
                         dcb->fd)));
+
+                /*< Adapt the size of the next read buffer */
+                if (n == bufsize && bufsize < MAX_BUFFER_SIZE)
+                {
+                        dcb->read_size = bufsize * 2;
+                }
+                else if (n < bufsize / 4 && bufsize > DCB_READ_SIZE_MIN)
+                {
+                        dcb->read_size = bufsize / 2;
+                }
+
+                if (n < bufsize)
+                {
+                        /*< Trim the unused tail and stop, the socket is empty */
+                        GWBUF_RTRIM(buffer, bufsize - n);
+                        *head = gwbuf_append(*head, buffer);
+                        n = 0;
+                        goto return_n;
+                }
                 /*< Append read data to the gwbuf */
                 *head = gwbuf_append(*head, buffer);
         } /*< while (true) */
 return_n:
+        TRACEPOINT4(dcb__read, dcb, dcb->session, nread, n);
         return n;
 }
 
 /**
- * General purpose routine to write to a DCB
+ * General purpose read routine to read data from a DCB and append it to a
+ * linked list of buffers. The data of a TLS connection is decrypted, the
+ * records the TLS session makes in response are written to the socket. A
+ * read during the handshake may therefore append no data.
+ *
+ * @param dcb	The DCB to read from
+ * @param head	Pointer to linked list to append data to
+ * @return	-1 on error, otherwise as dcb_read_socket
+ */
+int
+dcb_read(DCB *dcb, GWBUF **head)
+{
+GWBUF	*raw = NULL;
+int	n, rc, pending, locked;
+
+	CHK_DCB(dcb);
+	if (dcb->tls == NULL)
+		return dcb_read_socket(dcb, head);
+
+	n = dcb_read_socket(dcb, &raw);
+	if (raw != NULL)
+	{
+		locked = dcb_writeq_lock(dcb);
+		rc = tls_session_read(dcb->tls, raw, head);
+		pending = tls_session_pending(dcb->tls);
+		dcb_writeq_unlock(dcb, locked);
+		if (pending > 0)
+			dcb_write(dcb, NULL);
+		if (rc < 0)
+			n = -1;
+	}
+	return n;
+}
+
+/**
+ * Take the write queue lock of a DCB, unless the calling thread is the
+ * polling thread that owns the write queue, see poll_writeq_owner
+ *
+ * @param dcb	The DCB
+ * @return	Non-zero if the lock was taken
+ */
+static int
+dcb_writeq_lock(DCB *dcb)
+{
+	if (poll_writeq_owner(dcb) == 1)
+		return 0;
+	spinlock_acquire(&dcb->writeqlock);
+	return 1;
+}
+
+/**
+ * Release the write queue lock of a DCB if dcb_writeq_lock took it
+ *
+ * @param dcb		The DCB
+ * @param locked	The return of dcb_writeq_lock
+ */
+static void
+dcb_writeq_unlock(DCB *dcb, int locked)
+{
+	if (locked)
+		spinlock_release(&dcb->writeqlock);
+}
+
+/**
+ * Add to the length of the write queue of a DCB, the bytes are accounted
+ * to the session of the DCB too
+ *
+ * @param dcb	The DCB
+ * @param bytes	The bytes queued, negative when they are written
+ */
+static void
+dcb_writeq_add(DCB *dcb, int bytes)
+{
+	atomic_add(&dcb->writeqlen, bytes);
+	session_mem_add(dcb->session, bytes);
+}
+
+/**
+ * General purpose routine to write to a DCB. The data written to a TLS
+ * connection is encrypted, the queue may then be NULL to only write the
+ * records the TLS session has made. The writes to a polling DCB of another
+ * polling thread are posted to that thread when the threads have epoll
+ * sets of their own.
  *
  * @param dcb	The DCB of the client
  * @param queue	Queue of buffers to write
@@ -781,9 +1305,10 @@ dcb_write(DCB *dcb, GWBUF *queue)
 int	w;
 int	saved_errno = 0;
 int	below_water;
+int	owner, locked;
 
 	below_water = (dcb->high_water && dcb->writeqlen < dcb->high_water) ? 1 : 0;
-        ss_dassert(queue != NULL);
+        ss_dassert(queue != NULL || dcb->tls != NULL);
 
         /**
          * SESSION_STATE_STOPPING means that one of the backends is closing 
@@ -793,7 +1318,7 @@ int	below_water;
          * before router's closeSession is called and that tells that DCB may 
          * still be writable.
          */
-        if (queue == NULL ||
+        if ((queue == NULL && dcb->tls == NULL) ||
             (dcb->state != DCB_STATE_ALLOC &&
              dcb->state != DCB_STATE_POLLING &&
              dcb->state != DCB_STATE_LISTENING &&
@@ -812,10 +1337,77 @@ int	below_water;
                 ss_dassert(false);
                 return 0;
         }
-                
-        spinlock_acquire(&dcb->writeqlock);
 
-	if (dcb->writeq != NULL)
+        if (queue != NULL && dcb->session != NULL &&
+            dcb->session->service->mem_hard_limit &&
+            session_mem_exceeded(dcb->session, gwbuf_length(queue)))
+        {
+                /*< The session is being closed for its memory */
+                while (queue != NULL)
+                        queue = gwbuf_consume(queue, GWBUF_LENGTH(queue));
+                return 0;
+        }
+
+        if (queue != NULL && dcb->writeq != NULL &&
+            dcb_writeq_exceeded(dcb, gwbuf_length(queue)))
+        {
+                /*< The client does not read, its session is being closed */
+                while (queue != NULL)
+                        queue = gwbuf_consume(queue, GWBUF_LENGTH(queue));
+                return 0;
+        }
+
+        if ((owner = poll_writeq_owner(dcb)) == 0 &&
+            dcb->state == DCB_STATE_POLLING)
+        {
+                return poll_post_write(dcb, queue);
+        }
+        if (owner == 1 && dcb->mail_pending > 0)
+        {
+                /*< The writes posted earlier go first */
+                poll_read_own_mail();
+        }
+        locked = (owner != 1);
+        if (locked)
+                spinlock_acquire(&dcb->writeqlock);
+
+	/*<
+	 * The records of a TLS connection are made under the lock, so that
+	 * they are written in the order the session numbers them. Records
+	 * the session has made while reading go first.
+	 */
+	if (dcb->tls != NULL)
+	{
+		if (tls_session_write(dcb->tls, &queue) != 0)
+		{
+			dcb_writeq_unlock(dcb, locked);
+			return 0;
+		}
+		if (queue == NULL)
+		{
+			dcb_writeq_unlock(dcb, locked);
+			return 1;
+		}
+	}
+
+	if (writes_corked && (dcb->flags & DCBF_COALESCE) &&
+		dcb->state == DCB_STATE_POLLING && queue != NULL)
+	{
+		/*<
+		 * Hold the data until the event is done, the replies of the
+		 * event then go out in one write.
+		 */
+		dcb_writeq_add(dcb, gwbuf_length(queue));
+		dcb->writeq = gwbuf_append(dcb->writeq, queue);
+		dcb->stats.n_buffered++;
+		if (!dcb->corked)
+		{
+			dcb->corked = 1;
+			dcb->corked_next = corked_dcbs;
+			corked_dcbs = dcb;
+		}
+	}
+	else if (dcb->writeq != NULL)
 	{
 		/*
 		 * We have some queued data, so add our data to
@@ -831,7 +1423,7 @@ int	below_water;
                         int qlen;
                         
                         qlen = gwbuf_length(queue);
-                        atomic_add(&dcb->writeqlen, qlen);
+                        dcb_writeq_add(dcb, qlen);
                         dcb->writeq = gwbuf_append(dcb->writeq, queue);
                         dcb->stats.n_buffered++;
                         LOGIF(LD, (skygw_log_write(
@@ -855,7 +1447,6 @@ int	below_water;
 		 */
 		while (queue != NULL)
 		{
-                        int qlen;
 #if defined(SS_DEBUG)
                         if (dcb->dcb_role == DCB_ROLE_REQUEST_HANDLER &&
                             dcb->session != NULL)
@@ -873,13 +1464,8 @@ int	below_water;
                                 }
                         }
 #endif /* SS_DEBUG */
-			qlen = GWBUF_LENGTH(queue);
 			GW_NOINTR_CALL(
-                                w = gw_write(
-#if defined(SS_DEBUG)
-                                        dcb,
-#endif
-                                        dcb->fd, GWBUF_DATA(queue), qlen);
+                                w = dcb_write_chain(dcb, &queue);
                                 dcb->stats.n_writes++;
                                 );
                         
@@ -926,11 +1512,6 @@ int	below_water;
                                 }
 				break;
 			}
-			/*
-			 * Pull the number of bytes we have written from
-			 * queue with have.
-			 */
-			queue = gwbuf_consume(queue, w);
                         LOGIF(LD, (skygw_log_write(
                                 LOGFILE_DEBUG,
                                 "%lu [dcb_write] Wrote %d Bytes to dcb %p in "
@@ -952,7 +1533,7 @@ int	below_water;
                         int qlen;
                         
 			qlen = gwbuf_length(queue);
-                        atomic_add(&dcb->writeqlen, qlen);
+                        dcb_writeq_add(dcb, qlen);
                         dcb->stats.n_buffered++;
                 }
 	} /* if (dcb->writeq) */
@@ -985,10 +1566,13 @@ int	below_water;
                                 saved_errno,
                                 strerror(saved_errno))));
                 }
-		spinlock_release(&dcb->writeqlock);
+		dcb_writeq_unlock(dcb, locked);
 		return 0;
 	}
-	spinlock_release(&dcb->writeqlock);
+	dcb_writeq_unlock(dcb, locked);
+
+	if (dcb->writeq != NULL)
+		dcb_write_watch(dcb);
 
 	if (dcb->high_water && dcb->writeqlen > dcb->high_water && below_water)
 	{
@@ -999,6 +1583,41 @@ int	below_water;
 	return 1;
 }
 
+/**
+ * Start holding the writes to the DCBs that coalesce their writes, called by
+ * a polling thread before it processes an event.
+ */
+void
+dcb_cork_writes()
+{
+	writes_corked = 1;
+}
+
+/**
+ * Send the writes held since dcb_cork_writes, called by a polling thread
+ * once it has processed an event. The DCBs cannot be freed before the
+ * thread looks at the zombies, the closed ones have already been sent
+ * by dcb_close.
+ */
+void
+dcb_flush_writes()
+{
+DCB	*dcb;
+int	locked;
+
+	writes_corked = 0;
+	while ((dcb = corked_dcbs) != NULL)
+	{
+		corked_dcbs = dcb->corked_next;
+		locked = dcb_writeq_lock(dcb);
+		dcb->corked = 0;
+		dcb->corked_next = NULL;
+		dcb_writeq_unlock(dcb, locked);
+		if (dcb->state == DCB_STATE_POLLING)
+			dcb_drain_writeq(dcb);
+	}
+}
+
 /**
  * Drain the write queue of a DCB. This is called as part of the EPOLLOUT handling
  * of a socket and will try to send any buffered data from the write queue
@@ -1014,14 +1633,14 @@ int	n = 0;
 int	w;
 int	saved_errno = 0;
 int	above_water;
+int	locked;
 
 	above_water = (dcb->low_water && dcb->writeqlen > dcb->low_water) ? 1 : 0;
 
-	spinlock_acquire(&dcb->writeqlock);
+	locked = dcb_writeq_lock(dcb);
 
         if (dcb->writeq)
 	{
-		int	len;
 		/*
 		 * Loop over the buffer chain in the pending writeq
 		 * Send as much of the data in that chain as possible and
@@ -1029,14 +1648,7 @@ int	above_water;
 		 */
 		while (dcb->writeq != NULL)
 		{
-			len = GWBUF_LENGTH(dcb->writeq);
-			GW_NOINTR_CALL(w = gw_write(
-#if defined(SS_DEBUG)
-                               dcb,
-#endif
-                               dcb->fd,
-                               GWBUF_DATA(dcb->writeq),
-                               len););
+			GW_NOINTR_CALL(w = dcb_write_chain(dcb, &dcb->writeq););
 			saved_errno = errno;
                         errno = 0;
                         
@@ -1064,11 +1676,6 @@ int	above_water;
                                         strerror(saved_errno))));
                                 break;
 			}
-			/*
-			 * Pull the number of bytes we have written from
-			 * queue with have.
-			 */
-			dcb->writeq = gwbuf_consume(dcb->writeq, w);
                         LOGIF(LD, (skygw_log_write(
                                 LOGFILE_DEBUG,
                                 "%lu [dcb_drain_writeq] Wrote %d Bytes to dcb %p "
@@ -1081,12 +1688,14 @@ int	above_water;
 			n += w;
 		}
 	}
-	spinlock_release(&dcb->writeqlock);
-	atomic_add(&dcb->writeqlen, -n);
+	dcb_writeq_unlock(dcb, locked);
+	dcb_writeq_add(dcb, -n);
 	
         /* The write queue has drained, potentially need to call a callback function */
 	if (dcb->writeq == NULL)
 		dcb_call_callback(dcb, DCB_REASON_DRAINED);
+	else
+		dcb_write_watch(dcb);
 
         if (above_water && dcb->writeqlen < dcb->low_water)
 	{
@@ -1097,6 +1706,485 @@ int	above_water;
 	return n;
 }
 
+/**
+ * Check if the write queue of a DCB can take no more data for now: it is
+ * above the high water mark, or above the low water mark while its session
+ * is above the soft memory limit of the service
+ *
+ * @param peer	The DCB
+ * @return	Non-zero if the reads for the DCB are to be paused
+ */
+static int
+dcb_peer_full(DCB *peer)
+{
+	if (DCB_ABOVE_HIGH_WATER(peer))
+		return 1;
+	return peer->low_water && peer->writeqlen > (int)peer->low_water &&
+		session_mem_above_soft(peer->session);
+}
+
+/**
+ * Pause the read of a DCB while the write queue of its peer is above the
+ * high water mark of the peer, or above its low water mark while the
+ * session is above its soft memory limit. The data that is not read stays
+ * in the socket of the DCB, so the sender of the data is held back by TCP
+ * rather than the data being queued in memory for the peer. The read is
+ * resumed by dcb_read_resume once the write queue of the peer is back to
+ * its low water mark.
+ *
+ * @param dcb	The DCB that is about to be read
+ * @param peer	The DCB the data read is written to
+ * @return	1 if the read is paused and must not be done, 0 otherwise
+ */
+int
+dcb_read_throttle(DCB *dcb, DCB *peer)
+{
+	CHK_DCB(dcb);
+	CHK_DCB(peer);
+	if (!dcb_peer_full(peer) || peer->state != DCB_STATE_POLLING)
+		return 0;
+	return dcb_read_wait(dcb, peer, 1);
+}
+
+/**
+ * Pause the reads of a DCB until a peer that can take no more data for
+ * now resumes them with dcb_read_resume. The read events of a paused DCB
+ * are not passed to its protocol, the data stays in the socket.
+ *
+ * @param dcb	The DCB whose reads are paused
+ * @param peer	The DCB that resumes the reads
+ * @return	1 if the reads are paused
+ */
+int
+dcb_read_pause(DCB *dcb, DCB *peer)
+{
+	CHK_DCB(dcb);
+	CHK_DCB(peer);
+	return dcb_read_wait(dcb, peer, 0);
+}
+
+/**
+ * Add a DCB to the DCBs whose reads wait for a peer
+ *
+ * @param dcb	The DCB whose reads are paused
+ * @param peer	The DCB that resumes the reads
+ * @param water	Pause only if the write queue of the peer can take no
+ *		more, see dcb_peer_full
+ * @return	1 if the reads of the DCB wait for the peer
+ */
+static int
+dcb_read_wait(DCB *dcb, DCB *peer, int water)
+{
+int	paused = 0;
+
+	spinlock_acquire(&peer->writeqlock);
+	if ((!water || dcb_peer_full(peer)) && dcb->paused_by == NULL)
+	{
+		dcb->paused_by = peer;
+		dcb->paused_next = peer->paused;
+		peer->paused = dcb;
+		paused = 1;
+	}
+	else if (dcb->paused_by == peer)
+	{
+		paused = 1;
+	}
+	spinlock_release(&peer->writeqlock);
+
+	if (paused)
+	{
+		atomic_add(&dcb->stats.n_read_paused, 1);
+		LOGIF(LD, (skygw_log_write(
+			LOGFILE_DEBUG,
+			"%lu [dcb_read_wait] Read of dcb %p fd %d paused, "
+			"%d bytes queued for dcb %p fd %d.",
+			pthread_self(),
+			dcb,
+			dcb->fd,
+			peer->writeqlen,
+			peer,
+			peer->fd)));
+	}
+	return paused;
+}
+
+/**
+ * Resume the reads that were paused for the write queue of a DCB if the
+ * queue has drained to the low water mark. The reads are done by the read
+ * routine of the protocol of each paused DCB, under the read lock of that
+ * DCB as it may be read by its own polling thread at the same time. The
+ * reads still paused when a resumed read fills the queue again wait for the
+ * next write event, which follows as the queue is not empty. Called
+ * from the write event of the DCB, without its write lock held.
+ *
+ * @param dcb	The DCB whose write queue has been written
+ */
+void
+dcb_read_resume(DCB *dcb)
+{
+DCB	*paused;
+
+	CHK_DCB(dcb);
+	while (dcb->paused != NULL)
+	{
+		/*< A resumed read may fill the write queue again */
+		spinlock_acquire(&dcb->writeqlock);
+		if (dcb->writeqlen > (int)dcb->low_water ||
+			(paused = dcb->paused) == NULL)
+		{
+			spinlock_release(&dcb->writeqlock);
+			break;
+		}
+		dcb->paused = paused->paused_next;
+		paused->paused_by = NULL;
+		paused->paused_next = NULL;
+		spinlock_release(&dcb->writeqlock);
+
+		simple_mutex_lock(&paused->dcb_read_lock, true);
+		paused->dcb_read_active = TRUE;
+		if (paused->state == DCB_STATE_POLLING &&
+			paused->paused_by == NULL && paused->func.read != NULL)
+		{
+			LOGIF(LD, (skygw_log_write(
+				LOGFILE_DEBUG,
+				"%lu [dcb_read_resume] Read of dcb %p fd %d "
+				"resumed by dcb %p fd %d.",
+				pthread_self(),
+				paused,
+				paused->fd,
+				dcb,
+				dcb->fd)));
+			paused->func.read(paused);
+		}
+		paused->dcb_read_active = FALSE;
+		simple_mutex_unlock(&paused->dcb_read_lock);
+	}
+}
+
+/**
+ * Remove a DCB that is closed or pooled from the reads paused for a peer
+ * and release the reads that are paused for the DCB itself. A released
+ * DCB may outlive the DCB, a backend that failed is replaced while the
+ * client stays, so the events of the released DCB are raised again and
+ * the data that arrived while it was paused is read by its own thread.
+ *
+ * @param dcb	The DCB
+ */
+static void
+dcb_read_unpause(DCB *dcb)
+{
+DCB	*peer, **ptr, *next, *released;
+
+	if ((peer = dcb->paused_by) != NULL)
+	{
+		spinlock_acquire(&peer->writeqlock);
+		for (ptr = &peer->paused; *ptr; ptr = &(*ptr)->paused_next)
+		{
+			if (*ptr == dcb)
+			{
+				*ptr = dcb->paused_next;
+				break;
+			}
+		}
+		dcb->paused_by = NULL;
+		dcb->paused_next = NULL;
+		spinlock_release(&peer->writeqlock);
+	}
+	if (dcb->paused != NULL)
+	{
+		spinlock_acquire(&dcb->writeqlock);
+		released = dcb->paused;
+		dcb->paused = NULL;
+		spinlock_release(&dcb->writeqlock);
+		while ((next = released) != NULL)
+		{
+			released = next->paused_next;
+			next->paused_by = NULL;
+			next->paused_next = NULL;
+			if (next->state == DCB_STATE_POLLING)
+				poll_rearm_dcb(next);
+		}
+	}
+}
+
+/**
+ * Add a request to the delay queue of a DCB. The queue is a ring with room
+ * for the backend_pending_requests of the configuration, the ring is
+ * allocated when the first request is delayed. The caller holds the lock
+ * that orders the delayed requests with the ones written directly.
+ *
+ * @param dcb		The DCB
+ * @param buffer	The request
+ * @param command	The protocol command of the request
+ * @param tracked	Non-zero if the reply to the request is tracked
+ * @return		The number of requests the queue has room for after
+ *			this one, -1 if the request could not be queued
+ */
+int
+dcb_delayq_add(DCB *dcb, GWBUF *buffer, int command, int tracked)
+{
+DCB_PENDING	*entry;
+int		room;
+
+	CHK_DCB(dcb);
+	spinlock_acquire(&dcb->delayqlock);
+	if (dcb->delayq == NULL)
+	{
+		int	size = config_backend_pending_requests();
+
+		if (size < 1)
+			size = 1;
+		if ((dcb->delayq = calloc(size, sizeof(DCB_PENDING))) == NULL)
+		{
+			spinlock_release(&dcb->delayqlock);
+			return -1;
+		}
+		dcb->delayq_size = size;
+		dcb->delayq_first = 0;
+		dcb->delayq_count = 0;
+	}
+	if (dcb->delayq_count == dcb->delayq_size)
+	{
+		spinlock_release(&dcb->delayqlock);
+		return -1;
+	}
+	entry = &dcb->delayq[(dcb->delayq_first + dcb->delayq_count)
+					% dcb->delayq_size];
+	entry->buffer = buffer;
+	entry->command = command;
+	entry->tracked = tracked;
+	dcb->delayq_count++;
+	room = dcb->delayq_size - dcb->delayq_count;
+	spinlock_release(&dcb->delayqlock);
+	session_mem_add(dcb->session, gwbuf_length(buffer));
+	return room;
+}
+
+/**
+ * Take the oldest request from the delay queue of a DCB
+ *
+ * @param dcb		The DCB
+ * @param pending	Filled with the request, its command and tracking
+ * @return		1 if a request was taken, 0 if the queue is empty
+ */
+int
+dcb_delayq_take(DCB *dcb, DCB_PENDING *pending)
+{
+int	taken = 0;
+
+	CHK_DCB(dcb);
+	spinlock_acquire(&dcb->delayqlock);
+	if (dcb->delayq_count > 0)
+	{
+		*pending = dcb->delayq[dcb->delayq_first];
+		dcb->delayq[dcb->delayq_first].buffer = NULL;
+		dcb->delayq_first = (dcb->delayq_first + 1) % dcb->delayq_size;
+		dcb->delayq_count--;
+		taken = 1;
+	}
+	spinlock_release(&dcb->delayqlock);
+	if (taken)
+		session_mem_add(dcb->session, -gwbuf_length(pending->buffer));
+	return taken;
+}
+
+/**
+ * Discard the requests in the delay queue of a DCB, the ring is kept
+ *
+ * @param dcb	The DCB
+ */
+void
+dcb_delayq_free(DCB *dcb)
+{
+DCB_PENDING	pending;
+
+	while (dcb_delayq_take(dcb, &pending))
+	{
+		GWBUF	*queue = pending.buffer;
+
+		while (queue != NULL)
+			queue = gwbuf_consume(queue, GWBUF_LENGTH(queue));
+	}
+}
+
+/**
+ * Switch a client DCB to TLS, the reads and writes of the DCB go through
+ * a TLS session from then on. The session is started on the data that
+ * was read after the request to switch, the ClientHello may have arrived
+ * with the request and no read event would follow for it.
+ *
+ * @param dcb	The client DCB, accepted by a listener with a TLS context
+ * @param raw	The data read after the request or NULL, consumed
+ * @return	0 on success or -1 on error
+ */
+int
+dcb_tls_accept(DCB *dcb, GWBUF *raw)
+{
+GWBUF	*plain = NULL;
+int	rc = 0, locked;
+
+	CHK_DCB(dcb);
+	if (dcb->tls_ctx == NULL || dcb->tls != NULL ||
+		(dcb->tls = tls_session_alloc(dcb->tls_ctx,
+						dcb->owner_thread)) == NULL)
+	{
+		while (raw != NULL)
+			raw = gwbuf_consume(raw, GWBUF_LENGTH(raw));
+		return -1;
+	}
+	if (raw == NULL)
+		return 0;
+
+	locked = dcb_writeq_lock(dcb);
+	rc = tls_session_read(dcb->tls, raw, &plain);
+	dcb_writeq_unlock(dcb, locked);
+	/*< The client sends no data before the handshake has completed */
+	if (plain != NULL)
+	{
+		while (plain != NULL)
+			plain = gwbuf_consume(plain, GWBUF_LENGTH(plain));
+		rc = -1;
+	}
+	if (rc < 0 || dcb_write(dcb, NULL) == 0)
+		return -1;
+	return 0;
+}
+
+/**
+ * Forward the data of two DCBs to each other with splice, through a pipe
+ * of each DCB, so that the data is not copied to and from buffers. Once
+ * spliced the data read from the DCBs is no longer seen by their protocols,
+ * the caller must only splice connections whose bytes it forwards verbatim.
+ *
+ * The DCBs are spliced only if nothing is waiting to be written to them
+ * and no partial read is kept for them, the data that follows must not
+ * overtake data that is still buffered. TLS connections are never spliced.
+ *
+ * @param a	A DCB
+ * @param b	The DCB to forward the data of a to and from
+ * @return	1 if the DCBs are spliced, 0 otherwise
+ */
+int
+dcb_splice(DCB *a, DCB *b)
+{
+	CHK_DCB(a);
+	CHK_DCB(b);
+
+	if (a->splice_to != NULL || b->splice_to != NULL ||
+		a->state != DCB_STATE_POLLING || b->state != DCB_STATE_POLLING ||
+		a->writeq != NULL || b->writeq != NULL ||
+		a->delayq_count != 0 || b->delayq_count != 0 ||
+		a->dcb_readqueue != NULL || b->dcb_readqueue != NULL ||
+		a->tls != NULL || b->tls != NULL)
+	{
+		return 0;
+	}
+	if (pipe2(a->splice_pipe, O_NONBLOCK) != 0)
+	{
+		a->splice_pipe[0] = a->splice_pipe[1] = -1;
+		return 0;
+	}
+	if (pipe2(b->splice_pipe, O_NONBLOCK) != 0)
+	{
+		close(a->splice_pipe[0]);
+		close(a->splice_pipe[1]);
+		a->splice_pipe[0] = a->splice_pipe[1] = -1;
+		b->splice_pipe[0] = b->splice_pipe[1] = -1;
+		return 0;
+	}
+	a->splice_pending = b->splice_pending = 0;
+	b->splice_to = a;
+	a->splice_to = b;
+	LOGIF(LD, (skygw_log_write(
+		LOGFILE_DEBUG,
+		"%lu [dcb_splice] Spliced dcb %p fd %d and dcb %p fd %d.",
+		pthread_self(),
+		a,
+		a->fd,
+		b,
+		b->fd)));
+	return 1;
+}
+
+/**
+ * Move the data read from a spliced DCB to its peer. The data is spliced
+ * from the socket into the pipe of the DCB and from the pipe to the socket
+ * of the peer until the socket of the DCB is drained or the peer can take
+ * no more. Data left in the pipe is written when the peer is writable
+ * again, the write queue of the peer is always written first.
+ *
+ * The end of the data or an error are left to the read routine of the
+ * protocol. Called with the read lock of the DCB held, from the read
+ * event of the DCB or from the write event of the peer.
+ *
+ * @param dcb	The spliced DCB
+ * @return	The number of bytes written to the peer
+ */
+int
+dcb_splice_read(DCB *dcb)
+{
+DCB	*to = dcb->splice_to;
+ssize_t	n;
+int	total = 0;
+
+	if (to == NULL)
+		return 0;
+	while (true)
+	{
+		while (dcb->splice_pending > 0)
+		{
+			if (to->writeq != NULL)
+				return total;
+			n = splice(dcb->splice_pipe[0], NULL, to->fd, NULL,
+				dcb->splice_pending,
+				SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+			if (n < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+				{
+					/*< The error is handled for the peer */
+					LOGIF(LD, (skygw_log_write(
+						LOGFILE_DEBUG,
+						"%lu [dcb_splice_read] Splice to "
+						"fd %d failed due %d, %s.",
+						pthread_self(),
+						to->fd,
+						errno,
+						strerror(errno))));
+				}
+				errno = 0;
+				return total;
+			}
+			dcb->splice_pending -= n;
+			total += n;
+			to->stats.n_writes++;
+			to->last_activity = timer_now();
+		}
+		n = splice(dcb->fd, NULL, dcb->splice_pipe[1], NULL,
+				DCB_SPLICE_SIZE, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		if (n > 0)
+		{
+			dcb->splice_pending = n;
+			dcb->stats.n_reads++;
+			dcb->last_activity = timer_now();
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			errno = 0;
+			return total;
+		}
+		/*< End of data or an error, the protocol reads it */
+		errno = 0;
+		dcb->func.read(dcb);
+		return total;
+	}
+}
+
 /** 
  * Removes dcb from poll set, and adds it to zombies list. As a consequense,
  * dcb first moves to DCB_STATE_NOPOLLING, and then to DCB_STATE_ZOMBIE state.
@@ -1112,8 +2200,37 @@ void
 dcb_close(DCB *dcb)
 {
         int  rc;
+        int  locked;
 
         CHK_DCB(dcb);
+        /*< No timeout may fire once the DCB is closing */
+        timer_disable(&dcb->timer);
+        timer_disable(&dcb->write_timer);
+        /*< The peer reads through its protocol again */
+        if (dcb->splice_to != NULL)
+        {
+                dcb->splice_to->splice_to = NULL;
+                dcb->splice_to = NULL;
+        }
+        /*< No read waits for the DCB and the DCB waits for no peer */
+        dcb_read_unpause(dcb);
+        /*<
+         * A TLS session that is shut down may be resumed, the session of a
+         * DCB that another polling thread writes to is left as it is
+         */
+        if (dcb->tls != NULL && dcb->state == DCB_STATE_POLLING &&
+            poll_writeq_owner(dcb) != 0)
+        {
+                locked = dcb_writeq_lock(dcb);
+                tls_session_shutdown(dcb->tls);
+                dcb_writeq_unlock(dcb, locked);
+                dcb_write(dcb, NULL);
+        }
+        /*< The writes held for the event go out before the close */
+        if (dcb->corked && dcb->state == DCB_STATE_POLLING)
+        {
+                dcb_drain_writeq(dcb);
+        }
 
         /*<
          * dcb_close may be called for freshly created dcb, in which case
@@ -1145,6 +2262,8 @@ dcb_close(DCB *dcb)
                 dcb->func.close(dcb);
         }
 	dcb_call_callback(dcb, DCB_REASON_CLOSE);
+	/*< A client of a service with a connection limit lets the next one in */
+	serviceReleaseClient(dcb);
 
         if (rc == 0) {
                 LOGIF(LD, (skygw_log_write(
@@ -1200,6 +2319,8 @@ printDCB(DCB *dcb)
 				dcb->stats.n_high_water);
 	printf("\t\tNo. of Low Water Events:	 %d\n",
 				dcb->stats.n_low_water);
+	printf("\t\tNo. of Paused Reads:		 %d\n",
+				dcb->stats.n_read_paused);
 }
 
 /**
@@ -1214,52 +2335,243 @@ DCB	*dcb;
 	dcb = allDCBs;
 	while (dcb)
 	{
-		printDCB(dcb);
+		if ((dcb->flags & DCBF_CURSOR) == 0)
+			printDCB(dcb);
 		dcb = dcb->next;
 	}
 	spinlock_release(&dcbspin);
 }
 
+/**
+ * Copy the details of a DCB that the diagnostics print. Called with dcbspin
+ * held, which keeps the DCB and the strings it owns from being freed.
+ *
+ * @param dcb	The DCB
+ * @param info	The copy
+ */
+static void
+dcb_get_info(DCB *dcb, DCB_INFO *info)
+{
+SESSION	*session = dcb->session;
+SERVICE	*service = dcb->service;
+
+	info->dcb = dcb;
+	info->session = session;
+	info->state = dcb->state;
+	info->role = dcb->dcb_role;
+	info->flags = dcb->flags;
+	info->is_client = session && session->client == dcb;
+	info->writeqlen = dcb->writeqlen;
+	if (session && session->service)
+		service = session->service;
+	strncpy(info->service, service && service->name ? service->name : "",
+						DCB_INFO_NAMELEN - 1);
+	info->service[DCB_INFO_NAMELEN - 1] = '\0';
+	strncpy(info->remote, dcb->remote ? dcb->remote : "",
+						DCB_INFO_NAMELEN - 1);
+	info->remote[DCB_INFO_NAMELEN - 1] = '\0';
+	strncpy(info->user, dcb->user ? dcb->user : "", DCB_INFO_NAMELEN - 1);
+	info->user[DCB_INFO_NAMELEN - 1] = '\0';
+	info->stats = dcb->stats;
+}
+
+/**
+ * Call a function with a copy of the details of each DCB. The DCBs are
+ * copied DCB_INFO_BATCH at a time with the chain locked, and the function
+ * is called on the copies with the lock released. A cursor is left in the
+ * chain to mark the place the walk goes on from, so DCBs may come and go
+ * in between without the walk losing its place. DCBs created during the
+ * walk are not seen, as they go at the head of the chain.
+ *
+ * @param func	The function, returns 0 to end the walk
+ * @param data	Passed to the function
+ * @return	0 if the function ended the walk, otherwise 1
+ */
+int
+dcb_foreach_info(int (*func)(DCB_INFO *, void *), void *data)
+{
+DCB		cursor, *ptr;
+DCB_INFO	info[DCB_INFO_BATCH];
+int		i, n, rval = 1;
+
+	memset(&cursor, 0, sizeof(DCB));
+	cursor.flags = DCBF_CURSOR;
+
+	spinlock_acquire(&dcbspin);
+	ptr = allDCBs;
+	while (1)
+	{
+		for (n = 0; ptr && n < DCB_INFO_BATCH; ptr = ptr->next)
+		{
+			if ((ptr->flags & DCBF_CURSOR) == 0)
+				dcb_get_info(ptr, &info[n++]);
+		}
+		if (ptr)
+		{
+			/*< Leave the cursor in the place of the next DCB */
+			cursor.next = ptr;
+			cursor.prev = ptr->prev;
+			if (ptr->prev)
+				ptr->prev->next = &cursor;
+			else
+				allDCBs = &cursor;
+			ptr->prev = &cursor;
+		}
+		spinlock_release(&dcbspin);
+
+		for (i = 0; i < n && rval; i++)
+			rval = func(&info[i], data);
+		if (ptr == NULL)
+			break;
+
+		spinlock_acquire(&dcbspin);
+		ptr = cursor.next;
+		dcb_list_remove(&cursor);
+		if (rval == 0)
+		{
+			spinlock_release(&dcbspin);
+			break;
+		}
+	}
+	return rval;
+}
+
+/**
+ * Decide whether a diagnostic prints an object, and count the object
+ *
+ * @param range		The range of objects to print, NULL for all
+ * @param service	The name of the service of the object
+ * @return		1 to print the object, 0 to leave it out and -1 if
+ *			the range is complete
+ */
+int
+diag_range_select(DIAG_RANGE *range, char *service)
+{
+	if (range == NULL)
+		return 1;
+	if (range->service && strcmp(range->service, service) != 0)
+		return 0;
+	range->seen++;
+	if (range->seen <= range->first)
+		return 0;
+	if (range->count > 0 && range->seen > range->first + range->count)
+	{
+		range->more = 1;
+		return -1;
+	}
+	return 1;
+}
+
+/**
+ * The state of a diagnostic that prints copies of the DCBs
+ */
+typedef struct {
+	DCB		*pdcb;		/*< The DCB to print to */
+	DIAG_RANGE	*range;		/*< The DCBs to print */
+	int		clients;	/*< Only the client DCBs */
+} DCB_PRINT;
+
+/**
+ * Print the details of a DCB in full
+ */
+static int
+dcb_print_info(DCB_INFO *info, void *data)
+{
+DCB_PRINT	*print = (DCB_PRINT *)data;
+DCB		*pdcb = print->pdcb;
+int		sel;
+
+	if ((sel = diag_range_select(print->range, info->service)) <= 0)
+		return sel == 0;
+	dcb_printf(pdcb, "DCB: %p\n", info->dcb);
+	dcb_printf(pdcb, "\tDCB state:          %s\n",
+				gw_dcb_state2string(info->state));
+	if (*info->service)
+		dcb_printf(pdcb, "\tService:            %s\n", info->service);
+	if (*info->remote)
+		dcb_printf(pdcb, "\tConnected to:       %s\n", info->remote);
+	if (*info->user)
+		dcb_printf(pdcb, "\tUsername:           %s\n", info->user);
+	if (info->writeqlen)
+		dcb_printf(pdcb, "\tQueued write data:  %d\n", info->writeqlen);
+	dcb_printf(pdcb, "\tStatistics:\n");
+	dcb_printf(pdcb, "\t\tNo. of Reads:           %d\n", info->stats.n_reads);
+	dcb_printf(pdcb, "\t\tNo. of Writes:          %d\n", info->stats.n_writes);
+	dcb_printf(pdcb, "\t\tNo. of Buffered Writes: %d\n", info->stats.n_buffered);
+	dcb_printf(pdcb, "\t\tNo. of Accepts:         %d\n", info->stats.n_accepts);
+	dcb_printf(pdcb, "\t\tNo. of High Water Events: %d\n", info->stats.n_high_water);
+	dcb_printf(pdcb, "\t\tNo. of Low Water Events: %d\n", info->stats.n_low_water);
+	dcb_printf(pdcb, "\t\tNo. of Paused Reads:    %d\n", info->stats.n_read_paused);
+	if (info->flags & DCBF_CLONE)
+		dcb_printf(pdcb, "\t\tDCB is a clone.\n");
+	return 1;
+}
+
+/**
+ * Print a DCB, or a client DCB, as a row of a table
+ */
+static int
+dcb_list_info(DCB_INFO *info, void *data)
+{
+DCB_PRINT	*print = (DCB_PRINT *)data;
+int		sel;
+
+	if (print->clients && (info->is_client == 0 ||
+			info->role != DCB_ROLE_REQUEST_HANDLER))
+		return 1;
+	if ((sel = diag_range_select(print->range, info->service)) <= 0)
+		return sel == 0;
+	if (print->clients)
+		dcb_printf(print->pdcb, " %-15s | %10p | %-20s | %10p\n",
+			info->remote, info->dcb, info->service, info->session);
+	else
+		dcb_printf(print->pdcb, " %10p | %-26s | %-20s | %s\n",
+			info->dcb, gw_dcb_state2string(info->state),
+			info->service, info->remote);
+	return 1;
+}
+
+/**
+ * Tell the user a page of a diagnostic did not hold all the objects
+ *
+ * @param pdcb	The DCB to print to
+ * @param range	The range of the page, NULL for all the objects
+ */
+void
+diag_range_more(DCB *pdcb, DIAG_RANGE *range)
+{
+	if (range && range->more)
+		dcb_printf(pdcb, "More follow, the next page starts at %d.\n\n",
+					range->first + range->count);
+}
+
 
 /**
  * Diagnostic to print all DCB allocated in the system
  *
  */
-void dprintAllDCBs(DCB *pdcb)
+void dprintAllDCBs(DCB *pdcb)
+{
+	dprintDCBRange(pdcb, NULL);
+}
+
+/**
+ * Diagnostic to print the DCBs of a range, the DCBs of a service or a page
+ * of the DCBs
+ *
+ * @param pdcb	The DCB to print to
+ * @param range	The DCBs to print, NULL for all
+ */
+void dprintDCBRange(DCB *pdcb, DIAG_RANGE *range)
 {
-DCB	*dcb;
-
-	spinlock_acquire(&dcbspin);
-	dcb = allDCBs;
-	while (dcb)
-	{
-		dcb_printf(pdcb, "DCB: %p\n", (void *)dcb);
-		dcb_printf(pdcb, "\tDCB state:          %s\n",
-					gw_dcb_state2string(dcb->state));
-		if (dcb->session && dcb->session->service)
-			dcb_printf(pdcb, "\tService:            %s\n",
-					dcb->session->service->name);
-		if (dcb->remote)
-			dcb_printf(pdcb, "\tConnected to:       %s\n",
-					dcb->remote);
-		if (dcb->user)
-			dcb_printf(pdcb, "\tUsername:           %s\n",
-					dcb->user);
-		if (dcb->writeq)
-			dcb_printf(pdcb, "\tQueued write data:  %d\n",
-					gwbuf_length(dcb->writeq));
-		dcb_printf(pdcb, "\tStatistics:\n");
-		dcb_printf(pdcb, "\t\tNo. of Reads:           %d\n", dcb->stats.n_reads);
-		dcb_printf(pdcb, "\t\tNo. of Writes:          %d\n", dcb->stats.n_writes);
-		dcb_printf(pdcb, "\t\tNo. of Buffered Writes: %d\n", dcb->stats.n_buffered);
-		dcb_printf(pdcb, "\t\tNo. of Accepts:         %d\n", dcb->stats.n_accepts);
-		dcb_printf(pdcb, "\t\tNo. of High Water Events: %d\n", dcb->stats.n_high_water);
-		dcb_printf(pdcb, "\t\tNo. of Low Water Events: %d\n", dcb->stats.n_low_water);
-		if (dcb->flags & DCBF_CLONE)
-			dcb_printf(pdcb, "\t\tDCB is a clone.\n");
-		dcb = dcb->next;
-	}
-	spinlock_release(&dcbspin);
+DCB_PRINT	print;
+
+	print.pdcb = pdcb;
+	print.range = range;
+	print.clients = 0;
+	dprintDCBPool(pdcb);
+	dcb_foreach_info(dcb_print_info, &print);
+	diag_range_more(pdcb, range);
 }
 
 /** 
@@ -1270,26 +2582,31 @@ DCB	*dcb;
 void
 dListDCBs(DCB *pdcb)
 {
-DCB     *dcb;
+	dListDCBRange(pdcb, NULL);
+}
 
-	spinlock_acquire(&dcbspin);
-	dcb = allDCBs;
+/** 
+ * Diagnotic routine to print a range of the DCBs in a tabular form.
+ * 
+ * @param       pdcb    DCB to print results to
+ * @param	range	The DCBs to print, NULL for all
+ */
+void
+dListDCBRange(DCB *pdcb, DIAG_RANGE *range)
+{
+DCB_PRINT	print;
+
+	print.pdcb = pdcb;
+	print.range = range;
+	print.clients = 0;
 	dcb_printf(pdcb, "Descriptor Control Blocks\n");
 	dcb_printf(pdcb, "------------+----------------------------+----------------------+----------\n");
 	dcb_printf(pdcb, " %-10s | %-26s | %-20s | %s\n", 
 			"DCB", "State", "Service", "Remote");
 	dcb_printf(pdcb, "------------+----------------------------+----------------------+----------\n");
-	while (dcb)
-	{
-		dcb_printf(pdcb, " %10p | %-26s | %-20s | %s\n",
-			dcb, gw_dcb_state2string(dcb->state),
-			(dcb->session->service ?
-				dcb->session->service->name : ""), 
-			(dcb->remote ? dcb->remote : ""));
-		dcb = dcb->next;
-	}
+	dcb_foreach_info(dcb_list_info, &print);
 	dcb_printf(pdcb, "------------+----------------------------+----------------------+----------\n\n");
-	spinlock_release(&dcbspin);
+	diag_range_more(pdcb, range);
 }
 
 /** 
@@ -1300,30 +2617,31 @@ DCB     *dcb;
 void
 dListClients(DCB *pdcb)
 {
-DCB     *dcb;
+	dListClientRange(pdcb, NULL);
+}
 
-	spinlock_acquire(&dcbspin);
-	dcb = allDCBs;
+/** 
+ * Diagnotic routine to print a range of the client DCBs in a tabular form.
+ * 
+ * @param       pdcb    DCB to print results to
+ * @param	range	The client DCBs to print, NULL for all
+ */
+void
+dListClientRange(DCB *pdcb, DIAG_RANGE *range)
+{
+DCB_PRINT	print;
+
+	print.pdcb = pdcb;
+	print.range = range;
+	print.clients = 1;
 	dcb_printf(pdcb, "Client Connections\n");
 	dcb_printf(pdcb, "-----------------+------------+----------------------+------------\n");
 	dcb_printf(pdcb, " %-15s | %-10s | %-20s | %s\n", 
 			"Client", "DCB", "Service", "Session");
 	dcb_printf(pdcb, "-----------------+------------+----------------------+------------\n");
-	while (dcb)
-	{
-		if (dcb_isclient(dcb)
-			&& dcb->dcb_role == DCB_ROLE_REQUEST_HANDLER)
-		{
-			dcb_printf(pdcb, " %-15s | %10p | %-20s | %10p\n",
-				(dcb->remote ? dcb->remote : ""),
-				dcb, (dcb->session->service ?
-					dcb->session->service->name : ""), 
-				dcb->session);
-		}
-		dcb = dcb->next;
-	}
+	dcb_foreach_info(dcb_list_info, &print);
 	dcb_printf(pdcb, "-----------------+------------+----------------------+------------\n\n");
-	spinlock_release(&dcbspin);
+	diag_range_more(pdcb, range);
 }
 
 
@@ -1362,6 +2680,8 @@ dprintDCB(DCB *pdcb, DCB *dcb)
 						dcb->stats.n_high_water);
 	dcb_printf(pdcb, "\t\tNo. of Low Water Events:	%d\n",
 						dcb->stats.n_low_water);
+	dcb_printf(pdcb, "\t\tNo. of Paused Reads:		%d\n",
+						dcb->stats.n_read_paused);
 	if (dcb->flags & DCBF_CLONE)
 		dcb_printf(pdcb, "\t\tDCB is a clone.\n");
 }
@@ -1397,6 +2717,11 @@ gw_dcb_state2string (int state) {
  * A  DCB based wrapper for printf. Allows formatting printing to
  * a descritor control block.
  *
+ * The output is written in a buffer of its size. Between dcb_printf_begin
+ * and dcb_printf_end the output is held instead, it is formatted into the
+ * free space at the end of the last held buffer and a new buffer of at
+ * least DCB_PRINT_CHUNK bytes is added when it does not fit.
+ *
  * @param dcb	Descriptor to write to
  * @param fmt	A printf format string
  * @param ...	Variable arguments for the print format
@@ -1406,15 +2731,108 @@ dcb_printf(DCB *dcb, const char *fmt, ...)
 {
 GWBUF	*buf;
 va_list	args;
+char	line[DCB_PRINT_LINE];
+int	len, size;
+
+	if (dcb->print_held && dcb->printq_room > 0)
+	{
+		va_start(args, fmt);
+		len = vsnprintf((char *)dcb->printq_tail->end, dcb->printq_room,
+				fmt, args);
+		va_end(args);
+		if (len >= 0 && len < dcb->printq_room)
+		{
+			dcb->printq_tail->end += len;
+			dcb->printq_room -= len;
+			dcb->printq_len += len;
+			if (dcb->printq_len >= DCB_PRINT_FLUSH)
+				dcb_printf_flush(dcb);
+			return;
+		}
+	}
 
-	if ((buf = gwbuf_alloc(10240)) == NULL)
-		return;
 	va_start(args, fmt);
-	vsnprintf(GWBUF_DATA(buf), 10240, fmt, args);
+	len = vsnprintf(line, sizeof(line), fmt, args);
 	va_end(args);
+	if (len <= 0)
+		return;
+	size = len + 1;
+	if (dcb->print_held && size < DCB_PRINT_CHUNK)
+		size = DCB_PRINT_CHUNK;
+	if ((buf = gwbuf_alloc(size)) == NULL)
+		return;
+	if (len < sizeof(line))
+	{
+		memcpy(GWBUF_DATA(buf), line, len);
+	}
+	else
+	{
+		va_start(args, fmt);
+		vsnprintf(GWBUF_DATA(buf), len + 1, fmt, args);
+		va_end(args);
+	}
+	buf->end = GWBUF_DATA(buf) + len;
+
+	if (!dcb->print_held)
+	{
+		dcb->func.write(dcb, buf);
+		return;
+	}
+	if (dcb->printq_tail)
+		dcb->printq_tail->next = buf;
+	else
+		dcb->printq = buf;
+	dcb->printq_tail = buf;
+	dcb->printq_room = buf->sbuf->size - len;
+	dcb->printq_len += len;
+	if (dcb->printq_len >= DCB_PRINT_FLUSH)
+		dcb_printf_flush(dcb);
+}
 
-	buf->end = GWBUF_DATA(buf) + strlen(GWBUF_DATA(buf));
-	dcb->func.write(dcb, buf);
+/**
+ * Hold the output of dcb_printf to a DCB until dcb_printf_end, so that
+ * the output of an admin command is written in a few large buffers rather
+ * than a write for each line. More than DCB_PRINT_FLUSH bytes held are
+ * written before the end. Only the thread that runs the command prints to
+ * the DCB, the held output is not locked.
+ *
+ * @param dcb	The DCB the command prints to
+ */
+void
+dcb_printf_begin(DCB *dcb)
+{
+	dcb->print_held = 1;
+}
+
+/**
+ * Write the output held by dcb_printf_begin and stop holding it
+ *
+ * @param dcb	The DCB the command prints to
+ */
+void
+dcb_printf_end(DCB *dcb)
+{
+	dcb_printf_flush(dcb);
+	dcb->print_held = 0;
+}
+
+/**
+ * Write the printed output held for a DCB
+ *
+ * @param dcb	The DCB
+ */
+static void
+dcb_printf_flush(DCB *dcb)
+{
+GWBUF	*queue;
+
+	if ((queue = dcb->printq) == NULL)
+		return;
+	dcb->printq = NULL;
+	dcb->printq_tail = NULL;
+	dcb->printq_room = 0;
+	dcb->printq_len = 0;
+	dcb->func.write(dcb, queue);
 }
 
 /**
@@ -1700,6 +3118,107 @@ int gw_write(
         return w;
 }
 
+/**
+ * Vectored version of gw_write, writes the iovec array with a single
+ * writev system call.
+ *
+ * @param fd		The socket to write to
+ * @param iov		The array of data areas to write
+ * @param iovcnt	The number of entries in iov
+ * @return The number of bytes written or -1 with errno set
+ */
+int gw_writev(
+#if defined(SS_DEBUG)
+        DCB*                dcb,
+#endif
+        int                 fd,
+        const struct iovec* iov,
+        int                 iovcnt)
+{
+        int w;
+#if defined(SS_DEBUG)
+        if (dcb_fake_write_errno[fd] != 0) {
+                ss_dassert(dcb_fake_write_ev[fd] != 0);
+                /*< leave peer to read missing bytes */
+                w = write(fd, iov[0].iov_base, iov[0].iov_len/2);
+
+                if (w > 0) {
+                        w = -1;
+                        errno = dcb_fake_write_errno[fd];
+                }
+                return w;
+        }
+#endif
+        w = writev(fd, iov, iovcnt);
+        return w;
+}
+
+/**
+ * Write as much of a buffer chain as the socket accepts with a single
+ * writev call, covering up to DCB_MAX_IOV buffers of the chain. The bytes that
+ * were written are consumed from the chain, which may leave the first
+ * remaining buffer partially written.
+ *
+ * The caller must hold the write queue lock if the chain is the write queue.
+ *
+ * @param dcb	The DCB to write to
+ * @param queue	Pointer to the head of the buffer chain, updated on return
+ * @return The number of bytes written or -1 with errno set
+ */
+static int
+dcb_write_chain(DCB *dcb, GWBUF **queue)
+{
+struct iovec	iov[DCB_MAX_IOV];
+GWBUF		*ptr;
+int		niov = 0;
+int		w;
+int		n;
+
+	for (ptr = *queue; ptr != NULL && niov < DCB_MAX_IOV; ptr = ptr->next)
+	{
+		if (GWBUF_EMPTY(ptr))
+			continue;
+		iov[niov].iov_base = GWBUF_DATA(ptr);
+		iov[niov].iov_len = GWBUF_LENGTH(ptr);
+		niov++;
+	}
+	if (niov == 0)
+	{
+		/*< Nothing but empty buffers, release them */
+		while (*queue != NULL)
+			*queue = gwbuf_consume(*queue, 0);
+		return 0;
+	}
+	w = gw_writev(
+#if defined(SS_DEBUG)
+                        dcb,
+#endif
+                        dcb->fd, iov, niov);
+	TRACEPOINT4(dcb__write, dcb, dcb->session, w, niov);
+
+	if (w > 0)
+	{
+		dcb->last_activity = timer_now();
+		dcb->last_written = dcb->last_activity;
+		n = w;
+		/*< Consume fully written buffers and the partial one, if any */
+		while (*queue != NULL && (n > 0 || GWBUF_EMPTY(*queue)))
+		{
+			int len = GWBUF_LENGTH(*queue);
+
+			if (n < len)
+			{
+				GWBUF_CONSUME(*queue, n);
+				n = 0;
+				break;
+			}
+			*queue = gwbuf_consume(*queue, len);
+			n -= len;
+		}
+	}
+	return w;
+}
+
 /**
  * Add a callback
  *
@@ -1709,6 +3228,9 @@ int gw_write(
  * An error will also be returned if the is insufficient memeory available to
  * create the registration.
  *
+ * The callbacks of a DCB are kept in a list for each reason, the bit of the
+ * reason in the cb_mask of the DCB is set while its list is not empty.
+ *
  * @param dcb		The DCB to add the callback to
  * @param reason	The callback reason
  * @param callback	The callback function to call
@@ -1721,10 +3243,16 @@ dcb_add_callback(
         DCB_REASON reason, 
         int (*callback)(struct dcb *, DCB_REASON, void *), void *userdata)
 {
-DCB_CALLBACK	*cb, *ptr;
-int		rval = 1;
+DCB_CALLBACK	*cb, *ptr, **pcb;
 
-	if ((ptr = (DCB_CALLBACK *)malloc(sizeof(DCB_CALLBACK))) == NULL)
+	if ((unsigned)reason >= DCB_N_REASONS)
+		return 0;
+	spinlock_acquire(&dcb->cb_lock);
+	if ((ptr = dcb->cb_spare) != NULL)
+		dcb->cb_spare = ptr->next;
+	spinlock_release(&dcb->cb_lock);
+	if (ptr == NULL &&
+		(ptr = (DCB_CALLBACK *)malloc(sizeof(DCB_CALLBACK))) == NULL)
 	{
 		return 0;
 	}
@@ -1733,37 +3261,27 @@ int		rval = 1;
 	ptr->userdata = userdata;
 	ptr->next = NULL;
 	spinlock_acquire(&dcb->cb_lock);
-	cb = dcb->callbacks;
-	if (cb == NULL)
-	{
-		dcb->callbacks = ptr;
-		spinlock_release(&dcb->cb_lock);
-	}
-	else
+	for (pcb = &dcb->callbacks[reason]; (cb = *pcb) != NULL; pcb = &cb->next)
 	{
-		while (cb)
+		if (cb->cb == callback && cb->userdata == userdata)
 		{
-			if (cb->reason == reason && cb->cb == callback &&
-				cb->userdata == userdata)
-			{
-				free(ptr);
-				spinlock_release(&dcb->cb_lock);
-				return 0;
-			}
-			if (cb->next == NULL)
-				cb->next = ptr;
-			cb = cb->next;
+			ptr->next = dcb->cb_spare;
+			dcb->cb_spare = ptr;
+			spinlock_release(&dcb->cb_lock);
+			return 0;
 		}
-		spinlock_release(&dcb->cb_lock);
 	}
-	return rval;
+	*pcb = ptr;
+	dcb->cb_mask |= DCB_REASON_BIT(reason);
+	spinlock_release(&dcb->cb_lock);
+	return 1;
 }
 
 /**
  * Remove a callback from the callback list for the DCB
  *
- * Searches down the linked list to find the callback with a matching reason, function
- * and userdata.
+ * Searches down the linked list of the reason to find the callback with a
+ * matching function and userdata.
  *
  * @param dcb		The DCB to add the callback to
  * @param reason	The callback reason
@@ -1774,42 +3292,34 @@ int		rval = 1;
 int
 dcb_remove_callback(DCB *dcb, DCB_REASON reason, int (*callback)(struct dcb *, DCB_REASON), void *userdata)
 {
-DCB_CALLBACK	*cb, *pcb = NULL;
+DCB_CALLBACK	*cb, **pcb;
 int		rval = 0;
 
+	if ((unsigned)reason >= DCB_N_REASONS ||
+		!(dcb->cb_mask & DCB_REASON_BIT(reason)))
+		return 0;
 	spinlock_acquire(&dcb->cb_lock);
-	cb = dcb->callbacks;
-	if (cb == NULL)
-	{
-		rval = 0;
-	}
-	else
+	for (pcb = &dcb->callbacks[reason]; (cb = *pcb) != NULL; pcb = &cb->next)
 	{
-		while (cb)
+		if ((void *)cb->cb == (void *)callback && cb->userdata == userdata)
 		{
-			if (cb->reason == reason && cb->cb == callback
-				&& cb->userdata == userdata)
-			{
-				if (pcb != NULL)
-					pcb->next = cb->next;
-				else
-					dcb->callbacks = cb->next;
-				spinlock_release(&dcb->cb_lock);
-				free(cb);
-				rval = 1;
-				break;
-			}
-			pcb = cb;
-			cb = cb->next;
+			*pcb = cb->next;
+			cb->next = dcb->cb_spare;
+			dcb->cb_spare = cb;
+			rval = 1;
+			break;
 		}
 	}
-	if (!rval)
-		spinlock_release(&dcb->cb_lock);
+	if (dcb->callbacks[reason] == NULL)
+		dcb->cb_mask &= ~DCB_REASON_BIT(reason);
+	spinlock_release(&dcb->cb_lock);
 	return rval;
 }
 
 /**
- * Call the set of callbacks registered for a particular reason.
+ * Call the set of callbacks registered for a particular reason. The mask of
+ * the registered reasons is read without the lock, a reason nothing is
+ * registered for costs no more than the test.
  *
  * @param dcb		The DCB to call the callbacks regarding
  * @param reason	The reason that has triggered the call
@@ -1819,21 +3329,44 @@ dcb_call_callback(DCB *dcb, DCB_REASON reason)
 {
 DCB_CALLBACK	*cb, *nextcb;
 
+	if (!(dcb->cb_mask & DCB_REASON_BIT(reason)))
+		return;
 	spinlock_acquire(&dcb->cb_lock);
-	cb = dcb->callbacks;
+	cb = dcb->callbacks[reason];
 	while (cb)
 	{
-		if (cb->reason == reason)
+		nextcb = cb->next;
+		spinlock_release(&dcb->cb_lock);
+		cb->cb(dcb, reason, cb->userdata);
+		spinlock_acquire(&dcb->cb_lock);
+		cb = nextcb;
+	}
+	spinlock_release(&dcb->cb_lock);
+}
+
+/**
+ * Drop all the callbacks of a DCB, the entries are kept as spares for the
+ * next user of the DCB
+ *
+ * @param dcb		The DCB
+ */
+static void
+dcb_release_callbacks(DCB *dcb)
+{
+DCB_CALLBACK	*cb;
+int		i;
+
+	spinlock_acquire(&dcb->cb_lock);
+	for (i = 0; i < DCB_N_REASONS; i++)
+	{
+		while ((cb = dcb->callbacks[i]) != NULL)
 		{
-			nextcb = cb->next;
-			spinlock_release(&dcb->cb_lock);
-			cb->cb(dcb, reason, cb->userdata);
-			spinlock_acquire(&dcb->cb_lock);
-			cb = nextcb;
+			dcb->callbacks[i] = cb->next;
+			cb->next = dcb->cb_spare;
+			dcb->cb_spare = cb;
 		}
-		else
-			cb = cb->next;
 	}
+	dcb->cb_mask = 0;
 	spinlock_release(&dcb->cb_lock);
 }
 
@@ -1865,6 +3398,196 @@ int	rval = 0;
 	return rval;
 }
 
+/**
+ * The idle timer of a DCB has expired. The DCB is shut down if there has
+ * been no activity for the idle timeout, otherwise the timer is restarted
+ * for the balance. Shutting down the socket rather than closing the DCB
+ * here leaves the close to the normal hangup processing of the protocol.
+ *
+ * @param data	The DCB
+ */
+static void
+dcb_idle_expired(void *data)
+{
+DCB		*dcb = (DCB *)data;
+unsigned long	idle;
+
+	if (dcb->state != DCB_STATE_POLLING || dcb->idle_timeout <= 0)
+		return;
+	idle = timer_now() - dcb->last_activity;
+	if (idle >= (unsigned long)dcb->idle_timeout * 1000)
+	{
+		LOGIF(LT, (skygw_log_write(
+			LOGFILE_TRACE,
+			"Closing dcb %p fd %d, idle for %lu seconds.",
+			dcb,
+			dcb->fd,
+			idle / 1000)));
+		dcb->flags |= DCBF_TIMED_OUT;
+		shutdown(dcb->fd, SHUT_RDWR);
+		return;
+	}
+	timer_start(&dcb->timer, dcb->idle_timeout * 1000 - idle,
+			dcb_idle_expired, dcb);
+}
+
+/**
+ * The write stall timer of a client has expired. The session is closed if
+ * the write queue of the client has had nothing written from it for the
+ * write timeout of the service, otherwise the timer is restarted for the
+ * balance. A write queue that has drained in the meantime leaves the timer
+ * stopped until the writes block again.
+ *
+ * @param data	The DCB of the client
+ */
+static void
+dcb_write_expired(void *data)
+{
+DCB		*dcb = (DCB *)data;
+int		timeout;
+unsigned long	stalled;
+
+	if (dcb->state != DCB_STATE_POLLING || dcb->writeq == NULL ||
+		dcb->session == NULL ||
+		(timeout = dcb->session->service->write_timeout) <= 0)
+	{
+		return;
+	}
+	stalled = timer_now() - dcb->last_written;
+	if (stalled < (unsigned long)timeout * 1000)
+	{
+		timer_start(&dcb->write_timer, timeout * 1000 - stalled,
+				dcb_write_expired, dcb);
+		return;
+	}
+	if (session_evict(dcb->session))
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : Client %s of service '%s' has read nothing "
+			"for %lu seconds, %d bytes are queued for it. "
+			"The session is closed.",
+			dcb->remote ? dcb->remote : "",
+			dcb->session->service->name,
+			stalled / 1000,
+			dcb->writeqlen)));
+	}
+}
+
+/**
+ * Start the write stall timer of a DCB whose write queue holds data, if the
+ * DCB is a client of a service with a write timeout and the timer is not
+ * already running. The stall is timed from the last write, which is the
+ * time the writes blocked when the timer is started.
+ *
+ * @param dcb	The DCB
+ */
+static void
+dcb_write_watch(DCB *dcb)
+{
+int	timeout;
+
+	if (dcb->write_timer.state == TIMER_PENDING || !dcb_isclient(dcb) ||
+		(timeout = dcb->session->service->write_timeout) <= 0)
+	{
+		return;
+	}
+	dcb->last_written = timer_now();
+	timer_start(&dcb->write_timer, timeout * 1000, dcb_write_expired, dcb);
+}
+
+/**
+ * Check the write queue limit of the service of a client before more bytes
+ * are queued for it. The session of a client whose write queue would go
+ * over the limit is closed.
+ *
+ * @param dcb	The DCB
+ * @param bytes	The bytes that are about to be queued
+ * @return	Non-zero if the bytes must not be queued
+ */
+static int
+dcb_writeq_exceeded(DCB *dcb, int bytes)
+{
+int	limit;
+
+	if (!dcb_isclient(dcb) ||
+		(limit = dcb->session->service->writeq_limit) <= 0 ||
+		dcb->writeqlen + bytes <= limit)
+	{
+		return 0;
+	}
+	if (session_evict(dcb->session))
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : Client %s of service '%s' has %d bytes queued, "
+			"more than the client_writeq_limit %d. "
+			"The session is closed.",
+			dcb->remote ? dcb->remote : "",
+			dcb->session->service->name,
+			dcb->writeqlen + bytes,
+			limit)));
+	}
+	return 1;
+}
+
+/**
+ * Close the DCB if there is no read or write on it for a number of seconds.
+ * The timer is only restarted when it expires, reads and writes merely
+ * record the time, so activity on the DCB costs nothing.
+ *
+ * @param dcb	The DCB
+ * @param secs	The idle timeout in seconds, 0 disables it
+ */
+void
+dcb_set_idle_timeout(DCB *dcb, int secs)
+{
+	dcb->idle_timeout = secs;
+	if (secs <= 0)
+	{
+		timer_cancel(&dcb->timer);
+		return;
+	}
+	dcb->last_activity = timer_now();
+	timer_start(&dcb->timer, secs * 1000, dcb_idle_expired, dcb);
+}
+
+/**
+ * The connect timer of a DCB has expired, shut the DCB down if nothing
+ * has been read from or written to it yet.
+ *
+ * @param data	The DCB
+ */
+static void
+dcb_connect_expired(void *data)
+{
+DCB	*dcb = (DCB *)data;
+
+	if (dcb->state != DCB_STATE_POLLING || dcb->last_activity != 0)
+		return;
+	LOGIF(LE, (skygw_log_write_flush(
+		LOGFILE_ERROR,
+		"Error : Backend connection timed out, closing dcb %p fd %d.",
+		dcb,
+		dcb->fd)));
+	dcb->flags |= DCBF_TIMED_OUT;
+	shutdown(dcb->fd, SHUT_RDWR);
+}
+
+/**
+ * Close the DCB if the peer has not sent or accepted any data on it within
+ * a number of seconds of the connect.
+ *
+ * @param dcb	The DCB
+ * @param secs	The connect timeout in seconds
+ */
+void
+dcb_set_connect_timeout(DCB *dcb, int secs)
+{
+	if (secs > 0)
+		timer_start(&dcb->timer, secs * 1000, dcb_connect_expired, dcb);
+}
+
 static DCB* dcb_get_next (
         DCB* dcb)
 {
@@ -1895,6 +3618,11 @@ static DCB* dcb_get_next (
                         dcb = NULL;
                 }
         }
+        /*< Cursors of the diagnostics are not DCBs */
+        while (dcb != NULL && (dcb->flags & DCBF_CURSOR))
+        {
+                dcb = dcb->next;
+        }
         spinlock_release(&dcbspin);
         
         return dcb;
@@ -30,16 +30,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <filter.h>
 #include <session.h>
 #include <modules.h>
 #include <spinlock.h>
+#include <brlock.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
 
 extern int lm_enabled_logfiles_bitmask;
 
-static SPINLOCK	filter_spin = SPINLOCK_INIT;	/**< Protects the list of all filters */
+static BRLOCK	filter_lock = BRLOCK_INIT;	/**< Protects the list of all filters */
 static FILTER_DEF *allFilters = NULL;		/**< The list of all filters */
 
 /**
@@ -67,10 +69,10 @@ FILTER_DEF 	*filter;
 
 	spinlock_init(&filter->spin);
 
-	spinlock_acquire(&filter_spin);
+	brlock_write_acquire(&filter_lock);
 	filter->next = allFilters;
 	allFilters = filter;
-	spinlock_release(&filter_spin);
+	brlock_write_release(&filter_lock);
 
 	return filter;
 }
@@ -88,7 +90,7 @@ filter_free(FILTER_DEF *filter)
 FILTER_DEF *ptr;
 
 	/* First of all remove from the linked list */
-	spinlock_acquire(&filter_spin);
+	brlock_write_acquire(&filter_lock);
 	if (allFilters == filter)
 	{
 		allFilters = filter->next;
@@ -103,7 +105,7 @@ FILTER_DEF *ptr;
 		if (ptr)
 			ptr->next = filter->next;
 	}
-	spinlock_release(&filter_spin);
+	brlock_write_release(&filter_lock);
 
 	/* Clean up session and free the memory */
 	free(filter->name);
@@ -123,7 +125,7 @@ filter_find(char *name)
 {
 FILTER_DEF 	*filter;
 
-	spinlock_acquire(&filter_spin);
+	brlock_read_acquire(&filter_lock);
 	filter = allFilters;
 	while (filter)
 	{
@@ -131,7 +133,7 @@ FILTER_DEF 	*filter;
 			break;
 		filter = filter->next;
 	}
-	spinlock_release(&filter_spin);
+	brlock_read_release(&filter_lock);
 	return filter;
 }
 
@@ -148,6 +150,37 @@ filter_standard_parameter(char *name)
 	return 0;
 }
 
+/**
+ * Classify a request for the interest of the filters, see
+ * FILTER_INTEREST_READ. Only the first word of a COM_QUERY is looked at.
+ *
+ * @param queue	The request
+ * @return	The FILTER_INTEREST bit of the request
+ */
+int
+filter_classify(GWBUF *queue)
+{
+static char	*reads[] = { "SELECT", "SHOW", "DESCRIBE", "DESC", "EXPLAIN",
+				NULL };
+unsigned char	*ptr = GWBUF_DATA(queue), *end;
+int		i, len;
+
+	if (GWBUF_LENGTH(queue) < 5 || ptr[3] != 0 || ptr[4] != 0x03)
+		return FILTER_INTEREST_COMMAND;		// Not a COM_QUERY
+	end = ptr + GWBUF_LENGTH(queue);
+	for (ptr += 5; ptr < end && isspace(*ptr); ptr++)
+		;
+	for (i = 0; reads[i]; i++)
+	{
+		len = strlen(reads[i]);
+		if (end - ptr >= len && !strncasecmp((char *)ptr, reads[i], len)
+			&& (end - ptr == len || !(isalnum(ptr[len]) ||
+							ptr[len] == '_')))
+			return FILTER_INTEREST_READ;
+	}
+	return FILTER_INTEREST_WRITE;
+}
+
 /**
  * Print all filters to a DCB
  *
@@ -160,7 +193,7 @@ dprintAllFilters(DCB *dcb)
 FILTER_DEF	*ptr;
 int		i;
 
-	spinlock_acquire(&filter_spin);
+	brlock_read_acquire(&filter_lock);
 	ptr = allFilters;
 	while (ptr)
 	{
@@ -179,7 +212,7 @@ int		i;
 			dcb_printf(dcb, "\tModule not loaded.\n");
 		ptr = ptr->next;
 	}
-	spinlock_release(&filter_spin);
+	brlock_read_release(&filter_lock);
 }
 
 /**
@@ -216,7 +249,7 @@ dListFilters(DCB *dcb)
 FILTER_DEF	*ptr;
 int	i;
 
-	spinlock_acquire(&filter_spin);
+	brlock_read_acquire(&filter_lock);
 	ptr = allFilters;
 	if (ptr)
 	{
@@ -237,7 +270,7 @@ int	i;
 	}
 	if (allFilters)
 		dcb_printf(dcb, "--------------------+-----------------+----------------------------------------\n\n");
-	spinlock_release(&filter_spin);
+	brlock_read_release(&filter_lock);
 }
 
 /**
@@ -336,6 +369,9 @@ DOWNSTREAM	*me;
 	}
 	me->instance = filter->filter;
 	me->routeQuery = (void *)(filter->obj->routeQuery);
+	/*< A batch can only be passed on if the rest of the chain takes it */
+	if (downstream->routeBatch != NULL)
+		me->routeBatch = (void *)(filter->obj->routeBatch);
 	me->session = filter->obj->newSession(me->instance, session);
 
 	filter->obj->setDownstream(me->instance, me->session, downstream);
@@ -51,6 +51,10 @@
 #include <modules.h>
 #include <config.h>
 #include <poll.h>
+#include <resolver.h>
+#include <querykill.h>
+#include <qccache.h>
+#include <handoff.h>
 
 #include <stdlib.h>
 #include <unistd.h>
@@ -833,10 +837,12 @@ static void usage(void)
 {
         fprintf(stderr,
                 "*\n* Usage : maxscale [-h] | [-d] [-c <home "
-                "directory>] [-f <config file name>]\n* where:\n* "
+                "directory>] [-f <config file name>] [-b <log ids>]\n* where:\n* "
                 "-h help\n* -d enable running in terminal process (default:disabled)\n* "
                 "-c relative|absolute MaxScale home directory\n* "
-                "-f relative|absolute pathname of MaxScale configuration file (default:MAXSCALE_HOME/etc/MaxScale.cnf)\n*\n");
+                "-f relative|absolute pathname of MaxScale configuration file (default:MAXSCALE_HOME/etc/MaxScale.cnf)\n* "
+                "-b logs written in binary mode, LOGFILE_TRACE and/or LOGFILE_DEBUG,\n*    "
+                "read them with maxlogdecode (default:none)\n*\n");
 }
 
 /** 
@@ -892,6 +898,7 @@ int main(int argc, char **argv)
         char*    home_dir = NULL;             /*< home dir, to be freed */
         char*    cnf_file_path = NULL;        /*< conf file, to be freed */
         char*    cnf_file_arg = NULL;         /*< conf filename from cmd-line arg */
+        char*    binlog_ids = NULL;           /*< logs written in binary mode */
         void*    log_flush_thr = NULL;
         ssize_t  log_flush_timeout_ms = 0;
         sigset_t sigset;
@@ -930,7 +937,7 @@ int main(int argc, char **argv)
                         goto return_main;
                 }
         }
-        while ((opt = getopt(argc, argv, "dc:f:h")) != -1)
+        while ((opt = getopt(argc, argv, "dc:f:b:h")) != -1)
         {
                 bool succp = true;
                 
@@ -1011,6 +1018,28 @@ int main(int argc, char **argv)
                                 succp = false;
                         }
                         break;  
+
+                case 'b':
+                        /*<
+                         * Logs written in binary mode, the ids are passed
+                         * to log manager which checks them.
+                         */
+                        if (optarg[0] != '-')
+                        {
+                                binlog_ids = strdup(optarg);
+                        }
+                        if (binlog_ids == NULL)
+                        {
+                                char* logerr = "Binary log argument "
+                                        "identifier \'-b\' was specified but "
+                                        "the argument didn't specify\n  the "
+                                        "log files or the argument was "
+                                        "missing.";
+                                print_log_n_stderr(true, true, logerr, logerr, 0);
+                                usage();
+                                succp = false;
+                        }
+                        break;
                         
                 default:
                         usage();
@@ -1184,7 +1213,8 @@ int main(int argc, char **argv)
          */
         {
                 char 	buf[1024];
-                char	*argv[8];
+                char	*argv[10];
+                int	argc = 7;
 
                 sprintf(buf, "%s/log", home_dir);
                 mkdir(buf, 0777);
@@ -1195,8 +1225,13 @@ int main(int argc, char **argv)
                 argv[4] = "LOGFILE_DEBUG,LOGFILE_TRACE";   /*< ..these logs to shm */
                 argv[5] = "-l"; /*< write to syslog */
                 argv[6] = "LOGFILE_MESSAGE,LOGFILE_ERROR"; /*< ..these logs to syslog */
-                argv[7] = NULL;
-                skygw_logmanager_init(7, argv);
+                if (binlog_ids != NULL)
+                {
+                        argv[argc++] = "-k"; /*< write in binary mode */
+                        argv[argc++] = binlog_ids;
+                }
+                argv[argc] = NULL;
+                skygw_logmanager_init(argc, argv);
         }
 
         /*<
@@ -1338,6 +1373,38 @@ int main(int argc, char **argv)
 
 	/* Init MaxScale poll system */
         poll_init();
+        /*<
+         * Start the thread that looks up the host names, the names of the
+         * servers are looked up before it starts.
+         */
+        resolver_start();
+        /*< Start the thread that kills the statements that time out */
+        querykill_start();
+        /*<
+         * Load the classifications saved by the last run before any
+         * listener is opened and start the thread that saves them.
+         */
+        qccache_start(home_dir);
+        /*<
+         * With handoff on, take over the listening sockets of a running
+         * MaxScale, the services then start on them.
+         */
+        handoff_receive(home_dir);
+        n_threads = config_threadcount();
+        threads = (void **)calloc(n_threads, sizeof(void *));
+        /*<
+         * With listen_early the polling threads, other than the main
+         * thread, serve the listeners of each service as soon as the
+         * service is started instead of once they all are.
+         */
+        if (config_listen_early())
+        {
+                for (n = 0; n < n_threads - 1; n++)
+                {
+                        threads[n] = thread_start(poll_waitevents,
+                                                  (void *)(n + 1));
+                }
+        }
     
         /*<
          * Start the services that were created above
@@ -1350,6 +1417,10 @@ int main(int argc, char **argv)
                 rc = MAXSCALE_NOSERVICES;
                 goto return_main;
         }
+        /*<
+         * Start the thread that keeps the users' tables up to date.
+         */
+        serviceStartUsersLoader();
         /*<
          * Start periodic log flusher thread.
          */
@@ -1361,18 +1432,18 @@ int main(int argc, char **argv)
          * Start the polling threads, note this is one less than is
          * configured as the main thread will also poll.
          */
-        n_threads = config_threadcount();
-        threads = (void **)calloc(n_threads, sizeof(void *));
-        /*<
-         * Start server threads.
-         */
-        for (n = 0; n < n_threads - 1; n++)
+        for (n = 0; n < n_threads - 1 && !config_listen_early(); n++)
         {
                 threads[n] = thread_start(poll_waitevents, (void *)(n + 1));
         }
         LOGIF(LM, (skygw_log_write(LOGFILE_MESSAGE,
                         "MaxScale started with %d server threads.",
                                    config_threadcount())));
+        /*<
+         * The listeners are polled, let the old MaxScale go and serve the
+         * handoff socket for the next one.
+         */
+        handoff_start(home_dir);
         /*<
          * Serve clients.
          */
@@ -1394,6 +1465,12 @@ int main(int argc, char **argv)
          */
         thread_wait(log_flush_thr);
 
+        serviceStopUsersLoader();
+        resolver_stop();
+        querykill_stop();
+        qccache_stop();
+        handoff_stop();
+
         /*< Stop all the monitors */
         monitorStopAll();
         LOGIF(LM, (skygw_log_write(
@@ -1404,8 +1481,9 @@ int main(int argc, char **argv)
                            LOGFILE_MESSAGE,
                            "MaxScale shutdown completed.")));
 
-	/* Remove Pidfile */
-	unlink_pidfile();
+	/* Remove Pidfile, unless the new MaxScale has written its own */
+	if (!handoff_handed_over())
+		unlink_pidfile();
 	
 return_main:
         return rc;
@@ -0,0 +1,625 @@
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file handoff.c  -  The handoff of the listeners to a restarted MaxScale
+ *
+ * The old MaxScale serves the handoff socket from the handoff thread, one
+ * new MaxScale at a time. It sends each listening socket in a message of
+ * its own and waits for the new MaxScale to say it has taken over, for at
+ * most HANDOFF_TIMEOUT seconds. Until then both accept clients, if the new
+ * MaxScale fails to start the old one keeps its listeners and goes on.
+ *
+ * The new MaxScale keeps the sockets it receives by their address until
+ * its services start. A socket of an address no listener is configured for
+ * any more, or a per thread copy of a thread the new MaxScale doesn't
+ * have, is closed once the listeners are polled.
+ *
+ * Only a process of the same user may connect to the handoff socket.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <handoff.h>
+#include <service.h>
+#include <session.h>
+#include <dcb.h>
+#include <poll.h>
+#include <config.h>
+#include <thread.h>
+#include <spinlock.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+extern int lm_enabled_logfiles_bitmask;
+extern void shutdown_server();
+
+/**
+ * A listening socket received from the old MaxScale
+ */
+typedef struct handoff_sock {
+	int		fd;		/*< The socket */
+	struct sockaddr_storage
+			addr;		/*< The address it is bound to */
+	socklen_t	addrlen;
+	struct handoff_sock
+			*next;
+} HANDOFF_SOCK;
+
+static HANDOFF_SOCK	*handoff_socks = NULL;	/*< Received, not yet taken */
+static SPINLOCK		handoff_socks_lock = SPINLOCK_INIT;
+static int		handoff_conn = -1;	/*< To the old MaxScale */
+static int		handoff_fd = -1;	/*< The handoff socket served */
+static char		*handoff_path = NULL;
+static int		handoff_over = 0;	/*< The listeners are handed over */
+static int		handoff_done = 0;	/*< The thread must exit */
+static void		*handoff_thr = NULL;
+static pthread_mutex_t	handoff_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	handoff_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Make the name of the handoff socket
+ *
+ * @param home_dir	The MaxScale home directory of the default socket
+ * @return		The name, to be freed by the caller, or NULL
+ */
+static char *
+handoff_socket_name(char *home_dir)
+{
+char	*name;
+
+	if (config_handoff_socket() != NULL)
+		return strdup(config_handoff_socket());
+	if ((name = (char *)malloc(strlen(home_dir) +
+				strlen(HANDOFF_SOCKET) + 2)) != NULL)
+		sprintf(name, "%s/%s", home_dir, HANDOFF_SOCKET);
+	return name;
+}
+
+/**
+ * Send a message of the handoff socket
+ *
+ * @param conn	The connection
+ * @param type	The message
+ * @param fd	The socket attached to the message or -1
+ * @return	0 on success or -1 on error
+ */
+static int
+handoff_send_msg(int conn, char type, int fd)
+{
+struct msghdr	msg;
+struct iovec	iov;
+struct cmsghdr	*cmsg;
+char		cbuf[CMSG_SPACE(sizeof(int))];
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &type;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (fd >= 0)
+	{
+		memset(cbuf, 0, sizeof(cbuf));
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	return sendmsg(conn, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+/**
+ * Receive a message of the handoff socket
+ *
+ * @param conn	The connection
+ * @param fd	The socket attached to the message, -1 if none
+ * @return	The message or 0 on error or end of file
+ */
+static char
+handoff_recv_msg(int conn, int *fd)
+{
+struct msghdr	msg;
+struct iovec	iov;
+struct cmsghdr	*cmsg;
+char		cbuf[CMSG_SPACE(sizeof(int))];
+char		type;
+
+	*fd = -1;
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &type;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	if (recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) != 1)
+		return 0;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+			cmsg->cmsg_type == SCM_RIGHTS &&
+			cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	return type;
+}
+
+/**
+ * Connect to the handoff socket of a running MaxScale and receive its
+ * listening sockets. Called before the services are started.
+ *
+ * @param home_dir	The MaxScale home directory
+ * @return		The number of sockets received, 0 if no MaxScale
+ *			runs or handoff is off
+ */
+int
+handoff_receive(char *home_dir)
+{
+struct sockaddr_un	addr;
+HANDOFF_SOCK		*sock;
+char			*name, type;
+int			conn, fd, n = 0;
+
+	if (!config_handoff() || (name = handoff_socket_name(home_dir)) == NULL)
+		return 0;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, name, sizeof(addr.sun_path) - 1);
+	free(name);
+
+	if ((conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return 0;
+	if (connect(conn, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		/*< No MaxScale serves the socket, a plain start */
+		close(conn);
+		return 0;
+	}
+
+	while ((type = handoff_recv_msg(conn, &fd)) == HANDOFF_MSG_LISTENER)
+	{
+		if (fd < 0)
+			continue;
+		if ((sock = (HANDOFF_SOCK *)calloc(1, sizeof(HANDOFF_SOCK))) == NULL)
+		{
+			close(fd);
+			continue;
+		}
+		sock->fd = fd;
+		sock->addrlen = sizeof(sock->addr);
+		if (getsockname(fd, (struct sockaddr *)&sock->addr,
+				&sock->addrlen) != 0)
+		{
+			close(fd);
+			free(sock);
+			continue;
+		}
+		sock->next = handoff_socks;
+		handoff_socks = sock;
+		n++;
+	}
+	if (type != HANDOFF_MSG_END)
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : The handoff of the listeners of the running "
+			"MaxScale at %s broke off, the listeners are bound "
+			"again.",
+			addr.sun_path)));
+		close(conn);
+		while ((sock = handoff_socks) != NULL)
+		{
+			handoff_socks = sock->next;
+			close(sock->fd);
+			free(sock);
+		}
+		return 0;
+	}
+	handoff_conn = conn;
+	LOGIF(LM, (skygw_log_write(
+		LOGFILE_MESSAGE,
+		"Received %d listening sockets from the running MaxScale at %s.",
+		n,
+		addr.sun_path)));
+	return n;
+}
+
+/**
+ * Compare the addresses of two sockets
+ *
+ * @return	Non-zero if the addresses are the same
+ */
+static int
+handoff_same_addr(struct sockaddr *a, struct sockaddr *b)
+{
+	if (a->sa_family != b->sa_family)
+		return 0;
+	switch (a->sa_family)
+	{
+	case AF_INET:
+		return ((struct sockaddr_in *)a)->sin_port ==
+			((struct sockaddr_in *)b)->sin_port &&
+			((struct sockaddr_in *)a)->sin_addr.s_addr ==
+			((struct sockaddr_in *)b)->sin_addr.s_addr;
+	case AF_INET6:
+		return ((struct sockaddr_in6 *)a)->sin6_port ==
+			((struct sockaddr_in6 *)b)->sin6_port &&
+			memcmp(&((struct sockaddr_in6 *)a)->sin6_addr,
+				&((struct sockaddr_in6 *)b)->sin6_addr,
+				sizeof(struct in6_addr)) == 0;
+	case AF_UNIX:
+		return strncmp(((struct sockaddr_un *)a)->sun_path,
+				((struct sockaddr_un *)b)->sun_path,
+				sizeof(((struct sockaddr_un *)a)->sun_path)) == 0;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * Take a listening socket received from the old MaxScale. Called by the
+ * protocol modules, and for the per thread copies, in place of binding a
+ * new socket.
+ *
+ * @param addr		The address the listener is to be bound to
+ * @param addrlen	The length of the address
+ * @return		The socket, bound and listening, or -1 if none was
+ *			received for the address
+ */
+int
+handoff_take(struct sockaddr *addr, socklen_t addrlen)
+{
+HANDOFF_SOCK	**pp, *sock;
+int		fd = -1;
+
+	if (handoff_socks == NULL)
+		return -1;
+	spinlock_acquire(&handoff_socks_lock);
+	for (pp = &handoff_socks; *pp != NULL; pp = &(*pp)->next)
+	{
+		if (handoff_same_addr((struct sockaddr *)&(*pp)->addr, addr))
+		{
+			sock = *pp;
+			*pp = sock->next;
+			fd = sock->fd;
+			free(sock);
+			break;
+		}
+	}
+	spinlock_release(&handoff_socks_lock);
+	return fd;
+}
+
+/**
+ * Collect the listening sockets of a service
+ *
+ * @param service	The service
+ * @param arg		The array of HANDOFF_MAX_SOCKETS sockets, its first
+ *			element is the number collected
+ */
+static void
+handoff_collect(SERVICE *service, void *arg)
+{
+int		*fds = (int *)arg;
+SERV_PROTOCOL	*port;
+
+	for (port = service->ports; port; port = port->next)
+	{
+		if (port->listener == NULL ||
+			port->listener->state != DCB_STATE_POLLING)
+			continue;
+		fds[0] += poll_listener_fds(port->listener, &fds[1 + fds[0]],
+						HANDOFF_MAX_SOCKETS - fds[0]);
+	}
+}
+
+/**
+ * Stop accepting on the listeners of a service, the sockets stay open for
+ * the new MaxScale
+ *
+ * @param service	The service
+ * @param arg		Unused
+ */
+static void
+handoff_stop_listeners(SERVICE *service, void *arg)
+{
+SERV_PROTOCOL	*port;
+
+	for (port = service->ports; port; port = port->next)
+	{
+		if (port->listener == NULL || port->listener->session == NULL)
+			continue;
+		poll_stop_listener(port->listener);
+		port->listener->session->state = SESSION_STATE_LISTENER_STOPPED;
+	}
+}
+
+/**
+ * Count the client sessions of a service, the session of each listener
+ * is left out
+ *
+ * @param service	The service
+ * @param arg		The count
+ */
+static void
+handoff_count_sessions(SERVICE *service, void *arg)
+{
+SERV_PROTOCOL	*port;
+int		n;
+
+	n = ts_stats_get(service->stats.counters, SERVICE_N_CURRENT);
+	for (port = service->ports; port; port = port->next)
+		if (port->listener && port->listener->session)
+			n--;
+	if (n > 0)
+		*(int *)arg += n;
+}
+
+/**
+ * Hand the listeners over to a new MaxScale
+ *
+ * @param conn	The connection from the new MaxScale
+ * @return	1 if the new MaxScale has taken over, 0 otherwise
+ */
+static int
+handoff_send(int conn)
+{
+struct ucred	cred;
+socklen_t	len = sizeof(cred);
+struct timeval	tv;
+int		fds[1 + HANDOFF_MAX_SOCKETS];
+int		i, fd;
+
+	if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 ||
+		cred.uid != geteuid())
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : A process of another user connected to the "
+			"handoff socket %s, it is not given the listeners.",
+			handoff_path)));
+		return 0;
+	}
+	fds[0] = 0;
+	serviceForEach(handoff_collect, fds);
+	for (i = 1; i <= fds[0]; i++)
+	{
+		if (handoff_send_msg(conn, HANDOFF_MSG_LISTENER, fds[i]) != 0)
+			return 0;
+	}
+	if (handoff_send_msg(conn, HANDOFF_MSG_END, -1) != 0)
+		return 0;
+
+	/*< The new MaxScale starts its services meanwhile */
+	tv.tv_sec = HANDOFF_TIMEOUT;
+	tv.tv_usec = 0;
+	setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (handoff_recv_msg(conn, &fd) != HANDOFF_MSG_TAKEN)
+	{
+		if (fd >= 0)
+			close(fd);
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : The new MaxScale did not take over the %d "
+			"listening sockets handed to it, this MaxScale goes "
+			"on accepting.",
+			fds[0])));
+		return 0;
+	}
+
+	serviceForEach(handoff_stop_listeners, NULL);
+	LOGIF(LM, (skygw_log_write(
+		LOGFILE_MESSAGE,
+		"The new MaxScale has taken over %d listening sockets, this "
+		"MaxScale no longer accepts and shuts down once its sessions "
+		"have closed, in %d seconds at most.",
+		fds[0],
+		config_handoff_drain_timeout())));
+	return 1;
+}
+
+/**
+ * Wait for the sessions to close once the listeners are handed over, then
+ * shut MaxScale down. The handoff lock is held.
+ */
+static void
+handoff_drain()
+{
+struct timespec	ts;
+time_t		deadline = time(NULL) + config_handoff_drain_timeout();
+int		n;
+
+	while (!handoff_done)
+	{
+		n = 0;
+		serviceForEach(handoff_count_sessions, &n);
+		if (n == 0 || time(NULL) >= deadline)
+		{
+			LOGIF(LM, (skygw_log_write(
+				LOGFILE_MESSAGE,
+				"Shutting down after the handoff with %d "
+				"sessions left.",
+				n)));
+			shutdown_server();
+			break;
+		}
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 1;
+		pthread_cond_timedwait(&handoff_cond, &handoff_lock, &ts);
+	}
+}
+
+/**
+ * The main loop of the handoff thread
+ *
+ * @param arg	Unused
+ */
+static void
+handoff_main(void *arg)
+{
+int	conn;
+
+	pthread_mutex_lock(&handoff_lock);
+	while (!handoff_done)
+	{
+		pthread_mutex_unlock(&handoff_lock);
+		/*< The accept times out each second, see handoff_start */
+		conn = accept4(handoff_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (conn >= 0)
+		{
+			if (handoff_send(conn))
+				handoff_over = 1;
+			close(conn);
+		}
+		pthread_mutex_lock(&handoff_lock);
+		if (handoff_over)
+			break;
+	}
+	if (handoff_over)
+	{
+		/*< The new MaxScale serves the socket now, its name is kept */
+		close(handoff_fd);
+		handoff_fd = -1;
+		handoff_drain();
+	}
+	pthread_mutex_unlock(&handoff_lock);
+}
+
+/**
+ * Tell the old MaxScale that the listeners are taken over and serve the
+ * handoff socket for the next MaxScale. Called once the services have
+ * been started and the polling threads run.
+ *
+ * @param home_dir	The MaxScale home directory
+ */
+void
+handoff_start(char *home_dir)
+{
+struct sockaddr_un	addr;
+struct timeval		tv;
+HANDOFF_SOCK		*sock;
+int			n = 0;
+
+	if (!config_handoff())
+		return;
+	if (handoff_conn >= 0)
+	{
+		spinlock_acquire(&handoff_socks_lock);
+		while ((sock = handoff_socks) != NULL)
+		{
+			handoff_socks = sock->next;
+			close(sock->fd);
+			free(sock);
+			n++;
+		}
+		spinlock_release(&handoff_socks_lock);
+		if (n > 0)
+		{
+			LOGIF(LM, (skygw_log_write(
+				LOGFILE_MESSAGE,
+				"Closed %d listening sockets of the old MaxScale "
+				"that no listener took.",
+				n)));
+		}
+		handoff_send_msg(handoff_conn, HANDOFF_MSG_TAKEN, -1);
+		close(handoff_conn);
+		handoff_conn = -1;
+	}
+
+	if ((handoff_path = handoff_socket_name(home_dir)) == NULL)
+		return;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, handoff_path, sizeof(addr.sun_path) - 1);
+	unlink(addr.sun_path);
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	if ((handoff_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+		bind(handoff_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+		chmod(addr.sun_path, 0600) != 0 ||
+		listen(handoff_fd, 1) != 0 ||
+		setsockopt(handoff_fd, SOL_SOCKET, SO_RCVTIMEO, &tv,
+				sizeof(tv)) != 0)
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : Unable to serve the handoff socket %s, due "
+			"%d, %s. The listeners can't be handed to a new "
+			"MaxScale.",
+			addr.sun_path,
+			errno,
+			strerror(errno))));
+		if (handoff_fd >= 0)
+			close(handoff_fd);
+		handoff_fd = -1;
+		return;
+	}
+	handoff_done = 0;
+	handoff_thr = thread_start(handoff_main, NULL);
+}
+
+/**
+ * Stop the handoff thread and wait for it to exit
+ */
+void
+handoff_stop()
+{
+void	*thr;
+
+	pthread_mutex_lock(&handoff_lock);
+	thr = handoff_thr;
+	handoff_done = 1;
+	pthread_cond_signal(&handoff_cond);
+	pthread_mutex_unlock(&handoff_lock);
+
+	if (thr != NULL)
+		thread_wait(thr);
+	handoff_thr = NULL;
+	if (handoff_fd >= 0)
+	{
+		close(handoff_fd);
+		handoff_fd = -1;
+		unlink(handoff_path);
+	}
+	free(handoff_path);
+	handoff_path = NULL;
+}
+
+/**
+ * Return whether the listeners have been handed to a new MaxScale, which
+ * then owns the pidfile too
+ *
+ * @return Non-zero once a new MaxScale has taken over
+ */
+int
+handoff_handed_over()
+{
+	return handoff_over;
+}
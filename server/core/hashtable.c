@@ -18,7 +18,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sched.h>
 #include <hashtable.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /**
  * @file hashtable.c General purpose hashtable routines
@@ -35,12 +39,26 @@
  * The linked lists are searched using the key comparison function that is
  * passed into the hash table creation routine.
  *
+ * The size passed in is the initial and minimum number of lists, the table
+ * doubles in size as the average chain gets long and halves again as entries
+ * are removed. A resize does not move the entries at once, the old lists are
+ * kept and emptied into the new ones a few at a time by each add and delete,
+ * lookups search both sets of lists until the move has completed.
+ *
  * By default the hash table keeps the original pointers that are passed in
  * for the keys and values, however two functions can be supplied to copy these
  * a copy function and a free function. Please note the same function is used for
  * the key and the value, if the actions required are different the called functions
  * must understand how to differenate the key and value.
  *
+ * Tables allocated with hashtable_alloc_type as HASHTABLE_OPEN store the
+ * entries inline in a single array instead, see the open addressing section
+ * below.
+ *
+ * Fetches take no lock at all, see hashtable_fetch. The remaining readers,
+ * the iterator and the statistics routines, and the writers use the locks
+ * described below.
+ *
  * The hash table implements a single write, multiple reader locking policy by
  * using a pair of counters and a spinlock. The spinlock is used to protect the
  * number of readers and writers counters when taking out locks. Releasing of
@@ -63,6 +81,45 @@ static	void hashtable_read_lock(HASHTABLE *table);
 static	void hashtable_read_unlock(HASHTABLE *table);
 static	void hashtable_write_lock(HASHTABLE *table);
 static	void hashtable_write_unlock(HASHTABLE *table);
+static	void hashtable_rehash_step(HASHTABLE *table);
+static	void hashtable_check_size(HASHTABLE *table);
+static	HASHENTRIES *hashtable_chain(HASHCHAINS *chains, int chain);
+static	void hashtable_count(HASHTABLE *table, int *nelems, int *longest);
+static	void hashtable_synchronize();
+static	void *hashtable_lookup(HASHTABLE *table, void *key, int hashkey);
+static	HASHOPEN *hashopen_alloc(int n_groups);
+static	void hashopen_free(HASHTABLE *table, HASHOPEN *open, int entries);
+static	int hashopen_add(HASHTABLE *table, void *key, void *value, int hashkey);
+static	int hashopen_delete(HASHTABLE *table, void *key, int hashkey);
+static	void *hashopen_fetch(HASHTABLE *table, void *key, int hashkey);
+static	void hashopen_count(HASHOPEN *open, int *nelems, int *longest);
+
+/**
+ * Return the chain a hash value belongs to in a table of a given size
+ */
+#define	HASH_CHAIN(hash, size)	((unsigned int)(hash) % (unsigned int)(size))
+
+/**
+ * Rounds a writer spins on a fetch in progress before it yields
+ */
+#define	HASHTABLE_SYNC_SPINS	1000
+
+/**
+ * The read state of a thread that has fetched from a hashtable. The epoch is
+ * written only by the owning thread and the record fills a cache line of its
+ * own, so a fetch never writes to memory shared with another thread. The
+ * records are never freed, a thread that exits leaves an idle record.
+ */
+typedef struct hashreader {
+	volatile unsigned long	epoch;		/*< Epoch the fetch began in, 0 if idle */
+	struct hashreader	*next;		/*< All the registered readers */
+	char			pad[64 - sizeof(unsigned long) - sizeof(void *)];
+} HASHREADER;
+
+static	volatile unsigned long	hash_epoch = 1;		/*< The global read epoch */
+static	HASHREADER		*hashReaders = NULL;
+static	SPINLOCK		readerlock = SPINLOCK_INIT;
+static	__thread HASHREADER	*thread_reader = NULL;
 
 /**
  * Special null function used as default memory allfunctions in the hashtable
@@ -78,6 +135,28 @@ nullfn(void *data)
 	return data;
 }
 
+/**
+ * Allocate a set of empty chains
+ *
+ * @param size		The number of chains
+ * @param old		The chains these replace or NULL
+ * @return		The chains or NULL if they could not be allocated
+ */
+static HASHCHAINS *
+hashchains_alloc(int size, HASHCHAINS *old)
+{
+HASHCHAINS	*chains;
+
+	if ((chains = (HASHCHAINS *)malloc(sizeof(HASHCHAINS)
+				+ size * sizeof(HASHENTRIES *))) == NULL)
+		return NULL;
+	chains->size = size;
+	chains->entries = (HASHENTRIES **)(chains + 1);
+	chains->old = old;
+	memset(chains->entries, 0, size * sizeof(HASHENTRIES *));
+	return chains;
+}
+
 /**
  * Allocate a new hash table
  *
@@ -88,8 +167,25 @@ nullfn(void *data)
  */
 HASHTABLE *
 hashtable_alloc(int size, int (*hashfn)(), int (*cmpfn)())
+{
+	return hashtable_alloc_type(size, hashfn, cmpfn, HASHTABLE_CHAINED);
+}
+
+/**
+ * Allocate a new hash table of a given type. For a HASHTABLE_OPEN table the
+ * size is the number of entries the table should hold without growing.
+ *
+ * @param size		The size of the hash table
+ * @param hashfn	The user supplied hash function
+ * @param cmpfn		The user supplied key comparison function
+ * @param type		HASHTABLE_CHAINED or HASHTABLE_OPEN
+ * @return The hashtable table
+ */
+HASHTABLE *
+hashtable_alloc_type(int size, int (*hashfn)(), int (*cmpfn)(), int type)
 {
 HASHTABLE 	*rval;
+int		n_groups = 1;
 
 	if ((rval = malloc(sizeof(HASHTABLE))) == NULL)
 		return NULL;
@@ -98,7 +194,9 @@ HASHTABLE 	*rval;
         rval->ht_chk_top = CHK_NUM_HASHTABLE;
         rval->ht_chk_tail = CHK_NUM_HASHTABLE;
 #endif
-	rval->hashsize = size;
+	rval->minsize = size;
+	rval->n_elements = 0;
+	rval->rehashidx = 0;
 	rval->hashfn = hashfn;
 	rval->cmpfn = cmpfn;
 	rval->kcopyfn = nullfn;
@@ -108,31 +206,47 @@ HASHTABLE 	*rval;
 	rval->n_readers = 0;
 	rval->writelock = 0;
 	spinlock_init(&rval->spin);
-	if ((rval->entries = (HASHENTRIES **)calloc(size, sizeof(HASHENTRIES *))) == NULL)
+	rval->chains = NULL;
+	rval->open = NULL;
+	if (type == HASHTABLE_OPEN)
+	{
+		while (n_groups * HASHOPEN_GROUP * HASHOPEN_MAX_LOAD_N
+				< size * HASHOPEN_MAX_LOAD_D)
+			n_groups *= 2;
+		/*< The minimum size of an open table is in groups */
+		if (size > 0)
+			rval->minsize = n_groups;
+		if ((rval->open = hashopen_alloc(n_groups)) == NULL)
+		{
+			free(rval);
+			return NULL;
+		}
+		return rval;
+	}
+	if ((rval->chains = hashchains_alloc(size, NULL)) == NULL)
 	{
 		free(rval);
 		return NULL;
 	}
-	memset(rval->entries, 0, size * sizeof(HASHENTRIES *));
 
 	return rval;
 }
 
 /**
- * Delete an entire hash table
+ * Free the entries of a set of chains
  *
- * @param	table	The hash table to delete
+ * @param table		The hash table
+ * @param chains	The chains
  */
-void
-hashtable_free(HASHTABLE *table)
+static void
+hashtable_free_chains(HASHTABLE *table, HASHCHAINS *chains)
 {
 int		i;
 HASHENTRIES	*entry, *ptr;
 
-	hashtable_write_lock(table);
-	for (i = 0; i < table->hashsize; i++)
+	for (i = 0; i < chains->size; i++)
 	{
-		entry = table->entries[i];
+		entry = chains->entries[i];
 		while (entry)
 		{
 			ptr = entry->next;
@@ -142,7 +256,27 @@ HASHENTRIES	*entry, *ptr;
 			entry = ptr;
 		}
 	}
-	free(table->entries);
+	free(chains);
+}
+
+/**
+ * Delete an entire hash table
+ *
+ * @param	table	The hash table to delete
+ */
+void
+hashtable_free(HASHTABLE *table)
+{
+	hashtable_write_lock(table);
+	if (table->open)
+	{
+		hashopen_free(table, table->open, 1);
+		free(table);
+		return;
+	}
+	if (table->chains->old)
+		hashtable_free_chains(table, table->chains->old);
+	hashtable_free_chains(table, table->chains);
 	free(table);
 }
 
@@ -170,6 +304,44 @@ hashtable_memory_fns(HASHTABLE *table, HASHMEMORYFN kcopyfn, HASHMEMORYFN vcopyf
 		table->vfreefn = vfreefn;
 }
 
+/**
+ * Find the link that points to the entry with a given key. While the table
+ * is being rehashed the key may be in the old chains or the current chains,
+ * the old chains are searched first since entries are copied to the current
+ * chains before they are removed from the old ones.
+ *
+ * @param table		The hash table
+ * @param chains	The chains to search
+ * @param key		The key to find
+ * @param hashkey	The hash value of the key
+ * @return		The link to the entry or NULL if the key is not found
+ */
+static HASHENTRIES **
+hashtable_find(HASHTABLE *table, HASHCHAINS *chains, void *key, int hashkey)
+{
+HASHENTRIES	**link;
+HASHCHAINS	*old;
+
+	if ((old = chains->old) != NULL)
+	{
+		link = &old->entries[HASH_CHAIN(hashkey, old->size)];
+		while (*link)
+		{
+			if (table->cmpfn(key, (*link)->key) == 0)
+				return link;
+			link = &(*link)->next;
+		}
+	}
+	link = &chains->entries[HASH_CHAIN(hashkey, chains->size)];
+	while (*link)
+	{
+		if (table->cmpfn(key, (*link)->key) == 0)
+			return link;
+		link = &(*link)->next;
+	}
+	return NULL;
+}
+
 /**
  * Add an item to the hash table.
  *
@@ -181,61 +353,74 @@ hashtable_memory_fns(HASHTABLE *table, HASHMEMORYFN kcopyfn, HASHMEMORYFN vcopyf
 int
 hashtable_add(HASHTABLE *table, void *key, void *value)
 {
-        int		hashkey;
-        HASHENTRIES	*entry;
+int		hashkey;
+HASHENTRIES	*ptr, **chain;
 
-        if (key == NULL || value == NULL)
-            return 0;
+	if (key == NULL || value == NULL)
+		return 0;
+
+	if (table->minsize <= 0)
+		return 0;
+	hashkey = table->hashfn(key);
 
-        if (table->hashsize <= 0) {            
-            return 0;
-        } else {
-            hashkey = table->hashfn(key) % table->hashsize;
-        }
 	hashtable_write_lock(table);
-	entry = table->entries[hashkey % table->hashsize];
-	while (entry && table->cmpfn(key, entry->key) != 0)
+	if (table->open)
 	{
-		entry = entry->next;
+		int	rval = hashopen_add(table, key, value, hashkey);
+
+		hashtable_write_unlock(table);
+		return rval;
 	}
-	if (entry && table->cmpfn(key, entry->key) == 0)
+	hashtable_rehash_step(table);
+	if (hashtable_find(table, table->chains, key, hashkey) != NULL)
 	{
 		/* Duplicate key value */
 		hashtable_write_unlock(table);
 		return 0;
 	}
-	else
-	{
-		HASHENTRIES	*ptr = (HASHENTRIES *)malloc(sizeof(HASHENTRIES));
-		if (ptr == NULL)
-		{
-			hashtable_write_unlock(table);
-			return 0;
-		}
 
-		/* copy the key */
-		ptr->key = table->kcopyfn(key);
+	if ((ptr = (HASHENTRIES *)malloc(sizeof(HASHENTRIES))) == NULL)
+	{
+		hashtable_write_unlock(table);
+		return 0;
+	}
 
-		/* check succesfull key copy */
-		if ( ptr->key  == NULL) {
-			return 0;
-		}
+	/* copy the key */
+	ptr->key = table->kcopyfn(key);
 
-		/* copy the value */
-		ptr->value = table->vcopyfn(value);
+	/* check succesfull key copy */
+	if (ptr->key == NULL)
+	{
+		free(ptr);
+		hashtable_write_unlock(table);
+		return 0;
+	}
 
-		/* check succesfull value copy */
-		if  ( ptr->value == NULL) {
-			/* remove the key ! */
-			table->kfreefn(ptr->key);
+	/* copy the value */
+	ptr->value = table->vcopyfn(value);
 
-			/* value not copied, return */
-			return 0;
-		}
+	/* check succesfull value copy */
+	if (ptr->value == NULL)
+	{
+		/* remove the key ! */
+		table->kfreefn(ptr->key);
+		free(ptr);
 
-		ptr->next = table->entries[hashkey % table->hashsize];
-		table->entries[hashkey % table->hashsize] = ptr;
+		/* value not copied, return */
+		hashtable_write_unlock(table);
+		return 0;
 	}
+
+	/*
+	 * New entries always go into the current chains. The entry must be
+	 * complete before a fetch can reach it.
+	 */
+	chain = &table->chains->entries[HASH_CHAIN(hashkey, table->chains->size)];
+	ptr->next = *chain;
+	__sync_synchronize();
+	*chain = ptr;
+	table->n_elements++;
+	hashtable_check_size(table);
 	hashtable_write_unlock(table);
 	return 1;
 }
@@ -250,60 +435,108 @@ hashtable_add(HASHTABLE *table, void *key, void *value)
 int
 hashtable_delete(HASHTABLE *table, void *key)
 {
-int		hashkey = table->hashfn(key) % table->hashsize;
-HASHENTRIES	*entry, *ptr;
+int		hashkey;
+HASHENTRIES	**link, *entry;
+
+	if (table->minsize <= 0)
+		return 0;
+	hashkey = table->hashfn(key);
 
 	hashtable_write_lock(table);
-	entry = table->entries[hashkey % table->hashsize];
-	while (entry && entry->key && table->cmpfn(key, entry->key) != 0)
+	if (table->open)
 	{
-		entry = entry->next;
+		int	rval = hashopen_delete(table, key, hashkey);
+
+		hashtable_write_unlock(table);
+		return rval;
 	}
-	if (entry == NULL)
+	hashtable_rehash_step(table);
+	if ((link = hashtable_find(table, table->chains, key, hashkey)) == NULL)
 	{
 		/* Not found */
 		hashtable_write_unlock(table);
 		return 0;
 	}
+	/*< The unlinked entry keeps its next pointer for fetches still on it */
+	entry = *link;
+	*link = entry->next;
+	hashtable_synchronize();
+	table->kfreefn(entry->key);
+	table->vfreefn(entry->value);
+	free(entry);
+	table->n_elements--;
+	hashtable_check_size(table);
+	hashtable_write_unlock(table);
+	return 1;
+}
 
-	if (entry == table->entries[hashkey % table->hashsize])
-	{
-		/* We are removing from the first entry */
-		table->entries[hashkey % table->hashsize] = entry->next;
-		table->kfreefn(entry->key);
-		table->vfreefn(entry->value);
+/**
+ * Search the table for the value of a key. A writer may unlink entries
+ * while the search is on the chains, so every link is read only once, a
+ * link read again may already point past the entry or be NULL.
+ *
+ * @param table		The hash table
+ * @param key		The key value
+ * @param hashkey	The hash value of the key
+ * @return The value or NULL if the key was not found
+ */
+static void *
+hashtable_lookup(HASHTABLE *table, void *key, int hashkey)
+{
+HASHCHAINS	*chains, *old;
+HASHENTRIES	*entry;
 
-                if (entry->next != NULL) {
-                    entry->key = entry->next->key;
-                    entry->value = entry->next->value;
-                } else {
-                    entry->key = NULL;
-                    entry->value = NULL;
-                }
-		free(entry);
-	}
-	else
+	if (table->open)
+		return hashopen_fetch(table, key, hashkey);
+	chains = table->chains;
+	if ((old = chains->old) != NULL)
 	{
-		ptr = table->entries[hashkey % table->hashsize];
-		while (ptr && ptr->next != entry)
-			ptr = ptr->next;
-		if (ptr == NULL)
+		for (entry = old->entries[HASH_CHAIN(hashkey, old->size)];
+				entry; entry = entry->next)
 		{
-			hashtable_write_unlock(table);
-			return 0;	/* This should never happen */
+			if (table->cmpfn(key, entry->key) == 0)
+				return entry->value;
 		}
-		ptr->next = entry->next;
-		table->kfreefn(entry->key);
-		table->vfreefn(entry->value);
-		free(entry);
 	}
-	hashtable_write_unlock(table);
-	return 1;
+	for (entry = chains->entries[HASH_CHAIN(hashkey, chains->size)];
+			entry; entry = entry->next)
+	{
+		if (table->cmpfn(key, entry->key) == 0)
+			return entry->value;
+	}
+	return NULL;
+}
+
+/**
+ * Register the calling thread as a hashtable reader
+ *
+ * @return The read state of the thread or NULL if it could not be allocated
+ */
+static HASHREADER *
+hashtable_reader_init()
+{
+HASHREADER	*self;
+
+	if ((self = (HASHREADER *)calloc(1, sizeof(HASHREADER))) == NULL)
+		return NULL;
+	spinlock_acquire(&readerlock);
+	self->next = hashReaders;
+	__sync_synchronize();
+	hashReaders = self;
+	spinlock_release(&readerlock);
+	thread_reader = self;
+	return self;
 }
 
 /**
  * Fetch an item with a given key value from the hash table
  *
+ * The fetch takes no lock. The calling thread records the global epoch in
+ * its own read state for the duration of the search and writers wait for
+ * every search that began before an entry was unlinked to complete before
+ * they free it, see hashtable_synchronize. A thread that cannot allocate a
+ * read state falls back to the read lock.
+ *
  * @param table		The hash table
  * @param key		The key value
  * @return The item or NULL if the item was not found
@@ -311,58 +544,631 @@ HASHENTRIES	*entry, *ptr;
 void *
 hashtable_fetch(HASHTABLE *table, void *key)
 {
-int		hashkey = table->hashfn(key) % table->hashsize;
-HASHENTRIES	*entry;
+int		hashkey;
+HASHREADER	*self;
+unsigned long	prev;
+void		*rval = NULL;
 
-	hashtable_read_lock(table);
-	entry = table->entries[hashkey % table->hashsize];
-	while (entry && entry->key && table->cmpfn(key, entry->key) != 0)
+	if (table->minsize <= 0)
+		return NULL;
+	hashkey = table->hashfn(key);
+
+	if ((self = thread_reader) == NULL && (self = hashtable_reader_init()) == NULL)
 	{
-		entry = entry->next;
+		hashtable_read_lock(table);
+		rval = hashtable_lookup(table, key, hashkey);
+		hashtable_read_unlock(table);
+		return rval;
 	}
-	if (entry == NULL)
+
+	/*< A fetch from a key comparison keeps the outer epoch */
+	if ((prev = self->epoch) == 0)
 	{
-		hashtable_read_unlock(table);
-		return NULL;
+		self->epoch = hash_epoch;
+		/*< Order the epoch store before the loads of the chains */
+		__sync_synchronize();
 	}
-	else
+	rval = hashtable_lookup(table, key, hashkey);
+	__asm__ __volatile__("" ::: "memory");
+	self->epoch = prev;
+	return rval;
+}
+
+/**
+ * Wait for every fetch that may still see memory unlinked from a table.
+ * Called by writers after unlinking and before freeing, with the write
+ * lock held.
+ *
+ * The global epoch is advanced, a fetch that records the new epoch began
+ * after the unlink and can not reach the unlinked memory, so only fetches
+ * that recorded an earlier epoch are waited for. Fetches are short, they
+ * hold no locks and never wait for a writer, but a reader that was
+ * preempted in a fetch only finishes it when the writer yields the
+ * processor.
+ */
+static void
+hashtable_synchronize()
+{
+HASHREADER	*reader;
+unsigned long	epoch;
+int		spins;
+
+	/*< The locked add also orders the unlink before the reads below */
+	epoch = __sync_fetch_and_add(&hash_epoch, 1);
+	for (reader = hashReaders; reader; reader = reader->next)
 	{
-		hashtable_read_unlock(table);
-		return entry->value;
+		for (spins = 0; reader->epoch != 0 && reader->epoch <= epoch;
+				spins++)
+		{
+			if (spins > HASHTABLE_SYNC_SPINS)
+				sched_yield();
+		}
 	}
 }
 
 /**
- * Print hash table statistics to the standard output
+ * Start moving the entries to a new set of chains. Called with the write
+ * lock held and only when no rehash is in progress. If the new chains cannot
+ * be allocated the table simply keeps its current size.
  *
  * @param table		The hash table
+ * @param size		The new number of chains
  */
-void
-hashtable_stats(HASHTABLE *table)
+static void
+hashtable_resize(HASHTABLE *table, int size)
+{
+HASHCHAINS	*chains;
+
+	if ((chains = hashchains_alloc(size, table->chains)) == NULL)
+		return;
+	table->rehashidx = 0;
+	__sync_synchronize();
+	table->chains = chains;
+}
+
+/**
+ * Grow or shrink the table if the load factor is out of bounds. Called with
+ * the write lock held.
+ *
+ * @param table		The hash table
+ */
+static void
+hashtable_check_size(HASHTABLE *table)
+{
+int	size = table->chains->size;
+
+	if (table->chains->old)
+		return;
+	if (table->n_elements > size * HASHTABLE_MAX_LOAD)
+		hashtable_resize(table, size * 2);
+	else if (table->n_elements * HASHTABLE_MIN_LOAD < size &&
+			size / 2 >= table->minsize)
+		hashtable_resize(table, size / 2);
+}
+
+/**
+ * Copy the entries of an old chain to the current chains. The copies are
+ * all allocated before any is linked in, so that a failure leaves the entry
+ * in the old chain only.
+ *
+ * @param table		The hash table
+ * @param entry		The first entry of the old chain
+ * @return		Non-zero if the chain was copied
+ */
+static int
+hashtable_copy_chain(HASHTABLE *table, HASHENTRIES *entry)
+{
+HASHCHAINS	*chains = table->chains;
+HASHENTRIES	*copies = NULL, *ptr, **chain;
+
+	for (; entry; entry = entry->next)
+	{
+		if ((ptr = (HASHENTRIES *)malloc(sizeof(HASHENTRIES))) == NULL)
+		{
+			while (copies)
+			{
+				ptr = copies->next;
+				free(copies);
+				copies = ptr;
+			}
+			return 0;
+		}
+		ptr->key = entry->key;
+		ptr->value = entry->value;
+		ptr->next = copies;
+		copies = ptr;
+	}
+	while ((ptr = copies) != NULL)
+	{
+		copies = ptr->next;
+		chain = &chains->entries[HASH_CHAIN(table->hashfn(ptr->key), chains->size)];
+		ptr->next = *chain;
+		__sync_synchronize();
+		*chain = ptr;
+	}
+	return 1;
+}
+
+/**
+ * Move the entries of the next few old chains into the current chains.
+ * Called with the write lock held, the cost of a resize is spread over the
+ * updates that follow it so that no single call has to move the whole table.
+ *
+ * Entries are not relinked into the current chains since a fetch may be
+ * walking the old chain, instead they are copied, the old chain is detached
+ * and freed once no fetch can still be on it.
+ *
+ * @param table		The hash table
+ */
+static void
+hashtable_rehash_step(HASHTABLE *table)
+{
+HASHCHAINS	*old = table->chains->old;
+HASHENTRIES	*moved[HASHTABLE_REHASH_STEP], *entry, *next;
+int		i, n = 0, empty = 0;
+
+	if (old == NULL)
+		return;
+	/*< Bound the empty chains visited as well, a shrunk table is sparse */
+	while (table->rehashidx < old->size && n < HASHTABLE_REHASH_STEP &&
+			empty < HASHTABLE_REHASH_STEP * 10)
+	{
+		if ((entry = old->entries[table->rehashidx]) == NULL)
+		{
+			empty++;
+			table->rehashidx++;
+			continue;
+		}
+		if (!hashtable_copy_chain(table, entry))
+			break;
+		__sync_synchronize();
+		old->entries[table->rehashidx++] = NULL;
+		moved[n++] = entry;
+	}
+	if (table->rehashidx >= old->size)
+		table->chains->old = NULL;
+	if (n == 0 && table->chains->old)
+		return;
+
+	hashtable_synchronize();
+	for (i = 0; i < n; i++)
+	{
+		for (entry = moved[i]; entry; entry = next)
+		{
+			next = entry->next;
+			free(entry);
+		}
+	}
+	if (table->chains->old == NULL)
+		free(old);
+}
+
+/**
+ * Return one of the chains of the table, the chains that are still being
+ * rehashed come before the current chains.
+ *
+ * @param chains	The chains of the table
+ * @param chain		The chain index, 0 to the number of old and current chains
+ * @return		The first entry of the chain
+ */
+static HASHENTRIES *
+hashtable_chain(HASHCHAINS *chains, int chain)
+{
+	if (chains->old)
+	{
+		if (chain < chains->old->size)
+			return chains->old->entries[chain];
+		chain -= chains->old->size;
+	}
+	return chains->entries[chain];
+}
+
+/**
+ * Return the number of old and current chains of the table
+ */
+#define	HASH_N_CHAINS(chains)	((chains)->size + ((chains)->old ? (chains)->old->size : 0))
+
+/**
+ * Count the entries and the longest chain, called with the table locked.
+ * For an open addressing table the longest chain is the longest probe, in
+ * groups, that a fetch of one of the entries makes.
+ *
+ * @param table		The hash table
+ * @param nelems	Set to the number of entries
+ * @param longest	Set to the length of the longest chain
+ */
+static void
+hashtable_count(HASHTABLE *table, int *nelems, int *longest)
 {
-int		total, longest, i, j;
 HASHENTRIES	*entries;
+int		i, j;
 
-	printf("Hashtable: %p, size %d\n", table, table->hashsize);
-	total = 0;
-	longest = 0;
-	hashtable_read_lock(table);
-	for (i = 0; i < table->hashsize; i++)
+	if (table->open)
+	{
+		hashopen_count(table->open, nelems, longest);
+		return;
+	}
+	*nelems = 0;
+	*longest = 0;
+	for (i = 0; i < HASH_N_CHAINS(table->chains); i++)
 	{
 		j = 0;
-		entries = table->entries[i];
+		entries = hashtable_chain(table->chains, i);
 		while (entries)
 		{
 			j++;
 			entries = entries->next;
 		}
-		total += j;
-		if (j > longest)
-			longest = j;
+		*nelems += j;
+		if (j > *longest)
+			*longest = j;
+	}
+}
+
+/*
+ * The open addressing tables
+ *
+ * The slots are arranged in groups of HASHOPEN_GROUP, with a control byte
+ * per slot held in a separate array. The control byte of a slot in use holds
+ * 7 bits of the mixed hash of its key, the other two values mark free slots
+ * and slots of deleted entries. A search starts at the group selected by the
+ * hash and compares the 7 bits against every control byte of the group at
+ * once, using SSE2 where it is available, only the slots that match have
+ * their full hash and key compared. The search moves on to the next group in
+ * a triangular sequence, which visits every group of a power of two sized
+ * table, and stops at the first group that has a free slot.
+ *
+ * Entries never move once added, a delete only marks the control byte, so a
+ * fetch can search the table without a lock in the same way as the chains.
+ * A table that fills with used or deleted slots is rebuilt in one go, at
+ * twice the size if it holds enough entries, and published with a single
+ * pointer store.
+ */
+
+/** Mix the user hash, the tables use both the low and the high bits */
+#define	HASHOPEN_MIX(hash)	((unsigned int)(hash) * 2654435761U)
+#define	HASHOPEN_H2(mixed)	((unsigned char)((mixed) >> 25))
+
+/**
+ * Allocate an empty open addressing table, the control bytes are aligned
+ * for group loads.
+ *
+ * @param n_groups	The number of groups, a power of two
+ * @return		The table or NULL if it could not be allocated
+ */
+static HASHOPEN *
+hashopen_alloc(int n_groups)
+{
+HASHOPEN	*open;
+void		*mem;
+int		size = n_groups * HASHOPEN_GROUP;
+
+	if ((open = (HASHOPEN *)malloc(sizeof(HASHOPEN))) == NULL)
+		return NULL;
+	if (posix_memalign(&mem, HASHOPEN_GROUP, size + size * sizeof(HASHSLOT)) != 0)
+	{
+		free(open);
+		return NULL;
+	}
+	open->n_groups = n_groups;
+	open->n_used = 0;
+	open->ctrl = (unsigned char *)mem;
+	open->slots = (HASHSLOT *)(open->ctrl + size);
+	memset(open->ctrl, HASHOPEN_EMPTY, size);
+	return open;
+}
+
+/**
+ * Free an open addressing table
+ *
+ * @param table		The hash table
+ * @param open		The open addressing table
+ * @param entries	Non-zero to free the keys and values as well
+ */
+static void
+hashopen_free(HASHTABLE *table, HASHOPEN *open, int entries)
+{
+int	i;
+
+	for (i = 0; entries && i < HASHOPEN_SIZE(open); i++)
+	{
+		if (HASHOPEN_FULL(open->ctrl[i]))
+		{
+			table->kfreefn(open->slots[i].key);
+			table->vfreefn(open->slots[i].value);
+		}
+	}
+	free(open->ctrl);
+	free(open);
+}
+
+/**
+ * Return a bit for every control byte of a group that has a given value
+ *
+ * @param group		The control bytes of the group
+ * @param byte		The value to match
+ * @return		The mask of matching slots
+ */
+static unsigned int
+hashopen_match(const unsigned char *group, unsigned char byte)
+{
+#if defined(__SSE2__)
+	__m128i	ctrl = _mm_load_si128((const __m128i *)group);
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)byte)));
+#else
+unsigned int	mask = 0;
+int		i;
+
+	for (i = 0; i < HASHOPEN_GROUP; i++)
+		if (group[i] == byte)
+			mask |= 1 << i;
+	return mask;
+#endif
+}
+
+/**
+ * Return a bit for every free or deleted slot of a group, these are the
+ * control bytes with the top bit set.
+ *
+ * @param group		The control bytes of the group
+ * @return		The mask of slots not in use
+ */
+static unsigned int
+hashopen_match_unused(const unsigned char *group)
+{
+#if defined(__SSE2__)
+	return _mm_movemask_epi8(_mm_load_si128((const __m128i *)group));
+#else
+unsigned int	mask = 0;
+int		i;
+
+	for (i = 0; i < HASHOPEN_GROUP; i++)
+		if (!HASHOPEN_FULL(group[i]))
+			mask |= 1 << i;
+	return mask;
+#endif
+}
+
+/**
+ * Find the slot that holds a key
+ *
+ * @param table		The hash table
+ * @param open		The open addressing table
+ * @param key		The key to find
+ * @param hashkey	The hash value of the key
+ * @return		The slot index or -1 if the key is not found
+ */
+static int
+hashopen_find(HASHTABLE *table, HASHOPEN *open, void *key, int hashkey)
+{
+unsigned int	mixed = HASHOPEN_MIX(hashkey), mask;
+unsigned char	*ctrl;
+int		group, probe, slot;
+
+	group = mixed & (open->n_groups - 1);
+	for (probe = 1; probe <= open->n_groups; probe++)
+	{
+		ctrl = &open->ctrl[group * HASHOPEN_GROUP];
+		mask = hashopen_match(ctrl, HASHOPEN_H2(mixed));
+		while (mask)
+		{
+			slot = group * HASHOPEN_GROUP + __builtin_ctz(mask);
+			if (open->slots[slot].hash == hashkey &&
+					table->cmpfn(key, open->slots[slot].key) == 0)
+				return slot;
+			mask &= mask - 1;
+		}
+		if (hashopen_match(ctrl, HASHOPEN_EMPTY))
+			return -1;
+		group = (group + probe) & (open->n_groups - 1);
+	}
+	return -1;
+}
+
+/**
+ * Place an entry in the first free or deleted slot of its probe sequence,
+ * the table must have such a slot. The slot is complete before its control
+ * byte makes it visible.
+ *
+ * @param open		The open addressing table
+ * @param hashkey	The hash value of the key
+ * @param key		The key
+ * @param value		The value
+ */
+static void
+hashopen_place(HASHOPEN *open, int hashkey, void *key, void *value)
+{
+unsigned int	mixed = HASHOPEN_MIX(hashkey), mask;
+int		group, probe, slot;
+
+	group = mixed & (open->n_groups - 1);
+	for (probe = 1; (mask = hashopen_match_unused(
+			&open->ctrl[group * HASHOPEN_GROUP])) == 0; probe++)
+		group = (group + probe) & (open->n_groups - 1);
+	slot = group * HASHOPEN_GROUP + __builtin_ctz(mask);
+	if (open->ctrl[slot] == HASHOPEN_EMPTY)
+		open->n_used++;
+	open->slots[slot].hash = hashkey;
+	open->slots[slot].key = key;
+	open->slots[slot].value = value;
+	__sync_synchronize();
+	open->ctrl[slot] = HASHOPEN_H2(mixed);
+}
+
+/**
+ * Rebuild the open addressing table with a new number of groups, dropping
+ * the deleted slots. Called with the write lock held, if the new table can
+ * not be allocated the current one is kept.
+ *
+ * @param table		The hash table
+ * @param n_groups	The new number of groups
+ */
+static void
+hashopen_resize(HASHTABLE *table, int n_groups)
+{
+HASHOPEN	*old = table->open, *open;
+int		i;
+
+	if ((open = hashopen_alloc(n_groups)) == NULL)
+		return;
+	for (i = 0; i < HASHOPEN_SIZE(old); i++)
+	{
+		if (HASHOPEN_FULL(old->ctrl[i]))
+			hashopen_place(open, old->slots[i].hash, old->slots[i].key,
+					old->slots[i].value);
+	}
+	__sync_synchronize();
+	table->open = open;
+	hashtable_synchronize();
+	hashopen_free(table, old, 0);
+}
+
+/**
+ * Add an entry to an open addressing table, called with the write lock held
+ *
+ * @param table		The hash table
+ * @param key		The key of the item
+ * @param value		The value for the item
+ * @param hashkey	The hash value of the key
+ * @return		The number of items added
+ */
+static int
+hashopen_add(HASHTABLE *table, void *key, void *value, int hashkey)
+{
+HASHOPEN	*open = table->open;
+void		*k, *v;
+
+	if (hashopen_find(table, open, key, hashkey) != -1)
+		return 0;
+	if ((k = table->kcopyfn(key)) == NULL)
+		return 0;
+	if ((v = table->vcopyfn(value)) == NULL)
+	{
+		table->kfreefn(k);
+		return 0;
+	}
+	if ((open->n_used + 1) * HASHOPEN_MAX_LOAD_D
+				> HASHOPEN_SIZE(open) * HASHOPEN_MAX_LOAD_N)
+	{
+		/*< Rebuild at the same size if the slots are mostly deleted ones */
+		if ((table->n_elements + 1) * 2 > HASHOPEN_SIZE(open))
+			hashopen_resize(table, open->n_groups * 2);
+		else
+			hashopen_resize(table, open->n_groups);
+		open = table->open;
+		if (table->n_elements == HASHOPEN_SIZE(open))
+		{
+			table->kfreefn(k);
+			table->vfreefn(v);
+			return 0;
+		}
 	}
+	hashopen_place(open, hashkey, k, v);
+	table->n_elements++;
+	return 1;
+}
+
+/**
+ * Delete an entry from an open addressing table, called with the write lock
+ * held. A slot in a group that has a free slot is marked free rather than
+ * deleted, no search continues past such a group.
+ *
+ * @param table		The hash table
+ * @param key		The key value of the item to remove
+ * @param hashkey	The hash value of the key
+ * @return		The number of items deleted
+ */
+static int
+hashopen_delete(HASHTABLE *table, void *key, int hashkey)
+{
+HASHOPEN	*open = table->open;
+int		slot;
+
+	if ((slot = hashopen_find(table, open, key, hashkey)) == -1)
+		return 0;
+	if (hashopen_match(&open->ctrl[slot & ~(HASHOPEN_GROUP - 1)], HASHOPEN_EMPTY))
+	{
+		open->ctrl[slot] = HASHOPEN_EMPTY;
+		open->n_used--;
+	}
+	else
+		open->ctrl[slot] = HASHOPEN_DELETED;
+	table->n_elements--;
+	hashtable_synchronize();
+	table->kfreefn(open->slots[slot].key);
+	table->vfreefn(open->slots[slot].value);
+	if (table->n_elements * HASHTABLE_MIN_LOAD < HASHOPEN_SIZE(open) &&
+			open->n_groups / 2 >= table->minsize)
+		hashopen_resize(table, open->n_groups / 2);
+	return 1;
+}
+
+/**
+ * Fetch the value of a key from an open addressing table
+ *
+ * @param table		The hash table
+ * @param key		The key value
+ * @param hashkey	The hash value of the key
+ * @return The value or NULL if the key was not found
+ */
+static void *
+hashopen_fetch(HASHTABLE *table, void *key, int hashkey)
+{
+HASHOPEN	*open = table->open;
+int		slot;
+
+	if ((slot = hashopen_find(table, open, key, hashkey)) == -1)
+		return NULL;
+	return open->slots[slot].value;
+}
+
+/**
+ * Count the entries of an open addressing table and the longest probe
+ *
+ * @param open		The open addressing table
+ * @param nelems	Set to the number of entries
+ * @param longest	Set to the number of groups of the longest probe
+ */
+static void
+hashopen_count(HASHOPEN *open, int *nelems, int *longest)
+{
+unsigned int	mixed;
+int		i, group, probe;
+
+	*nelems = 0;
+	*longest = 0;
+	for (i = 0; i < HASHOPEN_SIZE(open); i++)
+	{
+		if (!HASHOPEN_FULL(open->ctrl[i]))
+			continue;
+		(*nelems)++;
+		mixed = HASHOPEN_MIX(open->slots[i].hash);
+		group = mixed & (open->n_groups - 1);
+		for (probe = 1; group != i / HASHOPEN_GROUP; probe++)
+			group = (group + probe) & (open->n_groups - 1);
+		if (probe > *longest)
+			*longest = probe;
+	}
+}
+
+/**
+ * Print hash table statistics to the standard output
+ *
+ * @param table		The hash table
+ */
+void
+hashtable_stats(HASHTABLE *table)
+{
+int		total, longest, size;
+
+	hashtable_read_lock(table);
+	size = table->open ? HASHOPEN_SIZE(table->open) : table->chains->size;
+	hashtable_count(table, &total, &longest);
 	hashtable_read_unlock(table);
+	printf("Hashtable: %p, size %d\n", table, size);
 	printf("\tNo. of entries:     	%d\n", total);
-	printf("\tAverage chain length:	%.1f\n", (float)total / table->hashsize);
+	printf("\tAverage chain length:	%.1f\n", (float)total / size);
 	printf("\tLongest chain length:	%d\n", longest);
 }
 
@@ -393,31 +1199,12 @@ void hashtable_get_stats(
         int*  longest)
 {
         HASHTABLE*   ht;
-        HASHENTRIES* entries;
-        int          i;
-        int          j;
 
         ht = (HASHTABLE *)table;
         CHK_HASHTABLE(ht);
-        *nelems = 0;
-        *longest = 0;
 	hashtable_read_lock(ht);
-        
-	for (i = 0; i < ht->hashsize; i++)
-	{
-		j = 0;
-		entries = ht->entries[i];
-		while (entries)
-		{
-			j++;
-			entries = entries->next;
-		}
-		*nelems += j;
-		if (j > *longest) {
-			*longest = j;
-                }
-	}
-        *hashsize = ht->hashsize;
+	hashtable_count(ht, nelems, longest);
+        *hashsize = ht->open ? HASHOPEN_SIZE(ht->open) : ht->chains->size;
 	hashtable_read_unlock(ht);
 }
 
@@ -544,24 +1331,42 @@ int		i;
 HASHENTRIES	*entries;
 
 	iter->depth++;
-	while (iter->chain < iter->table->hashsize)
+	hashtable_read_lock(iter->table);
+	if (iter->table->open)
+	{
+		HASHOPEN	*open = iter->table->open;
+
+		for (; iter->chain < HASHOPEN_SIZE(open); iter->chain++)
+		{
+			if (HASHOPEN_FULL(open->ctrl[iter->chain]))
+			{
+				hashtable_read_unlock(iter->table);
+				return open->slots[iter->chain++].key;
+			}
+		}
+		hashtable_read_unlock(iter->table);
+		return NULL;
+	}
+	while (iter->chain < HASH_N_CHAINS(iter->table->chains))
 	{
-		if ((entries = iter->table->entries[iter->chain]) != NULL)
+		if ((entries = hashtable_chain(iter->table->chains, iter->chain)) != NULL)
 		{
 			i = 0;
-			hashtable_read_lock(iter->table);
 			while (entries && i < iter->depth)
 			{
 				entries = entries->next;
 				i++;
 			}
-			hashtable_read_unlock(iter->table);
 			if (entries)
+			{
+				hashtable_read_unlock(iter->table);
 				return entries->key;
+			}
 		}
 		iter->depth = 0;
 		iter->chain++;
 	}
+	hashtable_read_unlock(iter->table);
 	return NULL;
 }
 
@@ -0,0 +1,343 @@
+/*
+ * This file is distributed as part of MaxScale from SkySQL.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file hint.c  - Routing hints given in SQL comments
+ *
+ * A hint is a comment at the start of a statement with the text
+ *
+ *	maxscale route to master
+ *	maxscale route to slave
+ *	maxscale route to server <name>
+ *	maxscale <parameter>=<value>
+ *
+ * The comment may be a C style, a '#' or a '-- ' comment. Only the
+ * comments before the first token of the statement are examined, so a
+ * statement without a hint costs a look at its first character and a
+ * router may decide where to send a hinted statement without calling
+ * the query classifier for it. A filter may add hints to a statement
+ * with hint_add.
+ */
+#include <buffer.h>
+#include <hint.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <skygw_sqlscan.h>
+
+static HINT	*hint_alloc(HINT_TYPE, char *, int, char *, int);
+static HINT	*hint_comment(char *, char *);
+static char	*hint_word(char *, char *, char *);
+static void	hint_free_object(void *);
+
+/**
+ * Parse the hints from the comments at the start of a statement
+ *
+ * @param	sql	The statement, need not be NULL terminated
+ * @param	length	The length of the statement
+ * @return	The hints in the order they were given or NULL if there are none
+ */
+HINT *
+hint_parse(char *sql, int length)
+{
+char	*ptr = sql, *end = sql + length;
+char	*cend, *next;
+HINT	*head = NULL, *tail = NULL, *hint;
+
+	while ((ptr = sqlscan_skip_space(ptr, end)) < end)
+	{
+		if (*ptr == '/' && ptr + 1 < end && ptr[1] == '*')
+		{
+			ptr += 2;
+			if ((cend = sqlscan_comment_end(ptr, end)) == NULL)
+				break;		/*< Unterminated comment */
+			next = cend + 2;
+		}
+		else if (*ptr == '#' || (*ptr == '-' && ptr + 2 < end
+				&& ptr[1] == '-' && isspace(ptr[2])))
+		{
+			ptr += (*ptr == '#' ? 1 : 3);
+			if ((cend = memchr(ptr, '\n', end - ptr)) == NULL)
+				cend = end;
+			next = cend;
+		}
+		else
+			break;			/*< The statement itself */
+
+		if ((hint = hint_comment(ptr, cend)) != NULL)
+		{
+			if (tail)
+				tail->next = hint;
+			else
+				head = hint;
+			tail = hint;
+		}
+		ptr = next;
+	}
+	return head;
+}
+
+/**
+ * Return the hints of the COM_QUERY packet at the start of a buffer.
+ *
+ * The hints are parsed from the first buffer of the chain and attached to
+ * the buffer data, the hints of a packet are parsed once whatever the
+ * number of modules that ask for them. The hints are freed with the
+ * buffer and must not be modified or freed by the caller.
+ *
+ * @param	buf	The packet buffer
+ * @return	The hints or NULL if the packet has none
+ */
+HINT *
+hint_get(GWBUF *buf)
+{
+unsigned char	*data;
+HINT		*hint;
+int		length;
+
+	if (GWBUF_LENGTH(buf) < 6)
+		return NULL;
+	data = GWBUF_DATA(buf);
+	if (data[4] != 0x03)		// COM_QUERY
+		return NULL;
+	if ((hint = (HINT *)gwbuf_get_buffer_object_data(buf, GWBUF_OBJ_HINT))
+			!= NULL)
+		return hint;
+	/*< Nearly every statement starts with a keyword */
+	if (data[5] != '/' && data[5] != '#' && data[5] != '-' &&
+		!isspace(data[5]))
+		return NULL;
+
+	length = data[0] + (data[1] << 8) + (data[2] << 16) - 1;
+	if (length > GWBUF_LENGTH(buf) - 5)
+		length = GWBUF_LENGTH(buf) - 5;
+	if ((hint = hint_parse((char *)data + 5, length)) == NULL)
+		return NULL;
+	if (!gwbuf_add_buffer_object(buf, GWBUF_OBJ_HINT, hint,
+					hint_free_object))
+	{
+		hint_free(hint);
+		return NULL;
+	}
+	return hint;
+}
+
+/**
+ * Add a hint to the COM_QUERY packet at the start of a buffer. The hint
+ * follows the hints given in the comments of the statement and the ones
+ * added before it.
+ *
+ * @param	buf	The packet buffer
+ * @param	type	The type of the hint
+ * @param	data	The server or parameter name or NULL
+ * @param	value	The parameter value or NULL
+ * @return	Non-zero if the hint was added
+ */
+int
+hint_add(GWBUF *buf, HINT_TYPE type, char *data, char *value)
+{
+HINT	*hint, *ptr;
+
+	if (GWBUF_LENGTH(buf) < 5 || ((unsigned char *)GWBUF_DATA(buf))[4] != 0x03)
+		return 0;
+	if ((hint = hint_alloc(type, data, data ? strlen(data) : 0,
+				value, value ? strlen(value) : 0)) == NULL)
+		return 0;
+	if ((ptr = hint_get(buf)) != NULL)
+	{
+		while (ptr->next)
+			ptr = ptr->next;
+		ptr->next = hint;
+	}
+	else if (!gwbuf_add_buffer_object(buf, GWBUF_OBJ_HINT, hint,
+					hint_free_object))
+	{
+		hint_free(hint);
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Return the first routing hint of a list
+ *
+ * @param	hint	The hints of a statement
+ * @return	The hint or NULL if there are only parameter hints
+ */
+HINT *
+hint_route(HINT *hint)
+{
+	while (hint && hint->type == HINT_PARAMETER)
+		hint = hint->next;
+	return hint;
+}
+
+/**
+ * Return the value of a parameter hint, the first hint for the parameter
+ * is used.
+ *
+ * @param	hint	The hints of a statement
+ * @param	name	The name of the parameter
+ * @return	The value or NULL if the parameter is not given
+ */
+char *
+hint_parameter(HINT *hint, char *name)
+{
+	for (; hint; hint = hint->next)
+		if (hint->type == HINT_PARAMETER && !strcasecmp(hint->data, name))
+			return hint->value;
+	return NULL;
+}
+
+/**
+ * Free a list of hints
+ *
+ * @param	hint	The first hint of the list
+ */
+void
+hint_free(HINT *hint)
+{
+HINT	*next;
+
+	while (hint)
+	{
+		next = hint->next;
+		free(hint->data);
+		free(hint->value);
+		free(hint);
+		hint = next;
+	}
+}
+
+/**
+ * Free the hints attached to a buffer
+ *
+ * @param	data	The first hint of the list
+ */
+static void
+hint_free_object(void *data)
+{
+	hint_free((HINT *)data);
+}
+
+/**
+ * Allocate a hint, the name and value are copied
+ *
+ * @param	type	The type of the hint
+ * @param	data	The server or parameter name or NULL
+ * @param	dlen	The length of the name
+ * @param	value	The parameter value or NULL
+ * @param	vlen	The length of the value
+ * @return	The hint or NULL if memory could not be allocated
+ */
+static HINT *
+hint_alloc(HINT_TYPE type, char *data, int dlen, char *value, int vlen)
+{
+HINT	*hint;
+
+	if ((hint = (HINT *)calloc(1, sizeof(HINT))) == NULL)
+		return NULL;
+	hint->type = type;
+	if ((data && (hint->data = strndup(data, dlen)) == NULL) ||
+		(value && (hint->value = strndup(value, vlen)) == NULL))
+	{
+		hint_free(hint);
+		return NULL;
+	}
+	return hint;
+}
+
+/**
+ * Parse the hint from the text of a comment
+ *
+ * @param	ptr	The start of the comment text
+ * @param	end	The end of the comment text
+ * @return	The hint or NULL if the comment is not a valid hint
+ */
+static HINT *
+hint_comment(char *ptr, char *end)
+{
+char	*start, *value;
+int	length;
+
+	if ((ptr = hint_word(ptr, end, "maxscale")) == NULL)
+		return NULL;
+
+	if ((value = hint_word(ptr, end, "route")) != NULL)
+	{
+		if ((ptr = hint_word(value, end, "to")) == NULL)
+			return NULL;
+		if (hint_word(ptr, end, "master") != NULL)
+			return hint_alloc(HINT_ROUTE_TO_MASTER, NULL, 0, NULL, 0);
+		if (hint_word(ptr, end, "slave") != NULL)
+			return hint_alloc(HINT_ROUTE_TO_SLAVE, NULL, 0, NULL, 0);
+		if ((ptr = hint_word(ptr, end, "server")) == NULL)
+			return NULL;
+		while (ptr < end && isspace(*ptr))
+			ptr++;
+		for (start = ptr; ptr < end && !isspace(*ptr); ptr++)
+			;
+		if (ptr == start)
+			return NULL;
+		return hint_alloc(HINT_ROUTE_TO_NAMED_SERVER, start,
+					ptr - start, NULL, 0);
+	}
+
+	/*< A parameter, <name>=<value> */
+	while (ptr < end && isspace(*ptr))
+		ptr++;
+	for (start = ptr; ptr < end && (isalnum(*ptr) || *ptr == '_'); ptr++)
+		;
+	length = ptr - start;
+	while (ptr < end && isspace(*ptr))
+		ptr++;
+	if (length == 0 || ptr == end || *ptr != '=')
+		return NULL;
+	ptr++;
+	while (ptr < end && isspace(*ptr))
+		ptr++;
+	for (value = ptr; ptr < end && !isspace(*ptr); ptr++)
+		;
+	if (ptr == value)
+		return NULL;
+	return hint_alloc(HINT_PARAMETER, start, length, value, ptr - value);
+}
+
+/**
+ * Match a word of a hint, the case of the word is ignored
+ *
+ * @param	ptr	The text, leading white space is skipped
+ * @param	end	The end of the text
+ * @param	word	The word to match
+ * @return	The text after the word or NULL if the word did not match
+ */
+static char *
+hint_word(char *ptr, char *end, char *word)
+{
+int	len = strlen(word);
+
+	while (ptr < end && isspace(*ptr))
+		ptr++;
+	if (end - ptr < len || strncasecmp(ptr, word, len) != 0)
+		return NULL;
+	ptr += len;
+	if (ptr < end && !isspace(*ptr))
+		return NULL;
+	return ptr;
+}
@@ -38,6 +38,7 @@
 #include	<unistd.h>
 #include	<string.h>
 #include	<dlfcn.h>
+#include	<pthread.h>
 #include	<modules.h>
 #include	<modinfo.h>
 #include	<skygw_utils.h>
@@ -47,6 +48,13 @@ extern int lm_enabled_logfiles_bitmask;
 
 static	MODULES	*registered = NULL;
 
+/*<
+ * Serialises the loading and unloading of the modules. The list of the
+ * registered modules is searched without it, a module is only added at
+ * the head of the list once it is complete.
+ */
+static	pthread_mutex_t	load_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static MODULES *find_module(const char *module);
 static void register_module(const char *module,
                             const char  *type,
@@ -55,6 +63,7 @@ static void register_module(const char *module,
                             void        *modobj,
 			    MODULE_INFO *info);
 static void unregister_module(const char *module);
+static void *load_module_locked(const char *module, const char *type);
 
 char* get_maxscale_home(void)
 {
@@ -72,6 +81,10 @@ char* get_maxscale_home(void)
  * will look for library files in the current directory, 
  * $MAXSCALE_HOME/modules and /usr/local/skysql/MaxScale/modules.
  *
+ * A module already loaded is returned without taking the load lock, so
+ * the services that start at the same time and the backend connections
+ * only wait for the modules that are not yet loaded.
+ *
  * @param module	Name of the module to load
  * @param type		Type of module, used purely for registration
  * @return		The module specific entry point structure or NULL
@@ -79,6 +92,29 @@ char* get_maxscale_home(void)
 void *
 load_module(const char *module, const char *type)
 {
+MODULES	*mod;
+void	*modobj;
+
+	if ((mod = find_module(module)) != NULL)
+		return mod->modobj;
+	pthread_mutex_lock(&load_lock);
+	modobj = load_module_locked(module, type);
+	pthread_mutex_unlock(&load_lock);
+
+	return modobj;
+}
+
+/**
+ * Load a module with the load lock held, another thread may have loaded
+ * it while the caller waited for the lock.
+ *
+ * @param module	Name of the module to load
+ * @param type		Type of module, used purely for registration
+ * @return		The module specific entry point structure or NULL
+ */
+static void *
+load_module_locked(const char *module, const char *type)
+{
 char		*home, *version;
 char		fname[MAXPATHLEN];
 void		*dlhandle, *sym;
@@ -242,13 +278,18 @@ MODULE_INFO	*mod_info = NULL;
 void
 unload_module(const char *module)
 {
-MODULES	*mod = find_module(module);
+MODULES	*mod;
 void	*handle;
 
-	if (!mod)
+	pthread_mutex_lock(&load_lock);
+	if ((mod = find_module(module)) == NULL)
+	{
+		pthread_mutex_unlock(&load_lock);
 		return;
+	}
 	handle = mod->handle;
 	unregister_module(module);
+	pthread_mutex_unlock(&load_lock);
 	dlclose(handle);
 }
 
@@ -297,6 +338,8 @@ MODULES	*mod;
 	mod->modobj = modobj;
 	mod->next = registered;
 	mod->info = mod_info;
+	/*< The module is complete before the searches can see it */
+	__sync_synchronize();
 	registered = mod;
 }
 
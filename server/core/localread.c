@@ -0,0 +1,597 @@
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file localread.c  -  The statements answered without a backend
+ *
+ * A statement is answered only if all of it is understood: a SELECT of
+ * integer literals, known server variables and VERSION(), each with an
+ * optional alias, optionally followed by FROM DUAL and a LIMIT. Anything
+ * else is left to the backend, the parse does not try to be complete.
+ *
+ * The result set is the one the server would send, the column names are
+ * the items as written or their aliases.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <localread.h>
+#include <modutil.h>
+#include <skygw_sqlscan.h>
+
+#define	LOCALREAD_FIXED		0x0001	/*< Can't change while the server runs */
+#define	LOCALREAD_BOOL		0x0002	/*< Shown as ON or OFF, selected as 1 or 0 */
+
+/**
+ * A server variable that may be answered
+ */
+typedef struct localread_var {
+	char	*name;		/*< The variable name */
+	int	flags;		/*< LOCALREAD_FIXED and LOCALREAD_BOOL */
+} LOCALREAD_VAR;
+
+static LOCALREAD_VAR localread_vars[] = {
+	{ "version",			LOCALREAD_FIXED },
+	{ "version_comment",		LOCALREAD_FIXED },
+	{ "version_compile_os",		LOCALREAD_FIXED },
+	{ "version_compile_machine",	LOCALREAD_FIXED },
+	{ "protocol_version",		LOCALREAD_FIXED },
+	{ "license",			LOCALREAD_FIXED },
+	{ "lower_case_table_names",	LOCALREAD_FIXED },
+	{ "system_time_zone",		LOCALREAD_FIXED },
+	{ "max_allowed_packet",		0 },
+	{ "tx_isolation",		0 },
+	{ "tx_read_only",		LOCALREAD_BOOL },
+	{ "autocommit",			LOCALREAD_BOOL },
+	{ "sql_mode",			0 },
+	{ "time_zone",			0 },
+	{ "auto_increment_increment",	0 },
+	{ "character_set_server",	0 },
+	{ "collation_server",		0 },
+	{ "query_cache_size",		0 },
+	{ "query_cache_type",		0 },
+	{ NULL,				0 }
+};
+
+/**
+ * The words that end a select item rather than being its alias
+ */
+static char *localread_reserved[] = {
+	"from", "limit", "into", "union", "for", "lock", "procedure",
+	"where", "group", "having", "order", NULL
+};
+
+/**
+ * A column of the result set
+ */
+typedef struct localread_col {
+	char	name[LOCALREAD_NAMELEN];	/*< The column name */
+	char	value[LOCALREAD_VALUELEN];	/*< The value */
+	int	literal;			/*< The value is an integer literal */
+	int	numeric;			/*< The value is an integer */
+} LOCALREAD_COL;
+
+static pthread_once_t	localread_once = PTHREAD_ONCE_INIT;
+static char		localread_query[1024];
+
+/**
+ * Skip the white space and the comments, an executable comment is not
+ * skipped so that the parse stops at it
+ *
+ * @param ptr	The position in the statement
+ * @param end	The end of the statement
+ * @return	The position of the next token
+ */
+static char *
+localread_skip(char *ptr, char *end)
+{
+char	*close;
+
+	while ((ptr = sqlscan_skip_space(ptr, end)) < end)
+	{
+		if (*ptr == '#' ||
+			(end - ptr >= 3 && ptr[0] == '-' && ptr[1] == '-' &&
+			isspace(ptr[2])))
+		{
+			if ((ptr = memchr(ptr, '\n', end - ptr)) == NULL)
+				return end;
+		}
+		else if (end - ptr >= 4 && ptr[0] == '/' && ptr[1] == '*' &&
+			ptr[2] != '!')
+		{
+			if ((close = sqlscan_comment_end(ptr + 2, end)) == NULL)
+				return ptr;
+			ptr = close + 2;
+		}
+		else
+		{
+			break;
+		}
+	}
+	return ptr;
+}
+
+/**
+ * Whether a character may be part of an unquoted identifier
+ */
+static int
+localread_isident(int c)
+{
+	return isalnum(c) || c == '_' || c == '$';
+}
+
+/**
+ * Take a keyword, the case is ignored. A longer identifier that starts
+ * with the word is not taken.
+ *
+ * @param ptr	The position in the statement, moved past the word
+ * @param end	The end of the statement
+ * @param word	The keyword, in lower case
+ * @return	1 if the word was taken, 0 otherwise
+ */
+static int
+localread_word(char **ptr, char *end, char *word)
+{
+int	len = strlen(word);
+
+	if (end - *ptr < len || strncasecmp(*ptr, word, len) != 0 ||
+		(*ptr + len < end && localread_isident((*ptr)[len])))
+		return 0;
+	*ptr += len;
+	return 1;
+}
+
+/**
+ * Take an alias, an identifier or a quoted name
+ *
+ * @param ptr	The position in the statement, moved past the alias
+ * @param end	The end of the statement
+ * @param name	Filled with the alias
+ * @return	1 if an alias was taken, 0 otherwise
+ */
+static int
+localread_alias(char **ptr, char *end, char *name)
+{
+char	*p = *ptr, quote;
+int	len = 0, i;
+
+	if (p >= end)
+		return 0;
+	if (*p == '`' || *p == '\'' || *p == '"')
+	{
+		quote = *p++;
+		while (p < end && *p != quote && *p != '\\')
+		{
+			if (len == LOCALREAD_NAMELEN - 1)
+				return 0;
+			name[len++] = *p++;
+		}
+		if (p >= end || *p != quote || len == 0)
+			return 0;
+		p++;
+	}
+	else
+	{
+		if (isdigit(*p))
+			return 0;
+		while (p < end && localread_isident(*p))
+		{
+			if (len == LOCALREAD_NAMELEN - 1)
+				return 0;
+			name[len++] = *p++;
+		}
+		if (len == 0)
+			return 0;
+		for (i = 0; localread_reserved[i]; i++)
+		{
+			if (strlen(localread_reserved[i]) == (size_t)len &&
+				strncasecmp(name, localread_reserved[i], len) == 0)
+				return 0;
+		}
+	}
+	name[len] = 0;
+	*ptr = p;
+	return 1;
+}
+
+/**
+ * Take the value of a server variable
+ *
+ * @param server	The server
+ * @param name		The variable name, any case
+ * @param len		The length of name
+ * @param changed	The session has changed its state
+ * @param col		The column, its value is filled in
+ * @return		1 if the variable may be answered, 0 otherwise
+ */
+static int
+localread_variable(SERVER *server, char *name, int len, int changed,
+			LOCALREAD_COL *col)
+{
+char	varname[64];
+char	*p;
+int	i;
+
+	if (len == 0 || len >= (int)sizeof(varname))
+		return 0;
+	for (i = 0; i < len; i++)
+		varname[i] = tolower(name[i]);
+	varname[len] = 0;
+
+	for (i = 0; localread_vars[i].name; i++)
+	{
+		if (strcmp(localread_vars[i].name, varname) == 0)
+			break;
+	}
+	if (localread_vars[i].name == NULL ||
+		(changed && (localread_vars[i].flags & LOCALREAD_FIXED) == 0) ||
+		!server_get_variable(server, varname, col->value,
+						sizeof(col->value)))
+		return 0;
+
+	if (localread_vars[i].flags & LOCALREAD_BOOL)
+	{
+		if (strcasecmp(col->value, "ON") == 0)
+			strcpy(col->value, "1");
+		else if (strcasecmp(col->value, "OFF") == 0)
+			strcpy(col->value, "0");
+		else
+			return 0;
+	}
+	col->numeric = (col->value[0] != 0);
+	for (p = col->value; *p; p++)
+	{
+		if (!isdigit(*p))
+			col->numeric = 0;
+	}
+	return 1;
+}
+
+/**
+ * Take a select item and its alias
+ *
+ * @param ptr		The position in the statement, moved past the item
+ * @param end		The end of the statement
+ * @param server	The server of the variables
+ * @param changed	The session has changed its state
+ * @param col		Filled with the column
+ * @return		1 if the item may be answered, 0 otherwise
+ */
+static int
+localread_item(char **ptr, char *end, SERVER *server, int changed,
+		LOCALREAD_COL *col)
+{
+char	*p = *ptr, *start = *ptr, *name;
+int	len;
+
+	col->literal = 0;
+	col->numeric = 0;
+
+	if (end - p > 2 && p[0] == '@' && p[1] == '@')
+	{
+		p += 2;
+		if (end - p > 7 && strncasecmp(p, "global.", 7) == 0)
+			p += 7;
+		else if (end - p > 8 && strncasecmp(p, "session.", 8) == 0)
+			p += 8;
+		else if (end - p > 6 && strncasecmp(p, "local.", 6) == 0)
+			p += 6;
+		for (name = p; p < end && localread_isident(*p); p++)
+			;
+		if (!localread_variable(server, name, p - name, changed, col))
+			return 0;
+	}
+	else if (p < end && (isdigit(*p) || (*p == '-' && end - p > 1 &&
+						isdigit(p[1]))))
+	{
+		for (name = p++; p < end && isdigit(*p); p++)
+			;
+		len = p - name;
+		if (len > 18 || (p < end && (localread_isident(*p) || *p == '.')) ||
+			(name[*name == '-'] == '0' && len > 1 + (*name == '-')))
+			return 0;
+		memcpy(col->value, name, len);
+		col->value[len] = 0;
+		col->literal = 1;
+		col->numeric = 1;
+	}
+	else if (localread_word(&p, end, "version"))
+	{
+		p = localread_skip(p, end);
+		if (p >= end || *p++ != '(')
+			return 0;
+		p = localread_skip(p, end);
+		if (p >= end || *p++ != ')')
+			return 0;
+		if (!localread_variable(server, "version", 7, changed, col))
+			return 0;
+	}
+	else
+	{
+		return 0;
+	}
+
+	if ((len = p - start) >= LOCALREAD_NAMELEN)
+		return 0;
+	memcpy(col->name, start, len);
+	col->name[len] = 0;
+
+	*ptr = localread_skip(p, end);
+	if (localread_word(ptr, end, "as"))
+	{
+		*ptr = localread_skip(*ptr, end);
+		if (!localread_alias(ptr, end, col->name))
+			return 0;
+		*ptr = localread_skip(*ptr, end);
+	}
+	else if (localread_alias(ptr, end, col->name))
+	{
+		*ptr = localread_skip(*ptr, end);
+	}
+	return 1;
+}
+
+/**
+ * Write a length encoded string
+ *
+ * @param ptr	Where to write
+ * @param str	The string
+ * @return	The position after the string
+ */
+static uint8_t *
+localread_lenenc(uint8_t *ptr, char *str)
+{
+size_t	len = strlen(str);
+
+	if (len < 251)
+	{
+		*ptr++ = len;
+	}
+	else
+	{
+		*ptr++ = 0xfc;
+		*ptr++ = len & 0xff;
+		*ptr++ = (len >> 8) & 0xff;
+	}
+	memcpy(ptr, str, len);
+	return ptr + len;
+}
+
+/**
+ * Write the header of a packet once its payload is written
+ *
+ * @param hdr	The start of the packet
+ * @param end	The end of the payload
+ * @param seq	The sequence number
+ */
+static void
+localread_header(uint8_t *hdr, uint8_t *end, int seq)
+{
+size_t	len = end - hdr - 4;
+
+	hdr[0] = len & 0xff;
+	hdr[1] = (len >> 8) & 0xff;
+	hdr[2] = (len >> 16) & 0xff;
+	hdr[3] = seq;
+}
+
+/**
+ * Write an EOF packet
+ */
+static uint8_t *
+localread_eof(uint8_t *ptr, int seq, int status)
+{
+uint8_t	*hdr = ptr;
+
+	ptr += 4;
+	*ptr++ = 0xfe;
+	*ptr++ = 0;
+	*ptr++ = 0;
+	*ptr++ = status & 0xff;
+	*ptr++ = (status >> 8) & 0xff;
+	localread_header(hdr, ptr, seq);
+	return ptr;
+}
+
+/**
+ * Build the result set of one row
+ *
+ * @param cols		The columns
+ * @param ncols		The number of columns
+ * @param status	The status flags of the EOF packets
+ * @return		The result set or NULL if it could not be allocated
+ */
+static GWBUF *
+localread_resultset(LOCALREAD_COL *cols, int ncols, int status)
+{
+GWBUF		*buf;
+uint8_t		*ptr, *hdr;
+size_t		size, vlen;
+int		i, seq = 1, length, charset, type, flags, decimals;
+
+	size = 5 + 9 + 4 + 9;
+	for (i = 0; i < ncols; i++)
+	{
+		size += 4 + 4 + 3 + 3 + strlen(cols[i].name) + 1 + 13;
+		size += 3 + strlen(cols[i].value);
+	}
+	if ((buf = gwbuf_alloc(size)) == NULL)
+		return NULL;
+	ptr = (uint8_t *)GWBUF_DATA(buf);
+
+	/*< The column count */
+	hdr = ptr;
+	ptr += 4;
+	*ptr++ = ncols;
+	localread_header(hdr, ptr, seq++);
+
+	for (i = 0; i < ncols; i++)
+	{
+		vlen = strlen(cols[i].value);
+		if (cols[i].numeric)
+		{
+			charset = 63;
+			length = cols[i].literal ? vlen : 21;
+			type = 0x08;		/* MYSQL_TYPE_LONGLONG */
+			flags = cols[i].literal ? 0x0081 : 0x0080;
+			decimals = 0;
+		}
+		else
+		{
+			charset = 33;		/* utf8_general_ci */
+			length = 3 * (vlen ? vlen : 1);
+			type = 0xfd;		/* MYSQL_TYPE_VAR_STRING */
+			flags = 0;
+			decimals = 0x1f;
+		}
+		hdr = ptr;
+		ptr += 4;
+		ptr = localread_lenenc(ptr, "def");
+		ptr = localread_lenenc(ptr, "");	/* schema */
+		ptr = localread_lenenc(ptr, "");	/* table */
+		ptr = localread_lenenc(ptr, "");	/* org_table */
+		ptr = localread_lenenc(ptr, cols[i].name);
+		ptr = localread_lenenc(ptr, "");	/* org_name */
+		*ptr++ = 0x0c;
+		*ptr++ = charset & 0xff;
+		*ptr++ = (charset >> 8) & 0xff;
+		*ptr++ = length & 0xff;
+		*ptr++ = (length >> 8) & 0xff;
+		*ptr++ = (length >> 16) & 0xff;
+		*ptr++ = (length >> 24) & 0xff;
+		*ptr++ = type;
+		*ptr++ = flags & 0xff;
+		*ptr++ = (flags >> 8) & 0xff;
+		*ptr++ = decimals;
+		*ptr++ = 0;
+		*ptr++ = 0;
+		localread_header(hdr, ptr, seq++);
+	}
+	ptr = localread_eof(ptr, seq++, status);
+
+	/*< The row */
+	hdr = ptr;
+	ptr += 4;
+	for (i = 0; i < ncols; i++)
+		ptr = localread_lenenc(ptr, cols[i].value);
+	localread_header(hdr, ptr, seq++);
+
+	ptr = localread_eof(ptr, seq++, status);
+	return gwbuf_trim(buf, size - (ptr - (uint8_t *)GWBUF_DATA(buf)));
+}
+
+/**
+ * Answer a statement that needs no data of the databases, with the
+ * variables of a server as the monitor last read them.
+ *
+ * @param queue		The COM_QUERY packet
+ * @param server	The server whose variables are answered
+ * @param changed	The session has changed its own state, its variables
+ *			may no longer be those of the server
+ * @param status	The status flags of the session for the EOF packets
+ * @return		The result set or NULL if the statement can't be
+ *			answered here
+ */
+GWBUF *
+localread_reply(GWBUF *queue, SERVER *server, int changed, int status)
+{
+LOCALREAD_COL	*cols;
+GWBUF		*reply = NULL;
+char		*sql, *ptr, *end;
+int		len, ncols = 0, limit;
+
+	if (server == NULL || !SERVER_IS_RUNNING(server) ||
+		queue->next != NULL || GWBUF_IS_TYPE_FRAGMENT(queue) ||
+		!modutil_extract_SQL(queue, &sql, &len) ||
+		len + 5 > (int)GWBUF_LENGTH(queue))
+		return NULL;
+	ptr = localread_skip(sql, sql + len);
+	end = sql + len;
+	if (!localread_word(&ptr, end, "select"))
+		return NULL;
+	if ((cols = (LOCALREAD_COL *)malloc(LOCALREAD_MAX_COLUMNS *
+					sizeof(LOCALREAD_COL))) == NULL)
+		return NULL;
+
+	for (;;)
+	{
+		ptr = localread_skip(ptr, end);
+		if (ncols == LOCALREAD_MAX_COLUMNS ||
+			!localread_item(&ptr, end, server, changed, &cols[ncols]))
+			goto out;
+		ncols++;
+		if (ptr >= end || *ptr != ',')
+			break;
+		ptr++;
+	}
+
+	if (localread_word(&ptr, end, "from"))
+	{
+		ptr = localread_skip(ptr, end);
+		if (!localread_word(&ptr, end, "dual"))
+			goto out;
+		ptr = localread_skip(ptr, end);
+	}
+	if (localread_word(&ptr, end, "limit"))
+	{
+		ptr = localread_skip(ptr, end);
+		for (limit = 0; ptr < end && isdigit(*ptr) && limit < 1000000; ptr++)
+			limit = limit * 10 + (*ptr - '0');
+		if (limit == 0 || (ptr < end && localread_isident(*ptr)))
+			goto out;
+		ptr = localread_skip(ptr, end);
+	}
+	if (ptr < end && *ptr == ';')
+		ptr = localread_skip(ptr + 1, end);
+	if (ptr == end)
+		reply = localread_resultset(cols, ncols, status);
+out:
+	free(cols);
+	return reply;
+}
+
+/**
+ * Build the query of the monitor for the variables that are answered
+ */
+static void
+localread_build_query()
+{
+char	*ptr = localread_query;
+int	i;
+
+	ptr += sprintf(ptr, "SHOW GLOBAL VARIABLES WHERE Variable_name IN (");
+	for (i = 0; localread_vars[i].name; i++)
+		ptr += sprintf(ptr, "%s'%s'", i ? "," : "", localread_vars[i].name);
+	sprintf(ptr, ")");
+}
+
+/**
+ * Return the statement that reads the variables answered by
+ * localread_reply, the monitors run it and give the rows of variable
+ * names and values to server_set_variables.
+ *
+ * @return	The statement
+ */
+char *
+localread_variables_query()
+{
+	pthread_once(&localread_once, localread_build_query);
+	return localread_query;
+}
@@ -0,0 +1,924 @@
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file metrics.c  -  Machine readable counters and latency histograms
+ *
+ * Every group of objects, the services, the servers and the polling threads,
+ * has a table of metrics. The objects of a group are visited once: in JSON
+ * each object is written with all its values, in the Prometheus format the
+ * samples of each metric are collected apart and written after their HELP
+ * and TYPE lines, since the samples of a metric must be together.
+ *
+ * For the collection of the changes each value is a sample with a flat key,
+ * the group, the object and the metric apart by '/', the buckets of
+ * a histogram have a value each. The samples are sorted by key and merged
+ * with those of the previous collection, a value that is gone is null.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <metrics.h>
+#include <statistics.h>
+#include <service.h>
+#include <server.h>
+#include <poll.h>
+#include <config.h>
+#include <router.h>
+
+#define	METRICS_MAX_METRICS	16	/*< Metrics of a group */
+
+#define	METRICS_FLAT		2	/*< Flat samples for a METRICS_DELTA */
+
+#define	METRIC_COUNTER		0
+#define	METRIC_GAUGE		1
+#define	METRIC_HISTOGRAM	2
+
+/**
+ * A growing text buffer
+ */
+typedef struct {
+	char	*data;
+	int	len;
+	int	size;
+} METRICS_TEXT;
+
+/**
+ * A metric of the objects of a group, the histograms give their buckets and
+ * sum, the other metrics their value
+ */
+typedef struct {
+	char	*name;		/*< Prometheus name */
+	char	*key;		/*< JSON key */
+	char	*help;		/*< Prometheus HELP text */
+	int	type;		/*< METRIC_COUNTER, METRIC_GAUGE or METRIC_HISTOGRAM */
+	long	(*value)(void *);
+	void	(*hist)(void *, long *, long *);
+} METRIC;
+
+/**
+ * A value of the flat collection, its key is at an offset of the text of
+ * the keys
+ */
+typedef struct {
+	int	key;		/*< Offset of the key */
+	long	value;
+} METRICS_SAMPLE;
+
+/**
+ * The flat samples of a collection
+ */
+typedef struct {
+	METRICS_TEXT	keys;		/*< The keys, each ended by a NUL */
+	METRICS_SAMPLE	*samples;
+	int		n_samples;
+	int		size;
+} METRICS_FLATSET;
+
+/**
+ * The values of the last collection of a subscriber, sorted by key
+ */
+struct metrics_delta {
+	METRICS_FLATSET	last;
+	int		n_collected;	/*< Collections so far */
+};
+
+/**
+ * A counter of the routers, its samples are collected from all the services
+ * before it is written
+ */
+typedef struct {
+	char		*name;		/*< Prometheus name, NULL if the slot is free */
+	char		*help;		/*< Prometheus HELP text */
+} ROUTER_METRIC;
+
+/**
+ * The state of a collection
+ */
+typedef struct {
+	int		format;		/*< METRICS_PROMETHEUS, METRICS_JSON or METRICS_FLAT */
+	METRICS_TEXT	out;		/*< The collected metrics */
+	METRICS_FLATSET	flat;		/*< The flat samples */
+	char		*group;		/*< The name of the current group */
+	METRICS_TEXT	samples[METRICS_MAX_METRICS]; /*< Prometheus samples */
+	METRIC		*metrics;	/*< The metrics of the current group */
+	char		*label;		/*< The label of the objects of the group */
+	int		n_objects;	/*< Objects of the group so far */
+	ROUTER_METRIC	routers[METRICS_MAX_METRICS]; /*< The router counters */
+	SERVICE		*service;	/*< The service of the router counters */
+} METRICS;
+
+/**
+ * Append to a text buffer, the buffer grows as needed. A buffer that could
+ * not grow keeps what it has.
+ */
+static void
+metrics_append(METRICS_TEXT *text, const char *fmt, ...)
+{
+va_list	args;
+int	n;
+char	*data;
+
+	while (1)
+	{
+		va_start(args, fmt);
+		n = vsnprintf(text->data ? text->data + text->len : NULL,
+				text->size - text->len, fmt, args);
+		va_end(args);
+		if (n < 0)
+			return;
+		if (text->len + n < text->size)
+		{
+			text->len += n;
+			return;
+		}
+		if ((data = realloc(text->data, 2 * text->size + n + 1024)) == NULL)
+		{
+			if (text->data)
+				text->data[text->len] = '\0';
+			return;
+		}
+		text->data = data;
+		text->size = 2 * text->size + n + 1024;
+	}
+}
+
+/**
+ * Append a string with the characters a Prometheus label value or a JSON
+ * string must not hold as they are escaped
+ */
+static void
+metrics_append_escaped(METRICS_TEXT *text, const char *str)
+{
+	for (; str && *str; str++)
+	{
+		if (*str == '"' || *str == '\\')
+			metrics_append(text, "\\%c", *str);
+		else if (*str == '\n')
+			metrics_append(text, "\\n");
+		else if ((unsigned char)*str >= 0x20)
+			metrics_append(text, "%c", *str);
+	}
+}
+
+/**
+ * Start the key of a flat sample, the parts are appended to the text of the
+ * keys with metrics_append
+ *
+ * @return	The offset of the key
+ */
+static int
+metrics_flat_key(METRICS *m, const char *object, const char *metric)
+{
+int	key = m->flat.keys.len;
+
+	metrics_append(&m->flat.keys, "%s/%s/%s", m->group, object, metric);
+	return key;
+}
+
+/**
+ * Add a flat sample whose key has been appended, the key is ended here.
+ * A sample that can not be added is dropped, with its key.
+ */
+static void
+metrics_flat_add(METRICS *m, int key, long value)
+{
+METRICS_FLATSET	*flat = &m->flat;
+METRICS_SAMPLE	*samples;
+int		len = flat->keys.len;
+
+	metrics_append(&flat->keys, "%c", '\0');
+	if (flat->keys.len != len + 1)
+	{
+		flat->keys.len = key;
+		return;
+	}
+	if (flat->n_samples == flat->size)
+	{
+		if ((samples = realloc(flat->samples,
+			(2 * flat->size + 64) * sizeof(METRICS_SAMPLE))) == NULL)
+		{
+			flat->keys.len = key;
+			return;
+		}
+		flat->samples = samples;
+		flat->size = 2 * flat->size + 64;
+	}
+	flat->samples[flat->n_samples].key = key;
+	flat->samples[flat->n_samples].value = value;
+	flat->n_samples++;
+}
+
+/**
+ * Start a group of objects
+ *
+ * @param m		The collection
+ * @param group		The name of the group in JSON
+ * @param label		The label that names an object of the group
+ * @param metrics	The metrics of the objects, ended by a NULL name
+ */
+static void
+metrics_group_start(METRICS *m, char *group, char *label, METRIC *metrics)
+{
+	m->metrics = metrics;
+	m->label = label;
+	m->group = group;
+	m->n_objects = 0;
+	if (m->format == METRICS_JSON)
+		metrics_append(&m->out, "%s\"%s\":[",
+				m->out.len > 1 ? "," : "", group);
+}
+
+/**
+ * Write the histogram of one object. The counts are cumulative, so only the
+ * buckets that end on a power of 2 microseconds are written, the finer
+ * buckets in between are for the percentiles of the diagnostics.
+ */
+static void
+metrics_histogram(METRICS *m, METRICS_TEXT *text, METRIC *metric,
+		const char *name, void *obj)
+{
+long		counts[TS_HIST_BUCKETS], sum, total = 0;
+unsigned long	bound;
+int		i, key;
+
+	metric->hist(obj, counts, &sum);
+	if (m->format == METRICS_JSON)
+		metrics_append(text, ",\"%s\":{\"buckets\":[", metric->key);
+	for (i = 0; i < TS_HIST_BUCKETS; i++)
+	{
+		total += counts[i];
+		bound = ts_hist_bound(i);
+		if (bound & (bound - 1))
+			continue;
+		if (m->format == METRICS_FLAT)
+		{
+			key = metrics_flat_key(m, name, metric->key);
+			if (bound)
+				metrics_append(&m->flat.keys, "/le=%.9g", bound / 1e6);
+			else
+				metrics_append(&m->flat.keys, "/le=+Inf");
+			metrics_flat_add(m, key, total);
+			continue;
+		}
+		if (m->format == METRICS_JSON)
+		{
+			if (bound)
+				metrics_append(text, "%s{\"le\":%.9g,\"count\":%ld}",
+					i ? "," : "", bound / 1e6, total);
+			else
+				metrics_append(text, ",{\"le\":null,\"count\":%ld}",
+					total);
+			continue;
+		}
+		metrics_append(text, "%s_bucket{%s=\"", metric->name, m->label);
+		metrics_append_escaped(text, name);
+		if (bound)
+			metrics_append(text, "\",le=\"%.9g\"} %ld\n",
+					bound / 1e6, total);
+		else
+			metrics_append(text, "\",le=\"+Inf\"} %ld\n", total);
+	}
+	if (m->format == METRICS_FLAT)
+	{
+		key = metrics_flat_key(m, name, metric->key);
+		metrics_append(&m->flat.keys, "/sum_microseconds");
+		metrics_flat_add(m, key, sum);
+		key = metrics_flat_key(m, name, metric->key);
+		metrics_append(&m->flat.keys, "/count");
+		metrics_flat_add(m, key, total);
+		return;
+	}
+	if (m->format == METRICS_JSON)
+	{
+		metrics_append(text, "],\"sum\":%g,\"count\":%ld}", sum / 1e6, total);
+		return;
+	}
+	metrics_append(text, "%s_sum{%s=\"", metric->name, m->label);
+	metrics_append_escaped(text, name);
+	metrics_append(text, "\"} %g\n", sum / 1e6);
+	metrics_append(text, "%s_count{%s=\"", metric->name, m->label);
+	metrics_append_escaped(text, name);
+	metrics_append(text, "\"} %ld\n", total);
+}
+
+/**
+ * Write the metrics of one object of the current group
+ *
+ * @param m	The collection
+ * @param name	The value of the label of the object
+ * @param obj	The object, passed to the functions of the metrics
+ */
+static void
+metrics_object(METRICS *m, const char *name, void *obj)
+{
+METRIC	*metric;
+int	i;
+
+	if (m->format == METRICS_JSON)
+	{
+		metrics_append(&m->out, "%s{\"%s\":\"", m->n_objects ? "," : "",
+				m->label);
+		metrics_append_escaped(&m->out, name);
+		metrics_append(&m->out, "\"");
+	}
+	for (i = 0; m->metrics[i].name && i < METRICS_MAX_METRICS; i++)
+	{
+		metric = &m->metrics[i];
+		if (metric->type == METRIC_HISTOGRAM)
+		{
+			metrics_histogram(m, m->format == METRICS_JSON ?
+					&m->out : &m->samples[i], metric, name, obj);
+		}
+		else if (m->format == METRICS_JSON)
+		{
+			metrics_append(&m->out, ",\"%s\":%ld", metric->key,
+					metric->value(obj));
+		}
+		else if (m->format == METRICS_FLAT)
+		{
+			metrics_flat_add(m, metrics_flat_key(m, name, metric->key),
+					metric->value(obj));
+		}
+		else
+		{
+			metrics_append(&m->samples[i], "%s{%s=\"",
+					metric->name, m->label);
+			metrics_append_escaped(&m->samples[i], name);
+			metrics_append(&m->samples[i], "\"} %ld\n",
+					metric->value(obj));
+		}
+	}
+	if (m->format == METRICS_JSON)
+		metrics_append(&m->out, "}");
+	m->n_objects++;
+}
+
+/**
+ * End the current group, the Prometheus samples of each metric follow the
+ * description of the metric
+ */
+static void
+metrics_group_end(METRICS *m)
+{
+static char	*types[] = { "counter", "gauge", "histogram" };
+METRIC		*metric;
+int		i;
+
+	if (m->format == METRICS_FLAT)
+		return;
+	if (m->format == METRICS_JSON)
+	{
+		metrics_append(&m->out, "]");
+		return;
+	}
+	for (i = 0; m->metrics[i].name && i < METRICS_MAX_METRICS; i++)
+	{
+		metric = &m->metrics[i];
+		metrics_append(&m->out, "# HELP %s %s\n# TYPE %s %s\n",
+			metric->name, metric->help, metric->name,
+			types[metric->type]);
+		if (m->samples[i].len)
+			metrics_append(&m->out, "%s", m->samples[i].data);
+		m->samples[i].len = 0;
+	}
+}
+
+/*
+ * The services
+ */
+static long
+service_sessions_total(void *obj)
+{
+	return ts_stats_get(((SERVICE *)obj)->stats.counters, SERVICE_N_SESSIONS);
+}
+
+static long
+service_sessions(void *obj)
+{
+	return ts_stats_get(((SERVICE *)obj)->stats.counters, SERVICE_N_CURRENT);
+}
+
+static long
+service_evicted(void *obj)
+{
+	return ts_stats_get(((SERVICE *)obj)->stats.counters, SERVICE_N_EVICTED);
+}
+
+static long
+service_queued(void *obj)
+{
+	return ((SERVICE *)obj)->conn_queue.depth;
+}
+
+static long
+service_rejected(void *obj)
+{
+	return ((SERVICE *)obj)->conn_queue.n_rejected;
+}
+
+static void
+service_latency(void *obj, long *counts, long *sum)
+{
+	ts_hist_get(((SERVICE *)obj)->stats.latency, -1, counts, sum);
+}
+
+static METRIC serviceMetrics[] = {
+	{ "maxscale_service_sessions_total", "sessions_total",
+		"Sessions created by the service.",
+		METRIC_COUNTER, service_sessions_total, NULL },
+	{ "maxscale_service_sessions", "sessions",
+		"Current sessions of the service.",
+		METRIC_GAUGE, service_sessions, NULL },
+	{ "maxscale_service_evicted_sessions_total", "evicted_sessions_total",
+		"Sessions closed for the data buffered for them.",
+		METRIC_COUNTER, service_evicted, NULL },
+	{ "maxscale_service_queued_clients", "queued_clients",
+		"Clients waiting for admission to the service.",
+		METRIC_GAUGE, service_queued, NULL },
+	{ "maxscale_service_rejected_clients_total", "rejected_clients_total",
+		"Clients turned away by the admission control of the service.",
+		METRIC_COUNTER, service_rejected, NULL },
+	{ "maxscale_service_response_seconds", "response_seconds",
+		"Time from a request to the end of its reply.",
+		METRIC_HISTOGRAM, NULL, service_latency },
+	{ NULL }
+};
+
+static void
+metrics_service(SERVICE *service, void *arg)
+{
+	metrics_object((METRICS *)arg, service->name, service);
+}
+
+/*
+ * The servers
+ */
+static long
+server_connections_total(void *obj)
+{
+	return ts_stats_get(((SERVER *)obj)->stats.counters, SERVER_N_CONNECTIONS);
+}
+
+static long
+server_connections(void *obj)
+{
+	return ((SERVER *)obj)->stats.n_current;
+}
+
+static long
+server_persistent(void *obj)
+{
+	return ((SERVER *)obj)->n_persistent;
+}
+
+static long
+server_up(void *obj)
+{
+	return SERVER_IS_RUNNING((SERVER *)obj) ? 1 : 0;
+}
+
+static void
+server_latency(void *obj, long *counts, long *sum)
+{
+	ts_hist_get(((SERVER *)obj)->stats.latency, -1, counts, sum);
+}
+
+static METRIC serverMetrics[] = {
+	{ "maxscale_server_connections_total", "connections_total",
+		"Connections made to the server.",
+		METRIC_COUNTER, server_connections_total, NULL },
+	{ "maxscale_server_connections", "connections",
+		"Current connections to the server.",
+		METRIC_GAUGE, server_connections, NULL },
+	{ "maxscale_server_persistent_connections", "persistent_connections",
+		"Idle connections in the persistent pool of the server.",
+		METRIC_GAUGE, server_persistent, NULL },
+	{ "maxscale_server_up", "up",
+		"1 if the server is running and not in maintenance.",
+		METRIC_GAUGE, server_up, NULL },
+	{ "maxscale_server_response_seconds", "response_seconds",
+		"Time from a request to the end of its reply.",
+		METRIC_HISTOGRAM, NULL, server_latency },
+	{ NULL }
+};
+
+static void
+metrics_server(SERVER *server, void *arg)
+{
+char	name[256];
+
+	snprintf(name, sizeof(name), "%s",
+		server->unique_name ? server->unique_name : server->name);
+	metrics_object((METRICS *)arg, name, server);
+}
+
+/*
+ * The polling threads, the object is the thread id
+ */
+#define	THREAD_STAT(field)				\
+static long						\
+thread_##field(void *obj)				\
+{							\
+POLL_THREAD_STATS	stats;				\
+							\
+	poll_thread_stats((int)(long)obj, &stats);	\
+	return stats.field;				\
+}
+
+THREAD_STAT(n_polls)
+THREAD_STAT(n_reads)
+THREAD_STAT(n_writes)
+THREAD_STAT(n_errors)
+THREAD_STAT(n_hangups)
+THREAD_STAT(n_accepts)
+THREAD_STAT(n_stolen)
+THREAD_STAT(n_dcbs)
+THREAD_STAT(n_events)
+THREAD_STAT(busy_usecs)
+THREAD_STAT(idle_usecs)
+THREAD_STAT(max_event_usecs)
+THREAD_STAT(cur_usecs)
+
+static void
+thread_latency(void *obj, long *counts, long *sum)
+{
+TS_HIST	*hist = poll_event_latency();
+
+	if (hist == NULL)
+	{
+		memset(counts, 0, TS_HIST_BUCKETS * sizeof(long));
+		*sum = 0;
+		return;
+	}
+	ts_hist_get(hist, (int)(long)obj, counts, sum);
+}
+
+static METRIC threadMetrics[] = {
+	{ "maxscale_thread_polls_total", "polls_total",
+		"Poll cycles of the thread that found events.",
+		METRIC_COUNTER, thread_n_polls, NULL },
+	{ "maxscale_thread_read_events_total", "read_events_total",
+		"Read events processed by the thread.",
+		METRIC_COUNTER, thread_n_reads, NULL },
+	{ "maxscale_thread_write_events_total", "write_events_total",
+		"Write events processed by the thread.",
+		METRIC_COUNTER, thread_n_writes, NULL },
+	{ "maxscale_thread_error_events_total", "error_events_total",
+		"Error events processed by the thread.",
+		METRIC_COUNTER, thread_n_errors, NULL },
+	{ "maxscale_thread_hangup_events_total", "hangup_events_total",
+		"Hangup events processed by the thread.",
+		METRIC_COUNTER, thread_n_hangups, NULL },
+	{ "maxscale_thread_accept_events_total", "accept_events_total",
+		"Accept events processed by the thread.",
+		METRIC_COUNTER, thread_n_accepts, NULL },
+	{ "maxscale_thread_events_total", "events_total",
+		"Events processed by the thread.",
+		METRIC_COUNTER, thread_n_events, NULL },
+	{ "maxscale_thread_stolen_events_total", "stolen_events_total",
+		"Events the thread took from the queues of the other threads.",
+		METRIC_COUNTER, thread_n_stolen, NULL },
+	{ "maxscale_thread_busy_microseconds_total", "busy_microseconds_total",
+		"Time the thread spent in the event handlers.",
+		METRIC_COUNTER, thread_busy_usecs, NULL },
+	{ "maxscale_thread_idle_microseconds_total", "idle_microseconds_total",
+		"Time the thread spent polling or parked.",
+		METRIC_COUNTER, thread_idle_usecs, NULL },
+	{ "maxscale_thread_dcbs", "dcbs",
+		"DCBs in the event set of the thread, -1 if the set is shared.",
+		METRIC_GAUGE, thread_n_dcbs, NULL },
+	{ "maxscale_thread_event_max_microseconds", "event_max_microseconds",
+		"Longest time the thread spent in a single event handler.",
+		METRIC_GAUGE, thread_max_event_usecs, NULL },
+	{ "maxscale_thread_handler_microseconds", "handler_microseconds",
+		"Time in the handler the thread is running, 0 if it polls.",
+		METRIC_GAUGE, thread_cur_usecs, NULL },
+	{ "maxscale_thread_event_seconds", "event_seconds",
+		"Time the thread takes to process an event.",
+		METRIC_HISTOGRAM, NULL, thread_latency },
+	{ NULL }
+};
+
+/*
+ * The counters of the routers, given by their getMetrics
+ */
+
+/**
+ * Write a sample of a router counter, the ROUTER_METRIC_FN of getMetrics.
+ * A counter beyond METRICS_MAX_METRICS names is dropped.
+ */
+static void
+metrics_router_sample(void *arg, char *name, char *help, char **labels,
+		long value)
+{
+METRICS		*m = (METRICS *)arg;
+METRICS_TEXT	*text;
+int		i, key;
+
+	if (m->format == METRICS_FLAT)
+	{
+		key = metrics_flat_key(m, m->service->name, name);
+		for (i = 0; labels && labels[i]; i += 2)
+			metrics_append(&m->flat.keys, "/%s=%s",
+					labels[i], labels[i + 1]);
+		metrics_flat_add(m, key, value);
+		return;
+	}
+	if (m->format == METRICS_JSON)
+	{
+		text = &m->out;
+		metrics_append(text, "%s{\"service\":\"", m->n_objects ? "," : "");
+		metrics_append_escaped(text, m->service->name);
+		metrics_append(text, "\",\"metric\":\"");
+		metrics_append_escaped(text, name);
+		metrics_append(text, "\"");
+		for (i = 0; labels && labels[i]; i += 2)
+		{
+			metrics_append(text, ",\"%s\":\"", labels[i]);
+			metrics_append_escaped(text, labels[i + 1]);
+			metrics_append(text, "\"");
+		}
+		metrics_append(text, ",\"value\":%ld}", value);
+		m->n_objects++;
+		return;
+	}
+	for (i = 0; i < METRICS_MAX_METRICS && m->routers[i].name; i++)
+	{
+		if (strcmp(m->routers[i].name, name) == 0)
+			break;
+	}
+	if (i == METRICS_MAX_METRICS)
+		return;
+	if (m->routers[i].name == NULL)
+	{
+		m->routers[i].name = name;
+		m->routers[i].help = help;
+	}
+	text = &m->samples[i];
+	metrics_append(text, "%s{service=\"", name);
+	metrics_append_escaped(text, m->service->name);
+	metrics_append(text, "\"");
+	for (i = 0; labels && labels[i]; i += 2)
+	{
+		metrics_append(text, ",%s=\"", labels[i]);
+		metrics_append_escaped(text, labels[i + 1]);
+		metrics_append(text, "\"");
+	}
+	metrics_append(text, "} %ld\n", value);
+}
+
+static void
+metrics_router(SERVICE *service, void *arg)
+{
+METRICS	*m = (METRICS *)arg;
+
+	if (service->router == NULL || service->router->getMetrics == NULL ||
+		service->router_instance == NULL)
+		return;
+	m->service = service;
+	service->router->getMetrics(service->router_instance,
+				metrics_router_sample, m);
+}
+
+/**
+ * Write the counters of the routers, in the Prometheus format the samples
+ * of each counter follow its description. The names and help texts are
+ * those of the modules, the modules stay loaded.
+ */
+static void
+metrics_routers(METRICS *m)
+{
+int	i;
+
+	m->n_objects = 0;
+	m->group = "routers";
+	if (m->format == METRICS_JSON)
+		metrics_append(&m->out, ",\"routers\":[");
+	serviceForEach(metrics_router, m);
+	if (m->format == METRICS_FLAT)
+		return;
+	if (m->format == METRICS_JSON)
+	{
+		metrics_append(&m->out, "]");
+		return;
+	}
+	for (i = 0; i < METRICS_MAX_METRICS && m->routers[i].name; i++)
+	{
+		metrics_append(&m->out, "# HELP %s %s\n# TYPE %s counter\n",
+			m->routers[i].name, m->routers[i].help,
+			m->routers[i].name);
+		if (m->samples[i].len)
+			metrics_append(&m->out, "%s", m->samples[i].data);
+		m->samples[i].len = 0;
+	}
+}
+
+/**
+ * Visit the groups of objects and the routers
+ *
+ * @param m	The collection
+ */
+static void
+metrics_gather(METRICS *m)
+{
+char	name[20];
+int	i;
+
+	metrics_group_start(m, "services", "service", serviceMetrics);
+	serviceForEach(metrics_service, m);
+	metrics_group_end(m);
+
+	metrics_group_start(m, "servers", "server", serverMetrics);
+	server_foreach(metrics_server, m);
+	metrics_group_end(m);
+
+	metrics_group_start(m, "threads", "thread", threadMetrics);
+	for (i = 0; i < config_threadcount(); i++)
+	{
+		sprintf(name, "%d", i);
+		metrics_object(m, name, (void *)(long)i);
+	}
+	metrics_group_end(m);
+
+	metrics_routers(m);
+}
+
+/**
+ * Collect the metrics of the services, the servers, the polling threads
+ * and the routers.
+ * Only the lists of the services and of the servers are read locked, the
+ * counters are read as they are, so this may be called at any rate while
+ * the gateway is busy.
+ *
+ * @param format	METRICS_PROMETHEUS or METRICS_JSON
+ * @return		The metrics or NULL if out of memory
+ */
+GWBUF *
+metrics_collect(int format)
+{
+METRICS	m;
+GWBUF	*buf = NULL;
+int	i;
+
+	memset(&m, 0, sizeof(METRICS));
+	m.format = format;
+	if (format == METRICS_JSON)
+		metrics_append(&m.out, "{");
+
+	metrics_gather(&m);
+
+	if (format == METRICS_JSON)
+		metrics_append(&m.out, "}\n");
+
+	if (m.out.len > 0 && (buf = gwbuf_alloc(m.out.len)) != NULL)
+		memcpy(GWBUF_DATA(buf), m.out.data, m.out.len);
+	free(m.out.data);
+	for (i = 0; i < METRICS_MAX_METRICS; i++)
+		free(m.samples[i].data);
+
+	return buf;
+}
+
+/*< The keys of the samples being sorted, qsort passes no context */
+static __thread char	*sort_keys;
+
+static int
+metrics_sample_cmp(const void *a, const void *b)
+{
+	return strcmp(sort_keys + ((METRICS_SAMPLE *)a)->key,
+			sort_keys + ((METRICS_SAMPLE *)b)->key);
+}
+
+/**
+ * Allocate the state of a subscriber to the changed values
+ *
+ * @return	The state or NULL if out of memory
+ */
+METRICS_DELTA *
+metrics_delta_alloc()
+{
+	return (METRICS_DELTA *)calloc(1, sizeof(METRICS_DELTA));
+}
+
+/**
+ * Free the state of a subscriber
+ *
+ * @param delta	The state of the subscriber
+ */
+void
+metrics_delta_free(METRICS_DELTA *delta)
+{
+	if (delta == NULL)
+		return;
+	free(delta->last.keys.data);
+	free(delta->last.samples);
+	free(delta);
+}
+
+/**
+ * Append a changed value to the JSON object of the changes
+ */
+static void
+metrics_delta_value(METRICS_TEXT *out, int *n, const char *key, long *value)
+{
+	metrics_append(out, "%s\"", (*n)++ ? "," : "");
+	metrics_append_escaped(out, key);
+	if (value)
+		metrics_append(out, "\":%ld", *value);
+	else
+		metrics_append(out, "\":null");
+}
+
+/**
+ * Collect the values that have changed since the previous collection of a
+ * subscriber, the first collection has all of them. The changes are a JSON
+ * object on one line:
+ *
+ *	{"time":<msecs>,"full":<0 or 1>,"values":{"<key>":<value>,...}}
+ *
+ * The value of a key that is gone is null, the sums of the histograms are
+ * in microseconds. The collection reads the counters as metrics_collect
+ * does.
+ *
+ * @param delta	The state of the subscriber
+ * @param now	The time of the collection, in milliseconds
+ * @return	The changes or NULL if out of memory
+ */
+GWBUF *
+metrics_delta_collect(METRICS_DELTA *delta, unsigned long now)
+{
+METRICS		m;
+METRICS_FLATSET	*last = &delta->last;
+METRICS_SAMPLE	*ns, *os;
+GWBUF		*buf = NULL;
+char		*nkey, *okey;
+int		i = 0, j = 0, n = 0, cmp;
+
+	memset(&m, 0, sizeof(METRICS));
+	m.format = METRICS_FLAT;
+	metrics_gather(&m);
+	sort_keys = m.flat.keys.data;
+	if (m.flat.n_samples > 1)
+		qsort(m.flat.samples, m.flat.n_samples, sizeof(METRICS_SAMPLE),
+			metrics_sample_cmp);
+
+	metrics_append(&m.out, "{\"time\":%lu,\"full\":%d,\"values\":{",
+			now, delta->n_collected == 0);
+	while (i < m.flat.n_samples || j < last->n_samples)
+	{
+		ns = i < m.flat.n_samples ? &m.flat.samples[i] : NULL;
+		os = j < last->n_samples ? &last->samples[j] : NULL;
+		nkey = ns ? m.flat.keys.data + ns->key : NULL;
+		okey = os ? last->keys.data + os->key : NULL;
+		cmp = ns == NULL ? 1 : os == NULL ? -1 : strcmp(nkey, okey);
+		if (cmp < 0)
+		{
+			metrics_delta_value(&m.out, &n, nkey, &ns->value);
+			i++;
+		}
+		else if (cmp > 0)
+		{
+			metrics_delta_value(&m.out, &n, okey, NULL);
+			j++;
+		}
+		else
+		{
+			if (ns->value != os->value)
+				metrics_delta_value(&m.out, &n, nkey, &ns->value);
+			i++;
+			j++;
+		}
+	}
+	metrics_append(&m.out, "}}\n");
+
+	if (m.out.len > 0 && (buf = gwbuf_alloc(m.out.len)) != NULL)
+		memcpy(GWBUF_DATA(buf), m.out.data, m.out.len);
+	free(m.out.data);
+	for (i = 0; i < METRICS_MAX_METRICS; i++)
+		free(m.samples[i].data);
+
+	/*< The samples of this collection are compared with the next one */
+	free(last->keys.data);
+	free(last->samples);
+	*last = m.flat;
+	delta->n_collected++;
+
+	return buf;
+}
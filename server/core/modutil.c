@@ -28,10 +28,17 @@
  * @endverbatim
  */
 #include <buffer.h>
+#include <modutil.h>
 #include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <skygw_sqlscan.h>
+
+static int	modutil_canonicalise(char *, int, char *);
 
 /**
- * Check if a GWBUF structure is a MySQL COM_QUERY packet
+ * Check if a GWBUF structure is a MySQL COM_QUERY packet. A packet that
+ * continues the payload of a long one is not, whatever its first byte.
  *
  * @param	buf	Buffer to check
  * @return	True if GWBUF is a COM_QUERY packet
@@ -41,7 +48,7 @@ modutil_is_SQL(GWBUF *buf)
 {
 unsigned char	*ptr;
 
-	if (GWBUF_LENGTH(buf) < 5)
+	if (GWBUF_LENGTH(buf) < 5 || GWBUF_IS_TYPE_FRAGMENT(buf))
 		return 0;
 	ptr = GWBUF_DATA(buf);
 	return ptr[4] == 0x03;		// COM_QUERY
@@ -55,7 +62,8 @@ unsigned char	*ptr;
  * not NULL terminated.
  *
  * This routine is very simplistic and does not deal with SQL text
- * that spans multiple buffers.
+ * that spans multiple buffers, see modutil_sql_view and
+ * modutil_sql_contiguous for the text of a chain of buffers.
  *
  * The length returned is the complete length of the SQL, which may
  * be larger than the amount of data in this packet.
@@ -128,46 +136,461 @@ unsigned char	*ptr;
  *
  * @param orig	The original request in a GWBUF
  * @param sql	The SQL text to replace in the packet
- * @return A newly formed GWBUF containing the MySQL packet.
+ * @return A GWBUF containing the MySQL packet, see modutil_rewrite_SQL.
  */
 GWBUF *
 modutil_replace_SQL(GWBUF *orig, char *sql)
 {
 unsigned char	*ptr;
-int	length, newlength;
-GWBUF	*addition;
+int		length;
 
 	if (!modutil_is_SQL(orig))
 		return NULL;
 	ptr = GWBUF_DATA(orig);
-	length = *ptr++;
-	length += (*ptr++ << 8);
-	length += (*ptr++ << 8);
-        ptr += 2;  // Skip sequence id	and COM_QUERY byte
+	length = ptr[0] + (ptr[1] << 8) + (ptr[2] << 16) - 1;
+	return modutil_rewrite_SQL(orig, 0, length, sql, strlen(sql));
+}
+
+/**
+ * Replace a part of the SQL text of the COM_QUERY packet at the start of a
+ * buffer. The packet is rewritten in place if the buffer holds the whole
+ * packet, no other buffer shares the data and the new text fits in the
+ * memory of the shared data. Otherwise the new packet is built in a single
+ * buffer and the old packet is freed, the packets that followed it in the
+ * chain follow the new one.
+ *
+ * The objects attached to the buffer are removed as the statement changes.
+ *
+ * @param orig		The original request in a GWBUF
+ * @param offset	The offset in the SQL text of the part to replace
+ * @param length	The length of the part to replace
+ * @param text		The new text of the part, need not be NULL terminated
+ * @param textlen	The length of the new text
+ * @return The GWBUF of the new packet, NULL if the buffer is not a
+ *	   COM_QUERY packet or memory could not be allocated, in which case
+ *	   the original buffer is not changed
+ */
+GWBUF *
+modutil_rewrite_SQL(GWBUF *orig, int offset, int length, char *text,
+		int textlen)
+{
+unsigned char	*ptr, *sql;
+int		sqllen, newlength, packetlen, n;
+GWBUF		*newbuf, *rest;
+
+	if (!modutil_is_SQL(orig))
+		return NULL;
+	ptr = GWBUF_DATA(orig);
+	sqllen = ptr[0] + (ptr[1] << 8) + (ptr[2] << 16) - 1;
+	packetlen = sqllen + 5;
+	newlength = sqllen - length + textlen;
+	if (offset < 0 || length < 0 || offset + length > sqllen ||
+		newlength + 1 > 0xffffff)
+		return NULL;
 
-	newlength = strlen(sql);
-	if (length - 1 == newlength)
+	if (GWBUF_LENGTH(orig) >= packetlen && orig->sbuf->refcount == 1 &&
+		(unsigned char *)orig->end + (newlength - sqllen) <=
+				orig->sbuf->data + orig->sbuf->size)
 	{
-		/* New SQL is the same length as old */
-		memcpy(ptr, sql, newlength);
+		/* Rewrite in place, moving anything after the part */
+		gwbuf_remove_buffer_objects(orig);
+		sql = ptr + 5;
+		memmove(sql + offset + textlen, sql + offset + length,
+			GWBUF_LENGTH(orig) - 5 - offset - length);
+		memcpy(sql + offset, text, textlen);
+		orig->end = (unsigned char *)orig->end + (newlength - sqllen);
+		ptr[0] = (newlength + 1) & 0xff;
+		ptr[1] = ((newlength + 1) >> 8) & 0xff;
+		ptr[2] = ((newlength + 1) >> 16) & 0xff;
+		return orig;
 	}
-	else if (length - 1 > newlength)
+
+	if (GWBUF_LENGTH(orig) >= packetlen)
+		sql = ptr + 5;
+	else if ((sql = (unsigned char *)modutil_get_SQL(orig)) == NULL)
+		return NULL;
+	if ((newbuf = gwbuf_alloc(newlength + 5)) == NULL)
+		return NULL;
+	ptr = GWBUF_DATA(newbuf);
+	ptr[0] = (newlength + 1) & 0xff;
+	ptr[1] = ((newlength + 1) >> 8) & 0xff;
+	ptr[2] = ((newlength + 1) >> 16) & 0xff;
+	ptr[3] = ((unsigned char *)GWBUF_DATA(orig))[3];
+	ptr[4] = ((unsigned char *)GWBUF_DATA(orig))[4];
+	memcpy(ptr + 5, sql, offset);
+	memcpy(ptr + 5 + offset, text, textlen);
+	memcpy(ptr + 5 + offset + textlen, sql + offset + length,
+		sqllen - offset - length);
+	newbuf->gwbuf_type = orig->gwbuf_type;
+	newbuf->command = orig->command;
+
+	/* Drop the old packet, keep what follows it in the chain */
+	rest = orig;
+	while (rest && packetlen > 0)
+	{
+		n = GWBUF_LENGTH(rest);
+		if (n > packetlen)
+			n = packetlen;
+		packetlen -= n;
+		rest = gwbuf_consume(rest, n);
+	}
+	newbuf->next = rest;
+	return newbuf;
+}
+
+/**
+ * Return the SQL text of a COM_QUERY or COM_STMT_PREPARE packet as a NULL
+ * terminated string.
+ *
+ * The text is copied once for each packet and attached to the buffer data,
+ * later calls for the same packet return the same string. The statement
+ * may span several buffers of the chain. The string is freed with the
+ * buffer and must not be modified or freed by the caller.
+ *
+ * @param	buf	The packet buffer
+ * @return	The SQL text or NULL if the buffer is not a COM_QUERY or
+ *		COM_STMT_PREPARE packet or memory could not be allocated
+ */
+char *
+modutil_get_SQL(GWBUF *buf)
+{
+GWBUF		*ptr;
+unsigned char	*data;
+char		*sql;
+int		length, n, copied;
+
+	if (GWBUF_LENGTH(buf) < 5 || GWBUF_IS_TYPE_FRAGMENT(buf))
+		return NULL;
+	data = GWBUF_DATA(buf);
+	if (data[4] != 0x03 && data[4] != 0x16)	// COM_QUERY, COM_STMT_PREPARE
+		return NULL;
+	if ((sql = (char *)gwbuf_get_buffer_object_data(buf, GWBUF_OBJ_SQL)) != NULL)
+		return sql;
+
+	length = data[0] + (data[1] << 8) + (data[2] << 16) - 1;
+	if ((sql = (char *)malloc(length + 1)) == NULL)
+		return NULL;
+	n = GWBUF_LENGTH(buf) - 5;
+	copied = (n < length ? n : length);
+	memcpy(sql, data + 5, copied);
+	for (ptr = buf->next; ptr && copied < length; ptr = ptr->next)
 	{
-		/* New SQL is shorter */
-		memcpy(ptr, sql, newlength);
-		GWBUF_RTRIM(orig, (length - 1) - newlength);
+		n = GWBUF_LENGTH(ptr);
+		if (n > length - copied)
+			n = length - copied;
+		memcpy(sql + copied, GWBUF_DATA(ptr), n);
+		copied += n;
 	}
-	else
+	sql[copied] = 0;
+
+	if (!gwbuf_add_buffer_object(buf, GWBUF_OBJ_SQL, sql, free))
 	{
-		memcpy(ptr, sql, length - 1);
-		addition = gwbuf_alloc(newlength - (length - 1));
-		memcpy(GWBUF_DATA(addition), &sql[length - 1], newlength - (length - 1));
-		ptr = GWBUF_DATA(orig);
-		*ptr++ = (newlength + 1) & 0xff;
-		*ptr++ = ((newlength + 1) >> 8) & 0xff;
-		*ptr++ = ((newlength + 1) >> 16) & 0xff;
-		orig->next = addition;
+		free(sql);
+		return NULL;
 	}
+	return sql;
+}
+
+/**
+ * Start a view of the SQL text of the COM_QUERY or COM_STMT_PREPARE packet
+ * at the start of a buffer. The view is the first segment of the text, the
+ * part that is in the first buffer of the chain, modutil_sql_view_next
+ * moves it to the following segments. Nothing is copied, the segments
+ * point into the buffers and they are not NULL terminated.
+ *
+ * @param	buf	The packet buffer
+ * @param	view	The view to set
+ * @return	True if the packet has SQL text
+ */
+int
+modutil_sql_view(GWBUF *buf, MODUTIL_SQL_VIEW *view)
+{
+unsigned char	*data;
+int		length;
 
-	return orig;
+	if (GWBUF_LENGTH(buf) < 5 || GWBUF_IS_TYPE_FRAGMENT(buf))
+		return 0;
+	data = GWBUF_DATA(buf);
+	if (data[4] != 0x03 && data[4] != 0x16)	// COM_QUERY, COM_STMT_PREPARE
+		return 0;
+	length = data[0] + (data[1] << 8) + (data[2] << 16) - 1;
+	view->buffer = buf;
+	view->segment = (char *)data + 5;
+	view->length = GWBUF_LENGTH(buf) - 5;
+	if (view->length > length)
+		view->length = length;
+	view->remaining = length - view->length;
+	return 1;
+}
+
+/**
+ * Move a view of the SQL text to the next segment of the text
+ *
+ * @param	view	The view set by modutil_sql_view
+ * @return	True if the view has been moved, false at the end of the text
+ *		or of the chain of buffers
+ */
+int
+modutil_sql_view_next(MODUTIL_SQL_VIEW *view)
+{
+GWBUF	*next;
+
+	do {
+		if (view->remaining == 0 ||
+			(next = view->buffer->next) == NULL)
+			return 0;
+		view->buffer = next;
+		view->segment = (char *)GWBUF_DATA(next);
+		view->length = GWBUF_LENGTH(next);
+	} while (view->length == 0);
+	if (view->length > view->remaining)
+		view->length = view->remaining;
+	view->remaining -= view->length;
+	return 1;
+}
+
+/**
+ * Return the SQL text of the packet at the start of a buffer as a single
+ * run of characters. If the text is in the first buffer the pointer is into
+ * the packet and the text is not NULL terminated, otherwise the text of the
+ * chain is gathered once with modutil_get_SQL and kept with the buffer.
+ * The caller must not free the text.
+ *
+ * @param	buf	The packet buffer
+ * @param	sql	Set to the SQL text
+ * @param	length	Set to the length of the SQL text
+ * @return	True if the packet has SQL text
+ */
+int
+modutil_sql_contiguous(GWBUF *buf, char **sql, int *length)
+{
+MODUTIL_SQL_VIEW	view;
+
+	if (!modutil_sql_view(buf, &view))
+		return 0;
+	if (view.remaining == 0)
+	{
+		*sql = view.segment;
+		*length = view.length;
+		return 1;
+	}
+	if ((*sql = modutil_get_SQL(buf)) == NULL)
+		return 0;
+	*length = strlen(*sql);
+	return 1;
+}
+
+/**
+ * Return the fingerprint of the COM_QUERY packet at the start of a buffer.
+ *
+ * The fingerprint is made once for each packet and attached to the buffer
+ * data, so that every filter and the router that asks for it share a single
+ * pass over the statement. The statement may span several buffers of the
+ * chain.
+ *
+ * @param	buf	The packet buffer
+ * @return	The fingerprint or NULL if the buffer is not a COM_QUERY
+ *		packet or memory could not be allocated
+ */
+MODUTIL_FINGERPRINT *
+modutil_get_fingerprint(GWBUF *buf)
+{
+MODUTIL_FINGERPRINT	*fp;
+char			*sql;
+int			length, n;
+uint64_t		hash;
+
+	if (!modutil_is_SQL(buf))
+		return NULL;
+	if ((fp = (MODUTIL_FINGERPRINT *)gwbuf_get_buffer_object_data(buf,
+					GWBUF_OBJ_FINGERPRINT)) != NULL)
+		return fp;
+	if ((sql = modutil_get_SQL(buf)) == NULL)
+		return NULL;
+
+	length = strlen(sql);
+	if ((fp = (MODUTIL_FINGERPRINT *)malloc(sizeof(MODUTIL_FINGERPRINT)
+						+ length)) == NULL)
+		return NULL;
+	fp->length = modutil_canonicalise(sql, length, fp->canonical);
+
+	/*< FNV-1a */
+	hash = 14695981039346656037ULL;
+	for (n = 0; n < fp->length; n++)
+	{
+		hash ^= (unsigned char)fp->canonical[n];
+		hash *= 1099511628211ULL;
+	}
+	fp->fingerprint = hash;
+
+	if (!gwbuf_add_buffer_object(buf, GWBUF_OBJ_FINGERPRINT, fp, free))
+	{
+		free(fp);
+		return NULL;
+	}
+	return fp;
+}
+
+/**
+ * Make the canonical text of a statement. String and numeric literals are
+ * replaced by '?' and white space is collapsed to single spaces. Quoted
+ * identifiers and comments are copied as they are. The canonical text is
+ * never longer than the statement.
+ *
+ * @param	sql	The statement, not NULL terminated
+ * @param	length	The length of the statement
+ * @param	out	Buffer of length + 1 bytes for the canonical text
+ * @return	The length of the canonical text
+ */
+static int
+modutil_canonicalise(char *sql, int length, char *out)
+{
+char	*p = sql, *end = sql + length, *stop;
+int	n = 0, space = 0;
+char	q;
+
+	while (p < end)
+	{
+		if (isspace((unsigned char)*p))
+		{
+			space = 1;
+			p++;
+			continue;
+		}
+		if (space && n > 0)
+			out[n++] = ' ';
+		space = 0;
+
+		if (*p == '\'' || *p == '"')
+		{
+			/*< String literal, quotes are escaped by \ or doubling */
+			q = *p++;
+			while ((p = sqlscan_find2(p, end, q, '\\')) != NULL)
+			{
+				if (*p == '\\' && p + 1 < end)
+					p += 2;
+				else if (*p == q && p + 1 < end && p[1] == q)
+					p += 2;
+				else if (*p == q)
+					break;
+				else
+					p++;
+			}
+			p = (p ? p : end) + 1;
+			out[n++] = '?';
+		}
+		else if (isdigit((unsigned char)*p) && (p == sql ||
+			!(isalnum((unsigned char)p[-1]) || p[-1] == '_'
+			|| p[-1] == '$')))
+		{
+			/*< Number, including decimals, exponents and hex */
+			while (p < end && (isalnum((unsigned char)*p)
+					|| *p == '.' || *p == '_'))
+				p++;
+			out[n++] = '?';
+		}
+		else if (*p == '`' || *p == '#' ||
+			(*p == '/' && p + 1 < end && p[1] == '*') ||
+			(*p == '-' && p + 2 < end && p[1] == '-'
+				&& isspace((unsigned char)p[2])))
+		{
+			/*< Copy up to and including the terminator */
+			if (*p == '`')
+			{
+				for (stop = p + 1; stop < end && *stop != '`'; stop++)
+					;
+			}
+			else if (*p == '/')
+			{
+				if ((stop = sqlscan_comment_end(p + 2, end)) == NULL)
+					stop = end;
+				stop++;
+			}
+			else
+			{
+				for (stop = p; stop < end && *stop != '\n'; stop++)
+					;
+			}
+			if (stop >= end)
+				stop = end - 1;
+			memcpy(&out[n], p, stop - p + 1);
+			n += stop - p + 1;
+			p = stop + 1;
+		}
+		else
+		{
+			out[n++] = *p++;
+		}
+	}
+	out[n] = 0;
+	return n;
+}
+
+/**
+ * Create a MySQL error packet, for the modules that answer a client without
+ * passing the request to a server.
+ *
+ * @param	packet_number	The sequence number of the packet
+ * @param	merrno		The MySQL error number
+ * @param	statemsg	The five character SQL state
+ * @param	msg		The error message
+ * @return	The buffer of the packet or NULL if memory could not be
+ *		allocated
+ */
+GWBUF *
+modutil_create_mysql_err_msg(int packet_number, int merrno,
+		const char *statemsg, const char *msg)
+{
+GWBUF		*buf;
+unsigned char	*ptr;
+int		msglen = strlen(msg), length;
+
+	length = 1 + 2 + 1 + 5 + msglen;	/* 0xff, errno, '#', state */
+	if ((buf = gwbuf_alloc(4 + length)) == NULL)
+		return NULL;
+	ptr = GWBUF_DATA(buf);
+	*ptr++ = length & 0xff;
+	*ptr++ = (length >> 8) & 0xff;
+	*ptr++ = (length >> 16) & 0xff;
+	*ptr++ = packet_number;
+	*ptr++ = 0xff;
+	*ptr++ = merrno & 0xff;
+	*ptr++ = (merrno >> 8) & 0xff;
+	*ptr++ = '#';
+	memcpy(ptr, statemsg, 5);
+	ptr += 5;
+	memcpy(ptr, msg, msglen);
+	return buf;
+}
+
+/**
+ * Create a MySQL OK packet with no affected rows, for the modules that
+ * answer a client without passing the request to a server.
+ *
+ * @param	packet_number	The sequence number of the packet
+ * @param	status		The server status flags of the packet
+ * @return	The buffer of the packet or NULL if memory could not be
+ *		allocated
+ */
+GWBUF *
+modutil_create_mysql_ok(int packet_number, int status)
+{
+GWBUF		*buf;
+unsigned char	*ptr;
+
+	if ((buf = gwbuf_alloc(4 + 7)) == NULL)
+		return NULL;
+	ptr = GWBUF_DATA(buf);
+	*ptr++ = 7;
+	*ptr++ = 0;
+	*ptr++ = 0;
+	*ptr++ = packet_number;
+	*ptr++ = 0x00;			/* OK */
+	*ptr++ = 0;			/* affected rows */
+	*ptr++ = 0;			/* insert id */
+	*ptr++ = status & 0xff;
+	*ptr++ = (status >> 8) & 0xff;
+	*ptr++ = 0;			/* warnings */
+	*ptr++ = 0;
+	return buf;
 }
@@ -313,3 +313,33 @@ monitorSetReplicationHeartbeat(MONITOR *mon, int replication_heartbeat)
 		mon->module->replicationHeartbeat(mon->handle, replication_heartbeat);
 	}
 }
+
+/**
+ * Set the interval of the high resolution replication heartbeat of a monitor,
+ * the heartbeat then runs between the monitoring passes.
+ *
+ * @param mon		The monitor instance
+ * @param interval	The heartbeat interval in milliseconds
+ */
+void
+monitorSetHeartbeatInterval(MONITOR *mon, unsigned long interval)
+{
+	if (mon->module->setHeartbeatInterval != NULL) {
+		mon->module->setHeartbeatInterval(mon->handle, interval);
+	}
+}
+
+/**
+ * Set the interval of the liveness probe of a monitor, the servers are then
+ * checked for being up between the monitoring passes.
+ *
+ * @param mon		The monitor instance
+ * @param interval	The probe interval in milliseconds
+ */
+void
+monitorSetProbeInterval(MONITOR *mon, unsigned long interval)
+{
+	if (mon->module->setProbeInterval != NULL) {
+		mon->module->setProbeInterval(mon->handle, interval);
+	}
+}
@@ -15,19 +15,40 @@
  *
  * Copyright SkySQL Ab 2013
  */
+/** for CPU_SET and pthread_setaffinity_np */
+#define _GNU_SOURCE
+#include <sched.h>
+#include <dirent.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <errno.h>
+#include <time.h>
 #include <poll.h>
 #include <dcb.h>
+#include <server.h>
+#include <service.h>
+#include <session.h>
 #include <atomic.h>
 #include <gwbitmask.h>
+#include <slab.h>
+#include <thread.h>
+#include <timer.h>
+#include <statistics.h>
+#include <config.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <gw.h>
+#include <tracepoint.h>
+#include <pollengine.h>
+#include <handoff.h>
 
 extern int lm_enabled_logfiles_bitmask;
 
@@ -45,236 +66,1654 @@ extern int lm_enabled_logfiles_bitmask;
  * @endverbatim
  */
 
-static	int		epoll_fd = -1;	  /*< The epoll file descriptor */
+/**
+ * In the default, shared, mode there is a single epoll set that all the
+ * polling threads wait on. When per_thread_poll is set in the configuration
+ * every polling thread has an epoll set of its own and a SO_REUSEPORT copy
+ * of every listener. A DCB is added to the set of the thread that calls
+ * poll_add_dcb, which for the client and backend DCBs of a session is the
+ * thread that accepted the client, so the session never moves thread.
+ *
+ * With accept_balance a client the accepting thread adds is given instead to
+ * the thread of its service with the fewest DCBs in its set, or the least
+ * time in the event handlers over the last second. The backend DCBs of the
+ * session then join that thread as they are added by its handlers.
+ *
+ * A service may be bound to some of the polling threads, serviceSetPollThreads,
+ * its listeners are then only polled by those threads and its sessions never
+ * run on the other ones.
+ *
+ * The threads beyond the number set with poll_set_threads retire. In the
+ * shared mode a retiring thread simply parks. With sets of their own a
+ * retiring thread first gives up its listener copies and pooled backend
+ * connections, so that it gets no new sessions, and keeps polling until the
+ * sessions it has are all closed. The threads are only parked, so the number
+ * of threads can be raised again up to the number configured.
+ *
+ * With thread_affinity the polling threads bind themselves to their CPUs
+ * before they create their slab caches and timer wheels, the memory a
+ * thread allocates is then first touched, and so placed, on its own NUMA
+ * node. Freed DCBs are pooled by node for the same reason.
+ *
+ * With sets of their own every polling thread also has a mailbox, a list
+ * of writes and calls that other threads have made to the DCBs in its set,
+ * see poll_post_write and poll_post_call, and an
+ * eventfd in its set that wakes it up to do them. The write queue of a
+ * polling DCB is then only touched by the thread that owns the DCB, which
+ * does so without the write queue lock, see poll_writeq_owner.
+ *
+ * The event sets are implemented by an engine, see pollengine.h, epoll by
+ * default or io_uring with poll_engine=io_uring. The sets are still called
+ * the epoll sets here, whatever the engine.
+ *
+ * With work_stealing the events a thread takes from its set wait in a ready
+ * queue of the thread, and a thread that has nothing to do takes the events
+ * from the end of the queues of the others; a busy thread rings an idle one
+ * when it queues events, through the mailbox of the thread or a doorbell in
+ * the shared set. A DCB is claimed by the thread that runs its handlers,
+ * the events another thread has for it meanwhile are left to that thread,
+ * so the handlers of a DCB never run on two threads at a time. With sets
+ * of their own the events of a DCB are pinned to its owner, only the reads
+ * of the request handlers without TLS, splicing or paused reads are taken;
+ * the thief writes through the mailbox of the owner, and a write, error or
+ * hangup event left to it is raised again for the owner. A thief claims one
+ * DCB, not its session, so the DCBs of a session that a router has pinned
+ * with poll_pin_session are never taken.
+ *
+ * When a service has a priority other than normal the events a thread takes
+ * from its set are ordered by the priority of their service, high first,
+ * before they are run or queued. Only low_priority_budget events of the low
+ * priority services run in a cycle, the others are raised again in the set
+ * and come back in a later wait, so a burst of background work only ever
+ * delays the interactive events of a cycle by the budget.
+ */
+static	POLL_ENGINE	*engine = NULL;	  /*< The engine of the event sets */
+static	int		*epoll_fds = NULL; /*< The epoll file descriptors */
+static	int		n_epoll = 0;	  /*< Number of epoll sets */
+static	int		next_epoll = 0;	  /*< Round robin for non-polling threads */
+static	__thread int	thread_index = -1; /*< Polling thread id of this thread */
 static	int		do_shutdown = 0;	  /*< Flag the shutdown of the poll subsystem */
 static	GWBITMASK	poll_mask;
+static	volatile int	n_active = 0;	  /*< Polling threads that are not retired */
+static	int		*poll_owned = NULL; /*< Request handlers in each epoll set */
+static	volatile int	*poll_parked = NULL; /*< Threads parked or about to park */
+static	pthread_mutex_t	park_lock = PTHREAD_MUTEX_INITIALIZER;
+static	pthread_cond_t	park_cond = PTHREAD_COND_INITIALIZER;
+static	SPINLOCK	copy_lock = SPINLOCK_INIT; /*< Chains of listener copies */
+static	int		*poll_cpus = NULL; /*< CPU of each polling thread */
+static	int		n_cpus = 0;	  /*< Number of CPUs, 0 if not bound */
+static	__thread int	thread_node = 0; /*< NUMA node of this thread */
 static  simple_mutex_t  epoll_wait_mutex; /*< serializes calls to epoll_wait */
+static	__thread int	reading_mail = 0; /*< The thread is doing its mail */
+static	__thread int	guest_of = -1;	/*< Owner of the DCB of a stolen event */
+
+/**
+ * A write or a call posted to the polling thread that owns the DCB
+ */
+typedef struct poll_mail {
+	DCB			*dcb;	/*< The DCB to write to */
+	GWBUF			*queue;	/*< The data, NULL for the TLS records */
+	void			(*fn)(DCB *, void *); /*< The call or NULL */
+	void			*data;	/*< The data of the call */
+	struct poll_mail	*next;	/*< The mail posted before this one */
+} POLL_MAIL;
+
+/**
+ * The mailbox of a polling thread, the writers push on to the list and the
+ * owner takes the whole list at once, so there is no lock
+ */
+typedef struct {
+	POLL_MAIL * volatile	head;	/*< The last mail posted */
+	int			efd;	/*< eventfd in the set of the owner */
+	char			pad[64 - sizeof(void *) - sizeof(int)];
+} POLL_MAILBOX;
+static	POLL_MAILBOX	*mailboxes = NULL; /*< One per epoll set, or NULL */
 
 /**
- * The polling statistics
+ * The events a polling thread has taken from its set and not yet run, with
+ * work_stealing. The owner runs them from the first, the other threads take
+ * them from the last. An event taken from the middle leaves a NULL DCB.
  */
-static struct {
-	int	n_read;		/*< Number of read events   */
-	int	n_write;	/*< Number of write events  */
-	int	n_error;	/*< Number of error events  */
-	int	n_hup;		/*< Number of hangup events */
-	int	n_accept;	/*< Number of accept events */
-	int	n_polls;	/*< Number of poll cycles   */
-} pollStats;
+typedef struct {
+	DCB		*dcb;		/*< The DCB, NULL if taken */
+	__uint32_t	ev;		/*< The events */
+	int		stealable;	/*< The other threads may take it */
+} POLL_EVENT;
+
+typedef struct {
+	SPINLOCK	lock;
+	int		first;		/*< The next event to run */
+	int		last;		/*< The end of the events */
+	volatile int	n_stealable;	/*< Events the others may take */
+	POLL_EVENT	events[MAX_EVENTS];
+} POLL_READYQ;
+static	POLL_READYQ	*readyq = NULL;	/*< One per thread, NULL if no stealing */
+static	volatile int	*poll_idle = NULL; /*< Threads about to block */
+static	int		doorbell_efd = -1; /*< Wakes a thread of the shared set */
+static	int		poll_priorities = 0; /*< A service is not of normal priority */
+
+#define	POLL_STEAL_MAX	64	/*< Events a thread takes in a cycle */
+
+static	int	poll_add_dcb_thread(DCB *dcb, int owner);
+static	int	poll_next_thread(SERVICE *service);
+static	int	poll_least_loaded(SERVICE *service, int self);
+static	int	poll_copy_listener(DCB *listener, int thread,
+			struct sockaddr_storage *addr, socklen_t addrlen);
+static	int	poll_drained(int thread_id, int *draining);
+static	int	poll_park(int thread_id);
+static	void	poll_init_affinity();
+static	int	poll_thread_cpu(int thread_id);
+static	void	poll_bind_thread(int thread_id);
+static	void	poll_incoming_cpu(int fd, int thread_id);
+static	void	poll_splice_peer(DCB *dcb);
+static	void	poll_init_mailboxes();
+static	void	poll_init_readyq();
+static	void	poll_read_doorbell();
+static	void	poll_queue_events(int thread_id, struct epoll_event *events,
+					int nfds);
+static	int	poll_next_event(int thread_id, DCB **dcb, __uint32_t *ev);
+static	void	poll_wake_idle(int thread_id);
+static	int	poll_order_events(struct epoll_event *events, int nfds);
+static	int	poll_stealable_waiting(int thread_id);
+static	void	poll_read_mail(int thread_id);
+static	void	poll_post_mail(POLL_MAIL *mail);
+static	int	epoll_engine_create(int n_sets);
+static	int	epoll_engine_add(int set, int fd, void *ptr);
+static	int	epoll_engine_rearm(int set, int fd, void *ptr);
+static	int	epoll_engine_remove(int set, int fd);
+static	long	poll_usecs(struct timespec *ts);
+static	int	epoll_engine_wait(int set, struct epoll_event *events, int max,
+			int timeout);
+
+static	POLL_ENGINE	epoll_engine = {
+	"epoll",
+	epoll_engine_create,
+	epoll_engine_add,
+	epoll_engine_rearm,
+	epoll_engine_remove,
+	epoll_engine_wait
+};
+
+/**
+ * The polling statistics, each polling thread counts in a copy of its own
+ */
+enum {
+	POLL_N_READ,		/*< Number of read events   */
+	POLL_N_WRITE,		/*< Number of write events  */
+	POLL_N_ERROR,		/*< Number of error events  */
+	POLL_N_HUP,		/*< Number of hangup events */
+	POLL_N_ACCEPT,		/*< Number of accept events */
+	POLL_N_POLLS,		/*< Number of poll cycles   */
+	POLL_N_SPINS,		/*< Number of polls that found events spinning */
+	POLL_N_BLOCKS,		/*< Number of blocking polls */
+	POLL_N_SPIN_TIME,	/*< Current spin window of the threads, sum */
+	POLL_N_MAIL,		/*< Writes posted to the owner of the DCB */
+	POLL_N_STOLEN,		/*< Events taken from the queue of another thread */
+	POLL_N_MERGED,		/*< Events left to the thread running the DCB */
+	POLL_N_DEFERRED,	/*< Low priority events put off to a later cycle */
+	POLL_N_STATS
+};
+static TS_STATS	*pollStats = NULL;
+static TS_HIST	*eventLatency = NULL;	/*< Time to process an event */
+
+/**
+ * The load of a polling thread, only written by the thread itself and read
+ * without locking by the diagnostics. The times are in microseconds of the
+ * monotonic clock.
+ */
+typedef struct {
+	long		started;	/*< When the thread started to poll */
+	long		n_events;	/*< Events processed */
+	long		busy;		/*< Time spent in the event handlers */
+	long		max_event;	/*< Longest time in a single event */
+	DCB		*max_dcb;	/*< The DCB of the longest event */
+	int		max_fd;		/*< The descriptor of that DCB */
+	volatile long	cur_start;	/*< Start of the running handler */
+	DCB * volatile	cur_dcb;	/*< DCB of the running handler, or NULL */
+	long		period_start;	/*< Start of the current second */
+	long		period_busy;	/*< The busy time at its start */
+	volatile long	recent_busy;	/*< Busy time over the last second */
+	char		pad[TS_STATS_CACHE_LINE]; /*< Apart from the next thread */
+} POLL_LOAD;
+static POLL_LOAD	*pollLoad = NULL;
+
+static	void	poll_process_event(int thread_id, DCB *dcb, __uint32_t ev,
+					POLL_LOAD *load);
+static	void	poll_claim_event(int thread_id, DCB *dcb, __uint32_t ev,
+					POLL_LOAD *load);
+static	void	poll_steal_events(int thread_id, POLL_LOAD *load);
+static	void	poll_load_period(POLL_LOAD *load);
+
+static	int	spin_max = 0;	/*< Longest spin before blocking, microseconds */
 
 
 /**
  * Initialise the polling system we are using for the gateway.
  *
- * In this case we are using the Linux epoll mechanism
+ * The event sets are made by the engine of the configuration, epoll is
+ * used if the io_uring engine cannot be created
  */
 void
 poll_init()
 {
-	if (epoll_fd != -1)
+	if (engine != NULL)
 		return;
-	if ((epoll_fd = epoll_create(MAX_EVENTS)) == -1)
+	n_epoll = 1;
+	if (config_per_thread_poll() && config_threadcount() > 1)
+		n_epoll = config_threadcount();
+	n_active = config_threadcount();
+	if ((poll_owned = (int *)calloc(n_epoll, sizeof(int))) == NULL ||
+		(poll_parked = (int *)calloc(n_active > 0 ? n_active : 1,
+						sizeof(int))) == NULL)
 	{
-		perror("epoll_create");
+		perror("calloc");
 		exit(-1);
 	}
-	memset(&pollStats, 0, sizeof(pollStats));
+	if (config_poll_engine() == POLL_ENGINE_URING)
+	{
+		if ((engine = poll_uring_engine()) == NULL ||
+			engine->create(n_epoll) != 0)
+		{
+			LOGIF(LE, (skygw_log_write_flush(
+				LOGFILE_ERROR,
+				"Error : The io_uring event engine is not "
+				"available, %s. The polling threads use epoll.",
+				engine == NULL ? "MaxScale is built without it" :
+				"the kernel does not support it")));
+			engine = NULL;
+		}
+	}
+	if (engine == NULL)
+	{
+		engine = &epoll_engine;
+		if (engine->create(n_epoll) != 0)
+		{
+			perror("epoll_create");
+			exit(-1);
+		}
+	}
+	LOGIF(LM, (skygw_log_write(
+		LOGFILE_MESSAGE,
+		"Using the %s event engine with %d event sets.",
+		engine->name,
+		n_epoll)));
+	pollStats = ts_stats_alloc(POLL_N_STATS);
+	eventLatency = ts_hist_alloc();
+	pollLoad = (POLL_LOAD *)calloc(config_threadcount() > 0 ?
+				config_threadcount() : 1, sizeof(POLL_LOAD));
+	if ((spin_max = config_poll_spin_time()) < 0)
+		spin_max = 0;
 	bitmask_init(&poll_mask);
         simple_mutex_init(&epoll_wait_mutex, "epoll_wait_mutex");        
+	poll_init_affinity();
+	poll_init_mailboxes();
+	poll_init_readyq();
 }
 
 /**
- * Add a DCB to the set of descriptors within the polling
- * environment.
- *
- * @param dcb	The descriptor to add to the poll
- * @return	-1 on error or 0 on success
+ * Create the mailboxes of the polling threads when each thread has an epoll
+ * set of its own. Without them every thread writes to the DCBs itself and
+ * the write queue lock is always taken.
  */
-int
-poll_add_dcb(DCB *dcb)
+static void
+poll_init_mailboxes()
 {
-        int         rc = -1;
-        dcb_state_t old_state = DCB_STATE_UNDEFINED;
-        dcb_state_t new_state;
-        struct	epoll_event	ev;
+POLL_MAILBOX		*boxes;
+int			i;
 
-        CHK_DCB(dcb);
-        
-	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
-	ev.data.ptr = dcb;
+	if (n_epoll == 1)
+		return;
+	if ((boxes = (POLL_MAILBOX *)calloc(n_epoll,
+					sizeof(POLL_MAILBOX))) == NULL)
+		return;
+	for (i = 0; i < n_epoll; i++)
+	{
+		/*< No DCB is the mailbox */
+		if ((boxes[i].efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1 ||
+			engine->add(i, boxes[i].efd, NULL) == -1)
+		{
+			LOGIF(LE, (skygw_log_write_flush(
+				LOGFILE_ERROR,
+				"Error : Failed to add the mailbox of polling "
+				"thread %d, %s. The writes of the polling threads "
+				"are not handed to the owner of the DCB.",
+				i,
+				strerror(errno))));
+			while (i >= 0)
+			{
+				if (boxes[i].efd != -1)
+					close(boxes[i].efd);
+				i--;
+			}
+			free(boxes);
+			return;
+		}
+	}
+	mailboxes = boxes;
+}
 
-        /*<
-         * Choose new state according to the role of dcb.
-         */
-        if (dcb->dcb_role == DCB_ROLE_REQUEST_HANDLER) {
-                new_state = DCB_STATE_POLLING;
-        } else {
-                ss_dassert(dcb->dcb_role == DCB_ROLE_SERVICE_LISTENER);
-                new_state = DCB_STATE_LISTENING;
-        }
-        /*<
-         * If dcb is in unexpected state, state change fails indicating that dcb
-         * is not polling anymore.
-         */
-        if (dcb_set_state(dcb, new_state, &old_state)) {
-                rc = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, dcb->fd, &ev);
+/**
+ * Create the ready queues of the polling threads with work_stealing, a
+ * single thread has no one to take its events. The shared set gets a
+ * doorbell that wakes a thread, with sets of their own the mailbox of each
+ * thread is its doorbell.
+ */
+static void
+poll_init_readyq()
+{
+POLL_READYQ	*queues;
+int		i, n = config_threadcount();
 
-                if (rc != 0) {
-                        int eno = errno;
-                        errno = 0;
-                        LOGIF(LE, (skygw_log_write_flush(
-                                LOGFILE_ERROR,
-                                "Error : Adding dcb %p in state %s "
-                                "to poll set failed. epoll_ctl failed due "
-                                "%d, %s.",
-                                dcb,
-                                STRDCBSTATE(dcb->state),
-                                eno,
-                                strerror(eno))));
-                } else {
-                        LOGIF(LD, (skygw_log_write(
-                                LOGFILE_DEBUG,
-                                "%lu [poll_add_dcb] Added dcb %p in state %s to "
-                                "poll set.",
-                                pthread_self(),
-                                dcb,
-                                STRDCBSTATE(dcb->state))));
-                }
-                ss_dassert(rc == 0); /*< trap in debug */
-        } else {
-                LOGIF(LE, (skygw_log_write_flush(
-                        LOGFILE_ERROR,
-                        "Error : Unable to set new state for dcb %p "
-                        "in state %s. Adding to poll set failed.",
-                        dcb,
-                        STRDCBSTATE(dcb->state))));
-        }
-        
-	return rc; 
+	if (!config_work_stealing() || n < 2)
+		return;
+	if ((queues = (POLL_READYQ *)calloc(n, sizeof(POLL_READYQ))) == NULL ||
+		(poll_idle = (int *)calloc(n, sizeof(int))) == NULL)
+	{
+		free(queues);
+		return;
+	}
+	for (i = 0; i < n; i++)
+		spinlock_init(&queues[i].lock);
+	if (n_epoll == 1 &&
+		((doorbell_efd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) == -1 ||
+		 engine->add(0, doorbell_efd, NULL) == -1))
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : Failed to add the doorbell of the polling "
+			"threads, %s. The idle threads only take events once "
+			"they wake up.",
+			strerror(errno))));
+		if (doorbell_efd != -1)
+			close(doorbell_efd);
+		doorbell_efd = -1;
+	}
+	readyq = queues;
+	LOGIF(LM, (skygw_log_write(
+		LOGFILE_MESSAGE,
+		"The idle polling threads take the events of the busy ones.")));
 }
 
 /**
- * Remove a descriptor from the set of descriptors within the
- * polling environment.
- * The state change command may fail because concurrent threads may call
- * dcb_set_state simultaneously and the conflict is prevented in dcb_set_state.
+ * Reset the doorbell of the shared set once a thread has woken up for it
+ */
+static void
+poll_read_doorbell()
+{
+uint64_t	count;
+
+	if (doorbell_efd != -1 &&
+		read(doorbell_efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		errno = 0;
+}
+
+/**
+ * Create the epoll sets
  *
- * @param dcb	The descriptor to remove
- * @return	-1 on error or 0 on success
+ * @param n_sets	The number of sets
+ * @return		0 or -1 on error
  */
-int
-poll_remove_dcb(DCB *dcb)
+static int
+epoll_engine_create(int n_sets)
 {
-        struct	epoll_event ev;
-        int                 rc = -1;
-        dcb_state_t         old_state = DCB_STATE_UNDEFINED;
-        dcb_state_t         new_state = DCB_STATE_NOPOLLING;
+int	i;
 
-        CHK_DCB(dcb);
+	if ((epoll_fds = (int *)calloc(n_sets, sizeof(int))) == NULL)
+		return -1;
+	for (i = 0; i < n_sets; i++)
+	{
+		if ((epoll_fds[i] = epoll_create(MAX_EVENTS)) == -1)
+			return -1;
+	}
+	return 0;
+}
 
-        /*< It is possible that dcb has already been removed from the set */
-        if (dcb->state != DCB_STATE_POLLING) {
-                if (dcb->state == DCB_STATE_NOPOLLING ||
-                    dcb->state == DCB_STATE_ZOMBIE)
-                {
-                        rc = 0;
-                }
-                goto return_rc;
-        }
-        
-        /*<
-         * Set state to NOPOLLING and remove dcb from poll set.
-         */
-        if (dcb_set_state(dcb, new_state, &old_state)) {
-                rc = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, dcb->fd, &ev);
+static int
+epoll_engine_add(int set, int fd, void *ptr)
+{
+struct epoll_event	ev;
 
-                if (rc != 0) {
-                        int eno = errno;
-                        errno = 0;
-                        LOGIF(LE, (skygw_log_write_flush(
-                                LOGFILE_ERROR,
-                                "Error : epoll_ctl failed due %d, %s.",
-                                eno,
-                                strerror(eno))));
-                }
-                ss_dassert(rc == 0); /*< trap in debug */
-        }
-        /*<
-         * This call was redundant, but the end result is correct.
-         */
-        else if (old_state == new_state)
-        {
-                rc = 0;
-                goto return_rc;
-        }
-        
-        /*< Set bit for each maxscale thread */
-        bitmask_copy(&dcb->memdata.bitmask, poll_bitmask()); 
-        rc = 0;
-return_rc:
-        return rc;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.ptr = ptr;
+	return epoll_ctl(epoll_fds[set], EPOLL_CTL_ADD, fd, &ev);
 }
 
-#define	BLOCKINGPOLL	0	/*< Set BLOCKING POLL to 1 if using a single thread and to make
-				 *  debugging easier.
-				 */
+/**
+ * Modifying a descriptor in its set makes epoll report its state again
+ */
+static int
+epoll_engine_rearm(int set, int fd, void *ptr)
+{
+struct epoll_event	ev;
+
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.ptr = ptr;
+	return epoll_ctl(epoll_fds[set], EPOLL_CTL_MOD, fd, &ev);
+}
+
+static int
+epoll_engine_remove(int set, int fd)
+{
+struct epoll_event	ev;
+
+	return epoll_ctl(epoll_fds[set], EPOLL_CTL_DEL, fd, &ev);
+}
+
+static int
+epoll_engine_wait(int set, struct epoll_event *events, int max, int timeout)
+{
+	return epoll_wait(epoll_fds[set], events, max, timeout);
+}
 
 /**
- * The main polling loop
- *
- * This routine does the polling and despatches of IO events
- * to the DCB's. It may be called either directly or as the entry point
- * of a polling thread within the gateway.
+ * Return who may touch the write queue of a DCB. When the polling threads
+ * have mailboxes the write queue of a DCB is only touched by the thread
+ * that owns the DCB, the others post their writes to it.
  *
- * The routine will loop as long as the variable "shutdown" is set to zero,
- * setting this to a non-zero value will cause the polling loop to return.
+ * @param dcb	The DCB
+ * @return	-1 if any thread may, under the write queue lock, 1 if the
+ *		calling thread owns the write queue and 0 if another thread
+ *		does
+ */
+int
+poll_writeq_owner(DCB *dcb)
+{
+	if (mailboxes == NULL)
+		return -1;
+	return dcb->owner_thread == thread_index;
+}
+
+/**
+ * Post a write to the polling thread that owns the DCB, which is woken up
+ * if its mailbox was empty. The DCB is not freed before the owner has done
+ * the write, see dcb_process_zombies.
  *
- * There are two options for the polling, a debug option that is only useful if
- * you have a single thread. This blocks in epoll_wait until an event occurs.
+ * @param dcb	The polling DCB of another thread
+ * @param queue	The data to write, NULL to write the TLS records
+ * @return	1 if the write was posted, 0 if the mail could not be
+ *		allocated, the data is then freed
+ */
+int
+poll_post_write(DCB *dcb, GWBUF *queue)
+{
+POLL_MAIL	*mail;
+
+	if ((mail = (POLL_MAIL *)malloc(sizeof(POLL_MAIL))) == NULL)
+	{
+		while (queue != NULL)
+			queue = gwbuf_consume(queue, GWBUF_LENGTH(queue));
+		return 0;
+	}
+	mail->dcb = dcb;
+	mail->queue = queue;
+	mail->fn = NULL;
+	poll_post_mail(mail);
+	return 1;
+}
+
+/**
+ * Post a call to the polling thread that owns the DCB, so that the work of
+ * the session of the DCB is done by the thread that runs its events. The
+ * call is made in order with the writes posted to the DCB, and also when
+ * the DCB is no longer polled so that the function can release its data.
  *
- * The non-debug option does an epoll with a time out. This allows the checking of
- * shutdown value to be checked in all threads. The algorithm for polling in this
- * mode is to do a poll with no-wait, if no events are detected then the poll is
- * repeated with a time out. This allows for a quick check before making the call 
- * with timeout. The call with the timeout differs in that the Linux scheduler may
- * deschedule a process if a timeout is included, but will not do this if a 0 timeout
- * value is given. this improves performance when the gateway is under heavy load.
+ * @param dcb	The polling DCB of another thread
+ * @param fn	The function to call with the DCB and the data
+ * @param data	The data of the call
+ * @return	1 if the call was posted, 0 if the mail could not be
+ *		allocated
+ */
+int
+poll_post_call(DCB *dcb, void (*fn)(DCB *, void *), void *data)
+{
+POLL_MAIL	*mail;
+
+	if ((mail = (POLL_MAIL *)malloc(sizeof(POLL_MAIL))) == NULL)
+		return 0;
+	mail->dcb = dcb;
+	mail->queue = NULL;
+	mail->fn = fn;
+	mail->data = data;
+	poll_post_mail(mail);
+	return 1;
+}
+
+/**
+ * Push a mail to the mailbox of the owner of its DCB and wake the owner up
+ * if the mailbox was empty
  *
- * @param arg	The thread ID passed as a void * to satisfy the threading package
+ * @param mail	The mail
  */
-void
-poll_waitevents(void *arg)
+static void
+poll_post_mail(POLL_MAIL *mail)
 {
-        struct epoll_event events[MAX_EVENTS];
-        int		   i, nfds;
-        int		   thread_id = (int)arg;
-        bool               no_op = false;
-        static bool        process_zombies_only = false; /*< flag for all threads */
-        DCB                *zombies = NULL;
+DCB		*dcb = mail->dcb;
+POLL_MAILBOX	*box = &mailboxes[dcb->owner_thread];
+POLL_MAIL	*head;
+uint64_t	one = 1;
 
-	/* Add this thread to the bitmask of running polling threads */
-	bitmask_set(&poll_mask, thread_id);
+	atomic_add(&dcb->mail_pending, 1);
+	do {
+		head = box->head;
+		mail->next = head;
+	} while (!__sync_bool_compare_and_swap(&box->head, head, mail));
+	/*< The owner reads the eventfd before it takes the list */
+	if (head == NULL && write(box->efd, &one, sizeof(one)) != sizeof(one))
+	{
+		LOGIF(LE, (skygw_log_write(
+			LOGFILE_ERROR,
+			"Error : Failed to wake up polling thread %d, %s.",
+			dcb->owner_thread,
+			strerror(errno))));
+	}
+	ts_stats_add(pollStats, POLL_N_MAIL, 1);
+}
 
-	while (1)
+/**
+ * Do the writes and the calls posted to the calling polling thread, in the
+ * order they were posted. The writes to a DCB that is no longer polled are
+ * dropped.
+ *
+ * @param thread_id	The polling thread
+ */
+static void
+poll_read_mail(int thread_id)
+{
+POLL_MAILBOX	*box;
+POLL_MAIL	*mail, *list = NULL, *next;
+uint64_t	count;
+DCB		*dcb;
+
+	if (mailboxes == NULL || thread_id >= n_epoll || reading_mail)
+		return;
+	box = &mailboxes[thread_id];
+	if (read(box->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		errno = 0;
+	for (mail = __sync_lock_test_and_set(&box->head, NULL); mail; mail = next)
 	{
-#if BLOCKINGPOLL
-		nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
-#else /* BLOCKINGPOLL */
-                if (!no_op) {
-                        LOGIF(LD, (skygw_log_write(
-                                           LOGFILE_DEBUG,
-                                           "%lu [poll_waitevents] MaxScale thread "
-                                           "%d > epoll_wait <",
-                                           pthread_self(),
-                                           thread_id)));                        
-                        no_op = TRUE;
-                }
-#if 0
-                simple_mutex_lock(&epoll_wait_mutex, TRUE);
-#endif
-                
-		if ((nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, 0)) == -1)
-		{
+		next = mail->next;
+		mail->next = list;
+		list = mail;
+	}
+	reading_mail = 1;
+	for (mail = list; mail; mail = next)
+	{
+		next = mail->next;
+		dcb = mail->dcb;
+		if (mail->fn != NULL)
+		{
+			mail->fn(dcb, mail->data);
+		}
+		else if (dcb->state == DCB_STATE_POLLING ||
+			dcb->state == DCB_STATE_NOPOLLING)
+		{
+			dcb_write(dcb, mail->queue);
+		}
+		else
+		{
+			while (mail->queue != NULL)
+				mail->queue = gwbuf_consume(mail->queue,
+						GWBUF_LENGTH(mail->queue));
+		}
+		/*< The last touch of the DCB, it may be freed after this */
+		atomic_add(&dcb->mail_pending, -1);
+		free(mail);
+	}
+	reading_mail = 0;
+}
+
+/**
+ * Do the writes other threads have posted to the DCBs of the calling
+ * polling thread before it writes to one of them itself, so that the
+ * writes to a DCB stay in order
+ */
+void
+poll_read_own_mail()
+{
+	if (thread_index >= 0)
+		poll_read_mail(thread_index);
+}
+
+/**
+ * Read the CPUs of the polling threads from thread_affinity, a list of CPUs
+ * and ranges or auto for the CPUs the process may run on. The threads that
+ * the polling threads start later keep the CPUs of the process.
+ */
+static void
+poll_init_affinity()
+{
+char		*affinity = config_thread_affinity();
+char		*list, *tok, *lasts, *end;
+cpu_set_t	cpus;
+int		first, last, cpu;
+
+	if (affinity == NULL)
+		return;
+	thread_default_affinity();
+	if ((poll_cpus = (int *)calloc(CPU_SETSIZE, sizeof(int))) == NULL)
+		return;
+	if (strcasecmp(affinity, "auto") == 0)
+	{
+		if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0)
+		{
+			for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+				if (CPU_ISSET(cpu, &cpus))
+					poll_cpus[n_cpus++] = cpu;
+		}
+	}
+	else if ((list = strdup(affinity)) != NULL)
+	{
+		for (tok = strtok_r(list, ", \t", &lasts); tok;
+				tok = strtok_r(NULL, ", \t", &lasts))
+		{
+			first = last = strtol(tok, &end, 10);
+			if (*end == '-')
+				last = strtol(end + 1, &end, 10);
+			if (end == tok || *end != '\0' || first < 0 ||
+				last < first || last >= CPU_SETSIZE)
+			{
+				LOGIF(LE, (skygw_log_write_flush(
+					LOGFILE_ERROR,
+					"Error : Invalid thread_affinity '%s', the "
+					"polling threads are not bound to CPUs.",
+					affinity)));
+				n_cpus = 0;
+				break;
+			}
+			for (; first <= last && n_cpus < CPU_SETSIZE; first++)
+				poll_cpus[n_cpus++] = first;
+		}
+		free(list);
+	}
+	if (n_cpus == 0)
+	{
+		free(poll_cpus);
+		poll_cpus = NULL;
+	}
+}
+
+/**
+ * Return the CPU a polling thread is bound to
+ *
+ * @param thread_id	The polling thread
+ * @return		The CPU or -1 if the threads are not bound
+ */
+static int
+poll_thread_cpu(int thread_id)
+{
+	if (n_cpus == 0)
+		return -1;
+	return poll_cpus[thread_id % n_cpus];
+}
+
+/**
+ * Return the NUMA node of a CPU, the node directory linked from the CPU in
+ * sysfs
+ *
+ * @param cpu	The CPU
+ * @return	The node or 0 if it is not known
+ */
+static int
+poll_cpu_node(int cpu)
+{
+char		path[80];
+DIR		*dir;
+struct dirent	*ent;
+int		node = 0;
+
+	sprintf(path, "/sys/devices/system/cpu/cpu%d", cpu);
+	if ((dir = opendir(path)) == NULL)
+		return 0;
+	while ((ent = readdir(dir)) != NULL)
+	{
+		if (strncmp(ent->d_name, "node", 4) == 0 &&
+			sscanf(ent->d_name + 4, "%d", &node) == 1)
+			break;
+		node = 0;
+	}
+	closedir(dir);
+	return node;
+}
+
+/**
+ * Bind the calling polling thread to its CPU, if thread_affinity is set
+ *
+ * @param thread_id	The polling thread
+ */
+static void
+poll_bind_thread(int thread_id)
+{
+cpu_set_t	cpus;
+int		cpu, rc;
+
+	if ((cpu = poll_thread_cpu(thread_id)) < 0)
+		return;
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	if ((rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) != 0)
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : Failed to bind polling thread %d to CPU %d, "
+			"due %d, %s.",
+			thread_id,
+			cpu,
+			rc,
+			strerror(rc))));
+		return;
+	}
+	thread_node = poll_cpu_node(cpu);
+	LOGIF(LM, (skygw_log_write(
+		LOGFILE_MESSAGE,
+		"Polling thread %d bound to CPU %d, NUMA node %d.",
+		thread_id,
+		cpu,
+		thread_node)));
+}
+
+/**
+ * Prefer the connections received on the CPU of a polling thread for a
+ * listener socket of the thread. Among the SO_REUSEPORT copies of a
+ * listener the kernel then gives a connection to the thread whose CPU
+ * handles the interrupts of the receive queue of the connection.
+ *
+ * @param fd		The listener socket
+ * @param thread_id	The polling thread that polls the socket
+ */
+static void
+poll_incoming_cpu(int fd, int thread_id)
+{
+#ifdef SO_INCOMING_CPU
+int	cpu = poll_thread_cpu(thread_id);
+
+	if (cpu >= 0 && n_epoll > 1)
+		setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, (char *)&cpu, sizeof(cpu));
+#endif
+}
+
+/**
+ * Return the NUMA node of the calling polling thread
+ *
+ * @return The node, 0 if the thread is not bound to a CPU
+ */
+int
+poll_thread_node()
+{
+	return thread_node;
+}
+
+/**
+ * Return the service whose polling threads a DCB must be polled by
+ *
+ * @param dcb	The descriptor
+ * @return	The service or NULL if any thread may poll the DCB
+ */
+static SERVICE *
+poll_dcb_service(DCB *dcb)
+{
+	if (dcb->service)
+		return dcb->service;
+	if (dcb->session && dcb->session->service)
+		return dcb->session->service;
+	return NULL;
+}
+
+/**
+ * Return whether a polling thread that is not retired polls for a service
+ *
+ * @param service	The service or NULL for any service
+ * @param thread	The polling thread
+ * @return		Non-zero if the thread may be given DCBs of the service
+ */
+static int
+poll_thread_serves(SERVICE *service, int thread)
+{
+	if (thread >= n_active)
+		return 0;
+	return service == NULL || serviceUsesPollThread(service, thread);
+}
+
+/**
+ * Choose a polling thread of a service for a DCB added by a thread that
+ * does not poll for the service, the DCBs are shared out between the
+ * threads of the service in turn. Retired threads are passed over.
+ *
+ * @param service	The service of the DCB or NULL
+ * @return		The index of the polling thread
+ */
+static int
+poll_next_thread(SERVICE *service)
+{
+int	i, owner;
+
+	owner = (atomic_add(&next_epoll, 1) & 0x7fffffff) % n_epoll;
+	for (i = 0; i < n_epoll; i++, owner = (owner + 1) % n_epoll)
+	{
+		if (poll_thread_serves(service, owner))
+			return owner;
+	}
+	/*< None of the threads of the service is running */
+	return 0;
+}
+
+/**
+ * Choose the polling thread of the service that is the least loaded for an
+ * accepted client, by the DCBs in the sets or by the recent busy time of
+ * the threads with accept_balance=busy. The calling thread wins a tie.
+ *
+ * @param service	The service of the client or NULL
+ * @param self		The calling polling thread, -1 if none
+ * @return		The index of the polling thread
+ */
+static int
+poll_least_loaded(SERVICE *service, int self)
+{
+int	busy = config_accept_balance() == ACCEPT_BALANCE_BUSY && pollLoad;
+int	i, best = -1;
+long	load, best_load = 0;
+
+	for (i = 0; i < n_epoll; i++)
+	{
+		if (!poll_thread_serves(service, i))
+			continue;
+		load = busy ? pollLoad[i].recent_busy : poll_owned[i];
+		if (best == -1 || load < best_load ||
+			(load == best_load && i == self))
+		{
+			best = i;
+			best_load = load;
+		}
+	}
+	return best == -1 ? poll_next_thread(service) : best;
+}
+
+/**
+ * Add a DCB to the set of descriptors within the polling
+ * environment.
+ *
+ * @param dcb	The descriptor to add to the poll
+ * @return	-1 on error or 0 on success
+ */
+int
+poll_add_dcb(DCB *dcb)
+{
+SERVICE	*service;
+int	owner, rc;
+int	self = guest_of >= 0 ? guest_of : thread_index;
+
+        CHK_DCB(dcb);
+
+        /*<
+         * Listeners start on the set of the first thread of the service,
+         * thread 0 unless the service is bound to some threads, the copies
+         * for the other threads are made by poll_clone_listener. Request
+         * handlers join the set of the calling polling thread if it polls
+         * for the service, otherwise the DCBs are shared out between the
+         * sets of the threads of the service. A retiring thread still
+         * takes the DCBs of its own sessions, which it drains. A thread
+         * that runs an event it has taken from another thread adds them
+         * for that thread, the session stays on its thread.
+         */
+        if (n_epoll == 1)
+        {
+                owner = 0;
+        }
+        else
+        {
+                service = poll_dcb_service(dcb);
+                if (dcb->dcb_role == DCB_ROLE_SERVICE_LISTENER)
+                {
+                        for (owner = 0; owner < n_epoll; owner++)
+                                if (poll_thread_serves(service, owner))
+                                        break;
+                        if (owner == n_epoll)
+                                owner = 0;
+                }
+                else if (dcb->server == NULL && dcb->session == NULL &&
+                        config_accept_balance() != ACCEPT_BALANCE_OFF)
+                {
+                        /*< An accepted client, not yet in a session */
+                        owner = poll_least_loaded(service, self);
+                }
+                else if (self >= 0 && self < n_epoll &&
+                        (service == NULL ||
+                         serviceUsesPollThread(service, self)))
+                {
+                        owner = self;
+                }
+                else
+                {
+                        owner = poll_next_thread(service);
+                }
+        }
+
+        if (dcb->dcb_role != DCB_ROLE_REQUEST_HANDLER)
+                return poll_add_dcb_thread(dcb, owner);
+        /*<
+         * The thread is counted before its parked flag is read, a thread
+         * that parks sets the flag before it reads the count, so one of
+         * the two always sees the other. Thread 0 never parks.
+         */
+        atomic_add(&poll_owned[owner], 1);
+        if (owner != thread_index && poll_parked[owner])
+        {
+                atomic_add(&poll_owned[owner], -1);
+                owner = 0;
+                atomic_add(&poll_owned[owner], 1);
+        }
+        /*< A DCB left polling is uncounted by poll_remove_dcb */
+        if ((rc = poll_add_dcb_thread(dcb, owner)) != 0 &&
+                dcb->state != DCB_STATE_POLLING)
+                atomic_add(&poll_owned[owner], -1);
+        return rc;
+}
+
+/**
+ * Add a DCB to the epoll set of a given polling thread.
+ *
+ * @param dcb	 The descriptor to add to the poll
+ * @param owner	 The polling thread whose epoll set is used
+ * @return	-1 on error or 0 on success
+ */
+static int
+poll_add_dcb_thread(DCB *dcb, int owner)
+{
+        int         rc = -1;
+        dcb_state_t old_state = DCB_STATE_UNDEFINED;
+        dcb_state_t new_state;
+
+        CHK_DCB(dcb);
+
+        /*<
+         * Choose new state according to the role of dcb.
+         */
+        if (dcb->dcb_role == DCB_ROLE_REQUEST_HANDLER) {
+                new_state = DCB_STATE_POLLING;
+        } else {
+                ss_dassert(dcb->dcb_role == DCB_ROLE_SERVICE_LISTENER);
+                new_state = DCB_STATE_LISTENING;
+        }
+        /*<
+         * If dcb is in unexpected state, state change fails indicating that dcb
+         * is not polling anymore.
+         */
+        if (dcb_set_state(dcb, new_state, &old_state)) {
+                dcb->owner_thread = owner;
+                rc = engine->add(owner, dcb->fd, dcb);
+
+                if (rc != 0) {
+                        int eno = errno;
+                        errno = 0;
+                        LOGIF(LE, (skygw_log_write_flush(
+                                LOGFILE_ERROR,
+                                "Error : Adding dcb %p in state %s "
+                                "to poll set failed. %s failed due "
+                                "%d, %s.",
+                                dcb,
+                                STRDCBSTATE(dcb->state),
+                                engine->name,
+                                eno,
+                                strerror(eno))));
+                } else {
+                        LOGIF(LD, (skygw_log_write(
+                                LOGFILE_DEBUG,
+                                "%lu [poll_add_dcb] Added dcb %p in state %s to "
+                                "poll set.",
+                                pthread_self(),
+                                dcb,
+                                STRDCBSTATE(dcb->state))));
+                }
+                ss_dassert(rc == 0); /*< trap in debug */
+        } else {
+                LOGIF(LE, (skygw_log_write_flush(
+                        LOGFILE_ERROR,
+                        "Error : Unable to set new state for dcb %p "
+                        "in state %s. Adding to poll set failed.",
+                        dcb,
+                        STRDCBSTATE(dcb->state))));
+        }
+        
+	return rc; 
+}
+
+/**
+ * Raise the events of a descriptor in the polling environment again. The
+ * events are edge triggered, a descriptor whose read event was held back
+ * gets no new event for the data that is already waiting, the engine is
+ * asked to report the waiting data again.
+ *
+ * @param dcb	The descriptor
+ * @return	-1 on error or 0 on success
+ */
+int
+poll_rearm_dcb(DCB *dcb)
+{
+int			rc;
+
+	CHK_DCB(dcb);
+	if ((rc = engine->rearm(dcb->owner_thread, dcb->fd, dcb)) != 0)
+	{
+		int eno = errno;
+		errno = 0;
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : Raising the events of dcb %p fd %d "
+			"failed due %d, %s.",
+			dcb,
+			dcb->fd,
+			eno,
+			strerror(eno))));
+	}
+	return rc;
+}
+
+/**
+ * Remove a descriptor from the set of descriptors within the
+ * polling environment.
+ * The state change command may fail because concurrent threads may call
+ * dcb_set_state simultaneously and the conflict is prevented in dcb_set_state.
+ *
+ * @param dcb	The descriptor to remove
+ * @return	-1 on error or 0 on success
+ */
+int
+poll_remove_dcb(DCB *dcb)
+{
+        int                 rc = -1;
+        dcb_state_t         old_state = DCB_STATE_UNDEFINED;
+        dcb_state_t         new_state = DCB_STATE_NOPOLLING;
+
+        CHK_DCB(dcb);
+
+        /*< It is possible that dcb has already been removed from the set */
+        if (dcb->state != DCB_STATE_POLLING) {
+                if (dcb->state == DCB_STATE_NOPOLLING ||
+                    dcb->state == DCB_STATE_ZOMBIE)
+                {
+                        rc = 0;
+                }
+                goto return_rc;
+        }
+        
+        /*<
+         * Set state to NOPOLLING and remove dcb from poll set.
+         */
+        if (dcb_set_state(dcb, new_state, &old_state)) {
+                rc = engine->remove(dcb->owner_thread, dcb->fd);
+                atomic_add(&poll_owned[dcb->owner_thread], -1);
+
+                if (rc != 0) {
+                        int eno = errno;
+                        errno = 0;
+                        LOGIF(LE, (skygw_log_write_flush(
+                                LOGFILE_ERROR,
+                                "Error : Removing dcb %p fd %d from the "
+                                "poll set failed. %s failed due %d, %s.",
+                                dcb,
+                                dcb->fd,
+                                engine->name,
+                                eno,
+                                strerror(eno))));
+                }
+                ss_dassert(rc == 0); /*< trap in debug */
+        }
+        /*<
+         * This call was redundant, but the end result is correct.
+         */
+        else if (old_state == new_state)
+        {
+                rc = 0;
+                goto return_rc;
+        }
+        rc = 0;
+return_rc:
+        return rc;
+}
+
+/**
+ * Prepare a listening socket for the per thread copies made by
+ * poll_clone_listener. This must be called by the protocol modules before
+ * the socket is bound, it does nothing unless per_thread_poll is set.
+ *
+ * @param fd	The listening socket
+ * @return	0 on success or -1 on error
+ */
+int
+poll_reuseport(int fd)
+{
+int	one = 1;
+
+	if (n_epoll == 1)
+		return 0;
+#ifdef SO_REUSEPORT
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *)&one, sizeof(one)) == 0)
+		return 0;
+#else
+	errno = ENOPROTOOPT;
+#endif
+	LOGIF(LE, (skygw_log_write_flush(
+		LOGFILE_ERROR,
+		"Error : Unable to set SO_REUSEPORT on listener fd %d, due %d, %s. "
+		"Connections on this listener are only served by thread 0.",
+		fd,
+		errno,
+		strerror(errno))));
+	return -1;
+}
+
+/**
+ * Start listening on the socket of a listener with the backlog and the
+ * TCP_DEFER_ACCEPT time of its port, the backlog and defer_accept listener
+ * parameters. Called by the protocol modules in place of listen.
+ *
+ * The write policy of the port is set too: the listener is flagged to
+ * coalesce the writes of its clients, which the protocol copies to the
+ * client DCBs it accepts, and the TCP_NOTSENT_LOWAT of the socket is
+ * inherited by the accepted sockets. A port with fastopen accepts TCP Fast
+ * Open connections, their SYN carries the first data of the client, or the
+ * cookie alone, and the connection is accepted without waiting for the
+ * final ACK of the handshake.
+ *
+ * @param listener	The listener DCB
+ * @param fd		The bound socket
+ * @param backlog	The backlog of the protocol if the port sets none
+ * @param client_first	Non-zero if the client sends first in the protocol,
+ *			a deferred accept would only delay the others
+ * @return		0 on success or -1 on error
+ */
+int
+poll_listen(DCB *listener, int fd, int backlog, int client_first)
+{
+SERV_PROTOCOL	*port = serviceListenerPort(listener);
+
+	if (port && port->backlog > 0)
+		backlog = port->backlog;
+	if (port && port->defer_accept > 0)
+	{
+		if (!client_first)
+		{
+			LOGIF(LM, (skygw_log_write(
+				LOGFILE_MESSAGE,
+				"The clients of protocol %s wait for the server, "
+				"defer_accept is ignored for port %d.",
+				port->protocol,
+				port->port)));
+		}
+#ifdef TCP_DEFER_ACCEPT
+		else if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+					(char *)&port->defer_accept,
+					sizeof(port->defer_accept)) != 0)
+		{
+			LOGIF(LE, (skygw_log_write_flush(
+				LOGFILE_ERROR,
+				"Error : Unable to set TCP_DEFER_ACCEPT on "
+				"listener fd %d, due %d, %s.",
+				fd,
+				errno,
+				strerror(errno))));
+		}
+#endif
+	}
+	if (port && port->write_coalesce)
+		listener->flags |= DCBF_COALESCE;
+#ifdef TCP_NOTSENT_LOWAT
+	if (port && port->notsent_lowat > 0 &&
+		setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+				(char *)&port->notsent_lowat,
+				sizeof(port->notsent_lowat)) != 0)
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : Unable to set TCP_NOTSENT_LOWAT on "
+			"listener fd %d, due %d, %s.",
+			fd,
+			errno,
+			strerror(errno))));
+	}
+#endif
+#ifdef TCP_FASTOPEN
+	if (port && port->fastopen > 0 &&
+		setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN,
+				(char *)&port->fastopen,
+				sizeof(port->fastopen)) != 0)
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : Unable to set TCP_FASTOPEN on "
+			"listener fd %d, due %d, %s.",
+			fd,
+			errno,
+			strerror(errno))));
+	}
+#endif
+	return listen(fd, backlog);
+}
+
+/**
+ * Give every polling thread of the service of a listener, other than the
+ * thread that polls the listener, a copy of it.
+ *
+ * The copies are bound to the same address using SO_REUSEPORT, so the kernel
+ * spreads the incoming connections over the threads. Listeners that are not
+ * TCP sockets, or that could not be bound again, are instead added to the
+ * epoll sets of the other threads as they are. The copies share the function
+ * table and the session of the original listener and are chained from it.
+ *
+ * Must be called once the session of the listener has been created.
+ *
+ * @param listener	The listener DCB, already added with poll_add_dcb
+ * @return		The number of copies made
+ */
+int
+poll_clone_listener(DCB *listener)
+{
+struct sockaddr_storage	addr;
+socklen_t		addrlen = sizeof(addr);
+int			i, copies = 0;
+
+	CHK_DCB(listener);
+	if (n_epoll == 1 || listener->listener_copy != NULL)
+		return 0;
+	if (getsockname(listener->fd, (struct sockaddr *)&addr, &addrlen) != 0)
+		return 0;
+
+	poll_incoming_cpu(listener->fd, listener->owner_thread);
+	for (i = 0; i < n_epoll; i++)
+	{
+		if (i == listener->owner_thread ||
+			!poll_thread_serves(listener->service, i))
+			continue;
+		copies += poll_copy_listener(listener, i, &addr, addrlen);
+	}
+	LOGIF(LM, (skygw_log_write(
+		LOGFILE_MESSAGE,
+		"Listener fd %d has %d per thread copies.",
+		listener->fd,
+		copies)));
+	return copies;
+}
+
+/**
+ * Give one polling thread a copy of a listener, or the listener itself if
+ * no copy can be bound.
+ *
+ * @param listener	The listener DCB
+ * @param thread	The polling thread
+ * @param addr		The address the listener is bound to
+ * @param addrlen	The length of the address
+ * @return		1 if a copy was made, 0 otherwise
+ */
+static int
+poll_copy_listener(DCB *listener, int thread, struct sockaddr_storage *addr,
+			socklen_t addrlen)
+{
+DCB			*copy;
+SERV_PROTOCOL		*port = serviceListenerPort(listener);
+int			fd = -1, one = 1, defer = 0, taken = 0;
+socklen_t		optlen = sizeof(defer);
+
+	if ((fd = handoff_take((struct sockaddr *)addr, addrlen)) >= 0)
+	{
+		/*< A copy of the old MaxScale, bound and listening */
+		taken = 1;
+		setnonblocking(fd);
+		poll_incoming_cpu(fd, thread);
+	}
+	else if (addr->ss_family == AF_INET || addr->ss_family == AF_INET6)
+	{
+		fd = socket(addr->ss_family, SOCK_STREAM, 0);
+	}
+	if (fd >= 0 && !taken)
+	{
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *)&one, sizeof(one));
+#ifdef TCP_DEFER_ACCEPT
+		/*< A copy defers the accepts as the original does */
+		if (getsockopt(listener->fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+					(char *)&defer, &optlen) == 0 && defer > 0)
+			setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+					(char *)&defer, sizeof(defer));
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+		if (port && port->notsent_lowat > 0)
+			setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+					(char *)&port->notsent_lowat,
+					sizeof(port->notsent_lowat));
+#endif
+#ifdef TCP_FASTOPEN
+		if (port && port->fastopen > 0)
+			setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN,
+					(char *)&port->fastopen,
+					sizeof(port->fastopen));
+#endif
+		if (poll_reuseport(fd) != 0 ||
+			setnonblocking(fd) != 0 ||
+			bind(fd, (struct sockaddr *)addr, addrlen) != 0 ||
+			listen(fd, port && port->backlog > 0 ?
+					port->backlog : 10 * SOMAXCONN) != 0)
+		{
+			close(fd);
+			fd = -1;
+		}
+		else
+		{
+			poll_incoming_cpu(fd, thread);
+		}
+	}
+
+	if (fd < 0)
+	{
+		/*< Fall back to sharing the original socket */
+		if (engine->add(thread, listener->fd, listener) != 0 &&
+			errno != EEXIST)
+		{
+			LOGIF(LE, (skygw_log_write_flush(
+				LOGFILE_ERROR,
+				"Error : Failed to add listener fd %d to the "
+				"epoll set of thread %d, due %d, %s.",
+				listener->fd,
+				thread,
+				errno,
+				strerror(errno))));
+		}
+		return 0;
+	}
+
+	if ((copy = dcb_alloc(DCB_ROLE_SERVICE_LISTENER)) == NULL)
+	{
+		close(fd);
+		return 0;
+	}
+	copy->fd = fd;
+	memcpy(&copy->func, &listener->func, sizeof(GWPROTOCOL));
+	copy->session = listener->session;
+	copy->service = listener->service;
+	copy->tls_ctx = listener->tls_ctx;
+	copy->flags |= listener->flags & DCBF_COALESCE;
+	if (poll_add_dcb_thread(copy, thread) != 0)
+	{
+		copy->session = NULL;
+		dcb_close(copy);
+		return 0;
+	}
+	spinlock_acquire(&copy_lock);
+	copy->listener_copy = listener->listener_copy;
+	listener->listener_copy = copy;
+	spinlock_release(&copy_lock);
+	return 1;
+}
+
+/**
+ * Take a listener away from a polling thread that retires. The copy of the
+ * thread is closed, the kernel then no longer gives it connections. If the
+ * thread polls the original listener the listener moves to another thread
+ * of the service, or to thread 0 if the service has none left.
+ *
+ * Must be called by the retiring thread, no other thread polls its set.
+ *
+ * @param listener	The listener DCB
+ * @param thread	The polling thread that retires
+ */
+void
+poll_retire_listener(DCB *listener, int thread)
+{
+DCB			**pp, *copy = NULL;
+int			owner;
+
+	CHK_DCB(listener);
+	if (n_epoll == 1 || thread <= 0 || thread >= n_epoll)
+		return;
+
+	spinlock_acquire(&copy_lock);
+	for (pp = &listener->listener_copy; *pp != NULL; pp = &(*pp)->listener_copy)
+	{
+		if ((*pp)->owner_thread == thread)
+		{
+			copy = *pp;
+			*pp = copy->listener_copy;
+			copy->listener_copy = NULL;
+			break;
+		}
+	}
+	spinlock_release(&copy_lock);
+
+	if (copy != NULL)
+	{
+		engine->remove(thread, copy->fd);
+		dcb_set_state(copy, DCB_STATE_NOPOLLING, NULL);
+		copy->session = NULL;
+		dcb_close(copy);
+		return;
+	}
+	/*< The original socket, shared with the thread or owned by it */
+	if (engine->remove(thread, listener->fd) != 0 ||
+		listener->owner_thread != thread)
+		return;
+	for (owner = 0; owner < n_epoll; owner++)
+		if (owner != thread && poll_thread_serves(listener->service, owner))
+			break;
+	if (owner == n_epoll)
+		owner = 0;
+	listener->owner_thread = owner;
+	poll_incoming_cpu(listener->fd, owner);
+	if (engine->add(owner, listener->fd, listener) != 0 &&
+		errno != EEXIST)
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : Failed to move listener fd %d to the "
+			"epoll set of thread %d, due %d, %s.",
+			listener->fd,
+			owner,
+			errno,
+			strerror(errno))));
+	}
+}
+
+/**
+ * Give a listener back to a polling thread that resumes, the counterpart
+ * of poll_retire_listener.
+ *
+ * @param listener	The listener DCB
+ * @param thread	The polling thread that resumes
+ * @return		1 if a copy was made, 0 otherwise
+ */
+int
+poll_restore_listener(DCB *listener, int thread)
+{
+struct sockaddr_storage	addr;
+socklen_t		addrlen = sizeof(addr);
+DCB			*copy;
+
+	CHK_DCB(listener);
+	if (n_epoll == 1 || thread >= n_epoll || thread == listener->owner_thread ||
+		!poll_thread_serves(listener->service, thread))
+		return 0;
+	spinlock_acquire(&copy_lock);
+	for (copy = listener->listener_copy; copy; copy = copy->listener_copy)
+		if (copy->owner_thread == thread)
+			break;
+	spinlock_release(&copy_lock);
+	if (copy != NULL ||
+		getsockname(listener->fd, (struct sockaddr *)&addr, &addrlen) != 0)
+		return 0;
+	return poll_copy_listener(listener, thread, &addr, addrlen);
+}
+
+/**
+ * Return the sockets of a listener, the original and its per thread copies,
+ * for the handoff to a new MaxScale.
+ *
+ * @param listener	The listener DCB
+ * @param fds		The array of the sockets
+ * @param max		The size of the array
+ * @return		The number of sockets returned
+ */
+int
+poll_listener_fds(DCB *listener, int *fds, int max)
+{
+DCB	*copy;
+int	n = 0;
+
+	CHK_DCB(listener);
+	if (max <= 0)
+		return 0;
+	fds[n++] = listener->fd;
+	spinlock_acquire(&copy_lock);
+	for (copy = listener->listener_copy; copy && n < max;
+						copy = copy->listener_copy)
+		fds[n++] = copy->fd;
+	spinlock_release(&copy_lock);
+	return n;
+}
+
+/**
+ * Stop accepting on a listener once a new MaxScale has taken over its
+ * sockets. The original socket is taken out of the epoll sets of all the
+ * threads but left open, the copies are closed. The new MaxScale holds its
+ * own descriptors of them all, the connections the kernel queues go there.
+ *
+ * @param listener	The listener DCB
+ */
+void
+poll_stop_listener(DCB *listener)
+{
+DCB	*copy, *next;
+int	i;
+
+	CHK_DCB(listener);
+	spinlock_acquire(&copy_lock);
+	copy = listener->listener_copy;
+	listener->listener_copy = NULL;
+	spinlock_release(&copy_lock);
+
+	for (; copy; copy = next)
+	{
+		next = copy->listener_copy;
+		copy->listener_copy = NULL;
+		engine->remove(copy->owner_thread, copy->fd);
+		dcb_set_state(copy, DCB_STATE_NOPOLLING, NULL);
+		copy->session = NULL;
+		dcb_close(copy);
+	}
+	/*< The original may be shared with the other threads */
+	for (i = 0; i < n_epoll; i++)
+		if (i != listener->owner_thread)
+			engine->remove(i, listener->fd);
+	poll_remove_dcb(listener);
+}
+
+#define	BLOCKINGPOLL	0	/*< Set BLOCKING POLL to 1 if using a single thread and to make
+				 *  debugging easier.
+				 */
+
+/**
+ * The main polling loop
+ *
+ * This routine does the polling and despatches of IO events
+ * to the DCB's. It may be called either directly or as the entry point
+ * of a polling thread within the gateway.
+ *
+ * The routine will loop as long as the variable "shutdown" is set to zero,
+ * setting this to a non-zero value will cause the polling loop to return.
+ *
+ * There are two options for the polling, a debug option that is only useful if
+ * you have a single thread. This blocks in epoll_wait until an event occurs.
+ *
+ * The non-debug option does an epoll with a time out. This allows the checking of
+ * shutdown value to be checked in all threads. The algorithm for polling in this
+ * mode is to spin, polling with no-wait, for a short window and only then to
+ * repeat the poll with a time out. The call with the timeout may deschedule
+ * the thread, the calls with a 0 timeout will not.
+ *
+ * The spin window of each thread adapts to the recent event rate: a spin that
+ * finds events doubles the window, up to the poll_spin_time configured, and a
+ * poll that has to block halves it. A busy thread therefore keeps spinning and
+ * avoids the wakeup latency, an idle one quickly stops burning CPU.
+ *
+ * @param arg	The thread ID passed as a void * to satisfy the threading package
+ */
+void
+poll_waitevents(void *arg)
+{
+        struct epoll_event events[MAX_EVENTS];
+        int		   i, nfds;
+        int		   thread_id = (int)arg;
+        bool               no_op = false;
+        static bool        process_zombies_only = false; /*< flag for all threads */
+        int                zombies = 0;
+        int                set;
+        int                spin_time = spin_max; /*< Current spin window */
+        struct timespec    spin_start, now;
+        int                draining = 0; /*< Retiring, sessions still open */
+        POLL_LOAD          *load = pollLoad ? &pollLoad[thread_id] : NULL;
+        DCB                *dcb;
+        __uint32_t         ev;
+
+	/* Bind to the CPU first, the memory of the thread is then local */
+	poll_bind_thread(thread_id);
+	/* Add this thread to the bitmask of running polling threads */
+	bitmask_set(&poll_mask, thread_id);
+	thread_index = thread_id;
+	/* Statistics are counted in a copy private to the polling thread */
+	ts_stats_thread_init(thread_id);
+	ts_stats_add(pollStats, POLL_N_SPIN_TIME, spin_time);
+	set = thread_id < n_epoll ? thread_id : 0;
+	/* Buffers are allocated from a cache private to the polling thread */
+	slab_thread_init(thread_id);
+	/* Take part in the epoch based reclamation of DCBs */
+	dcb_thread_init(thread_id);
+	/* Timers started from this thread are run by it */
+	timer_thread_init(thread_id);
+	if (load)
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		load->started = poll_usecs(&now);
+	}
+
+	while (1)
+	{
+#if BLOCKINGPOLL
+		nfds = engine->wait(set, events, MAX_EVENTS, -1);
+#else /* BLOCKINGPOLL */
+                if (!no_op) {
+                        LOGIF(LD, (skygw_log_write(
+                                           LOGFILE_DEBUG,
+                                           "%lu [poll_waitevents] MaxScale thread "
+                                           "%d > epoll_wait <",
+                                           pthread_self(),
+                                           thread_id)));                        
+                        no_op = TRUE;
+                }
+#if 0
+                simple_mutex_lock(&epoll_wait_mutex, TRUE);
+#endif
+                
+		if ((nfds = engine->wait(set, events, MAX_EVENTS, 0)) == 0 &&
+                    spin_time > 0)
+                {
+                        /*< Spin for the current window before blocking */
+                        clock_gettime(CLOCK_MONOTONIC, &spin_start);
+                        do {
+                                nfds = engine->wait(set, events, MAX_EVENTS, 0);
+                                clock_gettime(CLOCK_MONOTONIC, &now);
+                        } while (nfds == 0 &&
+                                 (now.tv_sec - spin_start.tv_sec) * 1000000 +
+                                 (now.tv_nsec - spin_start.tv_nsec) / 1000 <
+                                 spin_time);
+
+                        if (nfds > 0)
+                        {
+                                ts_stats_add(pollStats, POLL_N_SPINS, 1);
+                                if (spin_time < spin_max)
+                                {
+                                        int grow = MIN(spin_time, spin_max - spin_time);
+                                        ts_stats_add(pollStats, POLL_N_SPIN_TIME, grow);
+                                        spin_time += grow;
+                                }
+                        }
+                }
+		if (nfds == -1)
+		{
                         int eno = errno;
                         errno = 0;
                         LOGIF(LD, (skygw_log_write(
@@ -294,17 +1733,42 @@ poll_waitevents(void *arg)
 #endif
                                 goto process_zombies;
                         } else {
-                                nfds = epoll_wait(epoll_fd,
-                                                  events,
-                                                  MAX_EVENTS,
-                                                  EPOLL_TIMEOUT);
+                                /*< Nothing within the window, shrink it */
+                                if (spin_time > 1)
+                                {
+                                        ts_stats_add(pollStats, POLL_N_SPIN_TIME,
+                                                   -(spin_time / 2));
+                                        spin_time -= spin_time / 2;
+                                }
+                                ts_stats_add(pollStats, POLL_N_BLOCKS, 1);
+                                /*<
+                                 * An idle thread is flagged before it looks
+                                 * at the queues, a busy thread queues its
+                                 * events before it looks at the flags, so
+                                 * the events are either seen or rung for.
+                                 */
+                                if (poll_idle)
+                                {
+                                        poll_idle[thread_id] = 1;
+                                        __sync_synchronize();
+                                }
+                                if (poll_idle && poll_stealable_waiting(thread_id))
+                                        nfds = 0;
+                                else
+                                        nfds = engine->wait(set,
+                                                          events,
+                                                          MAX_EVENTS,
+                                                          timer_next_timeout(
+                                                                  EPOLL_TIMEOUT));
+                                if (poll_idle)
+                                        poll_idle[thread_id] = 0;
                                 /*<
                                  * When there are zombies to be cleaned up but
                                  * no client requests, allow all threads to call
                                  * dcb_process_zombies without having to wait
                                  * for the timeout.
                                  */
-                                if (nfds == 0 && dcb_get_zombies() != NULL)
+                                if (nfds == 0 && dcb_get_zombies() > 0)
                                 {
                                         process_zombies_only = true;
                                 }
@@ -313,188 +1777,797 @@ poll_waitevents(void *arg)
 #if 0
                 simple_mutex_unlock(&epoll_wait_mutex);
 #endif
-#endif /* BLOCKINGPOLL */
-		if (nfds > 0)
-		{
+#endif /* BLOCKINGPOLL */
+		if (nfds > 0)
+		{
+                        LOGIF(LD, (skygw_log_write(
+                                LOGFILE_DEBUG,
+                                "%lu [poll_waitevents] epoll_wait found %d fds",
+                                pthread_self(),
+                                nfds)));
+			ts_stats_add(pollStats, POLL_N_POLLS, 1);
+			TRACEPOINT2(poll__wait, thread_id, nfds);
+			if (poll_priorities)
+				nfds = poll_order_events(events, nfds);
+
+			for (i = 0; i < nfds; i++)
+			{
+				if (events[i].data.ptr == NULL)
+				{
+					/*< Writes from the other threads */
+					dcb_cork_writes();
+					poll_read_mail(thread_id);
+					dcb_flush_writes();
+					if (n_epoll == 1)
+						poll_read_doorbell();
+				}
+				else if (readyq == NULL)
+				{
+					poll_process_event(thread_id,
+						(DCB *)events[i].data.ptr,
+						events[i].events, load);
+				}
+			}
+			if (readyq != NULL)
+			{
+				/*< The idle threads may take the events queued */
+				poll_queue_events(thread_id, events, nfds);
+				poll_wake_idle(thread_id);
+				while (poll_next_event(thread_id, &dcb, &ev))
+					poll_claim_event(thread_id, dcb, ev, load);
+			}
+                        no_op = FALSE;
+		}
+		/*< Help the busy threads with the events they have waiting */
+		if (readyq != NULL)
+			poll_steal_events(thread_id, load);
+        process_zombies:
+		if (load && config_accept_balance() == ACCEPT_BALANCE_BUSY)
+			poll_load_period(load);
+		timer_run();
+		zombies = dcb_process_zombies(thread_id);
+                
+                if (zombies == 0) {
+                        process_zombies_only = false;
+                }
+
+		if (do_shutdown)
+		{
+                        /*<
+                         * Remove the thread from the bitmask of running
+                         * polling threads.
+                         */
+			bitmask_clear(&poll_mask, thread_id);
+			dcb_thread_done();
+			return;
+		}
+
+		if (thread_id >= n_active)
+		{
+			if (poll_drained(thread_id, &draining))
+			{
+				if (!poll_park(thread_id))
+					return;
+				draining = 0;
+			}
+		}
+		else if (draining)
+		{
+			/*< Wanted again before its sessions were drained */
+			serviceRestoreListeners(thread_id);
+			draining = 0;
+		}
+	} /*< while(1) */
+}
+
+/**
+ * Run the handlers of the events of a DCB
+ *
+ * @param thread_id	The polling thread
+ * @param dcb		The DCB
+ * @param ev		The events
+ * @param load		The load of the thread, or NULL
+ */
+static void
+poll_process_event(int thread_id, DCB *dcb, __uint32_t ev, POLL_LOAD *load)
+{
+struct timespec	event_start, event_end;
+long		elapsed;
+int		fd;
+
+        CHK_DCB(dcb);
+	TRACEPOINT3(poll__event, thread_id, dcb, ev);
+
+#if defined(SS_DEBUG)
+        if (dcb_fake_write_ev[dcb->fd] != 0) {
+                LOGIF(LD, (skygw_log_write(
+                        LOGFILE_DEBUG,
+                        "%lu [poll_waitevents] "
+                        "Added fake events %d to ev %d.",
+                        pthread_self(),
+                        dcb_fake_write_ev[dcb->fd],
+                        ev)));
+                ev |= dcb_fake_write_ev[dcb->fd];
+                dcb_fake_write_ev[dcb->fd] = 0;
+        }
+#endif
+        ss_debug(spinlock_acquire(&dcb->dcb_initlock);)
+        ss_dassert(dcb->state != DCB_STATE_ALLOC);
+        ss_dassert(dcb->state != DCB_STATE_DISCONNECTED);
+        ss_dassert(dcb->state != DCB_STATE_FREED);
+        ss_debug(spinlock_release(&dcb->dcb_initlock);)
+
+        LOGIF(LD, (skygw_log_write(
+                LOGFILE_DEBUG,
+                "%lu [poll_waitevents] event %d dcb %p "
+                "role %s",
+                pthread_self(),
+                ev,
+                dcb,
+                STRDCBROLE(dcb->dcb_role))));
+
+	clock_gettime(CLOCK_MONOTONIC, &event_start);
+	fd = dcb->fd;
+	if (load)
+	{
+		load->cur_start = poll_usecs(&event_start);
+		load->cur_dcb = dcb;
+	}
+	dcb_cork_writes();
+	if (ev & EPOLLOUT)
+	{
+                int eno = 0;
+                eno = gw_getsockerrno(dcb->fd);
+
+                if (eno == 0)  {
+                        simple_mutex_lock(
+                                &dcb->dcb_write_lock,
+                                true);
+                        ss_info_dassert(
+                                !dcb->dcb_write_active,
+                                "Write already active");
+                        dcb->dcb_write_active = TRUE;
+                        ts_stats_add(pollStats,
+                                POLL_N_WRITE, 1);
+                        dcb->func.write_ready(dcb);
+                        dcb->dcb_write_active = FALSE;
+                        simple_mutex_unlock(
+                                &dcb->dcb_write_lock);
+                        if (dcb->splice_to != NULL)
+                                poll_splice_peer(dcb);
+                        if (dcb->paused != NULL)
+                                dcb_read_resume(dcb);
+                } else {
+                        LOGIF(LD, (skygw_log_write(
+                                LOGFILE_DEBUG,
+                                "%lu [poll_waitevents] "
+                                "EPOLLOUT due %d, %s. "
+                                "dcb %p, fd %i",
+                                pthread_self(),
+                                eno,
+                                strerror(eno),
+                                dcb,
+                                dcb->fd)));
+                }
+        }
+        if (ev & EPOLLIN)
+        {
+                simple_mutex_lock(&dcb->dcb_read_lock,
+                                  true);
+                ss_info_dassert(!dcb->dcb_read_active,
+                                "Read already active");
+                dcb->dcb_read_active = TRUE;
+
+		if (dcb->state == DCB_STATE_LISTENING)
+		{
+                        LOGIF(LD, (skygw_log_write(
+                                LOGFILE_DEBUG,
+                                "%lu [poll_waitevents] "
+                                "Accept in fd %d",
+                                pthread_self(),
+                                dcb->fd)));
+                        ts_stats_add(pollStats, POLL_N_ACCEPT, 1);
+                        dcb->func.accept(dcb);
+                }
+		else
+		{
+                        LOGIF(LD, (skygw_log_write(
+                                LOGFILE_DEBUG,
+                                "%lu [poll_waitevents] "
+                                "Read in dcb %p fd %d",
+                                pthread_self(),
+                                dcb,
+                                dcb->fd)));
+			ts_stats_add(pollStats, POLL_N_READ, 1);
+			if (dcb->paused_by != NULL)
+				;	/*< Resumed by the peer */
+			else if (dcb->splice_to != NULL)
+				dcb_splice_read(dcb);
+			else
+				dcb->func.read(dcb);
+		}
+                dcb->dcb_read_active = FALSE;
+                simple_mutex_unlock(
+                        &dcb->dcb_read_lock);
+	}
+	if (ev & EPOLLERR)
+	{
+                int eno = gw_getsockerrno(dcb->fd);
+#if defined(SS_DEBUG)
+                if (eno == 0) {
+                        eno = dcb_fake_write_errno[dcb->fd];
+                        LOGIF(LD, (skygw_log_write(
+                                LOGFILE_DEBUG,
+                                "%lu [poll_waitevents] "
+                                "Added fake errno %d. "
+                                "%s",
+                                pthread_self(),
+                                eno,
+                                strerror(eno))));
+                }
+                dcb_fake_write_errno[dcb->fd] = 0;
+#endif
+                if (eno != 0) {
                         LOGIF(LD, (skygw_log_write(
                                 LOGFILE_DEBUG,
-                                "%lu [poll_waitevents] epoll_wait found %d fds",
+                                "%lu [poll_waitevents] "
+                                "EPOLLERR due %d, %s.",
                                 pthread_self(),
-                                nfds)));
-			atomic_add(&pollStats.n_polls, 1);
+                                eno,
+                                strerror(eno))));
+                }
+                ts_stats_add(pollStats, POLL_N_ERROR, 1);
+                dcb->func.error(dcb);
+        }
 
-			for (i = 0; i < nfds; i++)
+	if (ev & EPOLLHUP)
+	{
+                int eno = 0;
+                eno = gw_getsockerrno(dcb->fd);
+
+                LOGIF(LD, (skygw_log_write(
+                        LOGFILE_DEBUG,
+                        "%lu [poll_waitevents] "
+                        "EPOLLHUP on dcb %p, fd %d. "
+                        "Errno %d, %s.",
+                        pthread_self(),
+                        dcb,
+                        dcb->fd,
+                        eno,
+                        strerror(eno))));
+                ts_stats_add(pollStats, POLL_N_HUP, 1);
+		dcb->func.hangup(dcb);
+	}
+	dcb_flush_writes();
+	clock_gettime(CLOCK_MONOTONIC, &event_end);
+	elapsed = poll_usecs(&event_end) -
+			poll_usecs(&event_start);
+	if (eventLatency)
+		ts_hist_add(eventLatency, elapsed);
+	if (load)
+	{
+		load->cur_dcb = NULL;
+		load->n_events++;
+		load->busy += elapsed;
+		if (elapsed > load->max_event)
+		{
+			load->max_event = elapsed;
+			load->max_dcb = dcb;
+			load->max_fd = fd;
+		}
+	}
+}
+
+/**
+ * The polling threads order their events by the priority of the services,
+ * called when a service is given a priority other than normal
+ */
+void
+poll_use_priorities()
+{
+	poll_priorities = 1;
+}
+
+/**
+ * Order the events a polling thread has taken from its set by the priority
+ * of the services of their DCBs, the order of the events of a class is kept.
+ * The writes of the mailbox and the doorbell come first. The low priority
+ * events beyond low_priority_budget are raised again in the set of their
+ * DCB and dropped, they come back in a later wait.
+ *
+ * @param events	The events of the set
+ * @param nfds		The number of events
+ * @return		The number of events to run in the cycle
+ */
+static int
+poll_order_events(struct epoll_event *events, int nfds)
+{
+struct epoll_event	sorted[MAX_EVENTS];
+unsigned char		prio[MAX_EVENTS];
+int			count[SERVICE_N_PRIORITIES], pos[SERVICE_N_PRIORITIES];
+int			budget = config_low_priority_budget();
+int			i, n;
+DCB			*dcb;
+SERVICE			*service;
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < nfds; i++)
+	{
+		if ((dcb = (DCB *)events[i].data.ptr) == NULL)
+			prio[i] = SERVICE_PRIORITY_HIGH;
+		else if ((service = poll_dcb_service(dcb)) == NULL)
+			prio[i] = SERVICE_PRIORITY_NORMAL;
+		else
+			prio[i] = service->priority;
+		count[prio[i]]++;
+	}
+	if (count[SERVICE_PRIORITY_NORMAL] == nfds)
+		return nfds;
+	pos[0] = 0;
+	for (i = 1; i < SERVICE_N_PRIORITIES; i++)
+		pos[i] = pos[i - 1] + count[i - 1];
+	for (i = 0; i < nfds; i++)
+		sorted[pos[prio[i]]++] = events[i];
+
+	n = nfds;
+	if (budget > 0 && count[SERVICE_PRIORITY_LOW] > budget)
+	{
+		n = nfds - count[SERVICE_PRIORITY_LOW] + budget;
+		for (i = n; i < nfds; i++)
+		{
+			dcb = (DCB *)sorted[i].data.ptr;
+			if (dcb->state == DCB_STATE_POLLING ||
+				dcb->state == DCB_STATE_LISTENING)
+				poll_rearm_dcb(dcb);
+			ts_stats_add(pollStats, POLL_N_DEFERRED, 1);
+		}
+	}
+	memcpy(events, sorted, n * sizeof(struct epoll_event));
+	return n;
+}
+
+/**
+ * Return whether a polling thread may run an event of a DCB it does not own.
+ * With the shared set every thread may. With sets of their own only the
+ * read of a request handler of the services of the thread is taken, the
+ * TLS session, the splicing and the paused reads of a DCB and the DCBs of
+ * a pinned session are its owner's.
+ *
+ * @param dcb		The DCB
+ * @param ev		The events
+ * @param thread	The thread, -1 for any thread
+ * @return		Non-zero if the thread may take the event
+ */
+static int
+poll_stealable(DCB *dcb, __uint32_t ev, int thread)
+{
+	if (n_epoll == 1)
+		return 1;
+	if (dcb->dcb_role != DCB_ROLE_REQUEST_HANDLER ||
+		(ev & EPOLLIN) == 0 || (ev & (EPOLLERR | EPOLLHUP)) != 0 ||
+		dcb->state != DCB_STATE_POLLING || dcb->tls != NULL ||
+		dcb->splice_to != NULL || dcb->paused != NULL ||
+		dcb->paused_by != NULL ||
+		(dcb->session != NULL && dcb->session->pinned))
+		return 0;
+	return thread < 0 || poll_thread_serves(poll_dcb_service(dcb), thread);
+}
+
+/**
+ * Queue the events of the DCBs a polling thread has taken from its set, the
+ * queue is empty as the thread has run or given away all the earlier ones
+ *
+ * @param thread_id	The polling thread
+ * @param events	The events of the set
+ * @param nfds		The number of events
+ */
+static void
+poll_queue_events(int thread_id, struct epoll_event *events, int nfds)
+{
+POLL_READYQ	*q = &readyq[thread_id];
+POLL_EVENT	*e;
+int		i, n = 0;
+
+	spinlock_acquire(&q->lock);
+	q->first = q->last = 0;
+	for (i = 0; i < nfds; i++)
+	{
+		if (events[i].data.ptr == NULL)
+			continue;
+		e = &q->events[q->last++];
+		e->dcb = (DCB *)events[i].data.ptr;
+		e->ev = events[i].events;
+		if ((e->stealable = poll_stealable(e->dcb, e->ev, -1)) != 0)
+			n++;
+	}
+	q->n_stealable = n;
+	spinlock_release(&q->lock);
+}
+
+/**
+ * Take the next event of the ready queue of the calling thread
+ *
+ * @param thread_id	The polling thread
+ * @param dcb		The DCB of the event
+ * @param ev		The events
+ * @return		0 if the queue is empty
+ */
+static int
+poll_next_event(int thread_id, DCB **dcb, __uint32_t *ev)
+{
+POLL_READYQ	*q = &readyq[thread_id];
+POLL_EVENT	*e;
+
+	spinlock_acquire(&q->lock);
+	while (q->first < q->last && q->events[q->first].dcb == NULL)
+		q->first++;
+	if (q->first == q->last)
+	{
+		spinlock_release(&q->lock);
+		return 0;
+	}
+	e = &q->events[q->first++];
+	*dcb = e->dcb;
+	*ev = e->ev;
+	if (e->stealable)
+		q->n_stealable--;
+	spinlock_release(&q->lock);
+	return 1;
+}
+
+/**
+ * Take an event from the end of the ready queue of another thread. With sets
+ * of their own only the read is taken, the rest of the event stays with the
+ * owner of the DCB.
+ *
+ * @param thread_id	The calling thread
+ * @param dcb		The DCB of the event
+ * @param ev		The events
+ * @return		0 if there is no event to take
+ */
+static int
+poll_steal_event(int thread_id, DCB **dcb, __uint32_t *ev)
+{
+POLL_READYQ	*q;
+POLL_EVENT	*e;
+int		n = config_threadcount();
+int		t, i, j;
+
+	for (i = 1; i < n; i++)
+	{
+		t = (thread_id + i) % n;
+		q = &readyq[t];
+		if (q->n_stealable == 0)
+			continue;
+		spinlock_acquire(&q->lock);
+		for (j = q->last - 1; j >= q->first; j--)
+		{
+			e = &q->events[j];
+			if (e->dcb == NULL || !e->stealable ||
+				!poll_stealable(e->dcb, e->ev, thread_id))
+				continue;
+			*dcb = e->dcb;
+			e->stealable = 0;
+			q->n_stealable--;
+			if (n_epoll > 1 && (e->ev & ~(EPOLLIN | EPOLLRDHUP)) != 0)
 			{
-				DCB 		*dcb = (DCB *)events[i].data.ptr;
-				__uint32_t	ev = events[i].events;
+				*ev = EPOLLIN;
+				e->ev &= ~(EPOLLIN | EPOLLRDHUP);
+			}
+			else
+			{
+				*ev = e->ev;
+				e->dcb = NULL;
+			}
+			spinlock_release(&q->lock);
+			return 1;
+		}
+		spinlock_release(&q->lock);
+	}
+	return 0;
+}
 
-                                CHK_DCB(dcb);
+/**
+ * Run an event of a DCB once the calling thread has claimed the DCB. If
+ * another thread runs the handlers of the DCB the event is left to it, it
+ * runs the events left before it gives the DCB up. A thread that runs an
+ * event of a DCB of another set runs the reads left to it, any other event
+ * is raised again for the owner.
+ *
+ * @param thread_id	The polling thread
+ * @param dcb		The DCB
+ * @param ev		The events
+ * @param load		The load of the thread, or NULL
+ */
+static void
+poll_claim_event(int thread_id, DCB *dcb, __uint32_t ev, POLL_LOAD *load)
+{
+int	guest = n_epoll > 1 && dcb->owner_thread != thread_id;
+int	rearm = 0;
 
-#if defined(SS_DEBUG)
-                                if (dcb_fake_write_ev[dcb->fd] != 0) {
-                                        LOGIF(LD, (skygw_log_write(
-                                                LOGFILE_DEBUG,
-                                                "%lu [poll_waitevents] "
-                                                "Added fake events %d to ev %d.",
-                                                pthread_self(),
-                                                dcb_fake_write_ev[dcb->fd],
-                                                ev)));
-                                        ev |= dcb_fake_write_ev[dcb->fd];
-                                        dcb_fake_write_ev[dcb->fd] = 0;
-                                }
-#endif
-                                ss_debug(spinlock_acquire(&dcb->dcb_initlock);)
-                                ss_dassert(dcb->state != DCB_STATE_ALLOC);
-                                ss_dassert(dcb->state != DCB_STATE_DISCONNECTED);
-                                ss_dassert(dcb->state != DCB_STATE_FREED);
-                                ss_debug(spinlock_release(&dcb->dcb_initlock);)
-
-                                LOGIF(LD, (skygw_log_write(
-                                        LOGFILE_DEBUG,
-                                        "%lu [poll_waitevents] event %d dcb %p "
-                                        "role %s",
-                                        pthread_self(),
-                                        ev,
-                                        dcb,
-                                        STRDCBROLE(dcb->dcb_role))));
-
-				if (ev & EPOLLOUT)
-				{
-                                        int eno = 0;
-                                        eno = gw_getsockerrno(dcb->fd);
-
-                                        if (eno == 0)  {
-                                                simple_mutex_lock(
-                                                        &dcb->dcb_write_lock,
-                                                        true);
-                                                ss_info_dassert(
-                                                        !dcb->dcb_write_active,
-                                                        "Write already active");
-                                                dcb->dcb_write_active = TRUE;
-                                                atomic_add(
-                                                &pollStats.n_write,
-                                                        1);
-                                                dcb->func.write_ready(dcb);
-                                                dcb->dcb_write_active = FALSE;
-                                                simple_mutex_unlock(
-                                                        &dcb->dcb_write_lock);
-                                        } else {
-                                                LOGIF(LD, (skygw_log_write(
-                                                        LOGFILE_DEBUG,
-                                                        "%lu [poll_waitevents] "
-                                                        "EPOLLOUT due %d, %s. "
-                                                        "dcb %p, fd %i",
-                                                        pthread_self(),
-                                                        eno,
-                                                        strerror(eno),
-                                                        dcb,
-                                                        dcb->fd)));
-                                        }
-                                }
-                                if (ev & EPOLLIN)
-                                {
-                                        simple_mutex_lock(&dcb->dcb_read_lock,
-                                                          true);
-                                        ss_info_dassert(!dcb->dcb_read_active,
-                                                        "Read already active");
-                                        dcb->dcb_read_active = TRUE;
-                                        
-					if (dcb->state == DCB_STATE_LISTENING)
-					{
-                                                LOGIF(LD, (skygw_log_write(
-                                                        LOGFILE_DEBUG,
-                                                        "%lu [poll_waitevents] "
-                                                        "Accept in fd %d",
-                                                        pthread_self(),
-                                                        dcb->fd)));
-                                                atomic_add(
-                                                        &pollStats.n_accept, 1);
-                                                dcb->func.accept(dcb);
-                                        }
-					else
-					{
-                                                LOGIF(LD, (skygw_log_write(
-                                                        LOGFILE_DEBUG,
-                                                        "%lu [poll_waitevents] "
-                                                        "Read in dcb %p fd %d",
-                                                        pthread_self(),
-                                                        dcb,
-                                                        dcb->fd)));
-						atomic_add(&pollStats.n_read, 1);
-						dcb->func.read(dcb);
-					}
-                                        dcb->dcb_read_active = FALSE;
-                                        simple_mutex_unlock(
-                                                &dcb->dcb_read_lock);
-				}
-				if (ev & EPOLLERR)
-				{
-                                        int eno = gw_getsockerrno(dcb->fd);
-#if defined(SS_DEBUG)
-                                        if (eno == 0) {
-                                                eno = dcb_fake_write_errno[dcb->fd];
-                                                LOGIF(LD, (skygw_log_write(
-                                                        LOGFILE_DEBUG,
-                                                        "%lu [poll_waitevents] "
-                                                        "Added fake errno %d. "
-                                                        "%s",
-                                                        pthread_self(),
-                                                        eno,
-                                                        strerror(eno))));
-                                        }
-                                        dcb_fake_write_errno[dcb->fd] = 0;
-#endif
-                                        if (eno != 0) {
-                                                LOGIF(LD, (skygw_log_write(
-                                                        LOGFILE_DEBUG,
-                                                        "%lu [poll_waitevents] "
-                                                        "EPOLLERR due %d, %s.",
-                                                        pthread_self(),
-                                                        eno,
-                                                        strerror(eno))));
-                                        }
-                                        atomic_add(&pollStats.n_error, 1);
-                                        dcb->func.error(dcb);
-                                }
+	spinlock_acquire(&dcb->poll_lock);
+	if (dcb->poll_busy)
+	{
+		dcb->poll_pending |= ev;
+		spinlock_release(&dcb->poll_lock);
+		ts_stats_add(pollStats, POLL_N_MERGED, 1);
+		return;
+	}
+	dcb->poll_busy = 1;
+	spinlock_release(&dcb->poll_lock);
 
-				if (ev & EPOLLHUP)
-				{
-                                        int eno = 0;
-                                        eno = gw_getsockerrno(dcb->fd);
-                                        
-                                        LOGIF(LD, (skygw_log_write(
-                                                LOGFILE_DEBUG,
-                                                "%lu [poll_waitevents] "
-                                                "EPOLLHUP on dcb %p, fd %d. "
-                                                "Errno %d, %s.",
-                                                pthread_self(),
-                                                dcb,
-                                                dcb->fd,
-                                                eno,
-                                                strerror(eno))));
-                                        atomic_add(&pollStats.n_hup, 1);
-					dcb->func.hangup(dcb);
-				}
-			} /*< for */
-                        no_op = FALSE;
+	if (guest)
+		guest_of = dcb->owner_thread;
+	while (ev != 0)
+	{
+		poll_process_event(thread_id, dcb, ev, load);
+		spinlock_acquire(&dcb->poll_lock);
+		ev = dcb->poll_pending;
+		dcb->poll_pending = 0;
+		if (guest && ev != 0 && ((ev & ~(EPOLLIN | EPOLLRDHUP)) != 0 ||
+			!poll_stealable(dcb, ev, thread_id)))
+		{
+			rearm = 1;
+			ev = 0;
 		}
-        process_zombies:
-		zombies = dcb_process_zombies(thread_id);
-                
-                if (zombies == NULL) {
-                        process_zombies_only = false;
-                }
+		if (ev == 0)
+			dcb->poll_busy = 0;
+		spinlock_release(&dcb->poll_lock);
+	}
+	guest_of = -1;
+	if (rearm && dcb->state == DCB_STATE_POLLING)
+		poll_rearm_dcb(dcb);
+}
 
-		if (do_shutdown)
+/**
+ * Ring an idle thread when the calling thread has queued events the others
+ * may take. The idle thread is unflagged so that it is rung once.
+ *
+ * @param thread_id	The calling thread
+ */
+static void
+poll_wake_idle(int thread_id)
+{
+uint64_t	one = 1;
+int		i, efd;
+
+	if (readyq[thread_id].n_stealable == 0)
+		return;
+	__sync_synchronize();
+	for (i = 0; i < n_active; i++)
+	{
+		if (i == thread_id || !poll_idle[i] ||
+			!__sync_bool_compare_and_swap(&poll_idle[i], 1, 0))
+			continue;
+		if (n_epoll > 1)
+			efd = mailboxes && i < n_epoll ? mailboxes[i].efd : -1;
+		else
+			efd = doorbell_efd;
+		if (efd != -1 && write(efd, &one, sizeof(one)) != sizeof(one))
+			errno = 0;
+		return;
+	}
+}
+
+/**
+ * Return whether another thread has events the calling thread may take
+ *
+ * @param thread_id	The calling thread
+ * @return		Non-zero if there are events to take
+ */
+static int
+poll_stealable_waiting(int thread_id)
+{
+int	i;
+
+	if (thread_id >= n_active)
+		return 0;
+	for (i = 0; i < config_threadcount(); i++)
+	{
+		if (i != thread_id && readyq[i].n_stealable > 0)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Take the events of the busy threads, up to POLL_STEAL_MAX so that the
+ * calling thread gets back to its own set. A retiring thread takes none.
+ *
+ * @param thread_id	The calling thread
+ * @param load		The load of the thread, or NULL
+ */
+static void
+poll_steal_events(int thread_id, POLL_LOAD *load)
+{
+DCB		*dcb;
+__uint32_t	ev;
+int		n;
+
+	for (n = 0; n < POLL_STEAL_MAX && !do_shutdown &&
+		thread_id < n_active && poll_steal_event(thread_id, &dcb, &ev);
+		n++)
+	{
+		ts_stats_add(pollStats, POLL_N_STOLEN, 1);
+		poll_claim_event(thread_id, dcb, ev, load);
+	}
+}
+
+/**
+ * Called at the end of each cycle by a polling thread beyond the number of
+ * active threads. With sets of their own the first call takes the listeners
+ * away from the thread and closes its pooled backend connections, the thread
+ * then polls on until the DCBs of its sessions are all removed.
+ *
+ * @param thread_id	The polling thread
+ * @param draining	Set once the thread has started to drain
+ * @return		1 if the thread holds no DCBs and may park
+ */
+static int
+poll_drained(int thread_id, int *draining)
+{
+	if (n_epoll > 1 && thread_id < n_epoll)
+	{
+		if (!*draining)
 		{
-                        /*<
-                         * Remove the thread from the bitmask of running
-                         * polling threads.
-                         */
-			bitmask_clear(&poll_mask, thread_id);
-			return;
+			*draining = 1;
+			serviceRetireListeners(thread_id);
+			server_close_persistent(thread_id);
+			LOGIF(LM, (skygw_log_write(
+				LOGFILE_MESSAGE,
+				"Polling thread %d is retiring, waiting for %d "
+				"connections to close.",
+				thread_id,
+				poll_owned[thread_id])));
 		}
-	} /*< while(1) */
+		if (poll_owned[thread_id] != 0)
+			return 0;
+	}
+	poll_parked[thread_id] = 1;
+	/*< Order the flag before the read of the count, see poll_add_dcb */
+	__sync_synchronize();
+	if (n_epoll > 1 && thread_id < n_epoll && poll_owned[thread_id] != 0)
+	{
+		poll_parked[thread_id] = 0;
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Park a retired polling thread until it is wanted again or the polling
+ * shuts down. A parked thread takes no part in the reclamation of DCBs and
+ * its timers do not run.
+ *
+ * @param thread_id	The polling thread
+ * @return		1 if the thread resumes, 0 if it must exit
+ */
+static int
+poll_park(int thread_id)
+{
+struct timespec	until;
+
+	bitmask_clear(&poll_mask, thread_id);
+	dcb_thread_done();
+	LOGIF(LM, (skygw_log_write(
+		LOGFILE_MESSAGE,
+		"Polling thread %d parked.",
+		thread_id)));
+
+	/*<
+	 * The shutdown is flagged from a signal handler, which can not take
+	 * the lock, the wait times out to look at the flag.
+	 */
+	pthread_mutex_lock(&park_lock);
+	while (thread_id >= n_active && !do_shutdown)
+	{
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += EPOLL_TIMEOUT / 1000;
+		pthread_cond_timedwait(&park_cond, &park_lock, &until);
+	}
+	pthread_mutex_unlock(&park_lock);
+	if (do_shutdown)
+		return 0;
+
+	dcb_thread_init(thread_id);
+	bitmask_set(&poll_mask, thread_id);
+	poll_parked[thread_id] = 0;
+	if (n_epoll > 1 && thread_id < n_epoll)
+		serviceRestoreListeners(thread_id);
+	LOGIF(LM, (skygw_log_write(
+		LOGFILE_MESSAGE,
+		"Polling thread %d resumed.",
+		thread_id)));
+	return 1;
+}
+
+/**
+ * Set the number of polling threads that serve connections. The threads
+ * beyond the number retire once their sessions are closed, retired threads
+ * resume when the number is raised again. Thread 0 never retires and no
+ * more threads than were configured at startup can be used.
+ *
+ * @param n	The number of active polling threads
+ * @return	The number set or -1 if it is out of range
+ */
+int
+poll_set_threads(int n)
+{
+	if (n < 1 || n > config_threadcount())
+		return -1;
+	pthread_mutex_lock(&park_lock);
+	n_active = n;
+	pthread_cond_broadcast(&park_cond);
+	pthread_mutex_unlock(&park_lock);
+	LOGIF(LM, (skygw_log_write(
+		LOGFILE_MESSAGE,
+		"Using %d of %d polling threads.",
+		n,
+		config_threadcount())));
+	return n;
+}
+
+/**
+ * Return the number of polling threads that are not retired
+ *
+ * @return The number of active polling threads
+ */
+int
+poll_active_threads()
+{
+	return n_active;
+}
+
+/**
+ * Return the polling thread that owns the DCBs added by the calling thread.
+ * The events of these DCBs are only processed by that thread. This is only
+ * the case when each polling thread has an epoll set of its own.
+ *
+ * @return The polling thread index or -1 if events may be processed by
+ *	   any polling thread
+ */
+int
+poll_owner_thread()
+{
+	if (guest_of >= 0)
+		return guest_of;
+	if (n_epoll > 1 && thread_index >= 0 && thread_index < n_epoll)
+		return thread_index;
+	return -1;
+}
+
+/**
+ * Return the id of the calling polling thread, whatever the mode of the
+ * epoll sets. The ids run from zero to the number of threads less one.
+ *
+ * @return The polling thread id or -1 if the thread does not poll
+ */
+int
+poll_thread_id()
+{
+	return thread_index;
+}
+
+/**
+ * Pin a session to the calling polling thread, the owner of the DCBs of the
+ * session. The events of these DCBs are then only ever run by the owner, so
+ * a router may keep the state of the session without a lock. A thread that
+ * runs an event it has taken from the owner can not pin the session, the
+ * owner may be running another DCB of the session meanwhile.
+ *
+ * @param session	The session
+ * @return		The owner thread or -1 if the session is not pinned
+ */
+int
+poll_pin_session(SESSION *session)
+{
+	if (guest_of >= 0 || n_epoll < 2 || thread_index < 0 ||
+		thread_index >= n_epoll)
+		return -1;
+	session->pinned = 1;
+	/*< A thread deciding to take an event sees the pin from now on */
+	__sync_synchronize();
+	return thread_index;
 }
 
 /**
@@ -525,10 +2598,206 @@ poll_bitmask()
 void
 dprintPollStats(DCB *dcb)
 {
-	dcb_printf(dcb, "Number of epoll cycles: 	%d\n", pollStats.n_polls);
-	dcb_printf(dcb, "Number of read events:   	%d\n", pollStats.n_read);
-	dcb_printf(dcb, "Number of write events: 	%d\n", pollStats.n_write);
-	dcb_printf(dcb, "Number of error events: 	%d\n", pollStats.n_error);
-	dcb_printf(dcb, "Number of hangup events:	%d\n", pollStats.n_hup);
-	dcb_printf(dcb, "Number of accept events:	%d\n", pollStats.n_accept);
+int	n_spins = ts_stats_get(pollStats, POLL_N_SPINS);
+int	n_blocks = ts_stats_get(pollStats, POLL_N_BLOCKS);
+
+	dcb_printf(dcb, "Event engine:			%s\n",
+		engine ? engine->name : "none");
+	dcb_printf(dcb, "Active polling threads:	%d of %d\n",
+		n_active, config_threadcount());
+	dcb_printf(dcb, "Number of epoll cycles: 	%d\n",
+		ts_stats_get(pollStats, POLL_N_POLLS));
+	dcb_printf(dcb, "Number of read events:   	%d\n",
+		ts_stats_get(pollStats, POLL_N_READ));
+	dcb_printf(dcb, "Number of write events: 	%d\n",
+		ts_stats_get(pollStats, POLL_N_WRITE));
+	dcb_printf(dcb, "Number of error events: 	%d\n",
+		ts_stats_get(pollStats, POLL_N_ERROR));
+	dcb_printf(dcb, "Number of hangup events:	%d\n",
+		ts_stats_get(pollStats, POLL_N_HUP));
+	dcb_printf(dcb, "Number of accept events:	%d\n",
+		ts_stats_get(pollStats, POLL_N_ACCEPT));
+	dcb_printf(dcb, "Number of polls satisfied spinning:	%d\n", n_spins);
+	dcb_printf(dcb, "Number of blocking polls:	%d\n", n_blocks);
+	if (n_blocks)
+		dcb_printf(dcb, "Spin/block ratio:		%.2f\n",
+			(double)n_spins / n_blocks);
+	dcb_printf(dcb, "Maximum spin time (usecs):	%d\n", spin_max);
+	dcb_printf(dcb, "Total current spin windows (usecs):	%d\n",
+		ts_stats_get(pollStats, POLL_N_SPIN_TIME));
+	if (mailboxes)
+		dcb_printf(dcb, "Writes handed to the DCB owner:	%d\n",
+			ts_stats_get(pollStats, POLL_N_MAIL));
+	if (poll_priorities)
+		dcb_printf(dcb, "Low priority events put off:	%d\n",
+			ts_stats_get(pollStats, POLL_N_DEFERRED));
+	if (readyq)
+	{
+		dcb_printf(dcb, "Events taken from busy threads:	%d\n",
+			ts_stats_get(pollStats, POLL_N_STOLEN));
+		dcb_printf(dcb, "Events left to the thread running the DCB:	%d\n",
+			ts_stats_get(pollStats, POLL_N_MERGED));
+	}
+}
+
+/**
+ * Read the event counters of one polling thread, without any locking
+ *
+ * @param thread	The polling thread
+ * @param stats		The counters of the thread
+ */
+void
+poll_thread_stats(int thread, POLL_THREAD_STATS *stats)
+{
+POLL_LOAD	*load;
+struct timespec	now;
+
+	memset(stats, 0, sizeof(POLL_THREAD_STATS));
+	if (pollStats == NULL)
+		return;
+	stats->n_polls = ts_stats_get_slot(pollStats, POLL_N_POLLS, thread);
+	stats->n_reads = ts_stats_get_slot(pollStats, POLL_N_READ, thread);
+	stats->n_writes = ts_stats_get_slot(pollStats, POLL_N_WRITE, thread);
+	stats->n_errors = ts_stats_get_slot(pollStats, POLL_N_ERROR, thread);
+	stats->n_hangups = ts_stats_get_slot(pollStats, POLL_N_HUP, thread);
+	stats->n_accepts = ts_stats_get_slot(pollStats, POLL_N_ACCEPT, thread);
+	stats->n_stolen = ts_stats_get_slot(pollStats, POLL_N_STOLEN, thread);
+	stats->n_dcbs = -1;
+	if (n_epoll > 1 && thread < n_epoll)
+		stats->n_dcbs = poll_owned[thread];
+	if (pollLoad == NULL || thread < 0 || thread >= config_threadcount())
+		return;
+	load = &pollLoad[thread];
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	stats->n_events = load->n_events;
+	stats->busy_usecs = load->busy;
+	if (load->started)
+		stats->idle_usecs = poll_usecs(&now) - load->started - load->busy;
+	if (stats->idle_usecs < 0)
+		stats->idle_usecs = 0;
+	stats->max_event_usecs = load->max_event;
+	stats->max_dcb = load->max_dcb;
+	stats->max_fd = load->max_fd;
+	if (load->n_events)
+		stats->avg_event_usecs = load->busy / load->n_events;
+	if ((stats->cur_dcb = load->cur_dcb) != NULL)
+		stats->cur_usecs = poll_usecs(&now) - load->cur_start;
+}
+
+/**
+ * Print the load of each polling thread to a DCB, the show threads command.
+ * A thread that has been in one event handler for long is a stuck thread,
+ * its running handler is shown.
+ *
+ * @param dcb	DCB to print to
+ */
+void
+dprintPollThreads(DCB *dcb)
+{
+POLL_THREAD_STATS	stats;
+char			dcbs[20];
+char			*state;
+long			total;
+int			i;
+
+	dcb_printf(dcb, "%-6s %-8s %10s %6s %6s %9s %9s  %s\n",
+		"Thread", "State", "Events", "Busy", "DCBs", "Avg usecs",
+		"Max usecs", "Longest handler");
+	for (i = 0; i < config_threadcount(); i++)
+	{
+		poll_thread_stats(i, &stats);
+		if (poll_parked && poll_parked[i])
+			state = "parked";
+		else if (i >= n_active)
+			state = "retiring";
+		else
+			state = "running";
+		if (stats.n_dcbs >= 0)
+			sprintf(dcbs, "%d", stats.n_dcbs);
+		else
+			strcpy(dcbs, "-");
+		total = stats.busy_usecs + stats.idle_usecs;
+		dcb_printf(dcb, "%-6d %-8s %10ld %5.1f%% %6s %9ld %9ld  ",
+			i, state, stats.n_events,
+			total ? 100.0 * stats.busy_usecs / total : 0.0,
+			dcbs, stats.avg_event_usecs, stats.max_event_usecs);
+		if (stats.max_dcb)
+			dcb_printf(dcb, "%p fd %d\n", stats.max_dcb, stats.max_fd);
+		else
+			dcb_printf(dcb, "-\n");
+		if (stats.cur_dcb)
+			dcb_printf(dcb, "       In the handler of DCB %p "
+				"for %ld usecs\n", stats.cur_dcb, stats.cur_usecs);
+	}
+	if (n_epoll == 1 && poll_owned)
+		dcb_printf(dcb, "The threads share one event set of %d DCBs.\n",
+			poll_owned[0]);
+}
+
+/**
+ * Keep the busy time of a polling thread over the last second, called by
+ * the thread itself at the end of each cycle. A thread cycles at least once
+ * in EPOLL_TIMEOUT, an idle thread soon shows an idle second.
+ *
+ * @param load	The load of the thread
+ */
+static void
+poll_load_period(POLL_LOAD *load)
+{
+struct timespec	now;
+long		usecs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	usecs = poll_usecs(&now);
+	if (usecs - load->period_start < 1000000)
+		return;
+	load->recent_busy = load->busy - load->period_busy;
+	load->period_busy = load->busy;
+	load->period_start = usecs;
+}
+
+/**
+ * A time of the monotonic clock in microseconds
+ *
+ * @param ts	The time
+ * @return	The microseconds
+ */
+static long
+poll_usecs(struct timespec *ts)
+{
+	return (long)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+/**
+ * Return the histogram of the time the polling threads take to process an
+ * event, from the call of the first handler to the flush of the writes
+ *
+ * @return	The histogram, NULL before poll_init
+ */
+TS_HIST *
+poll_event_latency()
+{
+	return eventLatency;
+}
+
+/**
+ * A spliced DCB is writable again, move the data its peer holds for it.
+ * The data of the peer is read under the read lock of the peer, as the
+ * peer may be read by the polling thread that owns it at the same time.
+ *
+ * @param dcb	The writable DCB
+ */
+static void
+poll_splice_peer(DCB *dcb)
+{
+DCB	*peer = dcb->splice_to;
+
+	if (peer == NULL)
+		return;
+	simple_mutex_lock(&peer->dcb_read_lock, true);
+	peer->dcb_read_active = TRUE;
+	if (peer->splice_to == dcb)
+		dcb_splice_read(peer);
+	peer->dcb_read_active = FALSE;
+	simple_mutex_unlock(&peer->dcb_read_lock);
 }
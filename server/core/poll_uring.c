@@ -0,0 +1,590 @@
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file poll_uring.c  - The io_uring event engine
+ *
+ * Every event set is an io_uring, each descriptor of the set has a
+ * multishot poll request in the ring, IORING_POLL_ADD_MULTI, that posts a
+ * completion each time the state of the descriptor changes. The reads and
+ * writes of the DCBs stay as they are, the engine replaces the epoll calls.
+ *
+ * The requests a polling thread makes to its own ring are not submitted
+ * straight away, they go with the wait of the thread, so a thread that
+ * adds and raises descriptors as it processes its events makes a single
+ * system call for all of them and the wait. A poll that finds no events
+ * only looks at the completion ring, it makes no system call at all. The
+ * requests of the other threads, and every removal, are submitted at once.
+ *
+ * A descriptor has a request record that is the user data of its poll
+ * requests. The record of a removed descriptor is freed with the last
+ * completion of its requests, a completion never refers to freed memory.
+ * A one shot poll request raises the state of a descriptor again, the
+ * counterpart of an EPOLL_CTL_MOD.
+ *
+ * The engine needs a kernel with multishot poll requests and the extended
+ * arguments of io_uring_enter, 5.13 or later. The create of the engine
+ * fails on older kernels and the polling threads then use epoll.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <pollengine.h>
+#include <spinlock.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#include <linux/io_uring.h>
+#if defined(IORING_POLL_ADD_MULTI) && defined(IORING_ENTER_EXT_ARG) && \
+	defined(IORING_FEAT_RSRC_TAGS)
+#define	URING_ENGINE	1
+#endif
+#endif
+
+extern int lm_enabled_logfiles_bitmask;
+
+#if defined(URING_ENGINE)
+
+#define	URING_ENTRIES		1024	/*< Submission queue entries */
+#define	URING_CQ_ENTRIES	16384	/*< Completion queue entries */
+#define	URING_POLL_EVENTS	(EPOLLIN | EPOLLOUT | EPOLLRDHUP)
+#define	URING_REARM		1UL	/*< User data bit of the one shot polls */
+
+/**
+ * The request record of a descriptor in a ring
+ */
+typedef struct {
+	void		*ptr;		/*< Reported with the events */
+	int		fd;		/*< The descriptor */
+	int		armed;		/*< The multishot poll is in the ring */
+	int		n_rearm;	/*< One shot polls in the ring */
+	int		removed;	/*< Removed, freed with the last completion */
+	unsigned	gen;		/*< Wait that last reported the descriptor */
+	int		slot;		/*< Its event in that wait */
+} URING_POLL;
+
+/**
+ * An event set, the rings shared with the kernel and the records of the
+ * descriptors by descriptor number
+ */
+typedef struct {
+	int			fd;		/*< The io_uring */
+	SPINLOCK		lock;		/*< Protects the ring and records */
+	unsigned		*sq_head;
+	unsigned		*sq_tail;
+	unsigned		*sq_mask;
+	unsigned		*sq_array;
+	unsigned		sq_entries;
+	struct io_uring_sqe	*sqes;
+	unsigned		*cq_head;
+	unsigned		*cq_tail;
+	unsigned		*cq_mask;
+	struct io_uring_cqe	*cqes;
+	unsigned		gen;		/*< Count of the waits */
+	URING_POLL		**by_fd;	/*< Records by descriptor */
+	int			n_fd;		/*< Size of by_fd */
+} URING_RING;
+
+static	URING_RING	*rings = NULL;
+static	int		n_rings = 0;
+static	__thread int	own_ring = -1;	/*< Ring the thread waits on */
+
+static int
+uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+		void *arg, size_t argsz)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+				flags, arg, argsz);
+}
+
+/**
+ * Map the rings of an io_uring
+ *
+ * @param ring	The ring, fd set
+ * @param p	The parameters the setup returned
+ * @return	0 or -1 on error
+ */
+static int
+uring_map(URING_RING *ring, struct io_uring_params *p)
+{
+size_t	sq_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+size_t	cq_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+char	*sq, *cq;
+
+	if ((p->features & IORING_FEAT_SINGLE_MMAP) && cq_size > sq_size)
+		sq_size = cq_size;
+	sq = mmap(NULL, sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+			ring->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		return -1;
+	cq = sq;
+	if (!(p->features & IORING_FEAT_SINGLE_MMAP))
+	{
+		cq = mmap(NULL, cq_size, PROT_READ|PROT_WRITE,
+			MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			return -1;
+	}
+	ring->sqes = mmap(NULL, p->sq_entries * sizeof(struct io_uring_sqe),
+			PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+			ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		return -1;
+	ring->sq_head = (unsigned *)(sq + p->sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + p->sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + p->sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + p->sq_off.array);
+	ring->sq_entries = p->sq_entries;
+	ring->cq_head = (unsigned *)(cq + p->cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + p->cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + p->cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+	return 0;
+}
+
+/**
+ * Create the rings of the event sets
+ *
+ * @param n_sets	The number of event sets
+ * @return		0 or -1 if the kernel has no io_uring that will do
+ */
+static int
+uring_create(int n_sets)
+{
+struct io_uring_params	p;
+int			i;
+
+	if ((rings = (URING_RING *)calloc(n_sets, sizeof(URING_RING))) == NULL)
+		return -1;
+	for (i = 0; i < n_sets; i++)
+	{
+		memset(&p, 0, sizeof(p));
+		p.flags = IORING_SETUP_CQSIZE;
+		p.cq_entries = URING_CQ_ENTRIES;
+		spinlock_init(&rings[i].lock);
+		if ((rings[i].fd = uring_setup(URING_ENTRIES, &p)) < 0)
+			break;
+		if ((p.features & IORING_FEAT_EXT_ARG) == 0 ||
+			(p.features & IORING_FEAT_RSRC_TAGS) == 0 ||
+			(p.features & IORING_FEAT_NODROP) == 0)
+		{
+			/*< Older than 5.13, no multishot poll requests */
+			close(rings[i].fd);
+			errno = ENOSYS;
+			break;
+		}
+		if (uring_map(&rings[i], &p) != 0)
+		{
+			close(rings[i].fd);
+			break;
+		}
+	}
+	if (i < n_sets)
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : Failed to create the io_uring of event set %d "
+			"due %d, %s.",
+			i,
+			errno,
+			strerror(errno))));
+		while (--i >= 0)
+			close(rings[i].fd);
+		free(rings);
+		rings = NULL;
+		return -1;
+	}
+	n_rings = n_sets;
+	return 0;
+}
+
+/**
+ * Return the number of requests in the submission queue that the kernel
+ * has not taken yet
+ */
+static unsigned
+uring_unsubmitted(URING_RING *ring)
+{
+	return *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Submit the requests of a ring, called with the lock of the ring held
+ *
+ * @param ring	The ring
+ * @return	0 or -1 on error
+ */
+static int
+uring_submit(URING_RING *ring)
+{
+unsigned	n;
+int		rc;
+
+	while ((n = uring_unsubmitted(ring)) > 0)
+	{
+		rc = uring_enter(ring->fd, n, 0, 0, NULL, 0);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * Get a free submission queue entry, called with the lock of the ring held.
+ * A full queue is submitted first.
+ *
+ * @param ring	The ring
+ * @return	The zeroed entry or NULL
+ */
+static struct io_uring_sqe *
+uring_get_sqe(URING_RING *ring)
+{
+unsigned		tail = *ring->sq_tail;
+unsigned		idx;
+struct io_uring_sqe	*sqe;
+
+	if (uring_unsubmitted(ring) >= ring->sq_entries)
+	{
+		if (uring_submit(ring) != 0)
+			return NULL;
+	}
+	idx = tail & *ring->sq_mask;
+	sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[idx] = idx;
+	return sqe;
+}
+
+/**
+ * Make a filled entry visible to the kernel
+ */
+static void
+uring_push(URING_RING *ring)
+{
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Queue a poll request of a descriptor, called with the lock of the ring
+ * held
+ *
+ * @param ring	The ring
+ * @param rec	The record of the descriptor
+ * @param multi	Non-zero for the multishot poll, zero for a one shot poll
+ * @return	0 or -1 on error
+ */
+static int
+uring_poll(URING_RING *ring, URING_POLL *rec, int multi)
+{
+struct io_uring_sqe	*sqe;
+
+	if ((sqe = uring_get_sqe(ring)) == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = rec->fd;
+	sqe->poll32_events = URING_POLL_EVENTS;
+	sqe->len = multi ? IORING_POLL_ADD_MULTI : 0;
+	sqe->user_data = (uintptr_t)rec | (multi ? 0 : URING_REARM);
+	uring_push(ring);
+	if (multi)
+		rec->armed = 1;
+	else
+		rec->n_rearm++;
+	return 0;
+}
+
+/**
+ * Queue the removal of a poll request, called with the lock of the ring
+ * held. The completion of the removal itself has no user data.
+ */
+static void
+uring_poll_remove(URING_RING *ring, uintptr_t user_data)
+{
+struct io_uring_sqe	*sqe;
+
+	if ((sqe = uring_get_sqe(ring)) == NULL)
+		return;
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = user_data;
+	sqe->user_data = 0;
+	uring_push(ring);
+}
+
+/**
+ * Submit the requests now unless the thread waits on the ring, its own
+ * requests then go with its next wait
+ */
+static int
+uring_flush(int set)
+{
+	if (n_rings > 1 && own_ring == set)
+		return 0;
+	return uring_submit(&rings[set]);
+}
+
+static int
+uring_add(int set, int fd, void *ptr)
+{
+URING_RING	*ring = &rings[set];
+URING_POLL	*rec;
+int		rc = -1;
+
+	spinlock_acquire(&ring->lock);
+	if (fd >= ring->n_fd)
+	{
+		int		n = ring->n_fd ? ring->n_fd : 1024;
+		URING_POLL	**by_fd;
+
+		while (n <= fd)
+			n *= 2;
+		if ((by_fd = realloc(ring->by_fd, n * sizeof(URING_POLL *))) == NULL)
+		{
+			spinlock_release(&ring->lock);
+			errno = ENOMEM;
+			return -1;
+		}
+		memset(by_fd + ring->n_fd, 0,
+			(n - ring->n_fd) * sizeof(URING_POLL *));
+		ring->by_fd = by_fd;
+		ring->n_fd = n;
+	}
+	if (ring->by_fd[fd] != NULL)
+	{
+		errno = EEXIST;
+	}
+	else if ((rec = (URING_POLL *)calloc(1, sizeof(URING_POLL))) == NULL)
+	{
+		errno = ENOMEM;
+	}
+	else
+	{
+		rec->ptr = ptr;
+		rec->fd = fd;
+		if (uring_poll(ring, rec, 1) != 0)
+		{
+			free(rec);
+		}
+		else
+		{
+			ring->by_fd[fd] = rec;
+			rc = uring_flush(set);
+		}
+	}
+	spinlock_release(&ring->lock);
+	return rc;
+}
+
+static int
+uring_rearm(int set, int fd, void *ptr)
+{
+URING_RING	*ring = &rings[set];
+URING_POLL	*rec;
+int		rc = 0;
+
+	spinlock_acquire(&ring->lock);
+	if (fd >= ring->n_fd || (rec = ring->by_fd[fd]) == NULL)
+	{
+		errno = ENOENT;
+		rc = -1;
+	}
+	else if (rec->n_rearm == 0)
+	{
+		/*< A one shot poll reports the state the descriptor has now */
+		rec->ptr = ptr;
+		if ((rc = uring_poll(ring, rec, 0)) == 0)
+			rc = uring_flush(set);
+	}
+	spinlock_release(&ring->lock);
+	return rc;
+}
+
+static int
+uring_remove(int set, int fd)
+{
+URING_RING	*ring = &rings[set];
+URING_POLL	*rec;
+int		rc = 0;
+
+	spinlock_acquire(&ring->lock);
+	if (fd >= ring->n_fd || (rec = ring->by_fd[fd]) == NULL)
+	{
+		spinlock_release(&ring->lock);
+		errno = ENOENT;
+		return -1;
+	}
+	ring->by_fd[fd] = NULL;
+	rec->removed = 1;
+	if (rec->armed)
+		uring_poll_remove(ring, (uintptr_t)rec);
+	if (rec->n_rearm)
+		uring_poll_remove(ring, (uintptr_t)rec | URING_REARM);
+	if (!rec->armed && rec->n_rearm == 0)
+		free(rec);
+	/*< The descriptor may be closed next, remove the requests now */
+	rc = uring_submit(ring);
+	spinlock_release(&ring->lock);
+	return rc;
+}
+
+/**
+ * Take the completions of a ring as events, called with the lock of the
+ * ring held. The completions of one descriptor in a wait are merged into
+ * one event.
+ *
+ * @return	The number of events
+ */
+static int
+uring_reap(URING_RING *ring, struct epoll_event *events, int max)
+{
+unsigned		head = *ring->cq_head;
+unsigned		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+struct io_uring_cqe	*cqe;
+URING_POLL		*rec;
+int			n = 0, rearm;
+
+	ring->gen++;
+	while (head != tail && n < max)
+	{
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		head++;
+		if (cqe->user_data == 0)
+			continue;
+		rec = (URING_POLL *)(uintptr_t)(cqe->user_data & ~URING_REARM);
+		rearm = (cqe->user_data & URING_REARM) != 0;
+		if (cqe->res > 0 && !rec->removed)
+		{
+			if (rec->gen == ring->gen)
+			{
+				events[rec->slot].events |= cqe->res;
+			}
+			else
+			{
+				rec->gen = ring->gen;
+				rec->slot = n;
+				events[n].events = cqe->res;
+				events[n].data.ptr = rec->ptr;
+				n++;
+			}
+		}
+		if (rearm)
+		{
+			rec->n_rearm--;
+		}
+		else if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+		{
+			/*< The multishot poll has ended */
+			rec->armed = 0;
+			if (!rec->removed && cqe->res >= 0)
+				uring_poll(ring, rec, 1);
+			else if (!rec->removed)
+				LOGIF(LE, (skygw_log_write_flush(
+					LOGFILE_ERROR,
+					"Error : The poll request of fd %d "
+					"failed due %d, %s.",
+					rec->fd,
+					-cqe->res,
+					strerror(-cqe->res))));
+		}
+		if (rec->removed && !rec->armed && rec->n_rearm == 0)
+			free(rec);
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+static int
+uring_wait(int set, struct epoll_event *events, int max, int timeout)
+{
+URING_RING			*ring = &rings[set];
+struct io_uring_getevents_arg	arg;
+struct __kernel_timespec	ts;
+unsigned			to_submit;
+int				n, rc;
+
+	own_ring = set;
+	spinlock_acquire(&ring->lock);
+	n = uring_reap(ring, events, max);
+	if (n > 0 || timeout == 0)
+	{
+		uring_submit(ring);
+		spinlock_release(&ring->lock);
+		return n;
+	}
+	/*< The requests of the thread go with the wait */
+	to_submit = uring_unsubmitted(ring);
+	spinlock_release(&ring->lock);
+
+	memset(&arg, 0, sizeof(arg));
+	if (timeout > 0)
+	{
+		ts.tv_sec = timeout / 1000;
+		ts.tv_nsec = (timeout % 1000) * 1000000L;
+		arg.ts = (uintptr_t)&ts;
+	}
+	rc = uring_enter(ring->fd, to_submit, 1,
+			IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+			&arg, sizeof(arg));
+	if (rc < 0 && errno != ETIME && errno != EINTR)
+		return -1;
+	errno = 0;
+	spinlock_acquire(&ring->lock);
+	n = uring_reap(ring, events, max);
+	spinlock_release(&ring->lock);
+	return n;
+}
+
+static POLL_ENGINE uring_engine = {
+	"io_uring",
+	uring_create,
+	uring_add,
+	uring_rearm,
+	uring_remove,
+	uring_wait
+};
+
+#endif /* URING_ENGINE */
+
+/**
+ * Return the io_uring engine
+ *
+ * @return The engine or NULL if MaxScale is built without io_uring
+ */
+POLL_ENGINE *
+poll_uring_engine()
+{
+#if defined(URING_ENGINE)
+	return &uring_engine;
+#else
+	return NULL;
+#endif
+}
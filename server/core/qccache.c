@@ -0,0 +1,151 @@
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file qccache.c  -  The saved query classification cache
+ *
+ * The file is written by the query classifier, it holds the MaxScale
+ * version and the build of the classifier and a file of another version or
+ * build is ignored. A save writes a new file and renames it over the old
+ * one, a crash leaves the file of the last save.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <qccache.h>
+#include <config.h>
+#include <thread.h>
+#include <version.h>
+#include <query_classifier.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+extern int lm_enabled_logfiles_bitmask;
+
+static char		*qccache_fname = NULL;	/*< NULL if not saved */
+static int		qccache_interval = 0;	/*< Seconds between saves */
+static int		qccache_done = 0;	/*< The thread must exit */
+static void		*qccache_thr = NULL;
+static pthread_mutex_t	qccache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	qccache_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * The main loop of the thread that saves the cache
+ *
+ * @param arg	Unused
+ */
+static void
+qccache_main(void *arg)
+{
+struct timespec	ts;
+
+	pthread_mutex_lock(&qccache_lock);
+	while (!qccache_done)
+	{
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += qccache_interval;
+		if (pthread_cond_timedwait(&qccache_cond, &qccache_lock,
+					&ts) != ETIMEDOUT || qccache_done)
+			continue;
+		pthread_mutex_unlock(&qccache_lock);
+
+		skygw_query_classifier_cache_save(qccache_fname,
+						MAXSCALE_VERSION);
+
+		pthread_mutex_lock(&qccache_lock);
+	}
+	pthread_mutex_unlock(&qccache_lock);
+}
+
+/**
+ * Load the saved classification cache and start the thread that saves it.
+ * Called before the services start, the statements of the first clients
+ * then find their classification in the cache.
+ *
+ * @param home_dir	The MaxScale home directory of the default file
+ */
+void
+qccache_start(char *home_dir)
+{
+char	*fname = config_qc_cache_file();
+int	n;
+
+	if (fname != NULL && strcasecmp(fname, "off") == 0)
+		return;
+	if (fname != NULL)
+		qccache_fname = strdup(fname);
+	else if ((qccache_fname = (char *)malloc(strlen(home_dir) +
+					strlen(QCCACHE_FILE) + 2)) != NULL)
+		sprintf(qccache_fname, "%s/%s", home_dir, QCCACHE_FILE);
+	if (qccache_fname == NULL)
+		return;
+
+	if ((n = skygw_query_classifier_cache_load(qccache_fname,
+						MAXSCALE_VERSION)) > 0)
+	{
+		LOGIF(LM, (skygw_log_write(
+			LOGFILE_MESSAGE,
+			"Loaded %d query classifications from %s.",
+			n, qccache_fname)));
+	}
+
+	pthread_mutex_lock(&qccache_lock);
+	qccache_interval = config_qc_cache_save_interval();
+	if (qccache_thr == NULL && qccache_interval > 0)
+	{
+		qccache_done = 0;
+		qccache_thr = thread_start(qccache_main, NULL);
+	}
+	pthread_mutex_unlock(&qccache_lock);
+}
+
+/**
+ * Stop the thread that saves the cache and save it for the next start
+ */
+void
+qccache_stop()
+{
+void	*thr;
+int	n;
+
+	pthread_mutex_lock(&qccache_lock);
+	thr = qccache_thr;
+	qccache_done = 1;
+	pthread_cond_signal(&qccache_cond);
+	pthread_mutex_unlock(&qccache_lock);
+
+	if (thr != NULL)
+		thread_wait(thr);
+	qccache_thr = NULL;
+
+	if (qccache_fname == NULL)
+		return;
+	if ((n = skygw_query_classifier_cache_save(qccache_fname,
+						MAXSCALE_VERSION)) >= 0)
+	{
+		LOGIF(LM, (skygw_log_write(
+			LOGFILE_MESSAGE,
+			"Saved %d query classifications to %s.",
+			n, qccache_fname)));
+	}
+	free(qccache_fname);
+	qccache_fname = NULL;
+}
@@ -0,0 +1,314 @@
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file querykill.c  -  The killer of the statements that time out
+ *
+ * The polling threads queue the kills with querykill_request and never wait
+ * for a server, the killer thread sends the KILL QUERY statements one at a
+ * time. It keeps a side connection for each pair of service and server it
+ * has killed a statement on, a connection that is found lost is made again
+ * once for the kill.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <mysql.h>
+#include <mysqld_error.h>
+#include <errmsg.h>
+#include <querykill.h>
+#include <thread.h>
+#include <secrets.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+extern int lm_enabled_logfiles_bitmask;
+
+/**
+ * A statement to kill
+ */
+typedef struct querykill_req {
+	SERVICE		*service;	/*< The service of the session */
+	SERVER		*server;	/*< The server that runs the statement */
+	unsigned long	tid;		/*< The backend thread */
+	struct querykill_req
+			*next;
+} QUERYKILL_REQ;
+
+/**
+ * A side connection, only used by the killer thread
+ */
+typedef struct querykill_conn {
+	SERVICE		*service;	/*< The credentials used */
+	SERVER		*server;	/*< The server connected to */
+	MYSQL		*con;		/*< The connection, NULL if not made */
+	struct querykill_conn
+			*next;
+} QUERYKILL_CONN;
+
+static QUERYKILL_REQ	*querykill_first = NULL;	/*< The oldest kill */
+static QUERYKILL_REQ	*querykill_last = NULL;
+static int		querykill_queued = 0;
+static QUERYKILL_CONN	*querykill_conns = NULL;
+static int		querykill_done = 0;	/*< The thread must exit */
+static void		*querykill_thr = NULL;
+static pthread_mutex_t	querykill_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	querykill_cond = PTHREAD_COND_INITIALIZER;
+
+/**
+ * Queue the kill of the statement a backend thread runs
+ *
+ * @param service	The service of the session, its user kills the statement
+ * @param server	The server of the backend connection
+ * @param tid		The thread of the backend connection
+ * @return		1 if the kill is queued, 0 otherwise
+ */
+int
+querykill_request(SERVICE *service, SERVER *server, unsigned long tid)
+{
+QUERYKILL_REQ	*req;
+
+	if ((req = (QUERYKILL_REQ *)malloc(sizeof(QUERYKILL_REQ))) == NULL)
+		return 0;
+	req->service = service;
+	req->server = server;
+	req->tid = tid;
+	req->next = NULL;
+
+	pthread_mutex_lock(&querykill_lock);
+	if (querykill_thr == NULL || querykill_queued >= QUERYKILL_MAX_QUEUED)
+	{
+		pthread_mutex_unlock(&querykill_lock);
+		free(req);
+		return 0;
+	}
+	if (querykill_last)
+		querykill_last->next = req;
+	else
+		querykill_first = req;
+	querykill_last = req;
+	querykill_queued++;
+	pthread_cond_signal(&querykill_cond);
+	pthread_mutex_unlock(&querykill_lock);
+
+	return 1;
+}
+
+/**
+ * Make the side connection to a server
+ *
+ * @param conn	The side connection
+ * @return	1 if the connection is made, 0 otherwise
+ */
+static int
+querykill_connect(QUERYKILL_CONN *conn)
+{
+char	*user, *passwd, *dpwd;
+int	timeout = QUERYKILL_TIMEOUT;
+
+	if (serviceGetUser(conn->service, &user, &passwd) == 0 ||
+		user == NULL || passwd == NULL)
+		return 0;
+	if ((conn->con = mysql_init(NULL)) == NULL)
+		return 0;
+	mysql_options(conn->con, MYSQL_OPT_USE_REMOTE_CONNECTION, NULL);
+	mysql_options(conn->con, MYSQL_OPT_CONNECT_TIMEOUT, (void *)&timeout);
+	mysql_options(conn->con, MYSQL_OPT_READ_TIMEOUT, (void *)&timeout);
+	mysql_options(conn->con, MYSQL_OPT_WRITE_TIMEOUT, (void *)&timeout);
+
+	dpwd = decryptPassword(passwd);
+	if (mysql_real_connect(conn->con,
+			conn->server->socket ? "localhost" : conn->server->name,
+			user,
+			dpwd,
+			NULL,
+			conn->server->port,
+			conn->server->socket,
+			0) == NULL)
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : Unable to connect to %s:%d to kill the "
+			"statements that time out in service %s: %s",
+			conn->server->name,
+			conn->server->port,
+			conn->service->name,
+			mysql_error(conn->con))));
+		free(dpwd);
+		mysql_close(conn->con);
+		conn->con = NULL;
+		return 0;
+	}
+	free(dpwd);
+	return 1;
+}
+
+/**
+ * Send the KILL QUERY of a request. A statement that has ended in the
+ * meantime is not an error.
+ *
+ * @param req	The request
+ */
+static void
+querykill_send(QUERYKILL_REQ *req)
+{
+QUERYKILL_CONN	*conn;
+char		query[40];
+unsigned int	err;
+int		attempt;
+
+	for (conn = querykill_conns; conn; conn = conn->next)
+	{
+		if (conn->service == req->service && conn->server == req->server)
+			break;
+	}
+	if (conn == NULL)
+	{
+		if ((conn = (QUERYKILL_CONN *)calloc(1,
+					sizeof(QUERYKILL_CONN))) == NULL)
+			return;
+		conn->service = req->service;
+		conn->server = req->server;
+		conn->next = querykill_conns;
+		querykill_conns = conn;
+	}
+
+	sprintf(query, "KILL QUERY %lu", req->tid);
+	for (attempt = 0; attempt < 2; attempt++)
+	{
+		/*< A connection that was not used for long may have been lost */
+		if (conn->con == NULL && !querykill_connect(conn))
+			return;
+		if (mysql_query(conn->con, query) == 0)
+			return;
+		if ((err = mysql_errno(conn->con)) == ER_NO_SUCH_THREAD)
+			return;
+		if (err < CR_MIN_ERROR)
+		{
+			LOGIF(LE, (skygw_log_write_flush(
+				LOGFILE_ERROR,
+				"Error : Failed to kill the statement of thread "
+				"%lu on %s:%d for service %s: %s",
+				req->tid,
+				req->server->name,
+				req->server->port,
+				req->service->name,
+				mysql_error(conn->con))));
+			return;
+		}
+		mysql_close(conn->con);
+		conn->con = NULL;
+	}
+}
+
+/**
+ * The main loop of the killer thread
+ *
+ * @param arg	Unused
+ */
+static void
+querykill_main(void *arg)
+{
+QUERYKILL_REQ	*req;
+QUERYKILL_CONN	*conn;
+
+	if (mysql_thread_init())
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : mysql_thread_init failed in the killer thread, "
+			"the statements that time out are not killed.")));
+		return;
+	}
+	pthread_mutex_lock(&querykill_lock);
+	while (!querykill_done)
+	{
+		if ((req = querykill_first) == NULL)
+		{
+			pthread_cond_wait(&querykill_cond, &querykill_lock);
+			continue;
+		}
+		if ((querykill_first = req->next) == NULL)
+			querykill_last = NULL;
+		querykill_queued--;
+		pthread_mutex_unlock(&querykill_lock);
+
+		querykill_send(req);
+		free(req);
+
+		pthread_mutex_lock(&querykill_lock);
+	}
+	pthread_mutex_unlock(&querykill_lock);
+
+	while ((conn = querykill_conns) != NULL)
+	{
+		querykill_conns = conn->next;
+		if (conn->con)
+			mysql_close(conn->con);
+		free(conn);
+	}
+	mysql_thread_end();
+}
+
+/**
+ * Start the killer thread
+ */
+void
+querykill_start()
+{
+	pthread_mutex_lock(&querykill_lock);
+	if (querykill_thr == NULL)
+	{
+		querykill_done = 0;
+		querykill_thr = thread_start(querykill_main, NULL);
+	}
+	pthread_mutex_unlock(&querykill_lock);
+}
+
+/**
+ * Stop the killer thread and wait for it to exit, the kills still queued
+ * are dropped.
+ */
+void
+querykill_stop()
+{
+QUERYKILL_REQ	*req;
+void		*thr;
+
+	pthread_mutex_lock(&querykill_lock);
+	thr = querykill_thr;
+	querykill_done = 1;
+	pthread_cond_signal(&querykill_cond);
+	pthread_mutex_unlock(&querykill_lock);
+
+	if (thr == NULL)
+		return;
+	thread_wait(thr);
+
+	pthread_mutex_lock(&querykill_lock);
+	querykill_thr = NULL;
+	while ((req = querykill_first) != NULL)
+	{
+		querykill_first = req->next;
+		free(req);
+	}
+	querykill_last = NULL;
+	querykill_queued = 0;
+	pthread_mutex_unlock(&querykill_lock);
+}
@@ -0,0 +1,357 @@
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file resolver.c  -  The cache of the addresses of host names
+ *
+ * The names are kept in a hash table and never removed, they are the names
+ * of the servers and of the hosts of the MySQL users. The resolver thread
+ * looks up the names queued by resolver_lookup and resolver_add and, once a
+ * second, the names whose address is older than RESOLVER_TTL. The lookups
+ * are made without holding the lock of the cache, so the readers do not
+ * wait for the name service.
+ *
+ * Before the resolver thread is started, at startup, resolver_lookup looks
+ * the names up itself.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <resolver.h>
+#include <thread.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+extern int lm_enabled_logfiles_bitmask;
+extern int setipaddress(struct in_addr *, char *);
+
+#define	RESOLVER_BUCKETS	256	/*< Hash buckets of the names */
+
+/**
+ * A name in the cache of the resolver
+ */
+typedef struct resolver_entry {
+	char		*name;		/*< The host name */
+	struct in_addr	addr;		/*< The address last found for name */
+	time_t		found;		/*< When addr was found, 0 if never */
+	time_t		tried;		/*< When name was last looked up */
+	int		queued;		/*< In the queue or being looked up */
+	struct resolver_entry
+			*next;		/*< Next name of the hash bucket */
+	struct resolver_entry
+			*qnext;		/*< Next name of the queue */
+} RESOLVER_ENTRY;
+
+static RESOLVER_ENTRY	*resolver_buckets[RESOLVER_BUCKETS];
+static RESOLVER_ENTRY	*resolver_queue = NULL;	/*< Names to look up */
+static int		resolver_busy = 0;	/*< The thread is looking up names */
+static int		resolver_done = 0;	/*< The thread must exit */
+static void		*resolver_thr = NULL;
+static pthread_mutex_t	resolver_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	resolver_cond = PTHREAD_COND_INITIALIZER;
+					/*< Signals names to the thread */
+static pthread_cond_t	resolver_idle = PTHREAD_COND_INITIALIZER;
+					/*< Signals the end of a lookup pass */
+
+/**
+ * The hash of a host name, FNV-1a
+ *
+ * @param name	The host name
+ * @return	The hash bucket of the name
+ */
+static int
+resolver_hash(char *name)
+{
+unsigned int	h = 2166136261U;
+
+	while (*name)
+	{
+		h ^= (unsigned char)*name++;
+		h *= 16777619U;
+	}
+	return h % RESOLVER_BUCKETS;
+}
+
+/**
+ * Find a name in the cache or add it. The caller holds resolver_lock.
+ *
+ * @param name	The host name
+ * @return	The entry of the name or NULL if it could not be added
+ */
+static RESOLVER_ENTRY *
+resolver_find(char *name)
+{
+RESOLVER_ENTRY	*entry;
+int		bucket = resolver_hash(name);
+
+	for (entry = resolver_buckets[bucket]; entry; entry = entry->next)
+	{
+		if (strcmp(entry->name, name) == 0)
+			return entry;
+	}
+	if ((entry = (RESOLVER_ENTRY *)calloc(1, sizeof(RESOLVER_ENTRY))) == NULL)
+		return NULL;
+	if ((entry->name = strdup(name)) == NULL)
+	{
+		free(entry);
+		return NULL;
+	}
+	entry->next = resolver_buckets[bucket];
+	resolver_buckets[bucket] = entry;
+	return entry;
+}
+
+/**
+ * Queue a name for the resolver thread. The caller holds resolver_lock.
+ *
+ * @param entry	The entry of the name
+ */
+static void
+resolver_enqueue(RESOLVER_ENTRY *entry)
+{
+	if (entry->queued)
+		return;
+	entry->queued = 1;
+	entry->qnext = resolver_queue;
+	resolver_queue = entry;
+	pthread_cond_signal(&resolver_cond);
+}
+
+/**
+ * Return the address of a host name from the cache. A name that is not in
+ * the cache is queued and is not known until the resolver thread has looked
+ * it up, the caller does not wait for the name service. Numeric addresses
+ * are converted without the cache.
+ *
+ * @param name	The host name or address
+ * @param addr	Filled with the address
+ * @return	1 if the address is known, 0 otherwise
+ */
+int
+resolver_lookup(char *name, struct in_addr *addr)
+{
+RESOLVER_ENTRY	*entry;
+struct in_addr	found;
+int		rc;
+
+	if (inet_pton(AF_INET, name, addr) == 1)
+		return 1;
+
+	pthread_mutex_lock(&resolver_lock);
+	if ((entry = resolver_find(name)) == NULL)
+	{
+		pthread_mutex_unlock(&resolver_lock);
+		return 0;
+	}
+	if (entry->found)
+	{
+		*addr = entry->addr;
+		pthread_mutex_unlock(&resolver_lock);
+		return 1;
+	}
+	if (resolver_thr != NULL)
+	{
+		resolver_enqueue(entry);
+		pthread_mutex_unlock(&resolver_lock);
+		return 0;
+	}
+	pthread_mutex_unlock(&resolver_lock);
+
+	/*< No resolver thread yet, the name is looked up here */
+	rc = setipaddress(&found, name);
+	pthread_mutex_lock(&resolver_lock);
+	entry->tried = time(0);
+	if (rc)
+	{
+		entry->addr = found;
+		entry->found = entry->tried;
+	}
+	pthread_mutex_unlock(&resolver_lock);
+	if (rc)
+		*addr = found;
+	return rc;
+}
+
+/**
+ * Queue a host name for the resolver thread if its address is not known
+ * yet, so that it is known by the time it is used.
+ *
+ * @param name	The host name or address
+ */
+void
+resolver_add(char *name)
+{
+RESOLVER_ENTRY	*entry;
+struct in_addr	addr;
+
+	if (inet_pton(AF_INET, name, &addr) == 1)
+		return;
+	pthread_mutex_lock(&resolver_lock);
+	if ((entry = resolver_find(name)) != NULL && !entry->found)
+		resolver_enqueue(entry);
+	pthread_mutex_unlock(&resolver_lock);
+}
+
+/**
+ * Wait for the resolver thread to look up the names queued so far.
+ *
+ * @param timeout	Seconds to wait at most
+ * @return		1 if the queue is empty, 0 if the wait timed out
+ */
+int
+resolver_wait(int timeout)
+{
+struct timespec	deadline;
+int		rval;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout;
+
+	pthread_mutex_lock(&resolver_lock);
+	while (resolver_thr != NULL && (resolver_queue != NULL || resolver_busy))
+	{
+		if (pthread_cond_timedwait(&resolver_idle, &resolver_lock,
+				&deadline) == ETIMEDOUT)
+			break;
+	}
+	rval = resolver_thr == NULL || (resolver_queue == NULL && !resolver_busy);
+	pthread_mutex_unlock(&resolver_lock);
+
+	return rval;
+}
+
+/**
+ * Look up the queued names and the names due for a lookup again. The
+ * caller holds resolver_lock, it is released during the lookups.
+ */
+static void
+resolver_pass()
+{
+RESOLVER_ENTRY	*batch, *entry;
+struct in_addr	found;
+time_t		now = time(0);
+int		i, rc;
+
+	/*< The addresses older than the TTL and the names not found */
+	for (i = 0; i < RESOLVER_BUCKETS; i++)
+	{
+		for (entry = resolver_buckets[i]; entry; entry = entry->next)
+		{
+			if (!entry->queued && entry->tried != 0 &&
+				now - entry->tried >= RESOLVER_RETRY &&
+				(!entry->found || now - entry->found >= RESOLVER_TTL))
+				resolver_enqueue(entry);
+		}
+	}
+	if ((batch = resolver_queue) == NULL)
+		return;
+	resolver_queue = NULL;
+	resolver_busy = 1;
+	pthread_mutex_unlock(&resolver_lock);
+
+	while ((entry = batch) != NULL)
+	{
+		batch = entry->qnext;
+		rc = setipaddress(&found, entry->name);
+
+		pthread_mutex_lock(&resolver_lock);
+		/*< The old address is kept if the lookup fails */
+		entry->tried = time(0);
+		if (rc)
+		{
+			entry->addr = found;
+			entry->found = entry->tried;
+		}
+		entry->queued = 0;
+		pthread_mutex_unlock(&resolver_lock);
+	}
+
+	pthread_mutex_lock(&resolver_lock);
+	resolver_busy = 0;
+}
+
+/**
+ * The main loop of the resolver thread
+ *
+ * @param arg	Unused
+ */
+static void
+resolver_main(void *arg)
+{
+struct timespec	deadline;
+
+	pthread_mutex_lock(&resolver_lock);
+	while (!resolver_done)
+	{
+		if (resolver_queue == NULL)
+		{
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += 1;
+			pthread_cond_timedwait(&resolver_cond, &resolver_lock,
+					&deadline);
+			if (resolver_done)
+				break;
+		}
+		resolver_pass();
+		pthread_cond_broadcast(&resolver_idle);
+	}
+	pthread_mutex_unlock(&resolver_lock);
+}
+
+/**
+ * Start the resolver thread. The names queued before, the names of the
+ * servers, are looked up first.
+ */
+void
+resolver_start()
+{
+	pthread_mutex_lock(&resolver_lock);
+	if (resolver_thr == NULL)
+	{
+		resolver_pass();
+		resolver_done = 0;
+		resolver_thr = thread_start(resolver_main, NULL);
+	}
+	pthread_mutex_unlock(&resolver_lock);
+}
+
+/**
+ * Stop the resolver thread and wait for it to exit
+ */
+void
+resolver_stop()
+{
+void	*thr;
+
+	pthread_mutex_lock(&resolver_lock);
+	thr = resolver_thr;
+	resolver_done = 1;
+	pthread_cond_signal(&resolver_cond);
+	pthread_mutex_unlock(&resolver_lock);
+
+	if (thr == NULL)
+		return;
+	thread_wait(thr);
+
+	pthread_mutex_lock(&resolver_lock);
+	resolver_thr = NULL;
+	pthread_mutex_unlock(&resolver_lock);
+}
@@ -36,17 +36,43 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
 #include <session.h>
 #include <server.h>
 #include <spinlock.h>
+#include <brlock.h>
+#include <atomic.h>
 #include <dcb.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
+#include <resolver.h>
 
 extern int lm_enabled_logfiles_bitmask;
 
-static SPINLOCK	server_spin = SPINLOCK_INIT;
+
+/**
+ * A listener for the events of the servers
+ */
+typedef struct server_listener {
+	int		events;		/**< The events listened for */
+	SERVER_EVENT_FN	fn;		/**< The callback */
+	void		*data;		/**< The data of the callback */
+	struct server_listener
+			*next;		/**< The next listener */
+} SERVER_LISTENER;
+
+static SPINLOCK		listener_lock = SPINLOCK_INIT;
+static SERVER_LISTENER	*listeners = NULL;
+
+static int	server_status_events(unsigned int, unsigned int);
+static void	server_event_notify(SERVER *, int);
+
+static BRLOCK	server_lock = BRLOCK_INIT;	/**< Protects the list of all servers */
 static SERVER	*allServers = NULL;
+static int	status_version = 0;	/**< Changed by every status change */
 
 /**
  * Allocate a new server withn the gateway
@@ -65,10 +91,22 @@ SERVER 	*server;
 
 	if ((server = (SERVER *)malloc(sizeof(SERVER))) == NULL)
 		return NULL;
+	memset(&server->stats, 0, sizeof(SERVER_STATS));
+	if ((server->stats.counters = ts_stats_alloc(SERVER_N_STATS)) == NULL)
+	{
+		free(server);
+		return NULL;
+	}
+	if ((server->stats.latency = ts_hist_alloc()) == NULL)
+	{
+		ts_stats_free(server->stats.counters);
+		free(server);
+		return NULL;
+	}
 	server->name = strdup(servname);
+	resolver_add(servname);
 	server->protocol = strdup(protocol);
 	server->port = port;
-	memset(&server->stats, 0, sizeof(SERVER_STATS));
 	server->status = SERVER_RUNNING;
 	server->nextdb = NULL;
 	server->monuser = NULL;
@@ -82,11 +120,35 @@ SERVER 	*server;
 	server->master_id = -1;
 	server->depth = -1;
 	server->slaves = NULL;
+	server->persistpoolmax = 0;
+	server->persistmaxtime = SERVER_PERSIST_MAXTIME;
+	server->persistent = NULL;
+	server->n_persistent = 0;
+	spinlock_init(&server->persistlock);
+	server->max_connections = 0;
+	server->circuit_max_failures = SERVER_CIRCUIT_FAILURES;
+	server->circuit_cooldown = SERVER_CIRCUIT_COOLDOWN;
+	server->circuit_state = SERVER_CIRCUIT_CLOSED;
+	server->circuit_failures = 0;
+	server->circuit_since = 0;
+	spinlock_init(&server->circuitlock);
+	server->compress = 0;
+	server->compress_threshold = SERVER_COMPRESS_THRESHOLD;
+	server->socket = NULL;
+	server->fastopen = 0;
+	server->wsrep_recv_queue = 0;
+	server->wsrep_send_queue = 0;
+	server->wsrep_fc_paused = 0;
+	server->wsrep_fc_sent = 0;
+	server->rlag_ms = -1;
+	server->rlag_ms_ts = 0;
+	server->variables = NULL;
+	spinlock_init(&server->varlock);
 
-	spinlock_acquire(&server_spin);
+	brlock_write_acquire(&server_lock);
 	server->next = allServers;
 	allServers = server;
-	spinlock_release(&server_spin);
+	brlock_write_release(&server_lock);
 
 	return server;
 }
@@ -104,7 +166,7 @@ server_free(SERVER *server)
 SERVER *ptr;
 
 	/* First of all remove from the linked list */
-	spinlock_acquire(&server_spin);
+	brlock_write_acquire(&server_lock);
 	if (allServers == server)
 	{
 		allServers = server->next;
@@ -119,7 +181,7 @@ SERVER *ptr;
 		if (ptr)
 			ptr->next = server->next;
 	}
-	spinlock_release(&server_spin);
+	brlock_write_release(&server_lock);
 
 	/* Clean up session and free the memory */
 	free(server->name);
@@ -128,6 +190,10 @@ SERVER *ptr;
 		free(server->unique_name);
 	if (server->server_string)
 		free(server->server_string);
+	free(server->socket);
+	server_set_variables(server, NULL);
+	ts_stats_free(server->stats.counters);
+	ts_hist_free(server->stats.latency);
 	free(server);
 	return 1;
 }
@@ -156,7 +222,7 @@ server_find_by_unique_name(char *name)
 {
 SERVER 	*server;
 
-	spinlock_acquire(&server_spin);
+	brlock_read_acquire(&server_lock);
 	server = allServers;
 	while (server)
 	{
@@ -164,7 +230,7 @@ SERVER 	*server;
 			break;
 		server = server->next;
 	}
-	spinlock_release(&server_spin);
+	brlock_read_release(&server_lock);
 	return server;
 }
 
@@ -180,7 +246,7 @@ server_find(char *servname, unsigned short port)
 {
 SERVER 	*server;
 
-	spinlock_acquire(&server_spin);
+	brlock_read_acquire(&server_lock);
 	server = allServers;
 	while (server)
 	{
@@ -188,7 +254,7 @@ SERVER 	*server;
 			break;
 		server = server->next;
 	}
-	spinlock_release(&server_spin);
+	brlock_read_release(&server_lock);
 	return server;
 }
 
@@ -204,7 +270,8 @@ printServer(SERVER *server)
 	printf("\tServer:			%s\n", server->name);
 	printf("\tProtocol:		%s\n", server->protocol);
 	printf("\tPort:			%d\n", server->port);
-	printf("\tTotal connections:	%d\n", server->stats.n_connections);
+	printf("\tTotal connections:	%d\n",
+		ts_stats_get(server->stats.counters, SERVER_N_CONNECTIONS));
 	printf("\tCurrent connections:	%d\n", server->stats.n_current);
 }
 
@@ -219,14 +286,32 @@ printAllServers()
 {
 SERVER	*ptr;
 
-	spinlock_acquire(&server_spin);
+	brlock_read_acquire(&server_lock);
 	ptr = allServers;
 	while (ptr)
 	{
 		printServer(ptr);
 		ptr = ptr->next;
 	}
-	spinlock_release(&server_spin);
+	brlock_read_release(&server_lock);
+}
+
+/**
+ * Call a function for every server. The list is read locked for the
+ * calls, so the function must not create or free a server.
+ *
+ * @param fn	The function to call
+ * @param arg	Passed to the function
+ */
+void
+server_foreach(void (*fn)(SERVER *, void *), void *arg)
+{
+SERVER	*ptr;
+
+	brlock_read_acquire(&server_lock);
+	for (ptr = allServers; ptr; ptr = ptr->next)
+		fn(ptr, arg);
+	brlock_read_release(&server_lock);
 }
 
 /**
@@ -241,7 +326,7 @@ dprintAllServers(DCB *dcb)
 SERVER	*ptr;
 char	*stat;
 
-	spinlock_acquire(&server_spin);
+	brlock_read_acquire(&server_lock);
 	ptr = allServers;
 	while (ptr)
 	{
@@ -281,19 +366,64 @@ char	*stat;
 			if (ptr->rlag >= 0) {
 				dcb_printf(dcb, "\tSlave delay:\t\t%d\n", ptr->rlag);
 			}
+			if (ptr->rlag_ms >= 0) {
+				dcb_printf(dcb, "\tSlave delay (ms):\t%d\n", ptr->rlag_ms);
+			}
 		}
 		if (ptr->node_ts > 0) {
 			dcb_printf(dcb, "\tLast Repl Heartbeat:\t%lu\n", ptr->node_ts);
 		}
 		dcb_printf(dcb, "\tNumber of connections:		%d\n",
-						ptr->stats.n_connections);
+			ts_stats_get(ptr->stats.counters, SERVER_N_CONNECTIONS));
 		dcb_printf(dcb, "\tCurrent no. of conns:		%d\n",
 							ptr->stats.n_current);
                 dcb_printf(dcb, "\tCurrent no. of operations:	%d\n",
 						ptr->stats.n_current_ops);
                 ptr = ptr->next;
 	}
-	spinlock_release(&server_spin);
+	brlock_read_release(&server_lock);
+}
+
+/**
+ * Print the percentiles of the response times of a server, the response
+ * time being from the write of a request to the end of its reply. The
+ * histograms of the threads are summed up here, so this does not stop
+ * the threads from counting.
+ *
+ * @param dcb		DCB to print to
+ * @param server	The server
+ */
+static void
+dprintServerLatency(DCB *dcb, SERVER *server)
+{
+static struct {
+	char	*name;
+	double	fraction;
+} percentiles[] = {
+	{ "50th", 0.5 }, { "99th", 0.99 }, { "99.9th", 0.999 }, { NULL, 0 }
+};
+long		counts[TS_HIST_BUCKETS], sum, total = 0;
+unsigned long	usecs;
+int		i;
+
+	ts_hist_get(server->stats.latency, -1, counts, &sum);
+	for (i = 0; i < TS_HIST_BUCKETS; i++)
+		total += counts[i];
+	if (total == 0)
+		return;
+	dcb_printf(dcb, "\tResponses timed:		%ld\n", total);
+	dcb_printf(dcb, "\tAverage response time:		%ldus\n", sum / total);
+	for (i = 0; percentiles[i].name; i++)
+	{
+		usecs = ts_hist_percentile(counts, percentiles[i].fraction);
+		if (usecs == ULONG_MAX)
+			dcb_printf(dcb, "\t%s percentile response:	> %luus\n",
+				percentiles[i].name,
+				ts_hist_bound(TS_HIST_BUCKETS - 2));
+		else
+			dcb_printf(dcb, "\t%s percentile response:	%luus\n",
+				percentiles[i].name, usecs);
+	}
 }
 
 /**
@@ -315,6 +445,8 @@ SERVER_PARAM	*param;
 	free(stat);
 	dcb_printf(dcb, "\tProtocol:			%s\n", server->protocol);
 	dcb_printf(dcb, "\tPort:				%d\n", server->port);
+	if (server->socket)
+		dcb_printf(dcb, "\tSocket:				%s\n", server->socket);
 	if (server->server_string)
 		dcb_printf(dcb, "\tServer Version:\t\t\t%s\n", server->server_string);
 	dcb_printf(dcb, "\tNode Id:			%d\n", server->node_id);
@@ -336,6 +468,9 @@ SERVER_PARAM	*param;
 		if (server->rlag >= 0) {
 			dcb_printf(dcb, "\tSlave delay:\t\t%d\n", server->rlag);
 		}
+		if (server->rlag_ms >= 0) {
+			dcb_printf(dcb, "\tSlave delay (ms):\t%d\n", server->rlag_ms);
+		}
 	}
 	if (server->node_ts > 0) {
 		dcb_printf(dcb, "\tLast Repl Heartbeat:\t%s",
@@ -352,10 +487,50 @@ SERVER_PARAM	*param;
 		}
 	}
 	dcb_printf(dcb, "\tNumber of connections:		%d\n",
-						server->stats.n_connections);
+			ts_stats_get(server->stats.counters, SERVER_N_CONNECTIONS));
 	dcb_printf(dcb, "\tCurrent no. of conns:		%d\n",
 						server->stats.n_current);
         dcb_printf(dcb, "\tCurrent no. of operations:	%d\n", server->stats.n_current_ops);
+	if (server->max_connections > 0)
+		dcb_printf(dcb, "\tMaximum connections:		%d\n",
+						server->max_connections);
+	if (server->persistpoolmax > 0)
+	{
+		dcb_printf(dcb, "\tPersistent pool size:		%d\n",
+						server->n_persistent);
+		dcb_printf(dcb, "\tPersistent pool maximum:	%d\n",
+						server->persistpoolmax);
+		dcb_printf(dcb, "\tConnections reused from pool:	%d\n",
+			ts_stats_get(server->stats.counters, SERVER_N_PERSISTENT));
+	}
+	if (server->circuit_max_failures > 0)
+	{
+		dcb_printf(dcb, "\tCircuit breaker:		%s\n",
+			server->circuit_state == SERVER_CIRCUIT_OPEN ? "Open" :
+			server->circuit_state == SERVER_CIRCUIT_HALF_OPEN ?
+						"Half open" : "Closed");
+		dcb_printf(dcb, "\tTimes circuit opened:		%d\n",
+			ts_stats_get(server->stats.counters,
+						SERVER_N_CIRCUIT_OPENED));
+	}
+	if (server->compress)
+		dcb_printf(dcb, "\tCompressed protocol threshold:	%d\n",
+						server->compress_threshold);
+	if (server->fastopen)
+		dcb_printf(dcb, "\tTCP Fast Open:			Enabled\n");
+	dprintServerLatency(dcb, server);
+	if (server->status & SERVER_JOINED)
+	{
+		dcb_printf(dcb, "\tGalera receive queue:		%d\n",
+						server->wsrep_recv_queue);
+		dcb_printf(dcb, "\tGalera send queue:		%d\n",
+						server->wsrep_send_queue);
+		dcb_printf(dcb, "\tFlow control paused:		%d.%d%%\n",
+						server->wsrep_fc_paused / 10,
+						server->wsrep_fc_paused % 10);
+		dcb_printf(dcb, "\tFlow control pauses sent:	%d\n",
+						server->wsrep_fc_sent);
+	}
 }
 
 /**
@@ -368,7 +543,7 @@ dListServers(DCB *dcb)
 SERVER	*ptr;
 char	*stat;
 
-	spinlock_acquire(&server_spin);
+	brlock_read_acquire(&server_lock);
 	ptr = allServers;
 	if (ptr)
 	{
@@ -390,7 +565,7 @@ char	*stat;
 	}
 	if (allServers)
 		dcb_printf(dcb, "-------------------+-----------------+-------+----------------------+------------\n\n");
-	spinlock_release(&server_spin);
+	brlock_read_release(&server_lock);
 }
 
 /**
@@ -432,7 +607,15 @@ char	*status = NULL;
 void
 server_set_status(SERVER *server, int bit)
 {
-	server->status |= bit;
+unsigned int	old = server->status;
+
+	if ((server->status & bit) != bit)
+	{
+		server->status |= bit;
+		atomic_add(&status_version, 1);
+		server_event_notify(server,
+				server_status_events(old, server->status));
+	}
 }
 
 /**
@@ -444,7 +627,231 @@ server_set_status(SERVER *server, int bit)
 void
 server_clear_status(SERVER *server, int bit)
 {
-	server->status &= ~bit;
+unsigned int	old = server->status;
+
+	if (server->status & bit)
+	{
+		server->status &= ~bit;
+		atomic_add(&status_version, 1);
+		server_event_notify(server,
+				server_status_events(old, server->status));
+	}
+}
+
+/**
+ * Set the whole status of the server, as a monitor does with the status
+ * it has worked out for the server
+ *
+ * @param server	The server to update
+ * @param status	The new status bits of the server
+ */
+void
+server_update_status(SERVER *server, unsigned int status)
+{
+unsigned int	old = server->status;
+
+	if (server->status != status)
+	{
+		server->status = status;
+		atomic_add(&status_version, 1);
+		server_event_notify(server, server_status_events(old, status));
+	}
+}
+
+/**
+ * Return the version of the statuses of the servers. The version changes
+ * whenever the status of any server changes, a router may keep what it
+ * has worked out from the statuses until the version changes.
+ *
+ * @return	The status version
+ */
+int
+server_status_version()
+{
+	return status_version;
+}
+
+/**
+ * Set the replication lag of a server, as a monitor does each time it
+ * measures it. The listeners for SERVER_EVENT_LAG are called when the lag
+ * is not the same as before.
+ *
+ * @param server	The server to update
+ * @param lag		The lag in seconds, -1 if it is not known
+ */
+void
+server_update_lag(SERVER *server, int lag)
+{
+	if (server->rlag != lag)
+	{
+		server->rlag = lag;
+		server_event_notify(server, SERVER_EVENT_LAG);
+	}
+}
+
+/**
+ * Return the wall clock time in milliseconds.
+ */
+static unsigned long
+server_time_ms()
+{
+struct timeval	tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/**
+ * Set the replication lag of a server in milliseconds, as measured by the
+ * high resolution heartbeat of a monitor. The measures are smoothed, a lag
+ * that grows is taken at once so that a bound on the lag is applied as
+ * soon as a slave falls behind, a lag that shrinks moves a quarter of the
+ * way to the new measure each time. A slave that is near a bound does not
+ * then go in and out of the bound with every heartbeat. The listeners for
+ * SERVER_EVENT_LAG are called when the smoothed lag changes.
+ *
+ * @param server	The server to update
+ * @param lag		The lag in milliseconds, -1 if it is not known
+ */
+void
+server_update_lag_ms(SERVER *server, int lag)
+{
+int	smoothed;
+
+	if (lag < 0 || server->rlag_ms < 0 || lag >= server->rlag_ms)
+		smoothed = lag;
+	else
+		smoothed = server->rlag_ms - (server->rlag_ms - lag + 3) / 4;
+	server->rlag_ms_ts = server_time_ms();
+	if (server->rlag_ms != smoothed)
+	{
+		server->rlag_ms = smoothed;
+		server_event_notify(server, SERVER_EVENT_LAG);
+	}
+}
+
+/**
+ * Set the flow control metrics of a Galera node, as the Galera monitor does
+ * each interval. The listeners for SERVER_EVENT_FLOW_CONTROL are called
+ * when the node starts or stops asking for flow control.
+ *
+ * @param server	The server to update
+ * @param recv_queue	The write sets waiting to be applied
+ * @param send_queue	The write sets waiting to be sent
+ * @param paused	Per mille of the interval the cluster was paused
+ * @param sent		The flow control pauses the node asked for
+ */
+void
+server_update_flow_control(SERVER *server, int recv_queue, int send_queue,
+	int paused, int sent)
+{
+int	was = SERVER_IS_THROTTLING(server);
+
+	server->wsrep_recv_queue = recv_queue;
+	server->wsrep_send_queue = send_queue;
+	server->wsrep_fc_paused = paused;
+	server->wsrep_fc_sent = sent;
+	if (was != SERVER_IS_THROTTLING(server))
+		server_event_notify(server, SERVER_EVENT_FLOW_CONTROL);
+}
+
+/**
+ * Work out the events of a change of the status of a server
+ *
+ * @param old		The status before the change
+ * @param new		The status after the change
+ * @return		The SERVER_EVENT bits of the change
+ */
+static int
+server_status_events(unsigned int old, unsigned int new)
+{
+unsigned int	mask, ran, runs;
+int		events = 0;
+
+	mask = SERVER_RUNNING|SERVER_MAINT;
+	ran = (old & mask) == SERVER_RUNNING;
+	runs = (new & mask) == SERVER_RUNNING;
+	if (ran != runs)
+		events |= runs ? SERVER_EVENT_UP : SERVER_EVENT_DOWN;
+	if ((ran && (old & SERVER_MASTER)) != (runs && (new & SERVER_MASTER)))
+		events |= (runs && (new & SERVER_MASTER)) ?
+				SERVER_EVENT_NEW_MASTER : SERVER_EVENT_MASTER_DOWN;
+	if ((ran && (old & SERVER_SLAVE)) != (runs && (new & SERVER_SLAVE)))
+		events |= (runs && (new & SERVER_SLAVE)) ?
+				SERVER_EVENT_SLAVE_UP : SERVER_EVENT_SLAVE_DOWN;
+	return events;
+}
+
+/**
+ * Call the listeners for the events of a server
+ *
+ * @param server	The server
+ * @param events	The SERVER_EVENT bits
+ */
+static void
+server_event_notify(SERVER *server, int events)
+{
+SERVER_LISTENER	*ptr;
+
+	if (listeners == NULL || events == 0)
+		return;
+	spinlock_acquire(&listener_lock);
+	for (ptr = listeners; ptr; ptr = ptr->next)
+	{
+		if (ptr->events & events)
+			ptr->fn(ptr->events & events, server, ptr->data);
+	}
+	spinlock_release(&listener_lock);
+}
+
+/**
+ * Listen for events of the servers. The callback is called for events of
+ * all servers, it is up to the listener to check the server.
+ *
+ * @param events	The SERVER_EVENT bits to listen for
+ * @param fn		The callback
+ * @param data		The data passed to the callback
+ * @return		A handle for server_event_unsubscribe or NULL
+ */
+void *
+server_event_subscribe(int events, SERVER_EVENT_FN fn, void *data)
+{
+SERVER_LISTENER	*listener;
+
+	if ((listener = malloc(sizeof(SERVER_LISTENER))) == NULL)
+		return NULL;
+	listener->events = events;
+	listener->fn = fn;
+	listener->data = data;
+	spinlock_acquire(&listener_lock);
+	listener->next = listeners;
+	listeners = listener;
+	spinlock_release(&listener_lock);
+	return listener;
+}
+
+/**
+ * Stop listening for the events of the servers. The callback is not called
+ * once this returns.
+ *
+ * @param handle	The handle from server_event_subscribe
+ */
+void
+server_event_unsubscribe(void *handle)
+{
+SERVER_LISTENER	**ptr;
+
+	spinlock_acquire(&listener_lock);
+	for (ptr = &listeners; *ptr; ptr = &(*ptr)->next)
+	{
+		if (*ptr == handle)
+		{
+			*ptr = (*ptr)->next;
+			break;
+		}
+	}
+	spinlock_release(&listener_lock);
+	free(handle);
 }
 
 /**
@@ -560,3 +967,398 @@ SERVER_PARAM	*param = server->parameters;
 	}
 	return NULL;
 }
+
+/**
+ * Add an idle backend connection to the persistent pool of the server. The
+ * DCB stays in the poll set of its polling thread, a hangup or any data
+ * from the server while it is in the pool closes it.
+ *
+ * @param server	The server the connection is to
+ * @param dcb		The idle DCB, not linked to any session
+ * @return	1 if the DCB was added, 0 if the pool is full
+ */
+int
+server_add_persistent(SERVER *server, DCB *dcb)
+{
+	spinlock_acquire(&server->persistlock);
+	if (server->n_persistent >= server->persistpoolmax)
+	{
+		spinlock_release(&server->persistlock);
+		return 0;
+	}
+	dcb->persistentstart = time(NULL);
+	dcb->nextpersistent = server->persistent;
+	server->persistent = dcb;
+	server->n_persistent++;
+	spinlock_release(&server->persistlock);
+	return 1;
+}
+
+/**
+ * Remove a DCB from the persistent pool of the server
+ *
+ * @param server	The server the connection is to
+ * @param dcb		The DCB to remove
+ * @return	1 if the DCB was removed, 0 if it was not in the pool
+ */
+int
+server_remove_persistent(SERVER *server, DCB *dcb)
+{
+DCB	**pp;
+int	rval = 0;
+
+	spinlock_acquire(&server->persistlock);
+	for (pp = &server->persistent; *pp != NULL; pp = &(*pp)->nextpersistent)
+	{
+		if (*pp == dcb)
+		{
+			*pp = dcb->nextpersistent;
+			dcb->nextpersistent = NULL;
+			dcb->persistentstart = 0;
+			server->n_persistent--;
+			rval = 1;
+			break;
+		}
+	}
+	spinlock_release(&server->persistlock);
+	return rval;
+}
+
+/**
+ * Take an idle connection of the given protocol from the persistent pool of
+ * the server. A polling thread with an epoll set of its own only takes the
+ * connections it polls, so that a session stays with one thread.
+ *
+ * @param server	The server to connect to
+ * @param funcs		The protocol of the connection
+ * @param owner		Polling thread of the caller or -1 for any
+ * @return	The DCB, removed from the pool, or NULL if there is none
+ */
+DCB *
+server_get_persistent(SERVER *server, GWPROTOCOL *funcs, int owner)
+{
+DCB	**pp;
+DCB	*dcb = NULL;
+
+	if (server->persistent == NULL)
+		return NULL;
+	spinlock_acquire(&server->persistlock);
+	for (pp = &server->persistent; *pp != NULL; pp = &(*pp)->nextpersistent)
+	{
+		if ((owner < 0 || (*pp)->owner_thread == owner) &&
+			(*pp)->func.connect == funcs->connect &&
+			(*pp)->state == DCB_STATE_POLLING)
+		{
+			dcb = *pp;
+			*pp = dcb->nextpersistent;
+			dcb->nextpersistent = NULL;
+			dcb->persistentstart = 0;
+			server->n_persistent--;
+			break;
+		}
+	}
+	spinlock_release(&server->persistlock);
+	return dcb;
+}
+
+/**
+ * Close the pooled connections of all the servers that a polling thread
+ * owns, when the thread retires. The sockets are only shut down as for an
+ * expired idle timeout, the owning thread closes the DCBs in the hangup
+ * processing of the protocol and they leave the pool then.
+ *
+ * @param owner		The polling thread
+ */
+void
+server_close_persistent(int owner)
+{
+SERVER	*server;
+DCB	*dcb;
+
+	brlock_read_acquire(&server_lock);
+	for (server = allServers; server; server = server->next)
+	{
+		if (server->persistent == NULL)
+			continue;
+		spinlock_acquire(&server->persistlock);
+		for (dcb = server->persistent; dcb; dcb = dcb->nextpersistent)
+		{
+			if (dcb->owner_thread == owner &&
+				dcb->state == DCB_STATE_POLLING)
+				shutdown(dcb->fd, SHUT_RDWR);
+		}
+		spinlock_release(&server->persistlock);
+	}
+	brlock_read_release(&server_lock);
+}
+
+/**
+ * Return the replication lag of a slave as it is at the time of the call.
+ *
+ * The rlag field is measured once per monitor interval and lags of less
+ * than the interval are stored as 0. The lag returned here counts from the
+ * last replication heartbeat the slave was seen to have applied, it is
+ * never less than the real lag however long ago the monitor sampled the
+ * slave. A slave that is in step with the master shows a lag of up to the
+ * monitor interval.
+ *
+ * @param server	The server
+ * @return	The lag in seconds, -1 if it is not known
+ */
+int
+server_get_replication_lag(SERVER *server)
+{
+time_t	now;
+
+	if (SERVER_IS_MASTER(server) && !SERVER_IS_SLAVE(server))
+		return 0;
+	if (server->rlag < 0 || server->node_ts == 0)
+		return -1;
+	now = time(0);
+	if ((unsigned long)now <= server->node_ts)
+		return 0;
+	return now - server->node_ts;
+}
+
+/**
+ * Return the replication lag of a slave in milliseconds. The smoothed lag
+ * of the high resolution heartbeat is used when the monitor measures one,
+ * to it is added the time since it was measured so that a slave the
+ * monitor has stopped measuring moves out of any bound. Without the high
+ * resolution heartbeat this is server_get_replication_lag in milliseconds.
+ *
+ * @param server	The server
+ * @return	The lag in milliseconds, -1 if it is not known
+ */
+int
+server_get_replication_lag_ms(SERVER *server)
+{
+unsigned long	now;
+int		lag;
+
+	if (SERVER_IS_MASTER(server) && !SERVER_IS_SLAVE(server))
+		return 0;
+	if (server->rlag_ms >= 0)
+	{
+		now = server_time_ms();
+		if (now <= server->rlag_ms_ts)
+			return server->rlag_ms;
+		return server->rlag_ms + (now - server->rlag_ms_ts);
+	}
+	if ((lag = server_get_replication_lag(server)) < 0)
+		return -1;
+	return lag * 1000;
+}
+
+/**
+ * Count a failure of a connection to a server, a connect that failed or
+ * timed out, a failed handshake or a reply that timed out. The circuit
+ * opens when circuit_max_failures failures are counted within the cooldown
+ * or when the probe of a half open circuit fails.
+ *
+ * @param server	The server
+ */
+void
+server_circuit_failure(SERVER *server)
+{
+time_t	now;
+int	opened = 0;
+
+	if (server->circuit_max_failures <= 0)
+		return;
+	now = time(0);
+	spinlock_acquire(&server->circuitlock);
+	switch (server->circuit_state)
+	{
+	case SERVER_CIRCUIT_CLOSED:
+		if (now - server->circuit_since >= server->circuit_cooldown)
+		{
+			server->circuit_since = now;
+			server->circuit_failures = 0;
+		}
+		if (++server->circuit_failures >= server->circuit_max_failures)
+		{
+			server->circuit_state = SERVER_CIRCUIT_OPEN;
+			server->circuit_since = now;
+			opened = 1;
+		}
+		break;
+	case SERVER_CIRCUIT_HALF_OPEN:
+		server->circuit_state = SERVER_CIRCUIT_OPEN;
+		server->circuit_since = now;
+		opened = 1;
+		break;
+	default:
+		break;
+	}
+	spinlock_release(&server->circuitlock);
+
+	if (opened)
+	{
+		atomic_add(&status_version, 1);
+		server_event_notify(server, SERVER_EVENT_CIRCUIT);
+		ts_stats_add(server->stats.counters, SERVER_N_CIRCUIT_OPENED, 1);
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : Server %s:%d is not used for %d seconds after "
+			"repeated connection failures.",
+			server->name,
+			server->port,
+			server->circuit_cooldown)));
+	}
+}
+
+/**
+ * Count a connection to a server that was established and authenticated.
+ * A circuit that is half open, or open but past the cooldown, closes.
+ *
+ * @param server	The server
+ */
+void
+server_circuit_success(SERVER *server)
+{
+int	closed = 0;
+
+	if (server->circuit_state == SERVER_CIRCUIT_CLOSED)
+		return;
+	spinlock_acquire(&server->circuitlock);
+	if (server->circuit_state == SERVER_CIRCUIT_HALF_OPEN ||
+		(server->circuit_state == SERVER_CIRCUIT_OPEN &&
+		time(0) - server->circuit_since >= server->circuit_cooldown))
+	{
+		server->circuit_state = SERVER_CIRCUIT_CLOSED;
+		server->circuit_failures = 0;
+		server->circuit_since = time(0);
+		closed = 1;
+	}
+	spinlock_release(&server->circuitlock);
+
+	if (closed)
+	{
+		atomic_add(&status_version, 1);
+		server_event_notify(server, SERVER_EVENT_CIRCUIT);
+		LOGIF(LM, (skygw_log_write(
+			LOGFILE_MESSAGE,
+			"Server %s:%d is used again, a probe connection "
+			"succeeded.",
+			server->name,
+			server->port)));
+	}
+}
+
+/**
+ * Ask to send a probe connection to a server whose circuit is open. A probe
+ * is let through once the cooldown has passed and then again each cooldown
+ * for as long as no probe reports back.
+ *
+ * @param server	The server
+ * @return		Non-zero if the caller may connect to the server
+ */
+int
+server_circuit_probe(SERVER *server)
+{
+time_t	now;
+int	rval = 0;
+
+	if (server->circuit_state == SERVER_CIRCUIT_CLOSED)
+		return 1;
+	now = time(0);
+	spinlock_acquire(&server->circuitlock);
+	if (server->circuit_state == SERVER_CIRCUIT_CLOSED)
+	{
+		rval = 1;
+	}
+	else if (now - server->circuit_since >= server->circuit_cooldown)
+	{
+		server->circuit_state = SERVER_CIRCUIT_HALF_OPEN;
+		server->circuit_since = now;
+		rval = 1;
+	}
+	spinlock_release(&server->circuitlock);
+	return rval;
+}
+
+/**
+ * Return the address to connect to a server from the cache of the resolver,
+ * see resolver.h, so that a new session never waits for the name service
+ * for its backend connections. The name of the server is queued when the
+ * server is allocated and is looked up again by the resolver thread.
+ *
+ * @param server	The server
+ * @param addr		Filled with the address
+ * @return		1 if an address was found, 0 otherwise
+ */
+int
+server_resolve(SERVER *server, struct in_addr *addr)
+{
+	if (!resolver_lookup(server->name, addr))
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : The address of server %s is not known yet, "
+			"the name is being looked up.",
+			server->name)));
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Replace the global variables of a server, the monitor reads them from
+ * the server. The list and its strings are owned by the server afterwards.
+ *
+ * @param server	The server
+ * @param vars		The variables, NULL to forget them
+ */
+void
+server_set_variables(SERVER *server, SERVER_PARAM *vars)
+{
+SERVER_PARAM	*old, *next;
+
+	spinlock_acquire(&server->varlock);
+	old = server->variables;
+	server->variables = vars;
+	spinlock_release(&server->varlock);
+
+	while (old)
+	{
+		next = old->next;
+		free(old->name);
+		free(old->value);
+		free(old);
+		old = next;
+	}
+}
+
+/**
+ * Copy the value of a global variable of a server, as the monitor last
+ * read it.
+ *
+ * @param server	The server
+ * @param name		The variable name, in lower case
+ * @param buf		Filled with the value
+ * @param len		The size of buf
+ * @return		1 if the value is known and fits in buf, 0 otherwise
+ */
+int
+server_get_variable(SERVER *server, char *name, char *buf, int len)
+{
+SERVER_PARAM	*var;
+int		rval = 0;
+
+	spinlock_acquire(&server->varlock);
+	for (var = server->variables; var; var = var->next)
+	{
+		if (strcmp(var->name, name) == 0)
+		{
+			if (strlen(var->value) < (size_t)len)
+			{
+				strcpy(buf, var->value);
+				rval = 1;
+			}
+			break;
+		}
+	}
+	spinlock_release(&server->varlock);
+	return rval;
+}
@@ -39,25 +39,42 @@
 #include <string.h>
 #include <ctype.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <session.h>
 #include <service.h>
 #include <server.h>
 #include <router.h>
 #include <spinlock.h>
+#include <brlock.h>
 #include <modules.h>
 #include <dcb.h>
 #include <users.h>
 #include <filter.h>
 #include <dbusers.h>
 #include <poll.h>
+#include <config.h>
+#include <tls.h>
+#include <thread.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
 
 extern int lm_enabled_logfiles_bitmask;
 
-static SPINLOCK	service_spin = SPINLOCK_INIT;
+static BRLOCK	service_lock = BRLOCK_INIT;	/**< Protects the list of all services */
 static SERVICE	*allServices = NULL;
 
+/**
+ * The users' loader thread, it reloads the users' tables that the failed
+ * logins ask for and checks the checksums of all of them every
+ * USERS_CHECK_TIME seconds.
+ */
+static pthread_mutex_t	users_loader_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	users_loader_cond = PTHREAD_COND_INITIALIZER;
+static int		users_loader_wanted = 0;	/**< A reload is pending */
+static int		users_loader_done = 0;		/**< The thread must exit */
+static void		*users_loader_thr = NULL;
+
 static void service_add_qualified_param(
         SERVICE*          svc,
         CONFIG_PARAMETER* param);
@@ -98,11 +115,25 @@ SERVICE 	*service;
 		free(service);
 		return NULL;
 	}
+	memset(&service->stats, 0, sizeof(SERVICE_STATS));
+	if ((service->stats.counters = ts_stats_alloc(SERVICE_N_STATS)) == NULL)
+	{
+		free(service);
+		return NULL;
+	}
+	if ((service->stats.latency = ts_hist_alloc()) == NULL)
+	{
+		ts_stats_free(service->stats.counters);
+		free(service);
+		return NULL;
+	}
 	service->name = strdup(servname);
 	service->routerModule = strdup(router);
 	service->version_string = NULL;
-	memset(&service->stats, 0, sizeof(SERVICE_STATS));
 	service->ports = NULL;
+	service->users = NULL;
+	service->users_loader = 0;
+	service->users_source = NULL;
 	service->stats.started = time(0);
 	service->state = SERVICE_STATE_ALLOC;
 	service->credentials.name = NULL;
@@ -115,14 +146,30 @@ SERVICE 	*service;
 	service->filters = NULL;
 	service->n_filters = 0;
 	service->weightby = 0;
+	service->conn_timeout = 0;
+	service->query_timeout = 0;
+	service->query_timeouts = NULL;
+	service->trace_sample = 0;
+	service->mem_soft_limit = 0;
+	service->mem_hard_limit = 0;
+	service->write_timeout = 0;
+	service->writeq_limit = 0;
+	bitmask_init(&service->poll_threads);
+	service->priority = SERVICE_PRIORITY_NORMAL;
+	service->max_connections = 0;
+	service->n_connections = 0;
+	memset(&service->conn_queue, 0, sizeof(SERVICE_QUEUE));
+	spinlock_init(&service->conn_queue.lock);
+	service->conn_queue.max_depth = SERVICE_MAX_QUEUED;
 	spinlock_init(&service->spin);
 	spinlock_init(&service->users_table_spin);
+	brlock_init(&service->users_lock);
 	memset(&service->rate_limit, 0, sizeof(SERVICE_REFRESH_RATE));
 
-	spinlock_acquire(&service_spin);
+	brlock_write_acquire(&service_lock);
 	service->next = allServices;
 	allServices = service;
-	spinlock_release(&service_spin);
+	brlock_write_release(&service_lock);
 
 	return service;
 }
@@ -139,7 +186,7 @@ service_isvalid(SERVICE *service)
 SERVICE		*ptr;
 int		rval = 0;
 
-	spinlock_acquire(&service_spin);
+	brlock_read_acquire(&service_lock);
 	ptr = allServices;
 	while (ptr)
 	{
@@ -150,7 +197,7 @@ int		rval = 0;
 		}
 		ptr = ptr->next;
 	}
-	spinlock_release(&service_spin);
+	brlock_read_release(&service_lock);
 	return rval;
 }
 
@@ -174,23 +221,39 @@ GWPROTOCOL	*funcs;
 	{
 		return 0;
 	}
-	if (strcmp(port->protocol, "MySQLClient") == 0) {
+	/*< The users are loaded once, not for each port of the service */
+	if (strcmp(port->protocol, "MySQLClient") == 0 && !service->users_loader) {
 		int loaded;
 		/* Allocate specific data for MySQL users */
 		service->users = mysql_users_alloc();
-		loaded = load_mysql_users(service);
+		/*<
+		 * A snapshot of the users lets the clients in before any
+		 * backend has answered, the users' loader checks it against
+		 * the backends once it has started.
+		 */
+		if ((loaded = load_mysql_users_snapshot(service)) >= 0)
+		{
+			pthread_mutex_lock(&users_loader_lock);
+			service->users_reload = 1;
+			users_loader_wanted = 1;
+			pthread_mutex_unlock(&users_loader_lock);
+		}
+		else
+			loaded = load_mysql_users(service);
 		/* At service start last update is set to USERS_REFRESH_TIME seconds earlier.
  		 * This way MaxScale could try reloading users' just after startup
  		 */
 
 		service->rate_limit.last=time(NULL) - USERS_REFRESH_TIME;
 		service->rate_limit.nloads=1;
+		service->users_loader = 1;
 
 		LOGIF(LM, (skygw_log_write(
                         LOGFILE_MESSAGE,
-                        "Loaded %d MySQL Users.",
-                        loaded)));
-	} else {
+                        "Loaded %d MySQL Users for service %s.",
+                        loaded,
+                        service->name)));
+	} else if (service->users == NULL) {
 		/* Generic users table */
 		service->users = users_alloc();
 	}
@@ -208,6 +271,31 @@ GWPROTOCOL	*funcs;
                         service->name)));
 		return 0;
 	}
+	if (port->ssl_cert && port->tls_ctx == NULL)
+	{
+		/*< A context for each epoll set, see poll_init */
+		port->tls_ctx = tls_context_alloc(port->ssl_cert,
+				port->ssl_key, port->ssl_ca_cert,
+				config_per_thread_poll() ? config_threadcount() : 1);
+		if (port->tls_ctx == NULL)
+		{
+			dcb_free(port->listener);
+			port->listener = NULL;
+			LOGIF(LE, (skygw_log_write_flush(
+				LOGFILE_ERROR,
+				"Error : Unable to create the TLS context of the "
+				"%s listener on port %d. Listener for service %s "
+				"not started.",
+				port->protocol,
+				port->port,
+				service->name)));
+			return 0;
+		}
+		port->tls_ctx->required = port->ssl_required;
+	}
+	port->listener->tls_ctx = port->tls_ctx;
+	/*< The polling threads of the service own the listener */
+	port->listener->service = service;
 	memcpy(&(port->listener->func), funcs, sizeof(GWPROTOCOL));
 	port->listener->session = NULL;
 	if (port->address)
@@ -220,6 +308,7 @@ GWPROTOCOL	*funcs;
 
                 if (port->listener->session != NULL) {
                         port->listener->session->state = SESSION_STATE_LISTENER;
+                        poll_clone_listener(port->listener);
                         listeners += 1;
                 } else {
                         dcb_close(port->listener);
@@ -291,24 +380,75 @@ SERV_PROTOCOL	*ptr;
 }
 
 
+/*<
+ * The services serviceStartAll has not yet given to a start thread and the
+ * number of listeners started so far
+ */
+static	SERVICE		*start_next = NULL;
+static	SPINLOCK	start_lock = SPINLOCK_INIT;
+static	int		start_listeners = 0;
+
+/**
+ * The main of a start thread, it takes the next service that has not been
+ * started until none is left
+ *
+ * @param arg	Unused
+ */
+static void
+serviceStartMain(void *arg)
+{
+SERVICE	*service;
+
+	while (1)
+	{
+		spinlock_acquire(&start_lock);
+		if ((service = start_next) != NULL)
+			start_next = service->next;
+		spinlock_release(&start_lock);
+		if (service == NULL)
+			break;
+		atomic_add(&start_listeners, serviceStart(service));
+	}
+}
+
 /**
  * Start all the services
  *
+ * Up to start_threads services are started at the same time, so that the
+ * time to create their router instances and to load their users' tables
+ * from the backends is not summed over the services. The calling thread
+ * is one of the start threads.
+ *
  * @return Return the number of services started
  */
 int
 serviceStartAll()
 {
 SERVICE	*ptr;
-int	n = 0;
-
-	ptr = allServices;
-	while (ptr)
+void	**threads = NULL;
+int	n_services = 0, n_threads, i;
+
+	for (ptr = allServices; ptr; ptr = ptr->next)
+		n_services++;
+	n_threads = config_start_threads();
+	if (n_threads > n_services)
+		n_threads = n_services;
+	if (n_threads > 1)
+		threads = (void **)calloc(n_threads, sizeof(void *));
+
+	start_next = allServices;
+	start_listeners = 0;
+	for (i = 1; threads && i < n_threads; i++)
+		threads[i] = thread_start(serviceStartMain, NULL);
+	serviceStartMain(NULL);
+	for (i = 1; threads && i < n_threads; i++)
 	{
-		n += serviceStart(ptr);
-		ptr = ptr->next;
+		if (threads[i])
+			thread_wait(threads[i]);
 	}
-	return n;
+	free(threads);
+
+	return start_listeners;
 }
 
 /**
@@ -377,10 +517,10 @@ service_free(SERVICE *service)
 {
 SERVICE *ptr;
 
-	if (service->stats.n_current)
+	if (ts_stats_get(service->stats.counters, SERVICE_N_CURRENT))
 		return 0;
 	/* First of all remove from the linked list */
-	spinlock_acquire(&service_spin);
+	brlock_write_acquire(&service_lock);
 	if (allServices == service)
 	{
 		allServices = service->next;
@@ -395,7 +535,7 @@ SERVICE *ptr;
 		if (ptr)
 			ptr->next = service->next;
 	}
-	spinlock_release(&service_spin);
+	brlock_write_release(&service_lock);
 
 	/* Clean up session and free the memory */
 	free(service->name);
@@ -404,6 +544,8 @@ SERVICE *ptr;
 		free(service->credentials.name);
 	if (service->credentials.authdata)
 		free(service->credentials.authdata);
+	ts_stats_free(service->stats.counters);
+	ts_hist_free(service->stats.latency);
 	free(service);
 	return 1;
 }
@@ -432,6 +574,17 @@ SERV_PROTOCOL	*proto;
 	else
 		proto->address = NULL;
 	proto->port = port;
+	proto->listener = NULL;
+	proto->ssl_cert = NULL;
+	proto->ssl_key = NULL;
+	proto->ssl_ca_cert = NULL;
+	proto->ssl_required = 0;
+	proto->backlog = 0;
+	proto->defer_accept = 0;
+	proto->fastopen = 0;
+	proto->write_coalesce = 0;
+	proto->notsent_lowat = 0;
+	proto->tls_ctx = NULL;
 	spinlock_acquire(&service->spin);
 	proto->next = service->ports;
 	service->ports = proto;
@@ -466,6 +619,143 @@ SERV_PROTOCOL	*proto;
 	return proto != NULL;
 }
 
+/**
+ * Set the TLS parameters of a protocol/port pair of the service. The
+ * clients of the listener may switch to TLS once it is started.
+ *
+ * @param service	The service
+ * @param protocol	The name of the protocol module
+ * @param port		The port of the listener
+ * @param cert		The certificate chain file
+ * @param key		The private key file
+ * @param ca		The CA certificates of client certificates or NULL
+ * @param required	Non-zero if clients must use TLS
+ * @return	TRUE if the protocol/port was found
+ */
+int
+serviceSetProtocolSSL(SERVICE *service, char *protocol, unsigned short port,
+			char *cert, char *key, char *ca, int required)
+{
+SERV_PROTOCOL	*proto;
+
+	spinlock_acquire(&service->spin);
+	proto = service->ports;
+	while (proto)
+	{
+		if (strcmp(proto->protocol, protocol) == 0 && proto->port == port)
+			break;
+		proto = proto->next;
+	}
+	if (proto)
+	{
+		proto->ssl_cert = strdup(cert);
+		proto->ssl_key = strdup(key);
+		proto->ssl_ca_cert = ca ? strdup(ca) : NULL;
+		proto->ssl_required = required;
+	}
+	spinlock_release(&service->spin);
+
+	return proto != NULL;
+}
+
+/**
+ * Set the listen backlog, the TCP_DEFER_ACCEPT time and the TCP Fast Open
+ * queue of a listener of the service, they are used when the listener is
+ * started.
+ *
+ * @param service	The service
+ * @param protocol	The name of the protocol module
+ * @param port		The port of the listener
+ * @param backlog	The listen backlog, 0 for the default of the protocol
+ * @param defer_accept	Seconds the kernel holds a connection until the
+ *			client sends data, 0 to accept at once
+ * @param fastopen	Pending TCP Fast Open connections, 0 for no Fast Open
+ * @return	TRUE if the protocol/port was found
+ */
+int
+serviceSetProtocolListen(SERVICE *service, char *protocol, unsigned short port,
+			int backlog, int defer_accept, int fastopen)
+{
+SERV_PROTOCOL	*proto;
+
+	spinlock_acquire(&service->spin);
+	proto = service->ports;
+	while (proto)
+	{
+		if (strcmp(proto->protocol, protocol) == 0 && proto->port == port)
+			break;
+		proto = proto->next;
+	}
+	if (proto)
+	{
+		proto->backlog = backlog;
+		proto->defer_accept = defer_accept;
+		proto->fastopen = fastopen;
+	}
+	spinlock_release(&service->spin);
+
+	return proto != NULL;
+}
+
+/**
+ * Set the write policy of the clients of a listener of the service, it is
+ * applied when the listener is started. With write_coalesce the replies a
+ * client gets while one event is processed are sent together at the end of
+ * the event, notsent_lowat bounds the data the kernel keeps unsent in the
+ * socket buffer.
+ *
+ * @param service	The service
+ * @param protocol	The name of the protocol module
+ * @param port		The port of the listener
+ * @param coalesce	Non-zero to coalesce the writes of an event
+ * @param notsent_lowat	TCP_NOTSENT_LOWAT in bytes, 0 for the kernel default
+ * @return	TRUE if the protocol/port was found
+ */
+int
+serviceSetProtocolWrites(SERVICE *service, char *protocol, unsigned short port,
+			int coalesce, int notsent_lowat)
+{
+SERV_PROTOCOL	*proto;
+
+	spinlock_acquire(&service->spin);
+	proto = service->ports;
+	while (proto)
+	{
+		if (strcmp(proto->protocol, protocol) == 0 && proto->port == port)
+			break;
+		proto = proto->next;
+	}
+	if (proto)
+	{
+		proto->write_coalesce = coalesce;
+		proto->notsent_lowat = notsent_lowat;
+	}
+	spinlock_release(&service->spin);
+
+	return proto != NULL;
+}
+
+/**
+ * Find the port of the service a listener DCB was started for
+ *
+ * @param listener	The listener DCB
+ * @return	The port or NULL if the DCB is not the listener of a port
+ */
+SERV_PROTOCOL *
+serviceListenerPort(DCB *listener)
+{
+SERV_PROTOCOL	*proto;
+
+	if (listener->service == NULL)
+		return NULL;
+	for (proto = listener->service->ports; proto; proto = proto->next)
+	{
+		if (proto->listener == listener)
+			return proto;
+	}
+	return NULL;
+}
+
 /**
  * Add a backend database server to a service
  *
@@ -695,11 +985,11 @@ service_find(char *servname)
 {
 SERVICE 	*service;
 
-	spinlock_acquire(&service_spin);
+	brlock_read_acquire(&service_lock);
 	service = allServices;
 	while (service && strcmp(service->name, servname) != 0)
 		service = service->next;
-	spinlock_release(&service_spin);
+	brlock_read_release(&service_lock);
 
 	return service;
 }
@@ -737,8 +1027,12 @@ int	i;
 		printf("\n");
 	}
 	printf("\tUsers data:        	%p\n", service->users);
-	printf("\tTotal connections:	%d\n", service->stats.n_sessions);
-	printf("\tCurrently connected:	%d\n", service->stats.n_current);
+	printf("\tTotal connections:	%d\n",
+		ts_stats_get(service->stats.counters, SERVICE_N_SESSIONS));
+	printf("\tCurrently connected:	%d\n",
+		ts_stats_get(service->stats.counters, SERVICE_N_CURRENT));
+	printf("\tSession memory:		%d bytes\n",
+		ts_stats_get(service->stats.counters, SERVICE_N_MEMORY));
 }
 
 /**
@@ -752,14 +1046,32 @@ printAllServices()
 {
 SERVICE	*ptr;
 
-	spinlock_acquire(&service_spin);
+	brlock_read_acquire(&service_lock);
 	ptr = allServices;
 	while (ptr)
 	{
 		printService(ptr);
 		ptr = ptr->next;
 	}
-	spinlock_release(&service_spin);
+	brlock_read_release(&service_lock);
+}
+
+/**
+ * Call a function for every service. The list is read locked for the
+ * calls, so the function must not create or free a service.
+ *
+ * @param fn	The function to call
+ * @param arg	Passed to the function
+ */
+void
+serviceForEach(void (*fn)(SERVICE *, void *), void *arg)
+{
+SERVICE	*ptr;
+
+	brlock_read_acquire(&service_lock);
+	for (ptr = allServices; ptr; ptr = ptr->next)
+		fn(ptr, arg);
+	brlock_read_release(&service_lock);
 }
 
 /**
@@ -773,14 +1085,14 @@ dprintAllServices(DCB *dcb)
 {
 SERVICE	*ptr;
 
-	spinlock_acquire(&service_spin);
+	brlock_read_acquire(&service_lock);
 	ptr = allServices;
 	while (ptr)
 	{
 		dprintService(dcb, ptr);
 		ptr = ptr->next;
 	}
-	spinlock_release(&service_spin);
+	brlock_read_release(&service_lock);
 }
 
 /**
@@ -792,6 +1104,8 @@ SERVICE	*ptr;
 void dprintService(DCB *dcb, SERVICE *service)
 {
 SERVER	*server = service->databases;
+SERV_PROTOCOL	*port;
+SERVICE_QUERY_TIMEOUT	*qt;
 int	i;
 
 	dcb_printf(dcb, "Service %p\n", service);
@@ -825,12 +1139,83 @@ int	i;
 	if (service->weightby)
 		dcb_printf(dcb, "\tRouting weight parameter:		%s\n",
 							service->weightby);
+	if (service->conn_timeout)
+		dcb_printf(dcb, "\tClient idle timeout:			%d\n",
+							service->conn_timeout);
+	if (service->query_timeout)
+		dcb_printf(dcb, "\tQuery timeout:				%d\n",
+							service->query_timeout);
+	for (qt = service->query_timeouts; qt; qt = qt->next)
+	{
+		if (qt->timeout >= 0)
+			dcb_printf(dcb, "\tQuery timeout of user %s:		%d\n",
+							qt->user, qt->timeout);
+	}
+	if (service->trace_sample)
+		dcb_printf(dcb, "\tRequests traced:			1 in %d\n",
+							service->trace_sample);
+	if (service->priority != SERVICE_PRIORITY_NORMAL)
+		dcb_printf(dcb, "\tPoll priority:				%s\n",
+			service->priority == SERVICE_PRIORITY_HIGH ? "high" : "low");
+	if (!bitmask_isallclear(&service->poll_threads))
+	{
+		dcb_printf(dcb, "\tPolling threads:			");
+		for (i = 0; i < config_threadcount(); i++)
+			if (bitmask_isset(&service->poll_threads, i))
+				dcb_printf(dcb, "%d ", i);
+		dcb_printf(dcb, "\n");
+	}
+	if (service->max_connections)
+	{
+		dcb_printf(dcb, "\tMaximum connections:			%d\n",
+						service->max_connections);
+		dcb_printf(dcb, "\tAdmitted connections:			%d\n",
+						service->n_connections);
+		dcb_printf(dcb, "\tQueue depth:				%d (max %d)\n",
+						service->conn_queue.depth,
+						service->conn_queue.max_depth);
+		dcb_printf(dcb, "\tQueued connections:			%d\n",
+						service->conn_queue.n_queued);
+		dcb_printf(dcb, "\tRejected connections:			%d\n",
+						service->conn_queue.n_rejected);
+		if (service->conn_queue.n_admitted)
+			dcb_printf(dcb, "\tAverage queue wait (ms):		%ld\n",
+				service->conn_queue.wait_total /
+				service->conn_queue.n_admitted);
+		dcb_printf(dcb, "\tLongest queue wait (ms):		%ld\n",
+						service->conn_queue.wait_max);
+	}
 	dcb_printf(dcb, "\tUsers data:        			%p\n",
 						service->users);
 	dcb_printf(dcb, "\tTotal connections:			%d\n",
-						service->stats.n_sessions);
+			ts_stats_get(service->stats.counters, SERVICE_N_SESSIONS));
 	dcb_printf(dcb, "\tCurrently connected:			%d\n",
-						service->stats.n_current);
+			ts_stats_get(service->stats.counters, SERVICE_N_CURRENT));
+	dcb_printf(dcb, "\tSession memory buffered:		%d bytes\n",
+			ts_stats_get(service->stats.counters, SERVICE_N_MEMORY));
+	if (service->mem_soft_limit)
+		dcb_printf(dcb, "\tSession memory soft limit:		%d bytes\n",
+						service->mem_soft_limit);
+	if (service->mem_hard_limit)
+		dcb_printf(dcb, "\tSession memory hard limit:		%d bytes\n",
+						service->mem_hard_limit);
+	if (service->write_timeout)
+		dcb_printf(dcb, "\tClient write timeout:			%d seconds\n",
+						service->write_timeout);
+	if (service->writeq_limit)
+		dcb_printf(dcb, "\tClient write queue limit:		%d bytes\n",
+						service->writeq_limit);
+	dcb_printf(dcb, "\tSessions closed for their buffers:	%d\n",
+			ts_stats_get(service->stats.counters, SERVICE_N_EVICTED));
+	for (port = service->ports; port; port = port->next)
+	{
+		if (port->tls_ctx == NULL)
+			continue;
+		dcb_printf(dcb, "\tTLS handshakes on port %-5d		%d\n",
+			port->port, port->tls_ctx->n_handshakes);
+		dcb_printf(dcb, "\tTLS sessions resumed on port %-5d	%d\n",
+			port->port, port->tls_ctx->n_resumed);
+	}
 }
 
 /**
@@ -843,7 +1228,7 @@ dListServices(DCB *dcb)
 {
 SERVICE	*ptr;
 
-	spinlock_acquire(&service_spin);
+	brlock_read_acquire(&service_lock);
 	ptr = allServices;
 	if (ptr)
 	{
@@ -857,12 +1242,13 @@ SERVICE	*ptr;
 	{
 		dcb_printf(dcb, "%-25s | %-20s | %6d | %5d\n",
 			ptr->name, ptr->routerModule,
-			ptr->stats.n_current, ptr->stats.n_sessions);
+			ts_stats_get(ptr->stats.counters, SERVICE_N_CURRENT),
+			ts_stats_get(ptr->stats.counters, SERVICE_N_SESSIONS));
 		ptr = ptr->next;
 	}
 	if (allServices)
 		dcb_printf(dcb, "--------------------------+----------------------+--------+---------------\n\n");
-	spinlock_release(&service_spin);
+	brlock_read_release(&service_lock);
 }
 
 /**
@@ -876,7 +1262,7 @@ dListListeners(DCB *dcb)
 SERVICE		*ptr;
 SERV_PROTOCOL	*lptr;
 
-	spinlock_acquire(&service_spin);
+	brlock_read_acquire(&service_lock);
 	ptr = allServices;
 	if (ptr)
 	{
@@ -904,7 +1290,7 @@ SERV_PROTOCOL	*lptr;
 	}
 	if (allServices)
 		dcb_printf(dcb, "---------------------+--------------------+-----------------+-------+--------\n\n");
-	spinlock_release(&service_spin);
+	brlock_read_release(&service_lock);
 }
 
 /**
@@ -956,8 +1342,25 @@ void	*router_obj;
 }
 
 
+/**
+ * Ask for a reload of the users' table of a service, after a failed login.
+ *
+ * The reloads are rate limited to USERS_REFRESH_MAX_PER_TIME within
+ * USERS_REFRESH_TIME seconds. While the users' loader is running the reload
+ * is left to it and the caller does not wait for the backend, requests that
+ * come while a reload is pending are merged into it. Without the loader
+ * the table is reloaded by the calling thread.
+ *
+ * @param service	The service
+ * @return 0 if the users' table has been reloaded, 1 if not or if the
+ *	reload is left to the users' loader
+ */
 int service_refresh_users(SERVICE *service) {
 	int ret = 1;
+
+	if (service->users_reload)
+		return 1;
+
 	/* check for another running getUsers request */
 	if (! spinlock_acquire_nowait(&service->users_table_spin)) {
 		LOGIF(LD, (skygw_log_write_flush(
@@ -988,6 +1391,20 @@ int service_refresh_users(SERVICE *service) {
 		service->rate_limit.last = time(NULL);
 	}
 
+	if (users_loader_thr != NULL)
+	{
+		/* the users' loader does the reload */
+		spinlock_release(&service->users_table_spin);
+
+		pthread_mutex_lock(&users_loader_lock);
+		service->users_reload = 1;
+		users_loader_wanted = 1;
+		pthread_cond_signal(&users_loader_cond);
+		pthread_mutex_unlock(&users_loader_lock);
+
+		return 1;
+	}
+
 	ret = replace_mysql_users(service);
 
 	/* remove lock */
@@ -999,6 +1416,125 @@ int service_refresh_users(SERVICE *service) {
 		return 1;
 }
 
+/**
+ * Reload or check the users' tables of the services with MySQL users
+ *
+ * The services are collected under the read lock of the list of services
+ * and loaded without it, so that a slow backend does not hold up the
+ * writers of the list. Services are never removed from the list once they
+ * have been started.
+ *
+ * @param check_all	Check all the tables, not only those asked for
+ */
+static void
+users_loader_run(int check_all)
+{
+SERVICE	*service, **services;
+int	n = 0, i;
+time_t	start = time(NULL);
+
+	brlock_read_acquire(&service_lock);
+	for (service = allServices; service; service = service->next)
+		n++;
+	if ((services = (SERVICE **)calloc(n + 1, sizeof(SERVICE *))) == NULL)
+	{
+		brlock_read_release(&service_lock);
+		return;
+	}
+	n = 0;
+	for (service = allServices; service; service = service->next)
+	{
+		if (service->users_loader &&
+			(check_all || service->users_reload))
+			services[n++] = service;
+	}
+	brlock_read_release(&service_lock);
+
+	for (i = 0; i < n; i++)
+	{
+		service = services[i];
+		service->users_reload = 0;
+
+		spinlock_acquire(&service->users_table_spin);
+		/*<
+		 * Unchanged tables only cost the checksum query, a source
+		 * shared with a service checked before is not checked again
+		 */
+		if (refresh_mysql_users(service, start) > 0)
+		{
+			LOGIF(LM, (skygw_log_write(
+				LOGFILE_MESSAGE,
+				"Reloaded the users' table of service %s.",
+				service->name)));
+		}
+		spinlock_release(&service->users_table_spin);
+	}
+	free(services);
+}
+
+/**
+ * The main loop of the users' loader thread
+ *
+ * @param arg	Unused
+ */
+static void
+users_loader_main(void *arg)
+{
+struct timespec	deadline;
+int		check_all;
+
+	pthread_mutex_lock(&users_loader_lock);
+	while (!users_loader_done)
+	{
+		check_all = 0;
+		if (!users_loader_wanted)
+		{
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += USERS_CHECK_TIME;
+			if (pthread_cond_timedwait(&users_loader_cond,
+					&users_loader_lock, &deadline) == ETIMEDOUT)
+				check_all = 1;
+			if (users_loader_done)
+				break;
+		}
+		users_loader_wanted = 0;
+		pthread_mutex_unlock(&users_loader_lock);
+
+		users_loader_run(check_all);
+
+		pthread_mutex_lock(&users_loader_lock);
+	}
+	pthread_mutex_unlock(&users_loader_lock);
+}
+
+/**
+ * Start the users' loader thread, once the services have been started
+ */
+void
+serviceStartUsersLoader()
+{
+	if (users_loader_thr == NULL)
+		users_loader_thr = thread_start(users_loader_main, NULL);
+}
+
+/**
+ * Stop the users' loader thread and wait for it to exit
+ */
+void
+serviceStopUsersLoader()
+{
+void	*thr = users_loader_thr;
+
+	if (thr == NULL)
+		return;
+	pthread_mutex_lock(&users_loader_lock);
+	users_loader_done = 1;
+	pthread_cond_signal(&users_loader_cond);
+	pthread_mutex_unlock(&users_loader_lock);
+	thread_wait(thr);
+	users_loader_thr = NULL;
+}
+
 bool service_set_param_value (
         SERVICE*            service,
         CONFIG_PARAMETER*   param,
@@ -1161,6 +1697,488 @@ serviceWeightBy(SERVICE *service, char *weightby)
 	service->weightby = strdup(weightby);
 }
 
+/**
+ * Set the idle timeout of the client connections of the service
+ *
+ * @param	service		The service pointer
+ * @param	timeout		The timeout in seconds, 0 for no timeout
+ */
+void
+serviceSetTimeout(SERVICE *service, int timeout)
+{
+	service->conn_timeout = timeout > 0 ? timeout : 0;
+}
+
+/**
+ * Set the query timeouts of the service, a statement that runs for longer
+ * on a backend is killed. The timeout is a number of seconds, optionally
+ * followed by the timeouts of users that differ from that of the service,
+ * for example "300,report=3600,batch=0". A timeout of 0 is no timeout.
+ *
+ * The users of an earlier call that are no longer listed keep their entry
+ * with no timeout of their own, the list is read without a lock.
+ *
+ * @param	service		The service pointer
+ * @param	spec		The timeouts
+ * @return	1 on success, 0 if the timeouts are not valid
+ */
+int
+serviceSetQueryTimeout(SERVICE *service, char *spec)
+{
+SERVICE_QUERY_TIMEOUT	*qt;
+char			*copy, *item, *value, *lasts, *end;
+int			timeout = 0;
+long			secs;
+
+	if ((copy = strdup(spec)) == NULL)
+		return 0;
+	/*< Check all of it before anything is changed */
+	for (item = strtok_r(copy, ",", &lasts); item;
+				item = strtok_r(NULL, ",", &lasts))
+	{
+		while (isspace(*item))
+			item++;
+		value = (value = strchr(item, '=')) ? value + 1 : item;
+		secs = strtol(value, &end, 10);
+		while (isspace(*end))
+			end++;
+		if (end == value || *end || secs < 0 || value == item + 1)
+		{
+			free(copy);
+			return 0;
+		}
+	}
+	free(copy);
+
+	spinlock_acquire(&service->spin);
+	for (qt = service->query_timeouts; qt; qt = qt->next)
+		qt->timeout = -1;
+	copy = strdup(spec);
+	for (item = copy ? strtok_r(copy, ",", &lasts) : NULL; item;
+				item = strtok_r(NULL, ",", &lasts))
+	{
+		while (isspace(*item))
+			item++;
+		if ((value = strchr(item, '=')) == NULL)
+		{
+			timeout = atoi(item);
+			continue;
+		}
+		*value++ = 0;
+		for (end = value - 2; end > item && isspace(*end); end--)
+			*end = 0;
+		for (qt = service->query_timeouts; qt; qt = qt->next)
+		{
+			if (strcmp(qt->user, item) == 0)
+				break;
+		}
+		if (qt == NULL &&
+			(qt = (SERVICE_QUERY_TIMEOUT *)calloc(1,
+					sizeof(SERVICE_QUERY_TIMEOUT))) != NULL)
+		{
+			if ((qt->user = strdup(item)) == NULL)
+			{
+				free(qt);
+				continue;
+			}
+			qt->timeout = -1;
+			qt->next = service->query_timeouts;
+			service->query_timeouts = qt;
+		}
+		if (qt)
+			qt->timeout = atoi(value);
+	}
+	free(copy);
+	service->query_timeout = timeout;
+	spinlock_release(&service->spin);
+
+	return 1;
+}
+
+/**
+ * Return the query timeout of a user of the service
+ *
+ * @param	service		The service pointer
+ * @param	user		The user name, NULL for the timeout of the service
+ * @return	The timeout in seconds, 0 for none
+ */
+int
+serviceGetQueryTimeout(SERVICE *service, char *user)
+{
+SERVICE_QUERY_TIMEOUT	*qt;
+
+	for (qt = user ? service->query_timeouts : NULL; qt; qt = qt->next)
+	{
+		if (qt->timeout >= 0 && strcmp(qt->user, user) == 0)
+			return qt->timeout;
+	}
+	return service->query_timeout;
+}
+
+/**
+ * Set the sampling of the requests of the service that are traced, the
+ * times a traced request reaches each stage are written to the trace log
+ *
+ * @param	service		The service pointer
+ * @param	sample		Trace one request in this many, 0 for none
+ */
+void
+serviceSetTraceSample(SERVICE *service, int sample)
+{
+	service->trace_sample = sample > 0 ? sample : 0;
+}
+
+/**
+ * Set the limits of the memory buffered for each session of the service,
+ * in the write and delay queues of its DCBs and the session command
+ * history of its router. Above the soft limit the reads for the session
+ * pause while its client drains, above the hard limit the session is
+ * closed.
+ *
+ * @param	service		The service pointer
+ * @param	soft		Bytes that pause the reads, 0 for no limit
+ * @param	hard		Bytes that close the session, 0 for no limit
+ */
+void
+serviceSetMemoryLimits(SERVICE *service, int soft, int hard)
+{
+	service->mem_soft_limit = soft > 0 ? soft : 0;
+	service->mem_hard_limit = hard > 0 ? hard : 0;
+}
+
+/**
+ * Set the limits of the writes to the clients of the service. A session is
+ * closed when the write queue of its client has not drained at all for the
+ * write timeout, or holds more than the write queue limit, so that a client
+ * that does not read its results does not hold the backends of its session.
+ *
+ * @param	service		The service pointer
+ * @param	timeout		Seconds a write may stall, 0 for no timeout
+ * @param	bytes		Bytes queued that close the session, 0 for no limit
+ */
+void
+serviceSetWriteLimits(SERVICE *service, int timeout, int bytes)
+{
+	service->write_timeout = timeout > 0 ? timeout : 0;
+	service->writeq_limit = bytes > 0 ? bytes : 0;
+}
+
+/**
+ * Set the priority class of the events of the service. In each cycle of a
+ * polling thread the events of the high priority services run first and
+ * those of the low priority ones last, up to low_priority_budget of them,
+ * the others are put off to a later cycle.
+ *
+ * @param	service		The service pointer
+ * @param	priority	high, normal or low
+ * @return	1 on success, 0 if the priority is not valid
+ */
+int
+serviceSetPriority(SERVICE *service, char *priority)
+{
+	if (strcasecmp(priority, "high") == 0)
+		service->priority = SERVICE_PRIORITY_HIGH;
+	else if (strcasecmp(priority, "normal") == 0)
+		service->priority = SERVICE_PRIORITY_NORMAL;
+	else if (strcasecmp(priority, "low") == 0)
+		service->priority = SERVICE_PRIORITY_LOW;
+	else
+		return 0;
+	if (service->priority != SERVICE_PRIORITY_NORMAL)
+		poll_use_priorities();
+	return 1;
+}
+
+/**
+ * Bind the sessions of the service to a subset of the polling threads.
+ * The listeners of the service are only polled by these threads, so the
+ * sessions and their backend connections are only ever processed by them.
+ * This needs an epoll set for each polling thread, see per_thread_poll,
+ * and must be set before the service is started.
+ *
+ * @param	service		The service pointer
+ * @param	threads		A list of thread ids and ranges, e.g. "1,3-5"
+ * @return	1 on success, 0 if the list is not valid
+ */
+int
+serviceSetPollThreads(SERVICE *service, char *threads)
+{
+char	*list, *tok, *lasts, *end;
+int	first, last, n_threads = config_threadcount();
+
+	if ((list = strdup(threads)) == NULL)
+		return 0;
+	for (tok = strtok_r(list, ", \t", &lasts); tok;
+			tok = strtok_r(NULL, ", \t", &lasts))
+	{
+		first = last = strtol(tok, &end, 10);
+		if (*end == '-')
+			last = strtol(end + 1, &end, 10);
+		if (end == tok || *end != '\0' || first < 0 || last < first ||
+				last >= n_threads)
+		{
+			free(list);
+			return 0;
+		}
+		for (; first <= last; first++)
+			bitmask_set(&service->poll_threads, first);
+	}
+	free(list);
+	return !bitmask_isallclear(&service->poll_threads);
+}
+
+/**
+ * Check if a polling thread may process the sessions of the service
+ *
+ * @param	service		The service pointer
+ * @param	thread		The polling thread id
+ * @return	Non-zero if the thread may process the sessions
+ */
+int
+serviceUsesPollThread(SERVICE *service, int thread)
+{
+	return bitmask_isallclear(&service->poll_threads) ||
+		bitmask_isset(&service->poll_threads, thread);
+}
+
+/**
+ * Take the listeners of all the services away from a polling thread that
+ * retires, see poll_retire_listener. Called by the retiring thread.
+ *
+ * @param	thread		The polling thread id
+ */
+void
+serviceRetireListeners(int thread)
+{
+SERVICE		*service;
+SERV_PROTOCOL	*port;
+
+	brlock_read_acquire(&service_lock);
+	for (service = allServices; service; service = service->next)
+	{
+		for (port = service->ports; port; port = port->next)
+		{
+			if (port->listener && port->listener->session &&
+				port->listener->state == DCB_STATE_LISTENING)
+				poll_retire_listener(port->listener, thread);
+		}
+	}
+	brlock_read_release(&service_lock);
+}
+
+/**
+ * Give the listeners of all the services back to a polling thread that
+ * resumes, see poll_restore_listener. Called by the resuming thread.
+ *
+ * @param	thread		The polling thread id
+ */
+void
+serviceRestoreListeners(int thread)
+{
+SERVICE		*service;
+SERV_PROTOCOL	*port;
+
+	brlock_read_acquire(&service_lock);
+	for (service = allServices; service; service = service->next)
+	{
+		for (port = service->ports; port; port = port->next)
+		{
+			if (port->listener && port->listener->session &&
+				port->listener->state == DCB_STATE_LISTENING)
+				poll_restore_listener(port->listener, thread);
+		}
+	}
+	brlock_read_release(&service_lock);
+}
+
+/**
+ * Set the admission limits of the client connections of the service
+ *
+ * @param	service		The service pointer
+ * @param	max_connections	Client connections allowed, 0 for no limit
+ * @param	max_queued	Clients that may wait for admission
+ */
+void
+serviceSetConnectionLimits(SERVICE *service, int max_connections, int max_queued)
+{
+	spinlock_acquire(&service->conn_queue.lock);
+	service->max_connections = max_connections > 0 ? max_connections : 0;
+	service->conn_queue.max_depth = max_queued >= 0 ? max_queued : 0;
+	spinlock_release(&service->conn_queue.lock);
+}
+
+/**
+ * Return the monotonic time in milliseconds
+ */
+static long
+service_msecs()
+{
+struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Is there room for another client connection, within the limit of the
+ * service and with at least one of its servers not full. A service that
+ * has no servers, such as the debug interface, only has its own limit.
+ *
+ * @param	service		The service pointer
+ * @return	Non-zero if a client may be admitted
+ */
+static int
+service_has_room(SERVICE *service)
+{
+SERVER	*server;
+
+	if (service->max_connections > 0 &&
+			service->n_connections >= service->max_connections)
+		return 0;
+	if (service->databases == NULL)
+		return 1;
+	for (server = service->databases; server; server = server->nextdb)
+	{
+		if (!SERVER_IS_FULL(server))
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Admit the waiting clients, oldest first, while there is room. Called with
+ * the lock of the queue held, a client that closes takes the lock to leave
+ * the queue so the DCBs in the queue are not closed under us.
+ *
+ * @param	service		The service pointer
+ */
+static void
+service_admit_queued(SERVICE *service)
+{
+SERVICE_QUEUE	*queue = &service->conn_queue;
+SERVICE_QUEUED	*entry;
+long		wait;
+
+	while ((entry = queue->first) != NULL && service_has_room(service))
+	{
+		if ((queue->first = entry->next) == NULL)
+			queue->last = NULL;
+		queue->depth--;
+		queue->n_admitted++;
+		service->n_connections++;
+		entry->dcb->flags = (entry->dcb->flags & ~DCBF_QUEUED) | DCBF_ADMITTED;
+		wait = service_msecs() - entry->since;
+		queue->wait_total += wait;
+		if (wait > queue->wait_max)
+			queue->wait_max = wait;
+		entry->admit(entry->dcb);
+		free(entry);
+	}
+}
+
+/**
+ * Admit a new client connection to the service. A client that finds the
+ * service, or all of its servers, at the connection limit waits in the FIFO
+ * queue of the service, the admit function is called for it once a client
+ * of the service has closed and there is room. While others wait a new
+ * client goes to the back of the queue.
+ *
+ * The DCB must be in the poll set, so that a client that gives up waiting
+ * is closed, and the DCB must call serviceReleaseClient when it closes.
+ *
+ * @param	service		The service pointer
+ * @param	dcb		The client DCB
+ * @param	admit		The function that completes a queued connection
+ * @return	SERVICE_ADMIT_NOW, SERVICE_ADMIT_QUEUED or SERVICE_ADMIT_REJECT
+ *		if the queue is full
+ */
+int
+serviceAdmitClient(SERVICE *service, DCB *dcb, void (*admit)(DCB *))
+{
+SERVICE_QUEUE	*queue = &service->conn_queue;
+SERVICE_QUEUED	*entry;
+int		rval = SERVICE_ADMIT_NOW;
+
+	spinlock_acquire(&queue->lock);
+	/*< The servers may have room again without a client closing */
+	service_admit_queued(service);
+	if (queue->first == NULL && service_has_room(service))
+	{
+		service->n_connections++;
+		dcb->flags |= DCBF_ADMITTED;
+	}
+	else if (queue->depth >= queue->max_depth ||
+		(entry = (SERVICE_QUEUED *)malloc(sizeof(SERVICE_QUEUED))) == NULL)
+	{
+		queue->n_rejected++;
+		rval = SERVICE_ADMIT_REJECT;
+	}
+	else
+	{
+		entry->dcb = dcb;
+		entry->admit = admit;
+		entry->since = service_msecs();
+		entry->next = NULL;
+		if (queue->last)
+			queue->last->next = entry;
+		else
+			queue->first = entry;
+		queue->last = entry;
+		queue->depth++;
+		queue->n_queued++;
+		dcb->flags |= DCBF_QUEUED;
+		rval = SERVICE_ADMIT_QUEUED;
+	}
+	spinlock_release(&queue->lock);
+
+	return rval;
+}
+
+/**
+ * A client DCB admitted by, or waiting in, serviceAdmitClient closes. It
+ * leaves the queue, or gives its place up to the oldest waiting client.
+ *
+ * @param	dcb		The client DCB
+ */
+void
+serviceReleaseClient(DCB *dcb)
+{
+SERVICE		*service = dcb->service;
+SERVICE_QUEUE	*queue;
+SERVICE_QUEUED	*entry, *prev = NULL;
+
+	if (service == NULL || (dcb->flags & (DCBF_ADMITTED|DCBF_QUEUED)) == 0)
+		return;
+	queue = &service->conn_queue;
+	spinlock_acquire(&queue->lock);
+	if (dcb->flags & DCBF_QUEUED)
+	{
+		for (entry = queue->first; entry; prev = entry, entry = entry->next)
+		{
+			if (entry->dcb == dcb)
+			{
+				if (prev)
+					prev->next = entry->next;
+				else
+					queue->first = entry->next;
+				if (queue->last == entry)
+					queue->last = prev;
+				queue->depth--;
+				free(entry);
+				break;
+			}
+		}
+		dcb->flags &= ~DCBF_QUEUED;
+	}
+	else if (dcb->flags & DCBF_ADMITTED)
+	{
+		dcb->flags &= ~DCBF_ADMITTED;
+		service->n_connections--;
+		service_admit_queued(service);
+	}
+	spinlock_release(&queue->lock);
+}
+
 /**
  * Return the parameter the wervice shoudl use to weight connections
  * by
@@ -34,6 +34,9 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/socket.h>
 #include <session.h>
 #include <service.h>
 #include <router.h>
@@ -42,6 +45,7 @@
 #include <atomic.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
+#include <config.h>
 
 extern int lm_enabled_logfiles_bitmask;
 
@@ -50,6 +54,18 @@ static SESSION	*allSessions = NULL;
 
 
 static int session_setup_filters(SESSION *session);
+static void session_list_remove(SESSION *session);
+static int session_filter_route(void *, void *, GWBUF *);
+static int session_trace_route(void *, void *, GWBUF *);
+static int session_trace_batch(void *, void *, GWBUF *);
+static int session_filter_batch(void *, void *, GWBUF *);
+static void session_arena_free(SESSION *session);
+
+/**
+ * Round an arena allocation up so that every allocation is aligned for
+ * any type
+ */
+#define	SESSION_ARENA_ALIGN(n)	(((n) + 15) & ~(size_t)15)
 
 /**
  * Allocate a new session for a new client of the specified service.
@@ -67,7 +83,8 @@ session_alloc(SERVICE *service, DCB *client_dcb)
 {
         SESSION 	*session;
 
-        session = (SESSION *)calloc(1, sizeof(SESSION));
+        session = (SESSION *)calloc(1, SESSION_ARENA_ALIGN(sizeof(SESSION)) +
+        				SESSION_ARENA_FIRST);
         ss_info_dassert(session != NULL,
                         "Allocating memory for session failed.");
         
@@ -87,6 +104,10 @@ session_alloc(SERVICE *service, DCB *client_dcb)
         session->ses_chk_tail = CHK_NUM_SESSION;
 #endif
         spinlock_init(&session->ses_lock);
+	spinlock_init(&session->arena.lock);
+	session->arena.next = (char *)session +
+				SESSION_ARENA_ALIGN(sizeof(SESSION));
+	session->arena.end = session->arena.next + SESSION_ARENA_FIRST;
         /*<
          * Prevent backend threads from accessing before session is completely
          * initialized.
@@ -108,6 +129,9 @@ session_alloc(SERVICE *service, DCB *client_dcb)
         session->data = client_dcb->data;
 	client_dcb->session = session;
 	session->refcount = 1;
+	/*< The backend reads pause while the client is slow to take replies */
+	DCB_SET_HIGH_WATER(client_dcb, config_writeq_high_water());
+	DCB_SET_LOW_WATER(client_dcb, config_writeq_low_water());
         /*<
          * This indicates that session is ready to be shared with backend
          * DCBs. Note that this doesn't mean that router is initialized yet!
@@ -167,6 +191,16 @@ session_alloc(SERVICE *service, DCB *client_dcb)
 		session->head.session = session->router_session;
 
 		session->head.routeQuery = (void *)(service->router->routeQuery);
+		session->head.routeBatch = (void *)(service->router->routeBatch);
+		if (service->trace_sample)
+		{
+			/*< Stamp the traced requests as they reach the router */
+			session->head.instance = session;
+			session->head.session = session;
+			session->head.routeQuery = session_trace_route;
+			session->head.routeBatch = service->router->routeBatch ?
+						session_trace_batch : NULL;
+		}
 
 		session->tail.instance = session;
 		session->tail.session = session;
@@ -212,12 +246,21 @@ session_alloc(SERVICE *service, DCB *client_dcb)
         else
         {
                 session->state = SESSION_STATE_ROUTER_READY;
+                session->prev = NULL;
                 session->next = allSessions;
+                if (allSessions)
+                        allSessions->prev = session;
                 allSessions = session;
                 spinlock_release(&session_spin);
-                atomic_add(&service->stats.n_sessions, 1);
-                atomic_add(&service->stats.n_current, 1);
+                ts_stats_add(service->stats.counters, SERVICE_N_SESSIONS, 1);
+                ts_stats_add(service->stats.counters, SERVICE_N_CURRENT, 1);
                 CHK_SESSION(session);
+
+                if (service->conn_timeout > 0 &&
+                    client_dcb->dcb_role == DCB_ROLE_REQUEST_HANDLER)
+                {
+                        dcb_set_idle_timeout(client_dcb, service->conn_timeout);
+                }
         }        
 return_session:
 	return session;
@@ -287,7 +330,6 @@ bool session_free(
         SESSION *session)
 {
         bool    succp = false;
-        SESSION *ptr;
         int     nlink;
 	int	i;
 
@@ -306,22 +348,9 @@ bool session_free(
         
 	/* First of all remove from the linked list */
 	spinlock_acquire(&session_spin);
-	if (allSessions == session)
-	{
-		allSessions = session->next;
-	}
-	else
-	{
-		ptr = allSessions;
-		while (ptr && ptr->next != session)
-		{
-			ptr = ptr->next;
-		}
-		if (ptr)
-			ptr->next = session->next;
-	}
+	session_list_remove(session);
 	spinlock_release(&session_spin);
-	atomic_add(&session->service->stats.n_current, -1);
+	ts_stats_add(session->service->stats.counters, SERVICE_N_CURRENT, -1);
 
 	/* Free router_session and session */
         if (session->router_session) {
@@ -343,8 +372,12 @@ bool session_free(
 					session->filters[i].instance,
 					session->filters[i].session);
 		}
-		free(session->filters);
 	}
+	/*< What is still accounted went with DCBs that were not drained */
+	if (session->mem_used)
+		ts_stats_add(session->service->stats.counters,
+				SERVICE_N_MEMORY, -session->mem_used);
+	session_arena_free(session);
 	free(session);
         succp = true;
         
@@ -410,7 +443,8 @@ SESSION	*ptr;
 	ptr = allSessions;
 	while (ptr)
 	{
-		printSession(ptr);
+		if (ptr->state != SESSION_STATE_CURSOR)
+			printSession(ptr);
 		ptr = ptr->next;
 	}
 	spinlock_release(&session_spin);
@@ -489,22 +523,173 @@ int	norouter = 0;
 void
 dprintAllSessions(DCB *dcb)
 {
-SESSION	*ptr;
+	dprintSessionRange(dcb, NULL);
+}
+
+/**
+ * Remove a session, or a cursor, from the list of all sessions. Must be
+ * called with session_spin held.
+ *
+ * @param session	The session to remove
+ */
+static void
+session_list_remove(SESSION *session)
+{
+	if (session->prev == NULL && allSessions != session)
+		return;		/*< Not in the list */
+	if (session->prev)
+		session->prev->next = session->next;
+	else
+		allSessions = session->next;
+	if (session->next)
+		session->next->prev = session->prev;
+	session->next = session->prev = NULL;
+}
+
+/**
+ * Copy the details of a session that the diagnostics print. Called with
+ * session_spin held, the session and its client DCB are not freed until
+ * the session has left the list.
+ */
+static void
+session_get_info(SESSION *session, SESSION_INFO *info)
+{
+	info->session = session;
+	info->state = session->state;
+	info->client = session->client;
+	info->service = session->service;
+	strncpy(info->service_name, session->service && session->service->name ?
+			session->service->name : "", SESSION_INFO_NAMELEN - 1);
+	info->service_name[SESSION_INFO_NAMELEN - 1] = '\0';
+	strncpy(info->remote, session->client && session->client->remote ?
+			session->client->remote : "", SESSION_INFO_NAMELEN - 1);
+	info->remote[SESSION_INFO_NAMELEN - 1] = '\0';
+	info->connect = session->stats.connect;
+}
+
+/**
+ * Call a function with a copy of the details of each session. As with the
+ * DCBs, the sessions are copied SESSION_INFO_BATCH at a time with the list
+ * locked and a cursor keeps the place of the walk while the function is
+ * called on the copies with the lock released.
+ *
+ * @param func	The function, returns 0 to end the walk
+ * @param data	Passed to the function
+ * @return	0 if the function ended the walk, otherwise 1
+ */
+int
+session_foreach_info(int (*func)(SESSION_INFO *, void *), void *data)
+{
+SESSION		cursor, *ptr;
+SESSION_INFO	info[SESSION_INFO_BATCH];
+int		i, n, rval = 1;
+
+	memset(&cursor, 0, sizeof(SESSION));
+	cursor.state = SESSION_STATE_CURSOR;
 
 	spinlock_acquire(&session_spin);
 	ptr = allSessions;
-	while (ptr)
+	while (1)
 	{
-		dcb_printf(dcb, "Session %p\n", ptr);
-		dcb_printf(dcb, "\tState:    		%s\n", session_state(ptr->state));
-		dcb_printf(dcb, "\tService:		%s (%p)\n", ptr->service->name, ptr->service);
-		dcb_printf(dcb, "\tClient DCB:		%p\n", ptr->client);
-		if (ptr->client && ptr->client->remote)
-			dcb_printf(dcb, "\tClient Address:		%s\n", ptr->client->remote);
-		dcb_printf(dcb, "\tConnected:		%s", asctime(localtime(&ptr->stats.connect)));
-		ptr = ptr->next;
+		for (n = 0; ptr && n < SESSION_INFO_BATCH; ptr = ptr->next)
+		{
+			if (ptr->state != SESSION_STATE_CURSOR)
+				session_get_info(ptr, &info[n++]);
+		}
+		if (ptr)
+		{
+			/*< Leave the cursor in the place of the next session */
+			cursor.next = ptr;
+			cursor.prev = ptr->prev;
+			if (ptr->prev)
+				ptr->prev->next = &cursor;
+			else
+				allSessions = &cursor;
+			ptr->prev = &cursor;
+		}
+		spinlock_release(&session_spin);
+
+		for (i = 0; i < n && rval; i++)
+			rval = func(&info[i], data);
+		if (ptr == NULL)
+			break;
+
+		spinlock_acquire(&session_spin);
+		ptr = cursor.next;
+		session_list_remove(&cursor);
+		if (rval == 0)
+		{
+			spinlock_release(&session_spin);
+			break;
+		}
 	}
-	spinlock_release(&session_spin);
+	return rval;
+}
+
+/**
+ * The state of a diagnostic that prints copies of the sessions
+ */
+typedef struct {
+	DCB		*dcb;		/*< The DCB to print to */
+	DIAG_RANGE	*range;		/*< The sessions to print */
+} SESSION_PRINT;
+
+/**
+ * Print the details of a session in full
+ */
+static int
+session_print_info(SESSION_INFO *info, void *data)
+{
+SESSION_PRINT	*print = (SESSION_PRINT *)data;
+DCB		*dcb = print->dcb;
+struct tm	tm;
+char		buf[30];
+int		sel;
+
+	if ((sel = diag_range_select(print->range, info->service_name)) <= 0)
+		return sel == 0;
+	dcb_printf(dcb, "Session %p\n", info->session);
+	dcb_printf(dcb, "\tState:    		%s\n", session_state(info->state));
+	dcb_printf(dcb, "\tService:		%s (%p)\n", info->service_name, info->service);
+	dcb_printf(dcb, "\tClient DCB:		%p\n", info->client);
+	if (*info->remote)
+		dcb_printf(dcb, "\tClient Address:		%s\n", info->remote);
+	dcb_printf(dcb, "\tConnected:		%s", asctime_r(localtime_r(&info->connect, &tm), buf));
+	return 1;
+}
+
+/**
+ * Print a session as a row of a table
+ */
+static int
+session_list_info(SESSION_INFO *info, void *data)
+{
+SESSION_PRINT	*print = (SESSION_PRINT *)data;
+int		sel;
+
+	if ((sel = diag_range_select(print->range, info->service_name)) <= 0)
+		return sel == 0;
+	dcb_printf(print->dcb, "%-16p | %-15s | %-14s | %s\n", info->session,
+			info->remote, info->service_name, session_state(info->state));
+	return 1;
+}
+
+/**
+ * Print the sessions of a range to a DCB, the sessions of a service or a
+ * page of the sessions
+ *
+ * @param dcb	The DCB to print to
+ * @param range	The sessions to print, NULL for all
+ */
+void
+dprintSessionRange(DCB *dcb, DIAG_RANGE *range)
+{
+SESSION_PRINT	print;
+
+	print.dcb = dcb;
+	print.range = range;
+	session_foreach_info(session_print_info, &print);
+	diag_range_more(dcb, range);
 }
 
 /**
@@ -528,6 +713,9 @@ int	i;
 	if (ptr->client && ptr->client->remote)
 		dcb_printf(dcb, "\tClient Address:		%s\n", ptr->client->remote);
 	dcb_printf(dcb, "\tConnected:		%s", asctime(localtime(&ptr->stats.connect)));
+	dcb_printf(dcb, "\tArena memory used:	%d bytes, %d chunks\n",
+			ptr->arena.used, ptr->arena.n_chunks);
+	dcb_printf(dcb, "\tBuffered memory:	%d bytes\n", ptr->mem_used);
 	if (ptr->n_filters)
 	{
 		for (i = 0; i < ptr->n_filters; i++)
@@ -553,30 +741,29 @@ int	i;
 void
 dListSessions(DCB *dcb)
 {
-SESSION	*ptr;
+	dListSessionRange(dcb, NULL);
+}
 
-	spinlock_acquire(&session_spin);
-	ptr = allSessions;
-	if (ptr)
-	{
-		dcb_printf(dcb, "Sessions.\n");
-		dcb_printf(dcb, "-----------------+-----------------+----------------+--------------------------\n");
-		dcb_printf(dcb, "Session          | Client          | Service        | State\n");
-		dcb_printf(dcb, "-----------------+-----------------+----------------+--------------------------\n");
-	}
-	while (ptr)
-	{
-		dcb_printf(dcb, "%-16p | %-15s | %-14s | %s\n", ptr,
-			((ptr->client && ptr->client->remote)
-				? ptr->client->remote : ""),
-			(ptr->service && ptr->service->name ? ptr->service->name
-				: ""),
-			session_state(ptr->state));
-		ptr = ptr->next;
-	}
-	if (allSessions)
-		dcb_printf(dcb, "-----------------+-----------------+----------------+--------------------------\n\n");
-	spinlock_release(&session_spin);
+/**
+ * List the sessions of a range in tabular form to a DCB
+ *
+ * @param dcb	The DCB to print to
+ * @param range	The sessions to print, NULL for all
+ */
+void
+dListSessionRange(DCB *dcb, DIAG_RANGE *range)
+{
+SESSION_PRINT	print;
+
+	print.dcb = dcb;
+	print.range = range;
+	dcb_printf(dcb, "Sessions.\n");
+	dcb_printf(dcb, "-----------------+-----------------+----------------+--------------------------\n");
+	dcb_printf(dcb, "Session          | Client          | Service        | State\n");
+	dcb_printf(dcb, "-----------------+-----------------+----------------+--------------------------\n");
+	session_foreach_info(session_list_info, &print);
+	dcb_printf(dcb, "-----------------+-----------------+----------------+--------------------------\n\n");
+	diag_range_more(dcb, range);
 }
 
 /**
@@ -630,6 +817,12 @@ SESSION* get_session_by_router_ses(
  * this head becomes the destination for the filter. The newly created
  * filter becomes the new head of the filter chain.
  *
+ * A filter session that has no interest in any request is left out of the
+ * chain. In front of a filter session that is only interested in some of
+ * the requests the head is session_filter_route, which passes each request
+ * to the first filter that wants it. The filters array has an extra entry
+ * after the filters for the router, that has an interest in everything.
+ *
  * @param	session		The session that requires the chain
  * @return	0 if filter creation fails
  */
@@ -641,8 +834,8 @@ DOWNSTREAM 	*head;
 UPSTREAM	*tail;
 int		i;
 
-	if ((session->filters = calloc(service->n_filters,
-				sizeof(SESSION_FILTER))) == NULL)
+	if ((session->filters = session_arena_alloc(session,
+			(service->n_filters + 1) * sizeof(SESSION_FILTER))) == NULL)
 	{
                 LOGIF(LE, (skygw_log_write_flush(
 			LOGFILE_ERROR,
@@ -651,6 +844,8 @@ int		i;
 			return 0;
 	}
 	session->n_filters = service->n_filters;
+	session->filters[service->n_filters].interest = FILTER_INTEREST_ALL;
+	session->filters[service->n_filters].entry = session->head;
 	for (i = service->n_filters - 1; i >= 0; i--)
 	{
 		if ((head = filterApply(service->filters[i], session,
@@ -666,11 +861,30 @@ int		i;
 		session->filters[i].filter = service->filters[i];
 		session->filters[i].session = head->session;
 		session->filters[i].instance = head->instance;
-		session->head = *head;
+		session->filters[i].entry = *head;
+		if (service->filters[i]->obj->getInterest)
+			session->filters[i].interest =
+				service->filters[i]->obj->getInterest(
+					head->instance, head->session);
+		else
+			session->filters[i].interest = FILTER_INTEREST_ALL;
+
+		if (session->filters[i].interest == FILTER_INTEREST_ALL)
+			session->head = *head;
+		else if (session->filters[i].interest != 0)
+		{
+			session->head.instance = session;
+			session->head.session = &session->filters[i];
+			session->head.routeQuery = session_filter_route;
+			session->head.routeBatch =
+				head->routeBatch ? session_filter_batch : NULL;
+		}
 	}
 
 	for (i = 0; i < service->n_filters; i++)
 	{
+		if (session->filters[i].interest == 0)
+			continue;
 		if ((tail = filterUpstream(service->filters[i],
 				session->filters[i].session,
 						&session->tail)) == NULL)
@@ -688,6 +902,200 @@ int		i;
 	return 1;
 }
 
+/**
+ * The element of the downstream chain in front of a filter that is only
+ * interested in some requests. The request goes to the first filter, or
+ * the router, that wants it.
+ *
+ * @param	instance	The session
+ * @param	fsession	The filter the request would get to
+ * @param	queue		The request
+ */
+static int
+session_filter_route(void *instance, void *fsession, GWBUF *queue)
+{
+SESSION_FILTER	*filter = (SESSION_FILTER *)fsession;
+int		mask = filter_classify(queue);
+
+	while ((filter->interest & mask) == 0)
+		filter++;
+	return filter->entry.routeQuery(filter->entry.instance,
+			filter->entry.session, queue);
+}
+
+/**
+ * The routeBatch of session_filter_route. A batch is not split, it goes to
+ * the filter whatever its interest.
+ *
+ * @param	instance	The session
+ * @param	fsession	The filter the batch is for
+ * @param	queue		The batch
+ */
+static int
+session_filter_batch(void *instance, void *fsession, GWBUF *queue)
+{
+SESSION_FILTER	*filter = (SESSION_FILTER *)fsession;
+
+	return filter->entry.routeBatch(filter->entry.instance,
+			filter->entry.session, queue);
+}
+
+/**
+ * The entry point of the router when the service traces its requests, it
+ * stamps a traced request as it gets past the filters.
+ *
+ * @param	instance	The session
+ * @param	session		The session
+ * @param	queue		The request
+ */
+static int
+session_trace_route(void *instance, void *session, GWBUF *queue)
+{
+SESSION	*the_session = (SESSION *)session;
+SERVICE	*service = the_session->service;
+
+	SESSION_TRACE_STAMP(the_session, SESSION_TRACE_ROUTED, 0);
+	return service->router->routeQuery(service->router_instance,
+				the_session->router_session, queue);
+}
+
+/**
+ * The routeBatch of session_trace_route
+ *
+ * @param	instance	The session
+ * @param	session		The session
+ * @param	queue		The batch
+ */
+static int
+session_trace_batch(void *instance, void *session, GWBUF *queue)
+{
+SESSION	*the_session = (SESSION *)session;
+SERVICE	*service = the_session->service;
+
+	SESSION_TRACE_STAMP(the_session, SESSION_TRACE_ROUTED, 0);
+	return service->router->routeBatch(service->router_instance,
+				the_session->router_session, queue);
+}
+
+/**
+ * Return the clock the stages of the traced requests are stamped with
+ *
+ * @return	Microseconds of the monotonic clock
+ */
+unsigned long
+session_trace_clock()
+{
+struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Start the trace of a request read from the client, if it is one of the
+ * requests the service samples and the session is not tracing another one.
+ * The requests are counted by thread, so no counter is shared.
+ *
+ * @param	session		The session
+ * @param	queue		The request, the first buffer holds the
+ *				packet header and the command
+ */
+void
+session_trace_start(SESSION *session, GWBUF *queue)
+{
+static __thread unsigned int	count = 0;
+SESSION_TRACE			*trace = &session->trace;
+unsigned char			*data;
+int				len, i;
+
+	if (trace->active || ++count % session->service->trace_sample)
+		return;
+	memset(trace, 0, sizeof(SESSION_TRACE));
+	data = (unsigned char *)GWBUF_DATA(queue);
+	len = GWBUF_LENGTH(queue);
+	if (len > 4)
+		trace->command = data[4];
+	if (trace->command == 0x03)	/*< COM_QUERY */
+	{
+		for (i = 0; i < len - 5 && i < SESSION_TRACE_SQLLEN; i++)
+			trace->sql[i] = isprint(data[5 + i]) ? data[5 + i] : ' ';
+		trace->sql[i] = '\0';
+	}
+	trace->stamps[SESSION_TRACE_READ] = session_trace_clock();
+	trace->active = 1;
+}
+
+/**
+ * Write the time spent in each stage of a traced request to the trace log,
+ * a stage that was not stamped is left out
+ *
+ * @param	session		The session
+ */
+static void
+session_trace_end(SESSION *session)
+{
+static char	*spans[] = { "filters", "router", "backend", "reply",
+				"client write" };
+SESSION_TRACE	*trace = &session->trace;
+char		buf[256];
+int		i, n = 0, from = SESSION_TRACE_READ;
+
+	buf[0] = '\0';
+	for (i = SESSION_TRACE_ROUTED; i < SESSION_TRACE_STAGES; i++)
+	{
+		if (trace->stamps[i] == 0)
+			continue;
+		n += snprintf(buf + n, sizeof(buf) - n, "%s%s %luus",
+				n ? ", " : "", spans[i - 1],
+				trace->stamps[i] - trace->stamps[from]);
+		if (n >= sizeof(buf))
+			break;
+		from = i;
+	}
+	LOGIF(LT, (skygw_log_write(
+		LOGFILE_TRACE,
+		"Trace: service %s session %p command 0x%02x%s%s%s: %s, total %luus",
+		session->service->name,
+		session,
+		trace->command,
+		*trace->sql ? " \"" : "",
+		trace->sql,
+		*trace->sql ? "\"" : "",
+		buf,
+		trace->stamps[SESSION_TRACE_WRITTEN] -
+				trace->stamps[SESSION_TRACE_READ])));
+}
+
+/**
+ * Stamp a stage of the traced request of a session. Only the first time a
+ * stage is reached is stamped, the stages of the reply only once the request
+ * was written to a backend. The trace ends once the end of the reply is
+ * written to the client. The stamps are plain stores, a trace is a sample
+ * and the threads of the client and of the backends do not lock for it.
+ *
+ * @param	session		The session
+ * @param	stage		The stage, SESSION_TRACE_READ to _WRITTEN
+ * @param	usecs		The time of session_trace_clock, 0 for now
+ */
+void
+session_trace_stamp(SESSION *session, int stage, unsigned long usecs)
+{
+SESSION_TRACE	*trace = &session->trace;
+
+	if (!trace->active || trace->stamps[stage] != 0)
+		return;
+	if (stage > SESSION_TRACE_SENT && trace->stamps[SESSION_TRACE_SENT] == 0)
+		return;
+	if (stage == SESSION_TRACE_WRITTEN && trace->stamps[SESSION_TRACE_LAST] == 0)
+		return;
+	trace->stamps[stage] = usecs ? usecs : session_trace_clock();
+	if (stage == SESSION_TRACE_WRITTEN)
+	{
+		session_trace_end(session);
+		trace->active = 0;
+	}
+}
+
 /**
  * Entry point for the final element int he upstream filter, i.e. the writing
  * of the data to the client.
@@ -700,8 +1108,11 @@ int
 session_reply(void *instance, void *session, GWBUF *data)
 {
 SESSION		*the_session = (SESSION *)session;
+int		rval;
 
-	return the_session->client->func.write(the_session->client, data);
+	rval = the_session->client->func.write(the_session->client, data);
+	SESSION_TRACE_STAMP(the_session, SESSION_TRACE_WRITTEN, 0);
+	return rval;
 }
 
 /**
@@ -756,3 +1167,182 @@ session_getUser(SESSION *session)
 {
 	return (session && session->client) ? session->client->user : NULL;
 }
+
+/**
+ * Allocate memory that lives as long as the session, for the router and
+ * filter sessions and the other objects that are only freed with the
+ * session. The memory is zeroed and aligned for any type. It is released
+ * all at once after the freeSession entry points of the router and the
+ * filters have been called and must not be freed by the caller.
+ *
+ * @param session	The session
+ * @param size		The number of bytes
+ * @return		The memory or NULL if it could not be allocated
+ */
+void *
+session_arena_alloc(SESSION *session, size_t size)
+{
+SESSION_ARENA	*arena = &session->arena;
+size_t		chunk;
+void		**block;
+char		*ptr;
+
+	size = SESSION_ARENA_ALIGN(size);
+	spinlock_acquire(&arena->lock);
+	if (size > (size_t)(arena->end - arena->next))
+	{
+		/*< A large allocation gets a chunk of its own */
+		chunk = size > SESSION_ARENA_CHUNK / 4 ?
+			size : SESSION_ARENA_CHUNK - SESSION_ARENA_ALIGN(sizeof(void *));
+		if ((block = (void **)malloc(SESSION_ARENA_ALIGN(sizeof(void *)) +
+						chunk)) == NULL)
+		{
+			spinlock_release(&arena->lock);
+			return NULL;
+		}
+		*block = arena->chunks;
+		arena->chunks = block;
+		arena->n_chunks++;
+		ptr = (char *)block + SESSION_ARENA_ALIGN(sizeof(void *));
+		if (chunk > size)
+		{
+			/*< The rest of the current chunk is left unused */
+			arena->next = ptr + size;
+			arena->end = ptr + chunk;
+		}
+	}
+	else
+	{
+		ptr = arena->next;
+		arena->next += size;
+	}
+	arena->used += size;
+	spinlock_release(&arena->lock);
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+/**
+ * Copy a string into the arena of a session
+ *
+ * @param session	The session
+ * @param str		The string
+ * @return		The copy or NULL if it could not be allocated
+ */
+char *
+session_arena_strdup(SESSION *session, const char *str)
+{
+size_t	len = strlen(str) + 1;
+char	*copy;
+
+	if ((copy = (char *)session_arena_alloc(session, len)) != NULL)
+		memcpy(copy, str, len);
+	return copy;
+}
+
+/**
+ * Free the chunks of the arena of a session, the first part of the arena
+ * is freed with the session
+ *
+ * @param session	The session
+ */
+static void
+session_arena_free(SESSION *session)
+{
+void	**block, **next;
+
+	for (block = session->arena.chunks; block; block = next)
+	{
+		next = (void **)*block;
+		free(block);
+	}
+	session->arena.chunks = NULL;
+}
+
+/**
+ * Account the bytes buffered for a session, in the write and delay queues
+ * of its DCBs and in the state its router keeps, the bytes are added to
+ * the total of the service too
+ *
+ * @param session	The session or NULL
+ * @param bytes		The bytes buffered, negative when they are released
+ */
+void
+session_mem_add(SESSION *session, int bytes)
+{
+	if (session == NULL || bytes == 0)
+		return;
+	atomic_add(&session->mem_used, bytes);
+	ts_stats_add(session->service->stats.counters, SERVICE_N_MEMORY, bytes);
+}
+
+/**
+ * Check the soft memory limit of the service of a session, the reads for
+ * a session above the limit are paused while its client drains
+ *
+ * @param session	The session or NULL
+ * @return		Non-zero if the session is above its soft limit
+ */
+int
+session_mem_above_soft(SESSION *session)
+{
+	if (session == NULL || session->service->mem_soft_limit == 0)
+		return 0;
+	return session->mem_used > session->service->mem_soft_limit;
+}
+
+/**
+ * Check the hard memory limit of the service of a session before more
+ * bytes are buffered for it. A session that would go over the limit is
+ * closed: the socket of its client is shut down, so the polling thread
+ * of the client sees the connection fail and closes the session the way
+ * it closes any other.
+ *
+ * @param session	The session or NULL
+ * @param bytes		The bytes that are about to be buffered
+ * @return		Non-zero if the bytes must not be buffered
+ */
+int
+session_mem_exceeded(SESSION *session, int bytes)
+{
+	if (session == NULL || session->service->mem_hard_limit == 0 ||
+		session->mem_used + bytes <= session->service->mem_hard_limit)
+	{
+		return 0;
+	}
+	if (session_evict(session))
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : Session %p of service '%s' has %d bytes "
+			"buffered, more than the session_mem_hard_limit %d. "
+			"The session is closed.",
+			session,
+			session->service->name,
+			session->mem_used + bytes,
+			session->service->mem_hard_limit)));
+	}
+	return 1;
+}
+
+/**
+ * Close a session for the data it has buffered. The socket of the client
+ * is shut down, so the polling thread of the client sees the connection
+ * fail and closes the session the way it closes any other, the backends
+ * of the session go back to the persistent pool of their servers through
+ * the normal close. Only the first call for a session does anything, it
+ * counts the session in the service and the caller logs why it is closed.
+ *
+ * @param session	The session
+ * @return		Non-zero if this call closes the session
+ */
+int
+session_evict(SESSION *session)
+{
+	if (atomic_add(&session->evicted, 1) != 0)
+		return 0;
+	ts_stats_add(session->service->stats.counters, SERVICE_N_EVICTED, 1);
+	if (session->client != NULL && session->client->fd >= 0)
+		shutdown(session->client->fd, SHUT_RDWR);
+	return 1;
+}
@@ -0,0 +1,463 @@
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file slab.c  - Per polling thread, size classed memory pools
+ *
+ * Every block handed out by slab_alloc is preceded by a small header that
+ * records the thread cache that owns the block and the size class it
+ * belongs to. The owner is NULL for blocks that came straight from malloc,
+ * either because the size was too large or because the allocating thread
+ * has no cache.
+ *
+ * The free list of each size class is only ever manipulated by the owning
+ * thread, so no locking is required on the fast path. Blocks freed by other
+ * threads are pushed onto a per class "remote" list with a compare and swap.
+ * The owner takes the whole remote list in a single atomic exchange when the
+ * local free list is empty, so there is no ABA problem to care about.
+ *
+ * With huge pages a cache that misses carves the block from the region it
+ * has mapped, a new region is mapped once the current one is used up. The
+ * explicit huge pages of MAP_HUGETLB need pages reserved by the system, when
+ * there are none the regions are mapped with normal pages and the kernel
+ * asked to back them with transparent huge pages. A block of a region is
+ * kept on the free list of its class even when the list is over its limit,
+ * the regions are never unmapped.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <slab.h>
+#include <spinlock.h>
+#include <atomic.h>
+#include <dcb.h>
+#include <skygw_debug.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+extern int lm_enabled_logfiles_bitmask;
+
+/**
+ * The header placed in front of every block. The union keeps the user data
+ * aligned for any type.
+ */
+typedef union slab_block {
+	struct {
+		struct slab_cache	*owner;	/*< Owning cache or NULL */
+		int			sclass;	/*< Size class index */
+		int			region;	/*< Carved from a region, never freed */
+		union slab_block	*next;	/*< Free list link */
+		size_t			size;	/*< Size of a block outside the classes */
+	} hdr;
+	long double	align;			/*< Alignment only */
+} SLAB_BLOCK;
+
+/**
+ * A single size class of a thread cache
+ */
+typedef struct {
+	SLAB_BLOCK		*freelist;	/*< Blocks owned by this thread */
+	SLAB_BLOCK * volatile	remote;		/*< Blocks freed by other threads */
+	int			limit;		/*< Maximum length of the free list */
+	SLAB_STATS		stats;		/*< Statistics for the class */
+} SLAB_CLASS;
+
+/**
+ * The cache of one polling thread
+ */
+typedef struct slab_cache {
+	int			thread_id;	/*< Polling thread that owns the cache */
+	SLAB_CLASS		classes[SLAB_NCLASSES];
+	char			*region_next;	/*< Next free byte of the region */
+	char			*region_end;	/*< End of the region */
+	struct slab_cache	*next;		/*< All caches, for diagnostics */
+} SLAB_CACHE;
+
+static __thread SLAB_CACHE	*thread_cache = NULL;
+static SLAB_CACHE		*allCaches = NULL;
+static SPINLOCK			cachespin = SPINLOCK_INIT;
+static int			n_unpooled = 0;	/*< Allocations bypassing the caches */
+static int			huge_pages = SLAB_HUGE_OFF;
+static struct {
+	int	n_hugetlb;	/*< Regions of explicit huge pages */
+	int	n_transparent;	/*< Regions advised for transparent huge pages */
+	int	n_small;	/*< Regions left with normal pages */
+	int	n_failed;	/*< Regions that could not be mapped */
+} regionStats;
+
+#define	SLAB_HDR(ptr)		(((SLAB_BLOCK *)(ptr)) - 1)
+#define	SLAB_DATA(blk)		((void *)((blk) + 1))
+#define	SLAB_CLASS_SIZE(c)	(1 << (SLAB_MIN_SHIFT + (c)))
+
+/**
+ * Find the smallest size class that can hold size bytes
+ *
+ * @param size	The requested size
+ * @return	The class index or -1 if the size is too large
+ */
+static int
+slab_class(size_t size)
+{
+int	c = 0;
+
+	if (size > SLAB_MAX_SIZE)
+		return -1;
+	while (SLAB_CLASS_SIZE(c) < size)
+		c++;
+	return c;
+}
+
+/**
+ * Set the backing of the blocks the thread caches take from now on, the
+ * blocks already cached are kept
+ *
+ * @param mode	SLAB_HUGE_OFF, SLAB_HUGE_ON or SLAB_HUGE_TRANSPARENT
+ */
+void
+slab_set_huge_pages(int mode)
+{
+	huge_pages = mode;
+}
+
+/**
+ * Map a region for the blocks of a thread cache. Without MAP_HUGETLB pages
+ * twice the size are mapped and trimmed to a region aligned on its size,
+ * the kernel can only back an aligned range with a transparent huge page.
+ *
+ * @return	The region or NULL if it could not be mapped
+ */
+static char *
+slab_region_map()
+{
+char		*ptr, *region;
+uintptr_t	aligned;
+
+#if defined(MAP_HUGETLB)
+	if (huge_pages == SLAB_HUGE_ON)
+	{
+		ptr = mmap(NULL, SLAB_REGION_SIZE, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+		if (ptr != MAP_FAILED)
+		{
+			atomic_add(&regionStats.n_hugetlb, 1);
+			return ptr;
+		}
+		/*< No huge pages reserved, do not ask for them again */
+		huge_pages = SLAB_HUGE_TRANSPARENT;
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : No explicit huge pages for the buffer pools, "
+			"mmap with MAP_HUGETLB failed due %d, %s. The pools use "
+			"transparent huge pages where the kernel has them.",
+			errno,
+			strerror(errno))));
+	}
+#endif
+	ptr = mmap(NULL, 2 * SLAB_REGION_SIZE, PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED)
+	{
+		atomic_add(&regionStats.n_failed, 1);
+		return NULL;
+	}
+	aligned = ((uintptr_t)ptr + SLAB_REGION_SIZE - 1) &
+				~((uintptr_t)SLAB_REGION_SIZE - 1);
+	region = (char *)aligned;
+	if (region > ptr)
+		munmap(ptr, region - ptr);
+	munmap(region + SLAB_REGION_SIZE, ptr + SLAB_REGION_SIZE - region);
+#if defined(MADV_HUGEPAGE)
+	if (madvise(region, SLAB_REGION_SIZE, MADV_HUGEPAGE) == 0)
+	{
+		atomic_add(&regionStats.n_transparent, 1);
+		return region;
+	}
+#endif
+	atomic_add(&regionStats.n_small, 1);
+	return region;
+}
+
+/**
+ * Carve a block from the region of a thread cache, the rest of a region
+ * too small for the block is left unused
+ *
+ * @param cache	The cache of the calling thread
+ * @param size	The size of the block with its header
+ * @return	The block or NULL if no region could be mapped
+ */
+static SLAB_BLOCK *
+slab_region_alloc(SLAB_CACHE *cache, size_t size)
+{
+SLAB_BLOCK	*blk;
+
+	if (cache->region_next == NULL ||
+		(size_t)(cache->region_end - cache->region_next) < size)
+	{
+		char	*region;
+
+		if ((region = slab_region_map()) == NULL)
+			return NULL;
+		cache->region_next = region;
+		cache->region_end = region + SLAB_REGION_SIZE;
+	}
+	blk = (SLAB_BLOCK *)cache->region_next;
+	cache->region_next += size;
+	blk->hdr.region = 1;
+	return blk;
+}
+
+/**
+ * Create the cache for the calling polling thread. Calling this more than
+ * once from the same thread has no effect.
+ *
+ * @param thread_id	The polling thread id, used in the diagnostics only
+ */
+void
+slab_thread_init(int thread_id)
+{
+SLAB_CACHE	*cache;
+int		c;
+
+	if (thread_cache != NULL)
+		return;
+	if ((cache = (SLAB_CACHE *)calloc(1, sizeof(SLAB_CACHE))) == NULL)
+		return;
+	cache->thread_id = thread_id;
+	for (c = 0; c < SLAB_NCLASSES; c++)
+	{
+		cache->classes[c].limit = SLAB_CACHE_BYTES / SLAB_CLASS_SIZE(c);
+		if (cache->classes[c].limit < SLAB_CACHE_MIN)
+			cache->classes[c].limit = SLAB_CACHE_MIN;
+	}
+	/*< Caches are never freed, the threads live until shutdown */
+	spinlock_acquire(&cachespin);
+	cache->next = allCaches;
+	allCaches = cache;
+	spinlock_release(&cachespin);
+	thread_cache = cache;
+}
+
+/**
+ * Allocate a block of at least size bytes
+ *
+ * @param size	The number of bytes required
+ * @return	Pointer to the memory or NULL if the allocation failed
+ */
+void *
+slab_alloc(size_t size)
+{
+SLAB_CACHE	*cache = thread_cache;
+SLAB_CLASS	*sc;
+SLAB_BLOCK	*blk;
+int		c;
+
+	if (cache == NULL || (c = slab_class(size)) == -1)
+	{
+		if ((blk = (SLAB_BLOCK *)malloc(sizeof(SLAB_BLOCK) + size)) == NULL)
+			return NULL;
+		atomic_add(&n_unpooled, 1);
+		blk->hdr.owner = NULL;
+		blk->hdr.sclass = -1;
+		blk->hdr.size = size;
+		blk->hdr.region = 0;
+		return SLAB_DATA(blk);
+	}
+	sc = &cache->classes[c];
+
+	if (sc->freelist == NULL && sc->remote != NULL)
+	{
+		/*< Collect everything other threads have freed on our behalf */
+		sc->freelist = (SLAB_BLOCK *)__sync_lock_test_and_set(&sc->remote,
+								NULL);
+		for (blk = sc->freelist; blk; blk = blk->hdr.next)
+			sc->stats.n_cached++;
+	}
+
+	if ((blk = sc->freelist) != NULL)
+	{
+		sc->freelist = blk->hdr.next;
+		sc->stats.n_cached--;
+		sc->stats.n_hits++;
+	}
+	else
+	{
+		blk = NULL;
+		if (huge_pages != SLAB_HUGE_OFF)
+			blk = slab_region_alloc(cache,
+					sizeof(SLAB_BLOCK) + SLAB_CLASS_SIZE(c));
+		if (blk == NULL)
+		{
+			blk = (SLAB_BLOCK *)malloc(sizeof(SLAB_BLOCK) +
+						SLAB_CLASS_SIZE(c));
+			if (blk == NULL)
+				return NULL;
+			blk->hdr.region = 0;
+		}
+		sc->stats.n_misses++;
+		blk->hdr.owner = cache;
+		blk->hdr.sclass = c;
+	}
+	blk->hdr.next = NULL;
+	return SLAB_DATA(blk);
+}
+
+/**
+ * Free a block allocated by slab_alloc. May be called from any thread.
+ *
+ * @param ptr	The block to free, NULL is ignored
+ */
+void
+slab_free(void *ptr)
+{
+SLAB_BLOCK	*blk;
+SLAB_CLASS	*sc;
+SLAB_BLOCK	*head;
+
+	if (ptr == NULL)
+		return;
+	blk = SLAB_HDR(ptr);
+
+	if (blk->hdr.owner == NULL)
+	{
+		free(blk);
+		return;
+	}
+	ss_dassert(blk->hdr.sclass >= 0 && blk->hdr.sclass < SLAB_NCLASSES);
+	sc = &blk->hdr.owner->classes[blk->hdr.sclass];
+
+	if (blk->hdr.owner == thread_cache)
+	{
+		if (sc->stats.n_cached >= sc->limit && !blk->hdr.region)
+		{
+			sc->stats.n_released++;
+			free(blk);
+			return;
+		}
+		blk->hdr.next = sc->freelist;
+		sc->freelist = blk;
+		sc->stats.n_cached++;
+	}
+	else
+	{
+		/*< Cross thread free, hand the block back to the owner */
+		do {
+			head = sc->remote;
+			blk->hdr.next = head;
+		} while (!__sync_bool_compare_and_swap(&sc->remote, head, blk));
+		atomic_add(&sc->stats.n_remote, 1);
+	}
+}
+
+/**
+ * Return the number of bytes that may be used in a block, this is the size
+ * of its class and may be more than was asked of slab_alloc.
+ *
+ * @param ptr	The block
+ * @return	The usable size of the block
+ */
+size_t
+slab_size(void *ptr)
+{
+SLAB_BLOCK	*blk = SLAB_HDR(ptr);
+
+	if (blk->hdr.sclass == -1)
+		return blk->hdr.size;
+	return SLAB_CLASS_SIZE(blk->hdr.sclass);
+}
+
+/**
+ * Return the statistics of a size class. Passing -1 as the thread id sums
+ * over all thread caches and passing -1 as the class sums over all classes.
+ *
+ * @param thread_id	The polling thread or -1
+ * @param sclass	The size class or -1
+ * @param stats		The statistics to fill in
+ */
+void
+slab_get_stats(int thread_id, int sclass, SLAB_STATS *stats)
+{
+SLAB_CACHE	*cache;
+int		c;
+
+	memset(stats, 0, sizeof(SLAB_STATS));
+	spinlock_acquire(&cachespin);
+	for (cache = allCaches; cache; cache = cache->next)
+	{
+		if (thread_id != -1 && cache->thread_id != thread_id)
+			continue;
+		for (c = 0; c < SLAB_NCLASSES; c++)
+		{
+			SLAB_STATS *s = &cache->classes[c].stats;
+
+			if (sclass != -1 && c != sclass)
+				continue;
+			stats->n_hits += s->n_hits;
+			stats->n_misses += s->n_misses;
+			stats->n_remote += s->n_remote;
+			stats->n_released += s->n_released;
+			stats->n_cached += s->n_cached;
+		}
+	}
+	spinlock_release(&cachespin);
+}
+
+/**
+ * Debug routine to print the slab allocator statistics
+ *
+ * @param dcb	DCB to print to
+ */
+void
+dprintSlabStats(DCB *dcb)
+{
+SLAB_CACHE	*cache;
+int		c;
+
+	dcb_printf(dcb, "Allocations bypassing the pools:	%d\n", n_unpooled);
+	if (regionStats.n_hugetlb || regionStats.n_transparent ||
+		regionStats.n_small || regionStats.n_failed)
+	{
+		dcb_printf(dcb, "Regions of huge pages:			%d\n",
+					regionStats.n_hugetlb);
+		dcb_printf(dcb, "Regions of transparent huge pages:	%d\n",
+					regionStats.n_transparent);
+		dcb_printf(dcb, "Regions of normal pages:		%d\n",
+					regionStats.n_small);
+		dcb_printf(dcb, "Regions that could not be mapped:	%d\n",
+					regionStats.n_failed);
+	}
+	dcb_printf(dcb, "Thread | Class  | Hits       | Misses     | Remote     | Released   | Cached\n");
+	dcb_printf(dcb, "-------+--------+------------+------------+------------+------------+-------\n");
+	spinlock_acquire(&cachespin);
+	for (cache = allCaches; cache; cache = cache->next)
+	{
+		for (c = 0; c < SLAB_NCLASSES; c++)
+		{
+			SLAB_STATS *s = &cache->classes[c].stats;
+
+			if (s->n_hits == 0 && s->n_misses == 0 && s->n_remote == 0)
+				continue;
+			dcb_printf(dcb, " %5d | %6d | %10d | %10d | %10d | %10d | %d\n",
+				cache->thread_id, SLAB_CLASS_SIZE(c),
+				s->n_hits, s->n_misses, s->n_remote,
+				s->n_released, s->n_cached);
+		}
+	}
+	spinlock_release(&cachespin);
+}
@@ -28,8 +28,63 @@
  * @endverbatim
  */
 
+#if SPINLOCK_PROFILE
+/** for dladdr */
+#define _GNU_SOURCE
+#endif
+#include <sched.h>
 #include <spinlock.h>
 #include <atomic.h>
+#include <dcb.h>
+#if SPINLOCK_PROFILE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dlfcn.h>
+#endif
+
+/**
+ * The pause between two looks at a busy lock, the pause instruction tells
+ * the processor that this is a spin loop. Both forms are also compiler
+ * barriers, so that the lock is read again after each pause.
+ */
+#if defined(__i386__) || defined(__x86_64__)
+#define	SPINLOCK_PAUSE()	__asm__ __volatile__("pause" ::: "memory")
+#else
+#define	SPINLOCK_PAUSE()	__asm__ __volatile__("" ::: "memory")
+#endif
+
+#define	SPINLOCK_BACKOFF_MIN	4	/*< First backoff of a test and set lock */
+#define	SPINLOCK_BACKOFF_MAX	1024	/*< Largest backoff of a test and set lock */
+#define	SPINLOCK_TICKET_BACKOFF	32	/*< Ticket lock backoff per waiter ahead */
+#define	SPINLOCK_TICKET_AHEAD	64	/*< Waiters ahead counted for the backoff */
+#define	SPINLOCK_YIELD_SPINS	10	/*< Rounds before a waiter yields the CPU */
+
+#if SPINLOCK_PROFILE
+#define	SPINLOCK_N_SITES	256	/*< Sites recorded, the others share one */
+
+static	SPINLOCK_SITE	sites[SPINLOCK_N_SITES + 1];
+static	void		spinlock_profile_acquired(SPINLOCK *lock, void *caller, int spins);
+static	void		spinlock_profile_release(SPINLOCK *lock);
+#endif
+
+/**
+ * Pause for a number of rounds. A thread that has waited for a long time
+ * also yields the processor, the holder, or with a ticket lock the next
+ * thread in line, may be waiting for it.
+ *
+ * @param n	The number of pause instructions
+ * @param spins	The rounds the thread has already waited
+ */
+static void
+spinlock_backoff(int n, int spins)
+{
+	if (spins > SPINLOCK_YIELD_SPINS)
+		sched_yield();
+	while (n-- > 0)
+		SPINLOCK_PAUSE();
+}
 
 /**
  * Initialise a spinlock.
@@ -44,27 +99,58 @@ spinlock_init(SPINLOCK *lock)
 	lock->spins = 0;
 	lock->acquired = 0;
 #endif
+#if SPINLOCK_TICKET
+	lock->serving = 0;
+#endif
 }
 
 /**
  * Acquire a spinlock.
  *
+ * The test and set lock only retries the atomic operation once the lock has
+ * been seen free, the pause between two looks doubles up to a limit, so that
+ * the waiting threads do not keep the cache line of the lock bouncing
+ * between the processors. The ticket lock waits for its turn instead, with
+ * a pause that grows with the number of threads ahead of it.
+ *
  * @param lock The spinlock to acquire
  */
 void
 spinlock_acquire(SPINLOCK *lock)
 {
+int		spins = 0;
+#if SPINLOCK_TICKET
+unsigned int	ticket = atomic_add(&(lock->lock), 1), ahead;
+
+	while ((ahead = ticket - (unsigned int)lock->serving) != 0)
+	{
+		if (ahead > SPINLOCK_TICKET_AHEAD)
+			ahead = SPINLOCK_TICKET_AHEAD;
+		spinlock_backoff(ahead * SPINLOCK_TICKET_BACKOFF, spins);
+		spins++;
+	}
+#else
+int		backoff = SPINLOCK_BACKOFF_MIN;
+
 	while (atomic_add(&(lock->lock), 1) != 0)
 	{
 		atomic_add(&(lock->lock), -1);
-#ifdef DEBUG
-		atomic_add(&(lock->spins), 1);
-#endif
+		do {
+			spinlock_backoff(backoff, spins);
+			if (backoff < SPINLOCK_BACKOFF_MAX)
+				backoff *= 2;
+			spins++;
+		} while (lock->lock != 0);
 	}
+#endif
 #ifdef DEBUG
+	lock->spins += spins;
 	lock->acquired++;
 	lock->owner = THREAD_SHELF();
 #endif
+#if SPINLOCK_PROFILE
+	spinlock_profile_acquired(lock, __builtin_return_address(0), spins);
+#endif
 }
 
 /**
@@ -76,14 +162,25 @@ spinlock_acquire(SPINLOCK *lock)
 int
 spinlock_acquire_nowait(SPINLOCK *lock)
 {
+#if SPINLOCK_TICKET
+int	serving = lock->serving;
+
+	/*< Only take a ticket if it is the one being served */
+	if (!__sync_bool_compare_and_swap(&(lock->lock), serving, serving + 1))
+		return FALSE;
+#else
 	if (atomic_add(&(lock->lock), 1) != 0)
 	{
 		atomic_add(&(lock->lock), -1);
 		return FALSE;
 	}
+#endif
 #ifdef DEBUG
 	lock->acquired++;
 	lock->owner = THREAD_SHELF();
+#endif
+#if SPINLOCK_PROFILE
+	spinlock_profile_acquired(lock, __builtin_return_address(0), 0);
 #endif
 	return TRUE;
 }
@@ -96,5 +193,155 @@ spinlock_acquire_nowait(SPINLOCK *lock)
 void
 spinlock_release(SPINLOCK *lock)
 {
+#if SPINLOCK_PROFILE
+	spinlock_profile_release(lock);
+#endif
+#if SPINLOCK_TICKET
+	atomic_add(&(lock->serving), 1);
+#else
 	atomic_add(&(lock->lock), -1);
+#endif
+}
+
+#if SPINLOCK_PROFILE
+/**
+ * Return the current time in nanoseconds
+ */
+static unsigned long
+spinlock_now()
+{
+struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/**
+ * Find or add the profile of an acquisition site. The sites are never
+ * removed, so that a site outlives the locks it has seen, many of which are
+ * part of DCBs and sessions that come and go.
+ *
+ * @param caller	The return address of the acquire
+ * @return		The index of the site
+ */
+static int
+spinlock_site(void *caller)
+{
+unsigned int	i = ((unsigned long)caller >> 2) % SPINLOCK_N_SITES;
+int		n;
+
+	for (n = 0; n < SPINLOCK_N_SITES; n++)
+	{
+		if (sites[i].caller == caller)
+			return i;
+		if (sites[i].caller == NULL &&
+			(__sync_bool_compare_and_swap(&sites[i].caller, NULL, caller)
+				|| sites[i].caller == caller))
+			return i;
+		i = (i + 1) % SPINLOCK_N_SITES;
+	}
+	return SPINLOCK_N_SITES;
+}
+
+/**
+ * Record an acquisition, called with the lock held
+ *
+ * @param lock		The lock
+ * @param caller	The return address of the acquire
+ * @param spins		The backoff rounds spent waiting
+ */
+static void
+spinlock_profile_acquired(SPINLOCK *lock, void *caller, int spins)
+{
+SPINLOCK_SITE	*site;
+
+	lock->site = spinlock_site(caller);
+	site = &sites[lock->site];
+	__sync_fetch_and_add(&site->acquired, 1);
+	if (spins)
+	{
+		__sync_fetch_and_add(&site->contended, 1);
+		__sync_fetch_and_add(&site->spins, spins);
+	}
+	lock->locked_at = spinlock_now();
+}
+
+/**
+ * Record the hold time of a lock that is about to be released
+ *
+ * @param lock		The lock
+ */
+static void
+spinlock_profile_release(SPINLOCK *lock)
+{
+SPINLOCK_SITE	*site = &sites[lock->site];
+unsigned long	hold = spinlock_now() - lock->locked_at, max;
+
+	__sync_fetch_and_add(&site->total_hold, hold);
+	while ((max = site->max_hold) < hold &&
+			!__sync_bool_compare_and_swap(&site->max_hold, max, hold))
+		;
+}
+
+/**
+ * Order sites by the time spent waiting for them
+ */
+static int
+spinlock_site_cmp(const void *a, const void *b)
+{
+const SPINLOCK_SITE	*s1 = *(const SPINLOCK_SITE **)a;
+const SPINLOCK_SITE	*s2 = *(const SPINLOCK_SITE **)b;
+
+	if (s1->spins != s2->spins)
+		return s1->spins < s2->spins ? 1 : -1;
+	return s1->acquired < s2->acquired ? 1 : (s1->acquired > s2->acquired ? -1 : 0);
+}
+#endif
+
+/**
+ * Print the spinlock profile to a DCB, the sites with the most time spent
+ * waiting first.
+ *
+ * @param dcb	The DCB to print to
+ */
+void
+dprintSpinlocks(DCB *dcb)
+{
+#if SPINLOCK_PROFILE
+SPINLOCK_SITE	*list[SPINLOCK_N_SITES + 1];
+Dl_info		info;
+char		name[80];
+int		i, n = 0;
+
+	for (i = 0; i <= SPINLOCK_N_SITES; i++)
+		if (sites[i].acquired)
+			list[n++] = &sites[i];
+	qsort(list, n, sizeof(SPINLOCK_SITE *), spinlock_site_cmp);
+
+	dcb_printf(dcb, "Spinlocks by acquisition site\n\n");
+	dcb_printf(dcb, "%-40s | %10s | %10s | %10s | %10s | %10s\n",
+			"Site", "Acquired", "Contended", "Spins",
+			"Avg hold", "Max hold");
+	dcb_printf(dcb, "-----------------------------------------+------------+"
+			"------------+------------+------------+-----------\n");
+	for (i = 0; i < n; i++)
+	{
+		if (list[i]->caller == NULL)
+			strcpy(name, "Other sites");
+		else if (dladdr(list[i]->caller, &info) && info.dli_sname)
+			snprintf(name, sizeof(name), "%s+0x%lx (%p)", info.dli_sname,
+				(char *)list[i]->caller - (char *)info.dli_saddr,
+				list[i]->caller);
+		else
+			snprintf(name, sizeof(name), "%p", list[i]->caller);
+		dcb_printf(dcb, "%-40s | %10lu | %10lu | %10lu | %8luns | %8luns\n",
+			name, list[i]->acquired, list[i]->contended,
+			list[i]->spins, list[i]->total_hold / list[i]->acquired,
+			list[i]->max_hold);
+	}
+	dcb_printf(dcb, "\n");
+#else
+	dcb_printf(dcb, "Spinlock profiling is not available, rebuild with "
+			"SPINLOCK_PROFILE set in build_gateway.inc.\n");
+#endif
 }
@@ -0,0 +1,325 @@
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file statistics.c  - Per thread statistics counters
+ *
+ * The number of polling thread copies is fixed by ts_stats_init, which is
+ * called once the number of threads has been read from the configuration.
+ * Sets allocated before that only have the shared copy.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <statistics.h>
+#include <atomic.h>
+
+static	int		n_slots = 0;		/*< Polling thread copies per set */
+static	__thread int	thread_slot = -1;	/*< The copy of the calling thread */
+
+/**
+ * Set the number of polling threads, only the first call has an effect
+ *
+ * @param n_threads	The number of polling threads
+ */
+void
+ts_stats_init(int n_threads)
+{
+	if (n_slots == 0 && n_threads > 0)
+		n_slots = n_threads;
+}
+
+/**
+ * Register the calling thread as a polling thread, its updates then go to
+ * a copy of its own.
+ *
+ * @param thread_id	The polling thread id
+ */
+void
+ts_stats_thread_init(int thread_id)
+{
+	thread_slot = thread_id;
+}
+
+/**
+ * Allocate a set of counters, all the counters start at zero
+ *
+ * @param n_counters	The number of counters in the set
+ * @return		The new set or NULL if it could not be allocated
+ */
+TS_STATS *
+ts_stats_alloc(int n_counters)
+{
+TS_STATS	*stats;
+int		line = TS_STATS_CACHE_LINE / sizeof(int);
+void		*counters;
+
+	if ((stats = (TS_STATS *)malloc(sizeof(TS_STATS))) == NULL)
+		return NULL;
+	stats->n_counters = n_counters;
+	stats->n_slots = n_slots;
+	stats->stride = ((n_counters + line - 1) / line) * line;
+	if (posix_memalign(&counters, TS_STATS_CACHE_LINE,
+			(stats->n_slots + 1) * stats->stride * sizeof(int)) != 0)
+	{
+		free(stats);
+		return NULL;
+	}
+	stats->counters = (int *)counters;
+	memset(stats->counters, 0, (stats->n_slots + 1) * stats->stride * sizeof(int));
+	return stats;
+}
+
+/**
+ * Free a set of counters
+ *
+ * @param stats	The set to free, NULL is ignored
+ */
+void
+ts_stats_free(TS_STATS *stats)
+{
+	if (stats == NULL)
+		return;
+	free(stats->counters);
+	free(stats);
+}
+
+/**
+ * Add to a counter. The value may be negative for counters that track a
+ * current number of objects.
+ *
+ * @param stats		The set of counters
+ * @param counter	The counter index
+ * @param value		The value to add
+ */
+void
+ts_stats_add(TS_STATS *stats, int counter, int value)
+{
+int	slot = thread_slot;
+
+	if (slot >= 0 && slot < stats->n_slots)
+		stats->counters[slot * stats->stride + counter] += value;
+	else
+		atomic_add(&stats->counters[stats->n_slots * stats->stride + counter],
+			value);
+}
+
+/**
+ * Return the value of a counter, the sum over all the threads. The copies
+ * are read without any locking, so the value is only exact when the
+ * counter is not being updated.
+ *
+ * @param stats		The set of counters
+ * @param counter	The counter index
+ * @return		The value of the counter
+ */
+int
+ts_stats_get(TS_STATS *stats, int counter)
+{
+int	i, total = 0;
+
+	for (i = 0; i <= stats->n_slots; i++)
+		total += ((volatile int *)stats->counters)[i * stats->stride + counter];
+	return total;
+}
+
+/**
+ * Return the value of a counter in the copy of one polling thread
+ *
+ * @param stats		The set of counters
+ * @param counter	The counter index
+ * @param slot		The polling thread, n_slots for the shared copy
+ * @return		The value of the counter for the thread
+ */
+int
+ts_stats_get_slot(TS_STATS *stats, int counter, int slot)
+{
+	if (slot < 0 || slot > stats->n_slots)
+		return 0;
+	return ((volatile int *)stats->counters)[slot * stats->stride + counter];
+}
+
+/**
+ * Allocate a latency histogram, all the buckets start at zero
+ *
+ * @return	The new histogram or NULL if it could not be allocated
+ */
+TS_HIST *
+ts_hist_alloc()
+{
+TS_HIST	*hist;
+int	line = TS_STATS_CACHE_LINE / sizeof(long);
+void	*counts;
+
+	if ((hist = (TS_HIST *)malloc(sizeof(TS_HIST))) == NULL)
+		return NULL;
+	hist->n_slots = n_slots;
+	hist->stride = ((TS_HIST_BUCKETS + 1 + line - 1) / line) * line;
+	if (posix_memalign(&counts, TS_STATS_CACHE_LINE,
+			(hist->n_slots + 1) * hist->stride * sizeof(long)) != 0)
+	{
+		free(hist);
+		return NULL;
+	}
+	hist->counts = (long *)counts;
+	memset(hist->counts, 0, (hist->n_slots + 1) * hist->stride * sizeof(long));
+	return hist;
+}
+
+/**
+ * Free a latency histogram
+ *
+ * @param hist	The histogram to free, NULL is ignored
+ */
+void
+ts_hist_free(TS_HIST *hist)
+{
+	if (hist == NULL)
+		return;
+	free(hist->counts);
+	free(hist);
+}
+
+/**
+ * Count a value in a latency histogram
+ *
+ * @param hist	The histogram
+ * @param usecs	The latency in microseconds
+ */
+void
+ts_hist_add(TS_HIST *hist, unsigned long usecs)
+{
+int		slot = thread_slot;
+int		bucket, top;
+unsigned long	value;
+long		*copy;
+
+	/*
+	 * The buckets are bounded above, so the bucket of a value is found
+	 * from the value less one. The top bit of that gives the power of 2
+	 * and the next TS_HIST_SUB_BITS bits the bucket within it.
+	 */
+	value = usecs > 0 ? usecs - 1 : 0;
+	if (value < TS_HIST_SUB_BUCKETS)
+	{
+		bucket = value;
+	}
+	else
+	{
+		top = sizeof(long) * 8 - 1 - __builtin_clzl(value);
+		bucket = TS_HIST_SUB_BUCKETS * (top - TS_HIST_SUB_BITS + 1)
+			+ ((value >> (top - TS_HIST_SUB_BITS))
+						& (TS_HIST_SUB_BUCKETS - 1));
+	}
+	if (bucket > TS_HIST_BUCKETS - 1)
+		bucket = TS_HIST_BUCKETS - 1;
+
+	if (slot >= 0 && slot < hist->n_slots)
+	{
+		copy = &hist->counts[slot * hist->stride];
+		copy[bucket]++;
+		copy[TS_HIST_BUCKETS] += usecs;
+	}
+	else
+	{
+		copy = &hist->counts[hist->n_slots * hist->stride];
+		__sync_fetch_and_add(&copy[bucket], 1);
+		__sync_fetch_and_add(&copy[TS_HIST_BUCKETS], (long)usecs);
+	}
+}
+
+/**
+ * Read a latency histogram without any locking, the buckets and the sum
+ * may be off by the values being counted while they are read.
+ *
+ * @param hist		The histogram
+ * @param slot		The polling thread, or -1 for the sum of all the threads
+ * @param counts	The TS_HIST_BUCKETS counts of the buckets
+ * @param sum		The sum of the values in microseconds
+ */
+void
+ts_hist_get(TS_HIST *hist, int slot, long *counts, long *sum)
+{
+volatile long	*copy;
+int		i, j;
+
+	memset(counts, 0, TS_HIST_BUCKETS * sizeof(long));
+	*sum = 0;
+	for (i = 0; i <= hist->n_slots; i++)
+	{
+		if (slot >= 0 && i != slot)
+			continue;
+		copy = &hist->counts[i * hist->stride];
+		for (j = 0; j < TS_HIST_BUCKETS; j++)
+			counts[j] += copy[j];
+		*sum += copy[TS_HIST_BUCKETS];
+	}
+}
+
+/**
+ * Return the upper bound of a bucket of the latency histograms
+ *
+ * @param bucket	The bucket index
+ * @return		The bound in microseconds, 0 for the last bucket
+ *			that has no bound
+ */
+unsigned long
+ts_hist_bound(int bucket)
+{
+int	octave;
+
+	if (bucket < 0 || bucket >= TS_HIST_BUCKETS - 1)
+		return 0;
+	if (bucket < TS_HIST_SUB_BUCKETS)
+		return bucket + 1;
+	octave = bucket / TS_HIST_SUB_BUCKETS - 1;
+	return (unsigned long)(TS_HIST_SUB_BUCKETS +
+			bucket % TS_HIST_SUB_BUCKETS + 1) << octave;
+}
+
+/**
+ * Return a percentile of the counts of a latency histogram, as read by
+ * ts_hist_get. The percentile is the bound of the bucket it falls in, so
+ * it is at most 25% above the true value.
+ *
+ * @param counts	The TS_HIST_BUCKETS counts of the buckets
+ * @param fraction	The percentile as a fraction, 0.99 for the 99th
+ * @return		The percentile in microseconds, 0 if the histogram
+ *			is empty or ULONG_MAX if it is above the last bound
+ */
+unsigned long
+ts_hist_percentile(long *counts, double fraction)
+{
+long	total = 0, rank, seen = 0;
+int	i;
+
+	for (i = 0; i < TS_HIST_BUCKETS; i++)
+		total += counts[i];
+	if (total == 0)
+		return 0;
+	rank = (long)(fraction * total + 0.999999);
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < TS_HIST_BUCKETS - 1; i++)
+	{
+		seen += counts[i];
+		if (seen >= rank)
+			return ts_hist_bound(i);
+	}
+	return ULONG_MAX;
+}
@@ -0,0 +1,427 @@
+/*
+ * This file is distributed as part of MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * Microbenchmarks of the core primitives: the buffers, the hashtable, the
+ * spinlocks, the reclamation of the zombie DCBs and the log writes.
+ *
+ * The first line of the output names the version, the processors and the
+ * scale of the run, each result follows as a line of JSON, e.g.
+ *
+ * {"bench":"spinlock","threads":4,"ops":4000000,"nsec":81520311,
+ *	"nsec_per_op":20.380,"ops_per_sec":49067539}
+ *
+ * so that the runs of different releases can be compared by a script. The
+ * multithreaded benchmarks are run with 1, 2, 4, ... threads up to the
+ * number of processors or the thread count given as the first argument.
+ * The second argument scales the number of operations.
+ *
+ *	benchcore [threads [scale]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <buffer.h>
+#include <hashtable.h>
+#include <spinlock.h>
+#include <atomic.h>
+#include <thread.h>
+#include <slab.h>
+#include <dcb.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+#include <version.h>
+
+#define	BENCH_MAX_THREADS	64
+
+static int	scale = 1;
+
+/**
+ * The state shared by the threads of a run, the threads wait for the start
+ * flag so that the time of the thread creations is not counted.
+ */
+typedef struct {
+	void		(*fn)(int, int);	/*< Body of a thread */
+	int		ops;			/*< Operations of each thread */
+	volatile int	start;			/*< The threads may run */
+	volatile int	ready;			/*< Threads waiting to start */
+} BENCH_RUN;
+
+typedef struct {
+	BENCH_RUN	*run;
+	int		id;
+} BENCH_THREAD;
+
+static unsigned long
+bench_clock()
+{
+struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Print the result of a benchmark
+ *
+ * @param name		The benchmark
+ * @param threads	The threads that ran it
+ * @param ops		The operations of all the threads
+ * @param nsec		The elapsed time in nanoseconds
+ */
+static void
+bench_report(char *name, int threads, long ops, unsigned long nsec)
+{
+	if (nsec == 0)
+		nsec = 1;
+	printf("{\"bench\":\"%s\",\"threads\":%d,\"ops\":%ld,\"nsec\":%lu,"
+		"\"nsec_per_op\":%.3f,\"ops_per_sec\":%.0f}\n",
+		name, threads, ops, nsec, (double)nsec / (ops ? ops : 1),
+		(double)ops * 1000000000.0 / nsec);
+	fflush(stdout);
+}
+
+static void
+bench_thread(void *data)
+{
+BENCH_THREAD	*thr = (BENCH_THREAD *)data;
+
+	atomic_add((int *)&thr->run->ready, 1);
+	while (thr->run->start == 0)
+		;
+	thr->run->fn(thr->id, thr->run->ops);
+}
+
+/**
+ * Run a benchmark in a number of threads and report the time from the
+ * start of the threads to the end of the last one.
+ *
+ * @param name		The benchmark
+ * @param fn		Body of each thread, called with its id and ops
+ * @param threads	The threads to run
+ * @param ops		The operations of each thread
+ */
+static void
+bench_run(char *name, void (*fn)(int, int), int threads, int ops)
+{
+BENCH_RUN	run;
+BENCH_THREAD	thr[BENCH_MAX_THREADS];
+void		*handles[BENCH_MAX_THREADS];
+unsigned long	started;
+int		i;
+
+	run.fn = fn;
+	run.ops = ops;
+	run.start = 0;
+	run.ready = 0;
+	for (i = 0; i < threads; i++)
+	{
+		thr[i].run = &run;
+		thr[i].id = i + 1;
+		handles[i] = thread_start(bench_thread, &thr[i]);
+	}
+	while (run.ready < threads)
+		usleep(1000);
+	started = bench_clock();
+	run.start = 1;
+	for (i = 0; i < threads; i++)
+		thread_wait(handles[i]);
+	bench_report(name, threads, (long)threads * ops, bench_clock() - started);
+}
+
+/**
+ * Run a benchmark with 1, 2, 4, ... threads
+ */
+static void
+bench_scale(char *name, void (*fn)(int, int), int max_threads, int ops)
+{
+int	n;
+
+	for (n = 1; n < max_threads; n *= 2)
+		bench_run(name, fn, n, ops);
+	bench_run(name, fn, max_threads, ops);
+}
+
+static void
+bench_gwbuf_alloc(int id, int ops)
+{
+int	i;
+
+	slab_thread_init(id);
+	for (i = 0; i < ops; i++)
+		gwbuf_free(gwbuf_alloc(128));
+}
+
+static void
+bench_gwbuf_clone(int id, int ops)
+{
+GWBUF	*buf;
+int	i;
+
+	slab_thread_init(id);
+	buf = gwbuf_alloc(1024);
+	for (i = 0; i < ops; i++)
+		gwbuf_free(gwbuf_clone(buf));
+	gwbuf_free(buf);
+}
+
+/**
+ * Consume chains of 16 buffers of 256 bytes in steps of 64 bytes, each
+ * consume is an operation
+ */
+static void
+bench_gwbuf_consume(int id, int ops)
+{
+GWBUF	*chain;
+int	i, j;
+
+	slab_thread_init(id);
+	for (i = 0; i < ops; i += 64)
+	{
+		chain = NULL;
+		for (j = 0; j < 16; j++)
+			chain = gwbuf_append(chain, gwbuf_alloc(256));
+		while (chain != NULL)
+			chain = gwbuf_consume(chain, 64);
+	}
+}
+
+#define	BENCH_HASH_KEYS	4096
+
+static HASHTABLE	*bench_hash;
+static int		bench_keys[2 * BENCH_HASH_KEYS];
+static volatile int	bench_writing;
+
+static int
+bench_hashfn(void *key)
+{
+	return *(int *)key;
+}
+
+static int
+bench_cmpfn(void *v1, void *v2)
+{
+	return *(int *)v1 - *(int *)v2;
+}
+
+static void
+bench_hash_fetch(int id, int ops)
+{
+int	i;
+
+	for (i = 0; i < ops; i++)
+		hashtable_fetch(bench_hash,
+				&bench_keys[(i * 7 + id) & (BENCH_HASH_KEYS - 1)]);
+}
+
+/**
+ * A writer that adds and deletes the keys the readers do not fetch until
+ * the readers are done
+ */
+static void
+bench_hash_writer(void *data)
+{
+int	i = 0;
+
+	while (bench_writing)
+	{
+		int *key = &bench_keys[BENCH_HASH_KEYS + (i & (BENCH_HASH_KEYS - 1))];
+
+		if (i & BENCH_HASH_KEYS)
+			hashtable_delete(bench_hash, key);
+		else
+			hashtable_add(bench_hash, key, key);
+		i++;
+	}
+}
+
+/**
+ * The adds of keys to a new table, which grows as the keys are added
+ */
+static void
+bench_hash_add(int ops)
+{
+HASHTABLE	*h;
+unsigned long	started, elapsed = 0;
+long		done = 0;
+int		i;
+
+	while (done < ops)
+	{
+		h = hashtable_alloc(16, bench_hashfn, bench_cmpfn);
+		started = bench_clock();
+		for (i = 0; i < 2 * BENCH_HASH_KEYS; i++)
+			hashtable_add(h, &bench_keys[i], &bench_keys[i]);
+		elapsed += bench_clock() - started;
+		done += 2 * BENCH_HASH_KEYS;
+		hashtable_free(h);
+	}
+	bench_report("hashtable_add", 1, done, elapsed);
+}
+
+static void
+bench_hashtable(int max_threads, int ops)
+{
+void	*writer;
+int	i;
+
+	for (i = 0; i < 2 * BENCH_HASH_KEYS; i++)
+		bench_keys[i] = i;
+	bench_hash_add(ops);
+
+	bench_hash = hashtable_alloc(BENCH_HASH_KEYS, bench_hashfn, bench_cmpfn);
+	for (i = 0; i < BENCH_HASH_KEYS; i++)
+		hashtable_add(bench_hash, &bench_keys[i], &bench_keys[i]);
+	bench_scale("hashtable_fetch", bench_hash_fetch, max_threads, ops);
+
+	bench_writing = 1;
+	writer = thread_start(bench_hash_writer, NULL);
+	bench_scale("hashtable_fetch_with_writer", bench_hash_fetch,
+			max_threads, ops);
+	bench_writing = 0;
+	thread_wait(writer);
+	hashtable_free(bench_hash);
+}
+
+static SPINLOCK		bench_lock = SPINLOCK_INIT;
+static volatile long	bench_counter;
+
+static void
+bench_spinlock(int id, int ops)
+{
+int	i;
+
+	for (i = 0; i < ops; i++)
+	{
+		spinlock_acquire(&bench_lock);
+		bench_counter++;
+		spinlock_release(&bench_lock);
+	}
+}
+
+static int	bench_nullfd;
+
+/**
+ * A DCB goes through the states of a closed connection, is added to the
+ * zombies of the thread and freed by the epoch based reclamation. The fd
+ * of the DCB is a duplicate of /dev/null, so the close is counted too.
+ */
+static void
+bench_zombies(int id, int ops)
+{
+DCB	*dcb;
+int	i;
+
+	dcb_thread_init(id);
+	for (i = 0; i < ops; i++)
+	{
+		if ((dcb = dcb_alloc(DCB_ROLE_REQUEST_HANDLER)) == NULL)
+			break;
+		dcb->fd = dup(bench_nullfd);
+		dcb_set_state(dcb, DCB_STATE_POLLING, NULL);
+		dcb_set_state(dcb, DCB_STATE_NOPOLLING, NULL);
+		dcb_add_to_zombieslist(dcb);
+		dcb_process_zombies(id);
+	}
+	dcb_thread_done();
+}
+
+static void
+bench_log_write(int id, int ops)
+{
+int	i;
+
+	for (i = 0; i < ops; i++)
+		skygw_log_write(LOGFILE_MESSAGE,
+				"Benchmark message %d of thread %d", i, id);
+}
+
+/**
+ * Initialise the log manager to write the logs to a temporary directory,
+ * which is removed by the caller
+ */
+static int
+bench_log_init(char *dir)
+{
+char	*argv[4];
+
+	strcpy(dir, "/tmp/benchcoreXXXXXX");
+	if (mkdtemp(dir) == NULL)
+		return 0;
+	argv[0] = "benchcore";
+	argv[1] = "-j";
+	argv[2] = dir;
+	argv[3] = NULL;
+	return skygw_logmanager_init(3, argv);
+}
+
+int
+main(int argc, char **argv)
+{
+int	max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+int	ops;
+char	logdir[64];
+char	cmd[128];
+
+	if (argc > 1)
+		max_threads = atoi(argv[1]);
+	if (argc > 2)
+		scale = atoi(argv[2]);
+	if (max_threads < 1)
+		max_threads = 1;
+	if (max_threads > BENCH_MAX_THREADS)
+		max_threads = BENCH_MAX_THREADS;
+	if (scale < 1)
+		scale = 1;
+	ops = 1000000 * scale;
+
+	printf("{\"version\":\"%s\",\"cpus\":%ld,\"threads\":%d,\"scale\":%d,"
+		"\"time\":%lu}\n", MAXSCALE_VERSION,
+		sysconf(_SC_NPROCESSORS_ONLN), max_threads, scale,
+		(unsigned long)time(0));
+
+	bench_scale("gwbuf_alloc_free", bench_gwbuf_alloc, max_threads, ops);
+	bench_scale("gwbuf_clone", bench_gwbuf_clone, max_threads, ops);
+	bench_scale("gwbuf_consume", bench_gwbuf_consume, max_threads, ops);
+
+	bench_hashtable(max_threads, ops);
+
+	bench_scale("spinlock", bench_spinlock, max_threads, ops);
+
+	if ((bench_nullfd = open("/dev/null", O_RDWR)) >= 0)
+	{
+		bench_scale("dcb_zombies", bench_zombies, max_threads, ops / 10);
+		while (dcb_process_zombies(0) > 0)
+			;
+		close(bench_nullfd);
+	}
+
+	if (bench_log_init(logdir))
+	{
+		bench_scale("log_write", bench_log_write, max_threads, ops / 10);
+		skygw_logmanager_done();
+		sprintf(cmd, "rm -rf %s", logdir);
+		system(cmd);
+	}
+	exit(0);
+}
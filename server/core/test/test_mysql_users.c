@@ -153,6 +153,41 @@ int set_and_get_single_mysql_users(char *username, char *hostname, char *passwor
 	return 0;
 }
 
+int set_and_get_mysql_users_wildcard(char *username, char *hostname, char *from, char *password) {
+        MYSQL_USER_HOST key;
+	USERS *mysql_users;
+	char *fetch_data;
+
+	mysql_users = mysql_users_alloc();
+	memset(&key, 0, sizeof(key));
+	key.user = username;
+
+	if (!mysql_users_parse_host(hostname, &key.ipv4, &key.hostbits)) {
+		fprintf(stderr, "mysql_users_parse_host() failed for host [%s]\n", hostname);
+		users_free(mysql_users);
+		return 1;
+	}
+
+	if (!mysql_users_add(mysql_users, &key, password)) {
+		fprintf(stderr, "mysql_users_add() failed for %s@%s\n", username, hostname);
+		users_free(mysql_users);
+		return 1;
+	}
+
+	memset(&key, 0, sizeof(key));
+	key.user = username;
+	inet_pton(AF_INET, from, &key.ipv4.sin_addr);
+
+	if ((fetch_data = mysql_users_fetch(mysql_users, &key)) == NULL)
+		fetch_data = mysql_users_fetch_wildcard(mysql_users, &key);
+
+	users_free(mysql_users);
+
+	if (!fetch_data)
+		return 1;
+
+	return 0;
+}
 
 int main() {
 	int ret;
@@ -189,6 +224,21 @@ int main() {
 	ret = set_and_get_single_mysql_users_ipv4(NULL, '\0', "JJcd");
 	assert(ret == 1);
 
+	ret = set_and_get_mysql_users_wildcard("pippo", "%", "10.0.0.1", "xyz");
+	assert(ret == 0);
+	ret = set_and_get_mysql_users_wildcard("pippo", "192.168.%", "192.168.10.1", "xyz");
+	assert(ret == 0);
+	ret = set_and_get_mysql_users_wildcard("pippo", "192.168.%", "192.169.10.1", "xyz");
+	assert(ret == 1);
+	ret = set_and_get_mysql_users_wildcard("pippo", "10.0.0.0/255.255.255.0", "10.0.0.77", "xyz");
+	assert(ret == 0);
+	ret = set_and_get_mysql_users_wildcard("pippo", "10.0.0.0/255.255.255.0", "10.0.1.77", "xyz");
+	assert(ret == 1);
+	ret = set_and_get_mysql_users_wildcard("pippo", "10.0.0.0/255.0.255.0", "10.0.0.77", "xyz");
+	assert(ret == 1);
+	ret = set_and_get_mysql_users_wildcard("pippo", "1.2.3.4.%", "1.2.3.4", "xyz");
+	assert(ret == 1);
+
 	for (i = 256*256*256; i <= 256*256*256 + 5; i++) {
 		char user[129] = "";
 		snprintf(user, 128, "user_%i", k);
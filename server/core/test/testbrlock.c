@@ -0,0 +1,183 @@
+/*
+ * This file is distributed as part of MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <brlock.h>
+#include <thread.h>
+
+static int acquire_time;
+
+static void
+test1_helper(void *data)
+{
+BRLOCK		*lck = (BRLOCK *)data;
+unsigned long	t1 = time(0);
+
+	brlock_read_acquire(lck);
+	acquire_time = time(0) - t1;
+	brlock_read_release(lck);
+}
+
+/**
+ * Check that a reader is kept out while the write lock is held.
+ *
+ * Take the write lock, start a thread that takes the read lock, sleep for
+ * 4 seconds and release the lock. The reader must have waited for at least
+ * 3 seconds.
+ */
+static int
+test1()
+{
+BRLOCK	lck;
+void	*handle;
+
+	acquire_time = 0;
+	brlock_init(&lck);
+	brlock_write_acquire(&lck);
+	handle = thread_start(test1_helper, (void *)&lck);
+	sleep(4);
+	brlock_write_release(&lck);
+	thread_wait(handle);
+
+	if (acquire_time < 3)
+	{
+		fprintf(stderr, "brlock: test 1 failed.\n");
+		return 1;
+	}
+	return 0;
+}
+
+static volatile int	test2_inside;
+
+static void
+test2_helper(void *data)
+{
+BRLOCK		*lck = (BRLOCK *)data;
+unsigned long	t1 = time(0);
+
+	brlock_read_acquire(lck);
+	__sync_fetch_and_add(&test2_inside, 1);
+	while (test2_inside < 2 && time(0) - t1 < 5)
+		;
+	brlock_read_release(lck);
+}
+
+/**
+ * Check that two readers hold the lock at the same time, each reader waits
+ * in the lock for the other one to come in.
+ */
+static int
+test2()
+{
+BRLOCK	lck = BRLOCK_INIT;
+void	*handles[2];
+
+	test2_inside = 0;
+	handles[0] = thread_start(test2_helper, (void *)&lck);
+	handles[1] = thread_start(test2_helper, (void *)&lck);
+	thread_wait(handles[0]);
+	thread_wait(handles[1]);
+
+	if (test2_inside != 2)
+	{
+		fprintf(stderr, "brlock: test 2 failed.\n");
+		return 1;
+	}
+	return 0;
+}
+
+#define	TEST3_READERS	(BRLOCK_SLOTS + 8)
+#define	TEST3_WRITERS	2
+#define	TEST3_LOOPS	20000
+
+static BRLOCK		test3_lck = BRLOCK_INIT;
+static volatile int	test3_a, test3_b;
+static int		test3_bad;
+
+static void
+test3_reader(void *data)
+{
+int	i;
+
+	for (i = 0; i < TEST3_LOOPS; i++)
+	{
+		brlock_read_acquire(&test3_lck);
+		if (test3_a != test3_b)
+			__sync_fetch_and_add(&test3_bad, 1);
+		brlock_read_release(&test3_lck);
+	}
+}
+
+static void
+test3_writer(void *data)
+{
+int	i;
+
+	for (i = 0; i < TEST3_LOOPS; i++)
+	{
+		brlock_write_acquire(&test3_lck);
+		test3_a++;
+		test3_b++;
+		brlock_write_release(&test3_lck);
+	}
+}
+
+/**
+ * Check that readers never see a write in progress and that the writers
+ * exclude each other. There are more readers than reader counters, so some
+ * readers share a counter.
+ */
+static int
+test3()
+{
+void	*handles[TEST3_READERS + TEST3_WRITERS];
+int	i;
+
+	test3_a = test3_b = test3_bad = 0;
+	for (i = 0; i < TEST3_READERS; i++)
+		handles[i] = thread_start(test3_reader, NULL);
+	for (i = 0; i < TEST3_WRITERS; i++)
+		handles[TEST3_READERS + i] = thread_start(test3_writer, NULL);
+	for (i = 0; i < TEST3_READERS + TEST3_WRITERS; i++)
+		thread_wait(handles[i]);
+
+	if (test3_bad != 0 || test3_a != TEST3_WRITERS * TEST3_LOOPS ||
+			test3_a != test3_b)
+	{
+		fprintf(stderr, "brlock: test 3 failed, %d inconsistent reads, "
+			"count %d.\n", test3_bad, test3_a);
+		return 1;
+	}
+	return 0;
+}
+
+main(int argc, char **argv)
+{
+int	result = 0;
+
+	result += test1();
+	result += test2();
+	result += test3();
+
+	exit(result);
+}
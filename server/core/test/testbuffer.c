@@ -0,0 +1,601 @@
+/*
+ * This file is distributed as part of MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <buffer.h>
+#include <modutil.h>
+#include <hint.h>
+#include <slab.h>
+#include <thread.h>
+
+/**
+ * test1	slab cache reuse on the owning thread
+ *
+ * Allocate and free a block from a thread with a cache, the second
+ * allocation of the same size class must be a cache hit and must return
+ * the block that was just freed.
+ */
+static int
+test1()
+{
+SLAB_STATS	stats;
+void		*p1, *p2;
+
+	slab_thread_init(1);
+	p1 = slab_alloc(100);
+	slab_free(p1);
+	p2 = slab_alloc(120);
+	if (p1 != p2)
+	{
+		fprintf(stderr, "slab: test 1 failed, block not reused.\n");
+		return 1;
+	}
+	slab_get_stats(1, -1, &stats);
+	if (stats.n_hits != 1 || stats.n_misses != 1)
+	{
+		fprintf(stderr, "slab: test 1 failed, hits %d misses %d.\n",
+			stats.n_hits, stats.n_misses);
+		return 1;
+	}
+	slab_free(p2);
+	return 0;
+}
+
+static void	*remote_block;
+
+static void
+test2_helper(void *data)
+{
+	slab_free(remote_block);
+}
+
+/**
+ * test2	cross thread free
+ *
+ * A block freed by another thread must be returned to the owner and
+ * handed out again on the next allocation of that class.
+ */
+static int
+test2()
+{
+SLAB_STATS	stats;
+void		*handle;
+void		*p;
+
+	/*< Empty the local free list of the class first */
+	p = slab_alloc(4000);
+	remote_block = slab_alloc(4000);
+	handle = thread_start(test2_helper, NULL);
+	thread_wait(handle);
+
+	slab_get_stats(1, -1, &stats);
+	if (stats.n_remote != 1)
+	{
+		fprintf(stderr, "slab: test 2 failed, no remote free seen.\n");
+		return 1;
+	}
+	if (slab_alloc(4000) != remote_block)
+	{
+		fprintf(stderr, "slab: test 2 failed, remote block not reused.\n");
+		return 1;
+	}
+	slab_free(remote_block);
+	slab_free(p);
+	return 0;
+}
+
+/**
+ * test3	gateway buffers on top of the slab caches
+ *
+ * Allocate, clone, consume and free a buffer chain and check the data
+ * is shared and the length bookkeeping is right.
+ */
+static int
+test3()
+{
+GWBUF	*buf, *clone;
+
+	buf = gwbuf_alloc(64);
+	memset(GWBUF_DATA(buf), 'a', 64);
+	clone = gwbuf_clone(buf);
+	if (GWBUF_DATA(clone) != GWBUF_DATA(buf))
+	{
+		fprintf(stderr, "buffer: test 3 failed, clone does not share data.\n");
+		return 1;
+	}
+	buf = gwbuf_append(buf, gwbuf_alloc(32));
+	if (gwbuf_length(buf) != 96)
+	{
+		fprintf(stderr, "buffer: test 3 failed, length %d.\n",
+			gwbuf_length(buf));
+		return 1;
+	}
+	buf = gwbuf_consume(buf, 64);
+	if (gwbuf_length(buf) != 32 || ((char *)GWBUF_DATA(clone))[63] != 'a')
+	{
+		fprintf(stderr, "buffer: test 3 failed after consume.\n");
+		return 1;
+	}
+	gwbuf_free(buf);
+	gwbuf_free(clone);
+	return 0;
+}
+
+/**
+ * test4	inline small buffers
+ *
+ * A small buffer is a single allocation, free the original before the
+ * clone and check the clone still references valid data.
+ */
+static int
+test4()
+{
+GWBUF	*buf, *clone;
+
+	buf = gwbuf_alloc(GWBUF_INLINE_SIZE);
+	if ((void *)GWBUF_DATA(buf) != (void *)((char *)buf + sizeof(GWBUF) + sizeof(SHARED_BUF)))
+	{
+		fprintf(stderr, "buffer: test 4 failed, data is not inline.\n");
+		return 1;
+	}
+	memset(GWBUF_DATA(buf), 'b', GWBUF_INLINE_SIZE);
+	clone = gwbuf_clone_portion(buf, 10, 20);
+	gwbuf_free(buf);
+	/*< Reuse of the host block would overwrite the data */
+	buf = gwbuf_alloc(GWBUF_INLINE_SIZE);
+	memset(GWBUF_DATA(buf), 'c', GWBUF_INLINE_SIZE);
+	if (GWBUF_LENGTH(clone) != 20 || ((char *)GWBUF_DATA(clone))[19] != 'b')
+	{
+		fprintf(stderr, "buffer: test 4 failed, clone data lost.\n");
+		return 1;
+	}
+	gwbuf_free(clone);
+	gwbuf_free(buf);
+	return 0;
+}
+
+static int	n_freed;
+
+static void
+test5_free(void *data)
+{
+	n_freed++;
+}
+
+/**
+ * test5	buffer objects
+ *
+ * An object attached to a buffer is seen through its clones, replaced by
+ * an object with the same identifier and freed with the last reference.
+ */
+static int
+test5()
+{
+GWBUF	*buf, *clone;
+int	a, b;
+
+	n_freed = 0;
+	buf = gwbuf_alloc(64);
+	clone = gwbuf_clone(buf);
+	gwbuf_add_buffer_object(buf, GWBUF_OBJ_FINGERPRINT, &a, test5_free);
+	if (gwbuf_get_buffer_object_data(clone, GWBUF_OBJ_FINGERPRINT) != &a)
+	{
+		fprintf(stderr, "buffer: test 5 failed, object not shared.\n");
+		return 1;
+	}
+	gwbuf_add_buffer_object(clone, GWBUF_OBJ_FINGERPRINT, &b, test5_free);
+	if (n_freed != 1 ||
+		gwbuf_get_buffer_object_data(buf, GWBUF_OBJ_FINGERPRINT) != &b)
+	{
+		fprintf(stderr, "buffer: test 5 failed, object not replaced.\n");
+		return 1;
+	}
+	gwbuf_free(buf);
+	if (n_freed != 1)
+	{
+		fprintf(stderr, "buffer: test 5 failed, object freed early.\n");
+		return 1;
+	}
+	gwbuf_free(clone);
+	if (n_freed != 2)
+	{
+		fprintf(stderr, "buffer: test 5 failed, object not freed.\n");
+		return 1;
+	}
+	return 0;
+}
+
+static GWBUF *
+test6_query(char *sql)
+{
+GWBUF	*buf;
+int	len = strlen(sql) + 1;
+unsigned char *ptr;
+
+	buf = gwbuf_alloc(len + 4);
+	ptr = GWBUF_DATA(buf);
+	ptr[0] = len & 0xff;
+	ptr[1] = (len >> 8) & 0xff;
+	ptr[2] = (len >> 16) & 0xff;
+	ptr[3] = 0;
+	ptr[4] = 0x03;
+	memcpy(ptr + 5, sql, len - 1);
+	return buf;
+}
+
+/**
+ * test6	statement fingerprints
+ *
+ * Statements that differ by their literals and white space share a
+ * fingerprint, the fingerprint is made once per buffer and it is
+ * dropped when the statement is replaced.
+ */
+static int
+test6()
+{
+GWBUF			*b1, *b2, *b3;
+MODUTIL_FINGERPRINT	*f1, *f2, *f3;
+
+	b1 = test6_query("SELECT a FROM t1 WHERE b = 10 AND c = 'x''y'");
+	b2 = test6_query("SELECT  a FROM t1\n WHERE b = 2 AND c = \"z\"");
+	b3 = test6_query("SELECT a FROM `t 1` WHERE b = 10 AND c = 'x'");
+	f1 = modutil_get_fingerprint(b1);
+	f2 = modutil_get_fingerprint(b2);
+	f3 = modutil_get_fingerprint(b3);
+	if (f1 == NULL || f2 == NULL || f3 == NULL ||
+		strcmp(f1->canonical, "SELECT a FROM t1 WHERE b = ? AND c = ?") ||
+		f1->fingerprint != f2->fingerprint ||
+		f1->fingerprint == f3->fingerprint)
+	{
+		fprintf(stderr, "buffer: test 6 failed, fingerprints differ.\n");
+		return 1;
+	}
+	if (modutil_get_fingerprint(b1) != f1)
+	{
+		fprintf(stderr, "buffer: test 6 failed, fingerprint not reused.\n");
+		return 1;
+	}
+	b1 = modutil_replace_SQL(b1, "DELETE FROM t1");
+	f1 = modutil_get_fingerprint(b1);
+	if (f1 == NULL || strcmp(f1->canonical, "DELETE FROM t1"))
+	{
+		fprintf(stderr, "buffer: test 6 failed, stale fingerprint.\n");
+		return 1;
+	}
+	gwbuf_free(b1);
+	gwbuf_free(b2);
+	gwbuf_free(b3);
+	return 0;
+}
+
+/**
+ * test7	packets sharing the data of a read buffer
+ *
+ * Two packets read into one buffer are split into portions of the
+ * same data, each must get its own SQL text and fingerprint. The SQL
+ * text of a packet continued in the next buffer of the chain is
+ * gathered.
+ */
+static int
+test7()
+{
+GWBUF	*buf, *p1, *p2, *b1, *b2;
+char	*sql;
+int	l1, l2;
+
+	b1 = test6_query("SELECT 1");
+	b2 = test6_query("UPDATE t SET a = 2");
+	l1 = GWBUF_LENGTH(b1);
+	l2 = GWBUF_LENGTH(b2);
+	buf = gwbuf_alloc(l1 + l2);
+	memcpy(GWBUF_DATA(buf), GWBUF_DATA(b1), l1);
+	memcpy((char *)GWBUF_DATA(buf) + l1, GWBUF_DATA(b2), l2);
+	p1 = gwbuf_clone_portion(buf, 0, l1);
+	p2 = gwbuf_clone_portion(buf, l1, l2);
+	if (modutil_get_fingerprint(p1) == NULL ||
+		strcmp(modutil_get_SQL(p1), "SELECT 1") ||
+		strcmp(modutil_get_SQL(p2), "UPDATE t SET a = 2") ||
+		strcmp(modutil_get_fingerprint(p2)->canonical, "UPDATE t SET a = ?"))
+	{
+		fprintf(stderr, "buffer: test 7 failed, packets share objects.\n");
+		return 1;
+	}
+	gwbuf_free(p1);
+	gwbuf_free(p2);
+	gwbuf_free(buf);
+
+	/*< Split the second statement over a chain of two buffers */
+	buf = gwbuf_alloc(10);
+	memcpy(GWBUF_DATA(buf), GWBUF_DATA(b2), 10);
+	p2 = gwbuf_alloc(l2 - 10);
+	memcpy(GWBUF_DATA(p2), (char *)GWBUF_DATA(b2) + 10, l2 - 10);
+	buf = gwbuf_append(buf, p2);
+	sql = modutil_get_SQL(buf);
+	if (sql == NULL || strcmp(sql, "UPDATE t SET a = 2") ||
+		modutil_get_SQL(buf) != sql)
+	{
+		fprintf(stderr, "buffer: test 7 failed, chained SQL %s.\n",
+			sql ? sql : "NULL");
+		return 1;
+	}
+	gwbuf_free(p2);
+	gwbuf_free(buf);
+	gwbuf_free(b1);
+	gwbuf_free(b2);
+	return 0;
+}
+
+/**
+ * test8	routing hints
+ *
+ * Hints are taken from the comments before the statement only, in the
+ * order they are given, and the hints of a buffer are parsed once.
+ */
+static int
+test8()
+{
+GWBUF	*buf;
+HINT	*hint;
+
+	buf = test6_query("/* MaxScale route to master */ SELECT 1");
+	hint = hint_get(buf);
+	if (hint == NULL || hint->type != HINT_ROUTE_TO_MASTER ||
+		hint->next != NULL || hint_get(buf) != hint)
+	{
+		fprintf(stderr, "buffer: test 8 failed, master hint.\n");
+		return 1;
+	}
+	gwbuf_free(buf);
+
+	buf = test6_query("-- maxscale route to server slave2\n"
+			"# maxscale route to slave\nSELECT 1");
+	hint = hint_get(buf);
+	if (hint == NULL || hint->type != HINT_ROUTE_TO_NAMED_SERVER ||
+		strcmp(hint->data, "slave2") || hint->next == NULL ||
+		hint->next->type != HINT_ROUTE_TO_SLAVE)
+	{
+		fprintf(stderr, "buffer: test 8 failed, named server hint.\n");
+		return 1;
+	}
+	gwbuf_free(buf);
+
+	buf = test6_query("SELECT 1 /* maxscale route to master */");
+	if (hint_get(buf) != NULL)
+	{
+		fprintf(stderr, "buffer: test 8 failed, hint after statement.\n");
+		return 1;
+	}
+	gwbuf_free(buf);
+
+	buf = test6_query("/* maxscale route to server */ /* maxscale routes "
+			"to master */ /* maxscale route to master SELECT 1");
+	if (hint_get(buf) != NULL)
+	{
+		fprintf(stderr, "buffer: test 8 failed, invalid hint.\n");
+		return 1;
+	}
+	gwbuf_free(buf);
+	return 0;
+}
+
+/**
+ * test9	parameter hints and hints added by a filter
+ *
+ * A parameter hint does not hide the routing hint that follows it, the
+ * hints added to a buffer come after the ones of its comments and the
+ * first value given for a parameter is used.
+ */
+static int
+test9()
+{
+GWBUF	*buf;
+HINT	*hint;
+
+	buf = test6_query("/* maxscale max_slave_replication_lag = 30 */ "
+			"/* maxscale route to slave */ SELECT 1");
+	hint = hint_get(buf);
+	if (hint == NULL || hint->type != HINT_PARAMETER ||
+		strcmp(hint_parameter(hint, "max_slave_replication_lag"), "30") ||
+		hint_route(hint) == NULL ||
+		hint_route(hint)->type != HINT_ROUTE_TO_SLAVE)
+	{
+		fprintf(stderr, "buffer: test 9 failed, parameter hint.\n");
+		return 1;
+	}
+	if (!hint_add(buf, HINT_PARAMETER, "max_slave_replication_lag", "0") ||
+		strcmp(hint_parameter(hint_get(buf),
+				"max_slave_replication_lag"), "30"))
+	{
+		fprintf(stderr, "buffer: test 9 failed, added hint first.\n");
+		return 1;
+	}
+	gwbuf_free(buf);
+
+	buf = test6_query("SELECT 1");
+	if (!hint_add(buf, HINT_PARAMETER, "max_slave_replication_lag", "5") ||
+		(hint = hint_get(buf)) == NULL ||
+		strcmp(hint_parameter(hint, "max_slave_replication_lag"), "5") ||
+		hint_route(hint) != NULL)
+	{
+		fprintf(stderr, "buffer: test 9 failed, added hint.\n");
+		return 1;
+	}
+	gwbuf_free(buf);
+	return 0;
+}
+
+/**
+ * test10	SQL views
+ *
+ * The segments of a statement in a chain of buffers point into the
+ * buffers, the text is made contiguous only for a chain.
+ */
+static int
+test10()
+{
+GWBUF			*buf, *b2, *b3;
+MODUTIL_SQL_VIEW	view;
+char			text[100], *sql;
+int			length, n = 0, segments = 0;
+
+	buf = test6_query("UPDATE t SET a = 2");
+	if (!modutil_sql_contiguous(buf, &sql, &length) ||
+		sql != (char *)GWBUF_DATA(buf) + 5 || length != 18)
+	{
+		fprintf(stderr, "buffer: test 10 failed, single buffer.\n");
+		return 1;
+	}
+
+	/*< Split the statement over a chain of three buffers */
+	b2 = gwbuf_alloc(6);
+	memcpy(GWBUF_DATA(b2), (char *)GWBUF_DATA(buf) + 13, 6);
+	b3 = gwbuf_alloc(4);
+	memcpy(GWBUF_DATA(b3), (char *)GWBUF_DATA(buf) + 19, 4);
+	GWBUF_RTRIM(buf, 10);
+	buf = gwbuf_append(gwbuf_append(buf, b2), b3);
+	if (!modutil_sql_view(buf, &view))
+	{
+		fprintf(stderr, "buffer: test 10 failed, no view.\n");
+		return 1;
+	}
+	do {
+		if (view.segment < (char *)GWBUF_DATA(view.buffer) ||
+			view.segment + view.length >
+				(char *)GWBUF_DATA(view.buffer)
+					+ GWBUF_LENGTH(view.buffer))
+		{
+			fprintf(stderr, "buffer: test 10 failed, segment "
+					"outside its buffer.\n");
+			return 1;
+		}
+		memcpy(text + n, view.segment, view.length);
+		n += view.length;
+		segments++;
+	} while (modutil_sql_view_next(&view));
+	text[n] = 0;
+	if (segments != 3 || strcmp(text, "UPDATE t SET a = 2"))
+	{
+		fprintf(stderr, "buffer: test 10 failed, %d segments '%s'.\n",
+				segments, text);
+		return 1;
+	}
+	if (!modutil_sql_contiguous(buf, &sql, &length) || length != 18 ||
+		strcmp(sql, "UPDATE t SET a = 2") || sql != modutil_get_SQL(buf))
+	{
+		fprintf(stderr, "buffer: test 10 failed, chained text.\n");
+		return 1;
+	}
+	while ((buf = gwbuf_consume(buf, GWBUF_LENGTH(buf))) != NULL)
+		;
+	return 0;
+}
+
+/**
+ * test11	statement rewrites
+ *
+ * A statement is rewritten in the buffer it was read into when it fits and
+ * the buffer is not shared, the packets after it in the buffer are kept.
+ */
+static int
+test11()
+{
+GWBUF	*buf, *b1, *b2, *clone, *rval;
+char	*sql;
+int	length, l1, l2;
+
+	buf = test6_query("SELECT 1");
+	if ((rval = modutil_rewrite_SQL(buf, 7, 1, "22", 2)) != buf ||
+		!modutil_sql_contiguous(rval, &sql, &length) || length != 9 ||
+		strncmp(sql, "SELECT 22", 9) ||
+		((unsigned char *)GWBUF_DATA(rval))[0] != 10)
+	{
+		fprintf(stderr, "buffer: test 11 failed, in place rewrite.\n");
+		return 1;
+	}
+
+	/*< A shared buffer is left to the other holder */
+	clone = gwbuf_clone(buf);
+	if ((rval = modutil_replace_SQL(buf, "SELECT 3")) == clone ||
+		rval == NULL || strcmp(modutil_get_SQL(rval), "SELECT 3") ||
+		strcmp(modutil_get_SQL(clone), "SELECT 22"))
+	{
+		fprintf(stderr, "buffer: test 11 failed, shared buffer.\n");
+		return 1;
+	}
+	gwbuf_free(rval);
+	gwbuf_free(clone);
+
+	/*< The second packet of a buffer follows the rewritten first one */
+	b1 = test6_query("SELECT 1");
+	b2 = test6_query("UPDATE t SET a = 2");
+	l1 = GWBUF_LENGTH(b1);
+	l2 = GWBUF_LENGTH(b2);
+	buf = gwbuf_alloc(l1 + l2);
+	memcpy(GWBUF_DATA(buf), GWBUF_DATA(b1), l1);
+	memcpy((char *)GWBUF_DATA(buf) + l1, GWBUF_DATA(b2), l2);
+	if ((rval = modutil_replace_SQL(buf, "SELECT 1000")) != buf ||
+		GWBUF_LENGTH(rval) != l1 + l2 + 3 ||
+		memcmp((char *)GWBUF_DATA(rval) + l1 + 3, GWBUF_DATA(b2), l2))
+	{
+		fprintf(stderr, "buffer: test 11 failed, following packet.\n");
+		return 1;
+	}
+	gwbuf_free(rval);
+
+	/*< A statement larger than the buffer is moved to a new one */
+	buf = test6_query("SELECT 1");
+	sql = malloc(1000);
+	memset(sql, ' ', 999);
+	sql[999] = 0;
+	memcpy(sql, "SELECT", 6);
+	if ((rval = modutil_replace_SQL(buf, sql)) == NULL ||
+		GWBUF_LENGTH(rval) != 1004 || rval->next != NULL ||
+		strcmp(modutil_get_SQL(rval), sql))
+	{
+		fprintf(stderr, "buffer: test 11 failed, larger statement.\n");
+		return 1;
+	}
+	free(sql);
+	gwbuf_free(rval);
+	gwbuf_free(b1);
+	gwbuf_free(b2);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+int	result = 0;
+
+	result += test1();
+	result += test2();
+	result += test3();
+	result += test4();
+	result += test5();
+	result += test6();
+	result += test7();
+	result += test8();
+	result += test9();
+	result += test10();
+	result += test11();
+
+	exit(result);
+}
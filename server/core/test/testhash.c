@@ -1,8 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "../../include/hashtable.h"
+#include "../../include/thread.h"
 
 static int hfun(void* key);
 static int cmpfun (void *, void *);
@@ -30,7 +32,8 @@ static int cmpfun(
 
 static bool do_hashtest(
         int argelems,
-        int argsize)
+        int argsize,
+        int type)
 {
         bool       succp = true;
         HASHTABLE* h;
@@ -48,7 +51,7 @@ static bool do_hashtest(
         
         val_arr = (int *)malloc(sizeof(void *)*argelems);
         
-        h = hashtable_alloc(argsize, hfun, cmpfun);
+        h = hashtable_alloc_type(argsize, hfun, cmpfun, type);
 
         ss_dfprintf(stderr, "\t..done\nAdd %d elements to hash table.", argelems);
         
@@ -63,20 +66,144 @@ static bool do_hashtest(
 
         ss_dfprintf(stderr, "\t..done\nValidate read values.");
         
-        ss_info_dassert(hsize == argsize, "Invalid hash size");
+        ss_info_dassert(hsize >= argsize, "Invalid hash size");
         ss_info_dassert((nelems == argelems) || (nelems == 0 && argsize == 0),
                         "Invalid element count");
         ss_info_dassert(longest <= nelems, "Too large longest list value");
+        ss_info_dassert(argsize == 0 ||
+                        nelems <= hsize * HASHTABLE_MAX_LOAD * 2,
+                        "Hash table did not grow");
+
+        ss_dfprintf(stderr, "\t\t..done\nFetch and delete all elements.");
+
+        for (i=0; i<argelems && argsize > 0; i++) {
+            ss_info_dassert(hashtable_fetch(h, (void *)&val_arr[i]) ==
+                            (void *)&val_arr[i], "Element not found");
+        }
+        for (i=0; i<argelems; i++) {
+            hashtable_delete(h, (void *)&val_arr[i]);
+        }
+        hashtable_get_stats((void *)h, &hsize, &nelems, &longest);
+        ss_info_dassert(nelems == 0, "Elements left after delete");
+        ss_info_dassert(hsize >= argsize, "Hash table shrunk too far");
 
         ss_dfprintf(stderr, "\t\t..done\n\nTest completed successfully.\n\n");
         
         CHK_HASHTABLE(h);
         hashtable_free(h);
+        free(val_arr);
         
 return_succp:
         return succp;
 }
 
+#define N_STABLE        1000
+#define N_READERS       3
+
+static HASHTABLE*    conc_h;
+static int           conc_keys[2 * N_STABLE];
+static volatile int  conc_done;
+
+static void conc_reader(
+        void* data)
+{
+        int i;
+
+        while (!conc_done) {
+            for (i=0; i<N_STABLE; i++) {
+                ss_info_dassert(hashtable_fetch(conc_h, (void *)&conc_keys[i]) ==
+                                (void *)&conc_keys[i], "Stable element lost");
+            }
+        }
+}
+
+/**
+ * @node Fetch a set of keys that stay in the table from several threads while
+ * another set is added and deleted, which also makes the table grow, shrink
+ * and rehash under the readers.
+ *
+ * @return true if succeed
+ */
+static bool do_concurrent_hashtest(
+        int type)
+{
+        void* readers[N_READERS];
+        int   i;
+        int   j;
+
+        ss_dfprintf(stderr, "testhash : concurrent fetches during updates.");
+        conc_h = hashtable_alloc_type(7, hfun, cmpfun, type);
+        for (i=0; i<2 * N_STABLE; i++) {
+            conc_keys[i] = i;
+        }
+        for (i=0; i<N_STABLE; i++) {
+            hashtable_add(conc_h, (void *)&conc_keys[i], (void *)&conc_keys[i]);
+        }
+        conc_done = 0;
+        for (i=0; i<N_READERS; i++) {
+            readers[i] = thread_start(conc_reader, NULL);
+        }
+        for (j=0; j<20; j++) {
+            for (i=N_STABLE; i<2 * N_STABLE; i++) {
+                hashtable_add(conc_h, (void *)&conc_keys[i], (void *)&conc_keys[i]);
+            }
+            for (i=N_STABLE; i<2 * N_STABLE; i++) {
+                hashtable_delete(conc_h, (void *)&conc_keys[i]);
+            }
+        }
+        conc_done = 1;
+        for (i=0; i<N_READERS; i++) {
+            thread_wait(readers[i]);
+        }
+        hashtable_free(conc_h);
+        ss_dfprintf(stderr, "\t..done\n");
+        return true;
+}
+
+/**
+ * @node Time fetches from a chained and an open addressing table holding the
+ * same keys. The result is only reported, the test fails if a fetch does.
+ *
+ * @return true if succeed
+ */
+static bool do_compare_hashtest(
+        int argelems)
+{
+        HASHTABLE* h[2];
+        int*       val_arr;
+        clock_t    start;
+        int        i;
+        int        n;
+        int        t;
+
+        val_arr = (int *)malloc(sizeof(int)*argelems);
+        for (i=0; i<argelems; i++) {
+            val_arr[i] = i * 7919;
+        }
+        for (t=0; t<2; t++) {
+            h[t] = hashtable_alloc_type(argelems / 8, hfun, cmpfun,
+                                        t == 0 ? HASHTABLE_CHAINED : HASHTABLE_OPEN);
+            for (i=0; i<argelems; i++) {
+                hashtable_add(h[t], (void *)&val_arr[i], (void *)&val_arr[i]);
+            }
+            start = clock();
+            for (n=0; n<20; n++) {
+                for (i=0; i<argelems; i++) {
+                    ss_info_dassert(hashtable_fetch(h[t], (void *)&val_arr[i]) ==
+                                    (void *)&val_arr[i], "Element not found");
+                }
+            }
+            ss_dfprintf(stderr,
+                        "testhash : %s table, %d fetches in %.3f seconds.\n",
+                        t == 0 ? "chained" : "open addressing",
+                        20 * argelems,
+                        (double)(clock() - start) / CLOCKS_PER_SEC);
+            hashtable_free(h[t]);
+        }
+        free(val_arr);
+        return true;
+}
+
 /** 
  * @node Simple test which creates hashtable and frees it. Size and number of entries
  * sre specified by user and passed as arguments.
@@ -91,16 +218,21 @@ return_succp:
 int main(void)
 {
         int rc = 1;
+        int type;
 
-        if (!do_hashtest(0, 1))         goto return_rc;
-        if (!do_hashtest(10, 1))        goto return_rc;
-        if (!do_hashtest(1000, 10))     goto return_rc;
-        if (!do_hashtest(10, 0))        goto return_rc;
-        if (!do_hashtest(1500, 17))     goto return_rc;
-        if (!do_hashtest(1, 1))         goto return_rc;
-        if (!do_hashtest(10000, 133))   goto return_rc;
-        if (!do_hashtest(1000, 1000))   goto return_rc;
-        if (!do_hashtest(1000, 100000)) goto return_rc;
+        for (type=HASHTABLE_CHAINED; type<=HASHTABLE_OPEN; type++) {
+            if (!do_hashtest(0, 1, type))         goto return_rc;
+            if (!do_hashtest(10, 1, type))        goto return_rc;
+            if (!do_hashtest(1000, 10, type))     goto return_rc;
+            if (!do_hashtest(10, 0, type))        goto return_rc;
+            if (!do_hashtest(1500, 17, type))     goto return_rc;
+            if (!do_hashtest(1, 1, type))         goto return_rc;
+            if (!do_hashtest(10000, 133, type))   goto return_rc;
+            if (!do_hashtest(1000, 1000, type))   goto return_rc;
+            if (!do_hashtest(1000, 100000, type)) goto return_rc;
+            if (!do_concurrent_hashtest(type))    goto return_rc;
+        }
+        if (!do_compare_hashtest(100000))         goto return_rc;
         
         rc = 0;
 return_rc:
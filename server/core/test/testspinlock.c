@@ -120,12 +120,59 @@ void		*handle;
 	return 0;
 }
 
+#define	TEST3_THREADS	4
+#define	TEST3_LOOPS	10000
+
+static SPINLOCK	test3_lck = SPINLOCK_INIT;
+static int	test3_count;
+
+static void
+test3_helper(void *data)
+{
+int	i;
+
+	for (i = 0; i < TEST3_LOOPS; i++)
+	{
+		spinlock_acquire(&test3_lck);
+		test3_count++;
+		spinlock_release(&test3_lck);
+	}
+}
+
+/**
+ * Check that a contended spinlock only has one holder at a time.
+ *
+ * Several threads each increment a counter under the lock, the count is
+ * only correct if no two threads held the lock at the same time.
+ */
+static int
+test3()
+{
+void	*handles[TEST3_THREADS];
+int	i;
+
+	test3_count = 0;
+	for (i = 0; i < TEST3_THREADS; i++)
+		handles[i] = thread_start(test3_helper, NULL);
+	for (i = 0; i < TEST3_THREADS; i++)
+		thread_wait(handles[i]);
+
+	if (test3_count != TEST3_THREADS * TEST3_LOOPS ||
+			SPINLOCK_IS_LOCKED(&test3_lck))
+	{
+		fprintf(stderr, "spinlock: test 3 failed, count %d.\n", test3_count);
+		return 1;
+	}
+	return 0;
+}
+
 main(int argc, char **argv)
 {
 int	result = 0;
 
 	result += test1();
 	result += test2();
+	result += test3();
 
 	exit(result);
 }
@@ -0,0 +1,220 @@
+/*
+ * This file is distributed as part of MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <statistics.h>
+#include <thread.h>
+
+#define	N_THREADS	4
+#define	N_ADDS		100000
+
+static TS_STATS	*stats;
+
+static void
+adder(void *data)
+{
+int	i, id = (int)(long)data;
+
+	/*< The last thread does not register, it uses the shared copy */
+	if (id < N_THREADS - 1)
+		ts_stats_thread_init(id);
+	for (i = 0; i < N_ADDS; i++)
+	{
+		ts_stats_add(stats, 0, 1);
+		ts_stats_add(stats, 1, -1);
+	}
+}
+
+/**
+ * test1	counters updated from several threads sum to the right totals
+ *
+ * Polling threads count in their own copies and a thread that does not
+ * poll counts in the shared copy, the totals must account for every add.
+ */
+static int
+test1()
+{
+void	*handles[N_THREADS];
+long	i;
+
+	stats = ts_stats_alloc(3);
+	for (i = 0; i < N_THREADS; i++)
+		handles[i] = thread_start(adder, (void *)i);
+	for (i = 0; i < N_THREADS; i++)
+		thread_wait(handles[i]);
+
+	if (ts_stats_get(stats, 0) != N_THREADS * N_ADDS ||
+		ts_stats_get(stats, 1) != -N_THREADS * N_ADDS ||
+		ts_stats_get(stats, 2) != 0)
+	{
+		fprintf(stderr, "statistics: test 1 failed, totals %d %d %d.\n",
+			ts_stats_get(stats, 0), ts_stats_get(stats, 1),
+			ts_stats_get(stats, 2));
+		return 1;
+	}
+	ts_stats_free(stats);
+	return 0;
+}
+
+/**
+ * test2	every copy starts on a cache line of its own
+ */
+static int
+test2()
+{
+	stats = ts_stats_alloc(3);
+	if (((long)stats->counters % TS_STATS_CACHE_LINE) != 0 ||
+		(stats->stride * sizeof(int)) % TS_STATS_CACHE_LINE != 0)
+	{
+		fprintf(stderr, "statistics: test 2 failed, copies not padded.\n");
+		return 1;
+	}
+	ts_stats_free(stats);
+	return 0;
+}
+
+static TS_HIST	*hist;
+
+static void
+hist_adder(void *data)
+{
+int	i, id = (int)(long)data;
+
+	if (id < N_THREADS - 1)
+		ts_stats_thread_init(id);
+	for (i = 0; i < N_ADDS; i++)
+		ts_hist_add(hist, i % 4 == 0 ? 1 : 1000);
+}
+
+/**
+ * test3	latency histogram buckets and sums, for all the threads and
+ *		for one of them
+ */
+static int
+test3()
+{
+void	*handles[N_THREADS];
+long	counts[TS_HIST_BUCKETS], sum;
+long	i;
+int	b1024;
+
+	for (b1024 = 0; ts_hist_bound(b1024) != 1024; b1024++)
+		;
+	hist = ts_hist_alloc();
+	for (i = 0; i < N_THREADS; i++)
+		handles[i] = thread_start(hist_adder, (void *)i);
+	for (i = 0; i < N_THREADS; i++)
+		thread_wait(handles[i]);
+
+	/*< 1 goes to the bucket of 1us, 1000 to the bucket of 1024us */
+	ts_hist_get(hist, -1, counts, &sum);
+	if (counts[0] != N_THREADS * N_ADDS / 4 ||
+		counts[b1024] != N_THREADS * (N_ADDS - N_ADDS / 4) ||
+		sum != N_THREADS * ((N_ADDS / 4) + 1000L * (N_ADDS - N_ADDS / 4)))
+	{
+		fprintf(stderr, "statistics: test 3 failed, counts %ld %ld sum %ld.\n",
+			counts[0], counts[b1024], sum);
+		return 1;
+	}
+	ts_hist_get(hist, 0, counts, &sum);
+	if (counts[0] != N_ADDS / 4 ||
+		ts_hist_bound(TS_HIST_BUCKETS - 2) != 1UL << TS_HIST_MAX_BITS ||
+		ts_hist_bound(TS_HIST_BUCKETS - 1) != 0)
+	{
+		fprintf(stderr, "statistics: test 3 failed, thread 0 count %ld.\n",
+			counts[0]);
+		return 1;
+	}
+	ts_hist_add(hist, 1UL << 40);
+	ts_hist_get(hist, -1, counts, &sum);
+	if (counts[TS_HIST_BUCKETS - 1] != 1)
+	{
+		fprintf(stderr, "statistics: test 3 failed, no overflow bucket.\n");
+		return 1;
+	}
+	ts_hist_free(hist);
+	return 0;
+}
+
+/**
+ * test4	every value goes to the bucket whose bounds hold it, the buckets
+ *		are at most a quarter of their bound wide and the percentiles
+ *		are the bounds of the buckets they fall in
+ */
+static int
+test4()
+{
+long		counts[TS_HIST_BUCKETS], sum;
+unsigned long	usecs, bound, prev;
+int		i;
+
+	hist = ts_hist_alloc();
+	for (usecs = 1; usecs <= 1UL << TS_HIST_MAX_BITS; usecs += 1 + usecs / 7)
+	{
+		ts_hist_add(hist, usecs);
+		ts_hist_get(hist, -1, counts, &sum);
+		for (i = 0; counts[i] == 0; i++)
+			;
+		bound = ts_hist_bound(i);
+		prev = i ? ts_hist_bound(i - 1) : 0;
+		if (usecs > bound || usecs <= prev || bound - prev > bound / 4 + 1)
+		{
+			fprintf(stderr, "statistics: test 4 failed, %lu in (%lu, %lu].\n",
+				usecs, prev, bound);
+			return 1;
+		}
+		ts_hist_free(hist);
+		hist = ts_hist_alloc();
+	}
+
+	/*< 90 values of 100us, 9 of 5000us and one of 50000us */
+	for (i = 0; i < 90; i++)
+		ts_hist_add(hist, 100);
+	for (i = 0; i < 9; i++)
+		ts_hist_add(hist, 5000);
+	ts_hist_add(hist, 50000);
+	ts_hist_get(hist, -1, counts, &sum);
+	if (ts_hist_percentile(counts, 0.5) != 112 ||
+		ts_hist_percentile(counts, 0.99) != 5120 ||
+		ts_hist_percentile(counts, 0.999) != 57344)
+	{
+		fprintf(stderr, "statistics: test 4 failed, percentiles %lu %lu %lu.\n",
+			ts_hist_percentile(counts, 0.5),
+			ts_hist_percentile(counts, 0.99),
+			ts_hist_percentile(counts, 0.999));
+		return 1;
+	}
+	ts_hist_free(hist);
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+int	result = 0;
+
+	ts_stats_init(N_THREADS - 1);
+	result += test1();
+	result += test2();
+	result += test3();
+	result += test4();
+
+	exit(result);
+}
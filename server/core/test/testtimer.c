@@ -0,0 +1,175 @@
+/*
+ * This file is distributed as part of MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <timer.h>
+
+static int		n_fired;
+static unsigned long	fired_at;
+
+static void
+count_fired(void *data)
+{
+	n_fired++;
+	fired_at = timer_now();
+}
+
+/**
+ * Run the wheel of the calling thread for at least msecs milliseconds,
+ * blocking the way the polling loop does.
+ */
+static void
+run_for(int msecs)
+{
+unsigned long	end = timer_now() + msecs;
+
+	while (timer_now() < end)
+	{
+		usleep(timer_next_timeout(10) * 1000);
+		timer_run();
+	}
+}
+
+/**
+ * test1	a timer fires once and never early
+ */
+static int
+test1()
+{
+TIMER		timer;
+unsigned long	started;
+
+	timer_init(&timer);
+	n_fired = 0;
+	started = timer_now();
+	timer_start(&timer, 50, count_fired, NULL);
+	run_for(200);
+	if (n_fired != 1)
+	{
+		fprintf(stderr, "timer: test 1 failed, fired %d times.\n", n_fired);
+		return 1;
+	}
+	if (fired_at < started + 50)
+	{
+		fprintf(stderr, "timer: test 1 failed, fired after %lu msecs.\n",
+			fired_at - started);
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * test2	cancelled and disabled timers do not fire
+ */
+static int
+test2()
+{
+TIMER	timer;
+
+	timer_init(&timer);
+	n_fired = 0;
+	timer_start(&timer, 20, count_fired, NULL);
+	timer_cancel(&timer);
+	run_for(60);
+	if (n_fired != 0)
+	{
+		fprintf(stderr, "timer: test 2 failed, cancelled timer fired.\n");
+		return 1;
+	}
+	timer_start(&timer, 20, count_fired, NULL);
+	timer_disable(&timer);
+	if (timer_start(&timer, 20, count_fired, NULL) != 0)
+	{
+		fprintf(stderr, "timer: test 2 failed, disabled timer restarted.\n");
+		return 1;
+	}
+	run_for(60);
+	if (n_fired != 0)
+	{
+		fprintf(stderr, "timer: test 2 failed, disabled timer fired.\n");
+		return 1;
+	}
+	return 0;
+}
+
+static TIMER	rearm_timer;
+
+static void
+rearm(void *data)
+{
+	if (++n_fired < 3)
+		timer_start(&rearm_timer, 10, rearm, data);
+}
+
+/**
+ * test3	a callback may restart its own timer
+ */
+static int
+test3()
+{
+	timer_init(&rearm_timer);
+	n_fired = 0;
+	timer_start(&rearm_timer, 10, rearm, NULL);
+	run_for(150);
+	if (n_fired != 3)
+	{
+		fprintf(stderr, "timer: test 3 failed, fired %d times.\n", n_fired);
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * test4	timers beyond the first level are cascaded down and fire
+ */
+static int
+test4()
+{
+TIMER		timer;
+unsigned long	started;
+int		delay = (TIMER_ROOT_SIZE + 20) * TIMER_TICK;
+
+	timer_init(&timer);
+	n_fired = 0;
+	started = timer_now();
+	timer_start(&timer, delay, count_fired, NULL);
+	run_for(delay + 100);
+	if (n_fired != 1 || fired_at < started + delay)
+	{
+		fprintf(stderr, "timer: test 4 failed, fired %d times.\n", n_fired);
+		return 1;
+	}
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+int	result = 0;
+
+	timer_thread_init(0);
+	result += test1();
+	result += test2();
+	result += test3();
+	result += test4();
+
+	exit(result);
+}
@@ -15,6 +15,9 @@
  *
  * Copyright SkySQL Ab 2013
  */
+/** for pthread_attr_setaffinity_np */
+#define _GNU_SOURCE
+#include <sched.h>
 #include <thread.h>
 #include <pthread.h>
 /**
@@ -29,6 +32,23 @@
  * @endverbatim
  */
 
+static cpu_set_t	default_cpus;		/*< CPUs of the threads started */
+static int		default_cpus_set = 0;
+
+/**
+ * Keep the CPU affinity of the calling thread for all the threads started
+ * later. The polling threads bind themselves to a CPU, the threads they
+ * start, e.g. for a monitor that is restarted, then still run on all the
+ * CPUs of the process rather than on the CPU of the polling thread.
+ */
+void
+thread_default_affinity()
+{
+	if (pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t),
+						&default_cpus) == 0)
+		default_cpus_set = 1;
+}
+
 
 /**
  * Start a polling thread
@@ -41,8 +61,19 @@ void *
 thread_start(void (*entry)(void *), void *arg)
 {
 pthread_t	thd;
+pthread_attr_t	attr;
+int		rc;
 
-	if (pthread_create(&thd, NULL, (void *(*)(void *))entry, arg) != 0)
+	if (default_cpus_set == 0)
+		rc = pthread_create(&thd, NULL, (void *(*)(void *))entry, arg);
+	else
+	{
+		pthread_attr_init(&attr);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &default_cpus);
+		rc = pthread_create(&thd, &attr, (void *(*)(void *))entry, arg);
+		pthread_attr_destroy(&attr);
+	}
+	if (rc != 0)
 	{
 		return NULL;
 	}
@@ -0,0 +1,422 @@
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file timer.c  - Hierarchical timer wheels for the polling threads
+ *
+ * The first level of a wheel has one slot per tick for the next 256 ticks,
+ * each of the following levels has 64 slots that each cover the whole range
+ * of the level below. A timer is placed directly in the slot for its expiry
+ * time, the wheel only visits the slot of the current tick and, every time
+ * the first level wraps around, moves the timers in the next slot of the
+ * level above down into the lower levels. Both adding and removing a timer
+ * are constant time operations.
+ *
+ * Timers that expire further away than the top level can represent are
+ * clamped to the maximum, about a week with the default tick.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <timer.h>
+#include <spinlock.h>
+#include <dcb.h>
+
+#define	TIMER_ROOT_MASK		(TIMER_ROOT_SIZE - 1)
+#define	TIMER_LEVEL_MASK	(TIMER_LEVEL_SIZE - 1)
+#define	TIMER_LEVEL_SHIFT(l)	(TIMER_ROOT_BITS + (l) * TIMER_LEVEL_BITS)
+#define	TIMER_MAX_TICKS		((1UL << TIMER_LEVEL_SHIFT(TIMER_LEVELS)) - 1)
+
+static	__thread TIMER_WHEEL	*thread_wheel = NULL;
+static	__thread unsigned long	thread_now = 0;	/*< Time of the last timer_run */
+static	TIMER_WHEEL		*allWheels = NULL;
+static	TIMER_WHEEL		*defaultWheel = NULL; /*< For threads that do not poll */
+static	SPINLOCK		wheelspin = SPINLOCK_INIT;
+
+/**
+ * Return the monotonic clock in milliseconds
+ */
+static unsigned long
+timer_clock()
+{
+struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Link a timer into the slot for its expiry time. Called with the wheel
+ * locked.
+ *
+ * @param wheel	The wheel
+ * @param timer	The timer to add
+ */
+static void
+wheel_link(TIMER_WHEEL *wheel, TIMER *timer)
+{
+unsigned long	delta;
+TIMER		**slot;
+int		l;
+
+	if (timer->expires <= wheel->now)
+		timer->expires = wheel->now;
+	delta = timer->expires - wheel->now;
+	if (delta > TIMER_MAX_TICKS)
+	{
+		timer->expires = wheel->now + TIMER_MAX_TICKS;
+		delta = TIMER_MAX_TICKS;
+	}
+
+	if (delta < TIMER_ROOT_SIZE)
+	{
+		slot = &wheel->root[timer->expires & TIMER_ROOT_MASK];
+	}
+	else
+	{
+		for (l = 0; l < TIMER_LEVELS - 1; l++)
+		{
+			if (delta < (1UL << TIMER_LEVEL_SHIFT(l + 1)))
+				break;
+		}
+		slot = &wheel->levels[l][(timer->expires >> TIMER_LEVEL_SHIFT(l))
+						& TIMER_LEVEL_MASK];
+	}
+	timer->next = *slot;
+	if (*slot)
+		(*slot)->pprev = &timer->next;
+	*slot = timer;
+	timer->pprev = slot;
+	timer->state = TIMER_PENDING;
+	wheel->n_pending++;
+}
+
+/**
+ * Unlink a pending timer from its slot. Called with the wheel locked.
+ *
+ * @param wheel	The wheel
+ * @param timer	The timer to remove
+ */
+static void
+wheel_unlink(TIMER_WHEEL *wheel, TIMER *timer)
+{
+	*timer->pprev = timer->next;
+	if (timer->next)
+		timer->next->pprev = timer->pprev;
+	timer->next = NULL;
+	timer->pprev = NULL;
+	timer->state = TIMER_IDLE;
+	wheel->n_pending--;
+}
+
+/**
+ * Move the timers of a slot of one of the upper levels down to the levels
+ * below. Called with the wheel locked.
+ *
+ * @param wheel	The wheel
+ * @param level	The level index
+ * @param index	The slot index
+ */
+static void
+wheel_cascade(TIMER_WHEEL *wheel, int level, int index)
+{
+TIMER	*timer;
+
+	while ((timer = wheel->levels[level][index]) != NULL)
+	{
+		wheel_unlink(wheel, timer);
+		wheel_link(wheel, timer);
+		wheel->n_cascaded++;
+	}
+}
+
+/**
+ * Create the timer wheel of the calling polling thread. Calling this more
+ * than once from the same thread has no effect.
+ *
+ * @param thread_id	The polling thread id, used in the diagnostics only
+ */
+void
+timer_thread_init(int thread_id)
+{
+TIMER_WHEEL	*wheel;
+
+	if (thread_wheel != NULL)
+		return;
+	if ((wheel = (TIMER_WHEEL *)calloc(1, sizeof(TIMER_WHEEL))) == NULL)
+		return;
+	spinlock_init(&wheel->lock);
+	wheel->thread_id = thread_id;
+	thread_now = timer_clock();
+	wheel->now = thread_now / TIMER_TICK;
+
+	/*< Wheels are never freed, the threads live until shutdown */
+	spinlock_acquire(&wheelspin);
+	wheel->next = allWheels;
+	allWheels = wheel;
+	if (defaultWheel == NULL || thread_id == 0)
+		defaultWheel = wheel;
+	spinlock_release(&wheelspin);
+	thread_wheel = wheel;
+}
+
+/**
+ * Initialise a timer, this must be done before the timer is first used and
+ * is the only way to reuse a timer that has been disabled.
+ *
+ * @param timer	The timer
+ */
+void
+timer_init(TIMER *timer)
+{
+	memset(timer, 0, sizeof(TIMER));
+	timer->state = TIMER_IDLE;
+}
+
+/**
+ * Start, or restart, a timer. The timer is bound to the wheel of the calling
+ * thread the first time it is started, threads that do not poll use the
+ * wheel of polling thread 0.
+ *
+ * @param timer	The timer
+ * @param msecs	The timeout in milliseconds
+ * @param fn	The callback
+ * @param data	The data passed to the callback
+ * @return	1 if the timer was started, 0 if it is disabled or there are
+ *		no timer wheels
+ */
+int
+timer_start(TIMER *timer, int msecs, void (*fn)(void *), void *data)
+{
+TIMER_WHEEL	*wheel;
+unsigned long	expires;
+
+	if ((wheel = timer->wheel) == NULL)
+	{
+		if ((wheel = thread_wheel) == NULL && (wheel = defaultWheel) == NULL)
+			return 0;
+	}
+	if (msecs < 0)
+		msecs = 0;
+	/*< Round up, a timer never fires early */
+	expires = (timer_clock() + msecs + TIMER_TICK - 1) / TIMER_TICK;
+
+	spinlock_acquire(&wheel->lock);
+	if (timer->state == TIMER_DISABLED)
+	{
+		spinlock_release(&wheel->lock);
+		return 0;
+	}
+	if (timer->state == TIMER_PENDING)
+		wheel_unlink(wheel, timer);
+	timer->wheel = wheel;
+	timer->fn = fn;
+	timer->data = data;
+	/*< Not before the next tick, a callback may safely restart its timer */
+	timer->expires = expires;
+	if (timer->expires <= wheel->now)
+		timer->expires = wheel->now + 1;
+	wheel_link(wheel, timer);
+	spinlock_release(&wheel->lock);
+	return 1;
+}
+
+/**
+ * Stop a timer, the callback will not be called unless the timer is started
+ * again.
+ *
+ * @param timer	The timer
+ */
+void
+timer_cancel(TIMER *timer)
+{
+TIMER_WHEEL	*wheel;
+
+	if ((wheel = timer->wheel) == NULL)
+		return;
+	spinlock_acquire(&wheel->lock);
+	if (timer->state == TIMER_PENDING)
+		wheel_unlink(wheel, timer);
+	spinlock_release(&wheel->lock);
+}
+
+/**
+ * Stop a timer and prevent it from being started again. This is used when
+ * the object that embeds the timer is closed.
+ *
+ * @param timer	The timer
+ */
+void
+timer_disable(TIMER *timer)
+{
+TIMER_WHEEL	*wheel;
+
+	if ((wheel = timer->wheel) == NULL)
+	{
+		timer->state = TIMER_DISABLED;
+		return;
+	}
+	spinlock_acquire(&wheel->lock);
+	if (timer->state == TIMER_PENDING)
+		wheel_unlink(wheel, timer);
+	timer->state = TIMER_DISABLED;
+	spinlock_release(&wheel->lock);
+}
+
+/**
+ * Run the timer wheel of the calling polling thread, calling the callbacks
+ * of every timer that has expired. This is called from the polling loop.
+ *
+ * @return The number of callbacks called
+ */
+int
+timer_run()
+{
+TIMER_WHEEL	*wheel = thread_wheel;
+TIMER		*timer;
+unsigned long	target;
+void		(*fn)(void *);
+void		*data;
+int		index, l, fired = 0;
+
+	thread_now = timer_clock();
+	if (wheel == NULL)
+		return 0;
+	target = thread_now / TIMER_TICK;
+
+	/*< Dirty read, no need to walk an empty wheel */
+	if (wheel->n_pending == 0)
+	{
+		spinlock_acquire(&wheel->lock);
+		if (wheel->n_pending == 0 && target >= wheel->now)
+			wheel->now = target + 1;
+		spinlock_release(&wheel->lock);
+		return 0;
+	}
+
+	spinlock_acquire(&wheel->lock);
+	while (wheel->now <= target)
+	{
+		index = wheel->now & TIMER_ROOT_MASK;
+		if (index == 0)
+		{
+			for (l = 0; l < TIMER_LEVELS; l++)
+			{
+				int lindex = (wheel->now >> TIMER_LEVEL_SHIFT(l))
+						& TIMER_LEVEL_MASK;
+				wheel_cascade(wheel, l, lindex);
+				if (lindex != 0)
+					break;
+			}
+		}
+		while ((timer = wheel->root[index]) != NULL)
+		{
+			wheel_unlink(wheel, timer);
+			fn = timer->fn;
+			data = timer->data;
+			wheel->n_fired++;
+			fired++;
+			/*<
+			 * The timer is not touched once the lock is released,
+			 * it may be restarted or cancelled by the callback or by
+			 * any other thread.
+			 */
+			spinlock_release(&wheel->lock);
+			fn(data);
+			spinlock_acquire(&wheel->lock);
+		}
+		wheel->now++;
+	}
+	spinlock_release(&wheel->lock);
+	return fired;
+}
+
+/**
+ * Return how long the calling polling thread may block before its wheel
+ * has to be run again.
+ *
+ * @param max_msecs	The longest time the caller wants to block
+ * @return		The time to block in milliseconds
+ */
+int
+timer_next_timeout(int max_msecs)
+{
+TIMER_WHEEL	*wheel = thread_wheel;
+unsigned long	tick, when;
+int		i;
+
+	if (wheel == NULL || wheel->n_pending == 0)
+		return max_msecs;
+
+	spinlock_acquire(&wheel->lock);
+	tick = wheel->now;
+	for (i = 0; i < TIMER_ROOT_SIZE; i++)
+	{
+		if (wheel->root[(tick + i) & TIMER_ROOT_MASK] != NULL)
+			break;
+		/*< The upper levels are cascaded when the first level wraps */
+		if (((tick + i) & TIMER_ROOT_MASK) == 0 && i > 0)
+			break;
+	}
+	spinlock_release(&wheel->lock);
+
+	when = (tick + i) * TIMER_TICK;
+	if (when <= thread_now)
+		return 0;
+	if (when - thread_now < (unsigned long)max_msecs)
+		return (int)(when - thread_now);
+	return max_msecs;
+}
+
+/**
+ * Return the current time in milliseconds. For a polling thread this is the
+ * time its timer wheel was last run, which is cheap to read and is accurate
+ * enough for timeouts.
+ *
+ * @return The monotonic time in milliseconds
+ */
+unsigned long
+timer_now()
+{
+	if (thread_wheel != NULL)
+		return thread_now;
+	return timer_clock();
+}
+
+/**
+ * Debug routine to print the timer wheels
+ *
+ * @param dcb	DCB to print to
+ */
+void
+dprintTimers(DCB *dcb)
+{
+TIMER_WHEEL	*wheel;
+
+	dcb_printf(dcb, "Timer resolution (msecs):	%d\n", TIMER_TICK);
+	dcb_printf(dcb, "Thread | Pending    | Fired      | Cascaded\n");
+	dcb_printf(dcb, "-------+------------+------------+-----------\n");
+	spinlock_acquire(&wheelspin);
+	for (wheel = allWheels; wheel; wheel = wheel->next)
+	{
+		dcb_printf(dcb, " %5d | %10d | %10d | %d\n",
+			wheel->thread_id, wheel->n_pending,
+			wheel->n_fired, wheel->n_cascaded);
+	}
+	spinlock_release(&wheelspin);
+}
@@ -0,0 +1,463 @@
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file tls.c  - TLS termination for the client connections
+ *
+ * The sessions use memory BIOs, the data read from the socket is written
+ * into the session and the records the session produces are taken out of
+ * it as a buffer that is written to the socket like any other. A session
+ * may therefore be started on data that has already been read, such as a
+ * ClientHello that arrived together with the MySQL SSL request.
+ *
+ * Full handshakes are avoided for reconnecting clients with both the session
+ * cache of the contexts and session tickets.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include <tls.h>
+#include <atomic.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+extern int lm_enabled_logfiles_bitmask;
+
+#define	TLS_READ_SIZE	16384	/*< The largest plaintext of a record */
+
+static	pthread_once_t	tls_once = PTHREAD_ONCE_INIT;
+
+static void	tls_init();
+static SSL_CTX	*tls_ctx_alloc(TLS_CONTEXT *, char *, char *, char *);
+static void	tls_log_error(char *, char *);
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static	pthread_mutex_t	*tls_locks = NULL;
+
+/**
+ * The locking callback of the TLS library, the library only locks
+ * internally from version 1.1.0 onwards.
+ */
+static void
+tls_lock(int mode, int n, const char *file, int line)
+{
+	if (mode & CRYPTO_LOCK)
+		pthread_mutex_lock(&tls_locks[n]);
+	else
+		pthread_mutex_unlock(&tls_locks[n]);
+}
+
+/**
+ * The thread id callback of the TLS library
+ */
+static unsigned long
+tls_thread_id()
+{
+	return (unsigned long)pthread_self();
+}
+#endif
+
+/**
+ * Initialise the TLS library, called once before the first context is
+ * created.
+ */
+static void
+tls_init()
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+int	i;
+#endif
+
+	SSL_library_init();
+	SSL_load_error_strings();
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	tls_locks = (pthread_mutex_t *)calloc(CRYPTO_num_locks(),
+						sizeof(pthread_mutex_t));
+	if (tls_locks == NULL)
+		return;
+	for (i = 0; i < CRYPTO_num_locks(); i++)
+		pthread_mutex_init(&tls_locks[i], NULL);
+	CRYPTO_set_id_callback(tls_thread_id);
+	CRYPTO_set_locking_callback(tls_lock);
+#endif
+}
+
+/**
+ * Allocate the TLS context of a listener
+ *
+ * @param cert		The certificate chain file, in PEM format
+ * @param key		The private key file, in PEM format
+ * @param ca		The CA certificates for client certificates or NULL
+ * @param n_ctx		The number of polling threads
+ * @return		The context or NULL if it could not be created
+ */
+TLS_CONTEXT *
+tls_context_alloc(char *cert, char *key, char *ca, int n_ctx)
+{
+TLS_CONTEXT	*context;
+int		i;
+
+	pthread_once(&tls_once, tls_init);
+	if (n_ctx < 1)
+		n_ctx = 1;
+	if ((context = (TLS_CONTEXT *)calloc(1, sizeof(TLS_CONTEXT))) == NULL)
+		return NULL;
+	if ((context->ctx = (SSL_CTX **)calloc(n_ctx, sizeof(SSL_CTX *))) == NULL)
+	{
+		free(context);
+		return NULL;
+	}
+	context->n_ctx = n_ctx;
+	if (RAND_bytes(context->ticket_keys, TLS_TICKET_KEY_MAX) != 1)
+	{
+		tls_log_error("generate the session ticket keys", NULL);
+		tls_context_free(context);
+		return NULL;
+	}
+	for (i = 0; i < n_ctx; i++)
+	{
+		if ((context->ctx[i] = tls_ctx_alloc(context, cert, key, ca)) == NULL)
+		{
+			tls_context_free(context);
+			return NULL;
+		}
+	}
+	return context;
+}
+
+/**
+ * Free the TLS context of a listener, the sessions of the context must
+ * have been freed.
+ *
+ * @param context	The context to free
+ */
+void
+tls_context_free(TLS_CONTEXT *context)
+{
+int	i;
+
+	if (context == NULL)
+		return;
+	for (i = 0; i < context->n_ctx; i++)
+	{
+		if (context->ctx[i])
+			SSL_CTX_free(context->ctx[i]);
+	}
+	memset(context->ticket_keys, 0, TLS_TICKET_KEY_MAX);
+	free(context->ctx);
+	free(context);
+}
+
+/**
+ * Create the SSL_CTX of one polling thread
+ *
+ * @param context	The TLS context of the listener
+ * @param cert		The certificate chain file
+ * @param key		The private key file
+ * @param ca		The CA certificates or NULL
+ * @return		The SSL_CTX or NULL on error
+ */
+static SSL_CTX *
+tls_ctx_alloc(TLS_CONTEXT *context, char *cert, char *key, char *ca)
+{
+SSL_CTX	*ctx;
+int	keylen;
+
+	ERR_clear_error();
+	if ((ctx = SSL_CTX_new(SSLv23_server_method())) == NULL)
+	{
+		tls_log_error("create a TLS context", NULL);
+		return NULL;
+	}
+	SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 |
+				SSL_OP_NO_COMPRESSION |
+				SSL_OP_CIPHER_SERVER_PREFERENCE);
+	/*< Idle connections give their record buffers back */
+	SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+
+	if (SSL_CTX_use_certificate_chain_file(ctx, cert) != 1)
+	{
+		tls_log_error("load the certificate", cert);
+		goto failed;
+	}
+	if (SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 ||
+		SSL_CTX_check_private_key(ctx) != 1)
+	{
+		tls_log_error("load the private key", key);
+		goto failed;
+	}
+	if (ca)
+	{
+		if (SSL_CTX_load_verify_locations(ctx, ca, NULL) != 1)
+		{
+			tls_log_error("load the CA certificates", ca);
+			goto failed;
+		}
+		/*< Certificates that clients present must be valid */
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	}
+
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_set_session_id_context(ctx, (unsigned char *)"MaxScale", 8);
+	SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+
+	/*< The key length differs between the versions of the TLS library */
+	keylen = SSL_CTX_set_tlsext_ticket_keys(ctx, NULL, 0);
+	if (keylen <= 0 || keylen > TLS_TICKET_KEY_MAX ||
+		SSL_CTX_set_tlsext_ticket_keys(ctx, context->ticket_keys,
+						keylen) != 1)
+	{
+		tls_log_error("set the session ticket keys", NULL);
+		goto failed;
+	}
+	context->ticket_keylen = keylen;
+	return ctx;
+
+failed:
+	SSL_CTX_free(ctx);
+	return NULL;
+}
+
+/**
+ * Allocate the TLS session of a client connection, the session waits
+ * for the ClientHello.
+ *
+ * @param context	The TLS context of the listener
+ * @param thread	The polling thread of the connection or -1
+ * @return		The session or NULL on error
+ */
+TLS_SESSION *
+tls_session_alloc(TLS_CONTEXT *context, int thread)
+{
+TLS_SESSION	*tls;
+int		i = (thread > 0) ? thread % context->n_ctx : 0;
+
+	if ((tls = (TLS_SESSION *)calloc(1, sizeof(TLS_SESSION))) == NULL)
+		return NULL;
+	tls->context = context;
+	ERR_clear_error();
+	if ((tls->ssl = SSL_new(context->ctx[i])) == NULL ||
+		(tls->rbio = BIO_new(BIO_s_mem())) == NULL ||
+		(tls->wbio = BIO_new(BIO_s_mem())) == NULL)
+	{
+		tls_log_error("create a TLS session", NULL);
+		if (tls->rbio)
+			BIO_free(tls->rbio);
+		if (tls->ssl)
+			SSL_free(tls->ssl);
+		free(tls);
+		return NULL;
+	}
+	/*< An empty BIO means that more data is needed, not the end of file */
+	BIO_set_mem_eof_return(tls->rbio, -1);
+	BIO_set_mem_eof_return(tls->wbio, -1);
+	SSL_set_bio(tls->ssl, tls->rbio, tls->wbio);
+	SSL_set_accept_state(tls->ssl);
+	return tls;
+}
+
+/**
+ * Free the TLS session of a connection
+ *
+ * @param tls	The session
+ */
+void
+tls_session_free(TLS_SESSION *tls)
+{
+	if (tls == NULL)
+		return;
+	SSL_free(tls->ssl);	/*< Frees the BIOs */
+	free(tls);
+}
+
+/**
+ * Shut down the TLS connection of a session. The close_notify alert is
+ * left in the session for the caller to write. A connection that is freed
+ * without a shutdown is taken as truncated and its session can no longer
+ * be resumed from the session cache.
+ *
+ * @param tls	The session
+ */
+void
+tls_session_shutdown(TLS_SESSION *tls)
+{
+	if (tls->established)
+	{
+		ERR_clear_error();
+		SSL_shutdown(tls->ssl);
+		ERR_clear_error();
+	}
+}
+
+/**
+ * Pass data read from the socket through a session. The handshake is
+ * advanced as far as the data allows and the application data is appended
+ * to a buffer chain. Handshake records to send to the client are left in
+ * the session, see tls_session_pending.
+ *
+ * @param tls	The session
+ * @param raw	The data read from the socket, consumed
+ * @param head	The chain to append the application data to
+ * @return	The number of bytes of application data or -1 if the
+ *		connection failed or was shut down by the client
+ */
+int
+tls_session_read(TLS_SESSION *tls, GWBUF *raw, GWBUF **head)
+{
+GWBUF	*buf;
+int	len, n, total = 0;
+
+	while (raw)
+	{
+		len = GWBUF_LENGTH(raw);
+		if (len > 0 && BIO_write(tls->rbio, GWBUF_DATA(raw), len) != len)
+		{
+			while ((raw = gwbuf_consume(raw, GWBUF_LENGTH(raw))) != NULL)
+				;
+			return -1;
+		}
+		raw = gwbuf_consume(raw, len);
+	}
+
+	ERR_clear_error();
+	while (1)
+	{
+		if ((buf = gwbuf_alloc(TLS_READ_SIZE)) == NULL)
+			return -1;
+		n = SSL_read(tls->ssl, GWBUF_DATA(buf), TLS_READ_SIZE);
+		if (n <= 0)
+		{
+			gwbuf_free(buf);
+			switch (SSL_get_error(tls->ssl, n))
+			{
+			case SSL_ERROR_WANT_READ:
+				break;
+			case SSL_ERROR_ZERO_RETURN:
+				return -1;
+			default:
+				tls_log_error(tls->established ?
+					"read from a TLS connection" :
+					"complete the TLS handshake", NULL);
+				return -1;
+			}
+			break;
+		}
+		if (n < TLS_READ_SIZE)
+			GWBUF_RTRIM(buf, TLS_READ_SIZE - n);
+		*head = gwbuf_append(*head, buf);
+		total += n;
+	}
+
+	if (!tls->established && SSL_is_init_finished(tls->ssl))
+	{
+		tls->established = 1;
+		atomic_add(&tls->context->n_handshakes, 1);
+		if (SSL_session_reused(tls->ssl))
+			atomic_add(&tls->context->n_resumed, 1);
+		LOGIF(LD, (skygw_log_write(
+			LOGFILE_DEBUG,
+			"%lu [tls_session_read] %s handshake completed with %s.",
+			pthread_self(),
+			SSL_session_reused(tls->ssl) ? "Abbreviated" : "Full",
+			SSL_get_cipher_name(tls->ssl))));
+	}
+	return total;
+}
+
+/**
+ * Encrypt a buffer chain for writing to the socket. The records are
+ * preceded by any handshake records the session has left to send.
+ *
+ * @param tls	The session
+ * @param queue	The application data, may point to NULL to only take the
+ *		handshake records. Replaced by the data to write, or NULL
+ *		if there is nothing to write
+ * @return	0 on success or -1 on error, the data is then discarded
+ */
+int
+tls_session_write(TLS_SESSION *tls, GWBUF **queue)
+{
+GWBUF	*out = NULL;
+int	len;
+
+	ERR_clear_error();
+	while (*queue)
+	{
+		len = GWBUF_LENGTH(*queue);
+		if (len > 0 && SSL_write(tls->ssl, GWBUF_DATA(*queue), len) != len)
+		{
+			tls_log_error("write to a TLS connection", NULL);
+			while ((*queue = gwbuf_consume(*queue,
+						GWBUF_LENGTH(*queue))) != NULL)
+				;
+			return -1;
+		}
+		*queue = gwbuf_consume(*queue, len);
+	}
+
+	if ((len = BIO_pending(tls->wbio)) > 0)
+	{
+		if ((out = gwbuf_alloc(len)) == NULL)
+			return -1;
+		if (BIO_read(tls->wbio, GWBUF_DATA(out), len) != len)
+		{
+			gwbuf_free(out);
+			return -1;
+		}
+	}
+	*queue = out;
+	return 0;
+}
+
+/**
+ * Return the number of bytes of records a session has to send
+ *
+ * @param tls	The session
+ * @return	The number of bytes waiting to be written
+ */
+int
+tls_session_pending(TLS_SESSION *tls)
+{
+	return BIO_pending(tls->wbio);
+}
+
+/**
+ * Log the errors of the TLS library for a failed operation
+ *
+ * @param what		The operation that failed
+ * @param file		The file the operation used or NULL
+ */
+static void
+tls_log_error(char *what, char *file)
+{
+char		buf[256];
+unsigned long	err = ERR_get_error();
+
+	ERR_error_string_n(err, buf, sizeof(buf));
+	LOGIF(LE, (skygw_log_write_flush(
+		LOGFILE_ERROR,
+		"Error : Failed to %s%s%s, %s.",
+		what,
+		file ? " from " : "",
+		file ? file : "",
+		err ? buf : "no error reported by the TLS library")));
+	ERR_clear_error();
+}
@@ -66,6 +66,7 @@ USERS 	*rval;
 		free(rval);
 		return NULL;
 	}
+	rval->refcount = 1;
 
 	hashtable_memory_fns(rval->data, (HASHMEMORYFN)strdup, (HASHMEMORYFN)strdup, (HASHMEMORYFN)free, (HASHMEMORYFN)free);
 
@@ -73,17 +74,34 @@ USERS 	*rval;
 }
 
 /**
- * Remove the users table
+ * Remove the users table, or drop a hold of it. The table is freed when
+ * the last holder drops it.
  *
  * @param users	The users table to remove
  */
 void
 users_free(USERS *users)
 {
+	if (atomic_add(&users->refcount, -1) > 1)
+		return;
 	hashtable_free(users->data);
 	free(users);
 }
 
+/**
+ * Hold a users table, a table shared by its holders is not modified.
+ * Each holder frees the table with users_free.
+ *
+ * @param users	The users table
+ * @return	The users table
+ */
+USERS *
+users_share(USERS *users)
+{
+	atomic_add(&users->refcount, 1);
+	return users;
+}
+
 /**
  * Add a new user to the user table. The user name must be unique
  *
@@ -41,6 +41,8 @@
 #include <poll.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 extern int lm_enabled_logfiles_bitmask;
 
@@ -91,25 +93,67 @@ char *gw_strend(register const char *s) {
 	return (char*) (s-1);
 }
 
+///////////////////////////////
+// the state of the random generator of the thread, a xorshift64*
+// seeded once from /dev/urandom, 0 until it is seeded
+//////////////////////////////
+static __thread uint64_t gw_random_state = 0;
+
+static void gw_random_seed() {
+	int fd;
+	uint64_t seed = 0;
+
+	if ((fd = open("/dev/urandom", O_RDONLY)) != -1) {
+		if (read(fd, &seed, sizeof(seed)) != sizeof(seed)) {
+			seed = 0;
+		}
+		close(fd);
+	}
+
+	seed ^= (uint64_t)time(0L) ^ ((uint64_t)getpid() << 32) ^
+		(uint64_t)pthread_self();
+
+	gw_random_state = (seed != 0 ? seed : 0x9e3779b97f4a7c15ULL);
+}
+
 ///////////////////////////////
 // generate a random char 
 //////////////////////////////
 static char gw_randomchar() {
-   return (char)((rand() % 78) + 30);
+	uint64_t x = gw_random_state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	gw_random_state = x;
+
+	return (char)(((x * 0x2545f4914f6cdd1dULL) >> 32) % 78 + 30);
 }
 
 /////////////////////////////////
-// generate a random string
+// generate a scramble of len random chars,
 // output must be pre allocated
 /////////////////////////////////
-int gw_generate_random_str(char *output, int len) {
+void gw_generate_scramble(uint8_t *output, int len) {
 
 	int i;
-	srand(time(0L));
+
+	if (gw_random_state == 0) {
+		gw_random_seed();
+	}
 
 	for ( i = 0; i < len; ++i ) {
 		output[i] = gw_randomchar();
 	}
+}
+
+/////////////////////////////////
+// generate a random string
+// output must be pre allocated
+/////////////////////////////////
+int gw_generate_random_str(char *output, int len) {
+
+	gw_generate_scramble((uint8_t *)output, len);
 
 	output[len]='\0';
 
@@ -0,0 +1,66 @@
+#ifndef _BRLOCK_H
+#define _BRLOCK_H
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file brlock.h
+ *
+ * A reader-writer lock for data that is read often and changed seldom, a
+ * "big reader" lock. The readers are counted in BRLOCK_SLOTS counters that
+ * each fill a cache line of their own, and every thread uses one of the
+ * counters for all the locks. A reader only writes to its own counter, so
+ * readers in different threads do not contend with each other or share a
+ * cache line. The cost is on the writer, it has to look at every counter
+ * and wait for each one to drop to zero.
+ *
+ * The threads get their counters in the order they first take a read lock,
+ * the first BRLOCK_SLOTS threads, which include the polling threads, have a
+ * counter of their own and the later threads share them.
+ *
+ * A writer waiting for the lock keeps new readers out. The lock is not
+ * recursive, a thread holding a read lock must not take it again since a
+ * writer may have started waiting in between.
+ */
+#include <spinlock.h>
+
+#define	BRLOCK_SLOTS		32	/**< Reader counters, a power of 2 */
+#define	BRLOCK_CACHE_LINE	64
+
+/**
+ * The reader counter of a group of threads
+ */
+typedef struct brlock_slot {
+	volatile int	readers;
+	char		pad[BRLOCK_CACHE_LINE - sizeof(int)];
+} BRLOCK_SLOT;
+
+typedef struct brlock {
+	BRLOCK_SLOT	slots[BRLOCK_SLOTS];	/**< Reader counters */
+	volatile int	writer;			/**< A writer holds or waits */
+	SPINLOCK	wlock;			/**< Serialises the writers */
+} BRLOCK;
+
+#define BRLOCK_INIT { { { 0 } }, 0, SPINLOCK_INIT }
+
+extern void	brlock_init(BRLOCK *lock);
+extern void	brlock_read_acquire(BRLOCK *lock);
+extern void	brlock_read_release(BRLOCK *lock);
+extern void	brlock_write_acquire(BRLOCK *lock);
+extern void	brlock_write_release(BRLOCK *lock);
+#endif
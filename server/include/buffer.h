@@ -51,8 +51,10 @@ typedef enum
         GWBUF_TYPE_MYSQL           = 0x02,
         GWBUF_TYPE_SINGLE_STMT     = 0x04,
         GWBUF_TYPE_SESCMD_RESPONSE = 0x08,
-	GWBUF_TYPE_RESPONSE_END    = 0x10,
-        GWBUF_TYPE_SESCMD          = 0x20
+	GWBUF_TYPE_RESPONSE_END    = 0x10, /*< The last buffer of a backend reply */
+        GWBUF_TYPE_SESCMD          = 0x20,
+        GWBUF_TYPE_FRAGMENT        = 0x40  /*< Continues the payload of the
+                                            * packet before it */
 } gwbuf_type_t;
 
 #define GWBUF_IS_TYPE_UNDEFINED(b)       (b->gwbuf_type == 0)
@@ -62,17 +64,63 @@ typedef enum
 #define GWBUF_IS_TYPE_SESCMD_RESPONSE(b) (b->gwbuf_type & GWBUF_TYPE_SESCMD_RESPONSE)
 #define GWBUF_IS_TYPE_RESPONSE_END(b)    (b->gwbuf_type & GWBUF_TYPE_RESPONSE_END)
 #define GWBUF_IS_TYPE_SESCMD(b)          (b->gwbuf_type & GWBUF_TYPE_SESCMD)
+#define GWBUF_IS_TYPE_FRAGMENT(b)        (b->gwbuf_type & GWBUF_TYPE_FRAGMENT)
+
+/**
+ * The identifiers of the objects that may be attached to the data of a buffer
+ */
+typedef enum
+{
+	GWBUF_OBJ_FINGERPRINT = 1,	/*< Statement fingerprint, see modutil.c */
+	GWBUF_OBJ_SQL,			/*< NULL terminated SQL text, see modutil.c */
+	GWBUF_OBJ_QUERY_TYPE,		/*< Query type set by the router */
+	GWBUF_OBJ_HINT,			/*< Routing hints, see hint.c */
+	GWBUF_OBJ_STMT			/*< Binary protocol statement, see mysql_client.c */
+} bufobj_id_t;
+
+/**
+ * An object attached to the shared data of a buffer. Information derived
+ * from the data, computed by one module, is kept here for the others that
+ * process the same data. The object is freed with the shared buffer.
+ *
+ * Several packets may share the data, the object belongs to the packet
+ * that starts where the buffer it was attached through started. Clones of
+ * that buffer, including portions with the same start, see the object.
+ */
+typedef struct bufobj {
+	bufobj_id_t	id;			/*< The object identifier */
+	void		*start;			/*< Start of the packet */
+	void		*data;			/*< The object itself */
+	void		(*freefn)(void *);	/*< Frees the object or NULL */
+	struct bufobj	*next;			/*< Next object of the buffer */
+} BUFFER_OBJECT;
 
 /**
  * A structure to encapsulate the data in a form that the data itself can be
  * shared between multiple GWBUF's without the need to make multiple copies
  * but still maintain separate data pointers.
+ *
+ * For small buffers the SHARED_BUF and the data are placed directly after the
+ * GWBUF structure returned by gwbuf_alloc, in the same allocation. The whole
+ * allocation is released when the last reference to the SHARED_BUF goes.
+ *
+ * The size is that of the memory block, which may be larger than what was
+ * asked of gwbuf_alloc, the bytes after the end of the data may be used to
+ * rewrite the data in place by the only holder of the buffer.
  */
 typedef struct  {
 	unsigned char	*data;			/*< Physical memory that was allocated */
+	unsigned int	size;			/*< Bytes usable from data */
 	int		refcount;		/*< Reference count on the buffer */
+	int		info;			/*< Allocation information bits */
+	BUFFER_OBJECT	*bufobj;		/*< Objects attached to the data */
 } SHARED_BUF;
 
+#define	SHARED_BUF_INLINE	0x01	/*< Header and data share the GWBUF allocation */
+
+/*< Largest data size that is allocated inline with the GWBUF */
+#define	GWBUF_INLINE_SIZE	256
+
 /**
  * The buffer structure used by the descriptor control blocks.
  *
@@ -121,4 +169,9 @@ extern unsigned int	gwbuf_length(GWBUF *head);
 extern GWBUF            *gwbuf_clone_portion(GWBUF *head, size_t offset, size_t len);
 extern GWBUF            *gwbuf_clone_transform(GWBUF *head, gwbuf_type_t type);
 extern void             gwbuf_set_type(GWBUF *head, gwbuf_type_t type);
+extern int		gwbuf_add_buffer_object(GWBUF *buf, bufobj_id_t id,
+				void *data, void (*freefn)(void *));
+extern void		*gwbuf_get_buffer_object_data(GWBUF *buf, bufobj_id_t id);
+extern void		gwbuf_remove_buffer_object(GWBUF *buf, bufobj_id_t id);
+extern void		gwbuf_remove_buffer_objects(GWBUF *buf);
 #endif
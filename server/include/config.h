@@ -38,6 +38,20 @@
  */
 enum {MAX_PARAM_LEN=256};
 
+#define	DEFAULT_POLL_SPIN_TIME	100	/**< Default poll_spin_time, microseconds */
+#define	DEFAULT_DCB_POOL_SIZE	1024	/**< Default dcb_pool_size */
+#define	DEFAULT_WRITEQ_HIGH_WATER 1048576 /**< Default writeq_high_water, bytes */
+#define	DEFAULT_WRITEQ_LOW_WATER 262144	/**< Default writeq_low_water, bytes */
+#define	DEFAULT_BACKEND_PENDING_REQUESTS 64 /**< Default backend_pending_requests */
+#define	DEFAULT_START_THREADS	8	/**< Default start_threads */
+#define	DEFAULT_LOW_PRIORITY_BUDGET 32	/**< Default low_priority_budget, events */
+#define	DEFAULT_QC_CACHE_SAVE_INTERVAL 300 /**< Default qc_cache_save_interval, seconds */
+#define	DEFAULT_HANDOFF_DRAIN_TIMEOUT 300 /**< Default handoff_drain_timeout, seconds */
+
+#define	ACCEPT_BALANCE_OFF	0	/**< A client stays on the accepting thread */
+#define	ACCEPT_BALANCE_SESSIONS	1	/**< To the thread with the fewest DCBs */
+#define	ACCEPT_BALANCE_BUSY	2	/**< To the thread least busy of late */
+
 typedef enum {
         UNDEFINED_TYPE = 0x00,
         STRING_TYPE    = 0x01,
@@ -80,6 +94,31 @@ typedef struct	config_context {
  */
 typedef struct {
 	int			n_threads;		/**< Number of polling threads */
+	int			per_thread_poll;	/**< Each polling thread has its own epoll set */
+	int			poll_spin_time;		/**< Longest spin before blocking, microseconds */
+	int			dcb_pool_size;		/**< Freed DCBs kept for reuse */
+	int			backend_connect_timeout; /**< Seconds to wait for a backend, 0 for ever */
+	int			writeq_high_water;	/**< Client write queue that pauses the backend reads */
+	int			writeq_low_water;	/**< Client write queue that resumes the backend reads */
+	int			backend_pending_requests; /**< Requests kept for a backend that is not ready */
+	int			log_error_burst;	/**< Error log strings of a call site per interval */
+	int			log_error_every;	/**< After the burst one in every is logged */
+	int			log_ratelimit_interval;	/**< Seconds of the error log rate limit */
+	double			log_trace_sample;	/**< Percentage of trace log strings logged */
+	char			*thread_affinity;	/**< CPUs of the polling threads or NULL */
+	int			start_threads;		/**< Services started at the same time */
+	int			listen_early;		/**< Poll before all the services are started */
+	int			huge_pages;		/**< Backing of the buffer and DCB pools */
+	int			poll_engine;		/**< Event engine of the polling threads */
+	int			work_stealing;		/**< Idle threads take the waiting events */
+	int			low_priority_budget;	/**< Low priority events run in a cycle */
+	int			accept_balance;		/**< Thread given an accepted client */
+	char			*qc_cache_file;		/**< Saved classification cache or NULL */
+	int			qc_cache_save_interval;	/**< Seconds between saves of the cache */
+	int			users_snapshot;		/**< Users' tables are saved and loaded */
+	int			handoff;		/**< Listeners handed over at restart */
+	char			*handoff_socket;	/**< Socket of the handoff or NULL */
+	int			handoff_drain_timeout;	/**< Seconds the sessions may take to close */
 	char			*version_string;	/**< The version string of embedded database library */
 	unsigned long		id;			/**< MaxScale ID */
 } GATEWAY_CONF;
@@ -87,6 +126,27 @@ typedef struct {
 extern int	    config_load(char *);
 extern int	    config_reload();
 extern int	    config_threadcount();
+extern int	    config_per_thread_poll();
+extern int	    config_poll_spin_time();
+extern int	    config_dcb_pool_size();
+extern int	    config_backend_connect_timeout();
+extern int	    config_writeq_high_water();
+extern int	    config_writeq_low_water();
+extern int	    config_backend_pending_requests();
+extern char	    *config_thread_affinity();
+extern int	    config_huge_pages();
+extern int	    config_poll_engine();
+extern int	    config_work_stealing();
+extern int	    config_low_priority_budget();
+extern int	    config_accept_balance();
+extern int	    config_start_threads();
+extern int	    config_listen_early();
+extern char	    *config_qc_cache_file();
+extern int	    config_qc_cache_save_interval();
+extern int	    config_users_snapshot();
+extern int	    config_handoff();
+extern char	    *config_handoff_socket();
+extern int	    config_handoff_drain_timeout();
 CONFIG_PARAMETER*   config_get_param(CONFIG_PARAMETER* params, const char* name);
 config_param_type_t config_get_paramtype(CONFIG_PARAMETER* param);
 CONFIG_PARAMETER*   config_clone_param(CONFIG_PARAMETER* param);
@@ -20,6 +20,7 @@
 
 #include <service.h>
 #include <arpa/inet.h>
+#include <pthread.h>
 
 
 /**
@@ -39,6 +40,7 @@
 /* Refresh rate limits for load users from database */
 #define USERS_REFRESH_TIME 30           /* Allowed time interval (in seconds) after last update*/
 #define USERS_REFRESH_MAX_PER_TIME 4    /* Max number of load calls within the time interval */
+#define USERS_CHECK_TIME 30             /* Interval (in seconds) of the checksum check of the users' loader */
 
 /* Max length of fields in the mysql.user table */
 #define MYSQL_USER_MAXLEN	128
@@ -47,17 +49,47 @@
 #define MYSQL_DATABASE_MAXLEN	128
 
 /**
- * MySQL user and host data structure
+ * MySQL user and host data structure. A host with wildcards, such as '%' or
+ * '10.0.%', or a netmask, such as '10.0.0.0/255.255.0.0', has the number of
+ * its wildcard low bits in hostbits and those bits of the address are 0.
  */
 typedef struct mysql_user_host_key {
         char *user;
         struct sockaddr_in ipv4;
+        int hostbits;	/**< 0 for a single host, 32 for '%' */
 } MYSQL_USER_HOST;
 
+/**
+ * The source of the MySQL users of the services that load them from the same
+ * backend servers with the same credentials. The services share the users'
+ * table of the source, which is loaded and checked once for all of them and
+ * not modified once it is shared.
+ */
+typedef struct mysql_users_source {
+	char		*user;		/**< The service user */
+	char		*passwd;	/**< Its password, as configured */
+	int		enable_root;	/**< The root users are loaded */
+	struct server	**servers;	/**< The backend servers, in any order */
+	int		n_servers;	/**< Number of the backend servers */
+	SERVICE		**services;	/**< The services sharing the table */
+	int		n_services;	/**< Number of the services */
+	USERS		*users;		/**< The table, held by the source */
+	int		nusers;		/**< Users in the table, -1 if it
+					 * could not be loaded */
+	time_t		checked;	/**< End of the last load or check */
+	pthread_mutex_t	lock;		/**< Loads and checks of the source */
+	struct mysql_users_source
+			*next;
+} MYSQL_USERS_SOURCE;
+
 extern int load_mysql_users(SERVICE *service);
+extern int load_mysql_users_snapshot(SERVICE *service);
 extern int reload_mysql_users(SERVICE *service);
 extern int mysql_users_add(USERS *users, MYSQL_USER_HOST *key, char *auth);
 extern USERS *mysql_users_alloc();
 extern char *mysql_users_fetch(USERS *users, MYSQL_USER_HOST *key);
+extern char *mysql_users_fetch_wildcard(USERS *users, MYSQL_USER_HOST *key);
+extern int mysql_users_parse_host(char *host, struct sockaddr_in *addr, int *hostbits);
 extern int replace_mysql_users(SERVICE *service);
+extern int refresh_mysql_users(SERVICE *service, time_t since);
 #endif
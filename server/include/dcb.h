@@ -21,14 +21,19 @@
 #include <buffer.h>
 #include <modinfo.h>
 #include <gwbitmask.h>
+#include <timer.h>
 #include <skygw_utils.h>
 #include <netinet/in.h>
+#include <time.h>
+#include <sys/uio.h>
 
 #define ERRHANDLE
 
 struct session;
 struct server;
 struct service;
+struct tls_context;
+struct tls_session;
 
 /**
  * @file dcb.h	The Descriptor Control Block
@@ -76,6 +81,10 @@ struct dcb;
 	 *	listen		Create a listener for the protocol
 	 *	auth		Authentication entry point
          *	session		Session handling entry point
+	 *	reuse		Check that an idle connection may be kept in
+	 *			the persistent pool of its server, when the
+	 *			session is NULL, or make a pooled connection
+	 *			ready for use by the session
 	 * @endverbatim
 	 *
 	 * This forms the "module object" for protocol modules within the gateway.
@@ -94,6 +103,7 @@ typedef struct gw_protocol {
 	int		(*listen)(struct dcb *, char *);
 	int		(*auth)(struct dcb *, struct server *, struct session *, GWBUF *);
 	int		(*session)(struct dcb *, void *);
+	int		(*reuse)(struct dcb *, struct session *);
 } GWPROTOCOL;
 
 /**
@@ -101,7 +111,7 @@ typedef struct gw_protocol {
  * the GWPROTOCOL structure is changed. See the rules defined in modinfo.h
  * that define how these numbers should change.
  */
-#define	GWPROTOCOL_VERSION	{1, 0, 0}
+#define	GWPROTOCOL_VERSION	{1, 1, 0}
 
 /**
  * The statitics gathered on a descriptor control block
@@ -113,6 +123,7 @@ typedef struct dcbstats {
 	int		n_buffered;	/*< Number of buffered writes */
 	int		n_high_water;	/*< Number of crosses of high water mark */
 	int		n_low_water;	/*< Number of crosses of low water mark */
+	int		n_read_paused;	/*< Number of reads paused for a peer */
 } DCBSTATS;
 
 /**
@@ -126,15 +137,17 @@ typedef struct dcbstats {
  * call, the is the only way we can be sure that no polling thread is pending a wakeup or
  * processing an event that will access the DCB.
  *
- * We solve this issue by making the dcb_free routine merely mark a DCB as a zombie and
- * place it on a special zombie list. Before placing the DCB on the zombie list we create
- * a bitmask with a bit set in it for each active polling thread. Each thread will call
- * a routine to process the zombie list at the end of the polling loop. This routine
- * will clear the bit value that corresponds to the calling thread. Once the bitmask
- * is completely cleared the DCB can finally be freed and removed from the zombie list.
+ * We solve this issue with epoch based reclamation. The dcb_free routine merely marks
+ * a DCB as a zombie and places it, tagged with the current global epoch, on the zombie
+ * list of the calling polling thread. Each polling thread announces the epoch it has
+ * seen every time it passes the end of the polling loop, the point at which it holds
+ * no DCB references, and the global epoch is advanced once every thread has announced
+ * it. A zombie tagged with epoch E can no longer be referenced once the global epoch
+ * has reached E + 2 and it is then freed by the thread that owns it. Neither adding a
+ * zombie nor freeing one takes a global lock.
  */
 typedef struct {
-	GWBITMASK	bitmask;	/*< The bitmask of threads */
+	unsigned long	epoch;		/*< The global epoch when the DCB became a zombie */
 	struct dcb	*next;		/*< Next pointer for the zombie list */
 } DCBMM;
 
@@ -169,6 +182,19 @@ typedef enum {
         DCB_REASON_NOT_RESPONDING       /*< Server connection was lost */
 } DCB_REASON;
 
+#define	DCB_N_REASONS	(DCB_REASON_NOT_RESPONDING + 1)
+#define	DCB_REASON_BIT(r)	(1 << (r))
+
+/**
+ * A request written to a backend DCB before the backend is ready for it,
+ * kept in the delay queue of the DCB with the command of the request.
+ */
+typedef struct dcb_pending {
+	GWBUF		*buffer;	/*< The request */
+	int		command;	/*< The protocol command of the request */
+	int		tracked;	/*< Non-zero if the reply is tracked */
+} DCB_PENDING;
+
 /**
  * Callback structure - used to track callbacks registered on a DCB
  */
@@ -219,21 +245,60 @@ typedef struct dcb {
 	SPINLOCK	writeqlock;	/**< Write Queue spinlock */
 	GWBUF		*writeq;	/**< Write Data Queue */
 	SPINLOCK	delayqlock;	/**< Delay Backend Write Queue spinlock */
-	GWBUF		*delayq;	/**< Delay Backend Write Data Queue */
+	DCB_PENDING	*delayq;	/**< Delay Backend Write Queue, a ring */
+	int		delayq_size;	/**< Number of entries of the ring */
+	int		delayq_first;	/**< Index of the oldest request */
+	int		delayq_count;	/**< Number of requests in the ring */
 	GWBUF           *dcb_readqueue; /**< read queue for storing incomplete reads */
 	SPINLOCK	authlock;	/**< Generic Authorization spinlock */
 
 	DCBSTATS	stats;		/**< DCB related statistics */
         unsigned int    dcb_server_status; /*< the server role indicator from SERVER */
 	struct dcb	*next;		/**< Next DCB in the chain of allocated DCB's */
+	struct dcb	*prev;		/**< Previous DCB in the chain */
 	struct service	*service;	/**< The related service */
 	void		*data;		/**< Specific client data */
 	DCBMM		memdata;	/**< The data related to DCB memory management */
-	SPINLOCK	cb_lock;	/**< The lock for the callbacks linked list */
-	DCB_CALLBACK	*callbacks;	/**< The list of callbacks for the DCB */
+	SPINLOCK	cb_lock;	/**< The lock for the callbacks linked lists */
+	DCB_CALLBACK	*callbacks[DCB_N_REASONS]; /**< The callbacks of each reason */
+	unsigned int	cb_mask;	/**< DCB_REASON_BIT of the reasons with callbacks */
 
 	unsigned int	high_water;	/**< High water mark */
 	unsigned int	low_water;	/**< Low water mark */
+	int		read_size;	/**< Buffer size used by the next dcb_read */
+	int		owner_thread;	/**< Polling thread whose epoll set holds the DCB */
+	int		numa_node;	/**< Node of the thread that created the DCB */
+	struct dcb	*listener_copy;	/**< Per thread copies of a listener */
+	void		*protocol_cache; /**< Protocol object kept by a pooled DCB */
+	size_t		protocol_size;	/**< Size of the dcb_protocol_alloc object */
+	DCB_CALLBACK	*cb_spare;	/**< Unused callback entries for reuse */
+	TIMER		timer;		/**< Idle or connect timeout */
+	int		idle_timeout;	/**< Idle timeout in seconds, 0 if none */
+	unsigned long	last_activity;	/**< Time of the last read or write, in msecs */
+	struct server	*server;	/**< The server of a backend DCB */
+	struct dcb	*nextpersistent; /**< Next DCB in the persistent pool */
+	time_t		persistentstart; /**< When the DCB was pooled, 0 if in use */
+	struct dcb	*splice_to;	/**< The DCB the data read is spliced to */
+	int		splice_pipe[2];	/**< The pipe data is spliced through */
+	int		splice_pending;	/**< Bytes in the pipe not yet written */
+	struct dcb	*paused;	/**< DCBs whose reads wait for this writeq */
+	struct dcb	*paused_by;	/**< The DCB whose writeq the reads wait for */
+	struct dcb	*paused_next;	/**< Next DCB paused by the same DCB */
+	struct tls_context *tls_ctx;	/**< TLS of the clients of a listener */
+	struct tls_session *tls;	/**< TLS of the connection, NULL if none */
+	int		corked;		/**< Writes held until the poll event is done */
+	struct dcb	*corked_next;	/**< Next DCB with writes held for the event */
+	int		mail_pending;	/**< Writes posted to the owner, not yet done */
+	SPINLOCK	poll_lock;	/**< The lock of the claim of the events */
+	int		poll_busy;	/**< A polling thread runs its handlers */
+	unsigned int	poll_pending;	/**< Events for the thread that runs them */
+	TIMER		write_timer;	/**< Write stall timeout of a client */
+	unsigned long	last_written;	/**< Time of the last write, in msecs */
+	int		print_held;	/**< dcb_printf output held, see dcb_printf_begin */
+	GWBUF		*printq;	/**< The output held */
+	GWBUF		*printq_tail;	/**< Its last buffer, printed into */
+	int		printq_room;	/**< Bytes free at the end of printq_tail */
+	int		printq_len;	/**< Bytes held */
 #if defined(SS_DEBUG)
         int             dcb_port;       /**< port of target server */
         skygw_chk_t     dcb_chk_tail;
@@ -249,17 +314,59 @@ int           fail_next_accept;
 int           fail_accept_errno;
 #endif
 
+/**
+ * A copy of the details of a DCB that the diagnostics print. The copies are
+ * made a batch at a time with the list of the DCBs locked, and printed once
+ * the lock is released, so that printing thousands of DCBs does not hold up
+ * the threads that create and close them.
+ */
+#define	DCB_INFO_NAMELEN	64
+
+typedef struct {
+	void		*dcb;		/**< Address of the DCB, only to print */
+	void		*session;	/**< Address of the session, only to print */
+	dcb_state_t	state;		/**< State of the DCB */
+	dcb_role_t	role;		/**< Role of the DCB */
+	int		flags;		/**< DCB flags */
+	int		is_client;	/**< The DCB is the client of its session */
+	int		writeqlen;	/**< Bytes in the write queue */
+	char		service[DCB_INFO_NAMELEN];	/**< Name of the service */
+	char		remote[DCB_INFO_NAMELEN];	/**< Address of remote end */
+	char		user[DCB_INFO_NAMELEN];		/**< User name */
+	DCBSTATS	stats;		/**< DCB related statistics */
+} DCB_INFO;
+
+#define	DCB_INFO_BATCH		32	/**< DCBs copied each time the list is locked */
+
+/**
+ * The objects a diagnostic list prints, those of one service and a page of
+ * them. A range is used once, it counts the objects as they are listed.
+ */
+typedef struct diag_range {
+	char	*service;	/**< Only the objects of this service, NULL for all */
+	int	first;		/**< Matching objects to skip */
+	int	count;		/**< Most objects to print, 0 for all */
+	int	seen;		/**< Matching objects so far */
+	int	more;		/**< Objects were left out at the end of the page */
+} DIAG_RANGE;
+
+#define	DCB_READ_SIZE_MIN	512	/**< Smallest buffer dcb_read reads into */
+#define	DCB_SPLICE_SIZE		65536	/**< Most bytes moved by one splice */
+#define	DCB_PRINT_LINE		512	/**< Bytes dcb_printf formats on the stack */
+#define	DCB_PRINT_CHUNK		8192	/**< Buffer size of the held printed output */
+#define	DCB_PRINT_FLUSH		65536	/**< Held output written before the end */
+
 /* A few useful macros */
 #define	DCB_SESSION(x)			(x)->session
 #define DCB_PROTOCOL(x, type)		(type *)((x)->protocol)
 #define	DCB_ISZOMBIE(x)			((x)->state == DCB_STATE_ZOMBIE)
 #define	DCB_WRITEQLEN(x)		(x)->writeqlen
 #define DCB_SET_LOW_WATER(x, lo)	(x)->low_water = (lo);
-#define DCB_SET_HIGH_WATER(x, hi)	(x)->low_water = (hi);
+#define DCB_SET_HIGH_WATER(x, hi)	(x)->high_water = (hi);
 #define DCB_BELOW_LOW_WATER(x)		((x)->low_water && (x)->writeqlen < (x)->low_water)
 #define DCB_ABOVE_HIGH_WATER(x)		((x)->high_water && (x)->writeqlen > (x)->high_water)
 
-DCB             *dcb_get_zombies(void);
+int             dcb_get_zombies(void);
 int             gw_write(
 #if defined(SS_DEBUG)
         DCB*        dcb,
@@ -267,23 +374,55 @@ int             gw_write(
         int         fd, 
         const void* buf, 
         size_t      nbytes);
+int             gw_writev(
+#if defined(SS_DEBUG)
+        DCB*                dcb,
+#endif
+        int                 fd,
+        const struct iovec* iov,
+        int                 iovcnt);
 int             dcb_write(DCB *, GWBUF *);
 DCB             *dcb_alloc(dcb_role_t);
 void            dcb_free(DCB *);
 DCB             *dcb_connect(struct server *, struct session *, const char *);	
 DCB		*dcb_clone(DCB *);
+void		*dcb_protocol_alloc(DCB *, size_t);
 int             dcb_read(DCB *, GWBUF **);
 int             dcb_drain_writeq(DCB *);
+int		dcb_splice(DCB *, DCB *);		/* Forward two DCBs in the kernel */
+int		dcb_splice_read(DCB *);			/* Splice the data read from a DCB */
+int		dcb_read_throttle(DCB *, DCB *);	/* Pause a read for the writeq of a peer */
+int		dcb_read_pause(DCB *, DCB *);		/* Pause the reads until a peer resumes them */
+void		dcb_read_resume(DCB *);			/* Resume the reads paused for a DCB */
+int		dcb_delayq_add(DCB *, GWBUF *, int, int); /* Delay a request */
+int		dcb_delayq_take(DCB *, DCB_PENDING *);	/* Take the oldest delayed request */
+void		dcb_delayq_free(DCB *);			/* Discard the delayed requests */
+int		dcb_tls_accept(DCB *, GWBUF *);		/* Switch a client DCB to TLS */
 void            dcb_close(DCB *);
-DCB		*dcb_process_zombies(int);		/* Process Zombies */
+int		dcb_park(DCB *);			/* Keep an idle backend DCB for reuse */
+int		dcb_process_zombies(int);		/* Process Zombies */
+void		dcb_cork_writes();			/* Hold coalesced writes for the event */
+void		dcb_flush_writes();			/* Send the writes held for the event */
+void		dcb_thread_init(int);			/* Register a polling thread */
+void		dcb_thread_done();			/* Unregister a polling thread */
 void		printAllDCBs();				/* Debug to print all DCB in the system */
 void		printDCB(DCB *);			/* Debug print routine */
 void		dprintAllDCBs(DCB *);			/* Debug to print all DCB in the system */
+void		dprintDCBPool(DCB *);			/* Debug to print the DCB pool */
 void		dprintDCB(DCB *, DCB *);		/* Debug to print a DCB in the system */
 void		dListDCBs(DCB *);			/* List all DCBs in the system */
 void		dListClients(DCB *);			/* List al the client DCBs */
+void		dprintDCBRange(DCB *, DIAG_RANGE *);	/* Debug to print a page of DCBs */
+void		dListDCBRange(DCB *, DIAG_RANGE *);	/* List a page of DCBs */
+void		dListClientRange(DCB *, DIAG_RANGE *);	/* List a page of client DCBs */
+int		dcb_foreach_info(int (*)(DCB_INFO *, void *), void *);
+							/* Walk copies of the DCBs */
+int		diag_range_select(DIAG_RANGE *, char *); /* Is an object in a range */
+void		diag_range_more(DCB *, DIAG_RANGE *);	/* Tell of the objects after a page */
 const char 	*gw_dcb_state2string(int);		/* DCB state to string */
 void		dcb_printf(DCB *, const char *, ...);	/* DCB version of printf */
+void		dcb_printf_begin(DCB *);
+void		dcb_printf_end(DCB *);
 int		dcb_isclient(DCB *);			/* the DCB is the client of the session */
 void		dcb_hashtable_stats(DCB *, void *);	/**< Print statisitics */
 void            dcb_add_to_zombieslist(DCB* dcb);
@@ -292,6 +431,8 @@ int		dcb_add_callback(DCB *, DCB_REASON, int	(*)(struct dcb *, DCB_REASON, void
 int		dcb_remove_callback(DCB *, DCB_REASON, int	(*)(struct dcb *, DCB_REASON),
 			 void *);
 int		dcb_isvalid(DCB *);			/* Check the DCB is in the linked list */
+void		dcb_set_idle_timeout(DCB *, int);	/* Close the DCB when idle */
+void		dcb_set_connect_timeout(DCB *, int);	/* Close the DCB if it never answers */
 
 bool dcb_set_state(
         DCB*         dcb,
@@ -305,4 +446,10 @@ void dcb_call_foreach (
 
 /* DCB flags values */
 #define	DCBF_CLONE		0x0001	/* DCB is a clone */
+#define	DCBF_TIMED_OUT		0x0002	/* DCB was shut down by its timer */
+#define	DCBF_FAILURE_COUNTED	0x0004	/* Failure counted for the server */
+#define	DCBF_ADMITTED		0x0008	/* Client counted in the service limit */
+#define	DCBF_QUEUED		0x0010	/* Client waiting for admission */
+#define	DCBF_COALESCE		0x0020	/* Writes of a poll event sent together */
+#define	DCBF_CURSOR		0x0040	/* Not a DCB, the place of a walk of the list */
 #endif /*  _DCB_H */
@@ -64,6 +64,19 @@ typedef struct {
  *	clientReply		Called for each reply packet
  * 	diagnostics		Called to force the filter to print
  * 				diagnostic output
+ *	routeBatch		Called with a chain of complete packets, one
+ *				packet in each buffer. Optional, the session
+ *				routes batches only if all of the filters and
+ *				the router give it.
+ *	getInterest		Called once after newSession to get the
+ *				requests the filter session wants to see, a
+ *				mask of the FILTER_INTEREST bits. Optional,
+ *				without it the filter sees every request.
+ *				Requests outside the mask go past the filter,
+ *				a filter with no interest is left out of the
+ *				session altogether. Batches and replies are
+ *				not split, a filter that has any interest
+ *				sees all of them.
  *
  * @endverbatim
  *
@@ -79,14 +92,28 @@ typedef struct filter_object {
 	int	(*routeQuery)(FILTER *instance, void *fsession, GWBUF *queue);
 	int	(*clientReply)(FILTER *instance, void *fsession, GWBUF *queue);
 	void	(*diagnostics)(FILTER *instance, void *fsession, DCB *dcb);
+	int	(*routeBatch)(FILTER *instance, void *fsession, GWBUF *queue);
+	int	(*getInterest)(FILTER *instance, void *fsession);
 } FILTER_OBJECT;
 
+/**
+ * The requests a filter session may be interested in. A COM_QUERY is a
+ * read if it starts with SELECT, SHOW, DESC, DESCRIBE or EXPLAIN, this is
+ * only a look at the first word. Any other packet, including the later
+ * packets of a statement that does not fit in one packet, is a command.
+ */
+#define	FILTER_INTEREST_READ	0x01	/**< COM_QUERY that reads */
+#define	FILTER_INTEREST_WRITE	0x02	/**< Any other COM_QUERY */
+#define	FILTER_INTEREST_COMMAND	0x04	/**< Any other request */
+#define	FILTER_INTEREST_QUERY	(FILTER_INTEREST_READ|FILTER_INTEREST_WRITE)
+#define	FILTER_INTEREST_ALL	(FILTER_INTEREST_QUERY|FILTER_INTEREST_COMMAND)
+
 /**
  * The filter API version. If the FILTER_OBJECT structure or the filter API
  * is changed these values must be updated in line with the rules in the
  * file modinfo.h.
  */
-#define FILTER_VERSION	{1, 1, 0}
+#define FILTER_VERSION	{1, 3, 0}
 /**
  * The definition of a filter from the configuration file.
  * This is basically the link between a plugin to load and the
@@ -113,6 +140,7 @@ void		filterAddParameter(FILTER_DEF *, char *, char *);
 DOWNSTREAM	*filterApply(FILTER_DEF *, SESSION *, DOWNSTREAM *);
 UPSTREAM	*filterUpstream(FILTER_DEF *, void *, UPSTREAM *);
 int		filter_standard_parameter(char *);
+int		filter_classify(GWBUF *);
 void		dprintAllFilters(DCB *);
 void		dprintFilter(DCB *, FILTER_DEF *);
 void		dListFilters(DCB *);
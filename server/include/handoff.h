@@ -0,0 +1,53 @@
+#ifndef _HANDOFF_H
+#define _HANDOFF_H
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file handoff.h	The handoff of the listeners to a restarted MaxScale
+ *
+ * With handoff on, a MaxScale that starts while another one runs connects
+ * to the handoff socket of the running one and receives its listening
+ * sockets, the per thread copies included, with SCM_RIGHTS. The protocol
+ * modules and the copies of the listeners take the received sockets of
+ * their addresses instead of binding new ones. Once the new MaxScale
+ * polls its listeners it tells the old one, which stops accepting and
+ * shuts down when its sessions have closed or handoff_drain_timeout has
+ * passed. No listener is ever closed, a client connecting during the
+ * restart is accepted by one process or the other.
+ */
+#include <sys/socket.h>
+
+#define	HANDOFF_SOCKET		"maxscale.handoff" /**< Default socket in the
+						    * home directory */
+#define	HANDOFF_MAX_SOCKETS	1024	/**< Sockets handed over at most */
+#define	HANDOFF_TIMEOUT		120	/**< Seconds the old MaxScale waits for
+					 * the new one to poll its listeners */
+
+/** The messages of the handoff socket */
+#define	HANDOFF_MSG_LISTENER	'L'	/**< One listening socket attached */
+#define	HANDOFF_MSG_END		'E'	/**< No more sockets */
+#define	HANDOFF_MSG_TAKEN	'T'	/**< The new MaxScale has taken over */
+
+extern int	handoff_receive(char *home_dir);
+extern int	handoff_take(struct sockaddr *addr, socklen_t addrlen);
+extern void	handoff_start(char *home_dir);
+extern void	handoff_stop();
+extern int	handoff_handed_over();
+
+#endif
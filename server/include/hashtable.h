@@ -50,6 +50,53 @@ typedef struct hashentry {
 	struct	hashentry	*next;	/**< The overflow chain */
 } HASHENTRIES;
 
+/**
+ * A set of chains. While a resize is in progress the current chains refer
+ * to the chains being emptied into them, so that a fetch sees a consistent
+ * pair through the single chains pointer of the table.
+ */
+typedef struct hashchains {
+	int			size;		/**< The number of chains */
+	HASHENTRIES		**entries;	/**< The chains themselves */
+	struct hashchains	*old;		/**< Chains being rehashed or NULL */
+} HASHCHAINS;
+
+/**
+ * A slot of an open addressing table, the full hash is kept with the key so
+ * that only keys with an equal hash are compared and the table can be
+ * rebuilt without calling the hash function.
+ */
+typedef struct hashslot {
+	int		hash;		/**< The hash value of the key */
+	void		*key;		/**< The key */
+	void		*value;		/**< The value associated with key */
+} HASHSLOT;
+
+/**
+ * An open addressing table. The slots are searched a group at a time using
+ * a control byte per slot, see hashtable.c.
+ */
+typedef struct hashopen {
+	int		n_groups;	/**< Number of groups, a power of two */
+	int		n_used;		/**< Slots in use or deleted */
+	unsigned char	*ctrl;		/**< The control byte of each slot */
+	HASHSLOT	*slots;		/**< The slots */
+} HASHOPEN;
+
+#define	HASHOPEN_GROUP		16	/**< Slots searched together */
+#define	HASHOPEN_EMPTY		0x80	/**< Control byte of a free slot */
+#define	HASHOPEN_DELETED	0xFE	/**< Control byte of a deleted entry */
+#define	HASHOPEN_FULL(c)	(((c) & 0x80) == 0)
+#define	HASHOPEN_SIZE(open)	((open)->n_groups * HASHOPEN_GROUP)
+#define	HASHOPEN_MAX_LOAD_N	7	/**< Rebuild when 7/8 of the slots are used */
+#define	HASHOPEN_MAX_LOAD_D	8
+
+/**
+ * The types of hashtable that may be allocated with hashtable_alloc_type
+ */
+#define	HASHTABLE_CHAINED	0	/**< Linked chains of entries */
+#define	HASHTABLE_OPEN		1	/**< Open addressing with inline slots */
+
 /**
  * HASHTABLE iterator - used to walk the hashtable in a thread safe
  * way
@@ -61,6 +108,17 @@ typedef struct hashiterator {
 	int		depth;		/**< The current depth down the chain */
 } HASHITERATOR;
 
+/**
+ * The table grows to twice its size when there are more than
+ * HASHTABLE_MAX_LOAD entries per chain on average and shrinks to half its
+ * size, but never below the size it was created with, when there are less
+ * than one entry per HASHTABLE_MIN_LOAD chains. The entries are moved to
+ * the new chains a few chains at a time by each add and delete.
+ */
+#define	HASHTABLE_MAX_LOAD	2	/**< Entries per chain that trigger growth */
+#define	HASHTABLE_MIN_LOAD	8	/**< Chains per entry that trigger a shrink */
+#define	HASHTABLE_REHASH_STEP	4	/**< Chains rehashed by each update */
+
 /**
  * The type definition for the memory allocation functions
  */
@@ -73,8 +131,11 @@ typedef struct hashtable {
 #if defined(SS_DEBUG)
         skygw_chk_t     ht_chk_top;
 #endif
-	int		hashsize;			/**< The number of HASHENTRIES */
-	HASHENTRIES	**entries;			/**< The entries themselves */
+	HASHCHAINS	*volatile chains;		/**< The current chains */
+	HASHOPEN	*volatile open;			/**< The slots of an open table */
+	int		minsize;			/**< The size requested at creation */
+	int		n_elements;			/**< Number of entries in the table */
+	int		rehashidx;			/**< Next old chain to rehash */
 	int		(*hashfn)(void *);		/**< The hash function */
 	int		(*cmpfn)(void *, void *);	/**< The key comparison function */
 	HASHMEMORYFN	kcopyfn;			/**< Optional key copy function */
@@ -91,6 +152,8 @@ typedef struct hashtable {
 
 extern HASHTABLE	*hashtable_alloc(int, int (*hashfn)(), int (*cmpfn)());
 				/**< Allocate a hashtable */
+extern HASHTABLE	*hashtable_alloc_type(int, int (*hashfn)(), int (*cmpfn)(), int);
+				/**< Allocate a hashtable of a given type */
 extern void		hashtable_memory_fns(HASHTABLE *, HASHMEMORYFN, HASHMEMORYFN, HASHMEMORYFN, HASHMEMORYFN);
 				/**< Provide an interface to control key/value memory
 				 * manipulation
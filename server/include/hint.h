@@ -0,0 +1,53 @@
+#ifndef _HINT_H
+#define _HINT_H
+/*
+ * This file is distributed as part of MaxScale from SkySQL.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file hint.h  The routing hints that may be given in SQL comments
+ */
+#include <buffer.h>
+
+/**
+ * The types of routing hint
+ */
+typedef enum {
+	HINT_ROUTE_TO_MASTER = 1,	/*< Route the statement to the master */
+	HINT_ROUTE_TO_SLAVE,		/*< Route the statement to a slave */
+	HINT_ROUTE_TO_NAMED_SERVER,	/*< Route to the server named in data */
+	HINT_PARAMETER			/*< Parameter data set to value */
+} HINT_TYPE;
+
+/**
+ * A routing hint. The hints of a statement are kept in the order they
+ * were given.
+ */
+typedef struct hint {
+	HINT_TYPE	type;		/*< The type of the hint */
+	char		*data;		/*< The server or parameter name or NULL */
+	char		*value;		/*< The parameter value or NULL */
+	struct hint	*next;		/*< The next hint of the statement */
+} HINT;
+
+extern HINT	*hint_parse(char *, int);
+extern HINT	*hint_get(GWBUF *);
+extern int	hint_add(GWBUF *, HINT_TYPE, char *, char *);
+extern HINT	*hint_route(HINT *);
+extern char	*hint_parameter(HINT *, char *);
+extern void	hint_free(HINT *);
+#endif
@@ -0,0 +1,48 @@
+#ifndef _LOCALREAD_H
+#define _LOCALREAD_H
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file localread.h	The statements answered without a backend
+ *
+ * A router may answer the simple SELECTs of the connection pools, such as
+ * SELECT 1 and SELECT @@tx_isolation, from the variables of the server the
+ * monitor has read, see server_get_variable. Only a known set of variables
+ * is answered. The variables that a session may change are only answered
+ * until the session changes any of its state, and the values are as fresh
+ * as the last monitor pass.
+ */
+#include <buffer.h>
+#include <server.h>
+
+#define	LOCALREAD_MAX_COLUMNS	16	/**< Columns of a statement answered */
+#define	LOCALREAD_NAMELEN	256	/**< Longest column name */
+#define	LOCALREAD_VALUELEN	1024	/**< Longest value of a variable */
+
+/**
+ * The status flags of the EOF packets of the result sets
+ */
+#define	LOCALREAD_STATUS_IN_TRANS	0x0001
+#define	LOCALREAD_STATUS_AUTOCOMMIT	0x0002
+
+extern GWBUF	*localread_reply(GWBUF *queue, SERVER *server, int changed,
+					int status);
+extern char	*localread_variables_query();
+
+#endif
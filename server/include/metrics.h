@@ -0,0 +1,47 @@
+#ifndef _METRICS_H
+#define _METRICS_H
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file metrics.h
+ *
+ * The counters and latency histograms of the services, the servers and the
+ * polling threads in a machine readable form, the Prometheus text format or
+ * JSON. The values are read from the per thread counters without locking,
+ * only the lists of the services and of the servers are read locked.
+ *
+ * A METRICS_DELTA keeps the values of the last collection, each following
+ * collection gives only the values that have changed since.
+ */
+#include <buffer.h>
+
+#define	METRICS_PROMETHEUS	0	/**< Prometheus text format 0.0.4 */
+#define	METRICS_JSON		1	/**< A JSON object */
+
+#define	METRICS_PROMETHEUS_TYPE	"text/plain; version=0.0.4"
+#define	METRICS_JSON_TYPE	"application/json"
+
+typedef struct metrics_delta METRICS_DELTA;
+
+extern GWBUF		*metrics_collect(int format);
+extern METRICS_DELTA	*metrics_delta_alloc();
+extern GWBUF		*metrics_delta_collect(METRICS_DELTA *delta,
+					unsigned long now);
+extern void		metrics_delta_free(METRICS_DELTA *delta);
+#endif
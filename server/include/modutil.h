@@ -31,9 +31,46 @@
  * @endverbatim
  */
 #include <buffer.h>
+#include <stdint.h>
+
+/**
+ * The fingerprint of a statement. The canonical text is the statement with
+ * the string and numeric literals replaced by '?' and white space collapsed,
+ * statements that differ only by their literals have the same fingerprint.
+ *
+ * The fingerprint is attached to the buffer and remains valid until the
+ * buffer is freed or the statement is modified with modutil_replace_SQL.
+ */
+typedef struct modutil_fingerprint {
+	uint64_t	fingerprint;	/*< 64 bit hash of the canonical text */
+	int		length;		/*< Length of the canonical text */
+	char		canonical[1];	/*< The canonical text, NULL terminated */
+} MODUTIL_FINGERPRINT;
+
+/**
+ * A view of one segment of the SQL text of a statement. A statement that is
+ * in a chain of buffers has a segment in each buffer, the text is not
+ * copied into the view.
+ */
+typedef struct modutil_sql_view {
+	GWBUF		*buffer;	/*< The buffer of the segment */
+	char		*segment;	/*< The segment, not NULL terminated */
+	int		length;		/*< Length of the segment */
+	int		remaining;	/*< Length of the text after the segment */
+} MODUTIL_SQL_VIEW;
 
 extern int	modutil_is_SQL(GWBUF *);
 extern int	modutil_extract_SQL(GWBUF *, char **, int *);
 extern int	modutil_MySQL_Query(GWBUF *, char **, int *, int *);
 extern GWBUF	*modutil_replace_SQL(GWBUF *, char *);
+extern GWBUF	*modutil_rewrite_SQL(GWBUF *, int, int, char *, int);
+extern char	*modutil_get_SQL(GWBUF *);
+extern int	modutil_sql_view(GWBUF *, MODUTIL_SQL_VIEW *);
+extern int	modutil_sql_view_next(MODUTIL_SQL_VIEW *);
+extern int	modutil_sql_contiguous(GWBUF *, char **, int *);
+extern GWBUF	*modutil_create_mysql_err_msg(int, int, const char *,
+			const char *);
+extern GWBUF	*modutil_create_mysql_ok(int, int);
+extern MODUTIL_FINGERPRINT
+		*modutil_get_fingerprint(GWBUF *);
 #endif
@@ -59,6 +59,14 @@
  *
  * unregisterServer is called to remove a server from the set of servers that need to be
  * monitored.
+ *
+ * setHeartbeatInterval sets the interval in milliseconds of a replication heartbeat that
+ * runs apart from the monitoring of the servers, it may be NULL in a monitor that has
+ * no such heartbeat.
+ *
+ * setProbeInterval sets the interval in milliseconds of a liveness probe of the
+ * servers that runs between the monitoring passes, it may be NULL in a monitor that
+ * has no such probe.
  */
 typedef struct {
 	void 	*(*startMonitor)(void *);
@@ -70,13 +78,15 @@ typedef struct {
 	void	(*setInterval)(void *, unsigned long);
 	void	(*defaultId)(void *, unsigned long);
 	void	(*replicationHeartbeat)(void *, int);
+	void	(*setHeartbeatInterval)(void *, unsigned long);
+	void	(*setProbeInterval)(void *, unsigned long);
 } MONITOR_OBJECT;
 
 /**
  * The monitor API version number. Any change to the monitor module API
  * must change these versions usign the rules defined in modinfo.h
  */
-#define	MONITOR_VERSION	{1, 0, 0}
+#define	MONITOR_VERSION	{1, 1, 0}
 
 /**
  * Monitor state bit mask values
@@ -110,4 +120,6 @@ extern void	monitorList(DCB *);
 extern void     monitorSetId(MONITOR *, unsigned long);
 extern void     monitorSetInterval (MONITOR *, unsigned long);
 extern void     monitorSetReplicationHeartbeat(MONITOR *, int);
+extern void     monitorSetHeartbeatInterval(MONITOR *, unsigned long);
+extern void     monitorSetProbeInterval(MONITOR *, unsigned long);
 #endif
@@ -19,6 +19,7 @@
  */
 #include <dcb.h>
 #include <gwbitmask.h>
+#include <statistics.h>
 
 /**
  * @file poll.h	The poll related functionality 
@@ -34,11 +35,57 @@
 #define	MAX_EVENTS	1000
 #define	EPOLL_TIMEOUT	1000	/**< The epoll timeout in milliseconds */
 
+/**
+ * The event counters and the load of one polling thread, the times are in
+ * microseconds
+ */
+typedef struct {
+	int	n_polls;	/**< Poll cycles that found events */
+	int	n_reads;	/**< Read events */
+	int	n_writes;	/**< Write events */
+	int	n_errors;	/**< Error events */
+	int	n_hangups;	/**< Hangup events */
+	int	n_accepts;	/**< Accept events */
+	int	n_stolen;	/**< Events taken from the other threads */
+	int	n_dcbs;		/**< DCBs in its epoll set, -1 if shared */
+	long	n_events;	/**< Events processed */
+	long	busy_usecs;	/**< Time spent in the event handlers */
+	long	idle_usecs;	/**< Time polling, or parked, since it started */
+	long	avg_event_usecs; /**< Average time in an event handler */
+	long	max_event_usecs; /**< Longest time in an event handler */
+	DCB	*max_dcb;	/**< The DCB of the longest event, may be freed */
+	int	max_fd;		/**< The descriptor of that DCB */
+	DCB	*cur_dcb;	/**< The DCB of the running handler, or NULL */
+	long	cur_usecs;	/**< Time in the running handler */
+} POLL_THREAD_STATS;
+
 extern	void		poll_init();
 extern	int		poll_add_dcb(DCB *);
 extern	int		poll_remove_dcb(DCB *);
+extern	int		poll_rearm_dcb(DCB *);
+extern	int		poll_reuseport(int);
+extern	int		poll_listen(DCB *, int, int, int);
+extern	int		poll_clone_listener(DCB *);
+extern	void		poll_retire_listener(DCB *, int);
+extern	int		poll_restore_listener(DCB *, int);
+extern	int		poll_listener_fds(DCB *, int *, int);
+extern	void		poll_stop_listener(DCB *);
+extern	int		poll_set_threads(int);
+extern	int		poll_active_threads();
 extern	void		poll_waitevents(void *);
 extern	void		poll_shutdown();
+extern	int		poll_owner_thread();
+extern	int		poll_thread_id();
+extern	int		poll_pin_session(struct session *);
+extern	int		poll_writeq_owner(DCB *);
+extern	int		poll_post_write(DCB *, GWBUF *);
+extern	int		poll_post_call(DCB *, void (*)(DCB *, void *), void *);
+extern	void		poll_read_own_mail();
+extern	void		poll_use_priorities();
+extern	int		poll_thread_node();
 extern	GWBITMASK	*poll_bitmask();
 extern	void		dprintPollStats(DCB *);
+extern	void		dprintPollThreads(DCB *);
+extern	void		poll_thread_stats(int, POLL_THREAD_STATS *);
+extern	TS_HIST		*poll_event_latency();
 #endif
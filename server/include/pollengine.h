@@ -0,0 +1,61 @@
+#ifndef _POLLENGINE_H
+#define _POLLENGINE_H
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file pollengine.h	The event engines of the polling threads
+ *
+ * The polling threads wait on event sets, one shared by all the threads or
+ * one for each thread with per_thread_poll. An engine implements the sets:
+ * it adds, raises again and removes the descriptors of a set and waits for
+ * their events. The events are edge triggered, a descriptor is reported
+ * readable or writable when its state changes, and they are reported in an
+ * epoll_event whatever the engine, with the EPOLLIN, EPOLLOUT, EPOLLERR,
+ * EPOLLHUP and EPOLLRDHUP bits.
+ *
+ * The control functions return 0 on success and -1 with errno set on error,
+ * as epoll_ctl does, an add of a descriptor already in the set fails with
+ * EEXIST.
+ */
+#include <sys/epoll.h>
+
+#define	POLL_ENGINE_EPOLL	0	/**< epoll, the default */
+#define	POLL_ENGINE_URING	1	/**< io_uring poll requests */
+
+typedef struct poll_engine {
+	char	*name;			/**< Name of the engine */
+	int	(*create)(int n_sets);	/**< Create the sets, 0 or -1 */
+	int	(*add)(int set, int fd, void *ptr);
+					/**< Add a descriptor, ptr is reported
+					 * with its events */
+	int	(*rearm)(int set, int fd, void *ptr);
+					/**< Report the state of a descriptor
+					 * again, as if it had changed */
+	int	(*remove)(int set, int fd);
+					/**< Remove a descriptor, no events
+					 * are reported for it afterwards */
+	int	(*wait)(int set, struct epoll_event *events, int max,
+			int timeout);	/**< Wait for events, timeout in
+					 * milliseconds or -1, the number of
+					 * events or -1 */
+} POLL_ENGINE;
+
+extern	POLL_ENGINE	*poll_uring_engine();
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef _QCCACHE_H
+#define _QCCACHE_H
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file qccache.h	The saved query classification cache
+ *
+ * The digests, query types and table names of the classification cache are
+ * loaded from qc_cache_file before the services start, so the statements
+ * of the clients that reconnect after a restart are not all parsed again.
+ * The cache is saved by a thread every qc_cache_save_interval seconds and
+ * once more at shutdown.
+ */
+
+#define	QCCACHE_FILE		"qc_cache.dat"	/**< Default file in the home
+						 * directory */
+
+extern void	qccache_start(char *home_dir);
+extern void	qccache_stop();
+
+#endif
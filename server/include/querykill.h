@@ -0,0 +1,43 @@
+#ifndef _QUERYKILL_H
+#define _QUERYKILL_H
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file querykill.h	The killer of the statements that time out
+ *
+ * The statements that run for longer than the query timeout of their
+ * service are killed with a KILL QUERY of the backend thread, sent by the
+ * killer thread on a side connection to the server. The side connections
+ * are made with the credentials of the service, the service user must be
+ * allowed to kill the statements of the other users, and they are kept
+ * open for the next kill.
+ */
+#include <service.h>
+#include <server.h>
+
+#define	QUERYKILL_MAX_QUEUED	256	/**< Kills waiting for the thread */
+#define	QUERYKILL_TIMEOUT	5	/**< Seconds to connect, read and write
+					 * on a side connection */
+
+extern int	querykill_request(SERVICE *service, SERVER *server,
+					unsigned long tid);
+extern void	querykill_start();
+extern void	querykill_stop();
+
+#endif
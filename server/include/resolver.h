@@ -0,0 +1,47 @@
+#ifndef _RESOLVER_H
+#define _RESOLVER_H
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file resolver.h	The cache of the addresses of host names
+ *
+ * The addresses of the backend servers and of the hosts of the MySQL users
+ * are looked up by the resolver thread and kept in a cache. The polling
+ * threads and the loading of the users only read the cache: a name that is
+ * not in it yet is queued for the resolver thread and is not known until
+ * the thread has looked it up. The addresses in the cache are looked up
+ * again by the thread when they are older than RESOLVER_TTL, the old
+ * address is kept if the lookup fails.
+ */
+#include <netinet/in.h>
+
+#define	RESOLVER_TTL		60	/**< Seconds an address is used before it
+					 * is looked up again */
+#define	RESOLVER_RETRY		5	/**< Seconds between the lookups of a name
+					 * that could not be found */
+#define	RESOLVER_WAIT		10	/**< Seconds the loading of the users waits
+					 * for the names of their hosts */
+
+extern int	resolver_lookup(char *name, struct in_addr *addr);
+extern void	resolver_add(char *name);
+extern int	resolver_wait(int timeout);
+extern void	resolver_start();
+extern void	resolver_stop();
+
+#endif
@@ -61,6 +61,14 @@ typedef void *ROUTER;
  *	clientReply		Called to reply to client the data from one or all backends
  *	errorReply		Called to reply to client errors with optional closeSession or
  *				make a request for a new backend connection
+ *	getCapabilities		Called to ask the type of input the router expects
+ *	routeBatch		Called with the complete packets of one read, in the
+ *				order they were read, each buffer of the chain holds
+ *				one packet. Optional, the router sets
+ *				RCAP_TYPE_BATCH_INPUT if it gives it.
+ *	getMetrics		Called by the metrics collection, the router calls
+ *				the given function for each of its counters.
+ *				Optional.
  *
  * @endverbatim
  *
@@ -72,6 +80,15 @@ typedef enum error_action {
 } error_action_t;
 
 
+/**
+ * The function a router's getMetrics calls for each sample of its counters.
+ * The samples of one name have the same help text. The labels are pairs of
+ * a label name and its value, ended by a NULL name, the service is added
+ * by the caller.
+ */
+typedef void (*ROUTER_METRIC_FN)(void *arg, char *name, char *help,
+				char **labels, long value);
+
 typedef struct router_object {
 	ROUTER	*(*createInstance)(SERVICE *service, char **options);
 	void	*(*newSession)(ROUTER *instance, SESSION *session);
@@ -88,6 +105,8 @@ typedef struct router_object {
                         error_action_t action, 
                         bool*          succp);
         uint8_t (*getCapabilities)(ROUTER *instance, void* router_session);
+	int	(*routeBatch)(ROUTER *instance, void *router_session, GWBUF *queue);
+	void	(*getMetrics)(ROUTER *instance, ROUTER_METRIC_FN fn, void *arg);
 } ROUTER_OBJECT;
 
 /**
@@ -95,7 +114,7 @@ typedef struct router_object {
  * must update these versions numbers in accordance with the rules in
  * modinfo.h.
  */
-#define	ROUTER_VERSION	{ 1, 0, 0 }
+#define	ROUTER_VERSION	{ 1, 2, 0 }
 
 /**
  * Router capability type. Indicates what kind of input router accepts.
@@ -103,7 +122,9 @@ typedef struct router_object {
 typedef enum router_capability_t {
         RCAP_TYPE_UNDEFINED    = 0x00,
         RCAP_TYPE_STMT_INPUT   = 0x01, /*< statement per buffer */
-        RCAP_TYPE_PACKET_INPUT = 0x02  /*< data as it was read from DCB */
+        RCAP_TYPE_PACKET_INPUT = 0x02, /*< data as it was read from DCB */
+        RCAP_TYPE_BATCH_INPUT  = 0x04  /*< with STMT_INPUT, the statements
+                                        * of a read may be given together */
 } router_capability_t;
 
         
@@ -17,7 +17,9 @@
  *
  * Copyright SkySQL Ab 2013
  */
+#include <netinet/in.h>
 #include <dcb.h>
+#include <statistics.h>
 
 /**
  * @file service.h
@@ -58,11 +60,50 @@ typedef struct server_params {
  *
  */
 typedef struct {
-	int		n_connections;	/**< Number of connections */
+	TS_STATS	*counters;	/**< The per thread connection counters */
 	int		n_current;	/**< Current connections */
 	int             n_current_ops;  /**< Current active operations */
+	TS_HIST		*latency;	/**< Response times of the server */
 } SERVER_STATS;
 
+/**
+ * The per thread counters of a server. The current connections and
+ * operations drive the routing decisions, they stay plain atomic counters
+ * so that a router can read them cheaply.
+ */
+#define	SERVER_N_CONNECTIONS	0	/**< Number of connections */
+#define	SERVER_N_PERSISTENT	1	/**< Connections taken from the pool */
+#define	SERVER_N_CIRCUIT_OPENED	2	/**< Times the circuit breaker opened */
+#define	SERVER_N_STATS		3
+
+/**
+ * The default number of seconds an idle connection is kept in the
+ * persistent pool of a server
+ */
+#define	SERVER_PERSIST_MAXTIME	3600
+
+/**
+ * The circuit breaker of a server. Connect failures, failed handshakes and
+ * reply timeouts seen by the protocol are counted, when circuit_failures
+ * of them happen within circuit_cooldown seconds the circuit opens and the
+ * routers stop choosing the server. Once the cooldown has passed a single
+ * probe connection is let through, the circuit closes if it succeeds and
+ * opens again if it fails.
+ */
+#define	SERVER_CIRCUIT_FAILURES	5	/**< Default failures that open the circuit */
+#define	SERVER_CIRCUIT_COOLDOWN	10	/**< Default seconds the circuit stays open */
+
+/**
+ * The compressed protocol is used with a server only if compress is set for
+ * it, data shorter than compress_threshold is sent without compression as
+ * the zlib overhead would make it longer.
+ */
+#define	SERVER_COMPRESS_THRESHOLD 50	/**< Default bytes below which data isn't compressed */
+
+#define	SERVER_CIRCUIT_CLOSED	0	/**< The server may be chosen */
+#define	SERVER_CIRCUIT_OPEN	1	/**< The server is not chosen */
+#define	SERVER_CIRCUIT_HALF_OPEN 2	/**< A probe connection tests the server */
+
 /**
  * The SERVER structure defines a backend server. Each server has a name
  * or IP address for the server, a port that the server listens on and
@@ -88,6 +129,35 @@ typedef struct server {
 	long		master_id;	/**< Master server id of this node */
 	int		depth;		/**< Replication level in the tree */
 	long		*slaves;	/**< Slaves of this node */
+	int		persistpoolmax;	/**< Idle connections kept in the pool, 0 for none */
+	int		persistmaxtime;	/**< Seconds an idle connection is kept */
+	DCB		*persistent;	/**< The pool of idle connections */
+	int		n_persistent;	/**< Number of connections in the pool */
+	SPINLOCK	persistlock;	/**< Lock for the pool */
+	int		max_connections; /**< Open connections allowed, 0 for no limit */
+	int		circuit_max_failures; /**< Failures that open the circuit, 0 for no circuit breaker */
+	int		circuit_cooldown; /**< Seconds the circuit stays open */
+	int		circuit_state;	/**< SERVER_CIRCUIT_ state of the circuit */
+	int		circuit_failures; /**< Failures seen since circuit_since */
+	time_t		circuit_since;	/**< Start of the count, the open or the probe */
+	SPINLOCK	circuitlock;	/**< Lock for the circuit state */
+	int		compress;	/**< Use the compressed protocol if the server has it */
+	int		compress_threshold; /**< Bytes below which data isn't compressed */
+	char		*socket;	/**< Unix domain socket of a co-located server,
+					     NULL to connect by TCP */
+	int		fastopen;	/**< Connect with TCP Fast Open */
+	int		wsrep_recv_queue; /**< Galera write sets waiting to be applied */
+	int		wsrep_send_queue; /**< Galera write sets waiting to be sent */
+	int		wsrep_fc_paused; /**< Per mille of the last monitor interval
+					     the cluster was paused by flow control */
+	int		wsrep_fc_sent;	/**< Flow control pauses asked for by the
+					     node in the last monitor interval */
+	int		rlag_ms;	/**< Smoothed replication lag in milliseconds
+					     from the high resolution heartbeat, -1 if
+					     not measured */
+	unsigned long	rlag_ms_ts;	/**< Time in milliseconds rlag_ms was measured */
+	SERVER_PARAM	*variables;	/**< Global variables read by the monitor */
+	SPINLOCK	varlock;	/**< Lock for the variables */
 } SERVER;
 
 /**
@@ -144,6 +214,54 @@ typedef struct server {
 #define SERVER_IS_RELAY_SERVER(server) \
         (((server)->status & (SERVER_RUNNING|SERVER_MASTER|SERVER_SLAVE|SERVER_MAINT)) == (SERVER_RUNNING|SERVER_MASTER|SERVER_SLAVE))
 
+/**
+ * Is the circuit breaker of the server closed, the server may be chosen for
+ * new connections. A server whose circuit is open is only chosen when
+ * server_circuit_probe lets a probe connection through.
+ */
+#define SERVER_CIRCUIT_IS_CLOSED(server) \
+	((server)->circuit_state == SERVER_CIRCUIT_CLOSED)
+
+/**
+ * Has the server as many open connections, in use or in the persistent
+ * pool, as it allows. No new connection is made to a full server.
+ */
+#define SERVER_IS_FULL(server) \
+	((server)->max_connections > 0 && \
+	 (server)->stats.n_current + (server)->n_persistent >= (server)->max_connections)
+
+/**
+ * Is the Galera node holding up the cluster, it asked for flow control in
+ * the last monitor interval as it could not apply the write sets quickly
+ * enough
+ */
+#define SERVER_IS_THROTTLING(server)	((server)->wsrep_fc_sent > 0)
+
+/**
+ * The events of a server that a router, or any other part of MaxScale, may
+ * listen for with server_event_subscribe. A change of the status gives one
+ * call with all of the events of the change.
+ */
+#define	SERVER_EVENT_UP		0x0001	/**< Running and not in maintenance */
+#define	SERVER_EVENT_DOWN	0x0002	/**< No longer running or in maintenance */
+#define	SERVER_EVENT_NEW_MASTER	0x0004	/**< The server became a running master */
+#define	SERVER_EVENT_MASTER_DOWN 0x0008	/**< The server is no longer a running master */
+#define	SERVER_EVENT_SLAVE_UP	0x0010	/**< The server became a running slave */
+#define	SERVER_EVENT_SLAVE_DOWN	0x0020	/**< The server is no longer a running slave */
+#define	SERVER_EVENT_LAG	0x0040	/**< The replication lag changed */
+#define	SERVER_EVENT_CIRCUIT	0x0080	/**< The circuit breaker opened or closed */
+#define	SERVER_EVENT_FLOW_CONTROL 0x0100 /**< The node started or stopped
+					     asking for flow control */
+#define	SERVER_EVENT_STATUS	0x01ff	/**< Any change of the server */
+
+/**
+ * The callback of a listener, called with the events of the server that
+ * the listener asked for. It is called by the thread that changed the
+ * server, often the monitor, with the listener lock held and must neither
+ * block nor subscribe or unsubscribe.
+ */
+typedef void	(*SERVER_EVENT_FN)(int events, SERVER *server, void *data);
+
 extern SERVER	*server_alloc(char *, char *, unsigned short);
 extern int	server_free(SERVER *);
 extern SERVER	*server_find_by_unique_name(char *);
@@ -156,9 +274,29 @@ extern void	dListServers(DCB *);
 extern char	*server_status(SERVER *);
 extern void	server_set_status(SERVER *, int);
 extern void	server_clear_status(SERVER *, int);
+extern void	server_update_status(SERVER *, unsigned int);
+extern int	server_status_version();
+extern void	server_update_lag(SERVER *, int);
+extern void	server_update_lag_ms(SERVER *, int);
+extern void	server_update_flow_control(SERVER *, int, int, int, int);
+extern void	*server_event_subscribe(int, SERVER_EVENT_FN, void *);
+extern void	server_event_unsubscribe(void *);
 extern void	serverAddMonUser(SERVER *, char *, char *);
 extern void	serverAddParameter(SERVER *, char *, char *);
 extern char	*serverGetParameter(SERVER *, char *);
 extern void	server_update(SERVER *, char *, char *, char *);
 extern void     server_set_unique_name(SERVER *, char *);
+extern int	server_add_persistent(SERVER *, DCB *);
+extern int	server_remove_persistent(SERVER *, DCB *);
+extern DCB	*server_get_persistent(SERVER *, GWPROTOCOL *, int);
+extern void	server_close_persistent(int);
+extern int	server_get_replication_lag(SERVER *);
+extern int	server_get_replication_lag_ms(SERVER *);
+extern void	server_circuit_failure(SERVER *);
+extern void	server_circuit_success(SERVER *);
+extern int	server_circuit_probe(SERVER *);
+extern int	server_resolve(SERVER *, struct in_addr *);
+extern void	server_foreach(void (*)(SERVER *, void *), void *);
+extern void	server_set_variables(SERVER *, SERVER_PARAM *);
+extern int	server_get_variable(SERVER *, char *, char *, int);
 #endif
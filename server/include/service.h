@@ -20,9 +20,12 @@
 
 #include <time.h>
 #include <spinlock.h>
+#include <brlock.h>
 #include <dcb.h>
 #include <server.h>
 #include <filter.h>
+#include <statistics.h>
+#include <gwbitmask.h>
 #include "config.h"
 
 /**
@@ -51,6 +54,7 @@ struct	server;
 struct	router;
 struct	router_object;
 struct	users;
+struct	mysql_users_source;
 
 /**
  * The servprotocol structure is used to link a service to the protocols that
@@ -63,19 +67,78 @@ typedef struct servprotocol {
 	unsigned short	port;		/**< Port to listen on */
 	char		*address;	/**< Address to listen with */
 	DCB		*listener;	/**< The DCB for the listener */
+	char		*ssl_cert;	/**< TLS certificate chain or NULL */
+	char		*ssl_key;	/**< TLS private key */
+	char		*ssl_ca_cert;	/**< CA of client certificates or NULL */
+	int		ssl_required;	/**< Clients must use TLS */
+	int		backlog;	/**< Listen backlog, 0 for the default */
+	int		defer_accept;	/**< TCP_DEFER_ACCEPT seconds, 0 for none */
+	int		fastopen;	/**< TCP_FASTOPEN queue length, 0 for none */
+	int		write_coalesce;	/**< Writes of one event sent together */
+	int		notsent_lowat;	/**< TCP_NOTSENT_LOWAT bytes, 0 for none */
+	struct tls_context
+			*tls_ctx;	/**< TLS context once started */
 	struct	servprotocol
 			*next;		/**< Next service protocol */
 } SERV_PROTOCOL;
 
+#define	SERVICE_FASTOPEN_QUEUE	256	/**< Default TCP_FASTOPEN queue of a listener */
+
 /**
  * The service statistics structure
  */
 typedef struct {
 	time_t		started;	/**< The time when the service was started */
-	int		n_sessions;	/**< Number of sessions created on service since start */
-	int		n_current;	/**< Current number of sessions */
+	TS_STATS	*counters;	/**< The per thread session counters */
+	TS_HIST		*latency;	/**< Response times of the backends */
 } SERVICE_STATS;
 
+/**
+ * A client connection waiting for admission to the service, the handshake
+ * is sent by the admit function of the protocol
+ */
+typedef struct service_queued {
+	DCB		*dcb;		/**< The client connection */
+	void		(*admit)(DCB *);/**< Completes the connection */
+	long		since;		/**< Time it was queued, milliseconds */
+	struct service_queued
+			*next;
+} SERVICE_QUEUED;
+
+/**
+ * The FIFO queue of the clients of a service that wait for admission
+ */
+typedef struct {
+	SPINLOCK	lock;		/**< Protects the queue and the admissions */
+	SERVICE_QUEUED	*first;		/**< The oldest waiting client */
+	SERVICE_QUEUED	*last;		/**< The newest waiting client */
+	int		depth;		/**< Number of waiting clients */
+	int		max_depth;	/**< Bound of the queue, 0 for no queue */
+	int		n_queued;	/**< Clients that have waited since start */
+	int		n_admitted;	/**< Waiting clients admitted since start */
+	int		n_rejected;	/**< Clients turned away since start */
+	long		wait_total;	/**< Total wait of the admitted clients, ms */
+	long		wait_max;	/**< Longest wait of an admitted client, ms */
+} SERVICE_QUEUE;
+
+#define	SERVICE_MAX_QUEUED	1024	/**< Default bound of the admission queue */
+
+/**
+ * The results of serviceAdmitClient
+ */
+#define	SERVICE_ADMIT_REJECT	0	/**< The client must be turned away */
+#define	SERVICE_ADMIT_NOW	1	/**< The client may start at once */
+#define	SERVICE_ADMIT_QUEUED	2	/**< The client waits in the queue */
+
+/**
+ * The per thread counters of a service
+ */
+#define	SERVICE_N_SESSIONS	0	/**< Number of sessions created on service since start */
+#define	SERVICE_N_CURRENT	1	/**< Current number of sessions */
+#define	SERVICE_N_MEMORY	2	/**< Bytes buffered for the sessions */
+#define	SERVICE_N_EVICTED	3	/**< Sessions closed for their buffers */
+#define	SERVICE_N_STATS		4
+
 /**
  * The service user structure holds the information that is needed
  for this service to allow the gateway to login to the backend
@@ -87,6 +150,19 @@ typedef struct {
 	char		*authdata;	/**< The authentication data requied */
 } SERVICE_USER;
 
+/**
+ * The query timeout of a user of the service, it overrides the timeout of
+ * the service. The entries are never freed, a reload of the configuration
+ * sets the timeout of a user that is no longer listed to -1 so that the
+ * polling threads may read the list without a lock.
+ */
+typedef struct service_query_timeout {
+	char		*user;		/**< The user name */
+	int		timeout;	/**< Seconds, 0 for none, -1 if not set */
+	struct service_query_timeout
+			*next;
+} SERVICE_QUERY_TIMEOUT;
+
 /**
  * The service refresh rate holds the counter and last load time_t
  for this service to load users data from the backend database
@@ -121,6 +197,7 @@ typedef struct service {
 	SPINLOCK	spin;		/**< The service spinlock */
 	SERVICE_STATS	stats;		/**< The service statistics */
 	struct users	*users;		/**< The user data for this service */
+	BRLOCK		users_lock;	/**< Readers of users, replacing it writes */
 	int		enable_root;	/**< Allow root user  access */
 	CONFIG_PARAMETER*
 			svc_config_param;     /*<  list of config params and values */
@@ -129,14 +206,39 @@ typedef struct service {
 			users_table_spin;	/**< The spinlock for users data refresh */
 	SERVICE_REFRESH_RATE
 			rate_limit;		/**< The refresh rate limit for users table */
+	int		users_loader;		/**< The users' loader keeps the MySQL users up to date */
+	int		users_reload;		/**< A reload of the users has been asked for */
+	struct mysql_users_source
+			*users_source;		/**< The source of the MySQL users, shared
+						 * by the services with the same backends
+						 * and credentials */
 	FILTER_DEF	**filters;		/**< Ordered list of filters */
 	int		n_filters;		/**< Number of filters */
 	char		*weightby;
+	int		conn_timeout;		/**< Client idle timeout in seconds, 0 for none */
+	int		query_timeout;		/**< Statement time limit in seconds, 0 for none */
+	SERVICE_QUERY_TIMEOUT
+			*query_timeouts;	/**< The users with a time limit of their own */
+	int		trace_sample;		/**< Trace one request in this many, 0 for none */
+	int		mem_soft_limit;		/**< Session bytes that pause its reads, 0 for none */
+	int		mem_hard_limit;		/**< Session bytes that close it, 0 for none */
+	int		write_timeout;		/**< Seconds a client write may stall, 0 for none */
+	int		writeq_limit;		/**< Client write queue bytes that close it, 0 for none */
+	GWBITMASK	poll_threads;		/**< The polling threads of the sessions, none set for all */
+	int		priority;		/**< Class of its events in the poll loop */
+	int		max_connections;	/**< Client connections allowed, 0 for no limit */
+	int		n_connections;		/**< Admitted client connections */
+	SERVICE_QUEUE	conn_queue;		/**< Clients waiting for admission */
 	struct service	*next;			/**< The next service in the linked list */
 } SERVICE;
 
 typedef enum count_spec_t {COUNT_ATLEAST=0, COUNT_EXACT, COUNT_ATMOST} count_spec_t;
 
+#define	SERVICE_PRIORITY_HIGH	0	/**< Events run before the others */
+#define	SERVICE_PRIORITY_NORMAL	1	/**< The default */
+#define	SERVICE_PRIORITY_LOW	2	/**< Events run last, within a budget */
+#define	SERVICE_N_PRIORITIES	3
+
 #define	SERVICE_STATE_ALLOC	1	/**< The service has been allocated */
 #define	SERVICE_STATE_STARTED	2	/**< The service has been started */
 
@@ -146,6 +248,8 @@ extern	SERVICE *service_find(char *);
 extern	int	service_isvalid(SERVICE *);
 extern	int	serviceAddProtocol(SERVICE *, char *, char *, unsigned short);
 extern	int	serviceHasProtocol(SERVICE *, char *, unsigned short);
+extern	int	serviceSetProtocolSSL(SERVICE *, char *, unsigned short,
+				char *, char *, char *, int);
 extern	void	serviceAddBackend(SERVICE *, SERVER *);
 extern	int	serviceHasBackend(SERVICE *, SERVER *);
 extern	void	serviceAddRouterOption(SERVICE *, char *);
@@ -161,8 +265,30 @@ extern	void	serviceSetFilters(SERVICE *, char *);
 extern	int	serviceEnableRootUser(SERVICE *, int );
 extern	void	serviceWeightBy(SERVICE *, char *);
 extern	char	*serviceGetWeightingParameter(SERVICE *);
+extern	void	serviceSetTimeout(SERVICE *, int);
+extern	int	serviceSetQueryTimeout(SERVICE *, char *);
+extern	int	serviceGetQueryTimeout(SERVICE *, char *);
+extern	void	serviceSetTraceSample(SERVICE *, int);
+extern	void	serviceSetMemoryLimits(SERVICE *, int, int);
+extern	void	serviceSetWriteLimits(SERVICE *, int, int);
+extern	int	serviceSetPollThreads(SERVICE *, char *);
+extern	int	serviceSetPriority(SERVICE *, char *);
+extern	int	serviceUsesPollThread(SERVICE *, int);
+extern	void	serviceRetireListeners(int);
+extern	int	serviceSetProtocolListen(SERVICE *, char *, unsigned short,
+						int, int, int);
+extern	int	serviceSetProtocolWrites(SERVICE *, char *, unsigned short,
+						int, int);
+extern	SERV_PROTOCOL	*serviceListenerPort(DCB *);
+extern	void	serviceForEach(void (*)(SERVICE *, void *), void *);
+extern	void	serviceRestoreListeners(int);
+extern	void	serviceSetConnectionLimits(SERVICE *, int, int);
+extern	int	serviceAdmitClient(SERVICE *, DCB *, void (*)(DCB *));
+extern	void	serviceReleaseClient(DCB *);
 extern	void	service_update(SERVICE *, char *, char *, char *);
 extern	int	service_refresh_users(SERVICE *);
+extern	void	serviceStartUsersLoader();
+extern	void	serviceStopUsersLoader();
 extern	void	printService(SERVICE *);
 extern	void	printAllServices();
 extern	void	dprintAllServices(DCB *);
@@ -45,6 +45,7 @@
 struct dcb;
 struct service;
 struct filter_def;
+struct diag_range;
 
 /**
  * The session statistics structure
@@ -53,6 +54,31 @@ typedef struct {
 	time_t		connect;	/**< Time when the session was started */
 } SESSION_STATS;
 
+/**
+ * The stages of a traced request, the times it reaches them are stamped in
+ * microseconds of the monotonic clock
+ */
+#define	SESSION_TRACE_READ	0	/**< Read from the client */
+#define	SESSION_TRACE_ROUTED	1	/**< Past the filters, given to the router */
+#define	SESSION_TRACE_SENT	2	/**< Written to a backend */
+#define	SESSION_TRACE_FIRST	3	/**< First byte of the reply read */
+#define	SESSION_TRACE_LAST	4	/**< Last byte of the reply read */
+#define	SESSION_TRACE_WRITTEN	5	/**< Last byte of the reply written to the client */
+#define	SESSION_TRACE_STAGES	6
+
+#define	SESSION_TRACE_SQLLEN	64	/**< Bytes of the statement kept */
+
+/**
+ * The trace of a request. A session traces one request at a time, the
+ * stages are stamped by the protocols as the request goes through.
+ */
+typedef struct {
+	int		active;		/**< A request is being traced */
+	unsigned char	command;	/**< The command of the request */
+	unsigned long	stamps[SESSION_TRACE_STAGES];	/**< 0 until reached */
+	char		sql[SESSION_TRACE_SQLLEN + 1];	/**< Start of the statement */
+} SESSION_TRACE;
+
 typedef enum {
     SESSION_STATE_ALLOC,            /*< for all sessions */
     SESSION_STATE_READY,            /*< for router session */
@@ -60,18 +86,22 @@ typedef enum {
     SESSION_STATE_STOPPING,         /*< session and router are being closed */
     SESSION_STATE_LISTENER,         /*< for listener session */
     SESSION_STATE_LISTENER_STOPPED, /*< for listener session */
-    SESSION_STATE_FREE              /*< for all sessions */
+    SESSION_STATE_FREE,             /*< for all sessions */
+    SESSION_STATE_CURSOR            /*< not a session, the place of a walk of the list */
 } session_state_t;
 
 /**
  * The downstream element in the filter chain. This may refer to
- * another filter or to a router.
+ * another filter or to a router. The routeBatch entry point is NULL
+ * unless the element and all of the elements after it route batches.
  */
 typedef struct {
 	void		*instance;
 	void		*session;
 	int		(*routeQuery)(void *instance, void *session,
 					GWBUF *request);
+	int		(*routeBatch)(void *instance, void *session,
+					GWBUF *request);
 } DOWNSTREAM;
 
 /**
@@ -88,15 +118,35 @@ typedef struct {
 
 /**
  * Structure used to track the filter instances and sessions of the filters
- * that are in use within a session.
+ * that are in use within a session. The entry is the filter in the
+ * downstream chain, the interest the requests it wants to see.
  */
 typedef struct {
 	struct filter_def
 			*filter;
 	void		*instance;
 	void		*session;
+	int		interest;
+	DOWNSTREAM	entry;
 } SESSION_FILTER;
 
+/**
+ * The arena of a session, memory that is freed all at once with the
+ * session. The first part of the arena is in the allocation of the session
+ * itself, the rest is allocated in chunks as it is needed.
+ */
+#define	SESSION_ARENA_FIRST	1024	/**< Arena bytes allocated with the session */
+#define	SESSION_ARENA_CHUNK	4096	/**< Size of the chunks that follow */
+
+typedef struct {
+	SPINLOCK	lock;		/**< Protects the arena */
+	char		*next;		/**< Next free byte of the current chunk */
+	char		*end;		/**< End of the current chunk */
+	void		*chunks;	/**< The chunks allocated, a list */
+	int		used;		/**< Bytes handed out */
+	int		n_chunks;	/**< Number of chunks allocated */
+} SESSION_ARENA;
+
 /**
  * The session status block
  *
@@ -120,7 +170,13 @@ typedef struct session {
 	DOWNSTREAM	head;		/**< Head of the filter chain */
 	UPSTREAM	tail;		/**< The tail of the filter chain */
 	struct session	*next;		/**< Linked list of all sessions */
+	struct session	*prev;		/**< Previous session in the list */
+	SESSION_TRACE	trace;		/**< The request being traced */
 	int		refcount;	/**< Reference count on the session */
+	SESSION_ARENA	arena;		/**< Memory freed with the session */
+	int		mem_used;	/**< Bytes buffered for the session */
+	int		pinned;		/**< Only the owner thread runs its events */
+	int		evicted;	/**< Closed for what it has buffered */
 #if defined(SS_DEBUG)
         skygw_chk_t     ses_chk_tail;
 #endif
@@ -128,6 +184,39 @@ typedef struct session {
 
 #define SESSION_PROTOCOL(x, type)	DCB_PROTOCOL((x)->client, type)
 
+/**
+ * Start the trace of a request if the service samples its requests, the
+ * check keeps the cost low when tracing is off
+ */
+#define	SESSION_TRACE_START(sess, buf) \
+		if ((sess)->service->trace_sample) \
+			session_trace_start((sess), (buf))
+
+/**
+ * Stamp a stage of the traced request of a session
+ */
+#define	SESSION_TRACE_STAMP(sess, stage, usecs) \
+		if ((sess) != NULL && (sess)->trace.active) \
+			session_trace_stamp((sess), (stage), (usecs))
+
+/**
+ * A copy of the details of a session that the diagnostics print, made with
+ * the list of the sessions locked and printed with the lock released.
+ */
+#define	SESSION_INFO_NAMELEN	64
+
+typedef struct {
+	void		*session;	/**< Address of the session, only to print */
+	session_state_t	state;		/**< State of the session */
+	void		*client;	/**< Address of the client DCB */
+	void		*service;	/**< Address of the service */
+	char		service_name[SESSION_INFO_NAMELEN]; /**< Name of the service */
+	char		remote[SESSION_INFO_NAMELEN];	/**< Address of the client */
+	time_t		connect;	/**< Time when the session was started */
+} SESSION_INFO;
+
+#define	SESSION_INFO_BATCH	32	/**< Sessions copied each time the list is locked */
+
 /**
  * A convenience macro that can be used by the protocol modules to route
  * the incoming data to the first element in the pipeline of filters and
@@ -136,6 +225,13 @@ typedef struct session {
 #define	SESSION_ROUTE_QUERY(sess, buf) \
 		((sess)->head.routeQuery)((sess)->head.instance, \
 				(sess)->head.session, (buf))
+/**
+ * Route a chain of complete packets, one in each buffer, as a batch. May
+ * only be used if head.routeBatch is set.
+ */
+#define	SESSION_ROUTE_BATCH(sess, buf) \
+		((sess)->head.routeBatch)((sess)->head.instance, \
+				(sess)->head.session, (buf))
 /**
  * A convenience macro that can be used by the router modules to route
  * the replies to the first element in the pipeline of filters and
@@ -156,7 +252,19 @@ void	printSession(SESSION *);
 void	dprintAllSessions(struct dcb *);
 void	dprintSession(struct dcb *, SESSION *);
 void	dListSessions(struct dcb *);
+void	dprintSessionRange(struct dcb *, struct diag_range *);
+void	dListSessionRange(struct dcb *, struct diag_range *);
+int	session_foreach_info(int (*)(SESSION_INFO *, void *), void *);
+void	session_trace_start(SESSION *, GWBUF *);
+void	session_trace_stamp(SESSION *, int, unsigned long);
+unsigned long	session_trace_clock();
 char	*session_state(int);
 bool	session_link_dcb(SESSION *, struct dcb *);
+void	*session_arena_alloc(SESSION *, size_t);
+char	*session_arena_strdup(SESSION *, const char *);
+void	session_mem_add(SESSION *, int);
+int	session_mem_above_soft(SESSION *);
+int	session_mem_exceeded(SESSION *, int);
+int	session_evict(SESSION *);
 SESSION* get_session_by_router_ses(void* rses);
 #endif
@@ -0,0 +1,75 @@
+#ifndef _SLAB_H
+#define _SLAB_H
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file slab.h	A size classed, per polling thread memory pool
+ *
+ * The slab allocator keeps a cache of free memory blocks for each polling
+ * thread, one free list per size class. Blocks are returned to the cache of
+ * the thread that allocated them; a block freed by any other thread is
+ * handed back to the owner via a lock free list that the owner collects
+ * the next time its own free list runs dry.
+ *
+ * Threads that have not called slab_thread_init, and requests larger than
+ * the biggest size class, fall back to malloc and free.
+ *
+ * With huge pages the blocks of a thread cache are carved from 2MB regions
+ * of huge pages the thread maps, rather than taken from malloc one by one,
+ * so that the buffers and DCBs of many connections need few TLB entries.
+ * The blocks of the regions are never returned, they stay in the cache.
+ */
+#include <stddef.h>
+
+struct dcb;
+
+#define	SLAB_NCLASSES		12	/**< Number of size classes, 16 bytes to 32KB */
+#define	SLAB_MIN_SHIFT		4	/**< The smallest size class is 1 << SLAB_MIN_SHIFT */
+#define	SLAB_MAX_SIZE		(1 << (SLAB_MIN_SHIFT + SLAB_NCLASSES - 1))
+#define	SLAB_CACHE_BYTES	(1024 * 1024)	/**< Bytes kept cached per class */
+#define	SLAB_CACHE_MIN		16	/**< Minimum blocks kept cached per class */
+#define	SLAB_REGION_SIZE	(2 * 1024 * 1024) /**< A region, one huge page */
+
+/**
+ * The backing of the blocks of the thread caches, see slab_set_huge_pages
+ */
+#define	SLAB_HUGE_OFF		0	/**< Blocks come from malloc */
+#define	SLAB_HUGE_ON		1	/**< Regions of explicit huge pages, MAP_HUGETLB */
+#define	SLAB_HUGE_TRANSPARENT	2	/**< Regions the kernel may back with
+					 * transparent huge pages */
+
+/**
+ * Statistics maintained for each size class of a thread cache
+ */
+typedef struct {
+	int	n_hits;		/**< Allocations satisfied from the cache */
+	int	n_misses;	/**< Allocations that had to call malloc */
+	int	n_remote;	/**< Blocks freed by a thread other than the owner */
+	int	n_released;	/**< Blocks returned to malloc as the cache was full */
+	int	n_cached;	/**< Blocks currently on the free list */
+} SLAB_STATS;
+
+extern void	slab_thread_init(int thread_id);
+extern void	*slab_alloc(size_t size);
+extern void	slab_free(void *ptr);
+extern size_t	slab_size(void *ptr);
+extern void	slab_set_huge_pages(int mode);
+extern void	slab_get_stats(int thread_id, int sclass, SLAB_STATS *stats);
+extern void	dprintSlabStats(struct dcb *);
+#endif
@@ -27,6 +27,15 @@
  * generally wasteful as any blocked threads will spin, consuming CPU cycles, waiting
  * for the lock to be released. However they are useful in that they do not involve
  * system calls and are light weight when the expected wait time for a lock is low.
+ *
+ * Two build options change the implementation. SPINLOCK_TICKET replaces the
+ * test and set lock with a ticket lock, which grants the lock to the waiting
+ * threads in the order they arrived, it is best used with no more threads
+ * than processors since a waiter that is not running holds up those behind
+ * it. SPINLOCK_PROFILE records the number of
+ * acquisitions, the contended acquisitions, the spins and the hold times of
+ * the locks, grouped by the code that acquires the lock, for the debug
+ * interface command "show spinlocks".
  */
 #include <thread.h>
 #include <stdbool.h>
@@ -38,8 +47,27 @@ typedef struct spinlock {
 	int		acquired;
 	THREAD		owner;
 #endif
+#if SPINLOCK_TICKET
+	int		serving;	/**< The ticket that holds the lock */
+#endif
+#if SPINLOCK_PROFILE
+	int		site;		/**< The site of the current holder */
+	unsigned long	locked_at;	/**< When the holder took the lock, nsec */
+#endif
 } SPINLOCK;
 
+/**
+ * The profile of the locks acquired from one place in the code
+ */
+typedef struct spinlock_site {
+	void		*caller;	/**< The return address of the acquire */
+	unsigned long	acquired;	/**< Number of acquisitions */
+	unsigned long	contended;	/**< Acquisitions that had to wait */
+	unsigned long	spins;		/**< Backoff rounds while waiting */
+	unsigned long	total_hold;	/**< Total hold time, nsec */
+	unsigned long	max_hold;	/**< Longest hold time, nsec */
+} SPINLOCK_SITE;
+
 #ifndef TRUE
 #define TRUE	true
 #endif
@@ -53,10 +81,17 @@ typedef struct spinlock {
 #define SPINLOCK_INIT { 0 }
 #endif
 
+#if SPINLOCK_TICKET
+#define SPINLOCK_IS_LOCKED(l) ((l)->lock != (l)->serving ? true : false)
+#else
 #define SPINLOCK_IS_LOCKED(l) ((l)->lock != 0 ? true : false)
-	
+#endif
+
+struct dcb;
+
 extern void	spinlock_init(SPINLOCK *lock);
 extern void	spinlock_acquire(SPINLOCK *lock);
 extern int	spinlock_acquire_nowait(SPINLOCK *lock);
 extern void	spinlock_release(SPINLOCK *lock);
+extern void	dprintSpinlocks(struct dcb *dcb);
 #endif
@@ -0,0 +1,81 @@
+#ifndef _STATISTICS_H
+#define _STATISTICS_H
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file statistics.h	Per thread statistics counters
+ *
+ * A TS_STATS is a set of integer counters with a separate copy for every
+ * polling thread. Each copy is padded to a whole number of cache lines, so
+ * a polling thread updates its own copy with a plain add and never shares a
+ * cache line with another thread. Threads that do not poll update an extra,
+ * shared, copy with an atomic add. The value of a counter is the sum of all
+ * the copies, which is only computed when the counter is read.
+ *
+ * A TS_HIST is a latency histogram kept the same way. The buckets are log
+ * linear, as in an HDR histogram: every power of 2 microseconds is split in
+ * TS_HIST_SUB_BUCKETS buckets of equal width, so a bucket is never wider
+ * than a quarter of its values and percentiles are read to within 25%.
+ */
+
+#define	TS_STATS_CACHE_LINE	64	/**< Alignment and padding of a copy */
+
+/**
+ * A set of per thread counters
+ */
+typedef struct {
+	int	n_counters;	/**< Number of counters in the set */
+	int	n_slots;	/**< Number of polling thread copies */
+	int	stride;		/**< Ints per copy, including the padding */
+	int	*counters;	/**< The copies, the shared copy is the last */
+} TS_STATS;
+
+#define	TS_HIST_SUB_BITS	2
+#define	TS_HIST_SUB_BUCKETS	(1 << TS_HIST_SUB_BITS)	/**< Buckets of a power of 2 */
+#define	TS_HIST_MAX_BITS	24	/**< The largest bound is 2^24 usecs */
+#define	TS_HIST_BUCKETS		(TS_HIST_SUB_BUCKETS * \
+		(TS_HIST_MAX_BITS - TS_HIST_SUB_BITS + 1) + 1)
+					/**< Buckets, the last one has no bound */
+
+/**
+ * A per thread latency histogram. Bucket i of a copy counts the values of
+ * at most ts_hist_bound(i) microseconds that are above the bound of bucket
+ * i - 1, the last bucket counts all the larger values. The sum of the values
+ * follows the buckets.
+ */
+typedef struct {
+	int	n_slots;	/**< Number of polling thread copies */
+	int	stride;		/**< Longs per copy, including the padding */
+	long	*counts;	/**< The copies, the shared copy is the last */
+} TS_HIST;
+
+extern void	ts_stats_init(int n_threads);
+extern void	ts_stats_thread_init(int thread_id);
+extern TS_STATS	*ts_stats_alloc(int n_counters);
+extern void	ts_stats_free(TS_STATS *stats);
+extern void	ts_stats_add(TS_STATS *stats, int counter, int value);
+extern int	ts_stats_get(TS_STATS *stats, int counter);
+extern int	ts_stats_get_slot(TS_STATS *stats, int counter, int slot);
+extern TS_HIST	*ts_hist_alloc();
+extern void	ts_hist_free(TS_HIST *hist);
+extern void	ts_hist_add(TS_HIST *hist, unsigned long usecs);
+extern void	ts_hist_get(TS_HIST *hist, int slot, long *counts, long *sum);
+extern unsigned long ts_hist_bound(int bucket);
+extern unsigned long ts_hist_percentile(long *counts, double fraction);
+#endif
@@ -34,5 +34,6 @@
 extern void 	*thread_start(void (*entry)(void *), void *arg);
 extern void	thread_wait(void *thd);
 extern void	thread_millisleep(int ms);
+extern void	thread_default_affinity();
 
 #endif
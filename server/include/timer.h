@@ -0,0 +1,96 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file timer.h	A hierarchical timer wheel per polling thread
+ *
+ * Every polling thread owns a timer wheel that is run from the polling loop.
+ * A timer is a TIMER structure embedded in the object it times, it is bound
+ * to the wheel of the thread that first starts it and the callback is always
+ * called from that thread. Starting and cancelling a timer are O(1) and may
+ * be done from any thread.
+ *
+ * Once timer_cancel has returned the callback will not be called, unless
+ * the timer is started again. timer_disable also prevents the timer from
+ * being started again until it is initialised with timer_init, it is used
+ * when the object that embeds the timer is closed. A callback that is already
+ * running when the timer is cancelled is not waited for, objects that are
+ * only freed once the polling threads have passed through the end of the
+ * polling loop, such as DCBs and sessions, may safely embed a timer. The
+ * callback must not free the object that embeds the timer.
+ */
+#include <spinlock.h>
+
+struct dcb;
+
+#define	TIMER_TICK		10	/**< Resolution of the wheels in milliseconds */
+#define	TIMER_ROOT_BITS		8	/**< First level has 256 slots */
+#define	TIMER_LEVEL_BITS	6	/**< Other levels have 64 slots */
+#define	TIMER_LEVELS		4	/**< Number of levels above the first */
+#define	TIMER_ROOT_SIZE		(1 << TIMER_ROOT_BITS)
+#define	TIMER_LEVEL_SIZE	(1 << TIMER_LEVEL_BITS)
+
+/**
+ * The timer states
+ */
+#define	TIMER_IDLE		0	/**< Not scheduled */
+#define	TIMER_PENDING		1	/**< Waiting in a wheel */
+#define	TIMER_DISABLED		2	/**< Disabled, can no longer be started */
+
+struct timer_wheel;
+
+/**
+ * A timer, embedded in the structure that is timed
+ */
+typedef struct timer {
+	struct timer		*next;		/**< Next timer in the slot */
+	struct timer		**pprev;	/**< The link that points to this timer */
+	unsigned long		expires;	/**< Expiry time in ticks */
+	int			state;		/**< The timer state */
+	void			(*fn)(void *);	/**< The callback */
+	void			*data;		/**< Data passed to the callback */
+	struct timer_wheel	*wheel;		/**< The wheel the timer is bound to */
+} TIMER;
+
+/**
+ * The timer wheel of a polling thread
+ */
+typedef struct timer_wheel {
+	SPINLOCK		lock;		/**< Protects the slots */
+	int			thread_id;	/**< The polling thread */
+	unsigned long		now;		/**< The next tick to process */
+	int			n_pending;	/**< Timers waiting in the wheel */
+	int			n_fired;	/**< Number of callbacks called */
+	int			n_cascaded;	/**< Timers moved down a level */
+	TIMER			*root[TIMER_ROOT_SIZE];
+	TIMER			*levels[TIMER_LEVELS][TIMER_LEVEL_SIZE];
+	struct timer_wheel	*next;		/**< All the wheels */
+} TIMER_WHEEL;
+
+extern void		timer_thread_init(int thread_id);
+extern void		timer_init(TIMER *timer);
+extern int		timer_start(TIMER *timer, int msecs, void (*fn)(void *), void *data);
+extern void		timer_cancel(TIMER *timer);
+extern void		timer_disable(TIMER *timer);
+extern int		timer_run();
+extern int		timer_next_timeout(int max_msecs);
+extern unsigned long	timer_now();
+extern void		dprintTimers(struct dcb *);
+#endif
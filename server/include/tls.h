@@ -0,0 +1,76 @@
+#ifndef _TLS_H
+#define _TLS_H
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file tls.h	TLS termination for the client connections of a listener
+ *
+ * A listener that has a certificate owns a TLS_CONTEXT, a connection that
+ * has switched to TLS owns a TLS_SESSION. The session does no I/O of its
+ * own, the DCB reads and writes the socket as for any other connection and
+ * passes the data through the session, so the socket is never touched by
+ * the TLS library and the usual write queue and flow control apply to the
+ * encrypted data.
+ *
+ * A session is not thread safe, the DCB serialises the calls for a session
+ * with its write queue lock.
+ */
+#include <openssl/ssl.h>
+#include <buffer.h>
+
+#define	TLS_TICKET_KEY_MAX	80	/**< Name, HMAC and AES keys of tickets */
+#define	TLS_SESSION_TIMEOUT	300	/**< Seconds a session may be resumed */
+
+/**
+ * The TLS configuration of a listener. There is one SSL_CTX for each
+ * polling thread, so the session caches and the locks inside the context
+ * are not shared between the threads. Session tickets are encrypted with
+ * the same keys in every context, a client may resume its session whatever
+ * the thread that serves the new connection.
+ */
+typedef struct tls_context {
+	SSL_CTX		**ctx;		/**< The contexts of the threads */
+	int		n_ctx;		/**< Number of contexts */
+	int		required;	/**< Clients must switch to TLS */
+	unsigned char	ticket_keys[TLS_TICKET_KEY_MAX]; /**< Shared ticket keys */
+	int		ticket_keylen;	/**< Key length of the TLS library */
+	int		n_handshakes;	/**< Completed handshakes */
+	int		n_resumed;	/**< Handshakes that resumed a session */
+} TLS_CONTEXT;
+
+/**
+ * The TLS state of a connection
+ */
+typedef struct tls_session {
+	SSL		*ssl;		/**< The TLS connection */
+	BIO		*rbio;		/**< Data read from the socket */
+	BIO		*wbio;		/**< Data to write to the socket */
+	TLS_CONTEXT	*context;	/**< The context of the listener */
+	int		established;	/**< The handshake has completed */
+} TLS_SESSION;
+
+extern TLS_CONTEXT	*tls_context_alloc(char *, char *, char *, int);
+extern void		tls_context_free(TLS_CONTEXT *);
+extern TLS_SESSION	*tls_session_alloc(TLS_CONTEXT *, int);
+extern void		tls_session_free(TLS_SESSION *);
+extern void		tls_session_shutdown(TLS_SESSION *);
+extern int		tls_session_read(TLS_SESSION *, GWBUF *, GWBUF **);
+extern int		tls_session_write(TLS_SESSION *, GWBUF **);
+extern int		tls_session_pending(TLS_SESSION *);
+#endif
@@ -0,0 +1,72 @@
+#ifndef _TRACEPOINT_H
+#define _TRACEPOINT_H
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file tracepoint.h
+ *
+ * Static user space tracepoints of the request path, in the SystemTap SDT
+ * format that bpftrace, perf and SystemTap attach to, for example
+ *
+ *	bpftrace -p <pid> -e 'usdt:maxscale:dcb__read { @bytes = hist(arg2); }'
+ *
+ * A tracepoint is a single nop instruction and a note in the binary that
+ * tells where its arguments are, a tool that attaches replaces the nop by
+ * a trap. The arguments are values the code has at hand, so a point costs
+ * next to nothing when nothing is attached. The points
+ * are compiled in when the build sets SDT=Y, which needs the sys/sdt.h
+ * header of the systemtap-sdt-devel package, otherwise they compile to
+ * nothing.
+ *
+ * The tracepoints of the provider maxscale are:
+ *
+ *	poll__wait	thread id, events returned by epoll_wait
+ *	poll__event	thread id, DCB, epoll events of the DCB
+ *	dcb__read	DCB, session, bytes read, result of the read
+ *	dcb__write	DCB, session, bytes written or -1, buffers in the write
+ *	session__route	session, client DCB, bytes of the first buffer,
+ *			MySQL command
+ *	router__query	session, router session, bytes of the first buffer,
+ *			MySQL command
+ *	router__reply	session, backend DCB, bytes of the first buffer
+ */
+
+#if defined(HAVE_SDT)
+#include <sys/sdt.h>
+
+#define	TRACEPOINT2(name, a1, a2) \
+		DTRACE_PROBE2(maxscale, name, a1, a2)
+#define	TRACEPOINT3(name, a1, a2, a3) \
+		DTRACE_PROBE3(maxscale, name, a1, a2, a3)
+#define	TRACEPOINT4(name, a1, a2, a3, a4) \
+		DTRACE_PROBE4(maxscale, name, a1, a2, a3, a4)
+#else
+#define	TRACEPOINT2(name, a1, a2)		do { } while (0)
+#define	TRACEPOINT3(name, a1, a2, a3)		do { } while (0)
+#define	TRACEPOINT4(name, a1, a2, a3, a4)	do { } while (0)
+#endif
+
+/**
+ * The length of the first buffer of a chain and the MySQL command in it,
+ * 0 if the buffer is shorter than a packet header and the command
+ */
+#define	TRACEPOINT_BUFLEN(buf)	((buf) != NULL ? (int)GWBUF_LENGTH(buf) : 0)
+#define	TRACEPOINT_COMMAND(buf)	(TRACEPOINT_BUFLEN(buf) > 4 ? \
+				(int)((unsigned char *)GWBUF_DATA(buf))[4] : 0)
+#endif
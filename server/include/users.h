@@ -59,10 +59,19 @@ typedef struct users {
 	USERS_STATS	stats;			/**< The statistics for the users table */
 	unsigned char
 		cksum[SHA_DIGEST_LENGTH];	/**< The users' table ckecksum */
+	int		version;		/**< Changed by each add, unique
+						 * between the tables */
+	unsigned long long
+			hostbits;		/**< MySQL users, bit n is set if
+						 * there are hosts with n
+						 * wildcard bits */
+	int		refcount;		/**< Holders of the table, it is
+						 * freed by the last users_free */
 } USERS;
 
 extern USERS	*users_alloc();				/**< Allocate a users table */
 extern void	users_free(USERS *);			/**< Free a users table */
+extern USERS	*users_share(USERS *);			/**< Hold a users table */
 extern int	users_add(USERS *, char *, char *);	/**< Add a user to the users table */
 extern int	users_delete(USERS *, char *);		/**< Delete a user from the users table */
 extern char	*users_fetch(USERS *, char *);		/**< Fetch the authentication data for a user */
@@ -0,0 +1,931 @@
+/*
+ * This file is distributed as part of MaxScale by SkySQL.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <regex.h>
+#include <filter.h>
+#include <modinfo.h>
+#include <modutil.h>
+#include <atomic.h>
+#include <mysql_client_server_protocol.h>
+#include <skygw_utils.h>
+#include <skygw_sqlscan.h>
+#include <log_manager.h>
+
+extern int lm_enabled_logfiles_bitmask;
+
+/**
+ * @file blockfilter.c - a filter that rejects the statements that match
+ * any of a list of patterns
+ * @verbatim
+ *
+ * The patterns are read from a file, one pattern on each line, and are all
+ * compiled into one Aho-Corasick automaton. The SQL text of a statement is
+ * scanned once, whatever the number of the patterns, and the statement is
+ * rejected with an error if one of them is found in it.
+ *
+ * A pattern is a text that is matched without regard to case, a run of
+ * white space in the pattern matches any run of white space. A pattern that
+ * starts or ends with a letter, a digit or an underscore only matches whole
+ * words at that end, "drop table" does not match "backdrop tables". The
+ * comments of the statement and of the pattern match as a single space and
+ * the body of an executable comment as the text it holds, so "drop table"
+ * also matches a statement that puts a comment in place of the space or
+ * the words in an executable comment. A line of the file may add a
+ * regular expression to its pattern after "=~", the statement is then only
+ * rejected if the regular expression matches it too, it is matched against
+ * the statement as it was sent:
+ *
+ *	into outfile
+ *	drop table =~ ^[[:space:]]*drop[[:space:]]+table
+ *
+ * The empty lines and the lines that start with '#' are ignored.
+ *
+ * The parameters of the filter
+ *	patterns=<file of the patterns>
+ * Optional parameters
+ *	source=<source address to limit filter>
+ *	user=<username to limit filter>
+ * @endverbatim
+ */
+
+MODULE_INFO 	info = {
+	MODULE_API_FILTER,
+	MODULE_BETA_RELEASE,
+	FILTER_VERSION,
+	"A filter that rejects the statements that match a list of patterns"
+};
+
+static char *version_str = "V1.0.0";
+
+#define	BLOCK_MAX_PATTERN	256		/* Longest pattern */
+#define	BLOCK_MAX_PATTERNS	4096		/* Most patterns */
+#define	BLOCK_ERRNO		1227		/* ER_SPECIFIC_ACCESS_DENIED_ERROR */
+
+/**
+ * A pattern of the list
+ */
+typedef struct {
+	char		*text;		/* The normalised text of the pattern */
+	int		length;		/* Length of the text */
+	int		word_start;	/* Only matches at the start of a word */
+	int		word_end;	/* Only matches at the end of a word */
+	char		*match;		/* The regular expression or NULL */
+	regex_t		re;		/* The compiled regular expression */
+	int		line;		/* Line of the pattern in the file */
+	int		n_matched;	/* Statements rejected by the pattern */
+} BLOCK_PATTERN;
+
+/**
+ * Instance structure. The automaton is a table of the next state of each
+ * state for each class of characters, the characters that are in no
+ * pattern are class 0 and always lead back to the root.
+ */
+typedef struct {
+	char		*source;	/* Source address to restrict matches */
+	char		*user;		/* User name to restrict matches */
+	char		*file;		/* The file of the patterns */
+	BLOCK_PATTERN	*patterns;	/* The patterns */
+	int		n_patterns;	/* Number of the patterns */
+	unsigned char	classes[256];	/* The class of each character */
+	int		n_classes;	/* Classes of the characters */
+	int		*delta;		/* The next states, n_states * n_classes */
+	int		*out;		/* Pattern ending at each state or -1 */
+	int		*dict;		/* Next state of the failure chain with
+					 * a pattern ending at it or -1 */
+	int		n_states;	/* States of the automaton */
+	int		n_confirm_failed; /* Matches the regular expression
+					 * did not confirm */
+	int		n_rejected;	/* Statements rejected */
+} BLOCK_INSTANCE;
+
+/**
+ * The session structure for this filter
+ */
+typedef struct {
+	DOWNSTREAM	down;		/* The downstream filter */
+	UPSTREAM	up;		/* The upstream filter */
+	int		active;		/* Is filter active */
+	int		n_passed;	/* Statements passed on */
+	int		n_rejected;	/* Statements rejected */
+} BLOCK_SESSION;
+
+static	FILTER	*createInstance(char **options, FILTER_PARAMETER **params);
+static	void	*newSession(FILTER *instance, SESSION *session);
+static	void 	closeSession(FILTER *instance, void *session);
+static	void 	freeSession(FILTER *instance, void *session);
+static	void	setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
+static	void	setUpstream(FILTER *instance, void *fsession, UPSTREAM *upstream);
+static	int	routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
+static	void	diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+static	int	getInterest(FILTER *instance, void *fsession);
+
+static	int	block_load(BLOCK_INSTANCE *my_instance);
+static	int	block_add(BLOCK_INSTANCE *my_instance, char *line, int lineno);
+static	int	block_compile(BLOCK_INSTANCE *my_instance);
+static	void	block_free(BLOCK_INSTANCE *my_instance);
+static	int	block_scan(BLOCK_INSTANCE *my_instance, GWBUF *queue);
+static	int	block_confirm(BLOCK_INSTANCE *my_instance, int pattern,
+			GWBUF *queue, uint8_t *tried);
+static	int	block_normalise(char *text, char *norm, int size);
+
+static FILTER_OBJECT MyObject = {
+    createInstance,
+    newSession,
+    closeSession,
+    freeSession,
+    setDownstream,
+    setUpstream,
+    routeQuery,
+    NULL,		// No client reply
+    diagnostic,
+    NULL,		// No batch routing
+    getInterest,
+};
+
+/** A character of a word, for the ends of the patterns */
+#define	BLOCK_IS_WORD(c)	(isalnum((unsigned char)(c)) || (c) == '_' || \
+				 (c) == '$')
+/** The case and the white space of the SQL text are normalised */
+#define	BLOCK_IS_SPACE(c)	((c) == ' ' || (c) == '\t' || (c) == '\n' || \
+				 (c) == '\r' || (c) == '\f' || (c) == '\v')
+
+/**
+ * Implementation of the mandatory version entry point
+ *
+ * @return version string of the module
+ */
+char *
+version()
+{
+	return version_str;
+}
+
+/**
+ * The module initialisation routine, called when the module
+ * is first loaded.
+ */
+void
+ModuleInit()
+{
+}
+
+/**
+ * The module entry point routine. It is this routine that
+ * must populate the structure that is referred to as the
+ * "module object", this is a structure with the set of
+ * external entry points for this module.
+ *
+ * @return The module object
+ */
+FILTER_OBJECT *
+GetModuleObject()
+{
+	return &MyObject;
+}
+
+/**
+ * Create an instance of the filter for a particular service
+ * within MaxScale.
+ *
+ * @param options	The options for this filter
+ * @param params	The array of name/value pair parameters for the filter
+ *
+ * @return The instance data for this new instance
+ */
+static	FILTER	*
+createInstance(char **options, FILTER_PARAMETER **params)
+{
+BLOCK_INSTANCE	*my_instance;
+int		i;
+
+	if ((my_instance = calloc(1, sizeof(BLOCK_INSTANCE))) != NULL)
+	{
+		for (i = 0; params && params[i]; i++)
+		{
+			if (!strcmp(params[i]->name, "patterns"))
+				my_instance->file = strdup(params[i]->value);
+			else if (!strcmp(params[i]->name, "source"))
+				my_instance->source = strdup(params[i]->value);
+			else if (!strcmp(params[i]->name, "user"))
+				my_instance->user = strdup(params[i]->value);
+			else if (!filter_standard_parameter(params[i]->name))
+			{
+				LOGIF(LE, (skygw_log_write_flush(
+					LOGFILE_ERROR,
+					"blockfilter: Unexpected parameter '%s'.\n",
+					params[i]->name)));
+			}
+		}
+
+		if (options)
+		{
+			for (i = 0; options[i]; i++)
+			{
+				LOGIF(LE, (skygw_log_write_flush(
+					LOGFILE_ERROR,
+					"blockfilter: unsupported option '%s'.\n",
+					options[i])));
+			}
+		}
+
+		if (my_instance->file == NULL)
+		{
+			LOGIF(LE, (skygw_log_write_flush(LOGFILE_ERROR,
+				"blockfilter: The patterns parameter is "
+				"required.\n")));
+			block_free(my_instance);
+			return NULL;
+		}
+		if (!block_load(my_instance) || !block_compile(my_instance))
+		{
+			block_free(my_instance);
+			return NULL;
+		}
+	}
+	return (FILTER *)my_instance;
+}
+
+/**
+ * Read the patterns from the file of the instance
+ *
+ * @param my_instance	The filter instance
+ * @return 1 if the patterns are read, 0 otherwise
+ */
+static int
+block_load(BLOCK_INSTANCE *my_instance)
+{
+FILE	*fp;
+char	line[BLOCK_MAX_PATTERN * 4];
+int	lineno = 0, rval = 1;
+
+	if ((fp = fopen(my_instance->file, "r")) == NULL)
+	{
+		LOGIF(LE, (skygw_log_write_flush(LOGFILE_ERROR,
+			"blockfilter: Unable to open the patterns file '%s'.\n",
+			my_instance->file)));
+		return 0;
+	}
+	if ((my_instance->patterns = calloc(BLOCK_MAX_PATTERNS,
+				sizeof(BLOCK_PATTERN))) == NULL)
+	{
+		fclose(fp);
+		return 0;
+	}
+	while (rval && fgets(line, sizeof(line), fp) != NULL)
+	{
+		lineno++;
+		rval = block_add(my_instance, line, lineno);
+	}
+	fclose(fp);
+	if (rval && my_instance->n_patterns == 0)
+	{
+		LOGIF(LE, (skygw_log_write_flush(LOGFILE_ERROR,
+			"blockfilter: No patterns in the file '%s'.\n",
+			my_instance->file)));
+		rval = 0;
+	}
+	return rval;
+}
+
+/**
+ * Add the pattern of a line of the file
+ *
+ * @param my_instance	The filter instance
+ * @param line		The line, it is modified
+ * @param lineno	The number of the line
+ * @return 1 if the line is added or ignored, 0 if it is in error
+ */
+static int
+block_add(BLOCK_INSTANCE *my_instance, char *line, int lineno)
+{
+BLOCK_PATTERN	*pattern;
+char		norm[BLOCK_MAX_PATTERN + 1];
+char		*match, *ptr;
+int		length;
+
+	if ((ptr = strchr(line, '\n')) != NULL)
+		*ptr = 0;
+	if ((match = strstr(line, "=~")) != NULL)
+	{
+		*match = 0;
+		for (match += 2; BLOCK_IS_SPACE(*match); match++)
+			;
+	}
+	for (ptr = line; BLOCK_IS_SPACE(*ptr); ptr++)
+		;
+	if (*ptr == 0 || *ptr == '#')
+		return 1;
+	if ((length = block_normalise(ptr, norm, sizeof(norm))) < 0)
+	{
+		LOGIF(LE, (skygw_log_write_flush(LOGFILE_ERROR,
+			"blockfilter: The pattern of line %d of '%s' is longer "
+			"than %d characters.\n", lineno, my_instance->file,
+			BLOCK_MAX_PATTERN)));
+		return 0;
+	}
+	if (length == 0)
+	{
+		LOGIF(LE, (skygw_log_write_flush(LOGFILE_ERROR,
+			"blockfilter: The pattern of line %d of '%s' is only "
+			"a comment.\n", lineno, my_instance->file)));
+		return 0;
+	}
+	if (my_instance->n_patterns == BLOCK_MAX_PATTERNS)
+	{
+		LOGIF(LE, (skygw_log_write_flush(LOGFILE_ERROR,
+			"blockfilter: More than %d patterns in '%s'.\n",
+			BLOCK_MAX_PATTERNS, my_instance->file)));
+		return 0;
+	}
+	pattern = &my_instance->patterns[my_instance->n_patterns];
+	if (match && *match)
+	{
+		if (regcomp(&pattern->re, match,
+				REG_EXTENDED|REG_ICASE|REG_NOSUB))
+		{
+			LOGIF(LE, (skygw_log_write_flush(LOGFILE_ERROR,
+				"blockfilter: Invalid regular expression '%s' "
+				"on line %d of '%s'.\n", match, lineno,
+				my_instance->file)));
+			return 0;
+		}
+		if ((pattern->match = strdup(match)) == NULL)
+		{
+			regfree(&pattern->re);
+			return 0;
+		}
+	}
+	if ((pattern->text = strdup(norm)) == NULL)
+	{
+		if (pattern->match)
+		{
+			regfree(&pattern->re);
+			free(pattern->match);
+			pattern->match = NULL;
+		}
+		return 0;
+	}
+	pattern->length = length;
+	pattern->word_start = BLOCK_IS_WORD(norm[0]);
+	pattern->word_end = BLOCK_IS_WORD(norm[length - 1]);
+	pattern->line = lineno;
+	my_instance->n_patterns++;
+	return 1;
+}
+
+/**
+ * Normalise the text of a pattern the way the SQL text is normalised when
+ * it is scanned, the letters are lowered, a comment is a space and a run of
+ * white space is one space. The white space at the end is removed.
+ *
+ * @param text	The text
+ * @param norm	Filled with the normalised text
+ * @param size	Size of norm
+ * @return The length of the normalised text or -1 if it is too long
+ */
+static int
+block_normalise(char *text, char *norm, int size)
+{
+SQLSCAN_LEX	lex;
+char		out[SQLSCAN_LEX_MAX];
+int		length = 0, n, i, end = 0;
+
+	memset(&lex, 0, sizeof(lex));
+	do {
+		/* The end of the text is fed as a space */
+		if (*text)
+			n = sqlscan_lex(&lex, (unsigned char)*text++, out);
+		else
+		{
+			n = sqlscan_lex(&lex, ' ', out);
+			end = 1;
+		}
+		for (i = 0; i < n; i++)
+		{
+			if (BLOCK_IS_SPACE(out[i]))
+			{
+				if (length == 0 || norm[length - 1] == ' ')
+					continue;
+				norm[length++] = ' ';
+			}
+			else
+				norm[length++] = tolower((unsigned char)out[i]);
+			if (length == size)
+				return -1;
+		}
+	} while (!end);
+	while (length > 0 && norm[length - 1] == ' ')
+		length--;
+	norm[length] = 0;
+	return length;
+}
+
+/**
+ * Build the automaton of the patterns. The trie of the patterns is built
+ * first, the failure links are then found breadth first and the missing
+ * transitions of each state are taken from the state of its failure link,
+ * so that the scan makes exactly one transition for each character.
+ *
+ * @param my_instance	The filter instance
+ * @return 1 if the automaton is built, 0 if out of memory
+ */
+static int
+block_compile(BLOCK_INSTANCE *my_instance)
+{
+BLOCK_PATTERN	*pattern;
+int		*fail, *queue;
+int		max_states = 1, i, j, c, s, t, n, head, tail;
+
+	my_instance->n_classes = 1;
+	for (i = 0; i < my_instance->n_patterns; i++)
+	{
+		pattern = &my_instance->patterns[i];
+		max_states += pattern->length;
+		for (j = 0; j < pattern->length; j++)
+		{
+			c = (unsigned char)pattern->text[j];
+			if (my_instance->classes[c] == 0)
+				my_instance->classes[c] = my_instance->n_classes++;
+		}
+	}
+	n = my_instance->n_classes;
+	my_instance->delta = calloc((size_t)max_states * n, sizeof(int));
+	my_instance->out = malloc(max_states * sizeof(int));
+	my_instance->dict = malloc(max_states * sizeof(int));
+	fail = calloc(max_states, sizeof(int));
+	queue = malloc(max_states * sizeof(int));
+	if (my_instance->delta == NULL || my_instance->out == NULL ||
+		my_instance->dict == NULL || fail == NULL || queue == NULL)
+	{
+		free(fail);
+		free(queue);
+		return 0;
+	}
+	for (i = 0; i < max_states; i++)
+	{
+		my_instance->out[i] = -1;
+		my_instance->dict[i] = -1;
+	}
+
+	/* The trie, 0 is the root and no transition leads back to it yet */
+	my_instance->n_states = 1;
+	for (i = 0; i < my_instance->n_patterns; i++)
+	{
+		pattern = &my_instance->patterns[i];
+		s = 0;
+		for (j = 0; j < pattern->length; j++)
+		{
+			c = my_instance->classes[(unsigned char)pattern->text[j]];
+			if ((t = my_instance->delta[s * n + c]) == 0)
+			{
+				t = my_instance->n_states++;
+				my_instance->delta[s * n + c] = t;
+			}
+			s = t;
+		}
+		/* The same pattern twice is reported as the first one */
+		if (my_instance->out[s] == -1)
+			my_instance->out[s] = i;
+	}
+
+	/* The failure links, breadth first */
+	head = tail = 0;
+	for (c = 1; c < n; c++)
+	{
+		if ((t = my_instance->delta[c]) != 0)
+		{
+			fail[t] = 0;
+			queue[tail++] = t;
+		}
+	}
+	while (head < tail)
+	{
+		s = queue[head++];
+		for (c = 1; c < n; c++)
+		{
+			/* Only the children of s in the trie are set yet */
+			if ((t = my_instance->delta[s * n + c]) != 0)
+			{
+				fail[t] = my_instance->delta[fail[s] * n + c];
+				my_instance->dict[t] =
+					my_instance->out[fail[t]] != -1 ?
+					fail[t] : my_instance->dict[fail[t]];
+				queue[tail++] = t;
+			}
+			else
+				my_instance->delta[s * n + c] =
+					my_instance->delta[fail[s] * n + c];
+		}
+	}
+	free(fail);
+	free(queue);
+	return 1;
+}
+
+/**
+ * Free an instance and what it holds
+ *
+ * @param my_instance	The filter instance
+ */
+static void
+block_free(BLOCK_INSTANCE *my_instance)
+{
+int	i;
+
+	for (i = 0; i < my_instance->n_patterns; i++)
+	{
+		free(my_instance->patterns[i].text);
+		if (my_instance->patterns[i].match)
+		{
+			regfree(&my_instance->patterns[i].re);
+			free(my_instance->patterns[i].match);
+		}
+	}
+	free(my_instance->patterns);
+	free(my_instance->delta);
+	free(my_instance->out);
+	free(my_instance->dict);
+	free(my_instance->file);
+	free(my_instance->source);
+	free(my_instance->user);
+	free(my_instance);
+}
+
+/**
+ * Associate a new session with this instance of the filter.
+ *
+ * @param instance	The filter instance data
+ * @param session	The session itself
+ * @return Session specific data for this session
+ */
+static	void	*
+newSession(FILTER *instance, SESSION *session)
+{
+BLOCK_INSTANCE	*my_instance = (BLOCK_INSTANCE *)instance;
+BLOCK_SESSION	*my_session;
+char		*remote, *user;
+
+	if ((my_session = calloc(1, sizeof(BLOCK_SESSION))) != NULL)
+	{
+		my_session->active = 1;
+		if (my_instance->source
+			&& (remote = session_get_remote(session)) != NULL)
+		{
+			if (strcmp(remote, my_instance->source))
+				my_session->active = 0;
+		}
+
+		if (my_instance->user && (user = session_getUser(session))
+				&& strcmp(user, my_instance->user))
+		{
+			my_session->active = 0;
+		}
+	}
+
+	return my_session;
+}
+
+/**
+ * Close a session with the filter, this is the mechanism
+ * by which a filter may cleanup data structure etc.
+ *
+ * @param instance	The filter instance data
+ * @param session	The session being closed
+ */
+static	void
+closeSession(FILTER *instance, void *session)
+{
+}
+
+/**
+ * Free the memory associated with this filter session.
+ *
+ * @param instance	The filter instance data
+ * @param session	The session being closed
+ */
+static void
+freeSession(FILTER *instance, void *session)
+{
+	free(session);
+        return;
+}
+
+/**
+ * Set the downstream component for this filter.
+ *
+ * @param instance	The filter instance data
+ * @param session	The session being closed
+ * @param downstream	The downstream filter or router
+ */
+static void
+setDownstream(FILTER *instance, void *session, DOWNSTREAM *downstream)
+{
+BLOCK_SESSION	*my_session = (BLOCK_SESSION *)session;
+
+	my_session->down = *downstream;
+}
+
+/**
+ * Set the upstream filter or session to which results will be
+ * passed from this filter.
+ *
+ * @param instance	The filter instance data
+ * @param session	The filter session
+ * @param upstream	The upstream filter or session.
+ */
+static void
+setUpstream(FILTER *instance, void *session, UPSTREAM *upstream)
+{
+BLOCK_SESSION	*my_session = (BLOCK_SESSION *)session;
+
+	my_session->up = *upstream;
+}
+
+/**
+ * The routeQuery entry point. A COM_QUERY or COM_STMT_PREPARE that matches
+ * one of the patterns is answered with an error and not passed on.
+ *
+ * @param instance	The filter instance data
+ * @param session	The filter session
+ * @param queue		The query data
+ */
+static	int
+routeQuery(FILTER *instance, void *session, GWBUF *queue)
+{
+BLOCK_INSTANCE	*my_instance = (BLOCK_INSTANCE *)instance;
+BLOCK_SESSION	*my_session = (BLOCK_SESSION *)session;
+BLOCK_PATTERN	*pattern;
+GWBUF		*err;
+char		msg[200];
+int		i;
+
+	if (!my_session->active || (i = block_scan(my_instance, queue)) < 0)
+	{
+		my_session->n_passed++;
+		return my_session->down.routeQuery(my_session->down.instance,
+				my_session->down.session, queue);
+	}
+	pattern = &my_instance->patterns[i];
+	atomic_add(&pattern->n_matched, 1);
+	atomic_add(&my_instance->n_rejected, 1);
+	my_session->n_rejected++;
+	snprintf(msg, sizeof(msg), "Statement rejected, it matches the blocked "
+		"pattern '%.100s'", pattern->text);
+	gwbuf_free(queue);
+	if ((err = modutil_create_mysql_err_msg(1, BLOCK_ERRNO, "42000",
+							msg)) != NULL)
+		my_session->up.clientReply(my_session->up.instance,
+				my_session->up.session, err);
+	return 1;
+}
+
+/**
+ * Scan the SQL text of a statement with the automaton. The segments of the
+ * text are read in place and through the lexer of the comments, the text is
+ * only made contiguous for a regular expression that confirms a match. The outputs of a state are looked at
+ * when the character after it is known, for the end of word check, the
+ * characters before a match are kept in a ring for the start of word check.
+ *
+ * @param my_instance	The filter instance
+ * @param queue		The request
+ * @return The index of the pattern that matched or -1
+ */
+static int
+block_scan(BLOCK_INSTANCE *my_instance, GWBUF *queue)
+{
+MODUTIL_SQL_VIEW	view;
+SQLSCAN_LEX	lex;
+char		ring[BLOCK_MAX_PATTERN + 1];
+char		out[SQLSCAN_LEX_MAX + 1];
+uint8_t		tried[BLOCK_MAX_PATTERNS / 8];
+BLOCK_PATTERN	*pattern;
+char		*stop;
+unsigned long	pos = 0;
+int		n = my_instance->n_classes;
+int		s = 0, p, i, c, last = ' ', end = 0;
+int		n_out = 0, k = 0, final = 0;
+int		any_tried = 0;
+
+	if (!modutil_sql_view(queue, &view))
+		return -1;
+	memset(&lex, 0, sizeof(lex));
+	do {
+		for (i = 0; !end; )
+		{
+			if (k == n_out)
+			{
+				/* The next byte of the text through the lexer */
+				if (i < view.length)
+				{
+					/* The body of a comment is passed over */
+					if (lex.state == SQLSCAN_LEX_COMMENT)
+					{
+						stop = sqlscan_comment_end(
+							view.segment + i,
+							view.segment + view.length);
+						i = stop ? stop - view.segment
+							: view.length - 1;
+					}
+					else if (lex.state == SQLSCAN_LEX_LINE)
+					{
+						stop = memchr(view.segment + i, '\n',
+							view.length - i);
+						i = stop ? stop - view.segment
+							: view.length - 1;
+					}
+					n_out = sqlscan_lex(&lex,
+						(unsigned char)view.segment[i++],
+						out);
+				}
+				else if (view.remaining == 0)
+				{
+					/* The end of the text is a space */
+					n_out = sqlscan_lex(&lex, ' ', out);
+					out[n_out++] = ' ';
+					final = 1;
+				}
+				else
+					break;
+				k = 0;
+				continue;
+			}
+			c = (unsigned char)out[k++];
+			if (final && k == n_out)
+				end = 1;
+			else if (BLOCK_IS_SPACE(c))
+			{
+				if (last == ' ')
+					continue;
+				c = ' ';
+			}
+			else
+				c = tolower(c);
+
+			/* The patterns that end at the last character */
+			p = my_instance->out[s] != -1 ? s : my_instance->dict[s];
+			for (; p != -1; p = my_instance->dict[p])
+			{
+				pattern = &my_instance->patterns[my_instance->out[p]];
+				if (pattern->word_end && BLOCK_IS_WORD(c))
+					continue;
+				if (pattern->word_start &&
+					pos > (unsigned long)pattern->length &&
+					BLOCK_IS_WORD(ring[(pos - pattern->length - 1)
+						% (BLOCK_MAX_PATTERN + 1)]))
+					continue;
+				if (pattern->match)
+				{
+					if (!any_tried)
+					{
+						memset(tried, 0, sizeof(tried));
+						any_tried = 1;
+					}
+					if (!block_confirm(my_instance,
+							my_instance->out[p],
+							queue, tried))
+						continue;
+				}
+				return my_instance->out[p];
+			}
+			if (end)
+				break;
+			ring[pos % (BLOCK_MAX_PATTERN + 1)] = c;
+			pos++;
+			last = c;
+			s = my_instance->delta[s * n + my_instance->classes[c]];
+		}
+	} while (!end && modutil_sql_view_next(&view));
+	return -1;
+}
+
+/**
+ * Confirm the match of a pattern with its regular expression, each
+ * regular expression is run at most once for a statement.
+ *
+ * @param my_instance	The filter instance
+ * @param i		The index of the pattern
+ * @param queue		The request
+ * @param tried		The patterns whose regular expression has failed
+ * @return 1 if the regular expression matches the statement
+ */
+static int
+block_confirm(BLOCK_INSTANCE *my_instance, int i, GWBUF *queue, uint8_t *tried)
+{
+BLOCK_PATTERN	*pattern = &my_instance->patterns[i];
+regmatch_t	match[1];
+char		*sql;
+int		length, rval;
+
+	if (tried[i / 8] & (1 << (i % 8)))
+		return 0;
+	if (!modutil_sql_contiguous(queue, &sql, &length))
+		return 0;
+#ifdef REG_STARTEND
+	match[0].rm_so = 0;
+	match[0].rm_eo = length;
+	rval = regexec(&pattern->re, sql, 1, match, REG_STARTEND);
+#else
+	{
+	char	*orig;
+
+	if ((orig = strndup(sql, length)) == NULL)
+		return 0;
+	rval = regexec(&pattern->re, orig, 1, match, 0);
+	free(orig);
+	}
+#endif
+	if (rval == 0)
+		return 1;
+	tried[i / 8] |= 1 << (i % 8);
+	atomic_add(&my_instance->n_confirm_failed, 1);
+	return 0;
+}
+
+/**
+ * The getInterest entry point. The filter sees the queries and the other
+ * requests, the prepared statements included, of a session that is matched.
+ *
+ * @param instance	The filter instance data
+ * @param session	The filter session
+ * @return The requests the filter session wants to see
+ */
+static int
+getInterest(FILTER *instance, void *session)
+{
+BLOCK_SESSION	*my_session = (BLOCK_SESSION *)session;
+
+	return my_session->active ? FILTER_INTEREST_ALL : 0;
+}
+
+/**
+ * Diagnostics routine
+ *
+ * If fsession is NULL then print diagnostics on the filter
+ * instance as a whole, otherwise print diagnostics for the
+ * particular session.
+ *
+ * @param	instance	The filter instance
+ * @param	fsession	Filter session, may be NULL
+ * @param	dcb		The DCB for diagnostic output
+ */
+static	void
+diagnostic(FILTER *instance, void *fsession, DCB *dcb)
+{
+BLOCK_INSTANCE	*my_instance = (BLOCK_INSTANCE *)instance;
+BLOCK_SESSION	*my_session = (BLOCK_SESSION *)fsession;
+BLOCK_PATTERN	*pattern;
+int		i;
+
+	dcb_printf(dcb, "\t\tPatterns file:				%s\n",
+			my_instance->file);
+	dcb_printf(dcb, "\t\tNo. of patterns:			%d\n",
+			my_instance->n_patterns);
+	dcb_printf(dcb, "\t\tNo. of states of the automaton:		%d\n",
+			my_instance->n_states);
+	if (my_instance->source)
+		dcb_printf(dcb, "\t\tLimit to connections from		%s\n",
+				my_instance->source);
+	if (my_instance->user)
+		dcb_printf(dcb, "\t\tLimit to user				%s\n",
+				my_instance->user);
+	if (my_session)
+	{
+		dcb_printf(dcb, "\t\tNo. of statements passed on:		%d\n",
+			my_session->n_passed);
+		dcb_printf(dcb, "\t\tNo. of statements rejected:		%d\n",
+			my_session->n_rejected);
+		return;
+	}
+	dcb_printf(dcb, "\t\tNo. of statements rejected:		%d\n",
+			my_instance->n_rejected);
+	dcb_printf(dcb, "\t\tNo. of matches not confirmed:		%d\n",
+			my_instance->n_confirm_failed);
+	for (i = 0; i < my_instance->n_patterns; i++)
+	{
+		pattern = &my_instance->patterns[i];
+		if (pattern->n_matched)
+			dcb_printf(dcb, "\t\t\tline %-5d %-40.40s rejected %d\n",
+				pattern->line, pattern->text,
+				pattern->n_matched);
+	}
+}
@@ -0,0 +1,951 @@
+/*
+ * This file is distributed as part of MaxScale by SkySQL.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <filter.h>
+#include <modinfo.h>
+#include <modutil.h>
+#include <spinlock.h>
+#include <atomic.h>
+#include <timer.h>
+#include <mysql_client_server_protocol.h>
+#include <mysql_packet.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+extern int lm_enabled_logfiles_bitmask;
+
+/**
+ * @file coalescefilter.c - a filter that merges single row INSERTs
+ * @verbatim
+ *
+ * Consecutive single row INSERT statements of a session that name the same
+ * table and columns, INSERT INTO t (a, b) VALUES (1, 2), are sent to the
+ * server as one multi-row INSERT. The OK of the multi-row INSERT is sent
+ * back to the client as one OK for each statement, with one affected row
+ * each. The insert ids are counted up from the first one the server gives,
+ * which assumes an auto_increment_increment of 1. An error of the multi-row
+ * INSERT is the error of every statement, none of the rows are inserted.
+ *
+ * The statements are only held back when the client has not waited for the
+ * reply to the statement before them, a client that waits for each reply
+ * sees no delay. The statements are merged until max_rows or max_size is
+ * reached, a statement that can not be merged comes or max_delay
+ * milliseconds have passed. Statements are not merged in a transaction or
+ * with autocommit disabled.
+ *
+ * Optional parameters
+ *	max_rows=<rows of a multi-row INSERT, default 100>
+ *	max_size=<bytes of a multi-row INSERT, default 16384>
+ *	max_delay=<milliseconds a statement is held back, default 10>
+ *	source=<source address to limit filter>
+ *	user=<username to limit filter>
+ * @endverbatim
+ */
+
+MODULE_INFO 	info = {
+	MODULE_API_FILTER,
+	MODULE_BETA_RELEASE,
+	FILTER_VERSION,
+	"A filter that merges single row INSERT statements"
+};
+
+static char *version_str = "V1.0.0";
+
+#define	COALESCE_MAX_ROWS	100		/* Default max_rows */
+#define	COALESCE_MAX_SIZE	16384		/* Default max_size */
+#define	COALESCE_MAX_DELAY	10		/* Default max_delay */
+#define	COALESCE_REPLY_MAX	1024		/* Bytes of a reply kept */
+
+/**
+ * Instance structure
+ */
+typedef struct {
+	char		*source;	/* Source address to restrict matches */
+	char		*user;		/* User name to restrict matches */
+	int		max_rows;	/* Rows of a multi-row INSERT */
+	int		max_size;	/* Bytes of a multi-row INSERT */
+	int		max_delay;	/* Milliseconds a statement is held */
+	int		n_batches;	/* Multi-row INSERTs sent */
+	int		n_rows;		/* Statements merged into them */
+} COALESCE_INSTANCE;
+
+/**
+ * A multi-row INSERT sent to the server, the reply is sent back to the
+ * client as one reply for each row.
+ */
+typedef struct coalesce_batch {
+	unsigned int		reply;		/* The reply to the INSERT */
+	int			n_rows;		/* Statements in the INSERT */
+	struct coalesce_batch	*next;		/* The next INSERT sent */
+} COALESCE_BATCH;
+
+/**
+ * The session structure for this filter. The replies are counted as in the
+ * cache filter, the reply of a multi-row INSERT is known when it arrives.
+ */
+typedef struct {
+	DOWNSTREAM	down;		/* The downstream filter */
+	UPSTREAM	up;		/* The upstream filter */
+	COALESCE_INSTANCE *instance;	/* The filter instance */
+	int		active;		/* Is filter active */
+	int		autocommit;	/* Autocommit is enabled */
+	int		in_trx;		/* A transaction has been started */
+	SPINLOCK	lock;		/* Protects the reply state */
+	unsigned int	n_sent;		/* Requests that have a reply */
+	unsigned int	n_replied;	/* Replies complete */
+	COALESCE_BATCH	*first;		/* The oldest multi-row INSERT sent */
+	COALESCE_BATCH	*last;		/* The newest multi-row INSERT sent */
+	uint8_t		reply[COALESCE_REPLY_MAX]; /* The reply being split */
+	int		reply_len;	/* Bytes of the reply */
+	TIMER		timer;		/* Sends the INSERT being merged */
+	GWBUF		*batch;		/* The INSERT being merged or NULL */
+	int		batch_len;	/* Bytes of SQL in the INSERT */
+	int		batch_prefix;	/* Bytes up to and with VALUES */
+	int		batch_rows;	/* Rows in the INSERT */
+	int		n_batches;	/* Multi-row INSERTs sent */
+	int		n_rows;		/* Statements merged into them */
+} COALESCE_SESSION;
+
+static	FILTER	*createInstance(char **options, FILTER_PARAMETER **params);
+static	void	*newSession(FILTER *instance, SESSION *session);
+static	void 	closeSession(FILTER *instance, void *session);
+static	void 	freeSession(FILTER *instance, void *session);
+static	void	setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
+static	void	setUpstream(FILTER *instance, void *fsession, UPSTREAM *upstream);
+static	int	routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
+static	int	clientReply(FILTER *instance, void *fsession, GWBUF *queue);
+static	void	diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+static	int	getInterest(FILTER *instance, void *fsession);
+
+static	int	coalesce_parse(char *, int, int *, int *);
+static	int	coalesce_keyword(char **, char *, char *);
+static	void	coalesce_trx_state(COALESCE_SESSION *, char *, int);
+static	int	coalesce_add(COALESCE_SESSION *, char *, int, int, int);
+static	int	coalesce_flush(COALESCE_SESSION *);
+static	void	coalesce_timeout(void *);
+static	GWBUF	*coalesce_split(COALESCE_SESSION *, int);
+
+static FILTER_OBJECT MyObject = {
+    createInstance,
+    newSession,
+    closeSession,
+    freeSession,
+    setDownstream,
+    setUpstream,
+    routeQuery,
+    clientReply,
+    diagnostic,
+    NULL,		// No batch routing
+    getInterest,
+};
+
+/**
+ * Implementation of the mandatory version entry point
+ *
+ * @return version string of the module
+ */
+char *
+version()
+{
+	return version_str;
+}
+
+/**
+ * The module initialisation routine, called when the module
+ * is first loaded.
+ */
+void
+ModuleInit()
+{
+}
+
+/**
+ * The module entry point routine. It is this routine that
+ * must populate the structure that is referred to as the
+ * "module object", this is a structure with the set of
+ * external entry points for this module.
+ *
+ * @return The module object
+ */
+FILTER_OBJECT *
+GetModuleObject()
+{
+	return &MyObject;
+}
+
+/**
+ * Create an instance of the filter for a particular service
+ * within MaxScale.
+ *
+ * @param options	The options for this filter
+ * @param params	The array of name/value pair parameters for the filter
+ *
+ * @return The instance data for this new instance
+ */
+static	FILTER	*
+createInstance(char **options, FILTER_PARAMETER **params)
+{
+COALESCE_INSTANCE	*my_instance;
+int			i;
+
+	if ((my_instance = calloc(1, sizeof(COALESCE_INSTANCE))) != NULL)
+	{
+		my_instance->max_rows = COALESCE_MAX_ROWS;
+		my_instance->max_size = COALESCE_MAX_SIZE;
+		my_instance->max_delay = COALESCE_MAX_DELAY;
+		for (i = 0; params && params[i]; i++)
+		{
+			if (!strcmp(params[i]->name, "max_rows"))
+				my_instance->max_rows = atoi(params[i]->value);
+			else if (!strcmp(params[i]->name, "max_size"))
+				my_instance->max_size = atoi(params[i]->value);
+			else if (!strcmp(params[i]->name, "max_delay"))
+				my_instance->max_delay = atoi(params[i]->value);
+			else if (!strcmp(params[i]->name, "source"))
+				my_instance->source = strdup(params[i]->value);
+			else if (!strcmp(params[i]->name, "user"))
+				my_instance->user = strdup(params[i]->value);
+			else if (!filter_standard_parameter(params[i]->name))
+			{
+				LOGIF(LE, (skygw_log_write_flush(
+					LOGFILE_ERROR,
+					"coalescefilter: Unexpected parameter '%s'.\n",
+					params[i]->name)));
+			}
+		}
+
+		if (options)
+		{
+			for (i = 0; options[i]; i++)
+			{
+				LOGIF(LE, (skygw_log_write_flush(
+					LOGFILE_ERROR,
+					"coalescefilter: unsupported option '%s'.\n",
+					options[i])));
+			}
+		}
+
+		if (my_instance->max_rows < 2 || my_instance->max_size < 64 ||
+			my_instance->max_size > 0xfffffe ||
+			my_instance->max_delay <= 0)
+		{
+			LOGIF(LE, (skygw_log_write_flush(LOGFILE_ERROR,
+				"coalescefilter: max_rows must be at least 2, "
+				"max_size at least 64 and max_delay "
+				"positive.\n")));
+			free(my_instance->source);
+			free(my_instance->user);
+			free(my_instance);
+			return NULL;
+		}
+	}
+	return (FILTER *)my_instance;
+}
+
+/**
+ * Associate a new session with this instance of the filter.
+ *
+ * @param instance	The filter instance data
+ * @param session	The session itself
+ * @return Session specific data for this session
+ */
+static	void	*
+newSession(FILTER *instance, SESSION *session)
+{
+COALESCE_INSTANCE	*my_instance = (COALESCE_INSTANCE *)instance;
+COALESCE_SESSION	*my_session;
+char			*remote, *user;
+
+	if ((my_session = calloc(1, sizeof(COALESCE_SESSION))) != NULL)
+	{
+		my_session->active = 1;
+		my_session->autocommit = 1;
+		my_session->instance = my_instance;
+		spinlock_init(&my_session->lock);
+		timer_init(&my_session->timer);
+		if (my_instance->source
+			&& (remote = session_get_remote(session)) != NULL)
+		{
+			if (strcmp(remote, my_instance->source))
+				my_session->active = 0;
+		}
+
+		if (my_instance->user && (user = session_getUser(session))
+				&& strcmp(user, my_instance->user))
+		{
+			my_session->active = 0;
+		}
+	}
+
+	return my_session;
+}
+
+/**
+ * Close a session with the filter, an INSERT still being merged is thrown
+ * away as the client has gone.
+ *
+ * @param instance	The filter instance data
+ * @param session	The session being closed
+ */
+static	void
+closeSession(FILTER *instance, void *session)
+{
+COALESCE_SESSION	*my_session = (COALESCE_SESSION *)session;
+
+	timer_disable(&my_session->timer);
+	if (my_session->batch)
+	{
+		gwbuf_free(my_session->batch);
+		my_session->batch = NULL;
+	}
+}
+
+/**
+ * Free the memory associated with this filter session.
+ *
+ * @param instance	The filter instance data
+ * @param session	The session being closed
+ */
+static void
+freeSession(FILTER *instance, void *session)
+{
+COALESCE_SESSION	*my_session = (COALESCE_SESSION *)session;
+COALESCE_BATCH		*batch;
+
+	while ((batch = my_session->first) != NULL)
+	{
+		my_session->first = batch->next;
+		free(batch);
+	}
+	free(session);
+        return;
+}
+
+/**
+ * Set the downstream component for this filter.
+ *
+ * @param instance	The filter instance data
+ * @param session	The session being closed
+ * @param downstream	The downstream filter or router
+ */
+static void
+setDownstream(FILTER *instance, void *session, DOWNSTREAM *downstream)
+{
+COALESCE_SESSION	*my_session = (COALESCE_SESSION *)session;
+
+	my_session->down = *downstream;
+}
+
+/**
+ * Set the upstream filter or session to which results will be
+ * passed from this filter.
+ *
+ * @param instance	The filter instance data
+ * @param session	The filter session
+ * @param upstream	The upstream filter or session.
+ */
+static void
+setUpstream(FILTER *instance, void *session, UPSTREAM *upstream)
+{
+COALESCE_SESSION	*my_session = (COALESCE_SESSION *)session;
+
+	my_session->up = *upstream;
+}
+
+/**
+ * The routeQuery entry point. A single row INSERT is merged into the INSERT
+ * being built or starts one if the reply to an earlier request is still to
+ * come. Any other request first sends the INSERT being built.
+ *
+ * @param instance	The filter instance data
+ * @param session	The filter session
+ * @param queue		The query data
+ */
+static	int
+routeQuery(FILTER *instance, void *session, GWBUF *queue)
+{
+COALESCE_INSTANCE	*my_instance = (COALESCE_INSTANCE *)instance;
+COALESCE_SESSION	*my_session = (COALESCE_SESSION *)session;
+uint8_t			*data = GWBUF_DATA(queue);
+MODUTIL_SQL_VIEW	view;
+char			*sql;
+int			length, prefix, row, waiting;
+
+	if (GWBUF_LENGTH(queue) < 5 || MYSQL_GET_PACKET_NO(data) != 0)
+		goto route;
+
+	switch (MYSQL_GET_COMMAND(data))
+	{
+	case MYSQL_COM_QUIT:
+	case MYSQL_COM_STMT_CLOSE:
+	case MYSQL_COM_STMT_SEND_LONG_DATA:
+		/* No reply */
+		if (my_session->batch && !coalesce_flush(my_session))
+			return 0;
+		goto route;
+	case MYSQL_COM_QUERY:
+		if (!my_session->active || !modutil_sql_view(queue, &view) ||
+			view.remaining)
+			break;
+		sql = view.segment;
+		length = view.length;
+		coalesce_trx_state(my_session, sql, length);
+		if (!my_session->autocommit || my_session->in_trx ||
+			length > my_instance->max_size ||
+			!coalesce_parse(sql, length, &prefix, &row))
+			break;
+		if (my_session->batch &&
+			(prefix != my_session->batch_prefix ||
+			memcmp(sql, (char *)GWBUF_DATA(my_session->batch) + 5,
+				prefix) ||
+			my_session->batch_len + 1 + length - row >
+						my_instance->max_size) &&
+			!coalesce_flush(my_session))
+		{
+			gwbuf_free(queue);
+			return 0;
+		}
+		spinlock_acquire(&my_session->lock);
+		waiting = my_session->n_sent != my_session->n_replied;
+		spinlock_release(&my_session->lock);
+		if (my_session->batch == NULL && !waiting)
+			break;
+		if (!coalesce_add(my_session, sql, length, prefix, row))
+			break;
+		gwbuf_free(queue);
+		if (my_session->batch_rows >= my_instance->max_rows)
+			return coalesce_flush(my_session);
+		return 1;
+	default:
+		break;
+	}
+
+	if (my_session->batch && !coalesce_flush(my_session))
+	{
+		gwbuf_free(queue);
+		return 0;
+	}
+	spinlock_acquire(&my_session->lock);
+	my_session->n_sent++;
+	spinlock_release(&my_session->lock);
+
+route:
+	return my_session->down.routeQuery(my_session->down.instance,
+			my_session->down.session, queue);
+}
+
+/**
+ * Add the row of an INSERT to the INSERT being built, the first row starts
+ * it in a buffer of max_size.
+ *
+ * @param my_session	The filter session
+ * @param sql		The INSERT statement
+ * @param length	The length of the statement
+ * @param prefix	The bytes of the statement up to and with VALUES
+ * @param row		The offset of the row in the statement
+ * @return True if the row has been added
+ */
+static int
+coalesce_add(COALESCE_SESSION *my_session, char *sql, int length, int prefix,
+	int row)
+{
+char	*ptr;
+int	rowlen = length - row;
+
+	/* Any white space or ; after the row is not copied */
+	while (rowlen > 0 && sql[row + rowlen - 1] != ')')
+		rowlen--;
+	if (my_session->batch == NULL)
+	{
+		if ((my_session->batch = gwbuf_alloc(
+				my_session->instance->max_size + 5)) == NULL)
+			return 0;
+		ptr = GWBUF_DATA(my_session->batch);
+		ptr[3] = 0;
+		ptr[4] = MYSQL_COM_QUERY;
+		memcpy(ptr + 5, sql, prefix);
+		my_session->batch_len = prefix;
+		my_session->batch_prefix = prefix;
+		my_session->batch_rows = 0;
+		timer_start(&my_session->timer,
+			my_session->instance->max_delay,
+			coalesce_timeout, my_session);
+	}
+	ptr = (char *)GWBUF_DATA(my_session->batch) + 5 + my_session->batch_len;
+	if (my_session->batch_rows)
+	{
+		*ptr++ = ',';
+		my_session->batch_len++;
+	}
+	memcpy(ptr, sql + row, rowlen);
+	my_session->batch_len += rowlen;
+	my_session->batch_rows++;
+	return 1;
+}
+
+/**
+ * Send the INSERT being built to the server
+ *
+ * @param my_session	The filter session
+ * @return The result of routing the INSERT
+ */
+static int
+coalesce_flush(COALESCE_SESSION *my_session)
+{
+COALESCE_BATCH	*batch = NULL;
+GWBUF		*queue = my_session->batch;
+uint8_t		*ptr;
+int		length = my_session->batch_len + 1;
+
+	timer_cancel(&my_session->timer);
+	my_session->batch = NULL;
+	ptr = GWBUF_DATA(queue);
+	ptr[0] = length & 0xff;
+	ptr[1] = (length >> 8) & 0xff;
+	ptr[2] = (length >> 16) & 0xff;
+	GWBUF_RTRIM(queue, GWBUF_LENGTH(queue) - (length + 4));
+	gwbuf_set_type(queue, GWBUF_TYPE_MYSQL|GWBUF_TYPE_SINGLE_STMT);
+
+	if (my_session->batch_rows > 1)
+	{
+		if ((batch = malloc(sizeof(COALESCE_BATCH))) == NULL)
+		{
+			gwbuf_free(queue);
+			return 0;
+		}
+		batch->n_rows = my_session->batch_rows;
+		batch->next = NULL;
+		my_session->n_batches++;
+		my_session->n_rows += batch->n_rows;
+		atomic_add(&my_session->instance->n_batches, 1);
+		atomic_add(&my_session->instance->n_rows, batch->n_rows);
+	}
+	spinlock_acquire(&my_session->lock);
+	my_session->n_sent++;
+	if (batch)
+	{
+		batch->reply = my_session->n_sent;
+		if (my_session->last)
+			my_session->last->next = batch;
+		else
+			my_session->first = batch;
+		my_session->last = batch;
+	}
+	spinlock_release(&my_session->lock);
+
+	return my_session->down.routeQuery(my_session->down.instance,
+			my_session->down.session, queue);
+}
+
+/**
+ * The timer callback that sends the INSERT being built after max_delay
+ *
+ * @param data	The filter session
+ */
+static void
+coalesce_timeout(void *data)
+{
+COALESCE_SESSION	*my_session = (COALESCE_SESSION *)data;
+
+	if (my_session->batch)
+		coalesce_flush(my_session);
+}
+
+/**
+ * The clientReply entry point. The replies are counted as they pass, the
+ * reply of a multi-row INSERT is kept until it is complete and is then sent
+ * on as the replies of the statements that were merged.
+ *
+ * @param instance	The filter instance data
+ * @param session	The filter session
+ * @param reply		The reply data
+ */
+static	int
+clientReply(FILTER *instance, void *session, GWBUF *reply)
+{
+COALESCE_SESSION	*my_session = (COALESCE_SESSION *)session;
+COALESCE_BATCH		*batch;
+GWBUF			*buf, *next, *out = NULL;
+int			len, end, n_rows;
+
+	for (buf = reply; buf; buf = next)
+	{
+		next = buf->next;
+		end = GWBUF_IS_TYPE_RESPONSE_END(buf);
+		n_rows = 0;
+
+		spinlock_acquire(&my_session->lock);
+		batch = my_session->first;
+		if (batch && batch->reply == my_session->n_replied + 1)
+		{
+			len = GWBUF_LENGTH(buf);
+			if (len > COALESCE_REPLY_MAX - my_session->reply_len)
+				len = COALESCE_REPLY_MAX - my_session->reply_len;
+			memcpy(my_session->reply + my_session->reply_len,
+				GWBUF_DATA(buf), len);
+			my_session->reply_len += len;
+			buf->next = NULL;
+			gwbuf_free(buf);
+			buf = NULL;
+			if (end)
+			{
+				n_rows = batch->n_rows;
+				if ((my_session->first = batch->next) == NULL)
+					my_session->last = NULL;
+				free(batch);
+			}
+		}
+		/* The answer to LOCAL INFILE is marked too, it has no request */
+		if (end && my_session->n_replied != my_session->n_sent)
+			my_session->n_replied++;
+		spinlock_release(&my_session->lock);
+
+		if (buf)
+		{
+			buf->next = NULL;
+			out = gwbuf_append(out, buf);
+		}
+		else if (n_rows)
+		{
+			out = gwbuf_append(out, coalesce_split(my_session,
+								n_rows));
+			my_session->reply_len = 0;
+		}
+	}
+
+	if (out == NULL)
+		return 1;
+	return my_session->up.clientReply(my_session->up.instance,
+			my_session->up.session, out);
+}
+
+/**
+ * Split the reply of a multi-row INSERT into the replies of its rows. An OK
+ * gives each row an affected row and its insert id, an error is the error
+ * of each row. Each reply is a buffer of its own marked as the end of a
+ * reply.
+ *
+ * @param my_session	The filter session
+ * @param n_rows	The rows of the INSERT
+ * @return The chain of replies
+ */
+static GWBUF *
+coalesce_split(COALESCE_SESSION *my_session, int n_rows)
+{
+GWBUF		*out = NULL, *buf;
+uint8_t		*ptr, *end, *data, status[2] = {0, 0}, warnings[2] = {0, 0};
+uint64_t	affected = 0, insert_id = 0;
+int		i, len = my_session->reply_len;
+MYSQL_READER	rd;
+
+	ptr = my_session->reply;
+	end = my_session->reply + len;
+	if (len < 5 || (ptr[4] != 0x00 && ptr[4] != 0xff) ||
+		4 + MYSQL_GET_PACKET_LEN(ptr) > len)
+	{
+		/* Not an OK or an error, pass it on as it is */
+		if ((buf = gwbuf_alloc(len)) == NULL)
+			return NULL;
+		memcpy(GWBUF_DATA(buf), ptr, len);
+		gwbuf_set_type(buf, GWBUF_TYPE_MYSQL|GWBUF_TYPE_RESPONSE_END);
+		return buf;
+	}
+	if (ptr[4] == 0x00)
+	{
+		mysql_reader_init(&rd, ptr + 5, end - ptr - 5);
+		affected = mysql_read_lenenc(&rd, NULL);
+		insert_id = mysql_read_lenenc(&rd, NULL);
+		memset(status, 0, 2);
+		memset(warnings, 0, 2);
+		if (mysql_reader_left(&rd) >= 4)
+		{
+			memcpy(status, rd.ptr, 2);
+			memcpy(warnings, rd.ptr + 2, 2);
+		}
+	}
+	for (i = 0; i < n_rows; i++)
+	{
+		if (my_session->reply[4] == 0xff)
+		{
+			len = 4 + MYSQL_GET_PACKET_LEN(my_session->reply);
+			if ((buf = gwbuf_alloc(len)) == NULL)
+				break;
+			memcpy(GWBUF_DATA(buf), my_session->reply, len);
+		}
+		else
+		{
+			/* Header, 0x00, two lenenc of up to 9, status, warnings */
+			if ((buf = gwbuf_alloc(4 + 1 + 9 + 9 + 4)) == NULL)
+				break;
+			data = GWBUF_DATA(buf);
+			ptr = data + 4;
+			*ptr++ = 0x00;
+			ptr = mysql_write_lenenc(ptr, i < affected ? 1 : 0);
+			ptr = mysql_write_lenenc(ptr, insert_id ?
+							insert_id + i : 0);
+			*ptr++ = status[0];
+			*ptr++ = status[1];
+			/* The warnings are given to the first row */
+			*ptr++ = i == 0 ? warnings[0] : 0;
+			*ptr++ = i == 0 ? warnings[1] : 0;
+			len = ptr - data;
+			mysql_write_header(data, len - 4, my_session->reply[3]);
+			GWBUF_RTRIM(buf, GWBUF_LENGTH(buf) - len);
+		}
+		gwbuf_set_type(buf, GWBUF_TYPE_MYSQL|GWBUF_TYPE_RESPONSE_END);
+		out = gwbuf_append(out, buf);
+	}
+	return out;
+}
+
+/**
+ * Follow the statements that start and end transactions and change
+ * autocommit, only the plain forms are recognised.
+ *
+ * @param my_session	The filter session
+ * @param sql		The statement
+ * @param length	The length of the statement
+ */
+static void
+coalesce_trx_state(COALESCE_SESSION *my_session, char *sql, int length)
+{
+char	*ptr = sql, *end = sql + length;
+
+	while (ptr < end && isspace(*ptr))
+		ptr++;
+	if (coalesce_keyword(&ptr, end, "BEGIN") ||
+		(coalesce_keyword(&ptr, end, "START") &&
+			coalesce_keyword(&ptr, end, "TRANSACTION")))
+		my_session->in_trx = 1;
+	else if (coalesce_keyword(&ptr, end, "COMMIT") ||
+		coalesce_keyword(&ptr, end, "ROLLBACK"))
+		my_session->in_trx = 0;
+	else if (coalesce_keyword(&ptr, end, "SET"))
+	{
+		/* SET autocommit = 0 and the @@ forms */
+		while (ptr < end && (*ptr == '@' || isspace(*ptr)))
+			ptr++;
+		if (end - ptr > 8 && !strncasecmp(ptr, "session.", 8))
+			ptr += 8;
+		if (!coalesce_keyword(&ptr, end, "autocommit"))
+			return;
+		while (ptr < end && (*ptr == '=' || isspace(*ptr)))
+			ptr++;
+		if (ptr < end && (*ptr == '0' ||
+			coalesce_keyword(&ptr, end, "OFF")))
+			my_session->autocommit = 0;
+		else
+			my_session->autocommit = 1;
+	}
+}
+
+/**
+ * Match a keyword and the white space after it
+ *
+ * @param ptr	The position, moved past the keyword if it matches
+ * @param end	The end of the statement
+ * @param word	The keyword
+ * @return True if the keyword matches
+ */
+static int
+coalesce_keyword(char **ptr, char *end, char *word)
+{
+char	*p = *ptr;
+int	len = strlen(word);
+
+	if (end - p < len || strncasecmp(p, word, len))
+		return 0;
+	p += len;
+	if (p < end && (isalnum(*p) || *p == '_'))
+		return 0;
+	while (p < end && isspace(*p))
+		p++;
+	*ptr = p;
+	return 1;
+}
+
+/**
+ * Check for a single row INSERT, INSERT INTO table [(columns)] VALUES (row)
+ * with nothing but white space or a ; after the row.
+ *
+ * @param sql		The statement
+ * @param length	The length of the statement
+ * @param prefix	Set to the length up to and with VALUES
+ * @param row		Set to the offset of the row
+ * @return True if the statement is a single row INSERT
+ */
+static int
+coalesce_parse(char *sql, int length, int *prefix, int *row)
+{
+char	*ptr = sql, *end = sql + length, quote = 0;
+int	depth = 0;
+
+	while (ptr < end && isspace(*ptr))
+		ptr++;
+	if (!coalesce_keyword(&ptr, end, "INSERT") ||
+		!coalesce_keyword(&ptr, end, "INTO"))
+		return 0;
+
+	/* The table, db.table or quoted names */
+	if (ptr == end || *ptr == '(')
+		return 0;
+	while (ptr < end && !isspace(*ptr) && *ptr != '(')
+	{
+		if (*ptr == '`')
+		{
+			while (++ptr < end && *ptr != '`')
+				;
+			if (ptr == end)
+				return 0;
+		}
+		else if (!isalnum(*ptr) && *ptr != '_' && *ptr != '$' &&
+				*ptr != '.')
+			return 0;
+		ptr++;
+	}
+	while (ptr < end && isspace(*ptr))
+		ptr++;
+	if (ptr < end && *ptr == '(')
+	{
+		/* The column list */
+		while (++ptr < end && *ptr != ')')
+		{
+			if (*ptr == '`')
+			{
+				while (++ptr < end && *ptr != '`')
+					;
+				if (ptr == end)
+					return 0;
+			}
+			else if (*ptr == '(' || *ptr == '\'' || *ptr == '"')
+				return 0;
+		}
+		if (ptr == end)
+			return 0;
+		ptr++;
+		while (ptr < end && isspace(*ptr))
+			ptr++;
+	}
+	if (end - ptr < 6 || strncasecmp(ptr, "VALUES", 6))
+		return 0;
+	ptr += 6;
+	*prefix = ptr - sql;
+	while (ptr < end && isspace(*ptr))
+		ptr++;
+	if (ptr == end || *ptr != '(')
+		return 0;
+	*row = ptr - sql;
+
+	/* The row, to its closing parenthesis */
+	for (; ptr < end; ptr++)
+	{
+		if (quote)
+		{
+			if (*ptr == '\\' && ptr + 1 < end)
+				ptr++;
+			else if (*ptr == quote)
+			{
+				if (ptr + 1 < end && ptr[1] == quote)
+					ptr++;
+				else
+					quote = 0;
+			}
+		}
+		else if (*ptr == '\'' || *ptr == '"' || *ptr == '`')
+			quote = *ptr;
+		else if (*ptr == '(')
+			depth++;
+		else if (*ptr == ')' && --depth == 0)
+			break;
+		else if (*ptr == '#' || (*ptr == '-' && ptr + 1 < end &&
+			ptr[1] == '-') || (*ptr == '/' && ptr + 1 < end &&
+			ptr[1] == '*'))
+			return 0;	/* Comments are not looked into */
+	}
+	if (ptr == end)
+		return 0;
+	for (ptr++; ptr < end && (isspace(*ptr) || *ptr == ';'); ptr++)
+		;
+	return ptr == end;
+}
+
+/**
+ * The getInterest entry point. A session that is not matched is left out of
+ * the filter chain, the replies are counted so every request of the others
+ * is needed.
+ *
+ * @param instance	The filter instance data
+ * @param session	The filter session
+ * @return The requests the filter session wants to see
+ */
+static int
+getInterest(FILTER *instance, void *session)
+{
+COALESCE_SESSION	*my_session = (COALESCE_SESSION *)session;
+
+	return my_session->active ? FILTER_INTEREST_ALL : 0;
+}
+
+/**
+ * Diagnostics routine
+ *
+ * If fsession is NULL then print diagnostics on the filter
+ * instance as a whole, otherwise print diagnostics for the
+ * particular session.
+ *
+ * @param	instance	The filter instance
+ * @param	fsession	Filter session, may be NULL
+ * @param	dcb		The DCB for diagnostic output
+ */
+static	void
+diagnostic(FILTER *instance, void *fsession, DCB *dcb)
+{
+COALESCE_INSTANCE	*my_instance = (COALESCE_INSTANCE *)instance;
+COALESCE_SESSION	*my_session = (COALESCE_SESSION *)fsession;
+
+	dcb_printf(dcb, "\t\tRows of a multi-row INSERT:		%d\n",
+			my_instance->max_rows);
+	dcb_printf(dcb, "\t\tBytes of a multi-row INSERT:		%d\n",
+			my_instance->max_size);
+	dcb_printf(dcb, "\t\tMilliseconds a statement is held:	%d\n",
+			my_instance->max_delay);
+	if (my_instance->source)
+		dcb_printf(dcb, "\t\tLimit to connections from		%s\n",
+				my_instance->source);
+	if (my_instance->user)
+		dcb_printf(dcb, "\t\tLimit to user				%s\n",
+				my_instance->user);
+	if (my_session)
+	{
+		dcb_printf(dcb, "\t\tNo. of multi-row INSERTs:		%d\n",
+			my_session->n_batches);
+		dcb_printf(dcb, "\t\tNo. of statements merged:		%d\n",
+			my_session->n_rows);
+	}
+	else
+	{
+		dcb_printf(dcb, "\t\tNo. of multi-row INSERTs:		%d\n",
+			my_instance->n_batches);
+		dcb_printf(dcb, "\t\tNo. of statements merged:		%d\n",
+			my_instance->n_rows);
+	}
+}
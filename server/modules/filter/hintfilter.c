@@ -0,0 +1,412 @@
+/*
+ * This file is distributed as part of MaxScale by SkySQL.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <filter.h>
+#include <modinfo.h>
+#include <modutil.h>
+#include <hint.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+#include <string.h>
+#include <regex.h>
+
+extern int lm_enabled_logfiles_bitmask;
+
+/**
+ * @file hintfilter.c - a filter that adds routing hints to statements
+ * @verbatim
+ *
+ * The statements that match a regular expression are given the hints of
+ * the filter, as if the hints were written in a comment of the statement.
+ * Hints that are written in the statement come first and override the ones
+ * of the filter. The parameters of the filter are
+ *	match=<regular expression>
+ *	max_slave_replication_lag=<seconds a slave may be behind the master
+ *		for the matching reads>
+ * Two optional parameters
+ *	source=<source address to limit filter>
+ *	user=<username to limit filter>
+ * @endverbatim
+ */
+
+MODULE_INFO 	info = {
+	MODULE_API_FILTER,
+	MODULE_BETA_RELEASE,
+	FILTER_VERSION,
+	"A filter that adds routing hints to the statements that match a regular expression"
+};
+
+static char *version_str = "V1.0.0";
+
+/**
+ * Instance structure
+ */
+typedef struct {
+	char	*source;	/* Source address to restrict matches */
+	char	*user;		/* User name to restrict matches */
+	char	*match;		/* Regular expression to match */
+	char	*max_rlag;	/* The max_slave_replication_lag hint */
+	regex_t	re;		/* Compiled regex text */
+} HINT_INSTANCE;
+
+/**
+ * The session structure for this hint filter
+ */
+typedef struct {
+	DOWNSTREAM	down;		/* The downstream filter */
+	int		n_hinted;	/* No. of statements given hints */
+	int		active;		/* Is filter active */
+} HINT_SESSION;
+
+static	FILTER	*createInstance(char **options, FILTER_PARAMETER **params);
+static	void	*newSession(FILTER *instance, SESSION *session);
+static	void 	closeSession(FILTER *instance, void *session);
+static	void 	freeSession(FILTER *instance, void *session);
+static	void	setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
+static	int	routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
+static	void	diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+static	int	getInterest(FILTER *instance, void *fsession);
+static	int	routeBatch(FILTER *instance, void *fsession, GWBUF *queue);
+static	void	hint_statement(HINT_INSTANCE *, HINT_SESSION *, GWBUF *);
+
+static FILTER_OBJECT MyObject = {
+    createInstance,
+    newSession,
+    closeSession,
+    freeSession,
+    setDownstream,
+    NULL,		// No Upstream requirement
+    routeQuery,
+    NULL,
+    diagnostic,
+    routeBatch,
+    getInterest,
+};
+
+/**
+ * Implementation of the mandatory version entry point
+ *
+ * @return version string of the module
+ */
+char *
+version()
+{
+	return version_str;
+}
+
+/**
+ * The module initialisation routine, called when the module
+ * is first loaded.
+ */
+void
+ModuleInit()
+{
+}
+
+/**
+ * The module entry point routine. It is this routine that
+ * must populate the structure that is referred to as the
+ * "module object", this is a structure with the set of
+ * external entry points for this module.
+ *
+ * @return The module object
+ */
+FILTER_OBJECT *
+GetModuleObject()
+{
+	return &MyObject;
+}
+
+/**
+ * Create an instance of the filter for a particular service
+ * within MaxScale.
+ *
+ * @param options	The options for this filter
+ * @param params	The array of name/value pair parameters for the filter
+ *
+ * @return The instance data for this new instance
+ */
+static	FILTER	*
+createInstance(char **options, FILTER_PARAMETER **params)
+{
+HINT_INSTANCE	*my_instance;
+int		i;
+
+	if ((my_instance = calloc(1, sizeof(HINT_INSTANCE))) != NULL)
+	{
+		for (i = 0; params && params[i]; i++)
+		{
+			if (!strcmp(params[i]->name, "match"))
+				my_instance->match = strdup(params[i]->value);
+			else if (!strcmp(params[i]->name,
+						"max_slave_replication_lag"))
+				my_instance->max_rlag = strdup(params[i]->value);
+			else if (!strcmp(params[i]->name, "source"))
+				my_instance->source = strdup(params[i]->value);
+			else if (!strcmp(params[i]->name, "user"))
+				my_instance->user = strdup(params[i]->value);
+			else if (!filter_standard_parameter(params[i]->name))
+			{
+				LOGIF(LE, (skygw_log_write_flush(
+					LOGFILE_ERROR,
+					"hintfilter: Unexpected parameter '%s'.\n",
+					params[i]->name)));
+			}
+		}
+
+		if (options)
+		{
+			for (i = 0; options[i]; i++)
+			{
+				LOGIF(LE, (skygw_log_write_flush(
+					LOGFILE_ERROR,
+					"hintfilter: unsupported option '%s'.\n",
+					options[i])));
+			}
+		}
+
+		if (my_instance->match == NULL || my_instance->max_rlag == NULL)
+		{
+			LOGIF(LE, (skygw_log_write_flush(LOGFILE_ERROR,
+				"hintfilter: The match and max_slave_replication_lag "
+				"parameters are required.\n")));
+			goto failed;
+		}
+		if (!isdigit(*my_instance->max_rlag))
+		{
+			LOGIF(LE, (skygw_log_write_flush(LOGFILE_ERROR,
+				"hintfilter: Invalid max_slave_replication_lag "
+				"'%s'.\n",
+					my_instance->max_rlag)));
+			goto failed;
+		}
+
+		if (regcomp(&my_instance->re, my_instance->match,
+					REG_ICASE|REG_NOSUB))
+		{
+			LOGIF(LE, (skygw_log_write_flush(LOGFILE_ERROR,
+				"hintfilter: Invalid regular expression '%s'.\n",
+					my_instance->match)));
+			goto failed;
+		}
+	}
+	return (FILTER *)my_instance;
+
+failed:
+	free(my_instance->match);
+	free(my_instance->max_rlag);
+	free(my_instance->source);
+	free(my_instance->user);
+	free(my_instance);
+	return NULL;
+}
+
+/**
+ * Associate a new session with this instance of the filter.
+ *
+ * @param instance	The filter instance data
+ * @param session	The session itself
+ * @return Session specific data for this session
+ */
+static	void	*
+newSession(FILTER *instance, SESSION *session)
+{
+HINT_INSTANCE	*my_instance = (HINT_INSTANCE *)instance;
+HINT_SESSION	*my_session;
+char		*remote, *user;
+
+	if ((my_session = calloc(1, sizeof(HINT_SESSION))) != NULL)
+	{
+		my_session->n_hinted = 0;
+		my_session->active = 1;
+		if (my_instance->source
+			&& (remote = session_get_remote(session)) != NULL)
+		{
+			if (strcmp(remote, my_instance->source))
+				my_session->active = 0;
+		}
+
+		if (my_instance->user && (user = session_getUser(session))
+				&& strcmp(user, my_instance->user))
+		{
+			my_session->active = 0;
+		}
+	}
+
+	return my_session;
+}
+
+/**
+ * Close a session with the filter, this is the mechanism
+ * by which a filter may cleanup data structure etc.
+ *
+ * @param instance	The filter instance data
+ * @param session	The session being closed
+ */
+static	void
+closeSession(FILTER *instance, void *session)
+{
+}
+
+/**
+ * Free the memory associated with this filter session.
+ *
+ * @param instance	The filter instance data
+ * @param session	The session being closed
+ */
+static void
+freeSession(FILTER *instance, void *session)
+{
+	free(session);
+        return;
+}
+
+/**
+ * Set the downstream component for this filter.
+ *
+ * @param instance	The filter instance data
+ * @param session	The session being closed
+ * @param downstream	The downstream filter or router
+ */
+static void
+setDownstream(FILTER *instance, void *session, DOWNSTREAM *downstream)
+{
+HINT_SESSION	*my_session = (HINT_SESSION *)session;
+
+	my_session->down = *downstream;
+}
+
+/**
+ * The routeQuery entry point. A statement that matches the regular
+ * expression is given the hints of the filter before it is passed to
+ * the downstream component.
+ *
+ * @param instance	The filter instance data
+ * @param session	The filter session
+ * @param queue		The query data
+ */
+static	int
+routeQuery(FILTER *instance, void *session, GWBUF *queue)
+{
+HINT_INSTANCE	*my_instance = (HINT_INSTANCE *)instance;
+HINT_SESSION	*my_session = (HINT_SESSION *)session;
+
+	hint_statement(my_instance, my_session, queue);
+	return my_session->down.routeQuery(my_session->down.instance,
+			my_session->down.session, queue);
+}
+
+/**
+ * The routeBatch entry point. Each statement of the batch, one in each
+ * buffer, is given the hints as in routeQuery and the batch is passed on
+ * as a whole.
+ *
+ * @param instance	The filter instance data
+ * @param session	The filter session
+ * @param queue		The statements of the batch
+ */
+static	int
+routeBatch(FILTER *instance, void *session, GWBUF *queue)
+{
+HINT_INSTANCE	*my_instance = (HINT_INSTANCE *)instance;
+HINT_SESSION	*my_session = (HINT_SESSION *)session;
+GWBUF		*ptr;
+
+	for (ptr = queue; ptr; ptr = ptr->next)
+		hint_statement(my_instance, my_session, ptr);
+	return my_session->down.routeBatch(my_session->down.instance,
+			my_session->down.session, queue);
+}
+
+/**
+ * Give the hints of the filter to a statement that matches the regular
+ * expression.
+ *
+ * @param my_instance	The filter instance data
+ * @param my_session	The filter session
+ * @param buf		The buffer of the statement
+ */
+static	void
+hint_statement(HINT_INSTANCE *my_instance, HINT_SESSION *my_session, GWBUF *buf)
+{
+char		*sql;
+
+	if (my_session->active && modutil_is_SQL(buf) &&
+		(sql = modutil_get_SQL(buf)) != NULL &&
+		regexec(&my_instance->re, sql, 0, NULL, 0) == 0)
+	{
+		if (hint_add(buf, HINT_PARAMETER,
+				"max_slave_replication_lag",
+				my_instance->max_rlag))
+			my_session->n_hinted++;
+	}
+}
+
+/**
+ * The getInterest entry point. Only the queries of a session that is matched
+ * are passed to the filter, the hints are only in COM_QUERY.
+ *
+ * @param instance	The filter instance data
+ * @param session	The filter session
+ * @return The requests the filter session wants to see
+ */
+static int
+getInterest(FILTER *instance, void *session)
+{
+HINT_SESSION	*my_session = (HINT_SESSION *)session;
+
+	return my_session->active ? FILTER_INTEREST_QUERY : 0;
+}
+
+/**
+ * Diagnostics routine
+ *
+ * If fsession is NULL then print diagnostics on the filter
+ * instance as a whole, otherwise print diagnostics for the
+ * particular session.
+ *
+ * @param	instance	The filter instance
+ * @param	fsession	Filter session, may be NULL
+ * @param	dcb		The DCB for diagnostic output
+ */
+static	void
+diagnostic(FILTER *instance, void *fsession, DCB *dcb)
+{
+HINT_INSTANCE	*my_instance = (HINT_INSTANCE *)instance;
+HINT_SESSION	*my_session = (HINT_SESSION *)fsession;
+
+	dcb_printf(dcb, "\t\tStatements matching:			%s\n",
+			my_instance->match);
+	dcb_printf(dcb, "\t\tMaximum slave replication lag:		%s\n",
+			my_instance->max_rlag);
+	if (my_session)
+	{
+		dcb_printf(dcb, "\t\tNo. of statements given hints:		%d\n",
+			my_session->n_hinted);
+	}
+	if (my_instance->source)
+		dcb_printf(dcb,
+			"\t\tHints limited to connections from 	%s\n",
+				my_instance->source);
+	if (my_instance->user)
+		dcb_printf(dcb,
+			"\t\tHints limited to user			%s\n",
+				my_instance->user);
+}
@@ -0,0 +1,711 @@
+/*
+ * This file is distributed as part of MaxScale by SkySQL.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <filter.h>
+#include <modinfo.h>
+#include <modutil.h>
+#include <atomic.h>
+#include <spinlock.h>
+#include <mysql_client_server_protocol.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+extern int lm_enabled_logfiles_bitmask;
+
+/**
+ * @file limitfilter.c - a filter that limits the size of the resultsets
+ * @verbatim
+ *
+ * The packets of the replies are followed as they pass, the rows and the
+ * bytes of the resultsets of COM_QUERY and COM_STMT_EXECUTE are counted.
+ * The row that would take a reply over a limit is not sent to the client,
+ * the client gets an error in its place and the rest of the reply is read
+ * from the backend and thrown away. No more than the start of a packet
+ * header that spans two buffers is held by the filter at any time.
+ *
+ * The replies come in the order of the requests, the filter keeps the
+ * requests that wait for a reply to know which replies are limited.
+ *
+ * The parameters of the filter, at least one limit is required
+ *	max_rows=<rows of a reply>
+ *	max_bytes=<bytes of a reply>
+ * Optional parameters
+ *	source=<source address to limit filter>
+ *	user=<username to limit filter>
+ * @endverbatim
+ */
+
+MODULE_INFO 	info = {
+	MODULE_API_FILTER,
+	MODULE_BETA_RELEASE,
+	FILTER_VERSION,
+	"A filter that limits the rows and the bytes of the resultsets"
+};
+
+static char *version_str = "V1.0.0";
+
+#define	LIMIT_MAX_PENDING	64		/* Requests kept for the replies */
+#define	LIMIT_ERRNO		1104		/* ER_TOO_BIG_SELECT */
+
+#define	LIMIT_FIRST		0		/* First packet of a result */
+#define	LIMIT_COLUMNS		1		/* The column definitions */
+#define	LIMIT_ROWS		2		/* The rows */
+
+/**
+ * Instance structure
+ */
+typedef struct {
+	char		*source;	/* Source address to restrict matches */
+	char		*user;		/* User name to restrict matches */
+	long		max_rows;	/* Rows of a reply, 0 for no limit */
+	long		max_bytes;	/* Bytes of a reply, 0 for no limit */
+	int		n_limited;	/* Replies cut at a limit */
+	long		n_drained;	/* Bytes of the replies thrown away */
+} LIMIT_INSTANCE;
+
+/**
+ * The session structure for this filter. The requests are added by the
+ * thread of the client and the replies come from the threads of the
+ * backends, the lock protects the state of both.
+ */
+typedef struct {
+	DOWNSTREAM	down;		/* The downstream filter */
+	UPSTREAM	up;		/* The upstream filter */
+	LIMIT_INSTANCE	*instance;	/* The filter instance */
+	int		active;		/* Is filter active */
+	SPINLOCK	lock;		/* Protects the reply state */
+	unsigned char	pending[LIMIT_MAX_PENDING]; /* Requests waiting for a
+					 * reply, true if the reply is limited */
+	int		p_first;	/* The oldest request */
+	int		n_pending;	/* Requests kept */
+	int		n_unrecorded;	/* Requests not kept, the ring was full,
+					 * their replies are not limited */
+	int		infile;		/* The client sends a LOCAL INFILE */
+	int		started;	/* A reply has started */
+	int		limited;	/* The reply is limited */
+	int		phase;		/* LIMIT_FIRST, _COLUMNS or _ROWS */
+	unsigned char	hdr[5];		/* Header and first byte of a packet */
+	int		hdr_len;	/* Bytes of hdr read */
+	unsigned long	pkt_left;	/* Bytes of the packet still to come */
+	int		continued;	/* The next packet continues the last one */
+	int		cut_rows;	/* The cut is at the limit of the rows */
+	int		draining;	/* The rest of the reply is thrown away */
+	long		rows;		/* Rows of the reply */
+	long		bytes;		/* Bytes of the reply */
+	int		n_limited;	/* Replies cut at a limit */
+} LIMIT_SESSION;
+
+static	FILTER	*createInstance(char **options, FILTER_PARAMETER **params);
+static	void	*newSession(FILTER *instance, SESSION *session);
+static	void 	closeSession(FILTER *instance, void *session);
+static	void 	freeSession(FILTER *instance, void *session);
+static	void	setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
+static	void	setUpstream(FILTER *instance, void *fsession, UPSTREAM *upstream);
+static	int	routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
+static	int	clientReply(FILTER *instance, void *fsession, GWBUF *queue);
+static	void	diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+static	int	getInterest(FILTER *instance, void *fsession);
+
+static	void	limit_request(LIMIT_SESSION *my_session, GWBUF *queue);
+static	GWBUF	*limit_buffer(LIMIT_SESSION *my_session, GWBUF *buf,
+			GWBUF **err);
+static	int	limit_packet(LIMIT_SESSION *my_session);
+static	void	limit_reply_end(LIMIT_SESSION *my_session);
+
+static FILTER_OBJECT MyObject = {
+    createInstance,
+    newSession,
+    closeSession,
+    freeSession,
+    setDownstream,
+    setUpstream,
+    routeQuery,
+    clientReply,
+    diagnostic,
+    NULL,		// No batch routing
+    getInterest,
+};
+
+/**
+ * Implementation of the mandatory version entry point
+ *
+ * @return version string of the module
+ */
+char *
+version()
+{
+	return version_str;
+}
+
+/**
+ * The module initialisation routine, called when the module
+ * is first loaded.
+ */
+void
+ModuleInit()
+{
+}
+
+/**
+ * The module entry point routine. It is this routine that
+ * must populate the structure that is referred to as the
+ * "module object", this is a structure with the set of
+ * external entry points for this module.
+ *
+ * @return The module object
+ */
+FILTER_OBJECT *
+GetModuleObject()
+{
+	return &MyObject;
+}
+
+/**
+ * Create an instance of the filter for a particular service
+ * within MaxScale.
+ *
+ * @param options	The options for this filter
+ * @param params	The array of name/value pair parameters for the filter
+ *
+ * @return The instance data for this new instance
+ */
+static	FILTER	*
+createInstance(char **options, FILTER_PARAMETER **params)
+{
+LIMIT_INSTANCE	*my_instance;
+int		i;
+
+	if ((my_instance = calloc(1, sizeof(LIMIT_INSTANCE))) != NULL)
+	{
+		for (i = 0; params && params[i]; i++)
+		{
+			if (!strcmp(params[i]->name, "max_rows"))
+				my_instance->max_rows = atol(params[i]->value);
+			else if (!strcmp(params[i]->name, "max_bytes"))
+				my_instance->max_bytes = atol(params[i]->value);
+			else if (!strcmp(params[i]->name, "source"))
+				my_instance->source = strdup(params[i]->value);
+			else if (!strcmp(params[i]->name, "user"))
+				my_instance->user = strdup(params[i]->value);
+			else if (!filter_standard_parameter(params[i]->name))
+			{
+				LOGIF(LE, (skygw_log_write_flush(
+					LOGFILE_ERROR,
+					"limitfilter: Unexpected parameter '%s'.\n",
+					params[i]->name)));
+			}
+		}
+
+		if (options)
+		{
+			for (i = 0; options[i]; i++)
+			{
+				LOGIF(LE, (skygw_log_write_flush(
+					LOGFILE_ERROR,
+					"limitfilter: unsupported option '%s'.\n",
+					options[i])));
+			}
+		}
+
+		if (my_instance->max_rows < 0)
+			my_instance->max_rows = 0;
+		if (my_instance->max_bytes < 0)
+			my_instance->max_bytes = 0;
+		if (my_instance->max_rows == 0 && my_instance->max_bytes == 0)
+		{
+			LOGIF(LE, (skygw_log_write_flush(LOGFILE_ERROR,
+				"limitfilter: One of the max_rows or max_bytes "
+				"parameters is required.\n")));
+			free(my_instance->source);
+			free(my_instance->user);
+			free(my_instance);
+			return NULL;
+		}
+	}
+	return (FILTER *)my_instance;
+}
+
+/**
+ * Associate a new session with this instance of the filter.
+ *
+ * @param instance	The filter instance data
+ * @param session	The session itself
+ * @return Session specific data for this session
+ */
+static	void	*
+newSession(FILTER *instance, SESSION *session)
+{
+LIMIT_INSTANCE	*my_instance = (LIMIT_INSTANCE *)instance;
+LIMIT_SESSION	*my_session;
+char		*remote, *user;
+
+	if ((my_session = calloc(1, sizeof(LIMIT_SESSION))) != NULL)
+	{
+		my_session->active = 1;
+		my_session->instance = my_instance;
+		spinlock_init(&my_session->lock);
+		if (my_instance->source
+			&& (remote = session_get_remote(session)) != NULL)
+		{
+			if (strcmp(remote, my_instance->source))
+				my_session->active = 0;
+		}
+
+		if (my_instance->user && (user = session_getUser(session))
+				&& strcmp(user, my_instance->user))
+		{
+			my_session->active = 0;
+		}
+	}
+
+	return my_session;
+}
+
+/**
+ * Close a session with the filter, this is the mechanism
+ * by which a filter may cleanup data structure etc.
+ *
+ * @param instance	The filter instance data
+ * @param session	The session being closed
+ */
+static	void
+closeSession(FILTER *instance, void *session)
+{
+}
+
+/**
+ * Free the memory associated with this filter session.
+ *
+ * @param instance	The filter instance data
+ * @param session	The session being closed
+ */
+static void
+freeSession(FILTER *instance, void *session)
+{
+	free(session);
+        return;
+}
+
+/**
+ * Set the downstream component for this filter.
+ *
+ * @param instance	The filter instance data
+ * @param session	The session being closed
+ * @param downstream	The downstream filter or router
+ */
+static void
+setDownstream(FILTER *instance, void *session, DOWNSTREAM *downstream)
+{
+LIMIT_SESSION	*my_session = (LIMIT_SESSION *)session;
+
+	my_session->down = *downstream;
+}
+
+/**
+ * Set the upstream filter or session to which results will be
+ * passed from this filter.
+ *
+ * @param instance	The filter instance data
+ * @param session	The filter session
+ * @param upstream	The upstream filter or session.
+ */
+static void
+setUpstream(FILTER *instance, void *session, UPSTREAM *upstream)
+{
+LIMIT_SESSION	*my_session = (LIMIT_SESSION *)session;
+
+	my_session->up = *upstream;
+}
+
+/**
+ * The routeQuery entry point. The requests that have a reply are kept to
+ * know which replies are limited, the request is always passed on.
+ *
+ * @param instance	The filter instance data
+ * @param session	The filter session
+ * @param queue		The query data
+ */
+static	int
+routeQuery(FILTER *instance, void *session, GWBUF *queue)
+{
+LIMIT_SESSION	*my_session = (LIMIT_SESSION *)session;
+
+	if (my_session->active)
+	{
+		spinlock_acquire(&my_session->lock);
+		limit_request(my_session, queue);
+		spinlock_release(&my_session->lock);
+	}
+	return my_session->down.routeQuery(my_session->down.instance,
+			my_session->down.session, queue);
+}
+
+/**
+ * Keep a request that has a reply. The packets of a LOCAL INFILE are not
+ * requests, the empty packet that ends the file has the reply. The caller
+ * holds the lock of the session.
+ *
+ * @param my_session	The filter session
+ * @param queue		The request
+ */
+static void
+limit_request(LIMIT_SESSION *my_session, GWBUF *queue)
+{
+uint8_t	*data = GWBUF_DATA(queue);
+int	limited;
+
+	if (GWBUF_LENGTH(queue) < 4 || GWBUF_IS_TYPE_FRAGMENT(queue))
+		return;
+	if (my_session->infile)
+	{
+		if (MYSQL_GET_PACKET_LEN(data) != 0)
+			return;
+		my_session->infile = 0;
+		limited = 0;
+	}
+	else
+	{
+		if (GWBUF_LENGTH(queue) < 5)
+			return;
+		switch (MYSQL_GET_COMMAND(data))
+		{
+		case MYSQL_COM_QUIT:
+		case MYSQL_COM_STMT_CLOSE:
+		case MYSQL_COM_STMT_SEND_LONG_DATA:
+			return;		/* No reply */
+		case MYSQL_COM_QUERY:
+		case MYSQL_COM_STMT_EXECUTE:
+			limited = 1;
+			break;
+		default:
+			limited = 0;
+			break;
+		}
+	}
+	/* The replies of the requests that are not kept come after the others */
+	if (my_session->n_unrecorded > 0 ||
+		my_session->n_pending == LIMIT_MAX_PENDING)
+	{
+		my_session->n_unrecorded++;
+		return;
+	}
+	my_session->pending[(my_session->p_first + my_session->n_pending)
+				% LIMIT_MAX_PENDING] = limited;
+	my_session->n_pending++;
+}
+
+/**
+ * The clientReply entry point. The buffers of the reply are passed on up to
+ * the row that would take the reply over a limit, the error that takes its
+ * place follows them and the rest of the reply is thrown away.
+ *
+ * @param instance	The filter instance data
+ * @param session	The filter session
+ * @param reply		The reply data
+ */
+static	int
+clientReply(FILTER *instance, void *session, GWBUF *reply)
+{
+LIMIT_SESSION	*my_session = (LIMIT_SESSION *)session;
+GWBUF		*buf, *next, *out = NULL, *err = NULL;
+
+	if (!my_session->active)
+		return my_session->up.clientReply(my_session->up.instance,
+				my_session->up.session, reply);
+
+	spinlock_acquire(&my_session->lock);
+	for (buf = reply; buf; buf = next)
+	{
+		next = buf->next;
+		buf->next = NULL;
+		if ((buf = limit_buffer(my_session, buf, &err)) != NULL)
+			out = gwbuf_append(out, buf);
+		if (err != NULL)
+		{
+			out = gwbuf_append(out, err);
+			err = NULL;
+		}
+	}
+	spinlock_release(&my_session->lock);
+
+	if (out == NULL)
+		return 1;
+	return my_session->up.clientReply(my_session->up.instance,
+			my_session->up.session, out);
+}
+
+/**
+ * Follow the packets of a buffer of a reply. The caller holds the lock of
+ * the session.
+ *
+ * @param my_session	The filter session
+ * @param buf		The buffer, a single one
+ * @param err		Set to the error to send after the buffer, if the
+ *			reply is cut in it
+ * @return The part of the buffer to pass on or NULL
+ */
+static GWBUF *
+limit_buffer(LIMIT_SESSION *my_session, GWBUF *buf, GWBUF **err)
+{
+LIMIT_INSTANCE	*my_instance = my_session->instance;
+uint8_t		*data = GWBUF_DATA(buf);
+unsigned int	len = GWBUF_LENGTH(buf), off = 0, n;
+int		end = GWBUF_IS_TYPE_RESPONSE_END(buf) != 0;
+int		start = 0, held = 0, cut = 0;
+GWBUF		*prefix = NULL;
+char		msg[120];
+
+	if (!my_session->started)
+	{
+		my_session->started = 1;
+		if (my_session->n_pending > 0)
+		{
+			my_session->limited =
+				my_session->pending[my_session->p_first];
+			my_session->p_first = (my_session->p_first + 1)
+						% LIMIT_MAX_PENDING;
+			my_session->n_pending--;
+		}
+		else
+		{
+			my_session->limited = 0;
+			if (my_session->n_unrecorded > 0)
+				my_session->n_unrecorded--;
+		}
+	}
+	if (my_session->draining)
+	{
+		__sync_fetch_and_add(&my_instance->n_drained, len);
+		if (end)
+			limit_reply_end(my_session);
+		gwbuf_free(buf);
+		return NULL;
+	}
+
+	/* The start of a header held back by the last buffer */
+	held = my_session->hdr_len;
+	while (my_session->limited && off < len)
+	{
+		if (my_session->pkt_left > 0)
+		{
+			n = len - off;
+			if (n > my_session->pkt_left)
+				n = my_session->pkt_left;
+			off += n;
+			my_session->pkt_left -= n;
+			continue;
+		}
+		if (my_session->hdr_len == 0)
+			start = off;
+		my_session->hdr[my_session->hdr_len++] = data[off++];
+		if (my_session->hdr_len < 4 ||
+			(my_session->hdr_len == 4 &&
+			 MYSQL_GET_PACKET_LEN(my_session->hdr) != 0))
+			continue;
+		if (held && (prefix = gwbuf_alloc(held)) != NULL)
+			memcpy(GWBUF_DATA(prefix), my_session->hdr, held);
+		if ((cut = limit_packet(my_session)) != 0)
+			break;
+		/* The bytes held back are passed on before the buffer */
+		held = 0;
+	}
+	if (cut)
+	{
+		/* The reply is cut at the start of the packet */
+		snprintf(msg, sizeof(msg), "The result of the statement is "
+			"over the limit of %ld %s", my_session->cut_rows ?
+			my_instance->max_rows : my_instance->max_bytes,
+			my_session->cut_rows ? "rows" : "bytes");
+		if ((*err = modutil_create_mysql_err_msg(my_session->hdr[3],
+				LIMIT_ERRNO, "42000", msg)) != NULL)
+			gwbuf_set_type(*err, GWBUF_TYPE_RESPONSE_END);
+		atomic_add(&my_instance->n_limited, 1);
+		my_session->n_limited++;
+		__sync_fetch_and_add(&my_instance->n_drained, len - start);
+		if (end)
+			limit_reply_end(my_session);
+		else
+			my_session->draining = 1;
+		if (held)
+		{
+			gwbuf_free(prefix);
+			prefix = NULL;
+		}
+		if (start == 0)
+		{
+			gwbuf_free(buf);
+			return prefix;
+		}
+		buf = gwbuf_trim(buf, len - start);
+		buf->gwbuf_type &= ~GWBUF_TYPE_RESPONSE_END;
+		return gwbuf_append(prefix, buf);
+	}
+	if (end)
+	{
+		limit_reply_end(my_session);
+		return gwbuf_append(prefix, buf);
+	}
+	/*
+	 * A header that is not complete is held back until the packet is
+	 * known, the reply may be cut at its start.
+	 */
+	if (my_session->hdr_len > 0)
+	{
+		if (held || start == 0)
+		{
+			gwbuf_free(buf);
+			buf = NULL;
+		}
+		else
+			buf = gwbuf_trim(buf, len - start);
+	}
+	return gwbuf_append(prefix, buf);
+}
+
+/**
+ * Follow a packet of a limited reply once its header and its first byte
+ * are known, and count it.
+ *
+ * @param my_session	The filter session
+ * @return True if the reply is cut at the start of the packet
+ */
+static int
+limit_packet(LIMIT_SESSION *my_session)
+{
+LIMIT_INSTANCE	*my_instance = my_session->instance;
+unsigned long	plen = MYSQL_GET_PACKET_LEN(my_session->hdr);
+int		first = plen > 0 ? my_session->hdr[4] : -1;
+int		continued = my_session->continued;
+
+	my_session->pkt_left = plen - (my_session->hdr_len - 4);
+	my_session->hdr_len = 0;
+	my_session->continued = plen == 0xffffff;
+	my_session->bytes += plen + 4;
+	if (continued)
+		return 0;
+
+	switch (my_session->phase)
+	{
+	case LIMIT_FIRST:
+		/* An OK, an ERR or a LOCAL INFILE request has no rows */
+		if (first == 0xfb)
+			my_session->infile = 1;
+		else if (first != 0x00 && first != 0xff)
+			my_session->phase = LIMIT_COLUMNS;
+		break;
+	case LIMIT_COLUMNS:
+		if (first == 0xfe && plen < 9)
+			my_session->phase = LIMIT_ROWS;
+		break;
+	case LIMIT_ROWS:
+		/* The EOF or ERR after the rows, another result may follow */
+		if ((first == 0xfe && plen < 9) || first == 0xff)
+		{
+			my_session->phase = LIMIT_FIRST;
+			break;
+		}
+		my_session->cut_rows = my_instance->max_rows &&
+				my_session->rows >= my_instance->max_rows;
+		if (my_session->cut_rows || (my_instance->max_bytes &&
+			 my_session->bytes > my_instance->max_bytes))
+			return 1;
+		my_session->rows++;
+		break;
+	}
+	return 0;
+}
+
+/**
+ * Reset the state of the reply after its last buffer
+ *
+ * @param my_session	The filter session
+ */
+static void
+limit_reply_end(LIMIT_SESSION *my_session)
+{
+	my_session->started = 0;
+	my_session->limited = 0;
+	my_session->phase = LIMIT_FIRST;
+	my_session->hdr_len = 0;
+	my_session->pkt_left = 0;
+	my_session->continued = 0;
+	my_session->cut_rows = 0;
+	my_session->draining = 0;
+	my_session->rows = 0;
+	my_session->bytes = 0;
+}
+
+/**
+ * The getInterest entry point. The filter follows all the requests of a
+ * session that is matched, to know the replies.
+ *
+ * @param instance	The filter instance data
+ * @param session	The filter session
+ * @return The requests the filter session wants to see
+ */
+static int
+getInterest(FILTER *instance, void *session)
+{
+LIMIT_SESSION	*my_session = (LIMIT_SESSION *)session;
+
+	return my_session->active ? FILTER_INTEREST_ALL : 0;
+}
+
+/**
+ * Diagnostics routine
+ *
+ * If fsession is NULL then print diagnostics on the filter
+ * instance as a whole, otherwise print diagnostics for the
+ * particular session.
+ *
+ * @param	instance	The filter instance
+ * @param	fsession	Filter session, may be NULL
+ * @param	dcb		The DCB for diagnostic output
+ */
+static	void
+diagnostic(FILTER *instance, void *fsession, DCB *dcb)
+{
+LIMIT_INSTANCE	*my_instance = (LIMIT_INSTANCE *)instance;
+LIMIT_SESSION	*my_session = (LIMIT_SESSION *)fsession;
+
+	if (my_instance->max_rows)
+		dcb_printf(dcb, "\t\tRows of a reply at most:		%ld\n",
+			my_instance->max_rows);
+	if (my_instance->max_bytes)
+		dcb_printf(dcb, "\t\tBytes of a reply at most:		%ld\n",
+			my_instance->max_bytes);
+	if (my_instance->source)
+		dcb_printf(dcb, "\t\tLimit to connections from		%s\n",
+				my_instance->source);
+	if (my_instance->user)
+		dcb_printf(dcb, "\t\tLimit to user				%s\n",
+				my_instance->user);
+	if (my_session)
+	{
+		dcb_printf(dcb, "\t\tNo. of replies cut at a limit:		%d\n",
+			my_session->n_limited);
+		return;
+	}
+	dcb_printf(dcb, "\t\tNo. of replies cut at a limit:		%d\n",
+			my_instance->n_limited);
+	dcb_printf(dcb, "\t\tBytes of the replies thrown away:	%ld\n",
+			my_instance->n_drained);
+}
@@ -31,6 +31,22 @@
  * file to which the queries are logged. A serial number is appended to this
  * name in order that each session logs to a different file.
  *
+ * The queries are not written by the polling threads. Each thread puts the
+ * query and its time in a ring of its own, that only the thread writes to,
+ * and a single writer thread empties the rings, formats the records and
+ * writes each file in large blocks. A query is dropped and counted if the
+ * ring of the thread is full, the polling threads never wait for the disk.
+ *
+ * With format=binary the file has, for each query, a struct qla_binary
+ * header in the byte order of the host followed by the query text.
+ *
+ * With format=capture the filter sees every packet of the session, not
+ * only the queries, and the file is a capture that the replay client
+ * plays back: the start of the session, each packet of the client whole,
+ * the time of the first reply to it and the close, in the records of
+ * qlacapture.h. The source and user parameters apply, the match and
+ * exclude parameters do not, a capture must have all of the packets.
+ *
  * Date		Who		Description
  * 03/06/2014	Mark Riddoch	Initial implementation
  * 11/06/2014	Mark Riddoch	Addition of source and match parameters
@@ -39,10 +55,16 @@
  * @endverbatim
  */
 #include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
 #include <fcntl.h>
 #include <filter.h>
 #include <modinfo.h>
 #include <modutil.h>
+#include <qlacapture.h>
+#include <spinlock.h>
+#include <atomic.h>
+#include <thread.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <time.h>
@@ -59,7 +81,7 @@ MODULE_INFO 	info = {
 	"A simple query logging filter"
 };
 
-static char *version_str = "V1.1.1";
+static char *version_str = "V1.3.0";
 
 /*
  * The filter entry points
@@ -69,8 +91,11 @@ static	void	*newSession(FILTER *instance, SESSION *session);
 static	void 	closeSession(FILTER *instance, void *session);
 static	void 	freeSession(FILTER *instance, void *session);
 static	void	setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
+static	void	setUpstream(FILTER *instance, void *fsession, UPSTREAM *upstream);
 static	int	routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
+static	int	clientReply(FILTER *instance, void *fsession, GWBUF *queue);
 static	void	diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+static	int	getInterest(FILTER *instance, void *fsession);
 
 
 static FILTER_OBJECT MyObject = {
@@ -79,12 +104,86 @@ static FILTER_OBJECT MyObject = {
     closeSession,
     freeSession,
     setDownstream,
-    NULL,		// No Upstream requirement
+    setUpstream,
     routeQuery,
-    NULL,		// No client reply
+    clientReply,
     diagnostic,
+    NULL,		// No batch routing
+    getInterest,
+};
+
+#define	QLA_RING_SIZE		(1024 * 1024)	/* Bytes of a ring, a power of two */
+#define	QLA_WRITE_SIZE		65536		/* Bytes written at once */
+#define	QLA_WRITER_SLEEP	10		/* Milliseconds the idle writer waits */
+
+#define	QLA_FORMAT_TEXT		0
+#define	QLA_FORMAT_BINARY	1
+#define	QLA_FORMAT_CAPTURE	2
+
+/**
+ * A log file. The files are in a list that only the writer thread walks,
+ * a file that is closed by its session is freed by the writer once the
+ * records queued before the close are written.
+ */
+typedef struct qla_file {
+	int		fd;		/* The file */
+	int		format;		/* QLA_FORMAT_ of the records */
+	int		session;	/* Serial of the session */
+	int		closed;		/* The session has closed */
+	char		*buf;		/* Data not yet written */
+	int		buflen;		/* Bytes in buf */
+	struct qla_file	*next;		/* The next file */
+} QLA_FILE;
+
+/**
+ * The record of a query in a ring, the query text follows the record and
+ * the records are aligned to 8 bytes. In a capture the record may also be
+ * the start or the close of the session, a packet or a reply.
+ */
+typedef struct {
+	QLA_FILE	*file;		/* The file of the session */
+	struct timeval	tv;		/* When the query was routed */
+	int		type;		/* QLA_CAPTURE_ type of a capture */
+	int		length;		/* Length of the query */
+} QLA_RECORD;
+
+#define	QLA_RECORD_SIZE(len)	((sizeof(QLA_RECORD) + (len) + 7) & ~7)
+
+/**
+ * The ring of a thread. Only the thread moves the head and only the writer
+ * moves the tail, both only grow and are taken modulo the size.
+ */
+typedef struct qla_ring {
+	unsigned long	head;		/* End of the records written */
+	unsigned long	tail;		/* End of the records read */
+	struct qla_ring	*next;		/* The ring of another thread */
+	char		data[QLA_RING_SIZE];
+} QLA_RING;
+
+/**
+ * The query record of the binary format
+ */
+struct qla_binary {
+	uint64_t	sec;		/* Seconds of the time of the query */
+	uint32_t	usec;		/* Microseconds of the time */
+	uint32_t	length;		/* Length of the query that follows */
 };
 
+static	QLA_RING	*rings = NULL;		/* The rings of all threads */
+static	__thread QLA_RING *thread_ring = NULL;	/* The ring of this thread */
+static	QLA_FILE	*files = NULL;		/* The open files */
+static	SPINLOCK	qla_lock = SPINLOCK_INIT; /* Protects rings and files */
+static	int		writer_started = 0;
+
+static	void	qla_writer(void *);
+static	void	qla_ring_read(QLA_RING *, unsigned long, void *, int);
+static	void	qla_ring_write(QLA_RING *, unsigned long, void *, int);
+static	QLA_RING *qla_ring_reserve(int *, int);
+static	void	qla_ring_commit(QLA_RING *, QLA_FILE *, int, int);
+static	void	qla_capture_event(int *, QLA_FILE *, int, char *, int);
+static	void	qla_file_write(QLA_FILE *, char *, int);
+static	void	qla_file_flush(QLA_FILE *);
+
 /**
  * A instance structure, the assumption is that the option passed
  * to the filter is simply a base for the filename to which the queries
@@ -102,6 +201,8 @@ typedef struct {
 	regex_t	re;		/* Compiled regex text */
 	char	*nomatch;	/* Optional text to match against for exclusion */
 	regex_t	nore;		/* Compiled regex nomatch text */
+	int	format;		/* QLA_FORMAT_ of the log */
+	int	n_dropped;	/* Queries dropped, the ring was full */
 } QLA_INSTANCE;
 
 /**
@@ -114,9 +215,11 @@ typedef struct {
  */
 typedef struct {
 	DOWNSTREAM	down;
+	UPSTREAM	up;
 	char		*filename;
-	FILE		*fp;
+	QLA_FILE	*file;
 	int		active;
+	int		waiting;	/* A captured packet has no reply yet */
 } QLA_SESSION;
 
 /**
@@ -194,6 +297,19 @@ int		i;
 					my_instance->source = strdup(params[i]->value);
 				else if (!strcmp(params[i]->name, "user"))
 					my_instance->userName = strdup(params[i]->value);
+				else if (!strcmp(params[i]->name, "format"))
+				{
+					if (!strcmp(params[i]->value, "binary"))
+						my_instance->format = QLA_FORMAT_BINARY;
+					else if (!strcmp(params[i]->value, "capture"))
+						my_instance->format = QLA_FORMAT_CAPTURE;
+					else if (strcmp(params[i]->value, "text"))
+						LOGIF(LE, (skygw_log_write_flush(
+							LOGFILE_ERROR,
+							"qlafilter: Unknown format '%s', "
+							"the text format is used.\n",
+							params[i]->value)));
+				}
 				else if (!strcmp(params[i]->name, "filebase"))
 				{
 					if (my_instance->filebase)
@@ -239,6 +355,19 @@ int		i;
 			free(my_instance);
 			return NULL;
 		}
+		spinlock_acquire(&qla_lock);
+		if (!writer_started)
+		{
+			if (thread_start(qla_writer, NULL) == NULL)
+			{
+				LOGIF(LE, (skygw_log_write_flush(LOGFILE_ERROR,
+					"qlafilter: Unable to start the writer "
+					"thread.\n")));
+			}
+			else
+				writer_started = 1;
+		}
+		spinlock_release(&qla_lock);
 	}
 	return (FILTER *)my_instance;
 }
@@ -258,6 +387,8 @@ newSession(FILTER *instance, SESSION *session)
 QLA_INSTANCE	*my_instance = (QLA_INSTANCE *)instance;
 QLA_SESSION	*my_session;
 char		*remote, *userName;
+char		info[512];
+int		serial, len;
 
 	if ((my_session = calloc(1, sizeof(QLA_SESSION))) != NULL)
 	{
@@ -279,11 +410,46 @@ char		*remote, *userName;
 		if (my_instance->userName && userName && strcmp(userName,
 							my_instance->userName))
 			my_session->active = 0;
+		serial = atomic_add(&my_instance->sessions, 1);
 		sprintf(my_session->filename, "%s.%d", my_instance->filebase,
-				my_instance->sessions);
-		my_instance->sessions++;
+				serial);
 		if (my_session->active)
-			my_session->fp = fopen(my_session->filename, "w");
+		{
+			if ((my_session->file = calloc(1, sizeof(QLA_FILE))) == NULL
+				|| (my_session->file->fd = open(my_session->filename,
+				O_WRONLY|O_CREAT|O_TRUNC, 0666)) == -1)
+			{
+				LOGIF(LE, (skygw_log_write_flush(LOGFILE_ERROR,
+					"qlafilter: Unable to open the log file "
+					"'%s'.\n", my_session->filename)));
+				free(my_session->file);
+				my_session->file = NULL;
+				my_session->active = 0;
+			}
+			else
+			{
+				my_session->file->format = my_instance->format;
+				my_session->file->session = serial;
+				spinlock_acquire(&qla_lock);
+				my_session->file->next = files;
+				files = my_session->file;
+				spinlock_release(&qla_lock);
+				if (my_instance->format == QLA_FORMAT_CAPTURE)
+				{
+					remote = session_get_remote(session);
+					len = snprintf(info, sizeof(info) - 1,
+						"%s%c%s", userName ? userName : "",
+						0, remote ? remote : "");
+					if (len > sizeof(info) - 2)
+						len = sizeof(info) - 2;
+					info[len++] = 0;
+					qla_capture_event(
+						&my_instance->n_dropped,
+						my_session->file,
+						QLA_CAPTURE_OPEN, info, len);
+				}
+			}
+		}
 	}
 
 	return my_session;
@@ -292,7 +458,8 @@ char		*remote, *userName;
 /**
  * Close a session with the filter, this is the mechanism
  * by which a filter may cleanup data structure etc.
- * In the case of the QLA filter we simple close the file descriptor.
+ * In the case of the QLA filter the writer thread is told to close the
+ * file once it has written the queries of the session.
  *
  * @param instance	The filter instance data
  * @param session	The session being closed
@@ -300,10 +467,19 @@ char		*remote, *userName;
 static	void 	
 closeSession(FILTER *instance, void *session)
 {
+QLA_INSTANCE	*my_instance = (QLA_INSTANCE *)instance;
 QLA_SESSION	*my_session = (QLA_SESSION *)session;
 
-	if (my_session->active && my_session->fp)
-		fclose(my_session->fp);
+	if (my_session->file)
+	{
+		if (my_session->file->format == QLA_FORMAT_CAPTURE)
+			qla_capture_event(&my_instance->n_dropped,
+				my_session->file, QLA_CAPTURE_CLOSE, NULL, 0);
+		__sync_synchronize();
+		my_session->file->closed = 1;
+		my_session->file = NULL;
+	}
+	my_session->active = 0;
 }
 
 /**
@@ -338,12 +514,31 @@ QLA_SESSION	*my_session = (QLA_SESSION *)session;
 	my_session->down = *downstream;
 }
 
+/**
+ * Set the upstream filter or session to which results will be
+ * passed from this filter.
+ *
+ * @param instance	The filter instance data
+ * @param session	The filter session 
+ * @param upstream	The upstream filter or session.
+ */
+static void
+setUpstream(FILTER *instance, void *session, UPSTREAM *upstream)
+{
+QLA_SESSION	*my_session = (QLA_SESSION *)session;
+
+	my_session->up = *upstream;
+}
+
 /**
  * The routeQuery entry point. This is passed the query buffer
  * to which the filter should be applied. Once applied the
  * query should normally be passed to the downstream component
  * (filter or router) in the filter chain.
  *
+ * A query that is logged is put in the ring of the thread, or dropped if
+ * the ring is full. A capture puts every packet in the ring.
+ *
  * @param instance	The filter instance data
  * @param session	The filter session
  * @param queue		The query data
@@ -353,34 +548,112 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
 {
 QLA_INSTANCE	*my_instance = (QLA_INSTANCE *)instance;
 QLA_SESSION	*my_session = (QLA_SESSION *)session;
-char		*ptr;
+char		*sql = NULL;
 int		length;
-struct tm	t;
-struct timeval	tv;
+QLA_RING	*ring;
+MODUTIL_SQL_VIEW view;
+unsigned long	pos;
+GWBUF		*buf;
 
-	if (my_session->active && modutil_extract_SQL(queue, &ptr, &length))
+	if (my_session->active && my_instance->format == QLA_FORMAT_CAPTURE)
+	{
+		length = gwbuf_length(queue);
+		if ((ring = qla_ring_reserve(&my_instance->n_dropped,
+							length)) == NULL)
+			goto route;
+		pos = ring->head + sizeof(QLA_RECORD);
+		for (buf = queue; buf; buf = buf->next)
+		{
+			qla_ring_write(ring, pos, GWBUF_DATA(buf),
+							GWBUF_LENGTH(buf));
+			pos += GWBUF_LENGTH(buf);
+		}
+		qla_ring_commit(ring, my_session->file, QLA_CAPTURE_PACKET,
+							length);
+		my_session->waiting = 1;
+	}
+	else if (my_session->active && modutil_is_SQL(queue) &&
+		modutil_sql_view(queue, &view))
 	{
+		/* Only the regular expressions need the text in one piece */
+		if ((my_instance->match || my_instance->nomatch) &&
+			(sql = modutil_get_SQL(queue)) == NULL)
+			goto route;
 		if ((my_instance->match == NULL ||
-			regexec(&my_instance->re, ptr, 0, NULL, 0) == 0) &&
+			regexec(&my_instance->re, sql, 0, NULL, 0) == 0) &&
 			(my_instance->nomatch == NULL ||
-				regexec(&my_instance->nore,ptr,0,NULL, 0) != 0))
+				regexec(&my_instance->nore,sql,0,NULL, 0) != 0))
 		{
-			gettimeofday(&tv, NULL);
-			localtime_r(&tv.tv_sec, &t);
-			fprintf(my_session->fp,
-				"%02d:%02d:%02d.%-3d %d/%02d/%d, ",
-				t.tm_hour, t.tm_min, t.tm_sec, (int)(tv.tv_usec / 1000),
-				t.tm_mday, t.tm_mon + 1, 1900 + t.tm_year);
-			fwrite(ptr, sizeof(char), length, my_session->fp);
-			fwrite("\n", sizeof(char), 1, my_session->fp);
+			length = view.length + view.remaining;
+			if ((ring = qla_ring_reserve(&my_instance->n_dropped,
+							length)) == NULL)
+				goto route;
+			pos = ring->head + sizeof(QLA_RECORD);
+			do {
+				qla_ring_write(ring, pos, view.segment,
+							view.length);
+				pos += view.length;
+			} while (modutil_sql_view_next(&view));
+			/* The chain may end before the packet */
+			qla_ring_commit(ring, my_session->file, 0,
+					pos - (ring->head + sizeof(QLA_RECORD)));
 		}
 	}
 
+route:
+
 	/* Pass the query downstream */
 	return my_session->down.routeQuery(my_session->down.instance,
 			my_session->down.session, queue);
 }
 
+/**
+ * The clientReply entry point. A capture records the time of the first
+ * reply to each packet, the rest of the reply is passed on as it is.
+ *
+ * @param instance	The filter instance data
+ * @param session	The filter session
+ * @param reply		The reply data
+ */
+static int
+clientReply(FILTER *instance, void *session, GWBUF *reply)
+{
+QLA_INSTANCE	*my_instance = (QLA_INSTANCE *)instance;
+QLA_SESSION	*my_session = (QLA_SESSION *)session;
+
+	if (my_session->waiting)
+	{
+		my_session->waiting = 0;
+		if (my_session->active)
+			qla_capture_event(&my_instance->n_dropped,
+				my_session->file, QLA_CAPTURE_REPLY, NULL, 0);
+	}
+
+	/* Pass the result upstream */
+	return my_session->up.clientReply(my_session->up.instance,
+			my_session->up.session, reply);
+}
+
+/**
+ * The getInterest entry point. Only the queries of a session that is logged
+ * are passed to the filter, a capture sees every request.
+ *
+ * @param instance	The filter instance data
+ * @param session	The filter session
+ * @return The requests the filter session wants to see
+ */
+static int
+getInterest(FILTER *instance, void *session)
+{
+QLA_INSTANCE	*my_instance = (QLA_INSTANCE *)instance;
+QLA_SESSION	*my_session = (QLA_SESSION *)session;
+
+	if (!my_session->active)
+		return 0;
+	return my_instance->format == QLA_FORMAT_CAPTURE ?
+			FILTER_INTEREST_ALL : FILTER_INTEREST_QUERY;
+}
+
 /**
  * Diagnostics routine
  *
@@ -403,6 +676,12 @@ QLA_SESSION	*my_session = (QLA_SESSION *)fsession;
 		dcb_printf(dcb, "\t\tLogging to file			%s.\n",
 			my_session->filename);
 	}
+	dcb_printf(dcb, "\t\tLog format				%s\n",
+			my_instance->format == QLA_FORMAT_CAPTURE ? "capture" :
+			my_instance->format == QLA_FORMAT_BINARY ? "binary" :
+			"text");
+	dcb_printf(dcb, "\t\tQueries dropped, the log was full	%d\n",
+			my_instance->n_dropped);
 	if (my_instance->source)
 		dcb_printf(dcb, "\t\tLimit logging to connections from 	%s\n",
 				my_instance->source);
@@ -416,3 +695,326 @@ QLA_SESSION	*my_session = (QLA_SESSION *)fsession;
 		dcb_printf(dcb, "\t\tExclude queries that match		%s\n",
 				my_instance->nomatch);
 }
+
+/**
+ * The writer thread. The rings of the threads are emptied in turn, the
+ * records are formatted into the buffers of the files and the buffers are
+ * written when full or when the rings are empty. The files closed by their
+ * session are freed once the rings have been emptied, so that the records
+ * queued before the close are written.
+ *
+ * @param arg	Unused
+ */
+static void
+qla_writer(void *arg)
+{
+QLA_RING	*ring;
+QLA_FILE	*file, **pfile, *closing;
+QLA_RECORD	rec;
+struct qla_binary bin;
+struct qla_capture cap;
+struct tm	t;
+time_t		last = 0;
+char		stamp[40], date[24], text[QLA_WRITE_SIZE];
+unsigned long	head;
+int		n, ms, stamplen = 0, datelen = 0, busy;
+
+	for (;;)
+	{
+		/* The files closed before the rings are emptied */
+		spinlock_acquire(&qla_lock);
+		for (file = files; file; file = file->next)
+			if (file->closed)
+				file->closed = 2;
+		ring = rings;
+		spinlock_release(&qla_lock);
+		__sync_synchronize();
+
+		busy = 0;
+		for (; ring; ring = ring->next)
+		{
+			head = ring->head;
+			__sync_synchronize();
+			while (ring->tail != head)
+			{
+				qla_ring_read(ring, ring->tail, &rec, sizeof(rec));
+				file = rec.file;
+				if (file->format == QLA_FORMAT_CAPTURE)
+				{
+					memset(&cap, 0, sizeof(cap));
+					cap.magic = QLA_CAPTURE_MAGIC;
+					cap.session = file->session;
+					cap.sec = rec.tv.tv_sec;
+					cap.usec = rec.tv.tv_usec;
+					cap.type = rec.type;
+					cap.length = rec.length;
+					qla_file_write(file, (char *)&cap,
+							sizeof(cap));
+				}
+				else if (file->format == QLA_FORMAT_BINARY)
+				{
+					bin.sec = rec.tv.tv_sec;
+					bin.usec = rec.tv.tv_usec;
+					bin.length = rec.length;
+					qla_file_write(file, (char *)&bin,
+							sizeof(bin));
+				}
+				else
+				{
+					/*
+					 * The stamp is rendered when the second
+					 * changes, the milliseconds of the
+					 * record are put in the middle of it.
+					 */
+					if (rec.tv.tv_sec != last)
+					{
+						last = rec.tv.tv_sec;
+						localtime_r(&last, &t);
+						stamplen = sprintf(stamp,
+							"%02d:%02d:%02d.",
+							t.tm_hour, t.tm_min,
+							t.tm_sec);
+						datelen = sprintf(date,
+							" %d/%02d/%d, ",
+							t.tm_mday, t.tm_mon + 1,
+							1900 + t.tm_year);
+					}
+					n = stamplen;
+					ms = (int)(rec.tv.tv_usec / 1000);
+					if (ms >= 100)
+						stamp[n++] = '0' + ms / 100;
+					if (ms >= 10)
+						stamp[n++] = '0' + (ms / 10) % 10;
+					stamp[n++] = '0' + ms % 10;
+					while (n < stamplen + 3)
+						stamp[n++] = ' ';
+					memcpy(&stamp[n], date, datelen);
+					qla_file_write(file, stamp, n + datelen);
+				}
+				for (n = 0; n < rec.length; n += sizeof(text))
+				{
+					int	len = rec.length - n;
+
+					if (len > sizeof(text))
+						len = sizeof(text);
+					qla_ring_read(ring, ring->tail +
+						sizeof(rec) + n, text, len);
+					qla_file_write(file, text, len);
+				}
+				if (file->format == QLA_FORMAT_TEXT)
+					qla_file_write(file, "\n", 1);
+				/* The space may be used once the record is read */
+				__sync_synchronize();
+				ring->tail += QLA_RECORD_SIZE(rec.length);
+				busy = 1;
+			}
+		}
+
+		closing = NULL;
+		spinlock_acquire(&qla_lock);
+		pfile = &files;
+		while ((file = *pfile) != NULL)
+		{
+			qla_file_flush(file);
+			if (file->closed == 2)
+			{
+				*pfile = file->next;
+				file->next = closing;
+				closing = file;
+			}
+			else
+				pfile = &file->next;
+		}
+		spinlock_release(&qla_lock);
+		while ((file = closing) != NULL)
+		{
+			closing = file->next;
+			close(file->fd);
+			free(file->buf);
+			free(file);
+		}
+		if (!busy)
+			thread_millisleep(QLA_WRITER_SLEEP);
+	}
+}
+
+/**
+ * Copy data out of a ring
+ *
+ * @param ring	The ring
+ * @param pos	Position of the data
+ * @param dest	Where to copy the data
+ * @param len	Bytes to copy
+ */
+static void
+qla_ring_read(QLA_RING *ring, unsigned long pos, void *dest, int len)
+{
+int	offset = pos & (QLA_RING_SIZE - 1);
+int	n = QLA_RING_SIZE - offset;
+
+	if (n >= len)
+		memcpy(dest, &ring->data[offset], len);
+	else
+	{
+		memcpy(dest, &ring->data[offset], n);
+		memcpy((char *)dest + n, ring->data, len - n);
+	}
+}
+
+/**
+ * Copy data into a ring
+ *
+ * @param ring	The ring
+ * @param pos	Position of the data
+ * @param src	The data
+ * @param len	Bytes to copy
+ */
+static void
+qla_ring_write(QLA_RING *ring, unsigned long pos, void *src, int len)
+{
+int	offset = pos & (QLA_RING_SIZE - 1);
+int	n = QLA_RING_SIZE - offset;
+
+	if (n >= len)
+		memcpy(&ring->data[offset], src, len);
+	else
+	{
+		memcpy(&ring->data[offset], src, n);
+		memcpy(ring->data, (char *)src + n, len - n);
+	}
+}
+
+/**
+ * Get the space for a record in the ring of this thread, the ring is
+ * created by the first record of the thread. The data of the record is
+ * written after the QLA_RECORD at the head of the ring and the record is
+ * committed by qla_ring_commit.
+ *
+ * @param n_dropped	Counter of the records dropped
+ * @param length	Bytes of data of the record
+ * @return The ring or NULL if the record was dropped
+ */
+static QLA_RING *
+qla_ring_reserve(int *n_dropped, int length)
+{
+QLA_RING	*ring;
+
+	if ((ring = thread_ring) == NULL &&
+		(ring = calloc(1, sizeof(QLA_RING))) != NULL)
+	{
+		spinlock_acquire(&qla_lock);
+		ring->next = rings;
+		rings = ring;
+		spinlock_release(&qla_lock);
+		thread_ring = ring;
+	}
+	if (ring == NULL || !writer_started ||
+		QLA_RECORD_SIZE(length) > QLA_RING_SIZE - (ring->head - ring->tail))
+	{
+		atomic_add(n_dropped, 1);
+		return NULL;
+	}
+	return ring;
+}
+
+/**
+ * Write the QLA_RECORD of the data at the head of the ring and pass the
+ * record to the writer
+ *
+ * @param ring		The ring of this thread
+ * @param file		The file of the session
+ * @param type		The QLA_CAPTURE_ type of a capture record
+ * @param length	Bytes of data written after the record
+ */
+static void
+qla_ring_commit(QLA_RING *ring, QLA_FILE *file, int type, int length)
+{
+QLA_RECORD	rec;
+
+	rec.file = file;
+	gettimeofday(&rec.tv, NULL);
+	rec.type = type;
+	rec.length = length;
+	qla_ring_write(ring, ring->head, &rec, sizeof(rec));
+	/* The record must be in the ring before the writer sees it */
+	__sync_synchronize();
+	ring->head += QLA_RECORD_SIZE(length);
+}
+
+/**
+ * Put a capture record that is not a packet in the ring of this thread
+ *
+ * @param n_dropped	Counter of the records dropped
+ * @param file		The file of the session
+ * @param type		The QLA_CAPTURE_ type
+ * @param data		The data of the record or NULL
+ * @param length	Bytes of data
+ */
+static void
+qla_capture_event(int *n_dropped, QLA_FILE *file, int type, char *data,
+								int length)
+{
+QLA_RING	*ring;
+
+	if ((ring = qla_ring_reserve(n_dropped, length)) == NULL)
+		return;
+	if (length > 0)
+		qla_ring_write(ring, ring->head + sizeof(QLA_RECORD), data,
+								length);
+	qla_ring_commit(ring, file, type, length);
+}
+
+/**
+ * Add data to the buffer of a file, the buffer is written when full
+ *
+ * @param file	The file
+ * @param data	The data
+ * @param len	Bytes of data
+ */
+static void
+qla_file_write(QLA_FILE *file, char *data, int len)
+{
+int	n;
+
+	if (file->buf == NULL && (file->buf = malloc(QLA_WRITE_SIZE)) == NULL)
+	{
+		if (write(file->fd, data, len) != len)
+			;
+		return;
+	}
+	while (len > 0)
+	{
+		if (file->buflen == QLA_WRITE_SIZE)
+			qla_file_flush(file);
+		n = QLA_WRITE_SIZE - file->buflen;
+		if (n > len)
+			n = len;
+		memcpy(file->buf + file->buflen, data, n);
+		file->buflen += n;
+		data += n;
+		len -= n;
+	}
+}
+
+/**
+ * Write the buffer of a file
+ *
+ * @param file	The file
+ */
+static void
+qla_file_flush(QLA_FILE *file)
+{
+int	n, done = 0;
+
+	while (done < file->buflen)
+	{
+		if ((n = write(file->fd, file->buf + done,
+				file->buflen - done)) <= 0)
+		{
+			/* The data is lost rather than blocking the writer */
+			break;
+		}
+		done += n;
+	}
+	file->buflen = 0;
+}
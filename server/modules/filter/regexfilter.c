@@ -15,11 +15,14 @@
  *
  * Copyright SkySQL Ab 2014
  */
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <ctype.h>
 #include <filter.h>
 #include <modinfo.h>
 #include <modutil.h>
 #include <skygw_utils.h>
+#include <skygw_sqlscan.h>
 #include <log_manager.h>
 #include <string.h>
 #include <regex.h>
@@ -38,6 +41,11 @@ extern int lm_enabled_logfiles_bitmask;
  *	source=<source address to limit filter>
  *	user=<username to limit filter>
  *
+ * The longest run of characters that every match must contain is taken
+ * from the regular expression, a statement without it is passed on without
+ * running the regular expression. The statement is rewritten in place when
+ * its buffer has room, otherwise in a single buffer of the new size.
+ *
  * Date		Who		Description
  * 19/06/2014	Mark Riddoch	Addition of source and user parameters
  * @endverbatim
@@ -59,8 +67,13 @@ static	void 	freeSession(FILTER *instance, void *session);
 static	void	setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
 static	int	routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
 static	void	diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+static	int	getInterest(FILTER *instance, void *fsession);
 
-static char	*regex_replace(char *sql, int length, regex_t *re, char *replace);
+static GWBUF	*regex_replace(GWBUF *queue, char *sql, int length, regex_t *re,
+			char *replace);
+static char	*regex_literal(char *pattern);
+static int	regex_prefilter(char *sql, int length, char *literal, int litlen,
+			int icase);
 
 static FILTER_OBJECT MyObject = {
     createInstance,
@@ -72,6 +85,8 @@ static FILTER_OBJECT MyObject = {
     routeQuery,
     NULL,
     diagnostic,
+    NULL,		// No batch routing
+    getInterest,
 };
 
 /**
@@ -83,6 +98,9 @@ typedef struct {
 	char	*match;		/* Regular expression to match */
 	char	*replace;	/* Replacement text */
 	regex_t	re;		/* Compiled regex text */
+	char	*literal;	/* Text every match contains or NULL */
+	int	litlen;		/* Length of the literal */
+	int	icase;		/* The match ignores case */
 } REGEX_INSTANCE;
 
 /**
@@ -92,6 +110,7 @@ typedef struct {
 	DOWNSTREAM	down;		/* The downstream filter */
 	int		no_change;	/* No. of unchanged requests */
 	int		replacements;	/* No. of changed requests */
+	int		prefiltered;	/* No. of requests without the literal */
 	int		active;		/* Is filter active */
 } REGEX_SESSION;
 
@@ -195,7 +214,7 @@ int		i, cflags = REG_ICASE;
 			return NULL;
 		}
 
-		if (regcomp(&my_instance->re, my_instance->match, REG_ICASE))
+		if (regcomp(&my_instance->re, my_instance->match, cflags))
 		{
 			LOGIF(LE, (skygw_log_write_flush(LOGFILE_ERROR,
 				"regexfilter: Invalid regular expression '%s'.\n",
@@ -205,6 +224,9 @@ int		i, cflags = REG_ICASE;
 			free(my_instance);
 			return NULL;
 		}
+		my_instance->icase = (cflags & REG_ICASE) != 0;
+		if ((my_instance->literal = regex_literal(my_instance->match)))
+			my_instance->litlen = strlen(my_instance->literal);
 	}
 	return (FILTER *)my_instance;
 }
@@ -300,28 +322,49 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
 {
 REGEX_INSTANCE	*my_instance = (REGEX_INSTANCE *)instance;
 REGEX_SESSION	*my_session = (REGEX_SESSION *)session;
-char		*sql, *newsql;
+char		*sql;
 int		length;
+GWBUF		*newbuf;
 
-	if (modutil_is_SQL(queue))
+	if (my_session->active && modutil_is_SQL(queue) &&
+		modutil_sql_contiguous(queue, &sql, &length))
 	{
-		modutil_extract_SQL(queue, &sql, &length);
-		newsql = regex_replace(sql, length, &my_instance->re,
-					my_instance->replace);
-		if (newsql)
+		if (my_instance->literal &&
+			!regex_prefilter(sql, length, my_instance->literal,
+				my_instance->litlen, my_instance->icase))
+		{
+			my_session->prefiltered++;
+			my_session->no_change++;
+		}
+		else if ((newbuf = regex_replace(queue, sql, length,
+				&my_instance->re, my_instance->replace)) != NULL)
 		{
-			queue = modutil_replace_SQL(queue, newsql);
-			free(newsql);
+			queue = newbuf;
 			my_session->replacements++;
 		}
 		else
 			my_session->no_change++;
-		
 	}
 	return my_session->down.routeQuery(my_session->down.instance,
 			my_session->down.session, queue);
 }
 
+/**
+ * The getInterest entry point. Only the queries of a session that is matched
+ * are passed to the filter.
+ *
+ * @param instance	The filter instance data
+ * @param session	The filter session
+ * @return The requests the filter session wants to see
+ */
+static int
+getInterest(FILTER *instance, void *session)
+{
+REGEX_SESSION	*my_session = (REGEX_SESSION *)session;
+
+	return my_session->active ? FILTER_INTEREST_QUERY : 0;
+}
+
 /**
  * Diagnostics routine
  *
@@ -341,10 +384,15 @@ REGEX_SESSION	*my_session = (REGEX_SESSION *)fsession;
 
 	dcb_printf(dcb, "\t\tSearch and replace: 			s/%s/%s/\n",
 			my_instance->match, my_instance->replace);
+	if (my_instance->literal)
+		dcb_printf(dcb, "\t\tStatements must contain:		%s\n",
+			my_instance->literal);
 	if (my_session)
 	{
 		dcb_printf(dcb, "\t\tNo. of queries unaltered by filter:	%d\n",
 			my_session->no_change);
+		dcb_printf(dcb, "\t\tNo. of queries without the literal:	%d\n",
+			my_session->prefiltered);
 		dcb_printf(dcb, "\t\tNo. of queries altered by filter:		%d\n",
 			my_session->replacements);
 	}
@@ -359,75 +407,160 @@ REGEX_SESSION	*my_session = (REGEX_SESSION *)fsession;
 }
 
 /**
- * Perform a regular expression match and subsititution on the SQL
+ * Perform a regular expression match and subsititution on the SQL. The
+ * first match is replaced, in place if the buffer has room for the new
+ * statement, see modutil_rewrite_SQL.
  *
+ * @param	queue	The buffer of the statement
  * @param	sql	The original SQL text
  * @param	length	The length of the SQL text
  * @param	re	The compiled regular expression
  * @param	replace	The replacement text
- * @return	The replaced text or NULL if no replacement was done.
+ * @return	The buffer of the new statement or NULL if no replacement
+ *		was done, the original buffer must no longer be used if
+ *		a buffer is returned.
  */
-static char *
-regex_replace(char *sql, int length, regex_t *re, char *replace)
+static GWBUF *
+regex_replace(GWBUF *queue, char *sql, int length, regex_t *re, char *replace)
 {
-char		*orig, *result, *ptr;
-int		i, res_size, res_length, rep_length;
-int		last_match;
-regmatch_t	match[10];
-
-	orig = strndup(sql, length);
-	if (regexec(re, orig, 10, match, 0))
+int		rval;
+regmatch_t	match[1];
+
+#ifdef REG_STARTEND
+	match[0].rm_so = 0;
+	match[0].rm_eo = length;
+	rval = regexec(re, sql, 1, match, REG_STARTEND);
+#else
 	{
-		free(orig);
+	char	*orig;
+
+	if ((orig = strndup(sql, length)) == NULL)
 		return NULL;
+	rval = regexec(re, orig, 1, match, 0);
+	free(orig);
 	}
-	res_size = 2 * length;
-	result = (char *)malloc(res_size);
-	res_length = 0;
-	rep_length = strlen(replace);
-	last_match = 0;
-	
-	for (i = 0; i < 10; i++)
+#endif
+	if (rval || match[0].rm_so > length || match[0].rm_eo > length)
+		return NULL;
+
+	return modutil_rewrite_SQL(queue, match[0].rm_so,
+			match[0].rm_eo - match[0].rm_so, replace, strlen(replace));
+}
+
+/**
+ * Find the longest run of characters that every match of a regular
+ * expression contains. Only the top level of the expression is looked at,
+ * the groups and bracket expressions end a run and an alternation at the
+ * top level means that there is no such text.
+ *
+ * @param	pattern	The regular expression
+ * @return	The text, it must be freed, or NULL
+ */
+static char *
+regex_literal(char *pattern)
+{
+char	*best = NULL, *run, *ptr;
+int	bestlen = 0, len = 0, depth = 0;
+char	c;
+
+	if ((run = malloc(strlen(pattern) + 1)) == NULL)
+		return NULL;
+	for (ptr = pattern; *ptr; ptr++)
 	{
-		if (match[i].rm_so != -1)
+		c = *ptr;
+		if (depth > 0)
 		{
-			ptr = &result[res_length];
-			if (last_match < match[i].rm_so)
-			{
-				int to_copy = match[i].rm_so - last_match;
-				if (last_match + to_copy > res_size)
-				{
-					res_size = last_match + to_copy + length;
-					result = (char *)realloc(result, res_size);
-				}
-				memcpy(ptr, &sql[last_match], to_copy);
-				res_length += to_copy;
-			}
-			last_match = match[i].rm_eo;
-			if (res_length + rep_length > res_size)
+			/* Inside a group, only look for its end */
+			if (c == '\\' && ptr[1])
+				ptr++;
+			else if (c == '(')
+				depth++;
+			else if (c == ')')
+				depth--;
+			continue;
+		}
+		if (c == '|')
+		{
+			free(best);
+			free(run);
+			return NULL;
+		}
+		if (c == '*' || c == '?' || c == '{')
+		{
+			/* The last character may be missing */
+			if (len > 0)
+				len--;
+			c = 0;
+		}
+		else if (c == '\\' && ptr[1] && ispunct(ptr[1]))
+		{
+			c = *++ptr;
+			if (ptr[1] == '*' || ptr[1] == '?' || ptr[1] == '{')
+				c = 0;
+		}
+		else if (strchr(".[]()+^$\\", c))
+		{
+			if (c == '(')
+				depth++;
+			else if (c == '[')
 			{
-				res_size += rep_length;
-				result = (char *)realloc(result, res_size);
+				/* Skip the bracket expression, ] may be first */
+				ptr++;
+				if (*ptr == '^')
+					ptr++;
+				if (*ptr == ']')
+					ptr++;
+				while (*ptr && *ptr != ']')
+					ptr++;
+				if (*ptr == 0)
+					break;
 			}
-			ptr = &result[res_length];
-			memcpy(ptr, replace, rep_length);
-			res_length += rep_length;
+			else if (c == '\\' && ptr[1])
+				ptr++;
+			c = 0;
 		}
-	}
-
-	if (last_match < length)
-	{
-		int to_copy = length - last_match;
-		if (last_match + to_copy > res_size)
+		else if (ptr[1] == '*' || ptr[1] == '?' || ptr[1] == '{')
+		{
+			c = 0;
+		}
+		if (c)
 		{
-			res_size = last_match + to_copy + 1;
-			result = (char *)realloc(result, res_size);
+			run[len++] = c;
+			continue;
 		}
-		ptr = &result[res_length];
-		memcpy(ptr, &sql[last_match], to_copy);
-		res_length += to_copy;
+		if (len > bestlen)
+		{
+			free(best);
+			if ((best = strndup(run, len)) == NULL)
+				bestlen = 0;
+			else
+				bestlen = len;
+		}
+		len = 0;
 	}
-	result[res_length] = 0;
+	if (len > bestlen)
+	{
+		free(best);
+		best = strndup(run, len);
+	}
+	free(run);
+	return best;
+}
 
-	return result;
+/**
+ * Check if a statement contains the literal of the regular expression
+ *
+ * @param	sql	The statement
+ * @param	length	The length of the statement
+ * @param	literal	The literal
+ * @param	litlen	The length of the literal
+ * @param	icase	Ignore the case of letters
+ * @return	Non-zero if the statement contains the literal
+ */
+static int
+regex_prefilter(char *sql, int length, char *literal, int litlen, int icase)
+{
+	if (!icase)
+		return memmem(sql, length, literal, litlen) != NULL;
+	return sqlscan_find_word(sql, sql + length, literal, litlen) != NULL;
 }
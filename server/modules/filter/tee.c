@@ -34,6 +34,16 @@
  *		of the request (optional)
  * user		A user name to match against. If present only requests that
  *		originate from this user will be duplciated (optional)
+ * queue	The maximum number of statements waiting for the branch,
+ *		default 100 (optional)
+ * latency	The number of milliseconds a statement may wait for the
+ *		branch before it is dropped, default 1000 (optional)
+ *
+ * The main session does not wait for the branch. The duplicates are queued
+ * in the tee session and one statement at a time is sent to the branch, the
+ * next one when the branch replies. The replies of the branch are thrown
+ * away. A statement that would overflow the queue, or that has waited
+ * longer than the latency, is dropped.
  *
  * Revision History
  * ================
@@ -57,6 +67,9 @@
 #include <service.h>
 #include <router.h>
 #include <dcb.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <timer.h>
 
 extern int lm_enabled_logfiles_bitmask; 
 
@@ -67,7 +80,7 @@ MODULE_INFO 	info = {
 	"A tee piece in the filter plumbing"
 };
 
-static char *version_str = "V1.0.0";
+static char *version_str = "V1.1.0";
 
 /*
  * The filter entry points
@@ -105,8 +118,25 @@ typedef struct {
 	regex_t	re;		/* Compiled regex text */
 	char	*nomatch;	/* Optional text to match against for exclusion */
 	regex_t	nore;		/* Compiled regex nomatch text */
+	int	queue_max;	/* Statements that may wait for the branch */
+	int	latency;	/* Milliseconds a statement may wait */
 } TEE_INSTANCE;
 
+#define	TEE_DEFAULT_QUEUE	100
+#define	TEE_DEFAULT_LATENCY	1000
+
+/**
+ * A statement waiting for the branch. The later packets of a statement
+ * that is in several packets are queued as continuations, they are sent
+ * as soon as the packets before them.
+ */
+typedef struct tee_queued {
+	GWBUF		*buffer;	/* The duplicate of the request */
+	unsigned long	queued;		/* When the request was queued */
+	int		continuation;	/* The rest of the previous request */
+	struct tee_queued *next;	/* The next request in the queue */
+} TEE_QUEUED;
+
 /**
  * The session structure for this TEE filter.
  * This stores the downstream filter information, such that the	
@@ -120,11 +150,27 @@ typedef struct {
 	int		active;		/* filter is active? */
 	DCB		*branch_dcb;	/* Client DCB for "branch" service */
 	SESSION		*branch_session;/* The branch service session */
+	UPSTREAM	branch_up;	/* The reply path of the branch */
+	SPINLOCK	lock;		/* Protects the queue */
+	TEE_QUEUED	*first;		/* The oldest queued request */
+	TEE_QUEUED	*last;		/* The newest queued request */
+	int		n_queued;	/* Number of queued statements */
+	int		in_flight;	/* The branch has not replied yet */
+	volatile int	routing;	/* Requests being sent to the branch */
+	int		closed;		/* The session is closing */
+	int		dropping;	/* The statement being queued is dropped */
+	int		expiring;	/* The statement being sent is dropped */
 	int		n_duped;	/* Number of duplicated queries */
 	int		n_rejected;	/* Number of rejected queries */
+	int		n_overflow;	/* Dropped because the queue was full */
+	int		n_expired;	/* Dropped because they waited too long */
 	int		residual;	/* Any outstanding SQL text */
 } TEE_SESSION;
 
+static	void	tee_enqueue(TEE_INSTANCE *, TEE_SESSION *, GWBUF *, int);
+static	void	tee_dispatch(TEE_INSTANCE *, TEE_SESSION *);
+static	int	tee_branch_reply(void *, void *, GWBUF *);
+
 /**
  * Implementation of the mandatory version entry point
  *
@@ -187,6 +233,8 @@ int		i;
 		my_instance->userName = NULL;
 		my_instance->match = NULL;
 		my_instance->nomatch = NULL;
+		my_instance->queue_max = TEE_DEFAULT_QUEUE;
+		my_instance->latency = TEE_DEFAULT_LATENCY;
 		if (params)
 		{
 			for (i = 0; params[i]; i++)
@@ -214,6 +262,10 @@ int		i;
 					my_instance->source = strdup(params[i]->value);
 				else if (!strcmp(params[i]->name, "user"))
 					my_instance->userName = strdup(params[i]->value);
+				else if (!strcmp(params[i]->name, "queue"))
+					my_instance->queue_max = atoi(params[i]->value);
+				else if (!strcmp(params[i]->name, "latency"))
+					my_instance->latency = atoi(params[i]->value);
 				else if (!filter_standard_parameter(params[i]->name))
 				{
 					LOGIF(LE, (skygw_log_write_flush(
@@ -281,6 +333,7 @@ char		*remote, *userName;
 	{
 		my_session->active = 1;
 		my_session->residual = 0;
+		spinlock_init(&my_session->lock);
 		if (my_instance->source 
 			&& (remote = session_get_remote(session)) != NULL)
 		{
@@ -295,6 +348,17 @@ char		*remote, *userName;
 		{
 			my_session->branch_dcb = dcb_clone(session->client);
 			my_session->branch_session = session_alloc(my_instance->service, my_session->branch_dcb);
+			if (my_session->branch_session == NULL)
+				my_session->active = 0;
+		}
+		if (my_session->active)
+		{
+			/* Replies of the branch come to the tee first */
+			my_session->branch_up = my_session->branch_session->tail;
+			my_session->branch_session->tail.instance = my_instance;
+			my_session->branch_session->tail.session = my_session;
+			my_session->branch_session->tail.clientReply =
+							tee_branch_reply;
 		}
 	}
 
@@ -317,9 +381,23 @@ TEE_SESSION	*my_session = (TEE_SESSION *)session;
 ROUTER_OBJECT	*router;
 void		*router_instance, *rsession;
 SESSION		*bsession;
+TEE_QUEUED	*queued;
 
 	if (my_session->active)
 	{
+		spinlock_acquire(&my_session->lock);
+		my_session->closed = 1;
+		spinlock_release(&my_session->lock);
+		/* Wait for the requests that are being sent to the branch */
+		while (my_session->routing)
+			thread_millisleep(1);
+		while ((queued = my_session->first) != NULL)
+		{
+			my_session->first = queued->next;
+			gwbuf_free(queued->buffer);
+			free(queued);
+		}
+		my_session->last = NULL;
 		bsession = my_session->branch_session;
 		router = bsession->service->router;
                 router_instance = bsession->service->router_instance;
@@ -390,13 +468,15 @@ TEE_INSTANCE	*my_instance = (TEE_INSTANCE *)instance;
 TEE_SESSION	*my_session = (TEE_SESSION *)session;
 char		*ptr;
 int		length, rval, residual;
+int		continuation = my_session->residual != 0;
 GWBUF		*clone = NULL;
 
 	if (my_session->residual)
 	{
 		clone = gwbuf_clone(queue);
 		if (my_session->residual < GWBUF_LENGTH(clone))
-			GWBUF_RTRIM(clone, GWBUF_LENGTH(clone) - residual);
+			GWBUF_RTRIM(clone, GWBUF_LENGTH(clone)
+						- my_session->residual);
 		my_session->residual -= GWBUF_LENGTH(clone);
 		if (my_session->residual < 0)
 			my_session->residual = 0;
@@ -419,8 +499,8 @@ GWBUF		*clone = NULL;
 			my_session->down.session, queue);
 	if (clone)
 	{
-		my_session->n_duped++;
-		SESSION_ROUTE_QUERY(my_session->branch_session, clone);
+		tee_enqueue(my_instance, my_session, clone, continuation);
+		tee_dispatch(my_instance, my_session);
 	}
 	else
 	{
@@ -429,6 +509,138 @@ GWBUF		*clone = NULL;
 	return rval;
 }
 
+/**
+ * Add a duplicated request to the queue of the branch. A new statement is
+ * dropped if the queue is full, the continuation of a statement follows
+ * what happened to its first packet.
+ *
+ * @param my_instance	The filter instance
+ * @param my_session	The filter session
+ * @param buffer	The duplicated request
+ * @param continuation	The request is the rest of the previous statement
+ */
+static void
+tee_enqueue(TEE_INSTANCE *my_instance, TEE_SESSION *my_session, GWBUF *buffer,
+	int continuation)
+{
+TEE_QUEUED	*queued;
+
+	spinlock_acquire(&my_session->lock);
+	if (!continuation)
+		my_session->dropping = my_session->n_queued >=
+						my_instance->queue_max;
+	if (my_session->closed || my_session->dropping ||
+		(queued = malloc(sizeof(TEE_QUEUED))) == NULL)
+	{
+		if (!continuation)
+		{
+			my_session->dropping = 1;
+			my_session->n_overflow++;
+		}
+		spinlock_release(&my_session->lock);
+		gwbuf_free(buffer);
+		return;
+	}
+	queued->buffer = buffer;
+	queued->queued = timer_now();
+	queued->continuation = continuation;
+	queued->next = NULL;
+	if (my_session->last)
+		my_session->last->next = queued;
+	else
+		my_session->first = queued;
+	my_session->last = queued;
+	if (!continuation)
+		my_session->n_queued++;
+	spinlock_release(&my_session->lock);
+}
+
+/**
+ * Send the queued requests to the branch. A new statement is sent only when
+ * the branch has replied to the previous one, the statements that have
+ * waited longer than the latency are dropped with their continuations.
+ *
+ * @param my_instance	The filter instance
+ * @param my_session	The filter session
+ */
+static void
+tee_dispatch(TEE_INSTANCE *my_instance, TEE_SESSION *my_session)
+{
+TEE_QUEUED	*queued;
+unsigned long	now;
+
+	for (;;)
+	{
+		spinlock_acquire(&my_session->lock);
+		now = timer_now();
+		if (my_session->closed || (queued = my_session->first) == NULL
+			|| (my_session->in_flight && !queued->continuation))
+		{
+			spinlock_release(&my_session->lock);
+			return;
+		}
+		if ((my_session->first = queued->next) == NULL)
+			my_session->last = NULL;
+		if (!queued->continuation)
+		{
+			my_session->n_queued--;
+			my_session->expiring = 0;
+			if (my_instance->latency > 0 &&
+				now - queued->queued > my_instance->latency)
+			{
+				my_session->n_expired++;
+				my_session->expiring = 1;
+			}
+		}
+		if (my_session->expiring)
+		{
+			spinlock_release(&my_session->lock);
+			gwbuf_free(queued->buffer);
+			free(queued);
+			continue;
+		}
+		if (!queued->continuation)
+		{
+			my_session->in_flight = 1;
+			my_session->n_duped++;
+		}
+		my_session->routing++;
+		spinlock_release(&my_session->lock);
+
+		SESSION_ROUTE_QUERY(my_session->branch_session, queued->buffer);
+		free(queued);
+
+		spinlock_acquire(&my_session->lock);
+		my_session->routing--;
+		spinlock_release(&my_session->lock);
+	}
+}
+
+/**
+ * The reply path of the branch session. The reply is not looked at, any
+ * reply lets the next queued statement go to the branch and the reply
+ * then carries on to the client DCB of the branch that throws it away.
+ *
+ * @param instance	The filter instance
+ * @param session	The filter session
+ * @param reply		The reply of the branch
+ * @return The result of the rest of the reply path
+ */
+static int
+tee_branch_reply(void *instance, void *session, GWBUF *reply)
+{
+TEE_SESSION	*my_session = (TEE_SESSION *)session;
+int		rval;
+
+	spinlock_acquire(&my_session->lock);
+	my_session->in_flight = 0;
+	spinlock_release(&my_session->lock);
+	rval = my_session->branch_up.clientReply(my_session->branch_up.instance,
+				my_session->branch_up.session, reply);
+	tee_dispatch((TEE_INSTANCE *)instance, my_session);
+	return rval;
+}
+
 /**
  * Diagnostics routine
  *
@@ -460,11 +672,21 @@ TEE_SESSION	*my_session = (TEE_SESSION *)fsession;
 	if (my_instance->nomatch)
 		dcb_printf(dcb, "\t\tExclude queries that match		%s\n",
 				my_instance->nomatch);
+	dcb_printf(dcb, "\t\tMaximum statements queued		%d\n",
+				my_instance->queue_max);
+	dcb_printf(dcb, "\t\tMaximum milliseconds queued		%d\n",
+				my_instance->latency);
 	if (my_session)
 	{
 		dcb_printf(dcb, "\t\tNo. of statements duplicated:	%d.\n",
 			my_session->n_duped);
 		dcb_printf(dcb, "\t\tNo. of statements rejected:	%d.\n",
 			my_session->n_rejected);
+		dcb_printf(dcb, "\t\tNo. of statements waiting:	%d.\n",
+			my_session->n_queued);
+		dcb_printf(dcb, "\t\tNo. dropped by a full queue:	%d.\n",
+			my_session->n_overflow);
+		dcb_printf(dcb, "\t\tNo. dropped by the latency:	%d.\n",
+			my_session->n_expired);
 	}
 }
@@ -0,0 +1,859 @@
+/*
+ * This file is distributed as part of MaxScale by SkySQL.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <filter.h>
+#include <modinfo.h>
+#include <modutil.h>
+#include <atomic.h>
+#include <spinlock.h>
+#include <poll.h>
+#include <timer.h>
+#include <config.h>
+#include <session.h>
+#include <service.h>
+#include <mysql_client_server_protocol.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+extern int lm_enabled_logfiles_bitmask;
+
+/**
+ * @file throttlefilter.c - a filter that limits the rate of statements
+ * @verbatim
+ *
+ * The statements of the sessions are limited by token buckets, one bucket
+ * for each user, one for each service and one for each statement
+ * fingerprint, each kind of bucket with its own rate. A statement takes a
+ * token from each of its buckets. A statement that finds a bucket empty is
+ * held back until the bucket has refilled, with a timer of the polling
+ * thread, or rejected with an error if it would wait longer than max_delay
+ * or if action=reject. The statements after a held back statement of a
+ * session wait behind it.
+ *
+ * The state of a bucket is kept per polling thread, a thread only writes
+ * its own copy and the polling threads take no locks. The threads that do
+ * not poll share one more copy under a lock. Each thread refills its copy
+ * at a share of the rate, every THROTTLE_RECONCILE milliseconds a thread
+ * looks at the number of statements the other threads have seen for the
+ * bucket and takes a share that is in proportion to its own.
+ *
+ * The parameters of the filter are, at least one rate is required
+ *	user_rate=<statements per second of each user>
+ *	service_rate=<statements per second of each service>
+ *	digest_rate=<statements per second of each fingerprint>
+ * Optional parameters
+ *	burst=<statements a bucket may save, default one second of its rate>
+ *	max_delay=<milliseconds a statement may be held, default 1000>
+ *	action=<delay or reject, default delay>
+ *	max_buckets=<buckets kept, default 10000, others are not limited>
+ *	source=<source address to limit filter>
+ *	user=<username to limit filter>
+ * @endverbatim
+ */
+
+MODULE_INFO 	info = {
+	MODULE_API_FILTER,
+	MODULE_BETA_RELEASE,
+	FILTER_VERSION,
+	"A filter that limits the rate of statements of users, services and fingerprints"
+};
+
+static char *version_str = "V1.0.0";
+
+#define	THROTTLE_USER		0		/* Bucket of a user */
+#define	THROTTLE_SERVICE	1		/* Bucket of a service */
+#define	THROTTLE_DIGEST		2		/* Bucket of a fingerprint */
+#define	THROTTLE_KINDS		3
+
+#define	THROTTLE_BUCKETS	1024		/* Hash buckets of the keys */
+#define	THROTTLE_RECONCILE	100		/* Milliseconds between shares */
+#define	THROTTLE_MAX_DELAY	1000		/* Default max_delay */
+#define	THROTTLE_MAX_KEYS	10000		/* Default max_buckets */
+#define	THROTTLE_ERRNO		1317		/* ER_QUERY_INTERRUPTED */
+
+static char *kind_names[THROTTLE_KINDS] = { "user", "service", "digest" };
+
+/**
+ * The copy of a bucket of one polling thread. Only the thread writes it,
+ * the others read the demand and when it was published. A copy fills a
+ * cache line of its own. The last copy is shared by the threads that do
+ * not poll, under the shared_lock of the instance.
+ */
+typedef struct {
+	double		tokens;		/* Tokens in the copy */
+	double		share;		/* Statements per second of the thread */
+	unsigned long	last;		/* When the tokens were refilled */
+	unsigned long	reconciled;	/* When the share was last taken */
+	int		window;		/* Statements since then */
+	volatile int	demand;		/* Statements of the last period */
+} __attribute__((aligned(64))) THROTTLE_SLOT;
+
+/**
+ * A bucket. The buckets are never freed, they are pushed on a hash chain
+ * with a compare and swap and the chains are read without a lock.
+ */
+typedef struct throttle_key {
+	int			kind;		/* User, service or digest */
+	uint64_t		hash;		/* Hash of the name */
+	char			*name;		/* Name of the user, service or
+						 * the canonical statement */
+	struct throttle_key	*next;		/* Next in the hash chain */
+	int			n_delayed;	/* Statements held back */
+	int			n_rejected;	/* Statements rejected */
+	THROTTLE_SLOT		slots[1];	/* The copies of the threads */
+} THROTTLE_KEY;
+
+/**
+ * Instance structure
+ */
+typedef struct {
+	char		*source;	/* Source address to restrict matches */
+	char		*user;		/* User name to restrict matches */
+	double		rate[THROTTLE_KINDS]; /* Rate of each kind or 0 */
+	int		burst;		/* Statements saved, 0 for the default */
+	int		max_delay;	/* Milliseconds a statement is held */
+	int		reject;		/* Reject rather than delay */
+	int		max_keys;	/* Buckets kept */
+	int		n_slots;	/* Copies of each bucket */
+	SPINLOCK	shared_lock;	/* Protects the copy of the threads
+					 * that do not poll */
+	THROTTLE_KEY	* volatile keys[THROTTLE_BUCKETS]; /* Hash chains */
+	int		n_keys;		/* Buckets kept */
+	int		n_untracked;	/* Statements of buckets not kept */
+	int		n_delayed;	/* Statements held back */
+	int		n_rejected;	/* Statements rejected */
+} THROTTLE_INSTANCE;
+
+/**
+ * A statement held back
+ */
+typedef struct throttle_delayed {
+	GWBUF			*queue;		/* The request */
+	int			checked;	/* It has taken its tokens */
+	struct throttle_delayed	*next;		/* The next held back request */
+} THROTTLE_DELAYED;
+
+/**
+ * The session structure for this throttle filter. The timer is started by
+ * the thread of the session and the held back statements are only used by
+ * that thread.
+ */
+typedef struct {
+	DOWNSTREAM	down;		/* The downstream filter */
+	UPSTREAM	up;		/* The upstream filter */
+	SESSION		*session;	/* The client session */
+	THROTTLE_INSTANCE *instance;	/* The filter instance */
+	int		active;		/* Is filter active */
+	int		closed;		/* The session is closing */
+	TIMER		timer;		/* Releases the held back statements */
+	THROTTLE_DELAYED *first;	/* The oldest held back statement */
+	THROTTLE_DELAYED *last;		/* The newest held back statement */
+	int		n_delayed;	/* Statements held back */
+	int		n_rejected;	/* Statements rejected */
+} THROTTLE_SESSION;
+
+static	FILTER	*createInstance(char **options, FILTER_PARAMETER **params);
+static	void	*newSession(FILTER *instance, SESSION *session);
+static	void 	closeSession(FILTER *instance, void *session);
+static	void 	freeSession(FILTER *instance, void *session);
+static	void	setDownstream(FILTER *instance, void *fsession, DOWNSTREAM *downstream);
+static	void	setUpstream(FILTER *instance, void *fsession, UPSTREAM *upstream);
+static	int	routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
+static	void	diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+static	int	getInterest(FILTER *instance, void *fsession);
+
+static	int	throttle_check(THROTTLE_INSTANCE *, THROTTLE_SESSION *, GWBUF *);
+static	THROTTLE_KEY *throttle_key(THROTTLE_INSTANCE *, int, char *);
+static	double	throttle_refill(THROTTLE_INSTANCE *, THROTTLE_KEY *,
+			THROTTLE_SLOT *, unsigned long);
+static	int	throttle_slot(THROTTLE_INSTANCE *);
+static	int	throttle_reject(THROTTLE_SESSION *, GWBUF *, THROTTLE_KEY *);
+static	void	throttle_release(void *);
+static	uint64_t throttle_hash(char *);
+
+static FILTER_OBJECT MyObject = {
+    createInstance,
+    newSession,
+    closeSession,
+    freeSession,
+    setDownstream,
+    setUpstream,
+    routeQuery,
+    NULL,		// No client reply
+    diagnostic,
+    NULL,		// No batch routing
+    getInterest,
+};
+
+/**
+ * Implementation of the mandatory version entry point
+ *
+ * @return version string of the module
+ */
+char *
+version()
+{
+	return version_str;
+}
+
+/**
+ * The module initialisation routine, called when the module
+ * is first loaded.
+ */
+void
+ModuleInit()
+{
+}
+
+/**
+ * The module entry point routine. It is this routine that
+ * must populate the structure that is referred to as the
+ * "module object", this is a structure with the set of
+ * external entry points for this module.
+ *
+ * @return The module object
+ */
+FILTER_OBJECT *
+GetModuleObject()
+{
+	return &MyObject;
+}
+
+/**
+ * Create an instance of the filter for a particular service
+ * within MaxScale.
+ *
+ * @param options	The options for this filter
+ * @param params	The array of name/value pair parameters for the filter
+ *
+ * @return The instance data for this new instance
+ */
+static	FILTER	*
+createInstance(char **options, FILTER_PARAMETER **params)
+{
+THROTTLE_INSTANCE	*my_instance;
+int			i;
+
+	if ((my_instance = calloc(1, sizeof(THROTTLE_INSTANCE))) != NULL)
+	{
+		spinlock_init(&my_instance->shared_lock);
+		my_instance->max_delay = THROTTLE_MAX_DELAY;
+		my_instance->max_keys = THROTTLE_MAX_KEYS;
+		for (i = 0; params && params[i]; i++)
+		{
+			if (!strcmp(params[i]->name, "user_rate"))
+				my_instance->rate[THROTTLE_USER] =
+						atof(params[i]->value);
+			else if (!strcmp(params[i]->name, "service_rate"))
+				my_instance->rate[THROTTLE_SERVICE] =
+						atof(params[i]->value);
+			else if (!strcmp(params[i]->name, "digest_rate"))
+				my_instance->rate[THROTTLE_DIGEST] =
+						atof(params[i]->value);
+			else if (!strcmp(params[i]->name, "burst"))
+				my_instance->burst = atoi(params[i]->value);
+			else if (!strcmp(params[i]->name, "max_delay"))
+				my_instance->max_delay = atoi(params[i]->value);
+			else if (!strcmp(params[i]->name, "max_buckets"))
+				my_instance->max_keys = atoi(params[i]->value);
+			else if (!strcmp(params[i]->name, "action"))
+			{
+				if (!strcasecmp(params[i]->value, "reject"))
+					my_instance->reject = 1;
+				else if (strcasecmp(params[i]->value, "delay"))
+					LOGIF(LE, (skygw_log_write_flush(
+						LOGFILE_ERROR,
+						"throttlefilter: Unknown action "
+						"'%s', statements are delayed.\n",
+						params[i]->value)));
+			}
+			else if (!strcmp(params[i]->name, "source"))
+				my_instance->source = strdup(params[i]->value);
+			else if (!strcmp(params[i]->name, "user"))
+				my_instance->user = strdup(params[i]->value);
+			else if (!filter_standard_parameter(params[i]->name))
+			{
+				LOGIF(LE, (skygw_log_write_flush(
+					LOGFILE_ERROR,
+					"throttlefilter: Unexpected parameter '%s'.\n",
+					params[i]->name)));
+			}
+		}
+
+		if (options)
+		{
+			for (i = 0; options[i]; i++)
+			{
+				LOGIF(LE, (skygw_log_write_flush(
+					LOGFILE_ERROR,
+					"throttlefilter: unsupported option '%s'.\n",
+					options[i])));
+			}
+		}
+
+		for (i = 0; i < THROTTLE_KINDS; i++)
+		{
+			if (my_instance->rate[i] < 0)
+				my_instance->rate[i] = 0;
+		}
+		if (my_instance->rate[THROTTLE_USER] == 0 &&
+			my_instance->rate[THROTTLE_SERVICE] == 0 &&
+			my_instance->rate[THROTTLE_DIGEST] == 0)
+		{
+			LOGIF(LE, (skygw_log_write_flush(LOGFILE_ERROR,
+				"throttlefilter: One of the user_rate, "
+				"service_rate or digest_rate parameters is "
+				"required.\n")));
+			free(my_instance->source);
+			free(my_instance->user);
+			free(my_instance);
+			return NULL;
+		}
+		if (my_instance->max_delay < 0)
+			my_instance->max_delay = 0;
+		/* A copy for each polling thread and one for the others */
+		if ((my_instance->n_slots = config_threadcount() + 1) < 2)
+			my_instance->n_slots = 2;
+	}
+	return (FILTER *)my_instance;
+}
+
+/**
+ * Associate a new session with this instance of the filter.
+ *
+ * @param instance	The filter instance data
+ * @param session	The session itself
+ * @return Session specific data for this session
+ */
+static	void	*
+newSession(FILTER *instance, SESSION *session)
+{
+THROTTLE_INSTANCE	*my_instance = (THROTTLE_INSTANCE *)instance;
+THROTTLE_SESSION	*my_session;
+char			*remote, *user;
+
+	if ((my_session = calloc(1, sizeof(THROTTLE_SESSION))) != NULL)
+	{
+		my_session->active = 1;
+		my_session->session = session;
+		my_session->instance = my_instance;
+		timer_init(&my_session->timer);
+		if (my_instance->source
+			&& (remote = session_get_remote(session)) != NULL)
+		{
+			if (strcmp(remote, my_instance->source))
+				my_session->active = 0;
+		}
+
+		if (my_instance->user && (user = session_getUser(session))
+				&& strcmp(user, my_instance->user))
+		{
+			my_session->active = 0;
+		}
+	}
+
+	return my_session;
+}
+
+/**
+ * Close a session with the filter, the statements that are held back are
+ * thrown away.
+ *
+ * @param instance	The filter instance data
+ * @param session	The session being closed
+ */
+static	void
+closeSession(FILTER *instance, void *session)
+{
+THROTTLE_SESSION	*my_session = (THROTTLE_SESSION *)session;
+THROTTLE_DELAYED	*delayed;
+
+	my_session->closed = 1;
+	timer_disable(&my_session->timer);
+	while ((delayed = my_session->first) != NULL)
+	{
+		my_session->first = delayed->next;
+		gwbuf_free(delayed->queue);
+		free(delayed);
+	}
+	my_session->last = NULL;
+}
+
+/**
+ * Free the memory associated with this filter session.
+ *
+ * @param instance	The filter instance data
+ * @param session	The session being closed
+ */
+static void
+freeSession(FILTER *instance, void *session)
+{
+	free(session);
+        return;
+}
+
+/**
+ * Set the downstream component for this filter.
+ *
+ * @param instance	The filter instance data
+ * @param session	The session being closed
+ * @param downstream	The downstream filter or router
+ */
+static void
+setDownstream(FILTER *instance, void *session, DOWNSTREAM *downstream)
+{
+THROTTLE_SESSION	*my_session = (THROTTLE_SESSION *)session;
+
+	my_session->down = *downstream;
+}
+
+/**
+ * Set the upstream filter or session to which results will be
+ * passed from this filter.
+ *
+ * @param instance	The filter instance data
+ * @param session	The filter session
+ * @param upstream	The upstream filter or session.
+ */
+static void
+setUpstream(FILTER *instance, void *session, UPSTREAM *upstream)
+{
+THROTTLE_SESSION	*my_session = (THROTTLE_SESSION *)session;
+
+	my_session->up = *upstream;
+}
+
+/**
+ * The routeQuery entry point. A statement is passed on if its buckets have
+ * a token, otherwise it is held back or rejected. The requests that come
+ * while a statement is held back wait behind it.
+ *
+ * @param instance	The filter instance data
+ * @param session	The filter session
+ * @param queue		The query data
+ */
+static	int
+routeQuery(FILTER *instance, void *session, GWBUF *queue)
+{
+THROTTLE_INSTANCE	*my_instance = (THROTTLE_INSTANCE *)instance;
+THROTTLE_SESSION	*my_session = (THROTTLE_SESSION *)session;
+THROTTLE_DELAYED	*delayed;
+int			wait;
+
+	if (!my_session->active)
+		goto route;
+	if (my_session->first == NULL)
+	{
+		if ((wait = throttle_check(my_instance, my_session, queue)) == 0)
+			goto route;
+		if (wait < 0)
+			return 1;
+	}
+	else
+		wait = -1;
+
+	if ((delayed = malloc(sizeof(THROTTLE_DELAYED))) == NULL)
+		goto route;
+	delayed->queue = queue;
+	delayed->checked = wait > 0;
+	delayed->next = NULL;
+	if (my_session->last)
+		my_session->last->next = delayed;
+	else
+		my_session->first = delayed;
+	my_session->last = delayed;
+	if (wait > 0)
+		timer_start(&my_session->timer, wait, throttle_release,
+				my_session);
+	return 1;
+
+route:
+	return my_session->down.routeQuery(my_session->down.instance,
+			my_session->down.session, queue);
+}
+
+/**
+ * The timer callback that passes on the held back statements. The first
+ * has already taken its tokens, the ones after it are checked in turn.
+ *
+ * @param data	The filter session
+ */
+static void
+throttle_release(void *data)
+{
+THROTTLE_SESSION	*my_session = (THROTTLE_SESSION *)data;
+THROTTLE_INSTANCE	*my_instance = my_session->instance;
+THROTTLE_DELAYED	*delayed;
+GWBUF			*queue;
+int			wait;
+
+	while (!my_session->closed && (delayed = my_session->first) != NULL)
+	{
+		if (!delayed->checked)
+		{
+			wait = throttle_check(my_instance, my_session,
+						delayed->queue);
+			if (wait > 0)
+			{
+				delayed->checked = 1;
+				timer_start(&my_session->timer, wait,
+					throttle_release, my_session);
+				return;
+			}
+		}
+		else
+			wait = 0;
+		if ((my_session->first = delayed->next) == NULL)
+			my_session->last = NULL;
+		queue = delayed->queue;
+		free(delayed);
+		/* A rejected statement has been answered and freed */
+		if (wait == 0)
+			my_session->down.routeQuery(my_session->down.instance,
+					my_session->down.session, queue);
+	}
+}
+
+/**
+ * Check the buckets of a statement. The tokens are taken if the statement
+ * is passed on now or held back.
+ *
+ * @param my_instance	The filter instance
+ * @param my_session	The filter session
+ * @param queue		The request
+ * @return Zero to pass the statement on, the milliseconds to hold it back
+ *	   or -1 if it has been rejected
+ */
+static int
+throttle_check(THROTTLE_INSTANCE *my_instance, THROTTLE_SESSION *my_session,
+	GWBUF *queue)
+{
+THROTTLE_KEY		*keys[THROTTLE_KINDS], *limit = NULL;
+THROTTLE_SLOT		*slot;
+MODUTIL_FINGERPRINT	*fp;
+unsigned long		now = timer_now();
+double			wait, longest = 0;
+char			*name;
+int			i, n = 0, s, shared, rejected;
+uint8_t			*data = GWBUF_DATA(queue);
+
+	if (GWBUF_LENGTH(queue) < 5 ||
+		(MYSQL_GET_COMMAND(data) != MYSQL_COM_QUERY &&
+		MYSQL_GET_COMMAND(data) != MYSQL_COM_STMT_EXECUTE))
+		return 0;
+	for (i = 0; i < THROTTLE_KINDS; i++)
+	{
+		if (my_instance->rate[i] == 0)
+			continue;
+		name = NULL;
+		if (i == THROTTLE_USER)
+			name = session_getUser(my_session->session);
+		else if (i == THROTTLE_SERVICE)
+			name = my_session->session->service->name;
+		else if ((fp = modutil_get_fingerprint(queue)) != NULL)
+			name = fp->canonical;
+		if (name && (keys[n] = throttle_key(my_instance, i, name)))
+			n++;
+	}
+
+	s = throttle_slot(my_instance);
+	if ((shared = (s == my_instance->n_slots - 1)) != 0)
+		spinlock_acquire(&my_instance->shared_lock);
+	for (i = 0; i < n; i++)
+	{
+		slot = &keys[i]->slots[s];
+		slot->window++;
+		if ((wait = throttle_refill(my_instance, keys[i], slot, now))
+								> longest)
+		{
+			longest = wait;
+			limit = keys[i];
+		}
+	}
+	rejected = limit && (my_instance->reject ||
+					longest > my_instance->max_delay);
+	for (i = 0; i < n && !rejected; i++)
+	{
+		keys[i]->slots[s].tokens -= 1;
+	}
+	if (shared)
+		spinlock_release(&my_instance->shared_lock);
+	if (rejected)
+		return throttle_reject(my_session, queue, limit);
+	if (limit == NULL)
+		return 0;
+	atomic_add(&limit->n_delayed, 1);
+	atomic_add(&my_instance->n_delayed, 1);
+	my_session->n_delayed++;
+	return longest < 1 ? 1 : (int)longest;
+}
+
+/**
+ * Refill the copy of a bucket of the calling thread. The share of the rate
+ * of the thread is taken again if the last one is older than
+ * THROTTLE_RECONCILE, it is in proportion to the statements the thread has
+ * seen for the bucket against all the threads.
+ *
+ * @param my_instance	The filter instance
+ * @param key		The bucket
+ * @param slot		The copy of the thread
+ * @param now		The time in milliseconds
+ * @return The milliseconds before the copy has a token, 0 if it has one
+ */
+static double
+throttle_refill(THROTTLE_INSTANCE *my_instance, THROTTLE_KEY *key,
+	THROTTLE_SLOT *slot, unsigned long now)
+{
+double	rate = my_instance->rate[key->kind], capacity;
+int	i, mine, total;
+
+	if (slot->reconciled == 0 || now - slot->reconciled >= THROTTLE_RECONCILE)
+	{
+		slot->demand = slot->window;
+		slot->window = 0;
+		slot->reconciled = now;
+		mine = slot->demand > 0 ? slot->demand : 1;
+		total = 0;
+		for (i = 0; i < my_instance->n_slots; i++)
+		{
+			/* Threads that have not published lately are idle */
+			if (&key->slots[i] != slot && key->slots[i].reconciled &&
+				now - key->slots[i].reconciled
+						< 2 * THROTTLE_RECONCILE)
+				total += key->slots[i].demand;
+		}
+		slot->share = rate * mine / (total + mine);
+	}
+	capacity = my_instance->burst > 0 ? my_instance->burst : rate;
+	capacity = capacity * slot->share / rate;
+	if (capacity < 1)
+		capacity = 1;
+	if (slot->last == 0)
+		slot->tokens = capacity;
+	else
+		slot->tokens += (now - slot->last) * slot->share / 1000;
+	if (slot->tokens > capacity)
+		slot->tokens = capacity;
+	slot->last = now;
+	if (slot->tokens >= 1)
+		return 0;
+	return (1 - slot->tokens) * 1000 / slot->share;
+}
+
+/**
+ * Find or add the bucket of a user, service or fingerprint. A bucket is
+ * added at the head of its hash chain with a compare and swap, the one
+ * added by another thread for the same name wins the race.
+ *
+ * @param my_instance	The filter instance
+ * @param kind		The kind of the bucket
+ * @param name		The name of the bucket
+ * @return The bucket or NULL if the buckets are not kept
+ */
+static THROTTLE_KEY *
+throttle_key(THROTTLE_INSTANCE *my_instance, int kind, char *name)
+{
+THROTTLE_KEY	*key, *head;
+uint64_t	hash = throttle_hash(name) + kind;
+int		bucket = hash % THROTTLE_BUCKETS;
+size_t		size = sizeof(THROTTLE_KEY) +
+			(my_instance->n_slots - 1) * sizeof(THROTTLE_SLOT);
+
+	for (;;)
+	{
+		head = my_instance->keys[bucket];
+		for (key = head; key; key = key->next)
+		{
+			if (key->hash == hash && key->kind == kind &&
+				!strcmp(key->name, name))
+				return key;
+		}
+		/* Each copy of the threads on a cache line of its own */
+		if (my_instance->n_keys >= my_instance->max_keys ||
+			posix_memalign((void **)&key, sizeof(THROTTLE_SLOT),
+								size) != 0)
+		{
+			atomic_add(&my_instance->n_untracked, 1);
+			return NULL;
+		}
+		memset(key, 0, size);
+		if ((key->name = strdup(name)) == NULL)
+		{
+			free(key);
+			return NULL;
+		}
+		key->kind = kind;
+		key->hash = hash;
+		key->next = head;
+		if (__sync_bool_compare_and_swap(&my_instance->keys[bucket],
+								head, key))
+		{
+			atomic_add(&my_instance->n_keys, 1);
+			return key;
+		}
+		/* The chain has changed, look again */
+		free(key->name);
+		free(key);
+	}
+}
+
+/**
+ * Return the copy of the buckets of the calling thread. Each polling thread
+ * has the copy of its polling thread id, any other thread shares the last
+ * one and must hold the shared_lock of the instance while it uses it.
+ *
+ * @param my_instance	The filter instance
+ * @return The index of the copy
+ */
+static int
+throttle_slot(THROTTLE_INSTANCE *my_instance)
+{
+int	id = poll_thread_id();
+
+	if (id < 0 || id >= my_instance->n_slots - 1)
+		return my_instance->n_slots - 1;
+	return id;
+}
+
+/**
+ * Reject a statement, the client is sent an error in place of the reply
+ *
+ * @param my_session	The filter session
+ * @param queue		The request, it is freed
+ * @param key		The bucket that is empty
+ * @return -1
+ */
+static int
+throttle_reject(THROTTLE_SESSION *my_session, GWBUF *queue, THROTTLE_KEY *key)
+{
+THROTTLE_INSTANCE	*my_instance = my_session->instance;
+GWBUF			*err;
+char			msg[200];
+
+	atomic_add(&key->n_rejected, 1);
+	atomic_add(&my_instance->n_rejected, 1);
+	my_session->n_rejected++;
+	snprintf(msg, sizeof(msg), "Statement rejected, the %s %.100s is over "
+		"its statement rate", kind_names[key->kind], key->name);
+	gwbuf_free(queue);
+	if ((err = modutil_create_mysql_err_msg(1, THROTTLE_ERRNO, "HY000",
+							msg)) != NULL)
+		my_session->up.clientReply(my_session->up.instance,
+				my_session->up.session, err);
+	return -1;
+}
+
+/**
+ * The hash of the name of a bucket, FNV-1a
+ *
+ * @param name	The name
+ * @return The hash
+ */
+static uint64_t
+throttle_hash(char *name)
+{
+uint64_t	hash = 14695981039346656037ULL;
+
+	while (*name)
+	{
+		hash ^= (unsigned char)*name++;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/**
+ * The getInterest entry point. A session that is not limited is left out of
+ * the filter chain.
+ *
+ * @param instance	The filter instance data
+ * @param session	The filter session
+ * @return The requests the filter session wants to see
+ */
+static int
+getInterest(FILTER *instance, void *session)
+{
+THROTTLE_SESSION	*my_session = (THROTTLE_SESSION *)session;
+
+	return my_session->active ? FILTER_INTEREST_ALL : 0;
+}
+
+/**
+ * Diagnostics routine
+ *
+ * If fsession is NULL then print diagnostics on the filter
+ * instance as a whole, otherwise print diagnostics for the
+ * particular session.
+ *
+ * @param	instance	The filter instance
+ * @param	fsession	Filter session, may be NULL
+ * @param	dcb		The DCB for diagnostic output
+ */
+static	void
+diagnostic(FILTER *instance, void *fsession, DCB *dcb)
+{
+THROTTLE_INSTANCE	*my_instance = (THROTTLE_INSTANCE *)instance;
+THROTTLE_SESSION	*my_session = (THROTTLE_SESSION *)fsession;
+THROTTLE_KEY		*key;
+int			i;
+
+	for (i = 0; i < THROTTLE_KINDS; i++)
+	{
+		if (my_instance->rate[i] > 0)
+			dcb_printf(dcb, "\t\tStatements per second of each %s:	%.1f\n",
+				kind_names[i], my_instance->rate[i]);
+	}
+	dcb_printf(dcb, "\t\tOver the rate statements are:		%s\n",
+			my_instance->reject ? "rejected" : "delayed");
+	if (my_instance->source)
+		dcb_printf(dcb, "\t\tLimit to connections from		%s\n",
+				my_instance->source);
+	if (my_instance->user)
+		dcb_printf(dcb, "\t\tLimit to user				%s\n",
+				my_instance->user);
+	if (my_session)
+	{
+		dcb_printf(dcb, "\t\tNo. of statements delayed:		%d\n",
+			my_session->n_delayed);
+		dcb_printf(dcb, "\t\tNo. of statements rejected:		%d\n",
+			my_session->n_rejected);
+		return;
+	}
+	dcb_printf(dcb, "\t\tNo. of buckets:				%d\n",
+			my_instance->n_keys);
+	dcb_printf(dcb, "\t\tNo. of statements not limited:		%d\n",
+			my_instance->n_untracked);
+	dcb_printf(dcb, "\t\tNo. of statements delayed:		%d\n",
+			my_instance->n_delayed);
+	dcb_printf(dcb, "\t\tNo. of statements rejected:		%d\n",
+			my_instance->n_rejected);
+	for (i = 0; i < THROTTLE_BUCKETS; i++)
+	{
+		for (key = my_instance->keys[i]; key; key = key->next)
+		{
+			if (key->n_delayed || key->n_rejected)
+				dcb_printf(dcb, "\t\t\t%-7s %-40.40s delayed %d, "
+					"rejected %d\n", kind_names[key->kind],
+					key->name, key->n_delayed,
+					key->n_rejected);
+		}
+	}
+}
@@ -31,6 +31,13 @@
  * file to which the queries are logged. A serial number is appended to this
  * name in order that each session logs to a different file.
  *
+ * The statements of all sessions are also counted by fingerprint, the
+ * statement with its literals replaced, in a table of the instance. The
+ * table holds the count, total, minimum and maximum time and a histogram of
+ * the times of each fingerprint, the diagnostics show the fingerprints with
+ * the largest total and 99th percentile times. Up to digests fingerprints
+ * are kept, the statements of the others are only counted.
+ *
  * Date		Who		Description
  * 18/06/2014	Mark Riddoch	Addition of source and user filters
  *
@@ -41,6 +48,8 @@
 #include <filter.h>
 #include <modinfo.h>
 #include <modutil.h>
+#include <spinlock.h>
+#include <atomic.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <string.h>
@@ -57,7 +66,7 @@ MODULE_INFO 	info = {
 	"A top N query logging filter"
 };
 
-static char *version_str = "V1.0.1";
+static char *version_str = "V1.1.0";
 
 /*
  * The filter entry points
@@ -71,6 +80,7 @@ static	void	setUpstream(FILTER *instance, void *fsession, UPSTREAM *upstream);
 static	int	routeQuery(FILTER *instance, void *fsession, GWBUF *queue);
 static	int	clientReply(FILTER *instance, void *fsession, GWBUF *queue);
 static	void	diagnostic(FILTER *instance, void *fsession, DCB *dcb);
+static	int	getInterest(FILTER *instance, void *fsession);
 
 
 static FILTER_OBJECT MyObject = {
@@ -83,8 +93,40 @@ static FILTER_OBJECT MyObject = {
     routeQuery,
     clientReply,
     diagnostic,
+    NULL,		// No batch routing
+    getInterest,
 };
 
+#define	TOPN_SHARDS		16	/* Locks of the fingerprint table */
+#define	TOPN_BUCKETS		256	/* Hash buckets of a shard */
+#define	TOPN_DIGESTS		1000	/* Default number of fingerprints */
+#define	TOPN_HIST_SUB		4	/* Histogram buckets in a power of two */
+#define	TOPN_HIST_BUCKETS	(32 * TOPN_HIST_SUB)
+
+/**
+ * The statistics of a fingerprint. The times are in microseconds, the
+ * histogram has TOPN_HIST_SUB buckets for each power of two of the time.
+ */
+typedef struct topn_digest {
+	uint64_t		fingerprint;	/* The statement fingerprint */
+	char			*canonical;	/* The canonical statement */
+	unsigned long		count;		/* Number of statements */
+	unsigned long long	total;		/* Total time */
+	unsigned long		min;		/* Shortest time */
+	unsigned long		max;		/* Longest time */
+	unsigned int		hist[TOPN_HIST_BUCKETS]; /* Histogram of times */
+	struct topn_digest	*next;		/* Next in the hash bucket */
+} TOPN_DIGEST;
+
+/**
+ * A part of the fingerprint table, a fingerprint is always in the same
+ * shard and the shards are locked separately.
+ */
+typedef struct {
+	SPINLOCK	lock;			/* Protects the shard */
+	TOPN_DIGEST	*buckets[TOPN_BUCKETS];	/* Hash buckets */
+} TOPN_SHARD;
+
 /**
  * A instance structure, the assumption is that the option passed
  * to the filter is simply a base for the filename to which the queries
@@ -103,6 +145,10 @@ typedef struct {
 	regex_t	re;		/* Compiled regex text */
 	char	*exclude;	/* Optional text to match against for exclusion */
 	regex_t	exre;		/* Compiled regex nomatch text */
+	int	max_digests;	/* Number of fingerprints kept */
+	int	n_digests;	/* Fingerprints in the table */
+	int	n_untracked;	/* Statements of the fingerprints not kept */
+	TOPN_SHARD shards[TOPN_SHARDS]; /* The fingerprint table */
 } TOPN_INSTANCE;
 
 /**
@@ -131,6 +177,7 @@ typedef struct {
 	int		fd;
 	struct timeval	start;
 	char		*current;
+	TOPN_DIGEST	*digest;	/* Fingerprint of the current statement */
 	TOPNQ		**top;
 	int		n_statements;
 	struct timeval	total;
@@ -138,6 +185,11 @@ typedef struct {
 	struct timeval	disconnect;
 } TOPN_SESSION;
 
+static	TOPN_DIGEST *topn_digest(TOPN_INSTANCE *, GWBUF *);
+static	void	topn_digest_add(TOPN_INSTANCE *, TOPN_DIGEST *, struct timeval *);
+static	unsigned long topn_percentile(TOPN_DIGEST *, int);
+static	void	topn_digest_report(TOPN_INSTANCE *, DCB *);
+
 /**
  * Implementation of the mandatory version entry point
  *
@@ -190,6 +242,9 @@ TOPN_INSTANCE	*my_instance;
 	if ((my_instance = calloc(1, sizeof(TOPN_INSTANCE))) != NULL)
 	{
 		my_instance->topN = 10;
+		my_instance->max_digests = TOPN_DIGESTS;
+		for (i = 0; i < TOPN_SHARDS; i++)
+			spinlock_init(&my_instance->shards[i].lock);
 		my_instance->match = NULL;
 		my_instance->exclude = NULL;
 		my_instance->source = NULL;
@@ -199,6 +254,8 @@ TOPN_INSTANCE	*my_instance;
 		{
 			if (!strcmp(params[i]->name, "count"))
 				my_instance->topN = atoi(params[i]->value);
+			else if (!strcmp(params[i]->name, "digests"))
+				my_instance->max_digests = atoi(params[i]->value);
 			else if (!strcmp(params[i]->name, "filebase"))
 			{
 				free(my_instance->filebase);
@@ -343,6 +400,8 @@ closeSession(FILTER *instance, void *session)
 TOPN_INSTANCE	*my_instance = (TOPN_INSTANCE *)instance;
 TOPN_SESSION	*my_session = (TOPN_SESSION *)session;
 struct timeval	diff;
+struct tm	tm;
+char		started[32];
 int		i;
 FILE		*fp;
 
@@ -366,8 +425,9 @@ FILE		*fp;
 			}
 		}
 		fprintf(fp, "-----------+-----------------------------------------------------------------\n");
+		localtime_r(&my_session->connect.tv_sec, &tm);
 		fprintf(fp, "\n\nSession started %s",
-			asctime(localtime(&my_session->connect.tv_sec)));
+			asctime_r(&tm, started));
 		if (my_session->clientHost)
 			fprintf(fp, "Connection from %s\n",
 				my_session->clientHost);
@@ -452,44 +512,65 @@ routeQuery(FILTER *instance, void *session, GWBUF *queue)
 {
 TOPN_INSTANCE	*my_instance = (TOPN_INSTANCE *)instance;
 TOPN_SESSION	*my_session = (TOPN_SESSION *)session;
-char		*ptr;
-int		length;
+char		*sql = NULL, *ptr;
+MODUTIL_SQL_VIEW view;
 
-	if (my_session->active && modutil_extract_SQL(queue, &ptr, &length))
+	if (my_session->active && modutil_is_SQL(queue) &&
+		modutil_sql_view(queue, &view))
 	{
+		/* Only the regular expressions need the text in one piece */
+		if ((my_instance->match || my_instance->exclude) &&
+			(sql = modutil_get_SQL(queue)) == NULL)
+			goto route;
 		if ((my_instance->match == NULL ||
-			regexec(&my_instance->re, ptr, 0, NULL, 0) == 0) &&
+			regexec(&my_instance->re, sql, 0, NULL, 0) == 0) &&
 			(my_instance->exclude == NULL ||
-				regexec(&my_instance->exre,ptr,0,NULL, 0) != 0))
+				regexec(&my_instance->exre,sql,0,NULL, 0) != 0))
 		{
 			my_session->n_statements++;
 			if (my_session->current)
 				free(my_session->current);
+			my_session->digest = topn_digest(my_instance, queue);
 			gettimeofday(&my_session->start, NULL);
-			my_session->current = strndup(ptr, length);
+			if (sql)
+				my_session->current = strdup(sql);
+			else if ((my_session->current = malloc(view.length +
+						view.remaining + 1)) != NULL)
+			{
+				ptr = my_session->current;
+				do {
+					memcpy(ptr, view.segment, view.length);
+					ptr += view.length;
+				} while (modutil_sql_view_next(&view));
+				*ptr = 0;
+			}
 		}
 	}
 
+route:
+
 	/* Pass the query downstream */
 	return my_session->down.routeQuery(my_session->down.instance,
 			my_session->down.session, queue);
 }
 
-static int
-cmp_topn(TOPNQ **a, TOPNQ **b)
-{
-	if ((*b)->duration.tv_sec == (*a)->duration.tv_sec)
-		return (*b)->duration.tv_usec - (*a)->duration.tv_usec;
-	return (*b)->duration.tv_sec - (*a)->duration.tv_sec;
-}
-
+/**
+ * The clientReply entry point. The time of the statement is added to the
+ * statistics of its fingerprint and the statement is put in the place of
+ * the session top N list, that is kept sorted, if it is long enough.
+ *
+ * @param instance	The filter instance data
+ * @param session	The filter session
+ * @param reply		The reply data
+ */
 static int
 clientReply(FILTER *instance, void *session, GWBUF *reply)
 {
 TOPN_INSTANCE	*my_instance = (TOPN_INSTANCE *)instance;
 TOPN_SESSION	*my_session = (TOPN_SESSION *)session;
 struct		timeval		tv, diff;
-int		i, inserted;
+TOPNQ		*last;
+int		i;
 
 	if (my_session->current)
 	{
@@ -497,30 +578,26 @@ int		i, inserted;
 		timersub(&tv, &(my_session->start), &diff);
 
 		timeradd(&(my_session->total), &diff, &(my_session->total));
+		if (my_session->digest)
+			topn_digest_add(my_instance, my_session->digest, &diff);
+		my_session->digest = NULL;
 
-		inserted = 0;
-		for (i = 0; i < my_instance->topN; i++)
+		/* The last place is free or the shortest of the list */
+		last = my_session->top[my_instance->topN - 1];
+		if (last->sql == NULL || timercmp(&diff, &last->duration, >))
 		{
-			if (my_session->top[i]->sql == NULL)
+			free(last->sql);
+			last->sql = my_session->current;
+			last->duration = diff;
+			for (i = my_instance->topN - 1; i > 0 &&
+				(my_session->top[i - 1]->sql == NULL ||
+				timercmp(&diff, &my_session->top[i - 1]->duration, >));
+									i--)
 			{
-				my_session->top[i]->sql = my_session->current;
-				my_session->top[i]->duration = diff;
-				inserted = 1;
-				break;
+				my_session->top[i] = my_session->top[i - 1];
 			}
+			my_session->top[i] = last;
 		}
-
-		if (inserted == 0 && ((diff.tv_sec > my_session->top[my_instance->topN-1]->duration.tv_sec) || (diff.tv_sec == my_session->top[my_instance->topN-1]->duration.tv_sec && diff.tv_usec > my_session->top[my_instance->topN-1]->duration.tv_usec )))
-		{
-			free(my_session->top[my_instance->topN-1]->sql);
-			my_session->top[my_instance->topN-1]->sql = my_session->current;
-			my_session->top[my_instance->topN-1]->duration = diff;
-			inserted = 1;
-		}
-
-		if (inserted)
-			qsort(my_session->top, my_instance->topN,
-					sizeof(TOPNQ *), cmp_topn);
 		else
 			free(my_session->current);
 		my_session->current = NULL;
@@ -531,6 +608,22 @@ int		i, inserted;
 			my_session->up.session, reply);
 }
 
+/**
+ * The getInterest entry point. Only the queries of a session that is
+ * measured are passed to the filter.
+ *
+ * @param instance	The filter instance data
+ * @param session	The filter session
+ * @return The requests the filter session wants to see
+ */
+static int
+getInterest(FILTER *instance, void *session)
+{
+TOPN_SESSION	*my_session = (TOPN_SESSION *)session;
+
+	return my_session->active ? FILTER_INTEREST_QUERY : 0;
+}
+
 /**
  * Diagnostics routine
  *
@@ -563,6 +656,8 @@ int		i;
 	if (my_instance->exclude)
 		dcb_printf(dcb, "\t\tExclude queries that match		%s\n",
 				my_instance->exclude);
+	if (my_session == NULL)
+		topn_digest_report(my_instance, dcb);
 	if (my_session)
 	{
 		dcb_printf(dcb, "\t\tLogging to file %s.\n",
@@ -582,3 +677,201 @@ int		i;
 		}
 	}
 }
+
+/**
+ * Find the statistics of the fingerprint of a statement, a new fingerprint
+ * is added if the table is not full.
+ *
+ * @param my_instance	The filter instance
+ * @param queue		The statement
+ * @return The statistics or NULL if the fingerprint is not kept
+ */
+static TOPN_DIGEST *
+topn_digest(TOPN_INSTANCE *my_instance, GWBUF *queue)
+{
+MODUTIL_FINGERPRINT	*fp;
+TOPN_SHARD		*shard;
+TOPN_DIGEST		*digest;
+int			bucket;
+
+	if ((fp = modutil_get_fingerprint(queue)) == NULL)
+		return NULL;
+	shard = &my_instance->shards[fp->fingerprint % TOPN_SHARDS];
+	bucket = (fp->fingerprint / TOPN_SHARDS) % TOPN_BUCKETS;
+
+	spinlock_acquire(&shard->lock);
+	for (digest = shard->buckets[bucket]; digest; digest = digest->next)
+		if (digest->fingerprint == fp->fingerprint)
+			break;
+	if (digest == NULL)
+	{
+		if (atomic_add(&my_instance->n_digests, 1) >=
+						my_instance->max_digests)
+		{
+			atomic_add(&my_instance->n_digests, -1);
+		}
+		else if ((digest = calloc(1, sizeof(TOPN_DIGEST))) == NULL ||
+			(digest->canonical = strdup(fp->canonical)) == NULL)
+		{
+			atomic_add(&my_instance->n_digests, -1);
+			free(digest);
+			digest = NULL;
+		}
+		else
+		{
+			digest->fingerprint = fp->fingerprint;
+			digest->next = shard->buckets[bucket];
+			shard->buckets[bucket] = digest;
+		}
+	}
+	spinlock_release(&shard->lock);
+	if (digest == NULL)
+		atomic_add(&my_instance->n_untracked, 1);
+	return digest;
+}
+
+/**
+ * Add the time of a statement to the statistics of its fingerprint
+ *
+ * @param my_instance	The filter instance
+ * @param digest	The statistics
+ * @param diff		The time of the statement
+ */
+static void
+topn_digest_add(TOPN_INSTANCE *my_instance, TOPN_DIGEST *digest,
+		struct timeval *diff)
+{
+TOPN_SHARD	*shard = &my_instance->shards[digest->fingerprint % TOPN_SHARDS];
+unsigned long	us = diff->tv_sec * 1000000 + diff->tv_usec;
+int		msb, bucket;
+
+	/* The power of two of the time and the next bits below it */
+	for (msb = 0; msb < 31 && (us >> (msb + 1)); msb++)
+		;
+	if (msb < 2)
+		bucket = us;
+	else
+		bucket = msb * TOPN_HIST_SUB +
+			((us >> (msb - 2)) & (TOPN_HIST_SUB - 1));
+	if (bucket >= TOPN_HIST_BUCKETS)
+		bucket = TOPN_HIST_BUCKETS - 1;
+
+	spinlock_acquire(&shard->lock);
+	if (digest->count == 0 || us < digest->min)
+		digest->min = us;
+	if (us > digest->max)
+		digest->max = us;
+	digest->count++;
+	digest->total += us;
+	digest->hist[bucket]++;
+	spinlock_release(&shard->lock);
+}
+
+/**
+ * The time below which a percentage of the statements of a fingerprint
+ * completed, the upper bound of the histogram bucket.
+ *
+ * @param digest	A copy of the statistics
+ * @param percent	The percentile
+ * @return The time in microseconds
+ */
+static unsigned long
+topn_percentile(TOPN_DIGEST *digest, int percent)
+{
+unsigned long	want, seen = 0, bound;
+int		bucket, msb;
+
+	want = (digest->count * percent + 99) / 100;
+	for (bucket = 0; bucket < TOPN_HIST_BUCKETS - 1; bucket++)
+	{
+		seen += digest->hist[bucket];
+		if (seen >= want)
+			break;
+	}
+	if (bucket < 2 * TOPN_HIST_SUB)
+		bound = bucket;
+	else
+	{
+		msb = bucket / TOPN_HIST_SUB;
+		bound = ((unsigned long)(TOPN_HIST_SUB + bucket % TOPN_HIST_SUB + 1)
+				<< (msb - 2)) - 1;
+	}
+	return bound < digest->max ? bound : digest->max;
+}
+
+static int
+cmp_total(const void *a, const void *b)
+{
+const TOPN_DIGEST	*da = a, *db = b;
+
+	return (db->total > da->total) - (db->total < da->total);
+}
+
+static int
+cmp_p99(const void *a, const void *b)
+{
+unsigned long	pa = topn_percentile((TOPN_DIGEST *)a, 99);
+unsigned long	pb = topn_percentile((TOPN_DIGEST *)b, 99);
+
+	return (pb > pa) - (pb < pa);
+}
+
+/**
+ * Print the fingerprints with the largest total and 99th percentile times.
+ * The statistics are copied a shard at a time, the statements are counted
+ * while the report is made.
+ *
+ * @param my_instance	The filter instance
+ * @param dcb		The DCB for diagnostic output
+ */
+static void
+topn_digest_report(TOPN_INSTANCE *my_instance, DCB *dcb)
+{
+TOPN_DIGEST	*copy, *digest;
+int		i, j, n = 0, max, pass;
+
+	max = my_instance->n_digests;
+	dcb_printf(dcb, "\t\tFingerprints kept			%d of %d\n",
+			max, my_instance->max_digests);
+	dcb_printf(dcb, "\t\tStatements of other fingerprints	%d\n",
+			my_instance->n_untracked);
+	if (max == 0 || (copy = calloc(max, sizeof(TOPN_DIGEST))) == NULL)
+		return;
+	for (i = 0; i < TOPN_SHARDS; i++)
+	{
+		spinlock_acquire(&my_instance->shards[i].lock);
+		for (j = 0; j < TOPN_BUCKETS; j++)
+		{
+			for (digest = my_instance->shards[i].buckets[j];
+				digest && n < max; digest = digest->next)
+			{
+				/* The canonical text is never changed or freed */
+				if (digest->count)
+					copy[n++] = *digest;
+			}
+		}
+		spinlock_release(&my_instance->shards[i].lock);
+	}
+	for (pass = 0; pass < 2; pass++)
+	{
+		qsort(copy, n, sizeof(TOPN_DIGEST), pass ? cmp_p99 : cmp_total);
+		dcb_printf(dcb, "\t\tTop %d fingerprints by %s:\n",
+				my_instance->topN,
+				pass ? "99th percentile time" : "total time");
+		dcb_printf(dcb, "\t\t   Count |  Total (s) |    Avg (ms) |    Min (ms) |"
+				"    Max (ms) |    P99 (ms) | Statement\n");
+		for (i = 0; i < n && i < my_instance->topN; i++)
+		{
+			dcb_printf(dcb, "\t\t%8lu | %10.3f | %11.3f | %11.3f | "
+				"%11.3f | %11.3f | %s\n",
+				copy[i].count,
+				(double)copy[i].total / 1000000,
+				(double)copy[i].total / (1000 * copy[i].count),
+				(double)copy[i].min / 1000,
+				(double)copy[i].max / 1000,
+				(double)topn_percentile(&copy[i], 99) / 1000,
+				copy[i].canonical);
+		}
+	}
+	free(copy);
+}
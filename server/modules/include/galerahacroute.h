@@ -0,0 +1,84 @@
+#ifndef _GALERAHACROUTE_H
+#define _GALERAHACROUTE_H
+/*
+ * This file is distributed as part of SkySQL MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file galerahacroute.h - The Galera HA connection router header file
+ */
+#include <dcb.h>
+
+/**
+ * The backend servers the connections are routed to and the number of
+ * sessions connected to each of them.
+ */
+typedef struct backend {
+	SERVER		*server;	           /*< The server itself */
+	int		current_connection_count;  /*< Number of connections to the server */
+} BACKEND;
+
+/**
+ * The client session structure used within this router.
+ */
+typedef struct router_client_session {
+#if defined(SS_DEBUG)
+        skygw_chk_t     rses_chk_top;
+#endif
+        SPINLOCK        rses_lock;	/*< protects rses_closed and the DCBs */
+        bool            rses_closed;	/*< true when closeSession is called */
+	BACKEND		*backend;	/*< Backend used by the client session */
+	DCB		*backend_dcb;	/*< DCB Connection to the backend */
+	DCB		**write_dcbs;	/*< Connections for the writes of a
+					 * table, by server, or NULL */
+	bool		rses_in_trx;	/*< An explicit transaction is open */
+	bool		rses_pinned;	/*< Session state the write connections
+					 * would lack, all goes to backend_dcb */
+	struct router_client_session *next;
+#if defined(SS_DEBUG)
+        skygw_chk_t     rses_chk_tail;
+#endif
+} ROUTER_CLIENT_SES;
+
+/**
+ * The statistics for this router instance
+ */
+typedef struct {
+	int		n_sessions;	/*< Number sessions created */
+	int		n_queries;	/*< Number of queries forwarded */
+	int		n_table_writes;	/*< Writes routed to the node of
+					 * their table */
+} ROUTER_STATS;
+
+/**
+ * The per instance data for the router.
+ */
+typedef struct router_instance {
+	SERVICE		  *service;	/*< Pointer to the service using this router */
+	ROUTER_CLIENT_SES *connections;	/*< Link list of all the client connections */
+	SPINLOCK	  lock;		/*< Spinlock for the instance data */
+	BACKEND		  **servers;	/*< The set of backend servers for this instance */
+	int		  n_servers;	/*< Number of the backend servers */
+	unsigned int	  bitmask;	/*< Bitmask to apply to server->status */
+	unsigned int	  bitvalue;	/*< Required value of server->status */
+	int		  table_writes;	/*< Route the writes of a table to one node */
+	ROUTER_STATS	  stats;	/*< Statistics for this router */
+	struct router_instance
+			  *next;
+} ROUTER_INSTANCE;
+
+#endif
@@ -30,17 +30,29 @@
  * @endverbatim
  */
 #include <dcb.h>
+#include <spinlock.h>
+#include <timer.h>
+#include <metrics.h>
 
 /**
  * The telnetd specific protocol structure to put in the DCB.
  */
 typedef struct	maxscaled {
-	int	state;		/**< The connection state */
-	char	*username;	/**< The login name of the user */
+	int		state;		/**< The connection state */
+	char		*username;	/**< The login name of the user */
+	SPINLOCK	lock;		/**< Protects the delta of the subscription */
+	METRICS_DELTA	*delta;		/**< The values sent, NULL if not subscribed */
+	int		interval;	/**< Milliseconds between the changes sent */
+	TIMER		timer;		/**< Sends the changes */
 } MAXSCALED;
 
 #define	MAXSCALED_STATE_LOGIN	1	/**< Issued login prompt */
 #define MAXSCALED_STATE_PASSWD	2	/**< Issued password prompt */
 #define MAXSCALED_STATE_DATA	3	/**< User logged in */
+#define MAXSCALED_STATE_STREAM	4	/**< The changes of the metrics are sent */
+
+#define	MAXSCALED_SUBSCRIBE	"subscribe metrics"	/**< The subscription command */
+#define	MAXSCALED_INTERVAL_DEFAULT	1000	/**< Default milliseconds between changes */
+#define	MAXSCALED_INTERVAL_MIN		100	/**< Shortest interval */
 
 #endif
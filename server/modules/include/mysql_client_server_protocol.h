@@ -64,6 +64,7 @@
 
 #define GW_MYSQL_VERSION "MaxScale " MAXSCALE_VERSION
 #define GW_MYSQL_LOOP_TIMEOUT 300000000
+#define GW_MYSQL_ACCEPT_BATCH 64 /*< Clients accepted for one listener event */
 #define GW_MYSQL_READ 0
 #define GW_MYSQL_WRITE 1
 #define MYSQL_HEADER_LEN 4L
@@ -99,7 +100,8 @@ typedef enum {
         MYSQL_AUTH_SENT,
         MYSQL_AUTH_RECV,
         MYSQL_AUTH_FAILED,
-        MYSQL_IDLE
+        MYSQL_IDLE,
+        MYSQL_QUEUED            /*< Client waits for admission, no handshake sent */
 } mysql_auth_state_t;
 
 
@@ -253,6 +255,93 @@ typedef struct server_command_st {
         struct server_command_st* scom_next;
 } server_command_t;
 
+/**
+ * A prepared statement of the binary protocol as the client protocol knows
+ * it. The statement is known by the id the client was given in PREPARE_OK.
+ */
+typedef struct mysql_stmt {
+        uint32_t            stmt_id;       /*< The statement id of the client */
+        int                 stmt_nparams;  /*< Number of parameters */
+        int                 stmt_qtype;    /*< Query type the router gave the
+        * prepared text, 0 if not known */
+        uint16_t*           stmt_types;    /*< Types of the parameters last
+        * bound, NULL if none are bound */
+        struct mysql_stmt*  stmt_next;     /*< Next statement of the client */
+} MYSQL_STMT;
+
+/**
+ * The decoded COM_STMT_* packet, attached to the packet buffer as the
+ * GWBUF_OBJ_STMT object by the client protocol. The NULL bitmap and the
+ * parameter types are copies of their own, the statement being prepared
+ * is only valid while the COM_STMT_PREPARE is routed.
+ */
+typedef struct mysql_stmt_info {
+        uint8_t             si_command;    /*< The COM_STMT_* command */
+        uint32_t            si_id;         /*< The statement id, 0 for
+        * COM_STMT_PREPARE */
+        uint8_t             si_flags;      /*< Cursor flags of COM_STMT_EXECUTE */
+        uint32_t            si_iterations; /*< Iterations of COM_STMT_EXECUTE */
+        uint32_t            si_rows;       /*< Rows asked by COM_STMT_FETCH */
+        uint16_t            si_param;      /*< Parameter of COM_STMT_SEND_LONG_DATA */
+        int                 si_nparams;    /*< Parameters of the statement,
+        * -1 if not known */
+        uint8_t*            si_nulls;      /*< NULL bitmap of the parameters */
+        uint16_t*           si_types;      /*< Types of the parameters */
+        int                 si_qtype;      /*< Query type of the prepared text,
+        * 0 if not known */
+        MYSQL_STMT*         si_prepare;    /*< The statement being prepared,
+        * the router sets its stmt_qtype */
+} MYSQL_STMT_INFO;
+
+/** Payload bytes of a reply packet that are looked at, enough for an OK */
+#define MYSQL_REPLY_PEEK        24
+
+/** The kind of packet the reply scanner expects next */
+typedef enum {
+        MYSQL_REPLY_FIRST = 0, /*< The first packet of a reply */
+        MYSQL_REPLY_NEXT,      /*< A further result or the answer to data
+        * the client was asked for */
+        MYSQL_REPLY_COLDEF,    /*< Column definitions until an EOF */
+        MYSQL_REPLY_ROWS,      /*< Rows until an EOF or an ERR */
+        MYSQL_REPLY_COUNTED,   /*< A known number of packets */
+        MYSQL_REPLY_STREAM     /*< The replication stream */
+} mysql_reply_state_t;
+
+/** What the reply scanner does with the reply to a command that was killed */
+typedef enum {
+        MYSQL_KILL_NONE = 0,   /*< The reply is not changed */
+        MYSQL_KILL_PENDING,    /*< Held until its first packet is seen */
+        MYSQL_KILL_REPLACE     /*< The error of the server is replaced */
+} mysql_reply_kill_t;
+
+/**
+ * The state of the reply scanner of a backend connection between reads.
+ * Only the header and the first bytes of each packet are collected, the
+ * rest of the payload is skipped without being looked at.
+ */
+typedef struct mysql_reply_scan {
+        mysql_reply_state_t rs_state;      /*< What the next packet is */
+        uint8_t             rs_cmd;        /*< Command of the current reply */
+        bool                rs_taken;      /*< rs_cmd was taken from the
+        * expected replies */
+        uint8_t             rs_hdr[4+MYSQL_REPLY_PEEK]; /*< Header and first
+        * bytes of the packet */
+        int                 rs_nhdr;       /*< Bytes collected in rs_hdr */
+        int                 rs_want;       /*< Bytes to collect in rs_hdr */
+        size_t              rs_left;       /*< Payload bytes still to come */
+        int                 rs_npackets;   /*< Packets left in the counted
+        * part of the reply */
+        bool                rs_fragment;   /*< The packet continues a
+        * packet of the maximum size */
+        bool                rs_continues;  /*< The packet is continued
+        * by the next one */
+        int                 rs_end;        /*< How the packet ends the reply */
+        mysql_reply_kill_t  rs_kill;       /*< The reply is to a command that
+        * was killed for the query timeout */
+        GWBUF*              rs_held;       /*< Data of the reply held until
+        * its first packet is seen */
+} MYSQL_REPLY_SCAN;
+
 /**
  * MySQL Protocol specific state data.
  * 
@@ -278,6 +367,43 @@ typedef struct {
         * created or received */
         unsigned        long tid;                         /*< MySQL Thread ID, in
         * handshake */
+        uint8_t             protocol_frame_hdr[4];        /*< Header of the packet
+        * being framed */
+        int                 protocol_frame_hdrlen;        /*< Header bytes seen */
+        size_t              protocol_frame_left;          /*< Payload bytes of the
+        * packet still to come */
+        size_t              protocol_frame_complete;      /*< Bytes of complete
+        * packets not yet taken */
+        bool                protocol_frame_continues;     /*< The last packet
+        * routed was of the maximum size, the next one continues its payload */
+        bool                protocol_compress;            /*< The compressed
+        * protocol is used */
+        uint8_t             protocol_zseq;                /*< Sequence number of
+        * the next frame that continues a command */
+        GWBUF*              protocol_zpending;            /*< Partial packet
+        * kept until the rest of it is written */
+        GWBUF*              protocol_zread;               /*< Partial frame
+        * kept until the rest of it is read */
+        MYSQL_STMT*         protocol_stmts;               /*< Prepared statements
+        * of the client */
+        MYSQL_STMT*         protocol_stmt_prepare;        /*< Statement waiting
+        * for its PREPARE_OK */
+        uint8_t*            protocol_reply_cmds;          /*< Ring of the commands
+        * written to the backend that wait for a reply */
+        unsigned long*      protocol_reply_times;         /*< When each command
+        * of the ring was written, in microseconds */
+        int                 protocol_reply_size;          /*< Entries of the ring */
+        int                 protocol_reply_first;         /*< Oldest command */
+        int                 protocol_reply_count;         /*< Commands in the ring */
+        MYSQL_REPLY_SCAN    protocol_reply;               /*< Reply scanner */
+        bool                protocol_reply_started;       /*< Data of the reply
+        * to the oldest command has been read */
+        TIMER               protocol_query_timer;         /*< Expires when the
+        * oldest command has run for the query timeout */
+        int                 protocol_query_timeout;       /*< The query timeout
+        * in seconds, 0 for none */
+        unsigned long       protocol_kill_sent;           /*< Write time of the
+        * command killed before its reply began, 0 if none */
 #if defined(SS_DEBUG)
         skygw_chk_t     protocol_chk_tail;
 #endif
@@ -295,6 +421,10 @@ typedef struct {
 #define MYSQL_IS_COM_QUIT(payload)              (MYSQL_GET_COMMAND(payload)==0x01)
 #define MYSQL_GET_NATTR(payload)                ((int)payload[4])
 
+/** Header of a frame of the compressed protocol and the most data in a frame */
+#define MYSQL_COMPRESS_HDRLEN                   7
+#define MYSQL_COMPRESS_MAXFRAME                 0xffffff
+
 #endif /** _MYSQL_PROTOCOL_H */
 
 void gw_mysql_close(MySQLProtocol **ptr);
@@ -310,7 +440,7 @@ int  gw_send_authentication_to_backend(
         uint8_t *passwd,
         MySQLProtocol *protocol);
 const char *gw_mysql_protocol_state2string(int state);
-int        gw_do_connect_to_backend(char *host, int port, int* fd);
+int        gw_do_connect_to_backend(SERVER *server, int* fd);
 int        mysql_send_com_quit(DCB* dcb, int packet_number, GWBUF* buf);
 GWBUF*     mysql_create_com_quit(GWBUF* bufparam, int packet_number);
 
@@ -364,12 +494,20 @@ void gw_str_xor(
 char  *gw_bin2hex(char *out, const uint8_t *in, unsigned int len);
 int    gw_hex2bin(uint8_t *out, const char *in, unsigned int len);
 int    gw_generate_random_str(char *output, int len);
+void   gw_generate_scramble(uint8_t *output, int len);
 char  *gw_strend(register const char *s);
 int    setnonblocking(int fd);
 int    setipaddress(struct in_addr *a, char *p);
 GWBUF* gw_MySQL_get_next_packet(GWBUF** p_readbuf);
+GWBUF* gw_MySQL_get_next_chain(GWBUF** p_readbuf);
 GWBUF* gw_MySQL_get_packets(GWBUF** p_readbuf, int* npackets);
 GWBUF* gw_MySQL_discard_packets(GWBUF* buf, int npackets);
+size_t gw_MySQL_frame_packets(MySQLProtocol* p, GWBUF* buf);
+GWBUF* gw_MySQL_frame_take(MySQLProtocol* p, GWBUF** p_readbuf);
+int    gw_MySQL_compress(MySQLProtocol* p, GWBUF** queue, int threshold);
+int    gw_MySQL_decompress(MySQLProtocol* p, GWBUF** buf);
+void   protocol_add_reply_commands(MySQLProtocol* p, GWBUF* queue);
+GWBUF* gw_MySQL_reply_scan(MySQLProtocol* p, GWBUF* buf);
 void   protocol_add_srv_command(MySQLProtocol* p, mysql_server_cmd_t cmd);
 void   protocol_remove_srv_command(MySQLProtocol* p);
 bool   protocol_waits_response(MySQLProtocol* p);
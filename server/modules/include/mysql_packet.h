@@ -0,0 +1,628 @@
+#ifndef _MYSQL_PACKET_H
+#define _MYSQL_PACKET_H
+/*
+ * This file is distributed as part of the SkySQL Gateway.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file mysql_packet.h
+ *
+ * The fields of the MySQL protocol packets, read and written by inline
+ * functions. A MYSQL_READER is a position in a payload that never moves
+ * past its end: a read that does not fit sets the error of the reader and
+ * gives 0 or NULL, the reads that follow give nothing either. A packet is
+ * read field by field and the error is checked once at the end, the
+ * parsers of the OK, ERR, EOF, prepared statement OK, column definition
+ * and handshake packets do so.
+ *
+ * The payload passed to the parsers is the packet without its 4 byte
+ * header. The strings they give point into the payload, they are not
+ * NUL terminated.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#define	MYSQL_PACKET_HEADER_LEN	4	/**< Payload length and sequence */
+#define	MYSQL_PACKET_MAX_LEN	0xffffff /**< Longest payload of a packet */
+
+#define	MYSQL_PACKET_OK		0x00	/**< First byte of an OK packet */
+#define	MYSQL_PACKET_INFILE	0xfb	/**< LOCAL INFILE request */
+#define	MYSQL_PACKET_EOF	0xfe	/**< First byte of an EOF packet */
+#define	MYSQL_PACKET_ERR	0xff	/**< First byte of an error packet */
+
+#define	MYSQL_LENENC_NULL	0xfb	/**< A NULL in place of a string */
+
+/**
+ * A position in a payload
+ */
+typedef struct mysql_reader {
+	uint8_t	*ptr;		/**< The next byte */
+	uint8_t	*end;		/**< The end of the payload */
+	int	error;		/**< A read went past the end */
+} MYSQL_READER;
+
+/**
+ * A string of a packet, the data is NULL for a NULL
+ */
+typedef struct mysql_str {
+	uint8_t	*data;
+	int	len;
+} MYSQL_STR;
+
+/**
+ * An OK packet
+ */
+typedef struct mysql_ok_packet {
+	uint64_t	affected_rows;
+	uint64_t	insert_id;
+	int		status;		/**< SERVER_STATUS_ flags */
+	int		warnings;
+	MYSQL_STR	info;		/**< Human readable information */
+} MYSQL_OK_PACKET;
+
+/**
+ * An ERR packet
+ */
+typedef struct mysql_err_packet {
+	int		code;
+	char		sqlstate[6];	/**< Empty if the packet has none */
+	MYSQL_STR	message;
+} MYSQL_ERR_PACKET;
+
+/**
+ * An EOF packet
+ */
+typedef struct mysql_eof_packet {
+	int		warnings;
+	int		status;		/**< SERVER_STATUS_ flags */
+} MYSQL_EOF_PACKET;
+
+/**
+ * The OK reply to COM_STMT_PREPARE
+ */
+typedef struct mysql_stmt_ok_packet {
+	uint32_t	stmt_id;
+	int		columns;
+	int		params;
+	int		warnings;
+} MYSQL_STMT_OK_PACKET;
+
+/**
+ * A column definition of the protocol 4.1
+ */
+typedef struct mysql_column_def {
+	MYSQL_STR	catalog;
+	MYSQL_STR	schema;
+	MYSQL_STR	table;
+	MYSQL_STR	org_table;
+	MYSQL_STR	name;
+	MYSQL_STR	org_name;
+	int		charset;
+	uint32_t	length;
+	int		type;
+	int		flags;
+	int		decimals;
+} MYSQL_COLUMN_DEF;
+
+/**
+ * The initial handshake of the protocol 10
+ */
+typedef struct mysql_handshake {
+	int		protocol;
+	MYSQL_STR	server_version;
+	uint32_t	thread_id;
+	uint8_t		scramble[20];
+	int		scramble_len;
+	uint32_t	capabilities;
+	int		charset;
+	int		status;
+	MYSQL_STR	plugin;		/**< The authentication plugin */
+} MYSQL_HANDSHAKE;
+
+/**
+ * Start reading a payload
+ *
+ * @param rd	The reader
+ * @param data	The payload
+ * @param len	The length of the payload
+ */
+static inline void
+mysql_reader_init(MYSQL_READER *rd, uint8_t *data, int len)
+{
+	rd->ptr = data;
+	rd->end = data + (len > 0 ? len : 0);
+	rd->error = 0;
+}
+
+/**
+ * The number of bytes left to read
+ */
+static inline int
+mysql_reader_left(MYSQL_READER *rd)
+{
+	return rd->end - rd->ptr;
+}
+
+/**
+ * Check that a number of bytes are left, the reader is put in error and at
+ * its end if they are not
+ *
+ * @return	Non-zero if the bytes may be read
+ */
+static inline int
+mysql_reader_need(MYSQL_READER *rd, int n)
+{
+	if (rd->error || rd->end - rd->ptr < n)
+	{
+		rd->error = 1;
+		rd->ptr = rd->end;
+		return 0;
+	}
+	return 1;
+}
+
+static inline unsigned int
+mysql_read_u8(MYSQL_READER *rd)
+{
+	if (!mysql_reader_need(rd, 1))
+		return 0;
+	return *rd->ptr++;
+}
+
+static inline unsigned int
+mysql_read_u16(MYSQL_READER *rd)
+{
+uint8_t	*p = rd->ptr;
+
+	if (!mysql_reader_need(rd, 2))
+		return 0;
+	rd->ptr += 2;
+	return p[0] | (p[1] << 8);
+}
+
+static inline unsigned int
+mysql_read_u24(MYSQL_READER *rd)
+{
+uint8_t	*p = rd->ptr;
+
+	if (!mysql_reader_need(rd, 3))
+		return 0;
+	rd->ptr += 3;
+	return p[0] | (p[1] << 8) | (p[2] << 16);
+}
+
+static inline uint32_t
+mysql_read_u32(MYSQL_READER *rd)
+{
+uint8_t	*p = rd->ptr;
+
+	if (!mysql_reader_need(rd, 4))
+		return 0;
+	rd->ptr += 4;
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t
+mysql_read_u64(MYSQL_READER *rd)
+{
+uint64_t	lo = mysql_read_u32(rd);
+
+	return lo | ((uint64_t)mysql_read_u32(rd) << 32);
+}
+
+/**
+ * Read a length encoded integer
+ *
+ * @param rd		The reader
+ * @param is_null	Set to non-zero if the integer is the NULL of a row,
+ *			may be NULL
+ * @return		The value, 0 for a NULL
+ */
+static inline uint64_t
+mysql_read_lenenc(MYSQL_READER *rd, int *is_null)
+{
+unsigned int	first = mysql_read_u8(rd);
+
+	if (is_null)
+		*is_null = (first == MYSQL_LENENC_NULL && !rd->error);
+	switch (first)
+	{
+	case MYSQL_LENENC_NULL:
+		return 0;
+	case 0xfc:
+		return mysql_read_u16(rd);
+	case 0xfd:
+		return mysql_read_u24(rd);
+	case 0xfe:
+		return mysql_read_u64(rd);
+	case 0xff:
+		rd->error = 1;
+		rd->ptr = rd->end;
+		return 0;
+	default:
+		return first;
+	}
+}
+
+/**
+ * Take a number of bytes
+ *
+ * @return	The start of the bytes or NULL if they are not all there
+ */
+static inline uint8_t *
+mysql_read_bytes(MYSQL_READER *rd, int n)
+{
+uint8_t	*p = rd->ptr;
+
+	if (n < 0 || !mysql_reader_need(rd, n))
+		return NULL;
+	rd->ptr += n;
+	return p;
+}
+
+/**
+ * Read a length encoded string, a NULL gives a string with NULL data
+ */
+static inline MYSQL_STR
+mysql_read_lenenc_str(MYSQL_READER *rd)
+{
+MYSQL_STR	str = { NULL, 0 };
+uint64_t	len;
+int		is_null;
+
+	len = mysql_read_lenenc(rd, &is_null);
+	if (rd->error || is_null)
+		return str;
+	if (len > (uint64_t)mysql_reader_left(rd))
+	{
+		mysql_reader_need(rd, mysql_reader_left(rd) + 1);
+		return str;
+	}
+	str.len = (int)len;
+	str.data = mysql_read_bytes(rd, str.len);
+	return str;
+}
+
+/**
+ * Read a NUL terminated string, the NUL is passed over
+ */
+static inline MYSQL_STR
+mysql_read_nulstr(MYSQL_READER *rd)
+{
+MYSQL_STR	str = { NULL, 0 };
+uint8_t		*nul;
+
+	if (rd->error ||
+		(nul = memchr(rd->ptr, 0, rd->end - rd->ptr)) == NULL)
+	{
+		mysql_reader_need(rd, mysql_reader_left(rd) + 1);
+		return str;
+	}
+	str.data = rd->ptr;
+	str.len = nul - rd->ptr;
+	rd->ptr = nul + 1;
+	return str;
+}
+
+/**
+ * The rest of the payload as a string
+ */
+static inline MYSQL_STR
+mysql_read_eofstr(MYSQL_READER *rd)
+{
+MYSQL_STR	str = { NULL, 0 };
+
+	if (rd->error)
+		return str;
+	str.data = rd->ptr;
+	str.len = rd->end - rd->ptr;
+	rd->ptr = rd->end;
+	return str;
+}
+
+/**
+ * The number of bytes of a length encoded integer
+ */
+static inline int
+mysql_lenenc_size(uint64_t val)
+{
+	return val < 0xfb ? 1 : val < 0x10000 ? 3 : val < 0x1000000 ? 4 : 9;
+}
+
+/**
+ * Write a length encoded integer, mysql_lenenc_size bytes
+ *
+ * @return	The position after the integer
+ */
+static inline uint8_t *
+mysql_write_lenenc(uint8_t *ptr, uint64_t val)
+{
+int	n, i;
+
+	if (val < 0xfb)
+	{
+		*ptr++ = val;
+		return ptr;
+	}
+	if (val < 0x10000)
+	{
+		*ptr++ = 0xfc;
+		n = 2;
+	}
+	else if (val < 0x1000000)
+	{
+		*ptr++ = 0xfd;
+		n = 3;
+	}
+	else
+	{
+		*ptr++ = 0xfe;
+		n = 8;
+	}
+	for (i = 0; i < n; i++)
+		*ptr++ = (val >> (8 * i)) & 0xff;
+	return ptr;
+}
+
+/**
+ * Write the header of a packet
+ *
+ * @param ptr	The start of the packet
+ * @param len	The length of the payload
+ * @param seq	The sequence number
+ * @return	The start of the payload
+ */
+static inline uint8_t *
+mysql_write_header(uint8_t *ptr, int len, int seq)
+{
+	ptr[0] = len & 0xff;
+	ptr[1] = (len >> 8) & 0xff;
+	ptr[2] = (len >> 16) & 0xff;
+	ptr[3] = seq & 0xff;
+	return ptr + MYSQL_PACKET_HEADER_LEN;
+}
+
+/**
+ * Parse an OK packet. The status flags are required, the warnings and the
+ * information text are not in the packets of old servers.
+ *
+ * @param payload	The payload
+ * @param len		The bytes of the payload available
+ * @param ok		The packet
+ * @return		Non-zero if the payload is an OK packet up to its status
+ */
+static inline int
+mysql_ok_parse(uint8_t *payload, int len, MYSQL_OK_PACKET *ok)
+{
+MYSQL_READER	rd;
+
+	mysql_reader_init(&rd, payload, len);
+	if (mysql_read_u8(&rd) != MYSQL_PACKET_OK)
+		return 0;
+	ok->affected_rows = mysql_read_lenenc(&rd, NULL);
+	ok->insert_id = mysql_read_lenenc(&rd, NULL);
+	ok->status = mysql_read_u16(&rd);
+	if (rd.error)
+		return 0;
+	ok->warnings = mysql_reader_left(&rd) >= 2 ? (int)mysql_read_u16(&rd) : 0;
+	ok->info = mysql_read_eofstr(&rd);
+	return 1;
+}
+
+/**
+ * Parse an ERR packet of the protocol 4.1, the SQL state is optional
+ *
+ * @return		Non-zero if the payload is an ERR packet
+ */
+static inline int
+mysql_err_parse(uint8_t *payload, int len, MYSQL_ERR_PACKET *err)
+{
+MYSQL_READER	rd;
+uint8_t		*state;
+
+	mysql_reader_init(&rd, payload, len);
+	if (mysql_read_u8(&rd) != MYSQL_PACKET_ERR)
+		return 0;
+	err->code = mysql_read_u16(&rd);
+	err->sqlstate[0] = 0;
+	if (mysql_reader_left(&rd) >= 6 && *rd.ptr == '#')
+	{
+		state = mysql_read_bytes(&rd, 6);
+		memcpy(err->sqlstate, state + 1, 5);
+		err->sqlstate[5] = 0;
+	}
+	err->message = mysql_read_eofstr(&rd);
+	return !rd.error;
+}
+
+/**
+ * Parse an EOF packet, a packet of 0xfe and of less than 9 bytes
+ *
+ * @return		Non-zero if the payload is an EOF packet
+ */
+static inline int
+mysql_eof_parse(uint8_t *payload, int len, MYSQL_EOF_PACKET *eof)
+{
+MYSQL_READER	rd;
+
+	if (len < 1 || len >= 9)
+		return 0;
+	mysql_reader_init(&rd, payload, len);
+	if (mysql_read_u8(&rd) != MYSQL_PACKET_EOF)
+		return 0;
+	eof->warnings = mysql_read_u16(&rd);
+	eof->status = mysql_read_u16(&rd);
+	if (rd.error)
+		eof->warnings = eof->status = 0;
+	return 1;
+}
+
+/**
+ * Parse the OK reply to COM_STMT_PREPARE
+ *
+ * @return		Non-zero if the payload is such a reply
+ */
+static inline int
+mysql_stmt_ok_parse(uint8_t *payload, int len, MYSQL_STMT_OK_PACKET *ok)
+{
+MYSQL_READER	rd;
+
+	mysql_reader_init(&rd, payload, len);
+	if (mysql_read_u8(&rd) != MYSQL_PACKET_OK)
+		return 0;
+	ok->stmt_id = mysql_read_u32(&rd);
+	ok->columns = mysql_read_u16(&rd);
+	ok->params = mysql_read_u16(&rd);
+	mysql_read_u8(&rd);		/*< Filler */
+	ok->warnings = mysql_read_u16(&rd);
+	return !rd.error;
+}
+
+/**
+ * Parse a column definition of the protocol 4.1
+ *
+ * @return		Non-zero if the payload is a whole column definition
+ */
+static inline int
+mysql_column_def_parse(uint8_t *payload, int len, MYSQL_COLUMN_DEF *def)
+{
+MYSQL_READER	rd;
+
+	mysql_reader_init(&rd, payload, len);
+	def->catalog = mysql_read_lenenc_str(&rd);
+	def->schema = mysql_read_lenenc_str(&rd);
+	def->table = mysql_read_lenenc_str(&rd);
+	def->org_table = mysql_read_lenenc_str(&rd);
+	def->name = mysql_read_lenenc_str(&rd);
+	def->org_name = mysql_read_lenenc_str(&rd);
+	mysql_read_lenenc(&rd, NULL);	/*< Length of the fixed fields */
+	def->charset = mysql_read_u16(&rd);
+	def->length = mysql_read_u32(&rd);
+	def->type = mysql_read_u8(&rd);
+	def->flags = mysql_read_u16(&rd);
+	def->decimals = mysql_read_u8(&rd);
+	return !rd.error;
+}
+
+/**
+ * Parse the initial handshake of the protocol 10. The scramble is the 8
+ * bytes of its first part and up to 12 of the second, the NUL after them
+ * is not part of it.
+ *
+ * @return		Non-zero if the payload is such a handshake
+ */
+static inline int
+mysql_handshake_parse(uint8_t *payload, int len, MYSQL_HANDSHAKE *hs)
+{
+MYSQL_READER	rd;
+uint8_t		*part;
+int		auth_len, n;
+
+	mysql_reader_init(&rd, payload, len);
+	if ((hs->protocol = mysql_read_u8(&rd)) != 10)
+		return 0;
+	hs->server_version = mysql_read_nulstr(&rd);
+	hs->thread_id = mysql_read_u32(&rd);
+	if ((part = mysql_read_bytes(&rd, 8)) != NULL)
+		memcpy(hs->scramble, part, 8);
+	hs->scramble_len = 8;
+	mysql_read_u8(&rd);		/*< Filler */
+	hs->capabilities = mysql_read_u16(&rd);
+	hs->plugin.data = NULL;
+	hs->plugin.len = 0;
+	if (rd.error)
+		return 0;
+	hs->charset = 0;
+	hs->status = 0;
+	if (mysql_reader_left(&rd) == 0)
+		return 1;
+	hs->charset = mysql_read_u8(&rd);
+	hs->status = mysql_read_u16(&rd);
+	hs->capabilities |= mysql_read_u16(&rd) << 16;
+	auth_len = mysql_read_u8(&rd);
+	mysql_read_bytes(&rd, 10);	/*< Reserved */
+	if (rd.error)
+		return 0;
+	/*< The second part is at least 13 bytes with its NUL */
+	n = auth_len - 8 > 13 ? auth_len - 8 : 13;
+	if (n > mysql_reader_left(&rd))
+		n = mysql_reader_left(&rd);
+	part = mysql_read_bytes(&rd, n);
+	/*< The NUL that ends the scramble is not part of it */
+	if (n > 0 && part[n - 1] == 0)
+		n--;
+	if (n > 12)
+		n = 12;
+	memcpy(hs->scramble + 8, part, n);
+	hs->scramble_len = 8 + n;
+	if (mysql_reader_left(&rd) > 0)
+	{
+		hs->plugin = mysql_read_nulstr(&rd);
+		if (rd.error)
+		{
+			/*< Old servers send the name without its NUL */
+			rd.error = 0;
+			hs->plugin.data = NULL;
+			hs->plugin.len = 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Write an OK packet, the sequence number is that of the reply
+ *
+ * @param ptr		Where to write, room for 4 + 1 + 9 + 9 + 4 bytes
+ * @param seq		The sequence number
+ * @param ok		The fields, the information text is not written
+ * @return		The length of the packet
+ */
+static inline int
+mysql_ok_build(uint8_t *ptr, int seq, MYSQL_OK_PACKET *ok)
+{
+uint8_t	*p = ptr + MYSQL_PACKET_HEADER_LEN;
+int	len;
+
+	*p++ = MYSQL_PACKET_OK;
+	p = mysql_write_lenenc(p, ok->affected_rows);
+	p = mysql_write_lenenc(p, ok->insert_id);
+	*p++ = ok->status & 0xff;
+	*p++ = (ok->status >> 8) & 0xff;
+	*p++ = ok->warnings & 0xff;
+	*p++ = (ok->warnings >> 8) & 0xff;
+	len = p - ptr;
+	mysql_write_header(ptr, len - MYSQL_PACKET_HEADER_LEN, seq);
+	return len;
+}
+
+/**
+ * Write the header and the command byte of a command packet, the
+ * arguments follow, COM_QUERY its statement text
+ *
+ * @param ptr		Where to write
+ * @param command	The command
+ * @param arglen	The length of the arguments
+ * @return		The start of the arguments
+ */
+static inline uint8_t *
+mysql_command_build(uint8_t *ptr, int command, int arglen)
+{
+	ptr = mysql_write_header(ptr, 1 + arglen, 0);
+	*ptr++ = command;
+	return ptr;
+}
+#endif
@@ -0,0 +1,63 @@
+/*
+ * This file is distributed as part of MaxScale by SkySQL.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+#ifndef _QLACAPTURE_H
+#define _QLACAPTURE_H
+
+#include <stdint.h>
+
+/**
+ * @file qlacapture.h - The records of a traffic capture of the QLA filter
+ *
+ * With format=capture the QLA filter writes, to the file of each session,
+ * every packet the client sends and the time of the reply to it, so that
+ * the traffic can be replayed with the concurrency and the timing it had.
+ * Every record is a struct qla_capture in the byte order of the host that
+ * wrote it, followed by length bytes.
+ *
+ * QLA_CAPTURE_OPEN	The session started, the user name and the remote
+ *			address follow, each terminated by a NUL.
+ * QLA_CAPTURE_PACKET	A packet of the client, the whole MySQL packet with
+ *			its header follows.
+ * QLA_CAPTURE_REPLY	The first reply to the packet before it reached the
+ *			filter, no data follows.
+ * QLA_CAPTURE_CLOSE	The session closed, no data follows.
+ *
+ * A record is dropped rather than delaying the client when the ring of
+ * the thread is full, a replay must not assume that every packet has its
+ * reply record or that a file ends with a close.
+ */
+
+#define	QLA_CAPTURE_MAGIC	0x51434150	/* "QCAP" */
+
+#define	QLA_CAPTURE_OPEN	1
+#define	QLA_CAPTURE_PACKET	2
+#define	QLA_CAPTURE_REPLY	3
+#define	QLA_CAPTURE_CLOSE	4
+
+struct qla_capture {
+	uint32_t	magic;		/* QLA_CAPTURE_MAGIC */
+	uint32_t	session;	/* Serial of the session in the filter */
+	uint64_t	sec;		/* Seconds of the time of the record */
+	uint32_t	usec;		/* Microseconds of the time */
+	uint16_t	type;		/* QLA_CAPTURE_ type */
+	uint16_t	flags;		/* Zero */
+	uint32_t	length;		/* Bytes that follow */
+	uint32_t	reserved;	/* Zero, the record is 32 bytes */
+};
+
+#endif
@@ -31,6 +31,7 @@
  * @endverbatim
  */
 #include <dcb.h>
+#include <statistics.h>
 
 /**
  * Internal structure used to define the set of backend servers we are routing
@@ -41,8 +42,46 @@ typedef struct backend {
 	SERVER		*server;	           /*< The server itself */
 	int		current_connection_count;  /*< Number of connections to the server */
 	int		weight;			   /*< Desired routing weight */
+	int		n_selected;		   /*< Sessions connected since startup */
+	int		heap_index;		   /*< Position in the heap or -1 */
 } BACKEND;
 
+/**
+ * A virtual node of the consistent hash ring of the servers, a server has
+ * a number of nodes in proportion to its weight.
+ */
+typedef struct ring_node {
+	unsigned int	hash;		/*< Position of the node on the ring */
+	BACKEND		*backend;	/*< The backend of the node */
+} RING_NODE;
+
+/**
+ * The key a session is placed on the ring with, set by the affinity
+ * router option
+ */
+#define	READCONN_AFFINITY_NONE		0	/*< Balance by connection count */
+#define	READCONN_AFFINITY_USER		1	/*< The client user */
+#define	READCONN_AFFINITY_DATABASE	2	/*< The default database */
+#define	READCONN_AFFINITY_ADDRESS	3	/*< The client address */
+
+#define	READCONN_RING_VNODES	160	/*< Ring nodes of a server of weight 1000 */
+
+/**
+ * The state of the reply to the statements of a session, see
+ * session_track_reply
+ */
+#define	READCONN_REPLY_IDLE	0	/*< No reply expected */
+#define	READCONN_REPLY_FIRST	1	/*< Waiting for the first packet */
+#define	READCONN_REPLY_COLUMNS	2	/*< Column definitions up to an EOF */
+#define	READCONN_REPLY_ROWS	3	/*< Rows up to the EOF of the result set */
+#define	READCONN_REPLY_INFILE	4	/*< The server waits for a LOCAL INFILE */
+#define	READCONN_REPLY_UNKNOWN	5	/*< The replies can't be followed */
+
+#define	READCONN_PACKET_PREFIX	28	/*< Bytes of a packet read for its state */
+
+#define	READCONN_RECONNECT_RETRY	100	/*< Milliseconds between the connects to a new master */
+#define	READCONN_RECONNECT_TIMEOUT	10000	/*< Milliseconds a statement waits for a new master */
+
 /**
  * The client session structure used within this router.
  */
@@ -57,18 +96,37 @@ typedef struct router_client_session {
 	DCB		*backend_dcb;  /*< DCB Connection to the backend      */
 	struct router_client_session *next;
         int             rses_capabilities; /*< input type, for example */
+	bool		rses_spliced;  /*< Client and backend are spliced     */
+	bool		rses_sticky;   /*< State a new connection would lack  */
+	bool		rses_in_trx;   /*< A transaction is open              */
+	struct session	*rses_session; /*< The session                        */
+	struct router_instance *rses_inst; /*< The router instance            */
+	int		rses_reply_state; /*< READCONN_REPLY_ state of the reply */
+	int		rses_nreplies; /*< Replies expected, pipelined too    */
+	uint8_t		rses_pkt[READCONN_PACKET_PREFIX]; /*< Start of a packet */
+	int		rses_pktlen;   /*< Bytes in rses_pkt                  */
+	int		rses_skip;     /*< Bytes of the packet left to skip   */
+	unsigned long	rses_lost_at;  /*< When the master connection was lost,
+					   in msecs, 0 if it was not          */
+	GWBUF		*rses_held;    /*< Statements waiting for a new master */
+	unsigned long	rses_held_at;  /*< When the first of them arrived     */
+	TIMER		rses_timer;    /*< Retries the connect to a new master */
 #if defined(SS_DEBUG)
         skygw_chk_t     rses_chk_tail;
 #endif
 } ROUTER_CLIENT_SES;
 
 /**
- * The statistics for this router instance
+ * The statistics for this router instance, counted per thread
  */
-typedef struct {
-	int		n_sessions;	/*< Number sessions created     */
-	int		n_queries;	/*< Number of queries forwarded */
-} ROUTER_STATS;
+#define	READCONN_N_SESSIONS	0	/*< Number sessions created     */
+#define	READCONN_N_QUERIES	1	/*< Number of queries forwarded */
+#define	READCONN_N_HINT_IGNORED	2	/*< Number of hints not followed */
+#define	READCONN_N_AFFINITY	3	/*< Sessions placed on the ring  */
+#define	READCONN_N_SPLICED	4	/*< Sessions forwarded by splice */
+#define	READCONN_N_REBALANCED	5	/*< Sessions moved to another server */
+#define	READCONN_N_RECONNECTED	6	/*< Sessions moved to a new master */
+#define	READCONN_N_STATS	7
 
 
 /**
@@ -79,9 +137,22 @@ typedef struct router_instance {
 	ROUTER_CLIENT_SES *connections; /*< Link list of all the client connections  */
 	SPINLOCK	  lock;	        /*< Spinlock for the instance data           */
 	BACKEND		  **servers;    /*< List of backend servers                  */
+	SPINLOCK	  heaplock;	/*< Protects the heap and connection counts  */
+	BACKEND		  **heap;	/*< Eligible backends, least loaded first    */
+	int		  n_heap;	/*< Number of backends in the heap           */
+	volatile int	  heap_stale;	/*< A server of the heap has changed         */
+	BACKEND		  *master_host;	/*< Root master when the heap was built      */
+	int		  n_ejected;	/*< Eligible servers with an open circuit    */
+	int		  affinity;	/*< READCONN_AFFINITY_ key of the sessions   */
+	RING_NODE	  *ring;	/*< Nodes of the servers, ordered by hash    */
+	int		  n_ring;	/*< Number of nodes on the ring              */
+	int		  passthrough;	/*< Splice the authenticated sessions        */
+	int		  flow_control;	/*< Avoid nodes that ask for flow control    */
+	int		  rebalance;	/*< Move idle sessions to less loaded servers */
+	int		  reconnect;	/*< Move idle sessions to a new master       */
 	unsigned int	  bitmask;	/*< Bitmask to apply to server->status       */
 	unsigned int	  bitvalue;	/*< Required value of server->status         */
-	ROUTER_STATS	  stats;	/*< Statistics for this router               */
+	TS_STATS	  *stats;	/*< Statistics for this router               */
 	struct router_instance
                           *next;
 } ROUTER_INSTANCE;
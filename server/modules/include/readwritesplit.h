@@ -31,10 +31,7 @@
 
 #include <dcb.h>
 #include <hashtable.h>
-
-#undef PREP_STMT_CACHING
-
-#if defined(PREP_STMT_CACHING)
+#include <statistics.h>
 
 typedef enum prep_stmt_type {
         PREP_STMT_NAME,
@@ -48,20 +45,31 @@ typedef enum prep_stmt_state {
         PREP_STMT_DROPPED
 } prep_stmt_state_t;
 
-#endif /*< PREP_STMT_CACHING */
-
 typedef enum bref_state {
         BREF_IN_USE           = 0x01,
         BREF_WAITING_RESULT   = 0x02, /*< for session commands only */
         BREF_QUERY_ACTIVE     = 0x04, /*< for other queries */
-        BREF_CLOSED           = 0x08
+        BREF_CLOSED           = 0x08,
+        BREF_CAUSAL_WRITE     = 0x10, /*< causal reads: write needs its GTID */
+        BREF_CAUSAL_GTID      = 0x20, /*< causal reads: GTID query sent */
+        BREF_CAUSAL_WAIT      = 0x40, /*< causal reads: slave waits for GTID */
+        BREF_PSTMT_PREPARE    = 0x80, /*< COM_STMT_PREPARE of the client sent */
+        BREF_PSTMT_LAZY       = 0x100, /*< COM_STMT_PREPARE of the router sent */
+        BREF_RELEASED         = 0x200 /*< multiplex: connection returned to pool */
 } bref_state_t;
 
+#define BREF_CAUSAL_STATES (BREF_CAUSAL_WRITE|BREF_CAUSAL_GTID|BREF_CAUSAL_WAIT)
+
 #define BREF_IS_NOT_USED(s)         (s->bref_state & ~BREF_IN_USE)
 #define BREF_IS_IN_USE(s)           (s->bref_state & BREF_IN_USE)
 #define BREF_IS_WAITING_RESULT(s)   (s->bref_num_result_wait > 0)
 #define BREF_IS_QUERY_ACTIVE(s)     (s->bref_state & BREF_QUERY_ACTIVE)
 #define BREF_IS_CLOSED(s)           (s->bref_state & BREF_CLOSED)
+#define BREF_IS_CAUSAL(s)           (s->bref_state & BREF_CAUSAL_STATES)
+#define BREF_IS_RELEASED(s)         (s->bref_state & BREF_RELEASED)
+
+/** Length of the GTID buffers of causal reads, fits domain-server-sequence */
+#define RWSPLIT_GTID_LEN            64
 
 typedef enum backend_type_t {
         BE_UNDEFINED=-1, 
@@ -95,14 +103,45 @@ typedef enum select_criteria {
         LEAST_ROUTER_CONNECTIONS, /*< connections established by this router */
         LEAST_BEHIND_MASTER,
         LEAST_CURRENT_OPERATIONS,
-        DEFAULT_CRITERIA=LEAST_CURRENT_OPERATIONS,
-        LAST_CRITERIA /*< not used except for an index */
+        LEAST_RESPONSE_TIME,      /*< average response time times operations */
+        LAST_CRITERIA, /*< not used except for an index */
+        DEFAULT_CRITERIA=LEAST_CURRENT_OPERATIONS
 } select_criteria_t;
 
 
 /** default values for rwsplit configuration parameters */
 #define CONFIG_MAX_SLAVE_CONN 1
 #define CONFIG_MAX_SLAVE_RLAG -1 /*< not used */
+#define CONFIG_MAX_SESCMD_HISTORY 50 /*< session commands kept, 0 for no limit */
+
+/**
+ * The average response time of a backend is an exponentially weighted moving
+ * average, each reply moves it 1/2^RWSPLIT_EWMA_SHIFT of the way towards the
+ * response time of the query.
+ */
+#define RWSPLIT_EWMA_SHIFT 3
+
+/**
+ * With master_failover_wait a session holds at most RWSPLIT_FAILOVER_MAX_HELD
+ * writes and looks for a new master every RWSPLIT_FAILOVER_POLL_MS
+ * milliseconds.
+ */
+#define RWSPLIT_FAILOVER_MAX_HELD 64
+#define RWSPLIT_FAILOVER_POLL_MS  500
+
+/**
+ * With dynamic_weights the weights are computed at most every
+ * RWSPLIT_WEIGHT_INTERVAL_MS milliseconds, and the response time moves a
+ * weight at most RWSPLIT_WEIGHT_MAX_SCALE times from the configured one.
+ */
+#define RWSPLIT_WEIGHT_INTERVAL_MS 1000
+#define RWSPLIT_WEIGHT_MAX_SCALE   4
+
+/**
+ * A statement of 16MB or more is classified by the first
+ * RWSPLIT_LONG_PREFIX bytes of its text.
+ */
+#define RWSPLIT_LONG_PREFIX 1024
 
 #define GET_SELECT_CRITERIA(s)                                                                  \
         (strncmp(s,"LEAST_GLOBAL_CONNECTIONS", strlen("LEAST_GLOBAL_CONNECTIONS")) == 0 ?       \
@@ -112,8 +151,19 @@ typedef enum select_criteria {
         strncmp(s,"LEAST_ROUTER_CONNECTIONS", strlen("LEAST_ROUTER_CONNECTIONS")) == 0 ?        \
         LEAST_ROUTER_CONNECTIONS : (                                                            \
         strncmp(s,"LEAST_CURRENT_OPERATIONS", strlen("LEAST_CURRENT_OPERATIONS")) == 0 ?        \
-        LEAST_CURRENT_OPERATIONS : UNDEFINED_CRITERIA))))
+        LEAST_CURRENT_OPERATIONS : (                                                            \
+        strncmp(s,"LEAST_RESPONSE_TIME", strlen("LEAST_RESPONSE_TIME")) == 0 ?                  \
+        LEAST_RESPONSE_TIME : UNDEFINED_CRITERIA)))))
         
+/**
+ * What a session command changes, used for compacting the history
+ */
+typedef enum sescmd_kind_t {
+        SESCMD_OTHER=0, /*< can't be superseded and may depend on others */
+        SESCMD_SET,     /*< SET of a single variable */
+        SESCMD_USE      /*< USE or COM_INIT_DB */
+} sescmd_kind_t;
+
 /**
  * Session variable command
  */
@@ -125,6 +175,14 @@ typedef struct mysql_sescmd_st {
         GWBUF*             my_sescmd_buf;        /*< query buffer */
         unsigned char      my_sescmd_packet_type;/*< packet type */
 	bool               my_sescmd_is_replied; /*< is cmd replied to client */
+        bool               my_sescmd_reply_err;  /*< the reply to client was an error */
+        GWBUF*             my_sescmd_err_buf;    /*< error reply held until a backend succeeds */
+        sescmd_kind_t      my_sescmd_kind;       /*< what the command changes */
+        char*              my_sescmd_key;        /*< variable of SESCMD_SET */
+        char*              my_sescmd_sql;        /*< SQL text, owned by the buffer */
+        char*              my_sescmd_value;      /*< value part of my_sescmd_sql */
+        SESSION*           my_sescmd_session;    /*< session the buffer is accounted to */
+        int                my_sescmd_mem;        /*< bytes accounted to the session */
 #if defined(SS_DEBUG)
         skygw_chk_t        my_sescmd_chk_tail;
 #endif
@@ -186,6 +244,20 @@ typedef struct backend_st {
 					      *  load. Expressed in .1%
 					      * increments
 					      */
+        int             be_response_time;    /*< Average response time in
+                                              *  microseconds, 0 until the
+                                              *  first reply
+                                              */
+        int             be_static_weight;    /*< The configured weight */
+        int             be_errors;           /*< Recent connection failures,
+                                              *  halved by each weight update
+                                              */
+        unsigned long   be_up_usec;          /*< When the server was seen
+                                              *  running, 0 if it's down
+                                              */
+        int             be_index;            /*< Index in the servers of the
+                                              *  router, for the counters
+                                              */
 #if defined(SS_DEBUG)
         skygw_chk_t     be_chk_tail;
 #endif
@@ -197,6 +269,33 @@ typedef struct backend_st {
  * 
  * Owned by router client session.
  */
+/**
+ * Where the reply to the oldest query of a backend is. The reply of a query
+ * of the text protocol is followed packet by packet so that it is known
+ * when the connection is idle and can be returned to the pool, and where
+ * the replies of pipelined queries start.
+ */
+typedef enum mpx_reply_state {
+        MPX_REPLY_IDLE = 0,   /*< no reply expected */
+        MPX_REPLY_FIRST,      /*< waiting for the first packet of a result */
+        MPX_REPLY_COLUMNS,    /*< column definitions up to the first EOF */
+        MPX_REPLY_ROWS,       /*< rows up to the EOF that ends the result set */
+        MPX_REPLY_INFILE,     /*< LOCAL INFILE, the server waits for the file */
+        MPX_REPLY_UNKNOWN     /*< the reply can't be followed */
+} mpx_reply_state_t;
+
+/** Bytes of a packet kept for the reply tracking, enough for an OK packet */
+#define MPX_PACKET_PREFIX 28
+
+/**
+ * A statement that waits for the replies of the earlier statements of a
+ * backend before it can be written to it, see bref_write.
+ */
+typedef struct bref_stmt_st {
+        GWBUF*               stmt_buf;  /*< the statement */
+        struct bref_stmt_st* stmt_next; /*< next statement of the backend */
+} bref_stmt_t;
+
 typedef struct backend_ref_st {
 #if defined(SS_DEBUG)
         skygw_chk_t     bref_chk_top;
@@ -206,6 +305,20 @@ typedef struct backend_ref_st {
         bref_state_t    bref_state;
         int             bref_num_result_wait;
         sescmd_cursor_t bref_sescmd_cur;
+        char            bref_causal_gtid[RWSPLIT_GTID_LEN]; /*< GTID the slave has reached */
+        GWBUF*          bref_causal_buf; /*< partial reply to a causal reads query */
+        GWBUF*          bref_pstmt_buf;  /*< partial reply to a lazy prepare */
+        unsigned long   bref_sent_usec;  /*< when the active query was sent */
+        mpx_reply_state_t bref_mpx_state; /*< state of the reply being read */
+        int             bref_mpx_nreplies; /*< query replies expected, pipelined too */
+        uint8_t         bref_mpx_pkt[MPX_PACKET_PREFIX]; /*< start of a packet */
+        int             bref_mpx_pktlen; /*< bytes in bref_mpx_pkt */
+        int             bref_mpx_skip;   /*< bytes of the packet left to skip */
+        int             bref_mpx_status; /*< status of the last reply, -1 if not known */
+        bref_stmt_t*    bref_held;       /*< statements waiting to be written */
+        GWBUF*          bref_batch;      /*< statements of a batch not written yet */
+        bool            bref_fragment;   /*< the payload written last continues */
+        bool            bref_sescmd_err_held; /*< its error to an unreplied session command is held */
 #if defined(SS_DEBUG)
         skygw_chk_t     bref_chk_tail;
 #endif
@@ -217,11 +330,38 @@ typedef struct rwsplit_config_st {
         int               rw_max_slave_conn_count;
         select_criteria_t rw_slave_select_criteria;
         int               rw_max_slave_replication_lag;
+        int               rw_backend_reply_timeout; /*< secs to wait for a reply, 0 for ever */
+        int               rw_causal_reads; /*< secs a slave may wait for the GTID, 0 if off */
+        int               rw_max_sescmd_history; /*< session commands kept, 0 for no limit */
+        bool              rw_multiplex; /*< connections are pooled between statements */
+        bool              rw_lazy_connect; /*< slaves are connected at the first read */
+        int               rw_retry_reads; /*< secs a failed read may be resent, 0 if off */
+        int               rw_max_slave_replication_lag_ms; /*< msecs a slave may be behind for a read, 0 if off */
+        int               rw_table_consistency; /*< slave server id of the table consistency listeners, 0 if off */
+        int               rw_adaptive_slaves; /*< secs a slave may idle before it is released, 0 if off */
+        int               rw_master_failover_wait; /*< secs writes wait for a new master, 0 if off */
+        bool              rw_dynamic_weights; /*< weights follow response times and failures */
+        int               rw_slow_start; /*< secs the weight of a started server ramps up */
+        bool              rw_local_reads; /*< simple variable reads are answered by the router */
+        bool              rw_skip_redundant_sescmd; /*< SETs of the current value are answered by the router */
+        int               rw_read_your_writes_window; /*< msecs reads go to master after a write, 0 if off */
+        bool              rw_statement_balance; /*< each read goes to the least busy connected slave */
 } rwsplit_config_t;
      
 
-#if defined(PREP_STMT_CACHING)
+/**
+ * A prepared statement in one backend
+ */
+typedef struct prep_stmt_backend_st {
+        uint32_t          pb_id;         /*< id in the backend, 0 if not prepared */
+        bool              pb_types_sent; /*< parameter types are sent to backend */
+} prep_stmt_backend_t;
 
+/**
+ * A prepared statement of the binary protocol. The client knows it by an
+ * id given by the router, and it is prepared in each backend when the
+ * first execution is routed there.
+ */
 typedef struct prep_stmt_st {
 #if defined(SS_DEBUG)
         skygw_chk_t       pstmt_chk_top;
@@ -229,16 +369,22 @@ typedef struct prep_stmt_st {
         union id {
                 int   seq;
                 char* name;
-        } pstmt_id;
+        } pstmt_id;                        /*< seq is the id of the client */
         prep_stmt_state_t pstmt_state;
         prep_stmt_type_t  pstmt_type;
+        GWBUF*            pstmt_buf;       /*< COM_STMT_PREPARE of the client */
+        bool              pstmt_is_read;   /*< statement is read-only */
+        bool              pstmt_long_data; /*< has COM_STMT_SEND_LONG_DATA */
+        int               pstmt_nparams;   /*< number of parameters */
+        uint8_t*          pstmt_types;     /*< last parameter types of client */
+        prep_stmt_backend_t* pstmt_backend; /*< one for each backend reference */
+        backend_ref_t*    pstmt_last_bref; /*< backend of the last execution */
+        struct prep_stmt_st* pstmt_next;
 #if defined(SS_DEBUG)
         skygw_chk_t       pstmt_chk_tail;
 #endif
 } prep_stmt_t;
 
-#endif /*< PREP_STMT_CACHING */
-
 /**
  * The client session structure used within this router.
  */
@@ -249,6 +395,8 @@ struct router_client_session {
         SPINLOCK         rses_lock;      /*< protects rses_deleted                 */
         int              rses_versno;    /*< even = no active update, else odd. not used 4/14 */
         bool             rses_closed;    /*< true when closeSession is called      */
+        int              rses_owner_thread; /*< polling thread of all the DCBs or -1 */
+        int              rses_lockfree_depth; /*< lock free actions of the owner */
 	/** Properties listed by their type */
 	rses_property_t* rses_properties[RSES_PROP_TYPE_COUNT];
         backend_ref_t*   rses_master_ref;
@@ -258,9 +406,35 @@ struct router_client_session {
         int              rses_capabilities; /*< input type, for example */
         bool             rses_autocommit_enabled;
         bool             rses_transaction_active;
-#if defined(PREP_STMT_CACHING)
-        HASHTABLE*       rses_prep_stmt[2];
-#endif
+        backend_ref_t*   rses_trx_slave; /*< slave of the read-only transaction */
+        char             rses_causal_gtid[RWSPLIT_GTID_LEN]; /*< GTID of the last write */
+        bool             rses_causal_unknown; /*< GTID of the last write couldn't be read */
+        GWBUF*           rses_causal_reply; /*< reply to the write held for its GTID */
+        GWBUF*           rses_causal_query; /*< read held while the slave waits */
+        bool             rses_sescmd_truncated; /*< history can't be replayed anymore */
+        HASHTABLE*       rses_prep_stmt; /*< prepared statements by client id */
+        prep_stmt_t*     rses_prep_stmt_list; /*< all prepared statements */
+        int              rses_prep_stmt_next_id; /*< next id given to client */
+        prep_stmt_t*     rses_pstmt_prepare; /*< statement waiting for its id */
+        GWBUF*           rses_pstmt_exec; /*< execution held for a lazy prepare */
+        int              rses_pstmt_exec_id; /*< client id of rses_pstmt_exec */
+        SESSION*         rses_session;   /*< the session of the client */
+        bool             rses_mpx_sticky; /*< multiplex: session keeps its connections */
+        bool             rses_slaves_pending; /*< lazy_connect: slaves not connected yet */
+        int              rses_slave_target; /*< adaptive_slaves: slaves the session needs */
+        GWBUF*           rses_retry_query; /*< read that may be resent, no reply yet */
+        backend_ref_t*   rses_retry_bref; /*< backend the read was routed to */
+        unsigned long    rses_retry_usec; /*< when the read was first routed */
+        bool             rses_batching;  /*< routeBatch collects the writes */
+        bool             rses_vars_changed; /*< local_reads: a session command was routed */
+        bool             rses_sescmd_state_lost; /*< variables changed outside the history */
+        unsigned long    rses_ryw_usec;  /*< when the last write completed its route, 0 if none */
+        bool             rses_ryw_trx_wrote; /*< the active transaction has written */
+        bool             rses_load_data; /*< the client sends a LOCAL INFILE */
+        unsigned long    rses_failover_usec; /*< when the master failed, 0 if it didn't */
+        bref_stmt_t*     rses_failover_held; /*< writes waiting for a new master */
+        int              rses_failover_nheld; /*< number of rses_failover_held */
+        TIMER            rses_failover_timer; /*< looks for the new master */
         struct router_client_session* next;
 #if defined(SS_DEBUG)
         skygw_chk_t      rses_chk_tail;
@@ -268,15 +442,83 @@ struct router_client_session {
 };
 
 /**
- * The statistics for this router instance
+ * True if the router session is locked, or in a lock free action of the
+ * thread it is pinned to
+ */
+#define RSES_IS_LOCKED(r) ((r)->rses_lockfree_depth > 0 || \
+                           SPINLOCK_IS_LOCKED(&(r)->rses_lock))
+
+/**
+ * The statistics for this router instance, counted per thread
+ */
+#define	RWSPLIT_N_SESSIONS	0	/*< Number sessions created        */
+#define	RWSPLIT_N_QUERIES	1	/*< Number of queries forwarded    */
+#define	RWSPLIT_N_MASTER	2	/*< Number of stmts sent to master */
+#define	RWSPLIT_N_SLAVE		3	/*< Number of stmts sent to slave  */
+#define	RWSPLIT_N_ALL		4	/*< Number of stmts sent to all    */
+#define	RWSPLIT_N_CAUSAL_WAIT	5	/*< Number of causal waits on slaves */
+#define	RWSPLIT_N_CAUSAL_MASTER	6	/*< Number of reads moved to master */
+#define	RWSPLIT_N_SESCMD_COMPACTED 7	/*< Number of sescmds removed from history */
+#define	RWSPLIT_N_PSTMT_SLAVE	8	/*< Number of stmt executions on slaves */
+#define	RWSPLIT_N_PSTMT_PREPARE	9	/*< Number of lazy prepares in backends */
+#define	RWSPLIT_N_MPX_RELEASED	10	/*< Number of connections returned to pool */
+#define	RWSPLIT_N_MPX_ACQUIRED	11	/*< Number of connections taken again */
+#define	RWSPLIT_N_READ_RETRY	12	/*< Number of failed reads resent */
+#define	RWSPLIT_N_HINTED	13	/*< Number of stmts routed by a hint */
+#define	RWSPLIT_N_BATCHES	14	/*< Number of batches of stmts routed */
+#define	RWSPLIT_N_TBR_SLAVE	15	/*< Number of reads to table consistent slaves */
+#define	RWSPLIT_N_RO_TRX	16	/*< Number of read-only trxs on slaves */
+#define	RWSPLIT_N_SLAVE_GROWN	17	/*< Number of slaves added for queued reads */
+#define	RWSPLIT_N_SLAVE_RELEASED 18	/*< Number of idle slaves released */
+#define	RWSPLIT_N_FAILOVER_HELD	19	/*< Number of writes held for a new master */
+#define	RWSPLIT_N_LOCAL_READ	20	/*< Number of stmts answered by the router */
+#define	RWSPLIT_N_SESCMD_SKIPPED 21	/*< Number of SETs of the current value */
+#define	RWSPLIT_N_RYW_MASTER	22	/*< Number of reads sent to master after a write */
+#define	RWSPLIT_N_STATS		23
+
+/**
+ * The reasons of the routing decisions, counted per thread for the router
+ * and for each server
+ */
+#define	RWSPLIT_R_READ		0	/*< Read to a slave                */
+#define	RWSPLIT_R_TRX_SLAVE	1	/*< Read-only transaction on a slave */
+#define	RWSPLIT_R_HINT		2	/*< Routed by a hint               */
+#define	RWSPLIT_R_SESCMD	3	/*< Session command to all         */
+#define	RWSPLIT_R_LOCAL		4	/*< Answered by the router         */
+#define	RWSPLIT_R_WRITE		5	/*< Write to the master            */
+#define	RWSPLIT_R_TRX		6	/*< In a transaction on the master */
+#define	RWSPLIT_R_UNKNOWN	7	/*< Type not known, to the master  */
+#define	RWSPLIT_R_CAUSAL	8	/*< Read to the master for causality */
+#define	RWSPLIT_R_LAG		9	/*< Read to the master, slaves lag */
+#define	RWSPLIT_R_NO_SLAVE	10	/*< Read to the master, no slave   */
+#define	RWSPLIT_R_PSTMT		11	/*< Prepared statement execution   */
+#define	RWSPLIT_R_N		12
+
+/**
+ * The classes of the statements, counted per thread after the reasons
  */
-typedef struct {
-	int		n_sessions;	/*< Number sessions created        */
-	int		n_queries;	/*< Number of queries forwarded    */
-	int		n_master;	/*< Number of stmts sent to master */
-	int		n_slave;	/*< Number of stmts sent to slave  */
-	int		n_all;		/*< Number of stmts sent to all    */
-} ROUTER_STATS;
+#define	RWSPLIT_QT_READ		0
+#define	RWSPLIT_QT_WRITE	1
+#define	RWSPLIT_QT_SESSION	2	/*< Session writes, SET and USE    */
+#define	RWSPLIT_QT_TRX		3	/*< BEGIN, COMMIT and ROLLBACK     */
+#define	RWSPLIT_QT_PSTMT	4	/*< Prepared statements            */
+#define	RWSPLIT_QT_UNKNOWN	5
+#define	RWSPLIT_QT_N		6
+
+/** The counter of a reason in the routing statistics */
+#define	RWSPLIT_ROUTE_REASON(r)		(r)
+/** The counter of a class of the statements */
+#define	RWSPLIT_ROUTE_QTYPE(q)		(RWSPLIT_R_N + (q))
+/** The counter of a reason for the server of index i */
+#define	RWSPLIT_ROUTE_SERVER(i, r)	(RWSPLIT_R_N + RWSPLIT_QT_N + \
+					 (i) * RWSPLIT_R_N + (r))
+
+/** Library of the table consistency listeners */
+#define RWSPLIT_TBR_LIBRARY	"libtable_replication_consistency.so"
+/** Most servers followed by the table consistency listeners */
+#define RWSPLIT_TBR_MAX_SERVERS	64
+/** Most tables of a read routed by table consistency */
+#define RWSPLIT_TBR_MAX_TABLES	8
 
 
 /**
@@ -292,7 +534,12 @@ typedef struct router_instance {
 	int                     rwsplit_version;/*< version number for router's config */
         unsigned int	        bitmask;     /*< Bitmask to apply to server->status */
 	unsigned int	        bitvalue;    /*< Required value of server->status   */
-	ROUTER_STATS            stats;       /*< Statistics for this router         */
+	TS_STATS*               stats;       /*< Statistics for this router         */
+	TS_STATS*               route_stats; /*< Routing decisions, by reason,
+                                              *  by statement class and by
+                                              *  server and reason          */
+	int                     n_servers;   /*< Number of the servers           */
+        unsigned long           weights_usec; /*< when the dynamic weights were computed */
         struct router_instance* next;        /*< Next router on the list            */
 } ROUTER_INSTANCE;
 
@@ -0,0 +1,137 @@
+#ifndef _SCHEMAROUTER_H
+#define _SCHEMAROUTER_H
+/*
+ * This file is distributed as part of SkySQL MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file schemarouter.h - The schema sharding router header file
+ */
+#include <dcb.h>
+#include <hashtable.h>
+#include <mysql_client_server_protocol.h>
+
+#define	SCHEMA_MAX_SESCMD	64	/*< Session commands kept for the
+					 * connections opened later */
+#define	SCHEMA_MAP_SIZE		1024	/*< Hash slots of the database map */
+
+#define	SCHEMA_MERGE_DATABASES	1	/*< Merge the rows without duplicates */
+#define	SCHEMA_MERGE_ROWS	2	/*< Concatenate the rows */
+
+/**
+ * How the result sets of the shards are merged into the one sent to the
+ * client. The rows are in the order of the shards unless the statement
+ * orders them, each shard has applied the ORDER BY and the LIMIT of the
+ * statement to its own rows.
+ */
+typedef struct schema_merge {
+	int		mode;		/*< SCHEMA_MERGE_DATABASES or ROWS */
+	int		column;		/*< Index of the ORDER BY column, -1 if
+					 * the rows are not ordered */
+	char		colname[MYSQL_DATABASE_MAXLEN+1];
+					/*< The ORDER BY column when it is given
+					 * by name, resolved in the reply */
+	bool		desc;		/*< The order is descending */
+	long		limit;		/*< The LIMIT of the rows, -1 for none */
+} SCHEMA_MERGE;
+
+/**
+ * A shard, a group of backend servers that hold the same databases. The
+ * connections to the shard go to the first running server of the group.
+ */
+typedef struct shard {
+	char		*name;		/*< The servers of the group, as configured */
+	int		index;		/*< Index of the shard in the instance */
+	SERVER		**servers;	/*< The servers in order of preference */
+	int		n_servers;	/*< Number of the servers */
+	int		n_databases;	/*< Databases mapped to the shard */
+} SHARD;
+
+/**
+ * The connection of a session to a shard, opened when a statement of the
+ * session is first routed to the shard.
+ */
+typedef struct shard_conn {
+	DCB		*dcb;		/*< The connection, NULL until it is used */
+	int		n_ignore;	/*< Replies to the commands of the router,
+					 * not sent to the client, still to come */
+	int		n_sescmd;	/*< Session commands sent on the connection */
+	bool		merging;	/*< The reply is merged with those of
+					 * the other shards */
+	GWBUF		*reply;		/*< Reply data kept until it is complete */
+	char		db[MYSQL_DATABASE_MAXLEN+1];
+					/*< The default database of the connection */
+} SHARD_CONN;
+
+/**
+ * The client session structure used within this router.
+ */
+typedef struct router_client_session {
+#if defined(SS_DEBUG)
+        skygw_chk_t     rses_chk_top;
+#endif
+        SPINLOCK        rses_lock;	/*< protects rses_closed and the DCBs */
+        bool            rses_closed;	/*< true when closeSession is called */
+	SESSION		*rses_session;	/*< The session */
+	SHARD_CONN	*rses_conns;	/*< The connections, by shard */
+	int		rses_shard;	/*< The shard of the current database */
+	int		rses_active;	/*< The shard of the last statement routed */
+	int		rses_n_merging;	/*< Shards whose reply is still to be merged */
+	SCHEMA_MERGE	rses_merge;	/*< How the replies are merged */
+	char		rses_db[MYSQL_DATABASE_MAXLEN+1];
+					/*< The current database of the client */
+	GWBUF		*rses_sescmd[SCHEMA_MAX_SESCMD];
+					/*< The session commands, sent to the
+					 * connections opened later */
+	int		rses_n_sescmd;	/*< Number of the session commands */
+	struct router_client_session *next;
+#if defined(SS_DEBUG)
+        skygw_chk_t     rses_chk_tail;
+#endif
+} ROUTER_CLIENT_SES;
+
+/**
+ * The statistics for this router instance
+ */
+typedef struct {
+	int		n_sessions;	/*< Number sessions created */
+	int		n_queries;	/*< Number of queries forwarded */
+	int		n_switches;	/*< Changes of the current shard */
+	int		n_table_routed;	/*< Statements routed by their tables */
+	int		n_merged;	/*< SHOW DATABASES merged from the shards */
+	int		n_fanout;	/*< SELECTs sent to a set of shards */
+	int		n_cross;	/*< Statements refused, their tables are
+					 * in more than one shard */
+} ROUTER_STATS;
+
+/**
+ * The per instance data for the router.
+ */
+typedef struct router_instance {
+	SERVICE		  *service;	/*< Pointer to the service using this router */
+	ROUTER_CLIENT_SES *connections;	/*< Link list of all the client connections */
+	SPINLOCK	  lock;		/*< Spinlock for the instance data */
+	SHARD		  **shards;	/*< The shards */
+	int		  n_shards;	/*< Number of the shards */
+	int		  default_shard; /*< Shard of the databases not mapped */
+	HASHTABLE	  *map;		/*< The shard of each mapped database */
+	ROUTER_STATS	  stats;	/*< Statistics for this router */
+	struct router_instance
+			  *next;
+} ROUTER_INSTANCE;
+
+#endif
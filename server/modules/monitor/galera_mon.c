@@ -51,6 +51,7 @@
 extern int lm_enabled_logfiles_bitmask;
 
 static	void	monitorMain(void *);
+static	void	monitorFlowControl(MONITOR_SERVERS *);
 
 static char *version_str = "V1.2.0";
 
@@ -174,6 +175,10 @@ MONITOR_SERVERS	*ptr, *db;
 	db->server = server;
 	db->con = NULL;
 	db->next = NULL;
+	db->fc_sent = 0;
+	db->fc_paused_ns = 0;
+	db->probed.tv_sec = 0;
+	db->probed.tv_usec = 0;
 	spinlock_acquire(&handle->lock);
 	if (handle->databases == NULL)
 		handle->databases = db;
@@ -386,12 +391,85 @@ char 			*server_string;
 		mysql_free_result(result);
 	}
 
+	monitorFlowControl(database);
+
 	if (isjoined)
 		server_set_status(database->server, SERVER_JOINED);
 	else
 		server_clear_status(database->server, SERVER_JOINED);
 }
 
+/**
+ * Collect the flow control metrics of a Galera node. The queues are the
+ * current lengths, the pauses are the flow control messages the node sent
+ * and the share of the time the cluster was paused since the last probe.
+ * The wsrep_flow_control_paused_ns counter is only in newer Galera
+ * versions, otherwise wsrep_flow_control_paused is used as it is.
+ *
+ * @param database	The database that was probed
+ */
+static void
+monitorFlowControl(MONITOR_SERVERS *database)
+{
+MYSQL_ROW		row;
+MYSQL_RES		*result;
+struct timeval		now;
+unsigned long		sent = database->fc_sent;
+unsigned long long	paused_ns = 0;
+long long		elapsed_us = 0;
+int			recv_queue = 0, send_queue = 0, paused = 0;
+int			have_ns = 0;
+
+	if (mysql_query(database->con, "SHOW STATUS WHERE Variable_name IN "
+			"('wsrep_local_recv_queue', 'wsrep_local_send_queue', "
+			"'wsrep_flow_control_sent', 'wsrep_flow_control_paused', "
+			"'wsrep_flow_control_paused_ns')") != 0
+		|| (result = mysql_store_result(database->con)) == NULL)
+		return;
+	while ((row = mysql_fetch_row(result)))
+	{
+		if (row[0] == NULL || row[1] == NULL)
+			continue;
+		if (strcasecmp(row[0], "wsrep_local_recv_queue") == 0)
+			recv_queue = atoi(row[1]);
+		else if (strcasecmp(row[0], "wsrep_local_send_queue") == 0)
+			send_queue = atoi(row[1]);
+		else if (strcasecmp(row[0], "wsrep_flow_control_sent") == 0)
+			sent = strtoul(row[1], NULL, 10);
+		else if (strcasecmp(row[0], "wsrep_flow_control_paused_ns") == 0)
+		{
+			paused_ns = strtoull(row[1], NULL, 10);
+			have_ns = 1;
+		}
+		else if (strcasecmp(row[0], "wsrep_flow_control_paused") == 0 &&
+				!have_ns)
+			paused = (int)(atof(row[1]) * 1000);
+	}
+	mysql_free_result(result);
+
+	gettimeofday(&now, NULL);
+	if (database->probed.tv_sec)
+		elapsed_us = (now.tv_sec - database->probed.tv_sec) * 1000000LL
+				+ (now.tv_usec - database->probed.tv_usec);
+	if (have_ns)
+	{
+		paused = 0;
+		if (elapsed_us > 0 && paused_ns >= database->fc_paused_ns)
+			paused = (int)((paused_ns - database->fc_paused_ns) /
+							elapsed_us);
+		if (paused > 1000)
+			paused = 1000;
+		database->fc_paused_ns = paused_ns;
+	}
+
+	/* A counter that went back is a restart of the node */
+	server_update_flow_control(database->server, recv_queue, send_queue,
+			paused, database->probed.tv_sec && sent >= database->fc_sent
+				? (int)(sent - database->fc_sent) : 0);
+	database->fc_sent = sent;
+	database->probed = now;
+}
+
 /**
  * The entry point for the monitoring module thread
  *
@@ -57,10 +57,12 @@
 #include <secrets.h>
 #include <dcb.h>
 #include <modinfo.h>
+#include <localread.h>
 
 extern int lm_enabled_logfiles_bitmask;
 
 static	void	monitorMain(void *);
+static	void	monitorProbe(void *);
 
 static char *version_str = "V1.2.0";
 
@@ -80,6 +82,8 @@ static	void	diagnostics(DCB *, void *);
 static  void    setInterval(void *, unsigned long);
 static  void    defaultId(void *, unsigned long);
 static	void	replicationHeartbeat(void *, int);
+static	void	setHeartbeatInterval(void *, unsigned long);
+static	void	setProbeInterval(void *, unsigned long);
 static  bool    mon_status_changed(MONITOR_SERVERS* mon_srv);
 static  bool    mon_print_fail_status(MONITOR_SERVERS* mon_srv);
 static	MONITOR_SERVERS   *getServerByNodeId(MONITOR_SERVERS *, long);
@@ -87,11 +91,19 @@ static	MONITOR_SERVERS   *getSlaveOfNodeId(MONITOR_SERVERS *, long);
 static MONITOR_SERVERS *get_replication_tree(MYSQL_MONITOR *, int);
 static void set_master_heartbeat(MYSQL_MONITOR *, MONITOR_SERVERS *);
 static void set_slave_heartbeat(MYSQL_MONITOR *, MONITOR_SERVERS *);
+static void set_master_heartbeat_us(MYSQL_MONITOR *, MONITOR_SERVERS *);
+static void set_slave_heartbeat_us(MYSQL_MONITOR *, MONITOR_SERVERS *);
+static void monitor_heartbeat(MYSQL_MONITOR *, MONITOR_SERVERS *);
+static void monitor_wait(MYSQL_MONITOR *, MONITOR_SERVERS *);
 static int add_slave_to_master(long *, int, long);
 static void monitor_set_pending_status(MONITOR_SERVERS *, int);
 static void monitor_clear_pending_status(MONITOR_SERVERS *, int);
+static void monitor_probe_servers(MYSQL_MONITOR *, int);
+static void monitor_probe_server(MYSQL_MONITOR *, MONITOR_SERVERS *, int);
+static void monitorPing(MYSQL_MONITOR *, MONITOR_SERVERS *);
+static void monitor_probe_stop(MYSQL_MONITOR *);
 
-static MONITOR_OBJECT MyObject = { startMonitor, stopMonitor, registerServer, unregisterServer, defaultUser, diagnostics, setInterval, defaultId, replicationHeartbeat };
+static MONITOR_OBJECT MyObject = { startMonitor, stopMonitor, registerServer, unregisterServer, defaultUser, diagnostics, setInterval, defaultId, replicationHeartbeat, setHeartbeatInterval, setProbeInterval };
 
 /**
  * Implementation of the mandatory version entry point
@@ -160,8 +172,19 @@ MYSQL_MONITOR *handle;
             handle->id = MONITOR_DEFAULT_ID;
             handle->interval = MONITOR_INTERVAL;
             handle->replicationHeartbeat = 0;
+            handle->heartbeat_interval = 0;
+            handle->probe_interval = 0;
+            handle->n_ping_failed = 0;
             handle->master = NULL;
             spinlock_init(&handle->lock);
+            pthread_mutex_init(&handle->probe_lock, NULL);
+            pthread_cond_init(&handle->probe_start, NULL);
+            pthread_cond_init(&handle->probe_done, NULL);
+            handle->probe_next = NULL;
+            handle->probe_running = 0;
+            handle->probe_pass = 0;
+            handle->probe_ping = 0;
+            handle->n_probes = 0;
         }
         handle->tid = (THREAD)thread_start(monitorMain, handle);
         return handle;
@@ -306,6 +329,14 @@ char		*sep;
 	dcb_printf(dcb,"\tSampling interval:\t%lu milliseconds\n", handle->interval);
 	dcb_printf(dcb,"\tMaxScale MonitorId:\t%lu\n", handle->id);
 	dcb_printf(dcb,"\tReplication lag:\t%s\n", (handle->replicationHeartbeat == 1) ? "enabled" : "disabled");
+	if (handle->replicationHeartbeat == 1 && handle->heartbeat_interval > 0)
+		dcb_printf(dcb,"\tHeartbeat interval:\t%lu milliseconds\n", handle->heartbeat_interval);
+	if (handle->probe_interval > 0)
+	{
+		dcb_printf(dcb,"\tProbe interval:\t\t%lu milliseconds\n", handle->probe_interval);
+		dcb_printf(dcb,"\tServers set down by the probes:\t%d\n", handle->n_ping_failed);
+	}
+	dcb_printf(dcb,"\tProbe threads:\t\t%d\n", handle->n_probes);
 	dcb_printf(dcb, "\tMonitored servers:	");
 
 	db = handle->databases;
@@ -324,7 +355,71 @@ char		*sep;
 }
 
 /**
- * Monitor an individual server
+ * Return the statements that probe a server, sent as one request so that
+ * a probe is one round trip. The results are the server_id, the slave
+ * status, of all the slaves for MariaDB 10, and the server variables
+ * that the routers may answer.
+ *
+ * @param con		The connection to the server
+ * @param buf		Filled with the statements
+ * @param len		The size of buf
+ * @return		The statements of the probe
+ */
+static char *
+monitor_probe_query(MYSQL *con, char *buf, int len)
+{
+	snprintf(buf, len, "SELECT @@server_id; %s; %s",
+		mysql_get_server_version(con) >= 100000 ?
+			"SHOW ALL SLAVES STATUS" : "SHOW SLAVE STATUS",
+		localread_variables_query());
+	return buf;
+}
+
+/**
+ * Give the variables of a result of the probe to the server
+ *
+ * @param server	The server
+ * @param result	The rows of the variable names and values
+ */
+static void
+monitor_set_variables(SERVER *server, MYSQL_RES *result)
+{
+MYSQL_ROW	row;
+SERVER_PARAM	*vars = NULL, *var;
+
+	if (mysql_num_fields(result) < 2)
+		return;
+	while ((row = mysql_fetch_row(result)))
+	{
+		if (row[0] == NULL || row[1] == NULL)
+			continue;
+		if ((var = (SERVER_PARAM *)malloc(sizeof(SERVER_PARAM))) == NULL)
+			break;
+		var->name = strdup(row[0]);
+		var->value = strdup(row[1]);
+		var->next = vars;
+		vars = var;
+		if (var->name == NULL || var->value == NULL)
+			break;
+	}
+	if (vars && (vars->name == NULL || vars->value == NULL))
+	{
+		/*< Out of memory, the variables last read are kept */
+		while ((var = vars) != NULL)
+		{
+			vars = var->next;
+			free(var->name);
+			free(var->value);
+			free(var);
+		}
+		return;
+	}
+	server_set_variables(server, vars);
+}
+
+/**
+ * Monitor an individual server. The server_id and the slave status are
+ * read by a single multi-statement request.
  *
  * @param handle        The MySQL Monitor object
  * @param database	The database to probe
@@ -337,9 +432,11 @@ MYSQL_RES	  *result;
 int		  num_fields;
 int               isslave = 0;
 char		  *uname  = handle->defaultUser; 
+char		  query[1024];
 char              *passwd = handle->defaultPasswd;
 unsigned long int server_version = 0;
 char 		  *server_string;
+int		  probed;
 
         if (database->server->monuser != NULL)
 	{
@@ -357,15 +454,31 @@ char 		  *server_string;
         /** Store prevous status */
         database->mon_prev_status = database->server->status;
         
-	if (database->con == NULL || mysql_ping(database->con) != 0)
+	/*
+	 * The probe is one request of several statements, a failure of an
+	 * open connection to run it is taken as a lost connection, as a
+	 * failed ping was before.
+	 */
+	probed = (database->con != NULL &&
+		mysql_query(database->con, monitor_probe_query(database->con,
+						query, sizeof(query))) == 0);
+
+	if (!probed)
 	{
 		char *dpwd = decryptPassword(passwd);
                 int  rc;
-                int  read_timeout = 1;
+                int  connect_timeout = MONITOR_CONNECT_TIMEOUT;
+                int  read_timeout = MONITOR_READ_TIMEOUT;
+                int  write_timeout = MONITOR_WRITE_TIMEOUT;
 
+                if (database->con)
+                        mysql_close(database->con);
                 database->con = mysql_init(NULL);
 
+                /* A server that does not answer only holds up its own probe */
+                rc = mysql_options(database->con, MYSQL_OPT_CONNECT_TIMEOUT, (void *)&connect_timeout);
                 rc = mysql_options(database->con, MYSQL_OPT_READ_TIMEOUT, (void *)&read_timeout);
+                rc = mysql_options(database->con, MYSQL_OPT_WRITE_TIMEOUT, (void *)&write_timeout);
                 
 		if (mysql_real_connect(database->con,
                                        database->server->name,
@@ -374,7 +487,7 @@ char 		  *server_string;
                                        NULL,
                                        database->server->port,
                                        NULL,
-                                       0) == NULL)
+                                       CLIENT_MULTI_STATEMENTS) == NULL)
 		{
                         free(dpwd);
                         
@@ -406,6 +519,9 @@ char 		  *server_string;
 			return;
 		}
 		free(dpwd);
+
+		probed = (mysql_query(database->con, monitor_probe_query(database->con,
+						query, sizeof(query))) == 0);
 	}
         /* Store current status in both server and monitor server pending struct */
 	server_set_status(database->server, SERVER_RUNNING);
@@ -420,9 +536,18 @@ char 		  *server_string;
 		database->server->server_string = strdup(server_string);
 	}
 
-        /* get server_id form current node */
-        if (mysql_query(database->con, "SELECT @@server_id") == 0
-                && (result = mysql_store_result(database->con)) != NULL)
+	if (!probed)
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : Monitor was unable to probe server %s:%d : \"%s\"",
+			database->server->name,
+			database->server->port,
+			mysql_error(database->con))));
+	}
+
+        /* get server_id form current node, the first result of the probe */
+        if (probed && (result = mysql_store_result(database->con)) != NULL)
         {
                 long server_id = -1;
                 num_fields = mysql_num_fields(result);
@@ -440,15 +565,13 @@ char 		  *server_string;
         }
 
 	/* Check if the Slave_SQL_Running and Slave_IO_Running status is
-	 * set to Yes
+	 * set to Yes, the slave status is the second result of the probe
 	 */
-
-	/* Check first for MariaDB 10.x.x and get status for multimaster replication */
-	if (server_version >= 100000) {
-
-		if (mysql_query(database->con, "SHOW ALL SLAVES STATUS") == 0
-			&& (result = mysql_store_result(database->con)) != NULL)
-		{
+	if (probed && mysql_next_result(database->con) == 0
+		&& (result = mysql_store_result(database->con)) != NULL)
+	{
+		/* MariaDB 10.x.x gives the status of multimaster replication */
+		if (server_version >= 100000) {
 			int i = 0;
 			long master_id = -1;
 			num_fields = mysql_num_fields(result);
@@ -469,18 +592,12 @@ char 		  *server_string;
 			/* store master_id of current node */
 			memcpy(&database->server->master_id, &master_id, sizeof(long));
 
-			mysql_free_result(result);
-
 			/* If all configured slaves are running set this node as slave */
 			if (isslave > 0 && isslave == i)
 				isslave = 1;
 			else
 				isslave = 0;
-		}
-	} else {	
-		if (mysql_query(database->con, "SHOW SLAVE STATUS") == 0
-			&& (result = mysql_store_result(database->con)) != NULL)
-		{
+		} else {
 			long master_id = -1;
 			num_fields = mysql_num_fields(result);
 			while ((row = mysql_fetch_row(result)))
@@ -498,8 +615,25 @@ char 		  *server_string;
 			}
 			/* store master_id of current node */
 			memcpy(&database->server->master_id, &master_id, sizeof(long));
+		}
+		mysql_free_result(result);
+	}
 
-			mysql_free_result(result);
+	/* The server variables are the third result of the probe */
+	if (probed && mysql_next_result(database->con) == 0
+		&& (result = mysql_store_result(database->con)) != NULL)
+	{
+		monitor_set_variables(database->server, result);
+		mysql_free_result(result);
+	}
+
+	/* Read what is left of the probe so that the connection can be used again */
+	if (probed)
+	{
+		while (mysql_next_result(database->con) == 0)
+		{
+			if ((result = mysql_store_result(database->con)) != NULL)
+				mysql_free_result(result);
 		}
 	}
 
@@ -551,6 +685,7 @@ MONITOR_SERVERS *root_master;
 		if (handle->shutdown)
 		{
 			handle->status = MONITOR_STOPPING;
+			monitor_probe_stop(handle);
 			mysql_thread_end();
 			handle->status = MONITOR_STOPPED;
 			return;
@@ -558,17 +693,22 @@ MONITOR_SERVERS *root_master;
 		/* reset num_servers */
 		num_servers = 0;
 
-		/* start from the first server in the list */
+		/* copy server status into monitor pending_status */
 		ptr = handle->databases;
-
 		while (ptr)
 		{
-			/* copy server status into monitor pending_status */
 			ptr->pending_status = ptr->server->status;
+			ptr = ptr->next;
+		}
+
+		/* monitor all the nodes, the probes run in parallel */
+		monitor_probe_servers(handle, 0);
 
-			/* monitor current node */
-			monitorDatabase(handle, ptr);
+		/* start from the first server in the list */
+		ptr = handle->databases;
 
+		while (ptr)
+		{
 			/* reset the slave list of current node */
 			if (ptr->server->slaves) {
 				free(ptr->server->slaves);
@@ -616,7 +756,7 @@ MONITOR_SERVERS *root_master;
 		while (ptr)
 		{
 			if (! SERVER_IN_MAINT(ptr->server)) {
-                        	ptr->server->status = ptr->pending_status;
+                        	server_update_status(ptr->server, ptr->pending_status);
 			}
                         ptr = ptr->next;
                 }
@@ -637,10 +777,188 @@ MONITOR_SERVERS *root_master;
                 }
 
 		/* wait for the configured interval */
-		thread_millisleep(handle->interval);
+		monitor_wait(handle, root_master);
 	}
 }
                         
+/**
+ * The liveness probe of a server, a ping over the monitor connection. A
+ * server that is running and does not answer is set down at once, the
+ * routers then stop using it without waiting for the next monitoring pass.
+ * The connection is closed and the next pass connects again, which is
+ * also what finds the servers that have come back up.
+ *
+ * @param handle	The MySQL Monitor object
+ * @param database	The server to ping
+ */
+static void
+monitorPing(MYSQL_MONITOR *handle, MONITOR_SERVERS *database)
+{
+unsigned int	status;
+
+	if (database->con == NULL || !SERVER_IS_RUNNING(database->server))
+		return;
+	if (mysql_ping(database->con) == 0)
+		return;
+
+	LOGIF(LE, (skygw_log_write_flush(
+		LOGFILE_ERROR,
+		"Error : Monitor ping of server %s:%d failed : \"%s\"",
+		database->server->name,
+		database->server->port,
+		mysql_error(database->con))));
+	mysql_close(database->con);
+	database->con = NULL;
+
+	database->mon_prev_status = database->server->status;
+	status = database->server->status &
+			~(SERVER_RUNNING|SERVER_MASTER|SERVER_SLAVE);
+	server_update_status(database->server, status);
+	atomic_add(&handle->n_ping_failed, 1);
+	dcb_call_foreach(DCB_REASON_NOT_RESPONDING);
+	LOGIF(LM, (skygw_log_write_flush(
+		LOGFILE_MESSAGE,
+		"Backend server %s:%d state : %s",
+		database->server->name,
+		database->server->port,
+		STRSRVSTATUS(database->server))));
+}
+
+/**
+ * Run the full probe or the liveness probe of a server
+ *
+ * @param handle	The MySQL Monitor object
+ * @param database	The server to probe
+ * @param ping		Non-zero for the liveness probe
+ */
+static void
+monitor_probe_server(MYSQL_MONITOR *handle, MONITOR_SERVERS *database, int ping)
+{
+	if (ping)
+		monitorPing(handle, database);
+	else
+		monitorDatabase(handle, database);
+}
+
+/**
+ * Probe all the monitored servers. The servers are taken one at a time from
+ * the list by the monitor thread and the probe threads, so that a server
+ * that is slow to answer only holds up its own probe. Probe threads are
+ * started as needed, one fewer than the servers up to MONITOR_MAX_PROBES.
+ * Returns when all of the probes of the pass are done.
+ *
+ * @param handle	The MySQL Monitor object
+ * @param ping		Non-zero for a pass of liveness probes
+ */
+static void
+monitor_probe_servers(MYSQL_MONITOR *handle, int ping)
+{
+MONITOR_SERVERS	*ptr;
+int		n_servers = 0;
+
+	for (ptr = handle->databases; ptr; ptr = ptr->next)
+		n_servers++;
+	while (handle->n_probes < n_servers - 1 &&
+		handle->n_probes < MONITOR_MAX_PROBES - 1)
+	{
+		handle->probes[handle->n_probes] =
+				(THREAD)thread_start(monitorProbe, handle);
+		handle->n_probes++;
+	}
+
+	pthread_mutex_lock(&handle->probe_lock);
+	handle->probe_next = handle->databases;
+	handle->probe_ping = ping;
+	handle->probe_pass++;
+	pthread_cond_broadcast(&handle->probe_start);
+	while ((ptr = handle->probe_next) != NULL || handle->probe_running)
+	{
+		if (ptr == NULL)
+		{
+			pthread_cond_wait(&handle->probe_done, &handle->probe_lock);
+			continue;
+		}
+		handle->probe_next = ptr->next;
+		handle->probe_running++;
+		pthread_mutex_unlock(&handle->probe_lock);
+
+		monitor_probe_server(handle, ptr, ping);
+
+		pthread_mutex_lock(&handle->probe_lock);
+		handle->probe_running--;
+	}
+	pthread_mutex_unlock(&handle->probe_lock);
+}
+
+/**
+ * The entry point of a probe thread. The thread waits for a pass to start
+ * and probes servers of the pass until there are none left.
+ *
+ * @param arg	The handle of the monitor
+ */
+static void
+monitorProbe(void *arg)
+{
+MYSQL_MONITOR	*handle = (MYSQL_MONITOR *)arg;
+MONITOR_SERVERS	*ptr;
+int		pass;
+int		ping;
+
+	if (mysql_thread_init())
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+                                   LOGFILE_ERROR,
+                                   "Error : mysql_thread_init failed in "
+                                   "monitor probe thread, the servers are "
+                                   "probed by the other threads.\n")));
+		return;
+	}
+	pthread_mutex_lock(&handle->probe_lock);
+	pass = handle->probe_pass;
+	while (1)
+	{
+		while (!handle->shutdown && handle->probe_pass == pass)
+			pthread_cond_wait(&handle->probe_start, &handle->probe_lock);
+		if (handle->shutdown)
+			break;
+		pass = handle->probe_pass;
+		ping = handle->probe_ping;
+		while ((ptr = handle->probe_next) != NULL)
+		{
+			handle->probe_next = ptr->next;
+			handle->probe_running++;
+			pthread_mutex_unlock(&handle->probe_lock);
+
+			monitor_probe_server(handle, ptr, ping);
+
+			pthread_mutex_lock(&handle->probe_lock);
+			if (--handle->probe_running == 0 &&
+					handle->probe_next == NULL)
+				pthread_cond_signal(&handle->probe_done);
+		}
+	}
+	pthread_mutex_unlock(&handle->probe_lock);
+	mysql_thread_end();
+}
+
+/**
+ * Stop the probe threads of the monitor.
+ *
+ * @param handle	The MySQL Monitor object
+ */
+static void
+monitor_probe_stop(MYSQL_MONITOR *handle)
+{
+int	i;
+
+	pthread_mutex_lock(&handle->probe_lock);
+	pthread_cond_broadcast(&handle->probe_start);
+	pthread_mutex_unlock(&handle->probe_lock);
+	for (i = 0; i < handle->n_probes; i++)
+		thread_wait((void *)handle->probes[i]);
+	handle->n_probes = 0;
+}
+
 /**
  * Set the default id to use in the monitor.
  *
@@ -667,6 +985,34 @@ MYSQL_MONITOR   *handle = (MYSQL_MONITOR *)arg;
 	memcpy(&handle->interval, &interval, sizeof(unsigned long));
 	}
 
+/**
+ * Set the interval of the high resolution replication heartbeat, that runs
+ * between the monitoring passes.
+ *
+ * @param arg           The handle allocated by startMonitor
+ * @param interval      The heartbeat interval in milliseconds, 0 for none
+ */
+static void
+setHeartbeatInterval(void *arg, unsigned long interval)
+{
+MYSQL_MONITOR   *handle = (MYSQL_MONITOR *)arg;
+	handle->heartbeat_interval = interval;
+}
+
+/**
+ * Set the interval of the liveness probe, the ping of the servers that runs
+ * between the monitoring passes.
+ *
+ * @param arg           The handle allocated by startMonitor
+ * @param interval      The probe interval in milliseconds, 0 for none
+ */
+static void
+setProbeInterval(void *arg, unsigned long interval)
+{
+MYSQL_MONITOR   *handle = (MYSQL_MONITOR *)arg;
+	handle->probe_interval = interval;
+}
+
 /**
  * Enable/Disable the MySQL Replication hearbeat, detecting slave lag behind master.
  *
@@ -780,7 +1126,7 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
 			"[mysql_mon]: Error creating maxscale_schema database in Master server"
 			": %s", mysql_error(database->con))));
 
-			database->server->rlag = -1;
+			server_update_lag(database->server, -1);
 	}
 
 	/* create repl_heartbeat table in maxscale_schema database */
@@ -796,7 +1142,7 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
 			"[mysql_mon]: Error creating maxscale_schema.replication_heartbeat table in Master server"
 			": %s", mysql_error(database->con))));
 
-		database->server->rlag = -1;
+		server_update_lag(database->server, -1);
 	}
 
 	/* auto purge old values after 48 hours*/
@@ -822,7 +1168,7 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
 	/* Try to insert MaxScale timestamp into master */
 	if (mysql_query(database->con, heartbeat_insert_query)) {
 
-		database->server->rlag = -1;
+		server_update_lag(database->server, -1);
 
 		LOGIF(LE, (skygw_log_write_flush(
 			LOGFILE_ERROR,
@@ -836,7 +1182,7 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
 
 			if (mysql_query(database->con, heartbeat_insert_query)) {
 
-				database->server->rlag = -1;
+				server_update_lag(database->server, -1);
 
 				LOGIF(LE, (skygw_log_write_flush(
 					LOGFILE_ERROR,
@@ -845,7 +1191,7 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
 					mysql_error(database->con))));
 			} else {
 				/* Set replication lag to 0 for the master */
-				database->server->rlag = 0;
+				server_update_lag(database->server, 0);
 
 				LOGIF(LD, (skygw_log_write_flush(
 					LOGFILE_DEBUG,
@@ -853,7 +1199,7 @@ static void set_master_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *databas
 			}
 		} else {
 			/* Set replication lag as 0 for the master */
-			database->server->rlag = 0;
+			server_update_lag(database->server, 0);
 
 			LOGIF(LD, (skygw_log_write_flush(
 				LOGFILE_DEBUG,
@@ -914,9 +1260,9 @@ static void set_slave_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *database
 
 			if (rlag >= 0) {
 				/* store rlag only if greater than monitor sampling interval */
-				database->server->rlag = (rlag > (handle->interval / 1000)) ? rlag : 0;
+				server_update_lag(database->server, (rlag > (handle->interval / 1000)) ? rlag : 0);
 			} else {
-				database->server->rlag = -1;
+				server_update_lag(database->server, -1);
 			}
 
 			LOGIF(LD, (skygw_log_write_flush(
@@ -928,13 +1274,13 @@ static void set_slave_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *database
 				database->server->rlag)));
 		}
 		if (!rows_found) {
-			database->server->rlag = -1;
+			server_update_lag(database->server, -1);
 			database->server->node_ts = 0;
 		}
 
 		mysql_free_result(result);
 	} else {
-		database->server->rlag = -1;
+		server_update_lag(database->server, -1);
 		database->server->node_ts = 0;
 
 		if (handle->master->server->node_id < 0) {
@@ -957,6 +1303,189 @@ static void set_slave_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *database
 	}
 }
 
+/*******
+ * This function sets the high resolution replication heartbeat, the time in
+ * microseconds, into the maxscale_schema.replication_heartbeat_us table in
+ * the current master. The table has one row for each master and MaxScale
+ * and so needs no purge. Errors are logged to the debug log only, as the
+ * heartbeat runs many times each pass and the pass reports the errors of
+ * the master.
+ *
+ * @param handle   	The monitor handle
+ * @param database   	The master database server
+ */
+static void set_master_heartbeat_us(MYSQL_MONITOR *handle, MONITOR_SERVERS *database) {
+	unsigned long id = handle->id;
+	struct timeval tv;
+	unsigned long long heartbeat;
+	char heartbeat_insert_query[256]="";
+	int rc;
+
+	gettimeofday(&tv, NULL);
+	heartbeat = (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+
+	sprintf(heartbeat_insert_query, "REPLACE INTO maxscale_schema.replication_heartbeat_us (master_server_id, maxscale_id, master_timestamp_us) VALUES (%li, %lu, %llu)", handle->master->server->node_id, id, heartbeat);
+
+	if ((rc = mysql_query(database->con, heartbeat_insert_query)) != 0 &&
+		mysql_errno(database->con) == ER_NO_SUCH_TABLE) {
+		/* create the table the first time and try again */
+		if (mysql_query(database->con, "CREATE TABLE IF NOT EXISTS "
+				"maxscale_schema.replication_heartbeat_us "
+				"(maxscale_id INT NOT NULL, "
+				"master_server_id INT NOT NULL, "
+				"master_timestamp_us BIGINT UNSIGNED NOT NULL, "
+				"PRIMARY KEY ( master_server_id, maxscale_id ) ) "
+				"ENGINE=MYISAM DEFAULT CHARSET=latin1") == 0) {
+			rc = mysql_query(database->con, heartbeat_insert_query);
+		}
+	}
+
+	if (rc != 0) {
+		LOGIF(LD, (skygw_log_write_flush(
+			LOGFILE_DEBUG,
+			"[mysql_mon]: Error setting high resolution heartbeat in %s:%i: [%s], %s",
+			database->server->name,
+			database->server->port,
+			heartbeat_insert_query,
+			mysql_error(database->con))));
+	}
+}
+
+/*******
+ * This function gets the high resolution replication heartbeat from the
+ * maxscale_schema.replication_heartbeat_us table in the current slave and
+ * stores the replication lag in milliseconds in the slave server struct.
+ * The lag is the time since the master wrote the heartbeat the slave has
+ * applied, the measure is within one heartbeat interval of the real lag.
+ *
+ * @param handle   	The monitor handle
+ * @param database   	The slave database server
+ */
+static void set_slave_heartbeat_us(MYSQL_MONITOR *handle, MONITOR_SERVERS *database) {
+	unsigned long id = handle->id;
+	struct timeval tv;
+	unsigned long long now;
+	unsigned long long slave_read;
+	unsigned long long lag;
+	char select_heartbeat_query[256] = "";
+	MYSQL_ROW row;
+	MYSQL_RES *result;
+	int rlag = -1;
+
+	sprintf(select_heartbeat_query, "SELECT master_timestamp_us "
+		"FROM maxscale_schema.replication_heartbeat_us "
+		"WHERE maxscale_id = %lu AND master_server_id = %li",
+		id, handle->master->server->node_id);
+
+	if (mysql_query(database->con, select_heartbeat_query) == 0
+		&& (result = mysql_store_result(database->con)) != NULL) {
+		if ((row = mysql_fetch_row(result)) != NULL && row[0] != NULL) {
+			gettimeofday(&tv, NULL);
+			now = (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+			slave_read = strtoull(row[0], NULL, 10);
+
+			if (slave_read) {
+				lag = (now > slave_read) ? (now - slave_read) / 1000 : 0;
+				rlag = (lag > INT_MAX) ? INT_MAX : (int)lag;
+			}
+		}
+		mysql_free_result(result);
+	} else {
+		LOGIF(LD, (skygw_log_write_flush(
+			LOGFILE_DEBUG,
+			"[mysql_mon]: Error reading high resolution heartbeat of %s:%i: [%s], %s",
+			database->server->name,
+			database->server->port,
+			select_heartbeat_query,
+			mysql_error(database->con))));
+	}
+	server_update_lag_ms(database->server, rlag);
+}
+
+/*******
+ * This function runs the high resolution replication heartbeat once. The
+ * heartbeat uses the connections and the status of the last pass, the
+ * servers are not probed again.
+ *
+ * @param handle   	The monitor handle
+ * @param root_master	The root master found by the last pass
+ */
+static void monitor_heartbeat(MYSQL_MONITOR *handle, MONITOR_SERVERS *root_master) {
+	MONITOR_SERVERS *ptr;
+
+	if (SERVER_IS_MASTER(root_master->server) || SERVER_IS_RELAY_SERVER(root_master->server)) {
+		set_master_heartbeat_us(handle, root_master);
+		ptr = handle->databases;
+		while (ptr) {
+			if( (! SERVER_IN_MAINT(ptr->server)) && SERVER_IS_RUNNING(ptr->server))
+			{
+				if (ptr->server->node_id != root_master->server->node_id && (SERVER_IS_SLAVE(ptr->server) || SERVER_IS_RELAY_SERVER(ptr->server))) {
+					set_slave_heartbeat_us(handle, ptr);
+				}
+			}
+			ptr = ptr->next;
+		}
+	}
+}
+
+/*******
+ * This function waits for the monitor interval, running the high resolution
+ * replication heartbeat every heartbeat_interval milliseconds and the
+ * liveness probe of the servers every probe_interval milliseconds. The
+ * first heartbeat runs at once, the first probe one probe interval after
+ * the pass. It returns early if the monitor is shut down.
+ *
+ * @param handle   	The monitor handle
+ * @param root_master	The root master found by the last pass, may be NULL
+ */
+static void monitor_wait(MYSQL_MONITOR *handle, MONITOR_SERVERS *root_master) {
+	struct timeval start;
+	struct timeval now;
+	unsigned long elapsed = 0;
+	unsigned long heartbeat = 0;
+	unsigned long probe = handle->probe_interval;
+	unsigned long next_heartbeat = 0;
+	unsigned long next_probe = probe;
+	unsigned long wake;
+
+	if (handle->replicationHeartbeat && root_master)
+		heartbeat = handle->heartbeat_interval;
+	if (probe >= handle->interval)
+		probe = 0;
+	if (heartbeat == 0 && probe == 0) {
+		thread_millisleep(handle->interval);
+		return;
+	}
+
+	gettimeofday(&start, NULL);
+
+	while (elapsed < handle->interval && !handle->shutdown) {
+		if (heartbeat && elapsed >= next_heartbeat) {
+			monitor_heartbeat(handle, root_master);
+			next_heartbeat = elapsed + heartbeat;
+		}
+		if (probe && elapsed >= next_probe) {
+			monitor_probe_servers(handle, 1);
+			next_probe = elapsed + probe;
+		}
+
+		gettimeofday(&now, NULL);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000;
+		if (elapsed >= handle->interval)
+			break;
+		wake = handle->interval;
+		if (heartbeat && next_heartbeat < wake)
+			wake = next_heartbeat;
+		if (probe && next_probe < wake)
+			wake = next_probe;
+		if (wake > elapsed)
+			thread_millisleep(wake - elapsed);
+
+		gettimeofday(&now, NULL);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_usec - start.tv_usec) / 1000;
+	}
+}
+
 /*******
  * This function computes the replication tree
  * from a set of MySQL Master/Slave monitored servers
@@ -20,6 +20,8 @@
 #include	<server.h>
 #include	<spinlock.h>
 #include	<mysql.h>
+#include	<thread.h>
+#include	<sys/time.h>
 
 /**
  * @file mysqlmon.h - The MySQL monitor functionality within the gateway
@@ -46,12 +48,22 @@ typedef struct monitor_servers {
 	int             mon_err_count;
         unsigned int    mon_prev_status;
 	unsigned int    pending_status; /**< Pending Status flag bitmap */	
+	unsigned long	fc_sent;	/**< Galera wsrep_flow_control_sent at the last probe */
+	unsigned long long
+			fc_paused_ns;	/**< Galera wsrep_flow_control_paused_ns at the last probe */
+	struct timeval	probed;		/**< Time of the last probe, 0 if none */
 	struct monitor_servers
 			*next;		/**< The next server in the list */
 } MONITOR_SERVERS;
 
+#define MONITOR_MAX_PROBES	8	/**< Servers probed at the same time */
+
 /**
- * The handle for an instance of a MySQL Monitor module
+ * The handle for an instance of a MySQL Monitor module. The servers of a
+ * monitoring pass are probed by the monitor thread and up to
+ * MONITOR_MAX_PROBES - 1 probe threads, probe_next is the next server of
+ * the pass to probe. The liveness probes between the passes are run by
+ * the same threads, probe_ping is then set.
  */
 typedef struct {
         SPINLOCK  lock;	                /**< The monitor spinlock */
@@ -63,8 +75,22 @@ typedef struct {
         unsigned long   interval;       /**< Monitor sampling interval */
         unsigned long         id;       /**< Monitor ID */
 	int	replicationHeartbeat;	/**< Monitor flag for MySQL replication heartbeat */
+	unsigned long	heartbeat_interval; /**< Milliseconds between high resolution
+					     heartbeats, 0 for one heartbeat a pass */
+	unsigned long	probe_interval;	/**< Milliseconds between the liveness
+					     probes, 0 for none */
+	int		n_ping_failed;	/**< Servers the liveness probes set down */
         MONITOR_SERVERS *master;        /**< Master server for MySQL Master/Slave replication */
         MONITOR_SERVERS	*databases;     /**< Linked list of servers to monitor */
+	pthread_mutex_t	probe_lock;	/**< Protects the probe state */
+	pthread_cond_t	probe_start;	/**< Signalled when a pass starts */
+	pthread_cond_t	probe_done;	/**< Signalled when the probes are done */
+	MONITOR_SERVERS	*probe_next;	/**< Next server of the pass to probe */
+	int		probe_running;	/**< Probes still running */
+	int		probe_pass;	/**< Number of the pass */
+	int		probe_ping;	/**< The pass is a liveness probe */
+	int		n_probes;	/**< Number of probe threads */
+	THREAD		probes[MONITOR_MAX_PROBES]; /**< The probe threads */
 } MYSQL_MONITOR;
 
 #define MONITOR_RUNNING		1
@@ -74,5 +100,8 @@ typedef struct {
 #define MONITOR_INTERVAL 10000 // in milliseconds
 #define MONITOR_DEFAULT_ID 1UL // unsigned long value
 #define MONITOR_MAX_NUM_SLAVES 20 //number of MySQL slave servers associated to a MySQL master server
+#define MONITOR_CONNECT_TIMEOUT 2 // seconds a probe waits for a connection
+#define MONITOR_READ_TIMEOUT 1 // seconds a probe waits for a reply
+#define MONITOR_WRITE_TIMEOUT 2 // seconds a probe waits to send a query
 
 #endif
@@ -40,6 +40,8 @@
 #include <httpd.h>
 #include <gw.h>
 #include <modinfo.h>
+#include <metrics.h>
+#include <handoff.h>
 
 MODULE_INFO info = {
 	MODULE_API_PROTOCOL,
@@ -61,7 +63,8 @@ static int httpd_accept(DCB *dcb);
 static int httpd_close(DCB *dcb);
 static int httpd_listen(DCB *dcb, char *config);
 static int httpd_get_line(int sock, char *buf, int size);
-static void httpd_send_headers(DCB *dcb, int final);
+static void httpd_send_headers(DCB *dcb, int final, char *type, int length);
+static void httpd_send_metrics(DCB *dcb, char *query_string);
 
 /**
  * The "module object" for the httpd protocol module.
@@ -225,8 +228,14 @@ HTTPD_session *client_data = NULL;
 	 * Now begins the server reply
 	 */
 
+	if (strcmp(url, "/metrics") == 0) {
+		httpd_send_metrics(dcb, query_string);
+		dcb_close(dcb);
+		return 0;
+	}
+
 	/* send all the basic headers and close with \r\n */
-	httpd_send_headers(dcb, 1);
+	httpd_send_headers(dcb, 1, "text/plain", -1);
 
 	/**
 	 * ToDO: launch proper content handling based on the requested URI, later REST interface
@@ -379,28 +388,40 @@ int                     rc;
 	if (!parse_bindconfig(config, 6442, &addr))
 		return 0;
 
-	if ((listener->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	if ((listener->fd = handoff_take((struct sockaddr *)&addr,
+					sizeof(addr))) >= 0)
 	{
-		return 0;
+		/*< The socket of the old MaxScale, bound and listening */
+		setnonblocking(listener->fd);
 	}
+	else
+	{
+		if ((listener->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		{
+			return 0;
+		}
 
-        /* socket options */
-	setsockopt(listener->fd,
-                   SOL_SOCKET,
-                   SO_REUSEADDR,
-                   (char *)&one,
-                   sizeof(one));
+		/* socket options */
+		setsockopt(listener->fd,
+			   SOL_SOCKET,
+			   SO_REUSEADDR,
+			   (char *)&one,
+			   sizeof(one));
 
-        /* set NONBLOCKING mode */
-        setnonblocking(listener->fd);
+		/* set NONBLOCKING mode */
+		setnonblocking(listener->fd);
 
-        /* bind address and port */
-        if (bind(listener->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
-	{
-        	return 0;
+		/* allow per thread copies of the listener */
+		poll_reuseport(listener->fd);
+
+		/* bind address and port */
+		if (bind(listener->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		{
+			return 0;
+		}
 	}
 
-        rc = listen(listener->fd, SOMAXCONN);
+        rc = poll_listen(listener, listener->fd, SOMAXCONN, 1);
         
         if (rc == 0) {
             fprintf(stderr,
@@ -457,8 +478,13 @@ static int httpd_get_line(int sock, char *buf, int size) {
 
 /**
  * HTTPD send basic headers with 200 OK
+ *
+ * @param dcb		The client DCB
+ * @param final		Close the headers
+ * @param type		The Content-Type of the reply
+ * @param length	The Content-Length of the reply, -1 if not known
  */
-static void httpd_send_headers(DCB *dcb, int final)
+static void httpd_send_headers(DCB *dcb, int final, char *type, int length)
 {
 	char date[64] = "";
 	const char *fmt = "%a, %d %b %Y %H:%M:%S GMT";
@@ -466,10 +492,37 @@ static void httpd_send_headers(DCB *dcb, int final)
 
 	strftime(date, sizeof(date), fmt, localtime(&httpd_current_time));
 
-	dcb_printf(dcb, "HTTP/1.1 200 OK\r\nDate: %s\r\nServer: %s\r\nConnection: close\r\nContent-Type: text/plain\r\n", date, HTTP_SERVER_STRING);
+	dcb_printf(dcb, "HTTP/1.1 200 OK\r\nDate: %s\r\nServer: %s\r\nConnection: close\r\nContent-Type: %s\r\n", date, HTTP_SERVER_STRING, type);
+	if (length >= 0)
+		dcb_printf(dcb, "Content-Length: %d\r\n", length);
 
 	/* close the headers */
 	if (final) {
  		dcb_printf(dcb, "\r\n");
 	}
 }
+
+/**
+ * Reply with the metrics of the gateway, in JSON if the query string is
+ * "json" and in the Prometheus text format otherwise. The metrics are
+ * collected without the locks of the DCBs and of the sessions, so a scraper
+ * can poll at any rate.
+ *
+ * @param dcb		The client DCB
+ * @param query_string	The query string of the request
+ */
+static void httpd_send_metrics(DCB *dcb, char *query_string)
+{
+	int format = METRICS_PROMETHEUS;
+	GWBUF *buf;
+
+	if (query_string && strcmp(query_string, "json") == 0)
+		format = METRICS_JSON;
+
+	buf = metrics_collect(format);
+	httpd_send_headers(dcb, 1, format == METRICS_JSON ?
+			METRICS_JSON_TYPE : METRICS_PROMETHEUS_TYPE,
+			buf ? GWBUF_LENGTH(buf) : 0);
+	if (buf)
+		dcb_write(dcb, buf);
+}
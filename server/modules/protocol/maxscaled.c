@@ -37,6 +37,8 @@
 #include <log_manager.h>
 #include <modinfo.h>
 #include <maxscaled.h>
+#include <handoff.h>
+#include <ctype.h>
 
 MODULE_INFO info = {
 	MODULE_API_PROTOCOL,
@@ -69,6 +71,9 @@ static int maxscaled_hangup(DCB *dcb);
 static int maxscaled_accept(DCB *dcb);
 static int maxscaled_close(DCB *dcb);
 static int maxscaled_listen(DCB *dcb, char *config);
+static int maxscaled_subscribe(DCB *dcb, GWBUF *cmd);
+static void maxscaled_unsubscribe(MAXSCALED *maxscaled);
+static void maxscaled_push(void *data);
 
 /**
  * The "module object" for the maxscaled protocol module.
@@ -171,7 +176,17 @@ char		*password;
 					gwbuf_consume(head, GWBUF_LENGTH(head));
 					free(password);
 					break;
+				case MAXSCALED_STATE_STREAM:
+					/*< Any command ends the subscription */
+					maxscaled_unsubscribe(maxscaled);
+					maxscaled->state = MAXSCALED_STATE_DATA;
+					/* FALLTHROUGH */
 				case MAXSCALED_STATE_DATA:
+					if (maxscaled_subscribe(dcb, head))
+					{
+						gwbuf_consume(head, GWBUF_LENGTH(head));
+						break;
+					}
 					SESSION_ROUTE_QUERY(session, head);
 					dcb_printf(dcb, "OK");
 					break;
@@ -294,6 +309,10 @@ int	n_connect = 0;
 			n_connect++;
 			maxscaled_pr->state = MAXSCALED_STATE_LOGIN;
 			maxscaled_pr->username = NULL;
+			spinlock_init(&maxscaled_pr->lock);
+			maxscaled_pr->delta = NULL;
+			maxscaled_pr->interval = 0;
+			timer_init(&maxscaled_pr->timer);
 			dcb_printf(client_dcb, "USER");
 		}
 	}
@@ -314,6 +333,11 @@ MAXSCALED *maxscaled = dcb->protocol;
 
 	if (maxscaled && maxscaled->username)
 		free(maxscaled->username);
+	if (maxscaled)
+	{
+		timer_disable(&maxscaled->timer);
+		maxscaled_unsubscribe(maxscaled);
+	}
 
 	dcb_close(dcb);
 	return 0;
@@ -338,22 +362,34 @@ int                     rc;
 		return 0;
 
 
-	if ((listener->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	if ((listener->fd = handoff_take((struct sockaddr *)&addr,
+					sizeof(addr))) >= 0)
 	{
-		return 0;
+		/*< The socket of the old MaxScale, bound and listening */
+		setnonblocking(listener->fd);
 	}
-
-        // socket options
-	setsockopt(listener->fd, SOL_SOCKET, SO_REUSEADDR, (char *)&one, sizeof(one));
-        // set NONBLOCKING mode
-        setnonblocking(listener->fd);
-        // bind address and port
-        if (bind(listener->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	else
 	{
-        	return 0;
+		if ((listener->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		{
+			return 0;
+		}
+
+		// socket options
+		setsockopt(listener->fd, SOL_SOCKET, SO_REUSEADDR, (char *)&one, sizeof(one));
+		// set NONBLOCKING mode
+		setnonblocking(listener->fd);
+
+		/* allow per thread copies of the listener */
+		poll_reuseport(listener->fd);
+		// bind address and port
+		if (bind(listener->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		{
+			return 0;
+		}
 	}
 
-        rc = listen(listener->fd, SOMAXCONN);
+        rc = poll_listen(listener, listener->fd, SOMAXCONN, 0);
         
         if (rc == 0) {
 		LOGIF(LD, (skygw_log_write(
@@ -379,3 +415,112 @@ int                     rc;
 	}
 	return 1;
 }
+
+/**
+ * Start the subscription of a connection to the changes of the metrics if
+ * the command is "subscribe metrics [<milliseconds>]". The reply is OK, or
+ * an error text and OK, then the changes are sent as a JSON object on a
+ * line at each interval, see metrics_delta_collect. The first object has
+ * all the values. Any command sent on the connection ends the subscription.
+ *
+ * @param dcb	The DCB of the connection
+ * @param cmd	The command
+ * @return	1 if the command was the subscription, 0 otherwise
+ */
+static int
+maxscaled_subscribe(DCB *dcb, GWBUF *cmd)
+{
+MAXSCALED	*maxscaled = (MAXSCALED *)dcb->protocol;
+char		*ptr = GWBUF_DATA(cmd);
+int		len = GWBUF_LENGTH(cmd);
+int		n = strlen(MAXSCALED_SUBSCRIBE);
+char		arg[20];
+int		interval = MAXSCALED_INTERVAL_DEFAULT;
+
+	if (len < n || strncasecmp(ptr, MAXSCALED_SUBSCRIBE, n) != 0 ||
+		(len > n && !isspace((unsigned char)ptr[n])))
+		return 0;
+	ptr += n;
+	len -= n;
+	while (len > 0 && isspace((unsigned char)*ptr))
+	{
+		ptr++;
+		len--;
+	}
+	if (len > 0)
+	{
+		n = len < sizeof(arg) - 1 ? len : sizeof(arg) - 1;
+		memcpy(arg, ptr, n);
+		arg[n] = 0;
+		interval = atoi(arg);
+		if (interval < MAXSCALED_INTERVAL_MIN)
+		{
+			dcb_printf(dcb, "The interval must be at least %d "
+				"milliseconds.\n", MAXSCALED_INTERVAL_MIN);
+			dcb_printf(dcb, "OK");
+			return 1;
+		}
+	}
+
+	spinlock_acquire(&maxscaled->lock);
+	if (maxscaled->delta == NULL)
+		maxscaled->delta = metrics_delta_alloc();
+	spinlock_release(&maxscaled->lock);
+	if (maxscaled->delta == NULL)
+	{
+		dcb_printf(dcb, "Out of memory for the subscription.\n");
+		dcb_printf(dcb, "OK");
+		return 1;
+	}
+	maxscaled->interval = interval;
+	maxscaled->state = MAXSCALED_STATE_STREAM;
+	dcb_printf(dcb, "OK");
+	maxscaled_push(dcb);
+	return 1;
+}
+
+/**
+ * End the subscription of a connection, a push that is running is not
+ * waited for but it finds no delta to collect
+ *
+ * @param maxscaled	The protocol of the connection
+ */
+static void
+maxscaled_unsubscribe(MAXSCALED *maxscaled)
+{
+METRICS_DELTA	*delta;
+
+	timer_cancel(&maxscaled->timer);
+	spinlock_acquire(&maxscaled->lock);
+	delta = maxscaled->delta;
+	maxscaled->delta = NULL;
+	spinlock_release(&maxscaled->lock);
+	metrics_delta_free(delta);
+}
+
+/**
+ * Send the changes of the metrics to a subscribed connection and start the
+ * timer of the next ones. The timer runs from the polling thread that
+ * started the subscription.
+ *
+ * @param data	The DCB of the connection
+ */
+static void
+maxscaled_push(void *data)
+{
+DCB		*dcb = (DCB *)data;
+MAXSCALED	*maxscaled = (MAXSCALED *)dcb->protocol;
+GWBUF		*buf = NULL;
+int		subscribed;
+
+	spinlock_acquire(&maxscaled->lock);
+	if ((subscribed = (maxscaled->delta != NULL)))
+		buf = metrics_delta_collect(maxscaled->delta, timer_now());
+	spinlock_release(&maxscaled->lock);
+
+	if (!subscribed)
+		return;
+	if (buf)
+		dcb->func.write(dcb, buf);
+	timer_start(&maxscaled->timer, maxscaled->interval, maxscaled_push, dcb);
+}
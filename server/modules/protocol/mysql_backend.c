@@ -44,6 +44,7 @@
  *
  */
 #include <modinfo.h>
+#include <tracepoint.h>
 
 MODULE_INFO info = {
 	MODULE_API_PROTOCOL,
@@ -63,9 +64,15 @@ static int gw_error_backend_event(DCB *dcb);
 static int gw_backend_close(DCB *dcb);
 static int gw_backend_hangup(DCB *dcb);
 static int backend_write_delayqueue(DCB *dcb);
-static void backend_set_delayqueue(DCB *dcb, GWBUF *queue);
+static int backend_flush_delayqueue(DCB *dcb);
+static int backend_write(DCB *dcb, GWBUF *queue);
+static int backend_set_delayqueue(DCB *dcb, GWBUF *queue, int cmd, int tracked);
+static void backend_add_srv_commands(MySQLProtocol *p, GWBUF *queue);
 static int gw_change_user(DCB *backend_dcb, SERVER *server, SESSION *in_session, GWBUF *queue);
 static GWBUF* process_response_data (DCB* dcb, GWBUF* readbuf, int nbytes_to_process); 
+static int gw_backend_reuse(DCB *dcb, SESSION *session);
+static int gw_backend_pooled_event(DCB *dcb);
+static void backend_count_failure(DCB *dcb);
 
 
 
@@ -85,7 +92,8 @@ static GWPROTOCOL MyObject = {
 	gw_backend_close,			/* Close			 */
 	NULL,					/* Listen			 */
 	gw_change_user,				/* Authentication		 */
-        NULL                                    /* Session                       */
+        NULL,                                   /* Session                       */
+        gw_backend_reuse                        /* Reuse                         */
 };
 
 /*
@@ -159,6 +167,11 @@ static int gw_read_backend_event(DCB *dcb) {
         int            rc = 0;
 
         CHK_DCB(dcb);        
+
+        if (dcb->session == NULL)
+        {
+                return gw_backend_pooled_event(dcb);
+        }
 	CHK_SESSION(dcb->session);
                 
         /*< return only with complete session */
@@ -201,6 +214,7 @@ static int gw_read_backend_event(DCB *dcb) {
                 {
                         if (gw_read_backend_handshake(backend_protocol) != 0) 
                         {
+                                backend_count_failure(dcb);
                                 backend_protocol->protocol_auth_state = MYSQL_AUTH_FAILED;
                                 LOGIF(LD, (skygw_log_write(
                                         LOGFILE_DEBUG,
@@ -294,6 +308,14 @@ static int gw_read_backend_event(DCB *dcb) {
                                         break;
                                 case 1:
                                         backend_protocol->protocol_auth_state = MYSQL_IDLE;
+                                        /** The OK is the last uncompressed packet */
+                                        if (backend_protocol->client_capabilities &
+                                            GW_MYSQL_CAPABILITIES_COMPRESS)
+                                        {
+                                                backend_protocol->protocol_compress = true;
+                                        }
+                                        if (dcb->server)
+                                                server_circuit_success(dcb->server);
                                         
                                         LOGIF(LD, (skygw_log_write_flush(
                                                 LOGFILE_DEBUG,
@@ -330,15 +352,7 @@ static int gw_read_backend_event(DCB *dcb) {
                                  * lock can be freed 
                                  */
                                 spinlock_release(&dcb->authlock);
-                                spinlock_acquire(&dcb->delayqlock);
-                                
-                                if (dcb->delayq != NULL) 
-                                {                                        
-                                        while ((dcb->delayq = gwbuf_consume(
-                                                dcb->delayq,
-                                                GWBUF_LENGTH(dcb->delayq))) != NULL);
-                                }
-                                spinlock_release(&dcb->delayqlock);
+                                dcb_delayq_free(dcb);
                                 
                                 {
                                         GWBUF* errbuf;
@@ -405,10 +419,16 @@ static int gw_read_backend_event(DCB *dcb) {
                                         current_session->user)));
                                
                                 /* check the delay queue and flush the data */
-                                if (dcb->delayq)
+                                if (dcb->delayq_count != 0)
                                 {
                                         rc = backend_write_delayqueue(dcb);
-                                        goto return_with_lock;
+                                        spinlock_release(&dcb->authlock);
+                                        /*< The client may send again */
+                                        if (dcb->paused != NULL)
+                                        {
+                                                dcb_read_resume(dcb);
+                                        }
+                                        goto return_rc;
                                 }
                         }
                 } /* MYSQL_AUTH_RECV || MYSQL_AUTH_FAILED */
@@ -430,9 +450,25 @@ static int gw_read_backend_event(DCB *dcb) {
                 router = session->service->router;
                 router_instance = session->service->router_instance;
 
+                /*<
+                 * The reply is left in the socket while the client is behind,
+                 * the read is resumed when the client has taken enough of it.
+                 */
+                if (session->client != NULL &&
+                        dcb_read_throttle(dcb, session->client))
+                {
+                        rc = 0;
+                        goto return_rc;
+                }
                 /* read available backend data */
                 rc = dcb_read(dcb, &read_buffer);
                 
+                if (rc > 0 && backend_protocol->protocol_compress &&
+                        gw_MySQL_decompress(backend_protocol, &read_buffer) == -1)
+                {
+                        rc = -1;
+                }
+                
                 if (rc < 0) 
                 {
                         GWBUF* errbuf;
@@ -497,7 +533,8 @@ static int gw_read_backend_event(DCB *dcb) {
                 {
                         if (nbytes_read < 5) 
                         {
-                                gwbuf_append(dcb->dcb_readqueue, read_buffer);
+                                dcb->dcb_readqueue = gwbuf_append(dcb->dcb_readqueue,
+                                                                  read_buffer);
                                 rc = 0;
                                 goto return_rc;
                         }
@@ -508,6 +545,9 @@ static int gw_read_backend_event(DCB *dcb) {
                 {
                         read_buffer = process_response_data(dcb, read_buffer, nbytes_read);
                 }
+                /** Mark the last buffer of each complete reply */
+                read_buffer = gw_MySQL_reply_scan((MySQLProtocol *)dcb->protocol,
+                                                  read_buffer);
                 /*<
                  * If dcb->session->client is freed already it may be NULL.
                  */
@@ -523,7 +563,8 @@ static int gw_read_backend_event(DCB *dcb) {
                                         MYSQL_IDLE)
 				{
                                         gwbuf_set_type(read_buffer, GWBUF_TYPE_MYSQL);
-                                        
+                                        TRACEPOINT3(router__reply, session, dcb,
+                                                    TRACEPOINT_BUFLEN(read_buffer));
                                         router->clientReply(
                                                 router_instance,
                                                 session->router_session,
@@ -536,6 +577,8 @@ static int gw_read_backend_event(DCB *dcb) {
                 	else if (dcb->session->client->dcb_role == DCB_ROLE_INTERNAL) 
                         {
                                 gwbuf_set_type(read_buffer, GWBUF_TYPE_MYSQL);
+                                TRACEPOINT3(router__reply, session, dcb,
+                                            TRACEPOINT_BUFLEN(read_buffer));
                                 router->clientReply(router_instance, session->router_session, read_buffer, dcb);
 				rc = 1;
 			}
@@ -680,9 +723,6 @@ gw_MySQLWrite_backend(DCB *dcb, GWBUF *queue)
 
                 case MYSQL_IDLE:
                 {
-                        uint8_t* ptr = GWBUF_DATA(queue);
-                        int      cmd = MYSQL_GET_COMMAND(ptr);
-                        
                         LOGIF(LD, (skygw_log_write(
                                 LOGFILE_DEBUG,
                                 "%lu [gw_MySQLWrite_backend] write to dcb %p "
@@ -703,11 +743,12 @@ gw_MySQLWrite_backend(DCB *dcb, GWBUF *queue)
                         if (GWBUF_IS_TYPE_SINGLE_STMT(queue) &&
                                 GWBUF_IS_TYPE_SESCMD(queue))
                         {
-                                /** Record the command to backend's protocol */
-                                protocol_add_srv_command(backend_protocol, cmd);
+                                /** Record the commands to backend's protocol */
+                                backend_add_srv_commands(backend_protocol, queue);
                         }
+                        protocol_add_reply_commands(backend_protocol, queue);
                         /** Write to backend */
-                        rc = dcb_write(dcb, queue);
+                        rc = backend_write(dcb, queue);
                         goto return_rc;
                         break;
                 }
@@ -725,23 +766,18 @@ gw_MySQLWrite_backend(DCB *dcb, GWBUF *queue)
                                 dcb,
                                 dcb->fd,
                                 STRPROTOCOLSTATE(backend_protocol->protocol_auth_state))));
-                        /** 
-                         * In case of session commands, store command to DCB's 
-                         * protocol struct.
-                         */
-                        if (GWBUF_IS_TYPE_SINGLE_STMT(queue) &&
-                                GWBUF_IS_TYPE_SESCMD(queue))
-                        {
-                                /** Record the command to backend's protocol */
-                                protocol_add_srv_command(backend_protocol, cmd);
-                        }
                         /*<
                          * Now put the incoming data to the delay queue unless backend is
-                         * connected with auth ok
+                         * connected with auth ok. Session commands are recorded
+                         * to the protocol when they are written, in the order
+                         * the replies come.
                          */
-                        backend_set_delayqueue(dcb, queue);
+                        rc = backend_set_delayqueue(dcb,
+                                        queue,
+                                        cmd,
+                                        GWBUF_IS_TYPE_SINGLE_STMT(queue) &&
+                                        GWBUF_IS_TYPE_SESCMD(queue));
                         spinlock_release(&dcb->authlock);
-                        rc = 1;
                         goto return_rc;
                         break;
                 }
@@ -768,6 +804,11 @@ static int gw_error_backend_event(DCB *dcb)
         
 	CHK_DCB(dcb);
 	session = dcb->session;
+
+        if (session == NULL)
+        {
+                return gw_backend_pooled_event(dcb);
+        }
 	CHK_SESSION(session);
         rsession = session->router_session;
         router = session->service->router;
@@ -778,6 +819,7 @@ static int gw_error_backend_event(DCB *dcb)
                 LOGFILE_ERROR,
                 "Backend error event handling.")));
 #endif
+        backend_count_failure(dcb);
         /**
          * Avoid running redundant error handling procedure.
          * dcb_close is already called for the DCB. Thus, either connection is
@@ -851,7 +893,7 @@ static int gw_create_backend_connection(
         }
         
         /*< if succeed, fd > 0, -1 otherwise */
-        rv = gw_do_connect_to_backend(server->name, server->port, &fd);
+        rv = gw_do_connect_to_backend(server, &fd);
         /*< Assign protocol with backend_dcb */
         backend_dcb->protocol = protocol;
 
@@ -891,6 +933,7 @@ static int gw_create_backend_connection(
 		default:
                         ss_dassert(fd == -1);
                         ss_dassert(protocol->protocol_auth_state == MYSQL_ALLOC);
+                        server_circuit_failure(server);
                         LOGIF(LD, (skygw_log_write(
                                 LOGFILE_DEBUG,
                                 "%lu [gw_create_backend_connection] Connection "
@@ -930,6 +973,11 @@ gw_backend_hangup(DCB *dcb)
         
         CHK_DCB(dcb);
         session = dcb->session;
+
+        if (session == NULL)
+        {
+                return gw_backend_pooled_event(dcb);
+        }
         CHK_SESSION(session);
         
         rsession = session->router_session;
@@ -941,6 +989,7 @@ gw_backend_hangup(DCB *dcb)
                 LOGFILE_ERROR,
                 "Backend hangup error handling.")));
 #endif
+        backend_count_failure(dcb);
         
         
         errbuf = mysql_create_custom_error(
@@ -983,17 +1032,52 @@ gw_backend_close(DCB *dcb)
         DCB*     client_dcb;
         SESSION* session;
         GWBUF*   quitbuf;
+        MySQLProtocol* protocol;
         
         CHK_DCB(dcb);
         session = dcb->session;
-        CHK_SESSION(session);
+        protocol = (MySQLProtocol *)dcb->protocol;
 
+        if (session != NULL)
+        {
+                CHK_SESSION(session);
+        }
         quitbuf = mysql_create_com_quit(NULL, 0);
         gwbuf_set_type(quitbuf, GWBUF_TYPE_MYSQL);
 
         /** Send COM_QUIT to the backend being closed */
         mysql_send_com_quit(dcb, 0, quitbuf);
 
+        /** Partial packets and frames of the compressed protocol */
+        if (protocol->protocol_zpending != NULL)
+        {
+                gwbuf_consume(protocol->protocol_zpending,
+                              gwbuf_length(protocol->protocol_zpending));
+                protocol->protocol_zpending = NULL;
+        }
+        while (protocol->protocol_zread != NULL)
+        {
+                protocol->protocol_zread = gwbuf_consume(
+                        protocol->protocol_zread,
+                        GWBUF_LENGTH(protocol->protocol_zread));
+        }
+        timer_disable(&protocol->protocol_query_timer);
+        if (protocol->protocol_reply.rs_held != NULL)
+        {
+                gwbuf_consume(protocol->protocol_reply.rs_held,
+                              gwbuf_length(protocol->protocol_reply.rs_held));
+                protocol->protocol_reply.rs_held = NULL;
+        }
+        spinlock_acquire(&protocol->protocol_lock);
+        free(protocol->protocol_reply_cmds);
+        protocol->protocol_reply_cmds = NULL;
+        free(protocol->protocol_reply_times);
+        protocol->protocol_reply_times = NULL;
+        protocol->protocol_reply_size = 0;
+        protocol->protocol_reply_count = 0;
+        protocol->protocol_kill_sent = 0;
+        spinlock_release(&protocol->protocol_lock);
+
         if (session != NULL && session->state == SESSION_STATE_STOPPING)
         {
                 client_dcb = session->client;
@@ -1012,24 +1096,139 @@ gw_backend_close(DCB *dcb)
  * This routine put into the delay queue the input queue
  * The input is what backend DCB is receiving
  * The routine is called from func.write() when mysql backend connection
- * is not yet complete buu there are inout data from client
+ * is not yet complete but there are input data from client
+ *
+ * The delay queue has room for a limited number of requests. When it is
+ * full the reads of the client are paused until the queue is written, a
+ * request that still finds the queue full fails.
  *
- * @param dcb   The current backend DCB
- * @param queue Input data in the GWBUF struct
+ * @param dcb		The current backend DCB
+ * @param queue		Input data in the GWBUF struct
+ * @param cmd		The command of the request
+ * @param tracked	Non-zero if the command is recorded to the protocol
+ *			when the request is written
+ * @return		1 if the request was queued, 0 otherwise
  */
-static void backend_set_delayqueue(DCB *dcb, GWBUF *queue) {
-	spinlock_acquire(&dcb->delayqlock);
-
-	if (dcb->delayq) {
-		/* Append data */
-		dcb->delayq = gwbuf_append(dcb->delayq, queue);
-	} else {
-		if (queue != NULL) {
-			/* create the delay queue */
-			dcb->delayq = queue;
-		}
-	}
-	spinlock_release(&dcb->delayqlock);
+static int backend_set_delayqueue(DCB *dcb, GWBUF *queue, int cmd, int tracked)
+{
+        int room;
+
+        if ((room = dcb_delayq_add(dcb, queue, cmd, tracked)) < 0)
+        {
+                LOGIF(LE, (skygw_log_write_flush(
+                        LOGFILE_ERROR,
+                        "Error : Unable to keep the request for backend "
+                        "dcb %p fd %d, %d requests are waiting for the "
+                        "connection.",
+                        dcb,
+                        dcb->fd,
+                        dcb->delayq_count)));
+                while (queue != NULL)
+                {
+                        queue = gwbuf_consume(queue, GWBUF_LENGTH(queue));
+                }
+                return 0;
+        }
+        if (room == 0 && dcb->session != NULL && dcb->session->client != NULL)
+        {
+                dcb_read_pause(dcb->session->client, dcb);
+        }
+        return 1;
+}
+
+/**
+ * Record the session commands of a write to the protocol. A router may
+ * chain several session commands to one write, each buffer of the chain
+ * that is a single session command is one command whose response the
+ * protocol marks.
+ *
+ * @param p	The backend protocol
+ * @param queue	The session commands
+ */
+static void backend_add_srv_commands(MySQLProtocol *p, GWBUF *queue)
+{
+        GWBUF *buf;
+
+        for (buf = queue; buf != NULL; buf = buf->next)
+        {
+                if (GWBUF_IS_TYPE_SINGLE_STMT(buf) && GWBUF_IS_TYPE_SESCMD(buf))
+                {
+                        uint8_t *data = (uint8_t *)GWBUF_DATA(buf);
+
+                        protocol_add_srv_command(
+                                p,
+                                (mysql_server_cmd_t)MYSQL_GET_COMMAND(data));
+                }
+        }
+}
+
+/**
+ * Write to the backend, the packets are put to the frames of the compressed
+ * protocol if it is used with the backend.
+ *
+ * @param dcb	The backend DCB
+ * @param queue	The packets to write
+ * @return	The dcb_write status
+ */
+static int backend_write(DCB *dcb, GWBUF *queue)
+{
+	MySQLProtocol *backend_protocol = (MySQLProtocol *)dcb->protocol;
+
+        if (backend_protocol->protocol_compress)
+        {
+                if (!gw_MySQL_compress(backend_protocol,
+                                       &queue,
+                                       dcb->server ?
+                                       dcb->server->compress_threshold :
+                                       SERVER_COMPRESS_THRESHOLD))
+                {
+                        return 0;
+                }
+                /** Only part of a packet was written */
+                if (queue == NULL)
+                {
+                        return 1;
+                }
+        }
+        return dcb_write(dcb, queue);
+}
+
+/**
+ * Write the requests of the delay queue in the order they were queued. The
+ * command of a tracked request is recorded to the protocol just before the
+ * request is written, so the commands are recorded in the order of the
+ * replies. A request that fails to be written ends the writing, the rest
+ * of the queue is discarded.
+ *
+ * @param dcb	The backend DCB
+ * @return	1 if the queue was written, 0 if a write failed
+ */
+static int backend_flush_delayqueue(DCB *dcb)
+{
+        MySQLProtocol *backend_protocol = (MySQLProtocol *)dcb->protocol;
+        DCB_PENDING   pending;
+
+        while (dcb_delayq_take(dcb, &pending))
+        {
+                if (pending.tracked)
+                {
+                        backend_add_srv_commands(backend_protocol,
+                                                 pending.buffer);
+                }
+                /** The reply to COM_CHANGE_USER of a reused connection is read
+                 * by the authentication */
+                if (backend_protocol->protocol_auth_state == MYSQL_IDLE)
+                {
+                        protocol_add_reply_commands(backend_protocol,
+                                                    pending.buffer);
+                }
+                if (backend_write(dcb, pending.buffer) == 0)
+                {
+                        dcb_delayq_free(dcb);
+                        return 0;
+                }
+        }
+        return 1;
 }
 
 /**
@@ -1042,23 +1241,9 @@ static void backend_set_delayqueue(DCB *dcb, GWBUF *queue) {
  */
 static int backend_write_delayqueue(DCB *dcb)
 {
-	GWBUF *localq = NULL;
         int   rc;
 
-	spinlock_acquire(&dcb->delayqlock);
-
-        if (dcb->delayq == NULL)
-        {
-                spinlock_release(&dcb->delayqlock);
-                rc = 1;
-        }
-        else
-        {
-                localq = dcb->delayq;
-                dcb->delayq = NULL;
-                spinlock_release(&dcb->delayqlock);
-                rc = dcb_write(dcb, localq);
-        }
+        rc = backend_flush_delayqueue(dcb);
 
         if (rc == 0)
         {
@@ -1180,6 +1365,11 @@ static int gw_change_user(
 		// get db name
 		strcpy(database, (char *)client_auth_packet);
 
+		/** The response is read like those of other session commands */
+		if (GWBUF_IS_TYPE_SESCMD(queue))
+		{
+			protocol_add_srv_command(backend_protocol, MYSQL_COM_CHANGE_USER);
+		}
 		rv = gw_send_change_user_to_backend(database, username, client_sha1, backend_protocol);
 
 		/*<
@@ -1249,6 +1439,22 @@ static GWBUF* process_response_data (
                 
                 srvcmd = protocol_get_srv_command(p, false);
                 
+                /**
+                 * The rest is the reply to a statement that was written
+                 * after the session commands and it is passed on as is.
+                 */
+                if (srvcmd == MYSQL_COM_UNDEFINED)
+                {
+                        GWBUF* b;
+
+                        for (b = readbuf; b != NULL; b = b->next)
+                        {
+                                b->gwbuf_type &= ~GWBUF_TYPE_SESCMD_RESPONSE;
+                        }
+                        outbuf = gwbuf_append(outbuf, readbuf);
+                        readbuf = NULL;
+                        break;
+                }
                 /** 
                  * Read values from protocol structure, fails if values are 
                  * uninitialized. 
@@ -1347,3 +1553,139 @@ static GWBUF* process_response_data (
         }
         return outbuf;
 }
+
+/**
+ * The reuse entry point of the persistent connection pool.
+ *
+ * With a NULL session the connection is about to be pooled and it is only
+ * checked that it is authenticated and that no reply is outstanding. With
+ * a session the pooled connection is given to the session and
+ * COM_CHANGE_USER is sent with the credentials of its user. The server
+ * resets the connection state, and the reply is read like the reply to
+ * the authentication of a new connection: anything written before it
+ * arrives waits in the delay queue.
+ *
+ * @param dcb		The backend DCB
+ * @param session	The session that takes the connection or NULL
+ * @return 1 if the connection can be used, -1 otherwise
+ */
+static int gw_backend_reuse(
+        DCB     *dcb,
+        SESSION *session)
+{
+        MySQLProtocol *backend_protocol = (MySQLProtocol *)dcb->protocol;
+        MYSQL_session *auth_info;
+        int            rc = -1;
+
+        CHK_PROTOCOL(backend_protocol);
+
+        if (session == NULL)
+        {
+                if (backend_protocol->protocol_auth_state == MYSQL_IDLE &&
+                    protocol_get_srv_command(backend_protocol, false) ==
+                    MYSQL_COM_UNDEFINED &&
+                    backend_protocol->protocol_zpending == NULL &&
+                    backend_protocol->protocol_zread == NULL &&
+                    backend_protocol->protocol_reply_count == 0)
+                {
+                        rc = 1;
+                }
+                return rc;
+        }
+
+        if ((auth_info = gw_get_shared_session_auth_info(dcb)) == NULL)
+        {
+                return rc;
+        }
+        spinlock_acquire(&dcb->authlock);
+
+        if (backend_protocol->protocol_auth_state != MYSQL_IDLE)
+        {
+                spinlock_release(&dcb->authlock);
+                return rc;
+        }
+        backend_protocol->protocol_auth_state = MYSQL_AUTH_RECV;
+        spinlock_release(&dcb->authlock);
+        /*<
+         * The protocol is no longer idle so the packet is put to the delay
+         * queue, take it from there and write it ahead of everything else.
+         */
+        if (gw_send_change_user_to_backend(auth_info->db,
+                                           auth_info->user,
+                                           auth_info->client_sha1,
+                                           backend_protocol) == 0)
+        {
+                return rc;
+        }
+        if (dcb->delayq_count != 0 && backend_flush_delayqueue(dcb) == 1)
+        {
+                rc = 1;
+        }
+        LOGIF(LD, (skygw_log_write(
+                LOGFILE_DEBUG,
+                "%lu [gw_backend_reuse] Sent COM_CHANGE_USER for user %s "
+                "to dcb %p fd %d, rc %d.",
+                pthread_self(),
+                auth_info->user,
+                dcb,
+                dcb->fd,
+                rc)));
+        return rc;
+}
+
+/**
+ * An event on a connection in the persistent pool. The connection has no
+ * session and nothing is expected from the server, so whatever happened
+ * the connection is no longer usable. It is only closed here if it is
+ * still in the pool, otherwise a session has just taken it and the event
+ * is left to the session.
+ *
+ * @param dcb	The pooled backend DCB
+ * @return 1 always
+ */
+static int gw_backend_pooled_event(
+        DCB *dcb)
+{
+        if (dcb->server != NULL &&
+            server_remove_persistent(dcb->server, dcb))
+        {
+                LOGIF(LD, (skygw_log_write(
+                        LOGFILE_DEBUG,
+                        "%lu [gw_backend_pooled_event] Closing pooled dcb %p "
+                        "fd %d.",
+                        pthread_self(),
+                        dcb,
+                        dcb->fd)));
+                dcb_close(dcb);
+        }
+        return 1;
+}
+
+/**
+ * Count the failure of a backend connection in the circuit breaker of the
+ * server. A connection fails if it is lost before it is authenticated or if
+ * it was shut down by its connect or reply timer. Each connection counts
+ * once, the error and hangup events of a connection may both be seen.
+ *
+ * @param dcb	The backend DCB
+ */
+static void backend_count_failure(
+        DCB *dcb)
+{
+        MySQLProtocol* protocol = (MySQLProtocol *)dcb->protocol;
+
+        if (dcb->server == NULL || protocol == NULL ||
+            (dcb->flags & DCBF_FAILURE_COUNTED))
+        {
+                return;
+        }
+        if ((dcb->flags & DCBF_TIMED_OUT) ||
+            protocol->protocol_auth_state == MYSQL_PENDING_CONNECT ||
+            protocol->protocol_auth_state == MYSQL_CONNECTED ||
+            protocol->protocol_auth_state == MYSQL_AUTH_SENT ||
+            protocol->protocol_auth_state == MYSQL_AUTH_RECV)
+        {
+                dcb->flags |= DCBF_FAILURE_COUNTED;
+                server_circuit_failure(dcb->server);
+        }
+}
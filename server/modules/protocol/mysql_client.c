@@ -36,11 +36,16 @@
  * 07/05/2014   Massimiliano Pinto	Added: specific version string in server handshake
  *
  */
+/** for accept4 */
+#define _GNU_SOURCE
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <mysql_client_server_protocol.h>
 #include <gw.h>
 #include <modinfo.h>
+#include <tls.h>
+#include <tracepoint.h>
+#include <handoff.h>
 
 MODULE_INFO info = {
 	MODULE_API_PROTOCOL,
@@ -64,8 +69,40 @@ static int gw_client_hangup_event(DCB *dcb);
 
 int mysql_send_ok(DCB *dcb, int packet_number, int in_affected_rows, const char* mysql_message);
 int MySQLSendHandshake(DCB* dcb);
+static void gw_mysql_admit_client(DCB *dcb);
 static int gw_mysql_do_authentication(DCB *dcb, GWBUF *queue);
-static int route_by_statement(SESSION *, GWBUF *);
+static int route_by_statement(SESSION *, GWBUF *, bool);
+static void mysql_stmt_decode(MySQLProtocol *, GWBUF *);
+static void mysql_stmt_prepared(MySQLProtocol *, GWBUF *);
+static void mysql_stmt_info_free(void *);
+static void mysql_stmt_free(MYSQL_STMT *);
+
+/** Number of handshake templates kept by a thread */
+#define MYSQL_HANDSHAKE_CACHE_SIZE 8
+
+/**
+ * The handshake of the clients of a service through the listeners with or
+ * without TLS. Only the thread id and the scramble differ between the
+ * clients, the rest of the packet is built once.
+ */
+typedef struct {
+        SERVICE *service;               /*< the service, NULL if unused */
+        bool    tls;                    /*< the clients may switch to TLS */
+        char    *version;               /*< the version string of the packet */
+        uint8_t *packet;                /*< the packet with its header */
+        int     len;                    /*< length of the packet */
+        int     tid_offset;             /*< offset of the thread id */
+        int     scramble_offset1;       /*< offset of the first 8 bytes of the scramble */
+        int     scramble_offset2;       /*< offset of the last 12 bytes */
+} MYSQL_HANDSHAKE_TEMPLATE;
+
+/**
+ * The templates are kept in each thread so that no locking is needed, like
+ * the authentication cache. A thread only builds the templates of the
+ * services whose clients it accepts.
+ */
+static __thread MYSQL_HANDSHAKE_TEMPLATE handshake_cache[MYSQL_HANDSHAKE_CACHE_SIZE];
+static __thread int handshake_next = 0;
 
 /*
  * The "module object" for the mysqld client protocol module.
@@ -118,10 +155,24 @@ GetModuleObject()
 	return &MyObject;
 }
 
+/**
+ * The OK packet without a message, the sequence number and the affected
+ * rows are patched in.
+ */
+static const uint8_t mysql_ok_template[] = {
+        0x07, 0x00, 0x00, 0x00,         /*< payload length, sequence number */
+        0x00,                           /*< field count */
+        0x00,                           /*< affected rows */
+        0x00,                           /*< insert id */
+        0x02, 0x00,                     /*< server status, autocommit */
+        0x00, 0x00                      /*< warning count */
+};
+
 /**
  * mysql_send_ok
  *
- * Send a MySQL protocol OK message to the dcb (client)
+ * Send a MySQL protocol OK message to the dcb (client). The packet is copied
+ * from mysql_ok_template and the message, if any, is appended to it.
  *
  * @param dcb Descriptor Control Block for the connection to which the OK is sent
  * @param packet_number
@@ -132,234 +183,252 @@ GetModuleObject()
  */
 int
 mysql_send_ok(DCB *dcb, int packet_number, int in_affected_rows, const char* mysql_message) {
-        uint8_t *outbuf = NULL;
-        uint8_t mysql_payload_size = 0;
-        uint8_t mysql_packet_header[4];
-        uint8_t *mysql_payload = NULL;
-        uint8_t field_count = 0;
-        uint8_t affected_rows = 0;
-        uint8_t insert_id = 0;
-        uint8_t mysql_server_status[2];
-        uint8_t mysql_warning_count[2];
+        size_t  msglen = (mysql_message != NULL ? strlen(mysql_message) : 0);
+        size_t  len = sizeof(mysql_ok_template) + msglen;
+        uint8_t *outbuf;
 	GWBUF	*buf;
 
-        affected_rows = in_affected_rows;
-	
-	mysql_payload_size = sizeof(field_count) +
-                sizeof(affected_rows) +
-                sizeof(insert_id) +
-                sizeof(mysql_server_status) +
-                sizeof(mysql_warning_count);
-
-        if (mysql_message != NULL) {
-                mysql_payload_size += strlen(mysql_message);
-        }
-
         // allocate memory for packet header + payload
-        if ((buf = gwbuf_alloc(sizeof(mysql_packet_header) + mysql_payload_size)) == NULL)
+        if ((buf = gwbuf_alloc(len)) == NULL)
 	{
 		return 0;
 	}
 	outbuf = GWBUF_DATA(buf);
 
-        // write packet header with packet number
-        gw_mysql_set_byte3(mysql_packet_header, mysql_payload_size);
-        mysql_packet_header[3] = packet_number;
-
-        // write header
-        memcpy(outbuf, mysql_packet_header, sizeof(mysql_packet_header));
-
-        mysql_payload = outbuf + sizeof(mysql_packet_header);
-
-        mysql_server_status[0] = 2;
-        mysql_server_status[1] = 0;
-        mysql_warning_count[0] = 0;
-        mysql_warning_count[1] = 0;
-
-        // write data
-        memcpy(mysql_payload, &field_count, sizeof(field_count));
-        mysql_payload = mysql_payload + sizeof(field_count);
-
-        memcpy(mysql_payload, &affected_rows, sizeof(affected_rows));
-        mysql_payload = mysql_payload + sizeof(affected_rows);
+        memcpy(outbuf, mysql_ok_template, sizeof(mysql_ok_template));
+        gw_mysql_set_byte3(outbuf, len - 4);
+        outbuf[3] = packet_number;
+        outbuf[5] = in_affected_rows;
 
-        memcpy(mysql_payload, &insert_id, sizeof(insert_id));
-        mysql_payload = mysql_payload + sizeof(insert_id);
-
-        memcpy(mysql_payload, mysql_server_status, sizeof(mysql_server_status));
-        mysql_payload = mysql_payload + sizeof(mysql_server_status);
-
-        memcpy(mysql_payload, mysql_warning_count, sizeof(mysql_warning_count));
-        mysql_payload = mysql_payload + sizeof(mysql_warning_count);
-
-        if (mysql_message != NULL) {
-                memcpy(mysql_payload, mysql_message, strlen(mysql_message));
+        if (msglen > 0) {
+                memcpy(outbuf + sizeof(mysql_ok_template), mysql_message, msglen);
         }
 
 	// writing data in the Client buffer queue
 	dcb->func.write(dcb, buf);
 
-	return sizeof(mysql_packet_header) + mysql_payload_size;
+	return len;
 }
 
 /**
- * MySQLSendHandshake
+ * Complete the connection of a client admitted to the service, now or
+ * after waiting in the admission queue, by sending the handshake.
  *
- * @param dcb The descriptor control block to use for sending the handshake request
- * @return	The packet length sent
+ * @param dcb The client DCB
  */
-int
-MySQLSendHandshake(DCB* dcb)
+static void
+gw_mysql_admit_client(DCB *dcb)
 {
-        uint8_t *outbuf = NULL;
-        uint8_t mysql_payload_size = 0;
-        uint8_t mysql_packet_header[4];
-        uint8_t mysql_packet_id = 0;
-        uint8_t mysql_filler = GW_MYSQL_HANDSHAKE_FILLER;
-        uint8_t mysql_protocol_version = GW_MYSQL_PROTOCOL_VERSION;
-        uint8_t *mysql_handshake_payload = NULL;
-        uint8_t mysql_thread_id[4];
-        uint8_t mysql_scramble_buf[9] = "";
-        uint8_t mysql_plugin_data[13] = "";
-        uint8_t mysql_server_capabilities_one[2];
-        uint8_t mysql_server_capabilities_two[2];
-        uint8_t mysql_server_language = 8;
-        uint8_t mysql_server_status[2];
-        uint8_t mysql_scramble_len = 21;
-        uint8_t mysql_filler_ten[10];
-        uint8_t mysql_last_byte = 0x00;
-	char server_scramble[GW_MYSQL_SCRAMBLE_SIZE + 1]="";
-	char *version_string;
-	int len_version_string=0;
-
-	MySQLProtocol *protocol = DCB_PROTOCOL(dcb, MySQLProtocol);
-	GWBUF		*buf;
-
-	/* get the version string from service property if available*/
-	if (dcb->service->version_string != NULL) {
-		version_string = dcb->service->version_string;
-		len_version_string = strlen(version_string);
-	} else {
-		version_string = GW_MYSQL_VERSION;
-		len_version_string = strlen(GW_MYSQL_VERSION);
-	}
-
-	gw_generate_random_str(server_scramble, GW_MYSQL_SCRAMBLE_SIZE);
-	
-	// copy back to the caller
-	memcpy(protocol->scramble, server_scramble, GW_MYSQL_SCRAMBLE_SIZE);
-
-	// fill the handshake packet
-
-	memset(&mysql_filler_ten, 0x00, sizeof(mysql_filler_ten));
-
-        // thread id, now put thePID
-        gw_mysql_set_byte4(mysql_thread_id, getpid() + dcb->fd);
-	
-        memcpy(mysql_scramble_buf, server_scramble, 8);
-
-        memcpy(mysql_plugin_data, server_scramble + 8, 12);
-
-        mysql_payload_size  = sizeof(mysql_protocol_version) + (len_version_string + 1) + sizeof(mysql_thread_id) + 8 + sizeof(mysql_filler) + sizeof(mysql_server_capabilities_one) + sizeof(mysql_server_language) + sizeof(mysql_server_status) + sizeof(mysql_server_capabilities_two) + sizeof(mysql_scramble_len) + sizeof(mysql_filler_ten) + 12 + sizeof(mysql_last_byte) + strlen("mysql_native_password") + sizeof(mysql_last_byte);
-
-        // allocate memory for packet header + payload
-        if ((buf = gwbuf_alloc(sizeof(mysql_packet_header) + mysql_payload_size)) == NULL)
-	{
-                ss_dassert(buf != NULL);
-		return 0;
-	}
-	outbuf = GWBUF_DATA(buf);
+        MySQLProtocol* protocol = (MySQLProtocol *)dcb->protocol;
 
-        // write packet heder with mysql_payload_size
-        gw_mysql_set_byte3(mysql_packet_header, mysql_payload_size);
-        //mysql_packet_header[0] = mysql_payload_size;
+        // client protocol state change
+        protocol->protocol_auth_state = MYSQL_AUTH_SENT;
+        //send handshake to the client_dcb
+        MySQLSendHandshake(dcb);
+}
 
-        // write packent number, now is 0
-        mysql_packet_header[3]= mysql_packet_id;
-        memcpy(outbuf, mysql_packet_header, sizeof(mysql_packet_header));
+/**
+ * Build the handshake of the clients of a service. Everything but the
+ * thread id and the scramble is the same for every client that connects
+ * through a listener: the version string of the service and the server
+ * capabilities, which tell whether the clients may switch to TLS.
+ *
+ * @param tpl		The template to fill
+ * @param version	The version string sent to the clients
+ * @param tls		The clients may switch to TLS
+ * @return		true if the template was built
+ */
+static bool
+mysql_handshake_build(MYSQL_HANDSHAKE_TEMPLATE *tpl, const char *version, bool tls)
+{
+        size_t  vlen = strlen(version);
+        size_t  payload_size;
+        uint8_t *packet;
+        uint8_t *p;
 
-        // current buffer pointer
-        mysql_handshake_payload = outbuf + sizeof(mysql_packet_header);
+        payload_size = 1 + (vlen + 1) + 4 + 8 + 1 + 2 + 1 + 2 + 2 + 1 + 10 +
+                12 + 1 + strlen("mysql_native_password") + 1;
 
-        // write protocol version
-        memcpy(mysql_handshake_payload, &mysql_protocol_version, sizeof(mysql_protocol_version));
-        mysql_handshake_payload = mysql_handshake_payload + sizeof(mysql_protocol_version);
+        if ((packet = (uint8_t *)malloc(4 + payload_size)) == NULL ||
+                (tpl->version = strdup(version)) == NULL)
+        {
+                free(packet);
+                return false;
+        }
+        p = packet;
+
+        // packet header, the packet number is 0
+        gw_mysql_set_byte3(p, payload_size);
+        p[3] = 0;
+        p += 4;
+
+        *p++ = GW_MYSQL_PROTOCOL_VERSION;
+
+        // server version plus 0 filler
+        memcpy(p, version, vlen + 1);
+        p += vlen + 1;
+
+        // thread id, patched in for each client
+        tpl->tid_offset = p - packet;
+        memset(p, 0, 4);
+        p += 4;
+
+        // first 8 bytes of the scramble, patched in for each client
+        tpl->scramble_offset1 = p - packet;
+        memset(p, 0, 8);
+        p += 8;
+        *p++ = GW_MYSQL_HANDSHAKE_FILLER;
+
+        // server capabilities part one
+        p[0] = GW_MYSQL_SERVER_CAPABILITIES_BYTE1 & ~GW_MYSQL_CAPABILITIES_COMPRESS;
+        p[1] = GW_MYSQL_SERVER_CAPABILITIES_BYTE2;
+        if (tls)
+        {
+                /*< Clients of the listener may switch to TLS */
+                p[1] |= GW_MYSQL_CAPABILITIES_SSL >> 8;
+        }
+        p += 2;
 
-        // write server version plus 0 filler
-       	strcpy((char *)mysql_handshake_payload, version_string);
-       	mysql_handshake_payload = mysql_handshake_payload + len_version_string;
+        // server language
+        *p++ = 8;
 
-        *mysql_handshake_payload = 0x00;
+        // server status
+        *p++ = 2;
+        *p++ = 0;
 
-	mysql_handshake_payload++;
+        // server capabilities part two
+        *p++ = 15;
+        *p++ = 128;
 
-        // write thread id
-        memcpy(mysql_handshake_payload, mysql_thread_id, sizeof(mysql_thread_id));
-        mysql_handshake_payload = mysql_handshake_payload + sizeof(mysql_thread_id);
+        // scramble len
+        *p++ = 21;
 
-        // write scramble buf
-        memcpy(mysql_handshake_payload, mysql_scramble_buf, 8);
-        mysql_handshake_payload = mysql_handshake_payload + 8;
-        *mysql_handshake_payload = GW_MYSQL_HANDSHAKE_FILLER;
-        mysql_handshake_payload++;
+        // 10 filler
+        memset(p, 0, 10);
+        p += 10;
 
-        // write server capabilities part one
-        mysql_server_capabilities_one[0] = GW_MYSQL_SERVER_CAPABILITIES_BYTE1;
-        mysql_server_capabilities_one[1] = GW_MYSQL_SERVER_CAPABILITIES_BYTE2;
+        // rest of the scramble, patched in for each client
+        tpl->scramble_offset2 = p - packet;
+        memset(p, 0, 12);
+        p += 12;
+        *p++ = 0x00;
 
+        memcpy(p, "mysql_native_password", strlen("mysql_native_password") + 1);
+        p += strlen("mysql_native_password") + 1;
 
-        mysql_server_capabilities_one[0] &= ~GW_MYSQL_CAPABILITIES_COMPRESS;
-        mysql_server_capabilities_one[0] &= ~GW_MYSQL_CAPABILITIES_SSL;
+        ss_dassert(p - packet == 4 + payload_size);
+        tpl->service = NULL;
+        tpl->tls = tls;
+        tpl->packet = packet;
+        tpl->len = 4 + payload_size;
 
-        memcpy(mysql_handshake_payload, mysql_server_capabilities_one, sizeof(mysql_server_capabilities_one));
-        mysql_handshake_payload = mysql_handshake_payload + sizeof(mysql_server_capabilities_one);
+        return true;
+}
 
-        // write server language
-        memcpy(mysql_handshake_payload, &mysql_server_language, sizeof(mysql_server_language));
-        mysql_handshake_payload = mysql_handshake_payload + sizeof(mysql_server_language);
+/**
+ * Find the handshake template of the clients of a service in the cache of
+ * the thread, or build it. A template whose version string no longer is
+ * the one of the service, after a reload, is built again.
+ *
+ * @param service	The service of the client
+ * @param tls		The listener of the client has a TLS context
+ * @return		The template or NULL if memory could not be allocated
+ */
+static MYSQL_HANDSHAKE_TEMPLATE *
+mysql_handshake_template(SERVICE *service, bool tls)
+{
+        const char               *version;
+        MYSQL_HANDSHAKE_TEMPLATE *tpl;
+        int                      i;
 
-        //write server status
-        mysql_server_status[0] = 2;
-        mysql_server_status[1] = 0;
-        memcpy(mysql_handshake_payload, mysql_server_status, sizeof(mysql_server_status));
-        mysql_handshake_payload = mysql_handshake_payload + sizeof(mysql_server_status);
+        version = (service->version_string != NULL ?
+                   service->version_string : GW_MYSQL_VERSION);
 
-        //write server capabilities part two
-        mysql_server_capabilities_two[0] = 15;
-        mysql_server_capabilities_two[1] = 128;
+        for (i = 0; i < MYSQL_HANDSHAKE_CACHE_SIZE; i++)
+        {
+                tpl = &handshake_cache[i];
 
-        memcpy(mysql_handshake_payload, mysql_server_capabilities_two, sizeof(mysql_server_capabilities_two));
-        mysql_handshake_payload = mysql_handshake_payload + sizeof(mysql_server_capabilities_two);
+                if (tpl->service == service && tpl->tls == tls)
+                {
+                        if (strcmp(tpl->version, version) == 0)
+                        {
+                                return tpl;
+                        }
+                        break;
+                }
+        }
 
-        // write scramble_len
-        memcpy(mysql_handshake_payload, &mysql_scramble_len, sizeof(mysql_scramble_len));
-        mysql_handshake_payload = mysql_handshake_payload + sizeof(mysql_scramble_len);
+        if (i == MYSQL_HANDSHAKE_CACHE_SIZE)
+        {
+                /** Take an unused slot, or the slots in turn */
+                for (i = 0; i < MYSQL_HANDSHAKE_CACHE_SIZE; i++)
+                {
+                        if (handshake_cache[i].packet == NULL)
+                        {
+                                break;
+                        }
+                }
+                if (i == MYSQL_HANDSHAKE_CACHE_SIZE)
+                {
+                        i = handshake_next;
+                        handshake_next = (handshake_next + 1) % MYSQL_HANDSHAKE_CACHE_SIZE;
+                }
+                tpl = &handshake_cache[i];
+        }
 
-        //write 10 filler
-        memcpy(mysql_handshake_payload, mysql_filler_ten, sizeof(mysql_filler_ten));
-        mysql_handshake_payload = mysql_handshake_payload + sizeof(mysql_filler_ten);
+        free(tpl->packet);
+        free(tpl->version);
+        tpl->packet = NULL;
+        tpl->version = NULL;
+        tpl->service = NULL;
 
-        // write plugin data
-        memcpy(mysql_handshake_payload, mysql_plugin_data, 12);
-        mysql_handshake_payload = mysql_handshake_payload + 12;
+        if (!mysql_handshake_build(tpl, version, tls))
+        {
+                return NULL;
+        }
+        tpl->service = service;
 
-        //write last byte, 0
-        *mysql_handshake_payload = 0x00;
-        mysql_handshake_payload++;
+        return tpl;
+}
 
-        // to be understanded ????
-        memcpy(mysql_handshake_payload, "mysql_native_password", strlen("mysql_native_password"));
-        mysql_handshake_payload = mysql_handshake_payload + strlen("mysql_native_password");
+/**
+ * MySQLSendHandshake
+ *
+ * The handshake is copied from the template of the service and the
+ * listener, see mysql_handshake_template, and the thread id and the
+ * scramble of the client are patched in.
+ *
+ * @param dcb The descriptor control block to use for sending the handshake request
+ * @return	The packet length sent
+ */
+int
+MySQLSendHandshake(DCB* dcb)
+{
+	MySQLProtocol            *protocol = DCB_PROTOCOL(dcb, MySQLProtocol);
+        MYSQL_HANDSHAKE_TEMPLATE *tpl;
+        uint8_t                  *outbuf;
+	GWBUF		         *buf;
+
+        if ((tpl = mysql_handshake_template(dcb->service,
+                                            dcb->tls_ctx != NULL)) == NULL ||
+                (buf = gwbuf_alloc(tpl->len)) == NULL)
+	{
+		return 0;
+	}
+	outbuf = GWBUF_DATA(buf);
+        memcpy(outbuf, tpl->packet, tpl->len);
 
-        //write last byte, 0
-        *mysql_handshake_payload = 0x00;
+        gw_generate_scramble(protocol->scramble, GW_MYSQL_SCRAMBLE_SIZE);
 
-        mysql_handshake_payload++;
+        // thread id, now put thePID
+        gw_mysql_set_byte4(outbuf + tpl->tid_offset, getpid() + dcb->fd);
+        memcpy(outbuf + tpl->scramble_offset1, protocol->scramble, 8);
+        memcpy(outbuf + tpl->scramble_offset2, protocol->scramble + 8, 12);
 
 	// writing data in the Client buffer queue
 	dcb->func.write(dcb, buf);
 
-	return sizeof(mysql_packet_header) + mysql_payload_size;
+	return tpl->len;
 }
 
 /**
@@ -370,9 +439,14 @@ MySQLSendHandshake(DCB* dcb)
  * The useful data: user, db, client_sha1 are copied into the MYSQL_session * dcb->session->data
  * client_capabilitiesa are copied into the dcb->protocol
  *
+ * A client of a listener with a TLS context may first send an SSL Request,
+ * the part of the Handshake Response before the user name, and send the
+ * full Handshake Response once the connection has switched to TLS.
+ *
  * @param dcb Descriptor Control Block of the client
  * @param queue The GWBUF with data from client
- * @return 0 for Authentication ok, !=0 for failed autht
+ * @return 0 for Authentication ok, 2 if the client is switching to TLS,
+ * other !=0 for failed autht
  *
  */
 
@@ -394,6 +468,30 @@ static int gw_mysql_do_authentication(DCB *dcb, GWBUF *queue) {
 
         protocol = DCB_PROTOCOL(dcb, MySQLProtocol);
         CHK_PROTOCOL(protocol);
+
+	if (dcb->tls_ctx != NULL && dcb->tls == NULL)
+	{
+		if (gwbuf_length(queue) == 4 + 4 + 4 + 1 + 23 &&
+			(gw_mysql_get_byte4(client_auth_packet + 4) &
+				GW_MYSQL_CAPABILITIES_SSL))
+		{
+			/**
+			 * The data after the SSL Request is the start of
+			 * the TLS handshake, it is not framed as packets.
+			 */
+			GWBUF *raw = dcb->dcb_readqueue;
+
+			dcb->dcb_readqueue = NULL;
+			protocol->protocol_frame_hdrlen = 0;
+			protocol->protocol_frame_left = 0;
+			protocol->protocol_frame_complete = 0;
+			return dcb_tls_accept(dcb, raw) == 0 ? 2 : 1;
+		}
+		if (dcb->tls_ctx->required)
+		{
+			return 1;
+		}
+	}
 	client_data = (MYSQL_session *)calloc(1, sizeof(MYSQL_session));
 	dcb->data = client_data; 
 
@@ -500,6 +598,12 @@ static int gw_mysql_do_authentication(DCB *dcb, GWBUF *queue) {
 int
 gw_MySQLWrite_client(DCB *dcb, GWBUF *queue)
 {
+        MySQLProtocol *protocol = (MySQLProtocol *)dcb->protocol;
+
+        if (protocol != NULL && protocol->protocol_stmt_prepare != NULL)
+        {
+                mysql_stmt_prepared(protocol, queue);
+        }
  	return dcb_write(dcb, queue);
 }
 
@@ -536,51 +640,24 @@ int gw_read_client_event(
                 goto return_rc;
         }        
         /** 
-         * if read queue existed appent read to it.
-         *   if length of read buffer is less than 3 or less than mysql packet
-         *   then return.
-         *   else copy mysql packets to separate buffers from read buffer and 
-         *   continue.
-         * else
-         *   if read queue didn't exist, length of read is less than 3 or less 
-         *   than mysql packet then 
-         *   create read queue and append to it and return.
-         *   if length read is less than mysql packet length append to read queue
-         *     append to it and return.
-         *   else (complete packet was read) continue.
+         * The framing of the protocol is advanced over the new data only,
+         * it remembers where the packet that was being read ends. Until
+         * a packet is complete the data waits in the read queue. Once
+         * there are complete packets they are taken from the read queue
+         * and a partial packet after them is left there.
          */
-        if (dcb->dcb_readqueue)
-        {
-                uint8_t* data = (uint8_t *)GWBUF_DATA(read_buffer);
-                
-                read_buffer = gwbuf_append(dcb->dcb_readqueue, read_buffer);
-                nbytes_read = gwbuf_length(read_buffer);
-                
-                if (nbytes_read < 3 || nbytes_read < MYSQL_GET_PACKET_LEN(data))
-                {
-                       rc = 0;
-                       goto return_rc;
-                }
-                else
-                {
-                        /** 
-                         * There is at least one complete mysql packet in
-                         * read_buffer. 
-                         */
-                        read_buffer = dcb->dcb_readqueue;
-                        dcb->dcb_readqueue = NULL;                        
-                }
-        }
-        else
+        gw_MySQL_frame_packets(protocol, read_buffer);
+        read_buffer = gwbuf_append(dcb->dcb_readqueue, read_buffer);
+        nbytes_read = protocol->protocol_frame_complete;
+        dcb->dcb_readqueue = read_buffer;
+        
+        if (nbytes_read == 0 ||
+                (read_buffer = gw_MySQL_frame_take(
+                                protocol, 
+                                &dcb->dcb_readqueue)) == NULL)
         {
-                uint8_t* data = (uint8_t *)GWBUF_DATA(read_buffer);
-
-                if (nbytes_read < 3 || nbytes_read < MYSQL_GET_PACKET_LEN(data)+4) 
-                {
-                        gwbuf_append(dcb->dcb_readqueue, read_buffer);
-                        rc = 0;
-                        goto return_rc;
-                }
+                rc = 0;
+                goto return_rc;
         }
         
         /**
@@ -591,11 +668,19 @@ int gw_read_client_event(
         case MYSQL_AUTH_SENT:
         {
                 int    auth_val = -1;
+                int    packet_number;
                                 
                 auth_val = gw_mysql_do_authentication(dcb, read_buffer);
                 read_buffer = gwbuf_consume(read_buffer, nbytes_read);
                 ss_dassert(read_buffer == NULL || GWBUF_EMPTY(read_buffer));
+                /*< The SSL Request took packet # 1 of a TLS connection */
+                packet_number = (dcb->tls != NULL) ? 3 : 2;
                 
+                if (auth_val == 2)
+                {
+                        /*< The Handshake Response follows over TLS */
+                        break;
+                }
                 if (auth_val == 0)
                 {
                         SESSION *session = NULL;
@@ -615,9 +700,10 @@ int gw_read_client_event(
                                 protocol->protocol_auth_state = MYSQL_IDLE;
                                 /** 
                                  * Send an AUTH_OK packet to the client, 
-                                 * packet sequence is # 2 
+                                 * packet sequence is # 2, or # 3 after
+                                 * the SSL Request
                                  */
-                                mysql_send_ok(dcb, 2, 0, NULL);
+                                mysql_send_ok(dcb, packet_number, 0, NULL);
                         } 
                         else 
                         {
@@ -633,7 +719,7 @@ int gw_read_client_event(
                                 /** Send ERR 1045 to client */
                                 mysql_send_auth_error(
                                         dcb,
-                                        2,
+                                        packet_number,
                                         0,
                                         "failed to create new session");
 
@@ -654,7 +740,7 @@ int gw_read_client_event(
                         /** Send ERR 1045 to client */
                         mysql_send_auth_error(
                                 dcb,
-                                2,
+                                packet_number,
                                 0,
                                 "Authorization failed");                        
 
@@ -668,6 +754,7 @@ int gw_read_client_event(
                 uint8_t  cap = 0;
                 uint8_t* payload = NULL; 
                 bool     stmt_input; /*< router input type */
+                bool     batch_input = false; /*< statements may be batched */
                 
                 ss_dassert(nbytes_read >= 5);
 
@@ -739,9 +826,12 @@ int gw_read_client_event(
                 {
                         stmt_input = false;
                 }
-                else if (cap == RCAP_TYPE_STMT_INPUT)
+                else if ((cap & ~RCAP_TYPE_BATCH_INPUT) == RCAP_TYPE_STMT_INPUT)
                 {
                         stmt_input = true;
+                        /** Every filter of the session must take batches too */
+                        batch_input = ((cap & RCAP_TYPE_BATCH_INPUT) &&
+                                       session->head.routeBatch != NULL);
                         /** Mark buffer to as MySQL type */
                         gwbuf_set_type(read_buffer, GWBUF_TYPE_MYSQL);
                 }
@@ -761,15 +851,17 @@ int gw_read_client_event(
                         goto return_rc;
                 }
                 
-                /** Route COM_QUIT to backend */
+                /** COM_QUIT closes the session */
                 if (MYSQL_IS_COM_QUIT(payload))
                 {
                         /** 
-                         * Sends COM_QUIT packets since buffer is already
-                         * created. A BREF_CLOSED flag is set so dcb_close won't
-                         * send redundant COM_QUIT.
+                         * COM_QUIT is not routed. The backends that are
+                         * closed with the session are sent one by dcb_close,
+                         * and the idle ones that the router returns to the
+                         * pool of their server are kept open for the next
+                         * session.
                          */
-                        SESSION_ROUTE_QUERY(session, read_buffer);
+                        gwbuf_consume(read_buffer, gwbuf_length(read_buffer));
                         /** 
                          * Close router session which causes closing of backends.
                          */
@@ -783,17 +875,17 @@ int gw_read_client_event(
                                  * Feed each statement completely and separately
                                  * to router.
                                  */
-                                rc = route_by_statement(session, read_buffer);
-                                
-                                if (read_buffer != NULL)
-                                {
-                                        /** add incomplete mysql packet to read queue */
-                                        gwbuf_append(dcb->dcb_readqueue, read_buffer);
-                                }
+                                rc = route_by_statement(session,
+                                                        read_buffer,
+                                                        batch_input);
                         }
                         else
                         {
                                 /** Feed whole packet to router */
+                                SESSION_TRACE_START(session, read_buffer);
+                                TRACEPOINT4(session__route, session, dcb,
+                                            TRACEPOINT_BUFLEN(read_buffer),
+                                            TRACEPOINT_COMMAND(read_buffer));
                                 rc = SESSION_ROUTE_QUERY(session, read_buffer);
                         }
                                        
@@ -920,14 +1012,24 @@ int gw_MySQLListener(
 	struct sockaddr *current_addr;
 	int  one = 1;
         int  rc;
+        int  taken = 0;
 
 	if (strchr(config_bind, '/')) {
 		char *tmp = strrchr(config_bind, ':');
 		if (tmp)
 			*tmp = '\0';
 
+		memset(&local_addr, 0, sizeof(local_addr));
+		local_addr.sun_family = AF_UNIX;
+		strncpy(local_addr.sun_path, config_bind, sizeof(local_addr.sun_path) - 1);
+
+		current_addr = (struct sockaddr *) &local_addr;
+
+		/*< The socket of the old MaxScale, its path must stay */
+		if ((l_so = handoff_take(current_addr, sizeof(local_addr))) >= 0)
+			taken = 1;
 		// UNIX socket create
-		if ((l_so = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		else if ((l_so = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
 			fprintf(stderr,
 				"\n* Error: can't create UNIX socket due "
 				"error %i, %s.\n\n\t",
@@ -935,11 +1037,6 @@ int gw_MySQLListener(
 				strerror(errno));
 			return 0;
 		}
-		memset(&local_addr, 0, sizeof(local_addr));
-		local_addr.sun_family = AF_UNIX;
-		strncpy(local_addr.sun_path, config_bind, sizeof(local_addr.sun_path) - 1);
-
-		current_addr = (struct sockaddr *) &local_addr;
 
 	} else {
 		/* MaxScale, as default, will bind on port 4406 */
@@ -947,8 +1044,12 @@ int gw_MySQLListener(
 			fprintf(stderr, "Error in parse_bindconfig for [%s]\n", config_bind);
 			return 0;
 		}
+		current_addr = (struct sockaddr *) &serv_addr;
+
+		if ((l_so = handoff_take(current_addr, sizeof(serv_addr))) >= 0)
+			taken = 1;
 		// TCP socket create
-		if ((l_so = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		else if ((l_so = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
 			fprintf(stderr,
 				"\n* Error: can't create socket due "
 				"error %i, %s.\n\n\t",
@@ -956,18 +1057,20 @@ int gw_MySQLListener(
 				strerror(errno));
 			return 0;
 		}
-
-		current_addr = (struct sockaddr *) &serv_addr;
 	}
 
 	listen_dcb->fd = -1;
 
-	// socket options
-	setsockopt(l_so, SOL_SOCKET, SO_REUSEADDR, (char *)&one, sizeof(one));
-
 	// set NONBLOCKING mode
 	setnonblocking(l_so);
 
+	/*< Bound and listening already, the backlog is set again */
+	if (taken)
+		goto listen_socket;
+
+	// socket options
+	setsockopt(l_so, SOL_SOCKET, SO_REUSEADDR, (char *)&one, sizeof(one));
+
 	/* get the right socket family for bind */
 	switch (current_addr->sa_family) {
 		case AF_UNIX:
@@ -988,6 +1091,9 @@ int gw_MySQLListener(
 			break;
 
 		case AF_INET:
+			/* allow per thread copies of the listener */
+			poll_reuseport(l_so);
+
 			if (bind(l_so, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
 				fprintf(stderr,
 					"\n* Bind failed due error %i, %s.\n",
@@ -1004,7 +1110,9 @@ int gw_MySQLListener(
 			return 0;
 	}
 
-        rc = listen(l_so, 10 * SOMAXCONN);
+listen_socket:
+        /*< The client waits for the handshake, no deferred accept */
+        rc = poll_listen(listen_dcb, l_so, 10 * SOMAXCONN, 0);
 
         if (rc == 0) {
                 fprintf(stderr,
@@ -1059,18 +1167,31 @@ int gw_MySQLAccept(DCB *listener)
         DCB                *client_dcb;
         MySQLProtocol      *protocol;
         int                c_sock;
-	struct sockaddr    client_conn;
-	socklen_t          client_len = sizeof(struct sockaddr_storage);
+	struct sockaddr_storage client_conn;
+	socklen_t          client_len;
         int                sendbuf = GW_BACKEND_SO_SNDBUF;
         socklen_t          optlen = sizeof(sendbuf);
         int                eno = 0;
         int                i = 0;
+        int                n_accepted = 0;
                 
         CHK_DCB(listener);
         
 	while (1) {
 
+                /**
+                 * Leave the other events of the thread a turn, the
+                 * listener is raised again for the connections left.
+                 */
+                if (n_accepted++ == GW_MYSQL_ACCEPT_BATCH)
+                {
+                        poll_rearm_dcb(listener);
+                        rc = 1;
+                        goto return_rc;
+                }
+
     retry_accept:
+                client_len = sizeof(client_conn);
 
 #if defined(SS_DEBUG)
                 if (fail_next_accept > 0)
@@ -1081,10 +1202,11 @@ int gw_MySQLAccept(DCB *listener)
                 } else {
                         fail_accept_errno = 0;          
 #endif /* SS_DEBUG */
-                        // new connection from client
-		        c_sock = accept(listener->fd,
-                                        (struct sockaddr *) &client_conn,
-                                        &client_len);
+                        // new connection from client, nonblocking already
+		        c_sock = accept4(listener->fd,
+                                         (struct sockaddr *) &client_conn,
+                                         &client_len,
+                                         SOCK_NONBLOCK | SOCK_CLOEXEC);
                         eno = errno;
                         errno = 0;
 #if defined(SS_DEBUG)
@@ -1166,9 +1288,7 @@ int gw_MySQLAccept(DCB *listener)
                         c_sock)));
                 conn_open[c_sock] = true;
 #endif
-                /* set nonblocking  */
                 setsockopt(c_sock, SOL_SOCKET, SO_SNDBUF, &sendbuf, optlen);
-                setnonblocking(c_sock);
                 
                 client_dcb = dcb_alloc(DCB_ROLE_REQUEST_HANDLER);
 
@@ -1183,10 +1303,12 @@ int gw_MySQLAccept(DCB *listener)
 		}
 
                 client_dcb->service = listener->session->service;
+                client_dcb->tls_ctx = listener->tls_ctx;
+                client_dcb->flags |= listener->flags & DCBF_COALESCE;
                 client_dcb->fd = c_sock;
 
 		// get client address
-		if ( client_conn.sa_family == AF_UNIX) 
+		if ( client_conn.ss_family == AF_UNIX) 
                 {
 			// client address
 			client_dcb->remote = strdup("localhost_from_socket");
@@ -1227,11 +1349,12 @@ int gw_MySQLAccept(DCB *listener)
                 client_dcb->protocol = protocol;
                 // assign function poiters to "func" field
                 memcpy(&client_dcb->func, &MyObject, sizeof(GWPROTOCOL));
-                //send handshake to the client_dcb
-                MySQLSendHandshake(client_dcb);
-
-                // client protocol state change
-                protocol->protocol_auth_state = MYSQL_AUTH_SENT;
+                /**
+                 * The handshake is sent once the client is admitted, the
+                 * client is in the poll set before so that a client that
+                 * gives up waiting is closed.
+                 */
+                protocol->protocol_auth_state = MYSQL_QUEUED;
 
                 /**
                  * Set new descriptor to event set. At the same time,
@@ -1271,6 +1394,39 @@ int gw_MySQLAccept(DCB *listener)
                                 client_dcb,
                                 client_dcb->fd)));
                 }
+
+                switch (serviceAdmitClient(client_dcb->service,
+                                           client_dcb,
+                                           gw_mysql_admit_client))
+                {
+                case SERVICE_ADMIT_NOW:
+                        gw_mysql_admit_client(client_dcb);
+                        break;
+
+                case SERVICE_ADMIT_QUEUED:
+                        LOGIF(LD, (skygw_log_write(
+                                LOGFILE_DEBUG,
+                                "%lu [gw_MySQLAccept] Client dcb %p of service "
+                                "%s waits for admission.",
+                                pthread_self(),
+                                client_dcb,
+                                client_dcb->service->name)));
+                        break;
+
+                default:
+                        mysql_send_custom_error(
+                                client_dcb,
+                                0,
+                                0,
+                                "Too many connections");
+                        LOGIF(LE, (skygw_log_write_flush(
+                                LOGFILE_ERROR,
+                                "Error : Client connection to service %s "
+                                "turned away, the admission queue is full.",
+                                client_dcb->service->name)));
+                        dcb_close(client_dcb);
+                        break;
+                }
         } /**< while 1 */
 #if defined(SS_DEBUG)
         if (rc == 0) {
@@ -1343,6 +1499,21 @@ gw_client_close(DCB *dcb)
                 /** Close router session and all its connections */
                 router->closeSession(router_instance, rsession);
         }
+        if (dcb->protocol != NULL)
+        {
+                MySQLProtocol* p = (MySQLProtocol *)dcb->protocol;
+                MYSQL_STMT*    stmt;
+
+                spinlock_acquire(&p->protocol_lock);
+                while ((stmt = p->protocol_stmts) != NULL)
+                {
+                        p->protocol_stmts = stmt->stmt_next;
+                        mysql_stmt_free(stmt);
+                }
+                mysql_stmt_free(p->protocol_stmt_prepare);
+                p->protocol_stmt_prepare = NULL;
+                spinlock_release(&p->protocol_lock);
+        }
 	return 1;
 }
 
@@ -1377,20 +1548,31 @@ gw_client_hangup_event(DCB *dcb)
 
 
 /**
- * Detect if buffer includes partial mysql packet or multiple packets.
- * Store partial packet to dcb_readqueue. Send complete packets one by one
- * to router.
+ * Send the complete packets of a buffer one by one to router. If the
+ * router and the filters of the session take batches, the packets are
+ * sent together as a chain with one packet in each buffer.
  * 
- * It is assumed readbuf includes at least one complete packet. 
- * Return 1 in success. If the last packet is incomplete return success but
- * leave incomplete packet to readbuf.
+ * The buffer holds only complete packets, a partial packet has been left
+ * to dcb_readqueue by the framing of the reads. A packet of a long payload
+ * may be a chain of buffers, see gw_MySQL_get_next_packet, it is sent by
+ * itself after the batch collected before it.
+ *
+ * A payload of 16MB or more is sent in packets of the maximum size and a
+ * shorter one that ends it. The packets after the first one are typed
+ * GWBUF_TYPE_FRAGMENT, the router passes them where it sent the first one.
+ * Return 1 in success.
  */
-static int route_by_statement(SESSION *session, GWBUF *readbuf)
+static int route_by_statement(
+        SESSION* session, 
+        GWBUF*   readbuf,
+        bool     batch_input)
 {
         int            rc = -1;
         GWBUF*         packetbuf;
+        GWBUF*         batch = NULL;
+        GWBUF*         batch_tail = NULL;
+        MySQLProtocol* protocol = (MySQLProtocol *)session->client->protocol;
 #if defined(SS_DEBUG)
-        gwbuf_type_t   prevtype;
         GWBUF*         tmpbuf;
         
         tmpbuf = readbuf;
@@ -1404,7 +1586,10 @@ static int route_by_statement(SESSION *session, GWBUF *readbuf)
         {
                 ss_dassert(GWBUF_IS_TYPE_MYSQL(readbuf));
                 
-                packetbuf = gw_MySQL_get_next_packet(&readbuf);
+                /** The packets that continue a long payload aren't copied */
+                packetbuf = protocol->protocol_frame_continues ?
+                        gw_MySQL_get_next_chain(&readbuf) :
+                        gw_MySQL_get_next_packet(&readbuf);
 
                 ss_dassert(GWBUF_IS_TYPE_MYSQL(packetbuf));
                 
@@ -1424,22 +1609,327 @@ static int route_by_statement(SESSION *session, GWBUF *readbuf)
                          * sure it is set to each (MySQL) packet.
                          */
                         gwbuf_set_type(packetbuf, GWBUF_TYPE_SINGLE_STMT);
-                        /** Route query */
-                        rc = SESSION_ROUTE_QUERY(session, packetbuf);
+
+                        if (protocol->protocol_frame_continues)
+                        {
+                                gwbuf_set_type(packetbuf, GWBUF_TYPE_FRAGMENT);
+                        }
+                        protocol->protocol_frame_continues = 
+                                (MYSQL_GET_PACKET_LEN((uint8_t *)GWBUF_DATA(packetbuf)) ==
+                                 0xffffff);
+                        mysql_stmt_decode(protocol, packetbuf);
+                        SESSION_TRACE_START(session, packetbuf);
+                        TRACEPOINT4(session__route, session, session->client,
+                                    TRACEPOINT_BUFLEN(packetbuf),
+                                    TRACEPOINT_COMMAND(packetbuf));
+
+                        if (batch_input && packetbuf->next != NULL)
+                        {
+                                /** A chain is routed by itself, in order */
+                                if (batch != NULL)
+                                {
+                                        rc = batch->next == NULL ?
+                                                SESSION_ROUTE_QUERY(session, batch) :
+                                                SESSION_ROUTE_BATCH(session, batch);
+                                        batch = NULL;
+                                        batch_tail = NULL;
+                                }
+                                rc = SESSION_ROUTE_QUERY(session, packetbuf);
+                        }
+                        else if (batch_input)
+                        {
+                                /** Collect the packets, they are routed together */
+                                if (batch_tail != NULL)
+                                {
+                                        batch_tail->next = packetbuf;
+                                }
+                                else
+                                {
+                                        batch = packetbuf;
+                                }
+                                batch_tail = packetbuf;
+                                rc = 1;
+                        }
+                        else
+                        {
+                                /** Route query */
+                                rc = SESSION_ROUTE_QUERY(session, packetbuf);
+                        }
                 }
                 else
                 {
-                        rc = 1;
+                        /** Only complete packets are left, copying one failed */
+                        gwbuf_consume(readbuf, gwbuf_length(readbuf));
+
+                        if (batch != NULL)
+                        {
+                                gwbuf_consume(batch, gwbuf_length(batch));
+                        }
+                        rc = 0;
                         goto return_rc;
                 }
         }
         while (readbuf != NULL);
+
+        if (batch != NULL)
+        {
+                if (batch->next == NULL)
+                {
+                        rc = SESSION_ROUTE_QUERY(session, batch);
+                }
+                else
+                {
+                        rc = SESSION_ROUTE_BATCH(session, batch);
+                }
+        }
         
 return_rc:
         return rc;
 }
 
 
+/**
+ * Decode a COM_STMT_* packet once for the router and the filters and attach
+ * the result to the packet buffer as the GWBUF_OBJ_STMT object. The client
+ * protocol keeps the prepared statements of the client, a COM_STMT_EXECUTE
+ * is given the parameter count and the query type of its prepared text and
+ * the parameter types the client bound last, as the client sends the types
+ * only when they change. Other packets are left as they are.
+ *
+ * @param protocol	The protocol of the client
+ * @param buf		The buffer of a single packet
+ */
+static void
+mysql_stmt_decode(
+        MySQLProtocol* protocol,
+        GWBUF*         buf)
+{
+        uint8_t*         data = (uint8_t *)GWBUF_DATA(buf);
+        size_t           len = GWBUF_LENGTH(buf);
+        MYSQL_STMT_INFO* si;
+        MYSQL_STMT*      stmt;
+        MYSQL_STMT**     pstmt;
+        size_t           nullen;
+        int              i;
+
+        /** A packet that continues a command, like a LOCAL INFILE, isn't one */
+        if (len < 5 ||
+                MYSQL_GET_PACKET_NO(data) != 0 ||
+                (data[4] != MYSQL_COM_STMT_PREPARE &&
+                data[4] != MYSQL_COM_STMT_EXECUTE &&
+                data[4] != MYSQL_COM_STMT_SEND_LONG_DATA &&
+                data[4] != MYSQL_COM_STMT_CLOSE &&
+                data[4] != MYSQL_COM_STMT_RESET &&
+                data[4] != MYSQL_COM_STMT_FETCH))
+        {
+                return;
+        }
+        /** Only the first buffer of a packet is decoded */
+        if (len > MYSQL_GET_PACKET_LEN(data) + 4)
+        {
+                len = MYSQL_GET_PACKET_LEN(data) + 4;
+        }
+        if ((data[4] != MYSQL_COM_STMT_PREPARE && len < 9) ||
+                (si = (MYSQL_STMT_INFO *)calloc(1, sizeof(MYSQL_STMT_INFO))) == NULL)
+        {
+                return;
+        }
+        si->si_command = data[4];
+        si->si_nparams = -1;
+
+        if (si->si_command == MYSQL_COM_STMT_PREPARE)
+        {
+                if ((stmt = (MYSQL_STMT *)calloc(1, sizeof(MYSQL_STMT))) == NULL)
+                {
+                        free(si);
+                        return;
+                }
+                /** The id and parameters come in the PREPARE_OK */
+                spinlock_acquire(&protocol->protocol_lock);
+                mysql_stmt_free(protocol->protocol_stmt_prepare);
+                protocol->protocol_stmt_prepare = stmt;
+                spinlock_release(&protocol->protocol_lock);
+                si->si_prepare = stmt;
+                goto attach;
+        }
+        si->si_id = gw_mysql_get_byte4(&data[5]);
+
+        spinlock_acquire(&protocol->protocol_lock);
+        for (pstmt = &protocol->protocol_stmts; *pstmt != NULL;
+             pstmt = &(*pstmt)->stmt_next)
+        {
+                if ((*pstmt)->stmt_id == si->si_id)
+                {
+                        break;
+                }
+        }
+        if ((stmt = *pstmt) != NULL)
+        {
+                si->si_nparams = stmt->stmt_nparams;
+                si->si_qtype = stmt->stmt_qtype;
+        }
+
+        switch (si->si_command) {
+        case MYSQL_COM_STMT_EXECUTE:
+                if (len < 14)
+                {
+                        break;
+                }
+                si->si_flags = data[9];
+                si->si_iterations = gw_mysql_get_byte4(&data[10]);
+
+                if (stmt == NULL || stmt->stmt_nparams <= 0)
+                {
+                        break;
+                }
+                /** NULL bitmap, new_params_bound_flag and the types */
+                nullen = (stmt->stmt_nparams + 7) / 8;
+
+                if (len < 14 + nullen + 1)
+                {
+                        break;
+                }
+                if ((si->si_nulls = (uint8_t *)malloc(nullen)) != NULL)
+                {
+                        memcpy(si->si_nulls, &data[14], nullen);
+                }
+                if (data[14 + nullen] == 1 &&
+                        len >= 15 + nullen + 2 * stmt->stmt_nparams &&
+                        (stmt->stmt_types != NULL ||
+                        (stmt->stmt_types = (uint16_t *)malloc(
+                                stmt->stmt_nparams * sizeof(uint16_t))) != NULL))
+                {
+                        for (i = 0; i < stmt->stmt_nparams; i++)
+                        {
+                                stmt->stmt_types[i] = gw_mysql_get_byte2(
+                                        &data[15 + nullen + 2 * i]);
+                        }
+                }
+                if (stmt->stmt_types != NULL &&
+                        (si->si_types = (uint16_t *)malloc(
+                                stmt->stmt_nparams * sizeof(uint16_t))) != NULL)
+                {
+                        memcpy(si->si_types,
+                               stmt->stmt_types,
+                               stmt->stmt_nparams * sizeof(uint16_t));
+                }
+                break;
+
+        case MYSQL_COM_STMT_FETCH:
+                if (len >= 13)
+                {
+                        si->si_rows = gw_mysql_get_byte4(&data[9]);
+                }
+                break;
+
+        case MYSQL_COM_STMT_SEND_LONG_DATA:
+                if (len >= 11)
+                {
+                        si->si_param = gw_mysql_get_byte2(&data[9]);
+                }
+                break;
+
+        case MYSQL_COM_STMT_CLOSE:
+                if (stmt != NULL)
+                {
+                        *pstmt = stmt->stmt_next;
+                        mysql_stmt_free(stmt);
+                }
+                break;
+
+        default:
+                break;
+        }
+        spinlock_release(&protocol->protocol_lock);
+
+attach:
+        if (!gwbuf_add_buffer_object(buf, GWBUF_OBJ_STMT, si, mysql_stmt_info_free))
+        {
+                mysql_stmt_info_free(si);
+        }
+}
+
+/**
+ * Look at a reply written to the client while a statement is being
+ * prepared. A PREPARE_OK is the first packet of the reply to its
+ * COM_STMT_PREPARE, it gives the statement its id and parameter count
+ * and the statement is added to the statements of the client. An error
+ * drops the statement.
+ *
+ * @param protocol	The protocol of the client
+ * @param queue		The data written to the client
+ */
+static void
+mysql_stmt_prepared(
+        MySQLProtocol* protocol,
+        GWBUF*         queue)
+{
+        uint8_t*    data;
+        MYSQL_STMT* stmt;
+
+        if (queue == NULL || GWBUF_LENGTH(queue) < 5)
+        {
+                return;
+        }
+        data = (uint8_t *)GWBUF_DATA(queue);
+
+        spinlock_acquire(&protocol->protocol_lock);
+        if ((stmt = protocol->protocol_stmt_prepare) == NULL ||
+                MYSQL_GET_PACKET_NO(data) != 1)
+        {
+                spinlock_release(&protocol->protocol_lock);
+                return;
+        }
+        protocol->protocol_stmt_prepare = NULL;
+
+        /** 0x00, id, columns, parameters, filler and warnings */
+        if (data[4] == 0x00 &&
+                MYSQL_GET_PACKET_LEN(data) == 12 &&
+                GWBUF_LENGTH(queue) >= 16)
+        {
+                stmt->stmt_id = gw_mysql_get_byte4(&data[5]);
+                stmt->stmt_nparams = gw_mysql_get_byte2(&data[11]);
+                stmt->stmt_next = protocol->protocol_stmts;
+                protocol->protocol_stmts = stmt;
+                stmt = NULL;
+        }
+        spinlock_release(&protocol->protocol_lock);
+        mysql_stmt_free(stmt);
+}
+
+/**
+ * Free the decoded statement attached to a buffer
+ *
+ * @param data	The MYSQL_STMT_INFO
+ */
+static void
+mysql_stmt_info_free(
+        void* data)
+{
+        MYSQL_STMT_INFO* si = (MYSQL_STMT_INFO *)data;
+
+        free(si->si_nulls);
+        free(si->si_types);
+        free(si);
+}
+
+/**
+ * Free a prepared statement of the client
+ *
+ * @param stmt	The statement or NULL
+ */
+static void
+mysql_stmt_free(
+        MYSQL_STMT* stmt)
+{
+        if (stmt != NULL)
+        {
+                free(stmt->stmt_types);
+                free(stmt);
+        }
+}
+
+
 /**
  * Create a character array including the query string. 
  * GWBUF given as input includes either one complete or partial query.
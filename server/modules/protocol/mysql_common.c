@@ -33,6 +33,9 @@
 #include <skygw_types.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
+#include <modutil.h>
+#include <querykill.h>
+#include <zlib.h>
 
 extern int lm_enabled_logfiles_bitmask;
 
@@ -41,6 +44,42 @@ extern int gw_write_backend_event(DCB *dcb);
 extern int gw_MySQLWrite_backend(DCB *dcb, GWBUF *queue);
 extern int gw_error_backend_event(DCB *dcb);
 
+/** Number of users@host in the authentication cache of a thread */
+#define MYSQL_AUTH_CACHE_SIZE 64
+
+/**
+ * The authentication data of a user@host found in a users' table. Once a
+ * client has authenticated, its SHA1(password) is kept too, so that the
+ * next connect with the same password is checked without the second SHA1.
+ */
+typedef struct {
+        int     version;                           /*< version of the users' table, 0 if unused */
+        in_addr_t addr;                            /*< the client address */
+        char    user[MYSQL_USER_MAXLEN + 1];       /*< the user name */
+        uint8_t stage2[SHA_DIGEST_LENGTH];         /*< SHA1(SHA1(password)) of the table */
+        bool    stage1_valid;                      /*< stage1 has been verified */
+        uint8_t stage1[SHA_DIGEST_LENGTH];         /*< SHA1(password) of the client */
+} MYSQL_AUTH_CACHE;
+
+/**
+ * The cache is kept in each thread so that no locking is needed, a connect
+ * is authenticated by the thread that reads the client.
+ */
+static __thread MYSQL_AUTH_CACHE *auth_cache = NULL;
+
+static MYSQL_AUTH_CACHE* auth_cache_entry(DCB* dcb, char* username);
+
+/** The zlib streams of the thread for the compressed protocol */
+static __thread z_stream *zdeflate = NULL;
+static __thread z_stream *zinflate = NULL;
+
+static z_stream* zstream_deflate(void);
+static z_stream* zstream_inflate(void);
+static GWBUF*    zframe_make(uint8_t* data, size_t len, uint8_t seq, int threshold);
+static size_t    zbuf_copy(GWBUF* buf, size_t offset, size_t len, uint8_t* dest);
+static GWBUF*    zbuf_consume(GWBUF* buf, size_t len);
+static GWBUF*    get_next_packet(GWBUF** p_readbuf, bool chain);
+
 static server_command_t* server_command_init(server_command_t* srvcmd,
                                              mysql_server_cmd_t cmd);
 
@@ -64,7 +103,7 @@ MySQLProtocol* mysql_protocol_init(
 {
         MySQLProtocol* p;
         
-	p = (MySQLProtocol *) calloc(1, sizeof(MySQLProtocol));
+	p = (MySQLProtocol *) dcb_protocol_alloc(dcb, sizeof(MySQLProtocol));
         ss_dassert(p != NULL);
         
         if (p == NULL) {
@@ -83,6 +122,12 @@ MySQLProtocol* mysql_protocol_init(
         p->protocol_command.scom_cmd = MYSQL_COM_UNDEFINED;
         p->protocol_command.scom_nresponse_packets = 0;
         p->protocol_command.scom_nbytes_to_read = 0;
+        p->protocol_frame_hdrlen = 0;
+        p->protocol_frame_left = 0;
+        p->protocol_frame_complete = 0;
+        p->protocol_reply.rs_state = MYSQL_REPLY_FIRST;
+        p->protocol_reply.rs_want = 4;
+        timer_init(&p->protocol_query_timer);
 #if defined(SS_DEBUG)
         p->protocol_chk_top = CHK_NUM_PROTOCOL;
         p->protocol_chk_tail = CHK_NUM_PROTOCOL;
@@ -318,6 +363,8 @@ int gw_decode_mysql_server_handshake(
 
 	// get capabilities part 2 (2 bytes)
 	memcpy(&(capab_ptr[2]), &mysql_server_capabilities_two, 2);
+	conn->server_capabilities = mysql_server_capabilities_one |
+		((uint32_t)mysql_server_capabilities_two << 16);
 
 	// 2 bytes shift 
 	payload+=2;
@@ -374,6 +421,19 @@ int gw_receive_backend_auth(
 
         n = dcb_read(dcb, &head);
 
+        /*< The reply to COM_CHANGE_USER of a compressed connection is in a frame */
+        if (n > 0 && protocol->protocol_compress)
+        {
+                if (gw_MySQL_decompress(protocol, &head) == -1)
+                {
+                        n = -1;
+                }
+                else if (head == NULL)
+                {
+                        n = 0;
+                }
+        }
+
         /*<
          * Read didn't fail and there is enough data for mysql packet.
          */
@@ -494,7 +554,7 @@ int gw_send_authentication_to_backend(
         uint8_t *passwd,
         MySQLProtocol *conn)
 {
-        int compress = 0;
+        int compress;
         int rv;
         uint8_t *payload = NULL;
         uint8_t *payload_start = NULL;
@@ -517,6 +577,9 @@ int gw_send_authentication_to_backend(
                 curr_passwd = passwd;
 
 	dcb = conn->owner_dcb;
+        /** The compressed protocol is used if both ends want it */
+        compress = (dcb->server != NULL && dcb->server->compress &&
+                    (conn->server_capabilities & GW_MYSQL_CAPABILITIES_COMPRESS));
 
 	// Zero the vars
 	memset(&server_capabilities, '\0', sizeof(server_capabilities));
@@ -566,6 +629,7 @@ int gw_send_authentication_to_backend(
         final_capabilities |= GW_MYSQL_CAPABILITIES_PLUGIN_AUTH;
 
         gw_mysql_set_byte4(client_capabilities, final_capabilities);
+        conn->client_capabilities = final_capabilities;
 
 	// Protocol MySQL HandshakeResponse for CLIENT_PROTOCOL_41
 	// 4 bytes capabilities + 4 bytes max packet size + 1 byte charset + 23 '\0' bytes
@@ -677,9 +741,12 @@ int gw_send_authentication_to_backend(
  *
  * This routine creates socket and connects to a backend server.
  * Connect it non-blocking operation. If connect fails, socket is closed.
+ * A server that has a Unix domain socket is connected through the socket,
+ * otherwise by TCP to the address the resolver keeps for the server, so
+ * the name is never looked up by the polling thread. TCP connections use TCP
+ * Fast Open if fastopen is set for the server.
  *
- * @param host The host to connect to
- * @param port The host TCP/IP port 
+ * @param server The server to connect to
  * @param *fd where connected fd is copied
  * @return 0/1 on success and -1 on failure
  * If succesful, fd has file descriptor to socket which is connected to
@@ -687,17 +754,38 @@ int gw_send_authentication_to_backend(
  *
  */
 int gw_do_connect_to_backend(
-        char          *host,
-        int           port,
+        SERVER        *server,
         int*          fd)
 {
 	struct sockaddr_in serv_addr;
+	struct sockaddr_un local_addr;
+	struct sockaddr    *addr;
+	socklen_t          addrlen;
+	char               peer[256];
 	int rv;
 	int so = 0;
         
-	memset(&serv_addr, 0, sizeof serv_addr);
-	serv_addr.sin_family = AF_INET;
-	so = socket(AF_INET,SOCK_STREAM,0);
+        if (server->socket != NULL)
+        {
+                memset(&local_addr, 0, sizeof local_addr);
+                local_addr.sun_family = AF_UNIX;
+                strncpy(local_addr.sun_path,
+                        server->socket,
+                        sizeof(local_addr.sun_path)-1);
+                addr = (struct sockaddr *)&local_addr;
+                addrlen = sizeof(local_addr);
+                snprintf(peer, sizeof(peer), "%s", server->socket);
+                so = socket(AF_UNIX, SOCK_STREAM, 0);
+        }
+        else
+        {
+                memset(&serv_addr, 0, sizeof serv_addr);
+                serv_addr.sin_family = AF_INET;
+                addr = (struct sockaddr *)&serv_addr;
+                addrlen = sizeof(serv_addr);
+                snprintf(peer, sizeof(peer), "%s:%d", server->name, server->port);
+                so = socket(AF_INET,SOCK_STREAM,0);
+        }
         
 	if (so < 0) {
                 int eno = errno;
@@ -705,21 +793,51 @@ int gw_do_connect_to_backend(
                 LOGIF(LE, (skygw_log_write_flush(
                         LOGFILE_ERROR,
                         "Error: Establishing connection to backend server "
-                        "%s:%d failed.\n\t\t             Socket creation failed "
+                        "%s failed.\n\t\t             Socket creation failed "
                         "due %d, %s.",
-                        host,
-                        port,
+                        peer,
                         eno,
                         strerror(eno))));
                 rv = -1;
                 goto return_rv;
 	}
 	/* prepare for connect */
-	setipaddress(&serv_addr.sin_addr, host);
-	serv_addr.sin_port = htons(port);
+        if (server->socket == NULL)
+        {
+                if (!server_resolve(server, &serv_addr.sin_addr))
+                {
+                        close(so);
+                        rv = -1;
+                        goto return_rv;
+                }
+                serv_addr.sin_port = htons(server->port);
+        }
 	/* set socket to as non-blocking here */
 	setnonblocking(so);
-        rv = connect(so, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
+#ifdef MSG_FASTOPEN
+        if (server->socket == NULL && server->fastopen)
+        {
+                /*<
+                 * The server speaks first, so there is no data for the SYN,
+                 * it carries the Fast Open cookie alone. A server that knows
+                 * the cookie accepts the connection when the SYN arrives and
+                 * sends its handshake without waiting for the final ACK.
+                 */
+                rv = sendto(so, NULL, 0, MSG_FASTOPEN, addr, addrlen);
+
+                /*< The kernel has no client Fast Open, connect as usual */
+                if (rv != 0 && errno == EOPNOTSUPP)
+                {
+                        rv = connect(so, addr, addrlen);
+                }
+        }
+        else
+        {
+                rv = connect(so, addr, addrlen);
+        }
+#else
+        rv = connect(so, addr, addrlen);
+#endif
 
         if (rv != 0) {
                 int eno = errno;
@@ -733,10 +851,9 @@ int gw_do_connect_to_backend(
                         
                         LOGIF(LE, (skygw_log_write_flush(
                                 LOGFILE_ERROR,
-                                "Error:  Failed to connect backend server %s:%d, "
+                                "Error:  Failed to connect backend server %s, "
                                 "due %d, %s.",
-                                host,
-                                port,
+                                peer,
                                 eno,
                                 strerror(eno))));
                         /*< Close newly created socket. */
@@ -760,10 +877,9 @@ int gw_do_connect_to_backend(
         LOGIF(LD, (skygw_log_write_flush(
                 LOGFILE_DEBUG,
                 "%lu [gw_do_connect_to_backend] Connected to backend server "
-                "%s:%d, fd %d.",
+                "%s, fd %d.",
                 pthread_self(),
-                host,
-                port,
+                peer,
                 so)));
 #if defined(SS_DEBUG)
         conn_open[so] = true;
@@ -868,44 +984,35 @@ int mysql_send_com_quit(
 }
 
 
+/**
+ * The head of the generic error packet, the payload length and the sequence
+ * number are patched in and the message follows it. The errno is 2003 and
+ * the state HY000.
+ */
+static const uint8_t mysql_err_template[] = {
+        0x00, 0x00, 0x00, 0x00,                 /*< payload length, sequence number */
+        0xff,                                   /*< field count */
+        0xd3, 0x07,                             /*< errno 2003 */
+        '#', 'H', 'Y', '0', '0', '0'            /*< sqlstate */
+};
+
 GWBUF* mysql_create_custom_error(
         int         packet_number,
         int         affected_rows,
         const char* msg)
 {
         uint8_t*     outbuf = NULL;
-        uint8_t      mysql_payload_size = 0;
-        uint8_t      mysql_packet_header[4];
-        uint8_t*     mysql_payload = NULL;
-        uint8_t      field_count = 0;
-        uint8_t      mysql_err[2];
-        uint8_t      mysql_statemsg[6];
-        unsigned int mysql_errno = 0;
-        const char*  mysql_error_msg = NULL;
-        const char*  mysql_state = NULL;
-        
-        GWBUF* errbuf = NULL;
-        
-        mysql_errno = 2003;
-        mysql_error_msg = "An errorr occurred ...";
-        mysql_state = "HY000";
-        
-        field_count = 0xff;
-        gw_mysql_set_byte2(mysql_err, mysql_errno);
-        mysql_statemsg[0]='#';
-        memcpy(mysql_statemsg+1, mysql_state, 5);
+        const char*  mysql_error_msg = "An errorr occurred ...";
+        size_t       msglen;
+        GWBUF*       errbuf = NULL;
         
         if (msg != NULL) {
                 mysql_error_msg = msg;
         }
-        
-        mysql_payload_size = sizeof(field_count) + 
-                                sizeof(mysql_err) + 
-                                sizeof(mysql_statemsg) + 
-                                strlen(mysql_error_msg);
+        msglen = strlen(mysql_error_msg);
         
         /** allocate memory for packet header + payload */
-        errbuf = gwbuf_alloc(sizeof(mysql_packet_header) + mysql_payload_size);
+        errbuf = gwbuf_alloc(sizeof(mysql_err_template) + msglen);
         ss_dassert(errbuf != NULL);
         
         if (errbuf == NULL)
@@ -914,29 +1021,13 @@ GWBUF* mysql_create_custom_error(
         }
         outbuf = GWBUF_DATA(errbuf);
         
-        /** write packet header and packet number */
-        gw_mysql_set_byte3(mysql_packet_header, mysql_payload_size);
-        mysql_packet_header[3] = packet_number;
-        
-        /** write header */
-        memcpy(outbuf, mysql_packet_header, sizeof(mysql_packet_header));
-        
-        mysql_payload = outbuf + sizeof(mysql_packet_header);
-        
-        /** write field */
-        memcpy(mysql_payload, &field_count, sizeof(field_count));
-        mysql_payload = mysql_payload + sizeof(field_count);
-        
-        /** write errno */
-        memcpy(mysql_payload, mysql_err, sizeof(mysql_err));
-        mysql_payload = mysql_payload + sizeof(mysql_err);
-        
-        /** write sqlstate */
-        memcpy(mysql_payload, mysql_statemsg, sizeof(mysql_statemsg));
-        mysql_payload = mysql_payload + sizeof(mysql_statemsg);
+        /** write the head, then patch in the length and packet number */
+        memcpy(outbuf, mysql_err_template, sizeof(mysql_err_template));
+        gw_mysql_set_byte3(outbuf, sizeof(mysql_err_template) - 4 + msglen);
+        outbuf[3] = packet_number;
         
         /** write error message */
-        memcpy(mysql_payload, mysql_error_msg, strlen(mysql_error_msg));
+        memcpy(outbuf + sizeof(mysql_err_template), mysql_error_msg, msglen);
 
         return errbuf;
 }
@@ -960,12 +1051,18 @@ int mysql_send_custom_error (
         const char *mysql_message) 
 {
         GWBUF* buf;
+        int    len;
 
         buf = mysql_create_custom_error(packet_number, in_affected_rows, mysql_message);
         
+        if (buf == NULL)
+        {
+                return 0;
+        }
+        len = GWBUF_LENGTH(buf);
         dcb->func.write(dcb, buf);
 
-        return GWBUF_LENGTH(buf);
+        return len;
 }
 
 /**
@@ -1170,6 +1267,8 @@ int gw_check_mysql_scramble_data(DCB *dcb, uint8_t *token, unsigned int token_le
 	char hex_double_sha1[2 * GW_MYSQL_SCRAMBLE_SIZE + 1]="";
 	uint8_t password[GW_MYSQL_SCRAMBLE_SIZE]="";
 	int ret_val = 1;
+	MYSQL_AUTH_CACHE *entry;
+	SERVICE *service = (SERVICE *)dcb->service;
 
 	if ((username == NULL) || (scramble == NULL) || (stage1_hash == NULL)) {
 		return 1;
@@ -1178,13 +1277,34 @@ int gw_check_mysql_scramble_data(DCB *dcb, uint8_t *token, unsigned int token_le
 	/*<
 	 * get the user's password from repository in SHA1(SHA1(real_password));
 	 * please note 'real_password' is unknown!
+	 * The cache of the thread has it if the user@host connected before
+	 * and the users' table hasn't changed since.
+	 * The read lock keeps the table from being replaced and freed
+	 * while it is in use.
 	 */
 
-	ret_val = gw_find_mysql_user_password_sha1(username, password, dcb);
+	brlock_read_acquire(&service->users_lock);
+	entry = auth_cache_entry(dcb, username);
 
-	if (ret_val) {
-		return 1;
+	if (entry != NULL && entry->version != 0) {
+		memcpy(password, entry->stage2, SHA_DIGEST_LENGTH);
+	} else {
+		ret_val = gw_find_mysql_user_password_sha1(username, password, dcb);
+
+		if (ret_val) {
+			brlock_read_release(&service->users_lock);
+			return 1;
+		}
+
+		if (entry != NULL) {
+			entry->version = service->users->version;
+			entry->addr = dcb->ipv4.sin_addr.s_addr;
+			strcpy(entry->user, username);
+			memcpy(entry->stage2, password, SHA_DIGEST_LENGTH);
+			entry->stage1_valid = false;
+		}
 	}
+	brlock_read_release(&service->users_lock);
 
 	if (token && token_len) {
 		/*<
@@ -1235,6 +1355,15 @@ int gw_check_mysql_scramble_data(DCB *dcb, uint8_t *token, unsigned int token_le
 	
 	memcpy(stage1_hash, step2, SHA_DIGEST_LENGTH);
 
+	/*<
+	 * SHA1(STEP2) was found to match before, the client used the same password
+	 */
+
+	if (entry != NULL && entry->stage1_valid &&
+		memcmp(entry->stage1, step2, SHA_DIGEST_LENGTH) == 0) {
+		return 0;
+	}
+
 	/*<
 	 * step 3: prepare the check_hash
 	 *	
@@ -1254,7 +1383,59 @@ int gw_check_mysql_scramble_data(DCB *dcb, uint8_t *token, unsigned int token_le
 #endif
 
 	/* now compare SHA1(SHA1(gateway_password)) and check_hash: return 0 is MYSQL_AUTH_OK */
-	return memcmp(password, check_hash, SHA_DIGEST_LENGTH);
+	ret_val = memcmp(password, check_hash, SHA_DIGEST_LENGTH);
+
+	if (ret_val == 0 && entry != NULL) {
+		memcpy(entry->stage1, step2, SHA_DIGEST_LENGTH);
+		entry->stage1_valid = true;
+	}
+
+	return ret_val;
+}
+
+/**
+ * auth_cache_entry
+ *
+ * Find the entry of a user@host in the authentication cache of the calling
+ * thread. The cache is direct mapped, an entry that holds another user@host
+ * or the data of an older users' table is cleared for the caller to fill.
+ *
+ * @param dcb		The client DCB
+ * @param username	The user name
+ * @return The entry, its version is 0 if the data has to be looked up, or
+ * NULL if the user can't be cached
+ *
+ */
+static MYSQL_AUTH_CACHE *auth_cache_entry(DCB *dcb, char *username) {
+	SERVICE *service = (SERVICE *)dcb->service;
+	MYSQL_AUTH_CACHE *entry;
+	in_addr_t addr = dcb->ipv4.sin_addr.s_addr;
+	unsigned int hash = addr;
+	char *ptr;
+
+	if (service == NULL || service->users == NULL ||
+		strlen(username) > MYSQL_USER_MAXLEN) {
+		return NULL;
+	}
+
+	if (auth_cache == NULL &&
+		(auth_cache = calloc(MYSQL_AUTH_CACHE_SIZE, sizeof(MYSQL_AUTH_CACHE))) == NULL) {
+		return NULL;
+	}
+
+	for (ptr = username; *ptr; ptr++) {
+		hash = hash * 31 + (unsigned char)*ptr;
+	}
+	entry = &auth_cache[hash % MYSQL_AUTH_CACHE_SIZE];
+
+	if (entry->version != service->users->version ||
+		entry->addr != addr ||
+		strcmp(entry->user, username) != 0) {
+		entry->version = 0;
+		entry->stage1_valid = false;
+	}
+
+	return entry;
 }
 
 /**
@@ -1271,6 +1452,8 @@ int gw_check_mysql_scramble_data(DCB *dcb, uint8_t *token, unsigned int token_le
  * @param dcb			Current DCB
  * @return 1 if user is not found or 0 if the user exists
  *
+ * The caller holds the read lock of dcb->service->users_lock.
+ *
  */
 
 int gw_find_mysql_user_password_sha1(char *username, uint8_t *gateway_password, DCB *dcb) {
@@ -1282,6 +1465,7 @@ int gw_find_mysql_user_password_sha1(char *username, uint8_t *gateway_password,
 	service = (SERVICE *) dcb->service;
 	client = (struct sockaddr_in *) &dcb->ipv4;
 
+	memset(&key, 0, sizeof(key));
 	key.user = username;
 	memcpy(&key.ipv4, client, sizeof(struct sockaddr_in));
 
@@ -1316,21 +1500,20 @@ int gw_find_mysql_user_password_sha1(char *username, uint8_t *gateway_password,
 			return 1;
 		}
 	
-		/* 2) Continue and check for wildcard host, user@%
+		/* 2) Continue and check the wildcard hosts, from the
+		 * most specific one to user@%
 		 * Return 1 if no match
 		 */
 
-		memset(&key.ipv4, 0, sizeof(struct sockaddr_in));
-
 		LOGIF(LD,
 			(skygw_log_write_flush(
 				LOGFILE_DEBUG,
-				"%lu [MySQL Client Auth], checking user [%s@%s] with wildcard host [%%]",
+				"%lu [MySQL Client Auth], checking user [%s@%s] with wildcard hosts",
 				pthread_self(),
 				key.user,
 				dcb->remote)));
 
-		user_password = mysql_users_fetch(service->users, &key);
+		user_password = mysql_users_fetch_wildcard(service->users, &key);
      
 		if (!user_password) {
 			/* the user@% was not found.
@@ -1456,22 +1639,140 @@ mysql_send_auth_error (
 }
 
 
+/**
+ * Take a packet that spans buffers from the head of a chain without copying
+ * its payload. The buffers that the packet fills are moved to the returned
+ * chain and the buffer where it ends is cloned. The header and the command
+ * byte are copied to a buffer of their own if the first buffer is shorter,
+ * the routers look at them in the first buffer.
+ *
+ * @param p_readbuf	The chain, left with what follows the packet
+ * @param packetlen	The length of the packet with its header
+ * @return		The packet or NULL if memory could not be allocated
+ */
+static GWBUF* packet_chain(
+        GWBUF** p_readbuf,
+        size_t  packetlen)
+{
+        GWBUF*  readbuf = *p_readbuf;
+        GWBUF*  head = NULL;
+        GWBUF*  tail = NULL;
+        GWBUF*  part;
+        size_t  nhead = MIN(packetlen, 5);
+        size_t  n;
+
+        if (GWBUF_LENGTH(readbuf) < nhead)
+        {
+                size_t ncopied = 0;
+
+                if ((head = gwbuf_alloc(nhead)) == NULL)
+                {
+                        return NULL;
+                }
+                head->gwbuf_type = readbuf->gwbuf_type;
+
+                while (ncopied < nhead)
+                {
+                        n = MIN(GWBUF_LENGTH(readbuf), nhead - ncopied);
+                        memcpy((uint8_t *)GWBUF_DATA(head) + ncopied,
+                               GWBUF_DATA(readbuf),
+                               n);
+                        readbuf = gwbuf_consume(readbuf, n);
+                        ncopied += n;
+                }
+                packetlen -= nhead;
+                tail = head;
+        }
+
+        while (packetlen > 0 && packetlen >= GWBUF_LENGTH(readbuf))
+        {
+                GWBUF* next = readbuf->next;
+
+                packetlen -= GWBUF_LENGTH(readbuf);
+                readbuf->next = NULL;
+
+                if (tail != NULL)
+                {
+                        tail->next = readbuf;
+                }
+                else
+                {
+                        head = readbuf;
+                }
+                tail = readbuf;
+                readbuf = next;
+        }
+
+        if (packetlen > 0)
+        {
+                if ((part = gwbuf_clone_portion(readbuf, 0, packetlen)) == NULL)
+                {
+                        *p_readbuf = readbuf;
+                        gwbuf_consume(head, gwbuf_length(head));
+                        return NULL;
+                }
+                GWBUF_CONSUME(readbuf, packetlen);
+                tail->next = part;
+        }
+        *p_readbuf = readbuf;
+
+        return head;
+}
+
 /**
  * Buffer contains at least one of the following:
  * complete [complete] [partial] mysql packet
+ *
+ * A packet in the first buffer is cloned from it. A packet that spans
+ * buffers is copied, unless it is of the maximum size and a payload of 16MB
+ * or more continues in the packets after it. It is then returned as a
+ * chain of the buffers it was read to, see packet_chain, and so are the
+ * packets that continue it with gw_MySQL_get_next_chain. The length of the
+ * chain is looked at only as far as the packet reaches.
  * 
  * return pointer to gwbuf containing a complete packet or
  *   NULL if no complete packet was found.
  */
 GWBUF* gw_MySQL_get_next_packet(
         GWBUF** p_readbuf)
+{
+        return get_next_packet(p_readbuf, false);
+}
+
+/**
+ * Take the next complete packet as gw_MySQL_get_next_packet does, but as a
+ * chain of the buffers it was read to if it spans buffers, it is never
+ * copied. Used for the packets that continue a payload of 16MB or more.
+ *
+ * return pointer to gwbuf containing a complete packet or
+ *   NULL if no complete packet was found.
+ */
+GWBUF* gw_MySQL_get_next_chain(
+        GWBUF** p_readbuf)
+{
+        return get_next_packet(p_readbuf, true);
+}
+
+/**
+ * Take the next complete packet from the head of a chain, see
+ * gw_MySQL_get_next_packet.
+ *
+ * @param p_readbuf	The chain, left with what follows the packet
+ * @param chain		Take a packet that spans buffers without copying it
+ * @return		The packet or NULL if no complete packet was found
+ */
+static GWBUF* get_next_packet(
+        GWBUF** p_readbuf,
+        bool    chain)
 {
         GWBUF*   packetbuf;
         GWBUF*   readbuf;
+        GWBUF*   buf;
         size_t   buflen;
         size_t   packetlen;
-        size_t   totalbuflen;
-        uint8_t* data;
+        size_t   nbytes;
+        uint8_t  hdr[3];
+        int      i;
         readbuf = *p_readbuf;
 
         if (readbuf == NULL)
@@ -1487,52 +1788,77 @@ GWBUF* gw_MySQL_get_next_packet(
                 goto return_packetbuf;
         }
         
-        buflen      = GWBUF_LENGTH((readbuf));
-        totalbuflen = gwbuf_length(readbuf);
-        data        = (uint8_t *)GWBUF_DATA((readbuf));
-        packetlen   = MYSQL_GET_PACKET_LEN(data)+4;
+        buflen = GWBUF_LENGTH((readbuf));
+        /** The packet length may be split between buffers */
+        for (buf = readbuf, i = 0; buf != NULL && i < 3; buf = buf->next)
+        {
+                uint8_t* data = (uint8_t *)GWBUF_DATA(buf);
 
-        /** packet is incomplete */
-        if (packetlen > totalbuflen)
+                for (nbytes = 0; nbytes < GWBUF_LENGTH(buf) && i < 3; nbytes++)
+                {
+                        hdr[i++] = data[nbytes];
+                }
+        }
+        
+        if (i < 3)
         {
                 packetbuf = NULL;
                 goto return_packetbuf;
         }
-        /** there is one complete packet in the buffer */
-        if (packetlen == buflen)
+        packetlen = MYSQL_GET_PACKET_LEN(hdr)+4;
+
+        /** the packet is in the first buffer */
+        if (packetlen <= buflen)
         {
                 packetbuf = gwbuf_clone_portion(readbuf, 0, packetlen);
                 *p_readbuf = gwbuf_consume(readbuf, packetlen);
                 goto return_packetbuf;
         }
+
+        for (buf = readbuf, nbytes = 0; 
+             buf != NULL && nbytes < packetlen;
+             buf = buf->next)
+        {
+                nbytes += GWBUF_LENGTH(buf);
+        }
+        
+        /** packet is incomplete */
+        if (nbytes < packetlen)
+        {
+                packetbuf = NULL;
+                goto return_packetbuf;
+        }
+        if (chain || packetlen == 0xffffff + 4)
+        {
+                packetbuf = packet_chain(p_readbuf, packetlen);
+                goto return_packetbuf;
+        }
         /**
          * Packet spans multiple buffers. 
          * Allocate buffer for complete packet
          * copy packet parts into it and consume copied bytes
          */        
-        else if (packetlen > buflen)
+        if ((packetbuf = gwbuf_alloc(packetlen)) != NULL)
         {
                 size_t   nbytes_copied = 0;
-                uint8_t* target;
+                uint8_t* target = GWBUF_DATA(packetbuf);
                 
-                packetbuf = gwbuf_alloc(packetlen);
-                target    = GWBUF_DATA(packetbuf);
+                packetbuf->gwbuf_type = readbuf->gwbuf_type;
 
                 while (nbytes_copied < packetlen)
                 {
-                        uint8_t* src = GWBUF_DATA(readbuf);
-                        size_t   buflen = GWBUF_LENGTH(readbuf);
+                        size_t n = GWBUF_LENGTH(readbuf);
 
-                        memcpy(target+nbytes_copied, src, buflen);
-                        *p_readbuf = gwbuf_consume(readbuf, buflen);
-                        nbytes_copied += buflen;
+                        if (n > packetlen - nbytes_copied)
+                        {
+                                n = packetlen - nbytes_copied;
+                        }
+                        memcpy(target+nbytes_copied, GWBUF_DATA(readbuf), n);
+                        readbuf = gwbuf_consume(readbuf, n);
+                        nbytes_copied += n;
                 }
                 ss_dassert(nbytes_copied == packetlen);
-        }
-        else
-        {
-                packetbuf = gwbuf_clone_portion(readbuf, 0, packetlen);
-                *p_readbuf = gwbuf_consume(readbuf, packetlen);
+                *p_readbuf = readbuf;
         }
         
 return_packetbuf:
@@ -1561,82 +1887,1360 @@ GWBUF* gw_MySQL_get_packets(
         return targetbuf;
 }
 
-
-static server_command_t* server_command_init(
-        server_command_t* srvcmd,
-        mysql_server_cmd_t cmd)
+/**
+ * Advance the packet framing of a connection over newly read data.
+ *
+ * The protocol remembers the header of the packet being read and how many
+ * of its bytes are still to come, so only the headers of the new data are
+ * examined and the data read earlier is never scanned again.
+ *
+ * @param p     The protocol of the connection
+ * @param buf   The new data, it continues the packets read earlier
+ * @return      The number of bytes of complete packets not yet taken
+ */
+size_t gw_MySQL_frame_packets(
+        MySQLProtocol* p,
+        GWBUF*         buf)
 {
-        server_command_t* c;
-        
-        if (srvcmd != NULL)
-        {
-                c = srvcmd;
-        }
-        else
+        for (; buf != NULL; buf = buf->next)
         {
-                c = (server_command_t *)malloc(sizeof(server_command_t));
-        }
-        c->scom_cmd = cmd;
-        c->scom_nresponse_packets = -1;
-        c->scom_nbytes_to_read = 0;
-        c->scom_next = NULL;
-        
-        return c;
-}
+                uint8_t* ptr = (uint8_t *)GWBUF_DATA(buf);
+                uint8_t* end = ptr + GWBUF_LENGTH(buf);
 
-static server_command_t* server_command_copy(
-        server_command_t* srvcmd)
-{
-        server_command_t* c = 
-                (server_command_t *)malloc(sizeof(server_command_t));
-        *c = *srvcmd;
-        
-        return c;
-}
+                while (ptr < end)
+                {
+                        if (p->protocol_frame_hdrlen < 4)
+                        {
+                                p->protocol_frame_hdr[p->protocol_frame_hdrlen++] = *ptr++;
 
-#define MAX_CMD_HISTORY 10
+                                if (p->protocol_frame_hdrlen == 4)
+                                {
+                                        p->protocol_frame_left = 
+                                                MYSQL_GET_PACKET_LEN(p->protocol_frame_hdr);
+                                }
+                        }
+                        else
+                        {
+                                size_t n = end - ptr;
+
+                                if (n > p->protocol_frame_left)
+                                {
+                                        n = p->protocol_frame_left;
+                                }
+                                ptr += n;
+                                p->protocol_frame_left -= n;
+                        }
+                        
+                        if (p->protocol_frame_hdrlen == 4 && 
+                                p->protocol_frame_left == 0)
+                        {
+                                p->protocol_frame_complete += 
+                                        MYSQL_GET_PACKET_LEN(p->protocol_frame_hdr)+4;
+                                p->protocol_frame_hdrlen = 0;
+                        }
+                }
+        }
+        return p->protocol_frame_complete;
+}
 
-void protocol_archive_srv_command(
-        MySQLProtocol* p)
+/**
+ * Take the complete packets framed by gw_MySQL_frame_packets from the
+ * head of a buffer chain. The buffers that hold only complete packets are
+ * moved to the returned chain as they are and the buffer where the last
+ * complete packet ends is cloned, no data is copied.
+ *
+ * @param p             The protocol of the connection
+ * @param p_readbuf     The read buffer chain, left with the partial packet
+ * @return              The chain of complete packets or NULL if there are none
+ */
+GWBUF* gw_MySQL_frame_take(
+        MySQLProtocol* p,
+        GWBUF**        p_readbuf)
 {
-        server_command_t*  s1;
-        server_command_t** s2;
-        int                len;
+        GWBUF* head = *p_readbuf;
+        GWBUF* tail = NULL;
+        GWBUF* buf  = head;
+        GWBUF* part = NULL;
+        size_t nbytes = p->protocol_frame_complete;
         
-        spinlock_acquire(&p->protocol_lock);
-        
-        s1 = &p->protocol_command;
-        
-        LOGIF(LT, (skygw_log_write(
-                LOGFILE_TRACE,
-                "Move command %s from fd %d to command history.",
-                STRPACKETTYPE(s1->scom_cmd), 
-                p->owner_dcb->fd)));
+        if (nbytes == 0)
+        {
+                return NULL;
+        }
         
-        /** Copy to history list */
-        s2 = &p->protocol_cmd_history;
+        while (buf != NULL && nbytes >= GWBUF_LENGTH(buf))
+        {
+                nbytes -= GWBUF_LENGTH(buf);
+                tail = buf;
+                buf = buf->next;
+        }
+        ss_dassert(nbytes == 0 || buf != NULL);
         
-        if (*s2 != NULL)
+        if (nbytes > 0)
         {
-                len = 0;
-                
-                while ((*s2)->scom_next != NULL)
+                if ((part = gwbuf_clone_portion(buf, 0, nbytes)) == NULL)
                 {
-                        *s2 = (*s2)->scom_next;
-                        len += 1;
+                        return NULL;
                 }
+                GWBUF_CONSUME(buf, nbytes);
         }
-        *s2 = server_command_copy(s1);
         
-        /** Keep history limits, remove oldest */
-        if (len > MAX_CMD_HISTORY)
+        if (tail != NULL)
         {
-                server_command_t* c = p->protocol_cmd_history;
-                p->protocol_cmd_history = p->protocol_cmd_history->scom_next;
-                free(c);
+                tail->next = part;
         }
-        
-        /** Remove from command list */
+        else
+        {
+                head = part;
+        }
+        *p_readbuf = buf;
+        p->protocol_frame_complete = 0;
+        
+        return head;
+}
+
+/**
+ * Return the zlib stream of the thread for compressing, the stream is
+ * reset for a new frame. Each frame of the compressed protocol is
+ * compressed on its own, so one stream in each thread serves all the
+ * connections and no connection pays for the state of a stream.
+ *
+ * @return The stream or NULL if it could not be initialised
+ */
+static z_stream* zstream_deflate(void)
+{
+        if (zdeflate == NULL)
+        {
+                z_stream* z = (z_stream *)calloc(1, sizeof(z_stream));
+                
+                if (z == NULL || deflateInit(z, Z_DEFAULT_COMPRESSION) != Z_OK)
+                {
+                        free(z);
+                        return NULL;
+                }
+                zdeflate = z;
+        }
+        else
+        {
+                deflateReset(zdeflate);
+        }
+        return zdeflate;
+}
+
+/**
+ * Return the zlib stream of the thread for decompressing, the stream is
+ * reset for a new frame.
+ *
+ * @return The stream or NULL if it could not be initialised
+ */
+static z_stream* zstream_inflate(void)
+{
+        if (zinflate == NULL)
+        {
+                z_stream* z = (z_stream *)calloc(1, sizeof(z_stream));
+                
+                if (z == NULL || inflateInit(z) != Z_OK)
+                {
+                        free(z);
+                        return NULL;
+                }
+                zinflate = z;
+        }
+        else
+        {
+                inflateReset(zinflate);
+        }
+        return zinflate;
+}
+
+/**
+ * Make a frame of the compressed protocol. Data shorter than the threshold,
+ * and data that doesn't get shorter, is put to the frame as it is.
+ *
+ * @param data          The packets of the frame
+ * @param len           The number of bytes, at most MYSQL_COMPRESS_MAXFRAME
+ * @param seq           The sequence number of the frame
+ * @param threshold     The number of bytes below which data isn't compressed
+ * @return The frame or NULL if memory could not be allocated
+ */
+static GWBUF* zframe_make(
+        uint8_t* data,
+        size_t   len,
+        uint8_t  seq,
+        int      threshold)
+{
+        GWBUF*    frame = NULL;
+        uint8_t*  hdr;
+        z_stream* z;
+        uLong     bound;
+        
+        if (len >= (size_t)threshold && (z = zstream_deflate()) != NULL)
+        {
+                bound = deflateBound(z, len);
+                
+                if ((frame = gwbuf_alloc(MYSQL_COMPRESS_HDRLEN + bound)) != NULL)
+                {
+                        hdr = (uint8_t *)GWBUF_DATA(frame);
+                        z->next_in = data;
+                        z->avail_in = len;
+                        z->next_out = hdr + MYSQL_COMPRESS_HDRLEN;
+                        z->avail_out = bound;
+                        
+                        if (deflate(z, Z_FINISH) == Z_STREAM_END &&
+                                z->total_out < len)
+                        {
+                                GWBUF_RTRIM(frame, bound - z->total_out);
+                                gw_mysql_set_byte3(hdr, z->total_out);
+                                gw_mysql_set_byte3(&hdr[4], len);
+                        }
+                        else
+                        {
+                                gwbuf_free(frame);
+                                frame = NULL;
+                        }
+                }
+        }
+        
+        if (frame == NULL)
+        {
+                if ((frame = gwbuf_alloc(MYSQL_COMPRESS_HDRLEN + len)) == NULL)
+                {
+                        return NULL;
+                }
+                hdr = (uint8_t *)GWBUF_DATA(frame);
+                memcpy(hdr + MYSQL_COMPRESS_HDRLEN, data, len);
+                gw_mysql_set_byte3(hdr, len);
+                gw_mysql_set_byte3(&hdr[4], 0);
+        }
+        hdr[3] = seq;
+        
+        return frame;
+}
+
+/**
+ * Copy bytes from a buffer chain.
+ *
+ * @param buf           The buffer chain
+ * @param offset        The offset of the first byte to copy
+ * @param len           The number of bytes to copy
+ * @param dest          Where the bytes are copied
+ * @return The number of bytes copied, less than len if the chain is shorter
+ */
+static size_t zbuf_copy(
+        GWBUF*   buf,
+        size_t   offset,
+        size_t   len,
+        uint8_t* dest)
+{
+        size_t ncopied = 0;
+        
+        for (; buf != NULL && ncopied < len; buf = buf->next)
+        {
+                size_t buflen = GWBUF_LENGTH(buf);
+                size_t n;
+                
+                if (offset >= buflen)
+                {
+                        offset -= buflen;
+                        continue;
+                }
+                n = MIN(buflen - offset, len - ncopied);
+                memcpy(dest + ncopied, (uint8_t *)GWBUF_DATA(buf) + offset, n);
+                ncopied += n;
+                offset = 0;
+        }
+        return ncopied;
+}
+
+/**
+ * Consume bytes from the head of a buffer chain, the buffers that are
+ * emptied are freed.
+ *
+ * @param buf   The buffer chain
+ * @param len   The number of bytes to consume
+ * @return The rest of the chain
+ */
+static GWBUF* zbuf_consume(
+        GWBUF* buf,
+        size_t len)
+{
+        while (buf != NULL && len > 0)
+        {
+                size_t n = MIN(len, GWBUF_LENGTH(buf));
+                
+                len -= n;
+                buf = gwbuf_consume(buf, n);
+        }
+        return buf;
+}
+
+/**
+ * Put the packets written to a backend to frames of the compressed protocol.
+ *
+ * The frames hold whole packets, a packet that doesn't fit in the frame
+ * starts the next one and only a packet longer than a frame is split. The
+ * server takes a frame that starts with a command to start from sequence
+ * number 0, any other frame continues from the last frame the server
+ * sent. A partial packet at the end of the data is kept in the protocol
+ * until the rest of it is written.
+ *
+ * Writes to a backend are done in the order the packets are to be sent.
+ *
+ * @param p             The protocol of the backend connection
+ * @param queue         The packets, replaced by the frames or NULL if the
+ *                      data was all kept for the next write
+ * @param threshold     The number of bytes below which data isn't compressed
+ * @return 1 on success, 0 if memory could not be allocated
+ */
+int gw_MySQL_compress(
+        MySQLProtocol* p,
+        GWBUF**        queue,
+        int            threshold)
+{
+        GWBUF*   buf;
+        GWBUF*   frames = NULL;
+        GWBUF*   frame;
+        uint8_t* data;
+        size_t   len;
+        size_t   pos = 0;
+        int      rc = 1;
+
+        spinlock_acquire(&p->protocol_lock);
+        buf = gwbuf_append(p->protocol_zpending, *queue);
+        p->protocol_zpending = NULL;
+        *queue = NULL;
+        
+        if (buf == NULL)
+        {
+                goto return_rc;
+        }
+        /** Frames are made of contiguous data */
+        if (buf->next != NULL)
+        {
+                GWBUF* flat;
+                
+                len = gwbuf_length(buf);
+                
+                if ((flat = gwbuf_alloc(len)) == NULL)
+                {
+                        zbuf_consume(buf, len);
+                        rc = 0;
+                        goto return_rc;
+                }
+                zbuf_copy(buf, 0, len, GWBUF_DATA(flat));
+                zbuf_consume(buf, len);
+                buf = flat;
+        }
+        data = GWBUF_DATA(buf);
+        len = GWBUF_LENGTH(buf);
+        
+        while (pos + 4 <= len && pos + 4 + MYSQL_GET_PACKET_LEN(&data[pos]) <= len)
+        {
+                size_t  start = pos;
+                size_t  end = pos + 4 + MYSQL_GET_PACKET_LEN(&data[pos]);
+                uint8_t seq = (data[pos+3] == 0 ? 0 : p->protocol_zseq);
+                
+                if (end - start > MYSQL_COMPRESS_MAXFRAME)
+                {
+                        end = start + MYSQL_COMPRESS_MAXFRAME;
+                }
+                else
+                {
+                        /** Add the packets that fit in the frame whole */
+                        while (end + 4 <= len)
+                        {
+                                size_t next = end + 4 + 
+                                        MYSQL_GET_PACKET_LEN(&data[end]);
+                                
+                                if (next > len ||
+                                        next - start > MYSQL_COMPRESS_MAXFRAME)
+                                {
+                                        break;
+                                }
+                                end = next;
+                        }
+                }
+                /** The rest of a long packet goes to the next frames */
+                while (1)
+                {
+                        if ((frame = zframe_make(&data[start],
+                                                 end - start,
+                                                 seq,
+                                                 threshold)) == NULL)
+                        {
+                                rc = 0;
+                                break;
+                        }
+                        frames = gwbuf_append(frames, frame);
+                        p->protocol_zseq = seq = seq + 1;
+                        
+                        if (end >= pos + 4 + MYSQL_GET_PACKET_LEN(&data[pos]))
+                        {
+                                break;
+                        }
+                        start = end;
+                        end = MIN(start + MYSQL_COMPRESS_MAXFRAME, 
+                                  pos + 4 + MYSQL_GET_PACKET_LEN(&data[pos]));
+                }
+                if (rc == 0)
+                {
+                        break;
+                }
+                pos = end;
+        }
+        
+        if (rc == 0)
+        {
+                while (frames != NULL)
+                {
+                        frames = gwbuf_consume(frames, GWBUF_LENGTH(frames));
+                }
+                gwbuf_free(buf);
+        }
+        else if (pos < len)
+        {
+                GWBUF_CONSUME(buf, pos);
+                p->protocol_zpending = buf;
+        }
+        else
+        {
+                gwbuf_free(buf);
+        }
+        *queue = frames;
+        
+return_rc:
+        spinlock_release(&p->protocol_lock);
+        return rc;
+}
+
+/**
+ * Take the packets from the frames of the compressed protocol read from a
+ * backend. A partial frame at the end of the data is kept in the protocol
+ * until the rest of it is read.
+ *
+ * @param p     The protocol of the backend connection
+ * @param buf   The data read, replaced by the packets or NULL if no frame
+ *              was complete
+ * @return 0 on success, -1 if a frame could not be decompressed
+ */
+int gw_MySQL_decompress(
+        MySQLProtocol* p,
+        GWBUF**        buf)
+{
+        GWBUF*   in = gwbuf_append(p->protocol_zread, *buf);
+        GWBUF*   out = NULL;
+        GWBUF*   packets;
+        uint8_t  hdr[MYSQL_COMPRESS_HDRLEN];
+        uint8_t* src;
+        uint8_t* tmp;
+        size_t   clen;
+        size_t   ulen;
+        size_t   len = gwbuf_length(in);
+        z_stream* z;
+        int      zrc;
+        
+        p->protocol_zread = NULL;
+        *buf = NULL;
+        
+        while (len >= MYSQL_COMPRESS_HDRLEN)
+        {
+                zbuf_copy(in, 0, MYSQL_COMPRESS_HDRLEN, hdr);
+                clen = gw_mysql_get_byte3(hdr);
+                ulen = gw_mysql_get_byte3(&hdr[4]);
+                
+                if (len < MYSQL_COMPRESS_HDRLEN + clen)
+                {
+                        break;
+                }
+                tmp = NULL;
+                
+                if (GWBUF_LENGTH(in) >= MYSQL_COMPRESS_HDRLEN + clen)
+                {
+                        src = (uint8_t *)GWBUF_DATA(in) + MYSQL_COMPRESS_HDRLEN;
+                }
+                else if ((tmp = (uint8_t *)malloc(clen)) != NULL)
+                {
+                        zbuf_copy(in, MYSQL_COMPRESS_HDRLEN, clen, tmp);
+                        src = tmp;
+                }
+                else
+                {
+                        goto return_error;
+                }
+                
+                if ((packets = gwbuf_alloc(ulen == 0 ? clen : ulen)) == NULL)
+                {
+                        free(tmp);
+                        goto return_error;
+                }
+                
+                if (ulen == 0)
+                {
+                        memcpy(GWBUF_DATA(packets), src, clen);
+                }
+                else
+                {
+                        if ((z = zstream_inflate()) == NULL)
+                        {
+                                zrc = Z_MEM_ERROR;
+                        }
+                        else
+                        {
+                                z->next_in = src;
+                                z->avail_in = clen;
+                                z->next_out = GWBUF_DATA(packets);
+                                z->avail_out = ulen;
+                                zrc = inflate(z, Z_FINISH);
+                        }
+                        
+                        if (zrc != Z_STREAM_END || z->total_out != ulen)
+                        {
+                                LOGIF(LE, (skygw_log_write_flush(
+                                        LOGFILE_ERROR,
+                                        "Error : Failed to decompress a %lu "
+                                        "byte frame of the compressed "
+                                        "protocol, zlib error %d.",
+                                        (unsigned long)clen,
+                                        zrc)));
+                                free(tmp);
+                                gwbuf_free(packets);
+                                goto return_error;
+                        }
+                }
+                free(tmp);
+                out = gwbuf_append(out, packets);
+                p->protocol_zseq = hdr[3] + 1;
+                in = zbuf_consume(in, MYSQL_COMPRESS_HDRLEN + clen);
+                len -= MYSQL_COMPRESS_HDRLEN + clen;
+        }
+        p->protocol_zread = in;
+        *buf = out;
+        
+        return 0;
+        
+return_error:
+        zbuf_consume(in, len);
+
+        while (out != NULL)
+        {
+                out = gwbuf_consume(out, GWBUF_LENGTH(out));
+        }
+        return -1;
+}
+
+/** Status flags of OK and EOF that the reply scanner looks at */
+#define MYSQL_SERVER_MORE_RESULTS       0x0008
+#define MYSQL_SERVER_CURSOR_EXISTS      0x0040
+
+/** How a packet ends a reply */
+#define MYSQL_REPLY_CONTINUES   0 /*< More packets of the reply follow */
+#define MYSQL_REPLY_ENDS        1 /*< The reply is complete */
+#define MYSQL_REPLY_WAITS       2 /*< The server waits for the client */
+
+/** The error that replaces the reply to a statement killed for the timeout */
+#define MYSQL_KILL_ERRNO        1317 /*< ER_QUERY_INTERRUPTED */
+#define MYSQL_KILL_SQLSTATE     "70100"
+
+static void reply_timer_expired(void* data);
+
+/**
+ * Return the monotonic clock in microseconds
+ */
+static unsigned long reply_clock()
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Add a command to the ring of the expected replies, the ring is doubled
+ * when it is full. The caller holds the protocol lock.
+ */
+static void reply_command_push(
+        MySQLProtocol* p,
+        uint8_t        cmd,
+        unsigned long  now)
+{
+        if (p->protocol_reply_count == p->protocol_reply_size)
+        {
+                int            size = p->protocol_reply_size ? 2*p->protocol_reply_size : 16;
+                uint8_t*       cmds = (uint8_t *)malloc(size);
+                unsigned long* times = (unsigned long *)malloc(size * sizeof(unsigned long));
+                int            i, k;
+
+                if (cmds == NULL || times == NULL)
+                {
+                        free(cmds);
+                        free(times);
+                        return;
+                }
+                for (i = 0; i < p->protocol_reply_count; i++)
+                {
+                        k = (p->protocol_reply_first+i) % p->protocol_reply_size;
+                        cmds[i] = p->protocol_reply_cmds[k];
+                        times[i] = p->protocol_reply_times[k];
+                }
+                free(p->protocol_reply_cmds);
+                free(p->protocol_reply_times);
+                p->protocol_reply_cmds = cmds;
+                p->protocol_reply_times = times;
+                p->protocol_reply_size = size;
+                p->protocol_reply_first = 0;
+        }
+        p->protocol_reply_cmds[(p->protocol_reply_first+p->protocol_reply_count) %
+                               p->protocol_reply_size] = cmd;
+        p->protocol_reply_times[(p->protocol_reply_first+p->protocol_reply_count) %
+                                p->protocol_reply_size] = now;
+        p->protocol_reply_count += 1;
+}
+
+/**
+ * Start the query timer of a backend for the command written at the given
+ * time, the oldest one that waits for its reply.
+ */
+static void reply_timer_start(
+        MySQLProtocol* p,
+        unsigned long  sent)
+{
+        unsigned long limit = (unsigned long)p->protocol_query_timeout * 1000000;
+        unsigned long elapsed = reply_clock() - sent;
+
+        timer_start(&p->protocol_query_timer,
+                    elapsed < limit ? (int)((limit - elapsed) / 1000) + 1 : 1,
+                    reply_timer_expired,
+                    p);
+}
+
+/**
+ * The query timer of a backend has expired. The statement that has run for
+ * longer than the query timeout is killed by the killer thread, only the
+ * queries and the executions of prepared statements are. The error of the
+ * server that ends the reply is replaced by one that names the timeout,
+ * unless the reply had begun to arrive.
+ *
+ * @param data  The protocol of the backend
+ */
+static void reply_timer_expired(
+        void* data)
+{
+        MySQLProtocol* p = (MySQLProtocol *)data;
+        DCB*           dcb = p->owner_dcb;
+        SESSION*       session;
+        unsigned long  sent = 0;
+        uint8_t        cmd = 0;
+        bool           started = false;
+
+        if (dcb == NULL || dcb->state != DCB_STATE_POLLING ||
+                dcb->server == NULL || (session = dcb->session) == NULL ||
+                session->service == NULL || p->protocol_query_timeout <= 0)
+        {
+                return;
+        }
+        spinlock_acquire(&p->protocol_lock);
+        if (p->protocol_reply_count > 0)
+        {
+                sent = p->protocol_reply_times[p->protocol_reply_first];
+                cmd = p->protocol_reply_cmds[p->protocol_reply_first];
+                started = p->protocol_reply_started;
+        }
+        if (sent == 0 ||
+                reply_clock() - sent <
+                (unsigned long)p->protocol_query_timeout * 1000000)
+        {
+                spinlock_release(&p->protocol_lock);
+
+                /** The command timed has been answered, time the next one */
+                if (sent != 0)
+                {
+                        reply_timer_start(p, sent);
+                }
+                return;
+        }
+        if (cmd != MYSQL_COM_QUERY && cmd != MYSQL_COM_STMT_EXECUTE)
+        {
+                spinlock_release(&p->protocol_lock);
+                return;
+        }
+        if (!started)
+        {
+                p->protocol_kill_sent = sent;
+        }
+        spinlock_release(&p->protocol_lock);
+
+        if (!querykill_request(session->service, dcb->server, p->tid))
+        {
+                spinlock_acquire(&p->protocol_lock);
+                if (p->protocol_kill_sent == sent)
+                {
+                        p->protocol_kill_sent = 0;
+                }
+                spinlock_release(&p->protocol_lock);
+
+                LOGIF(LE, (skygw_log_write_flush(
+                        LOGFILE_ERROR,
+                        "Error : The statement of backend thread %lu on "
+                        "%s:%d has run for longer than the query timeout "
+                        "of %d seconds of service %s and could not be killed.",
+                        p->tid,
+                        dcb->server->name,
+                        dcb->server->port,
+                        p->protocol_query_timeout,
+                        session->service->name)));
+                return;
+        }
+        LOGIF(LM, (skygw_log_write(
+                LOGFILE_MESSAGE,
+                "Killing the statement of user %s on backend thread %lu of "
+                "%s:%d, it has run for longer than the query timeout of "
+                "%d seconds.",
+                session_getUser(session) ? session_getUser(session) : "",
+                p->tid,
+                dcb->server->name,
+                dcb->server->port,
+                p->protocol_query_timeout)));
+}
+
+/**
+ * Record the commands of the packets being written to a backend, so that
+ * the reply scanner knows what each reply answers. Only the headers are
+ * looked at, the scan hops from a header to the next over the payloads.
+ * A packet with a sequence number other than 0 continues an earlier
+ * command and the commands that have no reply are not recorded.
+ *
+ * @param p     The protocol of the backend
+ * @param queue The packets, the chain starts at a packet header
+ */
+void protocol_add_reply_commands(
+        MySQLProtocol* p,
+        GWBUF*         queue)
+{
+        GWBUF*  buf = queue;
+        size_t  pos = 0;
+        size_t  skip = 0;
+        uint8_t hdr[5];
+        int     n = 0;
+        int     pushed = 0;
+        bool    idle;
+        unsigned long now = reply_clock();
+
+        spinlock_acquire(&p->protocol_lock);
+        idle = (p->protocol_reply_count == 0);
+
+        while (buf != NULL)
+        {
+                size_t len = GWBUF_LENGTH(buf);
+
+                if (pos + skip >= len)
+                {
+                        skip -= len - pos;
+                        pos = 0;
+                        buf = buf->next;
+                        continue;
+                }
+                pos += skip;
+                skip = 0;
+                hdr[n++] = ((uint8_t *)GWBUF_DATA(buf))[pos++];
+
+                if (n == 5 || (n == 4 && MYSQL_GET_PACKET_LEN(hdr) == 0))
+                {
+                        size_t plen = MYSQL_GET_PACKET_LEN(hdr);
+
+                        if (n == 5 &&
+                                MYSQL_GET_PACKET_NO(hdr) == 0 &&
+                                hdr[4] != MYSQL_COM_QUIT &&
+                                hdr[4] != MYSQL_COM_STMT_CLOSE &&
+                                hdr[4] != MYSQL_COM_STMT_SEND_LONG_DATA)
+                        {
+                                reply_command_push(p, hdr[4], now);
+                                pushed = 1;
+                        }
+                        skip = plen - (n - 4);
+                        n = 0;
+                }
+        }
+        spinlock_release(&p->protocol_lock);
+
+        if (pushed && p->owner_dcb != NULL)
+        {
+                SESSION* session = p->owner_dcb->session;
+
+                SESSION_TRACE_STAMP(session, SESSION_TRACE_SENT, now);
+
+                /** The timer runs while commands wait, for the oldest one */
+                if (idle && session != NULL && session->service != NULL)
+                {
+                        p->protocol_query_timeout = serviceGetQueryTimeout(
+                                session->service,
+                                session_getUser(session));
+
+                        if (p->protocol_query_timeout > 0)
+                        {
+                                reply_timer_start(p, now);
+                        }
+                }
+        }
+}
+
+/**
+ * Return the status flags of an OK packet or 0 if they were not collected
+ */
+static int reply_ok_status(
+        uint8_t* payload,
+        int      n)
+{
+        int i = 1;
+        int k;
+
+        for (k = 0; k < 2; k++)
+        {
+                if (i >= n)
+                {
+                        return 0;
+                }
+                switch (payload[i]) {
+                case 0xfc: i += 3; break;
+                case 0xfd: i += 4; break;
+                case 0xfe: i += 9; break;
+                default:   i += 1; break;
+                }
+        }
+        return i + 2 <= n ? gw_mysql_get_byte2(&payload[i]) : 0;
+}
+
+/**
+ * Decide what a packet of a reply is from its first bytes and move the
+ * scanner to the packet that follows.
+ *
+ * @param s             The scanner
+ * @param payload       The first bytes of the payload
+ * @param n             Number of bytes in payload
+ * @param len           The payload length
+ * @return How the packet ends the reply
+ */
+static int reply_packet(
+        MYSQL_REPLY_SCAN* s,
+        uint8_t*          payload,
+        int               n,
+        size_t            len)
+{
+        uint8_t first = n > 0 ? payload[0] : 0;
+        bool    eof = (first == 0xfe && len < 9);
+        int     status = (eof && n >= 5) ? gw_mysql_get_byte2(&payload[3]) : 0;
+
+        if (first == 0xff && s->rs_state != MYSQL_REPLY_COUNTED)
+        {
+                return MYSQL_REPLY_ENDS;
+        }
+
+        switch (s->rs_state) {
+        case MYSQL_REPLY_FIRST:
+        case MYSQL_REPLY_NEXT:
+                switch (s->rs_cmd) {
+                case MYSQL_COM_STATISTICS:
+                        return MYSQL_REPLY_ENDS;
+
+                case MYSQL_COM_CHANGE_USER:
+                        /** Anything but OK switches or continues the authentication */
+                        return first == 0x00 ? MYSQL_REPLY_ENDS : MYSQL_REPLY_WAITS;
+
+                case MYSQL_COM_BINLOG_DUMP:
+                        s->rs_state = MYSQL_REPLY_STREAM;
+                        return eof ? MYSQL_REPLY_ENDS : MYSQL_REPLY_CONTINUES;
+
+                case MYSQL_COM_STMT_FETCH:
+                        s->rs_state = MYSQL_REPLY_ROWS;
+                        return eof ? MYSQL_REPLY_ENDS : MYSQL_REPLY_CONTINUES;
+
+                case MYSQL_COM_FIELD_LIST:
+                        s->rs_state = MYSQL_REPLY_COLDEF;
+                        return eof ? MYSQL_REPLY_ENDS : MYSQL_REPLY_CONTINUES;
+
+                case MYSQL_COM_STMT_PREPARE:
+                        if (first == 0x00 && n >= 9)
+                        {
+                                int ncols = gw_mysql_get_byte2(&payload[5]);
+                                int nparams = gw_mysql_get_byte2(&payload[7]);
+
+                                s->rs_npackets = (ncols ? ncols + 1 : 0) +
+                                        (nparams ? nparams + 1 : 0);
+                                s->rs_state = MYSQL_REPLY_COUNTED;
+                                return s->rs_npackets == 0 ?
+                                        MYSQL_REPLY_ENDS : MYSQL_REPLY_CONTINUES;
+                        }
+                        return MYSQL_REPLY_ENDS;
+
+                default:
+                        break;
+                }
+                if (first == 0x00 || eof)
+                {
+                        if (first == 0x00)
+                        {
+                                status = reply_ok_status(payload, n);
+                        }
+                        if (status & MYSQL_SERVER_MORE_RESULTS)
+                        {
+                                s->rs_state = MYSQL_REPLY_NEXT;
+                                return MYSQL_REPLY_CONTINUES;
+                        }
+                        return MYSQL_REPLY_ENDS;
+                }
+                if (first == 0xfb)
+                {
+                        /** LOCAL INFILE, the OK follows the data of the client */
+                        s->rs_state = MYSQL_REPLY_NEXT;
+                        return MYSQL_REPLY_WAITS;
+                }
+                /** Column count of a resultset */
+                s->rs_state = MYSQL_REPLY_COLDEF;
+                return MYSQL_REPLY_CONTINUES;
+
+        case MYSQL_REPLY_COLDEF:
+                if (!eof)
+                {
+                        return MYSQL_REPLY_CONTINUES;
+                }
+                if (s->rs_cmd == MYSQL_COM_FIELD_LIST ||
+                        (status & MYSQL_SERVER_CURSOR_EXISTS))
+                {
+                        return MYSQL_REPLY_ENDS;
+                }
+                s->rs_state = MYSQL_REPLY_ROWS;
+                return MYSQL_REPLY_CONTINUES;
+
+        case MYSQL_REPLY_ROWS:
+                if (!eof)
+                {
+                        return MYSQL_REPLY_CONTINUES;
+                }
+                if (status & MYSQL_SERVER_MORE_RESULTS)
+                {
+                        s->rs_state = MYSQL_REPLY_NEXT;
+                        return MYSQL_REPLY_CONTINUES;
+                }
+                return MYSQL_REPLY_ENDS;
+
+        case MYSQL_REPLY_COUNTED:
+                s->rs_npackets -= 1;
+                return s->rs_npackets <= 0 ? MYSQL_REPLY_ENDS : MYSQL_REPLY_CONTINUES;
+
+        case MYSQL_REPLY_STREAM:
+        default:
+                return eof ? MYSQL_REPLY_ENDS : MYSQL_REPLY_CONTINUES;
+        }
+}
+
+/**
+ * Return the session of a backend when a request of it is being traced and
+ * the command sent at the given time is the traced one or a later one.
+ */
+static SESSION* reply_traced(
+        MySQLProtocol* p,
+        unsigned long  sent)
+{
+        DCB*     dcb = p->owner_dcb;
+        SESSION* session;
+
+        if (sent == 0 || dcb == NULL || (session = dcb->session) == NULL ||
+                !session->trace.active ||
+                session->trace.stamps[SESSION_TRACE_SENT] == 0 ||
+                sent < session->trace.stamps[SESSION_TRACE_SENT])
+        {
+                return NULL;
+        }
+        return session;
+}
+
+/**
+ * Start a new reply or finish the current one. A new reply takes the
+ * oldest expected command, data that no command waits for is read as the
+ * reply to a query. The reply to a command that was killed before its
+ * reply began is held until its first packet shows whether it is the
+ * error of the kill.
+ */
+static void reply_begin(
+        MySQLProtocol* p)
+{
+        MYSQL_REPLY_SCAN* s = &p->protocol_reply;
+        unsigned long     sent = 0;
+        SESSION*          session;
+
+        spinlock_acquire(&p->protocol_lock);
+        s->rs_taken = p->protocol_reply_count > 0;
+        s->rs_cmd = s->rs_taken ?
+                p->protocol_reply_cmds[p->protocol_reply_first] :
+                MYSQL_COM_QUERY;
+        if (s->rs_taken)
+        {
+                sent = p->protocol_reply_times[p->protocol_reply_first];
+        }
+        p->protocol_reply_started = true;
+        if (s->rs_taken && sent == p->protocol_kill_sent)
+        {
+                s->rs_kill = MYSQL_KILL_PENDING;
+        }
+        spinlock_release(&p->protocol_lock);
+
+        if ((session = reply_traced(p, sent)) != NULL)
+        {
+                SESSION_TRACE_STAMP(session, SESSION_TRACE_FIRST, reply_clock());
+        }
+}
+
+/**
+ * Finish the current reply. The time from the write of the command to the
+ * end of its reply is counted in the response times of the server and of
+ * the service of the session.
+ */
+static void reply_end(
+        MySQLProtocol* p)
+{
+        MYSQL_REPLY_SCAN* s = &p->protocol_reply;
+        unsigned long     sent = 0;
+        unsigned long     next = 0;
+        DCB*              dcb = p->owner_dcb;
+        SESSION*          session;
+
+        spinlock_acquire(&p->protocol_lock);
+        if (s->rs_taken && p->protocol_reply_count > 0)
+        {
+                sent = p->protocol_reply_times[p->protocol_reply_first];
+                p->protocol_reply_first = (p->protocol_reply_first + 1) %
+                        p->protocol_reply_size;
+                p->protocol_reply_count -= 1;
+
+                if (p->protocol_reply_count > 0)
+                {
+                        next = p->protocol_reply_times[p->protocol_reply_first];
+                }
+        }
+        p->protocol_reply_started = false;
+        if (sent != 0 && sent == p->protocol_kill_sent)
+        {
+                p->protocol_kill_sent = 0;
+        }
+        spinlock_release(&p->protocol_lock);
+
+        if (sent != 0 && p->protocol_query_timeout > 0)
+        {
+                if (next != 0)
+                {
+                        reply_timer_start(p, next);
+                }
+                else
+                {
+                        timer_cancel(&p->protocol_query_timer);
+                }
+        }
+
+        if ((session = reply_traced(p, sent)) != NULL)
+        {
+                SESSION_TRACE_STAMP(session, SESSION_TRACE_LAST, reply_clock());
+        }
+        if (sent != 0 && dcb != NULL)
+        {
+                unsigned long elapsed = reply_clock() - sent;
+
+                if (dcb->server != NULL && dcb->server->stats.latency != NULL)
+                {
+                        ts_hist_add(dcb->server->stats.latency, elapsed);
+                }
+                if (dcb->session != NULL && dcb->session->service != NULL &&
+                        dcb->session->service->stats.latency != NULL)
+                {
+                        ts_hist_add(dcb->session->service->stats.latency, elapsed);
+                }
+        }
+        s->rs_taken = false;
+        s->rs_state = MYSQL_REPLY_FIRST;
+}
+
+/**
+ * Decide on the reply to a killed command from its first packet, only the
+ * error of the kill is replaced. A statement that ended before the kill
+ * reached the server keeps its reply.
+ */
+static void reply_kill_check(
+        MYSQL_REPLY_SCAN* s)
+{
+        if (s->rs_nhdr >= 7 && s->rs_hdr[4] == 0xff &&
+                gw_mysql_get_byte2(&s->rs_hdr[5]) == MYSQL_KILL_ERRNO)
+        {
+                s->rs_kill = MYSQL_KILL_REPLACE;
+        }
+        else
+        {
+                s->rs_kill = MYSQL_KILL_NONE;
+        }
+}
+
+/**
+ * Return the data of a reply to pass on to the router. The data of a reply
+ * to a killed command is held until its first packet is seen, the error of
+ * the kill is then dropped and replaced by one that names the timeout.
+ *
+ * @param p     The protocol of the backend
+ * @param buf   Data of a single reply
+ * @param end   How buf ends the reply
+ * @return      The data to pass on, NULL if there is none yet
+ */
+static GWBUF* reply_emit(
+        MySQLProtocol* p,
+        GWBUF*         buf,
+        int            end)
+{
+        MYSQL_REPLY_SCAN* s = &p->protocol_reply;
+        GWBUF*            held = s->rs_held;
+        char              msg[160];
+
+        if (s->rs_kill == MYSQL_KILL_PENDING)
+        {
+                s->rs_held = gwbuf_append(s->rs_held, buf);
+                return NULL;
+        }
+        s->rs_held = NULL;
+
+        if (s->rs_kill == MYSQL_KILL_REPLACE)
+        {
+                buf = gwbuf_append(held, buf);
+                gwbuf_consume(buf, gwbuf_length(buf));
+
+                if (end != MYSQL_REPLY_ENDS)
+                {
+                        return NULL;
+                }
+                s->rs_kill = MYSQL_KILL_NONE;
+                snprintf(msg, sizeof(msg),
+                         "Query execution was interrupted, the statement ran "
+                         "for longer than the query timeout of %d seconds",
+                         p->protocol_query_timeout);
+
+                if ((buf = modutil_create_mysql_err_msg(
+                             1, MYSQL_KILL_ERRNO, MYSQL_KILL_SQLSTATE, msg)) == NULL)
+                {
+                        return NULL;
+                }
+                held = NULL;
+        }
+        if (end != MYSQL_REPLY_CONTINUES)
+        {
+                buf->gwbuf_type |= GWBUF_TYPE_RESPONSE_END;
+        }
+        return held != NULL ? gwbuf_append(held, buf) : buf;
+}
+
+/**
+ * Find the ends of the replies in data read from a backend and mark the
+ * last buffer of each reply with GWBUF_TYPE_RESPONSE_END. A buffer where a
+ * reply ends and the next one begins is split in two, no data is copied.
+ * The mark is also set where the server waits for the client, on the
+ * request for a LOCAL INFILE and on an authentication switch.
+ *
+ * The scan hops from a packet header to the next, only the header and the
+ * first bytes of the payload are looked at, and the state is kept between
+ * the reads so that no data is looked at twice. The error that ends the
+ * reply to a statement killed for the query timeout is replaced.
+ *
+ * @param p     The protocol of the backend
+ * @param buf   The data read, it continues the data read earlier
+ * @return      The same data, split at the ends of the replies
+ */
+GWBUF* gw_MySQL_reply_scan(
+        MySQLProtocol* p,
+        GWBUF*         buf)
+{
+        MYSQL_REPLY_SCAN* s = &p->protocol_reply;
+        GWBUF*            head = NULL;
+        GWBUF**           tailp = &head;
+
+        while (buf != NULL)
+        {
+                GWBUF*   next = buf->next;
+                uint8_t* data = (uint8_t *)GWBUF_DATA(buf);
+                size_t   len = GWBUF_LENGTH(buf);
+                size_t   pos = 0;
+                int      end = MYSQL_REPLY_CONTINUES;
+
+                buf->next = NULL;
+
+                while (pos < len)
+                {
+                        end = MYSQL_REPLY_CONTINUES;
+
+                        if (s->rs_nhdr == 0 && !s->rs_continues &&
+                                s->rs_state == MYSQL_REPLY_FIRST)
+                        {
+                                reply_begin(p);
+                        }
+
+                        if (s->rs_nhdr < s->rs_want)
+                        {
+                                s->rs_hdr[s->rs_nhdr++] = data[pos++];
+
+                                if (s->rs_nhdr == 4)
+                                {
+                                        size_t plen = MYSQL_GET_PACKET_LEN(s->rs_hdr);
+
+                                        s->rs_fragment = s->rs_continues;
+                                        s->rs_continues = (plen == 0xffffff);
+                                        s->rs_left = plen;
+                                        s->rs_want = 4;
+
+                                        if (!s->rs_fragment)
+                                        {
+                                                s->rs_want += plen < MYSQL_REPLY_PEEK ?
+                                                        plen : MYSQL_REPLY_PEEK;
+                                        }
+                                }
+                                else if (s->rs_nhdr > 4)
+                                {
+                                        s->rs_left -= 1;
+                                }
+
+                                if (s->rs_nhdr == s->rs_want && !s->rs_fragment)
+                                {
+                                        if (s->rs_kill == MYSQL_KILL_PENDING)
+                                        {
+                                                reply_kill_check(s);
+                                        }
+                                        s->rs_end = reply_packet(
+                                                s,
+                                                &s->rs_hdr[4],
+                                                s->rs_nhdr - 4,
+                                                MYSQL_GET_PACKET_LEN(s->rs_hdr));
+                                }
+                        }
+                        else
+                        {
+                                size_t n = len - pos;
+
+                                if (n > s->rs_left)
+                                {
+                                        n = s->rs_left;
+                                }
+                                pos += n;
+                                s->rs_left -= n;
+                        }
+
+                        /** A complete packet */
+                        if (s->rs_nhdr == s->rs_want && s->rs_left == 0)
+                        {
+                                s->rs_nhdr = 0;
+                                s->rs_want = 4;
+
+                                if (!s->rs_continues)
+                                {
+                                        if (s->rs_end == MYSQL_REPLY_ENDS)
+                                        {
+                                                reply_end(p);
+                                        }
+                                        end = s->rs_end;
+                                        s->rs_end = MYSQL_REPLY_CONTINUES;
+                                }
+                        }
+
+                        if (end != MYSQL_REPLY_CONTINUES && pos < len)
+                        {
+                                GWBUF* part = gwbuf_clone_portion(buf, 0, pos);
+
+                                if (part != NULL)
+                                {
+                                        GWBUF_CONSUME(buf, pos);
+                                        data += pos;
+                                        len -= pos;
+                                        pos = 0;
+
+                                        for (*tailp = reply_emit(p, part, end);
+                                             *tailp != NULL;
+                                             tailp = &(*tailp)->next)
+                                                ;
+                                }
+                        }
+                }
+                for (*tailp = reply_emit(p, buf, end);
+                     *tailp != NULL;
+                     tailp = &(*tailp)->next)
+                        ;
+                buf = next;
+        }
+        return head;
+}
+
+
+static server_command_t* server_command_init(
+        server_command_t* srvcmd,
+        mysql_server_cmd_t cmd)
+{
+        server_command_t* c;
+        
+        if (srvcmd != NULL)
+        {
+                c = srvcmd;
+        }
+        else
+        {
+                c = (server_command_t *)malloc(sizeof(server_command_t));
+        }
+        c->scom_cmd = cmd;
+        c->scom_nresponse_packets = -1;
+        c->scom_nbytes_to_read = 0;
+        c->scom_next = NULL;
+        
+        return c;
+}
+
+static server_command_t* server_command_copy(
+        server_command_t* srvcmd)
+{
+        server_command_t* c = 
+                (server_command_t *)malloc(sizeof(server_command_t));
+        *c = *srvcmd;
+        /** The copy is not a part of the command list */
+        c->scom_next = NULL;
+        
+        return c;
+}
+
+#define MAX_CMD_HISTORY 10
+
+void protocol_archive_srv_command(
+        MySQLProtocol* p)
+{
+        server_command_t*  s1;
+        server_command_t** s2;
+        int                len = 0;
+        
+        spinlock_acquire(&p->protocol_lock);
+        
+        s1 = &p->protocol_command;
+        
+        LOGIF(LT, (skygw_log_write(
+                LOGFILE_TRACE,
+                "Move command %s from fd %d to command history.",
+                STRPACKETTYPE(s1->scom_cmd), 
+                p->owner_dcb->fd)));
+        
+        /** Copy to history list */
+        s2 = &p->protocol_cmd_history;
+        
+        while (*s2 != NULL)
+        {
+                s2 = &(*s2)->scom_next;
+                len += 1;
+        }
+        *s2 = server_command_copy(s1);
+        
+        /** Keep history limits, remove oldest */
+        if (len > MAX_CMD_HISTORY)
+        {
+                server_command_t* c = p->protocol_cmd_history;
+                p->protocol_cmd_history = p->protocol_cmd_history->scom_next;
+                free(c);
+        }
+        
+        /** Remove from command list */
         if (s1->scom_next == NULL)
         {
                 p->protocol_command.scom_cmd = MYSQL_COM_UNDEFINED;
@@ -1653,6 +3257,9 @@ void protocol_archive_srv_command(
 /**
  * If router expects to get separate, complete statements, add MySQL command 
  * to MySQLProtocol structure. It is removed when response has arrived.
+ * Commands are added to the end of the list, the router may write several
+ * statements before the first response arrives and the responses come in
+ * the same order.
  */
 void protocol_add_srv_command(
         MySQLProtocol*     p,
@@ -1671,7 +3278,13 @@ void protocol_add_srv_command(
         else
         {
                 /** add to the end of list */
-                p->protocol_command.scom_next = server_command_init(NULL, cmd);
+                c = &p->protocol_command;
+
+                while (c->scom_next != NULL)
+                {
+                        c = c->scom_next;
+                }
+                c->scom_next = server_command_init(NULL, cmd);
         }
         
         LOGIF(LT, (skygw_log_write(
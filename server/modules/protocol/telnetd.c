@@ -37,6 +37,7 @@
 #include <skygw_utils.h>
 #include <log_manager.h>
 #include <modinfo.h>
+#include <handoff.h>
 
 MODULE_INFO info = {
 	MODULE_API_PROTOCOL,
@@ -365,22 +366,34 @@ int                     rc;
 		return 0;
 
 
-	if ((listener->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	if ((listener->fd = handoff_take((struct sockaddr *)&addr,
+					sizeof(addr))) >= 0)
 	{
-		return 0;
+		/*< The socket of the old MaxScale, bound and listening */
+		setnonblocking(listener->fd);
 	}
-
-        // socket options
-	setsockopt(listener->fd, SOL_SOCKET, SO_REUSEADDR, (char *)&one, sizeof(one));
-        // set NONBLOCKING mode
-        setnonblocking(listener->fd);
-        // bind address and port
-        if (bind(listener->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	else
 	{
-        	return 0;
+		if ((listener->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		{
+			return 0;
+		}
+
+		// socket options
+		setsockopt(listener->fd, SOL_SOCKET, SO_REUSEADDR, (char *)&one, sizeof(one));
+		// set NONBLOCKING mode
+		setnonblocking(listener->fd);
+
+		/* allow per thread copies of the listener */
+		poll_reuseport(listener->fd);
+		// bind address and port
+		if (bind(listener->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		{
+			return 0;
+		}
 	}
 
-        rc = listen(listener->fd, SOMAXCONN);
+        rc = poll_listen(listener, listener->fd, SOMAXCONN, 0);
         
         if (rc == 0) {
             fprintf(stderr,
@@ -20,6 +20,16 @@
  * @file GaleraHACRoute.c - A connection load balancer for use in a Galera
  * HA environment
  *
+ * The table_writes option routes the autocommit INSERT, UPDATE, DELETE and
+ * REPLACE statements of a table to one node of the cluster, picked from the
+ * synced nodes by the rendezvous hash of the table name. Concurrent writes
+ * to the same rows then meet the row locks of that node instead of failing
+ * in the certification of the cluster with a deadlock error. The other
+ * statements go to the connection of the session, so the reads still spread
+ * over all the nodes. A session whose state the other connections would
+ * lack, after a SET, USE, prepared statement, user variables or temporary
+ * table, keeps all of its statements on its own connection, as does an
+ * explicit transaction until it ends.
  *
  * @verbatim
  * Revision History
@@ -30,9 +40,11 @@
  *
  * @endverbatim
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <service.h>
 #include <server.h>
 #include <router.h>
@@ -40,12 +52,15 @@
 #include <spinlock.h>
 #include <dcb.h>
 #include <spinlock.h>
+#include <modutil.h>
+#include <galerahacroute.h>
 
 #include <skygw_types.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
 
 #include <mysql_client_server_protocol.h>
+#include <query_classifier.h>
 
 extern int lm_enabled_logfiles_bitmask;
 
@@ -66,11 +81,12 @@ static  void    GHAClientReply(
         DCB     *backend_dcb);
 
 static  void    GHAHandleError(
-        ROUTER  *instance,
-        void    *router_session,
-        char    *message,
-        DCB     *backend_dcb,
-        int     action);
+        ROUTER           *instance,
+        void             *router_session,
+        GWBUF            *errbuf,
+        DCB              *backend_dcb,
+        error_action_t   action,
+        bool             *succp);
 
 /** The module object definition */
 static ROUTER_OBJECT MyObject = {
@@ -90,6 +106,10 @@ static bool rses_begin_router_action(
 static void rses_exit_router_action(
         ROUTER_CLIENT_SES* rses);
 
+static DCB	*route_table_write(ROUTER_INSTANCE *inst,
+				ROUTER_CLIENT_SES *rses, GWBUF *queue,
+				DCB *backend_dcb);
+
 static SPINLOCK	instlock;
 static ROUTER_INSTANCE *instances;
 
@@ -112,7 +132,9 @@ void
 ModuleInit()
 {
         LOGIF(LM, (skygw_log_write(
-                           "Initialise readconnroute router module %s.\n", version_str)));
+                           LOGFILE_MESSAGE,
+                           "Initialise GaleraHACRoute router module %s.\n",
+                           version_str)));
         spinlock_init(&instlock);
 	instances = NULL;
 }
@@ -184,6 +206,7 @@ int		i, n;
 		n++;
 	}
 	inst->servers[n] = NULL;
+	inst->n_servers = n;
 
 	/*
 	 * Process the options
@@ -209,16 +232,23 @@ int		i, n;
 				inst->bitmask |= (SERVER_JOINED);
 				inst->bitvalue |= SERVER_JOINED;
 			}
+			else if (!strcasecmp(options[i], "table_writes"))
+			{
+				inst->table_writes = 1;
+			}
 			else
 			{
                             LOGIF(LE, (skygw_log_write(
                                                LOGFILE_ERROR,
                                                "Warning : Unsupported router "
-                                               "option %s for readconnroute.",
+                                               "option %s for GaleraHACRoute.",
                                                options[i])));
 			}
 		}
 	}
+	/*< All the writes already go to one node with the master option */
+	if (inst->bitvalue & SERVER_MASTER)
+		inst->table_writes = 0;
 
 	/*
 	 * We have completed the creation of the instance data, so now
@@ -268,6 +298,14 @@ int                     i;
         client_rses->rses_chk_top = CHK_NUM_ROUTER_SES;
         client_rses->rses_chk_tail = CHK_NUM_ROUTER_SES;
 #endif
+	spinlock_init(&client_rses->rses_lock);
+	if (inst->table_writes &&
+		(client_rses->write_dcbs = (DCB **)calloc(inst->n_servers,
+						sizeof(DCB *))) == NULL)
+	{
+		free(client_rses);
+		return NULL;
+	}
 
 	/**
 	 * Find a backend server to connect to. This is the extent of the
@@ -301,7 +339,7 @@ int                     i;
 		}
 		if (inst->servers[i] &&
        		             SERVER_IS_RUNNING(inst->servers[i]->server) &&
-	                    (inst->servers[i]->server->status & SERVER_SYNCED))
+	                    (inst->servers[i]->server->status & SERVER_JOINED))
 		{
 			if (master == NULL)
 				master = inst->servers[i];
@@ -322,8 +360,10 @@ int                     i;
 				}
 				else if (inst->servers[i]->current_connection_count ==
 					 candidate->current_connection_count &&
-					 inst->servers[i]->server->stats.n_connections <
-					 candidate->server->stats.n_connections)
+					 ts_stats_get(inst->servers[i]->server->stats.counters,
+						SERVER_N_CONNECTIONS) <
+					 ts_stats_get(candidate->server->stats.counters,
+						SERVER_N_CONNECTIONS))
 				{
 					/* This running server has the same number
 					of connections currently as the candidate
@@ -382,6 +422,7 @@ int                     i;
         if (client_rses->backend_dcb == NULL)
 	{
                 atomic_add(&candidate->current_connection_count, -1);
+		free(client_rses->write_dcbs);
 		free(client_rses);
 		return NULL;
 	}
@@ -457,6 +498,7 @@ static void GHAFreeSession(
                 router_cli_ses->backend->server->port,
                 prev_val-1)));
 
+        free(router_cli_ses->write_dcbs);
         free(router_cli_ses);
 }
 
@@ -471,8 +513,11 @@ static void GHAFreeSession(
 static	void 	
 GHACloseSession(ROUTER *instance, void *router_session)
 {
+ROUTER_INSTANCE	  *inst = (ROUTER_INSTANCE *)instance;
 ROUTER_CLIENT_SES *router_cli_ses = (ROUTER_CLIENT_SES *)router_session;
 DCB*              backend_dcb;
+DCB*              write_dcb;
+int               i;
 
         CHK_CLIENT_RSES(router_cli_ses);
         /**
@@ -493,6 +538,19 @@ DCB*              backend_dcb;
                         CHK_DCB(backend_dcb);
                         dcb_close(backend_dcb);
                 }
+                /**
+                 * The closed flag keeps routeQuery from the write
+                 * connections, they are not changed anymore
+                 */
+                for (i = 0; router_cli_ses->write_dcbs && i < inst->n_servers; i++)
+                {
+                        if ((write_dcb = router_cli_ses->write_dcbs[i]) != NULL)
+                        {
+                                router_cli_ses->write_dcbs[i] = NULL;
+                                atomic_add(&write_dcb->server->stats.n_current, -1);
+                                dcb_close(write_dcb);
+                        }
+                }
         }
 }
 
@@ -549,6 +607,20 @@ GHARouteQuery(ROUTER *instance, void *router_session, GWBUF *queue)
                         mysql_command)));
                 goto return_rc;
         }
+
+	if (mysql_command == MYSQL_COM_QUERY && router_cli_ses->write_dcbs &&
+		!router_cli_ses->rses_pinned)
+	{
+		backend_dcb = route_table_write(inst, router_cli_ses, queue,
+						backend_dcb);
+	}
+	else if (mysql_command != MYSQL_COM_QUERY &&
+		mysql_command != MYSQL_COM_PING &&
+		mysql_command != MYSQL_COM_QUIT)
+	{
+		/*< COM_INIT_DB, prepared statements and the like */
+		router_cli_ses->rses_pinned = true;
+	}
         
 	switch(mysql_command) {
         case MYSQL_COM_CHANGE_USER:
@@ -603,6 +675,9 @@ int		  i = 0;
 	dcb_printf(dcb, "\tCurrent no. of router sessions:	%d\n", i);
 	dcb_printf(dcb, "\tNumber of queries forwarded:   	%d\n",
                    router_inst->stats.n_queries);
+	if (router_inst->table_writes)
+		dcb_printf(dcb, "\tWrites routed to their table node:	%d\n",
+			router_inst->stats.n_table_writes);
 }
 
 /**
@@ -636,27 +711,54 @@ GHAClientReply(
  *
  * The routine will handle error occurred in backend.
  *
+ * A failed write connection is closed and the session goes on, the next
+ * write of the table opens a new one. The session can't go on without its
+ * own connection.
+ *
  * @param       instance        The router instance
  * @param       router_session  The router session
- * @param       message         The error message to reply
+ * @param       errbuf          The error message to reply
  * @param       backend_dcb     The backend DCB
- * @param       action     	The action: REPLY, REPLY_AND_CLOSE, NEW_CONNECTION
+ * @param       action     	The action: REPLY_CLIENT, NEW_CONNECTION
+ * @param	succp		Set to true if the session can go on
  *
  */
 static  void
 GHAHandleError(
-        ROUTER *instance,
-        void   *router_session,
-        char  *message,
-        DCB    *backend_dcb,
-        int     action)
+        ROUTER           *instance,
+        void             *router_session,
+        GWBUF            *errbuf,
+        DCB              *backend_dcb,
+        error_action_t   action,
+        bool             *succp)
 {
-	DCB		*client = NULL;
-	ROUTER_OBJECT   *router = NULL;
-	SESSION         *session = backend_dcb->session;
-	client = backend_dcb->session->client;
+ROUTER_INSTANCE	  *inst = (ROUTER_INSTANCE *)instance;
+ROUTER_CLIENT_SES *rses = (ROUTER_CLIENT_SES *)router_session;
+bool		  found = false;
+int		  i;
 
-	ss_dassert(client != NULL);
+	ss_dassert(backend_dcb->session->client != NULL);
+
+	if (rses != NULL && rses->write_dcbs &&
+		action == ERRACT_NEW_CONNECTION && rses_begin_router_action(rses))
+	{
+		for (i = 0; i < inst->n_servers; i++)
+		{
+			if (rses->write_dcbs[i] == backend_dcb)
+			{
+				rses->write_dcbs[i] = NULL;
+				found = true;
+				break;
+			}
+		}
+		rses_exit_router_action(rses);
+	}
+	if (found)
+	{
+		atomic_add(&backend_dcb->server->stats.n_current, -1);
+		dcb_close(backend_dcb);
+	}
+	*succp = found;
 }
 
 /** to be inline'd */
@@ -716,3 +818,201 @@ static void rses_exit_router_action(
         CHK_CLIENT_RSES(rses);
         spinlock_release(&rses->rses_lock);
 }
+
+/**
+ * Mix the bits of a hash value
+ *
+ * @param hash	The value to mix
+ * @return	The mixed value
+ */
+static unsigned int
+hash_mix(unsigned int hash)
+{
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bU;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35U;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+/**
+ * The FNV-1a hash of a string
+ *
+ * @param str	The string to hash
+ * @return	The hash value
+ */
+static unsigned int
+string_hash(char *str)
+{
+unsigned int	hash = 2166136261U;
+
+	while (*str)
+	{
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/**
+ * The node the writes of a table go to: of the running synced nodes the one
+ * with the highest hash of the table and the node together. A table only
+ * moves to another node when its own node leaves the cluster, and the
+ * tables of a node that leaves spread over all of the others.
+ *
+ * @param inst		The router instance
+ * @param table		The table, qualified with its database
+ * @return		The index of the node in the servers of the instance
+ *			or -1 if no node is synced
+ */
+static int
+table_node(ROUTER_INSTANCE *inst, char *table)
+{
+unsigned int	hash = string_hash(table), best_hash = 0, h;
+int		i, best = -1;
+
+	for (i = 0; i < inst->n_servers; i++)
+	{
+		if (!SERVER_IS_JOINED(inst->servers[i]->server))
+			continue;
+		h = hash_mix(hash ^ string_hash(inst->servers[i]->server->unique_name ?
+				inst->servers[i]->server->unique_name :
+				inst->servers[i]->server->name));
+		if (best == -1 || h > best_hash)
+		{
+			best = i;
+			best_hash = h;
+		}
+	}
+	return best;
+}
+
+/**
+ * Is a ROLLBACK statement a ROLLBACK TO SAVEPOINT, which keeps the
+ * transaction open
+ *
+ * @param sql	The statement
+ * @return	True for ROLLBACK [WORK] TO
+ */
+static bool
+is_rollback_to(char *sql)
+{
+char	word[16];
+int	n = 0;
+
+	while (*sql)
+	{
+		while (isspace((unsigned char)*sql))
+			sql++;
+		for (n = 0; isalpha((unsigned char)sql[n]) && n < 15; n++)
+			word[n] = sql[n];
+		word[n] = 0;
+		if (n == 0)
+			return false;
+		sql += n;
+		if (!strcasecmp(word, "TO"))
+			return true;
+		if (strcasecmp(word, "ROLLBACK") && strcasecmp(word, "WORK"))
+			return false;
+	}
+	return false;
+}
+
+/**
+ * Choose the connection for a COM_QUERY of a session when the table_writes
+ * option is set. A plain INSERT, UPDATE, DELETE or REPLACE outside of a
+ * transaction goes to the node of its first table, the table it writes to,
+ * and the connection to that node is opened on the first write. Everything
+ * else goes to the connection of the session, and the statements that leave
+ * state behind pin the session to it.
+ *
+ * @param inst		The router instance
+ * @param rses		The router session
+ * @param queue		The COM_QUERY packet
+ * @param backend_dcb	The connection of the session
+ * @return		The connection to write the statement to
+ */
+static DCB *
+route_table_write(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+		GWBUF *queue, DCB *backend_dcb)
+{
+skygw_query_type_t	qtype;
+char	*sql, **tables, *db;
+char	key[2 * MYSQL_DATABASE_MAXLEN + 2];
+int	n_tables, i, node;
+DCB	*dcb = backend_dcb;
+
+	if ((sql = modutil_get_SQL(queue)) == NULL)
+	{
+		rses->rses_pinned = true;
+		return backend_dcb;
+	}
+	if (!rses->rses_in_trx && strchr(sql, '@') == NULL &&
+		skygw_query_classifier_get_trx_type(sql, &qtype) &&
+		qtype == QUERY_TYPE_WRITE)
+	{
+		/*< A plain write, the tokenizer has no tables for it */
+		if ((tables = skygw_query_classifier_get_tables(sql,
+						&n_tables)) == NULL)
+			return backend_dcb;
+		if (n_tables > 0 && strlen(tables[0]) <= MYSQL_DATABASE_MAXLEN)
+		{
+			db = ((MYSQL_session *)backend_dcb->session->data)->db;
+			if (strchr(tables[0], '.') || *db == 0)
+				strcpy(key, tables[0]);
+			else
+				sprintf(key, "%s.%s", db, tables[0]);
+			if ((node = table_node(inst, key)) >= 0 &&
+				inst->servers[node] != rses->backend)
+				dcb = rses->write_dcbs[node];
+			if (node >= 0 && inst->servers[node] != rses->backend &&
+				dcb == NULL && (dcb = dcb_connect(
+					inst->servers[node]->server,
+					backend_dcb->session,
+					inst->servers[node]->server->protocol)) != NULL)
+			{
+				if (rses_begin_router_action(rses))
+				{
+					rses->write_dcbs[node] = dcb;
+					rses_exit_router_action(rses);
+				}
+				else
+				{
+					atomic_add(&dcb->server->stats.n_current, -1);
+					dcb_close(dcb);
+					dcb = NULL;
+				}
+			}
+			if (dcb == NULL)
+				dcb = backend_dcb;
+			else if (dcb != backend_dcb)
+				inst->stats.n_table_writes++;
+		}
+		for (i = 0; i < n_tables; i++)
+			free(tables[i]);
+		free(tables);
+		return dcb;
+	}
+
+	qtype = skygw_query_classifier_get_type(sql, 0, NULL);
+	if (QUERY_IS_TYPE(qtype, QUERY_TYPE_BEGIN_TRX))
+	{
+		rses->rses_in_trx = true;
+	}
+	else if (QUERY_IS_TYPE(qtype, QUERY_TYPE_COMMIT) ||
+		(QUERY_IS_TYPE(qtype, QUERY_TYPE_ROLLBACK) && !is_rollback_to(sql)))
+	{
+		rses->rses_in_trx = false;
+	}
+	else if (QUERY_IS_TYPE(qtype, QUERY_TYPE_SESSION_WRITE) ||
+		QUERY_IS_TYPE(qtype, QUERY_TYPE_DISABLE_AUTOCOMMIT) ||
+		QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_NAMED_STMT) ||
+		QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_STMT) ||
+		strchr(sql, '@') != NULL ||
+		strcasestr(sql, "TEMPORARY") != NULL)
+	{
+		rses->rses_pinned = true;
+	}
+	return backend_dcb;
+}
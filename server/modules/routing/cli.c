@@ -273,7 +273,9 @@ CLI_SESSION	*session = (CLI_SESSION *)router_session;
 		queue = gwbuf_consume(queue, GWBUF_LENGTH(queue));
 	}
 
+	dcb_printf_begin(session->session->client);
 	execute_cmd(session);
+	dcb_printf_end(session->session->client);
 	return 1;
 }
 
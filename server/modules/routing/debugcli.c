@@ -292,10 +292,17 @@ CLI_SESSION	*session = (CLI_SESSION *)router_session;
 
 	if (strrchr(session->cmdbuf, '\n'))
 	{
+		dcb_printf_begin(session->session->client);
 		if (execute_cmd(session))
+		{
 			dcb_printf(session->session->client, "MaxScale> ");
+			dcb_printf_end(session->session->client);
+		}
 		else
+		{
+			dcb_printf_end(session->session->client);
                         dcb_close(session->session->client);
+		}
 	}
 	return 1;
 }
@@ -25,7 +25,9 @@
  *
  * Each subcommand has a handler function defined for it that is passeed
  * the DCB to use to print the output of the commands and up to 3 arguments
- * as numeric values.
+ * as numeric values. A subcommand with a negative number of arguments takes
+ * up to that many optional arguments, the handler is passed their number
+ * and the words themselves.
  *
  * There are two "built in" commands, the help command and the quit
  * command.
@@ -58,6 +60,8 @@
 #include <spinlock.h>
 #include <dcb.h>
 #include <poll.h>
+#include <slab.h>
+#include <timer.h>
 #include <users.h>
 #include <dbusers.h>
 #include <config.h>
@@ -96,13 +100,24 @@ struct subcommand {
 };
 
 static	void	telnetdShowUsers(DCB *);
+static	void	showDCBs(DCB *, int, char **);
+static	void	showSessions(DCB *, int, char **);
+static	void	listClients(DCB *, int, char **);
+static	void	listDCBs(DCB *, int, char **);
+static	void	listSessions(DCB *, int, char **);
+
+#define	RANGE_HELP	" [<service>|* [<first> [<count>]]]"
 /**
  * The subcommands of the show command
  */
 struct subcommand showoptions[] = {
-        { "dcbs",	0, dprintAllDCBs,
-		"Show all descriptor control blocks (network connections)",
-		"Show all descriptor control blocks (network connections)",
+	{ "buffers",	0, dprintSlabStats,
+			"Show the buffer pool statistics of the polling threads",
+			"Show the buffer pool statistics of the polling threads",
+				{0, 0, 0} },
+        { "dcbs",	-3, showDCBs,
+		"Show all descriptor control blocks (network connections)" RANGE_HELP,
+		"Show all descriptor control blocks (network connections)" RANGE_HELP,
 				{0, 0, 0} },
 	{ "dcb",	1, dprintDCB,	
 		"Show a single descriptor control block e.g. show dcb 0x493340",
@@ -156,9 +171,21 @@ struct subcommand showoptions[] = {
 		 	"Show a single session in MaxScale, e.g. show session 0x284830",
 		 	"Show a single session in MaxScale, e.g. show session 0x284830",
 				{ARG_TYPE_SESSION, 0, 0} },
-	{ "sessions",	0, dprintAllSessions,
-		 	"Show all active sessions in MaxScale",
-		 	"Show all active sessions in MaxScale",
+	{ "sessions",	-3, showSessions,
+		 	"Show all active sessions in MaxScale" RANGE_HELP,
+		 	"Show all active sessions in MaxScale" RANGE_HELP,
+				{0, 0, 0} },
+	{ "spinlocks",	0, dprintSpinlocks,
+			"Show the spinlock statistics by acquisition site",
+			"Show the spinlock statistics by acquisition site, MaxScale must be built with SPINLOCK_PROFILE",
+				{0, 0, 0} },
+	{ "threads",	0, dprintPollThreads,
+			"Show the load of each polling thread and its longest event handler",
+			"Show the load of each polling thread and its longest event handler",
+				{0, 0, 0} },
+	{ "timers",	0, dprintTimers,
+			"Show the timer wheels of the polling threads",
+			"Show the timer wheels of the polling threads",
 				{0, 0, 0} },
 	{ "users",	0, telnetdShowUsers,
 			"Show statistics and user names for the debug interface",
@@ -172,13 +199,13 @@ struct subcommand showoptions[] = {
  * The subcommands of the list command
  */
 struct subcommand listoptions[] = {
-        { "clients",	0, dListClients,
-		"List all the client connections to MaxScale",
-		"List all the client connections to MaxScale",
+        { "clients",	-3, listClients,
+		"List all the client connections to MaxScale" RANGE_HELP,
+		"List all the client connections to MaxScale" RANGE_HELP,
 				{0, 0, 0} },
-        { "dcbs",	0, dListDCBs,
-		"List all the DCBs active within MaxScale",
-		"List all the DCBs active within MaxScale",
+        { "dcbs",	-3, listDCBs,
+		"List all the DCBs active within MaxScale" RANGE_HELP,
+		"List all the DCBs active within MaxScale" RANGE_HELP,
 				{0, 0, 0} },
         { "filters",	0, dListFilters,
 		"List all the filters defined within MaxScale",
@@ -204,9 +231,9 @@ struct subcommand listoptions[] = {
 		"List all the servers defined within MaxScale",
 		"List all the servers defined within MaxScale",
 				{0, 0, 0} },
-        { "sessions",	0, dListSessions,
-		"List all the active sessions within MaxScale",
-		"List all the active sessions within MaxScale",
+        { "sessions",	-3, listSessions,
+		"List all the active sessions within MaxScale" RANGE_HELP,
+		"List all the active sessions within MaxScale" RANGE_HELP,
 				{0, 0, 0} },
 	{ NULL,		0, NULL,		NULL,	NULL,
 				{0, 0, 0} }
@@ -273,10 +300,15 @@ struct subcommand restartoptions[] = {
 };
 
 static void set_server(DCB *dcb, SERVER *server, char *bit);
+static void set_pollthreads(DCB *dcb, char *count);
 /**
  * The subcommands of the set command
  */
 struct subcommand setoptions[] = {
+	{ "pollthreads",	1, set_pollthreads,
+		"Set the number of polling threads in use, up to the configured threads. E.g. set pollthreads 4",
+		"Set the number of polling threads in use, up to the configured threads. E.g. set pollthreads 4",
+				{ARG_TYPE_STRING, 0, 0} },
 	{ "server",	2, set_server,
 		"Set the status of a server. E.g. set server dbnode4 master",
 		"Set the status of a server. E.g. set server 0x4838320 master",
@@ -717,7 +749,16 @@ char		*ptr, *lptr;
 					if (strcasecmp(args[1], cmds[i].options[j].arg1) == 0)
 					{
                                         	found = 1; /**< command and sub-command match */
-						if (argc != cmds[i].options[j].n_args)
+						if (cmds[i].options[j].n_args < 0)
+						{
+							if (argc > -cmds[i].options[j].n_args)
+								dcb_printf(dcb, "Incorrect number of arguments: %s %s expects at most %d arguments\n",
+									cmds[i].cmd, cmds[i].options[j].arg1,
+									-cmds[i].options[j].n_args);
+							else
+								cmds[i].options[j].fn(dcb, argc, &args[2]);
+						}
+						else if (argc != cmds[i].options[j].n_args)
 						{
 							dcb_printf(dcb, "Incorrect number of arguments: %s %s expects %d arguments\n",
 								cmds[i].cmd, cmds[i].options[j].arg1,
@@ -799,6 +840,133 @@ char		*ptr, *lptr;
 	return 1;
 }
 
+/**
+ * Read the optional arguments of the commands that show all the DCBs or all
+ * the sessions: a service name, or * for all the services, the number of
+ * the first object to show and the number of objects to show.
+ *
+ * @param dcb		The DCB to print any error to
+ * @param argc		The number of arguments
+ * @param argv		The arguments
+ * @param range		The range to fill in
+ * @return		1 if the arguments are valid, otherwise 0
+ */
+static int
+parse_range(DCB *dcb, int argc, char **argv, DIAG_RANGE *range)
+{
+char	*end;
+
+	memset(range, 0, sizeof(DIAG_RANGE));
+	if (argc > 0 && strcmp(argv[0], "*") != 0)
+	{
+		if (service_find(argv[0]) == NULL)
+		{
+			dcb_printf(dcb, "No service %s\n", argv[0]);
+			return 0;
+		}
+		range->service = argv[0];
+	}
+	if (argc > 1)
+	{
+		range->first = strtol(argv[1], &end, 10);
+		if (*end || range->first < 0)
+		{
+			dcb_printf(dcb, "Invalid first entry: %s\n", argv[1]);
+			return 0;
+		}
+	}
+	if (argc > 2)
+	{
+		range->count = strtol(argv[2], &end, 10);
+		if (*end || range->count <= 0)
+		{
+			dcb_printf(dcb, "Invalid count: %s\n", argv[2]);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Show the DCBs, optionally of one service and a page of them
+ *
+ * @param dcb		The DCB to print to
+ * @param argc		The number of arguments
+ * @param argv		The service and the page
+ */
+static void
+showDCBs(DCB *dcb, int argc, char **argv)
+{
+DIAG_RANGE	range;
+
+	if (parse_range(dcb, argc, argv, &range))
+		dprintDCBRange(dcb, &range);
+}
+
+/**
+ * Show the sessions, optionally of one service and a page of them
+ *
+ * @param dcb		The DCB to print to
+ * @param argc		The number of arguments
+ * @param argv		The service and the page
+ */
+static void
+showSessions(DCB *dcb, int argc, char **argv)
+{
+DIAG_RANGE	range;
+
+	if (parse_range(dcb, argc, argv, &range))
+		dprintSessionRange(dcb, &range);
+}
+
+/**
+ * List the client connections, optionally of one service and a page of them
+ *
+ * @param dcb		The DCB to print to
+ * @param argc		The number of arguments
+ * @param argv		The service and the page
+ */
+static void
+listClients(DCB *dcb, int argc, char **argv)
+{
+DIAG_RANGE	range;
+
+	if (parse_range(dcb, argc, argv, &range))
+		dListClientRange(dcb, &range);
+}
+
+/**
+ * List the DCBs, optionally of one service and a page of them
+ *
+ * @param dcb		The DCB to print to
+ * @param argc		The number of arguments
+ * @param argv		The service and the page
+ */
+static void
+listDCBs(DCB *dcb, int argc, char **argv)
+{
+DIAG_RANGE	range;
+
+	if (parse_range(dcb, argc, argv, &range))
+		dListDCBRange(dcb, &range);
+}
+
+/**
+ * List the sessions, optionally of one service and a page of them
+ *
+ * @param dcb		The DCB to print to
+ * @param argc		The number of arguments
+ * @param argv		The service and the page
+ */
+static void
+listSessions(DCB *dcb, int argc, char **argv)
+{
+DIAG_RANGE	range;
+
+	if (parse_range(dcb, argc, argv, &range))
+		dListSessionRange(dcb, &range);
+}
+
 /**
  * Debug command to stop a service
  *
@@ -871,6 +1039,24 @@ unsigned int bitvalue;
 }
 
 
+/**
+ * Set the number of polling threads that serve connections, the others
+ * retire once their connections are closed
+ *
+ * @param dcb		DCB to send output to
+ * @param count		String representation of the number of threads
+ */
+static void
+set_pollthreads(DCB *dcb, char *count)
+{
+	if (poll_set_threads(atoi(count)) < 0)
+		dcb_printf(dcb, "The number of polling threads must be from 1 to %d\n",
+					config_threadcount());
+	else
+		dcb_printf(dcb, "Using %d of %d polling threads.\n",
+					poll_active_threads(), config_threadcount());
+}
+
 /**
  * Clear the status bit of a server
  *
@@ -38,6 +38,38 @@
  * as slaves. If neither option is specified the router will connect to either
  * masters or slaves.
  *
+ * The affinity option, affinity=[user|database|address], places the sessions
+ * of the same client user, default database or client address on the same
+ * server. The servers are put on a consistent hash ring, adding or removing
+ * one of N servers moves about 1/N of the keys to another server.
+ *
+ * The passthrough option forwards the data of an authenticated session
+ * between the client and the backend sockets with splice, the data no
+ * longer passes through MaxScale buffers. Sessions of a service with
+ * filters are not spliced.
+ *
+ * The flow_control option keeps new sessions away from the Galera nodes
+ * that asked for flow control in the last monitor interval, as long as
+ * there are other eligible nodes. Those nodes are holding up the writes
+ * of the whole cluster.
+ *
+ * The rebalance option moves a session to a less loaded server between
+ * two statements, when moving it makes the load of the servers more even.
+ * Only sessions whose state a new connection gets by authenticating are
+ * moved, see session_track_state, so that after a server returns from
+ * maintenance the sessions of long lived client pools spread over it.
+ *
+ * The reconnect option, with the master option, moves a session to the new
+ * master when its connection to the master is lost or its server is no
+ * longer the master, instead of the session being closed. Only a session
+ * with no transaction open and nothing a new connection would lack is
+ * moved, the transaction state is taken from the status flags of the OK
+ * and EOF packets that end the replies, see session_track_reply. The new
+ * connection is made at the next statement of the session, it gets the
+ * user and the database of the session by its authentication, or with a
+ * COM_CHANGE_USER when it comes from the persistent pool. The statement
+ * waits up to READCONN_RECONNECT_TIMEOUT milliseconds for a master.
+ *
  * @verbatim
  * Revision History
  *
@@ -73,6 +105,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <service.h>
 #include <server.h>
 #include <router.h>
@@ -82,12 +115,17 @@
 #include <dcb.h>
 #include <spinlock.h>
 #include <modinfo.h>
+#include <hint.h>
+#include <mysql.h>
+#include <mysql_packet.h>
 
 #include <skygw_types.h>
 #include <skygw_utils.h>
 #include <log_manager.h>
 
 #include <mysql_client_server_protocol.h>
+#include <tracepoint.h>
+#include <modutil.h>
 
 extern int lm_enabled_logfiles_bitmask;
 
@@ -120,6 +158,7 @@ static  void             handleError(
         error_action_t   action,
         bool             *succp);
 static  uint8_t getCapabilities (ROUTER* inst, void* router_session);
+static	int	hint_is_followed(BACKEND *backend, HINT *hint);
 
 
 /** The module object definition */
@@ -144,6 +183,33 @@ static void rses_end_locked_router_action(
 static BACKEND *get_root_master(
 	BACKEND **servers);
 
+static BACKEND *backend_select(ROUTER_INSTANCE *inst, char *key);
+static int	ring_build(ROUTER_INSTANCE *inst);
+static BACKEND	*ring_lookup(ROUTER_INSTANCE *inst, char *key);
+static char	*session_affinity_key(ROUTER_INSTANCE *inst, SESSION *session);
+static void	session_splice(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+				DCB *backend_dcb);
+static int	backend_release(ROUTER_INSTANCE *inst, BACKEND *backend);
+static void	heap_rebuild(ROUTER_INSTANCE *inst);
+static void	heap_server_event(int events, SERVER *server, void *data);
+static BACKEND	*backend_probe(ROUTER_INSTANCE *inst);
+static void	session_track_state(ROUTER_CLIENT_SES *rses, GWBUF *queue,
+				int mysql_command);
+static void	session_rebalance(ROUTER_INSTANCE *inst,
+				ROUTER_CLIENT_SES *rses);
+static int	session_move(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+				BACKEND *target);
+static void	session_expect_reply(ROUTER_CLIENT_SES *rses, int mysql_command);
+static int	session_reply_pending(ROUTER_CLIENT_SES *rses);
+static void	session_track_reply(ROUTER_CLIENT_SES *rses, GWBUF *queue);
+static void	session_master_check(ROUTER_INSTANCE *inst,
+				ROUTER_CLIENT_SES *rses);
+static int	session_lose_master(ROUTER_CLIENT_SES *rses, DCB *dcb);
+static int	session_reconnect(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+				GWBUF *queue, int mysql_command);
+static int	session_reconnect_try(ROUTER_CLIENT_SES *rses);
+static void	session_reconnect_expired(void *data);
+
 static SPINLOCK	instlock;
 static ROUTER_INSTANCE *instances;
 
@@ -207,6 +273,11 @@ char		*weightby;
         if ((inst = calloc(1, sizeof(ROUTER_INSTANCE))) == NULL) {
                 return NULL;
         }
+	if ((inst->stats = ts_stats_alloc(READCONN_N_STATS)) == NULL)
+	{
+		free(inst);
+		return NULL;
+	}
 
 	inst->service = service;
 	spinlock_init(&inst->lock);
@@ -222,9 +293,19 @@ char		*weightby;
 	inst->servers = (BACKEND **)calloc(n + 1, sizeof(BACKEND *));
 	if (!inst->servers)
 	{
+		ts_stats_free(inst->stats);
 		free(inst);
 		return NULL;
 	}
+	inst->heap = (BACKEND **)calloc(n + 1, sizeof(BACKEND *));
+	if (!inst->heap)
+	{
+		free(inst->servers);
+		ts_stats_free(inst->stats);
+		free(inst);
+		return NULL;
+	}
+	spinlock_init(&inst->heaplock);
 
 	for (server = service->databases, n = 0; server; server = server->nextdb)
 	{
@@ -233,12 +314,16 @@ char		*weightby;
 			for (i = 0; i < n; i++)
 				free(inst->servers[i]);
 			free(inst->servers);
+			free(inst->heap);
+			ts_stats_free(inst->stats);
 			free(inst);
 			return NULL;
 		}
 		inst->servers[n]->server = server;
 		inst->servers[n]->current_connection_count = 0;
 		inst->servers[n]->weight = 1000;
+		inst->servers[n]->n_selected = 0;
+		inst->servers[n]->heap_index = -1;
 		n++;
 	}
 	inst->servers[n] = NULL;
@@ -311,6 +396,34 @@ char		*weightby;
 				inst->bitmask |= (SERVER_JOINED);
 				inst->bitvalue |= SERVER_JOINED;
 			}
+			else if (!strcasecmp(options[i], "affinity=user"))
+			{
+				inst->affinity = READCONN_AFFINITY_USER;
+			}
+			else if (!strcasecmp(options[i], "affinity=database"))
+			{
+				inst->affinity = READCONN_AFFINITY_DATABASE;
+			}
+			else if (!strcasecmp(options[i], "affinity=address"))
+			{
+				inst->affinity = READCONN_AFFINITY_ADDRESS;
+			}
+			else if (!strcasecmp(options[i], "passthrough"))
+			{
+				inst->passthrough = 1;
+			}
+			else if (!strcasecmp(options[i], "flow_control"))
+			{
+				inst->flow_control = 1;
+			}
+			else if (!strcasecmp(options[i], "rebalance"))
+			{
+				inst->rebalance = 1;
+			}
+			else if (!strcasecmp(options[i], "reconnect"))
+			{
+				inst->reconnect = 1;
+			}
 			else
 			{
                             LOGIF(LM, (skygw_log_write(
@@ -318,11 +431,68 @@ char		*weightby;
                                            "* Warning : Unsupported router "
                                            "option \'%s\' for readconnroute. "
                                            "Expected router options are "
-                                           "[slave|master|synced]",
+                                           "[slave|master|synced|passthrough|"
+                                           "flow_control|rebalance|reconnect|"
+                                           "affinity=[user|database|address]]",
                                                options[i])));
 			}
 		}
 	}
+	if (inst->affinity != READCONN_AFFINITY_NONE &&
+		(inst->bitvalue & SERVER_MASTER))
+	{
+		LOGIF(LM, (skygw_log_write(
+			LOGFILE_MESSAGE,
+			"* Warning : The affinity option of service '%s' is "
+			"ignored with the master option.",
+			service->name)));
+		inst->affinity = READCONN_AFFINITY_NONE;
+	}
+	if (inst->rebalance &&
+		(inst->affinity != READCONN_AFFINITY_NONE || inst->passthrough ||
+		(inst->bitvalue & SERVER_MASTER)))
+	{
+		LOGIF(LM, (skygw_log_write(
+			LOGFILE_MESSAGE,
+			"* Warning : The rebalance option of service '%s' is "
+			"ignored with the affinity, passthrough and master "
+			"options.",
+			service->name)));
+		inst->rebalance = 0;
+	}
+	if (inst->reconnect &&
+		(!(inst->bitvalue & SERVER_MASTER) || inst->passthrough))
+	{
+		LOGIF(LM, (skygw_log_write(
+			LOGFILE_MESSAGE,
+			"* Warning : The reconnect option of service '%s' is "
+			"only used with the master option and without the "
+			"passthrough option.",
+			service->name)));
+		inst->reconnect = 0;
+	}
+	if (inst->affinity != READCONN_AFFINITY_NONE && !ring_build(inst))
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : Failed to allocate the hash ring of service "
+			"'%s'. Sessions are balanced by connection count.",
+			service->name)));
+		inst->affinity = READCONN_AFFINITY_NONE;
+	}
+
+	spinlock_acquire(&inst->heaplock);
+	heap_rebuild(inst);
+	spinlock_release(&inst->heaplock);
+	if (server_event_subscribe(SERVER_EVENT_STATUS & ~SERVER_EVENT_LAG,
+					heap_server_event, inst) == NULL)
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : Failed to listen for the server events of "
+			"service '%s'.",
+			service->name)));
+	}
 
 	/*
 	 * We have completed the creation of the instance data, so now
@@ -350,8 +520,6 @@ newSession(ROUTER *instance, SESSION *session)
 ROUTER_INSTANCE	        *inst = (ROUTER_INSTANCE *)instance;
 ROUTER_CLIENT_SES       *client_rses;
 BACKEND                 *candidate = NULL;
-int                     i;
-BACKEND *master_host = NULL;
 
         LOGIF(LD, (skygw_log_write_flush(
                 LOGFILE_DEBUG,
@@ -362,7 +530,9 @@ BACKEND *master_host = NULL;
                 inst)));
 
 
-	client_rses = (ROUTER_CLIENT_SES *)calloc(1, sizeof(ROUTER_CLIENT_SES));
+	/*< The router session is freed with the session */
+	client_rses = (ROUTER_CLIENT_SES *)session_arena_alloc(session,
+						sizeof(ROUTER_CLIENT_SES));
 
         if (client_rses == NULL) {
                 return NULL;
@@ -373,137 +543,34 @@ BACKEND *master_host = NULL;
         client_rses->rses_chk_tail = CHK_NUM_ROUTER_SES;
 #endif
 
-	/**
-         * Find the Master host from available servers
-	 */
-        master_host = get_root_master(inst->servers);
-
 	/**
 	 * Find a backend server to connect to. This is the extent of the
 	 * load balancing algorithm we need to implement for this simple
-	 * connection router.
-	 */
-
-	/*
-	 * Loop over all the servers and find any that have fewer connections
-         * than the candidate server.
+	 * connection router. The candidate is the least loaded of the
+	 * eligible servers, or the server of the session's key with the
+	 * affinity option, see backend_select, and the connection count of
+	 * the candidate is bumped.
 	 *
-	 * If a server has less connections than the current candidate we mark this
-	 * as the new candidate to connect to.
-	 *
-	 * If a server has the same number of connections currently as the candidate
-	 * and has had less connections over time than the candidate it will also
-	 * become the new candidate. This has the effect of spreading the
-         * connections over different servers during periods of very low load.
-	 */
-	for (i = 0; inst->servers[i]; i++) {
-		if(inst->servers[i]) {
-			LOGIF(LD, (skygw_log_write(
-				LOGFILE_DEBUG,
-				"%lu [newSession] Examine server in port %d with "
-                                "%d connections. Status is %d, "
-				"inst->bitvalue is %d",
-                                pthread_self(),
-				inst->servers[i]->server->port,
-				inst->servers[i]->current_connection_count,
-				inst->servers[i]->server->status,
-				inst->bitmask)));
-		}
-
-		if (SERVER_IN_MAINT(inst->servers[i]->server))
-			continue;
-
-		/* Check server status bits against bitvalue from router_options */
-		if (inst->servers[i] &&
-			SERVER_IS_RUNNING(inst->servers[i]->server) &&
-			(inst->servers[i]->server->status & inst->bitmask & inst->bitvalue))
-                {
-			if (master_host) {
-				if (inst->servers[i] == master_host && (inst->bitvalue & SERVER_SLAVE)) {
-					/* skip root Master here, as it could also be slave of an external server
-					 * that is not in the configuration.
-					 * Intermediate masters (Relay Servers) are also slave and will be selected
-					 * as Slave(s)
-			 		 */
-
-					continue;
-				}
-				if (inst->servers[i] == master_host && (inst->bitvalue & SERVER_MASTER)) {
-					/* If option is "master" return only the root Master as there
-					 * could be intermediate masters (Relay Servers)
-					 * and they must not be selected.
-			 	 	 */
-
-					candidate = master_host;
-					break;
-				}
-			} else {
-					/* master_host is NULL, no master server.
-					 * If requested router_option is 'master'
-					 * candidate wll be NULL.
-					 */
-					if (inst->bitvalue & SERVER_MASTER) {
-                                                candidate = NULL;
-                                                break;
-					}
-			}
-
-			/* If no candidate set, set first running server as
-			our initial candidate server */
-			if (candidate == NULL)
-                        {
-				candidate = inst->servers[i];
-			}
-                        else if ((inst->servers[i]->current_connection_count 
-					* 1000) / inst->servers[i]->weight <
-                                   (candidate->current_connection_count *
-					1000) / candidate->weight)
-                        {
-				/* This running server has fewer
-				connections, set it as a new candidate */
-				candidate = inst->servers[i];
-			}
-                        else if ((inst->servers[i]->current_connection_count 
-					* 1000) / inst->servers[i]->weight ==
-                                   (candidate->current_connection_count *
-					1000) / candidate->weight &&
-                                 inst->servers[i]->server->stats.n_connections <
-                                 candidate->server->stats.n_connections)
-                        {
-				/* This running server has the same number
-				of connections currently as the candidate
-				but has had fewer connections over time
-				than candidate, set this server to candidate*/
-				candidate = inst->servers[i];
-			}
-		}
-	}
-
-	/* There is no candidate server here!
-	 * With router_option=slave a master_host could be set, so route traffic there.
-	 * Otherwise, just clean up and return NULL
+	 * There is no candidate server if none is eligible. With
+	 * router_option=slave a master_host could be set, so route traffic
+	 * there. Otherwise, just clean up and return NULL.
 	 */
-	if (!candidate) {
-		if (master_host) {
-			candidate = master_host;
-		} else {
-                	LOGIF(LE, (skygw_log_write_flush(
-                      	  LOGFILE_ERROR,
-                      	  "Error : Failed to create new routing session. "
-                      	  "Couldn't find eligible candidate server. Freeing "
-                       	 "allocated resources.")));
-			free(client_rses);
-			return NULL;
-		}
+	if ((candidate = backend_select(inst,
+				session_affinity_key(inst, session))) == NULL)
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : Failed to create new routing session. "
+			"Couldn't find eligible candidate server. Freeing "
+			"allocated resources.")));
+		return NULL;
 	}
 
 	client_rses->rses_capabilities = RCAP_TYPE_PACKET_INPUT;
+	client_rses->rses_session = session;
+	client_rses->rses_inst = inst;
+	timer_init(&client_rses->rses_timer);
         
-	/*
-	 * We now have the server with the least connections.
-	 * Bump the connection count for this server
-	 */
-	atomic_add(&candidate->current_connection_count, 1);
 	client_rses->backend = candidate;
         LOGIF(LD, (skygw_log_write(
                 LOGFILE_DEBUG,
@@ -521,11 +588,10 @@ BACKEND *master_host = NULL;
                                       candidate->server->protocol);
         if (client_rses->backend_dcb == NULL)
 	{
-                atomic_add(&candidate->current_connection_count, -1);
-		free(client_rses);
+                backend_release(inst, candidate);
 		return NULL;
 	}
-	inst->stats.n_sessions++;
+	ts_stats_add(inst->stats, READCONN_N_SESSIONS, 1);
 
 	/**
          * Add this session to the list of active sessions.
@@ -566,7 +632,7 @@ static void freeSession(
                 (ROUTER_CLIENT_SES *)router_client_ses;
         int prev_val;
         
-        prev_val = atomic_add(&router_cli_ses->backend->current_connection_count, -1);
+        prev_val = backend_release(router, router_cli_ses->backend);
         ss_dassert(prev_val > 0);
         
 	spinlock_acquire(&router->lock);
@@ -595,8 +661,7 @@ static void freeSession(
                 router,
                 router_cli_ses->backend->server->port,
                 prev_val-1)));
-
-        free(router_cli_ses);
+        /*< The router session is in the arena of the session */
 }
 
 
@@ -612,6 +677,7 @@ closeSession(ROUTER *instance, void *router_session)
 {
 ROUTER_CLIENT_SES *router_cli_ses = (ROUTER_CLIENT_SES *)router_session;
 DCB*              backend_dcb;
+GWBUF*            held;
 
         CHK_CLIENT_RSES(router_cli_ses);
         /**
@@ -624,9 +690,15 @@ DCB*              backend_dcb;
 
                 backend_dcb = router_cli_ses->backend_dcb;
                 router_cli_ses->backend_dcb = NULL;
+                held = router_cli_ses->rses_held;
+                router_cli_ses->rses_held = NULL;
                 router_cli_ses->rses_closed = true;
                 /** Unlock */
                 rses_end_locked_router_action(router_cli_ses);
+
+                timer_disable(&router_cli_ses->rses_timer);
+                if (held != NULL)
+                        gwbuf_consume(held, gwbuf_length(held));
                 
                 /**
                  * Close the backend server connection
@@ -658,9 +730,52 @@ routeQuery(ROUTER *instance, void *router_session, GWBUF *queue)
         int               rc;
         DCB*              backend_dcb;
         bool              rses_is_closed;
+        HINT*             hint;
        
-	inst->stats.n_queries++;
+	ts_stats_add(inst->stats, READCONN_N_QUERIES, 1);
 	mysql_command = MYSQL_GET_COMMAND(payload);
+	TRACEPOINT4(router__query, router_cli_ses->backend_dcb != NULL ?
+			router_cli_ses->backend_dcb->session : NULL,
+			router_cli_ses, TRACEPOINT_BUFLEN(queue), mysql_command);
+
+	/**
+	 * The session has a single connection, a hint for another server
+	 * can not be followed. The statement is sent to the connection.
+	 */
+	if (mysql_command == MYSQL_COM_QUERY &&
+		(hint = hint_route(hint_get(queue))) != NULL &&
+		!hint_is_followed(router_cli_ses->backend, hint))
+	{
+		ts_stats_add(inst->stats, READCONN_N_HINT_IGNORED, 1);
+		LOGIF(LT, (skygw_log_write(
+			LOGFILE_TRACE,
+			"Routing hint can not be followed, the session is "
+			"connected to %s:%d.",
+			router_cli_ses->backend->server->name,
+			router_cli_ses->backend->server->port)));
+	}
+
+	if ((inst->rebalance || inst->reconnect) && !router_cli_ses->rses_closed)
+	{
+		if (mysql_command == MYSQL_COM_QUERY &&
+			!router_cli_ses->rses_sticky &&
+			!router_cli_ses->rses_in_trx)
+		{
+			if (inst->rebalance)
+				session_rebalance(inst, router_cli_ses);
+			else
+				session_master_check(inst, router_cli_ses);
+		}
+		session_track_state(router_cli_ses, queue, mysql_command);
+		session_expect_reply(router_cli_ses, mysql_command);
+	}
+
+	/*< The connection to the master was lost, the session waits for a new one */
+	if (inst->reconnect && router_cli_ses->rses_lost_at != 0 &&
+		router_cli_ses->backend_dcb == NULL && !router_cli_ses->rses_closed)
+	{
+		return session_reconnect(inst, router_cli_ses, queue, mysql_command);
+	}
 
         /** Dirty read for quick check if router is closed. */
         if (router_cli_ses->rses_closed)
@@ -702,6 +817,8 @@ routeQuery(ROUTER *instance, void *router_session, GWBUF *queue)
 		break;
         default:
                 rc = backend_dcb->func.write(backend_dcb, queue);
+                if (inst->passthrough && mysql_command != MYSQL_COM_QUIT)
+                        session_splice(inst, router_cli_ses, backend_dcb);
                 break;
         }
         
@@ -743,10 +860,30 @@ char              *weightby;
 	spinlock_release(&router_inst->lock);
 	
 	dcb_printf(dcb, "\tNumber of router sessions:   	%d\n",
-                   router_inst->stats.n_sessions);
+                   ts_stats_get(router_inst->stats, READCONN_N_SESSIONS));
 	dcb_printf(dcb, "\tCurrent no. of router sessions:	%d\n", i);
 	dcb_printf(dcb, "\tNumber of queries forwarded:   	%d\n",
-                   router_inst->stats.n_queries);
+                   ts_stats_get(router_inst->stats, READCONN_N_QUERIES));
+	dcb_printf(dcb, "\tRouting hints not followed:   	%d\n",
+                   ts_stats_get(router_inst->stats, READCONN_N_HINT_IGNORED));
+	if (router_inst->affinity != READCONN_AFFINITY_NONE)
+	{
+		dcb_printf(dcb, "\tSession affinity by:   		%s\n",
+			router_inst->affinity == READCONN_AFFINITY_USER ? "user" :
+			router_inst->affinity == READCONN_AFFINITY_DATABASE ?
+							"database" : "address");
+		dcb_printf(dcb, "\tSessions placed by affinity:   	%d\n",
+			ts_stats_get(router_inst->stats, READCONN_N_AFFINITY));
+	}
+	if (router_inst->passthrough)
+		dcb_printf(dcb, "\tSessions forwarded by splice:  	%d\n",
+			ts_stats_get(router_inst->stats, READCONN_N_SPLICED));
+	if (router_inst->rebalance)
+		dcb_printf(dcb, "\tSessions moved to rebalance:  	%d\n",
+			ts_stats_get(router_inst->stats, READCONN_N_REBALANCED));
+	if (router_inst->reconnect)
+		dcb_printf(dcb, "\tSessions moved to a new master:	%d\n",
+			ts_stats_get(router_inst->stats, READCONN_N_RECONNECTED));
 	if ((weightby = serviceGetWeightingParameter(router_inst->service))
 							!= NULL)
 	{
@@ -784,19 +921,26 @@ clientReply(
         GWBUF  *queue,
         DCB    *backend_dcb)
 {
+	ROUTER_INSTANCE *inst = (ROUTER_INSTANCE *)instance;
 	DCB *client = NULL;
 
 	client = backend_dcb->session->client;
 
 	ss_dassert(client != NULL);
 
+	if (inst->rebalance || inst->reconnect)
+		session_track_reply((ROUTER_CLIENT_SES *)router_session, queue);
+
 	SESSION_ROUTE_REPLY(backend_dcb->session, queue);
 }
 
 /**
  * Error Handler routine
  *
- * The routine will handle errors that occurred in backend writes.
+ * The routine will handle errors that occurred in backend writes. With the
+ * reconnect option a session that loses an idle connection to its master
+ * is kept, it moves to the new master at its next statement. Any other
+ * error closes the session.
  *
  * @param       instance        The router instance
  * @param       router_session  The router session
@@ -814,11 +958,18 @@ handleError(
         error_action_t   action,
         bool             *succp)
 {
+	ROUTER_INSTANCE	*inst = (ROUTER_INSTANCE *)instance;
 	DCB		*client = NULL;
 	SESSION         *session = backend_dcb->session;
 	client = session->client;
 
 	ss_dassert(client != NULL);
+
+	*succp = (action == ERRACT_NEW_CONNECTION && inst->reconnect &&
+		router_session != NULL &&
+		session_lose_master((ROUTER_CLIENT_SES *)router_session,
+					backend_dcb));
+	gwbuf_free(errbuf);
 }
 
 /** to be inline'd */
@@ -917,3 +1068,1183 @@ static BACKEND *get_root_master(BACKEND **servers) {
 	}
 	return master_host;
 }
+
+/**
+ * Check if the statement of a hint would be routed to the server the
+ * session is connected to.
+ *
+ * @param backend	The backend of the session
+ * @param hint		The routing hint of the statement
+ * @return		Non-zero if the hint is for that server
+ */
+static int
+hint_is_followed(BACKEND *backend, HINT *hint)
+{
+	switch (hint->type)
+	{
+	case HINT_ROUTE_TO_MASTER:
+		return SERVER_IS_MASTER(backend->server);
+	case HINT_ROUTE_TO_SLAVE:
+		return SERVER_IS_SLAVE(backend->server);
+	case HINT_ROUTE_TO_NAMED_SERVER:
+		return backend->server->unique_name != NULL &&
+			strcmp(backend->server->unique_name, hint->data) == 0;
+	default:
+		break;
+	}
+	return 1;
+}
+
+/**
+ * Compare the load of two backends. The load is the number of current
+ * connections relative to the weight of the server. When two servers have
+ * the same load the one that has been chosen for fewer sessions since
+ * startup has the lower load, this spreads the connections over different
+ * servers during periods of very low load.
+ *
+ * @param a	A backend
+ * @param b	Another backend
+ * @return	Negative if a has the lower load, positive if b has, else 0
+ */
+static int
+backend_cmp(BACKEND *a, BACKEND *b)
+{
+int	la = (a->current_connection_count * 1000) / a->weight;
+int	lb = (b->current_connection_count * 1000) / b->weight;
+
+	if (la != lb)
+		return la < lb ? -1 : 1;
+	return a->n_selected - b->n_selected;
+}
+
+/**
+ * Swap two entries of the heap
+ *
+ * @param heap	The heap
+ * @param i	Index of an entry
+ * @param j	Index of another entry
+ */
+static void
+heap_swap(BACKEND **heap, int i, int j)
+{
+BACKEND	*tmp = heap[i];
+
+	heap[i] = heap[j];
+	heap[j] = tmp;
+	heap[i]->heap_index = i;
+	heap[j]->heap_index = j;
+}
+
+/**
+ * Move an entry of the heap towards the top while its load is lower than
+ * the load of its parent, after the load of the backend went down.
+ *
+ * @param inst	The router instance, the heaplock is held
+ * @param i	Index of the entry
+ */
+static void
+heap_sift_up(ROUTER_INSTANCE *inst, int i)
+{
+	while (i > 0 && backend_cmp(inst->heap[i], inst->heap[(i - 1) / 2]) < 0)
+	{
+		heap_swap(inst->heap, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+/**
+ * Move an entry of the heap away from the top while one of its children
+ * has a lower load, after the load of the backend went up.
+ *
+ * @param inst	The router instance, the heaplock is held
+ * @param i	Index of the entry
+ */
+static void
+heap_sift_down(ROUTER_INSTANCE *inst, int i)
+{
+int	child;
+
+	while ((child = 2 * i + 1) < inst->n_heap)
+	{
+		if (child + 1 < inst->n_heap &&
+			backend_cmp(inst->heap[child + 1], inst->heap[child]) < 0)
+			child++;
+		if (backend_cmp(inst->heap[child], inst->heap[i]) >= 0)
+			break;
+		heap_swap(inst->heap, i, child);
+		i = child;
+	}
+}
+
+/**
+ * Is a server eligible for new sessions by its status. A server must be
+ * running, not in maintenance and have the status bits given by the router
+ * options. With router_option=slave the root master is not eligible, as it
+ * could also be slave of an external server that is not in the
+ * configuration. Intermediate masters (Relay Servers) are also slave and
+ * will be selected as Slave(s).
+ *
+ * @param inst		The router instance, the heaplock is held
+ * @param backend	The backend to check
+ * @return		Non-zero if the server is eligible
+ */
+static int
+backend_is_eligible(ROUTER_INSTANCE *inst, BACKEND *backend)
+{
+	if (SERVER_IN_MAINT(backend->server) ||
+		!SERVER_IS_RUNNING(backend->server) ||
+		!(backend->server->status & inst->bitmask & inst->bitvalue))
+		return 0;
+	if (backend == inst->master_host && (inst->bitvalue & SERVER_SLAVE))
+		return 0;
+	return 1;
+}
+
+/**
+ * Build the heap of the servers that are eligible for new sessions from
+ * the current statuses of the servers. Servers whose circuit breaker is
+ * open are left out of the heap and counted in n_ejected. With the
+ * flow_control option the nodes that ask for flow control are left out
+ * too, unless no other server is eligible.
+ *
+ * @param inst	The router instance, the heaplock is held
+ */
+static void
+heap_rebuild(ROUTER_INSTANCE *inst)
+{
+BACKEND	*backend;
+int	i, avoid = 0;
+
+	inst->heap_stale = 0;
+	inst->master_host = get_root_master(inst->servers);
+	for (i = 0; inst->flow_control && !avoid && inst->servers[i]; i++)
+	{
+		backend = inst->servers[i];
+		avoid = backend_is_eligible(inst, backend) &&
+			SERVER_CIRCUIT_IS_CLOSED(backend->server) &&
+			!SERVER_IS_THROTTLING(backend->server);
+	}
+	inst->n_heap = 0;
+	inst->n_ejected = 0;
+
+	for (i = 0; inst->servers[i]; i++)
+	{
+		backend = inst->servers[i];
+		backend->heap_index = -1;
+
+		if (!backend_is_eligible(inst, backend))
+			continue;
+		if (!SERVER_CIRCUIT_IS_CLOSED(backend->server))
+		{
+			inst->n_ejected++;
+			continue;
+		}
+		if (avoid && SERVER_IS_THROTTLING(backend->server))
+			continue;
+		backend->heap_index = inst->n_heap;
+		inst->heap[inst->n_heap++] = backend;
+	}
+	for (i = inst->n_heap / 2 - 1; i >= 0; i--)
+		heap_sift_down(inst, i);
+}
+
+/**
+ * The listener for the events of the servers. The heap is marked stale when
+ * one of the servers of the router has changed, the next choice of a
+ * server rebuilds it.
+ *
+ * @param events	The SERVER_EVENT bits
+ * @param server	The server that has changed
+ * @param data		The router instance
+ */
+static void
+heap_server_event(int events, SERVER *server, void *data)
+{
+ROUTER_INSTANCE	*inst = (ROUTER_INSTANCE *)data;
+int		i;
+
+	for (i = 0; inst->servers[i]; i++)
+	{
+		if (inst->servers[i]->server == server)
+		{
+			inst->heap_stale = 1;
+			break;
+		}
+	}
+}
+
+/**
+ * Find the least loaded server in the heap that has not reached its
+ * max_connections, the heap is not ordered by fullness so all of it is
+ * looked at. With option "master" only the root Master may be chosen.
+ *
+ * @param inst	The router instance, the heaplock is held
+ * @return	The backend or NULL if all the servers are full
+ */
+static BACKEND *
+heap_open_backend(ROUTER_INSTANCE *inst)
+{
+BACKEND	*best = NULL;
+int	i;
+
+	if (inst->bitvalue & SERVER_MASTER)
+		return NULL;
+	for (i = 0; i < inst->n_heap; i++)
+	{
+		if (!SERVER_IS_FULL(inst->heap[i]->server) &&
+			(best == NULL || backend_cmp(inst->heap[i], best) < 0))
+			best = inst->heap[i];
+	}
+	return best;
+}
+
+/**
+ * Choose the server for a new session and bump its connection count.
+ *
+ * With a session key the chosen server is the one of the first node on
+ * the hash ring at or after the hash of the key that belongs to an eligible
+ * server. Otherwise the chosen server is the eligible server with the
+ * lowest load, found at the top of the heap. The heap is rebuilt only when
+ * the status of one of its servers has changed since it was built, see
+ * heap_server_event, otherwise the choice and the update of the heap take
+ * O(log n) steps.
+ *
+ * A server whose circuit breaker is open is chosen only when it may take
+ * a probe session, see backend_probe. A server that has reached its
+ * max_connections is passed over for the least loaded server that has not,
+ * the fullness changes with every connection so it is not kept in the heap.
+ *
+ * If option is "master" the root Master is chosen if it is eligible, as
+ * there could be intermediate masters (Relay Servers) and they must not
+ * be selected. When no server is eligible the root Master is chosen, if
+ * there is one, its circuit is closed and the option is not "master".
+ *
+ * @param inst	The router instance
+ * @param key	The affinity key of the session or NULL
+ * @return	The chosen backend or NULL if there is none
+ */
+static BACKEND *
+backend_select(ROUTER_INSTANCE *inst, char *key)
+{
+BACKEND	*candidate = NULL;
+
+	spinlock_acquire(&inst->heaplock);
+	if (inst->heap_stale)
+		heap_rebuild(inst);
+
+	if (inst->n_ejected > 0 && (candidate = backend_probe(inst)) != NULL)
+	{
+		LOGIF(LT, (skygw_log_write(
+			LOGFILE_TRACE,
+			"Probe session sent to %s:%d.",
+			candidate->server->name,
+			candidate->server->port)));
+	}
+	else if (key && inst->n_ring > 0 &&
+		(candidate = ring_lookup(inst, key)) != NULL)
+	{
+		ts_stats_add(inst->stats, READCONN_N_AFFINITY, 1);
+	}
+	else if (inst->bitvalue & SERVER_MASTER)
+	{
+		if (inst->master_host == NULL)
+			candidate = NULL;
+		else if (inst->master_host->heap_index >= 0)
+			candidate = inst->master_host;
+		else if (inst->n_heap > 0)
+			candidate = inst->heap[0];
+		else if (SERVER_CIRCUIT_IS_CLOSED(inst->master_host->server))
+			candidate = inst->master_host;
+	}
+	else if (inst->n_heap > 0)
+		candidate = inst->heap[0];
+	else if (inst->master_host &&
+		SERVER_CIRCUIT_IS_CLOSED(inst->master_host->server))
+		candidate = inst->master_host;
+
+	if (candidate && SERVER_IS_FULL(candidate->server))
+		candidate = heap_open_backend(inst);
+
+	if (candidate)
+	{
+		atomic_add(&candidate->current_connection_count, 1);
+		candidate->n_selected++;
+		if (candidate->heap_index >= 0)
+			heap_sift_down(inst, candidate->heap_index);
+	}
+	spinlock_release(&inst->heaplock);
+
+	return candidate;
+}
+
+/**
+ * Find an eligible server whose circuit breaker is open and that may take a
+ * probe session, the probe tests whether the server has recovered.
+ *
+ * @param inst	The router instance, the heaplock is held
+ * @return	The backend for the probe or NULL if there is none
+ */
+static BACKEND *
+backend_probe(ROUTER_INSTANCE *inst)
+{
+BACKEND	*backend;
+int	i;
+
+	for (i = 0; (backend = inst->servers[i]) != NULL; i++)
+	{
+		if (backend->heap_index < 0 &&
+			!SERVER_CIRCUIT_IS_CLOSED(backend->server) &&
+			backend_is_eligible(inst, backend) &&
+			server_circuit_probe(backend->server))
+			return backend;
+	}
+	return NULL;
+}
+
+/**
+ * Drop the connection count of a backend when a session is freed
+ *
+ * @param inst		The router instance
+ * @param backend	The backend of the session
+ * @return		The connection count before it was dropped
+ */
+static int
+backend_release(ROUTER_INSTANCE *inst, BACKEND *backend)
+{
+int	prev_val;
+
+	spinlock_acquire(&inst->heaplock);
+	prev_val = atomic_add(&backend->current_connection_count, -1);
+	if (backend->heap_index >= 0)
+		heap_sift_up(inst, backend->heap_index);
+	spinlock_release(&inst->heaplock);
+
+	return prev_val;
+}
+
+/**
+ * The FNV-1a hash of a string, the bits are mixed at the end so that keys
+ * that differ in the last characters only spread over the whole ring
+ *
+ * @param str	The string to hash
+ * @return	The hash value
+ */
+static unsigned int
+ring_hash(char *str)
+{
+unsigned int	hash = 2166136261U;
+
+	while (*str)
+	{
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619U;
+	}
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bU;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35U;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+/**
+ * Order the nodes of the ring by their hash
+ */
+static int
+ring_node_cmp(const void *a, const void *b)
+{
+unsigned int	ha = ((RING_NODE *)a)->hash, hb = ((RING_NODE *)b)->hash;
+
+	return ha < hb ? -1 : (ha > hb ? 1 : 0);
+}
+
+/**
+ * Build the consistent hash ring of the servers of a router instance.
+ *
+ * Every server has a number of virtual nodes on the ring in proportion
+ * to its weight, placed by the hash of the server name and the node number.
+ * The places of the nodes of a server do not depend on the other servers,
+ * so adding or removing a server moves only the keys of its own nodes.
+ *
+ * @param inst	The router instance
+ * @return	Non-zero if the ring was built
+ */
+static int
+ring_build(ROUTER_INSTANCE *inst)
+{
+char	name[256];
+int	i, j, n = 0, nodes;
+
+	for (i = 0; inst->servers[i]; i++)
+	{
+		nodes = (READCONN_RING_VNODES * inst->servers[i]->weight) / 1000;
+		n += (nodes > 0 ? nodes : 1);
+	}
+	if (n == 0 || (inst->ring = calloc(n, sizeof(RING_NODE))) == NULL)
+		return 0;
+
+	for (i = 0, n = 0; inst->servers[i]; i++)
+	{
+		SERVER	*server = inst->servers[i]->server;
+
+		nodes = (READCONN_RING_VNODES * inst->servers[i]->weight) / 1000;
+		if (nodes < 1)
+			nodes = 1;
+		for (j = 0; j < nodes; j++, n++)
+		{
+			if (server->unique_name)
+				snprintf(name, sizeof(name), "%s-%d",
+						server->unique_name, j);
+			else
+				snprintf(name, sizeof(name), "%s:%d-%d",
+						server->name, server->port, j);
+			inst->ring[n].hash = ring_hash(name);
+			inst->ring[n].backend = inst->servers[i];
+		}
+	}
+	qsort(inst->ring, n, sizeof(RING_NODE), ring_node_cmp);
+	inst->n_ring = n;
+	return 1;
+}
+
+/**
+ * Find the server of a session key on the hash ring. The server is the
+ * one of the first node at or after the hash of the key that belongs to
+ * an eligible server, the keys of a server that is not eligible go to
+ * the servers of the nodes that follow its own. Called with the heap lock
+ * held, a server is eligible if it is in the heap.
+ *
+ * @param inst	The router instance
+ * @param key	The session key
+ * @return	The backend or NULL if no server is eligible
+ */
+static BACKEND *
+ring_lookup(ROUTER_INSTANCE *inst, char *key)
+{
+unsigned int	hash = ring_hash(key);
+int		low = 0, high = inst->n_ring, mid, i;
+
+	while (low < high)
+	{
+		mid = (low + high) / 2;
+		if (inst->ring[mid].hash < hash)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	for (i = 0; i < inst->n_ring; i++)
+	{
+		BACKEND *backend = inst->ring[(low + i) % inst->n_ring].backend;
+
+		if (backend->heap_index >= 0)
+			return backend;
+	}
+	return NULL;
+}
+
+/**
+ * Return the key a new session is placed on the hash ring with
+ *
+ * @param inst		The router instance
+ * @param session	The client session
+ * @return		The key or NULL if the session is not placed by a key
+ */
+static char *
+session_affinity_key(ROUTER_INSTANCE *inst, SESSION *session)
+{
+char	*key = NULL;
+
+	switch (inst->affinity)
+	{
+	case READCONN_AFFINITY_USER:
+		key = session_getUser(session);
+		break;
+	case READCONN_AFFINITY_DATABASE:
+		if (session->data)
+			key = ((MYSQL_session *)session->data)->db;
+		break;
+	case READCONN_AFFINITY_ADDRESS:
+		key = session_get_remote(session);
+		break;
+	default:
+		break;
+	}
+	return (key && *key) ? key : NULL;
+}
+
+/**
+ * Splice the client and backend connections of a session once the backend
+ * is authenticated, the statement just routed is the last one the router
+ * sees. Sessions with filters are not spliced as the filters must see
+ * every statement, nor are backends that use the compressed protocol as
+ * the client is sent the packets uncompressed. The connections are spliced only when nothing is
+ * queued for either of them, otherwise the next statement tries again.
+ *
+ * @param inst		The router instance
+ * @param rses		The router session
+ * @param backend_dcb	The backend DCB of the session
+ */
+static void
+session_splice(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+		DCB *backend_dcb)
+{
+SESSION		*session = backend_dcb->session;
+MySQLProtocol	*protocol = (MySQLProtocol *)backend_dcb->protocol;
+
+	if (rses->rses_spliced || session == NULL || session->client == NULL ||
+		session->n_filters > 0 ||
+		session->state != SESSION_STATE_ROUTER_READY ||
+		protocol->protocol_auth_state != MYSQL_IDLE ||
+		protocol->protocol_compress)
+	{
+		return;
+	}
+	if (dcb_splice(session->client, backend_dcb))
+	{
+		rses->rses_spliced = true;
+		ts_stats_add(inst->stats, READCONN_N_SPLICED, 1);
+		LOGIF(LT, (skygw_log_write(
+			LOGFILE_TRACE,
+			"Session of %s forwarded by splice to %s:%d.",
+			session->client->remote ? session->client->remote : "",
+			rses->backend->server->name,
+			rses->backend->server->port)));
+	}
+}
+
+/**
+ * Is a word at the start of the SQL text
+ *
+ * @param sql		The SQL text
+ * @param len		Length of the text
+ * @param word		The word, in upper case
+ * @return		Non-zero if the text starts with the word
+ */
+static int
+sql_starts_with(char *sql, int len, char *word)
+{
+int	n = strlen(word);
+
+	return len >= n && strncasecmp(sql, word, n) == 0 &&
+		(len == n || (!isalnum((unsigned char)sql[n]) && sql[n] != '_'));
+}
+
+/**
+ * Follow the state of a session that a new backend connection would not
+ * have. A new connection authenticates with the user and the default
+ * database of the client, so a session may be moved as long as it has only
+ * sent statements that leave no other state behind: queries and DML that
+ * don't touch user variables, and transactions, that are followed so that
+ * a session is not moved in the middle of one. Anything else, a SET, USE,
+ * COM_INIT_DB, prepared statement or temporary table, keeps the session on
+ * its server.
+ *
+ * @param rses		The router session
+ * @param queue		The statement being routed
+ * @param mysql_command	The command of the statement
+ */
+static void
+session_track_state(ROUTER_CLIENT_SES *rses, GWBUF *queue, int mysql_command)
+{
+char	*sql;
+int	len;
+
+	switch (mysql_command)
+	{
+	case MYSQL_COM_QUIT:
+	case MYSQL_COM_PING:
+	case MYSQL_COM_STATISTICS:
+	case MYSQL_COM_FIELD_LIST:
+		return;
+	case MYSQL_COM_QUERY:
+		break;
+	default:
+		rses->rses_sticky = true;
+		return;
+	}
+	if (!modutil_sql_contiguous(queue, &sql, &len))
+	{
+		rses->rses_sticky = true;
+		return;
+	}
+	while (len > 0 && isspace((unsigned char)*sql))
+	{
+		sql++;
+		len--;
+	}
+	if (sql_starts_with(sql, len, "BEGIN") ||
+		sql_starts_with(sql, len, "START"))
+	{
+		rses->rses_in_trx = true;
+	}
+	else if (sql_starts_with(sql, len, "COMMIT"))
+	{
+		rses->rses_in_trx = false;
+	}
+	else if (sql_starts_with(sql, len, "ROLLBACK"))
+	{
+		/*< ROLLBACK TO SAVEPOINT keeps the transaction open */
+		sql += 8;
+		len -= 8;
+		while (len > 0 && isspace((unsigned char)*sql))
+		{
+			sql++;
+			len--;
+		}
+		if (sql_starts_with(sql, len, "WORK"))
+		{
+			sql += 4;
+			len -= 4;
+			while (len > 0 && isspace((unsigned char)*sql))
+			{
+				sql++;
+				len--;
+			}
+		}
+		if (!sql_starts_with(sql, len, "TO"))
+			rses->rses_in_trx = false;
+	}
+	else if (!(sql_starts_with(sql, len, "SELECT") ||
+		sql_starts_with(sql, len, "INSERT") ||
+		sql_starts_with(sql, len, "UPDATE") ||
+		sql_starts_with(sql, len, "DELETE") ||
+		sql_starts_with(sql, len, "REPLACE") ||
+		sql_starts_with(sql, len, "SHOW")) ||
+		memchr(sql, '@', len) != NULL)
+	{
+		rses->rses_sticky = true;
+	}
+}
+
+/**
+ * Is the backend connection of a session idle, authenticated with nothing
+ * queued for it and no reply on the way, see dcb_park
+ *
+ * @param dcb		The backend DCB
+ * @return		Non-zero if the connection may be replaced
+ */
+static int
+backend_dcb_is_idle(DCB *dcb)
+{
+	return dcb->state == DCB_STATE_POLLING &&
+		dcb->writeq == NULL &&
+		dcb->delayq_count == 0 &&
+		dcb->dcb_readqueue == NULL &&
+		dcb->splice_pipe[0] < 0 &&
+		dcb->func.reuse != NULL &&
+		dcb->func.reuse(dcb, NULL) == 1;
+}
+
+/**
+ * Move a session to the least loaded server before its next statement is
+ * routed, if the load of the servers becomes more even: the least loaded
+ * server must still have a lower load than the server of the session after
+ * it has got the session. Every move lowers the difference so the load
+ * converges without sessions going back and forth, see session_move.
+ *
+ * @param inst		The router instance
+ * @param rses		The router session
+ */
+static void
+session_rebalance(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses)
+{
+BACKEND	*current = rses->backend;
+BACKEND	*target = NULL;
+DCB	*old_dcb = rses->backend_dcb;
+
+	/*< A dirty look before the lock, the heap top rarely changes */
+	if (old_dcb == NULL || old_dcb->session == NULL ||
+		(!inst->heap_stale &&
+		(inst->n_heap == 0 || inst->heap[0] == current)))
+		return;
+
+	spinlock_acquire(&inst->heaplock);
+	if (inst->heap_stale)
+		heap_rebuild(inst);
+	if (inst->n_heap > 0 && inst->heap[0] != current &&
+		!SERVER_IS_FULL(inst->heap[0]->server) &&
+		((inst->heap[0]->current_connection_count + 1) * 1000) /
+			inst->heap[0]->weight <
+		(current->current_connection_count * 1000) / current->weight)
+	{
+		target = inst->heap[0];
+		atomic_add(&target->current_connection_count, 1);
+		target->n_selected++;
+		heap_sift_down(inst, target->heap_index);
+	}
+	spinlock_release(&inst->heaplock);
+
+	if (target == NULL || !session_move(inst, rses, target))
+		return;
+	ts_stats_add(inst->stats, READCONN_N_REBALANCED, 1);
+	LOGIF(LT, (skygw_log_write(
+		LOGFILE_TRACE,
+		"Session moved from %s:%d to %s:%d to rebalance the load.",
+		current->server->name,
+		current->server->port,
+		target->server->name,
+		target->server->port)));
+}
+
+/**
+ * Move a session to the connection of another server while the connection
+ * of the session is idle, in the MySQL protocol the client has then read
+ * the whole reply to its previous statement. The statement written to the
+ * new connection waits in its delay queue until the connection is
+ * authenticated. The connection count of the target is already bumped, it
+ * is dropped again if the session is not moved.
+ *
+ * @param inst		The router instance
+ * @param rses		The router session
+ * @param target	The backend to move the session to
+ * @return		1 if the session was moved, 0 otherwise
+ */
+static int
+session_move(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses, BACKEND *target)
+{
+BACKEND	*current = rses->backend;
+DCB	*old_dcb = rses->backend_dcb;
+DCB	*new_dcb;
+
+	if (session_reply_pending(rses) ||
+		rses->rses_reply_state == READCONN_REPLY_UNKNOWN ||
+		!backend_dcb_is_idle(old_dcb) ||
+		(new_dcb = dcb_connect(target->server, old_dcb->session,
+				target->server->protocol)) == NULL)
+	{
+		backend_release(inst, target);
+		return 0;
+	}
+	if (!rses_begin_locked_router_action(rses))
+	{
+		dcb_close(new_dcb);
+		backend_release(inst, target);
+		return 0;
+	}
+	rses->backend_dcb = new_dcb;
+	rses->backend = target;
+	rses_end_locked_router_action(rses);
+
+	if (!dcb_park(old_dcb))
+		dcb_close(old_dcb);
+	atomic_add(&current->server->stats.n_current, -1);
+	backend_release(inst, current);
+	return 1;
+}
+
+/**
+ * Start following the reply to a statement routed to the backend. A
+ * statement written before the reply to the previous one has arrived is
+ * counted, its reply is followed after the earlier ones. The replies to the
+ * commands of the other protocols are not followed, and neither is anything
+ * from the backend after them.
+ *
+ * @param rses		The router session
+ * @param mysql_command	The command of the statement
+ */
+static void
+session_expect_reply(ROUTER_CLIENT_SES *rses, int mysql_command)
+{
+	if (rses->rses_reply_state == READCONN_REPLY_UNKNOWN ||
+		mysql_command == MYSQL_COM_QUIT ||
+		mysql_command == MYSQL_COM_STMT_CLOSE ||
+		mysql_command == MYSQL_COM_STMT_SEND_LONG_DATA)
+		return;
+	if (mysql_command != MYSQL_COM_QUERY &&
+		mysql_command != MYSQL_COM_INIT_DB &&
+		mysql_command != MYSQL_COM_PING)
+	{
+		rses->rses_reply_state = READCONN_REPLY_UNKNOWN;
+		rses->rses_sticky = true;
+	}
+	else if (rses->rses_reply_state == READCONN_REPLY_IDLE)
+	{
+		rses->rses_reply_state = READCONN_REPLY_FIRST;
+		rses->rses_nreplies = 1;
+	}
+	else
+	{
+		rses->rses_nreplies++;
+	}
+}
+
+/**
+ * Is a followed reply still on its way, the end of its last packet may
+ * arrive after the state is idle
+ *
+ * @param rses		The router session
+ * @return		Non-zero if a reply hasn't arrived completely
+ */
+static int
+session_reply_pending(ROUTER_CLIENT_SES *rses)
+{
+	return rses->rses_reply_state != READCONN_REPLY_UNKNOWN &&
+		(rses->rses_reply_state != READCONN_REPLY_IDLE ||
+		rses->rses_skip > 0);
+}
+
+/**
+ * Move the reply state of a session by one packet of the reply
+ *
+ * @param rses		The router session
+ * @param payload	The start of the payload, at most
+ *			READCONN_PACKET_PREFIX - 4 bytes
+ * @param plen		The length of the whole payload
+ * @return		The status flags of the OK or EOF packet that ended a
+ *			reply, -1 if there are none
+ */
+static int
+session_reply_packet(ROUTER_CLIENT_SES *rses, uint8_t *payload, int plen)
+{
+int	avail = MIN(plen, READCONN_PACKET_PREFIX - 4);
+int	is_eof = (plen > 0 && plen < 9 && payload[0] == 0xfe);
+int	is_err = (plen > 0 && payload[0] == 0xff);
+int	status = -1;
+MYSQL_OK_PACKET	ok;
+
+	/*< A packet of 16MB continues in the next one */
+	if (plen == 0xffffff || plen == 0)
+	{
+		rses->rses_reply_state = READCONN_REPLY_UNKNOWN;
+		return -1;
+	}
+	switch (rses->rses_reply_state)
+	{
+	case READCONN_REPLY_FIRST:
+		if (payload[0] == 0x00)
+		{
+			status = mysql_ok_parse(payload, avail, &ok) ? ok.status : -1;
+			rses->rses_reply_state = (status != -1 &&
+				(status & SERVER_MORE_RESULTS_EXISTS)) ?
+				READCONN_REPLY_FIRST : READCONN_REPLY_IDLE;
+		}
+		else if (is_err)
+			rses->rses_reply_state = READCONN_REPLY_IDLE;
+		else if (payload[0] == 0xfb)
+			rses->rses_reply_state = READCONN_REPLY_INFILE;
+		else
+			rses->rses_reply_state = READCONN_REPLY_COLUMNS;
+		break;
+	case READCONN_REPLY_COLUMNS:
+		if (is_eof)
+			rses->rses_reply_state = READCONN_REPLY_ROWS;
+		else if (is_err)
+			rses->rses_reply_state = READCONN_REPLY_IDLE;
+		break;
+	case READCONN_REPLY_ROWS:
+		if (is_eof)
+		{
+			status = (avail >= 5 ? payload[3] | (payload[4] << 8) : -1);
+			rses->rses_reply_state = (status != -1 &&
+				(status & SERVER_MORE_RESULTS_EXISTS)) ?
+				READCONN_REPLY_FIRST : READCONN_REPLY_IDLE;
+		}
+		else if (is_err)
+			rses->rses_reply_state = READCONN_REPLY_IDLE;
+		break;
+	default:
+		/*< Nothing was expected, or a LOCAL INFILE is being sent */
+		rses->rses_reply_state = READCONN_REPLY_UNKNOWN;
+		break;
+	}
+	return status;
+}
+
+/**
+ * Follow the replies to the statements of a session. The packets of a
+ * reply may be split anywhere between the buffers, so the start of each
+ * packet is collected to the router session and the rest of it skipped.
+ * The status flags of the packet that ends the last reply tell whether a
+ * transaction is open, which covers the statements that open or end one
+ * implicitly. A reply that can't be followed keeps the session on its
+ * server.
+ *
+ * @param rses		The router session
+ * @param queue		The reply buffers
+ */
+static void
+session_track_reply(ROUTER_CLIENT_SES *rses, GWBUF *queue)
+{
+GWBUF	*b;
+int	status = -1;
+
+	for (b = queue; b != NULL; b = b->next)
+	{
+		uint8_t	*ptr = (uint8_t *)GWBUF_DATA(b);
+		uint8_t	*end = ptr + GWBUF_LENGTH(b);
+
+		while (ptr < end && session_reply_pending(rses))
+		{
+			int	n, plen, want;
+
+			if (rses->rses_skip > 0)
+			{
+				n = MIN(rses->rses_skip, end - ptr);
+				rses->rses_skip -= n;
+				ptr += n;
+				continue;
+			}
+			if (rses->rses_pktlen < 4)
+			{
+				n = MIN(4 - rses->rses_pktlen, end - ptr);
+				memcpy(&rses->rses_pkt[rses->rses_pktlen], ptr, n);
+				rses->rses_pktlen += n;
+				ptr += n;
+				if (rses->rses_pktlen < 4)
+					continue;
+			}
+			plen = MYSQL_GET_PACKET_LEN(rses->rses_pkt);
+			want = 4 + MIN(plen, READCONN_PACKET_PREFIX - 4);
+			n = MIN(want - rses->rses_pktlen, end - ptr);
+			memcpy(&rses->rses_pkt[rses->rses_pktlen], ptr, n);
+			rses->rses_pktlen += n;
+			ptr += n;
+
+			if (rses->rses_pktlen == want)
+			{
+				status = session_reply_packet(rses,
+						&rses->rses_pkt[4], plen);
+				rses->rses_skip = plen - (want - 4);
+				rses->rses_pktlen = 0;
+
+				if (rses->rses_reply_state == READCONN_REPLY_IDLE &&
+					--rses->rses_nreplies > 0)
+				{
+					rses->rses_reply_state = READCONN_REPLY_FIRST;
+					status = -1;
+				}
+			}
+		}
+		if (rses->rses_reply_state == READCONN_REPLY_IDLE &&
+			(ptr < end || b->next != NULL))
+		{
+			/*< The replies ended but more data followed them */
+			rses->rses_reply_state = READCONN_REPLY_UNKNOWN;
+		}
+	}
+	if (rses->rses_reply_state == READCONN_REPLY_UNKNOWN)
+		rses->rses_sticky = true;
+	else if (rses->rses_reply_state == READCONN_REPLY_IDLE && status != -1)
+		rses->rses_in_trx = (status & SERVER_STATUS_IN_TRANS) ||
+			!(status & SERVER_STATUS_AUTOCOMMIT);
+}
+
+/**
+ * Move a session to the root Master before its next statement is routed,
+ * with the reconnect option, if the server of the session is no longer the
+ * master. The monitor has seen the switchover before the connection to the
+ * old master is lost, or the old master stays up as a slave.
+ *
+ * @param inst		The router instance
+ * @param rses		The router session
+ */
+static void
+session_master_check(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses)
+{
+BACKEND	*current = rses->backend;
+BACKEND	*target;
+
+	if (rses->backend_dcb == NULL || SERVER_IS_MASTER(current->server) ||
+		(target = backend_select(inst, NULL)) == NULL)
+		return;
+	if (target == current || !SERVER_IS_MASTER(target->server))
+	{
+		backend_release(inst, target);
+		return;
+	}
+	if (!session_move(inst, rses, target))
+		return;
+	ts_stats_add(inst->stats, READCONN_N_RECONNECTED, 1);
+	LOGIF(LT, (skygw_log_write(
+		LOGFILE_TRACE,
+		"Session moved from %s:%d to the new master %s:%d.",
+		current->server->name,
+		current->server->port,
+		target->server->name,
+		target->server->port)));
+}
+
+/**
+ * Keep a session whose connection to the master is lost, with the reconnect
+ * option. The session must have nothing a new connection would lack and no
+ * reply on the way, its next statement makes the connection to the new
+ * master. The lost DCB is closed by the caller.
+ *
+ * @param rses		The router session
+ * @param dcb		The backend DCB that is lost
+ * @return		1 if the session is kept, 0 if it must be closed
+ */
+static int
+session_lose_master(ROUTER_CLIENT_SES *rses, DCB *dcb)
+{
+int	kept = 0;
+
+	if (rses->rses_sticky || rses->rses_in_trx || rses->rses_spliced ||
+		session_reply_pending(rses) ||
+		rses->rses_reply_state == READCONN_REPLY_UNKNOWN ||
+		!backend_dcb_is_idle(dcb))
+		return 0;
+	if (!rses_begin_locked_router_action(rses))
+		return 0;
+	if (rses->backend_dcb == dcb)
+	{
+		rses->backend_dcb = NULL;
+		rses->rses_lost_at = timer_now();
+		kept = 1;
+	}
+	rses_end_locked_router_action(rses);
+
+	if (kept)
+	{
+		LOGIF(LT, (skygw_log_write(
+			LOGFILE_TRACE,
+			"Connection to the master %s:%d lost, the session waits "
+			"for a new master.",
+			rses->backend->server->name,
+			rses->backend->server->port)));
+	}
+	return kept;
+}
+
+/**
+ * Connect a session whose master connection is lost to the root Master and
+ * write the statements held for it
+ *
+ * @param rses		The router session
+ * @return		1 if the session is connected or closed, 0 otherwise
+ */
+static int
+session_reconnect_try(ROUTER_CLIENT_SES *rses)
+{
+ROUTER_INSTANCE	*inst = rses->rses_inst;
+BACKEND		*current = rses->backend;
+BACKEND		*target;
+DCB		*new_dcb;
+GWBUF		*held;
+
+	if ((target = backend_select(inst, NULL)) == NULL)
+		return 0;
+	if (!SERVER_IS_MASTER(target->server) ||
+		(new_dcb = dcb_connect(target->server, rses->rses_session,
+				target->server->protocol)) == NULL)
+	{
+		backend_release(inst, target);
+		return 0;
+	}
+	if (!rses_begin_locked_router_action(rses))
+	{
+		dcb_close(new_dcb);
+		backend_release(inst, target);
+		return 1;
+	}
+	rses->backend = target;
+	rses->backend_dcb = new_dcb;
+	held = rses->rses_held;
+	rses->rses_held = NULL;
+	rses->rses_pktlen = 0;
+	rses->rses_skip = 0;
+	rses->rses_lost_at = 0;
+	/*< Under the lock so that the statements that follow are not ahead */
+	if (held != NULL)
+		new_dcb->func.write(new_dcb, held);
+	rses_end_locked_router_action(rses);
+
+	atomic_add(&current->server->stats.n_current, -1);
+	backend_release(inst, current);
+	ts_stats_add(inst->stats, READCONN_N_RECONNECTED, 1);
+	LOGIF(LT, (skygw_log_write(
+		LOGFILE_TRACE,
+		"Session moved from %s:%d to the new master %s:%d.",
+		current->server->name,
+		current->server->port,
+		target->server->name,
+		target->server->port)));
+	return 1;
+}
+
+/**
+ * The timer of a session that waits for a new master. The connect is tried
+ * again until the first of the held statements has waited for
+ * READCONN_RECONNECT_TIMEOUT milliseconds, then the statements are dropped
+ * with an error to the client for each of them. The session stays without a master, its
+ * next statement tries again.
+ *
+ * @param data		The router session
+ */
+static void
+session_reconnect_expired(void *data)
+{
+ROUTER_CLIENT_SES	*rses = (ROUTER_CLIENT_SES *)data;
+GWBUF			*held;
+int			n;
+
+	if (rses->rses_closed || session_reconnect_try(rses))
+		return;
+	if (timer_now() - rses->rses_held_at < READCONN_RECONNECT_TIMEOUT)
+	{
+		timer_start(&rses->rses_timer, READCONN_RECONNECT_RETRY,
+				session_reconnect_expired, rses);
+		return;
+	}
+	if (!rses_begin_locked_router_action(rses))
+		return;
+	held = rses->rses_held;
+	rses->rses_held = NULL;
+	n = MAX(rses->rses_nreplies, 1);
+	rses->rses_reply_state = READCONN_REPLY_IDLE;
+	rses->rses_nreplies = 0;
+	rses_end_locked_router_action(rses);
+
+	if (held != NULL)
+		gwbuf_consume(held, gwbuf_length(held));
+	while (n-- > 0)
+		mysql_send_custom_error(rses->rses_session->client, 1, 0,
+			"No master server is available, the statement was "
+			"not run.");
+	LOGIF(LE, (skygw_log_write_flush(
+		LOGFILE_ERROR,
+		"Error : No master server for service '%s' was found in %d "
+		"seconds, the statements of a session were dropped.",
+		rses->rses_session->service->name,
+		READCONN_RECONNECT_TIMEOUT / 1000)));
+}
+
+/**
+ * Route a statement of a session whose connection to the master is lost.
+ * The statement is held until the session is connected to the new master,
+ * the statements that follow it are held after it. A COM_QUIT just ends
+ * the session.
+ *
+ * @param inst		The router instance
+ * @param rses		The router session
+ * @param queue		The statement
+ * @param mysql_command	The command of the statement
+ * @return		1 if the statement was taken, 0 otherwise
+ */
+static int
+session_reconnect(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+		GWBUF *queue, int mysql_command)
+{
+int	first;
+
+	if (mysql_command == MYSQL_COM_QUIT)
+	{
+		gwbuf_free(queue);
+		return 1;
+	}
+	if (!rses_begin_locked_router_action(rses))
+	{
+		gwbuf_free(queue);
+		return 0;
+	}
+	first = (rses->rses_held == NULL);
+	rses->rses_held = gwbuf_append(rses->rses_held, queue);
+	if (first)
+		rses->rses_held_at = timer_now();
+	rses_end_locked_router_action(rses);
+
+	if (first && !session_reconnect_try(rses))
+		timer_start(&rses->rses_timer, READCONN_RECONNECT_RETRY,
+				session_reconnect_expired, rses);
+	return 1;
+}
@@ -17,9 +17,13 @@
  */
 #include <stdio.h>
 #include <strings.h>
+#include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <dlfcn.h>
 
 #include <router.h>
 #include <readwritesplit.h>
@@ -30,8 +34,16 @@
 #include <query_classifier.h>
 #include <dcb.h>
 #include <spinlock.h>
+#include <poll.h>
+#include <modutil.h>
+#include <hint.h>
 #include <modinfo.h>
+#include <tracepoint.h>
+#include <secrets.h>
 #include <mysql_client_server_protocol.h>
+#include <mysql_packet.h>
+#include <table_replication_consistency.h>
+#include <localread.h>
 
 MODULE_INFO 	info = {
 	MODULE_API_ROUTER,
@@ -75,6 +87,8 @@ static	void*   newSession(ROUTER *instance, SESSION *session);
 static	void    closeSession(ROUTER *instance, void *session);
 static	void    freeSession(ROUTER *instance, void *session);
 static	int     routeQuery(ROUTER *instance, void *session, GWBUF *queue);
+static	int     routeBatch(ROUTER *instance, void *session, GWBUF *queue);
+static	void    getMetrics(ROUTER *instance, ROUTER_METRIC_FN fn, void *arg);
 static	void    diagnostic(ROUTER *instance, DCB *dcb);
 
 static  void	clientReply(
@@ -95,6 +109,12 @@ static void print_error_packet(ROUTER_CLIENT_SES* rses, GWBUF* buf, DCB* dcb);
 static int  router_get_servercount(ROUTER_INSTANCE* router);
 static int  rses_get_max_slavecount(ROUTER_CLIENT_SES* rses, int router_nservers);
 static int  rses_get_max_replication_lag(ROUTER_CLIENT_SES* rses);
+static int  get_query_max_rlag(ROUTER_CLIENT_SES* rses, GWBUF* querybuf);
+static backend_ref_t* ro_trx_get_slave(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses,
+        GWBUF*             querybuf);
+static bool bref_within_rlag(backend_ref_t* bref, int max_rlag);
 static backend_ref_t* get_bref_from_dcb(ROUTER_CLIENT_SES* rses, DCB* dcb);
 
 static  uint8_t getCapabilities (ROUTER* inst, void* router_session);
@@ -106,10 +126,38 @@ static bool router_option_configured(
         void*            data);
 #endif
 
-#if defined(PREP_STMT_CACHING)
-static prep_stmt_t* prep_stmt_init(prep_stmt_type_t type, void* id);
+static prep_stmt_t* prep_stmt_init(
+        ROUTER_CLIENT_SES* rses,
+        GWBUF*             buf,
+        bool               is_read);
 static void         prep_stmt_done(prep_stmt_t* pstmt);
-#endif /*< PREP_STMT_CACHING */
+static void         prep_stmt_free_all(ROUTER_CLIENT_SES* rses);
+static void         prep_stmt_backend_failed(
+        ROUTER_CLIENT_SES* rses,
+        backend_ref_t*     bref);
+static void         pstmt_prepare_reply(
+        ROUTER_CLIENT_SES* rses,
+        backend_ref_t*     bref,
+        GWBUF*             writebuf);
+static GWBUF*       pstmt_lazy_reply(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses,
+        backend_ref_t*     bref,
+        GWBUF*             writebuf);
+static bool route_prep_stmt(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses,
+        GWBUF*             querybuf,
+        unsigned char      packet_type,
+        skygw_query_type_t qtype);
+static bool route_local_read(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses,
+        GWBUF*             querybuf);
+static bool route_stmt_to_master(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses,
+        GWBUF*             querybuf);
 
 int bref_cmp_global_conn(
         const void* bref1,
@@ -127,6 +175,10 @@ int bref_cmp_current_load(
         const void* bref1,
         const void* bref2);
 
+int bref_cmp_response_time(
+        const void* bref1,
+        const void* bref2);
+
 /**
  * The order of functions _must_ match with the order the select criteria are
  * listed in select_criteria_t definition in readwritesplit.h
@@ -137,7 +189,8 @@ int (*criteria_cmpfun[LAST_CRITERIA])(const void*, const void*)=
         bref_cmp_global_conn,
         bref_cmp_router_conn,
         bref_cmp_behind_master,
-        bref_cmp_current_load
+        bref_cmp_current_load,
+        bref_cmp_response_time
 };
 
 static bool select_connect_backend_servers(
@@ -153,11 +206,30 @@ static bool select_connect_backend_servers(
 static bool get_dcb(
         DCB**              dcb,
         ROUTER_CLIENT_SES* rses,
-        backend_type_t     btype);
+        backend_type_t     btype,
+        int                max_rlag);
+
+static bool get_slave_two_choices(
+        DCB**              p_dcb,
+        ROUTER_CLIENT_SES* rses,
+        BACKEND*           master_host,
+        int                max_rlag);
+static bool get_slave_least_busy(
+        DCB**              p_dcb,
+        ROUTER_CLIENT_SES* rses,
+        BACKEND*           master_host,
+        int                max_rlag);
+
+static bool get_dcb_by_name(
+        DCB**              p_dcb,
+        ROUTER_CLIENT_SES* rses,
+        char*              name);
 
 static void rwsplit_process_router_options(
         ROUTER_INSTANCE* router,
         char**           options);
+static bool rwsplit_option_truth(
+        char* value);
 
 
 
@@ -170,7 +242,35 @@ static ROUTER_OBJECT MyObject = {
         diagnostic,
         clientReply,
 	handleError,
-        getCapabilities
+        getCapabilities,
+        routeBatch,
+        getMetrics
+};
+
+/** The names of the RWSPLIT_R_* reasons of the routing decisions */
+static char* route_reason_names[RWSPLIT_R_N] = {
+        "read",
+        "read_only_trx",
+        "hint",
+        "session_command",
+        "local",
+        "write",
+        "transaction",
+        "unknown_type",
+        "causal",
+        "lag_exceeded",
+        "no_slave",
+        "prepared_statement"
+};
+
+/** The names of the RWSPLIT_QT_* classes of the statements */
+static char* route_qtype_names[RWSPLIT_QT_N] = {
+        "read",
+        "write",
+        "session_write",
+        "transaction",
+        "prepared",
+        "unknown"
 };
 static bool rses_begin_locked_router_action(
         ROUTER_CLIENT_SES* rses);
@@ -178,6 +278,16 @@ static bool rses_begin_locked_router_action(
 static void rses_end_locked_router_action(
         ROUTER_CLIENT_SES* rses);
 
+static void rses_set_owner_thread(
+        ROUTER_CLIENT_SES* rses,
+        SESSION*           session);
+
+static skygw_query_type_t get_query_type(
+        GWBUF*  querybuf,
+        char*   querystr,
+        bool    trx_only,
+        MYSQL** mysql);
+
 static void mysql_sescmd_done(
 	mysql_sescmd_t* sescmd);
 
@@ -204,6 +314,14 @@ static mysql_sescmd_t* rses_property_get_sescmd(
         rses_property_t* prop);
 
 static bool execute_sescmd_history(backend_ref_t* bref);
+static void mysql_sescmd_classify(mysql_sescmd_t* sescmd);
+static void sescmd_history_compact(
+        ROUTER_CLIENT_SES* rses,
+        ROUTER_INSTANCE*   inst);
+static bool sescmd_is_redundant(
+        ROUTER_CLIENT_SES* rses,
+        mysql_sescmd_t*    sescmd);
+static bool rses_is_idle(ROUTER_CLIENT_SES* rses);
 
 static bool execute_sescmd_in_backend(
         backend_ref_t* backend_ref);
@@ -228,7 +346,14 @@ static mysql_sescmd_t* sescmd_cursor_get_command(
 static bool sescmd_cursor_next(
 	sescmd_cursor_t* scur);
 
-static GWBUF* sescmd_cursor_process_replies(GWBUF* replybuf, backend_ref_t* bref);
+static GWBUF* sescmd_cursor_process_replies(
+        GWBUF*         replybuf,
+        backend_ref_t* bref,
+        GWBUF**        restbuf);
+
+static void sescmd_held_release(
+        ROUTER_CLIENT_SES* rses,
+        bool               replied);
 
 static void tracelog_routed_query(
         ROUTER_CLIENT_SES* rses,
@@ -249,7 +374,107 @@ static void refreshInstance(
 
 static void bref_clear_state(backend_ref_t* bref, bref_state_t state);
 static void bref_set_state(backend_ref_t*   bref, bref_state_t state);
+static void bref_start_query_timer(ROUTER_CLIENT_SES* rses, backend_ref_t* bref);
+static bool causal_reads_to_master(ROUTER_CLIENT_SES* rses);
+static bool rses_reads_to_master(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses);
+static void ryw_note_route(
+        ROUTER_CLIENT_SES* rses,
+        skygw_query_type_t qtype);
+static void route_count(
+        ROUTER_INSTANCE* inst,
+        backend_ref_t*   bref,
+        int              reason);
+static int  route_qtype_class(skygw_query_type_t qtype);
+static void causal_buf_free(GWBUF* buf);
+static int  causal_reads_wait(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses,
+        backend_ref_t*     bref,
+        GWBUF*             querybuf);
+static GWBUF* causal_reads_reply(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses,
+        backend_ref_t*     bref,
+        GWBUF*             writebuf);
 static sescmd_cursor_t* backend_ref_get_sescmd_cursor (backend_ref_t* bref);
+static void mpx_check_sticky(
+        ROUTER_CLIENT_SES* rses,
+        mysql_server_cmd_t packet_type,
+        char*              querystr);
+static void mpx_expect_reply(
+        ROUTER_CLIENT_SES* rses,
+        backend_ref_t*     bref,
+        mysql_server_cmd_t packet_type);
+static bool mpx_reply_pending(backend_ref_t* bref);
+static int  mpx_track_reply(
+        ROUTER_CLIENT_SES* rses,
+        backend_ref_t*     bref,
+        GWBUF*             buf);
+static bool mpx_bref_is_idle(backend_ref_t* bref);
+static void mpx_release_backends(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses);
+static bool mpx_acquire_backends(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses);
+static int  rses_connect_slaves(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses);
+static int  rses_get_slave_target(
+        ROUTER_CLIENT_SES* rses,
+        int                router_nservers);
+static void rses_adapt_slaves(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses);
+static void rses_release_idle_slaves(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses);
+static bool failover_begin(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses);
+static int  failover_hold_write(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses,
+        GWBUF*             querybuf);
+static bool failover_connect_master(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses);
+static void failover_tick(void* data);
+static void router_update_weights(ROUTER_INSTANCE* router);
+static int  bref_write(
+        ROUTER_CLIENT_SES* rses,
+        backend_ref_t*     bref,
+        GWBUF*             buf);
+static void bref_write_held(backend_ref_t* bref);
+static int  bref_write_batch(backend_ref_t* bref);
+static void bref_clear_pipeline(backend_ref_t* bref);
+static void bref_query_reply(
+        ROUTER_CLIENT_SES* rses,
+        backend_ref_t*     bref,
+        GWBUF*             buf);
+static bool bref_is_infile_request(
+        backend_ref_t* bref,
+        GWBUF*         buf);
+static int  route_load_data(
+        ROUTER_CLIENT_SES* rses,
+        GWBUF*             buf);
+static int  route_fragment(
+        ROUTER_CLIENT_SES* rses,
+        GWBUF*             buf);
+static skygw_query_type_t get_long_query_type(GWBUF* querybuf);
+static void rses_track_server_status(
+        ROUTER_CLIENT_SES* rses,
+        backend_ref_t*     bref);
+static bool sescmd_write(
+        backend_ref_t*  bref,
+        mysql_sescmd_t* scmd);
+static void rses_retry_clear(ROUTER_CLIENT_SES* rses);
+static unsigned long response_clock(void);
+static bool rses_retry_read(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses);
 
 static int  router_handle_state_switch(DCB* dcb, DCB_REASON reason, void* data);
 static bool handle_error_new_connection(
@@ -269,9 +494,28 @@ static bool have_enough_servers(
         int                 router_nsrv,
         ROUTER_INSTANCE*    router);
 
+static bool tbr_start(ROUTER_INSTANCE* router);
+static bool tbr_get_dcb(
+        DCB**              p_dcb,
+        ROUTER_CLIENT_SES* rses,
+        char*              querystr,
+        int                max_rlag);
+
 static SPINLOCK	        instlock;
 static ROUTER_INSTANCE* instances;
 
+/**
+ * The table consistency listeners are started once, by the first router
+ * instance with table_consistency, and followed by every such instance.
+ * tbr_servers gives the server of each listener id.
+ */
+static SPINLOCK	        tbr_lock = SPINLOCK_INIT;
+static int              (*tbr_query)(table_consistency_query_t*,
+                                     table_consistency_t*,
+                                     size_t*) = NULL;
+static SERVER*          tbr_servers[RWSPLIT_TBR_MAX_SERVERS];
+static int              tbr_nservers = 0;
+
 /**
  * Implementation of the mandatory version entry point
  *
@@ -433,6 +677,10 @@ createInstance(SERVICE *service, char **options)
         if ((router = calloc(1, sizeof(ROUTER_INSTANCE))) == NULL) {
                 return NULL; 
         } 
+        if ((router->stats = ts_stats_alloc(RWSPLIT_N_STATS)) == NULL) {
+                free(router);
+                return NULL;
+        }
         router->service = service;
         spinlock_init(&router->lock);
         
@@ -449,6 +697,7 @@ createInstance(SERVICE *service, char **options)
         
         if (router->servers == NULL)
         {
+                ts_stats_free(router->stats);
                 free(router);
                 return NULL;
         }
@@ -468,6 +717,7 @@ createInstance(SERVICE *service, char **options)
                                 free(router->servers[i]);
                         }
                         free(router->servers);
+                        ts_stats_free(router->stats);
                         free(router);
                         return NULL;
                 }
@@ -475,6 +725,10 @@ createInstance(SERVICE *service, char **options)
                 router->servers[nservers]->backend_conn_count = 0;
                 router->servers[nservers]->be_valid = false;
                 router->servers[nservers]->weight = 1000;
+                router->servers[nservers]->be_response_time = 0;
+                router->servers[nservers]->be_errors = 0;
+                router->servers[nservers]->be_up_usec = 0;
+                router->servers[nservers]->be_index = nservers;
 #if defined(SS_DEBUG)
                 router->servers[nservers]->be_chk_top = CHK_NUM_BACKEND;
                 router->servers[nservers]->be_chk_tail = CHK_NUM_BACKEND;
@@ -483,6 +737,19 @@ createInstance(SERVICE *service, char **options)
                 server = server->nextdb;
         }
         router->servers[nservers] = NULL;
+        router->n_servers = nservers;
+
+        if ((router->route_stats = ts_stats_alloc(
+                        RWSPLIT_ROUTE_SERVER(nservers, 0))) == NULL)
+        {
+                for (i = 0; i < nservers; i++) {
+                        free(router->servers[i]);
+                }
+                free(router->servers);
+                ts_stats_free(router->stats);
+                free(router);
+                return NULL;
+        }
 
 	/*
 	 * If server weighting has been defined calculate the percentage
@@ -536,6 +803,10 @@ createInstance(SERVICE *service, char **options)
 			}
 		}
 	}
+	for (i = 0; router->servers[i]; i++)
+	{
+		router->servers[i]->be_static_weight = router->servers[i]->weight;
+	}
         
         /**
          * vraa : is this necessary for readwritesplit ?
@@ -549,6 +820,8 @@ createInstance(SERVICE *service, char **options)
 	router->bitmask = 0;
 	router->bitvalue = 0;
         
+        router->rwsplit_config.rw_max_sescmd_history = CONFIG_MAX_SESCMD_HISTORY;
+        
         /** Call this before refreshInstance */
 	if (options)
 	{
@@ -586,6 +859,25 @@ createInstance(SERVICE *service, char **options)
         {
                 refreshInstance(router, param);
         }
+        /**
+         * Table consistency refines causal reads, the reads are compared
+         * against the GTID of the last write.
+         */
+        if (router->rwsplit_config.rw_table_consistency > 0)
+        {
+                if (router->rwsplit_config.rw_causal_reads <= 0)
+                {
+                        LOGIF(LE, (skygw_log_write_flush(
+                                LOGFILE_ERROR,
+                                "Warning : table_consistency of service %s "
+                                "is only used with causal_reads.",
+                                service->name)));
+                }
+                else
+                {
+                        tbr_start(router);
+                }
+        }
         router->rwsplit_version = service->svc_config_version;
         /**
          * We have completed the creation of the router data, so now
@@ -636,6 +928,8 @@ static void* newSession(
         client_rses->rses_chk_top = CHK_NUM_ROUTER_SES;
         client_rses->rses_chk_tail = CHK_NUM_ROUTER_SES;
 #endif
+        client_rses->rses_owner_thread = -1;
+        timer_init(&client_rses->rses_failover_timer);
         /** 
          * If service config has been changed, reload config from service to 
          * router instance first.
@@ -660,6 +954,7 @@ static void* newSession(
          */
         client_rses->rses_autocommit_enabled = true;
         client_rses->rses_transaction_active = false;
+        client_rses->rses_slave_target = 1;
         
         router_nservers = router_get_servercount(router);
         
@@ -716,10 +1011,20 @@ static void* newSession(
          */
         rses_begin_locked_router_action(client_rses);
 
+        /**
+         * With lazy_connect the slaves are connected by the first read, with
+         * adaptive_slaves the first read connects one.
+         */
+        if (client_rses->rses_config.rw_lazy_connect ||
+                client_rses->rses_config.rw_adaptive_slaves > 0)
+        {
+                client_rses->rses_slaves_pending = true;
+        }
         succp = select_connect_backend_servers(&master_ref,
                                                backend_ref,
                                                router_nservers,
-                                               max_nslaves,
+                                               (client_rses->rses_slaves_pending ?
+                                                0 : max_nslaves),
                                                max_slave_rlag,
                                                client_rses->rses_config.rw_slave_select_criteria,
                                                session,
@@ -738,10 +1043,12 @@ static void* newSession(
         client_rses->rses_master_ref   = master_ref;
 	/* assert with master_host */
 	ss_dassert(master_ref && (master_ref->bref_backend->backend_server && SERVER_MASTER));
-        client_rses->rses_capabilities = RCAP_TYPE_STMT_INPUT;
+        client_rses->rses_capabilities = RCAP_TYPE_STMT_INPUT|RCAP_TYPE_BATCH_INPUT;
         client_rses->rses_backend_ref  = backend_ref;
         client_rses->rses_nbackends    = router_nservers; /*< # of backend servers */
-        router->stats.n_sessions      += 1;
+        client_rses->rses_session      = session;
+        rses_set_owner_thread(client_rses, session);
+        ts_stats_add(router->stats, RWSPLIT_N_SESSIONS, 1);
         
         /**
          * Version is bigger than zero once initialized.
@@ -817,6 +1124,7 @@ static void closeSession(
                  * whithout checking this first.
                  */
                 router_cli_ses->rses_closed = true;
+                timer_disable(&router_cli_ses->rses_failover_timer);
 
                 for (i=0; i<router_cli_ses->rses_nbackends; i++)
                 {
@@ -832,12 +1140,28 @@ static void closeSession(
                                 {
                                         bref_clear_state(bref, BREF_WAITING_RESULT);
                                 }
-                                bref_clear_state(bref, BREF_IN_USE);
-                                bref_set_state(bref, BREF_CLOSED);
                                 /**
-                                 * closes protocol and dcb
+                                 * A connection that has no reply on the way
+                                 * is returned to the pool, its state is reset
+                                 * when it is taken again.
                                  */
-                                dcb_close(dcb);
+                                if (mpx_bref_is_idle(bref) &&
+                                        dcb_park(dcb))
+                                {
+                                        bref_clear_state(bref, BREF_IN_USE);
+                                        bref_set_state(bref, BREF_CLOSED);
+                                        bref->bref_dcb = NULL;
+                                }
+                                else
+                                {
+                                        bref_clear_state(bref, BREF_IN_USE);
+                                        bref_set_state(bref, BREF_CLOSED);
+                                        /**
+                                         * closes protocol and dcb
+                                         */
+                                        dcb_close(dcb);
+                                }
+                                bref_clear_pipeline(bref);
                                 /** decrease server current connection counters */
                                 atomic_add(&bref->bref_backend->backend_server->stats.n_current, -1);
                                 atomic_add(&bref->bref_backend->backend_conn_count, -1);
@@ -901,6 +1225,38 @@ static void freeSession(
 			p = q;
 		}
 	}
+        rses_retry_clear(router_cli_ses);
+        /** Buffers held by causal reads, prepared statements and pipelines */
+        for (i=0; i<router_cli_ses->rses_nbackends; i++)
+        {
+                bref_clear_pipeline(&backend_ref[i]);
+
+                if (backend_ref[i].bref_causal_buf != NULL)
+                {
+                        causal_buf_free(backend_ref[i].bref_causal_buf);
+                }
+                if (backend_ref[i].bref_pstmt_buf != NULL)
+                {
+                        causal_buf_free(backend_ref[i].bref_pstmt_buf);
+                }
+        }
+        prep_stmt_free_all(router_cli_ses);
+        if (router_cli_ses->rses_causal_reply != NULL)
+        {
+                causal_buf_free(router_cli_ses->rses_causal_reply);
+        }
+        if (router_cli_ses->rses_causal_query != NULL)
+        {
+                causal_buf_free(router_cli_ses->rses_causal_query);
+        }
+        while (router_cli_ses->rses_failover_held != NULL)
+        {
+                bref_stmt_t* stmt = router_cli_ses->rses_failover_held;
+
+                router_cli_ses->rses_failover_held = stmt->stmt_next;
+                gwbuf_free(stmt->stmt_buf);
+                free(stmt);
+        }
         /*
          * We are no longer in the linked list, free
          * all the memory and other resources associated
@@ -911,14 +1267,191 @@ static void freeSession(
         return;
 }
 
+/** 
+ * A connected slave or relay server other than the root master, that is
+ * behind the master by at most max_rlag milliseconds unless max_rlag is -1
+ */
+static bool bref_is_read_slave(
+        backend_ref_t* bref,
+        BACKEND*       master_host,
+        int            max_rlag)
+{
+        SERVER* srv = bref->bref_backend->backend_server;
+
+        return (BREF_IS_IN_USE(bref) &&
+                (SERVER_IS_SLAVE(srv) || SERVER_IS_RELAY_SERVER(srv)) &&
+                srv != master_host->backend_server &&
+                SERVER_CIRCUIT_IS_CLOSED(srv) &&
+                bref_within_rlag(bref, max_rlag));
+}
+
+/**
+ * Check the replication lag of a backend against the bound of a read. The
+ * lag is the one of the moment, see server_get_replication_lag_ms, a backend
+ * whose lag is not known doesn't satisfy a bound.
+ *
+ * @param bref		Backend reference
+ * @param max_rlag	The bound in milliseconds or -1 for none
+ *
+ * @return true if there is no bound or the backend is within it
+ */
+static bool bref_within_rlag(
+        backend_ref_t* bref,
+        int            max_rlag)
+{
+        int rlag;
+
+        if (max_rlag < 0)
+        {
+                return true;
+        }
+        rlag = server_get_replication_lag_ms(bref->bref_backend->backend_server);
+
+        return (rlag != -1 && rlag <= max_rlag);
+}
+
+/**
+ * Choose two of the connected slaves at random and return the one with the
+ * better response time score. Sending every read to the slave that is the
+ * fastest at the moment would make all the sessions move to it together,
+ * the slower of the two random slaves is avoided without that.
+ *
+ * @param p_dcb		Pointer to the chosen backend DCB
+ * @param rses		Router client session
+ * @param master_host	The root master, never chosen
+ * @param max_rlag	Maximum replication lag of the slave or -1
+ *
+ * @return true if a slave was found
+ */
+static bool get_slave_two_choices(
+        DCB**              p_dcb,
+        ROUTER_CLIENT_SES* rses,
+        BACKEND*           master_host,
+        int                max_rlag)
+{
+        static __thread unsigned int seed = 0;
+        backend_ref_t* backend_ref = rses->rses_backend_ref;
+        backend_ref_t* chosen = NULL;
+        int            nslaves = 0;
+        int            pick1;
+        int            pick2;
+        int            n;
+        int            i;
+
+        if (master_host == NULL)
+        {
+                return false;
+        }
+
+        if (seed == 0)
+        {
+                seed = (unsigned int)time(NULL) ^ (unsigned int)pthread_self();
+        }
+
+        for (i=0; i<rses->rses_nbackends; i++)
+        {
+                if (bref_is_read_slave(&backend_ref[i], master_host, max_rlag))
+                {
+                        nslaves += 1;
+                }
+        }
+
+        if (nslaves == 0)
+        {
+                return false;
+        }
+        pick1 = rand_r(&seed) % nslaves;
+        pick2 = pick1;
+
+        if (nslaves > 1)
+        {
+                pick2 = (pick1 + 1 + rand_r(&seed) % (nslaves - 1)) % nslaves;
+        }
+
+        for (i=0, n=0; i<rses->rses_nbackends; i++)
+        {
+                if (bref_is_read_slave(&backend_ref[i], master_host, max_rlag))
+                {
+                        if ((n == pick1 || n == pick2) &&
+                                (chosen == NULL ||
+                                 bref_cmp_response_time(&backend_ref[i], chosen) < 0))
+                        {
+                                chosen = &backend_ref[i];
+                        }
+                        n += 1;
+                }
+        }
+        ss_dassert(chosen != NULL && chosen->bref_dcb->state != DCB_STATE_ZOMBIE);
+        *p_dcb = chosen->bref_dcb;
+
+        return true;
+}
+
+/**
+ * Return the connected slave with the least outstanding work, the one with
+ * the smallest response time score: the operations all the sessions have
+ * in the server, with the one to be routed, times its average response
+ * time. The operations count as soon as they are routed, so the sessions
+ * that choose at the same time don't all pick the same slave.
+ *
+ * @param p_dcb		Pointer to the chosen backend DCB
+ * @param rses		Router client session
+ * @param master_host	The root master, never chosen
+ * @param max_rlag	Maximum replication lag of the slave or -1
+ *
+ * @return true if a slave was found
+ */
+static bool get_slave_least_busy(
+        DCB**              p_dcb,
+        ROUTER_CLIENT_SES* rses,
+        BACKEND*           master_host,
+        int                max_rlag)
+{
+        backend_ref_t* backend_ref = rses->rses_backend_ref;
+        backend_ref_t* chosen = NULL;
+        int            cmp;
+        int            i;
+
+        if (master_host == NULL)
+        {
+                return false;
+        }
+        for (i=0; i<rses->rses_nbackends; i++)
+        {
+                if (!bref_is_read_slave(&backend_ref[i], master_host, max_rlag))
+                {
+                        continue;
+                }
+                if (chosen == NULL ||
+                        (cmp = bref_cmp_response_time(&backend_ref[i], chosen)) < 0 ||
+                        (cmp == 0 &&
+                         backend_ref[i].bref_backend->backend_server->stats.n_current_ops <
+                         chosen->bref_backend->backend_server->stats.n_current_ops))
+                {
+                        chosen = &backend_ref[i];
+                }
+        }
+        if (chosen == NULL)
+        {
+                return false;
+        }
+        ss_dassert(chosen->bref_dcb->state != DCB_STATE_ZOMBIE);
+        *p_dcb = chosen->bref_dcb;
+
+        return true;
+}
+
 /**
  * Provide a pointer to a suitable backend dcb. 
  * Detect failures in server statuses and reselect backends if necessary.
+ * A read with a bound for the replication lag, max_rlag, goes only to a
+ * slave within the bound, or to the master if there is none.
  */
 static bool get_dcb(
         DCB**              p_dcb,
         ROUTER_CLIENT_SES* rses,
-        backend_type_t     btype)
+        backend_type_t     btype,
+        int                max_rlag)
 {
         backend_ref_t* backend_ref;
         int            smallest_nconn = -1;
@@ -940,6 +1473,19 @@ static bool get_dcb(
 
         if (btype == BE_SLAVE)
         {
+                if (rses->rses_config.rw_statement_balance &&
+                        get_slave_least_busy(p_dcb, rses, master_host, max_rlag))
+                {
+                        succp = true;
+                        goto return_succp;
+                }
+                if (rses->rses_config.rw_slave_select_criteria == LEAST_RESPONSE_TIME &&
+                        get_slave_two_choices(p_dcb, rses, master_host, max_rlag))
+                {
+                        succp = true;
+                        goto return_succp;
+                }
+
                 for (i=0; i<rses->rses_nbackends; i++)
                 {
                         BACKEND* b = backend_ref[i].bref_backend;
@@ -947,6 +1493,8 @@ static bool get_dcb(
                         if (BREF_IS_IN_USE((&backend_ref[i])) &&
                                 (SERVER_IS_SLAVE(b->backend_server) || SERVER_IS_RELAY_SERVER(b->backend_server)) &&
 				(master_host != NULL && b->backend_server != master_host->backend_server) &&
+                                SERVER_CIRCUIT_IS_CLOSED(b->backend_server) &&
+                                bref_within_rlag(&backend_ref[i], max_rlag) &&
                                 (smallest_nconn == -1 || 
                                 b->backend_conn_count < smallest_nconn))
                         {
@@ -972,13 +1520,27 @@ static bool get_dcb(
 					(master_host && (backend_ref->bref_backend->backend_server == master_host->backend_server)) &&
 					smallest_nconn == -1);
                                 
-                                LOGIF(LE, (skygw_log_write_flush(
-                                        LOGFILE_ERROR,
-                                        "Warning : No slaves connected nor "
-                                        "available. Choosing master %s:%d "
-                                        "instead.",
-                                        backend_ref->bref_backend->backend_server->name,
-                                        backend_ref->bref_backend->backend_server->port)));
+                                if (max_rlag >= 0)
+                                {
+                                        LOGIF(LT, (skygw_log_write(
+                                                LOGFILE_TRACE,
+                                                "No slave within %d milliseconds "
+                                                "of the master, choosing master "
+                                                "%s:%d.",
+                                                max_rlag,
+                                                backend_ref->bref_backend->backend_server->name,
+                                                backend_ref->bref_backend->backend_server->port)));
+                                }
+                                else
+                                {
+                                        LOGIF(LE, (skygw_log_write_flush(
+                                                LOGFILE_ERROR,
+                                                "Warning : No slaves connected nor "
+                                                "available. Choosing master %s:%d "
+                                                "instead.",
+                                                backend_ref->bref_backend->backend_server->name,
+                                                backend_ref->bref_backend->backend_server->port)));
+                                }
                         }
                 }                        
                 ss_dassert(succp);
@@ -1003,23 +1565,115 @@ return_succp:
 }
 
 /**
- * The main routing entry, this is called with every packet that is
- * received and has to be forwarded to the backend database.
- *
- * The routeQuery will make the routing decision based on the contents
- * of the instance, session and the query itself in the queue. The
- * data in the queue may not represent a complete query, it represents
- * the data that has been received. The query router itself is responsible
- * for buffering the partial query, a later call to the query router will
- * contain the remainder, or part thereof of the query.
+ * Find the connected backend of a server given by its unique name, as in
+ * a route to server hint.
  *
- * @param instance	The query router instance
- * @param session	The session associated with the client
- * @param queue		Gateway buffer queue with the packets received
+ * @param p_dcb		Pointer to the backend DCB
+ * @param rses		Router client session
+ * @param name		The unique name of the server
  *
- * @return if succeed 1, otherwise 0
- * If routeQuery fails, it means that router session has failed.
- * In any tolerated failure, handleError is called and if necessary,
+ * @return true if the session has a connection to a running server of
+ * that name
+ */
+static bool get_dcb_by_name(
+        DCB**              p_dcb,
+        ROUTER_CLIENT_SES* rses,
+        char*              name)
+{
+        backend_ref_t* backend_ref = rses->rses_backend_ref;
+        int            i;
+
+        for (i=0; i<rses->rses_nbackends; i++)
+        {
+                SERVER* srv = backend_ref[i].bref_backend->backend_server;
+
+                if (BREF_IS_IN_USE((&backend_ref[i])) &&
+                        SERVER_IS_RUNNING(srv) &&
+                        srv->unique_name != NULL &&
+                        strcmp(srv->unique_name, name) == 0)
+                {
+                        ss_dassert(backend_ref[i].bref_dcb->state != DCB_STATE_ZOMBIE);
+                        *p_dcb = backend_ref[i].bref_dcb;
+                        return true;
+                }
+        }
+        return false;
+}
+
+/**
+ * Choose the slave of a read-only transaction with the normal criteria of
+ * a read. The whole transaction is routed to it. A slave that would first
+ * have to reach the GTID of the last write of the session isn't used, the
+ * transaction goes to the master then.
+ *
+ * @param inst		Router instance
+ * @param rses		Router client session
+ * @param querybuf	The statement that starts the transaction
+ *
+ * @return The slave or NULL if the transaction goes to the master
+ */
+static backend_ref_t* ro_trx_get_slave(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses,
+        GWBUF*             querybuf)
+{
+        DCB*           slave_dcb = NULL;
+        backend_ref_t* bref = NULL;
+
+        if (rses_reads_to_master(inst, rses) ||
+                !rses_begin_locked_router_action(rses))
+        {
+                return NULL;
+        }
+        if (rses->rses_slaves_pending)
+        {
+                rses_connect_slaves(inst, rses);
+        }
+        if (get_dcb(&slave_dcb, rses, BE_SLAVE, get_query_max_rlag(rses, querybuf)))
+        {
+                bref = get_bref_from_dcb(rses, slave_dcb);
+
+                if (bref == rses->rses_master_ref ||
+                        (rses->rses_config.rw_causal_reads > 0 &&
+                         rses->rses_causal_gtid[0] != '\0' &&
+                         strcmp(bref->bref_causal_gtid, rses->rses_causal_gtid) != 0))
+                {
+                        bref = NULL;
+                }
+        }
+        rses->rses_trx_slave = bref;
+        rses_end_locked_router_action(rses);
+
+        if (bref != NULL)
+        {
+                ts_stats_add(inst->stats, RWSPLIT_N_RO_TRX, 1);
+                LOGIF(LT, (skygw_log_write(
+                        LOGFILE_TRACE,
+                        "Read-only transaction is routed to %s:%d.",
+                        bref->bref_backend->backend_server->name,
+                        bref->bref_backend->backend_server->port)));
+        }
+        return bref;
+}
+
+/**
+ * The main routing entry, this is called with every packet that is
+ * received and has to be forwarded to the backend database.
+ *
+ * The routeQuery will make the routing decision based on the contents
+ * of the instance, session and the query itself in the queue. The
+ * data in the queue may not represent a complete query, it represents
+ * the data that has been received. The query router itself is responsible
+ * for buffering the partial query, a later call to the query router will
+ * contain the remainder, or part thereof of the query.
+ *
+ * @param instance	The query router instance
+ * @param session	The session associated with the client
+ * @param queue		Gateway buffer queue with the packets received
+ *
+ * @return if succeed 1, otherwise 0
+ * If routeQuery fails, it means that router session has failed.
+ * In any tolerated failure, handleError is called and if necessary,
  * an error message is sent to the client.
  * 
  * For now, routeQuery don't tolerate errors, so any error will close
@@ -1031,19 +1685,19 @@ static int routeQuery(
         GWBUF*  querybuf)
 {
         skygw_query_type_t qtype          = QUERY_TYPE_UNKNOWN;
-        GWBUF*             plainsqlbuf    = NULL;
         char*              querystr       = NULL;
-        char*              startpos;
         mysql_server_cmd_t packet_type;
         uint8_t*           packet;
         int                ret = 0;
         DCB*               master_dcb     = NULL;
         DCB*               slave_dcb      = NULL;
+        HINT*              hint           = NULL;
+        MYSQL_STMT_INFO*   stmtinfo       = NULL;
         ROUTER_INSTANCE*   inst = (ROUTER_INSTANCE *)instance;
         ROUTER_CLIENT_SES* router_cli_ses = (ROUTER_CLIENT_SES *)router_session;
         bool               rses_is_closed = false;
-        size_t             len;
         MYSQL*             mysql = NULL;
+        backend_ref_t*     trx_slave;
 
         CHK_CLIENT_RSES(router_cli_ses);
 
@@ -1057,6 +1711,8 @@ static int routeQuery(
         
         packet = GWBUF_DATA(querybuf);
         packet_type = packet[4];
+        TRACEPOINT4(router__query, router_cli_ses->rses_session,
+                    router_cli_ses, TRACEPOINT_BUFLEN(querybuf), packet_type);
         
         if (rses_is_closed)
         {
@@ -1080,9 +1736,52 @@ static int routeQuery(
                 }
                 goto return_ret;
         }
-        inst->stats.n_queries++;
-        startpos = (char *)&packet[5];
+        /** The packets of a LOCAL INFILE are the file, not statements */
+        if (router_cli_ses->rses_load_data)
+        {
+                ret = route_load_data(router_cli_ses, querybuf);
+                goto return_ret;
+        }
+        /** The packets after the first one of a long statement follow it */
+        if (GWBUF_IS_TYPE_FRAGMENT(querybuf))
+        {
+                ret = route_fragment(router_cli_ses, querybuf);
+                goto return_ret;
+        }
+        ts_stats_add(inst->stats, RWSPLIT_N_QUERIES, 1);
+
+        /** Take back the connections that were returned to the pool */
+        if (router_cli_ses->rses_config.rw_multiplex)
+        {
+                bool succp;
+
+                if (!rses_begin_locked_router_action(router_cli_ses))
+                {
+                        goto return_ret;
+                }
+                succp = mpx_acquire_backends(inst, router_cli_ses);
+                rses_end_locked_router_action(router_cli_ses);
 
+                if (!succp)
+                {
+                        LOGIF(LE, (skygw_log_write_flush(
+                                LOGFILE_ERROR,
+                                "Error : Failed to get a connection to the "
+                                "master for %s.",
+                                STRPACKETTYPE(packet_type))));
+                        goto return_ret;
+                }
+        }
+        /** 
+         * A read is only resent if it was the last statement, otherwise
+         * the statements would be executed in a different order.
+         */
+        if (router_cli_ses->rses_retry_query != NULL &&
+                rses_begin_locked_router_action(router_cli_ses))
+        {
+                rses_retry_clear(router_cli_ses);
+                rses_end_locked_router_action(router_cli_ses);
+        }
         master_dcb = router_cli_ses->rses_master_ref->bref_dcb;
         CHK_DCB(master_dcb);
         
@@ -1105,45 +1804,70 @@ static int routeQuery(
                         break;
 
                 case MYSQL_COM_QUERY:
-                        plainsqlbuf = gwbuf_clone_transform(querybuf, 
-                                                            GWBUF_TYPE_PLAINSQL);
-                        len = GWBUF_LENGTH(plainsqlbuf);
-                        /** unnecessary if buffer includes additional terminating null */
-                        querystr = (char *)malloc(len+1);
-                        memcpy(querystr, startpos, len);
-                        memset(&querystr[len], 0, 1);
+                        /** The text of a long statement isn't copied */
+                        if (MYSQL_GET_PACKET_LEN(packet) == 0xffffff)
+                        {
+                                qtype = get_long_query_type(querybuf);
+                                break;
+                        }
+                        /** The text is attached to querybuf, don't free it */
+                        querystr = modutil_get_SQL(querybuf);
+                        /**
+                         * A hint decides the route by itself, the statement
+                         * is taken for a write or a read without parsing it.
+                         */
+                        if ((hint = hint_route(hint_get(querybuf))) != NULL)
+                        {
+                                qtype = (hint->type == HINT_ROUTE_TO_MASTER ?
+                                         QUERY_TYPE_WRITE : QUERY_TYPE_READ);
+                                ts_stats_add(inst->stats, RWSPLIT_N_HINTED, 1);
+                                break;
+                        }
                         /** 
                          * Use mysql handle to query information from parse tree.
                          * call skygw_query_classifier_free before exit!
+                         * In a transaction the master gets everything that
+                         * doesn't end it or change the session, so the
+                         * boundaries of the transaction are enough.
                          */ 
-                        qtype = skygw_query_classifier_get_type(querystr, 0, &mysql);
+                        qtype = get_query_type(querybuf,
+                                               querystr,
+                                               router_cli_ses->rses_transaction_active,
+                                               &mysql);
                         break;
                         
                 case MYSQL_COM_STMT_PREPARE:
-                        plainsqlbuf = gwbuf_clone_transform(querybuf, 
-                                                            GWBUF_TYPE_PLAINSQL);
-                        len = GWBUF_LENGTH(plainsqlbuf);
-                        /** unnecessary if buffer includes additional terminating null */
-                        querystr = (char *)malloc(len+1);
-                        memcpy(querystr, startpos, len);
-                        memset(&querystr[len], 0, 1);
-                        qtype = skygw_query_classifier_get_type(querystr, 0, &mysql);
+                        if (MYSQL_GET_PACKET_LEN(packet) == 0xffffff)
+                        {
+                                qtype = get_long_query_type(querybuf);
+                        }
+                        else
+                        {
+                                querystr = modutil_get_SQL(querybuf);
+                                qtype = get_query_type(querybuf, querystr, false, &mysql);
+                        }
+                        /** The client protocol gives the type to the executions */
+                        if ((stmtinfo = (MYSQL_STMT_INFO *)gwbuf_get_buffer_object_data(
+                                        querybuf, GWBUF_OBJ_STMT)) != NULL &&
+                                stmtinfo->si_prepare != NULL)
+                        {
+                                stmtinfo->si_prepare->stmt_qtype = qtype;
+                        }
                         qtype |= QUERY_TYPE_PREPARE_STMT;
                         break;
                         
                 case MYSQL_COM_STMT_EXECUTE:
-                        /** Parsing is not needed for this type of packet */
-#if defined(NOT_USED)
-                        plainsqlbuf = gwbuf_clone_transform(querybuf, 
-                                                            GWBUF_TYPE_PLAINSQL);
-                        len = GWBUF_LENGTH(plainsqlbuf);
-                        /** unnecessary if buffer includes additional terminating null */
-                        querystr = (char *)malloc(len+1);
-                        memcpy(querystr, startpos, len);
-                        memset(&querystr[len], 0, 1);
-                        qtype = skygw_query_classifier_get_type(querystr, 0, &mysql);
-#endif
+                        /**
+                         * Parsing is not needed for this type of packet, the
+                         * client protocol knows the type of the prepared text.
+                         */
                         qtype = QUERY_TYPE_EXEC_STMT;
+
+                        if ((stmtinfo = (MYSQL_STMT_INFO *)gwbuf_get_buffer_object_data(
+                                        querybuf, GWBUF_OBJ_STMT)) != NULL)
+                        {
+                                qtype |= stmtinfo->si_qtype;
+                        }
                         break;
                         
                 case MYSQL_COM_SHUTDOWN:       /**< 8 where should shutdown be routed ? */
@@ -1158,6 +1882,30 @@ static int routeQuery(
                         break;
         } /**< switch by packet type */
 
+        ts_stats_add(inst->route_stats,
+                     RWSPLIT_ROUTE_QTYPE(route_qtype_class(qtype)),
+                     1);
+
+        if (router_cli_ses->rses_config.rw_multiplex &&
+                !router_cli_ses->rses_mpx_sticky)
+        {
+                mpx_check_sticky(router_cli_ses, packet_type, querystr);
+        }
+
+        /**
+         * A read-only transaction started with autocommit enabled goes to
+         * one slave, the statement that ends it too.
+         */
+        trx_slave = router_cli_ses->rses_trx_slave;
+
+        if (!router_cli_ses->rses_transaction_active &&
+                router_cli_ses->rses_autocommit_enabled &&
+                packet_type == MYSQL_COM_QUERY &&
+                QUERY_IS_TYPE(qtype, QUERY_TYPE_BEGIN_TRX) &&
+                QUERY_IS_TYPE(qtype, QUERY_TYPE_READ_ONLY_TRX))
+        {
+                trx_slave = ro_trx_get_slave(inst, router_cli_ses, querybuf);
+        }
         /**
          * If autocommit is disabled or transaction is explicitly started
          * transaction becomes active and master gets all statements until
@@ -1194,6 +1942,51 @@ static int routeQuery(
                 router_cli_ses->rses_autocommit_enabled = true;
                 router_cli_ses->rses_transaction_active = false;
         }
+        if (!router_cli_ses->rses_transaction_active)
+        {
+                router_cli_ses->rses_trx_slave = NULL;
+        }
+        /** A statement that commits implicitly must go to the master */
+        if (trx_slave != NULL &&
+                QUERY_IS_TYPE(qtype, QUERY_TYPE_COMMIT) &&
+                QUERY_IS_TYPE(qtype, QUERY_TYPE_WRITE))
+        {
+                trx_slave = NULL;
+        }
+        /**
+         * Statements of the binary protocol have ids of their own in each
+         * backend, see route_prep_stmt.
+         */
+        if (packet_type == MYSQL_COM_STMT_PREPARE ||
+                packet_type == MYSQL_COM_STMT_EXECUTE ||
+                packet_type == MYSQL_COM_STMT_SEND_LONG_DATA ||
+                packet_type == MYSQL_COM_STMT_CLOSE ||
+                packet_type == MYSQL_COM_STMT_RESET ||
+                packet_type == MYSQL_COM_STMT_FETCH)
+        {
+                if (route_prep_stmt(inst, 
+                                    router_cli_ses, 
+                                    querybuf, 
+                                    packet_type, 
+                                    qtype))
+                {
+                        ret = 1;
+                }
+                goto return_ret;
+        }
+        /**
+         * With local_reads the statements that read no data of the
+         * databases may be answered by the router, see route_local_read.
+         */
+        if (router_cli_ses->rses_config.rw_local_reads &&
+                packet_type == MYSQL_COM_QUERY &&
+                hint == NULL &&
+                (qtype & ~(QUERY_TYPE_LOCAL_READ | QUERY_TYPE_READ)) == 0 &&
+                route_local_read(inst, router_cli_ses, querybuf))
+        {
+                ret = 1;
+                goto return_ret;
+        }
         /**
          * Session update is always routed in the same way.
          */
@@ -1201,6 +1994,7 @@ static int routeQuery(
                 QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_STMT) ||
                 QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_NAMED_STMT))
         {
+                router_cli_ses->rses_vars_changed = true;
                 /**
                  * It is not sure if the session command in question requires
                  * response. Statement is examined in route_session_write.
@@ -1218,10 +2012,47 @@ static int routeQuery(
                 }
                 goto return_ret;
         }
+        else if (trx_slave != NULL)
+        {
+                LOGIF(LT, (skygw_log_write(
+                        LOGFILE_TRACE,
+                        "[%s]\tRead-only transaction, routing to Slave.",
+                        inst->service->name)));
+
+                if (!rses_begin_locked_router_action(router_cli_ses))
+                {
+                        goto return_ret;
+                }
+                /** Writes are refused by the slave in a read-only transaction */
+                if (BREF_IS_IN_USE(trx_slave) &&
+                        trx_slave->bref_dcb != NULL &&
+                        (ret = bref_write(router_cli_ses, trx_slave, querybuf)) == 1)
+                {
+                        ts_stats_add(inst->stats, RWSPLIT_N_SLAVE, 1);
+                        route_count(inst, trx_slave, RWSPLIT_R_TRX_SLAVE);
+                        bref_set_state(trx_slave, BREF_QUERY_ACTIVE);
+                        bref_set_state(trx_slave, BREF_WAITING_RESULT);
+                        bref_start_query_timer(router_cli_ses, trx_slave);
+                }
+                else
+                {
+                        router_cli_ses->rses_trx_slave = NULL;
+                        LOGIF(LE, (skygw_log_write_flush(
+                                LOGFILE_ERROR,
+                                "Error : Routing a statement of a read-only "
+                                "transaction to its slave failed.")));
+                }
+                rses_end_locked_router_action(router_cli_ses);
+                goto return_ret;
+        }
         else if (QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) && 
-                !router_cli_ses->rses_transaction_active)
+                !router_cli_ses->rses_transaction_active &&
+                !rses_reads_to_master(inst, router_cli_ses))
         {
                 bool succp;
+                bool tbr_consistent = false;
+                int  reason = RWSPLIT_R_READ;
+                int  max_rlag = -1;
                 
                 LOGIF(LT, (skygw_log_write(
                         LOGFILE_TRACE,
@@ -1234,21 +2065,112 @@ static int routeQuery(
                 {
                         goto return_ret;
                 }
-                succp = get_dcb(&slave_dcb, router_cli_ses, BE_SLAVE);
+                if (router_cli_ses->rses_slaves_pending)
+                {
+                        rses_connect_slaves(inst, router_cli_ses);
+                }
+                else if (router_cli_ses->rses_config.rw_adaptive_slaves > 0)
+                {
+                        rses_adapt_slaves(inst, router_cli_ses);
+                }
+                /** A server that isn't available is the same as no hint */
+                if (hint != NULL &&
+                        hint->type == HINT_ROUTE_TO_NAMED_SERVER &&
+                        get_dcb_by_name(&slave_dcb, router_cli_ses, hint->data))
+                {
+                        succp = true;
+                        reason = RWSPLIT_R_HINT;
+                }
+                else
+                {
+                        max_rlag = get_query_max_rlag(router_cli_ses, querybuf);
+                        
+                        /**
+                         * A slave that has replicated the tables of the
+                         * read past the last write needs no causal wait.
+                         */
+                        if (router_cli_ses->rses_config.rw_table_consistency > 0 &&
+                                packet_type == MYSQL_COM_QUERY &&
+                                tbr_get_dcb(&slave_dcb,
+                                            router_cli_ses,
+                                            querystr,
+                                            max_rlag))
+                        {
+                                tbr_consistent = true;
+                                succp = true;
+                                ts_stats_add(inst->stats, RWSPLIT_N_TBR_SLAVE, 1);
+                        }
+                        else
+                        {
+                                succp = get_dcb(&slave_dcb,
+                                                router_cli_ses,
+                                                BE_SLAVE,
+                                                max_rlag);
+                        }
+                }
                 
                 if (succp)
                 {                        
-                        if ((ret = slave_dcb->func.write(slave_dcb, querybuf)) == 1)
+                        backend_ref_t* bref;
+                        
+                        bref = get_bref_from_dcb(router_cli_ses, slave_dcb);
+                        /**
+                         * With causal reads the slave must first reach the
+                         * GTID of the last write of the session.
+                         */
+                        if (!tbr_consistent &&
+                                router_cli_ses->rses_config.rw_causal_reads > 0 &&
+                                router_cli_ses->rses_causal_gtid[0] != '\0' &&
+                                strcmp(bref->bref_causal_gtid,
+                                       router_cli_ses->rses_causal_gtid) != 0)
+                        {
+                                ret = causal_reads_wait(inst,
+                                                        router_cli_ses,
+                                                        bref,
+                                                        querybuf);
+                        }
+                        else
                         {
-                                backend_ref_t* bref;
+                                GWBUF* retrybuf = NULL;
+                                
+                                /** Keep the read until its reply starts */
+                                if (router_cli_ses->rses_config.rw_retry_reads > 0 &&
+                                        packet_type == MYSQL_COM_QUERY)
+                                {
+                                        retrybuf = gwbuf_clone(querybuf);
+                                }
+                                ret = bref_write(router_cli_ses, bref, querybuf);
                                 
-                                atomic_add(&inst->stats.n_slave, 1);
+                                if (ret == 1 && retrybuf != NULL)
+                                {
+                                        router_cli_ses->rses_retry_query = retrybuf;
+                                        router_cli_ses->rses_retry_bref = bref;
+                                        router_cli_ses->rses_retry_usec = response_clock();
+                                }
+                                else if (retrybuf != NULL)
+                                {
+                                        gwbuf_free(retrybuf);
+                                }
+                        }
+                        
+                        if (ret == 1)
+                        {
+                                ts_stats_add(inst->stats, RWSPLIT_N_SLAVE, 1);
+                                /** A read the slaves could not take */
+                                if (reason == RWSPLIT_R_READ &&
+                                        bref == router_cli_ses->rses_master_ref)
+                                {
+                                        reason = (max_rlag >= 0 ?
+                                                  RWSPLIT_R_LAG :
+                                                  RWSPLIT_R_NO_SLAVE);
+                                }
+                                route_count(inst, bref, reason);
                                 /** 
                                 * Add one query response waiter to backend reference
                                 */
-                                bref = get_bref_from_dcb(router_cli_ses, slave_dcb);
                                 bref_set_state(bref, BREF_QUERY_ACTIVE);
                                 bref_set_state(bref, BREF_WAITING_RESULT);
+                                bref_start_query_timer(router_cli_ses, bref);
                         }
                         else
                         {
@@ -1266,7 +2188,32 @@ static int routeQuery(
         else
         {
                 bool succp = true;
+                int  reason;
                                 
+                if (hint != NULL)
+                {
+                        reason = RWSPLIT_R_HINT;
+                }
+                else if (router_cli_ses->rses_transaction_active ||
+                        QUERY_IS_TYPE(qtype, QUERY_TYPE_BEGIN_TRX) ||
+                        QUERY_IS_TYPE(qtype, QUERY_TYPE_COMMIT) ||
+                        QUERY_IS_TYPE(qtype, QUERY_TYPE_ROLLBACK))
+                {
+                        reason = RWSPLIT_R_TRX;
+                }
+                else if (QUERY_IS_TYPE(qtype, QUERY_TYPE_READ))
+                {
+                        reason = RWSPLIT_R_CAUSAL;
+                }
+                else if (qtype == QUERY_TYPE_UNKNOWN)
+                {
+                        reason = RWSPLIT_R_UNKNOWN;
+                }
+                else
+                {
+                        reason = RWSPLIT_R_WRITE;
+                }
+
                 if (LOG_IS_ENABLED(LOGFILE_TRACE))
                 {
                         if (router_cli_ses->rses_transaction_active) /*< all to master */
@@ -1288,26 +2235,54 @@ static int routeQuery(
                 {
                         goto return_ret;
                 }
+                /** The master failed, the write waits for the new one */
+                if (router_cli_ses->rses_failover_usec != 0)
+                {
+                        ret = failover_hold_write(inst, router_cli_ses, querybuf);
+                        rses_end_locked_router_action(router_cli_ses);
+
+                        if (ret == 1)
+                        {
+                                route_count(inst, NULL, reason);
+                        }
+                        goto return_ret;
+                }
                 
                 if (master_dcb == NULL)
                 {
-                        succp = get_dcb(&master_dcb, router_cli_ses, BE_MASTER);
+                        succp = get_dcb(&master_dcb, router_cli_ses, BE_MASTER, -1);
                 }
                 
                 if (succp)
                 {
-                        if ((ret = master_dcb->func.write(master_dcb, querybuf)) == 1)
+                        backend_ref_t* bref;
+                        
+                        bref = get_bref_from_dcb(router_cli_ses, master_dcb);
+                        
+                        if ((ret = bref_write(router_cli_ses, bref, querybuf)) == 1)
                         {
-                                backend_ref_t* bref;
-                                
-                                atomic_add(&inst->stats.n_master, 1);
+                                ts_stats_add(inst->stats, RWSPLIT_N_MASTER, 1);
+                                route_count(inst, bref, reason);
                                                               
                                 /** 
                                  * Add one write response waiter to backend reference
                                  */
-                                bref = get_bref_from_dcb(router_cli_ses, master_dcb);
                                 bref_set_state(bref, BREF_QUERY_ACTIVE);
-                                bref_set_state(bref, BREF_WAITING_RESULT);                                
+                                bref_set_state(bref, BREF_WAITING_RESULT);
+                                bref_start_query_timer(router_cli_ses, bref);
+                                ryw_note_route(router_cli_ses, qtype);
+                                /**
+                                 * The GTID of a write outside a transaction,
+                                 * or of a commit, is read when it completes.
+                                 */
+                                if (router_cli_ses->rses_config.rw_causal_reads > 0 &&
+                                        !router_cli_ses->rses_transaction_active &&
+                                        !QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) &&
+                                        (packet_type == MYSQL_COM_QUERY ||
+                                        packet_type == MYSQL_COM_STMT_EXECUTE))
+                                {
+                                        bref_set_state(bref, BREF_CAUSAL_WRITE);
+                                }
                         }
                 }
                 rses_end_locked_router_action(router_cli_ses);
@@ -1322,14 +2297,6 @@ static int routeQuery(
                 }
         }
 return_ret:
-        if (plainsqlbuf != NULL)
-        {
-                gwbuf_free(plainsqlbuf);
-        }
-        if (querystr != NULL)
-        {
-                free(querystr);
-        }
         if (mysql != NULL)
         {
                 skygw_query_classifier_free(mysql);
@@ -1338,46 +2305,227 @@ return_ret:
 }
 
 
-/** to be inline'd */
-/** 
- * @node Acquires lock to router client session if it is not closed.
- *
- * Parameters:
- * @param rses - in, use
- *          
- *
- * @return true if router session was not closed. If return value is true
- * it means that router is locked, and must be unlocked later. False, if
- * router was closed before lock was acquired.
+/**
+ * Route the packets of one read in order. Each packet is routed as
+ * routeQuery routes it, but the statements written to a backend are
+ * collected and written to it together once the batch has been routed.
+ * A session command is written by itself, after the statements routed to
+ * the backend before it, see bref_write and bref_write_now.
  *
- * 
- * @details (write detailed description here)
+ * @param instance		The router instance
+ * @param router_session	The router client session
+ * @param querybuf		The packets, each buffer holds one packet
  *
+ * @return 1 if all the packets were routed, 0 otherwise
  */
-static bool rses_begin_locked_router_action(
-        ROUTER_CLIENT_SES* rses)
+static int routeBatch(
+        ROUTER* instance,
+        void*   router_session,
+        GWBUF*  querybuf)
 {
-        bool succp = false;
-        
+        ROUTER_INSTANCE*   inst = (ROUTER_INSTANCE *)instance;
+        ROUTER_CLIENT_SES* rses = (ROUTER_CLIENT_SES *)router_session;
+        GWBUF*             packetbuf;
+        int                ret = 1;
+        int                i;
+
         CHK_CLIENT_RSES(rses);
+        ts_stats_add(inst->stats, RWSPLIT_N_BATCHES, 1);
+        rses->rses_batching = true;
 
-        if (rses->rses_closed) {
-                
-                goto return_succp;
-        }       
-        spinlock_acquire(&rses->rses_lock);
-        if (rses->rses_closed) {
-                spinlock_release(&rses->rses_lock);
-                goto return_succp;
-        }       
-        succp = true;
-        
-return_succp:
-        return succp;
-}
+        while ((packetbuf = querybuf) != NULL)
+        {
+                querybuf = packetbuf->next;
+                packetbuf->next = NULL;
 
-/** to be inline'd */
-/** 
+                if (ret == 1)
+                {
+                        ret = routeQuery(instance, router_session, packetbuf);
+                }
+                else
+                {
+                        /** The session is closed, the rest isn't routed */
+                        gwbuf_free(packetbuf);
+                }
+        }
+        rses->rses_batching = false;
+
+        if (rses_begin_locked_router_action(rses))
+        {
+                for (i = 0; i < rses->rses_nbackends; i++)
+                {
+                        backend_ref_t* bref = &rses->rses_backend_ref[i];
+
+                        if (bref->bref_batch != NULL && 
+                                bref_write_batch(bref) != 1)
+                        {
+                                ret = 0;
+                        }
+                }
+                rses_end_locked_router_action(rses);
+        }
+        return ret;
+}
+
+
+/**
+ * Classify the first packet of a statement of 16MB or more. Only the start
+ * of its text is looked at, by the tokenizer, and nothing else is copied.
+ * The packets that continue the statement must follow it to one place and
+ * a read that long is rare, so the statement is taken for a write with the
+ * transaction boundaries and autocommit changes that the tokenizer finds.
+ * A session command is taken for a write too, the history could not
+ * replay it without the rest of its payload.
+ *
+ * @param querybuf	The first packet of the statement
+ *
+ * @return The query type
+ */
+static skygw_query_type_t get_long_query_type(
+        GWBUF* querybuf)
+{
+        MODUTIL_SQL_VIEW   view;
+        char               prefix[RWSPLIT_LONG_PREFIX + 1];
+        skygw_query_type_t qtype = QUERY_TYPE_UNKNOWN;
+        int                len;
+
+        if (modutil_sql_view(querybuf, &view))
+        {
+                len = MIN(view.length, RWSPLIT_LONG_PREFIX);
+                memcpy(prefix, view.segment, len);
+                prefix[len] = '\0';
+
+                if (!skygw_query_classifier_get_trx_type(prefix, &qtype))
+                {
+                        qtype = QUERY_TYPE_UNKNOWN;
+                }
+        }
+        qtype &= ~(QUERY_TYPE_READ | QUERY_TYPE_SESSION_WRITE);
+
+        return qtype | QUERY_TYPE_WRITE;
+}
+
+/** 
+ * @node Classify the statement of a query buffer
+ *
+ * Parameters:
+ * @param querybuf - in, use
+ *          The buffer with the MySQL packet
+ *
+ * @param querystr - in, use
+ *          The SQL text of the packet or NULL if it wasn't available
+ *
+ * @param trx_only - in, use
+ *          true if only the transaction boundaries and session changes of
+ *          the statement are needed, see skygw_query_classifier_get_trx_type
+ *
+ * @param mysql - out, use
+ *          The MYSQL handle of the parse, see skygw_query_classifier_get_type
+ *
+ * @return The query type
+ *
+ * 
+ * @details The type is attached to the buffer. A buffer that has already
+ * been classified, by this or an earlier module in the chain, isn't
+ * parsed again and no MYSQL handle is returned for it. A type from the
+ * tokenizer isn't attached since it isn't the full type of the statement.
+ *
+ */
+static skygw_query_type_t get_query_type(
+        GWBUF*  querybuf,
+        char*   querystr,
+        bool    trx_only,
+        MYSQL** mysql)
+{
+        skygw_query_type_t* p_qtype;
+        skygw_query_type_t  qtype = QUERY_TYPE_UNKNOWN;
+
+        p_qtype = (skygw_query_type_t *)gwbuf_get_buffer_object_data(
+                querybuf,
+                GWBUF_OBJ_QUERY_TYPE);
+        
+        if (p_qtype != NULL)
+        {
+                qtype = *p_qtype;
+                goto return_qtype;
+        }
+        if (querystr == NULL)
+        {
+                goto return_qtype;
+        }
+        if (trx_only && skygw_query_classifier_get_trx_type(querystr, &qtype))
+        {
+                goto return_qtype;
+        }
+        qtype = skygw_query_classifier_get_type(querystr, 0, mysql);
+        
+        if ((p_qtype = (skygw_query_type_t *)malloc(sizeof(skygw_query_type_t))) != NULL)
+        {
+                *p_qtype = qtype;
+                
+                if (!gwbuf_add_buffer_object(querybuf, 
+                                             GWBUF_OBJ_QUERY_TYPE,
+                                             p_qtype,
+                                             free))
+                {
+                        free(p_qtype);
+                }
+        }
+return_qtype:
+        return qtype;
+}
+
+/** to be inline'd */
+/** 
+ * @node Acquires lock to router client session if it is not closed.
+ *
+ * Parameters:
+ * @param rses - in, use
+ *          
+ *
+ * @return true if router session was not closed. If return value is true
+ * it means that router is locked, and must be unlocked later. False, if
+ * router was closed before lock was acquired.
+ *
+ * 
+ * @details (write detailed description here)
+ *
+ */
+static bool rses_begin_locked_router_action(
+        ROUTER_CLIENT_SES* rses)
+{
+        bool succp = false;
+        
+        CHK_CLIENT_RSES(rses);
+
+        if (rses->rses_closed) {
+                
+                goto return_succp;
+        }       
+        /**
+         * All the events of a pinned session are processed by its owner
+         * thread, one at a time, so the owner need not take the lock.
+         */
+        if (rses->rses_owner_thread >= 0 &&
+            rses->rses_owner_thread == poll_owner_thread())
+        {
+                rses->rses_lockfree_depth += 1;
+                succp = true;
+                goto return_succp;
+        }
+        spinlock_acquire(&rses->rses_lock);
+        if (rses->rses_closed) {
+                spinlock_release(&rses->rses_lock);
+                goto return_succp;
+        }       
+        succp = true;
+        
+return_succp:
+        return succp;
+}
+
+/** to be inline'd */
+/** 
  * @node Releases router client session lock.
  *
  * Parameters:
@@ -1387,16 +2535,68 @@ return_succp:
  * @return void
  *
  * 
- * @details (write detailed description here)
+ * @details A lock free action of the owner thread has nothing to release.
  *
  */
 static void rses_end_locked_router_action(
         ROUTER_CLIENT_SES* rses)
 {
         CHK_CLIENT_RSES(rses);
+
+        if (rses->rses_lockfree_depth > 0)
+        {
+                rses->rses_lockfree_depth -= 1;
+                return;
+        }
         spinlock_release(&rses->rses_lock);
 }
 
+/**
+ * @node Pin the router session to the polling thread that polls all of its
+ * DCBs. This is only the case when every polling thread has an epoll set of
+ * its own, then the client and the backend DCBs of a session all stay with
+ * the thread that accepted the client. The session is pinned so that an
+ * idle thread does not take the events of its DCBs. Events for other
+ * sessions, and for sessions created by threads that do not poll or by a
+ * thread running an event taken from the owner, may be processed by any
+ * thread and they keep using the router session lock.
+ *
+ * Parameters:
+ * @param rses - in, use
+ *          The router client session, with its backends connected
+ *
+ * @param session - in, use
+ *          The session
+ *
+ * @return void
+ */
+static void rses_set_owner_thread(
+        ROUTER_CLIENT_SES* rses,
+        SESSION*           session)
+{
+        int owner = poll_owner_thread();
+        int i;
+
+        if (owner >= 0 && session->client->owner_thread != owner)
+        {
+                owner = -1;
+        }
+        for (i = 0; owner >= 0 && i < rses->rses_nbackends; i++)
+        {
+                backend_ref_t* bref = &rses->rses_backend_ref[i];
+
+                if (BREF_IS_IN_USE(bref) && bref->bref_dcb->owner_thread != owner)
+                {
+                        owner = -1;
+                }
+        }
+        if (owner >= 0)
+        {
+                owner = poll_pin_session(session);
+        }
+        rses->rses_owner_thread = owner;
+}
+
 
 /**
  * Diagnostics routine
@@ -1414,6 +2614,7 @@ ROUTER_INSTANCE	  *router = (ROUTER_INSTANCE *)instance;
 int		  i = 0;
 BACKEND		  *backend;
 char		  *weightby;
+skygw_qc_cache_stats_t qc_stats;
 
 	spinlock_acquire(&router->lock);
 	router_cli_ses = router->connections;
@@ -1426,23 +2627,188 @@ char		  *weightby;
 	
 	dcb_printf(dcb,
                    "\tNumber of router sessions:           	%d\n",
-                   router->stats.n_sessions);
+                   ts_stats_get(router->stats, RWSPLIT_N_SESSIONS));
 	dcb_printf(dcb,
                    "\tCurrent no. of router sessions:      	%d\n",
                    i);
 	dcb_printf(dcb,
                    "\tNumber of queries forwarded:          	%d\n",
-                   router->stats.n_queries);
+                   ts_stats_get(router->stats, RWSPLIT_N_QUERIES));
 	dcb_printf(dcb,
                    "\tNumber of queries forwarded to master:	%d\n",
-                   router->stats.n_master);
+                   ts_stats_get(router->stats, RWSPLIT_N_MASTER));
 	dcb_printf(dcb,
                    "\tNumber of queries forwarded to slave: 	%d\n",
-                   router->stats.n_slave);
+                   ts_stats_get(router->stats, RWSPLIT_N_SLAVE));
 	dcb_printf(dcb,
                    "\tNumber of queries forwarded to all:   	%d\n",
-                   router->stats.n_all);
-	if ((weightby = serviceGetWeightingParameter(router->service)) != NULL)
+                   ts_stats_get(router->stats, RWSPLIT_N_ALL));
+	dcb_printf(dcb,
+                   "\tSession commands compacted from history:	%d\n",
+                   ts_stats_get(router->stats, RWSPLIT_N_SESCMD_COMPACTED));
+	dcb_printf(dcb,
+                   "\tPrepared statements executed in slaves:	%d\n",
+                   ts_stats_get(router->stats, RWSPLIT_N_PSTMT_SLAVE));
+	dcb_printf(dcb,
+                   "\tStatements prepared in a backend lazily:	%d\n",
+                   ts_stats_get(router->stats, RWSPLIT_N_PSTMT_PREPARE));
+	dcb_printf(dcb,
+                   "\tStatements routed by a hint:          	%d\n",
+                   ts_stats_get(router->stats, RWSPLIT_N_HINTED));
+	dcb_printf(dcb,
+                   "\tBatches of statements routed:         	%d\n",
+                   ts_stats_get(router->stats, RWSPLIT_N_BATCHES));
+	if (router->rwsplit_config.rw_retry_reads > 0)
+	{
+		dcb_printf(dcb,
+                           "\tFailed reads resent to another backend:	%d\n",
+                           ts_stats_get(router->stats, RWSPLIT_N_READ_RETRY));
+	}
+	if (router->rwsplit_config.rw_multiplex)
+	{
+		dcb_printf(dcb,
+                           "\tConnections returned to the pool:     	%d\n",
+                           ts_stats_get(router->stats, RWSPLIT_N_MPX_RELEASED));
+		dcb_printf(dcb,
+                           "\tConnections taken from the pool:      	%d\n",
+                           ts_stats_get(router->stats, RWSPLIT_N_MPX_ACQUIRED));
+	}
+	if (router->rwsplit_config.rw_causal_reads > 0)
+	{
+		dcb_printf(dcb,
+                           "\tNumber of causal waits on slaves:     	%d\n",
+                           ts_stats_get(router->stats, RWSPLIT_N_CAUSAL_WAIT));
+		dcb_printf(dcb,
+                           "\tNumber of causal reads sent to master:	%d\n",
+                           ts_stats_get(router->stats, RWSPLIT_N_CAUSAL_MASTER));
+	}
+	if (router->rwsplit_config.rw_table_consistency > 0)
+	{
+		dcb_printf(dcb,
+                           "\tReads to table consistent slaves:     	%d\n",
+                           ts_stats_get(router->stats, RWSPLIT_N_TBR_SLAVE));
+	}
+	if (router->rwsplit_config.rw_master_failover_wait > 0)
+	{
+		dcb_printf(dcb,
+                           "\tWrites held for a new master:         	%d\n",
+                           ts_stats_get(router->stats, RWSPLIT_N_FAILOVER_HELD));
+	}
+	if (router->rwsplit_config.rw_read_your_writes_window > 0)
+	{
+		dcb_printf(dcb,
+                           "\tReads sent to master after a write:   	%d\n",
+                           ts_stats_get(router->stats, RWSPLIT_N_RYW_MASTER));
+	}
+	if (router->rwsplit_config.rw_skip_redundant_sescmd)
+	{
+		dcb_printf(dcb,
+                           "\tSession commands of the current state:	%d\n",
+                           ts_stats_get(router->stats, RWSPLIT_N_SESCMD_SKIPPED));
+	}
+	if (router->rwsplit_config.rw_local_reads)
+	{
+		dcb_printf(dcb,
+                           "\tStatements answered by the router:    	%d\n",
+                           ts_stats_get(router->stats, RWSPLIT_N_LOCAL_READ));
+	}
+	if (router->rwsplit_config.rw_adaptive_slaves > 0)
+	{
+		dcb_printf(dcb,
+                           "\tSlaves connected for queued reads:    	%d\n",
+                           ts_stats_get(router->stats, RWSPLIT_N_SLAVE_GROWN));
+		dcb_printf(dcb,
+                           "\tIdle slaves released:                 	%d\n",
+                           ts_stats_get(router->stats, RWSPLIT_N_SLAVE_RELEASED));
+	}
+	dcb_printf(dcb,
+                   "\tRead-only transactions on slaves:     	%d\n",
+                   ts_stats_get(router->stats, RWSPLIT_N_RO_TRX));
+	skygw_query_classifier_get_cache_stats(&qc_stats);
+	dcb_printf(dcb,
+                   "\tQuery classifier cache size:          	%d\n",
+                   qc_stats.qcs_size);
+	dcb_printf(dcb,
+                   "\tQuery classifier cache entries:       	%d\n",
+                   qc_stats.qcs_entries);
+	dcb_printf(dcb,
+                   "\tQuery classifier cache hits:          	%lu\n",
+                   qc_stats.qcs_hits);
+	dcb_printf(dcb,
+                   "\tQuery classifier cache misses:        	%lu\n",
+                   qc_stats.qcs_misses);
+	dcb_printf(dcb,
+                   "\tQuery classifier cache evictions:     	%lu\n",
+                   qc_stats.qcs_evictions);
+	dcb_printf(dcb,
+                   "\tQuery classifier fast path:           	%lu\n",
+                   qc_stats.qcs_fast);
+	dcb_printf(dcb, "\tRouting decisions:\n");
+	for (i = 0; i < RWSPLIT_R_N; i++)
+	{
+		dcb_printf(dcb, "\t\t%-20s %d\n",
+                           route_reason_names[i],
+                           ts_stats_get(router->route_stats,
+                                        RWSPLIT_ROUTE_REASON(i)));
+	}
+	dcb_printf(dcb, "\tStatement types:\n");
+	for (i = 0; i < RWSPLIT_QT_N; i++)
+	{
+		dcb_printf(dcb, "\t\t%-20s %d\n",
+                           route_qtype_names[i],
+                           ts_stats_get(router->route_stats,
+                                        RWSPLIT_ROUTE_QTYPE(i)));
+	}
+	dcb_printf(dcb, "\tRouting decisions by server:\n");
+	for (i = 0; router->servers[i]; i++)
+	{
+		int r, n;
+
+		backend = router->servers[i];
+		dcb_printf(dcb, "\t\t%s\n", backend->backend_server->unique_name);
+
+		for (r = 0; r < RWSPLIT_R_N; r++)
+		{
+			if ((n = ts_stats_get(router->route_stats,
+                                        RWSPLIT_ROUTE_SERVER(i, r))) > 0)
+			{
+				dcb_printf(dcb, "\t\t\t%-20s %d\n",
+                                           route_reason_names[r], n);
+			}
+		}
+	}
+	if (router->rwsplit_config.rw_slave_select_criteria == LEAST_RESPONSE_TIME)
+        {
+                dcb_printf(dcb,
+                        "\t\tServer               Average response  Operations\n");
+                for (i = 0; router->servers[i]; i++)
+                {
+                        backend = router->servers[i];
+                        dcb_printf(dcb,
+				"\t\t%-20s %-10.3f ms     %d\n",
+                                backend->backend_server->unique_name,
+                                (double)backend->be_response_time / 1000,
+				backend->backend_server->stats.n_current_ops);
+                }
+        }
+	if (router->rwsplit_config.rw_dynamic_weights)
+        {
+                dcb_printf(dcb,
+                        "\tDynamic connection distribution.\n");
+                dcb_printf(dcb,
+                        "\t\tServer               Target %%    Configured %%  Failures\n");
+                for (i = 0; router->servers[i]; i++)
+                {
+                        backend = router->servers[i];
+                        dcb_printf(dcb,
+				"\t\t%-20s %5.1f%%      %5.1f%%        %d\n",
+                                backend->backend_server->unique_name,
+                                (float)backend->weight / 10,
+                                (float)backend->be_static_weight / 10,
+				backend->be_errors);
+                }
+        }
+	else if ((weightby = serviceGetWeightingParameter(router->service)) != NULL)
         {
                 dcb_printf(dcb,
 		   "\tConnection distribution based on %s "
@@ -1468,6 +2834,59 @@ char		  *weightby;
 
 }
 
+/**
+ * Give the routing decision counters to the metrics collection, by reason,
+ * by server and reason and by statement class.
+ *
+ * @param	instance	The router instance
+ * @param	fn		Called for each sample
+ * @param	arg		Passed to fn
+ */
+static void
+getMetrics(ROUTER *instance, ROUTER_METRIC_FN fn, void *arg)
+{
+ROUTER_INSTANCE	*router = (ROUTER_INSTANCE *)instance;
+char		*labels[5];
+int		i, r;
+
+	labels[2] = NULL;
+	for (r = 0; r < RWSPLIT_R_N; r++)
+	{
+		labels[0] = "reason";
+		labels[1] = route_reason_names[r];
+		fn(arg, "maxscale_rwsplit_route_decisions_total",
+			"Statements routed by the reason of the decision",
+			labels,
+			ts_stats_get(router->route_stats, RWSPLIT_ROUTE_REASON(r)));
+	}
+	for (r = 0; r < RWSPLIT_QT_N; r++)
+	{
+		labels[0] = "type";
+		labels[1] = route_qtype_names[r];
+		fn(arg, "maxscale_rwsplit_statements_total",
+			"Statements routed by their type",
+			labels,
+			ts_stats_get(router->route_stats, RWSPLIT_ROUTE_QTYPE(r)));
+	}
+	labels[4] = NULL;
+	for (i = 0; router->servers[i]; i++)
+	{
+		for (r = 0; r < RWSPLIT_R_N; r++)
+		{
+			labels[0] = "server";
+			labels[1] = router->servers[i]->backend_server->unique_name;
+			labels[2] = "reason";
+			labels[3] = route_reason_names[r];
+			fn(arg, "maxscale_rwsplit_server_route_decisions_total",
+				"Statements routed to a server by the reason of "
+				"the decision",
+				labels,
+				ts_stats_get(router->route_stats,
+					RWSPLIT_ROUTE_SERVER(i, r)));
+		}
+	}
+}
+
 /**
  * Client Reply routine
  *
@@ -1488,6 +2907,7 @@ static void clientReply (
         ROUTER_CLIENT_SES* router_cli_ses;
 	sescmd_cursor_t*   scur = NULL;
         backend_ref_t*     bref;
+        GWBUF*             querybuf = NULL;
         
 	router_cli_ses = (ROUTER_CLIENT_SES *)router_session;
         CHK_CLIENT_RSES(router_cli_ses);
@@ -1535,10 +2955,41 @@ static void clientReply (
         CHK_BACKEND_REF(bref);
         scur = &bref->bref_sescmd_cur;
         /**
-         * Active cursor means that reply is from session command 
-         * execution.
+         * Replies to the queries of causal reads and to lazy prepares are
+         * consumed by the router.
+         * A held reply is returned when it can be sent to the client.
+         */
+        if ((BREF_IS_CAUSAL(bref) || (bref->bref_state & BREF_PSTMT_LAZY)) &&
+                !GWBUF_IS_TYPE_SESCMD_RESPONSE(writebuf))
+        {
+                if (bref->bref_state & BREF_PSTMT_LAZY)
+                {
+                        writebuf = pstmt_lazy_reply((ROUTER_INSTANCE *)instance,
+                                                    router_cli_ses,
+                                                    bref,
+                                                    writebuf);
+                }
+                else
+                {
+                        writebuf = causal_reads_reply((ROUTER_INSTANCE *)instance,
+                                                      router_cli_ses,
+                                                      bref,
+                                                      writebuf);
+                }
+                
+                if (writebuf == NULL)
+                {
+                        rses_end_locked_router_action(router_cli_ses);
+                        goto lock_failed;
+                }
+        }
+        /**
+         * A reply that the protocol has marked as session command responses
+         * is from the cursor. Replies to statements pipelined after the
+         * session commands may follow the responses.
          */
-	if (sescmd_cursor_is_active(scur))
+	if (sescmd_cursor_is_active(scur) &&
+                GWBUF_IS_TYPE_SESCMD_RESPONSE(writebuf))
 	{
                 if (LOG_IS_ENABLED(LOGFILE_ERROR) && 
                         MYSQL_IS_ERROR_PACKET(((uint8_t *)GWBUF_DATA(writebuf))))
@@ -1561,39 +3012,49 @@ static void clientReply (
                         free(cmdstr);
                 }
                 
-                if (GWBUF_IS_TYPE_SESCMD_RESPONSE(writebuf))
-                {
-                        /** 
-                        * Discard all those responses that have already been sent to
-                        * the client. Return with buffer including response that
-                        * needs to be sent to client or NULL.
-                        */
-                        writebuf = sescmd_cursor_process_replies(writebuf, bref);
-                }
                 /** 
-                 * If response will be sent to client, decrease waiter count.
-                 * This applies to session commands only. Counter decrement
-                 * for other type of queries is done outside this block.
+                 * Discard all those responses that have already been sent to
+                 * the client. Return with buffer including responses that
+                 * need to be sent to client or NULL, the rest of the reply
+                 * is put to querybuf.
                  */
-                if (writebuf != NULL && client_dcb != NULL)
+                writebuf = sescmd_cursor_process_replies(writebuf,
+                                                         bref,
+                                                         &querybuf);
+	}
+        else
+        {
+                querybuf = writebuf;
+                writebuf = NULL;
+        }
+
+        if (querybuf != NULL)
+        {
+                /** Count the replies to the queries of the backend */
+                bref_query_reply(router_cli_ses, bref, querybuf);
+
+                /** The client sends the file of LOAD DATA LOCAL INFILE next */
+                if (bref == router_cli_ses->rses_master_ref &&
+                        bref_is_infile_request(bref, querybuf))
                 {
-                        /** Set response status as replied */
-                        bref_clear_state(bref, BREF_WAITING_RESULT);
+                        router_cli_ses->rses_load_data = true;
                 }
-	}
-	/**
-         * Clear BREF_QUERY_ACTIVE flag and decrease waiter counter.
-         * This applies for queries  other than session commands.
-         */
-	else if (BREF_IS_QUERY_ACTIVE(bref))
-	{
-                bref_clear_state(bref, BREF_QUERY_ACTIVE);
-                /** Set response status as replied */
-                bref_clear_state(bref, BREF_WAITING_RESULT);
+
+                /** The client is given the id of the router for a new statement */
+                if (bref->bref_state & BREF_PSTMT_PREPARE)
+                {
+                        pstmt_prepare_reply(router_cli_ses, bref, querybuf);
+                }
+                writebuf = gwbuf_append(writebuf, querybuf);
         }
 
         if (writebuf != NULL && client_dcb != NULL)
         {
+                /** Once the client has a part of the reply it can't be resent */
+                if (bref == router_cli_ses->rses_retry_bref)
+                {
+                        rses_retry_clear(router_cli_ses);
+                }
                 /** Write reply to client DCB */
 		SESSION_ROUTE_REPLY(backend_dcb->session, writebuf);
         }
@@ -1606,24 +3067,31 @@ static void clientReply (
                 /** Log to debug that router was closed */
                 goto lock_failed;
         }
-        /** There is one pending session command to be executed. */
-        if (sescmd_cursor_is_active(scur)) 
+        /** Statements that waited for the replies can be written now */
+        if (bref->bref_held != NULL && BREF_IS_IN_USE(bref))
         {
-                bool succp;
-                
                 LOGIF(LT, (skygw_log_write(
                         LOGFILE_TRACE,
-                        "Backend %s:%d processed reply and starts to execute "
-                        "active cursor.",
+                        "Backend %s:%d processed reply and writes the "
+                        "statements pipelined after it.",
                         bref->bref_backend->backend_server->name,
                         bref->bref_backend->backend_server->port)));
                 
-                succp = execute_sescmd_in_backend(bref);
-                
-                ss_dassert(succp);
+                bref_write_held(bref);
         }
-        /** Unlock router session */
-        rses_end_locked_router_action(router_cli_ses);
+        if (router_cli_ses->rses_config.rw_multiplex &&
+                !sescmd_cursor_is_active(scur))
+        {
+                mpx_release_backends((ROUTER_INSTANCE *)instance,
+                                     router_cli_ses);
+        }
+        if (router_cli_ses->rses_config.rw_adaptive_slaves > 0)
+        {
+                rses_release_idle_slaves((ROUTER_INSTANCE *)instance,
+                                         router_cli_ses);
+        }
+        /** Unlock router session */
+        rses_end_locked_router_action(router_cli_ses);
         
 lock_failed:
         return;
@@ -1679,6 +3147,178 @@ int bref_cmp_current_load(
         return ((1000 * s1->stats.n_current_ops) - b1->weight)
 			- ((1000 * s2->stats.n_current_ops) - b2->weight);
 }
+
+/**
+ * Return the monotonic clock in microseconds
+ */
+static unsigned long response_clock(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Compute the weights of the backends from the configured weights with the
+ * dynamic_weights router option. The weight of a backend is scaled by the
+ * average response time of the running backends divided by its own, within
+ * RWSPLIT_WEIGHT_MAX_SCALE times either way, and halved for each recent
+ * failure of a connection to it. A server that the monitor reports running
+ * again, or for the first time, starts from a small weight that grows
+ * linearly for slow_start seconds, so that new sessions don't all connect
+ * to a cold server. The weights are computed at most every
+ * RWSPLIT_WEIGHT_INTERVAL_MS milliseconds, the failures are halved each time.
+ *
+ * The weights are shared by all the sessions and are updated without a lock,
+ * a session that sees a weight of the previous round only chooses a bit
+ * differently.
+ *
+ * @param router	Router instance
+ */
+static void router_update_weights(
+        ROUTER_INSTANCE* router)
+{
+        unsigned long now = response_clock();
+        unsigned long slow_usec;
+        long long     rt_total = 0;
+        long long     total = 0;
+        int           nmeasured = 0;
+        int           avg_rt;
+        int           i;
+
+        if (now - router->weights_usec < RWSPLIT_WEIGHT_INTERVAL_MS * 1000 &&
+                router->weights_usec != 0)
+        {
+                return;
+        }
+        router->weights_usec = now;
+        slow_usec = (unsigned long)router->rwsplit_config.rw_slow_start * 1000000;
+
+        for (i = 0; router->servers[i]; i++)
+        {
+                BACKEND* b = router->servers[i];
+
+                if (SERVER_IS_RUNNING(b->backend_server) && b->be_response_time > 0)
+                {
+                        rt_total += b->be_response_time;
+                        nmeasured += 1;
+                }
+        }
+        avg_rt = (nmeasured > 0 ? (int)(rt_total / nmeasured) : 0);
+
+        for (i = 0; router->servers[i]; i++)
+        {
+                BACKEND*  b = router->servers[i];
+                long long w = b->be_static_weight;
+                int       nerrors;
+
+                if (!SERVER_IS_RUNNING(b->backend_server))
+                {
+                        b->be_up_usec = 0;
+                        continue;
+                }
+                if (b->be_up_usec == 0)
+                {
+                        b->be_up_usec = now;
+                }
+                if (avg_rt > 0 && b->be_response_time > 0)
+                {
+                        w = w * avg_rt / b->be_response_time;
+                        w = MAX(w, b->be_static_weight / RWSPLIT_WEIGHT_MAX_SCALE);
+                        w = MIN(w, b->be_static_weight * RWSPLIT_WEIGHT_MAX_SCALE);
+                }
+                nerrors = b->be_errors;
+                w >>= MIN(nerrors, 10);
+                atomic_add(&b->be_errors, -(nerrors - nerrors / 2));
+
+                if (slow_usec > 0 && now - b->be_up_usec < slow_usec)
+                {
+                        w = w * (long long)(now - b->be_up_usec) / (long long)slow_usec;
+                }
+                b->weight = (int)MAX(w, 1);
+                total += b->weight;
+        }
+        /** Keep the weights in .1% of the load like the configured ones */
+        for (i = 0; total > 0 && router->servers[i]; i++)
+        {
+                BACKEND* b = router->servers[i];
+
+                if (SERVER_IS_RUNNING(b->backend_server))
+                {
+                        b->weight = (int)MAX((b->weight * 1000LL) / total, 1);
+                }
+        }
+}
+
+/**
+ * The expected time a new query waits in a backend: the average response
+ * time scaled by the operations already in the backend and the weight of
+ * the backend. A backend that is yet to reply counts as the fastest one so
+ * that every backend gets measured.
+ *
+ * @param b	The backend
+ *
+ * @return The score of the backend, smaller is better
+ */
+static long long backend_response_score(
+        BACKEND* b)
+{
+        long long score;
+
+        score = (long long)b->be_response_time *
+                (b->backend_server->stats.n_current_ops + 1) * 1000;
+        return score / (b->weight > 0 ? b->weight : 1);
+}
+
+/** Compare the average response times of backend servers */
+int bref_cmp_response_time(
+        const void* bref1,
+        const void* bref2)
+{
+        long long r1 = backend_response_score(((backend_ref_t *)bref1)->bref_backend);
+        long long r2 = backend_response_score(((backend_ref_t *)bref2)->bref_backend);
+
+        return (r1 < r2 ? -1 : (r1 > r2 ? 1 : 0));
+}
+
+/**
+ * Add the response time of the query the backend has started to reply to
+ * into the average response time of the backend. The average is shared by
+ * all the sessions of the router and is updated without a lock, a lost
+ * update only drops one sample.
+ *
+ * @param bref	Backend reference whose query got a reply
+ */
+static void bref_update_response_time(
+        backend_ref_t* bref)
+{
+        BACKEND* b = bref->bref_backend;
+        long     sample;
+        long     avg;
+
+        sample = (long)(response_clock() - bref->bref_sent_usec);
+
+        if (sample <= 0)
+        {
+                sample = 1;
+        }
+        else if (sample > INT32_MAX)
+        {
+                sample = INT32_MAX;
+        }
+        avg = b->be_response_time;
+
+        if (avg == 0)
+        {
+                avg = sample;
+        }
+        else
+        {
+                avg += (sample - avg) / (1 << RWSPLIT_EWMA_SHIFT);
+        }
+        b->be_response_time = (avg > 0 ? (int)avg : 1);
+}
         
 static void bref_clear_state(
         backend_ref_t* bref,
@@ -1686,6 +3326,12 @@ static void bref_clear_state(
 {
         if (state != BREF_WAITING_RESULT)
         {
+                /** A closed backend's query gives no sample */
+                if ((state & BREF_QUERY_ACTIVE) && BREF_IS_QUERY_ACTIVE(bref) &&
+                        BREF_IS_IN_USE(bref))
+                {
+                        bref_update_response_time(bref);
+                }
                 bref->bref_state &= ~state;
         }
         else
@@ -1715,6 +3361,11 @@ static void bref_set_state(
 {
         if (state != BREF_WAITING_RESULT)
         {
+                /** The first of pipelined queries is timed */
+                if ((state & BREF_QUERY_ACTIVE) && !BREF_IS_QUERY_ACTIVE(bref))
+                {
+                        bref->bref_sent_usec = response_clock();
+                }
                 bref->bref_state |= state;
         }
         else
@@ -1733,1916 +3384,6416 @@ static void bref_set_state(
         }
 }
 
-/** 
- * @node Search suitable backend servers from those of router instance.
- *
- * Parameters:
- * @param p_master_ref - in, use, out
- *      Pointer to location where master's backend reference is to  be stored.
- *      NULL is not allowed.
- *
- * @param backend_ref - in, use, out 
- *      Pointer to backend server reference object array.
- *      NULL is not allowed.
- *
- * @param router_nservers - in, use
- *      Number of backend server pointers pointed to by b.
- * 
- * @param max_nslaves - in, use
- *      Upper limit for the number of slaves. Configuration parameter or default.
+/**
+ * Start the query timer of a backend that has been sent a query. The backend
+ * connection is closed if it stays silent for backend_reply_timeout seconds, which
+ * hands the backend to the normal error handling of the router.
  *
- * @param max_slave_rlag - in, use
- *      Maximum allowed replication lag for any slave. Configuration parameter or default.
+ * @param rses	Router client session
+ * @param bref	Backend reference the query was sent to
+ */
+static void bref_start_query_timer(
+        ROUTER_CLIENT_SES* rses,
+        backend_ref_t*     bref)
+{
+        if (bref != NULL &&
+            bref->bref_dcb != NULL &&
+            rses->rses_config.rw_backend_reply_timeout > 0)
+        {
+                dcb_set_idle_timeout(bref->bref_dcb,
+                                     rses->rses_config.rw_backend_reply_timeout);
+        }
+}
+
+/**
+ * Free a chain of buffers
  *
- * @param session - in, use
- *      MaxScale session pointer used when connection to backend is established.
+ * @param buf	The first buffer of the chain
+ */
+static void causal_buf_free(
+        GWBUF* buf)
+{
+        while ((buf = gwbuf_consume(buf, GWBUF_LENGTH(buf))) != NULL);
+}
+
+/**
+ * Copy the data of a chain of reply buffers to contiguous memory
  *
- * @param  router - in, use
- *      Pointer to router instance. Used when server states are qualified.
- * 
- * @return true, if at least one master and one slave was found.
+ * @param buf	The first buffer of the chain
+ * @param len	out, the length of the data
  *
- * 
- * @details It is assumed that there is only one master among servers of
- *      a router instance. As a result, the first master found is chosen.
- *      There will possibly be more backend references than connected backends
- *      because only those in correct state are connected to.
+ * @return The data, to be freed by the caller, or NULL if out of memory
  */
-static bool select_connect_backend_servers(
-        backend_ref_t**    p_master_ref,
-        backend_ref_t*     backend_ref,
-        int                router_nservers,
-        int                max_nslaves,
-        int                max_slave_rlag,
-        select_criteria_t  select_criteria,
-        SESSION*           session,
-        ROUTER_INSTANCE*   router)
+static uint8_t* reply_copy_chain(
+        GWBUF* buf,
+        int*   len)
 {
-        bool            succp = true;
-        bool            master_found;
-        bool            master_connected;
-        int             slaves_found = 0;
-        int             slaves_connected = 0;
-        int             i;
-        const int       min_nslaves = 0; /*< not configurable at the time */
-        bool            is_synced_master;
-        int (*p)(const void *, const void *);
-	BACKEND *master_host = NULL;
-        
-        if (p_master_ref == NULL || backend_ref == NULL)
+        GWBUF*   b;
+        uint8_t* data;
+        uint8_t* ptr;
+        int      total = 0;
+
+        for (b = buf; b != NULL; b = b->next)
         {
-                ss_dassert(FALSE);
-                succp = false;
-                goto return_succp;
+                total += GWBUF_LENGTH(b);
         }
-      
-	/* get the root Master */ 
-	master_host = get_root_master(backend_ref, router_nservers); 
+        if ((data = (uint8_t *)malloc(total + 1)) == NULL)
+        {
+                return NULL;
+        }
+        for (b = buf, ptr = data; b != NULL; b = b->next)
+        {
+                memcpy(ptr, GWBUF_DATA(b), GWBUF_LENGTH(b));
+                ptr += GWBUF_LENGTH(b);
+        }
+        *len = total;
+        return data;
+}
 
-        /** Master is already chosen and connected. This is slave failure case */
-        if (*p_master_ref != NULL &&
-                BREF_IS_IN_USE((*p_master_ref)))
+/**
+ * Start the table consistency listeners on the binlogs of the servers of a
+ * router. The listeners are a library of their own that is loaded the first
+ * time it is needed, they connect with the user of the service, which needs
+ * the REPLICATION SLAVE privilege, and the slaves must write a binlog of the
+ * replicated changes with log_slave_updates.
+ *
+ * @param router	The router instance
+ *
+ * @return true if the listeners follow the servers
+ */
+static bool tbr_start(
+        ROUTER_INSTANCE* router)
+{
+        void*                   dlhandle;
+        int                     (*init)(replication_listener_t*, size_t, unsigned int, int);
+        int                     (*query)(table_consistency_query_t*,
+                                         table_consistency_t*,
+                                         size_t*);
+        replication_listener_t* rpl;
+        char*                   user;
+        char*                   passwd;
+        char*                   dpwd;
+        int                     master = 0;
+        int                     n;
+        int                     i;
+        bool                    succp = false;
+
+        spinlock_acquire(&tbr_lock);
+
+        if (tbr_query != NULL)
         {
-                LOGIF(LD, (skygw_log_write(
-                        LOGFILE_DEBUG,
-                        "%lu [select_connect_backend_servers] Master %p fd %d found.",
-                        pthread_self(),
-                        (*p_master_ref)->bref_dcb,
-                        (*p_master_ref)->bref_dcb->fd)));
-                
-                master_found     = true;
-                master_connected = true;
-		/* assert with master_host */
-                ss_dassert(master_host && ((*p_master_ref)->bref_backend->backend_server == master_host->backend_server) && SERVER_MASTER);
+                spinlock_release(&tbr_lock);
+                return true;
         }
-        /** New session or master failure case */
-        else
+        for (n = 0; router->servers[n] != NULL; n++)
+                ;
+        if (n > RWSPLIT_TBR_MAX_SERVERS)
         {
-                LOGIF(LD, (skygw_log_write(
-                        LOGFILE_DEBUG,
-                        "%lu [select_connect_backend_servers] Session %p doesn't "
-                        "currently have a master chosen. Proceeding to master "
-                        "selection.",
-                        pthread_self(),
-                        session)));
-                
-                master_found     = false;
-                master_connected = false;
+                n = RWSPLIT_TBR_MAX_SERVERS;
         }
-        /** Check slave selection criteria and set compare function */
-        p = criteria_cmpfun[select_criteria];
-        
-        if (p == NULL)
+        if (serviceGetUser(router->service, &user, &passwd) == 0)
         {
-                succp = false;
+                LOGIF(LE, (skygw_log_write_flush(
+                        LOGFILE_ERROR,
+                        "Error : Service %s has no user for the table "
+                        "consistency listeners.",
+                        router->service->name)));
                 goto return_succp;
-        }        
-        
-        if (router->bitvalue != 0) /*< 'synced' is the only bitvalue in rwsplit */
+        }
+        if ((dlhandle = dlopen(RWSPLIT_TBR_LIBRARY, RTLD_NOW|RTLD_LOCAL)) == NULL)
         {
-                is_synced_master = true;
+                LOGIF(LE, (skygw_log_write_flush(
+                        LOGFILE_ERROR,
+                        "Error : Unable to load the table consistency "
+                        "listeners %s, %s.",
+                        RWSPLIT_TBR_LIBRARY,
+                        dlerror())));
+                goto return_succp;
         }
-        else
+        init = dlsym(dlhandle, "tb_replication_consistency_init");
+        query = dlsym(dlhandle, "tb_replication_consistency_query");
+
+        /** The listeners keep the definitions, they are never freed */
+        if (init == NULL ||
+                query == NULL ||
+                (rpl = calloc(n, sizeof(replication_listener_t))) == NULL)
         {
-                is_synced_master = false;
+                dlclose(dlhandle);
+                goto return_succp;
         }
+        dpwd = decryptPassword(passwd);
 
-#if defined(EXTRA_SS_DEBUG)        
-        LOGIF(LT, (skygw_log_write(LOGFILE_TRACE, "Servers and conns before ordering:")));
-        
-        for (i=0; i<router_nservers; i++)
+        for (i = 0; i < n; i++)
         {
-                BACKEND* b = backend_ref[i].bref_backend;
+                SERVER* srv = router->servers[i]->backend_server;
+                int     len = strlen(user) + strlen(dpwd) + strlen(srv->name) + 32;
 
-                LOGIF(LT, (skygw_log_write(LOGFILE_TRACE, 
-                                           "master bref %p bref %p %d %s %d:%d",
-                                           *p_master_ref,
-                                           &backend_ref[i],
-                                           backend_ref[i].bref_state,
-                                           b->backend_server->name,
-                                           b->backend_server->port,
-                                           b->backend_conn_count)));                
+                if ((rpl[i].server_url = malloc(len)) != NULL)
+                {
+                        snprintf(rpl[i].server_url, len, "mysql://%s:%s@%s:%d",
+                                 user, dpwd, srv->name, srv->port);
+                }
+                rpl[i].gateway_slave_server_id = router->rwsplit_config.rw_table_consistency;
+                /** The listener id of a server is its index */
+                tbr_servers[i] = srv;
+
+                if (SERVER_IS_MASTER(srv) && master == 0)
+                {
+                        master = i;
+                }
         }
-#endif
-	/* assert with master_host */
-        ss_dassert(!master_connected ||
-                (master_host && ((*p_master_ref)->bref_backend->backend_server == master_host->backend_server) && SERVER_MASTER));
-        /**
-         * Sort the pointer list to servers according to connection counts. As 
-         * a consequence those backends having least connections are in the 
-         * beginning of the list.
-         */
-        qsort(backend_ref, (size_t)router_nservers, sizeof(backend_ref_t), p);
+        free(dpwd);
+        /** The metadata of the listeners is kept in the master */
+        rpl[master].is_master = 1;
 
-        if (LOG_IS_ENABLED(LOGFILE_TRACE))
+        if (init(rpl, n, router->rwsplit_config.rw_table_consistency, 0) != 0)
         {
-                if (select_criteria == LEAST_GLOBAL_CONNECTIONS ||
-                        select_criteria == LEAST_ROUTER_CONNECTIONS ||
-                        select_criteria == LEAST_BEHIND_MASTER ||
-                        select_criteria == LEAST_CURRENT_OPERATIONS)
-                {
-                        LOGIF(LT, (skygw_log_write(LOGFILE_TRACE, 
-                                "Servers and %s connection counts:",
-                                select_criteria == LEAST_GLOBAL_CONNECTIONS ? 
-                                "all MaxScale" : "router")));
+                LOGIF(LE, (skygw_log_write_flush(
+                        LOGFILE_ERROR,
+                        "Error : Unable to start the table consistency "
+                        "listeners of service %s, %s.",
+                        router->service->name,
+                        rpl[0].error_message ? rpl[0].error_message : "")));
+                goto return_succp;
+        }
+        tbr_nservers = n;
+        tbr_query = query;
+        succp = true;
 
-                        for (i=0; i<router_nservers; i++)
-                        {
-                                BACKEND* b = backend_ref[i].bref_backend;
-                                
-                                switch(select_criteria) {
-                                        case LEAST_GLOBAL_CONNECTIONS:
-                                                LOGIF(LT, (skygw_log_write_flush(LOGFILE_TRACE, 
-                                                        "%s:%d MaxScale connections : %d",
-                                                        b->backend_server->name,
-                                                        b->backend_server->port,
-                                                        b->backend_server->stats.n_current)));
-                                                break;
-                                        
-                                        case LEAST_ROUTER_CONNECTIONS:
-                                                LOGIF(LT, (skygw_log_write_flush(LOGFILE_TRACE, 
-                                                        "%s:%d RWSplit connections : %d",
-                                                        b->backend_server->name,
-                                                        b->backend_server->port,
-                                                        b->backend_conn_count)));
-                                                break;
-                                                
-                                        case LEAST_CURRENT_OPERATIONS:
-                                                LOGIF(LT, (skygw_log_write_flush(LOGFILE_TRACE, 
-                                                        "%s:%d current operations : %d",
-                                                        b->backend_server->name,
-                                                        b->backend_server->port,
-                                                        b->backend_server->stats.n_current_ops)));
-                                                break;
-                                                
-                                        case LEAST_BEHIND_MASTER:
-                                                LOGIF(LT, (skygw_log_write_flush(LOGFILE_TRACE, 
-                                                        "%s:%d replication lag : %d",
-                                                        b->backend_server->name,
-                                                        b->backend_server->port,
-                                                        b->backend_server->rlag)));
-                                        default:
-                                                break;
-                                }
-                        } 
-                }
-        } /*< log only */
-        
-        /**
-         * Choose at least 1+min_nslaves (master and slave) and at most 1+max_nslaves 
-         * servers from the sorted list. First master found is selected.
-         */
-        for (i=0; 
-             i<router_nservers && (slaves_connected < max_nslaves || !master_connected);
-             i++)
+        LOGIF(LM, (skygw_log_write(
+                LOGFILE_MESSAGE,
+                "Table consistency listeners follow the %d servers of "
+                "service %s.",
+                n,
+                router->service->name)));
+return_succp:
+        spinlock_release(&tbr_lock);
+        return succp;
+}
+
+/**
+ * Check if the consistency information of a table shows that a listener has
+ * replicated the table at or past a MariaDB GTID. A table that is changed by
+ * a later transaction on a server has seen every earlier one.
+ *
+ * @param tc	Consistency of the table in one listener
+ * @param domain	Domain of the GTID
+ * @param seqno	Sequence number of the GTID
+ *
+ * @return true if the GTID of the table is at or past the given one
+ */
+static bool tbr_gtid_reached(
+        table_consistency_t* tc,
+        unsigned int         domain,
+        unsigned long long   seqno)
+{
+        unsigned int       d;
+        unsigned int       server;
+        unsigned long long n;
+
+        return (tc->mariadb_gtid_known &&
+                tc->gtid != NULL &&
+                sscanf((char *)tc->gtid, "%u-%u-%llu", &d, &server, &n) == 3 &&
+                d == domain &&
+                n >= seqno);
+}
+
+/**
+ * Find the slave for a read of a session with causal reads whose table
+ * consistency listener has seen a change of every table of the read at or
+ * past the last write of the session. Such a slave has the data of the read
+ * without waiting, even when the server as a whole is behind. The slave
+ * with the least connections is chosen.
+ *
+ * @param p_dcb		Pointer to the chosen backend DCB
+ * @param rses		Router client session
+ * @param querystr	The SQL of the read
+ * @param max_rlag	Maximum replication lag of the slave or -1
+ *
+ * @return true if a slave was found
+ */
+static bool tbr_get_dcb(
+        DCB**              p_dcb,
+        ROUTER_CLIENT_SES* rses,
+        char*              querystr,
+        int                max_rlag)
+{
+        table_consistency_t       tc[RWSPLIT_TBR_MAX_SERVERS];
+        table_consistency_query_t tq;
+        bool                      reached[RWSPLIT_TBR_MAX_SERVERS];
+        char                      name[2 * MYSQL_DATABASE_MAXLEN + 2];
+        char**                    tables;
+        char*                     db;
+        BACKEND*                  master_host;
+        backend_ref_t*            chosen = NULL;
+        bool                      possible;
+        unsigned int              domain;
+        unsigned int              server;
+        unsigned long long        seqno;
+        size_t                    n;
+        int                       n_tables;
+        int                       i;
+        int                       j;
+        int                       k;
+
+        if (tbr_query == NULL ||
+                querystr == NULL ||
+                sscanf(rses->rses_causal_gtid, "%u-%u-%llu",
+                       &domain, &server, &seqno) != 3 ||
+                (tables = skygw_query_classifier_get_tables(querystr,
+                                                            &n_tables)) == NULL)
         {
-                BACKEND* b = backend_ref[i].bref_backend;
+                return false;
+        }
+        db = ((MYSQL_session *)rses->rses_session->data)->db;
 
-                if (SERVER_IS_RUNNING(b->backend_server) &&
-                        ((b->backend_server->status & router->bitmask) ==
-                        router->bitvalue))
+        possible = (n_tables > 0 && n_tables <= RWSPLIT_TBR_MAX_TABLES);
+
+        for (k = 0; k < tbr_nservers; k++)
+        {
+                reached[k] = possible;
+        }
+
+        for (j = 0; j < n_tables; j++)
+        {
+                bool seen[RWSPLIT_TBR_MAX_SERVERS];
+
+                if (!possible)
                 {
-			/* check also for relay servers and don't take the master_host */
-                        if (slaves_found < max_nslaves &&
-                                (max_slave_rlag == -2 || 
-                                (b->backend_server->rlag != -1 && /*< information currently not available */
-                                 b->backend_server->rlag <= max_slave_rlag)) &&
-                                (SERVER_IS_SLAVE(b->backend_server) || SERVER_IS_RELAY_SERVER(b->backend_server)) &&
-				(master_host != NULL && (b->backend_server != master_host->backend_server)))
+                        /** No slave can be consistent anymore */
+                }
+                else if (strchr(tables[j], '.') != NULL ||
+                         (db[0] != '\0' &&
+                          strlen(tables[j]) <= MYSQL_DATABASE_MAXLEN))
+                {
+                        if (strchr(tables[j], '.') != NULL)
                         {
-                                slaves_found += 1;
-                                
-                                /** Slave is already connected */
-                                if (BREF_IS_IN_USE((&backend_ref[i])))
-                                {
-                                        slaves_connected += 1;
-                                }
-                                /** New slave connection is taking place */
-                                else
-                                {
-                                        backend_ref[i].bref_dcb = dcb_connect(
-                                                b->backend_server,
-                                                session,
-                                                b->backend_server->protocol);
-                                        
-                                        if (backend_ref[i].bref_dcb != NULL)
-                                        {
-                                                slaves_connected += 1;
-                                                /**
-                                                 * Start executing session command
-                                                 * history.
-                                                 */
-                                                execute_sescmd_history(&backend_ref[i]);
-                                                /** 
-                                                 * When server fails, this callback
-                                                 * is called.
-                                                 */
-                                                dcb_add_callback(
-                                                        backend_ref[i].bref_dcb,
-                                                        DCB_REASON_NOT_RESPONDING,
-                                                        &router_handle_state_switch,
-                                                        (void *)&backend_ref[i]);
-                                                backend_ref[i].bref_state = 0;
-                                                bref_set_state(&backend_ref[i], 
-                                                               BREF_IN_USE);
-                                               /** 
-                                                * Increase backend connection counter.
-                                                * Server's stats are _increased_ in 
-                                                * dcb.c:dcb_alloc !
-                                                * But decreased in the calling function 
-                                                * of dcb_close.
-                                                */
-                                                atomic_add(&b->backend_conn_count, 1);
-                                        }
-                                        else
-                                        {
-                                                LOGIF(LE, (skygw_log_write_flush(
-                                                        LOGFILE_ERROR,
-                                                        "Error : Unable to establish "
-                                                        "connection with slave %s:%d",
-                                                        b->backend_server->name,
-                                                        b->backend_server->port)));
-                                                /* handle connect error */
-                                        }
-                                }
+                                snprintf(name, sizeof(name), "%s", tables[j]);
                         }
-			/* take the master_host for master */
-			else if (master_host && 
-                                (b->backend_server == master_host->backend_server))
+                        else
                         {
-                                *p_master_ref = &backend_ref[i];
-                                
-                                if (master_connected)
-                                {   
-                                        continue;
-                                }
-                                master_found = true;
-                                  
-                                backend_ref[i].bref_dcb = dcb_connect(
-                                        b->backend_server,
-                                        session,
-                                        b->backend_server->protocol);
-                                
-                                if (backend_ref[i].bref_dcb != NULL) 
-                                {
-                                        master_connected = true;
-                                        /** 
-                                         * When server fails, this callback
-                                         * is called.
-                                         */
-                                        dcb_add_callback(
-                                                backend_ref[i].bref_dcb,
-                                                DCB_REASON_NOT_RESPONDING,
-                                                &router_handle_state_switch,
-                                                (void *)&backend_ref[i]);
+                                snprintf(name, sizeof(name), "%s.%s", db, tables[j]);
+                        }
+                        memset(tc, 0, sizeof(tc));
+                        memset(seen, 0, sizeof(seen));
+                        tq.db_dot_table = (unsigned char *)name;
+                        n = tbr_nservers;
 
-                                        backend_ref[i].bref_state = 0;
-                                        bref_set_state(&backend_ref[i], 
-                                                       BREF_IN_USE);
-                                        /** Increase backend connection counters */
-                                        atomic_add(&b->backend_conn_count, 1);
-                                }
-                                else
+                        if (tbr_query(&tq, tc, &n) != 0)
+                        {
+                                n = 0;
+                        }
+                        for (i = 0; i < tbr_nservers; i++)
+                        {
+                                if (i < (int)n &&
+                                        tc[i].server_id < (unsigned int)tbr_nservers &&
+                                        tbr_gtid_reached(&tc[i], domain, seqno))
                                 {
-                                        succp = false;
-                                        LOGIF(LE, (skygw_log_write_flush(
-                                                LOGFILE_ERROR,
-                                                "Error : Unable to establish "
-                                                "connection with master %s:%d",
-                                                b->backend_server->name,
-                                                b->backend_server->port)));
-                                        /** handle connect error */
+                                        seen[tc[i].server_id] = true;
                                 }
-                        }       
+                                free(tc[i].gtid);
+                                free(tc[i].error_message);
+                        }
+                        possible = false;
+
+                        for (k = 0; k < tbr_nservers; k++)
+                        {
+                                reached[k] = reached[k] && seen[k];
+                                possible = possible || reached[k];
+                        }
                 }
-        } /*< for */
-        
-#if defined(EXTRA_SS_DEBUG)        
-        LOGIF(LT, (skygw_log_write(LOGFILE_TRACE, "Servers and conns after ordering:")));
-        
-        for (i=0; i<router_nservers; i++)
+                else
+                {
+                        /** The database of the table isn't known */
+                        possible = false;
+
+                        for (k = 0; k < tbr_nservers; k++)
+                        {
+                                reached[k] = false;
+                        }
+                }
+                free(tables[j]);
+        }
+        free(tables);
+
+        master_host = get_root_master(rses->rses_backend_ref, rses->rses_nbackends);
+
+        if (!possible || master_host == NULL)
         {
-                BACKEND* b = backend_ref[i].bref_backend;
-                
-                LOGIF(LT, (skygw_log_write_flush(LOGFILE_TRACE,
-                                                "master bref %p bref %p %d %s %d:%d",
-                                                *p_master_ref,
-                                                &backend_ref[i],
-                                                backend_ref[i].bref_state,
-                                                b->backend_server->name,
-                                                b->backend_server->port,
-                                                b->backend_conn_count)));                
+                return false;
         }
-	/* assert with master_host */
-        ss_dassert(!master_connected ||
-        (master_host && ((*p_master_ref)->bref_backend->backend_server == master_host->backend_server) && SERVER_MASTER));
-#endif
-        
-        /**
-         * Successful cases
-         */
-        if (master_connected && 
-                slaves_connected >= min_nslaves && 
-                slaves_connected <= max_nslaves)
+
+        for (i = 0; i < rses->rses_nbackends; i++)
         {
-                succp = true;
-                
-                if (slaves_connected == 0 && slaves_found > 0)
+                backend_ref_t* bref = &rses->rses_backend_ref[i];
+
+                if (!bref_is_read_slave(bref, master_host, max_rlag))
                 {
-                        LOGIF(LE, (skygw_log_write(
-                                LOGFILE_ERROR,
-                                "Warning : Couldn't connect to any of the %d "
-                                "slaves. Routing to %s only.",
-                                slaves_found,
-                                (is_synced_master ? "Galera nodes" : "Master"))));
-                        
-                        LOGIF(LM, (skygw_log_write(
-                                LOGFILE_MESSAGE,
-                                "* Warning : Couldn't connect to any of the %d "
-                                "slaves. Routing to %s only.",
-                                slaves_found,
-                                (is_synced_master ? "Galera nodes" : "Master"))));
+                        continue;
                 }
-                else if (slaves_found == 0)
+                for (k = 0; k < tbr_nservers; k++)
                 {
-                        LOGIF(LE, (skygw_log_write(
-                                LOGFILE_ERROR,
-                                "Warning : Couldn't find any slaves from existing "
-                                "%d servers. Routing to %s only.",
-                                router_nservers,
-                                (is_synced_master ? "Galera nodes" : "Master"))));
-                        
-                        LOGIF(LM, (skygw_log_write(
-                                LOGFILE_MESSAGE,
-                                "* Warning : Couldn't find any slaves from existing "
-                                "%d servers. Routing to %s only.",
-                                router_nservers,
-                                (is_synced_master ? "Galera nodes" : "Master"))));                        
+                        if (tbr_servers[k] == bref->bref_backend->backend_server)
+                        {
+                                break;
+                        }
                 }
-                else if (slaves_connected < max_nslaves)
+                if (k < tbr_nservers &&
+                        reached[k] &&
+                        (chosen == NULL ||
+                         bref->bref_backend->backend_conn_count <
+                         chosen->bref_backend->backend_conn_count))
                 {
-                        LOGIF(LT, (skygw_log_write_flush(
-                                LOGFILE_TRACE,
-                                "Note : Couldn't connect to maximum number of "
-                                "slaves. Connected successfully to %d slaves "
-                                "of %d of them.",
-                                slaves_connected,
-                                slaves_found)));
+                        chosen = bref;
                 }
-                
-                if (LOG_IS_ENABLED(LT))
-                {
-                        for (i=0; i<router_nservers; i++)
-                        {
-                                BACKEND* b = backend_ref[i].bref_backend;
+        }
 
-                                if (BREF_IS_IN_USE((&backend_ref[i])))
-                                {
-                                        backend_type_t btype = BACKEND_TYPE(b);
-                                        
-                                        LOGIF(LT, (skygw_log_write(
-                                                LOGFILE_TRACE,
-                                                "Selected %s in \t%s:%d",
-                                                (btype == BE_MASTER ? "master" : 
-                                                (btype == BE_SLAVE ? "slave" : 
-                                                "unknown node type")),
-                                                b->backend_server->name,
-                                                b->backend_server->port)));
-                                }
-                        } /* for */
+        if (chosen == NULL)
+        {
+                return false;
+        }
+        ss_dassert(chosen->bref_dcb->state != DCB_STATE_ZOMBIE);
+        *p_dcb = chosen->bref_dcb;
+
+        return true;
+}
+
+/**
+ * Check if the reads of a session with causal reads must go to the master.
+ * That is the case when the GTID of the last write couldn't be read, or a
+ * read is already held waiting for a slave.
+ *
+ * @param rses	Router client session
+ *
+ * @return true if the next read is routed to the master
+ */
+static bool causal_reads_to_master(
+        ROUTER_CLIENT_SES* rses)
+{
+        return rses->rses_config.rw_causal_reads > 0 &&
+                (rses->rses_causal_unknown || rses->rses_causal_query != NULL);
+}
+
+/**
+ * Count a routing decision, for the router and for the server it was
+ * routed to.
+ *
+ * @param inst		Router instance
+ * @param bref		The backend the statement was written to, NULL if
+ *			it was not written to one backend
+ * @param reason	RWSPLIT_R_* reason of the decision
+ */
+static void route_count(
+        ROUTER_INSTANCE* inst,
+        backend_ref_t*   bref,
+        int              reason)
+{
+        ts_stats_add(inst->route_stats, RWSPLIT_ROUTE_REASON(reason), 1);
+
+        if (bref != NULL)
+        {
+                ts_stats_add(inst->route_stats,
+                             RWSPLIT_ROUTE_SERVER(bref->bref_backend->be_index,
+                                                  reason),
+                             1);
+        }
+}
+
+/**
+ * The class of a statement for the routing statistics
+ *
+ * @param qtype	Type of the statement
+ *
+ * @return RWSPLIT_QT_* class of the statement
+ */
+static int route_qtype_class(
+        skygw_query_type_t qtype)
+{
+        if (QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_STMT) ||
+                QUERY_IS_TYPE(qtype, QUERY_TYPE_PREPARE_NAMED_STMT) ||
+                QUERY_IS_TYPE(qtype, QUERY_TYPE_EXEC_STMT))
+        {
+                return RWSPLIT_QT_PSTMT;
+        }
+        if (QUERY_IS_TYPE(qtype, QUERY_TYPE_SESSION_WRITE))
+        {
+                return RWSPLIT_QT_SESSION;
+        }
+        if (QUERY_IS_TYPE(qtype, QUERY_TYPE_BEGIN_TRX) ||
+                QUERY_IS_TYPE(qtype, QUERY_TYPE_COMMIT) ||
+                QUERY_IS_TYPE(qtype, QUERY_TYPE_ROLLBACK))
+        {
+                return RWSPLIT_QT_TRX;
+        }
+        if (QUERY_IS_TYPE(qtype, QUERY_TYPE_WRITE))
+        {
+                return RWSPLIT_QT_WRITE;
+        }
+        if (QUERY_IS_TYPE(qtype, QUERY_TYPE_READ))
+        {
+                return RWSPLIT_QT_READ;
+        }
+        return RWSPLIT_QT_UNKNOWN;
+}
+
+/**
+ * Check if the reads of a session must go to the master, for causal reads
+ * or because the read_your_writes_window after the last write of the
+ * session is still open.
+ *
+ * @param inst	Router instance
+ * @param rses	Router client session
+ *
+ * @return true if the next read is routed to the master
+ */
+static bool rses_reads_to_master(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses)
+{
+        if (causal_reads_to_master(rses))
+        {
+                return true;
+        }
+        if (rses->rses_ryw_usec == 0)
+        {
+                return false;
+        }
+        if (response_clock() - rses->rses_ryw_usec >=
+                (unsigned long)rses->rses_config.rw_read_your_writes_window * 1000)
+        {
+                rses->rses_ryw_usec = 0;
+                return false;
+        }
+        ts_stats_add(inst->stats, RWSPLIT_N_RYW_MASTER, 1);
+        return true;
+}
+
+/**
+ * Note a statement routed to the master for the read_your_writes_window.
+ * A write outside a transaction opens the window. In a transaction it is
+ * the commit that opens it, if the transaction has written, as the reads
+ * of the transaction go to the master anyway.
+ *
+ * @param rses	Router client session
+ * @param qtype	Type of the statement
+ */
+static void ryw_note_route(
+        ROUTER_CLIENT_SES* rses,
+        skygw_query_type_t qtype)
+{
+        if (rses->rses_config.rw_read_your_writes_window <= 0)
+        {
+                return;
+        }
+        if (QUERY_IS_TYPE(qtype, QUERY_TYPE_COMMIT) &&
+                !QUERY_IS_TYPE(qtype, QUERY_TYPE_WRITE))
+        {
+                if (rses->rses_ryw_trx_wrote)
+                {
+                        rses->rses_ryw_usec = response_clock();
                 }
+                rses->rses_ryw_trx_wrote = false;
         }
-        /**
-         * Failure cases
-         */
-        else
-        {          
-                succp = false;
-                
-                if (!master_found)
+        else if (QUERY_IS_TYPE(qtype, QUERY_TYPE_ROLLBACK))
+        {
+                rses->rses_ryw_trx_wrote = false;
+        }
+        else if (!QUERY_IS_TYPE(qtype, QUERY_TYPE_READ))
+        {
+                if (rses->rses_transaction_active)
                 {
-                        LOGIF(LE, (skygw_log_write(
-                                LOGFILE_ERROR,
-                                "Error : Couldn't find suitable %s from %d "
-                                "candidates.",
-                                (is_synced_master ? "Galera node" : "Master"),
-                                router_nservers)));
-                        
-                        LOGIF(LM, (skygw_log_write(
-                                LOGFILE_MESSAGE,
-                                "Error : Couldn't find suitable %s from %d "
-                                "candidates.",
-                                (is_synced_master ? "Galera node" : "Master"),
-                                router_nservers)));
- 
-                        LOGIF(LT, (skygw_log_write(
-                                LOGFILE_TRACE,
-                                "Error : Couldn't find suitable %s from %d "
-                                "candidates.",
-                                (is_synced_master ? "Galera node" : "Master"),
-                                router_nservers)));
+                        rses->rses_ryw_trx_wrote = true;
                 }
-                else if (!master_connected)
+                else
                 {
-                        LOGIF(LE, (skygw_log_write(
-                                LOGFILE_ERROR,
-                                "Error : Couldn't connect to any %s although "
-                                "there exists at least one %s node in the "
-                                "cluster.",
-                                (is_synced_master ? "Galera node" : "Master"),
-                                (is_synced_master ? "Galera node" : "Master"))));
-                        
-                        LOGIF(LM, (skygw_log_write(
-                                LOGFILE_MESSAGE,
-                                "Error : Couldn't connect to any %s although "
-                                "there exists at least one %s node in the "
-                                "cluster.",
-                                (is_synced_master ? "Galera node" : "Master"),
-                                (is_synced_master ? "Galera node" : "Master"))));
-
-                        LOGIF(LT, (skygw_log_write(
-                                LOGFILE_TRACE,
-                                "Error : Couldn't connect to any %s although "
-                                "there exists at least one %s node in the "
-                                "cluster.",
-                                (is_synced_master ? "Galera node" : "Master"),
-                                (is_synced_master ? "Galera node" : "Master"))));
+                        rses->rses_ryw_usec = response_clock();
                 }
+        }
+}
 
-                if (slaves_connected < min_nslaves)
+/**
+ * Send a query of the router itself to a backend. The reply is consumed by
+ * causal_reads_reply and never reaches the client.
+ *
+ * @param bref	Backend reference
+ * @param sql	The SQL statement
+ *
+ * @return true if the query was written to the backend
+ */
+static bool causal_send_query(
+        backend_ref_t* bref,
+        char*          sql)
+{
+        GWBUF*   buf;
+        uint8_t* data;
+        int      len = strlen(sql) + 1;
+
+        if ((buf = gwbuf_alloc(len + 4)) == NULL)
+        {
+                return false;
+        }
+        data = GWBUF_DATA(buf);
+        data[0] = len & 0xff;
+        data[1] = (len >> 8) & 0xff;
+        data[2] = (len >> 16) & 0xff;
+        data[3] = 0x00;
+        data[4] = MYSQL_COM_QUERY;
+        memcpy(&data[5], sql, len - 1);
+        gwbuf_set_type(buf, GWBUF_TYPE_MYSQL|GWBUF_TYPE_SINGLE_STMT);
+
+        return bref_write(bref->bref_sescmd_cur.scmd_cur_rses, bref, buf) == 1;
+}
+
+/**
+ * Read the value of a result set of one row and one column, the reply to a
+ * query sent by causal_send_query. The reply may arrive in several buffers.
+ *
+ * @param buf	The chain of reply buffers received so far
+ * @param value	out, the value, an empty string for NULL
+ * @param size	Size of value
+ *
+ * @return 1 if the value was read, 0 if the result set is not complete yet
+ * and -1 if the reply was an error or not a result set
+ */
+static int causal_read_value(
+        GWBUF* buf,
+        char*  value,
+        int    size)
+{
+        uint8_t* data;
+        uint8_t* ptr;
+        uint8_t* end;
+        int      total;
+        int      npackets = 0;
+        int      neof = 0;
+        int      rc = 0;
+
+        value[0] = '\0';
+
+        if ((data = reply_copy_chain(buf, &total)) == NULL)
+        {
+                return -1;
+        }
+        end = data + total;
+        ptr = data;
+
+        while (ptr + 4 <= end)
+        {
+                int      plen = MYSQL_GET_PACKET_LEN(ptr);
+                uint8_t* payload = ptr + 4;
+
+                if (payload + plen > end)
                 {
-                        LOGIF(LE, (skygw_log_write(
-                                LOGFILE_ERROR,
-                                "Error : Couldn't establish required amount of "
-                                "slave connections for router session.")));
-                        
-                        LOGIF(LM, (skygw_log_write(
-                                LOGFILE_MESSAGE,
-                                "Error : Couldn't establish required amount of "
-                                "slave connections for router session.")));
+                        break;
                 }
-                
-                /** Clean up connections */
-                for (i=0; i<router_nservers; i++)
+                if (plen > 0 && payload[0] == 0xff)
                 {
-                        if (BREF_IS_IN_USE((&backend_ref[i])))
+                        rc = -1;
+                        break;
+                }
+                if (npackets == 0 && (plen == 0 || payload[0] == 0x00))
+                {
+                        /** An OK packet instead of a result set */
+                        rc = -1;
+                        break;
+                }
+                if (plen > 0 && plen < 9 && payload[0] == 0xfe)
+                {
+                        /** The second EOF ends the rows */
+                        if (++neof == 2)
                         {
-                                ss_dassert(backend_ref[i].bref_backend->backend_conn_count > 0);
-                                
-                                /** disconnect opened connections */
-                                dcb_close(backend_ref[i].bref_dcb);
-                                bref_clear_state(&backend_ref[i], BREF_IN_USE);
-                                /** Decrease backend's connection counter. */
-                                atomic_add(&backend_ref[i].bref_backend->backend_conn_count, -1);
+                                rc = 1;
+                                break;
                         }
                 }
-                master_connected = false;
-                slaves_connected = 0;
+                else if (neof == 1 && value[0] == '\0' && plen > 0)
+                {
+                        MYSQL_READER rd;
+                        MYSQL_STR    str;
+                        int          len;
+
+                        mysql_reader_init(&rd, payload, plen);
+                        str = mysql_read_lenenc_str(&rd);
+
+                        if (str.data != NULL && str.len > 0)
+                        {
+                                len = str.len < size ? str.len : size - 1;
+                                memcpy(value, str.data, len);
+                                value[len] = '\0';
+                        }
+                }
+                npackets += 1;
+                ptr = payload + plen;
         }
-return_succp:
+        free(data);
+        return rc;
+}
 
-        return succp;
+/**
+ * Check if a reply is a single OK packet that ends the results of the query
+ *
+ * @param buf	The reply
+ *
+ * @return true if the reply is an OK packet with no more results after it
+ */
+static bool causal_is_last_ok(
+        GWBUF* buf)
+{
+        uint8_t*        data = (uint8_t *)GWBUF_DATA(buf);
+        int             len = GWBUF_LENGTH(buf);
+        MYSQL_OK_PACKET ok;
+
+        if (buf->next != NULL ||
+                len < 7 ||
+                MYSQL_GET_PACKET_LEN(data) + 4 != len ||
+                !mysql_ok_parse(data + 4, len - 4, &ok))
+        {
+                return false;
+        }
+        return (ok.status & SERVER_MORE_RESULTS_EXISTS) == 0;
 }
 
+/**
+ * Make a slave wait for the GTID of the last write of the session before it
+ * executes a read. The wait is sent to the slave and the read is held until
+ * causal_reads_reply knows whether the slave got the GTID in time.
+ *
+ * @param inst		Router instance
+ * @param rses		Router client session
+ * @param bref		Backend reference of the slave
+ * @param querybuf	The read, owned by the router session on success
+ *
+ * @return 1 if the wait was sent, 0 if not and querybuf was freed
+ */
+static int causal_reads_wait(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses,
+        backend_ref_t*     bref,
+        GWBUF*             querybuf)
+{
+        char sql[RWSPLIT_GTID_LEN + 64];
+
+        snprintf(sql,
+                 sizeof(sql),
+                 "SELECT MASTER_GTID_WAIT('%s', %d)",
+                 rses->rses_causal_gtid,
+                 rses->rses_config.rw_causal_reads);
 
-/** 
- * Create a generic router session property strcture.
+        if (!causal_send_query(bref, sql))
+        {
+                causal_buf_free(querybuf);
+                return 0;
+        }
+        rses->rses_causal_query = querybuf;
+        bref_set_state(bref, BREF_CAUSAL_WAIT);
+        ts_stats_add(inst->stats, RWSPLIT_N_CAUSAL_WAIT, 1);
+        return 1;
+}
+
+/**
+ * Process a reply of a backend that has causal reads state. Called with the
+ * router session locked.
+ *
+ * The OK of a write is held, and the GTID of the write is read from the
+ * master with @@last_gtid before the OK is returned to be sent to the
+ * client. A read on a slave waits for that GTID with MASTER_GTID_WAIT.
+ * If the wait times out or fails the read is sent to the master instead.
+ *
+ * @param inst		Router instance
+ * @param rses		Router client session
+ * @param bref		Backend reference the reply came from
+ * @param writebuf	The reply
+ *
+ * @return The reply to send to the client or NULL if there is none
  */
-static rses_property_t* rses_property_init(
-	rses_property_type_t prop_type)
+static GWBUF* causal_reads_reply(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses,
+        backend_ref_t*     bref,
+        GWBUF*             writebuf)
 {
-	rses_property_t* prop;
-	
-	prop = (rses_property_t*)calloc(1, sizeof(rses_property_t));
-	if (prop == NULL)
-	{
-		goto return_prop;
-	}
+        char           value[RWSPLIT_GTID_LEN];
+        GWBUF*         querybuf;
+        backend_ref_t* master_bref;
+        int            rc;
+
+        if (bref->bref_state & BREF_CAUSAL_WRITE)
+        {
+                bref_clear_state(bref, BREF_CAUSAL_WRITE);
+
+                if (MYSQL_IS_ERROR_PACKET(((uint8_t *)GWBUF_DATA(writebuf))))
+                {
+                        /** Nothing was written */
+                        return writebuf;
+                }
+                if (causal_is_last_ok(writebuf) &&
+                        causal_send_query(bref, "SELECT @@last_gtid"))
+                {
+                        rses->rses_causal_reply = writebuf;
+                        bref_set_state(bref, BREF_CAUSAL_GTID);
+                        return NULL;
+                }
+                /** Reads go to the master until a GTID is read again */
+                rses->rses_causal_unknown = true;
+                return writebuf;
+        }
+        bref->bref_causal_buf = gwbuf_append(bref->bref_causal_buf, writebuf);
+        rc = causal_read_value(bref->bref_causal_buf, value, sizeof(value));
+
+        if (rc == 0)
+        {
+                return NULL;
+        }
+        causal_buf_free(bref->bref_causal_buf);
+        bref->bref_causal_buf = NULL;
+
+        if (bref->bref_state & BREF_CAUSAL_GTID)
+        {
+                bref_clear_state(bref, BREF_CAUSAL_GTID);
+
+                if (rc == 1)
+                {
+                        /** Empty if the session hasn't written anything */
+                        if (value[0] != '\0')
+                        {
+                                strcpy(rses->rses_causal_gtid, value);
+                        }
+                        rses->rses_causal_unknown = false;
+                }
+                else
+                {
+                        rses->rses_causal_unknown = true;
+                }
+                writebuf = rses->rses_causal_reply;
+                rses->rses_causal_reply = NULL;
+                return writebuf;
+        }
+        /** Reply to MASTER_GTID_WAIT, 0 if the slave reached the GTID in time */
+        bref_clear_state(bref, BREF_CAUSAL_WAIT);
+        querybuf = rses->rses_causal_query;
+        rses->rses_causal_query = NULL;
+
+        if (rc == 1 && strcmp(value, "0") == 0)
+        {
+                strcpy(bref->bref_causal_gtid, rses->rses_causal_gtid);
+
+                if (bref_write(rses, bref, querybuf) != 1)
+                {
+                        LOGIF(LE, (skygw_log_write_flush(
+                                LOGFILE_ERROR,
+                                "Error : Routing causal read to %s:%d failed.",
+                                bref->bref_backend->backend_server->name,
+                                bref->bref_backend->backend_server->port)));
+                }
+                return NULL;
+        }
+        LOGIF(LT, (skygw_log_write(
+                LOGFILE_TRACE,
+                "Slave %s:%d didn't reach GTID %s, routing read to Master.",
+                bref->bref_backend->backend_server->name,
+                bref->bref_backend->backend_server->port,
+                rses->rses_causal_gtid)));
+        /** The read was never sent to the slave */
+        bref_clear_state(bref, BREF_QUERY_ACTIVE);
+        if (rses->rses_config.rw_backend_reply_timeout > 0)
+        {
+                dcb_set_idle_timeout(bref->bref_dcb, 0);
+        }
+        bref_clear_state(bref, BREF_WAITING_RESULT);
+        master_bref = rses->rses_master_ref;
+
+        if (master_bref != NULL &&
+                BREF_IS_IN_USE(master_bref) &&
+                bref_write(rses, master_bref, querybuf) == 1)
+        {
+                ts_stats_add(inst->stats, RWSPLIT_N_CAUSAL_MASTER, 1);
+                bref_set_state(master_bref, BREF_QUERY_ACTIVE);
+                bref_set_state(master_bref, BREF_WAITING_RESULT);
+                bref_start_query_timer(rses, master_bref);
+        }
+        else
+        {
+                LOGIF(LE, (skygw_log_write_flush(
+                        LOGFILE_ERROR,
+                        "Error : Routing causal read to master failed.")));
+        }
+        return NULL;
+}
+
+/** 
+ * @node Search suitable backend servers from those of router instance.
+ *
+ * Parameters:
+ * @param p_master_ref - in, use, out
+ *      Pointer to location where master's backend reference is to  be stored.
+ *      NULL is not allowed.
+ *
+ * @param backend_ref - in, use, out 
+ *      Pointer to backend server reference object array.
+ *      NULL is not allowed.
+ *
+ * @param router_nservers - in, use
+ *      Number of backend server pointers pointed to by b.
+ * 
+ * @param max_nslaves - in, use
+ *      Upper limit for the number of slaves. Configuration parameter or default.
+ *
+ * @param max_slave_rlag - in, use
+ *      Maximum allowed replication lag for any slave. Configuration parameter or default.
+ *
+ * @param session - in, use
+ *      MaxScale session pointer used when connection to backend is established.
+ *
+ * @param  router - in, use
+ *      Pointer to router instance. Used when server states are qualified.
+ * 
+ * @return true, if at least one master and one slave was found.
+ *
+ * 
+ * @details It is assumed that there is only one master among servers of
+ *      a router instance. As a result, the first master found is chosen.
+ *      There will possibly be more backend references than connected backends
+ *      because only those in correct state are connected to.
+ */
+static bool select_connect_backend_servers(
+        backend_ref_t**    p_master_ref,
+        backend_ref_t*     backend_ref,
+        int                router_nservers,
+        int                max_nslaves,
+        int                max_slave_rlag,
+        select_criteria_t  select_criteria,
+        SESSION*           session,
+        ROUTER_INSTANCE*   router)
+{
+        bool            succp = true;
+        bool            master_found;
+        bool            master_connected;
+        int             slaves_found = 0;
+        int             slaves_connected = 0;
+        int             i;
+        const int       min_nslaves = 0; /*< not configurable at the time */
+        bool            is_synced_master;
+        int (*p)(const void *, const void *);
+	BACKEND *master_host = NULL;
+        
+        if (p_master_ref == NULL || backend_ref == NULL)
+        {
+                ss_dassert(FALSE);
+                succp = false;
+                goto return_succp;
+        }
+      
+	/* get the root Master */ 
+	master_host = get_root_master(backend_ref, router_nservers); 
+
+        if (router->rwsplit_config.rw_dynamic_weights)
+        {
+                router_update_weights(router);
+        }
+
+        /** Master is already chosen and connected. This is slave failure case */
+        if (*p_master_ref != NULL &&
+                BREF_IS_IN_USE((*p_master_ref)))
+        {
+                LOGIF(LD, (skygw_log_write(
+                        LOGFILE_DEBUG,
+                        "%lu [select_connect_backend_servers] Master %p fd %d found.",
+                        pthread_self(),
+                        (*p_master_ref)->bref_dcb,
+                        (*p_master_ref)->bref_dcb->fd)));
+                
+                master_found     = true;
+                master_connected = true;
+		/* assert with master_host */
+                ss_dassert(master_host && ((*p_master_ref)->bref_backend->backend_server == master_host->backend_server) && SERVER_MASTER);
+        }
+        /** New session or master failure case */
+        else
+        {
+                LOGIF(LD, (skygw_log_write(
+                        LOGFILE_DEBUG,
+                        "%lu [select_connect_backend_servers] Session %p doesn't "
+                        "currently have a master chosen. Proceeding to master "
+                        "selection.",
+                        pthread_self(),
+                        session)));
+                
+                master_found     = false;
+                master_connected = false;
+        }
+        /** Check slave selection criteria and set compare function */
+        p = criteria_cmpfun[select_criteria];
+        
+        if (p == NULL)
+        {
+                succp = false;
+                goto return_succp;
+        }        
+        
+        if (router->bitvalue != 0) /*< 'synced' is the only bitvalue in rwsplit */
+        {
+                is_synced_master = true;
+        }
+        else
+        {
+                is_synced_master = false;
+        }
+
+#if defined(EXTRA_SS_DEBUG)        
+        LOGIF(LT, (skygw_log_write(LOGFILE_TRACE, "Servers and conns before ordering:")));
+        
+        for (i=0; i<router_nservers; i++)
+        {
+                BACKEND* b = backend_ref[i].bref_backend;
+
+                LOGIF(LT, (skygw_log_write(LOGFILE_TRACE, 
+                                           "master bref %p bref %p %d %s %d:%d",
+                                           *p_master_ref,
+                                           &backend_ref[i],
+                                           backend_ref[i].bref_state,
+                                           b->backend_server->name,
+                                           b->backend_server->port,
+                                           b->backend_conn_count)));                
+        }
+#endif
+	/* assert with master_host */
+        ss_dassert(!master_connected ||
+                (master_host && ((*p_master_ref)->bref_backend->backend_server == master_host->backend_server) && SERVER_MASTER));
+        /**
+         * Sort the pointer list to servers according to connection counts. As 
+         * a consequence those backends having least connections are in the 
+         * beginning of the list.
+         */
+        qsort(backend_ref, (size_t)router_nservers, sizeof(backend_ref_t), p);
+
+        if (LOG_IS_ENABLED(LOGFILE_TRACE))
+        {
+                if (select_criteria == LEAST_GLOBAL_CONNECTIONS ||
+                        select_criteria == LEAST_ROUTER_CONNECTIONS ||
+                        select_criteria == LEAST_BEHIND_MASTER ||
+                        select_criteria == LEAST_CURRENT_OPERATIONS ||
+                        select_criteria == LEAST_RESPONSE_TIME)
+                {
+                        LOGIF(LT, (skygw_log_write(LOGFILE_TRACE, 
+                                "Servers and %s connection counts:",
+                                select_criteria == LEAST_GLOBAL_CONNECTIONS ? 
+                                "all MaxScale" : "router")));
+
+                        for (i=0; i<router_nservers; i++)
+                        {
+                                BACKEND* b = backend_ref[i].bref_backend;
+                                
+                                switch(select_criteria) {
+                                        case LEAST_GLOBAL_CONNECTIONS:
+                                                LOGIF(LT, (skygw_log_write_flush(LOGFILE_TRACE, 
+                                                        "%s:%d MaxScale connections : %d",
+                                                        b->backend_server->name,
+                                                        b->backend_server->port,
+                                                        b->backend_server->stats.n_current)));
+                                                break;
+                                        
+                                        case LEAST_ROUTER_CONNECTIONS:
+                                                LOGIF(LT, (skygw_log_write_flush(LOGFILE_TRACE, 
+                                                        "%s:%d RWSplit connections : %d",
+                                                        b->backend_server->name,
+                                                        b->backend_server->port,
+                                                        b->backend_conn_count)));
+                                                break;
+                                                
+                                        case LEAST_CURRENT_OPERATIONS:
+                                                LOGIF(LT, (skygw_log_write_flush(LOGFILE_TRACE, 
+                                                        "%s:%d current operations : %d",
+                                                        b->backend_server->name,
+                                                        b->backend_server->port,
+                                                        b->backend_server->stats.n_current_ops)));
+                                                break;
+
+                                        case LEAST_RESPONSE_TIME:
+                                                LOGIF(LT, (skygw_log_write_flush(LOGFILE_TRACE,
+                                                        "%s:%d average response time : %d us, "
+                                                        "current operations : %d",
+                                                        b->backend_server->name,
+                                                        b->backend_server->port,
+                                                        b->be_response_time,
+                                                        b->backend_server->stats.n_current_ops)));
+                                                break;
+                                                
+                                        case LEAST_BEHIND_MASTER:
+                                                LOGIF(LT, (skygw_log_write_flush(LOGFILE_TRACE, 
+                                                        "%s:%d replication lag : %d",
+                                                        b->backend_server->name,
+                                                        b->backend_server->port,
+                                                        b->backend_server->rlag)));
+                                        default:
+                                                break;
+                                }
+                        } 
+                }
+        } /*< log only */
+        
+        /**
+         * Choose at least 1+min_nslaves (master and slave) and at most 1+max_nslaves 
+         * servers from the sorted list. First master found is selected.
+         */
+        for (i=0; 
+             i<router_nservers && (slaves_connected < max_nslaves || !master_connected);
+             i++)
+        {
+                BACKEND* b = backend_ref[i].bref_backend;
+
+                if (SERVER_IS_RUNNING(b->backend_server) &&
+                        ((b->backend_server->status & router->bitmask) ==
+                        router->bitvalue))
+                {
+			/* check also for relay servers and don't take the master_host */
+                        if (slaves_found < max_nslaves &&
+                                (max_slave_rlag == -2 || 
+                                (b->backend_server->rlag != -1 && /*< information currently not available */
+                                 b->backend_server->rlag <= max_slave_rlag)) &&
+                                (SERVER_IS_SLAVE(b->backend_server) || SERVER_IS_RELAY_SERVER(b->backend_server)) &&
+				(master_host != NULL && (b->backend_server != master_host->backend_server)) &&
+                                (BREF_IS_IN_USE((&backend_ref[i])) ||
+                                 (!SERVER_IS_FULL(b->backend_server) &&
+                                  server_circuit_probe(b->backend_server))))
+                        {
+                                slaves_found += 1;
+                                
+                                /** Slave is already connected */
+                                if (BREF_IS_IN_USE((&backend_ref[i])))
+                                {
+                                        slaves_connected += 1;
+                                }
+                                /** New slave connection is taking place */
+                                else
+                                {
+                                        backend_ref[i].bref_dcb = dcb_connect(
+                                                b->backend_server,
+                                                session,
+                                                b->backend_server->protocol);
+                                        
+                                        if (backend_ref[i].bref_dcb != NULL)
+                                        {
+                                                slaves_connected += 1;
+                                                /**
+                                                 * Start executing session command
+                                                 * history.
+                                                 */
+                                                execute_sescmd_history(&backend_ref[i]);
+                                                /** 
+                                                 * When server fails, this callback
+                                                 * is called.
+                                                 */
+                                                dcb_add_callback(
+                                                        backend_ref[i].bref_dcb,
+                                                        DCB_REASON_NOT_RESPONDING,
+                                                        &router_handle_state_switch,
+                                                        (void *)&backend_ref[i]);
+                                                backend_ref[i].bref_state = 0;
+                                                bref_set_state(&backend_ref[i], 
+                                                               BREF_IN_USE);
+                                               /** 
+                                                * Increase backend connection counter.
+                                                * Server's stats are _increased_ in 
+                                                * dcb.c:dcb_alloc !
+                                                * But decreased in the calling function 
+                                                * of dcb_close.
+                                                */
+                                                atomic_add(&b->backend_conn_count, 1);
+                                        }
+                                        else
+                                        {
+                                                LOGIF(LE, (skygw_log_write_flush(
+                                                        LOGFILE_ERROR,
+                                                        "Error : Unable to establish "
+                                                        "connection with slave %s:%d",
+                                                        b->backend_server->name,
+                                                        b->backend_server->port)));
+                                                /* handle connect error */
+                                        }
+                                }
+                        }
+			/* take the master_host for master */
+			else if (master_host && 
+                                (b->backend_server == master_host->backend_server))
+                        {
+                                *p_master_ref = &backend_ref[i];
+                                
+                                if (master_connected)
+                                {   
+                                        continue;
+                                }
+                                master_found = true;
+
+                                /** A master with an open circuit fails the session at once */
+                                if (!server_circuit_probe(b->backend_server))
+                                {
+                                        succp = false;
+                                        LOGIF(LE, (skygw_log_write_flush(
+                                                LOGFILE_ERROR,
+                                                "Error : Master %s:%d is not used "
+                                                "after repeated connection failures.",
+                                                b->backend_server->name,
+                                                b->backend_server->port)));
+                                        continue;
+                                }
+                                  
+                                backend_ref[i].bref_dcb = dcb_connect(
+                                        b->backend_server,
+                                        session,
+                                        b->backend_server->protocol);
+                                
+                                if (backend_ref[i].bref_dcb != NULL) 
+                                {
+                                        master_connected = true;
+                                        /** 
+                                         * When server fails, this callback
+                                         * is called.
+                                         */
+                                        dcb_add_callback(
+                                                backend_ref[i].bref_dcb,
+                                                DCB_REASON_NOT_RESPONDING,
+                                                &router_handle_state_switch,
+                                                (void *)&backend_ref[i]);
+
+                                        backend_ref[i].bref_state = 0;
+                                        bref_set_state(&backend_ref[i], 
+                                                       BREF_IN_USE);
+                                        /** Increase backend connection counters */
+                                        atomic_add(&b->backend_conn_count, 1);
+                                }
+                                else
+                                {
+                                        succp = false;
+                                        LOGIF(LE, (skygw_log_write_flush(
+                                                LOGFILE_ERROR,
+                                                "Error : Unable to establish "
+                                                "connection with master %s:%d",
+                                                b->backend_server->name,
+                                                b->backend_server->port)));
+                                        /** handle connect error */
+                                }
+                        }       
+                }
+        } /*< for */
+        
+#if defined(EXTRA_SS_DEBUG)        
+        LOGIF(LT, (skygw_log_write(LOGFILE_TRACE, "Servers and conns after ordering:")));
+        
+        for (i=0; i<router_nservers; i++)
+        {
+                BACKEND* b = backend_ref[i].bref_backend;
+                
+                LOGIF(LT, (skygw_log_write_flush(LOGFILE_TRACE,
+                                                "master bref %p bref %p %d %s %d:%d",
+                                                *p_master_ref,
+                                                &backend_ref[i],
+                                                backend_ref[i].bref_state,
+                                                b->backend_server->name,
+                                                b->backend_server->port,
+                                                b->backend_conn_count)));                
+        }
+	/* assert with master_host */
+        ss_dassert(!master_connected ||
+        (master_host && ((*p_master_ref)->bref_backend->backend_server == master_host->backend_server) && SERVER_MASTER));
+#endif
+        
+        /**
+         * Successful cases
+         */
+        if (master_connected && 
+                slaves_connected >= min_nslaves && 
+                slaves_connected <= max_nslaves)
+        {
+                succp = true;
+                
+                if (slaves_connected == 0 && slaves_found > 0)
+                {
+                        LOGIF(LE, (skygw_log_write(
+                                LOGFILE_ERROR,
+                                "Warning : Couldn't connect to any of the %d "
+                                "slaves. Routing to %s only.",
+                                slaves_found,
+                                (is_synced_master ? "Galera nodes" : "Master"))));
+                        
+                        LOGIF(LM, (skygw_log_write(
+                                LOGFILE_MESSAGE,
+                                "* Warning : Couldn't connect to any of the %d "
+                                "slaves. Routing to %s only.",
+                                slaves_found,
+                                (is_synced_master ? "Galera nodes" : "Master"))));
+                }
+                else if (slaves_found == 0 && max_nslaves > 0)
+                {
+                        LOGIF(LE, (skygw_log_write(
+                                LOGFILE_ERROR,
+                                "Warning : Couldn't find any slaves from existing "
+                                "%d servers. Routing to %s only.",
+                                router_nservers,
+                                (is_synced_master ? "Galera nodes" : "Master"))));
+                        
+                        LOGIF(LM, (skygw_log_write(
+                                LOGFILE_MESSAGE,
+                                "* Warning : Couldn't find any slaves from existing "
+                                "%d servers. Routing to %s only.",
+                                router_nservers,
+                                (is_synced_master ? "Galera nodes" : "Master"))));                        
+                }
+                else if (slaves_connected < max_nslaves)
+                {
+                        LOGIF(LT, (skygw_log_write_flush(
+                                LOGFILE_TRACE,
+                                "Note : Couldn't connect to maximum number of "
+                                "slaves. Connected successfully to %d slaves "
+                                "of %d of them.",
+                                slaves_connected,
+                                slaves_found)));
+                }
+                
+                if (LOG_IS_ENABLED(LT))
+                {
+                        for (i=0; i<router_nservers; i++)
+                        {
+                                BACKEND* b = backend_ref[i].bref_backend;
+
+                                if (BREF_IS_IN_USE((&backend_ref[i])))
+                                {
+                                        backend_type_t btype = BACKEND_TYPE(b);
+                                        
+                                        LOGIF(LT, (skygw_log_write(
+                                                LOGFILE_TRACE,
+                                                "Selected %s in \t%s:%d",
+                                                (btype == BE_MASTER ? "master" : 
+                                                (btype == BE_SLAVE ? "slave" : 
+                                                "unknown node type")),
+                                                b->backend_server->name,
+                                                b->backend_server->port)));
+                                }
+                        } /* for */
+                }
+        }
+        /**
+         * Failure cases
+         */
+        else
+        {          
+                succp = false;
+                
+                if (!master_found)
+                {
+                        LOGIF(LE, (skygw_log_write(
+                                LOGFILE_ERROR,
+                                "Error : Couldn't find suitable %s from %d "
+                                "candidates.",
+                                (is_synced_master ? "Galera node" : "Master"),
+                                router_nservers)));
+                        
+                        LOGIF(LM, (skygw_log_write(
+                                LOGFILE_MESSAGE,
+                                "Error : Couldn't find suitable %s from %d "
+                                "candidates.",
+                                (is_synced_master ? "Galera node" : "Master"),
+                                router_nservers)));
+ 
+                        LOGIF(LT, (skygw_log_write(
+                                LOGFILE_TRACE,
+                                "Error : Couldn't find suitable %s from %d "
+                                "candidates.",
+                                (is_synced_master ? "Galera node" : "Master"),
+                                router_nservers)));
+                }
+                else if (!master_connected)
+                {
+                        LOGIF(LE, (skygw_log_write(
+                                LOGFILE_ERROR,
+                                "Error : Couldn't connect to any %s although "
+                                "there exists at least one %s node in the "
+                                "cluster.",
+                                (is_synced_master ? "Galera node" : "Master"),
+                                (is_synced_master ? "Galera node" : "Master"))));
+                        
+                        LOGIF(LM, (skygw_log_write(
+                                LOGFILE_MESSAGE,
+                                "Error : Couldn't connect to any %s although "
+                                "there exists at least one %s node in the "
+                                "cluster.",
+                                (is_synced_master ? "Galera node" : "Master"),
+                                (is_synced_master ? "Galera node" : "Master"))));
+
+                        LOGIF(LT, (skygw_log_write(
+                                LOGFILE_TRACE,
+                                "Error : Couldn't connect to any %s although "
+                                "there exists at least one %s node in the "
+                                "cluster.",
+                                (is_synced_master ? "Galera node" : "Master"),
+                                (is_synced_master ? "Galera node" : "Master"))));
+                }
+
+                if (slaves_connected < min_nslaves)
+                {
+                        LOGIF(LE, (skygw_log_write(
+                                LOGFILE_ERROR,
+                                "Error : Couldn't establish required amount of "
+                                "slave connections for router session.")));
+                        
+                        LOGIF(LM, (skygw_log_write(
+                                LOGFILE_MESSAGE,
+                                "Error : Couldn't establish required amount of "
+                                "slave connections for router session.")));
+                }
+                
+                /** Clean up connections */
+                for (i=0; i<router_nservers; i++)
+                {
+                        if (BREF_IS_IN_USE((&backend_ref[i])))
+                        {
+                                ss_dassert(backend_ref[i].bref_backend->backend_conn_count > 0);
+                                
+                                /** disconnect opened connections */
+                                dcb_close(backend_ref[i].bref_dcb);
+                                bref_clear_state(&backend_ref[i], BREF_IN_USE);
+                                /** Decrease backend's connection counter. */
+                                atomic_add(&backend_ref[i].bref_backend->backend_conn_count, -1);
+                        }
+                }
+                master_connected = false;
+                slaves_connected = 0;
+        }
+return_succp:
+
+        return succp;
+}
+
+
+/** 
+ * Create a generic router session property strcture.
+ */
+static rses_property_t* rses_property_init(
+	rses_property_type_t prop_type)
+{
+	rses_property_t* prop;
+	
+	prop = (rses_property_t*)calloc(1, sizeof(rses_property_t));
+	if (prop == NULL)
+	{
+		goto return_prop;
+	}
 	prop->rses_prop_type = prop_type;
 #if defined(SS_DEBUG)
-	prop->rses_prop_chk_top = CHK_NUM_ROUTER_PROPERTY;
-	prop->rses_prop_chk_tail = CHK_NUM_ROUTER_PROPERTY;
+	prop->rses_prop_chk_top = CHK_NUM_ROUTER_PROPERTY;
+	prop->rses_prop_chk_tail = CHK_NUM_ROUTER_PROPERTY;
+#endif
+	
+return_prop:
+	CHK_RSES_PROP(prop);
+	return prop;
+}
+
+/**
+ * Property is freed at the end of router client session.
+ */
+static void rses_property_done(
+	rses_property_t* prop)
+{
+	CHK_RSES_PROP(prop);
+	
+	switch (prop->rses_prop_type) {
+	case RSES_PROP_TYPE_SESCMD:
+		mysql_sescmd_done(&prop->rses_prop_data.sescmd);
+		break;
+	default:
+		LOGIF(LD, (skygw_log_write(
+                                   LOGFILE_DEBUG,
+                                   "%lu [rses_property_done] Unknown property type %d "
+                                   "in property %p",
+                                   pthread_self(),
+                                   prop->rses_prop_type,
+                                   prop)));
+		
+		ss_dassert(false);
+		break;
+	}
+	free(prop);
+}
+
+/**
+ * Add property to the router_client_ses structure's rses_properties
+ * array. The slot is determined by the type of property.
+ * In each slot there is a list of properties of similar type.
+ * 
+ * Router client session must be locked.
+ */
+static void rses_property_add(
+        ROUTER_CLIENT_SES* rses,
+        rses_property_t*   prop)
+{
+        rses_property_t* p;
+        
+        CHK_CLIENT_RSES(rses);
+        CHK_RSES_PROP(prop);
+        ss_dassert(RSES_IS_LOCKED(rses));
+        
+        prop->rses_prop_rsession = rses;
+        p = rses->rses_properties[prop->rses_prop_type];
+        
+        if (p == NULL)
+        {
+                rses->rses_properties[prop->rses_prop_type] = prop;
+        }
+        else
+        {
+                while (p->rses_prop_next != NULL)
+                {
+                        p = p->rses_prop_next;
+                }
+                p->rses_prop_next = prop;
+        }
+}
+
+/** 
+ * Router session must be locked.
+ * Return session command pointer if succeed, NULL if failed.
+ */
+static mysql_sescmd_t* rses_property_get_sescmd(
+        rses_property_t* prop)
+{
+        mysql_sescmd_t* sescmd;
+        
+        CHK_RSES_PROP(prop);
+        ss_dassert(prop->rses_prop_rsession == NULL ||
+                RSES_IS_LOCKED(prop->rses_prop_rsession));
+        
+        sescmd = &prop->rses_prop_data.sescmd;
+        
+        if (sescmd != NULL)
+        {
+                CHK_MYSQL_SESCMD(sescmd);
+        }
+        return sescmd;
+}
+       
+/**
+static void rses_begin_locked_property_action(
+        rses_property_t* prop)
+{
+        CHK_RSES_PROP(prop);
+        spinlock_acquire(&prop->rses_prop_lock);
+}
+
+static void rses_end_locked_property_action(
+        rses_property_t* prop)
+{
+        CHK_RSES_PROP(prop);
+        spinlock_release(&prop->rses_prop_lock);
+}
+*/
+
+/**
+ * Create session command property.
+ */
+static mysql_sescmd_t* mysql_sescmd_init (
+        rses_property_t*   rses_prop,
+        GWBUF*             sescmd_buf,
+        unsigned char      packet_type,
+        ROUTER_CLIENT_SES* rses)
+{
+        mysql_sescmd_t* sescmd;
+        
+        CHK_RSES_PROP(rses_prop);
+        /** Can't call rses_property_get_sescmd with uninitialized sescmd */
+        sescmd = &rses_prop->rses_prop_data.sescmd;
+        sescmd->my_sescmd_prop = rses_prop; /*< reference to owning property */
+#if defined(SS_DEBUG)
+        sescmd->my_sescmd_chk_top  = CHK_NUM_MY_SESCMD;
+        sescmd->my_sescmd_chk_tail = CHK_NUM_MY_SESCMD;
+#endif
+        /** Set session command buffer */
+        sescmd->my_sescmd_buf  = sescmd_buf;
+        sescmd->my_sescmd_packet_type = packet_type;
+        mysql_sescmd_classify(sescmd);
+        /** The history lives as long as the session, account its memory */
+        sescmd->my_sescmd_session = rses->rses_session;
+        sescmd->my_sescmd_mem = gwbuf_length(sescmd_buf);
+        session_mem_add(sescmd->my_sescmd_session, sescmd->my_sescmd_mem);
+        
+        return sescmd;
+}
+
+
+static void mysql_sescmd_done(
+	mysql_sescmd_t* sescmd)
+{
+	CHK_RSES_PROP(sescmd->my_sescmd_prop);
+	session_mem_add(sescmd->my_sescmd_session, -sescmd->my_sescmd_mem);
+	gwbuf_free(sescmd->my_sescmd_buf);
+        if (sescmd->my_sescmd_err_buf != NULL)
+        {
+                causal_buf_free(sescmd->my_sescmd_err_buf);
+        }
+        free(sescmd->my_sescmd_key);
+        memset(sescmd, 0, sizeof(mysql_sescmd_t));
+}
+
+/**
+ * Skip white space
+ */
+static char* sescmd_skip_space(
+        char* ptr)
+{
+        while (isspace(*ptr))
+        {
+                ptr++;
+        }
+        return ptr;
+}
+
+/**
+ * Check that the value of a SET assigns one variable only. Commas and
+ * semicolons outside quotes and parentheses mean more assignments or more
+ * statements.
+ */
+static bool sescmd_value_is_single(
+        char* ptr)
+{
+        char quote = 0;
+        int  depth = 0;
+
+        for (; *ptr != '\0'; ptr++)
+        {
+                if (quote != 0)
+                {
+                        if (*ptr == '\\' && ptr[1] != '\0')
+                        {
+                                ptr++;
+                        }
+                        else if (*ptr == quote)
+                        {
+                                quote = 0;
+                        }
+                }
+                else if (*ptr == '\'' || *ptr == '"' || *ptr == '`')
+                {
+                        quote = *ptr;
+                }
+                else if (*ptr == '(')
+                {
+                        depth++;
+                }
+                else if (*ptr == ')')
+                {
+                        depth--;
+                }
+                else if (*ptr == ';' || (*ptr == ',' && depth == 0))
+                {
+                        return false;
+                }
+        }
+        return true;
+}
+
+/**
+ * Find out what a session command changes. Only USE and SET of a single
+ * session or user variable are recognised, everything else is SESCMD_OTHER
+ * which is never removed from the history.
+ *
+ * @param sescmd	The session command
+ */
+static void mysql_sescmd_classify(
+        mysql_sescmd_t* sescmd)
+{
+        char* sql;
+        char* ptr;
+        char* name;
+        int   len;
+        int   i;
+
+        sescmd->my_sescmd_kind = SESCMD_OTHER;
+
+        if (sescmd->my_sescmd_packet_type == MYSQL_COM_INIT_DB)
+        {
+                sescmd->my_sescmd_kind = SESCMD_USE;
+                return;
+        }
+        if ((sql = modutil_get_SQL(sescmd->my_sescmd_buf)) == NULL)
+        {
+                return;
+        }
+        sescmd->my_sescmd_sql = sql;
+        ptr = sescmd_skip_space(sql);
+
+        if (strncasecmp(ptr, "USE", 3) == 0 && isspace(ptr[3]))
+        {
+                if (strchr(ptr, ';') == NULL)
+                {
+                        sescmd->my_sescmd_kind = SESCMD_USE;
+                }
+                return;
+        }
+        if (strncasecmp(ptr, "SET", 3) != 0 || !isspace(ptr[3]))
+        {
+                return;
+        }
+        ptr = sescmd_skip_space(ptr + 3);
+
+        if (strncasecmp(ptr, "SESSION", 7) == 0 && isspace(ptr[7]))
+        {
+                ptr = sescmd_skip_space(ptr + 7);
+        }
+        else if (strncasecmp(ptr, "LOCAL", 5) == 0 && isspace(ptr[5]))
+        {
+                ptr = sescmd_skip_space(ptr + 5);
+        }
+        else if (strncasecmp(ptr, "@@SESSION.", 10) == 0)
+        {
+                ptr += 10;
+        }
+        else if (strncasecmp(ptr, "@@LOCAL.", 8) == 0)
+        {
+                ptr += 8;
+        }
+        else if (strncmp(ptr, "@@", 2) == 0 &&
+                strncasecmp(ptr + 2, "GLOBAL.", 7) != 0)
+        {
+                ptr += 2;
+        }
+        /** SET NAMES is taken for a SET of the variable names */
+        if (strncasecmp(ptr, "NAMES", 5) == 0 && isspace(ptr[5]))
+        {
+                ptr = sescmd_skip_space(ptr + 5);
+
+                if (*ptr == '\0' ||
+                        !sescmd_value_is_single(ptr) ||
+                        (sescmd->my_sescmd_key = strdup("names")) == NULL)
+                {
+                        return;
+                }
+                sescmd->my_sescmd_value = ptr;
+                sescmd->my_sescmd_kind = SESCMD_SET;
+                return;
+        }
+        /** A session variable or a user variable starting with @ */
+        name = ptr;
+
+        if (*ptr == '@')
+        {
+                ptr++;
+        }
+        while (isalnum(*ptr) || *ptr == '_' || *ptr == '$')
+        {
+                ptr++;
+        }
+        len = ptr - name;
+
+        if (len == 0 || (name[0] == '@' && len == 1))
+        {
+                return;
+        }
+        ptr = sescmd_skip_space(ptr);
+
+        if (ptr[0] == ':' && ptr[1] == '=')
+        {
+                ptr += 2;
+        }
+        else if (ptr[0] == '=')
+        {
+                ptr += 1;
+        }
+        else
+        {
+                return;
+        }
+        if (!sescmd_value_is_single(ptr) ||
+                (sescmd->my_sescmd_key = (char *)malloc(len + 1)) == NULL)
+        {
+                return;
+        }
+        for (i = 0; i < len; i++)
+        {
+                sescmd->my_sescmd_key[i] = tolower(name[i]);
+        }
+        sescmd->my_sescmd_key[len] = '\0';
+        sescmd->my_sescmd_value = ptr;
+        sescmd->my_sescmd_kind = SESCMD_SET;
+}
+
+/**
+ * Check if SQL text may refer to a variable. Any occurrence of the name
+ * counts, a false positive only keeps a command in the history.
+ *
+ * @param text	The SQL text or NULL if the command has none
+ * @param name	Name of the variable
+ *
+ * @return true if the text mentions the name or there is no text
+ */
+static bool sescmd_text_mentions(
+        char* text,
+        char* name)
+{
+        int len = strlen(name);
+
+        if (text == NULL)
+        {
+                return true;
+        }
+        for (; *text != '\0'; text++)
+        {
+                if (strncasecmp(text, name, len) == 0)
+                {
+                        return true;
+                }
+        }
+        return false;
+}
+
+/**
+ * Check if a later command of the history makes a session command
+ * unnecessary for a backend that replays the history.
+ *
+ * A SET is superseded by a later SET of the same variable if neither the
+ * commands in between nor the value of the later SET mention the variable.
+ * A USE is superseded by a later USE if the commands in between are other
+ * USEs or SETs that can't contain a query, and thus don't depend on the
+ * current database.
+ *
+ * @param prop	Property of the session command
+ *
+ * @return true if the command can be removed from the history
+ */
+static bool sescmd_is_superseded(
+        rses_property_t* prop)
+{
+        mysql_sescmd_t*  scmd = &prop->rses_prop_data.sescmd;
+        mysql_sescmd_t*  next;
+        rses_property_t* p;
+        char*            name;
+
+        if (scmd->my_sescmd_kind == SESCMD_OTHER)
+        {
+                return false;
+        }
+        name = scmd->my_sescmd_key;
+
+        if (name != NULL && name[0] == '@')
+        {
+                name++;
+        }
+        for (p = prop->rses_prop_next; p != NULL; p = p->rses_prop_next)
+        {
+                next = &p->rses_prop_data.sescmd;
+
+                if (scmd->my_sescmd_kind == SESCMD_USE)
+                {
+                        if (next->my_sescmd_kind == SESCMD_USE)
+                        {
+                                return true;
+                        }
+                        if (next->my_sescmd_kind != SESCMD_SET ||
+                                strchr(next->my_sescmd_value, '(') != NULL)
+                        {
+                                return false;
+                        }
+                }
+                else if (next->my_sescmd_kind == SESCMD_SET &&
+                        strcmp(next->my_sescmd_key, scmd->my_sescmd_key) == 0)
+                {
+                        return !sescmd_text_mentions(next->my_sescmd_value, name);
+                }
+                else if (next->my_sescmd_kind != SESCMD_USE &&
+                        sescmd_text_mentions(next->my_sescmd_sql, name))
+                {
+                        return false;
+                }
+        }
+        return false;
+}
+
+/**
+ * Check if a variable is one of the character sets and collations that
+ * SET NAMES and USE change together.
+ */
+static bool sescmd_is_charset_key(
+        char* key)
+{
+        return strcmp(key, "names") == 0 ||
+                strncmp(key, "character_set_", 14) == 0 ||
+                strncmp(key, "collation_", 10) == 0;
+}
+
+/**
+ * Check that the value of a SET is a constant, a number, a quoted string
+ * or a word such as ON or utf8. DEFAULT and expressions may give another
+ * value each time.
+ */
+static bool sescmd_value_is_constant(
+        char* value)
+{
+        char* ptr = value;
+
+        if (strncasecmp(value, "DEFAULT", 7) == 0 &&
+                !isalnum(value[7]) && value[7] != '_')
+        {
+                return false;
+        }
+        for (; *ptr != '\0'; ptr++)
+        {
+                if (*ptr == '(' || *ptr == '@')
+                {
+                        return false;
+                }
+        }
+        return true;
+}
+
+/**
+ * Compare the values of two SETs, the white space at the end is ignored.
+ */
+static bool sescmd_value_equal(
+        char* a,
+        char* b)
+{
+        size_t alen = strlen(a);
+        size_t blen = strlen(b);
+
+        while (alen > 0 && isspace(a[alen - 1]))
+        {
+                alen--;
+        }
+        while (blen > 0 && isspace(b[blen - 1]))
+        {
+                blen--;
+        }
+        return alen == blen && strncmp(a, b, alen) == 0;
+}
+
+/**
+ * Check if a session command of the history may change a variable.
+ * The check is the one of sescmd_is_superseded, any mention of the name
+ * counts, and the character sets count for each other.
+ */
+static bool sescmd_may_change(
+        mysql_sescmd_t* scmd,
+        char*           key)
+{
+        bool charset = sescmd_is_charset_key(key);
+
+        switch (scmd->my_sescmd_kind) {
+        case SESCMD_USE:
+                /** The character set of the database follows it */
+                return charset;
+        case SESCMD_SET:
+                return (charset && sescmd_is_charset_key(scmd->my_sescmd_key)) ||
+                        sescmd_text_mentions(scmd->my_sescmd_value, key);
+        default:
+                return sescmd_text_mentions(scmd->my_sescmd_sql, key) ||
+                        (charset &&
+                         (sescmd_text_mentions(scmd->my_sescmd_sql, "names") ||
+                          sescmd_text_mentions(scmd->my_sescmd_sql, "character") ||
+                          sescmd_text_mentions(scmd->my_sescmd_sql, "collation")));
+        }
+}
+
+/**
+ * Check if a SET gives a variable the value it already has. The value is
+ * known from the history: the last SET of the variable, with the same
+ * constant value and a successful reply, and nothing after it that may
+ * have changed the variable. A history that has been truncated or a
+ * session whose variables changed otherwise tells nothing.
+ *
+ * Router session must be locked.
+ *
+ * @param rses		Router client session
+ * @param sescmd	The new session command, not in the history yet
+ *
+ * @return true if the SET wouldn't change the session
+ */
+static bool sescmd_is_redundant(
+        ROUTER_CLIENT_SES* rses,
+        mysql_sescmd_t*    sescmd)
+{
+        rses_property_t* p;
+        mysql_sescmd_t*  scmd;
+        mysql_sescmd_t*  last = NULL;
+        char*            key = sescmd->my_sescmd_key;
+
+        ss_dassert(RSES_IS_LOCKED(rses));
+
+        if (sescmd->my_sescmd_kind != SESCMD_SET ||
+                key[0] == '@' ||
+                rses->rses_sescmd_truncated ||
+                rses->rses_sescmd_state_lost ||
+                !sescmd_value_is_constant(sescmd->my_sescmd_value))
+        {
+                return false;
+        }
+        for (p = rses->rses_properties[RSES_PROP_TYPE_SESCMD];
+             p != NULL;
+             p = p->rses_prop_next)
+        {
+                scmd = &p->rses_prop_data.sescmd;
+
+                if (scmd->my_sescmd_kind == SESCMD_SET &&
+                        strcmp(scmd->my_sescmd_key, key) == 0)
+                {
+                        last = scmd;
+                }
+                else if (last != NULL && sescmd_may_change(scmd, key))
+                {
+                        last = NULL;
+                }
+        }
+        return last != NULL &&
+                last->my_sescmd_is_replied &&
+                !last->my_sescmd_reply_err &&
+                sescmd_value_is_constant(last->my_sescmd_value) &&
+                sescmd_value_equal(last->my_sescmd_value, sescmd->my_sescmd_value);
+}
+
+/**
+ * Get the number of history entries a cursor has moved past. The entry the
+ * cursor refers to through its property pointer is counted.
+ *
+ * @param scur	The cursor
+ *
+ * @return The number of entries or -1 if the cursor isn't in the history
+ */
+static int sescmd_cursor_position(
+        sescmd_cursor_t* scur)
+{
+        rses_property_t** pp;
+        int               n = 0;
+
+        pp = &scur->scmd_cur_rses->rses_properties[RSES_PROP_TYPE_SESCMD];
+
+        while (pp != scur->scmd_cur_ptr_property)
+        {
+                if (*pp == NULL)
+                {
+                        return -1;
+                }
+                pp = &(*pp)->rses_prop_next;
+                n++;
+        }
+        return n;
+}
+
+/**
+ * Remove session commands that are not needed anymore from the history of
+ * a router session. Only commands that all the backends in use have
+ * executed are removed, and of them those that a later command supersedes.
+ * If the history is still longer than max_sescmd_history the oldest
+ * executed commands are removed as well. The history can't be replayed
+ * after that, and the session stops opening new backend connections.
+ *
+ * Router session must be locked.
+ *
+ * @param rses	Router client session
+ * @param inst	Router instance
+ */
+static void sescmd_history_compact(
+        ROUTER_CLIENT_SES* rses,
+        ROUTER_INSTANCE*   inst)
+{
+        rses_property_t** pp;
+        rses_property_t*  p;
+        int               npassed = -1;
+        int               nleft = 0;
+        int               nremoved = 0;
+        int               idx;
+        int               n;
+        int               i;
+
+        ss_dassert(RSES_IS_LOCKED(rses));
+
+        for (i=0; i<rses->rses_nbackends; i++)
+        {
+                if (!BREF_IS_IN_USE((&rses->rses_backend_ref[i])))
+                {
+                        continue;
+                }
+                n = sescmd_cursor_position(&rses->rses_backend_ref[i].bref_sescmd_cur);
+
+                if (n < 0)
+                {
+                        return;
+                }
+                if (npassed < 0 || n < npassed)
+                {
+                        npassed = n;
+                }
+        }
+        /** The last entry every cursor has passed is referred to by them */
+        pp = &rses->rses_properties[RSES_PROP_TYPE_SESCMD];
+
+        for (idx = 0; (p = *pp) != NULL; idx++)
+        {
+                if (idx < npassed - 1 &&
+                        p->rses_prop_data.sescmd.my_sescmd_is_replied &&
+                        sescmd_is_superseded(p))
+                {
+                        *pp = p->rses_prop_next;
+                        rses_property_done(p);
+                        nremoved += 1;
+                }
+                else
+                {
+                        pp = &p->rses_prop_next;
+                        nleft += 1;
+                }
+        }
+
+        if (rses->rses_config.rw_max_sescmd_history > 0 &&
+                nleft > rses->rses_config.rw_max_sescmd_history)
+        {
+                /** Entries removed above are not counted in npassed anymore */
+                n = npassed - 1 - nremoved;
+                pp = &rses->rses_properties[RSES_PROP_TYPE_SESCMD];
+
+                while (nleft > rses->rses_config.rw_max_sescmd_history && n > 0)
+                {
+                        p = *pp;
+                        *pp = p->rses_prop_next;
+                        rses_property_done(p);
+                        nremoved += 1;
+                        nleft -= 1;
+                        n -= 1;
+
+                        if (!rses->rses_sescmd_truncated)
+                        {
+                                rses->rses_sescmd_truncated = true;
+                                LOGIF(LT, (skygw_log_write(
+                                        LOGFILE_TRACE,
+                                        "Session command history exceeded "
+                                        "max_sescmd_history %d, failed backends "
+                                        "won't be replaced in this session.",
+                                        rses->rses_config.rw_max_sescmd_history)));
+                        }
+                }
+        }
+        if (nremoved > 0)
+        {
+                ts_stats_add(inst->stats, RWSPLIT_N_SESCMD_COMPACTED, nremoved);
+        }
+}
+
+/**
+ * Close a backend whose reply to a session command differs from the one the
+ * client got. The socket is shut down so that the hangup is handled by the
+ * error handler of the thread that owns the session. A master that differs
+ * has a session state the client doesn't know of, the client connection is
+ * shut down and the session closes.
+ *
+ * Router session must be locked.
+ *
+ * @param bref	Backend reference
+ */
+static void sescmd_reply_diverged(
+        backend_ref_t* bref)
+{
+        ROUTER_CLIENT_SES* rses = bref->bref_sescmd_cur.scmd_cur_rses;
+        SERVER*            srv = bref->bref_backend->backend_server;
+        DCB*               client_dcb;
+
+        if (bref == rses->rses_master_ref)
+        {
+                LOGIF(LE, (skygw_log_write_flush(
+                        LOGFILE_ERROR,
+                        "Error : Master %s:%d replied to a session command "
+                        "differently than the backend whose reply was sent "
+                        "to the client, closing the session.",
+                        srv->name,
+                        srv->port)));
+                client_dcb = rses->rses_session->client;
+
+                if (client_dcb != NULL && client_dcb->state == DCB_STATE_POLLING)
+                {
+                        shutdown(client_dcb->fd, SHUT_RDWR);
+                }
+                return;
+        }
+        LOGIF(LE, (skygw_log_write_flush(
+                LOGFILE_ERROR,
+                "Error : Slave %s:%d replied to a session command differently "
+                "than the backend whose reply was sent to the client, closing "
+                "the connection.",
+                srv->name,
+                srv->port)));
+        if (bref->bref_dcb != NULL && bref->bref_dcb->state == DCB_STATE_POLLING)
+        {
+                shutdown(bref->bref_dcb->fd, SHUT_RDWR);
+        }
+}
+
+/**
+ * Check if a backend other than the given one is still to reply to the
+ * session command at a position of the history. A backend whose error reply
+ * to an earlier command is held doesn't count, its replies aren't used.
+ *
+ * Router session must be locked.
+ *
+ * @param rses	Router client session
+ * @param bref	The backend that replied, NULL for none
+ * @param pos	Position of the command in the history
+ *
+ * @return true if a reply may still come from another backend
+ */
+static bool sescmd_reply_pending(
+        ROUTER_CLIENT_SES* rses,
+        backend_ref_t*     bref,
+        int                pos)
+{
+        backend_ref_t* b;
+        int            n;
+        int            i;
+
+        for (i=0; i<rses->rses_nbackends; i++)
+        {
+                b = &rses->rses_backend_ref[i];
+
+                if (b == bref ||
+                        !BREF_IS_IN_USE(b) ||
+                        BREF_IS_CLOSED(b) ||
+                        b->bref_sescmd_err_held ||
+                        !b->bref_sescmd_cur.scmd_cur_active)
+                {
+                        continue;
+                }
+                n = sescmd_cursor_position(&b->bref_sescmd_cur);
+
+                if (n >= 0 && n <= pos)
+                {
+                        return true;
+                }
+        }
+        return false;
+}
+
+/**
+ * A session command has got the reply the client is sent. The error replies
+ * that were held for it are dropped. If the reply is an OK the backends that
+ * failed the command don't have the session state of the client and are
+ * closed, if it is an error they agree with it.
+ *
+ * Router session must be locked.
+ *
+ * @param rses	Router client session
+ * @param scmd	The session command, its reply state is set
+ */
+static void sescmd_reply_resolved(
+        ROUTER_CLIENT_SES* rses,
+        mysql_sescmd_t*    scmd)
+{
+        backend_ref_t* b;
+        int            i;
+
+        if (scmd->my_sescmd_err_buf != NULL)
+        {
+                causal_buf_free(scmd->my_sescmd_err_buf);
+                scmd->my_sescmd_err_buf = NULL;
+        }
+        for (i=0; i<rses->rses_nbackends; i++)
+        {
+                b = &rses->rses_backend_ref[i];
+
+                if (!b->bref_sescmd_err_held)
+                {
+                        continue;
+                }
+                b->bref_sescmd_err_held = false;
+
+                if (!scmd->my_sescmd_reply_err && !BREF_IS_CLOSED(b))
+                {
+                        sescmd_reply_diverged(b);
+                }
+        }
+}
+
+/**
+ * Send the client the held error reply of a session command once no backend
+ * is left to reply to it, after a backend has failed.
+ *
+ * Router session must be locked.
+ *
+ * @param rses		Router client session
+ * @param replied	The client already got the error of the failed backend
+ */
+static void sescmd_held_release(
+        ROUTER_CLIENT_SES* rses,
+        bool               replied)
+{
+        rses_property_t* p;
+        mysql_sescmd_t*  scmd;
+        DCB*             client_dcb;
+        GWBUF*           errbuf;
+        int              pos = 0;
+
+        for (p = rses->rses_properties[RSES_PROP_TYPE_SESCMD];
+             p != NULL;
+             p = p->rses_prop_next, pos++)
+        {
+                scmd = &p->rses_prop_data.sescmd;
+
+                if (!scmd->my_sescmd_is_replied && scmd->my_sescmd_err_buf != NULL)
+                {
+                        break;
+                }
+        }
+        if (p == NULL || sescmd_reply_pending(rses, NULL, pos))
+        {
+                return;
+        }
+        errbuf = scmd->my_sescmd_err_buf;
+        scmd->my_sescmd_err_buf = NULL;
+        scmd->my_sescmd_is_replied = true;
+        scmd->my_sescmd_reply_err = true;
+        sescmd_reply_resolved(rses, scmd);
+        client_dcb = rses->rses_session->client;
+
+        if (!replied && client_dcb != NULL)
+        {
+                client_dcb->func.write(client_dcb, errbuf);
+        }
+        else
+        {
+                causal_buf_free(errbuf);
+        }
+}
+
+/**
+ * All cases where backend message starts at least with one response to session
+ * command are handled here.
+ * Read session commands from property list. If command is already replied,
+ * discard packet. Else send reply to client. In both cases move cursor forward
+ * until all session command replies are handled. 
+ * 
+ * Cases that are expected to happen and which are handled:
+ * s = response not yet replied to client, S = already replied response,
+ * q = query
+ * 1. q+        for example : select * from mysql.user
+ * 2. s+        for example : set autocommit=1
+ * 3. S+        
+ * 4. sq+
+ * 5. Sq+
+ * 6. Ss+
+ * 7. Ss+q+
+ * 8. S+q+
+ * 9. s+q+
+ *
+ * The first successful reply from any backend goes to the client. An error
+ * reply is held while another backend may still succeed, and is sent only
+ * if none does; the backend that failed sends nothing to the client until
+ * then. Once the client has its reply the backends whose reply differs, a
+ * failure where the client got an OK or the other way round, no longer have
+ * the session state of the client. A slave is closed and replaced by the
+ * error handler like a failed backend, a master closes the session.
+ *
+ * Router session must be locked.
+ *
+ * @param replybuf	The reply of the backend
+ * @param bref		Backend reference
+ * @param restbuf	out, the reply to the queries after the commands
+ *
+ * @return The responses to send to the client or NULL
+ */
+static GWBUF* sescmd_cursor_process_replies(
+        GWBUF*           replybuf,
+        backend_ref_t*   bref,
+        GWBUF**          restbuf)
+{
+        mysql_sescmd_t*    scmd;
+        sescmd_cursor_t*   scur;
+        ROUTER_CLIENT_SES* rses;
+        GWBUF*             outbuf = NULL;
+        bool               diverged = false;
+        
+        scur = &bref->bref_sescmd_cur;        
+        rses = scur->scmd_cur_rses;
+        ss_dassert(RSES_IS_LOCKED(rses));
+        scmd = sescmd_cursor_get_command(scur);
+               
+        CHK_GWBUF(replybuf);
+        
+        /** 
+         * Walk through the responses in the message and the list of session 
+         * commands. The commands are written without waiting for the
+         * previous responses, so there may be several responses in the
+         * message. The protocol marks the last packet of each of them.
+         */
+        while (scmd != NULL &&
+                replybuf != NULL &&
+                GWBUF_IS_TYPE_SESCMD_RESPONSE(replybuf))
+        {
+                GWBUF* response = NULL;
+                bool   last_packet = false;
+                bool   is_err = false;
+                
+                while (!last_packet &&
+                        replybuf != NULL &&
+                        GWBUF_IS_TYPE_SESCMD_RESPONSE(replybuf))
+                {
+                        GWBUF* packet = replybuf;
+                        
+                        CHK_GWBUF(packet);
+                        replybuf = packet->next;
+                        packet->next = NULL;
+                        last_packet = GWBUF_IS_TYPE_RESPONSE_END(packet);
+                        
+                        if (response == NULL && GWBUF_LENGTH(packet) > 4)
+                        {
+                                is_err = MYSQL_IS_ERROR_PACKET(
+                                        ((uint8_t *)GWBUF_DATA(packet)));
+                        }
+                        response = gwbuf_append(response, packet);
+                }
+                
+                if (scmd->my_sescmd_is_replied)
+                {
+                        /** Faster backend has already responded to client : discard */
+                        if (is_err != scmd->my_sescmd_reply_err)
+                        {
+                                diverged = true;
+                        }
+                        causal_buf_free(response);
+                }
+                else if (bref->bref_sescmd_err_held)
+                {
+                        /** An earlier reply is held, this one can't pass it */
+                        causal_buf_free(response);
+                }
+                else if (is_err &&
+                         sescmd_reply_pending(rses, bref, sescmd_cursor_position(scur)))
+                {
+                        /** Another backend may still succeed */
+                        if (scmd->my_sescmd_err_buf == NULL)
+                        {
+                                scmd->my_sescmd_err_buf = response;
+                        }
+                        else
+                        {
+                                causal_buf_free(response);
+                        }
+                        bref->bref_sescmd_err_held = true;
+                }
+                else
+                {
+                        /** Response is in the buffer and it will be sent to client. */
+                        outbuf = gwbuf_append(outbuf, response);
+                        scmd->my_sescmd_is_replied = true;
+                        scmd->my_sescmd_reply_err = is_err;
+                        sescmd_reply_resolved(rses, scmd);
+                }
+                
+                /** The protocol passes on complete responses only */
+                if (!last_packet)
+                {
+                        ss_dassert(last_packet);
+                        break;
+                }
+                /** Set response status received */
+                bref_clear_state(bref, BREF_WAITING_RESULT);
+                
+                if (sescmd_cursor_next(scur))
+                {
+                        scmd = sescmd_cursor_get_command(scur);
+                }
+                else
+                {
+                        scmd = NULL;
+                        /** All session commands are replied */
+                        scur->scmd_cur_active = false;
+                }
+        }
+        if (diverged)
+        {
+                sescmd_reply_diverged(bref);
+        }
+        /** The rest is the reply to a query pipelined after the commands */
+        *restbuf = replybuf;
+        
+        return outbuf;
+}
+
+
+
+/**
+ * Get the address of current session command.
+ * 
+ * Router session must be locked */
+static mysql_sescmd_t* sescmd_cursor_get_command(
+	sescmd_cursor_t* scur)
+{
+        mysql_sescmd_t* scmd;
+        
+        ss_dassert(RSES_IS_LOCKED(scur->scmd_cur_rses));
+        scur->scmd_cur_cmd = rses_property_get_sescmd(*scur->scmd_cur_ptr_property);
+        
+        CHK_MYSQL_SESCMD(scur->scmd_cur_cmd);
+        
+        scmd = scur->scmd_cur_cmd;
+      
+	return scmd;
+}
+
+/** router must be locked */
+static bool sescmd_cursor_is_active(
+	sescmd_cursor_t* sescmd_cursor)
+{
+	bool succp;
+        ss_dassert(RSES_IS_LOCKED(sescmd_cursor->scmd_cur_rses));
+
+        succp = sescmd_cursor->scmd_cur_active;
+	return succp;
+}
+
+/** router must be locked */
+static void sescmd_cursor_set_active(
+        sescmd_cursor_t* sescmd_cursor,
+        bool             value)
+{
+        ss_dassert(RSES_IS_LOCKED(sescmd_cursor->scmd_cur_rses));
+        /** avoid calling unnecessarily */
+        ss_dassert(sescmd_cursor->scmd_cur_active != value);
+        sescmd_cursor->scmd_cur_active = value;
+}
+
+/** 
+ * Clone session command's command buffer. 
+ * Router session must be locked 
+ */
+static GWBUF* sescmd_cursor_clone_querybuf(
+	sescmd_cursor_t* scur)
+{
+	GWBUF* buf;
+	ss_dassert(scur->scmd_cur_cmd != NULL);
+	
+	buf = gwbuf_clone(scur->scmd_cur_cmd->my_sescmd_buf);
+	
+	CHK_GWBUF(buf);
+	return buf;
+}
+
+static bool sescmd_cursor_history_empty(
+        sescmd_cursor_t* scur)
+{
+        bool succp;
+        
+        CHK_SESCMD_CUR(scur);
+        
+        if (scur->scmd_cur_rses->rses_properties[RSES_PROP_TYPE_SESCMD] == NULL)
+        {
+                succp = true;
+        }
+        else
+        {
+                succp = false;
+        }
+        
+        return succp;
+}
+
+
+static void sescmd_cursor_reset(
+        sescmd_cursor_t* scur)
+{
+        ROUTER_CLIENT_SES* rses;
+        CHK_SESCMD_CUR(scur);
+        CHK_CLIENT_RSES(scur->scmd_cur_rses);
+        rses = scur->scmd_cur_rses;
+
+        scur->scmd_cur_ptr_property = &rses->rses_properties[RSES_PROP_TYPE_SESCMD];
+        
+        CHK_RSES_PROP((*scur->scmd_cur_ptr_property));
+        scur->scmd_cur_active = false;
+        scur->scmd_cur_cmd = &(*scur->scmd_cur_ptr_property)->rses_prop_data.sescmd;
+}
+
+static bool execute_sescmd_history(
+        backend_ref_t* bref)
+{
+        bool             succp;
+        sescmd_cursor_t* scur;
+        CHK_BACKEND_REF(bref);
+        
+        scur = &bref->bref_sescmd_cur;
+        CHK_SESCMD_CUR(scur);
+ 
+        if (!sescmd_cursor_history_empty(scur))
+        {
+                sescmd_cursor_reset(scur);
+                succp = execute_sescmd_in_backend(bref);
+        }
+        else
+        {
+                succp = true;
+        }
+
+        return succp;
+}
+
+/**
+ * Sends the session commands from the cursor to the end of the history to
+ * backend for execution. The commands are chained to one write without
+ * waiting for the responses, which are matched to the commands in
+ * sescmd_cursor_process_replies as they arrive. Statements routed to the
+ * backend meanwhile are pipelined after the commands. COM_CHANGE_USER is
+ * written by itself since the protocol authenticates it.
+ *  
+ * Returns true if the commands were sent or added successfully to the queue.
+ * Returns false if command sending failed or if there are no pending session
+ * 	commands.
+ * 
+ * Router session must be locked.
+ */ 
+static bool execute_sescmd_in_backend(
+        backend_ref_t* backend_ref)
+{
+	bool             succp = true;
+	sescmd_cursor_t* scur;
+	rses_property_t* prop;
+        GWBUF*           chain = NULL;
+        int              nchained = 0;
+
+        if (BREF_IS_CLOSED(backend_ref))
+        {
+                succp = false;
+                goto return_succp;
+        }
+	CHK_DCB(backend_ref->bref_dcb);
+ 	CHK_BACKEND_REF(backend_ref);
+	
+        scur = &backend_ref->bref_sescmd_cur;
+
+        /** Return if there are no pending ses commands */
+	if (sescmd_cursor_get_command(scur) == NULL)
+	{
+		succp = false;
+                LOGIF(LT, (skygw_log_write_flush(
+                        LOGFILE_TRACE,
+                        "Cursor had no pending session commands.")));
+                
+                goto return_succp;
+	}
+
+	if (!sescmd_cursor_is_active(scur))
+        {
+                /** Cursor is left active when function returns. */
+                sescmd_cursor_set_active(scur, true);
+        }
+        
+        for (prop = *scur->scmd_cur_ptr_property;
+             prop != NULL && succp;
+             prop = prop->rses_prop_next)
+        {
+                mysql_sescmd_t* scmd = &prop->rses_prop_data.sescmd;
+                GWBUF*          buf;
+                
+                if (scmd->my_sescmd_packet_type != MYSQL_COM_CHANGE_USER)
+                {
+                        gwbuf_set_type(scmd->my_sescmd_buf, GWBUF_TYPE_SESCMD);
+                        
+                        if ((buf = gwbuf_clone(scmd->my_sescmd_buf)) == NULL)
+                        {
+                                succp = false;
+                                break;
+                        }
+                        chain = gwbuf_append(chain, buf);
+                        nchained += 1;
+                        continue;
+                }
+                if (chain != NULL)
+                {
+                        succp = (bref_write(scur->scmd_cur_rses,
+                                            backend_ref,
+                                            chain) == 1);
+                        chain = NULL;
+                }
+                if (succp)
+                {
+                        succp = sescmd_write(backend_ref, scmd);
+                }
+        }
+        if (chain != NULL)
+        {
+                if (succp)
+                {
+                        succp = (bref_write(scur->scmd_cur_rses,
+                                            backend_ref,
+                                            chain) == 1);
+                }
+                else
+                {
+                        gwbuf_consume(chain, gwbuf_length(chain));
+                }
+        }
+        LOGIF(LT, (skygw_log_write(
+                LOGFILE_TRACE,
+                "%lu [execute_sescmd_in_backend] Routed %d session commands "
+                "to %s:%d in one write.",
+                pthread_self(),
+                nchained,
+                backend_ref->bref_backend->backend_server->name,
+                backend_ref->bref_backend->backend_server->port)));
+return_succp:
+	return succp;
+}
+
+/**
+ * Write a session command to a backend
+ *
+ * Router session must be locked.
+ *
+ * @param bref	Backend reference
+ * @param scmd	The session command
+ *
+ * @return true if the command was written or queued to the backend
+ */
+static bool sescmd_write(
+        backend_ref_t*  bref,
+        mysql_sescmd_t* scmd)
+{
+        int rc;
+
+        /** 
+         * Mark session command buffer, it triggers writing 
+         * MySQL command to protocol
+         */
+        gwbuf_set_type(scmd->my_sescmd_buf, GWBUF_TYPE_SESCMD);
+#if defined(SS_DEBUG)
+        LOGIF(LT, tracelog_routed_query(bref->bref_sescmd_cur.scmd_cur_rses,
+                                        "execute_sescmd_in_backend", 
+                                        bref, 
+                                        gwbuf_clone(scmd->my_sescmd_buf)));
+#endif /*< SS_DEBUG */
+        rc = bref_write(bref->bref_sescmd_cur.scmd_cur_rses,
+                        bref,
+                        gwbuf_clone(scmd->my_sescmd_buf));
+
+        LOGIF(LT, (skygw_log_write_flush(
+                LOGFILE_TRACE,
+                "%lu [execute_sescmd_in_backend] Routed %s cmd %p.",
+                pthread_self(),
+                STRPACKETTYPE(scmd->my_sescmd_packet_type),
+                scmd)));
+
+        return rc == 1;
+}
+
+
+/**
+ * Moves cursor to next property and copied address of its sescmd to cursor.
+ * Current propery must be non-null.
+ * If current property is the last on the list, *scur->scmd_ptr_property == NULL
+ * 
+ * Router session must be locked 
+ */
+static bool sescmd_cursor_next(
+	sescmd_cursor_t* scur)
+{
+	bool             succp = false;
+	rses_property_t* prop_curr;
+	rses_property_t* prop_next;
+
+        ss_dassert(scur != NULL);
+        ss_dassert(*(scur->scmd_cur_ptr_property) != NULL);
+        ss_dassert(RSES_IS_LOCKED((*(scur->scmd_cur_ptr_property))->rses_prop_rsession));
+
+        /** Illegal situation */
+	if (scur == NULL ||
+           *scur->scmd_cur_ptr_property == NULL ||
+            scur->scmd_cur_cmd == NULL)
+	{
+		/** Log error */
+		goto return_succp;
+	}
+	prop_curr = *(scur->scmd_cur_ptr_property);
+
+        CHK_MYSQL_SESCMD(scur->scmd_cur_cmd);
+        ss_dassert(prop_curr == mysql_sescmd_get_property(scur->scmd_cur_cmd));
+        CHK_RSES_PROP(prop_curr);
+
+        /** Copy address of pointer to next property */
+        scur->scmd_cur_ptr_property = &(prop_curr->rses_prop_next);
+        prop_next = *scur->scmd_cur_ptr_property;
+        ss_dassert(prop_next == *(scur->scmd_cur_ptr_property));
+        
+        
+	/** If there is a next property move forward */
+	if (prop_next != NULL)
+	{
+                CHK_RSES_PROP(prop_next);
+                CHK_RSES_PROP((*(scur->scmd_cur_ptr_property)));
+
+                /** Get pointer to next property's sescmd */
+                scur->scmd_cur_cmd = rses_property_get_sescmd(prop_next);
+
+                ss_dassert(prop_next == scur->scmd_cur_cmd->my_sescmd_prop);                
+                CHK_MYSQL_SESCMD(scur->scmd_cur_cmd);
+                CHK_RSES_PROP(scur->scmd_cur_cmd->my_sescmd_prop);
+	}
+	else
+	{
+		/** No more properties, can't proceed. */
+		goto return_succp;
+	}
+
+	if (scur->scmd_cur_cmd != NULL)
+	{
+                succp = true;
+        }
+        else
+        {
+                ss_dassert(false); /*< Log error, sescmd shouldn't be NULL */
+        }
+return_succp:
+	return succp;
+}
+
+static rses_property_t* mysql_sescmd_get_property(
+	mysql_sescmd_t* scmd)
+{
+	CHK_MYSQL_SESCMD(scmd);
+	return scmd->my_sescmd_prop;
+}
+
+static void tracelog_routed_query(
+        ROUTER_CLIENT_SES* rses,
+        char*              funcname,
+        backend_ref_t*     bref,
+        GWBUF*             buf)
+{
+        uint8_t*       packet = GWBUF_DATA(buf);
+        unsigned char  packet_type = packet[4];
+        size_t         len;
+        size_t         buflen = GWBUF_LENGTH(buf);
+        char*          querystr;
+        char*          startpos = (char *)&packet[5];
+        BACKEND*       b;
+        backend_type_t be_type;
+        DCB*           dcb;
+        
+        CHK_BACKEND_REF(bref);
+        b = bref->bref_backend;
+        CHK_BACKEND(b);
+        dcb = bref->bref_dcb;
+        CHK_DCB(dcb);
+        
+        be_type = BACKEND_TYPE(b);
+
+        if (GWBUF_IS_TYPE_MYSQL(buf))
+        {
+                len  = packet[0];
+                len += 256*packet[1];
+                len += 256*256*packet[2];
+                
+                if (packet_type == '\x03') 
+                {
+                        querystr = (char *)malloc(len);
+                        memcpy(querystr, startpos, len-1);
+                        querystr[len-1] = '\0';
+                        LOGIF(LT, (skygw_log_write_flush(
+                                LOGFILE_TRACE,
+                                "%lu [%s] %d bytes long buf, \"%s\" -> %s:%d %s dcb %p",
+                                pthread_self(),
+                                funcname,
+                                buflen,
+                                querystr,
+                                b->backend_server->name,
+                                b->backend_server->port, 
+                                STRBETYPE(be_type),
+                                dcb)));
+                        free(querystr);
+                }
+                else if (packet_type == '\x22' || 
+                        packet_type == 0x22 || 
+                        packet_type == '\x26' || 
+                        packet_type == 0x26 ||
+                        true)
+                {
+                        querystr = (char *)malloc(len);
+                        memcpy(querystr, startpos, len-1);
+                        querystr[len-1] = '\0';
+                        LOGIF(LT, (skygw_log_write_flush(
+                                LOGFILE_TRACE,
+                                "%lu [%s] %d bytes long buf, \"%s\" -> %s:%d %s dcb %p",
+                                pthread_self(),
+                                funcname,
+                                buflen,
+                                querystr,
+                                b->backend_server->name,
+                                b->backend_server->port, 
+                                STRBETYPE(be_type),
+                                dcb)));
+                        free(querystr);                        
+                }
+        }
+        gwbuf_free(buf);
+}
+
+
+/**
+ * Return rc, rc < 0 if router session is closed. rc == 0 if there are no 
+ * capabilities specified, rc > 0 when there are capabilities.
+ */ 
+static uint8_t getCapabilities (
+        ROUTER* inst,
+        void*   router_session)
+{
+        ROUTER_CLIENT_SES* rses = (ROUTER_CLIENT_SES *)router_session;
+        uint8_t            rc;
+        
+        if (!rses_begin_locked_router_action(rses))
+        {
+                rc = 0xff;
+                goto return_rc;
+        }
+        rc = rses->rses_capabilities;
+        
+        rses_end_locked_router_action(rses);
+        
+return_rc:
+        return rc;
+}
+
+/**
+ * Execute in backends used by current router session.
+ * Save session variable commands to router session property
+ * struct. Thus, they can be replayed in backends which are 
+ * started and joined later.
+ * 
+ * Suppress redundant OK packets sent by backends.
+ * 
+ * The first OK packet is replied to the client.
+ * Return true if succeed, false is returned if router session was closed or
+ * if execute_sescmd_in_backend failed.
+ */
+static bool route_session_write(
+        ROUTER_CLIENT_SES* router_cli_ses,
+        GWBUF*             querybuf,
+        ROUTER_INSTANCE*   inst,
+        unsigned char      packet_type,
+        skygw_query_type_t qtype)
+{
+        bool              succp;
+        rses_property_t*  prop;
+        backend_ref_t*    backend_ref;
+        int               i;
+  
+        LOGIF(LT, (skygw_log_write(
+                LOGFILE_TRACE,
+                "Session write, query type\t%s, packet type %s, "
+                "routing to all servers.",
+                STRQTYPE(qtype),
+                STRPACKETTYPE(packet_type))));
+
+        backend_ref = router_cli_ses->rses_backend_ref;
+        
+        /**
+         * These are one-way messages and server doesn't respond to them.
+         * Therefore reply processing is unnecessary and session 
+         * command property is not needed. It is just routed to all available
+         * backends.
+         */
+        if (packet_type == MYSQL_COM_STMT_SEND_LONG_DATA ||
+                packet_type == MYSQL_COM_QUIT ||
+                packet_type == MYSQL_COM_STMT_CLOSE)
+        {
+                int rc;
+               
+                succp = true;
+                
+                /** Lock router session */
+                if (!rses_begin_locked_router_action(router_cli_ses))
+                {
+                        succp = false;
+                        goto return_succp;
+                }
+                                
+                for (i=0; i<router_cli_ses->rses_nbackends; i++)
+                {
+                        if (BREF_IS_IN_USE((&backend_ref[i])))
+                        {
+                                rc = bref_write(router_cli_ses,
+                                                &backend_ref[i],
+                                                gwbuf_clone(querybuf));
+                        
+                                if (rc != 1)
+                                {
+                                        succp = false;
+                                }
+                        }
+                }
+                rses_end_locked_router_action(router_cli_ses);
+                gwbuf_free(querybuf);
+                goto return_succp;
+        }
+        /** Lock router session */
+        if (!rses_begin_locked_router_action(router_cli_ses))
+        {
+                rses_property_done(prop);
+                succp = false;
+                goto return_succp;
+        }        
+        /** 
+         * Additional reference is created to querybuf to 
+         * prevent it from being released before properties
+         * are cleaned up as a part of router sessionclean-up.
+         */
+        prop = rses_property_init(RSES_PROP_TYPE_SESCMD);
+        mysql_sescmd_init(prop, querybuf, packet_type, router_cli_ses);
+        
+        /**
+         * A SET of the value the variable already has is answered here,
+         * the backends and the history are left as they are.
+         */
+        if (router_cli_ses->rses_config.rw_skip_redundant_sescmd &&
+                sescmd_is_redundant(router_cli_ses, &prop->rses_prop_data.sescmd) &&
+                rses_is_idle(router_cli_ses))
+        {
+                GWBUF* okbuf;
+                int    status = 0;
+
+                if (router_cli_ses->rses_autocommit_enabled)
+                {
+                        status |= SERVER_STATUS_AUTOCOMMIT;
+                }
+                if (router_cli_ses->rses_transaction_active)
+                {
+                        status |= SERVER_STATUS_IN_TRANS;
+                }
+                if ((okbuf = modutil_create_mysql_ok(1, status)) != NULL)
+                {
+                        /** Frees querybuf */
+                        rses_property_done(prop);
+                        rses_end_locked_router_action(router_cli_ses);
+
+                        LOGIF(LT, (skygw_log_write(
+                                LOGFILE_TRACE,
+                                "Session command doesn't change the session "
+                                "state, replied by the router.")));
+                        ts_stats_add(inst->stats, RWSPLIT_N_SESCMD_SKIPPED, 1);
+                        route_count(inst, NULL, RWSPLIT_R_LOCAL);
+                        SESSION_ROUTE_REPLY(router_cli_ses->rses_session, okbuf);
+                        succp = true;
+                        goto return_succp;
+                }
+        }
+        /** Add sescmd property to router client session */
+        rses_property_add(router_cli_ses, prop);
+        /** Drop commands the new one makes unnecessary */
+        sescmd_history_compact(router_cli_ses, inst);
+         
+        for (i=0; i<router_cli_ses->rses_nbackends; i++)
+        {
+                if (BREF_IS_IN_USE((&backend_ref[i])))
+                {
+                        sescmd_cursor_t* scur;
+                        
+                        scur = backend_ref_get_sescmd_cursor(&backend_ref[i]);
+                        
+                        /** 
+                         * Add one waiter to backend reference.
+                         */
+                        bref_set_state(get_bref_from_dcb(router_cli_ses, 
+                                                         backend_ref[i].bref_dcb), 
+                                       BREF_WAITING_RESULT);
+                        route_count(inst, &backend_ref[i], RWSPLIT_R_SESCMD);
+                        /** 
+                         * Start execution if cursor is not already executing.
+                         * Otherwise, the command is pipelined after the
+                         * commands the cursor is executing.
+                         */
+                        if (sescmd_cursor_is_active(scur))
+                        {
+                                LOGIF(LT, (skygw_log_write(
+                                        LOGFILE_TRACE,
+                                        "Backend %s:%d already executing sescmd.",
+                                        backend_ref[i].bref_backend->backend_server->name,
+                                        backend_ref[i].bref_backend->backend_server->port)));
+                                
+                                succp = sescmd_write(&backend_ref[i],
+                                                     &prop->rses_prop_data.sescmd);
+                        }
+                        else
+                        {
+                                succp = execute_sescmd_in_backend(&backend_ref[i]);
+                                
+                                if (!succp)
+                                {
+                                        LOGIF(LE, (skygw_log_write_flush(
+                                                LOGFILE_ERROR,
+                                                "Error : Failed to execute session "
+                                                "command in %s:%d",
+                                                backend_ref[i].bref_backend->backend_server->name,
+                                                backend_ref[i].bref_backend->backend_server->port)));
+                                }
+                        }
+                }
+        }
+        /** Unlock router session */
+        rses_end_locked_router_action(router_cli_ses);
+        
+        ts_stats_add(inst->stats, RWSPLIT_N_ALL, 1);
+        
+return_succp:
+        return succp;
+}
+
+#if defined(NOT_USED)
+static bool router_option_configured(
+        ROUTER_INSTANCE* router,
+        const char*      optionstr,
+        void*            data)
+{
+        bool   succp = false;
+        char** option;
+        
+        option = router->service->routerOptions;
+        
+        while (option != NULL)
+        {
+                char*  value;
+
+                if ((value = strchr(options[i], '=')) == NULL)
+                {
+                        break;
+                }
+                else
+                {
+                        *value = 0;
+                        value++;
+                        if (strcmp(options[i], "slave_selection_criteria") == 0)
+                        {
+                                if (GET_SELECT_CRITERIA(value) == (select_criteria_t *)*data)
+                                {
+                                        succp = true;
+                                        break;
+                                }
+                        }
+                }
+        }
+        return succp;
+}
+#endif /*< NOT_USED */
+
+/**
+ * The value of a boolean router option, true, yes, on or a number other
+ * than zero turn the option on.
+ *
+ * @param value	The value of the option
+ *
+ * @return true if the option is turned on
+ */
+static bool rwsplit_option_truth(
+        char* value)
+{
+        return (strcasecmp(value, "true") == 0 ||
+                strcasecmp(value, "yes") == 0 ||
+                strcasecmp(value, "on") == 0 ||
+                atoi(value) != 0);
+}
+
+static void rwsplit_process_router_options(
+        ROUTER_INSTANCE* router,
+        char**           options)
+{
+        int               i;
+        char*             value;
+        select_criteria_t c;
+        
+        for (i = 0; options[i]; i++)
+        {
+                if ((value = strchr(options[i], '=')) == NULL)
+                {
+                        LOGIF(LE, (skygw_log_write(
+                                LOGFILE_ERROR, "Warning : Unsupported "
+                                "router option \"%s\" for "
+                                "readwritesplit router.",
+                                options[i])));
+                }
+                else
+                {
+                        *value = 0;
+                        value++;
+                        if (strcmp(options[i], "slave_selection_criteria") == 0)
+                        {
+                                c = GET_SELECT_CRITERIA(value);
+                                ss_dassert(
+                                        c == LEAST_GLOBAL_CONNECTIONS ||
+                                        c == LEAST_ROUTER_CONNECTIONS ||
+                                        c == LEAST_BEHIND_MASTER ||
+                                        c == LEAST_CURRENT_OPERATIONS ||
+                                        c == LEAST_RESPONSE_TIME ||
+                                        c == UNDEFINED_CRITERIA);
+                               
+                                if (c == UNDEFINED_CRITERIA)
+                                {
+                                        LOGIF(LE, (skygw_log_write(
+                                                LOGFILE_ERROR, "Warning : Unknown "
+                                                "slave selection criteria \"%s\". "
+                                                "Allowed values are LEAST_GLOBAL_CONNECTIONS, "
+                                                "LEAST_ROUTER_CONNECTIONS, "
+                                                "LEAST_BEHIND_MASTER, "
+                                                "LEAST_CURRENT_OPERATIONS "
+                                                "and LEAST_RESPONSE_TIME.",
+                                                STRCRITERIA(router->rwsplit_config.rw_slave_select_criteria))));
+                                }
+                                else
+                                {
+                                        router->rwsplit_config.rw_slave_select_criteria = c;
+                                }
+                        }
+                        else if (strcmp(options[i], "backend_reply_timeout") == 0)
+                        {
+                                router->rwsplit_config.rw_backend_reply_timeout = atoi(value);
+                        }
+                        else if (strcmp(options[i], "causal_reads") == 0)
+                        {
+                                router->rwsplit_config.rw_causal_reads = atoi(value);
+                        }
+                        else if (strcmp(options[i], "max_sescmd_history") == 0)
+                        {
+                                router->rwsplit_config.rw_max_sescmd_history = atoi(value);
+                        }
+                        else if (strcmp(options[i], "multiplex") == 0)
+                        {
+                                router->rwsplit_config.rw_multiplex =
+                                        rwsplit_option_truth(value);
+                        }
+                        else if (strcmp(options[i], "retry_reads") == 0)
+                        {
+                                router->rwsplit_config.rw_retry_reads = atoi(value);
+                        }
+                        else if (strcmp(options[i], "max_slave_replication_lag_ms") == 0)
+                        {
+                                router->rwsplit_config.rw_max_slave_replication_lag_ms = atoi(value);
+                        }
+                        else if (strcmp(options[i], "table_consistency") == 0)
+                        {
+                                router->rwsplit_config.rw_table_consistency = atoi(value);
+                        }
+                        else if (strcmp(options[i], "lazy_connect") == 0)
+                        {
+                                router->rwsplit_config.rw_lazy_connect =
+                                        rwsplit_option_truth(value);
+                        }
+                        else if (strcmp(options[i], "statement_balance") == 0)
+                        {
+                                router->rwsplit_config.rw_statement_balance =
+                                        rwsplit_option_truth(value);
+                        }
+                        else if (strcmp(options[i], "read_your_writes_window") == 0)
+                        {
+                                router->rwsplit_config.rw_read_your_writes_window = atoi(value);
+                        }
+                        else if (strcmp(options[i], "skip_redundant_sescmd") == 0)
+                        {
+                                router->rwsplit_config.rw_skip_redundant_sescmd =
+                                        rwsplit_option_truth(value);
+                        }
+                        else if (strcmp(options[i], "local_reads") == 0)
+                        {
+                                router->rwsplit_config.rw_local_reads =
+                                        rwsplit_option_truth(value);
+                        }
+                        else if (strcmp(options[i], "adaptive_slaves") == 0)
+                        {
+                                router->rwsplit_config.rw_adaptive_slaves = atoi(value);
+                        }
+                        else if (strcmp(options[i], "master_failover_wait") == 0)
+                        {
+                                router->rwsplit_config.rw_master_failover_wait = atoi(value);
+                        }
+                        else if (strcmp(options[i], "dynamic_weights") == 0)
+                        {
+                                router->rwsplit_config.rw_dynamic_weights =
+                                        rwsplit_option_truth(value);
+                        }
+                        else if (strcmp(options[i], "slow_start") == 0)
+                        {
+                                router->rwsplit_config.rw_slow_start = atoi(value);
+                        }
+                }
+        } /*< for */
+}
+
+/**
+ * Error Handler routine to resolve backend failures. If it succeeds then there
+ * are enough operative backends available and connected. Otherwise it fails, 
+ * and session is terminated.
+ *
+ * @param       instance        The router instance
+ * @param       router_session  The router session
+ * @param       message         The error message to reply
+ * @param       backend_dcb     The backend DCB
+ * @param       action          The action: REPLY, REPLY_AND_CLOSE, NEW_CONNECTION
+ * @param       succp           Result of action. 
+ * 
+ * Even if succp == true connecting to new slave may have failed. succp is to
+ * tell whether router has enough master/slave connections to continue work.
+ */
+
+static void handleError (
+        ROUTER*        instance,
+        void*          router_session,
+        GWBUF*         errmsgbuf,
+        DCB*           backend_dcb,
+        error_action_t action,
+        bool*          succp)
+{
+        SESSION*           session;
+        ROUTER_INSTANCE*   inst    = (ROUTER_INSTANCE *)instance;
+        ROUTER_CLIENT_SES* rses    = (ROUTER_CLIENT_SES *)router_session;
+      
+        CHK_DCB(backend_dcb);
+#if defined(SS_DEBUG)
+        backend_dcb->dcb_errhandle_called = true;
+#endif
+        session = backend_dcb->session;
+        
+        if (session != NULL)
+                CHK_SESSION(session);
+        
+        switch (action) {
+                case ERRACT_NEW_CONNECTION:
+                {
+                        if (rses != NULL)
+                                CHK_CLIENT_RSES(rses);
+                        
+                        if (!rses_begin_locked_router_action(rses))
+                        {
+                                *succp = false;
+                                return;
+                        }
+                        
+                        *succp = handle_error_new_connection(inst, 
+                                                             rses, 
+                                                             backend_dcb, 
+                                                             errmsgbuf);
+                        rses_end_locked_router_action(rses);
+                        break;
+                }
+                
+                case ERRACT_REPLY_CLIENT:
+                {
+                        *succp = handle_error_reply_client(session, errmsgbuf);
+                        break;       
+                }
+                
+                default:
+                        *succp = false;
+                        break;
+        }
+}
+
+
+static bool handle_error_reply_client(
+        SESSION* ses,
+        GWBUF*   errmsg)
+{
+        session_state_t sesstate;
+        DCB*            client_dcb;
+        bool            succp;
+
+        spinlock_acquire(&ses->ses_lock);
+        sesstate = ses->state;
+        client_dcb = ses->client;
+        spinlock_release(&ses->ses_lock);
+
+        if (sesstate == SESSION_STATE_ROUTER_READY)
+        {
+                CHK_DCB(client_dcb);
+                client_dcb->func.write(client_dcb, errmsg);
+        }
+        succp = false; /** false because new servers aren's selected. */
+
+        return succp;
+}
+
+/**
+ * This must be called with router lock
+ */
+static bool handle_error_new_connection(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses,
+        DCB*               backend_dcb,
+        GWBUF*             errmsg)
+{
+        SESSION*       ses;
+        int            router_nservers;
+        int            max_nslaves;
+        int            max_slave_rlag;
+        backend_ref_t* bref;
+        bool           succp;
+        bool           retry = false;
+        bool           replied = false;
+        
+        ss_dassert(RSES_IS_LOCKED(rses));
+        
+        ses = backend_dcb->session;
+        CHK_SESSION(ses);
+        
+        bref = get_bref_from_dcb(rses, backend_dcb);
+        
+        /** failed DCB has already been replaced */
+        if (bref == NULL)
+        {
+                succp = true;
+                goto return_succp;
+        }
+        /** 
+         * Error handler is already called for this DCB because
+         * it's not polling anymore. It can be assumed that
+         * it succeed because rses isn't closed.
+         */
+        if (backend_dcb->state != DCB_STATE_POLLING)
+        {
+                succp = true;
+                goto return_succp;
+        }
+        
+        CHK_BACKEND_REF(bref);
+        
+        /** The client gets the error instead of a held reply or read */
+        if (BREF_IS_CAUSAL(bref))
+        {
+                if (bref->bref_state & BREF_CAUSAL_WAIT)
+                {
+                        causal_buf_free(rses->rses_causal_query);
+                        rses->rses_causal_query = NULL;
+                }
+                else
+                {
+                        if (rses->rses_causal_reply != NULL)
+                        {
+                                causal_buf_free(rses->rses_causal_reply);
+                                rses->rses_causal_reply = NULL;
+                        }
+                        rses->rses_causal_unknown = true;
+                }
+                if (bref->bref_causal_buf != NULL)
+                {
+                        causal_buf_free(bref->bref_causal_buf);
+                        bref->bref_causal_buf = NULL;
+                }
+                bref_clear_state(bref, BREF_CAUSAL_STATES);
+        }
+        prep_stmt_backend_failed(rses, bref);
+        /** A failure halves the dynamic weight until it decays */
+        atomic_add(&bref->bref_backend->be_errors, 1);
+        
+        /** 
+         * A read the client has got nothing of yet is resent to another
+         * backend, if there is time left, instead of replying the error.
+         */
+        if (rses->rses_retry_query != NULL && rses->rses_retry_bref == bref)
+        {
+                retry = BREF_IS_WAITING_RESULT(bref) &&
+                        (response_clock() - rses->rses_retry_usec <
+                         (unsigned long)rses->rses_config.rw_retry_reads * 1000000);
+
+                if (!retry)
+                {
+                        rses_retry_clear(rses);
+                }
+        }
+        if (BREF_IS_WAITING_RESULT(bref))
+        {
+                if (!retry)
+                {
+                        DCB* client_dcb;
+                        client_dcb = ses->client;
+                        client_dcb->func.write(client_dcb, errmsg);
+                        errmsg = NULL;
+                        replied = true;
+                }
+        }
+        /** The statements pipelined to the backend are lost with it */
+        while (BREF_IS_WAITING_RESULT(bref))
+        {
+                bref_clear_state(bref, BREF_WAITING_RESULT);
+        }
+        bref_clear_pipeline(bref);
+        bref_clear_state(bref, BREF_IN_USE);
+        bref_clear_state(bref, BREF_QUERY_ACTIVE);
+        bref_set_state(bref, BREF_CLOSED);
+        /** The error held for a session command is the reply if none is left */
+        sescmd_held_release(rses, replied);
+        /** 
+         * Remove callback because this DCB won't be used 
+         * unless it is reconnected later, and then the callback
+         * is set again.
+         */
+        dcb_remove_callback(backend_dcb, 
+                            DCB_REASON_NOT_RESPONDING, 
+                            &router_handle_state_switch, 
+                            (void *)bref);
+        
+        /** 
+         * A new backend couldn't be given the session state if commands
+         * have been dropped from the history.
+         */
+        if (rses->rses_sescmd_truncated)
+        {
+                LOGIF(LT, (skygw_log_write(
+                        LOGFILE_TRACE,
+                        "Session command history is truncated, failed "
+                        "backend isn't replaced.")));
+                succp = (rses->rses_master_ref != NULL &&
+                         BREF_IS_IN_USE(rses->rses_master_ref));
+                goto return_succp;
+        }
+        /**
+         * With master_failover_wait the session waits for a new master
+         * instead of failing. A transaction in progress is lost with the
+         * master, so its session fails as before.
+         */
+        if (bref == rses->rses_master_ref &&
+                rses->rses_config.rw_master_failover_wait > 0 &&
+                !rses->rses_transaction_active)
+        {
+                succp = failover_begin(inst, rses);
+                goto return_succp;
+        }
+        /** Backends are chosen again once the new master is found */
+        if (rses->rses_failover_usec != 0)
+        {
+                succp = true;
+                goto return_succp;
+        }
+        router_nservers = router_get_servercount(inst);
+        max_nslaves     = rses_get_slave_target(rses, router_nservers);
+        max_slave_rlag  = rses_get_max_replication_lag(rses);
+        /** 
+         * Try to get replacement slave or at least the minimum 
+         * number of slave connections for router session.
+         */
+        succp = select_connect_backend_servers(
+                        &rses->rses_master_ref,
+                        rses->rses_backend_ref,
+                        router_nservers,
+                        max_nslaves,
+                        max_slave_rlag,
+                        rses->rses_config.rw_slave_select_criteria,
+                        ses,
+                        inst);
+
+return_succp:
+        if (retry)
+        {
+                if (succp && rses_retry_read(inst, rses))
+                {
+                        gwbuf_free(errmsg);
+                }
+                else if (errmsg != NULL && ses->client != NULL)
+                {
+                        ses->client->func.write(ses->client, errmsg);
+                }
+        }
+        return succp;        
+}
+
+
+static void print_error_packet(
+        ROUTER_CLIENT_SES* rses, 
+        GWBUF*             buf, 
+        DCB*               dcb)
+{
+#if defined(SS_DEBUG)
+        if (GWBUF_IS_TYPE_MYSQL(buf))
+        {
+                while (gwbuf_length(buf) > 0)
+                {
+                        /** 
+                         * This works with MySQL protocol only ! 
+                         * Protocol specific packet print functions would be nice.
+                         */
+                        uint8_t* ptr = GWBUF_DATA(buf);
+                        size_t   len = MYSQL_GET_PACKET_LEN(ptr);
+                        
+                        if (MYSQL_GET_COMMAND(ptr) == 0xff)
+                        {
+                                SERVER*        srv = NULL;
+                                backend_ref_t* bref = rses->rses_backend_ref;
+                                int            i;
+                                char*          bufstr;
+                                
+                                for (i=0; i<rses->rses_nbackends; i++)
+                                {
+                                        if (bref[i].bref_dcb == dcb)
+                                        {
+                                                srv = bref[i].bref_backend->backend_server;
+                                        }
+                                }
+                                ss_dassert(srv != NULL);
+                                
+                                bufstr = strndup(&ptr[7], len-3);
+                                
+                                LOGIF(LE, (skygw_log_write_flush(
+                                        LOGFILE_ERROR,
+                                        "Error : Backend server %s:%d responded with "
+                                        "error : %s",
+                                        srv->name,
+                                        srv->port,
+                                        bufstr)));                
+                                free(bufstr);
+                        }
+                        buf = gwbuf_consume(buf, len+4);
+                }
+        }
+        else
+        {
+                while ((buf = gwbuf_consume(buf, GWBUF_LENGTH(buf))) != NULL);
+        }
+#endif /*< SS_DEBUG */
+}
+
+static int router_get_servercount(
+        ROUTER_INSTANCE* inst)
+{
+        int       router_nservers = 0;
+        BACKEND** b = inst->servers;
+        /** count servers */
+        while (*(b++) != NULL) router_nservers++;
+                                                                
+        return router_nservers;
+}
+
+static bool have_enough_servers(
+        ROUTER_CLIENT_SES** p_rses,
+        const int           min_nsrv,
+        int                 router_nsrv,
+        ROUTER_INSTANCE*    router)
+{
+        bool succp;
+        
+        /** With too few servers session is not created */
+        if (router_nsrv < min_nsrv || 
+                MAX((*p_rses)->rses_config.rw_max_slave_conn_count, 
+                    (router_nsrv*(*p_rses)->rses_config.rw_max_slave_conn_percent)/100)
+                        < min_nsrv)
+        {
+                if (router_nsrv < min_nsrv)
+                {
+                        LOGIF(LE, (skygw_log_write_flush(
+                                LOGFILE_ERROR,
+                                "Error : Unable to start %s service. There are "
+                                "too few backend servers available. Found %d "
+                                "when %d is required.",
+                                router->service->name,
+                                router_nsrv,
+                                min_nsrv)));
+                }
+                else
+                {
+                        double pct = (*p_rses)->rses_config.rw_max_slave_conn_percent/100;
+                        double nservers = (double)router_nsrv*pct;
+                        
+                        if ((*p_rses)->rses_config.rw_max_slave_conn_count < min_nsrv)
+                        {
+                                LOGIF(LE, (skygw_log_write_flush(
+                                        LOGFILE_ERROR,
+                                        "Error : Unable to start %s service. There are "
+                                        "too few backend servers configured in "
+                                        "MaxScale.cnf. Found %d when %d is required.",
+                                        router->service->name,
+                                        (*p_rses)->rses_config.rw_max_slave_conn_count,
+                                        min_nsrv)));
+                        }
+                        if (nservers < min_nsrv)
+                        {
+                                LOGIF(LE, (skygw_log_write_flush(
+                                        LOGFILE_ERROR,
+                                        "Error : Unable to start %s service. There are "
+                                        "too few backend servers configured in "
+                                        "MaxScale.cnf. Found %d%% when at least %.0f%% "
+                                        "would be required.",
+                                        router->service->name,
+                                        (*p_rses)->rses_config.rw_max_slave_conn_percent,
+                                        min_nsrv/(((double)router_nsrv)/100))));
+                        }
+                }
+                free(*p_rses);
+                *p_rses = NULL;
+                succp = false;
+        }
+        else
+        {
+                succp = true;
+        }
+        return succp;
+}
+
+/** 
+ * Find out the number of read backend servers.
+ * Depending on the configuration value type, either copy direct count 
+ * of slave connections or calculate the count from percentage value.
+ */
+static int rses_get_max_slavecount(
+        ROUTER_CLIENT_SES* rses,
+        int                router_nservers)
+{
+        int conf_max_nslaves;
+        int max_nslaves;
+        
+        CHK_CLIENT_RSES(rses);
+        
+        if (rses->rses_config.rw_max_slave_conn_count > 0)
+        {
+                conf_max_nslaves = rses->rses_config.rw_max_slave_conn_count;
+        }
+        else
+        {
+                conf_max_nslaves = 
+                (router_nservers*rses->rses_config.rw_max_slave_conn_percent)/100;
+        }
+        max_nslaves = MIN(router_nservers-1, MAX(1, conf_max_nslaves));
+        
+        return max_nslaves;
+}
+
+
+static int rses_get_max_replication_lag(
+        ROUTER_CLIENT_SES* rses)
+{
+        int conf_max_rlag;
+        
+        CHK_CLIENT_RSES(rses);
+        
+        /** if there is no configured value, then longest possible int is used */
+        if (rses->rses_config.rw_max_slave_replication_lag > 0)
+        {
+                conf_max_rlag = rses->rses_config.rw_max_slave_replication_lag;
+        }
+        else
+        {
+                conf_max_rlag = ~(1<<31);
+        }
+        
+        return conf_max_rlag;
+}
+
+/**
+ * Return the maximum replication lag a read allows for the slave it is
+ * sent to, given in seconds in a max_slave_replication_lag parameter hint
+ * of the statement, or else the max_slave_replication_lag_ms router option.
+ * The max_slave_replication_lag of the router is applied when the slaves
+ * are connected, this bound is checked for each read against the current
+ * lag of the connected slaves.
+ *
+ * @param rses		Router client session
+ * @param querybuf	The read
+ *
+ * @return The bound in milliseconds or -1 if the read has none
+ */
+static int get_query_max_rlag(
+        ROUTER_CLIENT_SES* rses,
+        GWBUF*             querybuf)
+{
+        char* value;
+
+        value = hint_parameter(hint_get(querybuf), "max_slave_replication_lag");
+
+        if (value != NULL && isdigit(*value))
+        {
+                return atoi(value) * 1000;
+        }
+        if (rses->rses_config.rw_max_slave_replication_lag_ms > 0)
+        {
+                return rses->rses_config.rw_max_slave_replication_lag_ms;
+        }
+        return -1;
+}
+
+
+static backend_ref_t* get_bref_from_dcb(
+        ROUTER_CLIENT_SES* rses,
+        DCB*               dcb)
+{
+        backend_ref_t* bref;
+        int            i = 0;
+        CHK_DCB(dcb);
+        CHK_CLIENT_RSES(rses);
+        
+        bref = rses->rses_backend_ref;
+        
+        while (i<rses->rses_nbackends)
+        {
+                if (bref->bref_dcb == dcb)
+                {
+                        break;
+                }
+                bref++;
+                i += 1;
+        }
+        
+        if (i == rses->rses_nbackends)
+        {
+                bref = NULL;
+        }
+        return bref;
+}
+
+static int router_handle_state_switch(
+        DCB*       dcb,
+        DCB_REASON reason,
+        void*      data)
+{
+        backend_ref_t*     bref;
+        int                rc = 1;
+        ROUTER_CLIENT_SES* rses;
+        SESSION*           ses;
+        SERVER*            srv;
+        
+        CHK_DCB(dcb);
+        bref = (backend_ref_t *)data;
+        CHK_BACKEND_REF(bref);
+       
+        srv = bref->bref_backend->backend_server;
+        
+        if (SERVER_IS_RUNNING(srv) && SERVER_IS_IN_CLUSTER(srv))
+        {
+                goto return_rc;
+        }
+        ses = dcb->session;
+        CHK_SESSION(ses);
+
+        rses = (ROUTER_CLIENT_SES *)dcb->session->router_session;
+        CHK_CLIENT_RSES(rses);
+
+        switch (reason) {
+                case DCB_REASON_NOT_RESPONDING:
+                        /**
+                         * A pinned session must not be handled by another
+                         * thread, shutting the socket down makes the owner
+                         * thread see the hangup and handle the error.
+                         */
+                        if (rses->rses_owner_thread >= 0 &&
+                            rses->rses_owner_thread != poll_owner_thread())
+                        {
+                                shutdown(dcb->fd, SHUT_RDWR);
+                        }
+                        else
+                        {
+                                dcb->func.hangup(dcb);
+                        }
+                        break;
+                        
+                default:
+                        break;
+        }
+        
+return_rc:
+        return rc;
+}
+
+static sescmd_cursor_t* backend_ref_get_sescmd_cursor (
+        backend_ref_t* bref)
+{
+        sescmd_cursor_t* scur;
+        CHK_BACKEND_REF(bref);
+        
+        scur = &bref->bref_sescmd_cur;
+        CHK_SESCMD_CUR(scur);
+        
+        return scur;
+}
+
+#define PREP_STMT_HASHSIZE 32
+
+/** Read and write the statement id of a COM_STMT_* packet or PREPARE_OK */
+#define PSTMT_GET_ID(data) ((uint32_t)(data)[5] |                       \
+                            ((uint32_t)(data)[6] << 8) |                \
+                            ((uint32_t)(data)[7] << 16) |               \
+                            ((uint32_t)(data)[8] << 24))
+
+static void pstmt_set_id(
+        uint8_t* data,
+        uint32_t id)
+{
+        data[5] = id & 0xff;
+        data[6] = (id >> 8) & 0xff;
+        data[7] = (id >> 16) & 0xff;
+        data[8] = (id >> 24) & 0xff;
+}
+
+static int prep_stmt_hashfn(
+        void* key)
+{
+        return *(int *)key;
+}
+
+static int prep_stmt_cmpfn(
+        void* v1,
+        void* v2)
+{
+        int i1 = *(int *)v1;
+        int i2 = *(int *)v2;
+
+        return (i1 < i2 ? -1 : (i1 > i2 ? 1 : 0));
+}
+
+/**
+ * Create a prepared statement of the binary protocol
+ *
+ * @param rses		Router client session
+ * @param buf		The COM_STMT_PREPARE packet, a reference is kept
+ * @param is_read	true if the statement is read-only
+ *
+ * @return The statement or NULL if out of memory
+ */
+static prep_stmt_t* prep_stmt_init(
+        ROUTER_CLIENT_SES* rses,
+        GWBUF*             buf,
+        bool               is_read)
+{
+        prep_stmt_t* pstmt;
+        
+        pstmt = (prep_stmt_t *)calloc(1, sizeof(prep_stmt_t));
+        
+        if (pstmt != NULL)
+        {
+#if defined(SS_DEBUG)
+                pstmt->pstmt_chk_top  = CHK_NUM_PREP_STMT;
+                pstmt->pstmt_chk_tail = CHK_NUM_PREP_STMT;
 #endif
-	
-return_prop:
-	CHK_RSES_PROP(prop);
-	return prop;
+                pstmt->pstmt_state = PREP_STMT_ALLOC;
+                pstmt->pstmt_type  = PREP_STMT_ID;
+                pstmt->pstmt_is_read = is_read;
+                pstmt->pstmt_backend = (prep_stmt_backend_t *)calloc(
+                        rses->rses_nbackends,
+                        sizeof(prep_stmt_backend_t));
+
+                if (pstmt->pstmt_backend == NULL)
+                {
+                        free(pstmt);
+                        return NULL;
+                }
+                pstmt->pstmt_buf = gwbuf_clone(buf);
+                CHK_PREP_STMT(pstmt);
+        }
+        return pstmt;
+}
+
+static void prep_stmt_done(
+        prep_stmt_t* pstmt)
+{
+        CHK_PREP_STMT(pstmt);
+        
+        if (pstmt->pstmt_type == PREP_STMT_NAME)
+        {
+                free(pstmt->pstmt_id.name);
+        }
+        if (pstmt->pstmt_buf != NULL)
+        {
+                gwbuf_free(pstmt->pstmt_buf);
+        }
+        free(pstmt->pstmt_types);
+        free(pstmt->pstmt_backend);
+        free(pstmt);
+}
+
+/**
+ * Find the prepared statement a COM_STMT_* packet of the client refers to
+ *
+ * Router session must be locked.
+ *
+ * @return The statement or NULL if the id isn't known
+ */
+static prep_stmt_t* prep_stmt_find(
+        ROUTER_CLIENT_SES* rses,
+        GWBUF*             querybuf)
+{
+        int id;
+
+        if (rses->rses_prep_stmt == NULL || GWBUF_LENGTH(querybuf) < 9)
+        {
+                return NULL;
+        }
+        id = PSTMT_GET_ID((uint8_t *)GWBUF_DATA(querybuf));
+        return (prep_stmt_t *)hashtable_fetch(rses->rses_prep_stmt, &id);
+}
+
+/**
+ * Add a prepared statement to the router session once it has an id
+ *
+ * Router session must be locked.
+ *
+ * @return true if the statement was added
+ */
+static bool prep_stmt_add(
+        ROUTER_CLIENT_SES* rses,
+        prep_stmt_t*       pstmt)
+{
+        if (rses->rses_prep_stmt == NULL &&
+                (rses->rses_prep_stmt = hashtable_alloc(PREP_STMT_HASHSIZE,
+                                                        prep_stmt_hashfn,
+                                                        prep_stmt_cmpfn)) == NULL)
+        {
+                return false;
+        }
+        if (!hashtable_add(rses->rses_prep_stmt, &pstmt->pstmt_id.seq, pstmt))
+        {
+                return false;
+        }
+        pstmt->pstmt_state = PREP_STMT_RECV;
+        pstmt->pstmt_next = rses->rses_prep_stmt_list;
+        rses->rses_prep_stmt_list = pstmt;
+        return true;
+}
+
+/**
+ * Remove a prepared statement from the router session and free it
+ *
+ * Router session must be locked.
+ */
+static void prep_stmt_drop(
+        ROUTER_CLIENT_SES* rses,
+        prep_stmt_t*       pstmt)
+{
+        prep_stmt_t** pp;
+
+        CHK_PREP_STMT(pstmt);
+        hashtable_delete(rses->rses_prep_stmt, &pstmt->pstmt_id.seq);
+
+        for (pp = &rses->rses_prep_stmt_list; *pp != NULL; pp = &(*pp)->pstmt_next)
+        {
+                if (*pp == pstmt)
+                {
+                        *pp = pstmt->pstmt_next;
+                        break;
+                }
+        }
+        pstmt->pstmt_state = PREP_STMT_DROPPED;
+        prep_stmt_done(pstmt);
+}
+
+/**
+ * Free all the prepared statements of a router session
+ */
+static void prep_stmt_free_all(
+        ROUTER_CLIENT_SES* rses)
+{
+        prep_stmt_t* pstmt;
+
+        while ((pstmt = rses->rses_prep_stmt_list) != NULL)
+        {
+                rses->rses_prep_stmt_list = pstmt->pstmt_next;
+                prep_stmt_done(pstmt);
+        }
+        if (rses->rses_prep_stmt != NULL)
+        {
+                hashtable_free(rses->rses_prep_stmt);
+                rses->rses_prep_stmt = NULL;
+        }
+        if (rses->rses_pstmt_prepare != NULL)
+        {
+                prep_stmt_done(rses->rses_pstmt_prepare);
+                rses->rses_pstmt_prepare = NULL;
+        }
+        if (rses->rses_pstmt_exec != NULL)
+        {
+                causal_buf_free(rses->rses_pstmt_exec);
+                rses->rses_pstmt_exec = NULL;
+        }
+}
+
+/**
+ * Forget the statements prepared in a backend that has failed. Another
+ * connection to it prepares them again when they are executed there.
+ *
+ * Router session must be locked.
+ */
+static void prep_stmt_backend_failed(
+        ROUTER_CLIENT_SES* rses,
+        backend_ref_t*     bref)
+{
+        prep_stmt_t* pstmt;
+        int          idx = bref - rses->rses_backend_ref;
+
+        for (pstmt = rses->rses_prep_stmt_list; pstmt != NULL; pstmt = pstmt->pstmt_next)
+        {
+                pstmt->pstmt_backend[idx].pb_id = 0;
+                pstmt->pstmt_backend[idx].pb_types_sent = false;
+
+                if (pstmt->pstmt_last_bref == bref)
+                {
+                        pstmt->pstmt_last_bref = NULL;
+                }
+        }
+        if (bref->bref_state & BREF_PSTMT_LAZY)
+        {
+                /** The client gets the error of the backend instead */
+                causal_buf_free(rses->rses_pstmt_exec);
+                rses->rses_pstmt_exec = NULL;
+        }
+        if ((bref->bref_state & BREF_PSTMT_PREPARE) &&
+                rses->rses_pstmt_prepare != NULL)
+        {
+                prep_stmt_done(rses->rses_pstmt_prepare);
+                rses->rses_pstmt_prepare = NULL;
+        }
+        if (bref->bref_pstmt_buf != NULL)
+        {
+                causal_buf_free(bref->bref_pstmt_buf);
+                bref->bref_pstmt_buf = NULL;
+        }
+        bref_clear_state(bref, BREF_PSTMT_PREPARE|BREF_PSTMT_LAZY);
+}
+
+/**
+ * Read a reply to COM_STMT_PREPARE. The reply is the PREPARE_OK packet
+ * followed by the parameter and the column definitions, both ended by an
+ * EOF packet.
+ *
+ * @param buf		The chain of reply buffers received so far
+ * @param id		out, the statement id of the backend
+ *
+ * @return 1 if the reply is complete, 0 if not and -1 if it is an error
+ */
+static int pstmt_read_prepare_ok(
+        GWBUF*    buf,
+        uint32_t* id)
+{
+        uint8_t* data;
+        uint8_t* ptr;
+        uint8_t* end;
+        int      total;
+        int      npackets = 0;
+        int      expected = 1;
+        int      ncolumns;
+        int      nparams;
+        int      rc = 0;
+
+        if ((data = reply_copy_chain(buf, &total)) == NULL)
+        {
+                return -1;
+        }
+        end = data + total;
+        ptr = data;
+
+        if (total >= 5 && data[4] != 0x00)
+        {
+                rc = -1;
+                goto return_rc;
+        }
+        if (total < 16)
+        {
+                goto return_rc;
+        }
+        *id = PSTMT_GET_ID(data);
+        ncolumns = data[9] | (data[10] << 8);
+        nparams  = data[11] | (data[12] << 8);
+        expected += (nparams > 0 ? nparams + 1 : 0) + (ncolumns > 0 ? ncolumns + 1 : 0);
+
+        while (ptr + 4 <= end &&
+                ptr + 4 + MYSQL_GET_PACKET_LEN(ptr) <= end)
+        {
+                ptr += 4 + MYSQL_GET_PACKET_LEN(ptr);
+                npackets += 1;
+        }
+        if (npackets >= expected)
+        {
+                rc = 1;
+        }
+return_rc:
+        free(data);
+        return rc;
 }
 
 /**
- * Property is freed at the end of router client session.
+ * Read the reply of the master to the COM_STMT_PREPARE of the client. The
+ * statement is given an id of the router, which replaces the id of the
+ * master in the reply before it is sent to the client.
+ *
+ * Router session must be locked.
+ *
+ * @param rses		Router client session
+ * @param bref		Backend reference of the master
+ * @param writebuf	The first buffer of the reply
  */
-static void rses_property_done(
-	rses_property_t* prop)
+static void pstmt_prepare_reply(
+        ROUTER_CLIENT_SES* rses,
+        backend_ref_t*     bref,
+        GWBUF*             writebuf)
 {
-	CHK_RSES_PROP(prop);
-	
-	switch (prop->rses_prop_type) {
-	case RSES_PROP_TYPE_SESCMD:
-		mysql_sescmd_done(&prop->rses_prop_data.sescmd);
-		break;
-	default:
-		LOGIF(LD, (skygw_log_write(
-                                   LOGFILE_DEBUG,
-                                   "%lu [rses_property_done] Unknown property type %d "
-                                   "in property %p",
-                                   pthread_self(),
-                                   prop->rses_prop_type,
-                                   prop)));
-		
-		ss_dassert(false);
-		break;
-	}
-	free(prop);
+        prep_stmt_t* pstmt = rses->rses_pstmt_prepare;
+        uint8_t*     data = (uint8_t *)GWBUF_DATA(writebuf);
+        int          idx = bref - rses->rses_backend_ref;
+
+        bref_clear_state(bref, BREF_PSTMT_PREPARE);
+        rses->rses_pstmt_prepare = NULL;
+
+        if (pstmt == NULL)
+        {
+                return;
+        }
+        if (GWBUF_LENGTH(writebuf) < 16 || data[4] != 0x00)
+        {
+                /** Error, or the header didn't arrive in one piece */
+                prep_stmt_done(pstmt);
+                return;
+        }
+        pstmt->pstmt_backend[idx].pb_id = PSTMT_GET_ID(data);
+        pstmt->pstmt_nparams = data[11] | (data[12] << 8);
+        pstmt->pstmt_id.seq = ++rses->rses_prep_stmt_next_id;
+
+        if (!prep_stmt_add(rses, pstmt))
+        {
+                /** The client uses the id of the master as before */
+                prep_stmt_done(pstmt);
+                return;
+        }
+        pstmt_set_id(data, pstmt->pstmt_id.seq);
 }
 
 /**
- * Add property to the router_client_ses structure's rses_properties
- * array. The slot is determined by the type of property.
- * In each slot there is a list of properties of similar type.
- * 
- * Router client session must be locked.
+ * Make an execution carry the parameter types for a backend that hasn't
+ * got them. Clients send the types only when they change, so a backend
+ * the statement wasn't executed in before is given the last types the
+ * client sent.
+ *
+ * @param pstmt		The statement
+ * @param pb		The statement in the backend
+ * @param querybuf	COM_STMT_EXECUTE
+ *
+ * @return The execution to send to the backend
  */
-static void rses_property_add(
-        ROUTER_CLIENT_SES* rses,
-        rses_property_t*   prop)
+static GWBUF* pstmt_execute_types(
+        prep_stmt_t*         pstmt,
+        prep_stmt_backend_t* pb,
+        GWBUF*               querybuf)
 {
-        rses_property_t* p;
-        
-        CHK_CLIENT_RSES(rses);
-        CHK_RSES_PROP(prop);
-        ss_dassert(SPINLOCK_IS_LOCKED(&rses->rses_lock));
-        
-        prop->rses_prop_rsession = rses;
-        p = rses->rses_properties[prop->rses_prop_type];
-        
-        if (p == NULL)
+        uint8_t* data = (uint8_t *)GWBUF_DATA(querybuf);
+        uint8_t* newdata;
+        GWBUF*   buf;
+        int      len = GWBUF_LENGTH(querybuf);
+        int      ntypes = 2 * pstmt->pstmt_nparams;
+        int      pos = 14 + (pstmt->pstmt_nparams + 7) / 8; /*< new_params_bound_flag */
+
+        if (ntypes == 0 || querybuf->next != NULL || pos >= len)
         {
-                rses->rses_properties[prop->rses_prop_type] = prop;
+                return querybuf;
         }
-        else
+        if (data[pos] == 1)
         {
-                while (p->rses_prop_next != NULL)
+                if (pos + 1 + ntypes <= len &&
+                        (pstmt->pstmt_types != NULL ||
+                        (pstmt->pstmt_types = (uint8_t *)malloc(ntypes)) != NULL))
                 {
-                        p = p->rses_prop_next;
+                        memcpy(pstmt->pstmt_types, &data[pos + 1], ntypes);
                 }
-                p->rses_prop_next = prop;
+                pb->pb_types_sent = true;
+                return querybuf;
+        }
+        if (pb->pb_types_sent ||
+                pstmt->pstmt_types == NULL ||
+                (buf = gwbuf_alloc(len + ntypes)) == NULL)
+        {
+                return querybuf;
         }
+        newdata = (uint8_t *)GWBUF_DATA(buf);
+        memcpy(newdata, data, pos);
+        newdata[pos] = 1;
+        memcpy(&newdata[pos + 1], pstmt->pstmt_types, ntypes);
+        memcpy(&newdata[pos + 1 + ntypes], &data[pos + 1], len - pos - 1);
+        newdata[0] = (len + ntypes - 4) & 0xff;
+        newdata[1] = ((len + ntypes - 4) >> 8) & 0xff;
+        newdata[2] = ((len + ntypes - 4) >> 16) & 0xff;
+        gwbuf_set_type(buf, GWBUF_TYPE_MYSQL|GWBUF_TYPE_SINGLE_STMT);
+        gwbuf_free(querybuf);
+        pb->pb_types_sent = true;
+        return buf;
 }
 
-/** 
+/**
+ * Write a COM_STMT_EXECUTE, FETCH or RESET to a backend the statement is
+ * prepared in, with the id of the backend.
+ *
  * Router session must be locked.
- * Return session command pointer if succeed, NULL if failed.
+ *
+ * @return 1 if the packet was written
  */
-static mysql_sescmd_t* rses_property_get_sescmd(
-        rses_property_t* prop)
+static int pstmt_write(
+        ROUTER_CLIENT_SES* rses,
+        prep_stmt_t*       pstmt,
+        backend_ref_t*     bref,
+        GWBUF*             querybuf)
 {
-        mysql_sescmd_t* sescmd;
-        
-        CHK_RSES_PROP(prop);
-        ss_dassert(prop->rses_prop_rsession == NULL ||
-                SPINLOCK_IS_LOCKED(&prop->rses_prop_rsession->rses_lock));
-        
-        sescmd = &prop->rses_prop_data.sescmd;
-        
-        if (sescmd != NULL)
+        prep_stmt_backend_t* pb = &pstmt->pstmt_backend[bref - rses->rses_backend_ref];
+        uint8_t*             data = (uint8_t *)GWBUF_DATA(querybuf);
+
+        if (data[4] == MYSQL_COM_STMT_EXECUTE)
         {
-                CHK_MYSQL_SESCMD(sescmd);
+                querybuf = pstmt_execute_types(pstmt, pb, querybuf);
+                data = (uint8_t *)GWBUF_DATA(querybuf);
         }
-        return sescmd;
-}
-       
-/**
-static void rses_begin_locked_property_action(
-        rses_property_t* prop)
-{
-        CHK_RSES_PROP(prop);
-        spinlock_acquire(&prop->rses_prop_lock);
+        pstmt_set_id(data, pb->pb_id);
+        pstmt->pstmt_last_bref = bref;
+
+        return bref_write(rses, bref, querybuf);
 }
 
-static void rses_end_locked_property_action(
-        rses_property_t* prop)
+/**
+ * Route a COM_STMT_EXECUTE, FETCH or RESET to a backend. If the statement
+ * isn't prepared in the backend yet, it is prepared first and the packet
+ * is held until pstmt_lazy_reply gets the id of the backend.
+ *
+ * Router session must be locked.
+ *
+ * @return 1 if the packet, or the prepare, was written
+ */
+static int pstmt_route(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses,
+        prep_stmt_t*       pstmt,
+        backend_ref_t*     bref,
+        GWBUF*             querybuf)
 {
-        CHK_RSES_PROP(prop);
-        spinlock_release(&prop->rses_prop_lock);
+        if (pstmt->pstmt_backend[bref - rses->rses_backend_ref].pb_id != 0)
+        {
+                return pstmt_write(rses, pstmt, bref, querybuf);
+        }
+        if (rses->rses_pstmt_exec != NULL ||
+                bref_write(rses, bref, gwbuf_clone(pstmt->pstmt_buf)) != 1)
+        {
+                causal_buf_free(querybuf);
+                return 0;
+        }
+        rses->rses_pstmt_exec = querybuf;
+        rses->rses_pstmt_exec_id = pstmt->pstmt_id.seq;
+        bref_set_state(bref, BREF_PSTMT_LAZY);
+        ts_stats_add(inst->stats, RWSPLIT_N_PSTMT_PREPARE, 1);
+        return 1;
 }
-*/
 
 /**
- * Create session command property.
+ * Process the reply to a prepare sent by pstmt_route. The held packet is
+ * sent to the backend once the statement is prepared there. If the
+ * prepare fails in a slave, the packet is routed to the master instead.
+ *
+ * Router session must be locked.
+ *
+ * @return The reply to send to the client or NULL if there is none
  */
-static mysql_sescmd_t* mysql_sescmd_init (
-        rses_property_t*   rses_prop,
-        GWBUF*             sescmd_buf,
-        unsigned char      packet_type,
-        ROUTER_CLIENT_SES* rses)
+static GWBUF* pstmt_lazy_reply(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses,
+        backend_ref_t*     bref,
+        GWBUF*             writebuf)
 {
-        mysql_sescmd_t* sescmd;
-        
-        CHK_RSES_PROP(rses_prop);
-        /** Can't call rses_property_get_sescmd with uninitialized sescmd */
-        sescmd = &rses_prop->rses_prop_data.sescmd;
-        sescmd->my_sescmd_prop = rses_prop; /*< reference to owning property */
-#if defined(SS_DEBUG)
-        sescmd->my_sescmd_chk_top  = CHK_NUM_MY_SESCMD;
-        sescmd->my_sescmd_chk_tail = CHK_NUM_MY_SESCMD;
-#endif
-        /** Set session command buffer */
-        sescmd->my_sescmd_buf  = sescmd_buf;
-        sescmd->my_sescmd_packet_type = packet_type;
-        
-        return sescmd;
-}
+        prep_stmt_t* pstmt = NULL;
+        GWBUF*       querybuf;
+        uint32_t     id = 0;
+        int          rc;
 
+        bref->bref_pstmt_buf = gwbuf_append(bref->bref_pstmt_buf, writebuf);
+        rc = pstmt_read_prepare_ok(bref->bref_pstmt_buf, &id);
 
-static void mysql_sescmd_done(
-	mysql_sescmd_t* sescmd)
-{
-	CHK_RSES_PROP(sescmd->my_sescmd_prop);
-	gwbuf_free(sescmd->my_sescmd_buf);
-        memset(sescmd, 0, sizeof(mysql_sescmd_t));
+        if (rc == 0)
+        {
+                return NULL;
+        }
+        writebuf = bref->bref_pstmt_buf;
+        bref->bref_pstmt_buf = NULL;
+        bref_clear_state(bref, BREF_PSTMT_LAZY);
+        querybuf = rses->rses_pstmt_exec;
+        rses->rses_pstmt_exec = NULL;
+
+        if (rses->rses_prep_stmt != NULL)
+        {
+                pstmt = (prep_stmt_t *)hashtable_fetch(rses->rses_prep_stmt,
+                                                       &rses->rses_pstmt_exec_id);
+        }
+        if (rc == 1 && pstmt != NULL && querybuf != NULL)
+        {
+                causal_buf_free(writebuf);
+                pstmt->pstmt_backend[bref - rses->rses_backend_ref].pb_id = id;
+
+                if (pstmt_write(rses, pstmt, bref, querybuf) != 1)
+                {
+                        LOGIF(LE, (skygw_log_write_flush(
+                                LOGFILE_ERROR,
+                                "Error : Routing prepared statement to %s:%d "
+                                "failed.",
+                                bref->bref_backend->backend_server->name,
+                                bref->bref_backend->backend_server->port)));
+                }
+                return NULL;
+        }
+        if (bref == rses->rses_master_ref || pstmt == NULL || querybuf == NULL)
+        {
+                if (querybuf != NULL)
+                {
+                        causal_buf_free(querybuf);
+                }
+                /** Nowhere else to go, the client gets the error */
+                if (rc == -1)
+                {
+                        return writebuf;
+                }
+                causal_buf_free(writebuf);
+                bref_clear_state(bref, BREF_QUERY_ACTIVE);
+                if (rses->rses_config.rw_backend_reply_timeout > 0)
+                {
+                        dcb_set_idle_timeout(bref->bref_dcb, 0);
+                }
+                bref_clear_state(bref, BREF_WAITING_RESULT);
+                return NULL;
+        }
+        causal_buf_free(writebuf);
+        LOGIF(LT, (skygw_log_write(
+                LOGFILE_TRACE,
+                "Preparing statement in %s:%d failed, routing it to Master.",
+                bref->bref_backend->backend_server->name,
+                bref->bref_backend->backend_server->port)));
+        bref_clear_state(bref, BREF_QUERY_ACTIVE);
+        if (rses->rses_config.rw_backend_reply_timeout > 0)
+        {
+                dcb_set_idle_timeout(bref->bref_dcb, 0);
+        }
+        bref_clear_state(bref, BREF_WAITING_RESULT);
+        bref = rses->rses_master_ref;
+
+        if (bref != NULL &&
+                BREF_IS_IN_USE(bref) &&
+                pstmt_route(inst, rses, pstmt, bref, querybuf) == 1)
+        {
+                bref_set_state(bref, BREF_QUERY_ACTIVE);
+                bref_set_state(bref, BREF_WAITING_RESULT);
+                bref_start_query_timer(rses, bref);
+        }
+        return NULL;
 }
 
 /**
- * All cases where backend message starts at least with one response to session
- * command are handled here.
- * Read session commands from property list. If command is already replied,
- * discard packet. Else send reply to client. In both cases move cursor forward
- * until all session command replies are handled. 
- * 
- * Cases that are expected to happen and which are handled:
- * s = response not yet replied to client, S = already replied response,
- * q = query
- * 1. q+        for example : select * from mysql.user
- * 2. s+        for example : set autocommit=1
- * 3. S+        
- * 4. sq+
- * 5. Sq+
- * 6. Ss+
- * 7. Ss+q+
- * 8. S+q+
- * 9. s+q+
+ * Route the COM_STMT_* packets of the binary protocol.
+ *
+ * COM_STMT_PREPARE goes to the master, and the statement becomes known in
+ * the router session when the master replies. Executions of read-only
+ * statements go to a slave outside transactions, unless long data has
+ * been sent for the statement, and everything else goes to the master.
+ * The statement is prepared in a backend when it is first routed there.
+ * COM_STMT_FETCH follows the last execution. COM_STMT_SEND_LONG_DATA goes
+ * to the master only, and COM_STMT_CLOSE to all the backends that have
+ * the statement. Packets with an id the router doesn't know are routed as
+ * they were before, executions to the master and the rest to all.
+ *
+ * @return true if the packet was routed
  */
-static GWBUF* sescmd_cursor_process_replies(
-        GWBUF*           replybuf,
-        backend_ref_t*   bref)
+static bool route_prep_stmt(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses,
+        GWBUF*             querybuf,
+        unsigned char      packet_type,
+        skygw_query_type_t qtype)
 {
-        mysql_sescmd_t*  scmd;
-        sescmd_cursor_t* scur;
-        
-        scur = &bref->bref_sescmd_cur;        
-        ss_dassert(SPINLOCK_IS_LOCKED(&(scur->scmd_cur_rses->rses_lock)));
-        scmd = sescmd_cursor_get_command(scur);
-               
-        CHK_GWBUF(replybuf);
-        
-        /** 
-         * Walk through packets in the message and the list of session 
-         * commands. 
-         */
-        while (scmd != NULL && replybuf != NULL)
+        prep_stmt_t*   pstmt;
+        backend_ref_t* bref;
+        backend_ref_t* master_bref;
+        DCB*           slave_dcb = NULL;
+        bool           succp = false;
+        int            i;
+
+        if (!rses_begin_locked_router_action(rses))
         {
-                /** Faster backend has already responded to client : discard */
-                if (scmd->my_sescmd_is_replied)
+                causal_buf_free(querybuf);
+                return false;
+        }
+        master_bref = rses->rses_master_ref;
+
+        if (master_bref == NULL || !BREF_IS_IN_USE(master_bref))
+        {
+                rses_end_locked_router_action(rses);
+                causal_buf_free(querybuf);
+                return false;
+        }
+
+        if (packet_type == MYSQL_COM_STMT_PREPARE)
+        {
+                pstmt = prep_stmt_init(rses,
+                                       querybuf,
+                                       QUERY_IS_TYPE(qtype, QUERY_TYPE_READ));
+
+                if (bref_write(rses, master_bref, querybuf) == 1)
+                {
+                        succp = true;
+                        ts_stats_add(inst->stats, RWSPLIT_N_MASTER, 1);
+                        route_count(inst, master_bref, RWSPLIT_R_PSTMT);
+                        bref_set_state(master_bref, BREF_QUERY_ACTIVE);
+                        bref_set_state(master_bref, BREF_WAITING_RESULT);
+                        bref_start_query_timer(rses, master_bref);
+
+                        if (pstmt != NULL)
+                        {
+                                if (rses->rses_pstmt_prepare != NULL)
+                                {
+                                        prep_stmt_done(rses->rses_pstmt_prepare);
+                                }
+                                rses->rses_pstmt_prepare = pstmt;
+                                bref_set_state(master_bref, BREF_PSTMT_PREPARE);
+                        }
+                }
+                else if (pstmt != NULL)
+                {
+                        prep_stmt_done(pstmt);
+                }
+                rses_end_locked_router_action(rses);
+                return succp;
+        }
+        pstmt = prep_stmt_find(rses, querybuf);
+
+        if (pstmt == NULL)
+        {
+                rses_end_locked_router_action(rses);
+
+                if (packet_type == MYSQL_COM_STMT_CLOSE ||
+                        packet_type == MYSQL_COM_STMT_SEND_LONG_DATA)
                 {
-                        bool last_packet = false;
-                        
-                        CHK_GWBUF(replybuf);
-                        
-                        while (!last_packet)
+                        return route_session_write(rses,
+                                                   querybuf,
+                                                   inst,
+                                                   packet_type,
+                                                   QUERY_TYPE_SESSION_WRITE);
+                }
+                return route_stmt_to_master(inst, rses, querybuf);
+        }
+
+        switch (packet_type) {
+        case MYSQL_COM_STMT_CLOSE:
+                for (i=0; i<rses->rses_nbackends; i++)
+                {
+                        GWBUF*   buf;
+                        uint32_t id = pstmt->pstmt_backend[i].pb_id;
+
+                        bref = &rses->rses_backend_ref[i];
+
+                        if (id == 0 ||
+                                !BREF_IS_IN_USE(bref) ||
+                                (buf = gwbuf_alloc(9)) == NULL)
                         {
-                                int  buflen;
-                                
-                                buflen = GWBUF_LENGTH(replybuf);
-                                last_packet = GWBUF_IS_TYPE_RESPONSE_END(replybuf);
-                                /** discard packet */
-                                replybuf = gwbuf_consume(replybuf, buflen);
+                                continue;
                         }
-                        /** Set response status received */
-                        bref_clear_state(bref, BREF_WAITING_RESULT);
+                        memcpy(GWBUF_DATA(buf), GWBUF_DATA(querybuf), 9);
+                        ((uint8_t *)GWBUF_DATA(buf))[0] = 5;
+                        pstmt_set_id((uint8_t *)GWBUF_DATA(buf), id);
+                        gwbuf_set_type(buf, GWBUF_TYPE_MYSQL|GWBUF_TYPE_SINGLE_STMT);
+                        bref_write(rses, bref, buf);
                 }
-                /** Response is in the buffer and it will be sent to client. */
-                else if (replybuf != NULL)
+                causal_buf_free(querybuf);
+                prep_stmt_drop(rses, pstmt);
+                succp = true;
+                break;
+
+        case MYSQL_COM_STMT_SEND_LONG_DATA:
+                pstmt->pstmt_long_data = true;
+
+                if (pstmt->pstmt_backend[master_bref - rses->rses_backend_ref].pb_id != 0)
                 {
-                        /** Mark the rest session commands as replied */
-                        scmd->my_sescmd_is_replied = true;
+                        succp = (pstmt_write(rses, pstmt, master_bref, querybuf) == 1);
                 }
-                
-                if (sescmd_cursor_next(scur))
+                else
                 {
-                        scmd = sescmd_cursor_get_command(scur);
+                        causal_buf_free(querybuf);
                 }
-                else
+                break;
+
+        default:
+                bref = master_bref;
+
+                if (rses->rses_slaves_pending &&
+                        packet_type == MYSQL_COM_STMT_EXECUTE &&
+                        pstmt->pstmt_is_read)
                 {
-                        scmd = NULL;
-                        /** All session commands are replied */
-                        scur->scmd_cur_active = false;
+                        rses_connect_slaves(inst, rses);
+                }
+                if (packet_type == MYSQL_COM_STMT_FETCH)
+                {
+                        if (pstmt->pstmt_last_bref != NULL &&
+                                BREF_IS_IN_USE(pstmt->pstmt_last_bref))
+                        {
+                                bref = pstmt->pstmt_last_bref;
+                        }
+                }
+                else if (packet_type == MYSQL_COM_STMT_EXECUTE &&
+                        pstmt->pstmt_is_read &&
+                        !pstmt->pstmt_long_data &&
+                        !rses->rses_transaction_active &&
+                        !rses_reads_to_master(inst, rses) &&
+                        get_dcb(&slave_dcb, rses, BE_SLAVE, -1))
+                {
+                        backend_ref_t* slave_bref = get_bref_from_dcb(rses, slave_dcb);
+
+                        /** The slave must not be busy with session commands */
+                        if (slave_bref != NULL &&
+                                !sescmd_cursor_is_active(&slave_bref->bref_sescmd_cur) &&
+                                (rses->rses_config.rw_causal_reads == 0 ||
+                                rses->rses_causal_gtid[0] == '\0' ||
+                                strcmp(slave_bref->bref_causal_gtid,
+                                       rses->rses_causal_gtid) == 0))
+                        {
+                                bref = slave_bref;
+                        }
                 }
-        }
-        ss_dassert(replybuf == NULL || *scur->scmd_cur_ptr_property == NULL);
-        
-        return replybuf;
-}
 
+                if (pstmt_route(inst, rses, pstmt, bref, querybuf) == 1)
+                {
+                        succp = true;
 
+                        if (bref == master_bref)
+                        {
+                                ts_stats_add(inst->stats, RWSPLIT_N_MASTER, 1);
+                        }
+                        else
+                        {
+                                ts_stats_add(inst->stats, RWSPLIT_N_SLAVE, 1);
+                                ts_stats_add(inst->stats, RWSPLIT_N_PSTMT_SLAVE, 1);
+                        }
+                        route_count(inst, bref, RWSPLIT_R_PSTMT);
+                        bref_set_state(bref, BREF_QUERY_ACTIVE);
+                        bref_set_state(bref, BREF_WAITING_RESULT);
+                        bref_start_query_timer(rses, bref);
 
-/**
- * Get the address of current session command.
- * 
- * Router session must be locked */
-static mysql_sescmd_t* sescmd_cursor_get_command(
-	sescmd_cursor_t* scur)
-{
-        mysql_sescmd_t* scmd;
-        
-        ss_dassert(SPINLOCK_IS_LOCKED(&(scur->scmd_cur_rses->rses_lock)));
-        scur->scmd_cur_cmd = rses_property_get_sescmd(*scur->scmd_cur_ptr_property);
-        
-        CHK_MYSQL_SESCMD(scur->scmd_cur_cmd);
-        
-        scmd = scur->scmd_cur_cmd;
-      
-	return scmd;
+                        if (bref == master_bref &&
+                                packet_type == MYSQL_COM_STMT_EXECUTE)
+                        {
+                                ryw_note_route(rses, qtype);
+                        }
+                        if (bref == master_bref &&
+                                packet_type == MYSQL_COM_STMT_EXECUTE &&
+                                rses->rses_config.rw_causal_reads > 0 &&
+                                !rses->rses_transaction_active &&
+                                !pstmt->pstmt_is_read)
+                        {
+                                bref_set_state(bref, BREF_CAUSAL_WRITE);
+                        }
+                }
+                break;
+        }
+        rses_end_locked_router_action(rses);
+        return succp;
 }
 
-/** router must be locked */
-static bool sescmd_cursor_is_active(
-	sescmd_cursor_t* sescmd_cursor)
+/**
+ * Route a statement packet with an unknown id to the master as it is
+ *
+ * @return true if the packet was written
+ */
+static bool route_stmt_to_master(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses,
+        GWBUF*             querybuf)
 {
-	bool succp;
-        ss_dassert(SPINLOCK_IS_LOCKED(&sescmd_cursor->scmd_cur_rses->rses_lock));
+        backend_ref_t* bref;
+        bool           succp = false;
 
-        succp = sescmd_cursor->scmd_cur_active;
-	return succp;
+        if (!rses_begin_locked_router_action(rses))
+        {
+                causal_buf_free(querybuf);
+                return false;
+        }
+        bref = rses->rses_master_ref;
+
+        if (bref != NULL &&
+                BREF_IS_IN_USE(bref) &&
+                bref_write(rses, bref, querybuf) == 1)
+        {
+                succp = true;
+                ts_stats_add(inst->stats, RWSPLIT_N_MASTER, 1);
+                bref_set_state(bref, BREF_QUERY_ACTIVE);
+                bref_set_state(bref, BREF_WAITING_RESULT);
+                bref_start_query_timer(rses, bref);
+        }
+        rses_end_locked_router_action(rses);
+        return succp;
 }
 
-/** router must be locked */
-static void sescmd_cursor_set_active(
-        sescmd_cursor_t* sescmd_cursor,
-        bool             value)
-{
-        ss_dassert(SPINLOCK_IS_LOCKED(&sescmd_cursor->scmd_cur_rses->rses_lock));
-        /** avoid calling unnecessarily */
-        ss_dassert(sescmd_cursor->scmd_cur_active != value);
-        sescmd_cursor->scmd_cur_active = value;
+/********************************
+ * This routine returns the root master server from MySQL replication tree
+ * Get the root Master rule:
+ *
+ * find server with the lowest replication depth level
+ * and the SERVER_MASTER bitval
+ * Servers are checked even if they are in 'maintenance'
+ *
+ * @param	servers		The list of servers
+ * @param	router_nservers	The number of servers
+ * @return			The Master found
+ *
+ */
+static BACKEND *get_root_master(backend_ref_t *servers, int router_nservers) {
+        int i = 0;
+        BACKEND * master_host = NULL;
+
+        for (i = 0; i< router_nservers; i++) {
+                BACKEND* b = NULL;
+                b = servers[i].bref_backend;
+                if (b && (b->backend_server->status & (SERVER_MASTER|SERVER_MAINT)) == SERVER_MASTER) {
+                        if (master_host && b->backend_server->depth < master_host->backend_server->depth) {
+                                master_host = b;
+                        } else {
+                                if (master_host == NULL) {
+                                        master_host = b;
+                                }
+                        }
+                }
+        }
+	return master_host;
 }
 
-/** 
- * Clone session command's command buffer. 
- * Router session must be locked 
+
+/**
+ * Check if a statement makes the session keep its backend connections for
+ * good when the router option multiplex is set. A connection can only be
+ * returned to the pool if everything the session has done in the backend
+ * is either finished or can be redone with the session command history.
+ * Temporary tables, locks, user variables and the results of functions
+ * like LAST_INSERT_ID can't, nor can anything the router doesn't follow,
+ * so such a mention in the text is enough and a false positive only means
+ * that the session isn't multiplexed.
+ *
+ * @param rses		Router client session
+ * @param packet_type	The command of the client
+ * @param querystr	The SQL text of the command or NULL
  */
-static GWBUF* sescmd_cursor_clone_querybuf(
-	sescmd_cursor_t* scur)
+static void mpx_check_sticky(
+        ROUTER_CLIENT_SES* rses,
+        mysql_server_cmd_t packet_type,
+        char*              querystr)
 {
-	GWBUF* buf;
-	ss_dassert(scur->scmd_cur_cmd != NULL);
-	
-	buf = gwbuf_clone(scur->scmd_cur_cmd->my_sescmd_buf);
-	
-	CHK_GWBUF(buf);
-	return buf;
+        static char* sticky_words[] = {
+                "TEMPORARY",
+                "LOCK",
+                "LAST_INSERT_ID",
+                "FOUND_ROWS",
+                "ROW_COUNT",
+                "PREPARE",
+                NULL
+        };
+        char* reason = NULL;
+        char* ptr;
+        int   i;
+
+        if (packet_type != MYSQL_COM_QUERY &&
+                packet_type != MYSQL_COM_QUIT &&
+                packet_type != MYSQL_COM_INIT_DB &&
+                packet_type != MYSQL_COM_PING)
+        {
+                reason = "command isn't followed";
+        }
+        else if (rses->rses_config.rw_causal_reads > 0)
+        {
+                reason = "causal reads";
+        }
+        else if (rses->rses_sescmd_truncated)
+        {
+                reason = "session command history is truncated";
+        }
+        else if (packet_type == MYSQL_COM_QUERY && querystr == NULL)
+        {
+                reason = "statement text is not available";
+        }
+        else if (packet_type == MYSQL_COM_QUERY)
+        {
+                for (i = 0; reason == NULL && sticky_words[i] != NULL; i++)
+                {
+                        if (sescmd_text_mentions(querystr, sticky_words[i]))
+                        {
+                                reason = sticky_words[i];
+                        }
+                }
+                /** A single @ is a user variable, @@ a system variable */
+                for (ptr = querystr; reason == NULL && *ptr != '\0'; ptr++)
+                {
+                        if (ptr[0] == '@')
+                        {
+                                if (ptr[1] == '@')
+                                {
+                                        ptr++;
+                                }
+                                else
+                                {
+                                        reason = "user variable";
+                                }
+                        }
+                }
+        }
+        if (reason != NULL)
+        {
+                rses->rses_mpx_sticky = true;
+                LOGIF(LT, (skygw_log_write(
+                        LOGFILE_TRACE,
+                        "Session keeps its backend connections, %s %s.",
+                        STRPACKETTYPE(packet_type),
+                        reason)));
+        }
 }
 
-static bool sescmd_cursor_history_empty(
-        sescmd_cursor_t* scur)
+/**
+ * Start following the reply to a query routed to a backend. A query written
+ * before the reply to the previous one has arrived is counted, and its
+ * reply is followed after the earlier ones. Replies to other commands than
+ * those of the text protocol, and replies that the router consumes itself
+ * with causal reads, are not followed, and neither is anything else from
+ * the backend after that.
+ *
+ * @param rses		Router client session
+ * @param bref		Backend reference the query was sent to
+ * @param packet_type	The command that was sent
+ */
+static void mpx_expect_reply(
+        ROUTER_CLIENT_SES* rses,
+        backend_ref_t*     bref,
+        mysql_server_cmd_t packet_type)
 {
-        bool succp;
-        
-        CHK_SESCMD_CUR(scur);
-        
-        if (scur->scmd_cur_rses->rses_properties[RSES_PROP_TYPE_SESCMD] == NULL)
+        if (bref == NULL ||
+                bref->bref_mpx_state == MPX_REPLY_UNKNOWN ||
+                packet_type == MYSQL_COM_QUIT ||
+                packet_type == MYSQL_COM_STMT_CLOSE ||
+                packet_type == MYSQL_COM_STMT_SEND_LONG_DATA)
         {
-                succp = true;
+                return;
+        }
+        if ((packet_type != MYSQL_COM_QUERY &&
+                packet_type != MYSQL_COM_INIT_DB &&
+                packet_type != MYSQL_COM_PING) ||
+                rses->rses_config.rw_causal_reads > 0)
+        {
+                bref->bref_mpx_state = MPX_REPLY_UNKNOWN;
+        }
+        else if (bref->bref_mpx_state == MPX_REPLY_IDLE)
+        {
+                bref->bref_mpx_state = MPX_REPLY_FIRST;
+                bref->bref_mpx_nreplies = 1;
         }
         else
         {
-                succp = false;
+                bref->bref_mpx_nreplies += 1;
         }
-        
-        return succp;
 }
 
+/**
+ * Check if a backend is still sending the reply to a query that is
+ * followed. The end of the last packet may still be on its way after the
+ * state is idle.
+ *
+ * @param bref	Backend reference
+ *
+ * @return true if a followed reply hasn't arrived completely
+ */
+static bool mpx_reply_pending(
+        backend_ref_t* bref)
+{
+        return bref->bref_mpx_state != MPX_REPLY_UNKNOWN &&
+                (bref->bref_mpx_state != MPX_REPLY_IDLE ||
+                 bref->bref_mpx_skip > 0);
+}
 
-static void sescmd_cursor_reset(
-        sescmd_cursor_t* scur)
+/**
+ * Read the status flags of an OK packet
+ *
+ * @param payload	Start of the payload of the packet
+ * @param len		Number of bytes available
+ *
+ * @return The status flags or -1 if they weren't in the bytes
+ */
+static int mpx_ok_status(
+        uint8_t* payload,
+        int      len)
 {
-        ROUTER_CLIENT_SES* rses;
-        CHK_SESCMD_CUR(scur);
-        CHK_CLIENT_RSES(scur->scmd_cur_rses);
-        rses = scur->scmd_cur_rses;
+        MYSQL_OK_PACKET ok;
 
-        scur->scmd_cur_ptr_property = &rses->rses_properties[RSES_PROP_TYPE_SESCMD];
-        
-        CHK_RSES_PROP((*scur->scmd_cur_ptr_property));
-        scur->scmd_cur_active = false;
-        scur->scmd_cur_cmd = &(*scur->scmd_cur_ptr_property)->rses_prop_data.sescmd;
+        return mysql_ok_parse(payload, len, &ok) ? ok.status : -1;
 }
 
-static bool execute_sescmd_history(
-        backend_ref_t* bref)
+/**
+ * Move the reply state of a backend by one packet of the reply. The status
+ * flags of the OK or EOF packet that ends a reply are kept for
+ * rses_track_server_status.
+ *
+ * @param bref		Backend reference
+ * @param payload	Start of the payload, at most MPX_PACKET_PREFIX - 4 bytes
+ * @param plen		Length of the whole payload
+ */
+static void mpx_reply_packet(
+        backend_ref_t* bref,
+        uint8_t*       payload,
+        int            plen)
 {
-        bool             succp;
-        sescmd_cursor_t* scur;
-        CHK_BACKEND_REF(bref);
-        
-        scur = &bref->bref_sescmd_cur;
-        CHK_SESCMD_CUR(scur);
- 
-        if (!sescmd_cursor_history_empty(scur))
-        {
-                sescmd_cursor_reset(scur);
-                succp = execute_sescmd_in_backend(bref);
-        }
-        else
+        int  avail = MIN(plen, MPX_PACKET_PREFIX - 4);
+        bool is_eof = (plen > 0 && plen < 9 && payload[0] == 0xfe);
+        bool is_err = (plen > 0 && payload[0] == 0xff);
+        int  status;
+
+        /** A packet of 16MB continues in the next one */
+        if (plen == 0xffffff || plen == 0)
         {
-                succp = true;
+                bref->bref_mpx_state = MPX_REPLY_UNKNOWN;
+                return;
         }
+        switch (bref->bref_mpx_state) {
+        case MPX_REPLY_FIRST:
+                if (payload[0] == 0x00)
+                {
+                        status = mpx_ok_status(payload, avail);
+                        bref->bref_mpx_state =
+                                (status != -1 &&
+                                 (status & SERVER_MORE_RESULTS_EXISTS)) ?
+                                MPX_REPLY_FIRST : MPX_REPLY_IDLE;
+                        bref->bref_mpx_status = status;
+                }
+                else if (is_err)
+                {
+                        bref->bref_mpx_state = MPX_REPLY_IDLE;
+                        bref->bref_mpx_status = -1;
+                }
+                else if (payload[0] == 0xfb)
+                {
+                        /** 
+                         * LOAD DATA LOCAL INFILE, the client sends the file
+                         * and the reply follows it, see route_load_data
+                         */
+                        bref->bref_mpx_state = MPX_REPLY_INFILE;
+                }
+                else
+                {
+                        bref->bref_mpx_state = MPX_REPLY_COLUMNS;
+                }
+                break;
+
+        case MPX_REPLY_COLUMNS:
+                if (is_eof)
+                {
+                        bref->bref_mpx_state = MPX_REPLY_ROWS;
+                }
+                else if (is_err)
+                {
+                        bref->bref_mpx_state = MPX_REPLY_IDLE;
+                        bref->bref_mpx_status = -1;
+                }
+                break;
+
+        case MPX_REPLY_ROWS:
+                if (is_eof)
+                {
+                        status = (avail >= 5 ? payload[3] | (payload[4] << 8) : -1);
+                        bref->bref_mpx_state =
+                                (status != -1 &&
+                                 (status & SERVER_MORE_RESULTS_EXISTS)) ?
+                                MPX_REPLY_FIRST : MPX_REPLY_IDLE;
+                        bref->bref_mpx_status = status;
+                }
+                else if (is_err)
+                {
+                        bref->bref_mpx_state = MPX_REPLY_IDLE;
+                        bref->bref_mpx_status = -1;
+                }
+                break;
 
-        return succp;
+        default:
+                /** Nothing was expected */
+                bref->bref_mpx_state = MPX_REPLY_UNKNOWN;
+                break;
+        }
 }
 
 /**
- * If session command cursor is passive, sends the command to backend for
- * execution. 
- *  
- * Returns true if command was sent or added successfully to the queue.
- * Returns false if command sending failed or if there are no pending session
- * 	commands.
- * 
- * Router session must be locked.
- */ 
-static bool execute_sescmd_in_backend(
-        backend_ref_t* backend_ref)
+ * Follow a part of the replies to the queries of a backend. The packets of
+ * a reply may be split anywhere between the buffers, so the start of each
+ * packet is collected to the backend reference and the rest of it is
+ * skipped. When a reply ends the reply to the next pipelined query starts.
+ * A reply that can't be followed makes the session keep its connections.
+ *
+ * @param rses	Router client session
+ * @param bref	Backend reference the reply is from
+ * @param buf	The reply buffers
+ *
+ * @return The number of replies that were completed by the buffers
+ */
+static int mpx_track_reply(
+        ROUTER_CLIENT_SES* rses,
+        backend_ref_t*     bref,
+        GWBUF*             buf)
 {
-	DCB*             dcb;
-	bool             succp;
-	int              rc = 0;
-	sescmd_cursor_t* scur;
+        GWBUF* b;
+        int    ndone = 0;
 
-        if (BREF_IS_CLOSED(backend_ref))
+        for (b = buf; b != NULL; b = b->next)
         {
-                succp = false;
-                goto return_succp;
-        }
-        dcb = backend_ref->bref_dcb;
-        
-	CHK_DCB(dcb);
- 	CHK_BACKEND_REF(backend_ref);
-	
-        /** 
-         * Get cursor pointer and copy of command buffer to cursor.
-         */
-        scur = &backend_ref->bref_sescmd_cur;
+                uint8_t* ptr = (uint8_t *)GWBUF_DATA(b);
+                uint8_t* end = ptr + GWBUF_LENGTH(b);
 
-        /** Return if there are no pending ses commands */
-	if (sescmd_cursor_get_command(scur) == NULL)
-	{
-		succp = false;
-                LOGIF(LT, (skygw_log_write_flush(
-                        LOGFILE_TRACE,
-                        "Cursor had no pending session commands.")));
-                
-                goto return_succp;
-	}
+                while (ptr < end &&
+                        bref->bref_mpx_state != MPX_REPLY_UNKNOWN &&
+                        (bref->bref_mpx_state != MPX_REPLY_IDLE ||
+                         bref->bref_mpx_skip > 0))
+                {
+                        int n;
+                        int plen;
+                        int want;
 
-	if (!sescmd_cursor_is_active(scur))
-        {
-                /** Cursor is left active when function returns. */
-                sescmd_cursor_set_active(scur, true);
-        }
-#if defined(SS_DEBUG)
-        LOGIF(LT, tracelog_routed_query(scur->scmd_cur_rses, 
-                                        "execute_sescmd_in_backend", 
-                                        backend_ref, 
-                                        sescmd_cursor_clone_querybuf(scur)));
+                        if (bref->bref_mpx_skip > 0)
+                        {
+                                n = MIN(bref->bref_mpx_skip, end - ptr);
+                                bref->bref_mpx_skip -= n;
+                                ptr += n;
+                                continue;
+                        }
+                        if (bref->bref_mpx_pktlen < 4)
+                        {
+                                n = MIN(4 - bref->bref_mpx_pktlen, end - ptr);
+                                memcpy(&bref->bref_mpx_pkt[bref->bref_mpx_pktlen],
+                                       ptr,
+                                       n);
+                                bref->bref_mpx_pktlen += n;
+                                ptr += n;
+
+                                if (bref->bref_mpx_pktlen < 4)
+                                {
+                                        continue;
+                                }
+                        }
+                        plen = MYSQL_GET_PACKET_LEN(bref->bref_mpx_pkt);
+                        want = 4 + MIN(plen, MPX_PACKET_PREFIX - 4);
+                        n = MIN(want - bref->bref_mpx_pktlen, end - ptr);
+                        memcpy(&bref->bref_mpx_pkt[bref->bref_mpx_pktlen], ptr, n);
+                        bref->bref_mpx_pktlen += n;
+                        ptr += n;
+
+                        if (bref->bref_mpx_pktlen == want)
+                        {
+                                mpx_reply_packet(bref, &bref->bref_mpx_pkt[4], plen);
+                                bref->bref_mpx_skip = plen - (want - 4);
+                                bref->bref_mpx_pktlen = 0;
+
+                                if (bref->bref_mpx_state == MPX_REPLY_IDLE)
+                                {
+                                        ndone += 1;
+                                        bref->bref_mpx_nreplies -= 1;
 
+                                        if (bref->bref_mpx_nreplies > 0)
+                                        {
+                                                bref->bref_mpx_state = MPX_REPLY_FIRST;
+                                        }
+                                }
+                        }
+                }
+                if (bref->bref_mpx_state == MPX_REPLY_IDLE &&
+                        (ptr < end || b->next != NULL))
+                {
+                        /** The replies ended but more data followed them */
+                        bref->bref_mpx_state = MPX_REPLY_UNKNOWN;
+                }
+        }
+        
+        if (bref->bref_mpx_state == MPX_REPLY_UNKNOWN &&
+                rses->rses_config.rw_multiplex &&
+                !rses->rses_mpx_sticky)
         {
-                GWBUF* tmpbuf = sescmd_cursor_clone_querybuf(scur);
-                uint8_t* ptr = GWBUF_DATA(tmpbuf);
-                unsigned char cmd = MYSQL_GET_COMMAND(ptr);
-                
-                LOGIF(LD, (skygw_log_write(
-                        LOGFILE_DEBUG,
-                        "%lu [execute_sescmd_in_backend] Just before write, fd "
-                        "%d : cmd %s.",
-                        pthread_self(),
-                        dcb->fd,
-                        STRPACKETTYPE(cmd))));
-                gwbuf_free(tmpbuf);
+                rses->rses_mpx_sticky = true;
+                LOGIF(LT, (skygw_log_write(
+                        LOGFILE_TRACE,
+                        "Session keeps its backend connections, reply from "
+                        "%s:%d can't be followed.",
+                        bref->bref_backend->backend_server->name,
+                        bref->bref_backend->backend_server->port)));
         }
-#endif /*< SS_DEBUG */
-        switch (scur->scmd_cur_cmd->my_sescmd_packet_type) {
-                case MYSQL_COM_CHANGE_USER:
-                        rc = dcb->func.auth(
-                                dcb, 
-                                NULL, 
-                                dcb->session, 
-                                sescmd_cursor_clone_querybuf(scur));
-                        break;
+        return ndone;
+}
 
-                case MYSQL_COM_QUERY:
-                case MYSQL_COM_INIT_DB:
-                default:
-                        /** 
-                         * Mark session command buffer, it triggers writing 
-                         * MySQL command to protocol
-                         */
-                        gwbuf_set_type(scur->scmd_cur_cmd->my_sescmd_buf, GWBUF_TYPE_SESCMD);
-                        rc = dcb->func.write(
-                                dcb, 
-                                sescmd_cursor_clone_querybuf(scur));
-                        break;
-        }
-        LOGIF(LT, (skygw_log_write_flush(
-                LOGFILE_TRACE,
-                "%lu [execute_sescmd_in_backend] Routed %s cmd %p.",
-                pthread_self(),
-                STRPACKETTYPE(scur->scmd_cur_cmd->my_sescmd_packet_type),
-                scur->scmd_cur_cmd)));
+/**
+ * Check if the connection of a backend reference has nothing in progress
+ * and can be returned to the pool
+ *
+ * @param bref	Backend reference
+ *
+ * @return true if the connection is idle
+ */
+static bool mpx_bref_is_idle(
+        backend_ref_t* bref)
+{
+        return bref->bref_state == BREF_IN_USE &&
+                bref->bref_dcb != NULL &&
+                bref->bref_mpx_state == MPX_REPLY_IDLE &&
+                bref->bref_mpx_skip == 0 &&
+                bref->bref_held == NULL &&
+                !sescmd_cursor_is_active(&bref->bref_sescmd_cur);
+}
 
-        if (rc == 1)
+/**
+ * Return the idle backend connections of a session to the pools of their
+ * servers. That is only done between transactions and when nothing of the
+ * session lives in the backends but what the session command history
+ * gives to the connection that is taken from the pool next time.
+ *
+ * Router session must be locked.
+ *
+ * @param inst	Router instance
+ * @param rses	Router client session
+ */
+static void mpx_release_backends(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses)
+{
+        int i;
+
+        ss_dassert(RSES_IS_LOCKED(rses));
+
+        if (rses->rses_closed ||
+                rses->rses_mpx_sticky ||
+                rses->rses_transaction_active ||
+                !rses->rses_autocommit_enabled ||
+                rses->rses_causal_reply != NULL ||
+                rses->rses_causal_query != NULL ||
+                rses->rses_prep_stmt_list != NULL ||
+                rses->rses_pstmt_exec != NULL ||
+                rses->rses_session->client == NULL ||
+                rses->rses_session->client->state != DCB_STATE_POLLING)
         {
-                succp = true;
+                return;
         }
-        else
+        for (i = 0; i < rses->rses_nbackends; i++)
         {
-                succp = false;
+                backend_ref_t* bref = &rses->rses_backend_ref[i];
+                BACKEND*       b = bref->bref_backend;
+
+                if (!mpx_bref_is_idle(bref) ||
+                        b->backend_server->persistpoolmax <= 0 ||
+                        !dcb_park(bref->bref_dcb))
+                {
+                        continue;
+                }
+                while (BREF_IS_WAITING_RESULT(bref))
+                {
+                        bref_clear_state(bref, BREF_WAITING_RESULT);
+                }
+                bref->bref_dcb = NULL;
+                bref->bref_state = BREF_RELEASED;
+                atomic_add(&b->backend_server->stats.n_current, -1);
+                atomic_add(&b->backend_conn_count, -1);
+                ts_stats_add(inst->stats, RWSPLIT_N_MPX_RELEASED, 1);
         }
-return_succp:
-	return succp;
 }
 
-
 /**
- * Moves cursor to next property and copied address of its sescmd to cursor.
- * Current propery must be non-null.
- * If current property is the last on the list, *scur->scmd_ptr_property == NULL
- * 
- * Router session must be locked 
+ * Take a connection for each backend of the session that returned its
+ * connection to the pool. The connection is given the session state by
+ * replaying the session command history, and everything routed to it
+ * waits until the replay is done.
+ *
+ * Router session must be locked.
+ *
+ * @param inst	Router instance
+ * @param rses	Router client session
+ *
+ * @return false if the master couldn't be connected
  */
-static bool sescmd_cursor_next(
-	sescmd_cursor_t* scur)
+static bool mpx_acquire_backends(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses)
 {
-	bool             succp = false;
-	rses_property_t* prop_curr;
-	rses_property_t* prop_next;
-
-        ss_dassert(scur != NULL);
-        ss_dassert(*(scur->scmd_cur_ptr_property) != NULL);
-        ss_dassert(SPINLOCK_IS_LOCKED(
-                &(*(scur->scmd_cur_ptr_property))->rses_prop_rsession->rses_lock));
-
-        /** Illegal situation */
-	if (scur == NULL ||
-           *scur->scmd_cur_ptr_property == NULL ||
-            scur->scmd_cur_cmd == NULL)
-	{
-		/** Log error */
-		goto return_succp;
-	}
-	prop_curr = *(scur->scmd_cur_ptr_property);
+        bool succp = true;
+        int  i;
 
-        CHK_MYSQL_SESCMD(scur->scmd_cur_cmd);
-        ss_dassert(prop_curr == mysql_sescmd_get_property(scur->scmd_cur_cmd));
-        CHK_RSES_PROP(prop_curr);
-
-        /** Copy address of pointer to next property */
-        scur->scmd_cur_ptr_property = &(prop_curr->rses_prop_next);
-        prop_next = *scur->scmd_cur_ptr_property;
-        ss_dassert(prop_next == *(scur->scmd_cur_ptr_property));
-        
-        
-	/** If there is a next property move forward */
-	if (prop_next != NULL)
-	{
-                CHK_RSES_PROP(prop_next);
-                CHK_RSES_PROP((*(scur->scmd_cur_ptr_property)));
+        ss_dassert(RSES_IS_LOCKED(rses));
 
-                /** Get pointer to next property's sescmd */
-                scur->scmd_cur_cmd = rses_property_get_sescmd(prop_next);
+        for (i = 0; i < rses->rses_nbackends; i++)
+        {
+                backend_ref_t* bref = &rses->rses_backend_ref[i];
+                BACKEND*       b = bref->bref_backend;
 
-                ss_dassert(prop_next == scur->scmd_cur_cmd->my_sescmd_prop);                
-                CHK_MYSQL_SESCMD(scur->scmd_cur_cmd);
-                CHK_RSES_PROP(scur->scmd_cur_cmd->my_sescmd_prop);
-	}
-	else
-	{
-		/** No more properties, can't proceed. */
-		goto return_succp;
-	}
+                if (!BREF_IS_RELEASED(bref) || BREF_IS_IN_USE(bref))
+                {
+                        continue;
+                }
+                bref->bref_state = 0;
+                bref_clear_pipeline(bref);
+
+                if (!SERVER_IS_RUNNING(b->backend_server) ||
+                        (bref->bref_dcb = dcb_connect(
+                                b->backend_server,
+                                rses->rses_session,
+                                b->backend_server->protocol)) == NULL)
+                {
+                        bref->bref_dcb = NULL;
+                        bref_set_state(bref, BREF_CLOSED);
+                        LOGIF(LE, (skygw_log_write_flush(
+                                LOGFILE_ERROR,
+                                "Error : Unable to get a connection to %s:%d "
+                                "for a multiplexed session.",
+                                b->backend_server->name,
+                                b->backend_server->port)));
 
-	if (scur->scmd_cur_cmd != NULL)
-	{
-                succp = true;
-        }
-        else
-        {
-                ss_dassert(false); /*< Log error, sescmd shouldn't be NULL */
+                        if (bref == rses->rses_master_ref)
+                        {
+                                succp = false;
+                        }
+                        continue;
+                }
+                execute_sescmd_history(bref);
+                dcb_add_callback(bref->bref_dcb,
+                                 DCB_REASON_NOT_RESPONDING,
+                                 &router_handle_state_switch,
+                                 (void *)bref);
+                bref_set_state(bref, BREF_IN_USE);
+                atomic_add(&b->backend_conn_count, 1);
+                ts_stats_add(inst->stats, RWSPLIT_N_MPX_ACQUIRED, 1);
         }
-return_succp:
-	return succp;
+        return succp;
 }
 
-static rses_property_t* mysql_sescmd_get_property(
-	mysql_sescmd_t* scmd)
+/**
+ * Connect the slaves of a session that was created with lazy_connect. It is
+ * done once, when the first read is routed, and up to max_slave_connections
+ * slaves, or the slave target of adaptive_slaves, are chosen by the slave selection criteria like in
+ * select_connect_backend_servers. The backend references aren't reordered
+ * because the connected ones are referred to by their DCB callbacks. Each
+ * new slave replays the session command history before the read.
+ *
+ * Router session must be locked.
+ *
+ * @param inst	Router instance
+ * @param rses	Router client session
+ *
+ * @return The number of slaves connected
+ */
+static int rses_connect_slaves(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses)
 {
-	CHK_MYSQL_SESCMD(scmd);
-	return scmd->my_sescmd_prop;
-}
+        backend_ref_t* backend_ref = rses->rses_backend_ref;
+        BACKEND*       master_host;
+        int            max_nslaves;
+        int            max_slave_rlag;
+        int            nconnected = 0;
+        int            i;
+        int (*p)(const void *, const void *);
 
-static void tracelog_routed_query(
-        ROUTER_CLIENT_SES* rses,
-        char*              funcname,
-        backend_ref_t*     bref,
-        GWBUF*             buf)
-{
-        uint8_t*       packet = GWBUF_DATA(buf);
-        unsigned char  packet_type = packet[4];
-        size_t         len;
-        size_t         buflen = GWBUF_LENGTH(buf);
-        char*          querystr;
-        char*          startpos = (char *)&packet[5];
-        BACKEND*       b;
-        backend_type_t be_type;
-        DCB*           dcb;
-        
-        CHK_BACKEND_REF(bref);
-        b = bref->bref_backend;
-        CHK_BACKEND(b);
-        dcb = bref->bref_dcb;
-        CHK_DCB(dcb);
-        
-        be_type = BACKEND_TYPE(b);
+        ss_dassert(RSES_IS_LOCKED(rses));
+        rses->rses_slaves_pending = false;
 
-        if (GWBUF_IS_TYPE_MYSQL(buf))
+        master_host = get_root_master(backend_ref, rses->rses_nbackends);
+        max_nslaves = rses_get_slave_target(rses, rses->rses_nbackends);
+        max_slave_rlag = rses_get_max_replication_lag(rses);
+        p = criteria_cmpfun[rses->rses_config.rw_slave_select_criteria];
+
+        if (rses->rses_config.rw_dynamic_weights)
         {
-                len  = packet[0];
-                len += 256*packet[1];
-                len += 256*256*packet[2];
-                
-                if (packet_type == '\x03') 
-                {
-                        querystr = (char *)malloc(len);
-                        memcpy(querystr, startpos, len-1);
-                        querystr[len-1] = '\0';
-                        LOGIF(LT, (skygw_log_write_flush(
-                                LOGFILE_TRACE,
-                                "%lu [%s] %d bytes long buf, \"%s\" -> %s:%d %s dcb %p",
-                                pthread_self(),
-                                funcname,
-                                buflen,
-                                querystr,
-                                b->backend_server->name,
-                                b->backend_server->port, 
-                                STRBETYPE(be_type),
-                                dcb)));
-                        free(querystr);
+                router_update_weights(inst);
+        }
+
+        if (master_host == NULL || p == NULL)
+        {
+                return 0;
+        }
+        /** The error handling may have connected some already */
+        for (i = 0; i < rses->rses_nbackends; i++)
+        {
+                if (bref_is_read_slave(&backend_ref[i], master_host, -1))
+                {
+                        max_nslaves -= 1;
                 }
-                else if (packet_type == '\x22' || 
-                        packet_type == 0x22 || 
-                        packet_type == '\x26' || 
-                        packet_type == 0x26 ||
-                        true)
+        }
+        while (nconnected < max_nslaves)
+        {
+                backend_ref_t* best = NULL;
+                BACKEND*       b;
+
+                for (i = 0; i < rses->rses_nbackends; i++)
                 {
-                        querystr = (char *)malloc(len);
-                        memcpy(querystr, startpos, len-1);
-                        querystr[len-1] = '\0';
-                        LOGIF(LT, (skygw_log_write_flush(
-                                LOGFILE_TRACE,
-                                "%lu [%s] %d bytes long buf, \"%s\" -> %s:%d %s dcb %p",
-                                pthread_self(),
-                                funcname,
-                                buflen,
-                                querystr,
+                        SERVER* srv = backend_ref[i].bref_backend->backend_server;
+
+                        if (backend_ref[i].bref_state == 0 &&
+                                SERVER_IS_RUNNING(srv) &&
+                                (srv->status & inst->bitmask) == inst->bitvalue &&
+                                (SERVER_IS_SLAVE(srv) || SERVER_IS_RELAY_SERVER(srv)) &&
+                                srv != master_host->backend_server &&
+                                SERVER_CIRCUIT_IS_CLOSED(srv) &&
+                                (max_slave_rlag == -2 ||
+                                (srv->rlag != -1 && srv->rlag <= max_slave_rlag)) &&
+                                (best == NULL || p(&backend_ref[i], best) < 0))
+                        {
+                                best = &backend_ref[i];
+                        }
+                }
+                if (best == NULL)
+                {
+                        break;
+                }
+                b = best->bref_backend;
+                best->bref_dcb = dcb_connect(b->backend_server,
+                                             rses->rses_session,
+                                             b->backend_server->protocol);
+
+                if (best->bref_dcb == NULL)
+                {
+                        /** Not tried again, the error handling may reconnect */
+                        bref_set_state(best, BREF_CLOSED);
+                        LOGIF(LE, (skygw_log_write_flush(
+                                LOGFILE_ERROR,
+                                "Error : Unable to establish "
+                                "connection with slave %s:%d",
                                 b->backend_server->name,
-                                b->backend_server->port, 
-                                STRBETYPE(be_type),
-                                dcb)));
-                        free(querystr);                        
+                                b->backend_server->port)));
+                        continue;
                 }
+                execute_sescmd_history(best);
+                dcb_add_callback(best->bref_dcb,
+                                 DCB_REASON_NOT_RESPONDING,
+                                 &router_handle_state_switch,
+                                 (void *)best);
+                bref_set_state(best, BREF_IN_USE);
+                atomic_add(&b->backend_conn_count, 1);
+                /** A new slave is idle from now, not from its last query */
+                best->bref_sent_usec = response_clock();
+                nconnected += 1;
+
+                LOGIF(LT, (skygw_log_write(
+                        LOGFILE_TRACE,
+                        "Selected slave in \t%s:%d at the first read",
+                        b->backend_server->name,
+                        b->backend_server->port)));
         }
-        gwbuf_free(buf);
+        return nconnected;
 }
 
-
 /**
- * Return rc, rc < 0 if router session is closed. rc == 0 if there are no 
- * capabilities specified, rc > 0 when there are capabilities.
- */ 
-static uint8_t getCapabilities (
-        ROUTER* inst,
-        void*   router_session)
+ * Return the number of slaves a session connects to: max_slave_connections,
+ * or with adaptive_slaves the slaves the session has needed so far, at
+ * most max_slave_connections.
+ *
+ * @param rses			Router client session
+ * @param router_nservers	Number of backend servers
+ *
+ * @return The number of slaves to connect to
+ */
+static int rses_get_slave_target(
+        ROUTER_CLIENT_SES* rses,
+        int                router_nservers)
 {
-        ROUTER_CLIENT_SES* rses = (ROUTER_CLIENT_SES *)router_session;
-        uint8_t            rc;
-        
-        if (!rses_begin_locked_router_action(rses))
+        int max_nslaves = rses_get_max_slavecount(rses, router_nservers);
+
+        if (rses->rses_config.rw_adaptive_slaves > 0)
         {
-                rc = 0xff;
-                goto return_rc;
+                max_nslaves = MIN(max_nslaves, MAX(1, rses->rses_slave_target));
         }
-        rc = rses->rses_capabilities;
-        
-        rses_end_locked_router_action(rses);
-        
-return_rc:
-        return rc;
+        return max_nslaves;
 }
 
 /**
- * Execute in backends used by current router session.
- * Save session variable commands to router session property
- * struct. Thus, they can be replayed in backends which are 
- * started and joined later.
- * 
- * Suppress redundant OK packets sent by backends.
- * 
- * The first OK packet is replied to the client.
- * Return true if succeed, false is returned if router session was closed or
- * if execute_sescmd_in_backend failed.
+ * Adapt the slave connections of an adaptive_slaves session to its reads
+ * before a read is routed. The slaves that have been idle for
+ * adaptive_slaves seconds are released, and if every connected slave still
+ * has a reply on the way the read would queue behind it, so one more slave
+ * is connected, up to max_slave_connections. The new slave replays the
+ * session command history like the slaves of lazy_connect.
+ *
+ * Router session must be locked.
+ *
+ * @param inst	Router instance
+ * @param rses	Router client session
  */
-static bool route_session_write(
-        ROUTER_CLIENT_SES* router_cli_ses,
-        GWBUF*             querybuf,
+static void rses_adapt_slaves(
         ROUTER_INSTANCE*   inst,
-        unsigned char      packet_type,
-        skygw_query_type_t qtype)
+        ROUTER_CLIENT_SES* rses)
 {
-        bool              succp;
-        rses_property_t*  prop;
-        backend_ref_t*    backend_ref;
-        int               i;
-  
-        LOGIF(LT, (skygw_log_write(
-                LOGFILE_TRACE,
-                "Session write, query type\t%s, packet type %s, "
-                "routing to all servers.",
-                STRQTYPE(qtype),
-                STRPACKETTYPE(packet_type))));
+        backend_ref_t* backend_ref = rses->rses_backend_ref;
+        BACKEND*       master_host;
+        int            nslaves = 0;
+        int            i;
 
-        backend_ref = router_cli_ses->rses_backend_ref;
-        
-        /**
-         * These are one-way messages and server doesn't respond to them.
-         * Therefore reply processing is unnecessary and session 
-         * command property is not needed. It is just routed to all available
-         * backends.
-         */
-        if (packet_type == MYSQL_COM_STMT_SEND_LONG_DATA ||
-                packet_type == MYSQL_COM_QUIT ||
-                packet_type == MYSQL_COM_STMT_CLOSE)
+        ss_dassert(RSES_IS_LOCKED(rses));
+        rses_release_idle_slaves(inst, rses);
+
+        if (rses->rses_slaves_pending)
         {
-                int rc;
-               
-                succp = true;
-                
-                /** Lock router session */
-                if (!rses_begin_locked_router_action(router_cli_ses))
-                {
-                        succp = false;
-                        goto return_succp;
-                }
-                                
-                for (i=0; i<router_cli_ses->rses_nbackends; i++)
-                {
-                        DCB* dcb = backend_ref[i].bref_dcb;                        
+                rses_connect_slaves(inst, rses);
+                return;
+        }
+        master_host = get_root_master(backend_ref, rses->rses_nbackends);
 
-                        if (BREF_IS_IN_USE((&backend_ref[i])))
+        if (master_host == NULL ||
+                rses->rses_slave_target >=
+                rses_get_max_slavecount(rses, rses->rses_nbackends))
+        {
+                return;
+        }
+        for (i = 0; i < rses->rses_nbackends; i++)
+        {
+                if (bref_is_read_slave(&backend_ref[i], master_host, -1))
+                {
+                        if (!BREF_IS_WAITING_RESULT((&backend_ref[i])))
                         {
-                                rc = dcb->func.write(dcb, gwbuf_clone(querybuf));
-                        
-                                if (rc != 1)
-                                {
-                                        succp = false;
-                                }
+                                return;
                         }
+                        nslaves += 1;
                 }
-                rses_end_locked_router_action(router_cli_ses);
-                gwbuf_free(querybuf);
-                goto return_succp;
         }
-        /** Lock router session */
-        if (!rses_begin_locked_router_action(router_cli_ses))
+        rses->rses_slave_target = nslaves + 1;
+
+        if (rses_connect_slaves(inst, rses) > 0)
         {
-                rses_property_done(prop);
-                succp = false;
-                goto return_succp;
-        }        
-        /** 
-         * Additional reference is created to querybuf to 
-         * prevent it from being released before properties
-         * are cleaned up as a part of router sessionclean-up.
-         */
-        prop = rses_property_init(RSES_PROP_TYPE_SESCMD);
-        mysql_sescmd_init(prop, querybuf, packet_type, router_cli_ses);
-        
-        /** Add sescmd property to router client session */
-        rses_property_add(router_cli_ses, prop);
-         
-        for (i=0; i<router_cli_ses->rses_nbackends; i++)
+                ts_stats_add(inst->stats, RWSPLIT_N_SLAVE_GROWN, 1);
+                LOGIF(LT, (skygw_log_write(
+                        LOGFILE_TRACE,
+                        "Reads of the session queue up, it has now %d "
+                        "slaves.",
+                        rses->rses_slave_target)));
+        }
+        else
         {
-                if (BREF_IS_IN_USE((&backend_ref[i])))
+                rses->rses_slave_target = MAX(1, nslaves);
+        }
+}
+
+/**
+ * Release the slaves of an adaptive_slaves session that haven't been sent
+ * a query for adaptive_slaves seconds. Only slaves with nothing in
+ * progress and that hold no state outside the session command history are
+ * released, so the history gives a slave connected later the same state.
+ * The connection goes to the pool of the server when it has one. The slave
+ * target of the session decreases, and when no slave is left the next read
+ * connects one.
+ *
+ * Router session must be locked.
+ *
+ * @param inst	Router instance
+ * @param rses	Router client session
+ */
+static void rses_release_idle_slaves(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses)
+{
+        backend_ref_t* backend_ref = rses->rses_backend_ref;
+        BACKEND*       master_host;
+        unsigned long  now;
+        unsigned long  idle_usec;
+        int            nslaves = 0;
+        int            i;
+
+        ss_dassert(RSES_IS_LOCKED(rses));
+
+        if (rses->rses_closed ||
+                rses->rses_slaves_pending ||
+                rses->rses_transaction_active ||
+                rses->rses_causal_reply != NULL ||
+                rses->rses_causal_query != NULL ||
+                rses->rses_prep_stmt_list != NULL ||
+                rses->rses_pstmt_exec != NULL ||
+                (master_host = get_root_master(backend_ref,
+                                               rses->rses_nbackends)) == NULL)
+        {
+                return;
+        }
+        now = response_clock();
+        idle_usec = (unsigned long)rses->rses_config.rw_adaptive_slaves * 1000000;
+
+        for (i = 0; i < rses->rses_nbackends; i++)
+        {
+                backend_ref_t* bref = &backend_ref[i];
+                BACKEND*       b = bref->bref_backend;
+
+                if (!bref_is_read_slave(bref, master_host, -1))
                 {
-                        sescmd_cursor_t* scur;
-                        
-                        scur = backend_ref_get_sescmd_cursor(&backend_ref[i]);
-                        
-                        /** 
-                         * Add one waiter to backend reference.
-                         */
-                        bref_set_state(get_bref_from_dcb(router_cli_ses, 
-                                                         backend_ref[i].bref_dcb), 
-                                       BREF_WAITING_RESULT);
-                        /** 
-                         * Start execution if cursor is not already executing.
-                         * Otherwise, cursor will execute pending commands
-                         * when it completes with previous commands.
-                         */
-                        if (sescmd_cursor_is_active(scur))
-                        {
-                                succp = true;
-                                
-                                LOGIF(LT, (skygw_log_write(
-                                        LOGFILE_TRACE,
-                                        "Backend %s:%d already executing sescmd.",
-                                        backend_ref[i].bref_backend->backend_server->name,
-                                        backend_ref[i].bref_backend->backend_server->port)));
-                        }
-                        else
-                        {
-                                succp = execute_sescmd_in_backend(&backend_ref[i]);
-                                
-                                if (!succp)
-                                {
-                                        LOGIF(LE, (skygw_log_write_flush(
-                                                LOGFILE_ERROR,
-                                                "Error : Failed to execute session "
-                                                "command in %s:%d",
-                                                backend_ref[i].bref_backend->backend_server->name,
-                                                backend_ref[i].bref_backend->backend_server->port)));
-                                }
-                        }
+                        continue;
+                }
+                if (!mpx_bref_is_idle(bref) ||
+                        bref == rses->rses_trx_slave ||
+                        bref == rses->rses_retry_bref ||
+                        bref->bref_causal_buf != NULL ||
+                        bref->bref_pstmt_buf != NULL ||
+                        now - bref->bref_sent_usec < idle_usec)
+                {
+                        nslaves += 1;
+                        continue;
+                }
+                LOGIF(LT, (skygw_log_write(
+                        LOGFILE_TRACE,
+                        "Releasing idle slave %s:%d.",
+                        b->backend_server->name,
+                        b->backend_server->port)));
+
+                if (b->backend_server->persistpoolmax <= 0 ||
+                        !dcb_park(bref->bref_dcb))
+                {
+                        dcb_close(bref->bref_dcb);
+                }
+                bref_clear_pipeline(bref);
+                bref->bref_dcb = NULL;
+                /** The slave may be connected again */
+                bref->bref_state = 0;
+                bref->bref_causal_gtid[0] = '\0';
+                atomic_add(&b->backend_server->stats.n_current, -1);
+                atomic_add(&b->backend_conn_count, -1);
+                ts_stats_add(inst->stats, RWSPLIT_N_SLAVE_RELEASED, 1);
+
+                if (rses->rses_slave_target > 1)
+                {
+                        rses->rses_slave_target -= 1;
                 }
         }
-        /** Unlock router session */
-        rses_end_locked_router_action(router_cli_ses);
-        
-        atomic_add(&inst->stats.n_all, 1);
-        
-return_succp:
-        return succp;
+        if (nslaves == 0)
+        {
+                rses->rses_slaves_pending = true;
+        }
+}
+
+/**
+ * Start the failover window of a session whose master failed. Writes that
+ * are routed until a new master is found are held, see
+ * failover_hold_write, and the session checks every
+ * RWSPLIT_FAILOVER_POLL_MS milliseconds whether the monitor has promoted a
+ * new master. Writes that were sent to the failed master got an error,
+ * there's no knowing whether they were committed.
+ *
+ * Router session must be locked.
+ *
+ * @param inst	Router instance
+ * @param rses	Router client session
+ *
+ * @return true, the session continues without a master
+ */
+static bool failover_begin(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses)
+{
+        ss_dassert(RSES_IS_LOCKED(rses));
+
+        if (rses->rses_failover_usec == 0)
+        {
+                rses->rses_failover_usec = response_clock();
+                LOGIF(LT, (skygw_log_write(
+                        LOGFILE_TRACE,
+                        "Master failed, writes are held for at most %d "
+                        "seconds for a new master.",
+                        rses->rses_config.rw_master_failover_wait)));
+        }
+        if (!failover_connect_master(inst, rses))
+        {
+                timer_start(&rses->rses_failover_timer,
+                            RWSPLIT_FAILOVER_POLL_MS,
+                            failover_tick,
+                            rses);
+        }
+        return true;
+}
+
+/**
+ * Hold a write of a session that waits for a new master. The write is
+ * refused if the session has already waited master_failover_wait seconds
+ * or holds RWSPLIT_FAILOVER_MAX_HELD writes.
+ *
+ * Router session must be locked.
+ *
+ * @param inst		Router instance
+ * @param rses		Router client session
+ * @param querybuf	The write
+ *
+ * @return 1 if the write is held or was written to a new master
+ */
+static int failover_hold_write(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses,
+        GWBUF*             querybuf)
+{
+        bref_stmt_t*  stmt;
+        bref_stmt_t** pp;
+
+        ss_dassert(RSES_IS_LOCKED(rses));
+
+        if (rses->rses_failover_nheld >= RWSPLIT_FAILOVER_MAX_HELD ||
+                response_clock() - rses->rses_failover_usec >=
+                (unsigned long)rses->rses_config.rw_master_failover_wait * 1000000)
+        {
+                LOGIF(LE, (skygw_log_write_flush(
+                        LOGFILE_ERROR,
+                        "Error : No master was found for a held write in %d "
+                        "seconds.",
+                        rses->rses_config.rw_master_failover_wait)));
+                return 0;
+        }
+        if ((stmt = (bref_stmt_t *)malloc(sizeof(bref_stmt_t))) == NULL)
+        {
+                return 0;
+        }
+        stmt->stmt_buf = querybuf;
+        stmt->stmt_next = NULL;
+
+        for (pp = &rses->rses_failover_held; *pp != NULL; pp = &(*pp)->stmt_next)
+                ;
+        *pp = stmt;
+        rses->rses_failover_nheld += 1;
+        ts_stats_add(inst->stats, RWSPLIT_N_FAILOVER_HELD, 1);
+        failover_connect_master(inst, rses);
+        return 1;
 }
 
-#if defined(NOT_USED)
-static bool router_option_configured(
-        ROUTER_INSTANCE* router,
-        const char*      optionstr,
-        void*            data)
+/**
+ * Connect a session that waits for a new master to the root master given by
+ * the monitor, if there is one. A slave that was promoted is already
+ * connected and has the session state, another server replays the session
+ * command history first. The held writes are then written to the master in
+ * their order, their replies follow the replays.
+ *
+ * Router session must be locked.
+ *
+ * @param inst	Router instance
+ * @param rses	Router client session
+ *
+ * @return true if the session has a master again
+ */
+static bool failover_connect_master(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses)
 {
-        bool   succp = false;
-        char** option;
-        
-        option = router->service->routerOptions;
-        
-        while (option != NULL)
+        backend_ref_t* bref = NULL;
+        BACKEND*       master_host;
+        BACKEND*       b;
+        int            nwritten = 0;
+        int            i;
+
+        ss_dassert(RSES_IS_LOCKED(rses));
+        master_host = get_root_master(rses->rses_backend_ref, rses->rses_nbackends);
+
+        if (master_host == NULL)
         {
-                char*  value;
+                return false;
+        }
+        for (i = 0; bref == NULL && i < rses->rses_nbackends; i++)
+        {
+                if (rses->rses_backend_ref[i].bref_backend == master_host)
+                {
+                        bref = &rses->rses_backend_ref[i];
+                }
+        }
+        if (bref == NULL)
+        {
+                return false;
+        }
+        b = bref->bref_backend;
 
-                if ((value = strchr(options[i], '=')) == NULL)
+        if (!BREF_IS_IN_USE(bref))
+        {
+                if (!server_circuit_probe(b->backend_server))
                 {
-                        break;
+                        return false;
                 }
-                else
+                bref->bref_state = 0;
+                bref_clear_pipeline(bref);
+                bref->bref_causal_gtid[0] = '\0';
+                bref->bref_dcb = dcb_connect(b->backend_server,
+                                             rses->rses_session,
+                                             b->backend_server->protocol);
+
+                if (bref->bref_dcb == NULL)
                 {
-                        *value = 0;
-                        value++;
-                        if (strcmp(options[i], "slave_selection_criteria") == 0)
-                        {
-                                if (GET_SELECT_CRITERIA(value) == (select_criteria_t *)*data)
-                                {
-                                        succp = true;
-                                        break;
-                                }
-                        }
+                        bref_set_state(bref, BREF_CLOSED);
+                        LOGIF(LE, (skygw_log_write_flush(
+                                LOGFILE_ERROR,
+                                "Error : Unable to establish connection with "
+                                "new master %s:%d",
+                                b->backend_server->name,
+                                b->backend_server->port)));
+                        return false;
                 }
+                execute_sescmd_history(bref);
+                dcb_add_callback(bref->bref_dcb,
+                                 DCB_REASON_NOT_RESPONDING,
+                                 &router_handle_state_switch,
+                                 (void *)bref);
+                bref_set_state(bref, BREF_IN_USE);
+                atomic_add(&b->backend_conn_count, 1);
         }
-        return succp;
-}
-#endif /*< NOT_USED */
+        rses->rses_master_ref = bref;
+        rses->rses_failover_usec = 0;
+        timer_cancel(&rses->rses_failover_timer);
 
-static void rwsplit_process_router_options(
-        ROUTER_INSTANCE* router,
-        char**           options)
-{
-        int               i;
-        char*             value;
-        select_criteria_t c;
-        
-        for (i = 0; options[i]; i++)
+        while (rses->rses_failover_held != NULL)
         {
-                if ((value = strchr(options[i], '=')) == NULL)
-                {
-                        LOGIF(LE, (skygw_log_write(
-                                LOGFILE_ERROR, "Warning : Unsupported "
-                                "router option \"%s\" for "
-                                "readwritesplit router.",
-                                options[i])));
-                }
-                else
+                bref_stmt_t* stmt = rses->rses_failover_held;
+
+                rses->rses_failover_held = stmt->stmt_next;
+
+                if (bref_write(rses, bref, stmt->stmt_buf) == 1)
                 {
-                        *value = 0;
-                        value++;
-                        if (strcmp(options[i], "slave_selection_criteria") == 0)
-                        {
-                                c = GET_SELECT_CRITERIA(value);
-                                ss_dassert(
-                                        c == LEAST_GLOBAL_CONNECTIONS ||
-                                        c == LEAST_ROUTER_CONNECTIONS ||
-                                        c == LEAST_BEHIND_MASTER ||
-                                        c == LEAST_CURRENT_OPERATIONS ||
-                                        c == UNDEFINED_CRITERIA);
-                               
-                                if (c == UNDEFINED_CRITERIA)
-                                {
-                                        LOGIF(LE, (skygw_log_write(
-                                                LOGFILE_ERROR, "Warning : Unknown "
-                                                "slave selection criteria \"%s\". "
-                                                "Allowed values are LEAST_GLOBAL_CONNECTIONS, "
-                                                "LEAST_ROUTER_CONNECTIONS, "
-                                                "LEAST_BEHIND_MASTER,"
-                                                "and LEAST_CURRENT_OPERATIONS.",
-                                                STRCRITERIA(router->rwsplit_config.rw_slave_select_criteria))));
-                                }
-                                else
-                                {
-                                        router->rwsplit_config.rw_slave_select_criteria = c;
-                                }
-                        }
+                        ts_stats_add(inst->stats, RWSPLIT_N_MASTER, 1);
+                        bref_set_state(bref, BREF_QUERY_ACTIVE);
+                        bref_set_state(bref, BREF_WAITING_RESULT);
+                        nwritten += 1;
                 }
-        } /*< for */
+                free(stmt);
+        }
+        bref_start_query_timer(rses, bref);
+        LOGIF(LT, (skygw_log_write(
+                LOGFILE_TRACE,
+                "New master %s:%d found, %d of %d held writes forwarded.",
+                b->backend_server->name,
+                b->backend_server->port,
+                nwritten,
+                rses->rses_failover_nheld)));
+        rses->rses_failover_nheld = 0;
+        return true;
 }
 
 /**
- * Error Handler routine to resolve backend failures. If it succeeds then there
- * are enough operative backends available and connected. Otherwise it fails, 
- * and session is terminated.
+ * The failover timer of a session. The session looks for the new master
+ * and, after master_failover_wait seconds, gives the held writes an error
+ * and stops waiting. A later write then fails the session like it does
+ * without the option.
  *
- * @param       instance        The router instance
- * @param       router_session  The router session
- * @param       message         The error message to reply
- * @param       backend_dcb     The backend DCB
- * @param       action          The action: REPLY, REPLY_AND_CLOSE, NEW_CONNECTION
- * @param       succp           Result of action. 
- * 
- * Even if succp == true connecting to new slave may have failed. succp is to
- * tell whether router has enough master/slave connections to continue work.
+ * @param data	The router client session
  */
-
-static void handleError (
-        ROUTER*        instance,
-        void*          router_session,
-        GWBUF*         errmsgbuf,
-        DCB*           backend_dcb,
-        error_action_t action,
-        bool*          succp)
+static void failover_tick(
+        void* data)
 {
-        SESSION*           session;
-        ROUTER_INSTANCE*   inst    = (ROUTER_INSTANCE *)instance;
-        ROUTER_CLIENT_SES* rses    = (ROUTER_CLIENT_SES *)router_session;
-      
-        CHK_DCB(backend_dcb);
-#if defined(SS_DEBUG)
-        backend_dcb->dcb_errhandle_called = true;
-#endif
-        session = backend_dcb->session;
-        
-        if (session != NULL)
-                CHK_SESSION(session);
-        
-        switch (action) {
-                case ERRACT_NEW_CONNECTION:
+        ROUTER_CLIENT_SES* rses = (ROUTER_CLIENT_SES *)data;
+        ROUTER_INSTANCE*   inst;
+        DCB*               client_dcb;
+
+        if (!rses_begin_locked_router_action(rses))
+        {
+                return;
+        }
+        if (rses->rses_failover_usec == 0)
+        {
+                rses_end_locked_router_action(rses);
+                return;
+        }
+        inst = (ROUTER_INSTANCE *)rses->rses_session->service->router_instance;
+
+        if (failover_connect_master(inst, rses))
+        {
+                rses_end_locked_router_action(rses);
+                return;
+        }
+        if (response_clock() - rses->rses_failover_usec <
+                (unsigned long)rses->rses_config.rw_master_failover_wait * 1000000)
+        {
+                timer_start(&rses->rses_failover_timer,
+                            RWSPLIT_FAILOVER_POLL_MS,
+                            failover_tick,
+                            rses);
+                rses_end_locked_router_action(rses);
+                return;
+        }
+        LOGIF(LE, (skygw_log_write_flush(
+                LOGFILE_ERROR,
+                "Error : No master was found in %d seconds, %d held writes "
+                "fail.",
+                rses->rses_config.rw_master_failover_wait,
+                rses->rses_failover_nheld)));
+        client_dcb = rses->rses_session->client;
+
+        while (rses->rses_failover_held != NULL)
+        {
+                bref_stmt_t* stmt = rses->rses_failover_held;
+                GWBUF*       errbuf;
+
+                rses->rses_failover_held = stmt->stmt_next;
+                gwbuf_free(stmt->stmt_buf);
+                free(stmt);
+                errbuf = modutil_create_mysql_err_msg(1,
+                                                      2003,
+                                                      "HY000",
+                                                      "No master server is available");
+
+                if (errbuf != NULL && client_dcb != NULL)
                 {
-                        if (rses != NULL)
-                                CHK_CLIENT_RSES(rses);
-                        
-                        if (!rses_begin_locked_router_action(rses))
-                        {
-                                *succp = false;
-                                return;
-                        }
-                        
-                        *succp = handle_error_new_connection(inst, 
-                                                             rses, 
-                                                             backend_dcb, 
-                                                             errmsgbuf);
-                        rses_end_locked_router_action(rses);
-                        break;
+                        client_dcb->func.write(client_dcb, errbuf);
                 }
-                
-                case ERRACT_REPLY_CLIENT:
+                else if (errbuf != NULL)
                 {
-                        *succp = handle_error_reply_client(session, errmsgbuf);
-                        break;       
+                        gwbuf_free(errbuf);
                 }
-                
-                default:
-                        *succp = false;
-                        break;
         }
+        rses->rses_failover_nheld = 0;
+        rses->rses_failover_usec = 0;
+        rses_end_locked_router_action(rses);
 }
 
+/**
+ * Forget the read kept for retry_reads
+ *
+ * @param rses	Router client session
+ */
+static void rses_retry_clear(
+        ROUTER_CLIENT_SES* rses)
+{
+        if (rses->rses_retry_query != NULL)
+        {
+                gwbuf_free(rses->rses_retry_query);
+                rses->rses_retry_query = NULL;
+        }
+        rses->rses_retry_bref = NULL;
+}
 
-static bool handle_error_reply_client(
-        SESSION* ses,
-        GWBUF*   errmsg)
+/**
+ * Resend the read kept for retry_reads after its backend failed. The read
+ * goes to another slave, or to the master if no slave is connected, and it
+ * is kept again in case that backend fails too. The time allowed for the
+ * retries is counted from when the read was first routed.
+ *
+ * Router session must be locked.
+ *
+ * @param inst	Router instance
+ * @param rses	Router client session
+ *
+ * @return true if the read was resent
+ */
+static bool rses_retry_read(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses)
 {
-        session_state_t sesstate;
-        DCB*            client_dcb;
-        bool            succp;
+        GWBUF*         querybuf = rses->rses_retry_query;
+        GWBUF*         retrybuf;
+        DCB*           dcb = NULL;
+        backend_ref_t* bref;
 
-        spinlock_acquire(&ses->ses_lock);
-        sesstate = ses->state;
-        client_dcb = ses->client;
-        spinlock_release(&ses->ses_lock);
+        ss_dassert(RSES_IS_LOCKED(rses));
+        rses->rses_retry_query = NULL;
+        rses->rses_retry_bref = NULL;
 
-        if (sesstate == SESSION_STATE_ROUTER_READY)
+        if (querybuf == NULL || rses->rses_closed)
         {
-                CHK_DCB(client_dcb);
-                client_dcb->func.write(client_dcb, errmsg);
+                goto return_fail;
+        }
+        if (!get_dcb(&dcb, rses, BE_SLAVE, get_query_max_rlag(rses, querybuf)) ||
+                (bref = get_bref_from_dcb(rses, dcb)) == NULL)
+        {
+                goto return_fail;
+        }
+        retrybuf = gwbuf_clone(querybuf);
+
+        if (bref_write(rses, bref, querybuf) != 1)
+        {
+                gwbuf_free(retrybuf);
+                return false;
+        }
+        rses->rses_retry_query = retrybuf;
+        rses->rses_retry_bref = bref;
+        bref_set_state(bref, BREF_QUERY_ACTIVE);
+        bref_set_state(bref, BREF_WAITING_RESULT);
+        bref_start_query_timer(rses, bref);
+        ts_stats_add(inst->stats, RWSPLIT_N_READ_RETRY, 1);
+
+        LOGIF(LT, (skygw_log_write(
+                LOGFILE_TRACE,
+                "Read resent to %s:%d after its backend failed.",
+                bref->bref_backend->backend_server->name,
+                bref->bref_backend->backend_server->port)));
+        return true;
+
+return_fail:
+        if (querybuf != NULL)
+        {
+                gwbuf_free(querybuf);
+        }
+        return false;
+}
+
+/**
+ * Write a statement to the connection of a backend. A session command is
+ * written with the authentication entry point if it changes the user.
+ *
+ * @param bref	Backend reference
+ * @param buf	The statement
+ *
+ * @return 1 if the statement was written
+ */
+static int bref_write_now(
+        backend_ref_t* bref,
+        GWBUF*         buf)
+{
+        DCB*     dcb = bref->bref_dcb;
+        uint8_t* data = (uint8_t *)GWBUF_DATA(buf);
+
+        CHK_DCB(dcb);
+        /** The statements of a batch routed earlier are written first */
+        if (bref->bref_batch != NULL)
+        {
+                bref_write_batch(bref);
         }
-        succp = false; /** false because new servers aren's selected. */
 
-        return succp;
+        if (GWBUF_IS_TYPE_SESCMD(buf) &&
+                MYSQL_GET_COMMAND(data) == MYSQL_COM_CHANGE_USER)
+        {
+                return dcb->func.auth(dcb, NULL, dcb->session, buf);
+        }
+        return dcb->func.write(dcb, buf);
 }
 
 /**
- * This must be called with router lock
+ * Write a statement to a backend without waiting for the replies to the
+ * earlier statements. A session command can't be written while a reply to
+ * a query is still arriving, because the protocol would read the rest of
+ * that reply as the response to the session command. The session command
+ * is queued to the backend reference instead, and so is everything routed
+ * to the backend after it to keep the order. The queue is written when the
+ * reply has arrived, see bref_write_held.
+ *
+ * Router session must be locked.
+ *
+ * @param rses	Router client session
+ * @param bref	Backend reference
+ * @param buf	The statement
+ *
+ * @return 1 if the statement was written or queued
  */
-static bool handle_error_new_connection(
-        ROUTER_INSTANCE*   inst,
+static int bref_write(
         ROUTER_CLIENT_SES* rses,
-        DCB*               backend_dcb,
-        GWBUF*             errmsg)
+        backend_ref_t*     bref,
+        GWBUF*             buf)
 {
-        SESSION*       ses;
-        int            router_nservers;
-        int            max_nslaves;
-        int            max_slave_rlag;
-        backend_ref_t* bref;
-        bool           succp;
-        
-        ss_dassert(SPINLOCK_IS_LOCKED(&rses->rses_lock));
-        
-        ses = backend_dcb->session;
-        CHK_SESSION(ses);
-        
-        bref = get_bref_from_dcb(rses, backend_dcb);
-        
-        /** failed DCB has already been replaced */
-        if (bref == NULL)
+        mysql_server_cmd_t packet_type;
+        bool               is_sescmd;
+        bref_stmt_t*       stmt;
+        bref_stmt_t**      pp;
+        int                rc;
+        uint8_t*           data = (uint8_t *)GWBUF_DATA(buf);
+
+        packet_type = MYSQL_GET_COMMAND(data);
+        is_sescmd = GWBUF_IS_TYPE_SESCMD(buf);
+
+        /** A command of 16MB or more continues in the packets after it */
+        if (MYSQL_GET_PACKET_NO(data) == 0)
         {
-                succp = true;
-                goto return_succp;
+                bref->bref_fragment = (MYSQL_GET_PACKET_LEN(data) == 0xffffff);
         }
-        /** 
-         * Error handler is already called for this DCB because
-         * it's not polling anymore. It can be assumed that
-         * it succeed because rses isn't closed.
-         */
-        if (backend_dcb->state != DCB_STATE_POLLING)
+        else if (MYSQL_GET_PACKET_LEN(data) < 0xffffff)
         {
-                succp = true;
-                goto return_succp;
+                bref->bref_fragment = false;
         }
-        
-        CHK_BACKEND_REF(bref);
-        
-        if (BREF_IS_WAITING_RESULT(bref))
+
+        if (bref->bref_held == NULL &&
+                rses->rses_batching &&
+                !is_sescmd)
         {
-                DCB* client_dcb;
-                client_dcb = ses->client;
-                client_dcb->func.write(client_dcb, errmsg);
-                bref_clear_state(bref, BREF_WAITING_RESULT);
+                /** Written with the rest of the batch, see routeBatch */
+                bref->bref_batch = gwbuf_append(bref->bref_batch, buf);
+                rc = 1;
         }
-        bref_clear_state(bref, BREF_IN_USE);
-        bref_set_state(bref, BREF_CLOSED);
-        /** 
-         * Remove callback because this DCB won't be used 
-         * unless it is reconnected later, and then the callback
-         * is set again.
-         */
-        dcb_remove_callback(backend_dcb, 
-                            DCB_REASON_NOT_RESPONDING, 
-                            &router_handle_state_switch, 
-                            (void *)bref);
-        
-        router_nservers = router_get_servercount(inst);
-        max_nslaves     = rses_get_max_slavecount(rses, router_nservers);
-        max_slave_rlag  = rses_get_max_replication_lag(rses);
-        /** 
-         * Try to get replacement slave or at least the minimum 
-         * number of slave connections for router session.
-         */
-        succp = select_connect_backend_servers(
-                        &rses->rses_master_ref,
-                        rses->rses_backend_ref,
-                        router_nservers,
-                        max_nslaves,
-                        max_slave_rlag,
-                        rses->rses_config.rw_slave_select_criteria,
-                        ses,
-                        inst);
+        else if (bref->bref_held == NULL &&
+                !(is_sescmd && mpx_reply_pending(bref)))
+        {
+                rc = bref_write_now(bref, buf);
+        }
+        else if ((stmt = (bref_stmt_t *)malloc(sizeof(bref_stmt_t))) == NULL)
+        {
+                gwbuf_free(buf);
+                rc = 0;
+        }
+        else
+        {
+                stmt->stmt_buf = buf;
+                stmt->stmt_next = NULL;
 
-return_succp:
-        return succp;        
-}
+                for (pp = &bref->bref_held; *pp != NULL; pp = &(*pp)->stmt_next)
+                        ;
+                *pp = stmt;
+                rc = 1;
 
+                LOGIF(LT, (skygw_log_write(
+                        LOGFILE_TRACE,
+                        "%s waits for the replies of %s:%d before it is "
+                        "written.",
+                        STRPACKETTYPE(packet_type),
+                        bref->bref_backend->backend_server->name,
+                        bref->bref_backend->backend_server->port)));
+        }
+        /**
+         * Replies to session commands are counted by the cursor, a packet
+         * that continues a command or sends a file has no reply of its own.
+         */
+        if (rc == 1 && !is_sescmd && MYSQL_GET_PACKET_NO(data) == 0)
+        {
+                mpx_expect_reply(rses, bref, packet_type);
+        }
+        return rc;
+}
 
-static void print_error_packet(
-        ROUTER_CLIENT_SES* rses, 
-        GWBUF*             buf, 
-        DCB*               dcb)
+/**
+ * Write the statements that are queued to a backend reference until a
+ * session command has to wait for a reply again.
+ *
+ * Router session must be locked.
+ *
+ * @param bref	Backend reference
+ */
+static void bref_write_held(
+        backend_ref_t* bref)
 {
-#if defined(SS_DEBUG)
-        if (GWBUF_IS_TYPE_MYSQL(buf))
+        bref_stmt_t* stmt;
+
+        while ((stmt = bref->bref_held) != NULL &&
+                !(GWBUF_IS_TYPE_SESCMD(stmt->stmt_buf) && mpx_reply_pending(bref)))
         {
-                while (gwbuf_length(buf) > 0)
+                bref->bref_held = stmt->stmt_next;
+
+                if (bref_write_now(bref, stmt->stmt_buf) != 1)
                 {
-                        /** 
-                         * This works with MySQL protocol only ! 
-                         * Protocol specific packet print functions would be nice.
-                         */
-                        uint8_t* ptr = GWBUF_DATA(buf);
-                        size_t   len = MYSQL_GET_PACKET_LEN(ptr);
-                        
-                        if (MYSQL_GET_COMMAND(ptr) == 0xff)
-                        {
-                                SERVER*        srv = NULL;
-                                backend_ref_t* bref = rses->rses_backend_ref;
-                                int            i;
-                                char*          bufstr;
-                                
-                                for (i=0; i<rses->rses_nbackends; i++)
-                                {
-                                        if (bref[i].bref_dcb == dcb)
-                                        {
-                                                srv = bref[i].bref_backend->backend_server;
-                                        }
-                                }
-                                ss_dassert(srv != NULL);
-                                
-                                bufstr = strndup(&ptr[7], len-3);
-                                
-                                LOGIF(LE, (skygw_log_write_flush(
-                                        LOGFILE_ERROR,
-                                        "Error : Backend server %s:%d responded with "
-                                        "error : %s",
-                                        srv->name,
-                                        srv->port,
-                                        bufstr)));                
-                                free(bufstr);
-                        }
-                        buf = gwbuf_consume(buf, len+4);
+                        LOGIF(LE, (skygw_log_write_flush(
+                                LOGFILE_ERROR,
+                                "Error : Writing a pipelined statement to "
+                                "%s:%d failed.",
+                                bref->bref_backend->backend_server->name,
+                                bref->bref_backend->backend_server->port)));
                 }
+                free(stmt);
         }
-        else
+}
+
+/**
+ * Write the statements of a batch that were collected for a backend with
+ * one write.
+ *
+ * Router session must be locked.
+ *
+ * @param bref	Backend reference
+ *
+ * @return 1 if the statements were written
+ */
+static int bref_write_batch(
+        backend_ref_t* bref)
+{
+        GWBUF* buf = bref->bref_batch;
+        int    rc;
+
+        if (buf == NULL)
         {
-                while ((buf = gwbuf_consume(buf, GWBUF_LENGTH(buf))) != NULL);
+                return 1;
         }
-#endif /*< SS_DEBUG */
+        bref->bref_batch = NULL;
+        CHK_DCB(bref->bref_dcb);
+
+        if ((rc = bref->bref_dcb->func.write(bref->bref_dcb, buf)) != 1)
+        {
+                LOGIF(LE, (skygw_log_write_flush(
+                        LOGFILE_ERROR,
+                        "Error : Writing a batch of statements to %s:%d "
+                        "failed.",
+                        bref->bref_backend->backend_server->name,
+                        bref->bref_backend->backend_server->port)));
+        }
+        return rc;
 }
 
-static int router_get_servercount(
-        ROUTER_INSTANCE* inst)
+/**
+ * Forget the statements queued to a backend and the replies expected from
+ * it when its connection is closed or returned to the pool
+ *
+ * @param bref	Backend reference
+ */
+static void bref_clear_pipeline(
+        backend_ref_t* bref)
 {
-        int       router_nservers = 0;
-        BACKEND** b = inst->servers;
-        /** count servers */
-        while (*(b++) != NULL) router_nservers++;
-                                                                
-        return router_nservers;
+        bref_stmt_t* stmt;
+
+        while ((stmt = bref->bref_held) != NULL)
+        {
+                bref->bref_held = stmt->stmt_next;
+                gwbuf_consume(stmt->stmt_buf, gwbuf_length(stmt->stmt_buf));
+                free(stmt);
+        }
+        if (bref->bref_batch != NULL)
+        {
+                gwbuf_consume(bref->bref_batch, gwbuf_length(bref->bref_batch));
+                bref->bref_batch = NULL;
+        }
+        bref->bref_mpx_state = MPX_REPLY_IDLE;
+        bref->bref_mpx_nreplies = 0;
+        bref->bref_mpx_pktlen = 0;
+        bref->bref_mpx_skip = 0;
+        bref->bref_mpx_status = -1;
+        bref->bref_fragment = false;
 }
 
-static bool have_enough_servers(
-        ROUTER_CLIENT_SES** p_rses,
-        const int           min_nsrv,
-        int                 router_nsrv,
-        ROUTER_INSTANCE*    router)
+/**
+ * Process a reply to the queries of a backend. The query timer is stopped
+ * and the response time sampled when the backend starts to reply. A reply
+ * that is followed releases the waiter of its query when it is complete,
+ * so that each of the pipelined queries is counted and the next one is
+ * timed from the end of the previous reply. A reply that isn't followed
+ * releases one waiter when it starts.
+ *
+ * Router session must be locked.
+ *
+ * @param rses	Router client session
+ * @param bref	Backend reference the reply is from
+ * @param buf	The reply buffers
+ */
+static void bref_query_reply(
+        ROUTER_CLIENT_SES* rses,
+        backend_ref_t*     bref,
+        GWBUF*             buf)
 {
-        bool succp;
-        
-        /** With too few servers session is not created */
-        if (router_nsrv < min_nsrv || 
-                MAX((*p_rses)->rses_config.rw_max_slave_conn_count, 
-                    (router_nsrv*(*p_rses)->rses_config.rw_max_slave_conn_percent)/100)
-                        < min_nsrv)
+        bool followed;
+        int  ndone;
+        int  i;
+
+        followed = (bref->bref_mpx_state != MPX_REPLY_UNKNOWN &&
+                    bref->bref_mpx_state != MPX_REPLY_IDLE);
+
+        if (BREF_IS_QUERY_ACTIVE(bref))
         {
-                if (router_nsrv < min_nsrv)
+                bref_clear_state(bref, BREF_QUERY_ACTIVE);
+                /** The backend has answered, stop the query timer */
+                if (rses->rses_config.rw_backend_reply_timeout > 0)
                 {
-                        LOGIF(LE, (skygw_log_write_flush(
-                                LOGFILE_ERROR,
-                                "Error : Unable to start %s service. There are "
-                                "too few backend servers available. Found %d "
-                                "when %d is required.",
-                                router->service->name,
-                                router_nsrv,
-                                min_nsrv)));
+                        dcb_set_idle_timeout(bref->bref_dcb, 0);
                 }
-                else
+                if (!followed)
                 {
-                        double pct = (*p_rses)->rses_config.rw_max_slave_conn_percent/100;
-                        double nservers = (double)router_nsrv*pct;
-                        
-                        if ((*p_rses)->rses_config.rw_max_slave_conn_count < min_nsrv)
-                        {
-                                LOGIF(LE, (skygw_log_write_flush(
-                                        LOGFILE_ERROR,
-                                        "Error : Unable to start %s service. There are "
-                                        "too few backend servers configured in "
-                                        "MaxScale.cnf. Found %d when %d is required.",
-                                        router->service->name,
-                                        (*p_rses)->rses_config.rw_max_slave_conn_count,
-                                        min_nsrv)));
-                        }
-                        if (nservers < min_nsrv)
-                        {
-                                LOGIF(LE, (skygw_log_write_flush(
-                                        LOGFILE_ERROR,
-                                        "Error : Unable to start %s service. There are "
-                                        "too few backend servers configured in "
-                                        "MaxScale.cnf. Found %d%% when at least %.0f%% "
-                                        "would be required.",
-                                        router->service->name,
-                                        (*p_rses)->rses_config.rw_max_slave_conn_percent,
-                                        min_nsrv/(((double)router_nsrv)/100))));
-                        }
+                        /** Set response status as replied */
+                        bref_clear_state(bref, BREF_WAITING_RESULT);
                 }
-                free(*p_rses);
-                *p_rses = NULL;
-                succp = false;
         }
-        else
+        if (!followed && bref->bref_mpx_skip == 0)
+        {
+                return;
+        }
+        ndone = mpx_track_reply(rses, bref, buf);
+
+        for (i = 0; i < ndone; i++)
+        {
+                /** Set response status as replied */
+                bref_clear_state(bref, BREF_WAITING_RESULT);
+        }
+        if (ndone > 0)
         {
-                succp = true;
+                rses_track_server_status(rses, bref);
         }
-        return succp;
-}
 
-/** 
- * Find out the number of read backend servers.
- * Depending on the configuration value type, either copy direct count 
- * of slave connections or calculate the count from percentage value.
- */
-static int rses_get_max_slavecount(
-        ROUTER_CLIENT_SES* rses,
-        int                router_nservers)
-{
-        int conf_max_nslaves;
-        int max_nslaves;
-        
-        CHK_CLIENT_RSES(rses);
-        
-        if (rses->rses_config.rw_max_slave_conn_count > 0)
+        if (bref->bref_mpx_state == MPX_REPLY_UNKNOWN)
         {
-                conf_max_nslaves = rses->rses_config.rw_max_slave_conn_count;
+                /** The reply in progress is counted as it used to be */
+                if (followed && bref->bref_mpx_nreplies > 0)
+                {
+                        bref_clear_state(bref, BREF_WAITING_RESULT);
+                }
+                bref->bref_mpx_nreplies = 0;
         }
-        else
+        else if (ndone > 0 &&
+                bref->bref_mpx_nreplies > 0 &&
+                bref->bref_mpx_state == MPX_REPLY_FIRST &&
+                bref->bref_mpx_pktlen == 0 &&
+                bref->bref_mpx_skip == 0)
         {
-                conf_max_nslaves = 
-                (router_nservers*rses->rses_config.rw_max_slave_conn_percent)/100;
+                /** The backend works on the next pipelined query */
+                bref_set_state(bref, BREF_QUERY_ACTIVE);
+                bref_start_query_timer(rses, bref);
         }
-        max_nslaves = MIN(router_nservers-1, MAX(1, conf_max_nslaves));
-        
-        return max_nslaves;
 }
 
-
-static int rses_get_max_replication_lag(
-        ROUTER_CLIENT_SES* rses)
+/**
+ * Check if a reply is the request of the server for the file of a LOAD DATA
+ * LOCAL INFILE. A followed reply has told it by its state. Otherwise the
+ * request is a reply of its own, the protocol ends a reply where the server
+ * waits for the client: one packet that starts with 0xfb. A row can begin
+ * with 0xfb too but it is never the whole reply.
+ *
+ * Router session must be locked.
+ *
+ * @param bref	Backend reference the reply is from
+ * @param buf	The reply buffers
+ *
+ * @return true if the server waits for the file
+ */
+static bool bref_is_infile_request(
+        backend_ref_t* bref,
+        GWBUF*         buf)
 {
-        int conf_max_rlag;
-        
-        CHK_CLIENT_RSES(rses);
-        
-        /** if there is no configured value, then longest possible int is used */
-        if (rses->rses_config.rw_max_slave_replication_lag > 0)
+        GWBUF*   last;
+        uint8_t* data;
+
+        if (bref->bref_mpx_state == MPX_REPLY_INFILE)
         {
-                conf_max_rlag = rses->rses_config.rw_max_slave_replication_lag;
+                return true;
         }
-        else
+        if (bref->bref_mpx_state != MPX_REPLY_UNKNOWN ||
+                GWBUF_LENGTH(buf) < 5)
         {
-                conf_max_rlag = ~(1<<31);
+                return false;
         }
-        
-        return conf_max_rlag;
-}
+        for (last = buf; last->next != NULL; last = last->next)
+                ;
+        data = (uint8_t *)GWBUF_DATA(buf);
 
+        return GWBUF_IS_TYPE_RESPONSE_END(last) &&
+                data[4] == 0xfb &&
+                gwbuf_length(buf) == MYSQL_GET_PACKET_LEN(data) + 4;
+}
 
-static backend_ref_t* get_bref_from_dcb(
+/**
+ * Pass a packet of the file of a LOAD DATA LOCAL INFILE to the master. The
+ * packets are written as they came from the client, they aren't classified
+ * or copied, until the empty packet that ends the file. The reply to the
+ * statement follows the file and it is followed from there like the reply
+ * to any query.
+ *
+ * @param rses	Router client session
+ * @param buf	A packet of the file
+ *
+ * @return 1 if the packet was written to the master
+ */
+static int route_load_data(
         ROUTER_CLIENT_SES* rses,
-        DCB*               dcb)
+        GWBUF*             buf)
 {
         backend_ref_t* bref;
-        int            i = 0;
-        CHK_DCB(dcb);
-        CHK_CLIENT_RSES(rses);
-        
-        bref = rses->rses_backend_ref;
-        
-        while (i<rses->rses_nbackends)
+        uint8_t*       data = (uint8_t *)GWBUF_DATA(buf);
+        int            rc;
+
+        if (!rses_begin_locked_router_action(rses))
         {
-                if (bref->bref_dcb == dcb)
-                {
-                        break;
-                }
-                bref++;
-                i += 1;
+                gwbuf_free(buf);
+                return 0;
         }
-        
-        if (i == rses->rses_nbackends)
+        bref = rses->rses_master_ref;
+
+        if (bref == NULL || !BREF_IS_IN_USE(bref) || bref->bref_dcb == NULL)
         {
-                bref = NULL;
+                rses->rses_load_data = false;
+                rses_end_locked_router_action(rses);
+                gwbuf_free(buf);
+                LOGIF(LE, (skygw_log_write_flush(
+                        LOGFILE_ERROR,
+                        "Error : The master was lost during LOAD DATA LOCAL "
+                        "INFILE.")));
+                return 0;
         }
-        return bref;
-}
 
-static int router_handle_state_switch(
-        DCB*       dcb,
-        DCB_REASON reason,
-        void*      data)
-{
-        backend_ref_t*     bref;
-        int                rc = 1;
-        ROUTER_CLIENT_SES* rses;
-        SESSION*           ses;
-        SERVER*            srv;
-        
-        CHK_DCB(dcb);
-        bref = (backend_ref_t *)data;
-        CHK_BACKEND_REF(bref);
-       
-        srv = bref->bref_backend->backend_server;
-        
-        if (SERVER_IS_RUNNING(srv) && SERVER_IS_IN_CLUSTER(srv))
+        if (MYSQL_GET_PACKET_LEN(data) == 0)
         {
-                goto return_rc;
+                /** The end of the file, the server replies to the statement */
+                rses->rses_load_data = false;
+
+                if (bref->bref_mpx_state == MPX_REPLY_INFILE)
+                {
+                        bref->bref_mpx_state = MPX_REPLY_FIRST;
+                        bref_set_state(bref, BREF_QUERY_ACTIVE);
+                        bref_start_query_timer(rses, bref);
+                }
         }
-        ses = dcb->session;
-        CHK_SESSION(ses);
 
-        rses = (ROUTER_CLIENT_SES *)dcb->session->router_session;
-        CHK_CLIENT_RSES(rses);
+        rc = bref_write(rses, bref, buf);
+        rses_end_locked_router_action(rses);
 
-        switch (reason) {
-                case DCB_REASON_NOT_RESPONDING:
-                        dcb->func.hangup(dcb);
-                        break;
-                        
-                default:
-                        break;
-        }
-        
-return_rc:
         return rc;
 }
 
-static sescmd_cursor_t* backend_ref_get_sescmd_cursor (
-        backend_ref_t* bref)
+/**
+ * Pass a packet that continues a statement of 16MB or more to the backends
+ * that the first packet of the statement was written to. The packets are
+ * not classified or copied, each backend but the last gets a clone of the
+ * buffers.
+ *
+ * @param rses	Router client session
+ * @param buf	A packet of the statement, a chain of buffers
+ *
+ * @return 1 if the packet was written to the backends
+ */
+static int route_fragment(
+        ROUTER_CLIENT_SES* rses,
+        GWBUF*             buf)
 {
-        sescmd_cursor_t* scur;
-        CHK_BACKEND_REF(bref);
-        
-        scur = &bref->bref_sescmd_cur;
-        CHK_SESCMD_CUR(scur);
-        
-        return scur;
-}
+        backend_ref_t* last = NULL;
+        int            rc = 1;
+        int            i;
 
-#if defined(PREP_STMT_CACHING)
-#define MAX_STMT_LEN 1024
+        if (!rses_begin_locked_router_action(rses))
+        {
+                gwbuf_consume(buf, gwbuf_length(buf));
+                return 0;
+        }
 
-static prep_stmt_t* prep_stmt_init(
-        prep_stmt_type_t type,
-        void*            id)
-{
-        prep_stmt_t* pstmt;
-        
-        pstmt = (prep_stmt_t *)calloc(1, sizeof(prep_stmt_t));
-        
-        if (pstmt != NULL)
+        for (i = 0; i < rses->rses_nbackends; i++)
         {
-#if defined(SS_DEBUG)
-                pstmt->pstmt_chk_top  = CHK_NUM_PREP_STMT;
-                pstmt->pstmt_chk_tail = CHK_NUM_PREP_STMT;
-#endif
-                pstmt->pstmt_state = PREP_STMT_ALLOC;
-                pstmt->pstmt_type  = type;
-                
-                if (type == PREP_STMT_NAME)
+                backend_ref_t* bref = &rses->rses_backend_ref[i];
+                GWBUF*         clone = NULL;
+                GWBUF*         b;
+
+                if (!bref->bref_fragment ||
+                        !BREF_IS_IN_USE(bref) ||
+                        bref->bref_dcb == NULL)
                 {
-                        pstmt->pstmt_id.name = strndup((char *)id, MAX_STMT_LEN);
+                        continue;
                 }
-                else
+                if (last != NULL)
                 {
-                        pstmt->pstmt_id.seq = 0;
+                        for (b = buf; b != NULL; b = b->next)
+                        {
+                                clone = gwbuf_append(clone, gwbuf_clone(b));
+                        }
+                        if (bref_write(rses, last, clone) != 1)
+                        {
+                                rc = 0;
+                        }
                 }
+                last = bref;
         }
-        CHK_PREP_STMT(pstmt);
-        return pstmt;
-}
 
-static void prep_stmt_done(
-        prep_stmt_t* pstmt)
-{
-        CHK_PREP_STMT(pstmt);
-        
-        if (pstmt->pstmt_type == PREP_STMT_NAME)
+        if (last == NULL)
         {
-                free(pstmt->pstmt_id.name);
+                rses_end_locked_router_action(rses);
+                gwbuf_consume(buf, gwbuf_length(buf));
+                LOGIF(LE, (skygw_log_write_flush(
+                        LOGFILE_ERROR,
+                        "Error : The backend of a statement of 16MB or more "
+                        "was lost before the rest of it was routed.")));
+                return 0;
         }
-        free(pstmt);
+        if (bref_write(rses, last, buf) != 1)
+        {
+                rc = 0;
+        }
+        rses_end_locked_router_action(rses);
+
+        return rc;
 }
 
-static bool prep_stmt_drop(
-        prep_stmt_t* pstmt)
+/**
+ * Take the transaction and autocommit state of the session from the status
+ * flags of the reply that the master sent last. The server knows of the
+ * implicit commits and the transactions of stored procedures, which the
+ * query types don't tell, so the reads go to the slaves as soon as the
+ * transaction has ended. The state only follows the server when nothing
+ * else has been routed to the master after the query of the reply, since
+ * the state of the statements routed later is already in the session.
+ *
+ * Router session must be locked.
+ *
+ * @param rses	Router client session
+ * @param bref	Backend reference the reply is from
+ */
+static void rses_track_server_status(
+        ROUTER_CLIENT_SES* rses,
+        backend_ref_t*     bref)
 {
-        CHK_PREP_STMT(pstmt);
-        
-        pstmt->pstmt_state = PREP_STMT_DROPPED;
-        return true;
+        int  status = bref->bref_mpx_status;
+        bool autocommit;
+        bool trx_active;
+
+        bref->bref_mpx_status = -1;
+
+        if (bref != rses->rses_master_ref ||
+                rses->rses_trx_slave != NULL ||
+                status == -1 ||
+                bref->bref_mpx_state != MPX_REPLY_IDLE ||
+                bref->bref_held != NULL ||
+                bref->bref_batch != NULL ||
+                sescmd_cursor_is_active(&bref->bref_sescmd_cur))
+        {
+                return;
+        }
+        autocommit = (status & SERVER_STATUS_AUTOCOMMIT) != 0;
+        trx_active = (status & SERVER_STATUS_IN_TRANS) != 0 || !autocommit;
+
+        if (autocommit != rses->rses_autocommit_enabled ||
+                trx_active != rses->rses_transaction_active)
+        {
+                LOGIF(LT, (skygw_log_write(
+                        LOGFILE_TRACE,
+                        "Master %s:%d reports %s with autocommit %s.",
+                        bref->bref_backend->backend_server->name,
+                        bref->bref_backend->backend_server->port,
+                        (trx_active ? "an active transaction" :
+                         "no transaction"),
+                        (autocommit ? "enabled" : "disabled"))));
+                /** autocommit was changed by something else than a SET */
+                if (autocommit != rses->rses_autocommit_enabled)
+                {
+                        rses->rses_sescmd_state_lost = true;
+                }
+                rses->rses_autocommit_enabled = autocommit;
+                rses->rses_transaction_active = trx_active;
+        }
 }
-#endif /*< PREP_STMT_CACHING */
 
-/********************************
- * This routine returns the root master server from MySQL replication tree
- * Get the root Master rule:
- *
- * find server with the lowest replication depth level
- * and the SERVER_MASTER bitval
- * Servers are checked even if they are in 'maintenance'
+/**
+ * Check that no reply of a session is still to come, so that a reply made
+ * by the router is in the order of the statements. Router session must be
+ * locked.
  *
- * @param	servers		The list of servers
- * @param	router_nservers	The number of servers
- * @return			The Master found
+ * @param rses	Router client session
  *
+ * @return true if no statement of the session is waiting for its reply
  */
-static BACKEND *get_root_master(backend_ref_t *servers, int router_nservers) {
-        int i = 0;
-        BACKEND * master_host = NULL;
+static bool rses_is_idle(
+        ROUTER_CLIENT_SES* rses)
+{
+        int i;
 
-        for (i = 0; i< router_nservers; i++) {
-                BACKEND* b = NULL;
-                b = servers[i].bref_backend;
-                if (b && (b->backend_server->status & (SERVER_MASTER|SERVER_MAINT)) == SERVER_MASTER) {
-                        if (master_host && b->backend_server->depth < master_host->backend_server->depth) {
-                                master_host = b;
-                        } else {
-                                if (master_host == NULL) {
-                                        master_host = b;
-                                }
-                        }
+        if (rses->rses_causal_query != NULL ||
+                rses->rses_causal_reply != NULL ||
+                rses->rses_failover_held != NULL ||
+                rses->rses_pstmt_exec != NULL ||
+                rses->rses_batching)
+        {
+                return false;
+        }
+        for (i = 0; i < rses->rses_nbackends; i++)
+        {
+                if (BREF_IS_WAITING_RESULT((&rses->rses_backend_ref[i])))
+                {
+                        return false;
                 }
         }
-	return master_host;
+        return true;
 }
 
+/**
+ * Answer a statement that reads no data of the databases, such as SELECT 1
+ * or SELECT @@tx_isolation, with the variables of the master as its
+ * monitor last read them, see localread_reply. The statement is answered
+ * only when no reply of the session is still to come, so that the replies
+ * stay in the order of the statements. The variables that a session may
+ * change are no longer answered once a session command has been routed.
+ *
+ * @param inst		The router instance
+ * @param rses		The router client session
+ * @param querybuf	The COM_QUERY, freed if it is answered
+ * @return		true if the statement was answered, false if it must
+ *			be routed
+ */
+static bool route_local_read(
+        ROUTER_INSTANCE*   inst,
+        ROUTER_CLIENT_SES* rses,
+        GWBUF*             querybuf)
+{
+        GWBUF* reply;
+        SERVER* master;
+        int    status = 0;
+
+        if (!rses_begin_locked_router_action(rses))
+        {
+                return false;
+        }
+        if (rses->rses_master_ref == NULL || !rses_is_idle(rses))
+        {
+                rses_end_locked_router_action(rses);
+                return false;
+        }
+        master = rses->rses_master_ref->bref_backend->backend_server;
+
+        if (rses->rses_transaction_active)
+        {
+                status |= LOCALREAD_STATUS_IN_TRANS;
+        }
+        if (rses->rses_autocommit_enabled)
+        {
+                status |= LOCALREAD_STATUS_AUTOCOMMIT;
+        }
+        reply = localread_reply(querybuf, master, rses->rses_vars_changed, status);
+        rses_end_locked_router_action(rses);
+
+        if (reply == NULL)
+        {
+                return false;
+        }
+        LOGIF(LT, (skygw_log_write(
+                LOGFILE_TRACE,
+                "[%s]\tStatement answered by the router.",
+                inst->service->name)));
+        ts_stats_add(inst->stats, RWSPLIT_N_LOCAL_READ, 1);
+        route_count(inst, NULL, RWSPLIT_R_LOCAL);
+        gwbuf_free(querybuf);
+        SESSION_ROUTE_REPLY(rses->rses_session, reply);
+        return true;
+}
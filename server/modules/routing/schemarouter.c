@@ -0,0 +1,1968 @@
+/*
+ * This file is distributed as part of SkySQL MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file schemarouter.c - A router that shards the databases of the clients
+ * over groups of backend servers
+ *
+ * The router options map the databases to the shards, a shard is a group
+ * of servers of the service that hold the same databases:
+ *
+ *	router_options=tenant1=shard1a|shard1b,tenant2=shard2,default=shard1a|shard1b
+ *
+ * The connections to a shard go to the first running server of its group.
+ * The databases that are not mapped are in the default shard, the shard of
+ * the first server of the service unless the default option sets it.
+ *
+ * A session opens its connection to a shard when it first routes a
+ * statement there. The current database of the client, the database of the
+ * handshake or of the last USE or COM_INIT_DB, chooses the shard of the
+ * statements. A statement whose tables, as the query classifier finds them,
+ * are qualified with the databases of another shard goes to that shard, and
+ * one whose tables are in more than one shard is refused. SHOW DATABASES is
+ * sent to all the shards and the rows of their results are merged.
+ *
+ * A SELECT with the hint "maxscale fanout=all", or fanout=<database>,...
+ * for the shards of the databases, is sent to the shards in parallel and
+ * their rows are merged into one result set, in the order of the first
+ * column of its ORDER BY and up to its LIMIT. Each shard computes its own
+ * aggregates and groups, they are not combined.
+ *
+ * The backend connections are authenticated without a database, the router
+ * sets the default database of each connection with COM_INIT_DB when the
+ * connection is used for the current database. The session commands, SET
+ * and the like, go to all the open connections and are kept, up to
+ * SCHEMA_MAX_SESCMD of them, for the connections opened later. The replies
+ * to the commands of the router are not sent to the client.
+ *
+ * A transaction is not atomic over the shards, and prepared statements and
+ * the other commands go to the shard of the current database.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <service.h>
+#include <server.h>
+#include <router.h>
+#include <atomic.h>
+#include <spinlock.h>
+#include <dcb.h>
+#include <modutil.h>
+#include <hint.h>
+#include <schemarouter.h>
+#include <mysql_packet.h>
+
+#include <skygw_types.h>
+#include <skygw_utils.h>
+#include <log_manager.h>
+
+#include <query_classifier.h>
+
+extern int lm_enabled_logfiles_bitmask;
+
+static char *version_str = "V1.0.0";
+
+/* The router entry points */
+static	ROUTER	*createInstance(SERVICE *service, char **options);
+static	void	*newSession(ROUTER *instance, SESSION *session);
+static	void 	closeSession(ROUTER *instance, void *router_session);
+static	void 	freeSession(ROUTER *instance, void *router_session);
+static	int	routeQuery(ROUTER *instance, void *router_session, GWBUF *queue);
+static	void	diagnostics(ROUTER *instance, DCB *dcb);
+
+static  void    clientReply(
+        ROUTER  *instance,
+        void    *router_session,
+        GWBUF   *queue,
+        DCB     *backend_dcb);
+
+static  void    handleError(
+        ROUTER           *instance,
+        void             *router_session,
+        GWBUF            *errbuf,
+        DCB              *backend_dcb,
+        error_action_t   action,
+        bool             *succp);
+
+/** The module object definition */
+static ROUTER_OBJECT MyObject = {
+    createInstance,
+    newSession,
+    closeSession,
+    freeSession,
+    routeQuery,
+    diagnostics,
+    clientReply,
+    handleError
+};
+
+static bool rses_begin_router_action(
+        ROUTER_CLIENT_SES* rses);
+
+static void rses_exit_router_action(
+        ROUTER_CLIENT_SES* rses);
+
+static int	route_use(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+			GWBUF *queue, char *db);
+static int	route_query(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+			GWBUF *queue);
+static int	route_sescmd(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+			GWBUF *queue);
+static int	route_fanout(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses,
+			GWBUF *queue, bool *shards, char *sql, int mode);
+static void	merge_replies(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses);
+
+static SPINLOCK	instlock;
+static ROUTER_INSTANCE *instances;
+
+/**
+ * Implementation of the mandatory version entry point
+ *
+ * @return version string of the module
+ */
+char *
+version()
+{
+	return version_str;
+}
+
+/**
+ * The module initialisation routine, called when the module
+ * is first loaded.
+ */
+void
+ModuleInit()
+{
+        LOGIF(LM, (skygw_log_write(
+                           LOGFILE_MESSAGE,
+                           "Initialise schemarouter router module %s.\n",
+                           version_str)));
+        spinlock_init(&instlock);
+	instances = NULL;
+}
+
+/**
+ * The module entry point routine. It is this routine that
+ * must populate the structure that is referred to as the
+ * "module object", this is a structure with the set of
+ * external entry points for this module.
+ *
+ * @return The module object
+ */
+ROUTER_OBJECT *
+GetModuleObject()
+{
+	return &MyObject;
+}
+
+/**
+ * The FNV-1a hash of a database name
+ *
+ * @param key	The name
+ * @return	The hash value
+ */
+static int
+schema_hash(char *key)
+{
+unsigned int	hash = 2166136261U;
+
+	while (*key)
+	{
+		hash ^= (unsigned char)*key++;
+		hash *= 16777619U;
+	}
+	return hash & 0x7fffffff;
+}
+
+/**
+ * Find the shard of a group of servers or add it. The group is the unique
+ * names of the servers separated by '|'.
+ *
+ * @param inst		The router instance
+ * @param group		The servers of the shard
+ * @return		The shard or NULL if a server is not a server of the
+ *			service or memory could not be allocated
+ */
+static SHARD *
+shard_find(ROUTER_INSTANCE *inst, char *group)
+{
+SHARD	*shard, **shards;
+SERVER	*server;
+char	*names, *name, *lasts;
+int	i, n = 1;
+
+	for (i = 0; i < inst->n_shards; i++)
+	{
+		if (strcmp(inst->shards[i]->name, group) == 0)
+			return inst->shards[i];
+	}
+	for (name = group; *name; name++)
+		if (*name == '|')
+			n++;
+	if ((shard = (SHARD *)calloc(1, sizeof(SHARD))) == NULL ||
+		(shard->servers = (SERVER **)calloc(n, sizeof(SERVER *))) == NULL ||
+		(shard->name = strdup(group)) == NULL ||
+		(names = strdup(group)) == NULL)
+	{
+		if (shard)
+		{
+			free(shard->servers);
+			free(shard->name);
+			free(shard);
+		}
+		return NULL;
+	}
+	for (name = strtok_r(names, "|", &lasts); name;
+		name = strtok_r(NULL, "|", &lasts))
+	{
+		for (server = inst->service->databases; server;
+			server = server->nextdb)
+		{
+			if (server->unique_name &&
+				strcmp(server->unique_name, name) == 0)
+				break;
+		}
+		if (server == NULL)
+		{
+			LOGIF(LE, (skygw_log_write(
+				LOGFILE_ERROR,
+				"Error : Server %s of shard %s is not a server "
+				"of service %s.",
+				name,
+				group,
+				inst->service->name)));
+			break;
+		}
+		shard->servers[shard->n_servers++] = server;
+	}
+	free(names);
+
+	if (name != NULL || shard->n_servers == 0 ||
+		(shards = (SHARD **)realloc(inst->shards,
+				(inst->n_shards + 1) * sizeof(SHARD *))) == NULL)
+	{
+		free(shard->servers);
+		free(shard->name);
+		free(shard);
+		return NULL;
+	}
+	shard->index = inst->n_shards;
+	shards[inst->n_shards++] = shard;
+	inst->shards = shards;
+
+	return shard;
+}
+
+/**
+ * The shard of a database
+ *
+ * @param inst	The router instance
+ * @param db	The database, an empty string for none
+ * @return	The index of the shard
+ */
+static int
+shard_of_db(ROUTER_INSTANCE *inst, char *db)
+{
+SHARD	*shard;
+
+	if (*db && (shard = (SHARD *)hashtable_fetch(inst->map, db)) != NULL)
+		return shard->index;
+	return inst->default_shard;
+}
+
+/**
+ * Create an instance of the router for a particular service
+ * within the gateway.
+ *
+ * @param service	The service this router is being create for
+ * @param options	An array of options for this query router
+ *
+ * @return The instance data for this new instance
+ */
+static	ROUTER	*
+createInstance(SERVICE *service, char **options)
+{
+ROUTER_INSTANCE	*inst;
+SHARD		*shard;
+char		*option, *value;
+int		i;
+
+	if (service->databases == NULL || service->databases->unique_name == NULL)
+	{
+		LOGIF(LE, (skygw_log_write(
+			LOGFILE_ERROR,
+			"Error : Service %s has no servers for its shards.",
+			service->name)));
+		return NULL;
+	}
+        if ((inst = calloc(1, sizeof(ROUTER_INSTANCE))) == NULL) {
+                return NULL;
+        }
+
+	inst->service = service;
+	spinlock_init(&inst->lock);
+	inst->default_shard = -1;
+
+	if ((inst->map = hashtable_alloc(SCHEMA_MAP_SIZE, schema_hash,
+					strcmp)) == NULL)
+	{
+		free(inst);
+		return NULL;
+	}
+	hashtable_memory_fns(inst->map, (HASHMEMORYFN)strdup, NULL,
+			(HASHMEMORYFN)free, NULL);
+
+	/*
+	 * Process the options, database=server|server
+	 */
+	for (i = 0; options && options[i]; i++)
+	{
+		if ((value = strchr(options[i], '=')) == NULL ||
+			value == options[i] || value[1] == 0 ||
+			(option = strdup(options[i])) == NULL)
+		{
+			LOGIF(LE, (skygw_log_write(
+				LOGFILE_ERROR,
+				"Warning : Unsupported router option %s for "
+				"schemarouter.",
+				options[i])));
+			continue;
+		}
+		value = option + (value - options[i]);
+		*value++ = 0;
+		while (isspace((unsigned char)*value))
+			value++;
+
+		if ((shard = shard_find(inst, value)) == NULL)
+		{
+			LOGIF(LE, (skygw_log_write(
+				LOGFILE_ERROR,
+				"Warning : Router option %s of service %s "
+				"ignored.",
+				options[i],
+				service->name)));
+		}
+		else if (!strcasecmp(option, "default"))
+		{
+			inst->default_shard = shard->index;
+		}
+		else if (strlen(option) > MYSQL_DATABASE_MAXLEN ||
+			!hashtable_add(inst->map, option, shard))
+		{
+			LOGIF(LE, (skygw_log_write(
+				LOGFILE_ERROR,
+				"Warning : Database %s of service %s is mapped "
+				"more than once, router option %s ignored.",
+				option,
+				service->name,
+				options[i])));
+		}
+		else
+		{
+			shard->n_databases++;
+		}
+		free(option);
+	}
+
+	/*< The default shard is the first server of the service */
+	if (inst->default_shard == -1)
+	{
+		if ((shard = shard_find(inst,
+				service->databases->unique_name)) == NULL)
+		{
+			for (i = 0; i < inst->n_shards; i++)
+			{
+				free(inst->shards[i]->servers);
+				free(inst->shards[i]->name);
+				free(inst->shards[i]);
+			}
+			free(inst->shards);
+			hashtable_free(inst->map);
+			free(inst);
+			return NULL;
+		}
+		inst->default_shard = shard->index;
+	}
+
+	/*
+	 * We have completed the creation of the instance data, so now
+	 * insert this router instance into the linked list of routers
+	 * that have been created with this module.
+	 */
+	spinlock_acquire(&instlock);
+	inst->next = instances;
+	instances = inst;
+	spinlock_release(&instlock);
+
+	return (ROUTER *)inst;
+}
+
+/**
+ * Copy bytes of a buffer chain
+ *
+ * @param buf		The buffer chain
+ * @param offset	Offset of the first byte to copy
+ * @param len		Number of bytes to copy
+ * @param out		Where to copy them
+ * @return		The number of bytes copied
+ */
+static int
+buf_copy(GWBUF *buf, int offset, int len, uint8_t *out)
+{
+int	n = 0, chunk;
+
+	for (; buf && n < len; buf = buf->next)
+	{
+		chunk = GWBUF_LENGTH(buf);
+		if (offset >= chunk)
+		{
+			offset -= chunk;
+			continue;
+		}
+		chunk -= offset;
+		if (chunk > len - n)
+			chunk = len - n;
+		memcpy(out + n, (uint8_t *)GWBUF_DATA(buf) + offset, chunk);
+		n += chunk;
+		offset = 0;
+	}
+	return n;
+}
+
+/**
+ * Make a buffer chain a single buffer
+ *
+ * @param buf	The buffer chain, freed unless it is a single buffer
+ * @return	The single buffer or NULL if memory could not be allocated
+ */
+static GWBUF *
+buf_contiguous(GWBUF *buf)
+{
+GWBUF	*rval;
+int	len;
+
+	if (buf == NULL || buf->next == NULL)
+		return buf;
+	len = gwbuf_length(buf);
+	if ((rval = gwbuf_alloc(len)) != NULL)
+	{
+		buf_copy(buf, 0, len, GWBUF_DATA(rval));
+		gwbuf_set_type(rval, buf->gwbuf_type);
+	}
+	gwbuf_consume(buf, len);
+	return rval;
+}
+
+/**
+ * The length of the packet at an offset of a buffer chain
+ *
+ * @param buf		The buffer chain
+ * @param offset	Offset of the packet
+ * @param first		Set to the first byte of the payload, 0 if it is empty
+ * @return		The length of the packet with its header or 0 if the
+ *			packet is not complete
+ */
+static int
+packet_length(GWBUF *buf, int offset, uint8_t *first)
+{
+uint8_t	hdr[5];
+int	n, len;
+
+	n = buf_copy(buf, offset, 5, hdr);
+	if (n < 4)
+		return 0;
+	len = 4 + (hdr[0] | (hdr[1] << 8) | (hdr[2] << 16));
+	if (gwbuf_length(buf) < offset + len)
+		return 0;
+	*first = (len > 4 ? hdr[4] : 0);
+	return len;
+}
+
+/**
+ * Is the reply to a SHOW DATABASES complete: an error, or the column
+ * definitions and the rows each followed by an EOF packet
+ *
+ * @param buf	The reply data
+ * @return	True if the reply is complete
+ */
+static bool
+reply_complete(GWBUF *buf)
+{
+uint8_t	first;
+int	offset = 0, len, n_eof = 0;
+
+	while ((len = packet_length(buf, offset, &first)) > 0)
+	{
+		if (offset == 0 && (first == 0xff || first == 0x00))
+			return true;
+		if (first == 0xfe && len < 9 + 4 && ++n_eof == 2)
+			return true;
+		if (first == 0xff && n_eof > 0)
+			return true;
+		offset += len;
+	}
+	return false;
+}
+
+/**
+ * Send a command of the router on a connection, its reply is not sent to
+ * the client. The caller holds the lock of the router session.
+ *
+ * @param conn	The connection to the shard
+ * @param buf	The command
+ */
+static void
+shard_send_ignored(SHARD_CONN *conn, GWBUF *buf)
+{
+	conn->n_ignore++;
+	conn->dcb->func.write(conn->dcb, buf);
+}
+
+/**
+ * Return the connection of a session to a shard, opening it when it is first
+ * used. A new connection is sent the session commands of the session. The
+ * caller holds the lock of the router session.
+ *
+ * @param inst		The router instance
+ * @param rses		The router session
+ * @param index		The shard
+ * @return		The connection or NULL if no server of the shard could
+ *			be connected to
+ */
+static DCB *
+shard_connect(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses, int index)
+{
+SHARD_CONN	*conn = &rses->rses_conns[index];
+SHARD		*shard = inst->shards[index];
+GWBUF		*buf;
+int		i;
+
+	if (conn->dcb != NULL)
+		return conn->dcb;
+
+	for (i = 0; i < shard->n_servers; i++)
+	{
+		if (SERVER_IS_RUNNING(shard->servers[i]) &&
+			(conn->dcb = dcb_connect(shard->servers[i],
+					rses->rses_session,
+					shard->servers[i]->protocol)) != NULL)
+			break;
+	}
+	if (conn->dcb == NULL)
+	{
+		LOGIF(LE, (skygw_log_write_flush(
+			LOGFILE_ERROR,
+			"Error : No server of shard %s of service %s could be "
+			"connected to.",
+			shard->name,
+			inst->service->name)));
+		return NULL;
+	}
+	conn->n_ignore = 0;
+	conn->merging = false;
+	conn->db[0] = 0;
+
+	for (conn->n_sescmd = 0; conn->n_sescmd < rses->rses_n_sescmd;
+		conn->n_sescmd++)
+	{
+		if ((buf = gwbuf_clone(rses->rses_sescmd[conn->n_sescmd])) != NULL)
+			shard_send_ignored(conn, buf);
+	}
+	return conn->dcb;
+}
+
+/**
+ * Make a database the default database of a connection. The caller holds
+ * the lock of the router session.
+ *
+ * @param conn	The connection to the shard
+ * @param db	The database, an empty string for none
+ */
+static void
+shard_use(SHARD_CONN *conn, char *db)
+{
+GWBUF	*buf;
+uint8_t	*ptr;
+int	len = strlen(db);
+
+	if (len == 0 || strcmp(conn->db, db) == 0)
+		return;
+	if ((buf = gwbuf_alloc(4 + 1 + len)) == NULL)
+		return;
+	ptr = GWBUF_DATA(buf);
+	*ptr++ = (1 + len) & 0xff;
+	*ptr++ = ((1 + len) >> 8) & 0xff;
+	*ptr++ = ((1 + len) >> 16) & 0xff;
+	*ptr++ = 0;
+	*ptr++ = MYSQL_COM_INIT_DB;
+	memcpy(ptr, db, len);
+	shard_send_ignored(conn, buf);
+	strcpy(conn->db, db);
+}
+
+/**
+ * Send an error to the client of a session
+ *
+ * @param rses	The router session
+ * @param msg	The error message
+ */
+static void
+send_error(ROUTER_CLIENT_SES *rses, char *msg)
+{
+GWBUF	*err;
+
+	if ((err = modutil_create_mysql_err_msg(1, 1105, "HY000", msg)) != NULL)
+		rses->rses_session->client->func.write(rses->rses_session->client,
+						err);
+}
+
+/**
+ * Associate a new session with this instance of the router.
+ *
+ * The database of the handshake becomes the current database of the
+ * session and the session data is left without one, so that the
+ * connections to all the shards are authenticated without a database.
+ * The connection to the shard of the current database is opened at once.
+ *
+ * @param instance	The router instance data
+ * @param session	The session itself
+ * @return Session specific data for this session
+ */
+static	void	*
+newSession(ROUTER *instance, SESSION *session)
+{
+ROUTER_INSTANCE	        *inst = (ROUTER_INSTANCE *)instance;
+ROUTER_CLIENT_SES       *client_rses;
+MYSQL_session		*data = (MYSQL_session *)session->data;
+
+	client_rses = (ROUTER_CLIENT_SES *)calloc(1, sizeof(ROUTER_CLIENT_SES));
+
+        if (client_rses == NULL) {
+                return NULL;
+	}
+
+#if defined(SS_DEBUG)
+        client_rses->rses_chk_top = CHK_NUM_ROUTER_SES;
+        client_rses->rses_chk_tail = CHK_NUM_ROUTER_SES;
+#endif
+	spinlock_init(&client_rses->rses_lock);
+	client_rses->rses_session = session;
+	if ((client_rses->rses_conns = (SHARD_CONN *)calloc(inst->n_shards,
+					sizeof(SHARD_CONN))) == NULL)
+	{
+		free(client_rses);
+		return NULL;
+	}
+	strcpy(client_rses->rses_db, data->db);
+	data->db[0] = 0;
+	client_rses->rses_shard = shard_of_db(inst, client_rses->rses_db);
+	client_rses->rses_active = client_rses->rses_shard;
+
+	if (shard_connect(inst, client_rses, client_rses->rses_shard) == NULL)
+	{
+		free(client_rses->rses_conns);
+		free(client_rses);
+		return NULL;
+	}
+	atomic_add(&inst->stats.n_sessions, 1);
+
+        LOGIF(LD, (skygw_log_write(
+                LOGFILE_DEBUG,
+                "%lu [newSession] New session %p of database '%s' in shard %s.",
+                pthread_self(),
+                client_rses,
+                client_rses->rses_db,
+                inst->shards[client_rses->rses_shard]->name)));
+
+	/**
+         * Add this session to the list of active sessions.
+         */
+	spinlock_acquire(&inst->lock);
+	client_rses->next = inst->connections;
+	inst->connections = client_rses;
+	spinlock_release(&inst->lock);
+
+        CHK_CLIENT_RSES(client_rses);
+
+	return (void *)client_rses;
+}
+
+/**
+ * Unlink the router client session from the router's connection list and
+ * free its memory. The connections have been closed by closeSession.
+ *
+ * @param router_instance	The router instance
+ * @param router_client_ses	The router session
+ */
+static void freeSession(
+        ROUTER* router_instance,
+        void*   router_client_ses)
+{
+        ROUTER_INSTANCE*   router = (ROUTER_INSTANCE *)router_instance;
+        ROUTER_CLIENT_SES* router_cli_ses =
+                (ROUTER_CLIENT_SES *)router_client_ses;
+        int                i;
+
+	spinlock_acquire(&router->lock);
+
+	if (router->connections == router_cli_ses) {
+		router->connections = router_cli_ses->next;
+        } else {
+		ROUTER_CLIENT_SES *ptr = router->connections;
+
+		while (ptr != NULL && ptr->next != router_cli_ses) {
+			ptr = ptr->next;
+                }
+
+		if (ptr != NULL) {
+			ptr->next = router_cli_ses->next;
+                }
+	}
+	spinlock_release(&router->lock);
+
+	for (i = 0; i < router->n_shards; i++)
+	{
+		if (router_cli_ses->rses_conns[i].reply)
+			gwbuf_consume(router_cli_ses->rses_conns[i].reply,
+				gwbuf_length(router_cli_ses->rses_conns[i].reply));
+	}
+	for (i = 0; i < router_cli_ses->rses_n_sescmd; i++)
+		gwbuf_free(router_cli_ses->rses_sescmd[i]);
+        free(router_cli_ses->rses_conns);
+        free(router_cli_ses);
+}
+
+
+/**
+ * Close a session with the router, this is the mechanism
+ * by which a router may cleanup data structure etc.
+ *
+ * @param instance		The router instance data
+ * @param router_session	The session being closed
+ */
+static	void
+closeSession(ROUTER *instance, void *router_session)
+{
+ROUTER_INSTANCE	  *inst = (ROUTER_INSTANCE *)instance;
+ROUTER_CLIENT_SES *router_cli_ses = (ROUTER_CLIENT_SES *)router_session;
+DCB               *dcb;
+int               i;
+
+        CHK_CLIENT_RSES(router_cli_ses);
+        /**
+         * Lock router client session for secure read and update.
+         */
+        if (rses_begin_router_action(router_cli_ses))
+        {
+                router_cli_ses->rses_closed = true;
+                /** Unlock */
+                rses_exit_router_action(router_cli_ses);
+
+                /**
+                 * The closed flag keeps routeQuery from the connections,
+                 * they are not changed anymore
+                 */
+                for (i = 0; i < inst->n_shards; i++)
+                {
+                        if ((dcb = router_cli_ses->rses_conns[i].dcb) != NULL)
+                        {
+                                router_cli_ses->rses_conns[i].dcb = NULL;
+                                atomic_add(&dcb->server->stats.n_current, -1);
+                                dcb_close(dcb);
+                        }
+                }
+        }
+}
+
+/**
+ * Extract the database of a USE statement
+ *
+ * @param sql	The statement
+ * @param db	Filled with the database
+ * @return	True if the statement is a USE
+ */
+static bool
+is_use(char *sql, char *db)
+{
+char	*ptr = sql, *end;
+int	len;
+
+	while (isspace((unsigned char)*ptr))
+		ptr++;
+	if (strncasecmp(ptr, "USE", 3) != 0 ||
+		!(isspace((unsigned char)ptr[3]) || ptr[3] == '`'))
+		return false;
+	ptr += 3;
+	while (isspace((unsigned char)*ptr))
+		ptr++;
+	if (*ptr == '`')
+	{
+		if ((end = strchr(++ptr, '`')) == NULL)
+			return false;
+		len = end++ - ptr;
+	}
+	else
+	{
+		for (end = ptr; *end && !isspace((unsigned char)*end) &&
+			*end != ';'; end++)
+			;
+		len = end - ptr;
+	}
+	if (len == 0 || len > MYSQL_DATABASE_MAXLEN)
+		return false;
+	memcpy(db, ptr, len);
+	db[len] = 0;
+
+	while (isspace((unsigned char)*end) || *end == ';')
+		end++;
+	return *end == 0;
+}
+
+/**
+ * Is a statement a SHOW DATABASES or SHOW SCHEMAS
+ *
+ * @param sql	The statement
+ * @return	True for SHOW DATABASES
+ */
+static bool
+is_show_databases(char *sql)
+{
+	while (isspace((unsigned char)*sql))
+		sql++;
+	if (strncasecmp(sql, "SHOW", 4) != 0 || !isspace((unsigned char)sql[4]))
+		return false;
+	for (sql += 4; isspace((unsigned char)*sql); sql++)
+		;
+	return (strncasecmp(sql, "DATABASES", 9) == 0 &&
+			!isalnum((unsigned char)sql[9])) ||
+		(strncasecmp(sql, "SCHEMAS", 7) == 0 &&
+			!isalnum((unsigned char)sql[7]));
+}
+
+/**
+ * We have data from the client, we must route it to the shard of the
+ * current database or to the shard that the statement refers to.
+ *
+ * @param instance		The router instance
+ * @param router_session	The router session returned from the newSession call
+ * @param queue			The queue of data buffers to route
+ * @return The number of bytes sent
+ */
+static	int
+routeQuery(ROUTER *instance, void *router_session, GWBUF *queue)
+{
+        ROUTER_INSTANCE	  *inst = (ROUTER_INSTANCE *)instance;
+        ROUTER_CLIENT_SES *rses = (ROUTER_CLIENT_SES *)router_session;
+        uint8_t           *payload = GWBUF_DATA(queue);
+        int               mysql_command;
+        int               rc = 0, len;
+        DCB*              dcb;
+        MYSQL_session     *data;
+        char              db[MYSQL_DATABASE_MAXLEN+1];
+
+	atomic_add(&inst->stats.n_queries, 1);
+	mysql_command = MYSQL_GET_COMMAND(payload);
+
+        if (!rses_begin_router_action(rses))
+        {
+                LOGIF(LE, (skygw_log_write(
+                        LOGFILE_ERROR,
+                        "Error: Failed to route MySQL command %d to backend "
+                        "server.",
+                        mysql_command)));
+                gwbuf_free(queue);
+                return 0;
+        }
+
+	switch(mysql_command) {
+        case MYSQL_COM_QUIT:
+                /*< The connections are closed with the session */
+                gwbuf_free(queue);
+                rc = 1;
+                break;
+
+        case MYSQL_COM_INIT_DB:
+                len = MYSQL_GET_PACKET_LEN(payload) - 1;
+                if (len > MYSQL_DATABASE_MAXLEN || len > GWBUF_LENGTH(queue) - 5)
+                {
+                        gwbuf_free(queue);
+                        send_error(rses, "Database name too long.");
+                        rc = 1;
+                        break;
+                }
+                memcpy(db, payload + 5, len);
+                db[len] = 0;
+                rc = route_use(inst, rses, queue, db);
+                break;
+
+        case MYSQL_COM_QUERY:
+                rc = route_query(inst, rses, queue);
+                break;
+
+        case MYSQL_COM_CHANGE_USER:
+                /**
+                 * The other connections are closed, they are opened again
+                 * with the new user when they are used
+                 */
+                dcb = shard_connect(inst, rses, rses->rses_shard);
+                if (dcb == NULL)
+                {
+                        gwbuf_free(queue);
+                        break;
+                }
+                rc = dcb->func.auth(dcb, NULL, dcb->session, queue);
+                data = (MYSQL_session *)rses->rses_session->data;
+                strcpy(rses->rses_db, data->db);
+                strcpy(rses->rses_conns[rses->rses_shard].db, data->db);
+                data->db[0] = 0;
+                for (len = 0; len < inst->n_shards; len++)
+                {
+                        if (len != rses->rses_shard &&
+                                (dcb = rses->rses_conns[len].dcb) != NULL)
+                        {
+                                rses->rses_conns[len].dcb = NULL;
+                                atomic_add(&dcb->server->stats.n_current, -1);
+                                dcb_close(dcb);
+                        }
+                }
+                rses->rses_active = rses->rses_shard;
+                break;
+
+        default:
+                /*< Prepared statements and the like use the current database */
+                if ((dcb = shard_connect(inst, rses, rses->rses_shard)) == NULL)
+                {
+                        gwbuf_free(queue);
+                        send_error(rses, "The shard of the current database "
+                                "is not available.");
+                        rc = 1;
+                        break;
+                }
+                shard_use(&rses->rses_conns[rses->rses_shard], rses->rses_db);
+                rses->rses_active = rses->rses_shard;
+                rc = dcb->func.write(dcb, queue);
+                break;
+        }
+        rses_exit_router_action(rses);
+
+        LOGIF(LD, (skygw_log_write(
+                LOGFILE_DEBUG,
+                "%lu [schemarouter:routeQuery] Routed command %d to shard %s "
+                "with return value %d.",
+                pthread_self(),
+                mysql_command,
+                inst->shards[rses->rses_active]->name,
+                rc)));
+        return rc;
+}
+
+/**
+ * Route a USE or a COM_INIT_DB: the database becomes the current database
+ * and the command goes to its shard. The caller holds the lock of the
+ * router session.
+ *
+ * @param inst		The router instance
+ * @param rses		The router session
+ * @param queue		The command
+ * @param db		The database
+ * @return		The return value of the write
+ */
+static int
+route_use(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses, GWBUF *queue,
+	char *db)
+{
+int	index = shard_of_db(inst, db);
+DCB	*dcb;
+
+	if ((dcb = shard_connect(inst, rses, index)) == NULL)
+	{
+		gwbuf_free(queue);
+		send_error(rses, "The shard of the database is not available.");
+		return 1;
+	}
+	if (index != rses->rses_shard)
+		atomic_add(&inst->stats.n_switches, 1);
+	rses->rses_shard = index;
+	rses->rses_active = index;
+	strcpy(rses->rses_db, db);
+	strcpy(rses->rses_conns[index].db, db);
+
+	return dcb->func.write(dcb, queue);
+}
+
+/**
+ * The shards of the fanout hint of a statement, "all" or a list of the
+ * databases of the shards separated by ','
+ *
+ * @param inst		The router instance
+ * @param value		The value of the hint
+ * @return		The shards to send the statement to or NULL if memory
+ *			could not be allocated
+ */
+static bool *
+fanout_shards(ROUTER_INSTANCE *inst, char *value)
+{
+bool	*shards;
+char	db[MYSQL_DATABASE_MAXLEN+1], *end;
+int	i, len;
+
+	if ((shards = (bool *)calloc(inst->n_shards, sizeof(bool))) == NULL)
+		return NULL;
+	if (strcasecmp(value, "all") == 0)
+	{
+		for (i = 0; i < inst->n_shards; i++)
+			shards[i] = true;
+		return shards;
+	}
+	for (; *value; value = (*end ? end + 1 : end))
+	{
+		if ((end = strchr(value, ',')) == NULL)
+			end = value + strlen(value);
+		if ((len = end - value) == 0 || len > MYSQL_DATABASE_MAXLEN)
+			continue;
+		memcpy(db, value, len);
+		db[len] = 0;
+		shards[shard_of_db(inst, db)] = true;
+	}
+	return shards;
+}
+
+/**
+ * Route a COM_QUERY. The caller holds the lock of the router session.
+ *
+ * A SELECT with a fanout hint in a comment at its start,
+ *
+ *	maxscale fanout=all
+ *	maxscale fanout=<database>,<database>...
+ *
+ * is sent to all the shards or to the shards of the databases and their
+ * result sets are merged.
+ *
+ * @param inst		The router instance
+ * @param rses		The router session
+ * @param queue		The statement
+ * @return		The return value of the write
+ */
+static int
+route_query(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses, GWBUF *queue)
+{
+skygw_query_type_t	qtype = QUERY_TYPE_UNKNOWN;
+char	*sql, **tables = NULL, *dot, *fanout;
+char	db[MYSQL_DATABASE_MAXLEN+1];
+int	n_tables = 0, i, index = -1, shard, rc;
+bool	cross = false, *shards = NULL;
+DCB	*dcb;
+
+	if ((sql = modutil_get_SQL(queue)) != NULL)
+	{
+		if (is_use(sql, db))
+		{
+			free(sql);
+			return route_use(inst, rses, queue, db);
+		}
+		if (is_show_databases(sql))
+		{
+			rc = route_fanout(inst, rses, queue, NULL, sql,
+					SCHEMA_MERGE_DATABASES);
+			free(sql);
+			return rc;
+		}
+		qtype = skygw_query_classifier_get_type_tables(sql, 0, NULL,
+							&tables, &n_tables);
+	}
+
+	if (sql && (fanout = hint_parameter(hint_get(queue), "fanout")) != NULL)
+	{
+		if (QUERY_IS_TYPE(qtype, QUERY_TYPE_READ) &&
+			!QUERY_IS_TYPE(qtype, QUERY_TYPE_WRITE))
+		{
+			shards = fanout_shards(inst, fanout);
+		}
+		else
+		{
+			LOGIF(LE, (skygw_log_write(
+				LOGFILE_ERROR,
+				"Warning : The fanout hint of a statement that "
+				"is not a SELECT is ignored.")));
+		}
+	}
+	if (shards != NULL)
+	{
+		for (i = 0; tables && i < n_tables; i++)
+			free(tables[i]);
+		free(tables);
+		rc = route_fanout(inst, rses, queue, shards, sql,
+				SCHEMA_MERGE_ROWS);
+		free(shards);
+		free(sql);
+		return rc;
+	}
+	free(sql);
+
+	/*< The shard of the databases of the tables */
+	for (i = 0; tables && i < n_tables; i++)
+	{
+		if ((dot = strchr(tables[i], '.')) != NULL &&
+			dot - tables[i] <= MYSQL_DATABASE_MAXLEN)
+		{
+			memcpy(db, tables[i], dot - tables[i]);
+			db[dot - tables[i]] = 0;
+			shard = shard_of_db(inst, db);
+		}
+		else
+		{
+			shard = rses->rses_shard;
+		}
+		if (index == -1)
+			index = shard;
+		else if (shard != index)
+			cross = true;
+		free(tables[i]);
+	}
+	free(tables);
+
+	if (cross)
+	{
+		atomic_add(&inst->stats.n_cross, 1);
+		gwbuf_free(queue);
+		send_error(rses, "The statement refers to databases in more than "
+				"one shard.");
+		return 1;
+	}
+
+	if (QUERY_IS_TYPE(qtype, QUERY_TYPE_SESSION_WRITE) && index == -1)
+		return route_sescmd(inst, rses, queue);
+
+	if (index == -1)
+		index = rses->rses_shard;
+	if ((dcb = shard_connect(inst, rses, index)) == NULL)
+	{
+		gwbuf_free(queue);
+		send_error(rses, "The shard of the statement is not available.");
+		return 1;
+	}
+	if (index == rses->rses_shard)
+		shard_use(&rses->rses_conns[index], rses->rses_db);
+	else
+		atomic_add(&inst->stats.n_table_routed, 1);
+	rses->rses_active = index;
+
+	return dcb->func.write(dcb, queue);
+}
+
+/**
+ * Route a session command, such as SET. It goes to all the open connections
+ * and is kept for the connections opened later, the reply of the shard of
+ * the current database is sent to the client. The caller holds the lock of
+ * the router session.
+ *
+ * @param inst		The router instance
+ * @param rses		The router session
+ * @param queue		The statement
+ * @return		The return value of the write
+ */
+static int
+route_sescmd(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses, GWBUF *queue)
+{
+SHARD_CONN	*conn;
+GWBUF		*buf;
+DCB		*dcb;
+int		i;
+
+	if ((queue = buf_contiguous(queue)) == NULL)
+		return 0;
+	if ((dcb = shard_connect(inst, rses, rses->rses_shard)) == NULL)
+	{
+		gwbuf_free(queue);
+		send_error(rses, "The shard of the current database is not "
+				"available.");
+		return 1;
+	}
+
+	if (rses->rses_n_sescmd < SCHEMA_MAX_SESCMD)
+	{
+		if ((buf = gwbuf_clone(queue)) != NULL)
+			rses->rses_sescmd[rses->rses_n_sescmd++] = buf;
+	}
+	else
+	{
+		LOGIF(LE, (skygw_log_write(
+			LOGFILE_ERROR,
+			"Warning : Session commands after the first %d are not "
+			"sent to the shards connected to later.",
+			SCHEMA_MAX_SESCMD)));
+	}
+
+	for (i = 0; i < inst->n_shards; i++)
+	{
+		conn = &rses->rses_conns[i];
+		if (i == rses->rses_shard || conn->dcb == NULL)
+			continue;
+		if ((buf = gwbuf_clone(queue)) != NULL)
+			shard_send_ignored(conn, buf);
+		conn->n_sescmd = rses->rses_n_sescmd;
+	}
+	conn = &rses->rses_conns[rses->rses_shard];
+	conn->n_sescmd = rses->rses_n_sescmd;
+	rses->rses_active = rses->rses_shard;
+
+	return dcb->func.write(dcb, queue);
+}
+
+/**
+ * Match a keyword of a statement, the case of the keyword is ignored
+ *
+ * @param ptr	The statement text, leading white space is skipped
+ * @param word	The keyword
+ * @return	The text after the keyword or NULL if it did not match
+ */
+static char *
+sql_word(char *ptr, char *word)
+{
+int	len = strlen(word);
+
+	while (isspace((unsigned char)*ptr))
+		ptr++;
+	if (strncasecmp(ptr, word, len) != 0 ||
+		isalnum((unsigned char)ptr[len]) || ptr[len] == '_')
+		return NULL;
+	return ptr + len;
+}
+
+/**
+ * Find the ORDER BY and the LIMIT of a SELECT that are outside the quotes
+ * and the parentheses. The merged rows are ordered by the first column of
+ * the ORDER BY when it is a column of the result set, given by position or
+ * by name. A LIMIT with an offset is not applied to the merged rows as the
+ * shards have applied the offset to their own rows.
+ *
+ * @param sql	The statement
+ * @param merge	Filled with the order and the limit
+ */
+static void
+merge_parse_order(char *sql, SCHEMA_MERGE *merge)
+{
+char	*ptr, *end, *order = NULL, *limit = NULL, *start, quote = 0;
+int	depth = 0, len;
+long	n;
+
+	for (ptr = sql; *ptr; ptr++)
+	{
+		if (quote)
+		{
+			if (*ptr == '\\' && quote != '`' && ptr[1])
+				ptr++;
+			else if (*ptr == quote)
+				quote = 0;
+		}
+		else if (*ptr == '\'' || *ptr == '"' || *ptr == '`')
+			quote = *ptr;
+		else if (*ptr == '(')
+			depth++;
+		else if (*ptr == ')')
+			depth--;
+		else if (depth == 0 && (ptr == sql ||
+			!(isalnum((unsigned char)ptr[-1]) || ptr[-1] == '_')))
+		{
+			if ((end = sql_word(ptr, "ORDER")) != NULL &&
+				(end = sql_word(end, "BY")) != NULL)
+				order = end;
+			else if ((end = sql_word(ptr, "LIMIT")) != NULL)
+				limit = end;
+		}
+	}
+
+	if (order && (limit == NULL || limit > order))
+	{
+		for (ptr = order; isspace((unsigned char)*ptr); ptr++)
+			;
+		if (isdigit((unsigned char)*ptr))
+		{
+			n = strtol(ptr, &ptr, 10);
+			if (n >= 1)
+				merge->column = n - 1;
+		}
+		else
+		{
+			for (start = ptr; isalnum((unsigned char)*ptr) ||
+				*ptr == '_' || *ptr == '$' || *ptr == '.' ||
+				*ptr == '`'; ptr++)
+			{
+				if (*ptr == '.')
+					start = ptr + 1;
+			}
+			if (*start == '`')
+				start++;
+			len = ptr - start;
+			if (len > 0 && start[len - 1] == '`')
+				len--;
+			if (len > 0 && len <= MYSQL_DATABASE_MAXLEN)
+			{
+				memcpy(merge->colname, start, len);
+				merge->colname[len] = 0;
+			}
+		}
+		if ((end = sql_word(ptr, "DESC")) != NULL)
+		{
+			merge->desc = true;
+			ptr = end;
+		}
+		else if ((end = sql_word(ptr, "ASC")) != NULL)
+			ptr = end;
+		while (isspace((unsigned char)*ptr))
+			ptr++;
+		/*< An expression is not a column of the result set */
+		if (*ptr && *ptr != ',' && *ptr != ';' &&
+			!isalpha((unsigned char)*ptr))
+		{
+			merge->column = -1;
+			merge->colname[0] = 0;
+		}
+	}
+
+	if (limit)
+	{
+		n = strtol(limit, &ptr, 10);
+		if (ptr != limit && *ptr != ',' && sql_word(ptr, "OFFSET") == NULL)
+			merge->limit = n;
+	}
+}
+
+/**
+ * Route a SELECT to a set of the shards, or a SHOW DATABASES to all of
+ * them. The statement is sent to the shards at once and their replies are
+ * merged by merge_replies, so the client waits for the slowest shard. The
+ * caller holds the lock of the router session.
+ *
+ * @param inst		The router instance
+ * @param rses		The router session
+ * @param queue		The statement
+ * @param shards	The shards to send the statement to, NULL for all
+ * @param sql		The text of the statement
+ * @param mode		SCHEMA_MERGE_DATABASES or SCHEMA_MERGE_ROWS
+ * @return		1 if the statement was sent to the shards
+ */
+static int
+route_fanout(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses, GWBUF *queue,
+	bool *shards, char *sql, int mode)
+{
+SCHEMA_MERGE	*merge = &rses->rses_merge;
+GWBUF		*buf;
+int		i;
+
+	if (rses->rses_n_merging > 0)
+	{
+		gwbuf_free(queue);
+		send_error(rses, "The replies of the shards to the previous "
+				"statement have not arrived.");
+		return 1;
+	}
+	if ((queue = buf_contiguous(queue)) == NULL)
+		return 0;
+
+	/*< The rows of a SELECT are incomplete without one of its shards */
+	for (i = 0; i < inst->n_shards; i++)
+	{
+		if ((shards == NULL || shards[i]) &&
+			shard_connect(inst, rses, i) == NULL &&
+			mode == SCHEMA_MERGE_ROWS)
+		{
+			gwbuf_free(queue);
+			send_error(rses, "A shard of the statement is not "
+					"available.");
+			return 1;
+		}
+	}
+
+	memset(merge, 0, sizeof(SCHEMA_MERGE));
+	merge->mode = mode;
+	merge->column = -1;
+	merge->limit = -1;
+	if (mode == SCHEMA_MERGE_DATABASES)
+		merge->column = 0;	/*< The names in order, as one server */
+	else
+		merge_parse_order(sql, merge);
+
+	for (i = 0; i < inst->n_shards; i++)
+	{
+		if ((shards != NULL && !shards[i]) ||
+			rses->rses_conns[i].dcb == NULL ||
+			(buf = gwbuf_clone(queue)) == NULL)
+			continue;
+		if (i == rses->rses_shard)
+			shard_use(&rses->rses_conns[i], rses->rses_db);
+		rses->rses_conns[i].merging = true;
+		rses->rses_n_merging++;
+		rses->rses_conns[i].dcb->func.write(rses->rses_conns[i].dcb, buf);
+	}
+	gwbuf_free(queue);
+
+	if (rses->rses_n_merging == 0)
+	{
+		send_error(rses, "No shard is available.");
+		return 1;
+	}
+	if (mode == SCHEMA_MERGE_DATABASES)
+		atomic_add(&inst->stats.n_merged, 1);
+	else
+		atomic_add(&inst->stats.n_fanout, 1);
+	return 1;
+}
+
+/**
+ * A row of the merged result set
+ */
+typedef struct merge_row {
+	uint8_t		*packet;	/*< The row packet */
+	int		len;		/*< Length of the packet */
+	uint8_t		*key;		/*< The ORDER BY column */
+	long		keylen;		/*< Length of the column, -1 for NULL */
+	bool		numeric;	/*< The column is a number */
+	double		number;		/*< The value of a numeric column */
+	int		dir;		/*< 1 ascending, -1 descending */
+	int		seq;		/*< Position of the row in the replies */
+} MERGE_ROW;
+
+/**
+ * Compare two rows by their ORDER BY column, the NULLs are first and the
+ * numbers are compared by value. The order of equal rows is kept.
+ */
+static int
+merge_compare(const void *a, const void *b)
+{
+const MERGE_ROW	*r1 = (const MERGE_ROW *)a, *r2 = (const MERGE_ROW *)b;
+int		rval;
+
+	if (r1->keylen < 0 || r2->keylen < 0)
+		rval = (r1->keylen >= 0) - (r2->keylen >= 0);
+	else if (r1->numeric && r2->numeric)
+		rval = (r1->number > r2->number) - (r1->number < r2->number);
+	else if ((rval = memcmp(r1->key, r2->key,
+			r1->keylen < r2->keylen ? r1->keylen : r2->keylen)) == 0)
+		rval = (r1->keylen > r2->keylen) - (r1->keylen < r2->keylen);
+	rval = (rval > 0) - (rval < 0);
+	if ((rval *= r1->dir) == 0)
+		rval = r1->seq - r2->seq;
+	return rval;
+}
+
+/**
+ * Append a packet to the merged reply, with the next sequence number
+ *
+ * @param out		The merged reply
+ * @param used		The bytes used in out, updated
+ * @param seq		The sequence number, incremented
+ * @param packet	The packet
+ * @param len		The length of the packet
+ */
+static void
+merge_append(uint8_t *out, int *used, int *seq, uint8_t *packet, int len)
+{
+	memcpy(out + *used, packet, len);
+	out[*used + 3] = (*seq)++;
+	*used += len;
+}
+
+/**
+ * Merge the replies of the shards and send them to the client. The column
+ * definitions are those of the first result set and the rows are those of
+ * all the result sets, ordered and limited as merge_parse_order found. The
+ * EOF ends the rows with the warnings of all the shards.
+ *
+ * SHOW DATABASES lists the databases of the shards that replied, without
+ * the duplicates such as information_schema, and a SELECT fails if one of
+ * its shards returned an error. If no shard returned a result set, the first
+ * error or reply is sent. The caller holds the lock of the router session.
+ *
+ * @param inst		The router instance
+ * @param rses		The router session
+ */
+static void
+merge_replies(ROUTER_INSTANCE *inst, ROUTER_CLIENT_SES *rses)
+{
+SCHEMA_MERGE	*merge = &rses->rses_merge;
+HASHTABLE	*seen = NULL;
+MERGE_ROW	*rows = NULL, *row;
+GWBUF		*out = NULL, *base = NULL, *failed = NULL, *first = NULL;
+GWBUF		*reply;
+uint8_t		*data, *ptr, *end;
+uint8_t		eof[9];
+char		name[MYSQL_DATABASE_MAXLEN+1], *numend;
+MYSQL_READER	rd;
+MYSQL_COLUMN_DEF def;
+MYSQL_STR	str;
+int		i, j, len, total = 0, used = 0, seq = 1, n_eof, n_rows = 0;
+int		n_packets = 0, column = merge->column, warnings = 0, status = 0;
+bool		ok;
+
+	for (i = 0; i < inst->n_shards; i++)
+	{
+		SHARD_CONN *conn = &rses->rses_conns[i];
+
+		if (conn->reply == NULL ||
+			(conn->reply = buf_contiguous(conn->reply)) == NULL)
+			continue;
+		reply = conn->reply;
+		if (first == NULL)
+			first = reply;
+		total += GWBUF_LENGTH(reply);
+		data = GWBUF_DATA(reply);
+		end = data + GWBUF_LENGTH(reply);
+		ok = (end - data > 4 && data[4] != 0xff && data[4] != 0x00);
+		for (ptr = data, n_eof = 0; ptr + 4 < end; ptr += len)
+		{
+			len = 4 + (ptr[0] | (ptr[1] << 8) | (ptr[2] << 16));
+			n_packets++;
+			if (ptr[4] == 0xff)
+				ok = false;
+			else if (ptr[4] == 0xfe && len < 9 + 4)
+				n_eof++;
+		}
+		if (ok && base == NULL)
+			base = reply;
+		if (!ok && failed == NULL && (data[4] == 0xff || n_eof > 0))
+			failed = reply;
+	}
+
+	if (base == NULL || (failed && merge->mode == SCHEMA_MERGE_ROWS) ||
+		(merge->mode == SCHEMA_MERGE_DATABASES &&
+		(seen = hashtable_alloc(SCHEMA_MAP_SIZE, schema_hash,
+					strcmp)) == NULL) ||
+		(rows = (MERGE_ROW *)calloc(n_packets, sizeof(MERGE_ROW))) == NULL ||
+		(out = gwbuf_alloc(total + sizeof(eof))) == NULL)
+	{
+		/*< The first error or reply, or nothing if memory ran out */
+		if (base != NULL && (failed == NULL ||
+				merge->mode == SCHEMA_MERGE_DATABASES))
+			first = NULL;
+		else if (failed != NULL)
+			first = failed;
+		for (i = 0; i < inst->n_shards; i++)
+		{
+			if ((reply = rses->rses_conns[i].reply) == NULL)
+				continue;
+			rses->rses_conns[i].reply = NULL;
+			if (reply == first)
+				rses->rses_session->client->func.write(
+					rses->rses_session->client, reply);
+			else
+				gwbuf_free(reply);
+		}
+		if (seen)
+			hashtable_free(seen);
+		free(rows);
+		if (first == NULL)
+			send_error(rses, "Out of memory merging the replies of "
+					"the shards.");
+		return;
+	}
+	if (seen)
+		hashtable_memory_fns(seen, (HASHMEMORYFN)strdup, NULL,
+				(HASHMEMORYFN)free, NULL);
+
+	/*< The column count and definitions of the first result set */
+	ptr = GWBUF_DATA(base);
+	end = ptr + GWBUF_LENGTH(base);
+	for (j = -1; ptr + 4 < end; ptr += len, j++)
+	{
+		len = 4 + (ptr[0] | (ptr[1] << 8) | (ptr[2] << 16));
+		merge_append(GWBUF_DATA(out), &used, &seq, ptr, len);
+		if (ptr[4] == 0xfe && len < 9 + 4)
+			break;
+		if (j >= 0 && column == -1 && merge->colname[0] &&
+			mysql_column_def_parse(ptr + 4, len - 4, &def) &&
+			def.name.data != NULL &&
+			def.name.len == strlen(merge->colname) &&
+			strncasecmp((char *)def.name.data, merge->colname,
+					def.name.len) == 0)
+			column = j;
+	}
+	if (column >= j)
+		column = -1;
+
+	/*< The rows of all the result sets */
+	for (i = 0; i < inst->n_shards; i++)
+	{
+		if ((reply = rses->rses_conns[i].reply) == NULL)
+			continue;
+		data = GWBUF_DATA(reply);
+		end = data + GWBUF_LENGTH(reply);
+		if (data[4] == 0xff || data[4] == 0x00)
+			continue;
+		for (ptr = data, n_eof = 0; ptr + 4 < end; ptr += len)
+		{
+			len = 4 + (ptr[0] | (ptr[1] << 8) | (ptr[2] << 16));
+			if (ptr[4] == 0xff)
+				break;
+			if (ptr[4] == 0xfe && len < 9 + 4)
+			{
+				if (++n_eof < 2)
+					continue;
+				if (len >= 4 + 5)
+				{
+					warnings += ptr[5] | (ptr[6] << 8);
+					if (reply == base)
+						status = ptr[7] | (ptr[8] << 8);
+				}
+				break;
+			}
+			if (n_eof == 0)
+				continue;
+
+			row = &rows[n_rows];
+			row->packet = ptr;
+			row->len = len;
+			row->seq = n_rows;
+			row->dir = merge->desc ? -1 : 1;
+			row->keylen = -1;
+			if (column >= 0)
+			{
+				mysql_reader_init(&rd, ptr + 4, len - 4);
+				for (j = 0; j < column; j++)
+					mysql_read_lenenc_str(&rd);
+				str = mysql_read_lenenc_str(&rd);
+				if (str.data != NULL)
+				{
+					row->key = str.data;
+					row->keylen = str.len;
+				}
+			}
+			if (row->keylen > 0 && row->keylen <= MYSQL_DATABASE_MAXLEN)
+			{
+				memcpy(name, row->key, row->keylen);
+				name[row->keylen] = 0;
+				row->number = strtod(name, &numend);
+				row->numeric = (*numend == 0);
+				if (seen)
+				{
+					if (hashtable_fetch(seen, name) != NULL)
+						continue;
+					hashtable_add(seen, name, (void *)1);
+				}
+			}
+			n_rows++;
+		}
+	}
+
+	if (column >= 0)
+		qsort(rows, n_rows, sizeof(MERGE_ROW), merge_compare);
+	if (merge->limit >= 0 && n_rows > merge->limit)
+		n_rows = merge->limit;
+	for (i = 0; i < n_rows; i++)
+		merge_append(GWBUF_DATA(out), &used, &seq, rows[i].packet,
+				rows[i].len);
+
+	if (warnings > 0xffff)
+		warnings = 0xffff;
+	eof[0] = 5;
+	eof[1] = 0;
+	eof[2] = 0;
+	eof[3] = 0;
+	eof[4] = 0xfe;
+	eof[5] = warnings & 0xff;
+	eof[6] = (warnings >> 8) & 0xff;
+	eof[7] = status & 0xff;
+	eof[8] = (status >> 8) & 0xff;
+	merge_append(GWBUF_DATA(out), &used, &seq, eof, sizeof(eof));
+
+	if (seen)
+		hashtable_free(seen);
+	free(rows);
+	for (i = 0; i < inst->n_shards; i++)
+	{
+		if (rses->rses_conns[i].reply != NULL)
+		{
+			gwbuf_free(rses->rses_conns[i].reply);
+			rses->rses_conns[i].reply = NULL;
+		}
+	}
+	out = gwbuf_trim(out, total + sizeof(eof) - used);
+	rses->rses_session->client->func.write(rses->rses_session->client, out);
+}
+
+/**
+ * Display router diagnostics
+ *
+ * @param instance	Instance of the router
+ * @param dcb		DCB to send diagnostics to
+ */
+static	void
+diagnostics(ROUTER *router, DCB *dcb)
+{
+ROUTER_INSTANCE	  *router_inst = (ROUTER_INSTANCE *)router;
+ROUTER_CLIENT_SES *session;
+SHARD		  *shard;
+int		  i = 0, j;
+
+	spinlock_acquire(&router_inst->lock);
+	session = router_inst->connections;
+	while (session)
+	{
+		i++;
+		session = session->next;
+	}
+	spinlock_release(&router_inst->lock);
+
+	dcb_printf(dcb, "\tNumber of router sessions:   	%d\n",
+                   router_inst->stats.n_sessions);
+	dcb_printf(dcb, "\tCurrent no. of router sessions:	%d\n", i);
+	dcb_printf(dcb, "\tNumber of queries forwarded:   	%d\n",
+                   router_inst->stats.n_queries);
+	dcb_printf(dcb, "\tChanges of the current shard:	%d\n",
+                   router_inst->stats.n_switches);
+	dcb_printf(dcb, "\tStatements routed by table:	%d\n",
+                   router_inst->stats.n_table_routed);
+	dcb_printf(dcb, "\tSHOW DATABASES merged:		%d\n",
+                   router_inst->stats.n_merged);
+	dcb_printf(dcb, "\tSELECTs sent to several shards:	%d\n",
+                   router_inst->stats.n_fanout);
+	dcb_printf(dcb, "\tCross shard statements refused:	%d\n",
+                   router_inst->stats.n_cross);
+	for (i = 0; i < router_inst->n_shards; i++)
+	{
+		shard = router_inst->shards[i];
+		dcb_printf(dcb, "\tShard %s%s, %d databases\n", shard->name,
+			i == router_inst->default_shard ? " (default)" : "",
+			shard->n_databases);
+		for (j = 0; j < shard->n_servers; j++)
+			dcb_printf(dcb, "\t\t%s:%d	%s\n",
+				shard->servers[j]->name,
+				shard->servers[j]->port,
+				SERVER_IS_RUNNING(shard->servers[j]) ?
+					"running" : "down");
+	}
+}
+
+/**
+ * Client Reply routine
+ *
+ * The replies to the commands of the router are dropped, the replies to a
+ * SHOW DATABASES are kept until those of all the shards have arrived and
+ * the others are sent to the client.
+ *
+ * @param       instance        The router instance
+ * @param       router_session  The router session
+ * @param       backend_dcb     The backend DCB
+ * @param       queue           The GWBUF with reply data
+ */
+static  void
+clientReply(
+        ROUTER *instance,
+        void   *router_session,
+        GWBUF  *queue,
+        DCB    *backend_dcb)
+{
+ROUTER_INSTANCE	  *inst = (ROUTER_INSTANCE *)instance;
+ROUTER_CLIENT_SES *rses = (ROUTER_CLIENT_SES *)router_session;
+DCB		  *client = backend_dcb->session->client;
+SHARD_CONN	  *conn = NULL;
+uint8_t		  first;
+int		  i, len;
+
+	ss_dassert(client != NULL);
+
+	if (!rses_begin_router_action(rses))
+	{
+		gwbuf_consume(queue, gwbuf_length(queue));
+		return;
+	}
+	for (i = 0; i < inst->n_shards; i++)
+	{
+		if (rses->rses_conns[i].dcb == backend_dcb)
+		{
+			conn = &rses->rses_conns[i];
+			break;
+		}
+	}
+	if (conn == NULL)
+	{
+		rses_exit_router_action(rses);
+		gwbuf_consume(queue, gwbuf_length(queue));
+		return;
+	}
+
+	if (conn->n_ignore > 0 || conn->merging || conn->reply)
+	{
+		conn->reply = gwbuf_append(conn->reply, queue);
+		queue = NULL;
+	}
+	while (conn->n_ignore > 0 &&
+		(len = packet_length(conn->reply, 0, &first)) > 0)
+	{
+		if (first == 0xff)
+		{
+			LOGIF(LE, (skygw_log_write(
+				LOGFILE_ERROR,
+				"Error : A command of the router failed in "
+				"shard %s.",
+				inst->shards[i]->name)));
+		}
+		conn->reply = gwbuf_consume(conn->reply, len);
+		conn->n_ignore--;
+	}
+
+	if (conn->n_ignore > 0)
+	{
+		/*< The rest of a reply to the router is still to come */
+	}
+	else if (conn->merging)
+	{
+		if (reply_complete(conn->reply))
+		{
+			conn->merging = false;
+			if (--rses->rses_n_merging == 0)
+				merge_replies(inst, rses);
+		}
+	}
+	else if (conn->reply)
+	{
+		queue = conn->reply;
+		conn->reply = NULL;
+	}
+	rses_exit_router_action(rses);
+
+	if (queue)
+		client->func.write(client, queue);
+}
+
+/**
+ * Error handling routine
+ *
+ * A failed connection to a shard is closed and the session goes on, the
+ * next statement routed to the shard opens a new connection, unless the
+ * client waits for the reply of the failed connection.
+ *
+ * @param       instance        The router instance
+ * @param       router_session  The router session
+ * @param       errbuf          The error message to reply
+ * @param       backend_dcb     The backend DCB
+ * @param       action     	The action: REPLY_CLIENT, NEW_CONNECTION
+ * @param	succp		Set to true if the session can go on
+ *
+ */
+static  void
+handleError(
+        ROUTER           *instance,
+        void             *router_session,
+        GWBUF            *errbuf,
+        DCB              *backend_dcb,
+        error_action_t   action,
+        bool             *succp)
+{
+ROUTER_INSTANCE	  *inst = (ROUTER_INSTANCE *)instance;
+ROUTER_CLIENT_SES *rses = (ROUTER_CLIENT_SES *)router_session;
+DCB		  *client = backend_dcb->session->client;
+SHARD_CONN	  *conn;
+bool		  found = false;
+int		  i;
+
+	ss_dassert(client != NULL);
+
+	*succp = false;
+	if (action == ERRACT_REPLY_CLIENT)
+	{
+		client->func.write(client, errbuf);
+		return;
+	}
+	if (rses == NULL || action != ERRACT_NEW_CONNECTION ||
+		!rses_begin_router_action(rses))
+		return;
+
+	for (i = 0; i < inst->n_shards; i++)
+	{
+		conn = &rses->rses_conns[i];
+		if (conn->dcb != backend_dcb)
+			continue;
+		found = true;
+		conn->dcb = NULL;
+		if (conn->reply)
+		{
+			gwbuf_consume(conn->reply, gwbuf_length(conn->reply));
+			conn->reply = NULL;
+		}
+		if (conn->merging)
+		{
+			conn->merging = false;
+			if (--rses->rses_n_merging == 0)
+				merge_replies(inst, rses);
+		}
+		*succp = (i != rses->rses_active);
+		break;
+	}
+	rses_exit_router_action(rses);
+
+	if (found)
+	{
+		atomic_add(&backend_dcb->server->stats.n_current, -1);
+		dcb_close(backend_dcb);
+	}
+}
+
+/** to be inline'd */
+/**
+ * @node Acquires lock to router client session if it is not closed.
+ *
+ * Parameters:
+ * @param rses - in, use
+ *
+ *
+ * @return true if router session was not closed. If return value is true
+ * it means that router is locked, and must be unlocked later. False, if
+ * router was closed before lock was acquired.
+ *
+ */
+static bool rses_begin_router_action(
+        ROUTER_CLIENT_SES* rses)
+{
+        bool succp = false;
+
+        CHK_CLIENT_RSES(rses);
+
+        if (rses->rses_closed) {
+                goto return_succp;
+        }
+        spinlock_acquire(&rses->rses_lock);
+        if (rses->rses_closed) {
+                spinlock_release(&rses->rses_lock);
+                goto return_succp;
+        }
+        succp = true;
+
+return_succp:
+        return succp;
+}
+
+/** to be inline'd */
+/**
+ * @node Releases router client session lock.
+ *
+ * Parameters:
+ * @param rses - <usage>
+ *          <description>
+ *
+ * @return void
+ *
+ */
+static void rses_exit_router_action(
+        ROUTER_CLIENT_SES* rses)
+{
+        CHK_CLIENT_RSES(rses);
+        spinlock_release(&rses->rses_lock);
+}
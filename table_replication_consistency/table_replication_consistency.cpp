@@ -33,6 +33,7 @@ Updated:
 #include "table_replication_consistency.h"
 #include "table_replication_listener.h"
 #include "table_replication_metadata.h"
+#include "table_replication_filter.h"
 #include "listener_exception.h"
 #include "log_manager.h"
 
@@ -45,6 +46,10 @@ unsigned int n_replication_listeners = 0;
 bool listener_shutdown=false;          /* This flag will be true
 				       at shutdown */
 
+tbr_change_callback_t tbr_change_callback = NULL; /* Called for every
+						  changed table */
+void *tbr_change_arg = NULL;           /* Argument of the callback */
+
 
 #ifdef TBR_DEBUG
 bool tbr_trace = true;
@@ -234,10 +239,9 @@ tb_replication_consistency_query(
 	// We need to protect C client from exceptions here
 	try {
 		for(i = 0; i < *n_servers; i++) {
-			err = tb_replication_listener_consistency((const unsigned char *)tb_query->db_dot_table, &tb_consistency[i], i);
-
-			if (err) {
-				goto err_exit;
+			// No more servers have changed the table
+			if (tb_replication_listener_consistency((const unsigned char *)tb_query->db_dot_table, &tb_consistency[i], i)) {
+				break;
 			}
 		}
 	}
@@ -272,14 +276,60 @@ error_handling:
 	strcpy(tb_consistency[i].error_message, errmsg.c_str());
 	// This will log error to log file
 	skygw_log_write_flush( LOGFILE_ERROR, (char *)errmsg.c_str());
-
-err_exit:
-	*n_servers=i-1;
-	tb_consistency[i].error_code = err;
+	tb_consistency[i].error_code = 1;
+	*n_servers = i;
 
 	return (1);
 }
 
+/***********************************************************************//**
+With this function client can register a function that is called for
+every table changed by a query or a row event seen by a replication
+listener.
+@return 0 on success, error code at failure. */
+int
+tb_replication_consistency_callback(
+/*================================*/
+	tbr_change_callback_t callback, /*!< in: Function to call or
+					NULL */
+	void                  *arg)     /*!< in: Argument of the
+					function. */
+{
+	if (n_replication_listeners) {
+		// The listener threads already read the callback
+		return (1);
+	}
+
+	tbr_change_callback = callback;
+	tbr_change_arg = arg;
+	return (0);
+}
+
+/***********************************************************************//**
+With this function client can restrict the tables the replication
+listeners track.
+@return 0 on success, error code at failure. */
+int
+tb_replication_consistency_filter(
+/*==============================*/
+	const char *include,  /*!< in: Tables to track or NULL */
+	const char *exclude)  /*!< in: Tables not to track or NULL */
+{
+	if (n_replication_listeners) {
+		// The listener threads already read the filter
+		return (1);
+	}
+
+	if (!table_replication_filter::tbrf_compile(include, exclude)) {
+		skygw_log_write_flush(LOGFILE_ERROR,
+			(char *)"Error : Invalid table filter, patterns must be of "
+			"the form db.table.");
+		return (1);
+	}
+
+	return (0);
+}
+
 /***********************************************************************//**
 This function will reconnect replication listener to a server
 provided.
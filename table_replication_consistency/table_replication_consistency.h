@@ -46,7 +46,16 @@ typedef struct {
 				     binlog start position. */
 	int use_binlog_pos;          /*!< in: 1 if binlog position
 				     should be used for binlog start
-				     position. */
+				     position. If no start position is
+				     given the listener continues from
+				     its last committed GTID or binlog
+				     file and position. */
+	int verify_checksum;         /*!< in: 1 if binlog event checksums
+				     should be verified when the server
+				     writes them. */
+	int n_workers;               /*!< in: Number of threads applying
+				     the table changes in parallel, 0 to
+				     apply them on the listener thread. */
 	unsigned char *gtid;         /*!< in: Global transaction identifier
 				     or NULL */
 	size_t gtid_length;          /*!< in: Real size of GTID */
@@ -71,8 +80,9 @@ typedef struct table_consistency_query {
 typedef struct table_consistency {
 	unsigned char *db_dot_table;/*!< out: Fully qualified database and
 				    table, e.g. Production.Orders. */
-	unsigned int server_id;     /*!< out: Server id where the consitency
-				    information is from. */
+	unsigned int server_id;     /*!< out: Listener id where the consitency
+				    information is from, the index of the
+				    server in tb_replication_consistency_init. */
 	int mariadb_gtid_known;     /*!< out: 1 if MariaDB global
 				    transaction id is known. */
 	int mysql_gtid_known;       /*!< out: 1 if MySQL global
@@ -100,6 +110,11 @@ typedef struct table_consistency {
 extern bool listener_shutdown;           /* This flag will be true
 					 at shutdown */
 
+/* Function called with the db.table name of every table that the
+replication stream changes. It is called on the listener threads, or on
+their worker threads when n_workers is set, possibly concurrently. */
+typedef void (*tbr_change_callback_t)(const char *db_dot_table, void *arg);
+
 
 EXTERN_C_BLOCK_BEGIN
 
@@ -140,6 +155,37 @@ tb_replication_consistency_query(
 					     of successfull consistency
 					     query results. */
 
+/***********************************************************************//**
+With this function client can register a function that is called for
+every table changed by a query or a row event seen by a replication
+listener. The function must be registered before the listeners are
+started with tb_replication_consistency_init and it must not block, it is
+called on the listener threads or their worker threads.
+@return 0 on success, error code at failure. */
+int
+tb_replication_consistency_callback(
+/*================================*/
+	tbr_change_callback_t callback, /*!< in: Function to call or
+					NULL */
+	void                  *arg);    /*!< in: Argument of the
+					function. */
+
+/***********************************************************************//**
+With this function client can restrict the tables the replication
+listeners track. Both lists are comma separated db.table patterns where *
+matches any number of characters and ? one character, e.g.
+"shop.*,crm.orders". A table is tracked if it matches the include list, or
+the include list is NULL, and it doesn't match the exclude list. Row
+events of tables that are not tracked are skipped before their rows are
+parsed. The filter must be set before the listeners are started with
+tb_replication_consistency_init.
+@return 0 on success, error code at failure. */
+int
+tb_replication_consistency_filter(
+/*==============================*/
+	const char *include,  /*!< in: Tables to track or NULL */
+	const char *exclude); /*!< in: Tables not to track or NULL */
+
 /***********************************************************************//**
 This function will reconnect replication listener to a server
 provided.
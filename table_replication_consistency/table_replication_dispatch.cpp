@@ -0,0 +1,210 @@
+/*
+Copyright (C) 2014, SkySQL Ab
+
+
+This file is distributed as part of the SkySQL Gateway. It is free
+software: you can redistribute it and/or modify it under the terms of the
+GNU General Public License as published by the Free Software Foundation,
+version 2.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 51
+Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+Author: Jan Lindström jan.lindstrom@skysql.com
+
+Created: 17-09-2014
+Updated:
+
+*/
+
+#include <boost/functional/hash.hpp>
+#include "table_replication_dispatch.h"
+
+namespace mysql {
+
+namespace table_replication_dispatch {
+
+/***********************************************************************//**
+Internal function to apply one item on a worker.
+@return false when the worker should stop */
+static bool
+tbrd_apply(
+/*=======*/
+	tbrd_dispatcher_t *d,      /*!< in: Dispatcher */
+	tbrd_item_t *item)         /*!< in: Item, freed here */
+{
+	bool cont = true;
+
+	switch (item->type) {
+	case TBRD_CHANGE:
+		d->change(d->listener_id, &item->header, item->db_dot_table,
+			item->gtid_known, item->gtid);
+		break;
+
+	case TBRD_COMMIT: {
+		tbrd_commit_t *c = item->commit;
+
+		// The last worker to get here reports the commit, every
+		// change before it has been applied by then
+		if (__sync_sub_and_fetch(&c->refs, 1) == 0) {
+			d->commit(c->data);
+			delete c;
+		}
+		break;
+	}
+
+	case TBRD_STOP:
+		cont = false;
+		break;
+	}
+
+	delete item;
+	return cont;
+}
+
+/***********************************************************************//**
+This function is executed by the worker threads. */
+static void*
+tbrd_worker(
+/*========*/
+	void *arg)                 /*!< in: Worker */
+{
+	tbrd_worker_t *w = (tbrd_worker_t *)arg;
+	tbrd_item_t *items[32];
+	bool cont = true;
+
+	while (cont) {
+		boost::uint32_t n = w->queue->pop_batch(items, 32);
+
+		for (boost::uint32_t i = 0; i < n; i++) {
+			cont = tbrd_apply(w->dispatcher, items[i]) && cont;
+		}
+	}
+
+	return NULL;
+}
+
+/***********************************************************************//**
+Create a dispatcher and start its worker threads.
+@return the dispatcher or NULL if the threads could not be created */
+tbrd_dispatcher_t*
+tbrd_create(
+/*========*/
+	boost::uint32_t n_workers,     /*!< in: Number of workers, at most
+				       TBRD_MAX_WORKERS */
+	boost::uint32_t listener_id,   /*!< in: Listener of the changes */
+	tbrd_change_func_t change,     /*!< in: Applies a change */
+	tbrd_commit_func_t commit)     /*!< in: Reports a commit */
+{
+	tbrd_dispatcher_t *d = new tbrd_dispatcher_t;
+
+	if (n_workers > TBRD_MAX_WORKERS) {
+		n_workers = TBRD_MAX_WORKERS;
+	}
+
+	d->n_workers = 0;
+	d->listener_id = listener_id;
+	d->change = change;
+	d->commit = commit;
+
+	for (boost::uint32_t i = 0; i < n_workers; i++) {
+		tbrd_worker_t *w = &d->workers[i];
+
+		w->dispatcher = d;
+		w->queue = new spsc_ring<tbrd_item_t*>(TBRD_QUEUE_SIZE);
+
+		if (pthread_create(&w->thread, NULL, tbrd_worker, w) != 0) {
+			delete w->queue;
+			tbrd_destroy(d);
+			return NULL;
+		}
+
+		d->n_workers++;
+	}
+
+	return d;
+}
+
+/***********************************************************************//**
+Queue a change of a table to the worker of the table. Listener thread
+only. */
+void
+tbrd_change(
+/*========*/
+	tbrd_dispatcher_t *d,            /*!< in: Dispatcher */
+	Log_event_header *header,        /*!< in: Header of the event */
+	const std::string& db_dot_table, /*!< in: db.table name */
+	bool gtid_known,                 /*!< in: Is GTID known */
+	Gtid& gtid)                      /*!< in: GTID */
+{
+	boost::hash<std::string> hasher;
+	tbrd_item_t *item = new tbrd_item_t;
+
+	item->type = TBRD_CHANGE;
+	item->db_dot_table = db_dot_table;
+	item->header = *header;
+	item->gtid_known = gtid_known;
+	item->gtid = gtid;
+	item->commit = NULL;
+
+	// The table name rather than the table id picks the worker, the
+	// id of a table can change between transactions
+	d->workers[hasher(db_dot_table) % d->n_workers].queue->push_front(item);
+}
+
+/***********************************************************************//**
+Queue a commit marker to every worker. Listener thread only. */
+void
+tbrd_commit(
+/*========*/
+	tbrd_dispatcher_t *d,            /*!< in: Dispatcher */
+	void *data)                      /*!< in: Data of the commit */
+{
+	tbrd_commit_t *c = new tbrd_commit_t;
+
+	c->refs = d->n_workers;
+	c->data = data;
+	__sync_synchronize();
+
+	for (boost::uint32_t i = 0; i < d->n_workers; i++) {
+		tbrd_item_t *item = new tbrd_item_t;
+
+		item->type = TBRD_COMMIT;
+		item->commit = c;
+		d->workers[i].queue->push_front(item);
+	}
+}
+
+/***********************************************************************//**
+Apply the queued items, stop the workers and free the dispatcher.
+Listener thread only. */
+void
+tbrd_destroy(
+/*=========*/
+	tbrd_dispatcher_t *d)            /*!< in: Dispatcher */
+{
+	for (boost::uint32_t i = 0; i < d->n_workers; i++) {
+		tbrd_item_t *item = new tbrd_item_t;
+
+		item->type = TBRD_STOP;
+		item->commit = NULL;
+		d->workers[i].queue->push_front(item);
+	}
+
+	for (boost::uint32_t i = 0; i < d->n_workers; i++) {
+		pthread_join(d->workers[i].thread, NULL);
+		delete d->workers[i].queue;
+	}
+
+	delete d;
+}
+
+} // table_replication_dispatch
+
+} // mysql
@@ -0,0 +1,143 @@
+/*
+Copyright (C) 2014, SkySQL Ab
+
+
+This file is distributed as part of the SkySQL Gateway. It is free
+software: you can redistribute it and/or modify it under the terms of the
+GNU General Public License as published by the Free Software Foundation,
+version 2.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 51
+Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+Author: Jan Lindström jan.lindstrom@skysql.com
+
+Created: 17-09-2014
+Updated:
+
+*/
+
+#ifndef TABLE_REPLICATION_DISPATCH_H
+#define TABLE_REPLICATION_DISPATCH_H
+
+#include <pthread.h>
+#include <string>
+#include "binlog_api.h"
+#include "spsc_ring.h"
+
+namespace mysql {
+
+namespace table_replication_dispatch {
+
+/* Maximum number of workers of one listener */
+#define TBRD_MAX_WORKERS 64
+
+/* Size of the queue of one worker */
+#define TBRD_QUEUE_SIZE 1024
+
+/*
+A dispatcher fans the table changes seen by one listener thread out to a
+number of worker threads. The changes of one db.table always go to the same
+worker so that they are applied in binlog order. The listener sends a commit
+marker to every worker at each transaction boundary; the worker that applies
+the last copy of a marker runs the commit function, so a commit is reported
+only after every change before it has been applied, and commits are
+reported in binlog order.
+*/
+
+/* Item types */
+enum tbrd_item_type { TBRD_CHANGE = 1, TBRD_COMMIT = 2, TBRD_STOP = 3 };
+
+/* Commit marker, shared by the workers */
+typedef struct {
+	volatile boost::uint32_t refs;   /* Workers yet to apply it */
+	void *data;                      /* Passed to the commit function */
+} tbrd_commit_t;
+
+/* Queued item */
+typedef struct {
+	tbrd_item_type type;             /* Item type */
+	std::string db_dot_table;        /* TBRD_CHANGE: changed table */
+	Log_event_header header;         /* TBRD_CHANGE: header of the event */
+	bool gtid_known;                 /* TBRD_CHANGE: is GTID known */
+	Gtid gtid;                       /* TBRD_CHANGE: GTID */
+	tbrd_commit_t *commit;           /* TBRD_COMMIT: the marker */
+} tbrd_item_t;
+
+/* Applies a change seen by a listener */
+typedef void (*tbrd_change_func_t)(boost::uint32_t listener_id,
+	Log_event_header *header, const std::string& db_dot_table,
+	bool gtid_known, Gtid& gtid);
+
+/* Reports a commit, the data given to tbrd_commit */
+typedef void (*tbrd_commit_func_t)(void *data);
+
+struct tbrd_dispatcher_struct;
+
+/* One worker */
+typedef struct {
+	pthread_t thread;                /* Worker thread */
+	spsc_ring<tbrd_item_t*> *queue;  /* Items from the listener */
+	struct tbrd_dispatcher_struct *dispatcher; /* Owner */
+} tbrd_worker_t;
+
+/* Dispatcher of one listener */
+typedef struct tbrd_dispatcher_struct {
+	boost::uint32_t n_workers;       /* Number of workers */
+	boost::uint32_t listener_id;     /* Listener of the changes */
+	tbrd_worker_t workers[TBRD_MAX_WORKERS]; /* Workers */
+	tbrd_change_func_t change;       /* Applies a change */
+	tbrd_commit_func_t commit;       /* Reports a commit */
+} tbrd_dispatcher_t;
+
+/***********************************************************************//**
+Create a dispatcher and start its worker threads.
+@return the dispatcher or NULL if the threads could not be created */
+tbrd_dispatcher_t*
+tbrd_create(
+/*========*/
+	boost::uint32_t n_workers,     /*!< in: Number of workers, at most
+				       TBRD_MAX_WORKERS */
+	boost::uint32_t listener_id,   /*!< in: Listener of the changes */
+	tbrd_change_func_t change,     /*!< in: Applies a change */
+	tbrd_commit_func_t commit);    /*!< in: Reports a commit */
+
+/***********************************************************************//**
+Queue a change of a table to the worker of the table. Listener thread
+only. */
+void
+tbrd_change(
+/*========*/
+	tbrd_dispatcher_t *d,            /*!< in: Dispatcher */
+	Log_event_header *header,        /*!< in: Header of the event */
+	const std::string& db_dot_table, /*!< in: db.table name */
+	bool gtid_known,                 /*!< in: Is GTID known */
+	Gtid& gtid);                     /*!< in: GTID */
+
+/***********************************************************************//**
+Queue a commit marker to every worker. Listener thread only. */
+void
+tbrd_commit(
+/*========*/
+	tbrd_dispatcher_t *d,            /*!< in: Dispatcher */
+	void *data);                     /*!< in: Data of the commit */
+
+/***********************************************************************//**
+Apply the queued items, stop the workers and free the dispatcher.
+Listener thread only. */
+void
+tbrd_destroy(
+/*=========*/
+	tbrd_dispatcher_t *d);           /*!< in: Dispatcher */
+
+} // table_replication_dispatch
+
+} // mysql
+
+#endif
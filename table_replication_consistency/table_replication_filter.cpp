@@ -0,0 +1,215 @@
+/*
+Copyright (C) 2014, SkySQL Ab
+
+
+This file is distributed as part of the SkySQL Gateway. It is free
+software: you can redistribute it and/or modify it under the terms of the
+GNU General Public License as published by the Free Software Foundation,
+version 2.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 51
+Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+Author: Jan Lindström jan.lindstrom@skysql.com
+
+Created: 17-09-2014
+Updated:
+
+*/
+
+#include <string.h>
+#include <string>
+#include <vector>
+#include <boost/unordered_set.hpp>
+
+#include "table_replication_filter.h"
+
+namespace mysql {
+
+namespace table_replication_filter {
+
+/* A compiled list of db.table patterns */
+typedef struct {
+	bool                               used;      /* List was given */
+	boost::unordered_set<std::string>  exact;     /* db.table */
+	boost::unordered_set<std::string>  databases; /* db of db.* */
+	std::vector<std::string>           globs;     /* Other patterns */
+} tbrf_list_t;
+
+static tbrf_list_t tbrf_include;
+static tbrf_list_t tbrf_exclude;
+
+/***********************************************************************//**
+Internal function to match a name against a pattern with * and ?
+wildcards.
+@return true if the name matches */
+static bool
+tbrf_glob(
+/*======*/
+	const char *pattern, /*!< in: Pattern */
+	const char *name)    /*!< in: Name to match */
+{
+	const char *star = NULL;   /* Position after the last * seen */
+	const char *retry = NULL;  /* Name position to retry from */
+
+	while (*name) {
+		if (*pattern == '*') {
+			star = ++pattern;
+			retry = name;
+		} else if (*pattern == '?' || *pattern == *name) {
+			pattern++;
+			name++;
+		} else if (star) {
+			pattern = star;
+			name = ++retry;
+		} else {
+			return false;
+		}
+	}
+
+	while (*pattern == '*') {
+		pattern++;
+	}
+
+	return *pattern == '\0';
+}
+
+/***********************************************************************//**
+Internal function to compile one comma separated pattern list.
+@return true on success, false if a pattern is invalid */
+static bool
+tbrf_compile_list(
+/*==============*/
+	tbrf_list_t *list,  /*!< out: Compiled list */
+	const char *str)    /*!< in: Pattern list or NULL */
+{
+	list->used = false;
+	list->exact.clear();
+	list->databases.clear();
+	list->globs.clear();
+
+	if (str == NULL) {
+		return true;
+	}
+
+	list->used = true;
+
+	while (*str) {
+		const char *end = strchr(str, ',');
+		size_t len = end ? (size_t)(end - str) : strlen(str);
+		std::string pattern(str, len);
+
+		str += len;
+		if (*str == ',') {
+			str++;
+		}
+
+		// Trim surrounding white space
+		size_t first = pattern.find_first_not_of(" \t");
+		if (first == std::string::npos) {
+			continue;
+		}
+		pattern = pattern.substr(first, pattern.find_last_not_of(" \t") - first + 1);
+
+		size_t dot = pattern.find('.');
+		if (dot == std::string::npos || dot == 0 || dot == pattern.size() - 1) {
+			return false;
+		}
+
+		std::string db = pattern.substr(0, dot);
+		std::string table = pattern.substr(dot + 1);
+
+		if (pattern.find_first_of("*?") == std::string::npos) {
+			list->exact.insert(pattern);
+		} else if (table == "*" && db.find_first_of("*?") == std::string::npos) {
+			list->databases.insert(db);
+		} else {
+			list->globs.push_back(pattern);
+		}
+	}
+
+	return true;
+}
+
+/***********************************************************************//**
+Internal function to match a table against a compiled list.
+@return true if the table matches one of the patterns */
+static bool
+tbrf_list_match(
+/*============*/
+	const tbrf_list_t *list,          /*!< in: Compiled list */
+	const std::string& db_dot_table)  /*!< in: db.table name */
+{
+	if (list->exact.find(db_dot_table) != list->exact.end()) {
+		return true;
+	}
+
+	if (!list->databases.empty()) {
+		size_t dot = db_dot_table.find('.');
+		if (dot != std::string::npos &&
+		    list->databases.find(db_dot_table.substr(0, dot)) != list->databases.end()) {
+			return true;
+		}
+	}
+
+	for (size_t i = 0; i < list->globs.size(); i++) {
+		if (tbrf_glob(list->globs[i].c_str(), db_dot_table.c_str())) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/***********************************************************************//**
+This function compiles the table include and exclude lists.
+@return true on success, false if a pattern is invalid */
+bool
+tbrf_compile(
+/*=========*/
+	const char *include,   /*!< in: Tables to track or NULL for all */
+	const char *exclude)   /*!< in: Tables not to track or NULL */
+{
+	if (!tbrf_compile_list(&tbrf_include, include) ||
+	    !tbrf_compile_list(&tbrf_exclude, exclude)) {
+		tbrf_compile_list(&tbrf_include, NULL);
+		tbrf_compile_list(&tbrf_exclude, NULL);
+		return false;
+	}
+
+	return true;
+}
+
+/***********************************************************************//**
+@return true if a table filter has been configured */
+bool
+tbrf_active()
+/*==========*/
+{
+	return tbrf_include.used || tbrf_exclude.used;
+}
+
+/***********************************************************************//**
+This function checks a table against the compiled lists.
+@return true if the table is tracked */
+bool
+tbrf_tracked(
+/*=========*/
+	const std::string& db_dot_table) /*!< in: db.table name */
+{
+	if (tbrf_include.used && !tbrf_list_match(&tbrf_include, db_dot_table)) {
+		return false;
+	}
+
+	return !(tbrf_exclude.used && tbrf_list_match(&tbrf_exclude, db_dot_table));
+}
+
+} // table_replication_filter
+
+} // mysql
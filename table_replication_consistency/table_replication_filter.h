@@ -0,0 +1,69 @@
+/*
+Copyright (C) 2014, SkySQL Ab
+
+
+This file is distributed as part of the SkySQL Gateway. It is free
+software: you can redistribute it and/or modify it under the terms of the
+GNU General Public License as published by the Free Software Foundation,
+version 2.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 51
+Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+Author: Jan Lindström jan.lindstrom@skysql.com
+
+Created: 17-09-2014
+Updated:
+
+*/
+
+#ifndef TABLE_REPLICATION_FILTER_H
+#define TABLE_REPLICATION_FILTER_H
+
+#include <string>
+
+namespace mysql {
+
+namespace table_replication_filter {
+
+/***********************************************************************//**
+This function compiles the table include and exclude lists. Both are
+comma separated lists of db.table patterns where * matches any number of
+characters and ? matches one character. Patterns without wildcards and
+patterns of the form db.* are matched with hash lookups, only the others
+are matched one by one. The lists must be compiled before the listener
+threads start, they are read without locking.
+@return true on success, false if a pattern is invalid */
+bool
+tbrf_compile(
+/*=========*/
+	const char *include,   /*!< in: Tables to track or NULL for all */
+	const char *exclude);  /*!< in: Tables not to track or NULL */
+
+/***********************************************************************//**
+@return true if a table filter has been configured */
+bool
+tbrf_active();
+/*==========*/
+
+/***********************************************************************//**
+This function checks a table against the compiled lists. A table is
+tracked if it matches the include list, or there is no include list,
+and it doesn't match the exclude list.
+@return true if the table is tracked */
+bool
+tbrf_tracked(
+/*=========*/
+	const std::string& db_dot_table); /*!< in: db.table name */
+
+} // table_replication_filter
+
+} // mysql
+
+#endif
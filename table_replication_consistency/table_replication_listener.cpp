@@ -31,12 +31,16 @@ Updated:
 #include <errno.h>
 #include <string.h>
 #include <regex.h>
+#include <time.h>
 #include <algorithm>
 #include "listener_exception.h"
 #include "table_replication_consistency.h"
 #include "table_replication_listener.h"
 #include "table_replication_parser.h"
 #include "table_replication_metadata.h"
+#include "table_replication_filter.h"
+#include "table_replication_map.h"
+#include "table_replication_dispatch.h"
 #include "log_manager.h"
 #include "skygw_debug.h"
 
@@ -47,19 +51,25 @@ using namespace mysql;
 using namespace system;
 using namespace table_replication_parser;
 using namespace table_replication_metadata;
+using namespace table_replication_filter;
+using namespace table_replication_map;
+using namespace table_replication_dispatch;
+
+extern tbr_change_callback_t tbr_change_callback; /* Called for every
+						  changed table */
+extern void *tbr_change_arg;             /* Argument of the callback */
 
 namespace mysql {
 
 namespace table_replication_listener {
 
+/* Seconds between the checkpoints of changed consistency information */
+#define TBRL_CHECKPOINT_INTERVAL 10
 
-/* STL multimap containing the consistency information. Multimap is used
-because same table can be found from several servers. */
-multimap<std::string, tbr_metadata_t*> table_consistency_map;
+/* Flags of the MariaDB GTID event, after the sequence number and domain */
+#define TBRL_MARIADB_GTID_FLAGS_OFFSET 12
+#define TBRL_MARIADB_GTID_STANDALONE   1
 
-boost::mutex table_consistency_mutex;    /* This mutex is used to protect
-					 above data structure from
-					 multiple threads */
 
 /* We use this map to store constructed binary log connections */
 map<int, Binary_log*> table_replication_listeners;
@@ -142,147 +152,198 @@ tbrl_extract_master_connect_info()
 
 /***********************************************************************//**
 Internal function to update table consistency information based
-on log event header, table name and if GTID is known the gtid.*/
+on log event header, table name and if GTID is known the gtid. The
+information is kept per listener, that is per server whose binlog
+the change was seen in.*/
 static void
 tbrl_update_consistency(
 /*====================*/
+	boost::uint32_t listener_id, /*!< in: Listener id */
 	Log_event_header *lheader,  /*!< in: Log event header */
 	string database_dot_table,  /*!< in: db.table name */
 	bool gtid_known,            /*!< in: is GTID known */
 	Gtid& gtid)                 /*!< in: gtid */
 {
-	bool not_found = true;
-	tbr_metadata_t *tc=NULL;
-
-	// Need to be protected by mutex to avoid concurrency problems
-	boost::mutex::scoped_lock lock(table_consistency_mutex);
-
-	multimap<std::string, tbr_metadata_t*>::iterator key = table_consistency_map.find(database_dot_table);
-
-	if( key == table_consistency_map.end()) {
-		not_found = true;
-	} else {
-		// Loop through the consistency values
-		for(multimap<std::string, tbr_metadata_t*>::iterator i = key;
-		    i != table_consistency_map.end(); ++i) {
-			tc = (*i).second;
-			if (tc->server_id == lheader->server_id) {
-				not_found = false;
-				break;
-			}
-
-			// If the next table name is not anymore the same,
-			// we can safely exit from the loop, names are ordered
-			if (strcpy((char *)tc->db_table, (char *)database_dot_table.c_str()) != 0) {
-				not_found = true;
-				break;
-			}
-		}
+	// Tell the client that the table has changed
+	if (tbr_change_callback) {
+		tbr_change_callback(database_dot_table.c_str(), tbr_change_arg);
 	}
 
-	if(not_found) {
-		// Consistency for this table and server not found, insert a record
-		tc = (tbr_metadata_t*) malloc(sizeof(tbr_metadata_t));
-		tc->db_table = (unsigned char *)malloc(database_dot_table.size()+1);
-		strcpy((char *)tc->db_table, (char *)database_dot_table.c_str());
-		tc->server_id = lheader->server_id;
-		tc->binlog_pos = lheader->next_position;
-		tc->gtid_known =  gtid_known;
-		tc->gtid_len = gtid.get_gtid_length();
-		tc->gtid = (unsigned char *)malloc(tc->gtid_len);
-		memcpy(tc->gtid, gtid.get_gtid(), tc->gtid_len);
-
-		table_consistency_map.insert(pair<std::string, tbr_metadata_t*>(database_dot_table, tc));
-	} else {
-		// Consistency for this table and server found, update the
-		// consistency values
-		tc->binlog_pos = lheader->next_position;
-		free(tc->gtid);
-		tc->gtid_len = gtid.get_gtid_length();
-		tc->gtid = (unsigned char *)malloc(tc->gtid_len);
-		memcpy(tc->gtid, gtid.get_gtid(), tc->gtid_len);
-		tc->gtid_known = gtid_known;
-	}
+	tbrmap_update(database_dot_table, listener_id,
+		lheader->next_position, gtid.get_gtid(),
+		gtid.get_gtid_length(), gtid_known);
 
 	if (tbr_trace) {
 		// This will log error to log file
 		skygw_log_write_flush( LOGFILE_TRACE,
-			(char *)"TRC Trace: Current state for table %s in server %d binlog_pos %lu GTID '%s'",
-			tc->db_table, tc->server_id, tc->binlog_pos, gtid.get_string().c_str());
+			(char *)"TRC Trace: Current state for table %s in listener %d binlog_pos %lu GTID '%s'",
+			database_dot_table.c_str(), listener_id,
+			lheader->next_position, gtid.get_string().c_str());
 	}
 
 }
 
+/* State of a listener after a committed transaction */
+typedef struct {
+	boost::uint32_t listener_id;  /* Listener id */
+	boost::uint32_t server_type;  /* TRC_SERVER_TYPE_MARIADB or
+				      TRC_SERVER_TYPE_MYSQL */
+	boost::uint64_t binlog_pos;   /* Position after the commit */
+	std::string binlog_file;      /* Binlog file of binlog_pos */
+	bool gtid_known;              /* is GTID known */
+	Gtid gtid;                    /* GTID of the transaction */
+} tbrl_commit_t;
+
 /***********************************************************************//**
 Internal function to update table replication consistency server status
-based on log event header and gtid if known*/
+at a transaction boundary. The status is kept per listener, it is where
+the listener continues from after a restart. */
 static void
 tbrl_update_server_status(
 /*======================*/
-	Log_event_header *lheader,  /*!< in: Log event header */
-	bool gtid_known,            /*!< in: is GTID known */
-	Gtid& gtid)                 /*!< in: gtid */
+	const tbrl_commit_t *commit) /*!< in: Committed state */
 {
-	bool not_found = true;
 	tbr_server_t *ts=NULL;
+	Gtid gtid = commit->gtid;
 
 	// Need to be protected by mutex to avoid concurrency problems
 	boost::mutex::scoped_lock lock(table_servers_mutex);
 
-	// Try to find out the servre metadata
-	map<uint32_t, tbr_server_t*>::iterator key = table_replication_servers.find(lheader->server_id);
+	// Try to find out the server metadata
+	map<uint32_t, tbr_server_t*>::iterator key = table_replication_servers.find(commit->listener_id);
 
 	if( key == table_replication_servers.end()) {
-		not_found = true;
+		// Status for this server not found, insert a record
+		ts = (tbr_server_t*) calloc(1, sizeof(tbr_server_t));
+		ts->server_id = commit->listener_id;
+		table_replication_servers.insert(pair<boost::uint32_t, tbr_server_t*>(commit->listener_id, ts));
 	} else {
 		ts = (*key).second;
-		not_found = false;
 	}
 
-	if(not_found) {
-		// Consistency for this server not found, insert a record
-		ts = (tbr_server_t*) malloc(sizeof(tbr_server_t));
-		ts->server_id = lheader->server_id;
-		ts->binlog_pos = lheader->next_position;
-		ts->gtid_known =  gtid_known;
-		ts->gtid_len = gtid.get_gtid_length();
-		ts->gtid = (unsigned char *)malloc(ts->gtid_len);
-		memcpy(ts->gtid, gtid.get_gtid(), ts->gtid_len);
-
-		table_replication_servers.insert(pair<boost::uint32_t, tbr_server_t*>(lheader->server_id, ts));
-	} else {
-		// Consistency for this server found, update the consistency values
-		ts->binlog_pos = lheader->next_position;
-		free(ts->gtid);
-		ts->gtid_len = gtid.get_gtid_length();
-		ts->gtid = (unsigned char *)malloc(ts->gtid_len);
-		memcpy(ts->gtid, gtid.get_gtid(), ts->gtid_len);
-		ts->gtid_known = gtid_known;
-	}
+	ts->binlog_pos = commit->binlog_pos;
+	ts->server_type = commit->server_type;
+	free(ts->gtid);
+	ts->gtid_len = gtid.get_gtid_length();
+	ts->gtid = (unsigned char *)malloc(ts->gtid_len + 1);
+	memcpy(ts->gtid, gtid.get_gtid(), ts->gtid_len);
+	ts->gtid[ts->gtid_len] = '\0';
+	ts->gtid_known = commit->gtid_known;
+	free(ts->binlog_file);
+	ts->binlog_file = strdup(commit->binlog_file.c_str());
 
 	if (tbr_trace) {
 		// This will log error to log file
 		skygw_log_write_flush( LOGFILE_TRACE,
-			(char *)"TRC Trace: Current state for server %d binlog_pos %lu GTID '%s'",
-			ts->server_id, ts->binlog_pos, gtid.get_string().c_str());
+			(char *)"TRC Trace: Current state for server %d binlog '%s' pos %lu GTID '%s'",
+			ts->server_id, ts->binlog_file, ts->binlog_pos, gtid.get_string().c_str());
+	}
+}
+
+/***********************************************************************//**
+Internal function to update the server status on a dispatcher worker. */
+static void
+tbrl_apply_commit(
+/*==============*/
+	void *data)                 /*!< in: tbrl_commit_t, freed here */
+{
+	tbrl_commit_t *commit = (tbrl_commit_t *)data;
+
+	tbrl_update_server_status(commit);
+	delete commit;
+}
+
+/***********************************************************************//**
+Internal function to handle a transaction boundary, either on the
+listener thread or after the workers have applied the changes before
+it. */
+static void
+tbrl_commit(
+/*========*/
+	tbrd_dispatcher_t *dispatcher,     /*!< in: Dispatcher or NULL */
+	replication_listener_t *rlt,       /*!< in: Listener */
+	Binary_log& binlog,                /*!< in: Binlog connection */
+	Log_event_header *lheader,         /*!< in: Log event header */
+	bool gtid_known,                   /*!< in: is GTID known */
+	Gtid& gtid)                        /*!< in: gtid */
+{
+	tbrl_commit_t *commit = new tbrl_commit_t;
+
+	commit->listener_id = rlt->listener_id;
+	commit->server_type =
+		binlog.get_mysql_server_type() == MYSQL_SERVER_TYPE_MARIADB ?
+		TRC_SERVER_TYPE_MARIADB : TRC_SERVER_TYPE_MYSQL;
+	commit->binlog_pos = lheader->next_position;
+	(void) binlog.get_position(commit->binlog_file);
+	commit->gtid_known = gtid_known;
+	commit->gtid = gtid;
+
+	if (dispatcher) {
+		tbrd_commit(dispatcher, commit);
+	} else {
+		tbrl_apply_commit(commit);
+	}
+}
+
+/***********************************************************************//**
+Internal function to apply a table change on a dispatcher worker. */
+static void
+tbrl_apply_change(
+/*==============*/
+	boost::uint32_t listener_id,       /*!< in: Listener id */
+	Log_event_header *lheader,         /*!< in: Log event header */
+	const string& database_dot_table,  /*!< in: db.table name */
+	bool gtid_known,                   /*!< in: is GTID known */
+	Gtid& gtid)                        /*!< in: gtid */
+{
+	tbrl_update_consistency(listener_id, lheader, database_dot_table, gtid_known, gtid);
+}
+
+/***********************************************************************//**
+Internal function to handle a table changed by an event, either on the
+listener thread or by queueing it to the worker of the table. */
+static void
+tbrl_table_changed(
+/*===============*/
+	tbrd_dispatcher_t *dispatcher,     /*!< in: Dispatcher or NULL */
+	boost::uint32_t listener_id,       /*!< in: Listener id */
+	Log_event_header *lheader,         /*!< in: Log event header */
+	const string& database_dot_table,  /*!< in: db.table name */
+	bool gtid_known,                   /*!< in: is GTID known */
+	Gtid& gtid)                        /*!< in: gtid */
+{
+	// Tables excluded by the table filter are not tracked
+	if (!tbrf_tracked(database_dot_table)) {
+		return;
+	}
+
+	if (dispatcher) {
+		tbrd_change(dispatcher, lheader, database_dot_table, gtid_known, gtid);
+	} else {
+		tbrl_update_consistency(listener_id, lheader, database_dot_table, gtid_known, gtid);
 	}
 }
 
 /***********************************************************************//**
 Internal function to iterate through server metadata to find out if
-we should continue from existing binlog position or gtid position.*/
+we should continue from existing binlog position or gtid position.
+The binlog file is empty if it is not known, then the position is
+in the binlog the master starts from.*/
 static bool
 tbrl_get_startup_pos(
 /*=================*/
-	boost::uint32_t server_id,
-	boost::uint64_t *binlog_pos,
-	Gtid *gtid,
-	bool *gtid_known,
-	bool *use_binlog_pos)
+	boost::uint32_t server_id,   /*!< in: Listener id */
+	string *binlog_file,         /*!< out: Binlog file or empty */
+	boost::uint64_t *binlog_pos, /*!< out: Binlog position */
+	Gtid *gtid,                  /*!< out: GTID */
+	bool *gtid_known,            /*!< out: true if GTID is used */
+	bool *use_binlog_pos)        /*!< out: true if binlog position
+				     is used */
 {
 	*use_binlog_pos = true;
 	*gtid_known = false;
 	*binlog_pos = 0;
+	binlog_file->clear();
 
 	// Need to be protected by mutex to avoid concurrency problems
 	boost::mutex::scoped_lock lock(table_servers_mutex);
@@ -296,23 +357,32 @@ tbrl_get_startup_pos(
 		// For MariaDB we know how to start from GTID position if
 		// that is specified, in MYSQL we use always binlog pos
 
-		if (mserver->server_type == TRC_SERVER_TYPE_MARIADB) {
-			if (mserver->gtid_known) {
-				boost::uint32_t domain;
-				boost::uint32_t server;
-				boost::uint64_t sno;
-				sscanf((const char *)mserver->gtid, "%u-%u-%lu", &domain, &server, &sno);
+		if (mserver->server_type == TRC_SERVER_TYPE_MARIADB
+		    && mserver->gtid_known && mserver->gtid) {
+			boost::uint32_t domain;
+			boost::uint32_t server;
+			boost::uint64_t sno;
+			char buf[TBR_GTID_MAX_LEN + 1];
+			size_t len = mserver->gtid_len < TBR_GTID_MAX_LEN ?
+				mserver->gtid_len : TBR_GTID_MAX_LEN;
+
+			memcpy(buf, mserver->gtid, len);
+			buf[len] = '\0';
+
+			if (sscanf(buf, "%u-%u-%lu", &domain, &server, &sno) == 3) {
 				*gtid_known = true;
 				*gtid = Gtid(domain, server, sno);
-			} else {
-				*binlog_pos = mserver->binlog_pos;
-				*use_binlog_pos = true;
+				*use_binlog_pos = false;
+				return true;
 			}
-		} else {
-			*binlog_pos = mserver->binlog_pos;
-			*use_binlog_pos = true;
 		}
 
+		if (mserver->binlog_file) {
+			*binlog_file = mserver->binlog_file;
+		}
+		*binlog_pos = mserver->binlog_pos;
+		*use_binlog_pos = true;
+
 		return true;
 	}
 
@@ -335,17 +405,33 @@ void* tb_replication_listener_reader(
 	char *uri = rlt->server_url;
 	map<int, string> tid2tname;
 	map<int, string>::iterator tb_it;
+	map<int, bool> tid_tracked;   /* Table filter result by table id */
+	map<int, bool>::iterator tt_it;
+	bool filter_active = tbrf_active();
 	pthread_t id = pthread_self();
 	string database_dot_table;
 	const char* server_type;
 	Gtid gtid;
 	bool gtid_known = false;
 	boost::uint64_t binlog_pos = 0;
+	string binlog_file;           /* Binlog file to start from or empty */
 	bool use_binlog_pos = true;
+	tbrd_dispatcher_t *dispatcher = NULL; /* Workers or NULL */
+	bool in_trx = false;          /* Inside a transaction */
+	boost::uint64_t n_events = 0; /* Events since the last report */
+	time_t report_time = time(NULL); /* Time of the last report */
+	bool caught_up = false;       /* Listener has reached the master */
 
 	try {
 		Binary_log binlog(create_transport(uri), uri);
 
+		// Only the table id of row events is used, their row images
+		// are not needed.
+		binlog.set_header_only(true);
+
+		// Corrupted events are reported as incidents
+		binlog.set_verify_checksum(rlt->verify_checksum != 0);
+
 		// If the external user has provided the position where to
 		// continue we will use that. If no position is given,
 		// we try to use position from metadata tables. If all this
@@ -365,14 +451,17 @@ void* tb_replication_listener_reader(
 		} else {
 			// At startup we need to iterate through servers and see if
 			// we need to continue from last position
-			if(!tbrl_get_startup_pos(rlt->listener_id, &binlog_pos, &gtid, &gtid_known, &use_binlog_pos)) {
+			if(!tbrl_get_startup_pos(rlt->listener_id, &binlog_file, &binlog_pos, &gtid, &gtid_known, &use_binlog_pos)) {
 				binlog_pos = 0;
 				use_binlog_pos = true;
 			}
 		}
 
-		// Connect to server
-		if (use_binlog_pos) {
+		// Connect to server, a persisted position is continued from
+		// the binlog file it was recorded in
+		if (use_binlog_pos && !binlog_file.empty()) {
+			binlog.connect(binlog_file, binlog_pos);
+		} else if (use_binlog_pos) {
 			binlog.connect(binlog_pos);
 		} else {
 			binlog.connect(gtid);
@@ -396,22 +485,77 @@ void* tb_replication_listener_reader(
 			skygw_log_write_flush( LOGFILE_TRACE, (char *)trace_msg.c_str());
 		}
 
+		// With workers, table changes are applied in parallel and
+		// the server status is updated at transaction boundaries
+		// when the changes before it have been applied
+		if (rlt->n_workers > 0) {
+			dispatcher = tbrd_create(rlt->n_workers, rlt->listener_id,
+				tbrl_apply_change, tbrl_apply_commit);
+
+			if (!dispatcher) {
+				skygw_log_write_flush( LOGFILE_ERROR,
+					(char *)"Error: Could not create listener workers, changes are applied by the listener");
+			}
+		}
+
 		Binary_log_event *event;
 
 		// While we have events
 		while (true) {
 			Log_event_header *lheader;
+			Binary_log_event_view view;
 
-			// Wait for the next event
-			int result = binlog.wait_for_next_event(&event);
+			// Wait for the next event. It is read in place and
+			// only copied into an event object if it is used.
+			int result = binlog.wait_for_next_event_view(&view);
 
 			if (result == ERR_EOF)
 				break;
 
+			// Report how fast the listener catches up with the
+			// master after a restart
+			n_events++;
+
+			if (tbr_trace) {
+				time_t now = time(NULL);
+				long lag = (long)now - (long)view.header()->timestamp;
+
+				if (now - report_time >= TBRL_CHECKPOINT_INTERVAL) {
+					skygw_log_write_flush( LOGFILE_TRACE,
+						(char *)"TRC Trace: Listener %d %lu events/s binlog pos %lu lag %ld s",
+						rlt->listener_id,
+						(unsigned long)(n_events / (now - report_time)),
+						(unsigned long)view.header()->next_position,
+						lag);
+					n_events = 0;
+					report_time = now;
+				}
+
+				if (!caught_up && lag <= 1) {
+					caught_up = true;
+					skygw_log_write_flush( LOGFILE_TRACE,
+						(char *)"TRC Trace: Listener %d has caught up with the master",
+						rlt->listener_id);
+				}
+			}
+
+			// Row events of tables that are not tracked are
+			// skipped before their rows are parsed
+			if (filter_active && view.event() == NULL) {
+				Row_event_view rview;
+
+				if (!proto_rows_event_view(view, &rview)) {
+					tt_it = tid_tracked.find(rview.table_id);
+
+					if (tt_it != tid_tracked.end() && !tt_it->second) {
+						continue;
+					}
+				}
+			}
+
+			event = binlog.copy_event(view);
 			lheader = event->header();
 
-			// Insert or update current server status
-			tbrl_update_server_status(lheader, gtid_known, gtid);
 
 			switch(event->get_event_type()) {
 
@@ -440,7 +584,7 @@ void* tb_replication_listener_reader(
 						database_dot_table.append(".");
 						database_dot_table.append(string(table_names[k]));
 
-						tbrl_update_consistency(lheader, database_dot_table, gtid_known, gtid);
+						tbrl_table_changed(dispatcher, rlt->listener_id, lheader, database_dot_table, gtid_known, gtid);
 
 						free(db_names[k]);
 						free(table_names[k]);
@@ -469,6 +613,24 @@ void* tb_replication_listener_reader(
 						qevent->db_name.c_str(),
 						gtid.get_string().c_str());
 				}
+
+				// A transaction ends with COMMIT or an XID event,
+				// other statements outside of a transaction are
+				// committed on their own
+				if (qevent->query == "BEGIN") {
+					in_trx = true;
+				} else if (!in_trx || qevent->query == "COMMIT"
+					   || qevent->query == "ROLLBACK") {
+					in_trx = false;
+					tbrl_commit(dispatcher, rlt, binlog, lheader, gtid_known, gtid);
+				}
+				break;
+			}
+
+			// Transaction commit
+			case XID_EVENT: {
+				in_trx = false;
+				tbrl_commit(dispatcher, rlt, binlog, lheader, gtid_known, gtid);
 				break;
 			}
 
@@ -488,6 +650,14 @@ void* tb_replication_listener_reader(
 					gtid = Gtid(gevent->m_mysql_gtid);
 				}
 
+				// A MariaDB GTID event starts the transaction
+				// unless it is flagged as a standalone statement
+				if (event->get_event_type() == GTID_EVENT_MARIADB
+				    && view.body_length() > TBRL_MARIADB_GTID_FLAGS_OFFSET
+				    && !(view.body()[TBRL_MARIADB_GTID_FLAGS_OFFSET] & TBRL_MARIADB_GTID_STANDALONE)) {
+					in_trx = true;
+				}
+
 				if (tbr_debug) {
 					skygw_log_write_flush( LOGFILE_TRACE,
 						(char *)"TRC Debug: Thread %ld Server %d Binlog_pos %lu event %d"
@@ -510,7 +680,14 @@ void* tb_replication_listener_reader(
 				database_dot_table= table_map_event->db_name;
 				database_dot_table.append(".");
 				database_dot_table.append(table_map_event->table_name);
-				tid2tname[table_map_event->table_id]= database_dot_table;
+
+				// Match the table against the filter only when the
+				// table id is new or reused for another table
+				tb_it= tid2tname.find(table_map_event->table_id);
+				if (tb_it == tid2tname.end() || tb_it->second != database_dot_table) {
+					tid2tname[table_map_event->table_id]= database_dot_table;
+					tid_tracked[table_map_event->table_id]= tbrf_tracked(database_dot_table);
+				}
 
 				if (tbr_debug) {
 					skygw_log_write_flush( LOGFILE_TRACE,
@@ -558,7 +735,7 @@ void* tb_replication_listener_reader(
 
 
 				// Update the consistency information
-				tbrl_update_consistency(lheader, database_dot_table, gtid_known, gtid);
+				tbrl_table_changed(dispatcher, rlt->listener_id, lheader, database_dot_table, gtid_known, gtid);
 
 				break;
 
@@ -567,12 +744,22 @@ void* tb_replication_listener_reader(
 			default:
 				break;
 	          } // switch
+
+			delete event;
 		} // while
+
+		if (dispatcher) {
+			tbrd_destroy(dispatcher);
+			dispatcher = NULL;
+		}
 	} // try
 	catch(ListenerException e)
 	{
 		string err = std::string("Listener exception: ")+ e.what();
 		skygw_log_write_flush( LOGFILE_ERROR, (char *)err.c_str());
+		if (dispatcher) {
+			tbrd_destroy(dispatcher);
+		}
 		// Re-Throw this one.
 		throw;
 	}
@@ -580,6 +767,9 @@ void* tb_replication_listener_reader(
 	{
 		string err = std::string("Listener system exception: ")+ e.message();
 		skygw_log_write_flush( LOGFILE_ERROR, (char *)err.c_str());
+		if (dispatcher) {
+			tbrd_destroy(dispatcher);
+		}
 		// Re-Throw this one.
 		throw;
 	}
@@ -588,6 +778,9 @@ void* tb_replication_listener_reader(
 	{
 		string err = std::string("Listener other exception: ")+ e.what();
 		skygw_log_write_flush( LOGFILE_ERROR, (char *)err.c_str());
+		if (dispatcher) {
+			tbrd_destroy(dispatcher);
+		}
 		// Re-Throw this one.
 		throw;
 	}
@@ -596,6 +789,9 @@ void* tb_replication_listener_reader(
 	{
 		string err = std::string("Unknown exception: ");
 		skygw_log_write_flush( LOGFILE_ERROR, (char *)err.c_str());
+		if (dispatcher) {
+			tbrd_destroy(dispatcher);
+		}
 		// Re-Throw this one.
 		// It was not handled so you want to make sure it is handled correctly by
 		// the OS. So just allow the exception to keep propagating.
@@ -703,36 +899,38 @@ tb_replication_listener_consistency(
 	table_consistency_t *tb_consistency, /*!< out: Consistency values. */
 	boost::uint32_t     server_no)       /*!< in: Server */
 {
-	bool found = false;
-	boost::uint32_t cur_server = 0;
-	tbr_metadata_t *tc=NULL;
+	tbr_metadata_t tc;
+	unsigned char gtid[TBR_GTID_MAX_LEN];
 
-	// Need to be protected by mutex to avoid concurrency problems
-	boost::mutex::scoped_lock lock(table_consistency_mutex);
-
-	// Loop through the consistency values
-	for(multimap<std::string, tbr_metadata_t*>::iterator i = table_consistency_map.find((char *)db_dot_table);
-	    i != table_consistency_map.end(); ++i, ++cur_server) {
-		if (cur_server == server_no) {
-			tc = (*i).second;
-			memcpy(tb_consistency, tc, sizeof(tbr_metadata_t));
-			found = true;
-			break;
-		}
+	if (!tbrmap_read(std::string((const char *)db_dot_table), server_no,
+		    &tc, gtid)) {
+		return (1);
 	}
 
-	if (found) {
-		if (tbr_trace) {
-			// This will log error to log file
-			skygw_log_write_flush( LOGFILE_TRACE,
-				(char *)"TRC Trace: Current state for table %s in server %d binlog_pos %lu GTID '%s'",
-				tc->db_table, tc->server_id, tc->binlog_pos, tc->gtid);
-		}
-		return (1);
-	} else {
-		return (0);
+	tb_consistency->db_dot_table = (unsigned char *)db_dot_table;
+	tb_consistency->server_id = tc.server_id;
+	tb_consistency->binlog_pos = tc.binlog_pos;
+	tb_consistency->mysql_gtid_known = tc.gtid_known &&
+		tc.gtid_len == MYSQL_GTID_ENCODED_SIZE;
+	tb_consistency->mariadb_gtid_known = tc.gtid_known &&
+		tc.gtid_len != MYSQL_GTID_ENCODED_SIZE;
+	tb_consistency->gtid_length = tc.gtid_len;
+	tb_consistency->gtid = NULL;
+
+	if (tc.gtid_known) {
+		tb_consistency->gtid = (unsigned char *)malloc(tc.gtid_len + 1);
+		memcpy(tb_consistency->gtid, gtid, tc.gtid_len);
+		tb_consistency->gtid[tc.gtid_len] = '\0';
+	}
+
+	if (tbr_trace) {
+		// This will log error to log file
+		skygw_log_write_flush( LOGFILE_TRACE,
+			(char *)"TRC Trace: Current state for table %s in server %d binlog_pos %lu",
+			tc.db_table, tc.server_id, tc.binlog_pos);
 	}
 
+	return (0);
 }
 /***********************************************************************//**
 This function will reconnect replication listener to a server
@@ -851,6 +1049,54 @@ err_exit:
 	return (1);
 }
 
+/***********************************************************************//**
+Internal function to copy the server status so that it can be written
+without holding the servers mutex.
+@return number of servers copied */
+static size_t
+tbrl_copy_servers(
+/*==============*/
+	std::vector<tbr_server_t>& servers) /*!< out: Copy of the status */
+{
+	boost::mutex::scoped_lock lock(table_servers_mutex);
+
+	servers.clear();
+	servers.reserve(table_replication_servers.size());
+
+	for(map<boost::uint32_t, tbr_server_t*>::iterator i = table_replication_servers.begin();
+	    i != table_replication_servers.end(); ++i) {
+		tbr_server_t t = *((*i).second);
+
+		if (t.gtid) {
+			t.gtid = (unsigned char *)malloc(t.gtid_len + 1);
+			memcpy(t.gtid, (*i).second->gtid, t.gtid_len + 1);
+		}
+
+		if (t.binlog_file) {
+			t.binlog_file = strdup(t.binlog_file);
+		}
+
+		servers.push_back(t);
+	}
+
+	return servers.size();
+}
+
+/***********************************************************************//**
+Internal function to free a copy of the server status. */
+static void
+tbrl_free_servers(
+/*==============*/
+	std::vector<tbr_server_t>& servers) /*!< in/out: Copy to free */
+{
+	for(size_t k = 0; k < servers.size(); k++) {
+		free(servers[k].gtid);
+		free(servers[k].binlog_file);
+	}
+
+	servers.clear();
+}
+
 /***********************************************************************//**
 This internal function is executed on its own thread and it will write
 table consistency information to the master database in every n seconds
@@ -862,6 +1108,8 @@ void
 	void *arg)   /*!< in: Master definition */
 {
 	master = (replication_listener_t*)arg;
+	std::vector<tbr_metadata_t> snapshot;
+	std::vector<tbr_server_t> servers;
 	tbr_metadata_t **tm=NULL;
 	tbr_server_t **ts=NULL;
 	bool err = false;
@@ -870,34 +1118,26 @@ void
 	tbrl_extract_master_connect_info();
 
 	while(listener_shutdown == false) {
-		sleep(10); // Sleep ~10 seconds
+		sleep(TBRL_CHECKPOINT_INTERVAL);
 
 		try {
 			size_t nelems;
 
-			// This scope for scoped mutexing
-			{
-				// Need to be protected by mutex to avoid concurrency problems
-				boost::mutex::scoped_lock lock(table_consistency_mutex);
-
-				nelems = table_consistency_map.size();
-				size_t k =0;
-
-				tm = (tbr_metadata_t**)calloc(nelems, sizeof(tbr_metadata_t*));
-
-				if (!tm) {
-					skygw_log_write_flush( LOGFILE_ERROR, (char *)"Error: TRM: Out of memory");
-					goto my_exit;
-
-				}
+			// Copy the entries changed since the last checkpoint
+			// so that the listeners are not blocked while the
+			// metadata is written
+			nelems = tbrmap_snapshot(snapshot, true);
 
-				for(multimap<std::string, tbr_metadata_t*>::iterator i = table_consistency_map.begin();
-				    i != table_consistency_map.end(); ++i,++k) {
+			tm = (tbr_metadata_t**)calloc(nelems + 1, sizeof(tbr_metadata_t*));
 
-					tm[k] = ((*i).second);
-				}
+			if (!tm) {
+				skygw_log_write_flush( LOGFILE_ERROR, (char *)"Error: TRM: Out of memory");
+				goto my_exit;
 			}
 
+			for(size_t k = 0; k < nelems; k++) {
+				tm[k] = &snapshot[k];
+			}
 
 			// Insert or update metadata information
 			if (!tbrm_write_consistency_metadata(
@@ -907,34 +1147,27 @@ void
 				master_port,
 				tm,
 				nelems)) {
+				tbrmap_mark_dirty(snapshot);
 				goto my_exit;
 			}
 
 			free(tm);
 			tm = NULL;
+			tbrmap_free_snapshot(snapshot);
 
-			// This scope for scoped mutexing
-			{
-				// Need to be protected by mutex to avoid
-				// concurrency problems
-				boost::mutex::scoped_lock lock(table_servers_mutex);
+			// Copy the server status, listeners replace it at
+			// every commit
+			nelems = tbrl_copy_servers(servers);
 
-				nelems = table_replication_servers.size();
-				size_t k =0;
+			ts = (tbr_server_t**)calloc(nelems + 1, sizeof(tbr_server_t*));
 
-				ts = (tbr_server_t**)calloc(nelems, sizeof(tbr_server_t*));
-
-				if (!ts) {
-					skygw_log_write_flush( LOGFILE_ERROR, (char *)"Error: TRM: Out of memory");
-					goto my_exit;
-				}
-
-				for(map<boost::uint32_t, tbr_server_t*>::iterator i = table_replication_servers.begin();
-				    i != table_replication_servers.end(); ++i,++k) {
-
-					ts[k] = ((*i).second);
+			if (!ts) {
+				skygw_log_write_flush( LOGFILE_ERROR, (char *)"Error: TRM: Out of memory");
+				goto my_exit;
+			}
 
-				}
+			for(size_t k = 0; k < nelems; k++) {
+				ts[k] = &servers[k];
 			}
 
 			// Insert or update metadata information
@@ -950,6 +1183,7 @@ void
 
 			free(ts);
 			ts = NULL;
+			tbrl_free_servers(servers);
 		}
 		catch(ListenerException e)
 		{
@@ -985,6 +1219,9 @@ my_exit:
 		free(tm);
 	}
 
+	tbrmap_free_snapshot(snapshot);
+	tbrl_free_servers(servers);
+
 	if (ts) {
 		free(ts);
 	}
@@ -1034,9 +1271,15 @@ tb_replication_listener_init(
 			tbr_metadata_t *t = &(tm[i]);
 			dbtable = std::string((char *)t->db_table);
 
-			table_consistency_map.insert(pair<std::string, tbr_metadata_t*>(dbtable, t));
+			tbrmap_update(dbtable, t->server_id, t->binlog_pos,
+				t->gtid, t->gtid_len, t->gtid_known, false);
+			free(t->db_table);
+			free(t->gtid);
 		}
 
+		free(tm);
+		tm = NULL;
+
 		if (!tbrm_read_server_metadata(
 				(const char *)master_host,
 				(const char *)master_user,
@@ -1049,11 +1292,16 @@ tb_replication_listener_init(
 		}
 
 		for(size_t i=0;i < tm_rows; i++) {
-			tbr_server_t *t = &(ts[i]);
+			tbr_server_t *t = (tbr_server_t*) malloc(sizeof(tbr_server_t));
 
+			// Entries are freed one by one in done()
+			*t = ts[i];
 			table_replication_servers.insert(pair<uint32_t, tbr_server_t*>(t->server_id, t));
 		}
 
+		free(ts);
+		ts = NULL;
+
 	}
 	catch(ListenerException e)
 	{
@@ -1099,14 +1347,15 @@ tb_replication_listener_done(
 /*==========================*/
 	char **error_message)  /*!< out: error message */
 {
-	size_t nelems = table_consistency_map.size();
+	std::vector<tbr_metadata_t> snapshot;
+	size_t nelems = tbrmap_snapshot(snapshot, true);
 	size_t nelems2 = table_replication_servers.size();
 	size_t k =0;
 	tbr_metadata_t **tm=NULL;
 	tbr_server_t **ts=NULL;
 	bool err = false;
 
-	tm = (tbr_metadata_t**)calloc(nelems, sizeof(tbr_metadata_t*));
+	tm = (tbr_metadata_t**)calloc(nelems + 1, sizeof(tbr_metadata_t*));
 	ts = (tbr_server_t **)calloc(nelems2, sizeof(tbr_server_t*));
 
 	if (tm == NULL || ts == NULL) {
@@ -1115,10 +1364,8 @@ tb_replication_listener_done(
 	}
 
 	try {
-		k = 0;
-		for(multimap<std::string, tbr_metadata_t*>::iterator i = table_consistency_map.begin();
-		    i != table_consistency_map.end(); ++i,++k) {
-			tm[k] = ((*i).second);
+		for(k = 0; k < nelems; k++) {
+			tm[k] = &snapshot[k];
 		}
 
 		// Insert or update table consistency metadata information
@@ -1132,17 +1379,9 @@ tb_replication_listener_done(
 			goto error_exit;
 		}
 
-		// Clean up memory allocation for multimap items
-		for(multimap<std::string, tbr_metadata_t*>::iterator i = table_consistency_map.begin();
-		    i != table_consistency_map.end(); ++i) {
-			tbr_metadata_t *trm = ((*i).second);
-
-			free(trm->db_table);
-			free(trm->gtid);
-
-			table_consistency_map.erase(i);
-			free(trm);
-		}
+		// Clean up the table consistency entries
+		tbrmap_free_snapshot(snapshot);
+		tbrmap_clear();
 
 		k=0;
 		for(map<uint32_t, tbr_server_t*>::iterator i = table_replication_servers.begin();
@@ -1167,11 +1406,12 @@ tb_replication_listener_done(
 			tbr_server_t *trs = ((*j).second);
 
 			free(trs->gtid);
-
-			table_replication_servers.erase(j);
+			free(trs->binlog_file);
 			free(trs);
 		}
 
+		table_replication_servers.clear();
+
 		// Clean up binlog listeners
 		table_replication_listeners.erase(table_replication_listeners.begin(), table_replication_listeners.end());
 	}
@@ -1220,6 +1460,8 @@ error_exit:
 		free(ts);
 	}
 
+	tbrmap_free_snapshot(snapshot);
+
 	return err;
 }
 
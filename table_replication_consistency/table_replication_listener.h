@@ -50,8 +50,9 @@ With this fuction client can request table consistency status for a
 single table. As a return client will receive a number of consistency
 status structures. Client must allocate memory for consistency result
 array and provide the maximum number of values returned. At return
-there is information how many results where available.
-@return 0 on success, error code at failure. */
+there is information how many results where available. The GTID of
+the result is allocated with malloc and must be freed by the caller.
+@return 0 if the server_no'th server has changed the table, 1 if not. */
 int
 tb_replication_listener_consistency(
 /*================================*/
@@ -0,0 +1,324 @@
+/*
+Copyright (C) 2014, SkySQL Ab
+
+
+This file is distributed as part of the SkySQL Gateway. It is free
+software: you can redistribute it and/or modify it under the terms of the
+GNU General Public License as published by the Free Software Foundation,
+version 2.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 51
+Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+Author: Jan Lindström jan.lindstrom@skysql.com
+
+Created: 17-09-2014
+Updated:
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <boost/unordered_map.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+#include "table_replication_map.h"
+
+namespace mysql {
+
+namespace table_replication_map {
+
+/* One table on one server */
+typedef struct {
+	tbr_metadata_t   meta;      /* db_table and server_id are constant,
+				    the rest is written under seq */
+	volatile boost::uint32_t seq; /* Odd while an update is in progress */
+	volatile bool dirty;         /* Changed since the last checkpoint */
+} tbr_entry_t;
+
+typedef std::vector<tbr_entry_t*> tbr_entries_t;
+typedef boost::unordered_map<std::string, tbr_entries_t> tbr_shard_map_t;
+
+typedef struct {
+	boost::shared_mutex lock;   /* Exclusive only to add entries */
+	tbr_shard_map_t     tables;
+	char                pad[64];
+} tbr_shard_t;
+
+static tbr_shard_t tbr_shards[TBR_MAP_SHARDS];
+
+/***********************************************************************//**
+@return the shard of a table */
+static inline tbr_shard_t*
+tbrmap_shard(
+/*=========*/
+	const std::string& db_dot_table) /*!< in: db.table name */
+{
+	boost::hash<std::string> hasher;
+
+	return &tbr_shards[hasher(db_dot_table) & (TBR_MAP_SHARDS - 1)];
+}
+
+/***********************************************************************//**
+Internal function to find the entry of a server among the entries of a
+table.
+@return the entry or NULL */
+static tbr_entry_t*
+tbrmap_find_server(
+/*===============*/
+	tbr_entries_t& entries,     /*!< in: Entries of a table */
+	boost::uint32_t server_id)  /*!< in: Server id */
+{
+	for (size_t i = 0; i < entries.size(); i++) {
+		if (entries[i]->meta.server_id == server_id) {
+			return entries[i];
+		}
+	}
+
+	return NULL;
+}
+
+/***********************************************************************//**
+Internal function to copy the changing part of an entry without tearing.
+The GTID is copied to gtid_buf. */
+static void
+tbrmap_read_entry(
+/*==============*/
+	const tbr_entry_t *e,      /*!< in: Entry */
+	tbr_metadata_t *tc,        /*!< out: Values */
+	unsigned char *gtid_buf)   /*!< out: GTID */
+{
+	boost::uint32_t seq;
+
+	do {
+		while ((seq = e->seq) & 1) {
+			// An update is in progress
+		}
+		__sync_synchronize();
+
+		tc->binlog_pos = e->meta.binlog_pos;
+		tc->gtid_known = e->meta.gtid_known;
+		tc->gtid_len = e->meta.gtid_len;
+		memcpy(gtid_buf, e->meta.gtid, TBR_GTID_MAX_LEN);
+
+		__sync_synchronize();
+	} while (e->seq != seq);
+
+	tc->db_table = e->meta.db_table;
+	tc->server_id = e->meta.server_id;
+	tc->gtid = gtid_buf;
+}
+
+/***********************************************************************//**
+This function updates the consistency information of a table on a
+server, adding the entry if it is new. */
+void
+tbrmap_update(
+/*==========*/
+	const std::string& db_dot_table, /*!< in: db.table name */
+	boost::uint32_t server_id,       /*!< in: Server id */
+	boost::uint64_t binlog_pos,      /*!< in: Binlog position */
+	const unsigned char *gtid,       /*!< in: GTID */
+	boost::uint32_t gtid_len,        /*!< in: Length of GTID */
+	bool gtid_known,                 /*!< in: Is GTID known */
+	bool dirty)                      /*!< in: Needs to be written at
+					 the next checkpoint */
+{
+	tbr_shard_t *shard = tbrmap_shard(db_dot_table);
+	tbr_entry_t *e = NULL;
+
+	if (gtid_len > TBR_GTID_MAX_LEN) {
+		gtid_len = TBR_GTID_MAX_LEN;
+	}
+
+	{
+		boost::shared_lock<boost::shared_mutex> lock(shard->lock);
+		tbr_shard_map_t::iterator it = shard->tables.find(db_dot_table);
+
+		if (it != shard->tables.end()) {
+			e = tbrmap_find_server(it->second, server_id);
+		}
+
+		if (e) {
+			// Only this thread writes the entry, the seqlock
+			// makes the readers retry while it does
+			e->seq++;
+			__sync_synchronize();
+			e->meta.binlog_pos = binlog_pos;
+			e->meta.gtid_known = gtid_known;
+			e->meta.gtid_len = gtid_len;
+			memcpy(e->meta.gtid, gtid, gtid_len);
+			__sync_synchronize();
+			e->seq++;
+			e->dirty = dirty;
+			return;
+		}
+	}
+
+	// First change to the table on this server
+	e = (tbr_entry_t *)calloc(1, sizeof(tbr_entry_t));
+	e->meta.db_table = (unsigned char *)strdup(db_dot_table.c_str());
+	e->meta.gtid = (unsigned char *)calloc(1, TBR_GTID_MAX_LEN);
+	e->meta.server_id = server_id;
+	e->meta.binlog_pos = binlog_pos;
+	e->meta.gtid_known = gtid_known;
+	e->meta.gtid_len = gtid_len;
+	memcpy(e->meta.gtid, gtid, gtid_len);
+	e->dirty = dirty;
+
+	boost::unique_lock<boost::shared_mutex> lock(shard->lock);
+	tbr_entries_t& entries = shard->tables[db_dot_table];
+	tbr_entry_t *old = tbrmap_find_server(entries, server_id);
+
+	if (old) {
+		// Added by another path meanwhile, e.g. the startup load
+		free(old->meta.gtid);
+		old->meta.gtid = e->meta.gtid;
+		old->meta.binlog_pos = binlog_pos;
+		old->meta.gtid_known = gtid_known;
+		old->meta.gtid_len = gtid_len;
+		old->dirty = dirty;
+		free(e->meta.db_table);
+		free(e);
+	} else {
+		entries.push_back(e);
+	}
+}
+
+/***********************************************************************//**
+This function reads the consistency information of a table on the
+server_no'th server that has changed the table.
+@return true if found, false if not */
+bool
+tbrmap_read(
+/*========*/
+	const std::string& db_dot_table, /*!< in: db.table name */
+	boost::uint32_t server_no,       /*!< in: Server index */
+	tbr_metadata_t *tc,              /*!< out: Consistency values */
+	unsigned char *gtid_buf)         /*!< out: GTID */
+{
+	tbr_shard_t *shard = tbrmap_shard(db_dot_table);
+	boost::shared_lock<boost::shared_mutex> lock(shard->lock);
+	tbr_shard_map_t::iterator it = shard->tables.find(db_dot_table);
+
+	if (it == shard->tables.end() || server_no >= it->second.size()) {
+		return false;
+	}
+
+	tbrmap_read_entry(it->second[server_no], tc, gtid_buf);
+	return true;
+}
+
+/***********************************************************************//**
+This function takes a consistent copy of every entry or of the entries
+changed since the last checkpoint.
+@return number of entries copied */
+size_t
+tbrmap_snapshot(
+/*============*/
+	std::vector<tbr_metadata_t>& entries, /*!< out: Copies of entries */
+	bool dirty_only)                      /*!< in: Only changed
+					      entries */
+{
+	for (int i = 0; i < TBR_MAP_SHARDS; i++) {
+		tbr_shard_t *shard = &tbr_shards[i];
+		boost::shared_lock<boost::shared_mutex> lock(shard->lock);
+
+		for (tbr_shard_map_t::iterator it = shard->tables.begin();
+		     it != shard->tables.end(); ++it) {
+			for (size_t k = 0; k < it->second.size(); k++) {
+				tbr_entry_t *e = it->second[k];
+				tbr_metadata_t tc;
+				unsigned char *gtid;
+
+				if (dirty_only && !e->dirty) {
+					continue;
+				}
+
+				// Clear before reading, an update after
+				// this sets it again
+				e->dirty = false;
+				__sync_synchronize();
+
+				gtid = (unsigned char *)malloc(TBR_GTID_MAX_LEN);
+				tbrmap_read_entry(e, &tc, gtid);
+				tc.db_table = (unsigned char *)strdup((char *)tc.db_table);
+				entries.push_back(tc);
+			}
+		}
+	}
+
+	return entries.size();
+}
+
+/***********************************************************************//**
+Mark the entries of a snapshot changed again, e.g. after writing them
+failed, so that the next checkpoint writes them. */
+void
+tbrmap_mark_dirty(
+/*==============*/
+	const std::vector<tbr_metadata_t>& entries) /*!< in: Snapshot */
+{
+	for (size_t i = 0; i < entries.size(); i++) {
+		std::string name((char *)entries[i].db_table);
+		tbr_shard_t *shard = tbrmap_shard(name);
+		boost::shared_lock<boost::shared_mutex> lock(shard->lock);
+		tbr_shard_map_t::iterator it = shard->tables.find(name);
+
+		if (it != shard->tables.end()) {
+			tbr_entry_t *e = tbrmap_find_server(it->second,
+						entries[i].server_id);
+			if (e) {
+				e->dirty = true;
+			}
+		}
+	}
+}
+
+/***********************************************************************//**
+Free the names and GTIDs of a snapshot. */
+void
+tbrmap_free_snapshot(
+/*=================*/
+	std::vector<tbr_metadata_t>& entries) /*!< in: Snapshot */
+{
+	for (size_t i = 0; i < entries.size(); i++) {
+		free(entries[i].db_table);
+		free(entries[i].gtid);
+	}
+	entries.clear();
+}
+
+/***********************************************************************//**
+Remove and free all entries. */
+void
+tbrmap_clear()
+/*===========*/
+{
+	for (int i = 0; i < TBR_MAP_SHARDS; i++) {
+		tbr_shard_t *shard = &tbr_shards[i];
+		boost::unique_lock<boost::shared_mutex> lock(shard->lock);
+
+		for (tbr_shard_map_t::iterator it = shard->tables.begin();
+		     it != shard->tables.end(); ++it) {
+			for (size_t k = 0; k < it->second.size(); k++) {
+				free(it->second[k]->meta.db_table);
+				free(it->second[k]->meta.gtid);
+				free(it->second[k]);
+			}
+		}
+		shard->tables.clear();
+	}
+}
+
+} // table_replication_map
+
+} // mysql
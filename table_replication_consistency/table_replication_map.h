@@ -0,0 +1,127 @@
+/*
+Copyright (C) 2014, SkySQL Ab
+
+
+This file is distributed as part of the SkySQL Gateway. It is free
+software: you can redistribute it and/or modify it under the terms of the
+GNU General Public License as published by the Free Software Foundation,
+version 2.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 51
+Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+Author: Jan Lindström jan.lindstrom@skysql.com
+
+Created: 17-09-2014
+Updated:
+
+*/
+
+#ifndef TABLE_REPLICATION_MAP_H
+#define TABLE_REPLICATION_MAP_H
+
+#include <string>
+#include <vector>
+#include <boost/cstdint.hpp>
+#include "table_replication_metadata.h"
+
+namespace mysql {
+
+namespace table_replication_map {
+
+using table_replication_metadata::tbr_metadata_t;
+
+/* Number of shards, a power of two */
+#define TBR_MAP_SHARDS 64
+
+/* Room for the longest MariaDB GTID string and the MySQL encoded GTID */
+#define TBR_GTID_MAX_LEN 64
+
+/*
+The table consistency map holds one entry per db.table and server. The map
+is split in shards by the hash of the db.table name, each shard has its own
+reader/writer lock that is only held exclusively to add a table or a
+server to a table. The position and GTID of an existing entry are updated
+in place under a seqlock: the one listener thread of the server writes
+them without locking and readers retry if an update was in progress, so
+queries never block the listeners. Every update marks the entry dirty
+so that periodic checkpoints only need to write the changed entries.
+*/
+
+/***********************************************************************//**
+This function updates the consistency information of a table on a
+server, adding the entry if it is new. Only the listener thread of the
+server may update its entries. Entries read from the metadata tables are
+added with dirty false. */
+void
+tbrmap_update(
+/*==========*/
+	const std::string& db_dot_table, /*!< in: db.table name */
+	boost::uint32_t server_id,       /*!< in: Server id */
+	boost::uint64_t binlog_pos,      /*!< in: Binlog position */
+	const unsigned char *gtid,       /*!< in: GTID */
+	boost::uint32_t gtid_len,        /*!< in: Length of GTID */
+	bool gtid_known,                 /*!< in: Is GTID known */
+	bool dirty = true);              /*!< in: Needs to be written at
+					 the next checkpoint */
+
+/***********************************************************************//**
+This function reads the consistency information of a table on the
+server_no'th server that has changed the table. The db_table of the result
+points to the name held by the map, the GTID is copied to gtid_buf.
+@return true if found, false if not */
+bool
+tbrmap_read(
+/*========*/
+	const std::string& db_dot_table, /*!< in: db.table name */
+	boost::uint32_t server_no,       /*!< in: Server index */
+	tbr_metadata_t *tc,              /*!< out: Consistency values */
+	unsigned char *gtid_buf);        /*!< out: TBR_GTID_MAX_LEN bytes for
+					 the GTID */
+
+/***********************************************************************//**
+This function takes a consistent copy of every entry, e.g. for writing
+the entries to the metadata tables while the listeners keep updating
+them, and marks the copied entries clean. With dirty_only only entries
+changed since they were last copied are taken. Free the copies with
+tbrmap_free_snapshot.
+@return number of entries copied */
+size_t
+tbrmap_snapshot(
+/*============*/
+	std::vector<tbr_metadata_t>& entries, /*!< out: Copies of entries */
+	bool dirty_only = false);             /*!< in: Only changed
+					      entries */
+
+/***********************************************************************//**
+Mark the entries of a snapshot changed again, e.g. after writing them
+failed, so that the next checkpoint writes them. */
+void
+tbrmap_mark_dirty(
+/*==============*/
+	const std::vector<tbr_metadata_t>& entries); /*!< in: Snapshot */
+
+/***********************************************************************//**
+Free the names and GTIDs of a snapshot. */
+void
+tbrmap_free_snapshot(
+/*=================*/
+	std::vector<tbr_metadata_t>& entries); /*!< in: Snapshot */
+
+/***********************************************************************//**
+Remove and free all entries. No listener may be running. */
+void
+tbrmap_clear();
+/*===========*/
+
+} // table_replication_map
+
+} // mysql
+
+#endif
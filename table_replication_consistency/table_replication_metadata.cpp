@@ -62,30 +62,6 @@ tbrm_report_error(
 	}
 }
 
-/***********************************************************************//**
-Internal function to write statement error messages to the log file.
-*/
-static void
-tbrm_stmt_error(
-/*============*/
-	MYSQL_STMT *stmt,    /*!< in: MySQL statement */
-	const char *message, /*!< in: Error message */
-	const char *file,    /*!< in: File name */
-	int line)            /*!< in: Line number */
-{
-	skygw_log_write_flush( LOGFILE_ERROR,
-		(char *)"%s at file %s line %d", message, file, line);
-
-	if (stmt != NULL)
-	{
-		skygw_log_write_flush( LOGFILE_ERROR,
-			(char *)"Error %u (%s): %s\n",
-			mysql_stmt_errno (stmt),
-			mysql_stmt_sqlstate (stmt),
-			mysql_stmt_error (stmt));
-	}
-}
-
 /***********************************************************************//**
 Inspect master data dictionary and if necessary table replication
 consistency metadata is not created, create it.
@@ -121,7 +97,18 @@ tbrm_create_metadata(
 	myerrno = mysql_errno(con);
 
 	if (myerrno == 0) {
-		// Database found, assuming everyting ok
+		// Database found, servers table created before the binlog
+		// file was stored is upgraded
+		mysql_query(con, "ALTER TABLE TABLE_REPLICATION_SERVERS"
+			" ADD COLUMN BINLOG_FILE VARCHAR(255)");
+		myerrno = mysql_errno(con);
+
+		if (myerrno != 0 && myerrno != ER_DUP_FIELDNAME) {
+			tbrm_report_error(con, "Error: Upgrade of servers table failed", __FILE__, __LINE__);
+			return false;
+		}
+
+		mysql_close(con);
 		return true;
 	} else if (myerrno != ER_BAD_DB_ERROR) {
 		tbrm_report_error(con, "Error: mysql_query(USE_SKYSQL_GATEWAY_METADATA) failed", __FILE__, __LINE__);
@@ -173,6 +160,7 @@ tbrm_create_metadata(
 		"GTID VARBINARY(255),"
 		"GTID_KNOWN INT,"
 		"SERVER_TYPE INT,"
+		"BINLOG_FILE VARCHAR(255),"
 		"PRIMARY KEY(SERVER_ID)) ENGINE=InnoDB");
 
 	if (mysql_errno(con) != 0) {
@@ -340,8 +328,50 @@ tbrm_read_consistency_metadata(
 	return false;
 }
 
+/***********************************************************************//**
+Internal function to append one consistency row to a multi-row insert. */
+static void
+tbrm_append_consistency_row(
+/*========================*/
+	MYSQL *con,              /*!< in: MySQL connection */
+	std::string& stmt,       /*!< in/out: Statement */
+	const tbr_metadata_t *t) /*!< in: Consistency row */
+{
+	static const char hex[] = "0123456789ABCDEF";
+	size_t len = strlen((char *)t->db_table);
+	char *name = (char *)malloc(2 * len + 1);
+	char num[64];
+
+	mysql_real_escape_string(con, name, (char *)t->db_table, len);
+
+	stmt += "('";
+	stmt += name;
+	snprintf(num, sizeof(num), "', %u, ", t->server_id);
+	stmt += num;
+
+	// GTID is binary, write it as a hex literal
+	if (t->gtid_len) {
+		stmt += "0x";
+		for (boost::uint32_t k = 0; k < t->gtid_len; k++) {
+			stmt += hex[t->gtid[k] >> 4];
+			stmt += hex[t->gtid[k] & 0xF];
+		}
+	} else {
+		stmt += "''";
+	}
+
+	snprintf(num, sizeof(num), ", %llu, %d)",
+		(unsigned long long)t->binlog_pos, t->gtid_known ? 1 : 0);
+	stmt += num;
+
+	free(name);
+}
+
 /***********************************************************************//**
 Write table replication consistency metadata from the MySQL master server.
+The rows are written with multi-row INSERT ... ON DUPLICATE KEY UPDATE
+statements of at most TBRM_BATCH_ROWS rows inside one transaction, so
+either all of them or none are stored.
 This function assumes that necessary database and table are created.
 @return false if read failed, true if read succeeded */
 bool
@@ -355,34 +385,20 @@ tbrm_write_consistency_metadata(
 				    metadata. */
 	size_t tbrm_rows)           /*!< in: number of rows read */
 {
-        int myerrno=0;
-	boost::uint32_t i;
-	MYSQL_STMT *sstmt=NULL;
-	MYSQL_STMT *istmt=NULL;
-	MYSQL_STMT *ustmt=NULL;
-	MYSQL_BIND sparam[2];
-	MYSQL_BIND iparam[5];
-	MYSQL_BIND uparam[5];
-	MYSQL_BIND result[1];
-	char *dbtable=NULL;
-	void *gtid=NULL;
-	int gtidknown;
-	int serverid;
-	boost::uint64_t binlogpos;
-
-	// Query to find out if the row already exists on table
-	const char *sst = "SELECT BINLOG_POS FROM TABLE_REPLICATION_CONSISTENCY WHERE"
-		" DB_TABLE_NAME=? and SERVER_ID=?";
-
-	// Insert Query
+	int myerrno=0;
+	size_t i = 0;
+	size_t batch = 0;
+	std::string stmt;
+
 	const char *ist = "INSERT INTO TABLE_REPLICATION_CONSISTENCY(DB_TABLE_NAME,"
-		" SERVER_ID, GTID, BINLOG_POS, GTID_KNOWN) VALUES"
-		"(?, ?, ?, ?, ?)";
+		" SERVER_ID, GTID, BINLOG_POS, GTID_KNOWN) VALUES ";
+
+	const char *dup = " ON DUPLICATE KEY UPDATE GTID=VALUES(GTID),"
+		" BINLOG_POS=VALUES(BINLOG_POS), GTID_KNOWN=VALUES(GTID_KNOWN)";
 
-	// Update Query
-	const char *ust = "UPDATE TABLE_REPLICATION_CONSISTENCY "
-		"SET GTID=?, BINLOG_POS=?, GTID_KNOWN=?"
-		" WHERE DB_TABLE_NAME=? AND SERVER_ID=?";
+	if (tbrm_rows == 0) {
+		return true;
+	}
 
 	MYSQL *con = mysql_init(NULL);
 
@@ -397,7 +413,7 @@ tbrm_write_consistency_metadata(
 
 	if (!mysql_real_connect(con, master_host, user, passwd, NULL, master_port, NULL, 0)) {
 		tbrm_report_error(con, "Error: mysql_real_connect failed", __FILE__, __LINE__);
-		goto error_exit;
+		return false;
 	}
 
 	mysql_query(con, "USE SKYSQL_GATEWAY_METADATA");
@@ -405,197 +421,55 @@ tbrm_write_consistency_metadata(
 
 	if (myerrno != 0) {
 		tbrm_report_error(con, "Error: Database set failed", __FILE__, __LINE__);
+		return false;
 	}
 
-	// Allocate statement handlers
-	sstmt = mysql_stmt_init(con);
-	istmt = mysql_stmt_init(con);
-	ustmt = mysql_stmt_init(con);
+	mysql_query(con, "START TRANSACTION");
 
-	if (sstmt == NULL || istmt == NULL || ustmt == NULL) {
-		tbrm_report_error(con, "Could not initialize statement handler", __FILE__, __LINE__);
-		goto error_exit;
-	}
-
-	// Prepare the statements
-	if (mysql_stmt_prepare(sstmt, sst, strlen(sst)) != 0) {
-		tbrm_stmt_error(sstmt, "Error: Could not prepare select statement", __FILE__, __LINE__);
-		goto error_exit;
-	}
-	if (mysql_stmt_prepare(istmt, ist, strlen(ist)) != 0) {
-		tbrm_stmt_error(istmt, "Error: Could not prepare insert statement", __FILE__, __LINE__);
-		goto error_exit;
-	}
-	if (mysql_stmt_prepare(ustmt, ust, strlen(ust)) != 0) {
-		tbrm_stmt_error(ustmt, "Error: Could not prepare update statement", __FILE__, __LINE__);
-		goto error_exit;
+	if (mysql_errno(con) != 0) {
+		tbrm_report_error(con, "Error: Start transaction failed", __FILE__, __LINE__);
+		return false;
 	}
 
-	// Initialize the parameters
-	memset (sparam, 0, sizeof (sparam));
-	memset (iparam, 0, sizeof (iparam));
-	memset (uparam, 0, sizeof (uparam));
-	memset (result, 0, sizeof (result));
-
-	// Init param structure
-	// Select
-	sparam[0].buffer_type     = MYSQL_TYPE_VARCHAR;
-	sparam[1].buffer_type     = MYSQL_TYPE_LONG;
-	sparam[1].buffer         = (void *) &serverid;
-	// Insert
-	iparam[0].buffer_type     = MYSQL_TYPE_VARCHAR;
-	iparam[1].buffer_type     = MYSQL_TYPE_LONG;
-	iparam[1].buffer         = (void *) &serverid;
-	iparam[2].buffer_type     = MYSQL_TYPE_BLOB;
-	iparam[3].buffer_type     = MYSQL_TYPE_LONGLONG;
-	iparam[3].buffer         = (void *) &binlogpos;
-	iparam[4].buffer_type     = MYSQL_TYPE_SHORT;
-	iparam[4].buffer         = (void *) &gtidknown;
-	// Update
-	uparam[0].buffer_type     = MYSQL_TYPE_BLOB;
-	uparam[1].buffer_type     = MYSQL_TYPE_LONGLONG;
-	uparam[1].buffer         = (void *) &binlogpos;
-	uparam[2].buffer_type     = MYSQL_TYPE_SHORT;
-	uparam[2].buffer         = (void *) &gtidknown;
-	uparam[3].buffer_type     = MYSQL_TYPE_VARCHAR;
-	uparam[4].buffer_type     = MYSQL_TYPE_LONG;
-	uparam[4].buffer         = (void *) &serverid;
-	// Result set for select
-	result[0].buffer_type     = MYSQL_TYPE_LONGLONG;
-	result[0].buffer          = &binlogpos;
-
+	// On error tbrm_report_error closes the connection, which rolls
+	// back the transaction
 
 	// Iterate through the data
-	for(i = 0; i < tbrm_rows; i++) {
-		// Start from Select, we need to know if the consistency
-		// information for this table, server pair is already
-		// in metadata or not.
-
-		dbtable = (char *)tbrm_meta[i]->db_table;
-		gtid    = (char *)tbrm_meta[i]->gtid;
-		gtidknown = tbrm_meta[i]->gtid_known;
-		serverid  = tbrm_meta[i]->server_id;
-		uparam[3].buffer         = (void *) dbtable;
-
-		sparam[0].buffer         = (void *) dbtable;
-		uparam[0].buffer         = (void *) gtid;
-		iparam[0].buffer         = (void *) dbtable;
-		iparam[2].buffer         = (void *) gtid;
-		sparam[0].buffer_length = strlen(dbtable);
-		uparam[3].buffer_length = sparam[0].buffer_length;
-		iparam[0].buffer_length = sparam[0].buffer_length;
-		uparam[0].buffer_length = tbrm_meta[i]->gtid_len;
-		iparam[2].buffer_length = tbrm_meta[i]->gtid_len;
-
-		// Bind param structure to statement
-		if (mysql_stmt_bind_param(sstmt, sparam) != 0) {
-			tbrm_stmt_error(sstmt, "Error: Could not bind select parameters", __FILE__, __LINE__);
-			goto error_exit;
-		}
-
-		// Bind result structure to statement
-		if (mysql_stmt_bind_result(sstmt, result) != 0) {
-			tbrm_stmt_error(sstmt, "Error: Could not bind select return parameters", __FILE__, __LINE__);
-			goto error_exit;
-		}
-
-		// Execute!!
-		if (mysql_stmt_execute(sstmt) != 0) {
-			tbrm_stmt_error(sstmt, "Error: Could not execute select statement", __FILE__, __LINE__);
-			goto error_exit;
-		}
-
-		// Store result
-		if (mysql_stmt_store_result(sstmt) != 0) {
-			tbrm_stmt_error(sstmt, "Error: Could not buffer result set", __FILE__, __LINE__);
-			goto error_exit;
-		}
-
-		// Fetch result
-		myerrno = mysql_stmt_fetch(sstmt);
-		if (myerrno != 0 && myerrno != MYSQL_NO_DATA) {
-			tbrm_stmt_error(sstmt, "Error: Could not fetch result set", __FILE__, __LINE__);
-			goto error_exit;
-		}
-
-		// If fetch returned 0 rows, it means that this table, serverid
-		// pair was found from metadata, we might need to update
-		// the consistency information.
-		if (myerrno == 0) {
-			// We update the consistency if and only if the
-			// binlog position for this table has changed
-			if (binlogpos != tbrm_meta[i]->binlog_pos) {
-				// Update the consistency information
-				binlogpos = tbrm_meta[i]->binlog_pos;
-
-				// Bind param structure to statement
-				if (mysql_stmt_bind_param(ustmt, uparam) != 0) {
-					tbrm_stmt_error(ustmt, "Error: Could not bind update parameters", __FILE__, __LINE__);
-					goto error_exit;
-				}
-				// Execute!!
-				if (mysql_stmt_execute(ustmt) != 0) {
-					tbrm_stmt_error(ustmt, "Error: Could not execute update statement", __FILE__, __LINE__);
-					goto error_exit;
-				}
-				if (tbr_debug) {
-					skygw_log_write_flush( LOGFILE_TRACE,
-						(char *)"TRC Debug: Metadata state updated for %s in server %d is binlog_pos %lu gtid '%s'",
-						dbtable, serverid, binlogpos, gtid);
-				}
-			}
-
-		} else {
-			// Insert the consistency information
-			binlogpos = tbrm_meta[i]->binlog_pos;
-			// Bind param structure to statement
-			if (mysql_stmt_bind_param(istmt, iparam) != 0) {
-				tbrm_stmt_error(istmt, "Error: Could not bind insert parameters", __FILE__, __LINE__);
-				goto error_exit;
-			}
+	while (i < tbrm_rows) {
+		stmt = ist;
 
-			// Execute!!
-			if (mysql_stmt_execute(istmt) != 0) {
-				tbrm_stmt_error(istmt, "Error: Could not execute insert statement", __FILE__, __LINE__);
-				goto error_exit;
-			}
-
-			if (tbr_debug) {
-				skygw_log_write_flush( LOGFILE_TRACE,
-					(char *)"TRC Debug: Metadata state inserted for %s in server %d is binlog_pos %lu gtid '%s'",
-					dbtable, serverid, binlogpos, gtid);
+		for (batch = 0; batch < TBRM_BATCH_ROWS && i < tbrm_rows
+			     && stmt.size() < TBRM_BATCH_BYTES; batch++, i++) {
+			if (batch) {
+				stmt += ", ";
 			}
+			tbrm_append_consistency_row(con, stmt, tbrm_meta[i]);
 		}
-	}
 
-	return true;
+		stmt += dup;
 
- error_exit:
-	// Cleanup
-	if (sstmt) {
-		if (mysql_stmt_close(sstmt)) {
-			tbrm_stmt_error(sstmt, "Error: Could not close select statement", __FILE__, __LINE__);
+		if (mysql_real_query(con, stmt.c_str(), stmt.size()) != 0) {
+			tbrm_report_error(con, "Error: Could not execute insert statement", __FILE__, __LINE__);
+			return false;
 		}
-	}
 
-	if (istmt) {
-		if (mysql_stmt_close(istmt)) {
-			tbrm_stmt_error(istmt, "Error: Could not close select statement", __FILE__, __LINE__);
+		if (tbr_debug) {
+			skygw_log_write_flush( LOGFILE_TRACE,
+				(char *)"TRC Debug: Metadata state written for %lu tables",
+				(unsigned long)batch);
 		}
 	}
 
-	if (ustmt) {
-		if (mysql_stmt_close(ustmt)) {
-			tbrm_stmt_error(ustmt, "Error: Could not close select statement", __FILE__, __LINE__);
-		}
-	}
+	mysql_query(con, "COMMIT");
 
-	if (con) {
-		mysql_close(con);
+	if (mysql_errno(con) != 0) {
+		tbrm_report_error(con, "Error: Commit failed", __FILE__, __LINE__);
+		return false;
 	}
 
-	return false;
+	mysql_close(con);
 
+	return true;
 }
 
 /***********************************************************************//**
@@ -647,7 +521,8 @@ tbrm_read_server_metadata(
 		goto error_exit;
 	}
 
-	mysql_query(con, "SELECT * FROM TABLE_REPLICATION_SERVERS");
+	mysql_query(con, "SELECT SERVER_ID, BINLOG_POS, GTID, GTID_KNOWN,"
+		" SERVER_TYPE, BINLOG_FILE FROM TABLE_REPLICATION_SERVERS");
 	myerrno = mysql_errno(con);
 
 	if (myerrno != 0) {
@@ -664,7 +539,7 @@ tbrm_read_server_metadata(
 
 	nrows = mysql_num_rows(result);
 
-	ts = (tbr_server_t*) malloc(nrows * sizeof(tbr_server_t));
+	ts = (tbr_server_t*) calloc(nrows + 1, sizeof(tbr_server_t));
 
 	if(!ts) {
 		skygw_log_write_flush( LOGFILE_ERROR,
@@ -683,7 +558,7 @@ tbrm_read_server_metadata(
 		// BINLOG_POS
 		ts[i].binlog_pos = atoll(row[1]);
 		// GTID
-		ts[i].gtid = (unsigned char *)malloc((lengths[2])*sizeof(unsigned char));
+		ts[i].gtid = (unsigned char *)malloc((lengths[2] + 1)*sizeof(unsigned char));
 
 		if (!ts[i].gtid) {
 			skygw_log_write_flush( LOGFILE_ERROR,
@@ -692,11 +567,14 @@ tbrm_read_server_metadata(
 		}
 
 		memcpy(ts[i].gtid, row[2], lengths[2]);
+		ts[i].gtid[lengths[2]] = '\0';
 		ts[i].gtid_len = lengths[2];
 		// GTID_KNOWN
 		ts[i].gtid_known = atol(row[3]);
 		// SERVER_TYPE
-		ts[i].server_type = atol(row[4]);
+		ts[i].server_type = row[4] ? atol(row[4]) : 0;
+		// BINLOG_FILE
+		ts[i].binlog_file = row[5] ? strdup(row[5]) : NULL;
 	}
 
 	mysql_free_result(result);
@@ -706,8 +584,9 @@ tbrm_read_server_metadata(
 
  error_exit:
 	if (ts) {
-		for(size_t k=0;i < i; k++) {
+		for(size_t k=0; k <= i && k < nrows; k++) {
 			free(ts[k].gtid);
+			free(ts[k].binlog_file);
 		}
 		free(ts);
 		*tbrm_rows = 0;
@@ -725,8 +604,55 @@ tbrm_read_server_metadata(
 	return false;
 }
 
+/***********************************************************************//**
+Internal function to append one server row to a multi-row insert. */
+static void
+tbrm_append_server_row(
+/*===================*/
+	MYSQL *con,              /*!< in: MySQL connection */
+	std::string& stmt,       /*!< in/out: Statement */
+	const tbr_server_t *t)   /*!< in: Server row */
+{
+	static const char hex[] = "0123456789ABCDEF";
+	char num[64];
+
+	snprintf(num, sizeof(num), "(%u, ", t->server_id);
+	stmt += num;
+
+	// GTID is binary, write it as a hex literal
+	if (t->gtid && t->gtid_len) {
+		stmt += "0x";
+		for (boost::uint32_t k = 0; k < t->gtid_len; k++) {
+			stmt += hex[t->gtid[k] >> 4];
+			stmt += hex[t->gtid[k] & 0xF];
+		}
+	} else {
+		stmt += "''";
+	}
+
+	snprintf(num, sizeof(num), ", %llu, %d, %u, ",
+		(unsigned long long)t->binlog_pos, t->gtid_known ? 1 : 0,
+		t->server_type);
+	stmt += num;
+
+	if (t->binlog_file) {
+		size_t len = strlen(t->binlog_file);
+		char *file = (char *)malloc(2 * len + 1);
+
+		mysql_real_escape_string(con, file, t->binlog_file, len);
+		stmt += "'";
+		stmt += file;
+		stmt += "')";
+		free(file);
+	} else {
+		stmt += "NULL)";
+	}
+}
+
 /***********************************************************************//**
 Write table replication server metadata from the MySQL master server.
+The rows are written with multi-row INSERT ... ON DUPLICATE KEY UPDATE
+statements inside one transaction like the consistency metadata.
 This function assumes that necessary database and table are created.
 @return false if read failed, true if read succeeded */
 bool
@@ -740,35 +666,21 @@ tbrm_write_server_metadata(
 				    metadata. */
 	size_t tbrm_rows)           /*!< in: number of rows read */
 {
-        int myerrno=0;
-	boost::uint32_t i;
-	MYSQL_STMT *sstmt=NULL;
-	MYSQL_STMT *istmt=NULL;
-	MYSQL_STMT *ustmt=NULL;
-	MYSQL_BIND sparam[1];
-	MYSQL_BIND iparam[5];
-	MYSQL_BIND uparam[4];
-	MYSQL_BIND result[1];
-	char *dbtable;
-	void *gtid;
-	int gtidknown;
-	unsigned int serverid;
-	int servertype;
-	boost::uint64_t binlogpos;
-
-	// Query to find out if the row already exists on table
-	const char *sst = "SELECT BINLOG_POS FROM TABLE_REPLICATION_CONSISTENCY WHERE"
-		" SERVER_ID=?";
-
-	// Insert Query
-	const char *ist = "INSERT INTO TABLE_REPLICATION_SERVERS("
-		" SERVER_ID, GTID, BINLOG_POS, GTID_KNOWN, SERVER_TYPE) VALUES"
-		"(?, ?, ?, ?, ?)";
-
-	// Update Query
-	const char *ust = "UPDATE TABLE_REPLICATION_SERVERS "
-		"SET GTID=?, BINLOG_POS=?, GTID_KNOWN=?"
-		" WHERE SERVER_ID=?";
+	int myerrno=0;
+	size_t i = 0;
+	size_t batch = 0;
+	std::string stmt;
+
+	const char *ist = "INSERT INTO TABLE_REPLICATION_SERVERS(SERVER_ID,"
+		" GTID, BINLOG_POS, GTID_KNOWN, SERVER_TYPE, BINLOG_FILE) VALUES ";
+
+	const char *dup = " ON DUPLICATE KEY UPDATE GTID=VALUES(GTID),"
+		" BINLOG_POS=VALUES(BINLOG_POS), GTID_KNOWN=VALUES(GTID_KNOWN),"
+		" SERVER_TYPE=VALUES(SERVER_TYPE), BINLOG_FILE=VALUES(BINLOG_FILE)";
+
+	if (tbrm_rows == 0) {
+		return true;
+	}
 
 	MYSQL *con = mysql_init(NULL);
 
@@ -783,7 +695,7 @@ tbrm_write_server_metadata(
 
 	if (!mysql_real_connect(con, master_host, user, passwd, NULL, master_port, NULL, 0)) {
 		tbrm_report_error(con, "Error: mysql_real_connect failed", __FILE__, __LINE__);
-		goto error_exit;
+		return false;
 	}
 
 	mysql_query(con, "USE SKYSQL_GATEWAY_METADATA");
@@ -791,194 +703,57 @@ tbrm_write_server_metadata(
 
 	if (myerrno != 0) {
 		tbrm_report_error(con, "Error: Database set failed", __FILE__, __LINE__);
+		return false;
 	}
 
-	// Allocate statement handlers
-	sstmt = mysql_stmt_init(con);
-	istmt = mysql_stmt_init(con);
-	ustmt = mysql_stmt_init(con);
-
-	if (sstmt == NULL || istmt == NULL || ustmt == NULL) {
-		tbrm_report_error(con, "Could not initialize statement handler", __FILE__, __LINE__);
-		goto error_exit;
-	}
+	mysql_query(con, "START TRANSACTION");
 
-	// Prepare the statements
-	if (mysql_stmt_prepare(sstmt, sst, strlen(sst)) != 0) {
-		tbrm_stmt_error(sstmt, "Error: Could not prepare select statement", __FILE__, __LINE__);
-		goto error_exit;
-	}
-	if (mysql_stmt_prepare(istmt, ist, strlen(ist)) != 0) {
-		tbrm_stmt_error(istmt, "Error: Could not prepare insert statement", __FILE__, __LINE__);
-		goto error_exit;
-	}
-	if (mysql_stmt_prepare(ustmt, ust, strlen(ust)) != 0) {
-		tbrm_stmt_error(ustmt, "Error: Could not prepare update statement", __FILE__, __LINE__);
-		goto error_exit;
+	if (mysql_errno(con) != 0) {
+		tbrm_report_error(con, "Error: Start transaction failed", __FILE__, __LINE__);
+		return false;
 	}
 
-	// Initialize the parameters
-	memset (sparam, 0, sizeof (sparam));
-	memset (iparam, 0, sizeof (iparam));
-	memset (uparam, 0, sizeof (uparam));
-	memset (result, 0, sizeof (result));
-
-	// Init param structure
-	// Select
-	sparam[0].buffer_type     = MYSQL_TYPE_LONG;
-	sparam[0].buffer         = (void *) &serverid;
-	// Insert
-	iparam[0].buffer_type     = MYSQL_TYPE_LONG;
-	iparam[0].buffer         = (void *) &serverid;
-	iparam[1].buffer_type     = MYSQL_TYPE_BLOB;
-	iparam[2].buffer_type     = MYSQL_TYPE_LONGLONG;
-	iparam[2].buffer         = (void *) &binlogpos;
-	iparam[3].buffer_type     = MYSQL_TYPE_SHORT;
-	iparam[3].buffer         = (void *) &gtidknown;
-	iparam[4].buffer_type     = MYSQL_TYPE_LONG;
-	iparam[4].buffer         = (void *) &servertype;
-	// Update
-	uparam[0].buffer_type     = MYSQL_TYPE_BLOB;
-	uparam[1].buffer_type     = MYSQL_TYPE_LONGLONG;
-	uparam[1].buffer         = (void *) &binlogpos;
-	uparam[2].buffer_type     = MYSQL_TYPE_SHORT;
-	uparam[2].buffer         = (void *) &gtidknown;
-	uparam[3].buffer_type     = MYSQL_TYPE_LONG;
-	uparam[3].buffer         = (void *) &serverid;
-	// Result set for select
-	result[0].buffer_type     = MYSQL_TYPE_LONGLONG;
-	result[0].buffer          = &binlogpos;
-
+	// On error tbrm_report_error closes the connection, which rolls
+	// back the transaction
 
 	// Iterate through the data
-	for(i = 0; i < tbrm_rows; i++) {
-		// Start from Select, we need to know if the consistency
-		// information for this table, server pair is already
-		// in metadata or not.
-
-		gtid    = (char *)tbrm_servers[i]->gtid;
-		gtidknown = tbrm_servers[i]->gtid_known;
-		serverid  = tbrm_servers[i]->server_id;
-		servertype = tbrm_servers[i]->server_type;
-
-		iparam[1].buffer         = (void *) gtid;
-		uparam[0].buffer         = (void *) gtid;
-		uparam[0].buffer_length = tbrm_servers[i]->gtid_len;
-		iparam[1].buffer_length = tbrm_servers[i]->gtid_len;
-
-		// Bind param structure to statement
-		if (mysql_stmt_bind_param(sstmt, sparam) != 0) {
-			tbrm_stmt_error(sstmt, "Error: Could not bind select parameters", __FILE__, __LINE__);
-			goto error_exit;
-		}
-
-		// Bind result structure to statement
-		if (mysql_stmt_bind_result(sstmt, result) != 0) {
-			tbrm_stmt_error(sstmt, "Error: Could not bind select return parameters", __FILE__, __LINE__);
-			goto error_exit;
-		}
-
-		// Execute!!
-		if (mysql_stmt_execute(sstmt) != 0) {
-			tbrm_stmt_error(sstmt, "Error: Could not execute select statement", __FILE__, __LINE__);
-			goto error_exit;
-		}
-
-		// Store result
-		if (mysql_stmt_store_result(sstmt) != 0) {
-			tbrm_stmt_error(sstmt, "Error: Could not buffer result set", __FILE__, __LINE__);
-			goto error_exit;
-		}
-
-		// Fetch result
-		myerrno = mysql_stmt_fetch(sstmt);
-		if (myerrno != 0 && myerrno !=  MYSQL_NO_DATA) {
-			tbrm_stmt_error(sstmt, "Error: Could not fetch result set", __FILE__, __LINE__);
-			goto error_exit;
-		}
-
-		// If fetch returned 0 rows, it means that this table, serverid
-		// pair was found from metadata, we might need to update
-		// the consistency information.
-		if (myerrno == 0) {
-			// We update the consistency if and only if the
-			// binlog position for this table has changed
-			if (binlogpos != tbrm_servers[i]->binlog_pos) {
-				// Update the consistency information
-				binlogpos = tbrm_servers[i]->binlog_pos;
-
-				// Bind param structure to statement
-				if (mysql_stmt_bind_param(ustmt, uparam) != 0) {
-					tbrm_stmt_error(ustmt, "Error: Could not bind update parameters", __FILE__, __LINE__);
-					goto error_exit;
-				}
-				// Execute!!
-				if (mysql_stmt_execute(ustmt) != 0) {
-					tbrm_stmt_error(ustmt, "Error: Could not execute update statement", __FILE__, __LINE__);
-					goto error_exit;
-				}
-				if (tbr_debug) {
-					skygw_log_write_flush( LOGFILE_TRACE,
-						(char *)"TRC Debug: Metadata state updated for %s in server %d is binlog_pos %lu gtid '%s'",
-						dbtable, serverid, binlogpos, gtid);
-				}
-			}
-
-		} else {
-			// Insert the consistency information
-			binlogpos = tbrm_servers[i]->binlog_pos;
-			// Bind param structure to statement
-			if (mysql_stmt_bind_param(istmt, iparam) != 0) {
-				tbrm_stmt_error(istmt, "Error: Could not bind insert parameters", __FILE__, __LINE__);
-				goto error_exit;
-			}
-
-			// Execute!!
-			if (mysql_stmt_execute(istmt) != 0) {
-				tbrm_stmt_error(istmt, "Error: Could not execute insert statement", __FILE__, __LINE__);
-				goto error_exit;
-			}
+	while (i < tbrm_rows) {
+		stmt = ist;
 
-			if (tbr_debug) {
-				skygw_log_write_flush( LOGFILE_TRACE,
-					(char *)"TRC Debug: Metadata state inserted for %s in server %d is binlog_pos %lu gtid '%s'",
-					dbtable, serverid, binlogpos, gtid);
+		for (batch = 0; batch < TBRM_BATCH_ROWS && i < tbrm_rows
+			     && stmt.size() < TBRM_BATCH_BYTES; batch++, i++) {
+			if (batch) {
+				stmt += ", ";
 			}
+			tbrm_append_server_row(con, stmt, tbrm_servers[i]);
 		}
-	}
 
-	return true;
+		stmt += dup;
 
- error_exit:
-	// Cleanup
-	if (sstmt) {
-		if (mysql_stmt_close(sstmt)) {
-			tbrm_stmt_error(sstmt, "Error: Could not close select statement", __FILE__, __LINE__);
+		if (mysql_real_query(con, stmt.c_str(), stmt.size()) != 0) {
+			tbrm_report_error(con, "Error: Could not execute insert statement", __FILE__, __LINE__);
+			return false;
 		}
-	}
 
-	if (istmt) {
-		if (mysql_stmt_close(istmt)) {
-			tbrm_stmt_error(istmt, "Error: Could not close select statement", __FILE__, __LINE__);
+		if (tbr_debug) {
+			skygw_log_write_flush( LOGFILE_TRACE,
+				(char *)"TRC Debug: Metadata state written for %lu servers",
+				(unsigned long)batch);
 		}
 	}
 
-	if (ustmt) {
-		if (mysql_stmt_close(ustmt)) {
-			tbrm_stmt_error(ustmt, "Error: Could not close select statement", __FILE__, __LINE__);
-		}
-	}
+	mysql_query(con, "COMMIT");
 
-	if (con) {
-		mysql_close(con);
+	if (mysql_errno(con) != 0) {
+		tbrm_report_error(con, "Error: Commit failed", __FILE__, __LINE__);
+		return false;
 	}
 
-	return false;
+	mysql_close(con);
 
+	return true;
 }
 
-
-
 } // table_replication_metadata
 
 } // mysql
@@ -49,12 +49,19 @@ typedef struct {
 	boost::uint32_t gtid_len;        /* Actual length of gtid */
 	bool gtid_known;                 /* 1 if gtid known, 0 if not */
 	boost::uint32_t server_type;     /* server type */
+	char *binlog_file;               /* Binlog file of binlog_pos or
+					 NULL if not known */
  } tbr_server_t;
 
 // Not really nice, but currently we support only these two
 // server types.
 enum trc_server_type { TRC_SERVER_TYPE_MARIADB = 1, TRC_SERVER_TYPE_MYSQL = 2 };
 
+/* Maximum number of rows and approximate maximum size of one multi-row
+metadata write, kept well below the default max_allowed_packet */
+#define TBRM_BATCH_ROWS  500
+#define TBRM_BATCH_BYTES (512 * 1024)
+
 
 /***********************************************************************//**
 Read table replication consistency metadata from the MySQL master server.
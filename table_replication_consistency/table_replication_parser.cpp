@@ -19,7 +19,8 @@ Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 Author: Jan Lindström jan.lindstrom@skysql.com
 
 Created: 20-06-2013
-Updated:
+Updated: 14-10-2014 The white space is skipped with the vector scan of
+         skygw_sqlscan.h
 
 */
 
@@ -31,6 +32,7 @@ Updated:
 #include "table_replication_parser.h"
 #include "table_replication_consistency.h"
 #include "log_manager.h"
+#include "skygw_sqlscan.h"
 
 namespace mysql {
 
@@ -39,6 +41,7 @@ namespace table_replication_parser {
 typedef struct {
         char* m_start;
         char* m_pos;
+        char* m_end;
 } tb_parser_t;
 
 /***********************************************************************//**
@@ -52,6 +55,7 @@ tbr_parser_init(
 {
         m->m_start = (char *)s;
         m->m_pos = (char *)s;
+        m->m_end = (char *)s + strlen(s);
 }
 
 /***********************************************************************//**
@@ -59,12 +63,10 @@ This internal function skips all space characters on front
 @return position on string with next non space character*/
 static char* 
 tbr_parser_skipwspc(
-	char* str)  /*!< in string */
+	char* str,  /*!< in string */
+	char* end)  /*!< in end of string */
 {
-        while (isspace(*str)) {
-            str++;
-        }
-        return(str);
+        return(sqlscan_skip_space(str, end));
 }
 
 
@@ -80,7 +82,7 @@ tbr_match_keyword(
 {
         size_t len;
 
-	m->m_pos = tbr_parser_skipwspc(m->m_pos);
+	m->m_pos = tbr_parser_skipwspc(m->m_pos, m->m_end);
 
         if (const_str[0] == '\0') {
             return(m->m_pos[0] == '\0');
@@ -120,7 +122,7 @@ tbr_get_quoted(
         char quote;
         tb_parser_t saved_m;
 
-	m->m_pos = tbr_parser_skipwspc(m->m_pos);
+	m->m_pos = tbr_parser_skipwspc(m->m_pos, m->m_end);
 
         saved_m = *m;
 
@@ -192,7 +194,7 @@ tbr_get_id(
         char* org_id_buf = id_buf;
         tb_parser_t saved_m;
 
-	m->m_pos = tbr_parser_skipwspc(m->m_pos);
+	m->m_pos = tbr_parser_skipwspc(m->m_pos, m->m_end);
         saved_m = *m;
 
         if (*m->m_pos == '"' || *m->m_pos == '`') {
@@ -232,7 +234,7 @@ tbr_match_const(
 {
         size_t len;
 
-	m->m_pos = tbr_parser_skipwspc(m->m_pos);
+	m->m_pos = tbr_parser_skipwspc(m->m_pos, m->m_end);
 
         if (const_str[0] == '\0') {
 		return(m->m_pos[0] == '\0');
@@ -262,7 +264,7 @@ tbr_skipto_keyword(
         size_t len;
         bool more = true;
 
-	m->m_pos = tbr_parser_skipwspc(m->m_pos);
+	m->m_pos = tbr_parser_skipwspc(m->m_pos, m->m_end);
 
         if (const_str[0] == '\0') {
 		return(m->m_pos[0] == '\0');
@@ -0,0 +1,479 @@
+/*
+ * This file is distributed as part of MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file proxybench.c - Throughput and latency of the queries of a service
+ *
+ * Every connection is a thread that sends one query at a time and waits
+ * for the whole reply, the queries are a mix of reads and writes. The
+ * latencies are counted in the latency histograms of the core, one copy
+ * for each connection, and the result is printed as a line of JSON, e.g.
+ *
+ * {"bench":"rwsplit","connections":16,"seconds":10,"queries":412345,
+ *	"errors":0,"qps":41234,"avg_us":387,"p50_us":384,"p90_us":512,
+ *	"p99_us":768,"p999_us":1536}
+ *
+ * The percentiles are the upper bounds of the buckets they fall in.
+ *
+ *	proxybench [-h host] [-P port] [-u user] [-p password] [-D database]
+ *		[-c connections] [-t seconds] [-w seconds] [-r read percent]
+ *		[-R read query] [-W write query] [-n name]
+ *
+ * The client speaks the protocol itself, it does not need the client
+ * library and adds as little as it can to the time of a query.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/sha.h>
+
+#include <mysql_client_server_protocol.h>
+#include <atomic.h>
+#include <thread.h>
+#include <statistics.h>
+
+#define	BENCH_MAX_CONNECTIONS	1024
+#define	BENCH_BUFSIZE		65536
+#define	BENCH_CHARSET		0x21	/*< utf8_general_ci */
+#define	BENCH_MORE_RESULTS	0x0008	/*< SERVER_MORE_RESULTS_EXISTS */
+
+#define	BENCH_CAPABILITIES	(GW_MYSQL_CAPABILITIES_LONG_PASSWORD | \
+				GW_MYSQL_CAPABILITIES_LONG_FLAG | \
+				GW_MYSQL_CAPABILITIES_PROTOCOL_41 | \
+				GW_MYSQL_CAPABILITIES_TRANSACTIONS | \
+				GW_MYSQL_CAPABILITIES_SECURE_CONNECTION | \
+				GW_MYSQL_CAPABILITIES_MULTI_RESULTS | \
+				GW_MYSQL_CAPABILITIES_PLUGIN_AUTH)
+
+/**
+ * A connection to the service, the data read that is not yet looked at is
+ * kept in the buffer.
+ */
+typedef struct {
+	int		id;
+	int		fd;
+	unsigned char	buf[BENCH_BUFSIZE];
+	int		pos;
+	int		len;
+	unsigned int	seed;
+	long		queries;
+	long		errors;
+	int		failed;		/*< The connection was lost */
+} BENCH_CONN;
+
+static char		*host = "127.0.0.1";
+static int		port = 4006;
+static char		*user = "bench";
+static char		*passwd = "";
+static char		*database = NULL;
+static int		n_connections = 8;
+static int		seconds = 10;
+static int		warmup = 1;
+static int		read_percent = 80;
+static char		*read_query = "SELECT 1";
+static char		*write_query = "UPDATE bench SET c = c + 1 WHERE id = 1";
+static char		*name = "proxy";
+static struct addrinfo	*address;
+static TS_HIST		*latency;
+static volatile int	measuring = 0;
+static volatile int	stopping = 0;
+static int		n_started = 0;
+
+static unsigned long
+bench_clock()
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Read the next packet of the connection
+ *
+ * @param conn	The connection
+ * @param len	Set to the length of the payload
+ * @return	The payload or NULL if the connection was lost
+ */
+static unsigned char *
+read_packet(BENCH_CONN *conn, int *len)
+{
+	unsigned char	*pkt;
+	int		n;
+
+	while (conn->len - conn->pos < MYSQL_HEADER_LEN ||
+		conn->len - conn->pos < MYSQL_HEADER_LEN +
+			(int)MYSQL_GET_PACKET_LEN(conn->buf + conn->pos))
+	{
+		if (conn->pos > 0)
+		{
+			memmove(conn->buf, conn->buf + conn->pos,
+				conn->len - conn->pos);
+			conn->len -= conn->pos;
+			conn->pos = 0;
+		}
+		if (conn->len == BENCH_BUFSIZE)
+			return NULL;	/*< No packets this large are expected */
+		n = read(conn->fd, conn->buf + conn->len, BENCH_BUFSIZE - conn->len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return NULL;
+		conn->len += n;
+	}
+	pkt = conn->buf + conn->pos;
+	*len = MYSQL_GET_PACKET_LEN(pkt);
+	conn->pos += MYSQL_HEADER_LEN + *len;
+	return pkt + MYSQL_HEADER_LEN;
+}
+
+static int
+write_all(int fd, unsigned char *data, int len)
+{
+	int	w;
+
+	while (len > 0)
+	{
+		if ((w = write(fd, data, len)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += w;
+		len -= w;
+	}
+	return 0;
+}
+
+/**
+ * The token of mysql_native_password,
+ * SHA1(password) XOR SHA1(scramble, SHA1(SHA1(password)))
+ */
+static void
+scramble_password(unsigned char *token, unsigned char *scramble, char *pw)
+{
+	unsigned char	hash1[SHA_DIGEST_LENGTH];
+	unsigned char	hash2[SHA_DIGEST_LENGTH];
+	unsigned char	data[GW_MYSQL_SCRAMBLE_SIZE + SHA_DIGEST_LENGTH];
+	int		i;
+
+	SHA1((unsigned char *)pw, strlen(pw), hash1);
+	SHA1(hash1, SHA_DIGEST_LENGTH, hash2);
+	memcpy(data, scramble, GW_MYSQL_SCRAMBLE_SIZE);
+	memcpy(data + GW_MYSQL_SCRAMBLE_SIZE, hash2, SHA_DIGEST_LENGTH);
+	SHA1(data, sizeof(data), hash2);
+	for (i = 0; i < SHA_DIGEST_LENGTH; i++)
+		token[i] = hash1[i] ^ hash2[i];
+}
+
+/**
+ * Connect and authenticate
+ *
+ * @return	0 on success
+ */
+static int
+bench_connect(BENCH_CONN *conn)
+{
+	unsigned char	pkt[512];
+	unsigned char	scramble[GW_MYSQL_SCRAMBLE_SIZE];
+	unsigned char	*hs, *p;
+	unsigned long	caps = BENCH_CAPABILITIES;
+	int		len, one = 1;
+
+	if ((conn->fd = socket(address->ai_family, SOCK_STREAM, 0)) < 0)
+		return -1;
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(conn->fd, address->ai_addr, address->ai_addrlen) < 0)
+	{
+		fprintf(stderr, "proxybench: connect to %s:%d failed: %s\n",
+			host, port, strerror(errno));
+		return -1;
+	}
+
+	/*< The handshake: version, string, thread id, scramble, ... */
+	if ((hs = read_packet(conn, &len)) == NULL || hs[0] == 0xff)
+		return -1;
+	p = hs + 1 + strlen((char *)hs + 1) + 1 + 4;
+	memcpy(scramble, p, 8);
+	p += 8 + 1 + 2 + 1 + 2 + 2 + 1 + 10;
+	memcpy(scramble + 8, p, GW_MYSQL_SCRAMBLE_SIZE - 8);
+
+	if (database)
+		caps |= GW_MYSQL_CAPABILITIES_CONNECT_WITH_DB;
+	memset(pkt, 0, sizeof(pkt));
+	p = pkt + MYSQL_HEADER_LEN;
+	gw_mysql_set_byte4(p, caps);
+	gw_mysql_set_byte4(p + 4, 16 * 1024 * 1024);
+	p[8] = BENCH_CHARSET;
+	p += 32;
+	strcpy((char *)p, user);
+	p += strlen(user) + 1;
+	if (*passwd)
+	{
+		*p++ = SHA_DIGEST_LENGTH;
+		scramble_password(p, scramble, passwd);
+		p += SHA_DIGEST_LENGTH;
+	}
+	else
+	{
+		*p++ = 0;
+	}
+	if (database)
+	{
+		strcpy((char *)p, database);
+		p += strlen(database) + 1;
+	}
+	strcpy((char *)p, "mysql_native_password");
+	p += strlen("mysql_native_password") + 1;
+	gw_mysql_set_byte3(pkt, p - pkt - MYSQL_HEADER_LEN);
+	pkt[3] = 1;
+	if (write_all(conn->fd, pkt, p - pkt) < 0)
+		return -1;
+
+	if ((p = read_packet(conn, &len)) == NULL)
+		return -1;
+	if (p[0] != 0x00)
+	{
+		fprintf(stderr, "proxybench: authentication failed: %.*s\n",
+			p[0] == 0xff && len > 9 ? len - 9 : 0, (char *)p + 9);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Read the rest of a result set or an OK, ERR or EOF packet. The status of
+ * the OK and EOF packets tells if more results follow.
+ *
+ * @return	1 if more results follow, 0 at the end of the reply, -1 if the
+ *		reply is an error and -2 if the connection is lost
+ */
+static int
+read_result(BENCH_CONN *conn)
+{
+	unsigned char	*p;
+	int		len, status = 0, eofs = 0;
+
+	if ((p = read_packet(conn, &len)) == NULL)
+		return -2;
+	if (p[0] == 0xff)
+		return -1;
+	if (p[0] == 0x00)
+	{
+		/*< Skip the length encoded affected rows and insert id */
+		unsigned char	*q = p + 1;
+		int		i;
+
+		for (i = 0; i < 2; i++)
+			q += *q < 0xfb ? 1 : *q == 0xfc ? 3 : *q == 0xfd ? 4 : 9;
+		status = gw_mysql_get_byte2(q);
+		return (status & BENCH_MORE_RESULTS) ? 1 : 0;
+	}
+	if (p[0] == 0xfb)
+		return -1;	/*< LOCAL INFILE is not supported */
+
+	/*< The column definitions, an EOF, the rows and an EOF */
+	while (eofs < 2)
+	{
+		if ((p = read_packet(conn, &len)) == NULL)
+			return -2;
+		if (p[0] == 0xff)
+			return -1;
+		if (p[0] == 0xfe && len < 9)
+		{
+			eofs++;
+			status = gw_mysql_get_byte2(p + 3);
+		}
+	}
+	return (status & BENCH_MORE_RESULTS) ? 1 : 0;
+}
+
+/**
+ * Send a query and read the whole reply
+ *
+ * @return	0 on success, -1 if the reply was an error and -2 if the
+ *		connection was lost
+ */
+static int
+bench_query(BENCH_CONN *conn, char *sql)
+{
+	unsigned char	pkt[MYSQL_HEADER_LEN + 1 + 1024];
+	int		len = strlen(sql);
+	int		rc;
+
+	if (len > 1024)
+		len = 1024;
+	gw_mysql_set_byte3(pkt, len + 1);
+	pkt[3] = 0;
+	pkt[4] = MYSQL_COM_QUERY;
+	memcpy(pkt + 5, sql, len);
+	if (write_all(conn->fd, pkt, MYSQL_HEADER_LEN + 1 + len) < 0)
+		return -2;
+	while ((rc = read_result(conn)) == 1)
+		;
+	return rc;
+}
+
+static void
+bench_thread(void *data)
+{
+	BENCH_CONN	*conn = (BENCH_CONN *)data;
+	unsigned long	start;
+	char		*sql;
+	int		rc;
+
+	ts_stats_thread_init(conn->id);
+	if (bench_connect(conn) != 0)
+	{
+		conn->failed = 1;
+		atomic_add(&n_started, 1);
+		return;
+	}
+	atomic_add(&n_started, 1);
+	while (!stopping)
+	{
+		sql = (int)(rand_r(&conn->seed) % 100) < read_percent ?
+			read_query : write_query;
+		start = bench_clock();
+		rc = bench_query(conn, sql);
+		if (rc == -2)
+		{
+			conn->failed = 1;
+			break;
+		}
+		if (measuring)
+		{
+			if (rc == 0)
+			{
+				ts_hist_add(latency, bench_clock() - start);
+				conn->queries++;
+			}
+			else
+			{
+				conn->errors++;
+			}
+		}
+	}
+	close(conn->fd);
+}
+
+static void
+usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s [-h host] [-P port] [-u user] [-p password] "
+		"[-D database]\n"
+		"\t[-c connections] [-t seconds] [-w seconds] [-r read percent]\n"
+		"\t[-R read query] [-W write query] [-n name]\n", prog);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct addrinfo	hints;
+	BENCH_CONN	*conns;
+	void		**handles;
+	long		counts[TS_HIST_BUCKETS];
+	long		sum, queries = 0, errors = 0;
+	char		portstr[16];
+	int		opt, i, failed = 0;
+
+	while ((opt = getopt(argc, argv, "h:P:u:p:D:c:t:w:r:R:W:n:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'h': host = optarg; break;
+		case 'P': port = atoi(optarg); break;
+		case 'u': user = optarg; break;
+		case 'p': passwd = optarg; break;
+		case 'D': database = optarg; break;
+		case 'c': n_connections = atoi(optarg); break;
+		case 't': seconds = atoi(optarg); break;
+		case 'w': warmup = atoi(optarg); break;
+		case 'r': read_percent = atoi(optarg); break;
+		case 'R': read_query = optarg; break;
+		case 'W': write_query = optarg; break;
+		case 'n': name = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (n_connections < 1 || n_connections > BENCH_MAX_CONNECTIONS ||
+		seconds < 1 || warmup < 0)
+		usage(argv[0]);
+	signal(SIGPIPE, SIG_IGN);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	sprintf(portstr, "%d", port);
+	if (getaddrinfo(host, portstr, &hints, &address) != 0)
+	{
+		fprintf(stderr, "proxybench: unknown host %s\n", host);
+		exit(1);
+	}
+
+	/*< Each connection counts its latencies in a copy of its own */
+	ts_stats_init(n_connections);
+	latency = ts_hist_alloc();
+	conns = calloc(n_connections, sizeof(BENCH_CONN));
+	handles = calloc(n_connections, sizeof(void *));
+	if (latency == NULL || conns == NULL || handles == NULL)
+		exit(1);
+	for (i = 0; i < n_connections; i++)
+	{
+		conns[i].id = i;
+		conns[i].seed = i + 1;
+		handles[i] = thread_start(bench_thread, &conns[i]);
+	}
+	while (n_started < n_connections)
+		usleep(10000);
+
+	sleep(warmup);
+	measuring = 1;
+	sleep(seconds);
+	measuring = 0;
+	stopping = 1;
+	for (i = 0; i < n_connections; i++)
+	{
+		thread_wait(handles[i]);
+		queries += conns[i].queries;
+		errors += conns[i].errors;
+		failed += conns[i].failed;
+	}
+
+	ts_hist_get(latency, -1, counts, &sum);
+	printf("{\"bench\":\"%s\",\"connections\":%d,\"seconds\":%d,"
+		"\"queries\":%ld,\"errors\":%ld,\"failed\":%d,\"qps\":%.0f,"
+		"\"avg_us\":%ld,\"p50_us\":%lu,\"p90_us\":%lu,\"p99_us\":%lu,"
+		"\"p999_us\":%lu}\n",
+		name, n_connections, seconds, queries, errors, failed,
+		(double)queries / seconds, queries ? sum / queries : 0,
+		ts_hist_percentile(counts, 0.5), ts_hist_percentile(counts, 0.9),
+		ts_hist_percentile(counts, 0.99), ts_hist_percentile(counts, 0.999));
+	exit(failed == n_connections ? 1 : 0);
+}
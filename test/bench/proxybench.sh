@@ -0,0 +1,156 @@
+#!/bin/sh
+#
+# This file is distributed as part of MaxScale.  It is free
+# software: you can redistribute it and/or modify it under the terms of the
+# GNU General Public License as published by the Free Software Foundation,
+# version 2.
+#
+# This program is distributed in the hope that it will be useful, but WITHOUT
+# ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+# details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program; if not, write to the Free Software Foundation, Inc., 51
+# Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+#
+# Copyright SkySQL Ab 2014
+#
+# End-to-end benchmark of the proxy. Two stub servers stand for the master
+# and the slave, an installed MaxScale runs a readconnroute and a
+# readwritesplit service in front of them and proxybench measures the
+# throughput and latency of the stubs directly, the baseline, and through
+# each service. The results are printed as lines of JSON.
+#
+# The stubs do not answer the queries of the monitor, the status of the
+# servers is set through maxadmin instead. The stubs list the user bench
+# without a password, the clients of the services log in as it.
+#
+# Environment:
+#	MAXSCALE_HOME	the installed MaxScale, default /usr/local/skysql/MaxScale
+#	CONNECTIONS	the concurrencies to measure, default "1 8 32"
+#	DURATION	the seconds each run measures, default 10
+#	READS		the percentage of reads, default 80
+#	THREADS		the polling threads of MaxScale, default 4
+#	BASE_PORT	the ports are offsets of this one, default 14000
+
+MAXSCALE_HOME=${MAXSCALE_HOME:-/usr/local/skysql/MaxScale}
+CONNECTIONS=${CONNECTIONS:-"1 8 32"}
+DURATION=${DURATION:-10}
+READS=${READS:-80}
+THREADS=${THREADS:-4}
+BASE_PORT=${BASE_PORT:-14000}
+
+MASTER_PORT=`expr $BASE_PORT + 406`
+SLAVE_PORT=`expr $BASE_PORT + 407`
+RCONN_PORT=`expr $BASE_PORT + 8`
+RWSPLIT_PORT=`expr $BASE_PORT + 6`
+CLI_PORT=`expr $BASE_PORT + 603`
+
+BENCHDIR=`dirname $0`
+WORKDIR=`mktemp -d /tmp/proxybench.XXXXXX`
+PIDS=""
+
+cleanup()
+{
+	for pid in $PIDS
+	do
+		kill $pid 2> /dev/null
+	done
+	wait 2> /dev/null
+	rm -rf $WORKDIR
+}
+trap cleanup EXIT
+trap "exit 1" INT TERM
+
+$BENCHDIR/stubserver -p $MASTER_PORT -t $THREADS &
+PIDS="$PIDS $!"
+$BENCHDIR/stubserver -p $SLAVE_PORT -t $THREADS &
+PIDS="$PIDS $!"
+
+cat > $WORKDIR/MaxScale.cnf <<CNF
+[maxscale]
+threads=$THREADS
+
+[stub_master]
+type=server
+address=127.0.0.1
+port=$MASTER_PORT
+protocol=MySQLBackend
+
+[stub_slave]
+type=server
+address=127.0.0.1
+port=$SLAVE_PORT
+protocol=MySQLBackend
+
+[Read Connection Router]
+type=service
+router=readconnroute
+router_options=slave
+servers=stub_master,stub_slave
+user=bench
+passwd=bench
+
+[RW Split Router]
+type=service
+router=readwritesplit
+servers=stub_master,stub_slave
+user=bench
+passwd=bench
+
+[CLI]
+type=service
+router=cli
+
+[Read Connection Listener]
+type=listener
+service=Read Connection Router
+protocol=MySQLClient
+port=$RCONN_PORT
+
+[RW Split Listener]
+type=listener
+service=RW Split Router
+protocol=MySQLClient
+port=$RWSPLIT_PORT
+
+[CLI Listener]
+type=listener
+service=CLI
+protocol=maxscaled
+port=$CLI_PORT
+CNF
+
+$MAXSCALE_HOME/bin/maxscale -d -c $MAXSCALE_HOME -f $WORKDIR/MaxScale.cnf \
+	> $WORKDIR/maxscale.out 2>&1 &
+PIDS="$PIDS $!"
+
+MAXADMIN="$MAXSCALE_HOME/bin/maxadmin -P $CLI_PORT -pskysql"
+tries=0
+until $MAXADMIN show services > /dev/null 2>&1
+do
+	tries=`expr $tries + 1`
+	if [ $tries -gt 30 ]
+	then
+		echo "MaxScale did not start, see $WORKDIR/maxscale.out" >&2
+		cat $WORKDIR/maxscale.out >&2
+		exit 1
+	fi
+	sleep 1
+done
+
+$MAXADMIN set server stub_master running
+$MAXADMIN set server stub_master master
+$MAXADMIN set server stub_slave running
+$MAXADMIN set server stub_slave slave
+
+for c in $CONNECTIONS
+do
+	$BENCHDIR/proxybench -n direct -P $MASTER_PORT -c $c -t $DURATION \
+		-r $READS -u bench
+	$BENCHDIR/proxybench -n readconnroute -P $RCONN_PORT -c $c \
+		-t $DURATION -r $READS -u bench
+	$BENCHDIR/proxybench -n readwritesplit -P $RWSPLIT_PORT -c $c \
+		-t $DURATION -r $READS -u bench
+done
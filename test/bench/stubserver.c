@@ -0,0 +1,601 @@
+/*
+ * This file is distributed as part of MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+/**
+ * @file stubserver.c - A MySQL server that answers at once
+ *
+ * The stub speaks enough of the MySQL protocol for MaxScale and the
+ * benchmark client: it sends the handshake, accepts any user and password,
+ * answers the queries that load the users of a service and answers every
+ * other SELECT with a result set of one column, and everything else with
+ * an OK packet. No data is kept, so the time of a query through MaxScale
+ * is the cost of the proxy and of the network.
+ *
+ *	stubserver [-p port] [-t threads] [-r rows] [-u user]
+ *
+ * The connections are shared by the threads, each thread polls its own
+ * epoll instance.
+ */
+/** for accept4 */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <mysql_client_server_protocol.h>
+
+#define	STUB_MAX_THREADS	64
+#define	STUB_BUFSIZE		16384
+#define	STUB_VERSION		"5.5.5-10.0.0-stub"
+#define	STUB_CHARSET		0x21	/*< utf8_general_ci */
+#define	STUB_STATUS_AUTOCOMMIT	0x0002
+#define	STUB_TYPE_VAR_STRING	0xfd
+
+#define	STUB_CAPABILITIES	(GW_MYSQL_CAPABILITIES_LONG_PASSWORD | \
+				GW_MYSQL_CAPABILITIES_FOUND_ROWS | \
+				GW_MYSQL_CAPABILITIES_LONG_FLAG | \
+				GW_MYSQL_CAPABILITIES_CONNECT_WITH_DB | \
+				GW_MYSQL_CAPABILITIES_PROTOCOL_41 | \
+				GW_MYSQL_CAPABILITIES_TRANSACTIONS | \
+				GW_MYSQL_CAPABILITIES_SECURE_CONNECTION | \
+				GW_MYSQL_CAPABILITIES_MULTI_STATEMENTS | \
+				GW_MYSQL_CAPABILITIES_MULTI_RESULTS | \
+				GW_MYSQL_CAPABILITIES_PLUGIN_AUTH)
+
+/**
+ * A client connection, the data of a packet that is not complete is kept
+ * in the input buffer and the replies that the socket did not take in the
+ * output buffer.
+ */
+typedef struct {
+	int		fd;
+	int		authenticated;
+	unsigned char	*in;		/*< Data read */
+	int		inlen;
+	int		insize;
+	unsigned char	*out;		/*< Replies not yet written */
+	int		outpos;
+	int		outlen;
+	int		outsize;
+	int		pkt;		/*< Offset of the packet being made */
+} STUB_CONN;
+
+static int	n_threads = 4;
+static int	n_rows = 1;
+static char	*stub_user = "bench";
+static int	epoll_fds[STUB_MAX_THREADS];
+static int	next_conn = 0;
+
+/**
+ * Make room for len more bytes in the output buffer
+ */
+static void
+out_reserve(STUB_CONN *conn, int len)
+{
+	if (conn->outlen + len > conn->outsize)
+	{
+		while (conn->outlen + len > conn->outsize)
+			conn->outsize *= 2;
+		conn->out = realloc(conn->out, conn->outsize);
+	}
+}
+
+static void
+out_bytes(STUB_CONN *conn, void *data, int len)
+{
+	out_reserve(conn, len);
+	memcpy(conn->out + conn->outlen, data, len);
+	conn->outlen += len;
+}
+
+static void
+out_byte(STUB_CONN *conn, int byte)
+{
+	unsigned char	b = byte;
+
+	out_bytes(conn, &b, 1);
+}
+
+/**
+ * Append a length encoded string, all the strings here are shorter than
+ * 251 bytes so the length is a single byte
+ */
+static void
+out_lenenc(STUB_CONN *conn, char *str)
+{
+	int	len = strlen(str);
+
+	out_byte(conn, len);
+	out_bytes(conn, str, len);
+}
+
+/**
+ * Start a packet, the header is filled in by pkt_end
+ */
+static void
+pkt_begin(STUB_CONN *conn, int seq)
+{
+	out_reserve(conn, MYSQL_HEADER_LEN);
+	conn->pkt = conn->outlen;
+	conn->out[conn->outlen + 3] = seq;
+	conn->outlen += MYSQL_HEADER_LEN;
+}
+
+static void
+pkt_end(STUB_CONN *conn)
+{
+	gw_mysql_set_byte3(conn->out + conn->pkt,
+			conn->outlen - conn->pkt - MYSQL_HEADER_LEN);
+}
+
+static void
+send_handshake(STUB_CONN *conn, int id)
+{
+	unsigned char	b[4];
+	char		*scramble = "abcdefghijklmnopqrst";
+
+	pkt_begin(conn, 0);
+	out_byte(conn, GW_MYSQL_PROTOCOL_VERSION);
+	out_bytes(conn, STUB_VERSION, strlen(STUB_VERSION) + 1);
+	gw_mysql_set_byte4(b, id);
+	out_bytes(conn, b, 4);
+	out_bytes(conn, scramble, 8);
+	out_byte(conn, 0);
+	gw_mysql_set_byte2(b, STUB_CAPABILITIES & 0xffff);
+	out_bytes(conn, b, 2);
+	out_byte(conn, STUB_CHARSET);
+	gw_mysql_set_byte2(b, STUB_STATUS_AUTOCOMMIT);
+	out_bytes(conn, b, 2);
+	gw_mysql_set_byte2(b, (STUB_CAPABILITIES >> 16) & 0xffff);
+	out_bytes(conn, b, 2);
+	out_byte(conn, GW_MYSQL_SCRAMBLE_SIZE + 1);
+	memset(b, 0, sizeof(b));
+	out_bytes(conn, b, 4);
+	out_bytes(conn, b, 4);
+	out_bytes(conn, b, 2);
+	out_bytes(conn, scramble + 8, GW_MYSQL_SCRAMBLE_SIZE - 8);
+	out_byte(conn, 0);
+	out_bytes(conn, "mysql_native_password", 22);
+	pkt_end(conn);
+}
+
+static void
+send_ok(STUB_CONN *conn, int seq)
+{
+	unsigned char	b[2];
+
+	pkt_begin(conn, seq);
+	out_byte(conn, 0x00);
+	out_byte(conn, 0);		/*< Affected rows */
+	out_byte(conn, 0);		/*< Insert id */
+	gw_mysql_set_byte2(b, STUB_STATUS_AUTOCOMMIT);
+	out_bytes(conn, b, 2);
+	out_bytes(conn, "\0\0", 2);	/*< Warnings */
+	pkt_end(conn);
+}
+
+static void
+send_eof(STUB_CONN *conn, int seq)
+{
+	unsigned char	b[2];
+
+	pkt_begin(conn, seq);
+	out_byte(conn, 0xfe);
+	out_bytes(conn, "\0\0", 2);
+	gw_mysql_set_byte2(b, STUB_STATUS_AUTOCOMMIT);
+	out_bytes(conn, b, 2);
+	pkt_end(conn);
+}
+
+static void
+send_error(STUB_CONN *conn, int seq, char *msg)
+{
+	unsigned char	b[2];
+
+	pkt_begin(conn, seq);
+	out_byte(conn, 0xff);
+	gw_mysql_set_byte2(b, 1047);	/*< ER_UNKNOWN_COM_ERROR */
+	out_bytes(conn, b, 2);
+	out_bytes(conn, "#08S01", 6);
+	out_bytes(conn, msg, strlen(msg));
+	pkt_end(conn);
+}
+
+/**
+ * Send a result set of string columns
+ *
+ * @param conn		The connection
+ * @param seq		Sequence number of the first packet
+ * @param ncols		The columns
+ * @param names		Names of the columns
+ * @param nrows		The rows, each row has the values in values
+ * @param values	The values of a row
+ */
+static void
+send_resultset(STUB_CONN *conn, int seq, int ncols, char **names,
+	int nrows, char **values)
+{
+	unsigned char	b[4];
+	int		i, j;
+
+	pkt_begin(conn, seq++);
+	out_byte(conn, ncols);
+	pkt_end(conn);
+	for (i = 0; i < ncols; i++)
+	{
+		pkt_begin(conn, seq++);
+		out_lenenc(conn, "def");
+		out_lenenc(conn, "");
+		out_lenenc(conn, "");
+		out_lenenc(conn, "");
+		out_lenenc(conn, names[i]);
+		out_lenenc(conn, names[i]);
+		out_byte(conn, 0x0c);
+		gw_mysql_set_byte2(b, STUB_CHARSET);
+		out_bytes(conn, b, 2);
+		gw_mysql_set_byte4(b, 255);
+		out_bytes(conn, b, 4);
+		out_byte(conn, STUB_TYPE_VAR_STRING);
+		out_bytes(conn, "\0\0", 2);	/*< Flags */
+		out_byte(conn, 0);		/*< Decimals */
+		out_bytes(conn, "\0\0", 2);
+		pkt_end(conn);
+	}
+	send_eof(conn, seq++);
+	for (i = 0; i < nrows; i++)
+	{
+		pkt_begin(conn, seq++);
+		for (j = 0; j < ncols; j++)
+			out_lenenc(conn, values[j]);
+		pkt_end(conn);
+	}
+	send_eof(conn, seq);
+}
+
+/**
+ * Answer a query. The two queries a service loads its users with are
+ * answered with the stub user, which may connect from any host without a
+ * password.
+ */
+static void
+do_query(STUB_CONN *conn, int seq, char *sql, int len)
+{
+	static char	*cksum_names[] = { "nusers", "cksum" };
+	static char	*users_names[] = { "user", "host", "password", "userdata" };
+	static char	*one_names[] = { "1" };
+	char		*cksum_values[2];
+	char		*users_values[4];
+	char		*one_values[1];
+	char		userdata[128];
+
+	if (len >= 25 && strncasecmp(sql, "SELECT COUNT(1) AS nusers", 25) == 0)
+	{
+		cksum_values[0] = "1";
+		cksum_values[1] = "0123456789abcdef0123456789abcdef01234567";
+		send_resultset(conn, seq, 2, cksum_names, 1, cksum_values);
+	}
+	else if (len >= 17 && strncasecmp(sql, "SELECT user, host", 17) == 0)
+	{
+		snprintf(userdata, sizeof(userdata), "%s%%", stub_user);
+		users_values[0] = stub_user;
+		users_values[1] = "%";
+		users_values[2] = "";
+		users_values[3] = userdata;
+		send_resultset(conn, seq, 4, users_names, 1, users_values);
+	}
+	else if (len >= 6 && strncasecmp(sql, "SELECT", 6) == 0)
+	{
+		one_values[0] = "1";
+		send_resultset(conn, seq, 1, one_names, n_rows, one_values);
+	}
+	else
+	{
+		send_ok(conn, seq);
+	}
+}
+
+/**
+ * Answer a packet from the client
+ *
+ * @return	0 if the connection is to be closed
+ */
+static int
+do_packet(STUB_CONN *conn, unsigned char *pkt, int len)
+{
+	int	seq = pkt[3] + 1;
+	int	cmd = len > 0 ? pkt[MYSQL_HEADER_LEN] : -1;
+
+	if (!conn->authenticated)
+	{
+		/*< Any user and password will do */
+		conn->authenticated = 1;
+		send_ok(conn, seq);
+		return 1;
+	}
+	switch (cmd)
+	{
+	case MYSQL_COM_QUIT:
+		return 0;
+	case MYSQL_COM_QUERY:
+		do_query(conn, seq, (char *)pkt + MYSQL_HEADER_LEN + 1, len - 1);
+		break;
+	case MYSQL_COM_FIELD_LIST:
+		send_eof(conn, seq);
+		break;
+	case MYSQL_COM_STMT_PREPARE:
+	case MYSQL_COM_STMT_EXECUTE:
+	case MYSQL_COM_STMT_FETCH:
+	case MYSQL_COM_STMT_RESET:
+		send_error(conn, seq, "Prepared statements are not supported by the stub");
+		break;
+	case MYSQL_COM_STMT_CLOSE:
+	case MYSQL_COM_STMT_SEND_LONG_DATA:
+		break;
+	default:
+		send_ok(conn, seq);
+		break;
+	}
+	return 1;
+}
+
+static void
+conn_close(int efd, STUB_CONN *conn)
+{
+	epoll_ctl(efd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	free(conn->in);
+	free(conn->out);
+	free(conn);
+}
+
+/**
+ * Write what the socket takes, wait for EPOLLOUT if it did not take all
+ *
+ * @return	-1 on error
+ */
+static int
+conn_flush(int efd, STUB_CONN *conn)
+{
+	struct epoll_event	ev;
+	int			w;
+
+	while (conn->outpos < conn->outlen)
+	{
+		w = write(conn->fd, conn->out + conn->outpos,
+			conn->outlen - conn->outpos);
+		if (w < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				return -1;
+			ev.events = EPOLLOUT;
+			ev.data.ptr = conn;
+			epoll_ctl(efd, EPOLL_CTL_MOD, conn->fd, &ev);
+			return 0;
+		}
+		conn->outpos += w;
+	}
+	conn->outpos = conn->outlen = 0;
+	ev.events = EPOLLIN;
+	ev.data.ptr = conn;
+	epoll_ctl(efd, EPOLL_CTL_MOD, conn->fd, &ev);
+	return 0;
+}
+
+/**
+ * Read from a connection and answer the complete packets
+ *
+ * @return	-1 if the connection is to be closed
+ */
+static int
+conn_read(int efd, STUB_CONN *conn)
+{
+	int	n, pos, len;
+
+	if (conn->insize - conn->inlen < STUB_BUFSIZE)
+	{
+		conn->insize *= 2;
+		conn->in = realloc(conn->in, conn->insize);
+	}
+	n = read(conn->fd, conn->in + conn->inlen, conn->insize - conn->inlen);
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+		return -1;
+	if (n < 0)
+		return 0;
+	conn->inlen += n;
+
+	pos = 0;
+	while (conn->inlen - pos >= MYSQL_HEADER_LEN)
+	{
+		len = MYSQL_GET_PACKET_LEN(conn->in + pos);
+		if (conn->inlen - pos < MYSQL_HEADER_LEN + len)
+			break;
+		if (!do_packet(conn, conn->in + pos, len))
+			return -1;
+		pos += MYSQL_HEADER_LEN + len;
+	}
+	if (pos > 0)
+	{
+		memmove(conn->in, conn->in + pos, conn->inlen - pos);
+		conn->inlen -= pos;
+	}
+	return conn_flush(efd, conn);
+}
+
+static void *
+stub_thread(void *arg)
+{
+	struct epoll_event	events[64];
+	int			efd = epoll_fds[(long)arg];
+	int			i, n;
+
+	while (1)
+	{
+		n = epoll_wait(efd, events, 64, -1);
+		for (i = 0; i < n; i++)
+		{
+			STUB_CONN	*conn = (STUB_CONN *)events[i].data.ptr;
+			int		rc;
+
+			if (events[i].events & (EPOLLERR | EPOLLHUP))
+				rc = -1;
+			else if (events[i].events & EPOLLOUT)
+				rc = conn_flush(efd, conn);
+			else
+				rc = conn_read(efd, conn);
+			if (rc < 0)
+				conn_close(efd, conn);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Give a new connection its handshake and hand it to a polling thread. The
+ * handshake is written before the thread can see the connection, the socket
+ * buffer of a new connection always takes it.
+ */
+static void
+stub_accept(int fd)
+{
+	struct epoll_event	ev;
+	STUB_CONN		*conn;
+	int			one = 1, w;
+	int			efd = epoll_fds[next_conn % n_threads];
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if ((conn = calloc(1, sizeof(STUB_CONN))) == NULL)
+	{
+		close(fd);
+		return;
+	}
+	conn->fd = fd;
+	conn->insize = conn->outsize = 2 * STUB_BUFSIZE;
+	conn->in = malloc(conn->insize);
+	conn->out = malloc(conn->outsize);
+	send_handshake(conn, ++next_conn);
+	while (conn->outpos < conn->outlen)
+	{
+		w = write(fd, conn->out + conn->outpos, conn->outlen - conn->outpos);
+		if (w < 0 && errno != EINTR)
+		{
+			close(fd);
+			free(conn->in);
+			free(conn->out);
+			free(conn);
+			return;
+		}
+		if (w > 0)
+			conn->outpos += w;
+	}
+	conn->outpos = conn->outlen = 0;
+	ev.events = EPOLLIN;
+	ev.data.ptr = conn;
+	epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void
+usage(char *prog)
+{
+	fprintf(stderr, "Usage: %s [-p port] [-t threads] [-r rows] [-u user]\n"
+		"\t-p\tPort to listen on, default 4406\n"
+		"\t-t\tPolling threads, default 4\n"
+		"\t-r\tRows of the result set of a SELECT, default 1\n"
+		"\t-u\tThe user MaxScale loads for its services, default bench\n",
+		prog);
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct sockaddr_in	addr;
+	pthread_t		thr;
+	int			port = 4406;
+	int			lfd, fd, opt, one = 1;
+	long			i;
+
+	while ((opt = getopt(argc, argv, "p:t:r:u:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 't':
+			n_threads = atoi(optarg);
+			break;
+		case 'r':
+			n_rows = atoi(optarg);
+			break;
+		case 'u':
+			stub_user = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (n_threads < 1 || n_threads > STUB_MAX_THREADS || n_rows < 0)
+		usage(argv[0]);
+	signal(SIGPIPE, SIG_IGN);
+
+	if ((lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	{
+		perror("socket");
+		exit(1);
+	}
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		listen(lfd, SOMAXCONN) < 0)
+	{
+		perror("bind");
+		exit(1);
+	}
+
+	for (i = 0; i < n_threads; i++)
+	{
+		epoll_fds[i] = epoll_create(64);
+		pthread_create(&thr, NULL, stub_thread, (void *)i);
+	}
+	while (1)
+	{
+		if ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK)) < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			exit(1);
+		}
+		stub_accept(fd);
+	}
+	return 0;
+}
@@ -0,0 +1,456 @@
+/*
+ * This file is distributed as part of MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+#if !defined(SKYGW_SQLSCAN_H)
+#define SKYGW_SQLSCAN_H
+
+/**
+ * @file skygw_sqlscan.h	The scanning of SQL text
+ *
+ * The loops that pass over the white space, find the end of a comment or
+ * of a quoted string and look for a keyword in a statement. The text is
+ * looked at a vector of bytes at a time with AVX2, SSE2 or NEON, the one the
+ * compiler targets, and a byte at a time at the tail and on the others.
+ * A lexer that is fed a byte at a time turns the comments into white space.
+ *
+ * Every function reads the bytes from ptr up to but not including end and
+ * nothing else, the text need not be NUL terminated. White space is the
+ * white space of isspace in the C locale.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SQLSCAN_WIDTH	32
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SQLSCAN_WIDTH	16
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SQLSCAN_WIDTH	16
+#define SQLSCAN_NEON	1
+#else
+#define SQLSCAN_WIDTH	0
+#endif
+
+/**
+ * The vector operations. A mask has SQLSCAN_BITS bits for each byte of the
+ * vector, the ones of the bytes that compare true are all set.
+ */
+#if defined(__AVX2__)
+typedef __m256i		sqlscan_vec;
+#define SQLSCAN_BITS	1
+#define sqlscan_load(p)		_mm256_loadu_si256((const __m256i *)(p))
+#define sqlscan_splat(c)	_mm256_set1_epi8((char)(c))
+#define sqlscan_eq(a, b)	_mm256_cmpeq_epi8((a), (b))
+#define sqlscan_or(a, b)	_mm256_or_si256((a), (b))
+#define sqlscan_and(a, b)	_mm256_and_si256((a), (b))
+#define sqlscan_sub(a, b)	_mm256_sub_epi8((a), (b))
+#define sqlscan_le(a, b)	_mm256_cmpeq_epi8(_mm256_min_epu8((a), (b)), (a))
+#define sqlscan_mask(v)		((uint64_t)(uint32_t)_mm256_movemask_epi8(v))
+#elif defined(__SSE2__)
+typedef __m128i		sqlscan_vec;
+#define SQLSCAN_BITS	1
+#define sqlscan_load(p)		_mm_loadu_si128((const __m128i *)(p))
+#define sqlscan_splat(c)	_mm_set1_epi8((char)(c))
+#define sqlscan_eq(a, b)	_mm_cmpeq_epi8((a), (b))
+#define sqlscan_or(a, b)	_mm_or_si128((a), (b))
+#define sqlscan_and(a, b)	_mm_and_si128((a), (b))
+#define sqlscan_sub(a, b)	_mm_sub_epi8((a), (b))
+#define sqlscan_le(a, b)	_mm_cmpeq_epi8(_mm_min_epu8((a), (b)), (a))
+#define sqlscan_mask(v)		((uint64_t)(uint32_t)_mm_movemask_epi8(v))
+#elif defined(SQLSCAN_NEON)
+typedef uint8x16_t	sqlscan_vec;
+#define SQLSCAN_BITS	4
+#define sqlscan_load(p)		vld1q_u8((const uint8_t *)(p))
+#define sqlscan_splat(c)	vdupq_n_u8((uint8_t)(c))
+#define sqlscan_eq(a, b)	vceqq_u8((a), (b))
+#define sqlscan_or(a, b)	vorrq_u8((a), (b))
+#define sqlscan_and(a, b)	vandq_u8((a), (b))
+#define sqlscan_sub(a, b)	vsubq_u8((a), (b))
+#define sqlscan_le(a, b)	vcleq_u8((a), (b))
+/*< NEON has no movemask, the narrowing shift keeps four bits of each byte */
+#define sqlscan_mask(v)		vget_lane_u64(vreinterpret_u64_u8(	\
+				vshrn_n_u16(vreinterpretq_u16_u8(v), 4)), 0)
+#endif
+
+#if SQLSCAN_WIDTH
+/** The mask of the bytes of a vector, of all the bytes of the vector */
+#define SQLSCAN_ALL	(SQLSCAN_WIDTH * SQLSCAN_BITS == 64 ? ~(uint64_t)0 \
+			: (((uint64_t)1 << (SQLSCAN_WIDTH * SQLSCAN_BITS)) - 1))
+/** The offset of the first byte that is set in a mask that is not zero */
+#define sqlscan_first(m)	(__builtin_ctzll(m) / SQLSCAN_BITS)
+
+/**
+ * The white space bytes of a vector, the space and the bytes from tab to
+ * carriage return
+ */
+static inline sqlscan_vec
+sqlscan_vspace(sqlscan_vec v)
+{
+	return sqlscan_or(sqlscan_eq(v, sqlscan_splat(' ')),
+		sqlscan_le(sqlscan_sub(v, sqlscan_splat('\t')),
+				sqlscan_splat('\r' - '\t')));
+}
+
+/**
+ * Fold the letters of a vector to lower case where the fold is 0x20 and
+ * leave the other bytes. A byte that folds to a lower case letter was the
+ * letter in one of its cases, since the fold only sets the bit.
+ */
+static inline sqlscan_vec
+sqlscan_vfold(sqlscan_vec v, sqlscan_vec fold)
+{
+	return sqlscan_or(v, fold);
+}
+#endif
+
+/**
+ * Check if a byte is white space, without the locale of isspace
+ */
+static inline int
+sqlscan_isspace(int c)
+{
+	return c == ' ' || (unsigned)(c - '\t') <= (unsigned)('\r' - '\t');
+}
+
+/**
+ * Pass over the white space
+ *
+ * @param ptr	The text
+ * @param end	The end of the text
+ * @return	The first byte that is not white space or end
+ */
+static inline char *
+sqlscan_skip_space(const char *ptr, const char *end)
+{
+#if SQLSCAN_WIDTH
+	uint64_t	m;
+
+	/*< Most of the runs of white space are a single space */
+	if (ptr < end && !sqlscan_isspace((unsigned char)*ptr))
+		return (char *)ptr;
+	while (end - ptr >= SQLSCAN_WIDTH)
+	{
+		m = ~sqlscan_mask(sqlscan_vspace(sqlscan_load(ptr)))
+			& SQLSCAN_ALL;
+		if (m)
+			return (char *)ptr + sqlscan_first(m);
+		ptr += SQLSCAN_WIDTH;
+	}
+#endif
+	while (ptr < end && sqlscan_isspace((unsigned char)*ptr))
+		ptr++;
+	return (char *)ptr;
+}
+
+/**
+ * Find the first of two bytes, the quote or the escape that ends the
+ * run of plain characters of a string literal
+ *
+ * @param ptr	The text
+ * @param end	The end of the text
+ * @param a	A byte to find
+ * @param b	The other byte to find
+ * @return	The first of the bytes or NULL if neither is in the text
+ */
+static inline char *
+sqlscan_find2(const char *ptr, const char *end, char a, char b)
+{
+#if SQLSCAN_WIDTH
+	sqlscan_vec	va = sqlscan_splat(a), vb = sqlscan_splat(b), v;
+	uint64_t	m;
+
+	while (end - ptr >= SQLSCAN_WIDTH)
+	{
+		v = sqlscan_load(ptr);
+		m = sqlscan_mask(sqlscan_or(sqlscan_eq(v, va),
+						sqlscan_eq(v, vb)));
+		if (m)
+			return (char *)ptr + sqlscan_first(m);
+		ptr += SQLSCAN_WIDTH;
+	}
+#endif
+	for (; ptr < end; ptr++)
+		if (*ptr == a || *ptr == b)
+			return (char *)ptr;
+	return NULL;
+}
+
+/**
+ * Find the end of a C style comment
+ *
+ * @param ptr	The text of the comment, after its opening
+ * @param end	The end of the text
+ * @return	The '*' of the closing or NULL if the comment is not closed
+ */
+static inline char *
+sqlscan_comment_end(const char *ptr, const char *end)
+{
+#if SQLSCAN_WIDTH
+	sqlscan_vec	star = sqlscan_splat('*'), slash = sqlscan_splat('/');
+	uint64_t	m;
+
+	/*< The vector of the slashes is one byte on, it must be in the text */
+	while (end - ptr > SQLSCAN_WIDTH)
+	{
+		m = sqlscan_mask(sqlscan_and(
+				sqlscan_eq(sqlscan_load(ptr), star),
+				sqlscan_eq(sqlscan_load(ptr + 1), slash)));
+		if (m)
+			return (char *)ptr + sqlscan_first(m);
+		ptr += SQLSCAN_WIDTH;
+	}
+#endif
+	for (; ptr + 1 < end; ptr++)
+		if (ptr[0] == '*' && ptr[1] == '/')
+			return (char *)ptr;
+	return NULL;
+}
+
+/**
+ * Find a word in the text ignoring the case of its letters. The word need
+ * not be a whole word of the text, the caller checks its boundaries.
+ *
+ * @param ptr	The text
+ * @param end	The end of the text
+ * @param word	The word
+ * @param len	The length of the word
+ * @return	The first occurrence of the word or NULL if there is none
+ */
+static inline char *
+sqlscan_find_word(const char *ptr, const char *end, const char *word, int len)
+{
+	unsigned char	first, last, ffold, lfold;
+
+	if (len <= 0)
+		return (char *)ptr;
+	first = (unsigned char)word[0];
+	last = (unsigned char)word[len - 1];
+	/*< Letters compare in lower case, the other bytes as they are */
+	ffold = ((first | 0x20) >= 'a' && (first | 0x20) <= 'z') ? 0x20 : 0;
+	lfold = ((last | 0x20) >= 'a' && (last | 0x20) <= 'z') ? 0x20 : 0;
+	first |= ffold;
+	last |= lfold;
+#if SQLSCAN_WIDTH
+	{
+	sqlscan_vec	vf = sqlscan_splat(first), vl = sqlscan_splat(last);
+	sqlscan_vec	ff = sqlscan_splat(ffold), lf = sqlscan_splat(lfold);
+	uint64_t	m;
+	int		i;
+
+	/*< The first and the last bytes of the candidates are compared at once */
+	while (end - ptr >= SQLSCAN_WIDTH + len - 1)
+	{
+		m = sqlscan_mask(sqlscan_and(
+			sqlscan_eq(sqlscan_vfold(sqlscan_load(ptr), ff), vf),
+			sqlscan_eq(sqlscan_vfold(sqlscan_load(ptr + len - 1),
+							lf), vl)));
+		while (m)
+		{
+			i = sqlscan_first(m);
+			if (len <= 2 ||
+				strncasecmp(ptr + i + 1, word + 1, len - 2) == 0)
+				return (char *)ptr + i;
+			m &= ~((((uint64_t)1 << SQLSCAN_BITS) - 1)
+						<< (i * SQLSCAN_BITS));
+		}
+		ptr += SQLSCAN_WIDTH;
+	}
+	}
+#endif
+	for (; end - ptr >= len; ptr++)
+	{
+		if (((unsigned char)ptr[0] | ffold) == first &&
+			((unsigned char)ptr[len - 1] | lfold) == last &&
+			(len <= 2 ||
+			strncasecmp(ptr + 1, word + 1, len - 2) == 0))
+			return (char *)ptr;
+	}
+	return NULL;
+}
+
+/**
+ * The states of sqlscan_lex
+ */
+#define	SQLSCAN_LEX_SQL		0	/*< The text of the statement */
+#define	SQLSCAN_LEX_SLASH	1	/*< After a '/' */
+#define	SQLSCAN_LEX_DASH	2	/*< After a '-' */
+#define	SQLSCAN_LEX_DASH2	3	/*< After "--" */
+#define	SQLSCAN_LEX_OPEN	4	/*< After the opening of a comment */
+#define	SQLSCAN_LEX_OPEN_M	5	/*< After the opening and an 'M' */
+#define	SQLSCAN_LEX_VERSION	6	/*< The version of an executable comment */
+#define	SQLSCAN_LEX_COMMENT	7	/*< In a C style comment */
+#define	SQLSCAN_LEX_STAR	8	/*< After a '*' in a C style comment */
+#define	SQLSCAN_LEX_LINE	9	/*< In a '#' or a '-- ' comment */
+#define	SQLSCAN_LEX_QUOTE	10	/*< In a quoted string or name */
+#define	SQLSCAN_LEX_ESCAPE	11	/*< After a '\\' in a quoted string */
+#define	SQLSCAN_LEX_EXEC_STAR	12	/*< After a '*' in an executable comment */
+
+/** The most bytes sqlscan_lex yields for one byte */
+#define	SQLSCAN_LEX_MAX		3
+
+/**
+ * The state of the lexer, it is zeroed before the first byte of a text
+ */
+typedef struct {
+	int	state;		/*< One of the SQLSCAN_LEX states */
+	int	quote;		/*< The quote of the string or the name */
+	int	exec;		/*< In the body of an executable comment */
+} SQLSCAN_LEX;
+
+/**
+ * Feed a byte of a statement to the lexer. A C style, a '#' or a '-- '
+ * comment yields a single space. The body of an executable comment, a C
+ * style comment that starts with '!' or "M!", is the text of the statement
+ * and its version is dropped, its opening and its closing are a space each.
+ * The comments are not looked for in the quoted strings and names. The end
+ * of the text is fed as a space, it yields the bytes that are held back.
+ *
+ * @param lex	The state of the lexer
+ * @param c	The byte
+ * @param out	Filled with the bytes of the text without the comments,
+ *		room for SQLSCAN_LEX_MAX of them
+ * @return	The number of bytes in out
+ */
+static inline int
+sqlscan_lex(SQLSCAN_LEX *lex, int c, char *out)
+{
+int	n = 0;
+
+	/*< The bytes held back to tell a comment from the text */
+	switch (lex->state)
+	{
+	case SQLSCAN_LEX_SLASH:
+		if (c == '*')
+		{
+			lex->state = SQLSCAN_LEX_OPEN;
+			out[n++] = ' ';
+			return n;
+		}
+		out[n++] = '/';
+		break;
+	case SQLSCAN_LEX_DASH:
+		if (c == '-')
+		{
+			lex->state = SQLSCAN_LEX_DASH2;
+			return n;
+		}
+		out[n++] = '-';
+		break;
+	case SQLSCAN_LEX_DASH2:
+		if (sqlscan_isspace(c))
+		{
+			lex->state = SQLSCAN_LEX_LINE;
+			out[n++] = ' ';
+			return n;
+		}
+		out[n++] = '-';
+		out[n++] = '-';
+		break;
+	case SQLSCAN_LEX_EXEC_STAR:
+		if (c == '/')
+		{
+			lex->state = SQLSCAN_LEX_SQL;
+			lex->exec = 0;
+			out[n++] = ' ';
+			return n;
+		}
+		out[n++] = '*';
+		break;
+	case SQLSCAN_LEX_OPEN:
+	case SQLSCAN_LEX_OPEN_M:
+		if (c == '!')
+		{
+			lex->state = SQLSCAN_LEX_VERSION;
+			lex->exec = 1;
+			return n;
+		}
+		if (c == 'M' && lex->state == SQLSCAN_LEX_OPEN)
+		{
+			lex->state = SQLSCAN_LEX_OPEN_M;
+			return n;
+		}
+		lex->state = SQLSCAN_LEX_COMMENT;
+		/* FALLTHROUGH */
+	case SQLSCAN_LEX_COMMENT:
+		if (c == '*')
+			lex->state = SQLSCAN_LEX_STAR;
+		return n;
+	case SQLSCAN_LEX_STAR:
+		if (c == '/')
+			lex->state = SQLSCAN_LEX_SQL;
+		else if (c != '*')
+			lex->state = SQLSCAN_LEX_COMMENT;
+		return n;
+	case SQLSCAN_LEX_LINE:
+		if (c == '\n')
+			lex->state = SQLSCAN_LEX_SQL;
+		return n;
+	case SQLSCAN_LEX_QUOTE:
+		if (c == '\\' && lex->quote != '`')
+			lex->state = SQLSCAN_LEX_ESCAPE;
+		else if (c == lex->quote)
+			lex->state = SQLSCAN_LEX_SQL;
+		out[n++] = c;
+		return n;
+	case SQLSCAN_LEX_ESCAPE:
+		lex->state = SQLSCAN_LEX_QUOTE;
+		out[n++] = c;
+		return n;
+	case SQLSCAN_LEX_VERSION:
+		if ((unsigned)(c - '0') <= 9)
+			return n;
+		break;
+	}
+
+	lex->state = SQLSCAN_LEX_SQL;
+	switch (c)
+	{
+	case '/':
+		lex->state = SQLSCAN_LEX_SLASH;
+		break;
+	case '-':
+		lex->state = SQLSCAN_LEX_DASH;
+		break;
+	case '#':
+		lex->state = SQLSCAN_LEX_LINE;
+		out[n++] = ' ';
+		break;
+	case '*':
+		if (lex->exec)
+			lex->state = SQLSCAN_LEX_EXEC_STAR;
+		else
+			out[n++] = c;
+		break;
+	case '\'':
+	case '"':
+	case '`':
+		lex->state = SQLSCAN_LEX_QUOTE;
+		lex->quote = c;
+		out[n++] = c;
+		break;
+	default:
+		out[n++] = c;
+		break;
+	}
+	return n;
+}
+
+#endif /* SKYGW_SQLSCAN_H */
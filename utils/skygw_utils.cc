@@ -23,6 +23,12 @@
 #include <errno.h>
 #include <string.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/vfs.h>
+#include <limits.h>
 
 #include "skygw_debug.h"
 #include "skygw_types.h"
@@ -31,6 +37,18 @@
 const char*  timestamp_formatstr = "%04d %02d/%02d %02d:%02d:%02d   ";
 /** One for terminating '\0' */
 const int    timestamp_len       =    4+1 +2+1 +2+1 +2+1 +2+1 +2+3  +1;
+/** Milliseconds are between the seconds and the spaces */
+const int    timestamp_len_ms    =    timestamp_len +4;
+
+/**
+ * Timestamp of the thread rendered for the second ts_cache_sec, rendering
+ * is done once a second at most.
+ */
+static __thread time_t ts_cache_sec = (time_t)-1;
+static __thread int    ts_cache_len;
+static __thread char   ts_cache_str[32];
+
+static const char* timestamp_get_cached(time_t t, int* p_len);
 
 /** Single-linked list for storing test cases */
 
@@ -88,9 +106,25 @@ struct skygw_file_st {
         char*        sf_fname;
         FILE*        sf_file;
         int          sf_fd;
+        off_t        sf_offset;    /**< end of the data written */
+        off_t        sf_alloc_end; /**< end of the preallocated space */
+        bool         sf_prealloc;  /**< preallocation is supported */
+        size_t       sf_writeback; /**< dirty bytes bound, 0 for none */
+        off_t        sf_wb_start;  /**< start of the range being written back */
+        off_t        sf_wb_end;    /**< end of the range being written back */
+        int          sf_nwrites;   /**< writes since the last fsync */
         skygw_chk_t  sf_chk_tail;
 };
 
+/** Log files are preallocated in extents of this size */
+#define FILE_EXTENT   (8*1024*1024)
+
+/** File systems which keep the files in memory */
+#define FILE_TMPFS_MAGIC 0x01021994
+
+static void file_preallocate(skygw_file_t* file, size_t nbytes);
+static void file_sync(skygw_file_t* file, bool flush);
+
 /** End of structs and types */
 
 #if defined(MLIST)
@@ -573,8 +607,10 @@ bool mlist_add_node_nomutex(
         CHK_MLIST_NODE(newnode);
         ss_dassert(!list->mlist_deleted);
 
-        /** List is full already. */
-        if (list->mlist_nodecount == list->mlist_nodecount_max) {
+        /** List is full already, 0 is no limit. */
+        if (list->mlist_nodecount_max != 0 &&
+            list->mlist_nodecount == list->mlist_nodecount_max)
+        {
                 goto return_succp;
         }
         /** Find location for new node */
@@ -630,12 +666,362 @@ bool mlist_cursor_move_to_first(
 
 /** End of mlist */
 
+/** Alignment of pool elements */
+#define POOL_ALIGN 16
+#define POOL_ROUNDUP(n) (((n) + POOL_ALIGN - 1) & ~((size_t)POOL_ALIGN - 1))
+
+void ilist_init(
+        ilist_t* list)
+{
+        list->il_first = NULL;
+        list->il_last = NULL;
+        list->il_count = 0;
+}
+
+void ilist_push_back(
+        ilist_t*      list,
+        ilist_node_t* node)
+{
+        node->iln_next = NULL;
+
+        if (list->il_last != NULL) {
+                list->il_last->iln_next = node;
+        } else {
+                list->il_first = node;
+        }
+        list->il_last = node;
+        list->il_count += 1;
+}
+
+void ilist_push_front(
+        ilist_t*      list,
+        ilist_node_t* node)
+{
+        node->iln_next = list->il_first;
+        list->il_first = node;
+
+        if (list->il_last == NULL) {
+                list->il_last = node;
+        }
+        list->il_count += 1;
+}
+
+ilist_node_t* ilist_pop_front(
+        ilist_t* list)
+{
+        ilist_node_t* node = list->il_first;
+
+        if (node != NULL) {
+                list->il_first = node->iln_next;
+
+                if (list->il_first == NULL) {
+                        list->il_last = NULL;
+                }
+                node->iln_next = NULL;
+                list->il_count -= 1;
+        }
+        return node;
+}
+
+/** 
+ * @node Removes an element from an intrusive list. 
+ *
+ * Parameters:
+ * @param list - in, use
+ *          the list
+ *
+ * @param node - in, use
+ *          link of the element
+ *
+ * @return true if the element was in the list, false otherwise
+ *
+ * 
+ * @details The list is singly linked so the removal searches the link
+ * before the element, use ilist_pop_front where the order allows it.
+ *
+ */
+bool ilist_remove(
+        ilist_t*      list,
+        ilist_node_t* node)
+{
+        ilist_node_t** pp = &list->il_first;
+        ilist_node_t*  prev = NULL;
+
+        while (*pp != NULL && *pp != node) {
+                prev = *pp;
+                pp = &prev->iln_next;
+        }
+        if (*pp == NULL) {
+                return false;
+        }
+        *pp = node->iln_next;
+
+        if (list->il_last == node) {
+                list->il_last = prev;
+        }
+        node->iln_next = NULL;
+        list->il_count -= 1;
+        return true;
+}
+
+void mpsc_list_init(
+        mpsc_list_t* list)
+{
+        list->ml_head = NULL;
+}
+
+/** 
+ * @node Pushes an element to the head of a list shared by threads. 
+ *
+ * Parameters:
+ * @param list - in, use
+ *          the list
+ *
+ * @param node - in, use
+ *          link of the element
+ *
+ * @return void
+ *
+ * 
+ * @details The link of the element is set before the element is made the
+ * head with compare and swap, so a consumer reading the head sees the rest
+ * of the list behind it. The consumer doesn't reuse the detached elements
+ * while producers may still read them, so there is no ABA problem.
+ *
+ */
+void mpsc_list_push(
+        mpsc_list_t*  list,
+        ilist_node_t* node)
+{
+        ilist_node_t* head;
+
+        do {
+                head = list->ml_head;
+                node->iln_next = head;
+        } while (!__sync_bool_compare_and_swap(&list->ml_head, head, node));
+}
+
+/**
+ * @node Gives the newest element of a list whose elements are never
+ * removed, the rest are reached by following iln_next.
+ */
+ilist_node_t* mpsc_list_first(
+        mpsc_list_t* list)
+{
+        ilist_node_t* head = list->ml_head;
+        /** The links behind the head are read after the head */
+        __sync_synchronize();
+        return head;
+}
+
+/** 
+ * @node Detaches all elements of a list shared by threads. 
+ *
+ * Parameters:
+ * @param list - in, use
+ *          the list
+ *
+ * @return the elements in the order they were pushed, NULL if there was
+ * none
+ *
+ * 
+ * @details The list is emptied with one atomic exchange, the detached
+ * elements belong to the caller.
+ *
+ */
+ilist_node_t* mpsc_list_detach(
+        mpsc_list_t* list)
+{
+        ilist_node_t* node;
+        ilist_node_t* next;
+        ilist_node_t* first = NULL;
+
+        node = __sync_lock_test_and_set(&list->ml_head, (ilist_node_t *)NULL);
+        __sync_synchronize();
+
+        /** Pushes are in the reverse order */
+        while (node != NULL) {
+                next = node->iln_next;
+                node->iln_next = first;
+                first = node;
+                node = next;
+        }
+        return first;
+}
+
+/** 
+ * @node Initializes a pool of elements of one size. 
+ *
+ * Parameters:
+ * @param pool - in, use
+ *          address of the pool, NULL if it is allocated
+ *
+ * @param elemsize - in, use
+ *          size of an element
+ *
+ * @param chunkelems - in, use
+ *          number of elements allocated from the system at a time
+ *
+ * @return the pool, NULL if memory allocation failed
+ *
+ * 
+ * @details No elements are allocated before the first skygw_pool_alloc.
+ *
+ */
+skygw_pool_t* skygw_pool_init(
+        skygw_pool_t* pool,
+        size_t        elemsize,
+        size_t        chunkelems)
+{
+        if (pool == NULL &&
+            (pool = (skygw_pool_t *)malloc(sizeof(skygw_pool_t))) == NULL)
+        {
+                return NULL;
+        }
+        pool->sp_elemsize = POOL_ROUNDUP(MAX(elemsize, sizeof(ilist_node_t)));
+        pool->sp_chunkelems = MAX(chunkelems, 1);
+        pool->sp_lock = 0;
+        pool->sp_free = NULL;
+        mpsc_list_init(&pool->sp_freed);
+        pool->sp_chunks = NULL;
+        pool->sp_nchunks = 0;
+        return pool;
+}
+
+/**
+ * @node Frees the memory of a pool. The elements, allocated or not, are
+ * freed with it, the pool itself is not.
+ */
+void skygw_pool_done(
+        skygw_pool_t* pool)
+{
+        ilist_node_t* chunk;
+
+        while ((chunk = pool->sp_chunks) != NULL) {
+                pool->sp_chunks = chunk->iln_next;
+                free(chunk);
+        }
+        pool->sp_free = NULL;
+        mpsc_list_init(&pool->sp_freed);
+        pool->sp_nchunks = 0;
+}
+
+/** 
+ * @node Allocates an element from a pool. 
+ *
+ * Parameters:
+ * @param pool - in, use
+ *          the pool
+ *
+ * @return the element filled with zeros, NULL if there was no memory
+ *
+ * 
+ * @details The pool lock is a spinlock held only for taking an element
+ * from the free list. When the free list is empty the elements freed
+ * since are moved to it, and if there are none a chunk is allocated.
+ *
+ */
+void* skygw_pool_alloc(
+        skygw_pool_t* pool)
+{
+        ilist_node_t* node;
+        char*         chunk;
+        size_t        hdrlen = POOL_ROUNDUP(sizeof(ilist_node_t));
+        size_t        i;
+
+        acquire_lock(&pool->sp_lock);
+
+        if (pool->sp_free == NULL) {
+                pool->sp_free = mpsc_list_detach(&pool->sp_freed);
+        }
+        if (pool->sp_free == NULL) {
+                chunk = (char *)malloc(hdrlen +
+                                       pool->sp_elemsize*pool->sp_chunkelems);
+
+                if (chunk == NULL) {
+                        release_lock(&pool->sp_lock);
+                        return NULL;
+                }
+                ((ilist_node_t *)chunk)->iln_next = pool->sp_chunks;
+                pool->sp_chunks = (ilist_node_t *)chunk;
+                pool->sp_nchunks += 1;
+
+                for (i = pool->sp_chunkelems; i > 0; i--) {
+                        node = (ilist_node_t *)(chunk + hdrlen +
+                                                (i-1)*pool->sp_elemsize);
+                        node->iln_next = pool->sp_free;
+                        pool->sp_free = node;
+                }
+        }
+        node = pool->sp_free;
+        pool->sp_free = node->iln_next;
+        release_lock(&pool->sp_lock);
+
+        memset(node, 0, pool->sp_elemsize);
+        return node;
+}
+
+/** 
+ * @node Gives an element back to its pool without taking a lock. 
+ */
+void skygw_pool_free(
+        skygw_pool_t* pool,
+        void*         elem)
+{
+        if (elem != NULL) {
+                mpsc_list_push(&pool->sp_freed, (ilist_node_t *)elem);
+        }
+}
+
 
 int get_timestamp_len(void)
 {
         return timestamp_len;
 }
 
+int get_timestamp_len_ms(void)
+{
+        return timestamp_len_ms;
+}
+
+/**
+ * @node Returns the timestamp of a second, rendered by the thread.
+ *
+ * Parameters:
+ * @param t - in, use
+ *          the second
+ *
+ * @param p_len - out
+ *          length of the timestamp without terminating '\0'
+ *
+ * @return the timestamp in the cache of the thread
+ *
+ * @details The timestamp is rendered again only when the second changes.
+ */
+static const char* timestamp_get_cached(
+        time_t t,
+        int*   p_len)
+{
+        if (t != ts_cache_sec)
+        {
+                struct tm tm;
+
+                localtime_r(&t, &tm);
+                ts_cache_len = snprintf(ts_cache_str,
+                                        sizeof(ts_cache_str),
+                                        timestamp_formatstr,
+                                        tm.tm_year+1900,
+                                        tm.tm_mon+1,
+                                        tm.tm_mday,
+                                        tm.tm_hour,
+                                        tm.tm_min,
+                                        tm.tm_sec);
+                ts_cache_sec = t;
+        }
+        *p_len = ts_cache_len;
+        return ts_cache_str;
+}
+
 /** 
  * @node Generate and write a timestamp to location passed as argument
  * by using at most tslen characters. 
@@ -645,38 +1031,84 @@ int get_timestamp_len(void)
  *          Write position in memory. Must be filled with at least
  *          <timestamp_len> zeroes 
  *
- * @return Length of string written. Length includes terminating '\0'.
+ * @param tslen - in, use
+ *          size of the memory
+ *
+ * @return Length of string written without terminating '\0'.
  *
  * 
- * @details (write detailed description here)
+ * @details The timestamp of the second is rendered once by each thread,
+ * the later calls of the second copy it.
  *
  */
 int snprint_timestamp(
         char* p_ts,
         int   tslen)
 {
-        time_t       t;
-        struct tm    tm;
+        const char*  ts;
+        int          len = 0;
 
-        if (p_ts == NULL) {
-                goto return_p_ts;
+        if (p_ts == NULL || tslen <= 0) {
+                goto return_len;
         }
+        ts = timestamp_get_cached(time(NULL), &len);
+        len = MIN(len, tslen-1);
+        memcpy(p_ts, ts, len);
+        p_ts[len] = '\0';
 
-        /** Generate timestamp */
-        t = time(NULL);
-        tm = *(localtime(&t));
-        snprintf(p_ts,
-                 MIN(tslen,timestamp_len),
-                 timestamp_formatstr,
-                 tm.tm_year+1900,
-                 tm.tm_mon+1,
-                 tm.tm_mday,
-                 tm.tm_hour,
-                 tm.tm_min,
-                 tm.tm_sec);
+return_len:
+        return len;
+}
 
-return_p_ts:
-        return (strlen(p_ts));
+/**
+ * @node Generate and write a timestamp with milliseconds to location
+ * passed as argument by using at most tslen characters.
+ *
+ * Parameters:
+ * @param p_ts - in, use
+ *          Write position in memory, at least <timestamp_len_ms> bytes
+ *          are needed for the whole timestamp
+ *
+ * @param tslen - in, use
+ *          size of the memory
+ *
+ * @return Length of string written without terminating '\0'.
+ *
+ * @details The milliseconds are appended to the cached timestamp of the
+ * second, before its trailing spaces.
+ */
+int snprint_timestamp_ms(
+        char* p_ts,
+        int   tslen)
+{
+        struct timeval tv;
+        const char*    ts;
+        char           buf[48];
+        int            len = 0;
+        int            ms;
+
+        if (p_ts == NULL || tslen <= 0) {
+                goto return_len;
+        }
+        gettimeofday(&tv, NULL);
+        ts = timestamp_get_cached(tv.tv_sec, &len);
+        ms = (int)(tv.tv_usec/1000);
+        /** The three trailing spaces follow the milliseconds */
+        len -= 3;
+        memcpy(buf, ts, len);
+        buf[len++] = '.';
+        buf[len++] = '0' + ms/100;
+        buf[len++] = '0' + (ms/10)%10;
+        buf[len++] = '0' + ms%10;
+        memcpy(buf+len, "   ", 3);
+        len += 3;
+
+        len = MIN(len, tslen-1);
+        memcpy(p_ts, buf, len);
+        p_ts[len] = '\0';
+
+return_len:
+        return len;
 }
 
 
@@ -1712,37 +2144,91 @@ bool skygw_file_write(
         size_t        nbytes,
         bool          flush)
 {
-        bool   succp = false;
+        struct iovec iov;
+
+        iov.iov_base = data;
+        iov.iov_len  = nbytes;
+        return skygw_file_writev(file, &iov, 1, flush);
+}
+
+/**
+ * @node Writes the buffers of an io vector to the end of the file.
+ *
+ * Parameters:
+ * @param file - in, use
+ *          file to write to
+ *
+ * @param iov - in, use
+ *          the buffers, the vector is modified by a partial write
+ *
+ * @param iovcnt - in, use
+ *          number of buffers
+ *
+ * @param flush - in, use
+ *          the file is synced to disk after the write
+ *
+ * @return true if succeed, false otherwise
+ *
+ * @details The file is preallocated ahead of the writes. Without flush
+ * the file is synced every FSYNCLIMIT writes, or if the writeback bound is
+ * set, the writeback of the dirty range is started when it exceeds the
+ * bound, see skygw_file_set_writeback.
+ */
+bool skygw_file_writev(
+        skygw_file_t* file,
+        struct iovec* iov,
+        int           iovcnt,
+        bool          flush)
+{
+        bool    succp = false;
 #if !defined(LAPTOP_TEST)
-        int    err = 0;
-        size_t nwritten;
-        int    fd;
-        static int writecount;
+        ssize_t nwritten;
+        size_t  nbytes = 0;
+        int     i;
 #endif
-        
+
         CHK_FILE(file);
 #if (LAPTOP_TEST)
         usleep(DISKWRITE_LATENCY);
 #else
-        nwritten = fwrite(data, nbytes, 1, file->sf_file);
-        
-        if (nwritten != 1) {
-                perror("Logfile write.\n");
-                fprintf(stderr,
-                        "* Writing %ld bytes, %s to %s failed.\n",
-                        nbytes,
-                        (char *)data,
-                        file->sf_fname);
-                goto return_succp;
+        for (i = 0; i < iovcnt; i++) {
+                nbytes += iov[i].iov_len;
         }
-        writecount += 1;
-        
-        if (flush || writecount == FSYNCLIMIT) {
-                fd = fileno(file->sf_file);
-                err = fflush(file->sf_file);
-                err = fsync(fd);
-                writecount = 0;
+        file_preallocate(file, nbytes);
+
+        while (iovcnt > 0)
+        {
+                nwritten = writev(file->sf_fd, iov, MIN(iovcnt, IOV_MAX));
+
+                if (nwritten < 0)
+                {
+                        if (errno == EINTR) {
+                                continue;
+                        }
+                        perror("Logfile write.\n");
+                        fprintf(stderr,
+                                "* Writing %ld bytes to %s failed.\n",
+                                nbytes,
+                                file->sf_fname);
+                        goto return_succp;
+                }
+                file->sf_offset += nwritten;
+
+                /** Skip the buffers written */
+                while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len)
+                {
+                        nwritten -= iov->iov_len;
+                        iov += 1;
+                        iovcnt -= 1;
+                }
+
+                if (iovcnt > 0)
+                {
+                        iov->iov_base = (char *)iov->iov_base + nwritten;
+                        iov->iov_len -= nwritten;
+                }
         }
+        file_sync(file, flush);
 #endif
         succp = true;
         CHK_FILE(file);
@@ -1750,6 +2236,104 @@ return_succp:
         return succp;
 }
 
+/**
+ * @node Sets the bound of the dirty bytes of the file.
+ *
+ * Parameters:
+ * @param file - in, use
+ *          file
+ *
+ * @param nbytes - in, use
+ *          bytes written before their writeback is started, 0 to sync
+ *          every FSYNCLIMIT writes instead
+ *
+ * @return void
+ *
+ * @details When the written bytes reach the bound their writeback is
+ * started with sync_file_range, after waiting for the writeback of the
+ * previous range. The dirty pages of the file stay below twice the bound,
+ * and the writes aren't stalled by the writeback of a large backlog.
+ */
+void skygw_file_set_writeback(
+        skygw_file_t* file,
+        size_t        nbytes)
+{
+        CHK_FILE(file);
+        file->sf_writeback = nbytes;
+        file->sf_wb_start = file->sf_offset;
+        file->sf_wb_end = file->sf_offset;
+}
+
+static void file_preallocate(
+        skygw_file_t* file,
+        size_t        nbytes)
+{
+        off_t len;
+
+        if (!file->sf_prealloc ||
+            file->sf_offset + (off_t)nbytes <= file->sf_alloc_end)
+        {
+                return;
+        }
+        len = MAX(FILE_EXTENT, (off_t)nbytes);
+        /** The size of the file doesn't change, readers see no zeroes */
+        if (fallocate(file->sf_fd,
+                      FALLOC_FL_KEEP_SIZE,
+                      file->sf_offset,
+                      len) == 0)
+        {
+                file->sf_alloc_end = file->sf_offset + len;
+        }
+        else
+        {
+                /** Not supported by the file system */
+                file->sf_prealloc = false;
+        }
+}
+
+static void file_sync(
+        skygw_file_t* file,
+        bool          flush)
+{
+        file->sf_nwrites += 1;
+
+        if (flush)
+        {
+                fsync(file->sf_fd);
+                file->sf_nwrites = 0;
+                file->sf_wb_start = file->sf_offset;
+                file->sf_wb_end = file->sf_offset;
+        }
+        else if (file->sf_writeback > 0)
+        {
+                if (file->sf_offset - file->sf_wb_end >=
+                    (off_t)file->sf_writeback)
+                {
+                        if (file->sf_wb_end > file->sf_wb_start)
+                        {
+                                sync_file_range(file->sf_fd,
+                                                file->sf_wb_start,
+                                                file->sf_wb_end -
+                                                file->sf_wb_start,
+                                                SYNC_FILE_RANGE_WAIT_BEFORE |
+                                                SYNC_FILE_RANGE_WRITE |
+                                                SYNC_FILE_RANGE_WAIT_AFTER);
+                        }
+                        sync_file_range(file->sf_fd,
+                                        file->sf_wb_end,
+                                        file->sf_offset - file->sf_wb_end,
+                                        SYNC_FILE_RANGE_WRITE);
+                        file->sf_wb_start = file->sf_wb_end;
+                        file->sf_wb_end = file->sf_offset;
+                }
+        }
+        else if (file->sf_nwrites >= FSYNCLIMIT)
+        {
+                fsync(file->sf_fd);
+                file->sf_nwrites = 0;
+        }
+}
+
 skygw_file_t* skygw_file_init(
         char* fname,
         char* symlinkname)
@@ -1783,6 +2367,15 @@ skygw_file_t* skygw_file_init(
                 goto return_file;
         }
         setvbuf(file->sf_file, NULL, _IONBF, 0);
+        file->sf_fd = fileno(file->sf_file);
+        /** Files in memory aren't preallocated */
+        {
+                struct statfs sfs;
+
+                file->sf_prealloc =
+                        (fstatfs(file->sf_fd, &sfs) == 0 &&
+                         sfs.f_type != FILE_TMPFS_MAGIC);
+        }
         
         if (!file_write_header(file)) {
                 int eno = errno;
@@ -1796,6 +2389,10 @@ skygw_file_t* skygw_file_init(
                 file = NULL;
                 goto return_file;
         }
+        file->sf_offset = lseek(file->sf_fd, 0, SEEK_END);
+        file->sf_alloc_end = file->sf_offset;
+        file->sf_wb_start = file->sf_offset;
+        file->sf_wb_end = file->sf_offset;
         CHK_FILE(file);
         ss_dfprintf(stderr, "Opened %s\n", file->sf_fname);
 
@@ -1848,6 +2445,14 @@ void skygw_file_done(
                 }
             
                 fd = fileno(file->sf_file);
+                /** The preallocated space after the end is released */
+                if (file->sf_alloc_end > file->sf_offset) {
+                        off_t end = lseek(fd, 0, SEEK_END);
+
+                        if (end >= 0) {
+                                ftruncate(fd, end);
+                        }
+                }
                 fsync(fd);
                 err = fclose(file->sf_file);
         
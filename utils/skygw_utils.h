@@ -10,6 +10,7 @@
 #endif
 #define FSYNCLIMIT 10
 
+#include <stddef.h>
 #include "skygw_types.h"
 #include "skygw_debug.h"
 
@@ -22,6 +23,7 @@ typedef struct mlist_node_st    mlist_node_t;
 typedef struct skygw_file_st    skygw_file_t;
 typedef struct skygw_thread_st  skygw_thread_t;
 typedef struct skygw_message_st skygw_message_t;
+struct iovec;
 
 typedef struct simple_mutex_st {
         skygw_chk_t      sm_chk_top;
@@ -78,6 +80,50 @@ struct mlist_node_st {
         skygw_chk_t   mlnode_chk_tail;
 };
 
+/**
+ * Link of an intrusive list. The link is a member of the element so that
+ * adding an element to a list doesn't allocate anything, ILIST_ENTRY gives
+ * the element from the address of its link.
+ */
+typedef struct ilist_node_st {
+        struct ilist_node_st* iln_next;
+} ilist_node_t;
+
+#define ILIST_ENTRY(node, type, member) \
+        ((type *)((char *)(node) - offsetof(type, member)))
+
+/** Intrusive FIFO list, protected by the caller if it is shared. */
+typedef struct ilist_st {
+        ilist_node_t* il_first;
+        ilist_node_t* il_last;
+        size_t        il_count;
+} ilist_t;
+
+/**
+ * Intrusive list where any number of threads push elements without locks
+ * and one consumer either detaches all of them or, if elements are never
+ * removed while the list is in use, walks the list from its head.
+ */
+typedef struct mpsc_list_st {
+        ilist_node_t* volatile ml_head;
+} mpsc_list_t;
+
+/**
+ * Pool of elements of one size, allocated from the system in chunks. The
+ * link of a free element is in the first bytes of it. Freeing doesn't take
+ * a lock, the freed elements are pushed to sp_freed from where allocation
+ * moves them to sp_free when sp_free is empty.
+ */
+typedef struct skygw_pool_st {
+        size_t        sp_elemsize;   /**< rounded up to alignment */
+        size_t        sp_chunkelems; /**< elements in a chunk */
+        int           sp_lock;       /**< sp_free and sp_chunks */
+        ilist_node_t* sp_free;
+        mpsc_list_t   sp_freed;
+        ilist_node_t* sp_chunks;     /**< the link is at start of chunk */
+        size_t        sp_nchunks;
+} skygw_pool_t;
+
 
 typedef enum { THR_INIT, THR_RUNNING, THR_STOPPED, THR_DONE } skygw_thr_state_t;
 typedef enum { MES_RC_FAIL, MES_RC_SUCCESS, MES_RC_TIMEOUT } skygw_mes_rc_t;
@@ -94,6 +140,28 @@ bool slcursor_step_ahead(slist_cursor_t* c);
 
 EXTERN_C_BLOCK_END
 
+EXTERN_C_BLOCK_BEGIN
+
+void          ilist_init(ilist_t* list);
+void          ilist_push_back(ilist_t* list, ilist_node_t* node);
+void          ilist_push_front(ilist_t* list, ilist_node_t* node);
+ilist_node_t* ilist_pop_front(ilist_t* list);
+bool          ilist_remove(ilist_t* list, ilist_node_t* node);
+
+void          mpsc_list_init(mpsc_list_t* list);
+void          mpsc_list_push(mpsc_list_t* list, ilist_node_t* node);
+ilist_node_t* mpsc_list_first(mpsc_list_t* list);
+ilist_node_t* mpsc_list_detach(mpsc_list_t* list);
+
+skygw_pool_t* skygw_pool_init(skygw_pool_t* pool,
+                              size_t        elemsize,
+                              size_t        chunkelems);
+void          skygw_pool_done(skygw_pool_t* pool);
+void*         skygw_pool_alloc(skygw_pool_t* pool);
+void          skygw_pool_free(skygw_pool_t* pool, void* elem);
+
+EXTERN_C_BLOCK_END
+
 mlist_t*      mlist_init(mlist_t*         mlist,
                          mlist_cursor_t** cursor,
                          char*            name,
@@ -126,7 +194,9 @@ skygw_thr_state_t skygw_thread_get_state(skygw_thread_t* thr);
 pthread_t         skygw_thread_gettid(skygw_thread_t* thr);
 
 int get_timestamp_len(void);
+int get_timestamp_len_ms(void);
 int snprint_timestamp(char* p_ts, int tslen);
+int snprint_timestamp_ms(char* p_ts, int tslen);
 
 EXTERN_C_BLOCK_BEGIN
 
@@ -152,6 +222,12 @@ bool skygw_file_write(
         void*         data,
         size_t        nbytes,
         bool          flush);
+bool skygw_file_writev(
+        skygw_file_t* file,
+        struct iovec* iov,
+        int           iovcnt,
+        bool          flush);
+void skygw_file_set_writeback(skygw_file_t* file, size_t nbytes);
 /** Skygw file routines */
 
 EXTERN_C_BLOCK_BEGIN
@@ -0,0 +1,267 @@
+/*
+ * This file is distributed as part of MaxScale.  It is free
+ * software: you can redistribute it and/or modify it under the terms of the
+ * GNU General Public License as published by the Free Software Foundation,
+ * version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * Copyright SkySQL Ab 2014
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <skygw_sqlscan.h>
+
+#define TEXTLEN	200
+
+/*< The bytes of the texts, few of them so that the matches are frequent */
+static const char	alphabet[] = " \t\n*/'\\\"aAbB#-xY\r\v@`";
+
+static char	text[TEXTLEN + 1];
+
+static void
+random_text(int len)
+{
+int	i;
+
+	for (i = 0; i < len; i++)
+		text[i] = alphabet[random() % (sizeof(alphabet) - 1)];
+	text[len] = 0;
+}
+
+/**
+ * test1	the white space is passed over as isspace does
+ */
+static int
+test1()
+{
+int	n, len, start;
+char	*ptr, *expect;
+
+	for (n = 0; n < 20000; n++)
+	{
+		len = random() % TEXTLEN;
+		random_text(len);
+		/*< Long runs of white space cross the vectors */
+		if (n % 2)
+			memset(text, ' ', random() % (len + 1));
+		start = len ? random() % len : 0;
+		for (expect = text + start; expect < text + len &&
+					isspace((unsigned char)*expect); expect++)
+			;
+		ptr = sqlscan_skip_space(text + start, text + len);
+		if (ptr != expect)
+		{
+			fprintf(stderr, "sqlscan: test 1 failed, skipped to %d "
+				"not %d.\n", (int)(ptr - text),
+				(int)(expect - text));
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * test2	the first of two bytes and the end of a comment are found
+ */
+static int
+test2()
+{
+int	n, len, start;
+char	*ptr, *expect;
+
+	for (n = 0; n < 20000; n++)
+	{
+		len = random() % TEXTLEN;
+		random_text(len);
+		start = len ? random() % len : 0;
+		for (expect = text + start; expect < text + len &&
+				*expect != '\'' && *expect != '\\'; expect++)
+			;
+		if (expect == text + len)
+			expect = NULL;
+		ptr = sqlscan_find2(text + start, text + len, '\'', '\\');
+		if (ptr != expect)
+		{
+			fprintf(stderr, "sqlscan: test 2 failed, quote found "
+				"at the wrong place.\n");
+			return 1;
+		}
+		for (expect = text + start; expect + 1 < text + len &&
+				!(expect[0] == '*' && expect[1] == '/'); expect++)
+			;
+		if (expect + 1 >= text + len)
+			expect = NULL;
+		ptr = sqlscan_comment_end(text + start, text + len);
+		if (ptr != expect)
+		{
+			fprintf(stderr, "sqlscan: test 2 failed, comment end "
+				"found at the wrong place.\n");
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * test3	a word is found whatever the case of its letters
+ */
+static int
+test3()
+{
+static const char	*words[] = { "a", "*/", "ab", "aby", "b@a",
+				"#-xYa", "abababababababababab", NULL };
+int	n, i, len, wlen, start;
+char	*ptr, *expect;
+
+	for (n = 0; n < 20000; n++)
+	{
+		len = random() % TEXTLEN;
+		random_text(len);
+		start = len ? random() % len : 0;
+		for (i = 0; words[i]; i++)
+		{
+			wlen = strlen(words[i]);
+			for (expect = text + start; expect + wlen <= text + len &&
+				strncasecmp(expect, words[i], wlen); expect++)
+				;
+			if (expect + wlen > text + len)
+				expect = NULL;
+			ptr = sqlscan_find_word(text + start, text + len,
+						words[i], wlen);
+			if (ptr != expect)
+			{
+				fprintf(stderr, "sqlscan: test 3 failed, "
+					"word %s found at the wrong place.\n",
+					words[i]);
+				return 1;
+			}
+		}
+	}
+	if (sqlscan_find_word("SELECT * FROM t1 WHERE",
+			"SELECT * FROM t1 WHERE" + 22, "where", 5) == NULL)
+	{
+		fprintf(stderr, "sqlscan: test 3 failed, WHERE not found.\n");
+		return 1;
+	}
+	if (sqlscan_find_word("SELECT [ FROM t1", "SELECT [ FROM t1" + 16,
+				"{", 1) != NULL)
+	{
+		fprintf(stderr, "sqlscan: test 3 failed, [ matched {.\n");
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Feed a text to the lexer, a run of white space is one space
+ */
+static int
+lex_text(const char *sql, char *norm, int size)
+{
+SQLSCAN_LEX	lex;
+char		out[SQLSCAN_LEX_MAX];
+int		length = 0, n, i, end = 0;
+
+	memset(&lex, 0, sizeof(lex));
+	do {
+		if (*sql)
+			n = sqlscan_lex(&lex, (unsigned char)*sql++, out);
+		else
+		{
+			n = sqlscan_lex(&lex, ' ', out);
+			end = 1;
+		}
+		if (n < 0 || n > SQLSCAN_LEX_MAX)
+			return -1;
+		for (i = 0; i < n && length < size - 1; i++)
+		{
+			if (sqlscan_isspace((unsigned char)out[i]) &&
+				(length == 0 || norm[length - 1] == ' '))
+				continue;
+			norm[length++] = sqlscan_isspace((unsigned char)out[i])
+					? ' ' : out[i];
+		}
+	} while (!end);
+	while (length > 0 && norm[length - 1] == ' ')
+		length--;
+	norm[length] = 0;
+	return length;
+}
+
+/**
+ * test4	the comments are a space and an executable comment is its body
+ */
+static int
+test4()
+{
+static const char	*cases[][2] = {
+	{ "drop table", "drop table" },
+	{ "drop/**/table", "drop table" },
+	{ "drop/* x */table", "drop table" },
+	{ "drop/* ** / */table", "drop table" },
+	{ "/*!50000 drop*/ table", "drop table" },
+	{ "/*M!100000 drop*/table", "drop table" },
+	{ "/*!drop*/table", "drop table" },
+	{ "/*!50000 drop /* x */ table*/", "drop table" },
+	{ "select 2*3 -- drop table", "select 2*3" },
+	{ "drop # x\ntable", "drop table" },
+	{ "drop--x", "drop--x" },
+	{ "a/b-c", "a/b-c" },
+	{ "'/*' drop", "'/*' drop" },
+	{ "'a\\'/*' drop", "'a\\'/*' drop" },
+	{ "`a\\`/**/b", "`a\\` b" },
+	{ "\"--\" # x", "\"--\"" },
+	{ "/* unclosed drop table", "" },
+	{ NULL, NULL }
+};
+char	norm[TEXTLEN + 1];
+int	i, n;
+
+	for (i = 0; cases[i][0]; i++)
+	{
+		lex_text(cases[i][0], norm, sizeof(norm));
+		if (strcmp(norm, cases[i][1]))
+		{
+			fprintf(stderr, "sqlscan: test 4 failed, '%s' is '%s' "
+				"not '%s'.\n", cases[i][0], norm, cases[i][1]);
+			return 1;
+		}
+	}
+	for (n = 0; n < 20000; n++)
+	{
+		random_text(random() % TEXTLEN);
+		if (lex_text(text, norm, sizeof(norm)) < 0)
+		{
+			fprintf(stderr, "sqlscan: test 4 failed, too many "
+				"bytes for one byte.\n");
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+int	result = 0;
+
+	srandom(14102014);
+	result += test1();
+	result += test2();
+	result += test3();
+	result += test4();
+
+	exit(result);
+}